@@ -78,6 +78,7 @@ uschar *queue_font = NULL;
 int     queue_max_addresses = 10;
 skip_item *queue_skip = NULL;
 uschar *queue_stripchart_name = NULL;
+BOOL    queue_summary = FALSE;
 int     queue_update = 60;
 int     queue_width = 600;
 
@@ -134,6 +135,7 @@ time_t  deliver_frozen_at      = 0;
 BOOL    deliver_manual_thaw    = FALSE;
 
 #ifndef DISABLE_DKIM
+uschar *dkim_bodyhashes          = NULL;
 uschar *dkim_cur_signer          = NULL;
 uschar *dkim_signers             = NULL;
 uschar *dkim_signing_domain      = NULL;
@@ -182,6 +184,7 @@ uschar *message_id_external;
 uschar  message_id_option[MESSAGE_ID_LENGTH + 3];
 
 int     message_linecount      = 0;
+int     message_priority       = 0;
 int     message_size           = 0;
 uschar  message_subdir[2]      = { 0, 0 };
 
@@ -224,9 +227,9 @@ tls_support tls_in = {
  /* remainder zero/null/false */
 };
 
-tree_node *tree_duplicates     = NULL;
-tree_node *tree_nonrecipients  = NULL;
-tree_node *tree_unusable       = NULL;
+tree_hash  tree_duplicates     = { .slots = NULL };
+tree_hash  tree_nonrecipients  = { .slots = NULL };
+tree_hash  tree_unusable       = { .slots = NULL };
 
 uschar *version_date           = US"?";
 uschar *version_string         = US"?";
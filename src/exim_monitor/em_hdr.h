@@ -270,6 +270,7 @@ extern uschar *queue_font;          /* font for queue display */
 extern int     queue_max_addresses; /* limit on per-message list */
 extern skip_item *queue_skip;      /* for hiding bits of queue */
 extern uschar *queue_stripchart_name; /* sic */
+extern BOOL    queue_summary;       /* TRUE if Exim keeps a queue summary */
 extern int     queue_update;        /* update interval */
 extern int     queue_width;         /* width of queue window */
 
@@ -190,6 +190,9 @@ if (s != NULL && (x = Uatoi(s)) != 0) queue_update = x;
 s = US getenv("QUEUE_MAX_ADDRESSES");
 if (s != NULL && (x = Uatoi(s)) != 0) queue_max_addresses = x;
 
+s = US getenv("QUEUE_SUMMARY");
+if (s != NULL && Ustrcmp(s, "queue_summary") == 0) queue_summary = TRUE;
+
 s = US getenv("QUEUE_WIDTH");
 if (s != NULL && (x = Uatoi(s)) != 0) queue_width = x;
 
@@ -644,7 +644,7 @@ if (recipients_list)
   text_show(text, US"Recipients:\n");
   for (int i = 0; i < recipients_count; i++)
     text_showf(text, "  %s %s\n",
-      tree_search(tree_nonrecipients, recipients_list[i].address)
+      tree_hash_search(&tree_nonrecipients, recipients_list[i].address)
         ? "*" : " ",
       recipients_list[i].address);
   text_show(text, US"\n");
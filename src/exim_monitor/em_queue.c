@@ -37,6 +37,18 @@ return anon_result;
 
 static int queue_total = 0;   /* number of items in queue */
 
+/* State for following Exim's queue summary file. While the file is in use,
+summary_fields points to the fields of a line from which to set up a new
+queue item, instead of reading its header file. */
+
+#define SUMMARY_FIELDS 8
+
+static BOOL    summary_active = FALSE;
+static ino_t   summary_inode = 0;
+static dev_t   summary_dev = 0;
+static off_t   summary_offset = 0;
+static uschar **summary_fields = NULL;
+
 /* Table for turning base-62 numbers into binary */
 
 static uschar tab62[] =
@@ -50,7 +62,7 @@ static uschar tab62[] =
 
 /* Index for quickly finding things in the ordered queue. */
 
-static queue_item *queue_index[queue_index_size];
+static queue_item *queue_pointers[queue_index_size];
 
 
 
@@ -148,6 +160,55 @@ return node;
 
 
 
+/*************************************************
+*        Fill in a queue item from a summary     *
+*************************************************/
+
+/* The fields are those of an M or S line in Exim's queue summary file: id,
+kind, input time, size, frozen flag, sender, untrusted login, recipient count,
+and then the recipients, each prefixed by D if it has been delivered. As in
+update_recipients(), delivered addresses are removed and others added, so that
+children noticed in the log are kept. */
+
+static void
+summary_fill(queue_item *q, uschar **field)
+{
+int count = Uatoi(field[7]);
+uschar *p, *r;
+uschar *s = field[5];
+
+q->update_time = q->input_time = Uatoi(field[2]);
+q->size = Uatoi(field[3]);
+q->frozen = field[4][0] == '1';
+
+if (*s && (p = strstric(s+1, qualify_domain, FALSE)) != NULL && *(--p) == '@')
+  *p = 0;
+if (q->sender != NULL) store_free(q->sender);
+if (*field[6])
+  {
+  q->sender = store_malloc(Ustrlen(s) + Ustrlen(field[6]) + 6);
+  sprintf(CS q->sender, "%s (%s)", *s ? s : US"<>", field[6]);
+  }
+else
+  {
+  q->sender = store_malloc(Ustrlen(s) + 1);
+  Ustrcpy(q->sender, s);
+  }
+
+for (s = count > 0 ? field[SUMMARY_FIELDS] : NULL; count-- > 0 && s; )
+  {
+  uschar *next = Ustrchr(s, '\t');
+  if (next) *next++ = 0;
+  r = s + 1;
+  if (*r && (p = strstric(r+1, qualify_domain, FALSE)) != NULL &&
+    *(--p) == '@') *p = 0;
+  (void)find_dest(q, r, *s == 'D' ? dest_remove : dest_add, FALSE);
+  s = next;
+  }
+}
+
+
+
 /*************************************************
 *             Set up new queue item              *
 *************************************************/
@@ -173,6 +234,12 @@ q->dir_char = dir_char;
 q->sender = NULL;
 q->size = 0;
 
+if (summary_fields != NULL)
+  {
+  summary_fill(q, summary_fields);
+  return q;
+  }
+
 /* Read the header file from the spool; if there is a failure it might mean
 inaccessibility as a result of protections. A successful read will have caused
 sender_address to get set and the recipients fields to be initialized. If
@@ -279,7 +346,7 @@ if (recipients_list != NULL)
   for (i = 0; i < recipients_count; i++)
     {
     uschar *r = recipients_list[i].address;
-    if (tree_search(tree_nonrecipients, r) == NULL)
+    if (tree_hash_search(&tree_nonrecipients, r) == NULL)
       {
       if ((p = strstric(r+1, qualify_domain, FALSE)) != NULL &&
         *(--p) == '@') *p = 0;
@@ -315,17 +382,17 @@ queue_item *p;
 printf("\nqueue_total=%d\n", queue_total);
 
 for (i = 0; i < queue_index_size; i++)
-  printf("index %d = %d %s\n", i, (int)(queue_index[i]),
-    (queue_index[i])->name);
+  printf("index %d = %d %s\n", i, (int)(queue_pointers[i]),
+    (queue_pointers[i])->name);
 
 printf("Queue is:\n");
-p = queue_index[0];
+p = queue_pointers[0];
 while (p != NULL)
   {
   count++;
   for (i = 0; i < queue_index_size; i++)
     {
-    if (queue_index[i] == p) printf("count=%d index=%d\n", count, (int)p);
+    if (queue_pointers[i] == p) printf("count=%d index=%d\n", count, (int)p);
     }
   printf("%d %d %d %s\n", (int)p, (int)p->next, (int)p->prev, p->name);
   p = p->next;
@@ -351,7 +418,7 @@ if (queue_total == 0)
   if ((qq = set_up(name, dir_char)) != NULL)
     {
     int i;
-    for (i = 0; i < queue_index_size; i++) queue_index[i] = qq;
+    for (i = 0; i < queue_index_size; i++) queue_pointers[i] = qq;
     queue_total++;
     return qq;
     }
@@ -361,28 +428,28 @@ if (queue_total == 0)
 /* Also handle insertion at the start or end of the queue
 as special cases. */
 
-if (Ustrcmp(name, (queue_index[0])->name) < 0)
+if (Ustrcmp(name, (queue_pointers[0])->name) < 0)
   {
   if (action != queue_add) return NULL;
   if ((qq = set_up(name, dir_char)) != NULL)
     {
-    qq->next = queue_index[0];
-    (queue_index[0])->prev = qq;
-    queue_index[0] = qq;
+    qq->next = queue_pointers[0];
+    (queue_pointers[0])->prev = qq;
+    queue_pointers[0] = qq;
     queue_total++;
     return qq;
     }
   return NULL;
   }
 
-if (Ustrcmp(name, (queue_index[queue_index_size-1])->name) > 0)
+if (Ustrcmp(name, (queue_pointers[queue_index_size-1])->name) > 0)
   {
   if (action != queue_add) return NULL;
   if ((qq = set_up(name, dir_char)) != NULL)
     {
-    qq->prev = queue_index[queue_index_size-1];
-    (queue_index[queue_index_size-1])->next = qq;
-    queue_index[queue_index_size-1] = qq;
+    qq->prev = queue_pointers[queue_index_size-1];
+    (queue_pointers[queue_index_size-1])->next = qq;
+    queue_pointers[queue_index_size-1] = qq;
     queue_total++;
     return qq;
     }
@@ -394,7 +461,7 @@ when the name is somewhere in the middle, if present. */
 
 while (middle > first)
   {
-  if (Ustrcmp(name, (queue_index[middle])->name) >= 0) first = middle;
+  if (Ustrcmp(name, (queue_pointers[middle])->name) >= 0) first = middle;
     else last = middle;
   middle = (first + last)/2;
   }
@@ -403,8 +470,8 @@ while (middle > first)
 lie if it exists. Both end points are inclusive - though in fact
 the bottom one can only be = if it is the original bottom. */
 
-p = queue_index[first];
-q = queue_index[last];
+p = queue_pointers[first];
+q = queue_pointers[last];
 
 for (;;)
   {
@@ -455,6 +522,221 @@ for (;;)
 
 
 
+/*************************************************
+*      Remove unseen items and reset index       *
+*************************************************/
+
+static void
+queue_tidy(void)
+{
+int count = 0;
+int indexptr = 1;
+queue_item *p;
+
+/* Scan the queue and remove any items that have not been seen. At the same
+time, set up the index pointers into the queue. Because we are removing items,
+the total that we are comparing against isn't actually correct, but in a long
+queue it won't make much difference, and in a short queue it doesn't matter
+anyway!*/
+
+for (p = queue_pointers[0]; p; )
+  if (!p->seen)
+    {
+    queue_item * next = p->next;
+    if (p->prev)
+      p->prev->next = next;
+    else
+      queue_pointers[0] = next;
+    if (next)
+      next->prev = p->prev;
+    else
+      {
+      int i;
+      queue_item * q = queue_pointers[queue_index_size-1];
+      for (i = queue_index_size - 1; i >= 0; i--)
+        if (queue_pointers[i] == q) queue_pointers[i] = p->prev;
+      }
+    clean_up(p);
+    queue_total--;
+    p = next;
+    }
+  else
+    {
+    if (++count > (queue_total * indexptr)/(queue_index_size-1))
+      queue_pointers[indexptr++] = p;
+    p->seen = FALSE;  /* for next time */
+    p = p->next;
+    }
+
+/* If a lot of messages have been removed at the bottom, we may not
+have got the index all filled in yet. Make sure all the pointers
+are legal. */
+
+while (indexptr < queue_index_size - 1)
+  queue_pointers[indexptr++] = queue_pointers[queue_index_size-1];
+}
+
+
+
+/*************************************************
+*            Find a message's header file        *
+*************************************************/
+
+/* Returns the subdirectory character for the message, 0 if it is not in a
+subdirectory, or -1 if it is not on the queue. */
+
+static int
+summary_dir(uschar *name)
+{
+struct stat statbuf;
+uschar buffer[256];
+
+for (int i = 0; i < 2; i++)
+  {
+  BOOL split = spool_is_split == (i == 0);
+  snprintf(CS buffer, sizeof(buffer), "%s/input/%s/%s%.1s%s-H",
+    spool_directory, queue_name, split ? name + 5 : US"", split ? "/" : "",
+    name);
+  if (Ustat(buffer, &statbuf) == 0)
+    {
+    if (split) spool_is_split = TRUE;
+    return split ? name[5] : 0;
+    }
+  }
+return -1;
+}
+
+
+
+/*************************************************
+*       Apply one line of the summary file       *
+*************************************************/
+
+static void
+summary_apply(uschar *line)
+{
+uschar *field[SUMMARY_FIELDS + 1];
+int nfields = 0;
+int dir;
+queue_item *p;
+
+for (uschar *s = line; ; )
+  {
+  field[nfields++] = s;
+  if (nfields > SUMMARY_FIELDS || (s = Ustrchr(s, '\t')) == NULL) break;
+  *s++ = 0;
+  }
+if (nfields < 2 || Ustrlen(field[0]) != MESSAGE_ID_LENGTH) return;
+
+/* A message that has gone is marked unseen, so that queue_tidy() removes it.
+Exim also writes an X line for a message whose data will not fit in a summary
+line; if its header file is still there, read it in the old way. */
+
+if (field[1][0] == 'X')
+  {
+  if ((dir = summary_dir(field[0])) >= 0)
+    (void)find_queue(field[0], queue_add, dir);
+  else if ((p = find_queue(field[0], queue_noop, 0)) != NULL)
+    p->seen = FALSE;
+  return;
+  }
+
+if (nfields < SUMMARY_FIELDS || (field[1][0] != 'M' && field[1][0] != 'S') ||
+    (Uatoi(field[7]) > 0 && nfields <= SUMMARY_FIELDS))
+  return;
+
+/* An M line brings a known message up to date; an S line, written by a queue
+listing, only introduces one. A new message is set up from the line, provided
+it is still on the queue. */
+
+if ((p = find_queue(field[0], queue_noop, 0)) != NULL)
+  {
+  p->seen = TRUE;
+  if (field[1][0] == 'M') summary_fill(p, field);
+  }
+else if ((dir = summary_dir(field[0])) >= 0)
+  {
+  summary_fields = field;
+  (void)find_queue(field[0], queue_add, dir);
+  summary_fields = NULL;
+  }
+}
+
+
+
+/*************************************************
+*          Read the queue summary file           *
+*************************************************/
+
+/* When Exim's queue_summary option is set, a line is appended to the summary
+file in the input directory whenever a message's header file is written, and
+another when the message is removed. Reading whatever has been added since last
+time is much cheaper than scanning the directory and checking every message.
+Exim rewrites the file from time to time, so a new inode, or a file shorter than
+what has been read, means starting again from the top; then any message not
+mentioned is removed. An incomplete last line is left for next time.
+
+Returns:    FALSE if there is no summary file
+*/
+
+static BOOL
+summary_scan(void)
+{
+int fd;
+BOOL restart;
+off_t length;
+struct stat statbuf;
+uschar buffer[256];
+
+snprintf(CS buffer, sizeof(buffer), "%s/input/%s/summary", spool_directory,
+  queue_name);
+if ((fd = Uopen(buffer, O_RDONLY, 0)) < 0) return FALSE;
+if (fstat(fd, &statbuf) < 0)
+  {
+  (void)close(fd);
+  return FALSE;
+  }
+
+restart = statbuf.st_ino != summary_inode || statbuf.st_dev != summary_dev ||
+  statbuf.st_size < summary_offset;
+if (restart)
+  {
+  summary_inode = statbuf.st_ino;
+  summary_dev = statbuf.st_dev;
+  summary_offset = 0;
+  }
+
+if (queue_total > 0)
+  for (queue_item *p = queue_pointers[0]; p != NULL; p = p->next)
+    p->seen = !restart;
+
+if ((length = statbuf.st_size - summary_offset) > 0)
+  {
+  uschar *data = store_malloc(length + 1);
+
+  if (pread(fd, data, length, summary_offset) == length)
+    {
+    uschar *line, *end;
+
+    data[length] = 0;
+    for (line = data; (end = Ustrchr(line, '\n')) != NULL; line = end + 1)
+      {
+      *end = 0;
+      summary_apply(line);
+      }
+    summary_offset += line - data;
+    }
+  store_free(data);
+  }
+
+(void)close(fd);
+if (queue_total > 0) queue_tidy();
+stripchart_total[0] = queue_total;
+return TRUE;
+}
+
+
+
 /*************************************************
 *        Scan the exim spool directory           *
 *************************************************/
@@ -470,12 +752,13 @@ scan_spool_input(int full)
 int i;
 int subptr;
 int subdir_max = 1;
-int count = 0;
-int indexptr = 1;
-queue_item *p;
 uschar input_dir[256];
 uschar subdirs[64];
 
+/* If Exim keeps a summary file, follow that instead. */
+
+if (queue_summary && (summary_active = summary_scan())) return;
+
 subdirs[0] = 0;
 stripchart_total[0] = 0;
 
@@ -539,47 +822,9 @@ items in the in-store queue. */
 
 if (!full || queue_total == 0) return;
 
-/* Now scan the queue and remove any items that were not in the directory. At
-the same time, set up the index pointers into the queue. Because we are
-removing items, the total that we are comparing against isn't actually correct,
-but in a long queue it won't make much difference, and in a short queue it
-doesn't matter anyway!*/
+/* Now remove any items that were not in the directory. */
 
-for (p = queue_index[0]; p; )
-  if (!p->seen)
-    {
-    queue_item * next = p->next;
-    if (p->prev)
-      p->prev->next = next;
-    else
-      queue_index[0] = next;
-    if (next)
-      next->prev = p->prev;
-    else
-      {
-      int i;
-      queue_item * q = queue_index[queue_index_size-1];
-      for (i = queue_index_size - 1; i >= 0; i--)
-        if (queue_index[i] == q) queue_index[i] = p->prev;
-      }
-    clean_up(p);
-    queue_total--;
-    p = next;
-    }
-  else
-    {
-    if (++count > (queue_total * indexptr)/(queue_index_size-1))
-      queue_index[indexptr++] = p;
-    p->seen = FALSE;  /* for next time */
-    p = p->next;
-    }
-
-/* If a lot of messages have been removed at the bottom, we may not
-have got the index all filled in yet. Make sure all the pointers
-are legal. */
-
-while (indexptr < queue_index_size - 1)
-  queue_index[indexptr++] = queue_index[queue_index_size-1];
+queue_tidy();
 }
 
 
@@ -592,18 +837,15 @@ while (indexptr < queue_index_size - 1)
 /* We read the spool file only if its update time differs from last time,
 or if there is a journal file in existence. */
 
-/* First, a local subroutine to scan the non-recipients tree and
+/* First, a local subroutine to scan the non-recipients table and
 remove any of them from the address list */
 
 static void
-scan_tree(queue_item *p, tree_node *tn)
+scan_table(queue_item *p, const tree_hash *t)
 {
-if (tn != NULL)
-  {
-  if (tn->left != NULL) scan_tree(p, tn->left);
-  if (tn->right != NULL) scan_tree(p, tn->right);
-  (void)find_dest(p, tn->name, dest_remove, FALSE);
-  }
+for (unsigned i = 0; i < t->size; i++)
+  if (t->slots[i] != NULL)
+    (void)find_dest(p, t->slots[i]->name, dest_remove, FALSE);
 }
 
 /* The main function */
@@ -665,8 +907,8 @@ if (recipients_list)
     uschar * r = recipients_list[i].address;
     tree_node * node;
 
-    if (!(node = tree_search(tree_nonrecipients, r)))
-      node = tree_search(tree_nonrecipients, string_copylc(r));
+    if (!(node = tree_hash_search(&tree_nonrecipients, r)))
+      node = tree_hash_search(&tree_nonrecipients, string_copylc(r));
 
     if ((pp = strstric(r+1, qualify_domain, FALSE)) && *(--pp) == '@')
        *pp = 0;
@@ -676,13 +918,13 @@ if (recipients_list)
       (void)find_dest(p, r, dest_remove, FALSE);
     }
 
-/* We also need to scan the tree of non-recipients, which might
+/* We also need to scan the table of non-recipients, which might
 contain child addresses that are not in the recipients list, but
 which may have got onto the address list as a result of eximon
 noticing an == line in the log. Then remember the update time,
 recover the dynamic store, and we are done. */
 
-scan_tree(p, tree_nonrecipients);
+scan_table(p, &tree_nonrecipients);
 p->update_time = statdata.st_mtime;
 store_reset(reset_point);
 }
@@ -702,7 +944,7 @@ void
 queue_display(void)
 {
 int now = (int)time(NULL);
-queue_item *p = queue_index[0];
+queue_item *p = queue_pointers[0];
 
 if (menu_is_up) return;            /* Avoid nasty interactions */
 
@@ -736,7 +978,7 @@ while (p != NULL)
       }
     }
 
-  update_recipients(p);                   /* update destinations */
+  if (!summary_active) update_recipients(p);   /* update destinations */
 
   /* Can't set this earlier, as header data may change things. */
 
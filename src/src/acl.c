@@ -344,6 +344,7 @@ with the controls_list table that follows! */
 
 enum {
   CONTROL_AUTH_UNADVERTISED,
+  CONTROL_BLOCK,
 #ifdef EXPERIMENTAL_BRIGHTMAIL
   CONTROL_BMI_RUN,
 #endif
@@ -374,9 +375,11 @@ enum {
   CONTROL_NO_MULTILINE,
   CONTROL_NO_PIPELINING,
 
+  CONTROL_PRIORITY,
   CONTROL_QUEUE,
   CONTROL_SUBMISSION,
   CONTROL_SUPPRESS_LOCAL_FIXUPS,
+  CONTROL_TRACE_DUMP,
 #ifdef SUPPORT_I18N
   CONTROL_UTF8_DOWNCONVERT,
 #endif
@@ -401,6 +404,10 @@ static control_def controls_list[] = {
 				  (unsigned)
 				  ~(ACL_BIT_CONNECT | ACL_BIT_HELO)
   },
+[CONTROL_BLOCK] =
+  { US"block",			TRUE,
+	  ACL_BIT_NOTSMTP | ACL_BIT_NOTSMTP_START
+  },
 #ifdef EXPERIMENTAL_BRIGHTMAIL
 [CONTROL_BMI_RUN] =
   { US"bmi_run",                 FALSE,		0 },
@@ -510,6 +517,13 @@ static control_def controls_list[] = {
 	  ACL_BIT_NOTSMTP | ACL_BIT_NOTSMTP_START
   },
 
+[CONTROL_PRIORITY] =
+  { US"priority",		TRUE,
+	  (unsigned)
+	  ~(ACL_BIT_MAIL | ACL_BIT_RCPT |
+	    ACL_BIT_PREDATA | ACL_BIT_DATA |
+	    ACL_BIT_NOTSMTP | ACL_BIT_MIME)
+  },
 [CONTROL_QUEUE] =
   { US"queue",			TRUE,
 	  (unsigned)
@@ -530,6 +544,9 @@ static control_def controls_list[] = {
     ~(ACL_BIT_MAIL | ACL_BIT_RCPT | ACL_BIT_PREDATA |
       ACL_BIT_NOTSMTP_START)
   },
+[CONTROL_TRACE_DUMP] =
+  { US"trace_dump",              FALSE, 0
+  },
 #ifdef SUPPORT_I18N
 [CONTROL_UTF8_DOWNCONVERT] =
   { US"utf8_downconvert",        TRUE, (unsigned) ~(ACL_BIT_RCPT | ACL_BIT_VRFY)
@@ -2058,8 +2075,18 @@ else if (verify_sender_address)
       /* The recipient, qualify, and expn options are never set in
       verify_options. */
 
-      rc = verify_address(sender_vaddr, NULL, verify_options, callout,
-        callout_overall, callout_connect, se_mailfrom, pm_mailfrom, &routed);
+      /* Without a callout, the result may come from the shared cache
+      (see verify_cache_ttl). */
+
+      if (callout > 0
+	 || !verify_cache_get(sender_vaddr, verify_options, &rc, &routed))
+	{
+	rc = verify_address(sender_vaddr, NULL, verify_options, callout,
+	  callout_overall, callout_connect, se_mailfrom, pm_mailfrom, &routed);
+	if (callout <= 0)
+	  verify_cache_put(verify_sender_address, sender_vaddr, verify_options,
+	    rc, routed);
+	}
 
       HDEBUG(D_acl) debug_printf_indent("----------- end verify ------------\n");
 
@@ -2110,8 +2137,15 @@ else
   get rewritten. */
 
   addr2 = *addr;
-  rc = verify_address(&addr2, NULL, verify_options|vopt_is_recipient, callout,
-    callout_overall, callout_connect, se_mailfrom, pm_mailfrom, NULL);
+  addr_cold_share(addr);
+  verify_options |= vopt_is_recipient;
+  if (callout > 0 || !verify_cache_get(&addr2, verify_options, &rc, NULL))
+    {
+    rc = verify_address(&addr2, NULL, verify_options, callout,
+      callout_overall, callout_connect, se_mailfrom, pm_mailfrom, NULL);
+    if (callout <= 0)
+      verify_cache_put(addr->address, &addr2, verify_options, rc, TRUE);
+    }
   HDEBUG(D_acl) debug_printf_indent("----------- end verify ------------\n");
 
   *basic_errno = addr2.basic_errno;
@@ -2252,6 +2286,333 @@ return ERROR;
 
 
 
+/*************************************************
+*          Update a smoothed sending rate        *
+*************************************************/
+
+/* Called from acl_ratelimit() and ratelimit_cache_check() below
+
+Arguments:
+  dbd         the previous rate data, updated in place
+  tv          the time now
+  count       the size of this event
+  period      the smoothing period
+
+Returns:      nothing
+*/
+
+static void
+ratelimit_smooth(dbdata_ratelimit * dbd, const struct timeval * tv,
+  double count, double period)
+{
+/* The smoothed rate is computed using an exponentially weighted moving
+average adjusted for variable sampling intervals. The standard EWMA for
+a fixed sampling interval is:  f'(t) = (1 - a) * f(t) + a * f'(t - 1)
+where f() is the measured value and f'() is the smoothed value.
+
+Old data decays out of the smoothed value exponentially, such that data n
+samples old is multiplied by a^n. The exponential decay time constant p
+is defined such that data p samples old is multiplied by 1/e, which means
+that a = exp(-1/p). We can maintain the same time constant for a variable
+sampling interval i by using a = exp(-i/p).
+
+The rate we are measuring is messages per period, suitable for directly
+comparing with the limit. The average rate between now and the previous
+message is period / interval, which we feed into the EWMA as the sample.
+
+It turns out that the number of messages required for the smoothed rate
+to reach the limit when they are sent in a burst is equal to the limit.
+This can be seen by analysing the value of the smoothed rate after N
+messages sent at even intervals. Let k = (1 - a) * p/i
+
+  rate_1 = (1 - a) * p/i + a * rate_0
+         = k + a * rate_0
+  rate_2 = k + a * rate_1
+         = k + a * k + a^2 * rate_0
+  rate_3 = k + a * k + a^2 * k + a^3 * rate_0
+  rate_N = rate_0 * a^N + k * SUM(x=0..N-1)(a^x)
+         = rate_0 * a^N + k * (1 - a^N) / (1 - a)
+         = rate_0 * a^N + p/i * (1 - a^N)
+
+When N is large, a^N -> 0 so rate_N -> p/i as desired.
+
+  rate_N = p/i + (rate_0 - p/i) * a^N
+  a^N = (rate_N - p/i) / (rate_0 - p/i)
+  N * -i/p = log((rate_N - p/i) / (rate_0 - p/i))
+  N = p/i * log((rate_0 - p/i) / (rate_N - p/i))
+
+Numerical analysis of the above equation, setting the computed rate to
+increase from rate_0 = 0 to rate_N = limit, shows that for large sending
+rates, p/i, the number of messages N = limit. So limit serves as both the
+maximum rate measured in messages per period, and the maximum number of
+messages that can be sent in a fast burst. */
+
+double this_time = (double)tv->tv_sec
+                 + (double)tv->tv_usec / 1000000.0;
+double prev_time = (double)dbd->time_stamp
+                 + (double)dbd->time_usec / 1000000.0;
+
+/* We must avoid division by zero, and deal gracefully with the clock going
+backwards. If we blunder ahead when time is in reverse then the computed
+rate will be bogus. To be safe we clamp interval to a very small number. */
+
+double interval = this_time - prev_time <= 0.0 ? 1e-9
+                : this_time - prev_time;
+
+double i_over_p = interval / period;
+double a = exp(-i_over_p);
+
+/* Combine the instantaneous rate (period / interval) with the previous rate
+using the smoothing factor a. In order to measure sized events, multiply the
+instantaneous rate by the count of bytes or recipients etc. */
+
+dbd->time_stamp = tv->tv_sec;
+dbd->time_usec = tv->tv_usec;
+dbd->rate = (1 - a) * count / i_over_p + a * dbd->rate;
+
+/* When events are very widely spaced the computed rate tends towards zero.
+Although this is accurate it turns out not to be useful for our purposes,
+especially when the first event after a long silence is the start of a spam
+run. A more useful model is that the rate for an isolated event should be the
+size of the event per the period size, ignoring the lack of events outside
+the current period and regardless of where the event falls in the period. So,
+if the interval was so long that the calculated rate is unhelpfully small, we
+re-initialize the rate. In the absence of higher-rate bursts, the condition
+below is true if the interval is greater than the period. */
+
+if (dbd->rate < count) dbd->rate = count;
+}
+
+
+
+
+/*************************************************
+*        Shared table of ratelimit data          *
+*************************************************/
+
+/* If ratelimit_cache_size is set, rate data is kept in a file in the hints
+directory, which every Exim process maps shared, instead of in the ratelimit
+hints database. This saves each check from opening and locking the database,
+which serialises the SMTP processes of a busy server. The smoothing is exactly
+as for the database.
+
+The file holds a fixed number of slots, found as described for dbfn_slot_n().
+A slot is claimed only for the few instructions of an update; a process that
+cannot claim it quickly uses the database instead. A key that is not in the
+table is looked for in the database, so that its history survives the option
+being turned on, and an entry pushed out of the table to make room is written
+back there, decayed to the current time. Keys too long for a slot, and checks with the
+per_addr or unique= options, whose Bloom filters vary in size, always use the
+database. */
+
+#define RATELIMIT_CACHE_MAGIC	0x45524C31	/* "ERL1" */
+#define RATELIMIT_CACHE_KEY_MAX	256
+#define RATELIMIT_CACHE_PROBES	4
+#define RATELIMIT_CACHE_SPINS	1000
+
+typedef struct {
+  dbfn_shared_header sh;
+} ratelimit_cache_header;
+
+typedef struct {
+  dbfn_shared_slot sl;
+  dbdata_ratelimit dbd;
+  uschar	key[RATELIMIT_CACHE_KEY_MAX];	/* empty for an unused slot */
+} ratelimit_cache_slot;
+
+static ratelimit_cache_header * ratelimit_cache = NULL;
+static BOOL ratelimit_cache_tried = FALSE;
+
+
+/* Map the table file, creating it if necessary. Failure is not an error;
+the database is used instead.
+
+Returns:  TRUE if the table is available
+*/
+
+static BOOL
+ratelimit_cache_open(void)
+{
+if (ratelimit_cache) return TRUE;
+if (ratelimit_cache_tried || ratelimit_cache_size <= 0) return FALSE;
+ratelimit_cache_tried = TRUE;
+
+return !!(ratelimit_cache = dbfn_map_shared(US"ratecache",
+  RATELIMIT_CACHE_MAGIC, ratelimit_cache_size,
+  sizeof(ratelimit_cache_header), sizeof(ratelimit_cache_slot)));
+}
+
+
+/* Find the slot for a key: the one holding it if there is one, otherwise an
+unused one, or failing that the one least recently updated, within the probe
+range. The slot is not claimed, so the answer has to be checked again once it
+is.
+
+Arguments:
+  hash      hash of the key
+  key       the key
+  match     set TRUE if the slot holds the key
+
+Returns:    the slot
+*/
+
+static ratelimit_cache_slot *
+ratelimit_cache_slotp(unsigned hash, const uschar * key, BOOL * match)
+{
+ratelimit_cache_slot * s = NULL;
+
+for (int i = 0; i < RATELIMIT_CACHE_PROBES; i++)
+  {
+  ratelimit_cache_slot * t = dbfn_slot_n(ratelimit_cache, hash, i);
+  if (t->sl.hash == hash && Ustrcmp(t->key, key) == 0)
+    { *match = TRUE; return t; }
+  if (  !s
+     || s->key[0] && (!t->key[0] || t->dbd.time_stamp < s->dbd.time_stamp))
+    s = t;
+  }
+*match = FALSE;
+return s;
+}
+
+
+/* Do a ratelimit check using the shared table.
+
+Arguments:
+  key         the ratelimit key
+  count       the size of this event
+  limit       the rate limit
+  period      the smoothing period
+  leaky       update the rate only when under the limit
+  strict      update the rate always
+  dbdp        where to put a copy of the computed rate data
+
+Returns:      OK or FAIL as for acl_ratelimit(), or -1 if the table cannot
+              be used and the database should be
+*/
+
+static int
+ratelimit_cache_check(const uschar * key, double count, double limit,
+  double period, BOOL leaky, BOOL strict, dbdata_ratelimit ** dbdp)
+{
+unsigned hash = 2166136261u;			/* FNV-1a */
+ratelimit_cache_slot * s;
+dbdata_ratelimit dbd, victim;
+uschar victim_key[RATELIMIT_CACHE_KEY_MAX];
+BOOL match, seeded = FALSE, evicted = FALSE;
+struct timeval tv;
+uint64_t seq;
+int rc, len = Ustrlen(key);
+
+if (len >= RATELIMIT_CACHE_KEY_MAX || !ratelimit_cache_open())
+  return -1;
+
+for (const uschar * k = key; *k; k++) hash = (hash ^ *k) * 16777619u;
+
+/* A key not in the table may still have data in the database. */
+
+if (!(s = ratelimit_cache_slotp(hash, key, &match), match))
+  {
+  open_db dbblock, * dbm;
+  dbdata_ratelimit * d;
+  int size;
+
+  if ((dbm = dbfn_open(US"ratelimit", O_RDONLY, &dbblock, FALSE, TRUE)))
+    {
+    if ((d = dbfn_read_with_length(dbm, key, &size)) && size >= sizeof(*d))
+      {
+      HDEBUG(D_acl) debug_printf_indent("ratelimit found key in database\n");
+      dbd = *d;
+      seeded = TRUE;
+      }
+    dbfn_close(dbm);
+    }
+  s = ratelimit_cache_slotp(hash, key, &match);
+  }
+
+if (!dbfn_slot_claim(&s->sl, RATELIMIT_CACHE_SPINS, &seq))
+  return -1;
+
+/* Another process may have changed the slot before we claimed it. If it has
+taken the key away, we do not know its latest data, so use the database. */
+
+if ((s->sl.hash == hash && Ustrcmp(s->key, key) == 0) != match)
+  {
+  if (match) { dbfn_slot_release(&s->sl, seq); return -1; }
+  match = TRUE;
+  }
+
+gettimeofday(&tv, NULL);
+if (match)
+  {
+  HDEBUG(D_acl) debug_printf_indent("ratelimit found key in shared table\n");
+  dbd = s->dbd;
+  }
+if (match || seeded)
+  ratelimit_smooth(&dbd, &tv, count, period);
+else
+  {
+  HDEBUG(D_acl) debug_printf_indent("ratelimit initializing new key's rate data\n");
+  dbd.time_stamp = tv.tv_sec;
+  dbd.time_usec = tv.tv_usec;
+  dbd.rate = count;
+  }
+
+rc = dbd.rate < limit ? FAIL : OK;
+
+if ((rc == FAIL && leaky) || strict)
+  {
+  if (!match && s->key[0])
+    {
+    victim = s->dbd;
+    memcpy(victim_key, s->key, sizeof(victim_key));
+    evicted = TRUE;
+    }
+  s->sl.hash = hash;
+  memcpy(s->key, key, len + 1);
+  s->dbd = dbd;
+  }
+dbfn_slot_release(&s->sl, seq);
+
+if ((rc == FAIL && leaky) || strict)
+  {
+  HDEBUG(D_acl) debug_printf_indent("ratelimit shared table updated\n");
+  }
+else
+  {
+  HDEBUG(D_acl) debug_printf_indent("ratelimit shared table not updated: %s\n",
+    !leaky && !strict ? "readonly mode" : "over the limit, but leaky");
+  }
+
+/* Keep the history of the key that had to make way. Its rate is decayed as if
+checked with a zero count now, since writing it stamps it with the time. The
+smoothing period is the first element of the key. */
+
+if (evicted)
+  {
+  open_db dbblock, * dbm;
+  int vperiod = readconf_readtime(victim_key, '/', FALSE);
+  double interval = (double)(tv.tv_sec - victim.time_stamp)
+		  + (double)(tv.tv_usec - victim.time_usec) / 1000000.0;
+
+  if (vperiod > 0 && interval > 0.0)
+    victim.rate *= exp(-interval / vperiod);
+  victim.time_usec = tv.tv_usec;
+  if ((dbm = dbfn_open(US"ratelimit", O_RDWR, &dbblock, TRUE, TRUE)))
+    {
+    dbfn_write(dbm, victim_key, &victim, sizeof(victim));
+    dbfn_close(dbm);
+    HDEBUG(D_acl)
+      debug_printf_indent("ratelimit moved %s to database\n", victim_key);
+    }
+  }
+
+*dbdp = store_get(sizeof(dbd), FALSE);
+**dbdp = dbd;
+return rc;
+}
+
+
+
 /*************************************************
 *            Handle rate limiting                *
 *************************************************/
@@ -2476,6 +2837,14 @@ if ((t = tree_search(*anchor, key)))
   return rc;
   }
 
+/* Checks that need no Bloom filter can use the shared table, if there is
+one, rather than the database. */
+
+if (  !unique && ratelimit_cache_size > 0
+   && (rc = ratelimit_cache_check(key, count, limit, period, leaky, strict,
+	&dbd)) >= 0)
+  goto record;
+
 /* We aren't using a pre-computed rate, so get a previously recorded rate
 from the database, which will be updated and written back if required. */
 
@@ -2644,7 +3013,7 @@ if (unique && !readonly)
 
 /* If there was no previous ratelimit data block for this key, initialize
 the new one, otherwise update the block from the database. The initial rate
-is what would be computed by the code below for an infinite interval. */
+is what would be computed by ratelimit_smooth() for an infinite interval. */
 
 if (!dbd)
   {
@@ -2655,84 +3024,7 @@ if (!dbd)
   dbd->rate = count;
   }
 else
-  {
-  /* The smoothed rate is computed using an exponentially weighted moving
-  average adjusted for variable sampling intervals. The standard EWMA for
-  a fixed sampling interval is:  f'(t) = (1 - a) * f(t) + a * f'(t - 1)
-  where f() is the measured value and f'() is the smoothed value.
-
-  Old data decays out of the smoothed value exponentially, such that data n
-  samples old is multiplied by a^n. The exponential decay time constant p
-  is defined such that data p samples old is multiplied by 1/e, which means
-  that a = exp(-1/p). We can maintain the same time constant for a variable
-  sampling interval i by using a = exp(-i/p).
-
-  The rate we are measuring is messages per period, suitable for directly
-  comparing with the limit. The average rate between now and the previous
-  message is period / interval, which we feed into the EWMA as the sample.
-
-  It turns out that the number of messages required for the smoothed rate
-  to reach the limit when they are sent in a burst is equal to the limit.
-  This can be seen by analysing the value of the smoothed rate after N
-  messages sent at even intervals. Let k = (1 - a) * p/i
-
-    rate_1 = (1 - a) * p/i + a * rate_0
-           = k + a * rate_0
-    rate_2 = k + a * rate_1
-           = k + a * k + a^2 * rate_0
-    rate_3 = k + a * k + a^2 * k + a^3 * rate_0
-    rate_N = rate_0 * a^N + k * SUM(x=0..N-1)(a^x)
-           = rate_0 * a^N + k * (1 - a^N) / (1 - a)
-           = rate_0 * a^N + p/i * (1 - a^N)
-
-  When N is large, a^N -> 0 so rate_N -> p/i as desired.
-
-    rate_N = p/i + (rate_0 - p/i) * a^N
-    a^N = (rate_N - p/i) / (rate_0 - p/i)
-    N * -i/p = log((rate_N - p/i) / (rate_0 - p/i))
-    N = p/i * log((rate_0 - p/i) / (rate_N - p/i))
-
-  Numerical analysis of the above equation, setting the computed rate to
-  increase from rate_0 = 0 to rate_N = limit, shows that for large sending
-  rates, p/i, the number of messages N = limit. So limit serves as both the
-  maximum rate measured in messages per period, and the maximum number of
-  messages that can be sent in a fast burst. */
-
-  double this_time = (double)tv.tv_sec
-                   + (double)tv.tv_usec / 1000000.0;
-  double prev_time = (double)dbd->time_stamp
-                   + (double)dbd->time_usec / 1000000.0;
-
-  /* We must avoid division by zero, and deal gracefully with the clock going
-  backwards. If we blunder ahead when time is in reverse then the computed
-  rate will be bogus. To be safe we clamp interval to a very small number. */
-
-  double interval = this_time - prev_time <= 0.0 ? 1e-9
-                  : this_time - prev_time;
-
-  double i_over_p = interval / period;
-  double a = exp(-i_over_p);
-
-  /* Combine the instantaneous rate (period / interval) with the previous rate
-  using the smoothing factor a. In order to measure sized events, multiply the
-  instantaneous rate by the count of bytes or recipients etc. */
-
-  dbd->time_stamp = tv.tv_sec;
-  dbd->time_usec = tv.tv_usec;
-  dbd->rate = (1 - a) * count / i_over_p + a * dbd->rate;
-
-  /* When events are very widely spaced the computed rate tends towards zero.
-  Although this is accurate it turns out not to be useful for our purposes,
-  especially when the first event after a long silence is the start of a spam
-  run. A more useful model is that the rate for an isolated event should be the
-  size of the event per the period size, ignoring the lack of events outside
-  the current period and regardless of where the event falls in the period. So,
-  if the interval was so long that the calculated rate is unhelpfully small, we
-  re-initialize the rate. In the absence of higher-rate bursts, the condition
-  below is true if the interval is greater than the period. */
-
-  if (dbd->rate < count) dbd->rate = count;
-  }
+  ratelimit_smooth(dbd, &tv, count, period);
 
 /* Clients sending at the limit are considered to be over the limit.
 This matters for edge cases such as a limit of zero, when the client
@@ -2759,6 +3051,7 @@ else
 
 dbfn_close(dbm);
 
+record:
 /* Store the result in the tree for future reference.  Take the taint status
 from the key for consistency even though it's unlikely we'll ever expand this. */
 
@@ -2923,6 +3216,7 @@ acl_check_condition(int verb, acl_condition_block *cb, int where,
 uschar *user_message = NULL;
 uschar *log_message = NULL;
 int rc = OK;
+struct timeval phase_start, prof_start;
 #ifdef WITH_CONTENT_SCAN
 int sep = -'/';
 #endif
@@ -2962,6 +3256,7 @@ for (; cb; cb = cb->next)
   of them, but not for all, because expansion happens down in some lower level
   checking functions in some cases. */
 
+  if (profiling) gettimeofday(&prof_start, NULL);
   if (!conditions[cb->type].expand_at_top)
     arg = cb->arg;
   else if (!(arg = expand_string(cb->arg)))
@@ -3094,6 +3389,25 @@ for (; cb; cb = cb->next)
 	  f.allow_auth_unadvertised = TRUE;
 	  break;
 
+	case CONTROL_BLOCK:
+	  {
+	  int seconds;
+	  if (*p != '/' || (seconds = readconf_readtime(p+1, 0, FALSE)) <= 0)
+	    {
+	    *log_msgptr = string_sprintf("syntax error in \"control=%s\"", arg);
+	    return ERROR;
+	    }
+	  if (!sender_host_address || host_checking)
+	    {
+	    HDEBUG(D_acl) debug_printf_indent("control=block: not adding %s\n",
+	      host_checking ? "when checking a host" : "a local caller");
+	    }
+	  else if (daemon_screen_set(sender_host_address, seconds, FALSE) != OK)
+	    HDEBUG(D_acl) debug_printf_indent("control=block: %s not blocked\n",
+	      sender_host_address);
+	  break;
+	  }
+
 #ifdef EXPERIMENTAL_BRIGHTMAIL
 	case CONTROL_BMI_RUN:
 	  bmi_run = 1;
@@ -3231,6 +3545,22 @@ for (; cb; cb = cb->next)
 	  cancel_cutthrough_connection(TRUE, US"item frozen");
 	  break;
 
+	case CONTROL_PRIORITY:
+	  if (*p != '/' || !isdigit(p[1]))
+	    {
+	    *log_msgptr = string_sprintf("syntax error in \"control=%s\"", arg);
+	    return ERROR;
+	    }
+	  for (message_priority = 0; isdigit(*++p); )
+	    message_priority = message_priority < 1000
+	      ? message_priority * 10 + *p - '0' : 1000;
+	  if (*p || message_priority > 999)
+	    {
+	    *log_msgptr = string_sprintf("syntax error in \"control=%s\"", arg);
+	    return ERROR;
+	    }
+	  break;
+
 	case CONTROL_QUEUE:
 	  f.queue_only_policy = TRUE;
 	  if (Ustrcmp(p, "_only") == 0)
@@ -3321,6 +3651,10 @@ for (; cb; cb = cb->next)
 	  f.suppress_local_fixups = TRUE;
 	  break;
 
+	case CONTROL_TRACE_DUMP:
+	  trace_dump(US"acl");
+	  break;
+
 	case CONTROL_CUTTHROUGH_DELIVERY:
 	  {
 	  uschar * ignored = NULL;
@@ -3441,6 +3775,7 @@ for (; cb; cb = cb->next)
 
     case ACLC_DELAY:
       {
+      static int connect_delays = 0;	/* served in the connect ACL */
       int delay = readconf_readtime(arg, 0, FALSE);
       if (delay < 0)
         {
@@ -3469,6 +3804,28 @@ for (; cb; cb = cb->next)
 
         else
           {
+	  /* In the connect ACL of a connection that the daemon has held while
+	  earlier delays ran out, those delays are not repeated. Otherwise the
+	  daemon may be able to hold the connection for this one, freeing this
+	  process. */
+
+	  if (where == ACL_WHERE_CONNECT)
+	    {
+	    int skip = MIN(delay, daemon_park_served);
+
+	    daemon_park_served -= skip;
+	    connect_delays += skip;
+	    if ((delay -= skip) <= 0)
+	      {
+	      HDEBUG(D_acl)
+		debug_printf_indent("delay already served while parked\n");
+	      break;
+	      }
+	    if (daemon_park_connection(delay, connect_delays + delay))
+	      exim_exit(EXIT_SUCCESS);
+	    connect_delays += delay;
+	    }
+
           if (smtp_out && !f.disable_delay_flush)
 	    mac_smtp_fflush();
 
@@ -3532,7 +3889,9 @@ for (; cb; cb = cb->next)
 #endif
 
     case ACLC_DNSLISTS:
+    if (smtp_input) gettimeofday(&phase_start, NULL);
     rc = verify_check_dnsbl(where, &arg, log_msgptr);
+    if (smtp_input) smtp_phase_time(SMTP_PHASE_DNSLISTS, &phase_start);
     break;
 
     case ACLC_DOMAINS:
@@ -3642,12 +4001,14 @@ for (; cb; cb = cb->next)
       const uschar * list = arg;
       uschar * ss = string_nextinlist(&list, &sep, NULL, 0);
       uschar * opt;
-      BOOL defer_ok = FALSE;
+      BOOL defer_ok = FALSE, background = FALSE;
       int timeout = 0;
 
       while ((opt = string_nextinlist(&list, &sep, NULL, 0)))
         if (strcmpic(opt, US"defer_ok") == 0)
 	  defer_ok = TRUE;
+	else if (strcmpic(opt, US"background") == 0)
+	  background = TRUE;
 	else if (  strncmpic(opt, US"tmo=", 4) == 0
 		&& (timeout = readconf_readtime(opt+4, '\0', FALSE)) < 0
 		)
@@ -3656,7 +4017,14 @@ for (; cb; cb = cb->next)
 	  return ERROR;
 	  }
 
+      if (background)
+	{
+	rc = malware_background(timeout);
+	break;
+	}
+      if (smtp_input) gettimeofday(&phase_start, NULL);
       rc = malware(ss, timeout);
+      if (smtp_input) smtp_phase_time(SMTP_PHASE_SCAN, &phase_start);
       if (rc == DEFER && defer_ok)
 	rc = FAIL;	/* FAIL so that the message is passed to the next ACL */
       }
@@ -3747,7 +4115,9 @@ for (; cb; cb = cb->next)
       const uschar * list = arg;
       uschar *ss = string_nextinlist(&list, &sep, NULL, 0);
 
+      if (smtp_input) gettimeofday(&phase_start, NULL);
       rc = spam(CUSS &ss);
+      if (smtp_input) smtp_phase_time(SMTP_PHASE_SCAN, &phase_start);
       /* Modify return code based upon the existence of options. */
       while ((ss = string_nextinlist(&list, &sep, NULL, 0)))
         if (strcmpic(ss, US"defer_ok") == 0 && rc == DEFER)
@@ -3776,7 +4146,9 @@ for (; cb; cb = cb->next)
     (until something changes it). */
 
     case ACLC_VERIFY:
+    if (smtp_input) gettimeofday(&phase_start, NULL);
     rc = acl_verify(where, addr, arg, user_msgptr, log_msgptr, basic_errno);
+    if (smtp_input) smtp_phase_time(SMTP_PHASE_VERIFY, &phase_start);
     if (*user_msgptr)
       acl_verify_message = *user_msgptr;
     if (verb == ACL_WARN) *user_msgptr = NULL;
@@ -3788,6 +4160,14 @@ for (; cb; cb = cb->next)
     break;
     }
 
+  if (profiling)
+    {
+    uschar buf[64];
+    (void) string_format(buf, sizeof(buf), "condition %s",
+      conditions[cb->type].name);
+    profile_count(buf, &prof_start);
+    }
+
   /* If a condition was negated, invert OK/FAIL. */
 
   if (!conditions[cb->type].is_modifier && cb->u.negated)
@@ -3905,6 +4285,26 @@ Returns:   a pointer to the next line
 static uschar *acl_text;          /* Current pointer in the text */
 static uschar *acl_text_end;      /* Points one past the terminating '0' */
 
+/* ACLs that are parsed from files or from literal text are kept, in POOL_PERM
+store, for re-use. The tree is keyed by the file name or by the text. For a
+file, the identity and modification time are kept, so that a changed file is
+re-read. The number of literal texts kept is limited, as they may come from
+expansions that vary. */
+
+typedef struct {
+  acl_block *	acl;
+  BOOL		is_file;
+  dev_t		dev;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+} acl_cache_entry;
+
+#define ACL_TEXT_CACHE_MAX 100
+
+static tree_node *acl_text_cache = NULL;
+static int acl_text_cache_count = 0;
+
 
 static uschar *
 acl_getline(void)
@@ -4015,6 +4415,9 @@ acl_check_internal(int where, address_item *addr, uschar *s,
 {
 int fd = -1;
 acl_block *acl = NULL;
+acl_cache_entry *ce = NULL;
+tree_node *t = NULL;
+struct stat statbuf;
 uschar *acl_name = US"inline ACL";
 uschar *ss;
 
@@ -4055,15 +4458,14 @@ while (isspace(*ss)) ss++;
 acl_text = ss;
 
 /* Handle the case of a string that does not contain any spaces. Look for a
-named ACL among those read from the configuration, or a previously read file.
-It is possible that the pointer to the ACL is NULL if the configuration
-contains a name with no data. If not found, and the text begins with '/',
-read an ACL from a file, and save it so it can be re-used. */
+named ACL among those read from the configuration. It is possible that the
+pointer to the ACL is NULL if the configuration contains a name with no data.
+If not found, and the text begins with '/', read an ACL from a file, unless it
+was read before and has not changed since. */
 
 if (Ustrchr(ss, ' ') == NULL)
   {
-  tree_node * t = tree_search(acl_anchor, ss);
-  if (t)
+  if ((t = tree_search(acl_anchor, ss)))
     {
     if (!(acl = (acl_block *)(t->data.ptr)))
       {
@@ -4076,7 +4478,6 @@ if (Ustrchr(ss, ' ') == NULL)
 
   else if (*ss == '/')
     {
-    struct stat statbuf;
     if (is_tainted(ss))
       {
       log_write(0, LOG_MAIN|LOG_PANIC,
@@ -4085,6 +4486,21 @@ if (Ustrchr(ss, ' ') == NULL)
       *log_msgptr = US"internal configuration error";
       return ERROR;
       }
+
+    /* Use a previous reading of the file, if it has not changed since */
+
+    acl_name = string_sprintf("ACL \"%s\"", ss);
+    if (  (ce = (t = tree_search(acl_text_cache, ss)) ? t->data.ptr : NULL)
+       && Ustat(ss, &statbuf) == 0
+       && ce->dev == statbuf.st_dev && ce->ino == statbuf.st_ino
+       && ce->size == statbuf.st_size && ce->mtime == statbuf.st_mtime
+       )
+      {
+      HDEBUG(D_acl) debug_printf_indent("using ACL from file %s\n", ss);
+      if (!(acl = ce->acl)) return FAIL;
+      goto RUN;
+      }
+
     if ((fd = Uopen(ss, O_RDONLY, 0)) < 0)
       {
       *log_msgptr = string_sprintf("failed to open ACL file \"%s\": %s", ss,
@@ -4111,33 +4527,75 @@ if (Ustrchr(ss, ' ') == NULL)
     acl_text[statbuf.st_size] = 0;
     (void)close(fd);
 
-    acl_name = string_sprintf("ACL \"%s\"", ss);
     HDEBUG(D_acl) debug_printf_indent("read ACL from file %s\n", ss);
+    if (!ce)
+      {
+      ce = store_get_perm(sizeof(acl_cache_entry), FALSE);
+      ce->is_file = TRUE;
+      t = NULL;
+      }
+    }
+  }
+
+/* Literal text that has been seen before has already been parsed. Untainted
+text is a candidate for remembering. */
+
+if (!acl && fd < 0)
+  {
+  acl_text_end = ss + Ustrlen(ss) + 1;
+  if (!is_tainted(ss) && (t = tree_search(acl_text_cache, ss)))
+    {
+    HDEBUG(D_acl) debug_printf_indent("using previously parsed inline ACL\n");
+    if (!(acl = ((acl_cache_entry *)t->data.ptr)->acl)) return FAIL;
+    goto RUN;
+    }
+  if (!is_tainted(ss) && acl_text_cache_count < ACL_TEXT_CACHE_MAX)
+    {
+    ce = store_get_perm(sizeof(acl_cache_entry), FALSE);
+    ce->is_file = FALSE;
     }
   }
 
-/* Parse an ACL that is still in text form. If it came from a file, remember it
-in the ACL tree, having read it into the POOL_PERM store pool so that it
-persists between multiple messages. */
+/* Parse an ACL that is still in text form. If it is to be remembered, it is
+read into the POOL_PERM store pool so that it persists between multiple
+messages. The text is copied for the key before parsing, because
+acl_getline() modifies it. */
 
 if (!acl)
   {
   int old_pool = store_pool;
-  if (fd >= 0) store_pool = POOL_PERM;
+
+  if (ce && !t)
+    {
+    t = store_get_perm(sizeof(tree_node) + Ustrlen(ss), is_tainted(ss));
+    Ustrcpy(t->name, ss);
+    t->data.ptr = ce;
+    }
+  if (ce) store_pool = POOL_PERM;
   acl = acl_read(acl_getline, log_msgptr);
   store_pool = old_pool;
   if (!acl && *log_msgptr) return ERROR;
-  if (fd >= 0)
+  if (ce)
     {
-    tree_node *t = store_get_perm(sizeof(tree_node) + Ustrlen(ss), is_tainted(ss));
-    Ustrcpy(t->name, ss);
-    t->data.ptr = acl;
-    (void)tree_insertnode(&acl_anchor, t);
+    ce->acl = acl;
+    if (ce->is_file)
+      {
+      ce->dev = statbuf.st_dev;
+      ce->ino = statbuf.st_ino;
+      ce->size = statbuf.st_size;
+      ce->mtime = statbuf.st_mtime;
+      }
+    if (!tree_search(acl_text_cache, t->name))
+      {
+      (void)tree_insertnode(&acl_text_cache, t);
+      if (!ce->is_file) acl_text_cache_count++;
+      }
     }
   }
 
 /* Now we have an ACL to use. It's possible it may be NULL. */
 
+RUN:
 while (acl)
   {
   int cond;
@@ -4145,6 +4603,7 @@ while (acl)
   BOOL endpass_seen = FALSE;
   BOOL acl_quit_check = acl_level == 0
     && (where == ACL_WHERE_QUIT || where == ACL_WHERE_NOTQUIT);
+  struct timeval prof_start;
 
   *log_msgptr = *user_msgptr = NULL;
   f.acl_temp_details = FALSE;
@@ -4156,8 +4615,16 @@ while (acl)
   this condition. */
 
   search_error_message = NULL;
+  if (profiling) gettimeofday(&prof_start, NULL);
   cond = acl_check_condition(acl->verb, acl->condition, where, addr, acl_level,
     &endpass_seen, user_msgptr, log_msgptr, &basic_errno);
+  if (profiling)
+    {
+    uschar buf[256];
+    (void) string_format(buf, sizeof(buf), "%s in %s at %s:%d",
+      verbs[acl->verb], acl_name, acl->srcfile, acl->srcline);
+    profile_count(buf, &prof_start);
+    }
 
   /* Handle special returns: DEFER causes a return except on a WARN verb;
   ERROR always causes a return. */
@@ -4437,6 +4904,7 @@ acl_check(int where, uschar *recipient, uschar *s, uschar **user_msgptr,
 int rc;
 address_item adb;
 address_item *addr = NULL;
+struct timeval phase_start;
 
 *user_msgptr = *log_msgptr = NULL;
 sender_verified_failed = NULL;
@@ -4470,7 +4938,15 @@ if (where==ACL_WHERE_RCPT || where==ACL_WHERE_VRFY)
 
 acl_where = where;
 acl_level = 0;
+if (smtp_input || trace_ring || EXIM_PROBE_TIMING)
+  gettimeofday(&phase_start, NULL);
+EXIM_PROBE2(acl__start, acl_wherenames[where], message_id);
 rc = acl_check_internal(where, addr, s, user_msgptr, log_msgptr);
+EXIM_PROBE4(acl__done, acl_wherenames[where], message_id, rc,
+  usec_since(&phase_start));
+if (smtp_input) smtp_phase_acl(where, &phase_start);
+if (trace_ring)
+  trace_event(TRACE_ACL, rc, where, &phase_start, acl_wherenames[where]);
 acl_level = 0;
 acl_where = ACL_WHERE_UNKNOWN;
 
@@ -4621,34 +5097,6 @@ return node;
 
 
 
-/*************************************************
-*       Write an ACL variable in spool format    *
-*************************************************/
-
-/* This function is used as a callback for tree_walk when writing variables to
-the spool file. To retain spool file compatibility, what is written is -aclc or
--aclm followed by the rest of the name and the data length, space separated,
-then the value itself, starting on a new line, and terminated by an additional
-newline. When we had only numbered ACL variables, the first line might look
-like this: "-aclc 5 20". Now it might be "-aclc foo 20" for the variable called
-acl_cfoo.
-
-Arguments:
-  name    of the variable
-  value   of the variable
-  ctx     FILE pointer (as a void pointer)
-
-Returns:  nothing
-*/
-
-void
-acl_var_write(uschar *name, uschar *value, void *ctx)
-{
-FILE *f = (FILE *)ctx;
-if (is_tainted(value)) putc('-', f);
-fprintf(f, "-acl%c %s %d\n%s\n", name[0], name+1, Ustrlen(value), value);
-}
-
 /* vi: aw ai sw=2
 */
 /* End of acl.c */
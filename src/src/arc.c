@@ -634,21 +634,23 @@ return p;
 
 
 
+/* Find the bodyhash for an AMS in the DKIM verify context, where it is
+shared with any DKIM signature using the same parameters. It is created when
+the header is seen, before the body is fed; when the AMS is verified it must
+already exist, as a new one would not have been given the body. */
+
 static pdkim_bodyhash *
-arc_ams_setup_vfy_bodyhash(arc_line * ams)
+arc_ams_setup_vfy_bodyhash(arc_line * ams, BOOL create)
 {
-int canon_head = -1, canon_body = -1;
 long bodylen;
 
-if (!ams->c.data) ams->c.data = US"simple";	/* RFC 6376 (DKIM) default */
-pdkim_cstring_to_canons(ams->c.data, ams->c.len, &canon_head, &canon_body);
+if (!ams->c.data)				/* RFC 6376 (DKIM) default */
+  { ams->c.data = US"simple"; ams->c.len = 6; }
 bodylen = ams->l.data
 	? strtol(CS string_copyn(ams->l.data, ams->l.len), NULL, 10) : -1;
 
-return pdkim_set_bodyhash(dkim_verify_ctx,
-	pdkim_hashname_to_hashtype(ams->a_hash.data, ams->a_hash.len),
-	canon_body,
-	bodylen);
+return pdkim_find_bodyhash(dkim_verify_ctx, ams->c.data, ams->c.len,
+	ams->a_hash.data, ams->a_hash.len, bodylen, create);
 }
 
 
@@ -690,7 +692,7 @@ if (  !ams->a.data || !ams->b.data || !ams->bh.data || !ams->d.data
 /* The bodyhash should have been created earlier, and the dkim code should
 have managed calculating it during message input.  Find the reference to it. */
 
-if (!(b = arc_ams_setup_vfy_bodyhash(ams)))
+if (!(b = arc_ams_setup_vfy_bodyhash(ams, FALSE)))
   {
   as->ams_verify_done = arc_state_reason = US"internal hash setup error";
   return US"fail";
@@ -1515,14 +1517,10 @@ method if needed.
 void *
 arc_ams_setup_sign_bodyhash(void)
 {
-int canon_head, canon_body;
-
 DEBUG(D_transport) debug_printf("ARC: requesting bodyhash\n");
-pdkim_cstring_to_canons(US"relaxed", 7, &canon_head, &canon_body);	/*XXX hardwired */
-return pdkim_set_bodyhash(&dkim_sign_ctx,
-	pdkim_hashname_to_hashtype(US"sha256", 6),			/*XXX hardwired */
-	canon_body,
-	-1);
+return pdkim_find_bodyhash(&dkim_sign_ctx,
+	US"relaxed", 7, US"sha256", 6,		/*XXX hardwired, matching the AMS */
+	-1, TRUE);
 }
 
 
@@ -1796,7 +1794,7 @@ if (!al.c.data)
 
 /* Ask the dkim code to calc a bodyhash with those specs */
 
-if (!(b = arc_ams_setup_vfy_bodyhash(&al)))
+if (!(b = arc_ams_setup_vfy_bodyhash(&al, TRUE)))
   return US"dkim hash setup fail";
 
 /* Discard the reference; search again at verify time, knowing that one
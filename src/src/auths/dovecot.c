@@ -51,6 +51,7 @@ The cost is the length of an array of pointers on the stack.
 
 /* Options specific to the authentication mechanism. */
 optionlist auth_dovecot_options[] = {
+  { "server_cache_ttl", opt_time, OPT_OFF(auth_dovecot_options_block, server_cache_ttl) },
   { "server_socket", opt_stringptr, OPT_OFF(auth_dovecot_options_block, server_socket) },
 /*{ "server_tls", opt_bool, OPT_OFF(auth_dovecot_options_block, server_tls) },*/
 };
@@ -64,6 +65,7 @@ int auth_dovecot_options_count = nelem(auth_dovecot_options);
 
 auth_dovecot_options_block auth_dovecot_option_defaults = {
 	.server_socket = NULL,
+	.server_cache_ttl = 0,
 /*	.server_tls =	FALSE,*/
 };
 
@@ -86,6 +88,38 @@ int auth_dovecot_client(auth_instance *ablock, void * sx,
 static uschar sbuffer[256];
 static int socket_buffer_left;
 
+/* Connections to the auth server are kept for the life of the process, one
+for each socket, so that later authentications need neither a new connection
+nor the handshake. A child process must not use its parent's connections;
+they are dropped when seen. A connection that is not left between requests at
+the end of an exchange is closed. */
+
+typedef struct dc_conn {
+  struct dc_conn *	next;
+  uschar *		socket;		/* The server_socket it was made for */
+  uschar *		mechs;		/* Colon-list of advertised mechanisms */
+  client_conn_ctx	cctx;
+  pid_t			pid;		/* The process that made it */
+  int			reqid;		/* Id of the latest request */
+} dc_conn;
+
+static dc_conn * dc_conns = NULL;
+
+/* When server_cache_ttl is set, successful authentications are remembered
+for that long, so that a repeat of the same exchange is accepted without
+asking Dovecot. Only a SHA-256 hash of the client's data is kept. */
+
+#define DC_CACHE_SIZE	64
+#define DC_CACHE_KEYLEN	32
+
+typedef struct {
+  uschar	key[DC_CACHE_KEYLEN];
+  time_t	expiry;
+  uschar *	user;			/* NULL for an unused entry */
+} dc_cache_entry;
+
+static dc_cache_entry dc_cache[DC_CACHE_SIZE];
+
 
 
 /*************************************************
@@ -239,37 +273,83 @@ return s;
 
 
 /*************************************************
-*              Server entry point                *
+*         Send a line to the auth server         *
 *************************************************/
 
-int
-auth_dovecot_server(auth_instance * ablock, uschar * data)
+static BOOL
+dc_write(client_conn_ctx * cctx, const uschar * s)
 {
-auth_dovecot_options_block *ob =
-       (auth_dovecot_options_block *) ablock->options_block;
-uschar buffer[DOVECOT_AUTH_MAXLINELEN];
-uschar *args[DOVECOT_AUTH_MAXFIELDCOUNT];
-uschar *auth_command;
-uschar *auth_extra_data = US"";
-uschar *p;
-int nargs, tmp;
-int crequid = 1, ret = DEFER;
-host_item host;
-client_conn_ctx cctx = {.sock = -1, .tls_ctx = NULL};
-BOOL found = FALSE, have_mech_line = FALSE;
+int len = Ustrlen(s);
+return (
+#ifndef DISABLE_TLS
+    cctx->tls_ctx ? tls_write(cctx->tls_ctx, s, len, FALSE) :
+#endif
+    write(cctx->sock, s, len)) == len;
+}
 
-HDEBUG(D_auth) debug_printf("dovecot authentication\n");
 
-if (!data)
-  {
-  ret = FAIL;
-  goto out;
-  }
+
+/*************************************************
+*           Close a cached connection            *
+*************************************************/
+
+static void
+dc_drop(dc_conn * conn)
+{
+for (dc_conn ** cp = &dc_conns; *cp; cp = &(*cp)->next)
+  if (*cp == conn)
+    {
+    *cp = conn->next;
+    break;
+    }
+HDEBUG(D_auth) debug_printf("dovecot: closing connection to %s\n",
+  conn->socket);
+#ifndef DISABLE_TLS
+if (conn->cctx.tls_ctx)
+  tls_close(conn->cctx.tls_ctx, TRUE);
+#endif
+if (conn->cctx.sock >= 0)
+  close(conn->cctx.sock);
+store_free(conn->mechs);
+store_free(conn);
+}
+
+
+
+/*************************************************
+*        Connect and handshake with Dovecot       *
+*************************************************/
+
+/* Make a connection to the auth server and read its handshake, keeping the
+list of mechanisms that it advertises, then send our own VERSION and CPID
+lines. These are needed only once for a connection, however many
+authentications are done on it.
+
+Arguments:
+  ob         the options block
+  buffer     a buffer for reading lines
+  bufsize    its size
+
+Returns:     the new, cached, connection, or NULL with auth_defer_msg set
+*/
+
+static dc_conn *
+dc_connect(auth_dovecot_options_block * ob, uschar * buffer, int bufsize)
+{
+uschar *args[DOVECOT_AUTH_MAXFIELDCOUNT];
+client_conn_ctx cctx = {.sock = -1, .tls_ctx = NULL};
+host_item host;
+gstring * mechs = NULL;
+dc_conn * conn;
+uschar * p;
+int nargs;
+BOOL have_mech_line = FALSE;
 
 /*XXX timeout? */
 cctx.sock = ip_streamsocket(ob->server_socket, &auth_defer_msg, 5, &host);
 if (cctx.sock < 0)
- goto out;
+  return NULL;
+(void) fcntl(cctx.sock, F_SETFD, fcntl(cctx.sock, F_GETFD) | FD_CLOEXEC);
 
 #ifdef notdef
 # ifndef DISABLE_TLS
@@ -283,7 +363,7 @@ if (ob->server_tls)
   if (!tls_client_start(&cctx, &conn_args, NULL, &tls_dummy, &errstr))
     {
     auth_defer_msg = string_sprintf("TLS connect failed: %s", errstr);
-    goto out;
+    goto bad;
     }
   }
 # endif
@@ -294,13 +374,17 @@ auth_defer_msg = US"authentication socket protocol error";
 socket_buffer_left = 0;  /* Global, used to read more than a line but return by line */
 for (;;)
   {
-debug_printf("%s %d\n", __FUNCTION__, __LINE__);
-  if (!dc_gets(buffer, sizeof(buffer), &cctx))
-    OUT("authentication socket read error or premature eof");
-debug_printf("%s %d\n", __FUNCTION__, __LINE__);
+  if (!dc_gets(buffer, bufsize, &cctx))
+    {
+    auth_defer_msg = US"authentication socket read error or premature eof";
+    goto bad;
+    }
   p = buffer + Ustrlen(buffer) - 1;
   if (*p != '\n')
-    OUT("authentication socket protocol line too long");
+    {
+    auth_defer_msg = US"authentication socket protocol line too long";
+    goto bad;
+    }
 
   *p = '\0';
   HDEBUG(D_auth) debug_printf("received: '%s'\n", buffer);
@@ -321,16 +405,18 @@ debug_printf("%s %d\n", __FUNCTION__, __LINE__);
 
   if (Ustrcmp(args[0], US"VERSION") == 0)
     {
-    CHECK_COMMAND("VERSION", 2, 2);
+    if (nargs - 1 != 2) goto bad;
     if (Uatoi(args[1]) != VERSION_MAJOR)
-      OUT("authentication socket protocol version mismatch");
+      {
+      auth_defer_msg = US"authentication socket protocol version mismatch";
+      goto bad;
+      }
     }
   else if (Ustrcmp(args[0], US"MECH") == 0)
     {
-    CHECK_COMMAND("MECH", 1, INT_MAX);
+    if (nargs - 1 < 1) goto bad;
     have_mech_line = TRUE;
-    if (strcmpic(US args[1], ablock->public_name) == 0)
-      found = TRUE;
+    mechs = string_append_listele(mechs, ':', args[1]);
     }
   else if (Ustrcmp(args[0], US"SPID") == 0)
     {
@@ -344,27 +430,164 @@ debug_printf("%s %d\n", __FUNCTION__, __LINE__);
     to see if CUID is sent or not). */
 
     if (!have_mech_line)
-      OUT("authentication socket type mismatch"
-	" (connected to auth-master instead of auth-client)");
+      {
+      auth_defer_msg = US"authentication socket type mismatch"
+	" (connected to auth-master instead of auth-client)";
+      goto bad;
+      }
     }
   else if (Ustrcmp(args[0], US"DONE") == 0)
     {
-    CHECK_COMMAND("DONE", 0, 0);
+    if (nargs - 1 != 0) goto bad;
     break;
     }
   }
 
-if (!found)
+/****************************************************************************
+The code below was the original code here. It didn't work. A reading of the
+file auth-protocol.txt.gz that came with Dovecot 1.0_beta8 indicated that
+this was not right. Maybe something changed. I changed it to move the
+service indication into the AUTH command, and it seems to be better. PH
+
+fprintf(f, "VERSION\t%d\t%d\r\nSERVICE\tSMTP\r\nCPID\t%d\r\n"
+       "AUTH\t%d\t%s\trip=%s\tlip=%s\tresp=%s\r\n",
+       VERSION_MAJOR, VERSION_MINOR, getpid(), cuid,
+       ablock->public_name, sender_host_address, interface_address,
+       data ? CS  data : "");
+
+Subsequently, the command was modified to add "secured" and "valid-client-
+cert" when relevant. Later still, the VERSION and CPID lines were split from
+the AUTH command, so that they are sent only once for a connection.
+****************************************************************************/
+
+if (!dc_write(&cctx, string_sprintf("VERSION\t%d\t%d\nCPID\t%d\n",
+      VERSION_MAJOR, VERSION_MINOR, getpid())))
   {
-  auth_defer_msg = string_sprintf(
-    "Dovecot did not advertise mechanism \"%s\" to us", ablock->public_name);
-  goto out;
+  auth_defer_msg = US"authentication socket write error";
+  goto bad;
   }
 
-/* Added by PH: data must not contain tab (as it is
-b64 it shouldn't, but check for safety). */
+conn = store_malloc(sizeof(dc_conn) + Ustrlen(ob->server_socket) + 1);
+conn->socket = US (conn + 1);
+Ustrcpy(conn->socket, ob->server_socket);
+conn->mechs = string_copy_malloc(mechs ? string_from_gstring(mechs) : US"");
+conn->cctx = cctx;
+conn->pid = getpid();
+conn->reqid = 0;
+conn->next = dc_conns;
+dc_conns = conn;
+return conn;
+
+bad:
+#ifndef DISABLE_TLS
+if (cctx.tls_ctx)
+  tls_close(cctx.tls_ctx, TRUE);
+#endif
+close(cctx.sock);
+return NULL;
+}
 
-if (Ustrchr(data, '\t') != NULL)
+
+
+/*************************************************
+*       Cache of successful authentications      *
+*************************************************/
+
+/* Compute the cache key for an authentication whose client data is all in
+the initial response. The key covers the authenticator, the client's and our
+addresses, and the security flags, as well as the data.
+
+Arguments:
+  ablock      the authenticator
+  extra       the security flags for the AUTH command
+  data        the client's data
+  key         where to put the hash
+
+Returns:      TRUE if the key was computed
+*/
+
+static BOOL
+dc_cache_key(auth_instance * ablock, const uschar * extra, const uschar * data,
+  uschar * key)
+{
+hctx h;
+blob b;
+const uschar * parts[] = { ablock->name, sender_host_address,
+  interface_address, extra, data };
+
+if (!exim_sha_init(&h, HASH_SHA2_256)) return FALSE;
+for (int i = 0; i < nelem(parts); i++)
+  {
+  const uschar * s = parts[i] ? parts[i] : US"";
+  exim_sha_update(&h, s, Ustrlen(s) + 1);	/* Include the NUL as a separator */
+  }
+exim_sha_finish(&h, &b);
+if (b.len != DC_CACHE_KEYLEN) return FALSE;
+memcpy(key, b.data, DC_CACHE_KEYLEN);
+return TRUE;
+}
+
+
+/* Look for an unexpired entry; returns the user name, or NULL */
+
+static const uschar *
+dc_cache_find(const uschar * key)
+{
+time_t now = time(NULL);
+
+for (int i = 0; i < DC_CACHE_SIZE; i++)
+  if (  dc_cache[i].user && dc_cache[i].expiry > now
+     && memcmp(dc_cache[i].key, key, DC_CACHE_KEYLEN) == 0)
+    return dc_cache[i].user;
+return NULL;
+}
+
+
+/* Add an entry, replacing an expired one or else the one that expires
+soonest. */
+
+static void
+dc_cache_add(const uschar * key, const uschar * user, int ttl)
+{
+dc_cache_entry * e = dc_cache;
+
+for (int i = 1; i < DC_CACHE_SIZE && e->user; i++)
+  if (!dc_cache[i].user || dc_cache[i].expiry < e->expiry)
+    e = dc_cache + i;
+
+if (e->user) store_free(e->user);
+memcpy(e->key, key, DC_CACHE_KEYLEN);
+e->user = string_copy_malloc(user);
+e->expiry = time(NULL) + ttl;
+}
+
+
+
+/*************************************************
+*              Server entry point                *
+*************************************************/
+
+int
+auth_dovecot_server(auth_instance * ablock, uschar * data)
+{
+auth_dovecot_options_block *ob =
+       (auth_dovecot_options_block *) ablock->options_block;
+uschar buffer[DOVECOT_AUTH_MAXLINELEN];
+uschar *args[DOVECOT_AUTH_MAXFIELDCOUNT];
+uschar *auth_command;
+uschar *auth_extra_data = US"";
+uschar cache_key[DC_CACHE_KEYLEN];
+const uschar * s, * mechs;
+int nargs, tmp;
+int crequid, ret = DEFER;
+dc_conn * conn = NULL;
+pid_t pid = getpid();
+BOOL found = FALSE, clean = FALSE, reused, continued = FALSE;
+BOOL cacheable = FALSE;
+
+HDEBUG(D_auth) debug_printf("dovecot authentication\n");
+
+if (!data)
   {
   ret = FAIL;
   goto out;
@@ -382,46 +605,94 @@ else if (  interface_address
         && Ustrcmp(sender_host_address, interface_address) == 0)
   auth_extra_data = US"secured\t";
 
+/* A repeat of an exchange that has recently succeeded needs no Dovecot. */
 
-/****************************************************************************
-The code below was the original code here. It didn't work. A reading of the
-file auth-protocol.txt.gz that came with Dovecot 1.0_beta8 indicated that
-this was not right. Maybe something changed. I changed it to move the
-service indication into the AUTH command, and it seems to be better. PH
+if (  ob->server_cache_ttl > 0 && *data
+   && (cacheable = dc_cache_key(ablock, auth_extra_data, data, cache_key))
+   && (s = dc_cache_find(cache_key)))
+  {
+  HDEBUG(D_auth) debug_printf("dovecot: cached result used\n");
+  expand_nstring[1] = auth_vars[0] = string_copy(s);
+  expand_nlength[1] = Ustrlen(s);
+  expand_nmax = 1;
+  auth_defer_msg = NULL;
+  ret = OK;
+  goto out;
+  }
 
-fprintf(f, "VERSION\t%d\t%d\r\nSERVICE\tSMTP\r\nCPID\t%d\r\n"
-       "AUTH\t%d\t%s\trip=%s\tlip=%s\tresp=%s\r\n",
-       VERSION_MAJOR, VERSION_MINOR, getpid(), cuid,
-       ablock->public_name, sender_host_address, interface_address,
-       data ? CS  data : "");
+/* Use a connection that this process has already made, if there is one;
+drop any that were inherited from a parent. */
 
-Subsequently, the command was modified to add "secured" and "valid-client-
-cert" when relevant.
-****************************************************************************/
+RETRY:
+for (dc_conn * c = dc_conns, * next; c; c = next)
+  {
+  next = c->next;
+  if (c->pid != pid)
+    dc_drop(c);
+  else if (Ustrcmp(c->socket, ob->server_socket) == 0)
+    conn = c;
+  }
 
-auth_command = string_sprintf("VERSION\t%d\t%d\nCPID\t%d\n"
+reused = conn != NULL;
+if (reused)
+  {
+  HDEBUG(D_auth) debug_printf("dovecot: using cached connection to %s\n",
+    conn->socket);
+  socket_buffer_left = 0;
+  }
+else if (!(conn = dc_connect(ob, buffer, sizeof(buffer))))
+  goto out;
+
+mechs = conn->mechs;
+for (int sep = ':'; s = string_nextinlist(&mechs, &sep, NULL, 0); )
+  if (strcmpic(US s, ablock->public_name) == 0)
+    { found = TRUE; break; }
+
+clean = TRUE;		/* Nothing is outstanding on the connection */
+
+if (!found)
+  {
+  auth_defer_msg = string_sprintf(
+    "Dovecot did not advertise mechanism \"%s\" to us", ablock->public_name);
+  goto out;
+  }
+
+/* Added by PH: data must not contain tab (as it is
+b64 it shouldn't, but check for safety). */
+
+if (Ustrchr(data, '\t') != NULL)
+  {
+  ret = FAIL;
+  goto out;
+  }
+
+crequid = ++conn->reqid;
+auth_command = string_sprintf(
        "AUTH\t%d\t%s\tservice=smtp\t%srip=%s\tlip=%s\tnologin\tresp=%s\n",
-       VERSION_MAJOR, VERSION_MINOR, getpid(), crequid,
-       ablock->public_name, auth_extra_data, sender_host_address,
+       crequid, ablock->public_name, auth_extra_data, sender_host_address,
        interface_address, data);
 
-if ((
-#ifndef DISABLE_TLS
-    cctx.tls_ctx ? tls_write(cctx.tls_ctx, auth_command, Ustrlen(auth_command), FALSE) :
-#endif
-    write(cctx.sock, auth_command, Ustrlen(auth_command))) < 0)
+clean = FALSE;
+if (!dc_write(&conn->cctx, auth_command))
+  {
   HDEBUG(D_auth) debug_printf("error sending auth_command: %s\n",
     strerror(errno));
+  if (reused) goto RECONNECT;
+  }
 
 HDEBUG(D_auth) debug_printf("sent: '%s'\n", auth_command);
+auth_defer_msg = US"authentication socket protocol error";
 
 while (1)
   {
   uschar *temp;
   uschar *auth_id_pre = NULL;
 
-  if (!dc_gets(buffer, sizeof(buffer), &cctx))
+  if (!dc_gets(buffer, sizeof(buffer), &conn->cctx))
     {
+    /* The server may have closed a connection that was idle. */
+
+    if (reused && !continued) goto RECONNECT;
     auth_defer_msg = US"authentication socket read error or premature eof";
     goto out;
     }
@@ -455,12 +726,9 @@ while (1)
 	}
 
       temp = string_sprintf("CONT\t%d\t%s\n", crequid, data);
-      if ((
-#ifndef DISABLE_TLS
-	  cctx.tls_ctx ? tls_write(cctx.tls_ctx, temp, Ustrlen(temp), FALSE) :
-#endif
-	  write(cctx.sock, temp, Ustrlen(temp))) < 0)
+      if (!dc_write(&conn->cctx, temp))
 	OUT("authentication socket write error");
+      continued = TRUE;
       break;
 
     case 'F':
@@ -474,11 +742,13 @@ while (1)
 	  expand_nlength[1] = Ustrlen(auth_id_pre);
 	  expand_nmax = 1;
 	  }
+      clean = TRUE;
       ret = FAIL;
       goto out;
 
     case 'O':
       CHECK_COMMAND("OK", 2, -1);
+      clean = TRUE;
 
       /* Search for the "user=$USER" string in the args array
       and return the proper value.  */
@@ -495,6 +765,12 @@ while (1)
       if (!auth_id_pre)
         OUT("authentication socket protocol error, username missing");
 
+      /* Only an exchange that was all in the initial response can be
+      recognized again. */
+
+      if (cacheable && !continued)
+	dc_cache_add(cache_key, auth_id_pre, ob->server_cache_ttl);
+
       auth_defer_msg = NULL;
       ret = OK;
       /* fallthrough */
@@ -504,14 +780,21 @@ while (1)
     }
   }
 
+/* A cached connection has failed before the request got anywhere; try
+again on a new one. */
+
+RECONNECT:
+  dc_drop(conn);
+  conn = NULL;
+  found = clean = FALSE;
+  goto RETRY;
+
 out:
-/* close the socket used by dovecot */
-#ifndef DISABLE_TLS
-if (cctx.tls_ctx)
-  tls_close(cctx.tls_ctx, TRUE);
-#endif
-if (cctx.sock >= 0)
-  close(cctx.sock);
+/* Close the connection to dovecot unless it is ready for another
+authentication. */
+
+if (conn && !clean)
+  dc_drop(conn);
 
 /* Expand server_condition as an authorization check */
 return ret == OK ? auth_check_serv_cond(ablock) : ret;
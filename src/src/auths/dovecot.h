@@ -10,6 +10,7 @@
 
 typedef struct {
   uschar *	server_socket;
+  int		server_cache_ttl;
   BOOL		server_tls;
 } auth_dovecot_options_block;
 
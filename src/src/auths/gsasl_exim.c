@@ -71,8 +71,14 @@ optionlist auth_gsasl_options[] = {
   { "server_mech",		opt_stringptr,	LOFF(server_mech) },
   { "server_password",		opt_stringptr,	LOFF(server_password) },
   { "server_realm",		opt_stringptr,	LOFF(server_realm) },
+#ifdef EXIM_GSASL_SCRAM_S_KEY
+  { "server_scram_cache",	opt_bool,	LOFF(server_scram_cache) },
+#endif
   { "server_scram_iter",	opt_stringptr,	LOFF(server_scram_iter) },
   { "server_scram_salt",	opt_stringptr,	LOFF(server_scram_salt) },
+#ifdef EXIM_GSASL_SCRAM_S_KEY
+  { "server_scram_store",	opt_stringptr,	LOFF(server_scram_store) },
+#endif
 #ifdef EXIM_GSASL_SCRAM_S_KEY
   { "server_skey",		opt_stringptr,	LOFF(server_s_key) },
 #endif
@@ -130,6 +136,18 @@ static BOOL sasl_error_should_defer = FALSE;
 static Gsasl_property callback_loop = 0;
 static BOOL checked_server_condition = FALSE;
 
+#ifdef EXIM_GSASL_SCRAM_S_KEY
+/* Cache of SCRAM keys derived from server_password, and its state for the
+current server session */
+
+static tree_node * scram_keys = NULL;
+static uschar * scram_cache_key;
+static BOOL scram_cache_looked, scram_cache_hit;
+
+static void
+  scram_cache_record(Gsasl_session *sctx, auth_instance *ablock);
+#endif
+
 enum { CURRENTLY_SERVER = 1, CURRENTLY_CLIENT = 2 };
 
 struct callback_exim_state {
@@ -450,6 +468,10 @@ else
 #endif
 
 checked_server_condition = FALSE;
+#ifdef EXIM_GSASL_SCRAM_S_KEY
+scram_cache_key = NULL;
+scram_cache_looked = scram_cache_hit = FALSE;
+#endif
 
 received = CS initial_data;
 to_send = NULL;
@@ -526,6 +548,12 @@ HDEBUG(D_auth)
 #endif
   }
 
+#ifdef EXIM_GSASL_SCRAM_S_KEY
+if (auth_result == GSASL_OK && exim_error == OK
+   && scram_cache_key && !scram_cache_hit)
+  scram_cache_record(sctx, ablock);
+#endif
+
 gsasl_finish(sctx);
 
 /* Can return: OK DEFER FAIL CANCELLED BAD64 UNEXPECTED */
@@ -617,6 +645,194 @@ HDEBUG(D_auth) debug_printf("  option not set\n");
 return GSASL_NO_CALLBACK;
 }
 
+
+#ifdef EXIM_GSASL_SCRAM_S_KEY
+/*************************************************
+*          Cache of derived SCRAM keys           *
+*************************************************/
+
+/* Unless server_key and server_skey are given, the library derives the SCRAM
+keys from server_password, running PBKDF2 to the iteration count, on every
+authentication. The StoredKey and ServerKey it derives are kept here, in a
+per-process tree and, if server_scram_cache is set, in the "gsasl" hints
+database. The cache key is the user name with a hash of the mechanism,
+iteration count, salt and password, so a change to any of these misses. The
+salt must come from server_scram_salt; one made up by the library for a single
+session is no use for a cache.
+
+Returns:  the cache key, or NULL if the keys cannot be cached
+*/
+
+static uschar *
+scram_cache_keyname(Gsasl_session * sctx, auth_instance * ablock)
+{
+auth_gsasl_options_block * ob = ablock->options_block;
+const uschar * iter = CUS gsasl_property_fast(sctx, GSASL_SCRAM_ITER);
+const uschar * salt = CUS gsasl_property_fast(sctx, GSASL_SCRAM_SALT);
+uschar * pw;
+gstring * g;
+hctx h;
+blob b;
+
+if (!ob->server_scram_salt || !ob->server_password || !iter || !salt)
+  return NULL;
+set_exim_authvars_from_a_az_r_props(sctx);
+if (!auth_vars[0] || !*auth_vars[0]) return NULL;
+
+/* A failed expansion is left for the password callback to deal with */
+
+if (  !(pw = expand_string(ob->server_password))
+   || !exim_sha_init(&h, HASH_SHA2_256))
+  return NULL;
+exim_sha_update(&h, ob->server_mech, Ustrlen(ob->server_mech) + 1);
+exim_sha_update(&h, iter, Ustrlen(iter) + 1);
+exim_sha_update(&h, salt, Ustrlen(salt) + 1);
+exim_sha_update(&h, pw, Ustrlen(pw));
+exim_sha_finish(&h, &b);
+memset(pw, '\0', Ustrlen(pw));
+
+g = string_fmt_append(NULL, "%s:", auth_vars[0]);
+for (int i = 0; i < b.len; i++)
+  g = string_fmt_append(g, "%02x", b.data[i]);
+return string_from_gstring(g);
+}
+
+
+/* Add keys, in the form StoredKey NUL ServerKey NUL, to the per-process tree */
+
+static void
+scram_cache_remember(const uschar * keys, int len)
+{
+int old_pool = store_pool;
+tree_node * t;
+
+store_pool = POOL_PERM;
+t = store_get(sizeof(tree_node) + Ustrlen(scram_cache_key),
+		is_tainted(scram_cache_key));
+Ustrcpy(t->name, scram_cache_key);
+t->data.ptr = store_get(len, FALSE);
+memcpy(t->data.ptr, keys, len);
+(void) tree_insertnode(&scram_keys, t);
+store_pool = old_pool;
+}
+
+
+/* Called from the server callback for either key, when neither server_key
+nor server_skey is set.  On a hit, both keys are set for the session.
+
+Returns:  GSASL_OK on a hit, else GSASL_NO_CALLBACK
+*/
+
+static int
+scram_cache_lookup(Gsasl_session * sctx, auth_instance * ablock)
+{
+auth_gsasl_options_block * ob = ablock->options_block;
+const uschar * keys = NULL;
+tree_node * t;
+
+HDEBUG(D_auth) debug_printf(" SCRAM key cache\n");
+if (scram_cache_looked) return GSASL_NO_CALLBACK;
+scram_cache_looked = TRUE;
+if (!(scram_cache_key = scram_cache_keyname(sctx, ablock)))
+  {
+  HDEBUG(D_auth) debug_printf("  not usable\n");
+  return GSASL_NO_CALLBACK;
+  }
+
+if ((t = tree_search(scram_keys, scram_cache_key)))
+  keys = t->data.ptr;
+else if (ob->server_scram_cache)
+  {
+  open_db dbblock, * dbm;
+  dbdata_gsasl * rec;
+
+  if ((dbm = dbfn_open(US"gsasl", O_RDONLY, &dbblock, FALSE, TRUE)))
+    {
+    if ((rec = dbfn_read(dbm, scram_cache_key)))
+      {
+      int len = Ustrlen(rec->keys) + 1;
+      len += Ustrlen(rec->keys + len) + 1;
+      scram_cache_remember(rec->keys, len);
+      keys = rec->keys;
+      }
+    dbfn_close(dbm);
+    }
+  }
+
+if (!keys)
+  {
+  HDEBUG(D_auth) debug_printf("  miss\n");
+  return GSASL_NO_CALLBACK;
+  }
+HDEBUG(D_auth) debug_printf("  hit\n");
+gsasl_property_set(sctx, GSASL_SCRAM_STOREDKEY, CCS keys);
+gsasl_property_set(sctx, GSASL_SCRAM_SERVERKEY, CCS keys + Ustrlen(keys) + 1);
+scram_cache_hit = TRUE;
+return GSASL_OK;
+}
+
+
+/* Called after a successful SCRAM exchange for which the library derived the
+keys from the password.  Record them, and give them to server_scram_store,
+with $4 the iteration count, $5 the salt, $6 StoredKey and $7 ServerKey. */
+
+static void
+scram_cache_record(Gsasl_session * sctx, auth_instance * ablock)
+{
+auth_gsasl_options_block * ob = ablock->options_block;
+const uschar * skey = CUS gsasl_property_fast(sctx, GSASL_SCRAM_STOREDKEY);
+const uschar * key = CUS gsasl_property_fast(sctx, GSASL_SCRAM_SERVERKEY);
+int slen, len;
+uschar * keys;
+
+if (!skey || !key) return;
+slen = Ustrlen(skey) + 1;
+len = slen + Ustrlen(key) + 1;
+keys = store_get(len, FALSE);
+memcpy(keys, skey, slen);
+memcpy(keys + slen, key, len - slen);
+scram_cache_remember(keys, len);
+
+if (ob->server_scram_cache)
+  {
+  open_db dbblock, * dbm;
+  dbdata_gsasl * rec;
+
+  if ((dbm = dbfn_open(US"gsasl", O_RDWR, &dbblock, TRUE, TRUE)))
+    {
+    rec = store_get(sizeof(dbdata_gsasl) + len, FALSE);
+    memcpy(rec->keys, keys, len);
+    (void) dbfn_write(dbm, scram_cache_key, rec, sizeof(dbdata_gsasl) + len);
+    dbfn_close(dbm);
+    }
+  }
+HDEBUG(D_auth) debug_printf("SCRAM key cache: recorded keys\n");
+
+if (ob->server_scram_store)
+  {
+  const uschar * vals[] = {
+    CUS gsasl_property_fast(sctx, GSASL_SCRAM_ITER),
+    CUS gsasl_property_fast(sctx, GSASL_SCRAM_SALT), skey, key };
+  int save_nmax;
+
+  for (int i = 0; i < AUTH_VARS; i++) auth_vars[i] = NULL;
+  expand_nmax = 0;
+  set_exim_authvars_from_a_az_r_props(sctx);
+  save_nmax = expand_nmax;
+  for (int i = 0; i < nelem(vals); i++)
+    {
+    expand_nstring[++expand_nmax] = US (vals[i] ? vals[i] : CUS"");
+    expand_nlength[expand_nmax] = Ustrlen(expand_nstring[expand_nmax]);
+    }
+  if (!expand_string(ob->server_scram_store) && !f.expand_string_forcedfail)
+    log_write(0, LOG_MAIN|LOG_PANIC, "%s authenticator: failed to expand "
+      "server_scram_store: %s", ablock->name, expand_string_message);
+  expand_nmax = save_nmax;
+  }
+}
+#endif	/*EXIM_GSASL_SCRAM_S_KEY*/
+
+
 static int
 server_callback(Gsasl *ctx, Gsasl_session *sctx, Gsasl_property prop,
   auth_instance *ablock)
@@ -704,11 +920,15 @@ switch (prop)
 
 #ifdef EXIM_GSASL_SCRAM_S_KEY
   case GSASL_SCRAM_STOREDKEY:
-    cbrc = prop_from_option(sctx, prop, ob->server_s_key);
+    cbrc = ob->server_s_key || ob->server_key
+      ? prop_from_option(sctx, prop, ob->server_s_key)
+      : scram_cache_lookup(sctx, ablock);
     break;
 
   case GSASL_SCRAM_SERVERKEY:
-    cbrc = prop_from_option(sctx, prop, ob->server_key);
+    cbrc = ob->server_s_key || ob->server_key
+      ? prop_from_option(sctx, prop, ob->server_key)
+      : scram_cache_lookup(sctx, ablock);
     break;
 #endif
 
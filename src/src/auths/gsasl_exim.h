@@ -22,6 +22,7 @@ typedef struct {
   uschar *server_s_key;
   uschar *server_scram_iter;
   uschar *server_scram_salt;
+  uschar *server_scram_store;
 
   uschar *client_username;
   uschar *client_password;
@@ -29,6 +30,7 @@ typedef struct {
   uschar *client_spassword;
 
   BOOL    server_channelbinding;
+  BOOL    server_scram_cache;
   BOOL	  client_channelbinding;
 } auth_gsasl_options_block;
 
@@ -155,6 +155,7 @@ failure. We know that there will always be at least one extra option in the
 call when exec() is done here, so it can be used to add to the panic data. */
 
 DEBUG(D_exec) debug_print_argv(CUSS argv);
+mainlog_flush();
 exim_nullstd();                            /* Make sure std{in,out,err} exist */
 execv(CS argv[0], (char *const *)argv);
 
@@ -203,6 +204,159 @@ return child_open_exim2_function(fdptr, US"<>", bounce_sender_authentication,
 }
 
 
+/*************************************************
+*      Receive a message in a forked child       *
+*************************************************/
+
+/* When bounce_in_process is set, a message with an empty sender (a bounce,
+DSN, or warning) is received by a forked copy of the current process instead of
+a re-exec of Exim. The child sets up the state that "-t -oem -oi -f <>" would
+give a new process, reads the message from the pipe into the spool via
+receive_msg(), and then hands it on for delivery exactly as a locally submitted
+message would be. The pipe is read through its own stdio stream, as the stdin
+buffer may hold data left over from this process's own input. */
+
+static FILE * child_in = NULL;
+
+static int child_in_getc(unsigned lim)	{ return getc(child_in); }
+static int child_in_ungetc(int c)	{ return ungetc(c, child_in); }
+static int child_in_feof(void)		{ return feof(child_in); }
+static int child_in_ferror(void)	{ return ferror(child_in); }
+
+
+/* Decide whether the in-process path can be used. It is not used when a
+cutthrough connection might be disturbed, or when the delivery that follows
+would need privilege that this process cannot regain. */
+
+static BOOL
+child_receive_ok(const uschar * sender)
+{
+return bounce_in_process
+  && Ustrcmp(sender, "<>") == 0
+  && cutthrough.cctx.sock < 0
+  && (geteuid() == root_uid || deliver_drop_privilege);
+}
+
+
+/* The child side. Any message this process was handling is forgotten; the
+values the command line options would have set are put in place, root
+privilege is given up for the reception, and the message is read. Delivery is
+then done in a further process, after a re-exec if privilege is needed.
+
+Arguments:
+  fd                      the reading end of the pipe
+  sender_authentication   authenticated sender address or NULL
+
+Returns:      does not return
+*/
+
+static void
+child_receive(int fd, uschar * sender_authentication)
+{
+uschar * reference = mac_ismsgid(message_id_option + 2)
+  ? string_copy(message_id_option + 2) : NULL;
+struct passwd * pw;
+pid_t pid;
+
+if (!(child_in = fdopen(fd, "rb"))) _exit(EXIT_FAILURE);
+if (deliver_datafile >= 0) (void)close(deliver_datafile);
+deliver_datafile = -1;
+
+spool_clear_header_globals();
+deliver_set_expansions(NULL);
+recipients_count = recipients_list_max = 0;
+message_id[0] = 0;
+return_path = sender_address_unrewritten = NULL;
+callout_address = sending_ip_address = NULL;
+dnslist_domain = dnslist_matched = NULL;
+for(int i = 0; i < REGEX_VARS; i++) regex_vars[i] = NULL;
+#ifdef WITH_CONTENT_SCAN
+malware_name = NULL;
+#endif
+
+smtp_input = smtp_batched_input = FALSE;
+receive_getc = child_in_getc;
+receive_getbuf = NULL;
+receive_ungetc = child_in_ungetc;
+receive_feof = child_in_feof;
+receive_ferror = child_in_ferror;
+
+continue_hostname = continue_host_address = continue_transport = NULL;
+continue_sequence = 1;
+f.continue_more = FALSE;
+f.queue_running = FALSE;
+queue_run_pid = (pid_t)0;
+f.deliver_force = f.deliver_force_thaw = FALSE;
+f.queue_only_policy = f.submission_mode = f.suppress_local_fixups = FALSE;
+
+originator_uid = getuid();
+originator_gid = getgid();
+originator_login = (pw = getpwuid(originator_uid))
+  ? string_copy(US pw->pw_name) : string_sprintf("%ld", (long)originator_uid);
+sender_ident = originator_login;
+f.trusted_caller = TRUE;
+f.active_local_sender_retain = local_sender_retain;
+f.active_local_from_check = local_from_check;
+
+sender_address = raw_sender = string_copy(US"");
+f.sender_address_forced = TRUE;
+authenticated_sender = sender_authentication;
+received_protocol = US"local";
+message_reference = reference;
+f.local_error_message = TRUE;
+error_handling = ERRORS_SENDER;
+f.dot_ends = FALSE;
+
+/* In the test harness the bounce must be fully delivered before returning,
+as the -odi option gives the re-executed process. */
+
+if (f.running_in_test_harness) f.synchronous_delivery = TRUE;
+
+if (geteuid() == root_uid)
+  exim_setugid(exim_uid, exim_gid, TRUE, US"privilege not needed");
+set_process_info("accepting a local non-SMTP message from <>");
+
+if (acl_not_smtp_start)
+  {
+  uschar * user_msg, * log_msg;
+  f.enable_dollar_recipients = TRUE;
+  (void)acl_check(ACL_WHERE_NOTSMTP_START, NULL, acl_not_smtp_start,
+    &user_msg, &log_msg);
+  f.enable_dollar_recipients = FALSE;
+  }
+
+message_ended = END_NOTENDED;
+(void) receive_msg(TRUE);
+if (!message_id[0]) exim_underbar_exit(EXIT_FAILURE);
+
+if (queue_only_load >= 0 && (load_average = OS_GETLOADAVG()) > queue_only_load)
+  log_write(L_delay_delivery, LOG_MAIN, "no immediate delivery: load average "
+    "%.2f", (double)load_average/1000.0);
+
+else if (!queue_only && !f.queue_only_policy && !f.deliver_freeze)
+  {
+  search_tidyup();
+  if ((pid = exim_fork(US"local-accept-delivery")) == 0)
+    {
+    (void)setsid();
+    if (geteuid() != root_uid && !deliver_drop_privilege)
+      delivery_re_exec(CEE_EXEC_EXIT);
+    (void)deliver_message(message_id, FALSE, FALSE);
+    search_tidyup();
+    exim_underbar_exit(EXIT_SUCCESS);
+    }
+  if (pid < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "failed to fork automatic delivery "
+      "process: %s", strerror(errno));
+  else if (f.synchronous_delivery)
+    (void)waitpid(pid, NULL, 0);
+  }
+
+exim_underbar_exit(EXIT_SUCCESS);
+}
+
+
+
 /* This is a more complicated function for creating a child Exim process, with
 more arguments.
 
@@ -222,14 +376,17 @@ child_open_exim2_function(int * fdptr, uschar * sender,
 int pfd[2];
 int save_errno;
 pid_t pid;
+BOOL in_process = child_receive_ok(sender);
 
 /* Create the pipe and fork the process. Ensure that SIGCHLD is set to
 SIG_DFL before forking, so that the child process can be waited for. We
 sometimes get here with it set otherwise. Save the old state for resetting
-on the wait. */
+on the wait. A child that receives the message in-process must not share
+lookup connections with this process, so they are closed first. */
 
 if (pipe(pfd) != 0) return (pid_t)(-1);
 oldsignal = signal(SIGCHLD, SIG_DFL);
+if (in_process) search_tidyup();
 pid = exim_fork(purpose);
 
 /* Child process: make the reading end of the pipe into the standard input and
@@ -241,6 +398,12 @@ occur. */
 
 if (pid == 0)
   {
+  if (in_process)
+    {
+    (void)close(pfd[pipe_write]);
+    child_receive(pfd[pipe_read], sender_authentication);
+    /* Control does not return here. */
+    }
   force_fd(pfd[pipe_read], 0);
   (void)close(pfd[pipe_write]);
   if (debug_fd > 0) force_fd(debug_fd, 2);
@@ -293,6 +456,100 @@ return (pid_t)(-1);
 
 
 
+/*************************************************
+*      Create a child process with vfork()       *
+*************************************************/
+
+/* When no change of uid or gid is wanted, child_open_uid() creates the child
+with vfork(). The process that runs a pipe transport or a transport filter
+may have a large amount of store mapped, and with vfork() none of its page
+tables have to be copied just to be discarded by the exec.
+
+The child shares the parent's memory until it execs, so it does nothing but
+system calls on its own state. Signals are blocked across the vfork(), and the
+child resets any handlers before unblocking them, so that no handler can run
+in the shared memory. A failure in the child is recorded for the parent, which
+is suspended until the child has exec'd or exited, to report. The uid and gid
+cases still use fork(), because setuid() in the C library may have to act on
+every thread of the process, and in a vfork() child those are the parent's.
+
+Arguments:    as for child_open_uid(), with the two pairs of pipes
+
+Returns:      the pid of the created process or -1 if the vfork() failed
+*/
+
+static const char * volatile vfork_fail = NULL;
+static volatile int vfork_errno;
+
+static pid_t
+child_vfork(const uschar ** argv, const uschar ** envp, int newumask,
+  int * inpfd, int * outpfd, uschar * wd, BOOL make_leader,
+  const uschar * purpose)
+{
+sigset_t all, old;
+pid_t pid;
+
+DEBUG(D_any) debug_printf("%s vforking for %s\n", process_purpose, purpose);
+mainlog_flush();
+vfork_fail = NULL;
+sigfillset(&all);
+(void)sigprocmask(SIG_SETMASK, &all, &old);
+
+if ((pid = vfork()) == 0)
+  {
+  for (int sig = 1; sig < NSIG; sig++)
+    {
+    struct sigaction act;
+    if (  sigaction(sig, NULL, &act) == 0
+       && act.sa_handler != SIG_IGN && act.sa_handler != SIG_DFL)
+      {
+      act.sa_handler = SIG_DFL;
+      (void)sigaction(sig, &act, NULL);
+      }
+    }
+  signal(SIGUSR1, SIG_IGN);
+  signal(SIGPIPE, SIG_DFL);
+
+  (void)umask(newumask);
+  if (wd && Uchdir(wd) < 0)
+    { vfork_fail = "chdir"; goto CHILD_FAILED; }
+  if (make_leader && setpgid(0,0) < 0)
+    { vfork_fail = "set group leader"; goto CHILD_FAILED; }
+
+  (void)close(inpfd[pipe_write]);
+  force_fd(inpfd[pipe_read], 0);
+  (void)close(outpfd[pipe_read]);
+  force_fd(outpfd[pipe_write], 1);
+  (void)close(2);
+  (void)dup2(1, 2);
+
+  (void)sigprocmask(SIG_SETMASK, &old, NULL);
+  if (envp) execve(CS argv[0], (char *const *)argv, (char *const *)envp);
+  else execv(CS argv[0], (char *const *)argv);
+  vfork_fail = "exec";
+
+  CHILD_FAILED:
+  vfork_errno = errno;
+  _exit(EX_EXECFAILED);      /* Note: must be _exit(), NOT exit() */
+  }
+
+(void)sigprocmask(SIG_SETMASK, &old, NULL);
+if (pid > 0)
+  {
+  testharness_pause_ms(100);
+  DEBUG(D_any)
+    {
+    debug_printf("%s vforked for %s: %d\n", process_purpose, purpose, (int)pid);
+    if (vfork_fail)
+      debug_printf("failed to %s in subprocess: %s\n", vfork_fail,
+        strerror(vfork_errno));
+    }
+  }
+return pid;
+}
+
+
+
 /*************************************************
 *         Create a non-Exim child process        *
 *************************************************/
@@ -348,7 +605,9 @@ that the child process can be waited for. We sometimes get here with it set
 otherwise. Save the old state for resetting on the wait. */
 
 oldsignal = signal(SIGCHLD, SIG_DFL);
-pid = exim_fork(purpose);
+pid = newuid || newgid
+  ? exim_fork(purpose)
+  : child_vfork(argv, envp, newumask, inpfd, outpfd, wd, make_leader, purpose);
 
 /* Handle the child process. First, set the required environment. We must do
 this before messing with the pipes, in order to be able to write debugging
@@ -16,13 +16,49 @@
 
 typedef struct smtp_slot {
   pid_t pid;                       /* pid of the spawned reception process */
-  uschar *host_address;            /* address of the client host */
+  struct conn_count *host;         /* count for the client host */
+  struct conn_count *net;          /* count for the client's network */
+  int next;                        /* next slot on the pid or free chain */
 } smtp_slot;
 
-/* An empty slot for initializing (Standard C does not allow constructor
-expressions in assignments except as initializers in declarations). */
+/* Structure for the count of live connections from a host or network. These
+are chained from a hash table, and freed when the count drops to zero. */
 
-static smtp_slot empty_smtp_slot = { .pid = 0, .host_address = NULL };
+typedef struct conn_count {
+  struct conn_count *next;         /* next in hash chain */
+  int count;                       /* connections referring to this */
+  uschar key[1];                   /* host address or network key */
+} conn_count;
+
+/* Structure for a persistent queue runner, as seen by the daemon */
+
+typedef struct qrunner {
+  pid_t  pid;                      /* the process */
+  int    fd;                       /* the daemon's end of its socketpair */
+  BOOL   busy;                     /* doing a queue run */
+} qrunner;
+
+/* Structure for a connection that the daemon is holding while a delay in its
+connect ACL runs out; see daemon_park_connection(). */
+
+typedef struct parked_conn {
+  int    fd;                       /* the connection */
+  BOOL   watch;                    /* wait for the client to close it */
+  int    served;                   /* delay to credit when it is resumed */
+  struct timeval due;              /* when to resume it */
+  uschar host_address[46];         /* address of the client host */
+} parked_conn;
+
+/* Structure for each worker of the prefork pool. The vector of these lives in
+a shared anonymous mapping, so that each worker can record the connection it is
+handling and see those of its siblings, for the connection-count limits. */
+
+typedef struct prefork_slot {
+  pid_t  pid;                      /* pid of the worker process */
+  time_t started;                  /* when it was forked */
+  BOOL   busy;                     /* handling a connection */
+  uschar host_address[46];         /* address of the client host, when busy */
+} prefork_slot;
 
 
 
@@ -38,12 +74,68 @@ static int   accept_retry_count = 0;
 static int   accept_retry_errno;
 static BOOL  accept_retry_select_failed;
 
+static int   daemon_wake_pipe[2] = { -1, -1 };	/* Written by signal handlers */
+
+#define DAEMON_ACCEPT_BATCH 16	/* Connections per socket per wakeup */
+
 static int   queue_run_count = 0;
 static pid_t *queue_pid_slots = NULL;
 static smtp_slot *smtp_slots = NULL;
+static int  *smtp_slot_pids;		/* Pid hash: heads of slot chains */
+static unsigned smtp_slot_mask;
+static int   smtp_slot_free;		/* Head of the unused slot chain */
+static conn_count **conn_counts = NULL;	/* Per-host and per-network counts */
+static unsigned conn_count_mask;
+
+static parked_conn *parked_conns = NULL;
+static int   parked_count = 0;
+
+static qrunner *qrunners = NULL;
+static time_t qrunner_spawned = 0;
 
 static BOOL  write_pid = TRUE;
 
+static prefork_slot *prefork_slots = NULL;
+static int   prefork_slot_self = -1;	/* Our slot, when a prefork worker */
+static int  *prefork_listen_sockets;
+static int   prefork_listen_socket_count;
+static SIGNAL_BOOL prefork_sighup_seen;
+
+static pid_t *lookup_proxy_pids = NULL;
+static int    lookup_proxy_fd = -1;
+static uschar *lookup_proxy_path = NULL;
+static time_t lookup_proxy_spawned = 0;
+
+static pid_t  conn_cache_pid = 0;
+static int    conn_cache_fd = -1;
+static uschar *conn_cache_path = NULL;
+static time_t conn_cache_spawned = 0;
+
+static pid_t  delivery_helper_pid = 0;
+static int    delivery_helper_fd = -1;
+
+/* For the metrics request on the notifier socket. The accept counts live in a
+shared anonymous mapping, so that prefork workers can add to them. */
+
+static time_t daemon_started = 0;
+static unsigned long *listen_accepts = NULL;
+static uschar **listen_labels = NULL;
+static int    listen_metrics_count = 0;
+static unsigned long notify_counts[NOTIFY_TYPE_COUNT];
+static unsigned long deliveries_started = 0;
+static unsigned long deliveries_done = 0;
+
+/* Current activity counts, written by the daemon in a shared anonymous
+mapping so that its children see them as they change. They are indexed by the
+DCOUNT_* values. */
+
+static int   *daemon_counts = NULL;
+
+#if !defined(DISABLE_TLS) && !defined(DISABLE_OCSP)
+static time_t ocsp_refresh_checked = 0;
+static time_t ocsp_refresh_started = 0;
+#endif
+
 
 
 /*************************************************
@@ -56,11 +148,41 @@ Argument: the signal number
 Returns:  nothing
 */
 
+static void daemon_wake(void);
+static BOOL qrunner_ended(pid_t);
+
 static void
 sighup_handler(int sig)
 {
 sighup_seen = TRUE;
 signal(SIGHUP, sighup_handler);
+daemon_wake();
+}
+
+
+
+/*************************************************
+*       SIGHUP Handler for prefork workers       *
+*************************************************/
+
+/* The daemon sends this when it is restarting or stopping. Close the
+listening sockets at once, so that a new daemon can bind them, and set a flag
+so that the worker exits once any connection in progress is finished.
+
+Argument: the signal number
+Returns:  nothing
+*/
+
+static void
+prefork_sighup_handler(int sig)
+{
+prefork_sighup_seen = TRUE;
+for (int i = 0; i < prefork_listen_socket_count; i++)
+  if (prefork_listen_sockets[i] >= 0)
+    {
+    (void) close(prefork_listen_sockets[i]);
+    prefork_listen_sockets[i] = -1;
+    }
 }
 
 
@@ -84,6 +206,7 @@ main_sigchld_handler(int sig)
 {
 os_non_restarting_signal(SIGCHLD, SIG_DFL);
 sigchld_seen = TRUE;
+daemon_wake();
 }
 
 
@@ -94,6 +217,7 @@ static void
 main_sigterm_handler(int sig)
 {
 sigterm_seen = TRUE;
+daemon_wake();
 }
 
 
@@ -133,782 +257,2479 @@ close_daemon_sockets(int daemon_notifier_fd,
   int * listen_sockets, int listen_socket_count)
 {
 if (daemon_notifier_fd >= 0) (void) close(daemon_notifier_fd);
+if (lookup_proxy_fd >= 0) (void) close(lookup_proxy_fd);
+if (conn_cache_fd >= 0) (void) close(conn_cache_fd);
 for (int i = 0; i < listen_socket_count; i++) (void) close(listen_sockets[i]);
+for (int i = 0; i < parked_count; i++) (void) close(parked_conns[i].fd);
+if (qrunners) for (int i = 0; i < queue_run_persistent; i++)
+  if (qrunners[i].fd >= 0) (void) close(qrunners[i].fd);
+for (int i = 0; i < 2; i++) if (daemon_wake_pipe[i] >= 0)
+  {
+  (void) close(daemon_wake_pipe[i]);
+  daemon_wake_pipe[i] = -1;
+  }
 }
 
 
+
 /*************************************************
-*            Handle a connected SMTP call        *
+*          Wake the daemon's main loop           *
 *************************************************/
 
-/* This function is called when an SMTP connection has been accepted.
-If there are too many, give an error message and close down. Otherwise
-spin off a sub-process to handle the call. The list of listening sockets
-is required so that they can be closed in the sub-process. Take care not to
-leak store in this process - reset the stacking pool at the end.
-
-Arguments:
-  listen_sockets        sockets which are listening for incoming calls
-  listen_socket_count   count of listening sockets
-  accept_socket         socket of the current accepted call
-  accepted              socket information about the current call
-
-Returns:            nothing
-*/
+/* Called from the daemon's signal handlers. A signal that arrives after the
+main loop has checked its flags, but before it waits, would otherwise not be
+noticed until something else woke it; the byte in the pipe ends the wait
+straight away. */
 
 static void
-handle_smtp_call(int *listen_sockets, int listen_socket_count,
-  int accept_socket, struct sockaddr *accepted)
+daemon_wake(void)
 {
-pid_t pid;
-union sockaddr_46 interface_sockaddr;
-EXIM_SOCKLEN_T ifsize = sizeof(interface_sockaddr);
-int dup_accept_socket = -1;
-int max_for_this_host = 0;
-int save_log_selector = *log_selector;
-gstring * whofrom;
+if (daemon_wake_pipe[1] >= 0)
+  {
+  int save_errno = errno;
+  (void) write(daemon_wake_pipe[1], "", 1);
+  errno = save_errno;
+  }
+}
 
-rmark reset_point = store_mark();
 
-/* Make the address available in ASCII representation, and also fish out
-the remote port. */
 
-sender_host_address = host_ntoa(-1, accepted, NULL, &sender_host_port);
-DEBUG(D_any) debug_printf("Connection request from %s port %d\n",
-  sender_host_address, sender_host_port);
+/*************************************************
+*     Wait for some descriptors to be readable   *
+*************************************************/
 
-/* Set up the output stream, check the socket has duplicated, and set up the
-input stream. These operations fail only the exceptional circumstances. Note
-that never_error() won't use smtp_out if it is NULL. */
+/* This is used by the daemon and the prefork workers to wait for connections
+and notifications. Where poll() is available it is used instead of select(),
+so that the cost does not grow with the highest descriptor number and there is
+no limit from the size of an fd_set. Negative descriptors are ignored.
 
-if (!(smtp_out = fdopen(accept_socket, "wb")))
-  {
-  never_error(US"daemon: fdopen() for smtp_out failed", US"", errno);
-  goto ERROR_RETURN;
-  }
+Arguments:
+  fds        the descriptors
+  ready      set TRUE for each one that is readable (or has an error)
+  nfds       the number of descriptors
+  timeout    the longest wait, in milliseconds, or -1 for no limit
 
-if ((dup_accept_socket = dup(accept_socket)) < 0)
+Returns:     the poll() or select() result: the number ready, 0 on timeout,
+             or -1 with errno set
+*/
+
+static int
+daemon_wait(const int * fds, BOOL * ready, int nfds, int timeout)
+{
+int rc;
+#ifndef NO_POLL_H
+static struct pollfd * pfds = NULL;
+static int pfds_size = 0;
+
+if (nfds > pfds_size)
   {
-  never_error(US"daemon: couldn't dup socket descriptor",
-    US"Connection setup failed", errno);
-  goto ERROR_RETURN;
+  if (pfds) store_free(pfds);
+  pfds = store_malloc((pfds_size = nfds) * sizeof(struct pollfd));
   }
-
-if (!(smtp_in = fdopen(dup_accept_socket, "rb")))
+for (int i = 0; i < nfds; i++)
   {
-  never_error(US"daemon: fdopen() for smtp_in failed",
-    US"Connection setup failed", errno);
-  goto ERROR_RETURN;
+  pfds[i].fd = fds[i];
+  pfds[i].events = POLLIN;
+  pfds[i].revents = 0;
   }
+rc = poll(pfds, nfds, timeout);
+for (int i = 0; i < nfds; i++) ready[i] = rc > 0 && pfds[i].revents != 0;
 
-/* Get the data for the local interface address. Panic for most errors, but
-"connection reset by peer" just means the connection went away. */
+#else
+fd_set select_fds;
+struct timeval tv = { .tv_sec = timeout/1000, .tv_usec = (timeout%1000)*1000 };
+int max_fd = -1;
 
-if (getsockname(accept_socket, (struct sockaddr *)(&interface_sockaddr),
-     &ifsize) < 0)
+FD_ZERO(&select_fds);
+for (int i = 0; i < nfds; i++) if (fds[i] >= 0)
   {
-  log_write(0, LOG_MAIN | ((errno == ECONNRESET)? 0 : LOG_PANIC),
-    "getsockname() failed: %s", strerror(errno));
-  smtp_printf("421 Local problem: getsockname() failed; please try again later\r\n", FALSE);
-  goto ERROR_RETURN;
+  FD_SET(fds[i], &select_fds);
+  if (fds[i] > max_fd) max_fd = fds[i];
   }
+rc = select(max_fd + 1, (SELECT_ARG2_TYPE *)&select_fds, NULL, NULL,
+  timeout < 0 ? NULL : &tv);
+for (int i = 0; i < nfds; i++)
+  ready[i] = rc > 0 && fds[i] >= 0 && FD_ISSET(fds[i], &select_fds);
+#endif
+return rc;
+}
 
-interface_address = host_ntoa(-1, &interface_sockaddr, NULL, &interface_port);
-DEBUG(D_interface) debug_printf("interface address=%s port=%d\n",
-  interface_address, interface_port);
-
-/* Build a string identifying the remote host and, if requested, the port and
-the local interface data. This is for logging; at the end of this function the
-memory is reclaimed. */
-
-whofrom = string_append(NULL, 3, "[", sender_host_address, "]");
 
-if (LOGGING(incoming_port))
-  whofrom = string_fmt_append(whofrom, ":%d", sender_host_port);
 
-if (LOGGING(incoming_interface))
-  whofrom = string_fmt_append(whofrom, " I=[%s]:%d",
-    interface_address, interface_port);
+/*************************************************
+*        Record a wait or accept result          *
+*************************************************/
 
-(void) string_from_gstring(whofrom);    /* Terminate the newly-built string */
+/* If waiting or accept() fails and this was not caused by an interruption,
+log the incident and try again. With asymmetric TCP/IP routing errors such as
+"No route to network" have been seen here. Also "connection reset by peer" has
+been seen. These cannot be classed as disastrous errors, but they could fill up
+a lot of log. The code in smail crashes the daemon after 10 successive failures
+of accept, on the grounds that some OS fail continuously. Exim originally
+followed suit, but this appears to have caused problems. Now it just keeps
+going, but instead of logging each error, it batches them up when they are
+continuous.
 
-/* Check maximum number of connections. We do not check for reserved
-connections or unacceptable hosts here. That is done in the subprocess because
-it might take some time. */
+Arguments:
+  err            the errno value
+  select_failed  TRUE if it was the wait that failed; FALSE for accept()
+*/
 
-if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
+static void
+accept_failed(int err, BOOL select_failed)
+{
+if (accept_retry_count == 0)
   {
-  DEBUG(D_any) debug_printf("rejecting SMTP connection: count=%d max=%d\n",
-    smtp_accept_count, smtp_accept_max);
-  smtp_printf("421 Too many concurrent SMTP connections; "
-    "please try again later.\r\n", FALSE);
-  log_write(L_connection_reject,
-            LOG_MAIN, "Connection from %s refused: too many connections",
-    whofrom->s);
-  goto ERROR_RETURN;
+  accept_retry_errno = err;
+  accept_retry_select_failed = select_failed;
   }
-
-/* If a load limit above which only reserved hosts are acceptable is defined,
-get the load average here, and if there are in fact no reserved hosts, do
-the test right away (saves a fork). If there are hosts, do the check in the
-subprocess because it might take time. */
-
-if (smtp_load_reserve >= 0)
+else if (  err != accept_retry_errno
+	|| select_failed != accept_retry_select_failed
+	|| accept_retry_count >= 50)
   {
-  load_average = OS_GETLOADAVG();
-  if (smtp_reserve_hosts == NULL && load_average > smtp_load_reserve)
-    {
-    DEBUG(D_any) debug_printf("rejecting SMTP connection: load average = %.2f\n",
-      (double)load_average/1000.0);
-    smtp_printf("421 Too much load; please try again later.\r\n", FALSE);
-    log_write(L_connection_reject,
-              LOG_MAIN, "Connection from %s refused: load average = %.2f",
-      whofrom->s, (double)load_average/1000.0);
-    goto ERROR_RETURN;
-    }
+  log_write(0, LOG_MAIN | ((accept_retry_count >= 50)? LOG_PANIC : 0),
+    "%d %s() failure%s: %s",
+    accept_retry_count,
+    accept_retry_select_failed? "select" : "accept",
+    (accept_retry_count == 1)? "" : "s",
+    strerror(accept_retry_errno));
+  log_close_all();
+  accept_retry_count = 0;
+  accept_retry_errno = err;
+  accept_retry_select_failed = select_failed;
   }
+accept_retry_count++;
+}
 
-/* Check that one specific host (strictly, IP address) is not hogging
-resources. This is done here to prevent a denial of service attack by someone
-forcing you to fork lots of times before denying service. The value of
-smtp_accept_max_per_host is a string which is expanded. This makes it possible
-to provide host-specific limits according to $sender_host address, but because
-this is in the daemon mainline, only fast expansions (such as inline address
-checks) should be used. The documentation is full of warnings. */
 
-if (smtp_accept_max_per_host)
+/* A connection has been accepted: report any run of failures before it. */
+
+static void
+accept_succeeded(void)
+{
+if (accept_retry_count > 0)
   {
-  uschar *expanded = expand_string(smtp_accept_max_per_host);
-  if (!expanded)
-    {
-    if (!f.expand_string_forcedfail)
-      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
-        "failed for %s: %s", whofrom->s, expand_string_message);
-    }
-  /* For speed, interpret a decimal number inline here */
-  else
-    {
-    uschar *s = expanded;
-    while (isdigit(*s))
-      max_for_this_host = max_for_this_host * 10 + *s++ - '0';
-    if (*s)
-      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
-        "for %s contains non-digit: %s", whofrom->s, expanded);
-    }
+  log_write(0, LOG_MAIN, "%d %s() failure%s: %s",
+    accept_retry_count,
+    accept_retry_select_failed? "select" : "accept",
+    (accept_retry_count == 1)? "" : "s",
+    strerror(accept_retry_errno));
+  log_close_all();
+  accept_retry_count = 0;
   }
+}
 
-/* If we have fewer connections than max_for_this_host, we can skip the tedious
-per host_address checks. Note that at this stage smtp_accept_count contains the
-count of *other* connections, not including this one. */
 
-if (max_for_this_host > 0 && smtp_accept_count >= max_for_this_host)
-  {
-  int host_accept_count = 0;
-  int other_host_count = 0;    /* keep a count of non matches to optimise */
+/*************************************************
+*       Count busy prefork worker slots          *
+*************************************************/
 
-  for (int i = 0; i < smtp_accept_max; ++i)
-    if (smtp_slots[i].host_address)
-      {
-      if (Ustrcmp(sender_host_address, smtp_slots[i].host_address) == 0)
-       host_accept_count++;
-      else
-       other_host_count++;
+/* Count the other workers of the prefork pool that are handling a
+connection, optionally only those from a given host.
 
-      /* Testing all these strings is expensive - see if we can drop out
-      early, either by hitting the target, or finding there are not enough
-      connections left to make the target. */
+Argument:   host address to match, or NULL for all
+Returns:    count of busy sibling workers
+*/
 
-      if (  host_accept_count >= max_for_this_host
-         || smtp_accept_count - other_host_count < max_for_this_host)
-       break;
-      }
+static int
+prefork_busy_count(const uschar * host_address)
+{
+int count = 0;
+for (int i = 0; i < daemon_prefork_workers; i++)
+  if (  i != prefork_slot_self && prefork_slots[i].busy
+     && (!host_address
+        || Ustrcmp(host_address, prefork_slots[i].host_address) == 0)
+     )
+    count++;
+return count;
+}
 
-  if (host_accept_count >= max_for_this_host)
-    {
-    DEBUG(D_any) debug_printf("rejecting SMTP connection: too many from this "
-      "IP address: count=%d max=%d\n",
-      host_accept_count, max_for_this_host);
-    smtp_printf("421 Too many concurrent SMTP connections "
-      "from this IP address; please try again later.\r\n", FALSE);
-    log_write(L_connection_reject,
-              LOG_MAIN, "Connection from %s refused: too many connections "
-      "from that IP address", whofrom->s);
-    search_tidyup();
-    goto ERROR_RETURN;
-    }
-  }
 
-/* OK, the connection count checks have been passed. Before we can fork the
-accepting process, we must first log the connection if requested. This logging
-used to happen in the subprocess, but doing that means that the value of
-smtp_accept_count can be out of step by the time it is logged. So we have to do
-the logging here and accept the performance cost. Note that smtp_accept_count
-hasn't yet been incremented to take account of this connection.
 
-In order to minimize the cost (because this is going to happen for every
-connection), do a preliminary selector test here. This saves ploughing through
-the generalized logging code each time when the selector is false. If the
-selector is set, check whether the host is on the list for logging. If not,
-arrange to unset the selector in the subprocess. */
+/*************************************************
+*       Per-host and per-network counts          *
+*************************************************/
 
-if (LOGGING(smtp_connection))
-  {
-  uschar *list = hosts_connection_nolog;
-  memset(sender_host_cache, 0, sizeof(sender_host_cache));
-  if (list != NULL && verify_check_host(&list) == OK)
-    save_log_selector &= ~L_smtp_connection;
-  else
-    log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from %s "
-      "(TCP/IP connection count = %d)", whofrom->s, smtp_accept_count + 1);
-  }
+/* The daemon keeps a count of its live accepting processes for each client
+host and for each client network, so that neither the per-host limit nor the
+ACL variables need a scan of all the connections. The counts are held in a
+chained hash table keyed by the host address, or by a "/"-prefixed encoding of
+the masked network address (a /24 for IPv4, a /64 for IPv6). Each busy slot
+refers to its two entries, and the busy slots are chained from a hash on the
+pid so that a terminated process can be found directly. */
 
-/* Now we can fork the accepting process; do a lookup tidy, just in case any
-expansion above did a lookup. */
+#define CONN_NET_MASK_V4  24
+#define CONN_NET_MASK_V6  64
+#define CONN_NET_KEYLEN   18		/* "/" + 16 hex digits + NUL */
 
-search_tidyup();
-pid = exim_fork(US"daemon-accept");
+static unsigned
+conn_hash(const uschar * key)
+{
+unsigned h = 2166136261u;				/* FNV-1a */
+while (*key) h = (h ^ *key++) * 16777619u;
+return h;
+}
 
-/* Handle the child process */
+/* Build the network key for an address into a buffer of CONN_NET_KEYLEN. */
 
-if (pid == 0)
-  {
-  int queue_only_reason = 0;
-  int old_pool = store_pool;
-  int save_debug_selector = debug_selector;
-  BOOL local_queue_only;
-  BOOL session_local_queue_only;
-  #ifdef SA_NOCLDWAIT
-  struct sigaction act;
-  #endif
+static void
+conn_network_key(const uschar * address, uschar * buf)
+{
+int bin[4];
+int count = host_aton(address, bin);
 
-  smtp_accept_count++;    /* So that it includes this process */
+host_mask(count, bin, count == 1 ? CONN_NET_MASK_V4 : CONN_NET_MASK_V6);
+if (count == 1)
+  sprintf(CS buf, "/%08x", (unsigned)bin[0]);
+else
+  sprintf(CS buf, "/%08x%08x", (unsigned)bin[0], (unsigned)bin[1]);
+}
 
-  /* May have been modified for the subprocess */
+/* Find the count for a key, optionally creating a zero one.
+Returns NULL if not present and not created. */
 
-  *log_selector = save_log_selector;
+static conn_count *
+conn_count_find(const uschar * key, BOOL create)
+{
+conn_count ** chain = &conn_counts[conn_hash(key) & conn_count_mask];
+conn_count * c;
+int len;
 
-  /* Get the local interface address into permanent store */
+for (c = *chain; c; c = c->next)
+  if (Ustrcmp(c->key, key) == 0) return c;
+if (!create) return NULL;
+
+len = Ustrlen(key);
+c = store_malloc(sizeof(conn_count) + len);
+memcpy(c->key, key, len + 1);
+c->count = 0;
+c->next = *chain;
+*chain = c;
+return c;
+}
 
-  store_pool = POOL_PERM;
-  interface_address = string_copy(interface_address);
-  store_pool = old_pool;
+static int
+conn_count_get(const uschar * key)
+{
+conn_count * c = conn_counts ? conn_count_find(key, FALSE) : NULL;
+return c ? c->count : 0;
+}
 
-  /* Check for a tls-on-connect port */
+/* Drop one reference to a count, freeing it when unused. */
 
-  if (host_is_tls_on_connect_port(interface_port)) tls_in.on_connect = TRUE;
+static void
+conn_count_release(conn_count * c)
+{
+if (--c->count > 0) return;
+for (conn_count ** p = &conn_counts[conn_hash(c->key) & conn_count_mask];
+     *p; p = &(*p)->next)
+  if (*p == c)
+    {
+    *p = c->next;
+    store_free(c);
+    return;
+    }
+}
 
-  /* Expand smtp_active_hostname if required. We do not do this any earlier,
-  because it may depend on the local interface address (indeed, that is most
-  likely what it depends on.) */
+/* Count the busy sibling workers of the prefork pool whose clients are on a
+given network. */
 
-  smtp_active_hostname = primary_hostname;
-  if (raw_active_hostname)
+static int
+prefork_network_count(const uschar * netkey)
+{
+int count = 0;
+for (int i = 0; i < daemon_prefork_workers; i++)
+  if (i != prefork_slot_self && prefork_slots[i].busy)
     {
-    uschar * nah = expand_string(raw_active_hostname);
-    if (!nah)
+    uschar buf[CONN_NET_KEYLEN];
+    conn_network_key(prefork_slots[i].host_address, buf);
+    if (Ustrcmp(buf, netkey) == 0) count++;
+    }
+return count;
+}
+
+
+
+/*************************************************
+*        Manage the accepting process slots      *
+*************************************************/
+
+/* Get the slots for smtp_accept_max processes, all on the free chain, and
+the hash tables that index them. */
+
+static void
+smtp_slots_init(void)
+{
+unsigned size = 16;
+
+while (size < (unsigned)smtp_accept_max) size <<= 1;
+smtp_slot_mask = size - 1;
+conn_count_mask = 2*size - 1;		/* a host and a network per slot */
+
+smtp_slots = store_get(smtp_accept_max * sizeof(smtp_slot), FALSE);
+smtp_slot_pids = store_get(size * sizeof(int), FALSE);
+conn_counts = store_get(2*size * sizeof(conn_count *), FALSE);
+
+for (int i = 0; i < smtp_accept_max; i++)
+  smtp_slots[i] = (smtp_slot) { .pid = 0, .next = i + 1 };
+smtp_slots[smtp_accept_max - 1].next = -1;
+smtp_slot_free = 0;
+for (unsigned i = 0; i < size; i++) smtp_slot_pids[i] = -1;
+memset(conn_counts, 0, 2*size * sizeof(conn_count *));
+}
+
+/* Record a new accepting process. Returns FALSE if there is no free slot
+(which the smtp_accept_max check should prevent). */
+
+static BOOL
+smtp_slot_add(pid_t pid, const uschar * host_address, const uschar * netkey)
+{
+int i = smtp_slot_free, * chain;
+smtp_slot * sl;
+
+if (i < 0) return FALSE;
+sl = &smtp_slots[i];
+smtp_slot_free = sl->next;
+
+chain = &smtp_slot_pids[(unsigned)pid & smtp_slot_mask];
+sl->pid = pid;
+sl->next = *chain;
+*chain = i;
+
+/* Connection closes come asyncronously, so we cannot stack this store */
+
+if (host_address)
+  {
+  (sl->host = conn_count_find(host_address, TRUE))->count++;
+  (sl->net = conn_count_find(netkey, TRUE))->count++;
+  }
+else
+  sl->host = sl->net = NULL;
+return TRUE;
+}
+
+/* Forget a terminated accepting process. Returns FALSE if the pid was not
+that of an accepting process. */
+
+static BOOL
+smtp_slot_remove(pid_t pid)
+{
+for (int * p = &smtp_slot_pids[(unsigned)pid & smtp_slot_mask]; *p >= 0;
+     p = &smtp_slots[*p].next)
+  {
+  int i = *p;
+  smtp_slot * sl = &smtp_slots[i];
+
+  if (sl->pid != pid) continue;
+
+  *p = sl->next;
+  if (sl->host) conn_count_release(sl->host);
+  if (sl->net) conn_count_release(sl->net);
+  sl->pid = 0;
+  sl->host = sl->net = NULL;
+  sl->next = smtp_slot_free;
+  smtp_slot_free = i;
+  return TRUE;
+  }
+return FALSE;
+}
+
+
+/*************************************************
+*          Share the daemon's activity counts    *
+*************************************************/
+
+/* Called in the daemon whenever one of the counts may have changed.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+static void
+daemon_counts_update(void)
+{
+if (!daemon_counts) return;
+daemon_counts[DCOUNT_SMTP] = smtp_accept_count;
+daemon_counts[DCOUNT_DELIVERIES] = deliveries_started > deliveries_done
+  ? (int)(deliveries_started - deliveries_done) : 0;
+daemon_counts[DCOUNT_QUEUE_RUNNERS] = queue_run_count;
+}
+
+
+/* Return one of the daemon's activity counts, for the expansion variables and
+the gating options. The SMTP count includes connections being handled by
+prefork workers, which the daemon does not see start and finish.
+
+Argument:   a DCOUNT_* value
+Returns:    the count, or -1 when not running under a daemon
+*/
+
+int
+daemon_count(int which)
+{
+int count;
+
+if (!daemon_counts) return -1;
+count = daemon_counts[which];
+if (which == DCOUNT_SMTP && prefork_slots)
+  for (int i = 0; i < daemon_prefork_workers; i++)
+    if (prefork_slots[i].busy) count++;
+return count;
+}
+
+
+
+
+/*************************************************
+*            Root delivery helper                *
+*************************************************/
+
+/* The daemon gives up root privilege once it has set up its sockets, so a
+process that receives a message over SMTP has to re-exec Exim to deliver it,
+which means reading the configuration and initializing all over again for
+every message. When daemon_delivery_helper is set, the daemon first forks a
+helper that keeps root. Receiving processes pass it the ids of their messages
+over a socket pair inherited from the daemon, and for each one it forks a
+process that delivers the message directly, with the configuration it already
+has. If the helper cannot take a message, it is delivered by re-exec as before.
+
+A request holds the message id, a flag for -odqs, and the name of the queue.
+The socket is closed on exec, so only Exim processes running as the Exim user,
+which could in any case re-exec Exim to deliver, can make requests. The helper
+finishes when every process holding the other end has gone; after a restart of
+the daemon, that is when the last of the old receiving processes has ended.
+
+If daemon_delivery_helper_max is set, the helper keeps no more than that many
+deliveries going at once, taking no more requests while it is at the limit.
+They wait in the socket's queue meanwhile, so a burst is delivered as fast as
+the pool allows, without a process for every message. When the queue is full a
+receiving process does not wait; it leaves its message for a queue runner, as
+if the load were too high. */
+
+#define DELIVERY_HELPER_REQ_MAX	(MESSAGE_ID_LENGTH + 1 + 256)
+
+static void
+delivery_helper_serve(int fd)
+{
+uschar buf[DELIVERY_HELPER_REQ_MAX + 1];
+uschar id[MESSAGE_ID_LENGTH + 1];
+int running = 0;
+
+/* Without a limit the children need not be counted, and can be left for the
+system to reap. */
+
+signal(SIGCHLD, daemon_delivery_helper_max > 0 ? SIG_DFL : SIG_IGN);
+for (;;)
+  {
+  ssize_t n;
+  pid_t pid;
+
+  /* Reap any finished deliveries, waiting for one if at the limit */
+
+  if (daemon_delivery_helper_max > 0) for (;;)
+    {
+    pid = waitpid(-1, NULL, running >= daemon_delivery_helper_max ? 0 : WNOHANG);
+    if (pid > 0) running--;
+    else if (pid < 0 && errno == EINTR) continue;
+    else
       {
-      if (!f.expand_string_forcedfail)
-        {
-        log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand \"%s\" "
-          "(smtp_active_hostname): %s", raw_active_hostname,
-          expand_string_message);
-        smtp_printf("421 Local configuration error; "
-          "please try again later.\r\n", FALSE);
-        mac_smtp_fflush();
-        search_tidyup();
-        exim_underbar_exit(EXIT_FAILURE);
-        }
+      if (pid < 0) running = 0;		/* ECHILD */
+      break;
       }
-    else if (*nah) smtp_active_hostname = nah;
     }
 
-  /* Initialize the queueing flags */
+  if ((n = recv(fd, buf, DELIVERY_HELPER_REQ_MAX, 0)) < 0 && errno == EINTR)
+    continue;
+  if (n <= 0) break;
+  buf[n] = 0;
 
-  queue_check_only();
-  session_local_queue_only = queue_only;
+#ifndef SIG_IGN_WORKS
+  if (daemon_delivery_helper_max <= 0)
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+#endif
 
-  /* Close the listening sockets, and set the SIGCHLD handler to SIG_IGN.
-  We also attempt to set things up so that children are automatically reaped,
-  but just in case this isn't available, there's a paranoid waitpid() in the
-  loop too (except for systems where we are sure it isn't needed). See the more
-  extensive comment before the reception loop in exim.c for a fuller
-  explanation of this logic. */
+  memcpy(id, buf, MESSAGE_ID_LENGTH);
+  id[MESSAGE_ID_LENGTH] = 0;
+  if (  n <= MESSAGE_ID_LENGTH || Ustrlen(buf) != n || !mac_ismsgid(id)
+     || buf[MESSAGE_ID_LENGTH] != '0' && buf[MESSAGE_ID_LENGTH] != '1'
+     || Ustrchr(buf + MESSAGE_ID_LENGTH, '/')
+     )
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "delivery helper: bad request");
+    continue;
+    }
 
-  close_daemon_sockets(daemon_notifier_fd, listen_sockets, listen_socket_count);
+  if ((pid = exim_fork(US"helper-delivery")) == 0)
+    {
+    (void) close(fd);
+    signal(SIGCHLD, SIG_DFL);
+    f.queue_smtp = buf[MESSAGE_ID_LENGTH] == '1';
+    queue_name = string_copy(buf + MESSAGE_ID_LENGTH + 1);
+    (void) deliver_message(id, FALSE, FALSE);
+    search_tidyup();
+    exim_underbar_exit(EXIT_SUCCESS);
+    }
 
-  /* Set FD_CLOEXEC on the SMTP socket. We don't want any rogue child processes
-  to be able to communicate with them, under any circumstances. */
-  (void)fcntl(accept_socket, F_SETFD,
-              fcntl(accept_socket, F_GETFD) | FD_CLOEXEC);
-  (void)fcntl(dup_accept_socket, F_SETFD,
-              fcntl(dup_accept_socket, F_GETFD) | FD_CLOEXEC);
+  if (pid < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "delivery helper: fork failed for %s: %s",
+      id, strerror(errno));
+  else
+    {
+    running++;
+    DEBUG(D_any) debug_printf("delivery helper forked %d for %s (%d running)\n",
+      (int)pid, id, running);
+    }
+  }
 
-  #ifdef SA_NOCLDWAIT
-  act.sa_handler = SIG_IGN;
-  sigemptyset(&(act.sa_mask));
-  act.sa_flags = SA_NOCLDWAIT;
-  sigaction(SIGCHLD, &act, NULL);
-  #else
-  signal(SIGCHLD, SIG_IGN);
-  #endif
-  signal(SIGTERM, SIG_DFL);
+DEBUG(D_any) debug_printf("delivery helper: no more requests\n");
+exim_underbar_exit(EXIT_SUCCESS);
+}
 
-  /* Attempt to get an id from the sending machine via the RFC 1413
-  protocol. We do this in the sub-process in order not to hold up the
-  main process if there is any delay. Then set up the fullhost information
-  in case there is no HELO/EHLO.
 
-  If debugging is enabled only for the daemon, we must turn if off while
-  finding the id, but turn it on again afterwards so that information about the
-  incoming connection is output. */
+/* Start the helper; called while the daemon still has root privilege. */
+
+static void
+delivery_helper_start(int * listen_sockets, int listen_socket_count)
+{
+int pfd[2];
+pid_t pid;
+
+if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pfd) < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: delivery helper socketpair "
+    "failed: %s", strerror(errno));
+  return;
+  }
+(void)fcntl(pfd[0], F_SETFD, fcntl(pfd[0], F_GETFD) | FD_CLOEXEC);
+(void)fcntl(pfd[1], F_SETFD, fcntl(pfd[1], F_GETFD) | FD_CLOEXEC);
 
+if ((pid = exim_fork(US"delivery-helper")) == 0)
+  {
   if (f.debug_daemon) debug_selector = 0;
-  verify_get_ident(IDENT_PORT);
-  host_build_sender_fullhost();
-  debug_selector = save_debug_selector;
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  (void) close(pfd[1]);
+  close_daemon_sockets(daemon_notifier_fd, listen_sockets, listen_socket_count);
+  set_process_info("delivery helper");
+  delivery_helper_serve(pfd[0]);
+  /* Control never returns here. */
+  }
 
-  DEBUG(D_any)
-    debug_printf("Process %d is handling incoming connection from %s\n",
-      (int)getpid(), sender_fullhost);
+(void) close(pfd[0]);
+if (pid < 0)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of delivery helper "
+    "failed: %s", strerror(errno));
+  (void) close(pfd[1]);
+  return;
+  }
+delivery_helper_pid = pid;
+delivery_helper_fd = pfd[1];
+DEBUG(D_any) debug_printf("forked delivery helper %d\n", (int)pid);
+}
 
-  /* Now disable debugging permanently if it's required only for the daemon
-  process. */
 
-  if (f.debug_daemon) debug_selector = 0;
+/* Pass the message just received to the helper, if there is one and it would
+save a re-exec. A connection held from a callout has to be passed on by the
+re-exec, so the helper is not used then. If the helper's queue is full and
+its deliveries are limited, the message is left on the spool.
 
-  /* If there are too many child processes for immediate delivery,
-  set the session_local_queue_only flag, which is initialized from the
-  configured value and may therefore already be TRUE. Leave logging
-  till later so it will have a message id attached. Note that there is no
-  possibility of re-calculating this per-message, because the value of
-  smtp_accept_count does not change in this subprocess. */
+Returns:   TRUE if the helper has taken the message, or it has been left
+*/
 
-  if (smtp_accept_queue > 0 && smtp_accept_count > smtp_accept_queue)
+static BOOL
+delivery_helper_pass(void)
+{
+uschar * req;
+
+if (  delivery_helper_fd < 0
+   || geteuid() == root_uid || deliver_drop_privilege
+   || cutthrough.cctx.sock >= 0 && cutthrough.callout_hold_only
+   )
+  return FALSE;
+
+cancel_cutthrough_connection(TRUE, US"non-continued delivery");
+req = string_sprintf("%s%c%s", message_id, f.queue_smtp ? '1' : '0',
+  queue_name);
+if (send(delivery_helper_fd, req, Ustrlen(req), MSG_DONTWAIT) < 0)
+  {
+  DEBUG(D_any) debug_printf("delivery helper: %s\n", strerror(errno));
+  if (  daemon_delivery_helper_max > 0
+     && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
     {
-    session_local_queue_only = TRUE;
-    queue_only_reason = 1;
+    log_write(L_delay_delivery, LOG_MAIN,
+      "no immediate delivery: delivery helper busy (max %d)",
+      daemon_delivery_helper_max);
+    return TRUE;
     }
+  return FALSE;
+  }
+DEBUG(D_any) debug_printf("passed %s to delivery helper\n", message_id);
+return TRUE;
+}
 
-  /* Handle the start of the SMTP session, then loop, accepting incoming
-  messages from the SMTP connection. The end will come at the QUIT command,
-  when smtp_setup_msg() returns 0. A break in the connection causes the
-  process to die (see accept.c).
 
-  NOTE: We do *not* call smtp_log_no_mail() if smtp_start_session() fails,
-  because a log line has already been written for all its failure exists
-  (usually "connection refused: <reason>") and writing another one is
-  unnecessary clutter. */
 
-  if (!smtp_start_session())
+/*************************************************
+*        Shared table of screened addresses      *
+*************************************************/
+
+/* If smtp_screen_table_size is set, the daemon checks each connection it
+accepts against a table of blocked and allowed IP addresses, before it forks
+or does anything else for it. A blocked client is sent a 554 response and the
+connection is closed; a flood of connections from blocked hosts then costs
+little more than the accept(). The table is a file in the hints directory,
+which every Exim process maps shared. Entries are added by the "block" ACL
+control, and by the -bB command line option. An allow entry stops the address
+being blocked while it lasts.
+
+The table has a fixed number of slots, read and written as described for
+dbfn_slot_n(), so that the daemon never acts on a half-written entry. */
+
+#define SCREEN_TABLE_MAGIC	0x45534331	/* "ESC1" */
+#define SCREEN_KEY_MAX		48
+#define SCREEN_PROBES		8
+#define SCREEN_SPINS		1000
+
+typedef struct {
+  dbfn_shared_header sh;
+  volatile unsigned long rejects;	/* connections turned away */
+} screen_table_header;
+
+typedef struct {
+  dbfn_shared_slot sl;
+  time_t	expiry;
+  BOOL		allow;
+  uschar	key[SCREEN_KEY_MAX];	/* empty for an unused slot */
+} screen_table_slot;
+
+static screen_table_header * screen_table = NULL;
+static BOOL screen_table_tried = FALSE;
+
+
+/* Map the table file, creating it if necessary. The daemon does this as it
+starts, so that its children inherit the mapping.
+
+Returns:  TRUE if the table is available
+*/
+
+static BOOL
+screen_table_open(void)
+{
+if (screen_table) return TRUE;
+if (screen_table_tried || smtp_screen_table_size <= 0) return FALSE;
+screen_table_tried = TRUE;
+
+return !!(screen_table = dbfn_map_shared(US"screen", SCREEN_TABLE_MAGIC,
+  smtp_screen_table_size,
+  sizeof(screen_table_header), sizeof(screen_table_slot)));
+}
+
+
+static unsigned
+screen_table_hash(const uschar * key)
+{
+unsigned hash = 2166136261u;			/* FNV-1a */
+for ( ; *key; key++) hash = (hash ^ *key) * 16777619u;
+return hash;
+}
+
+
+/* Find a live entry for an address, without claiming its slot.
+
+Arguments:
+  address   the IP address, as text
+  now       the current time
+  allowp    where to put the type of the entry
+
+Returns:    the slot, or NULL
+*/
+
+static screen_table_slot *
+screen_table_find(const uschar * address, time_t now, BOOL * allowp)
+{
+unsigned hash = screen_table_hash(address);
+
+for (int i = 0; i < SCREEN_PROBES; i++)
+  {
+  screen_table_slot * s = dbfn_slot_n(screen_table, hash, i);
+  uint64_t seq;
+
+  if (  dbfn_slot_read_begin(&s->sl, &seq)
+     && s->sl.hash == hash && Ustrcmp(s->key, address) == 0 && s->expiry > now)
     {
-    mac_smtp_fflush();
-    search_tidyup();
-    exim_underbar_exit(EXIT_SUCCESS);
+    *allowp = s->allow;
+    if (dbfn_slot_read_end(&s->sl, seq)) return s;
+    }
+  }
+return NULL;
+}
+
+
+/* Check an accepted connection against the table. This is done in the
+daemon, or a prefork worker, for every connection, so it does nothing else. */
+
+static BOOL
+screen_table_blocked(const uschar * address)
+{
+BOOL allow;
+
+if (  !screen_table || screen_table->sh.magic != SCREEN_TABLE_MAGIC
+   || !screen_table_find(address, time(NULL), &allow) || allow)
+  return FALSE;
+(void) __sync_fetch_and_add(&screen_table->rejects, 1);
+return TRUE;
+}
+
+
+/*************************************************
+*       Add or remove a screen table entry       *
+*************************************************/
+
+/* An address that has an allow entry is not blocked; the allow entry has to
+be removed first. A new block for an address that is already blocked does not
+shorten the time.
+
+Arguments:
+  address   the IP address, as text
+  seconds   how long the entry lasts; zero or less removes any entry
+  allow     TRUE for an allow entry, FALSE for a block
+
+Returns:    OK if done, FAIL if prevented by an allow entry or a full table,
+            DEFER if the table is not available
+*/
+
+int
+daemon_screen_set(const uschar * address, int seconds, BOOL allow)
+{
+unsigned hash;
+time_t now = time(NULL), expiry = now + seconds;
+screen_table_slot * s, * old, * victim = NULL;
+BOOL old_allow;
+uint64_t seq;
+
+if (Ustrlen(address) >= SCREEN_KEY_MAX || !screen_table_open()) return DEFER;
+hash = screen_table_hash(address);
+
+/* Use the slot holding the address if there is one; otherwise an unused or
+expired one, or failing that the block that will expire soonest. Allow entries
+are never pushed out. */
+
+if ((s = old = screen_table_find(address, now, &old_allow)))
+  {
+  if (seconds > 0 && old_allow && !allow) return FAIL;
+  }
+else if (seconds <= 0)
+  return OK;
+else
+  {
+  for (int i = 0; i < SCREEN_PROBES && !s; i++)
+    {
+    screen_table_slot * t = dbfn_slot_n(screen_table, hash, i);
+    if (!t->key[0] || t->expiry <= now) s = t;
+    else if (!t->allow && (!victim || t->expiry < victim->expiry)) victim = t;
     }
+  if (!s && !(s = victim)) return FAIL;
+  }
+
+if (!dbfn_slot_claim(&s->sl, SCREEN_SPINS, &seq)) return DEFER;
+
+if (seconds <= 0)
+  s->key[0] = 0;
+else
+  {
+  if (old && !old_allow && !allow && s->expiry > expiry) expiry = s->expiry;
+  Ustrcpy(s->key, address);
+  s->expiry = expiry;
+  s->allow = allow;
+  s->sl.hash = hash;
+  }
+dbfn_slot_release(&s->sl, seq);
+
+DEBUG(D_any)
+  if (seconds <= 0)
+    debug_printf("screen table: %s removed\n", address);
+  else
+    debug_printf("screen table: %s %s for %s\n", address,
+      allow ? "allowed" : "blocked", readconf_printtime((int)(expiry - now)));
+return OK;
+}
+
+
+/*************************************************
+*         List the screen table entries          *
+*************************************************/
+
+/* This is for the -bB command line option.
+
+Returns:    FALSE if the table is not available
+*/
+
+BOOL
+daemon_screen_list(void)
+{
+time_t now = time(NULL);
+
+if (!screen_table_open()) return FALSE;
+for (unsigned i = 0; i < screen_table->sh.slots; i++)
+  {
+  screen_table_slot * s = dbfn_slot_n(screen_table, i, 0), copy;
+  uint64_t seq;
+
+  if (!dbfn_slot_read_begin(&s->sl, &seq)) continue;
+  copy = *s;
+  if (dbfn_slot_read_end(&s->sl, seq) && copy.key[0] && copy.expiry > now)
+    printf("%-40s %s %s\n", copy.key, copy.allow ? "allow" : "block",
+      readconf_printtime((int)(copy.expiry - now)));
+  }
+printf("%lu connections rejected\n", screen_table->rejects);
+return TRUE;
+}
+
+
+
+/*************************************************
+*            Handle a connected SMTP call        *
+*************************************************/
+
+/* This function is called when an SMTP connection has been accepted.
+If there are too many, give an error message and close down. Otherwise
+spin off a sub-process to handle the call. The list of listening sockets
+is required so that they can be closed in the sub-process. Take care not to
+leak store in this process - reset the stacking pool at the end.
+
+Arguments:
+  listen_sockets        sockets which are listening for incoming calls
+  listen_socket_count   count of listening sockets
+  accept_socket         socket of the current accepted call
+  accepted              socket information about the current call
+
+Returns:            nothing
+*/
+
+static void
+handle_smtp_call(int *listen_sockets, int listen_socket_count,
+  int accept_socket, struct sockaddr *accepted)
+{
+pid_t pid;
+union sockaddr_46 interface_sockaddr;
+EXIM_SOCKLEN_T ifsize = sizeof(interface_sockaddr);
+int dup_accept_socket = -1;
+int max_for_this_host = 0;
+int host_count, network_count;
+uschar netkey[CONN_NET_KEYLEN];
+int save_log_selector = *log_selector;
+BOOL prefork = prefork_slot_self >= 0;
+gstring * whofrom;
+
+/* A prefork worker handles many sessions, so everything used for this one
+must be released at the end; the mark for each message is separate. */
+
+rmark session_reset_point = store_mark(), reset_point;
+
+/* Make the address available in ASCII representation, and also fish out
+the remote port. */
+
+sender_host_address = host_ntoa(-1, accepted, NULL, &sender_host_port);
+DEBUG(D_any) debug_printf("Connection request from %s port %d\n",
+  sender_host_address, sender_host_port);
+
+/* A client in the screen table gets a short rejection straight away, without
+a fork, and without waiting for the write. */
+
+if (!daemon_park_served && screen_table_blocked(sender_host_address))
+  {
+  static const char reject[] = "554 Access denied\r\n";
+
+  DEBUG(D_any) debug_printf("%s is blocked by the screen table\n",
+    sender_host_address);
+  (void) send(accept_socket, reject, sizeof(reject) - 1, MSG_DONTWAIT);
+  if (LOGGING(smtp_connection))
+    log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from [%s] "
+      "rejected: address is blocked", sender_host_address);
+  goto ERROR_RETURN;
+  }
+
+/* Set up the output stream, check the socket has duplicated, and set up the
+input stream. These operations fail only the exceptional circumstances. Note
+that never_error() won't use smtp_out if it is NULL. */
+
+if (!(smtp_out = fdopen(accept_socket, "wb")))
+  {
+  never_error(US"daemon: fdopen() for smtp_out failed", US"", errno);
+  goto ERROR_RETURN;
+  }
+
+if ((dup_accept_socket = dup(accept_socket)) < 0)
+  {
+  never_error(US"daemon: couldn't dup socket descriptor",
+    US"Connection setup failed", errno);
+  goto ERROR_RETURN;
+  }
+
+if (!(smtp_in = fdopen(dup_accept_socket, "rb")))
+  {
+  never_error(US"daemon: fdopen() for smtp_in failed",
+    US"Connection setup failed", errno);
+  goto ERROR_RETURN;
+  }
+
+/* Get the data for the local interface address. Panic for most errors, but
+"connection reset by peer" just means the connection went away. */
+
+if (getsockname(accept_socket, (struct sockaddr *)(&interface_sockaddr),
+     &ifsize) < 0)
+  {
+  log_write(0, LOG_MAIN | ((errno == ECONNRESET)? 0 : LOG_PANIC),
+    "getsockname() failed: %s", strerror(errno));
+  smtp_printf("421 Local problem: getsockname() failed; please try again later\r\n", FALSE);
+  goto ERROR_RETURN;
+  }
+
+interface_address = host_ntoa(-1, &interface_sockaddr, NULL, &interface_port);
+DEBUG(D_interface) debug_printf("interface address=%s port=%d\n",
+  interface_address, interface_port);
+
+/* Build a string identifying the remote host and, if requested, the port and
+the local interface data. This is for logging; at the end of this function the
+memory is reclaimed. */
+
+whofrom = string_append(NULL, 3, "[", sender_host_address, "]");
+
+if (LOGGING(incoming_port))
+  whofrom = string_fmt_append(whofrom, ":%d", sender_host_port);
+
+if (LOGGING(incoming_interface))
+  whofrom = string_fmt_append(whofrom, " I=[%s]:%d",
+    interface_address, interface_port);
+
+(void) string_from_gstring(whofrom);    /* Terminate the newly-built string */
+
+/* Check maximum number of connections. We do not check for reserved
+connections or unacceptable hosts here. That is done in the subprocess because
+it might take some time. */
+
+if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
+  {
+  DEBUG(D_any) debug_printf("rejecting SMTP connection: count=%d max=%d\n",
+    smtp_accept_count, smtp_accept_max);
+  smtp_printf("421 Too many concurrent SMTP connections; "
+    "please try again later.\r\n", FALSE);
+  log_write(L_connection_reject,
+            LOG_MAIN, "Connection from %s refused: too many connections",
+    whofrom->s);
+  goto ERROR_RETURN;
+  }
+
+/* If a load limit above which only reserved hosts are acceptable is defined,
+get the load average here, and if there are in fact no reserved hosts, do
+the test right away (saves a fork). If there are hosts, do the check in the
+subprocess because it might take time. */
+
+if (smtp_load_reserve >= 0)
+  {
+  load_average = OS_GETLOADAVG();
+  if (smtp_reserve_hosts == NULL && load_average > smtp_load_reserve)
+    {
+    DEBUG(D_any) debug_printf("rejecting SMTP connection: load average = %.2f\n",
+      (double)load_average/1000.0);
+    smtp_printf("421 Too much load; please try again later.\r\n", FALSE);
+    log_write(L_connection_reject,
+              LOG_MAIN, "Connection from %s refused: load average = %.2f",
+      whofrom->s, (double)load_average/1000.0);
+    goto ERROR_RETURN;
+    }
+  }
+
+/* Check that one specific host (strictly, IP address) is not hogging
+resources. This is done here to prevent a denial of service attack by someone
+forcing you to fork lots of times before denying service. The value of
+smtp_accept_max_per_host is a string which is expanded. This makes it possible
+to provide host-specific limits according to $sender_host address, but because
+this is in the daemon mainline, only fast expansions (such as inline address
+checks) should be used. The documentation is full of warnings. */
+
+if (smtp_accept_max_per_host)
+  {
+  uschar *expanded = expand_string(smtp_accept_max_per_host);
+  if (!expanded)
+    {
+    if (!f.expand_string_forcedfail)
+      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
+        "failed for %s: %s", whofrom->s, expand_string_message);
+    }
+  /* For speed, interpret a decimal number inline here */
+  else
+    {
+    uschar *s = expanded;
+    while (isdigit(*s))
+      max_for_this_host = max_for_this_host * 10 + *s++ - '0';
+    if (*s)
+      log_write(0, LOG_MAIN|LOG_PANIC, "expansion of smtp_accept_max_per_host "
+        "for %s contains non-digit: %s", whofrom->s, expanded);
+    }
+  }
+
+/* Get the counts of *other* connections from this host and from its network,
+for the per-host limit and for the ACL variables. A prefork worker can see what
+its siblings are handling via the shared slots; otherwise, use the daemon's
+record of accepting processes. */
+
+conn_network_key(sender_host_address, netkey);
+if (prefork)
+  {
+  host_count = prefork_busy_count(sender_host_address);
+  network_count = prefork_network_count(netkey);
+  }
+else
+  {
+  host_count = conn_count_get(sender_host_address);
+  network_count = conn_count_get(netkey);
+  }
+
+if (max_for_this_host > 0 && host_count >= max_for_this_host)
+  {
+  DEBUG(D_any) debug_printf("rejecting SMTP connection: too many from this "
+    "IP address: count=%d max=%d\n",
+    host_count, max_for_this_host);
+  smtp_printf("421 Too many concurrent SMTP connections "
+    "from this IP address; please try again later.\r\n", FALSE);
+  log_write(L_connection_reject,
+            LOG_MAIN, "Connection from %s refused: too many connections "
+    "from that IP address", whofrom->s);
+  search_tidyup();
+  goto ERROR_RETURN;
+  }
+
+/* OK, the connection count checks have been passed. Before we can fork the
+accepting process, we must first log the connection if requested. This logging
+used to happen in the subprocess, but doing that means that the value of
+smtp_accept_count can be out of step by the time it is logged. So we have to do
+the logging here and accept the performance cost. Note that smtp_accept_count
+hasn't yet been incremented to take account of this connection.
+
+In order to minimize the cost (because this is going to happen for every
+connection), do a preliminary selector test here. This saves ploughing through
+the generalized logging code each time when the selector is false. If the
+selector is set, check whether the host is on the list for logging. If not,
+arrange to unset the selector in the subprocess. A connection resumed after
+being parked was logged when it was first accepted. */
+
+if (LOGGING(smtp_connection))
+  {
+  uschar *list = hosts_connection_nolog;
+  memset(sender_host_cache, 0, sizeof(sender_host_cache));
+  if (list != NULL && verify_check_host(&list) == OK)
+    save_log_selector &= ~L_smtp_connection;
+  else if (!daemon_park_served)
+    log_write(L_smtp_connection, LOG_MAIN, "SMTP connection from %s "
+      "(TCP/IP connection count = %d)", whofrom->s, smtp_accept_count + 1);
+  }
+
+/* Now we can fork the accepting process; do a lookup tidy, just in case any
+expansion above did a lookup. A prefork worker does not fork; it handles the
+connection itself and then goes back for another. */
+
+search_tidyup();
+
+if (prefork)
+  {
+  prefork_slot * ps = prefork_slots + prefork_slot_self;
+  (void) string_format(ps->host_address, sizeof(ps->host_address), "%s",
+    sender_host_address);
+  ps->busy = TRUE;
+  }
+else
+  pid = exim_fork(US"daemon-accept");
+
+/* Handle the child process */
+
+if (prefork || pid == 0)
+  {
+  int queue_only_reason = 0;
+  int old_pool = store_pool;
+  int save_debug_selector = debug_selector;
+  BOOL local_queue_only;
+  BOOL session_local_queue_only;
+  #ifdef SA_NOCLDWAIT
+  struct sigaction act;
+  #endif
+
+  smtp_accept_count++;    /* So that it includes this process */
+  smtp_accept_host_count = host_count + 1;
+  smtp_accept_network_count = network_count + 1;
+
+#ifdef EXIM_HAVE_CPU_AFFINITY
+  /* Move to the CPUs for SMTP connections, preferring those near the one
+  that received the connection */
+
+  if (smtp_cpus || smtp_cpus_follow_incoming)
+    {
+    int cpu = -1;
+#ifdef SO_INCOMING_CPU
+    socklen_t len = sizeof(cpu);
+    if (  smtp_cpus_follow_incoming
+       && getsockopt(accept_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) != 0)
+      cpu = -1;
+#endif
+    (void) exim_set_cpus(smtp_cpus, cpu);
+    }
+#endif
+
+  /* May have been modified for the subprocess */
+
+  *log_selector = save_log_selector;
+
+  /* Get the local interface address into permanent store */
+
+  store_pool = POOL_PERM;
+  interface_address = string_copy(interface_address);
+  store_pool = old_pool;
+
+  /* Check for a tls-on-connect port */
+
+  if (host_is_tls_on_connect_port(interface_port)) tls_in.on_connect = TRUE;
+
+  /* Expand smtp_active_hostname if required. We do not do this any earlier,
+  because it may depend on the local interface address (indeed, that is most
+  likely what it depends on.) */
+
+  smtp_active_hostname = primary_hostname;
+  if (raw_active_hostname)
+    {
+    uschar * nah = expand_string(raw_active_hostname);
+    if (!nah)
+      {
+      if (!f.expand_string_forcedfail)
+        {
+        log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand \"%s\" "
+          "(smtp_active_hostname): %s", raw_active_hostname,
+          expand_string_message);
+        smtp_printf("421 Local configuration error; "
+          "please try again later.\r\n", FALSE);
+        mac_smtp_fflush();
+        search_tidyup();
+        if (prefork) goto SESSION_END;
+        exim_underbar_exit(EXIT_FAILURE);
+        }
+      }
+    else if (*nah) smtp_active_hostname = nah;
+    }
+
+  /* Initialize the queueing flags */
+
+  queue_check_only();
+  session_local_queue_only = queue_only;
+
+  /* Close the listening sockets, and set the SIGCHLD handler to SIG_IGN.
+  We also attempt to set things up so that children are automatically reaped,
+  but just in case this isn't available, there's a paranoid waitpid() in the
+  loop too (except for systems where we are sure it isn't needed). See the more
+  extensive comment before the reception loop in exim.c for a fuller
+  explanation of this logic. A prefork worker keeps its listening sockets. */
+
+  if (!prefork)
+    close_daemon_sockets(daemon_notifier_fd, listen_sockets, listen_socket_count);
+
+  /* Set FD_CLOEXEC on the SMTP socket. We don't want any rogue child processes
+  to be able to communicate with them, under any circumstances. */
+  (void)fcntl(accept_socket, F_SETFD,
+              fcntl(accept_socket, F_GETFD) | FD_CLOEXEC);
+  (void)fcntl(dup_accept_socket, F_SETFD,
+              fcntl(dup_accept_socket, F_GETFD) | FD_CLOEXEC);
+
+  #ifdef SA_NOCLDWAIT
+  act.sa_handler = SIG_IGN;
+  sigemptyset(&(act.sa_mask));
+  act.sa_flags = SA_NOCLDWAIT;
+  sigaction(SIGCHLD, &act, NULL);
+  #else
+  signal(SIGCHLD, SIG_IGN);
+  #endif
+  signal(SIGTERM, SIG_DFL);
+
+  /* Attempt to get an id from the sending machine via the RFC 1413
+  protocol. We do this in the sub-process in order not to hold up the
+  main process if there is any delay. Then set up the fullhost information
+  in case there is no HELO/EHLO.
+
+  If debugging is enabled only for the daemon, we must turn if off while
+  finding the id, but turn it on again afterwards so that information about the
+  incoming connection is output. */
+
+  if (f.debug_daemon) debug_selector = 0;
+  verify_get_ident(IDENT_PORT);
+  host_build_sender_fullhost();
+  debug_selector = save_debug_selector;
+
+  DEBUG(D_any)
+    debug_printf("Process %d is handling incoming connection from %s\n",
+      (int)getpid(), sender_fullhost);
+
+  /* Now disable debugging permanently if it's required only for the daemon
+  process. */
+
+  if (f.debug_daemon) debug_selector = 0;
+
+  /* If there are too many child processes for immediate delivery,
+  set the session_local_queue_only flag, which is initialized from the
+  configured value and may therefore already be TRUE. Leave logging
+  till later so it will have a message id attached. Note that there is no
+  possibility of re-calculating this per-message, because the value of
+  smtp_accept_count does not change in this subprocess. */
+
+  if (smtp_accept_queue > 0 && smtp_accept_count > smtp_accept_queue)
+    {
+    session_local_queue_only = TRUE;
+    queue_only_reason = 1;
+    }
+
+  /* Handle the start of the SMTP session, then loop, accepting incoming
+  messages from the SMTP connection. The end will come at the QUIT command,
+  when smtp_setup_msg() returns 0. A break in the connection causes the
+  process to die (see accept.c).
+
+  NOTE: We do *not* call smtp_log_no_mail() if smtp_start_session() fails,
+  because a log line has already been written for all its failure exists
+  (usually "connection refused: <reason>") and writing another one is
+  unnecessary clutter. */
+
+  if (!smtp_start_session())
+    {
+    mac_smtp_fflush();
+    search_tidyup();
+    if (prefork) goto SESSION_END;
+    exim_underbar_exit(EXIT_SUCCESS);
+    }
+
+  for (;;)
+    {
+    int rc;
+    message_id[0] = 0;            /* Clear out any previous message_id */
+    reset_point = store_mark();   /* Save current store high water point */
+
+    DEBUG(D_any)
+      debug_printf("Process %d is ready for new message\n", (int)getpid());
+
+    /* Smtp_setup_msg() returns 0 on QUIT or if the call is from an
+    unacceptable host or if an ACL "drop" command was triggered, -1 on
+    connection lost, and +1 on validly reaching DATA. Receive_msg() almost
+    always returns TRUE when smtp_input is true; just retry if no message was
+    accepted (can happen for invalid message parameters). However, it can yield
+    FALSE if the connection was forcibly dropped by the DATA ACL. */
+
+    if ((rc = smtp_setup_msg()) > 0)
+      {
+      BOOL ok = receive_msg(FALSE);
+      search_tidyup();                    /* Close cached databases */
+      if (!ok)                            /* Connection was dropped */
+        {
+	cancel_cutthrough_connection(TRUE, US"receive dropped");
+        mac_smtp_fflush();
+        smtp_log_no_mail();               /* Log no mail if configured */
+        if (prefork) goto SESSION_END;
+        exim_underbar_exit(EXIT_SUCCESS);
+        }
+      if (message_id[0] == 0) continue;   /* No message was accepted */
+      }
+    else
+      {
+      if (smtp_out)
+	{
+	int fd = fileno(smtp_in);
+	uschar buf[128];
+
+	mac_smtp_fflush();
+	/* drain socket, for clean TCP FINs */
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0)
+	  for(int i = 16; read(fd, buf, sizeof(buf)) > 0 && i > 0; ) i--;
+	}
+      cancel_cutthrough_connection(TRUE, US"message setup dropped");
+      search_tidyup();
+      smtp_log_no_mail();                 /* Log no mail if configured */
+
+      /*XXX should we pause briefly, hoping that the client will be the
+      active TCP closer hence get the TCP_WAIT endpoint? */
+      if (prefork) goto SESSION_END;
+      DEBUG(D_receive) debug_printf("SMTP>>(close on process exit)\n");
+      exim_underbar_exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+      }
+
+    /* Show the recipients when debugging */
+
+    DEBUG(D_receive)
+      {
+      if (sender_address)
+        debug_printf("Sender: %s\n", sender_address);
+      if (recipients_list)
+        {
+        debug_printf("Recipients:\n");
+        for (int i = 0; i < recipients_count; i++)
+          debug_printf("  %s\n", recipients_list[i].address);
+        }
+      }
+
+    /* A message has been accepted. Clean up any previous delivery processes
+    that have completed and are defunct, on systems where they don't go away
+    by themselves (see comments when setting SIG_IGN above). On such systems
+    (if any) these delivery processes hang around after termination until
+    the next message is received. */
+
+    #ifndef SIG_IGN_WORKS
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+    #endif
+
+    /* Reclaim up the store used in accepting this message */
+
+      {
+      int r = receive_messagecount, pr = message_priority;
+      BOOL q = f.queue_only_policy;
+      smtp_reset(reset_point);
+      reset_point = NULL;
+      f.queue_only_policy = q;
+      receive_messagecount = r;
+      message_priority = pr;
+      }
+
+    /* If queue_only is set or if there are too many incoming connections in
+    existence, session_local_queue_only will be TRUE. If it is not, check
+    whether we have received too many messages in this session for immediate
+    delivery. */
+
+    if (!session_local_queue_only &&
+        smtp_accept_queue_per_connection > 0 &&
+        receive_messagecount > smtp_accept_queue_per_connection)
+      {
+      session_local_queue_only = TRUE;
+      queue_only_reason = 2;
+      }
+
+    /* Initialize local_queue_only from session_local_queue_only. If it is not
+    true, and queue_only_load is set, check that the load average is below it.
+    If local_queue_only is set by this means, we also set if for the session if
+    queue_only_load_latch is true (the default). This means that, once set,
+    local_queue_only remains set for any subsequent messages on the same SMTP
+    connection. This is a deliberate choice; even though the load average may
+    fall, it doesn't seem right to deliver later messages on the same call when
+    not delivering earlier ones. However, the are special circumstances such as
+    very long-lived connections from scanning appliances where this is not the
+    best strategy. In such cases, queue_only_load_latch should be set false. */
+
+    if (  !(local_queue_only = session_local_queue_only)
+       && queue_only_load >= 0
+       && (local_queue_only = (load_average = OS_GETLOADAVG()) > queue_only_load)
+       )
+      {
+      queue_only_reason = 3;
+      if (queue_only_load_latch) session_local_queue_only = TRUE;
+      }
+
+    /* Likewise if queue_only_deliveries is set, and the daemon is already
+    running at least that many deliveries. This tracks bursts as they happen,
+    which the load average does not. It does not latch. */
+
+    if (  !local_queue_only && queue_only_deliveries > 0
+       && daemon_count(DCOUNT_DELIVERIES) >= queue_only_deliveries)
+      {
+      local_queue_only = TRUE;
+      queue_only_reason = 4;
+      }
+
+    /* Log the queueing here, when it will get a message id attached, but
+    not if queue_only is set (case 0). */
+
+    if (local_queue_only) switch(queue_only_reason)
+      {
+      case 1: log_write(L_delay_delivery,
+                LOG_MAIN, "no immediate delivery: too many connections "
+                "(%d, max %d)", smtp_accept_count, smtp_accept_queue);
+	      break;
+
+      case 2: log_write(L_delay_delivery,
+                LOG_MAIN, "no immediate delivery: more than %d messages "
+                "received in one connection", smtp_accept_queue_per_connection);
+	      break;
+
+      case 3: log_write(L_delay_delivery,
+                LOG_MAIN, "no immediate delivery: load average %.2f",
+                (double)load_average/1000.0);
+	      break;
+
+      case 4: log_write(L_delay_delivery,
+                LOG_MAIN, "no immediate delivery: %d deliveries running",
+                daemon_count(DCOUNT_DELIVERIES));
+	      break;
+      }
+
+    /* If a delivery attempt is required, spin off a new process to handle it.
+    If we are not root, we have to re-exec exim unless deliveries are being
+    done unprivileged, or the delivery helper will do it. */
+
+    else if (  (!f.queue_only_policy || f.queue_smtp)
+            && !f.deliver_freeze
+	    && !delivery_helper_pass())
+      {
+      pid_t dpid;
+
+      /* Before forking, ensure that the C output buffer is flushed. Otherwise
+      anything that it in it will get duplicated, leading to duplicate copies
+      of the pending output. */
+
+      mac_smtp_fflush();
+
+      if ((dpid = exim_fork(US"daemon-accept-delivery")) == 0)
+        {
+        (void)fclose(smtp_in);
+        (void)fclose(smtp_out);
+        if (prefork)
+          close_daemon_sockets(-1, listen_sockets, listen_socket_count);
+
+        /* Don't ever molest the parent's SSL connection, but do clean up
+        the data structures if necessary. */
+
+#ifndef DISABLE_TLS
+        tls_close(NULL, TLS_NO_SHUTDOWN);
+#endif
+
+        /* Reset SIGHUP and SIGCHLD in the child in both cases. */
+
+        signal(SIGHUP,  SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+
+        if (geteuid() != root_uid && !deliver_drop_privilege)
+          {
+          signal(SIGALRM, SIG_DFL);
+	  delivery_re_exec(CEE_EXEC_PANIC);
+          /* Control does not return here. */
+          }
+
+        /* No need to re-exec; SIGALRM remains set to the default handler */
+
+        (void) deliver_message(message_id, FALSE, FALSE);
+        search_tidyup();
+        exim_underbar_exit(EXIT_SUCCESS);
+        }
+
+      if (dpid > 0)
+        {
+	release_cutthrough_connection(US"passed for delivery");
+        DEBUG(D_any) debug_printf("forked delivery process %d\n", (int)dpid);
+        }
+      else
+	{
+	cancel_cutthrough_connection(TRUE, US"delivery fork failed");
+        log_write(0, LOG_MAIN|LOG_PANIC, "daemon: delivery process fork "
+          "failed: %s", strerror(errno));
+	}
+      }
+
+#ifndef DISABLE_QUEUE_RAMP
+    /* A message of the most urgent priority class that is being left on the
+    queue gets a queue run of its own, rather than waiting for the next one. */
+
+    if (  !f.deliver_freeze
+       && (local_queue_only || f.queue_only_policy && !f.queue_smtp)
+       && queue_priority_urgent(message_priority))
+      queue_notify_daemon(message_id);
+#endif
+    }
+
+SESSION_END:
+  ;
+  }
+
+
+/* A prefork worker has finished with the session. Drop any TLS state that
+the session did not shut down itself, and release the slot. Otherwise we are
+carrying on in the parent daemon process... Can't do much if the fork
+failed. Otherwise, keep count of the number of accepting processes and
+remember the pid for ticking off when the child completes. */
+
+if (prefork)
+  {
+#ifndef DISABLE_TLS
+  if (tls_in.active.sock >= 0) tls_close(NULL, TLS_NO_SHUTDOWN);
+#endif
+  prefork_slots[prefork_slot_self].busy = FALSE;
+  }
+else if (pid < 0)
+  never_error(US"daemon: accept process fork failed", US"Fork failed", errno);
+else
+  {
+  if (smtp_slot_add(pid, sender_host_address, netkey))
+    smtp_accept_count++;
+  daemon_counts_update();
+  DEBUG(D_any) debug_printf("%d SMTP accept process%s running\n",
+    smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
+  }
+
+/* Get here via goto in error cases */
+
+ERROR_RETURN:
+
+/* Close the streams associated with the socket which will also close the
+socket fds in this process. We can't do anything if fclose() fails, but
+logging brings it to someone's attention. However, "connection reset by peer"
+isn't really a problem, so skip that one. On Solaris, a dropped connection can
+manifest itself as a broken pipe, so drop that one too. If the streams don't
+exist, something went wrong while setting things up. Make sure the socket
+descriptors are closed, in order to drop the connection. */
+
+if (smtp_out)
+  {
+  if (fclose(smtp_out) != 0 && errno != ECONNRESET && errno != EPIPE)
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fclose(smtp_out) failed: %s",
+      strerror(errno));
+  smtp_out = NULL;
+  }
+else (void)close(accept_socket);
+
+if (smtp_in)
+  {
+  if (fclose(smtp_in) != 0 && errno != ECONNRESET && errno != EPIPE)
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fclose(smtp_in) failed: %s",
+      strerror(errno));
+  smtp_in = NULL;
+  }
+else (void)close(dup_accept_socket);
+
+/* Release any store used in this process, including the store used for holding
+the incoming host address and an expanded active_hostname. */
+
+log_close_all();
+interface_address =
+sender_host_address = NULL;
+store_reset(session_reset_point);
+sender_host_address = NULL;
+}
+
+
+
+
+/*************************************************
+*       Check wildcard listen special cases      *
+*************************************************/
+
+/* This function is used when binding and listening on lists of addresses and
+ports. It tests for special cases of wildcard listening, when IPv4 and IPv6
+sockets may interact in different ways in different operating systems. It is
+passed an error number, the list of listening addresses, and the current
+address. Two checks are available: for a previous wildcard IPv6 address, or for
+a following wildcard IPv4 address, in both cases on the same port.
+
+In practice, pairs of wildcard addresses should be adjacent in the address list
+because they are sorted that way below.
+
+Arguments:
+  eno            the error number
+  addresses      the list of addresses
+  ipa            the current IP address
+  back           if TRUE, check for previous wildcard IPv6 address
+                 if FALSE, check for a following wildcard IPv4 address
+
+Returns:         TRUE or FALSE
+*/
+
+static BOOL
+check_special_case(int eno, ip_address_item *addresses, ip_address_item *ipa,
+  BOOL back)
+{
+ip_address_item *ipa2;
+
+/* For the "back" case, if the failure was "address in use" for a wildcard IPv4
+address, seek a previous IPv6 wildcard address on the same port. As it is
+previous, it must have been successfully bound and be listening. Flag it as a
+"6 including 4" listener. */
+
+if (back)
+  {
+  if (eno != EADDRINUSE || ipa->address[0] != 0) return FALSE;
+  for (ipa2 = addresses; ipa2 != ipa; ipa2 = ipa2->next)
+    {
+    if (ipa2->address[1] == 0 && ipa2->port == ipa->port)
+      {
+      ipa2->v6_include_v4 = TRUE;
+      return TRUE;
+      }
+    }
+  }
+
+/* For the "forward" case, if the current address is a wildcard IPv6 address,
+we seek a following wildcard IPv4 address on the same port. */
+
+else
+  {
+  if (ipa->address[0] != ':' || ipa->address[1] != 0) return FALSE;
+  for (ipa2 = ipa->next; ipa2 != NULL; ipa2 = ipa2->next)
+    if (ipa2->address[0] == 0 && ipa->port == ipa2->port) return TRUE;
+  }
+
+return FALSE;
+}
+
+
+
+
+/*************************************************
+*         Handle terminating subprocesses        *
+*************************************************/
+
+/* Handle the termination of child processes. Theoretically, this need be done
+only when sigchld_seen is TRUE, but rumour has it that some systems lose
+SIGCHLD signals at busy times, so to be on the safe side, this function is
+called each time round. It shouldn't be too expensive.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+static void
+handle_ending_processes(void)
+{
+int status;
+pid_t pid;
+
+while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+  {
+  DEBUG(D_any)
+    {
+    debug_printf("child %d ended: status=0x%x\n", (int)pid, status);
+#ifdef WCOREDUMP
+    if (WIFEXITED(status))
+      debug_printf("  normal exit, %d\n", WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+      debug_printf("  signal exit, signal %d%s\n", WTERMSIG(status),
+          WCOREDUMP(status) ? " (core dumped)" : "");
+#endif
+    }
+
+  /* If it's a prefork worker, free its slot so that a replacement is started.
+  The busy flag must be cleared too, as the worker may have died during a
+  connection. */
+
+  if (prefork_slots)
+    {
+    int i;
+    for (i = 0; i < daemon_prefork_workers; i++)
+      if (prefork_slots[i].pid == pid)
+        {
+        prefork_slots[i].pid = 0;
+        prefork_slots[i].busy = FALSE;
+        DEBUG(D_any) debug_printf("prefork worker %d (slot %d) ended\n",
+	  (int)pid, i);
+        break;
+        }
+    if (i < daemon_prefork_workers) continue;
+    }
+
+  /* If it's a lookup helper, free its slot so that a replacement is
+  started. */
+
+  if (lookup_proxy_pids)
+    {
+    int i;
+    for (i = 0; i < lookup_proxy_workers; i++)
+      if (lookup_proxy_pids[i] == pid)
+        {
+        lookup_proxy_pids[i] = 0;
+        DEBUG(D_any) debug_printf("lookup helper %d ended\n", (int)pid);
+        break;
+        }
+    if (i < lookup_proxy_workers) continue;
+    }
+
+  if (qrunners && qrunner_ended(pid)) continue;
+
+  if (pid == conn_cache_pid)
+    {
+    conn_cache_pid = 0;
+    DEBUG(D_any) debug_printf("connection cache %d ended\n", (int)pid);
+    continue;
+    }
+
+  /* If the delivery helper has gone, later children re-exec to deliver. */
+
+  if (pid == delivery_helper_pid)
+    {
+    delivery_helper_pid = 0;
+    (void) close(delivery_helper_fd);
+    delivery_helper_fd = -1;
+    log_write(0, LOG_MAIN, "delivery helper %d ended", (int)pid);
+    continue;
+    }
+
+  /* If it's a listening daemon for which we are keeping track of individual
+  subprocesses, deal with an accepting process that has terminated. */
+
+  if (smtp_slots && smtp_slot_remove(pid))
+    {
+    if (--smtp_accept_count < 0) smtp_accept_count = 0;
+    DEBUG(D_any) debug_printf("%d SMTP accept process%s now running\n",
+      smtp_accept_count, (smtp_accept_count == 1)? "" : "es");
+    continue;
+    }
+
+  /* If it wasn't an accepting process, see if it was a queue-runner
+  process that we are tracking. */
+
+  if (queue_pid_slots)
+    {
+    int max = atoi(CS expand_string(queue_run_max));
+    for (int i = 0; i < max; i++)
+      if (queue_pid_slots[i] == pid)
+        {
+        queue_pid_slots[i] = 0;
+        if (--queue_run_count < 0) queue_run_count = 0;
+        DEBUG(D_any) debug_printf("%d queue-runner process%s now running\n",
+          queue_run_count, (queue_run_count == 1)? "" : "es");
+        break;
+        }
+    }
+  }
+daemon_counts_update();
+}
+
+
+
+/*************************************************
+*           Prefork worker process               *
+*************************************************/
+
+/* This is the mainline of a worker in the prefork pool. It has been forked
+from the daemon after privilege was given up and the work that can be shared
+by children was done, so it starts warm. It waits for connections on the
+listening sockets (which it shares with its siblings), handling each one
+itself, up to daemon_prefork_sessions of them; then it exits and the daemon
+starts a replacement. Any session that ends abnormally will have exited the
+process anyway.
+
+Arguments:
+  slot                  index of this worker's slot
+  listen_sockets        sockets which are listening for incoming calls
+  listen_socket_count   count of listening sockets
+
+Returns:                does not return
+*/
+
+static void
+prefork_worker(int slot, int * listen_sockets, int listen_socket_count)
+{
+struct global_flags saved_flags;
+tls_support saved_tls_in;
+int save_debug_selector = debug_selector;
+BOOL * ready = store_malloc(listen_socket_count * sizeof(BOOL));
+
+prefork_slot_self = slot;
+prefork_listen_sockets = listen_sockets;
+prefork_listen_socket_count = listen_socket_count;
+
+if (daemon_notifier_fd >= 0)
+  {
+  (void) close(daemon_notifier_fd);
+  daemon_notifier_fd = -1;
+  }
+if (lookup_proxy_fd >= 0)
+  {
+  (void) close(lookup_proxy_fd);
+  lookup_proxy_fd = -1;
+  }
+if (conn_cache_fd >= 0)
+  {
+  (void) close(conn_cache_fd);
+  conn_cache_fd = -1;
+  }
+for (int i = 0; i < 2; i++) if (daemon_wake_pipe[i] >= 0)
+  {
+  (void) close(daemon_wake_pipe[i]);
+  daemon_wake_pipe[i] = -1;
+  }
+
+prefork_sighup_seen = FALSE;
+os_non_restarting_signal(SIGHUP, prefork_sighup_handler);
+signal(SIGTERM, SIG_DFL);
+
+/* The sockets are shared, so a sibling may win the race for a connection
+that woke us; make them non-blocking to avoid sticking in accept(). */
+
+for (int sk = 0; sk < listen_socket_count; sk++)
+  (void) fcntl(listen_sockets[sk], F_SETFL,
+	      fcntl(listen_sockets[sk], F_GETFL) | O_NONBLOCK);
+
+/* Remember the session-independent state, to restore between sessions */
+
+saved_flags = f;
+saved_tls_in = tls_in;
+
+DEBUG(D_any) debug_printf("prefork worker %d started (slot %d)\n",
+  (int)getpid(), slot);
+
+for (int sessions = 0;
+     !prefork_sighup_seen
+     && (daemon_prefork_sessions <= 0 || sessions < daemon_prefork_sessions);
+    )
+  {
+#if HAVE_IPV6
+  struct sockaddr_in6 accepted;
+#else
+  struct sockaddr_in accepted;
+#endif
+  EXIM_SOCKLEN_T len = sizeof(accepted);
+  int accept_socket = -1;
+
+  set_process_info("daemon(%s): prefork worker, waiting for a connection",
+    version_string);
+
+  if (daemon_wait(listen_sockets, ready, listen_socket_count, -1) < 0)
+    {
+    if (errno != EINTR)
+      {
+      log_write(0, LOG_MAIN|LOG_PANIC, "prefork worker select() failed: %s",
+	strerror(errno));
+      break;
+      }
+    continue;
+    }
+
+  for (int sk = 0; sk < listen_socket_count; sk++)
+    if (ready[sk])
+      {
+      accept_socket = accept(listen_sockets[sk],
+	(struct sockaddr *)&accepted, &len);
+      if (accept_socket >= 0 && listen_accepts && sk < listen_metrics_count)
+	(void) __sync_fetch_and_add(&listen_accepts[sk], 1);
+      break;
+      }
+
+  if (accept_socket < 0)
+    {
+    if (  errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+       && errno != ECONNABORTED && errno != EBADF)
+      {
+      log_write(0, LOG_MAIN, "prefork worker accept() failed: %s",
+	strerror(errno));
+      log_close_all();
+      }
+    continue;
+    }
+
+  /* Some systems pass on the non-blocking flag to the accepted socket */
+
+  (void) fcntl(accept_socket, F_SETFL,
+	      fcntl(accept_socket, F_GETFL) & ~O_NONBLOCK);
+
+  set_process_info("daemon(%s): prefork worker, handling a connection",
+    version_string);
+  smtp_accept_count = prefork_busy_count(NULL);
+  handle_smtp_call(listen_sockets, listen_socket_count, accept_socket,
+    (struct sockaddr *)&accepted);
+  callout_kept_close();
+  callout_cache_flush();
+  sessions++;
+
+  /* Put back the state that the session may have changed */
+
+  f = saved_flags;
+  tls_in = saved_tls_in;
+  debug_selector = save_debug_selector;
+  sender_host_name = sender_helo_name = sender_ident = NULL;
+  sender_fullhost = sender_rcvhost = NULL;
+  sender_host_aliases = NULL;
+  sender_host_authenticated = sender_host_auth_pubname = NULL;
+  authenticated_id = authenticated_fail_id = NULL;
+  host_lookup_deferred = host_lookup_failed = FALSE;
+  sender_host_dnssec = sender_helo_dnssec = FALSE;
+  proxy_session = FALSE;
+  ratelimiters_conn = NULL;
+  receive_messagecount = 0;
+  smtp_accept_count = smtp_accept_host_count = smtp_accept_network_count = 0;
+  }
+
+DEBUG(D_any) debug_printf("prefork worker %d ending\n", (int)getpid());
+exim_underbar_exit(EXIT_SUCCESS);
+}
+
+
+
+/*************************************************
+*         Start prefork workers as needed        *
+*************************************************/
+
+/* Called each time round the daemon loop. A slot whose previous worker lasted
+less than a second is left for a while, so that a worker which keeps dying (for
+example, because of a configuration problem) does not cause a fork storm.
+
+Arguments:
+  listen_sockets        sockets which are listening for incoming calls
+  listen_socket_count   count of listening sockets
+
+Returns:                TRUE if any slot was left empty
+*/
+
+static BOOL
+prefork_spawn(int * listen_sockets, int listen_socket_count)
+{
+BOOL deferred = FALSE;
+time_t now = time(NULL);
+
+for (int i = 0; i < daemon_prefork_workers; i++)
+  if (prefork_slots[i].pid <= 0)
+    {
+    pid_t pid;
+
+    if (now - prefork_slots[i].started < 1)
+      { deferred = TRUE; continue; }
+
+    prefork_slots[i].busy = FALSE;
+    prefork_slots[i].started = now;
+
+    if ((pid = exim_fork(US"prefork-worker")) == 0)
+      {
+      if (f.debug_daemon) debug_selector = 0;
+      prefork_worker(i, listen_sockets, listen_socket_count);
+      /* Control never returns here. */
+      }
+
+    if (pid < 0)
+      {
+      log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of prefork worker "
+	"failed: %s", strerror(errno));
+      log_close_all();
+      return TRUE;
+      }
+    prefork_slots[i].pid = pid;
+    DEBUG(D_any) debug_printf("forked prefork worker %d (slot %d)\n",
+      (int)pid, i);
+    }
+return deferred;
+}
+
+
+/* Tell the prefork workers to finish up; used when the daemon is stopping or
+restarting. */
+
+static void
+prefork_stop(void)
+{
+if (prefork_slots)
+  for (int i = 0; i < daemon_prefork_workers; i++)
+    if (prefork_slots[i].pid > 0)
+      (void) kill(prefork_slots[i].pid, SIGHUP);
+}
+
+
+
+/*************************************************
+*          Start and stop lookup helpers         *
+*************************************************/
+
+/* Create the unix socket for a helper process. The socket is created after
+the daemon has given up root privilege, and is accessible only to the Exim
+user.
+
+Arguments:
+  option     the setting of the option naming the socket
+  name       for messages
+  pathp      where to put the expanded path
+
+Returns:     the listening socket, or -1 on failure (which has been logged)
+*/
+
+static int
+daemon_helper_listen(const uschar * option, const uschar * name,
+  uschar ** pathp)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+const uschar * where;
+mode_t saved_umask;
+uschar * path;
+int fd;
+
+if (!(path = expand_string(US option)))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand %s socket: %s",
+    name, expand_string_message);
+  return -1;
+  }
+path = string_copy_perm(path, FALSE);
+if (Ustrlen(path) >= sizeof(sa_un.sun_path))
+  { errno = ENAMETOOLONG; where = US"path"; goto bad; }
+Ustrcpy(sa_un.sun_path, path);
+
+DEBUG(D_any) debug_printf("creating %s socket %s\n", name, path);
+
+if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
+  { where = US"socket"; goto bad; }
+(void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 
-  for (;;)
-    {
-    int rc;
-    message_id[0] = 0;            /* Clear out any previous message_id */
-    reset_point = store_mark();   /* Save current store high water point */
+/* Helpers may share the socket, so make it non-blocking to avoid one sticking
+in accept() after a sibling has taken the connection. */
 
-    DEBUG(D_any)
-      debug_printf("Process %d is ready for new message\n", (int)getpid());
+(void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-    /* Smtp_setup_msg() returns 0 on QUIT or if the call is from an
-    unacceptable host or if an ACL "drop" command was triggered, -1 on
-    connection lost, and +1 on validly reaching DATA. Receive_msg() almost
-    always returns TRUE when smtp_input is true; just retry if no message was
-    accepted (can happen for invalid message parameters). However, it can yield
-    FALSE if the connection was forcibly dropped by the DATA ACL. */
+(void) Uunlink(path);
+saved_umask = umask(0177);
+if (bind(fd, (const struct sockaddr *)&sa_un, sizeof(sa_un)) < 0)
+  {
+  (void) umask(saved_umask);
+  where = US"bind";
+  goto bad2;
+  }
+(void) umask(saved_umask);
 
-    if ((rc = smtp_setup_msg()) > 0)
-      {
-      BOOL ok = receive_msg(FALSE);
-      search_tidyup();                    /* Close cached databases */
-      if (!ok)                            /* Connection was dropped */
-        {
-	cancel_cutthrough_connection(TRUE, US"receive dropped");
-        mac_smtp_fflush();
-        smtp_log_no_mail();               /* Log no mail if configured */
-        exim_underbar_exit(EXIT_SUCCESS);
-        }
-      if (message_id[0] == 0) continue;   /* No message was accepted */
-      }
-    else
-      {
-      if (smtp_out)
-	{
-	int fd = fileno(smtp_in);
-	uschar buf[128];
+if (listen(fd, smtp_connect_backlog) < 0)
+  {
+  where = US"listen";
+  Uunlink(path);
+  goto bad2;
+  }
 
-	mac_smtp_fflush();
-	/* drain socket, for clean TCP FINs */
-	if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0)
-	  for(int i = 16; read(fd, buf, sizeof(buf)) > 0 && i > 0; ) i--;
-	}
-      cancel_cutthrough_connection(TRUE, US"message setup dropped");
-      search_tidyup();
-      smtp_log_no_mail();                 /* Log no mail if configured */
+*pathp = path;
+return fd;
 
-      /*XXX should we pause briefly, hoping that the client will be the
-      active TCP closer hence get the TCP_WAIT endpoint? */
-      DEBUG(D_receive) debug_printf("SMTP>>(close on process exit)\n");
-      exim_underbar_exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
-      }
+bad2:
+  close(fd);
+bad:
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s socket %s %s: %s",
+    name, path, where, strerror(errno));
+  return -1;
+}
 
-    /* Show the recipients when debugging */
 
-    DEBUG(D_receive)
-      {
-      if (sender_address)
-        debug_printf("Sender: %s\n", sender_address);
-      if (recipients_list)
-        {
-        debug_printf("Recipients:\n");
-        for (int i = 0; i < recipients_count; i++)
-          debug_printf("  %s\n", recipients_list[i].address);
-        }
-      }
+/* When lookup_proxy_socket is set, the daemon listens on that unix socket,
+and keeps a number of helper processes running to answer the SQL lookups of
+its children (see search_proxy_serve()). Other processes do their lookups for
+themselves. */
 
-    /* A message has been accepted. Clean up any previous delivery processes
-    that have completed and are defunct, on systems where they don't go away
-    by themselves (see comments when setting SIG_IGN above). On such systems
-    (if any) these delivery processes hang around after termination until
-    the next message is received. */
+static void
+lookup_proxy_listen(void)
+{
+if ((lookup_proxy_fd = daemon_helper_listen(lookup_proxy_socket,
+      US"lookup helper", &lookup_proxy_path)) < 0)
+  return;
 
-    #ifndef SIG_IGN_WORKS
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-    #endif
+lookup_proxy_pids = store_get(lookup_proxy_workers * sizeof(pid_t), FALSE);
+for (int i = 0; i < lookup_proxy_workers; i++) lookup_proxy_pids[i] = 0;
+}
 
-    /* Reclaim up the store used in accepting this message */
 
-      {
-      int r = receive_messagecount;
-      BOOL q = f.queue_only_policy;
-      smtp_reset(reset_point);
-      reset_point = NULL;
-      f.queue_only_policy = q;
-      receive_messagecount = r;
-      }
+/* Fill any empty helper slots. Replacements are started at most once a
+second, in case a helper is dying at once.
 
-    /* If queue_only is set or if there are too many incoming connections in
-    existence, session_local_queue_only will be TRUE. If it is not, check
-    whether we have received too many messages in this session for immediate
-    delivery. */
+Returns:   TRUE if any slot was left empty
+*/
 
-    if (!session_local_queue_only &&
-        smtp_accept_queue_per_connection > 0 &&
-        receive_messagecount > smtp_accept_queue_per_connection)
-      {
-      session_local_queue_only = TRUE;
-      queue_only_reason = 2;
-      }
+static BOOL
+lookup_proxy_spawn(void)
+{
+time_t now = time(NULL);
+BOOL started = FALSE;
 
-    /* Initialize local_queue_only from session_local_queue_only. If it is not
-    true, and queue_only_load is set, check that the load average is below it.
-    If local_queue_only is set by this means, we also set if for the session if
-    queue_only_load_latch is true (the default). This means that, once set,
-    local_queue_only remains set for any subsequent messages on the same SMTP
-    connection. This is a deliberate choice; even though the load average may
-    fall, it doesn't seem right to deliver later messages on the same call when
-    not delivering earlier ones. However, the are special circumstances such as
-    very long-lived connections from scanning appliances where this is not the
-    best strategy. In such cases, queue_only_load_latch should be set false. */
+for (int i = 0; i < lookup_proxy_workers; i++)
+  if (lookup_proxy_pids[i] <= 0)
+    {
+    pid_t pid;
 
-    if (  !(local_queue_only = session_local_queue_only)
-       && queue_only_load >= 0
-       && (local_queue_only = (load_average = OS_GETLOADAVG()) > queue_only_load)
-       )
+    if (now == lookup_proxy_spawned) return TRUE;
+    started = TRUE;
+
+    if ((pid = exim_fork(US"lookup-helper")) == 0)
       {
-      queue_only_reason = 3;
-      if (queue_only_load_latch) session_local_queue_only = TRUE;
+      if (f.debug_daemon) debug_selector = 0;
+      signal(SIGHUP, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGCHLD, SIG_DFL);
+      if (daemon_notifier_fd >= 0) (void) close(daemon_notifier_fd);
+      if (conn_cache_fd >= 0) (void) close(conn_cache_fd);
+      set_process_info("lookup helper");
+      search_proxy_serve(lookup_proxy_fd);
+      /* Control never returns here. */
       }
 
-    /* Log the queueing here, when it will get a message id attached, but
-    not if queue_only is set (case 0). */
-
-    if (local_queue_only) switch(queue_only_reason)
+    if (pid < 0)
       {
-      case 1: log_write(L_delay_delivery,
-                LOG_MAIN, "no immediate delivery: too many connections "
-                "(%d, max %d)", smtp_accept_count, smtp_accept_queue);
-	      break;
+      log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of lookup helper "
+	"failed: %s", strerror(errno));
+      return TRUE;
+      }
+    lookup_proxy_pids[i] = pid;
+    DEBUG(D_any) debug_printf("forked lookup helper %d\n", (int)pid);
+    }
 
-      case 2: log_write(L_delay_delivery,
-                LOG_MAIN, "no immediate delivery: more than %d messages "
-                "received in one connection", smtp_accept_queue_per_connection);
-	      break;
+if (started) lookup_proxy_spawned = now;
+return FALSE;
+}
 
-      case 3: log_write(L_delay_delivery,
-                LOG_MAIN, "no immediate delivery: load average %.2f",
-                (double)load_average/1000.0);
-	      break;
-      }
 
-    /* If a delivery attempt is required, spin off a new process to handle it.
-    If we are not root, we have to re-exec exim unless deliveries are being
-    done unprivileged. */
+/* Stop the helpers and remove their socket; used when the daemon is stopping
+or restarting. */
 
-    else if (  (!f.queue_only_policy || f.queue_smtp)
-            && !f.deliver_freeze)
-      {
-      pid_t dpid;
+static void
+lookup_proxy_stop(void)
+{
+if (lookup_proxy_pids)
+  for (int i = 0; i < lookup_proxy_workers; i++)
+    if (lookup_proxy_pids[i] > 0)
+      (void) kill(lookup_proxy_pids[i], SIGTERM);
+if (lookup_proxy_path)
+  {
+  DEBUG(D_any) debug_printf("unlinking lookup helper socket %s\n",
+    lookup_proxy_path);
+  (void) Uunlink(lookup_proxy_path);
+  }
+}
 
-      /* Before forking, ensure that the C output buffer is flushed. Otherwise
-      anything that it in it will get duplicated, leading to duplicate copies
-      of the pending output. */
 
-      mac_smtp_fflush();
 
-      if ((dpid = exim_fork(US"daemon-accept-delivery")) == 0)
-        {
-        (void)fclose(smtp_in);
-        (void)fclose(smtp_out);
+/*************************************************
+*          Persistent queue runners              *
+*************************************************/
 
-        /* Don't ever molest the parent's SSL connection, but do clean up
-        the data structures if necessary. */
+/* When queue_run_persistent is set, the daemon keeps that many queue-runner
+processes that are forked once and do run after run, instead of forking (and
+usually re-executing) a new process for each. Each waits on its end of a
+socketpair for a request, which is an empty string for a full queue run or a
+message id for a run triggered by a notification, and sends back a byte when it
+has finished. A timer or notification that finds none of them idle is dealt
+with as before. The daemon must have the privilege to deliver without
+re-executing. */
 
-#ifndef DISABLE_TLS
-        tls_close(NULL, TLS_NO_SHUTDOWN);
-#endif
+static void
+qrunner_serve(int fd)
+{
+uschar buf[MESSAGE_ID_LENGTH+1];
+BOOL save_2stage = f.queue_2stage;
 
-        /* Reset SIGHUP and SIGCHLD in the child in both cases. */
+for (;;)
+  {
+  rmark reset_point;
+  ssize_t n = recv(fd, buf, sizeof(buf), 0);
 
-        signal(SIGHUP,  SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
-        signal(SIGTERM, SIG_DFL);
+  if (n < 0 && errno == EINTR) continue;
+  if (n <= 0) break;
+  buf[n < sizeof(buf) ? n : sizeof(buf)-1] = '\0';
 
-        if (geteuid() != root_uid && !deliver_drop_privilege)
-          {
-          signal(SIGALRM, SIG_DFL);
-	  delivery_re_exec(CEE_EXEC_PANIC);
-          /* Control does not return here. */
-          }
+  reset_point = store_mark();
+  set_process_info("persistent queue runner: running");
+  if (*buf)
+    {
+    log_write(0, LOG_MAIN, "notify triggered queue run");
+    f.queue_2stage = FALSE;
+    queue_run(buf, buf, FALSE);
+    f.queue_2stage = save_2stage;
+    }
+  else
+    queue_run(NULL, NULL, FALSE);
+
+  f.queue_running = FALSE;
+  queue_run_pid = (pid_t)0;
+  search_tidyup();
+  store_reset(reset_point);
+  set_process_info("persistent queue runner: waiting");
+  if (send(fd, "I", 1, 0) < 0) break;
+  }
 
-        /* No need to re-exec; SIGALRM remains set to the default handler */
+DEBUG(D_any) debug_printf("persistent queue runner: no more requests\n");
+exim_underbar_exit(EXIT_SUCCESS);
+}
 
-        (void) deliver_message(message_id, FALSE, FALSE);
-        search_tidyup();
-        exim_underbar_exit(EXIT_SUCCESS);
-        }
 
-      if (dpid > 0)
-        {
-	release_cutthrough_connection(US"passed for delivery");
-        DEBUG(D_any) debug_printf("forked delivery process %d\n", (int)dpid);
-        }
-      else
-	{
-	cancel_cutthrough_connection(TRUE, US"delivery fork failed");
-        log_write(0, LOG_MAIN|LOG_PANIC, "daemon: delivery process fork "
-          "failed: %s", strerror(errno));
-	}
-      }
-    }
+/* Get the slots for the runners; called when the daemon starts, if there are
+to be queue runs. */
+
+static void
+qrunner_init(void)
+{
+if (geteuid() != root_uid && !deliver_drop_privilege)
+  {
+  log_write(0, LOG_MAIN, "queue_run_persistent ignored: the daemon does not "
+    "have the privilege to deliver without re-executing");
+  return;
   }
+qrunners = store_get(queue_run_persistent * sizeof(qrunner), FALSE);
+for (int i = 0; i < queue_run_persistent; i++)
+  qrunners[i] = (qrunner) { .pid = 0, .fd = -1, .busy = FALSE };
+}
 
 
-/* Carrying on in the parent daemon process... Can't do much if the fork
-failed. Otherwise, keep count of the number of accepting processes and
-remember the pid for ticking off when the child completes. */
+/* Fill any empty runner slots, at most once a second.
 
-if (pid < 0)
-  never_error(US"daemon: accept process fork failed", US"Fork failed", errno);
-else
+Returns:   TRUE if any slot was left empty
+*/
+
+static BOOL
+qrunner_spawn(int * listen_sockets, int listen_socket_count)
+{
+time_t now = time(NULL);
+BOOL started = FALSE;
+
+for (int i = 0; i < queue_run_persistent; i++) if (qrunners[i].pid <= 0)
   {
-  for (int i = 0; i < smtp_accept_max; ++i)
-    if (smtp_slots[i].pid <= 0)
-      {
-      smtp_slots[i].pid = pid;
-      /* Connection closes come asyncronously, so we cannot stack this store */
-      if (smtp_accept_max_per_host)
-        smtp_slots[i].host_address = string_copy_malloc(sender_host_address);
-      smtp_accept_count++;
-      break;
-      }
-  DEBUG(D_any) debug_printf("%d SMTP accept process%s running\n",
-    smtp_accept_count, smtp_accept_count == 1 ? "" : "es");
+  int pfd[2];
+  pid_t pid;
+
+  if (now == qrunner_spawned) return TRUE;
+  started = TRUE;
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pfd) < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: persistent queue runner "
+      "socketpair failed: %s", strerror(errno));
+    return TRUE;
+    }
+  (void)fcntl(pfd[0], F_SETFD, fcntl(pfd[0], F_GETFD) | FD_CLOEXEC);
+  (void)fcntl(pfd[1], F_SETFD, fcntl(pfd[1], F_GETFD) | FD_CLOEXEC);
+
+  if ((pid = exim_fork(US"queue-runner")) == 0)
+    {
+    if (f.debug_daemon) debug_selector = 0;
+    (void) close(pfd[1]);
+    close_daemon_sockets(daemon_notifier_fd, listen_sockets, listen_socket_count);
+    signal(SIGHUP,  SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    set_process_info("persistent queue runner: waiting");
+    qrunner_serve(pfd[0]);
+    /* Control never returns here. */
+    }
+
+  (void) close(pfd[0]);
+  if (pid < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of persistent queue runner "
+      "failed: %s", strerror(errno));
+    (void) close(pfd[1]);
+    return TRUE;
+    }
+  qrunners[i] = (qrunner) { .pid = pid, .fd = pfd[1], .busy = FALSE };
+  DEBUG(D_any) debug_printf("forked persistent queue runner %d\n", (int)pid);
   }
 
-/* Get here via goto in error cases */
+if (started) qrunner_spawned = now;
+return FALSE;
+}
 
-ERROR_RETURN:
 
-/* Close the streams associated with the socket which will also close the
-socket fds in this process. We can't do anything if fclose() fails, but
-logging brings it to someone's attention. However, "connection reset by peer"
-isn't really a problem, so skip that one. On Solaris, a dropped connection can
-manifest itself as a broken pipe, so drop that one too. If the streams don't
-exist, something went wrong while setting things up. Make sure the socket
-descriptors are closed, in order to drop the connection. */
+/* Give a queue run to an idle runner. The argument is a message id, or an
+empty string for a full run. The run is counted as a queue runner until the
+runner reports that it has finished.
 
-if (smtp_out)
+Returns:   TRUE if a runner has taken the run
+*/
+
+static BOOL
+qrunner_wake(const uschar * msgid)
+{
+for (int i = 0; i < queue_run_persistent; i++)
   {
-  if (fclose(smtp_out) != 0 && errno != ECONNRESET && errno != EPIPE)
-    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fclose(smtp_out) failed: %s",
-      strerror(errno));
-  smtp_out = NULL;
+  qrunner * q = &qrunners[i];
+
+  if (q->fd < 0 || q->busy) continue;
+  if (send(q->fd, msgid, Ustrlen(msgid) + 1, MSG_DONTWAIT) < 0)
+    {
+    DEBUG(D_any) debug_printf("persistent queue runner %d: send: %s\n",
+      (int)q->pid, strerror(errno));
+    continue;
+    }
+  q->busy = TRUE;
+  queue_run_count++;
+  daemon_counts_update();
+  DEBUG(D_any) debug_printf("queue run given to persistent runner %d\n",
+    (int)q->pid);
+  return TRUE;
   }
-else (void)close(accept_socket);
+return FALSE;
+}
 
-if (smtp_in)
+
+/* Put the runners' sockets into the list to wait on; return the count */
+
+static int
+qrunner_wait_fds(int * fds)
+{
+for (int i = 0; i < queue_run_persistent; i++) fds[i] = qrunners[i].fd;
+return queue_run_persistent;
+}
+
+
+/* Deal with runners whose sockets were ready: a finished run, or the end of
+the process. */
+
+static void
+qrunner_service(const BOOL * ready)
+{
+for (int i = 0; i < queue_run_persistent; i++) if (ready[i])
   {
-  if (fclose(smtp_in) != 0 && errno != ECONNRESET && errno != EPIPE)
-    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fclose(smtp_in) failed: %s",
-      strerror(errno));
-  smtp_in = NULL;
+  qrunner * q = &qrunners[i];
+  uschar c;
+  ssize_t n = recv(q->fd, &c, 1, MSG_DONTWAIT);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    continue;
+  if (n > 0 && q->busy)
+    {
+    q->busy = FALSE;
+    if (--queue_run_count < 0) queue_run_count = 0;
+    daemon_counts_update();
+    }
+  else if (n <= 0)
+    {
+    (void) close(q->fd);
+    q->fd = -1;
+    }
   }
-else (void)close(dup_accept_socket);
+}
 
-/* Release any store used in this process, including the store used for holding
-the incoming host address and an expanded active_hostname. */
 
-log_close_all();
-interface_address =
-sender_host_address = NULL;
-store_reset(reset_point);
-sender_host_address = NULL;
-}
+/* Forget a runner that has ended; returns FALSE if the pid is not one */
 
+static BOOL
+qrunner_ended(pid_t pid)
+{
+for (int i = 0; i < queue_run_persistent; i++)
+  {
+  qrunner * q = &qrunners[i];
+
+  if (q->pid != pid) continue;
+  if (q->fd >= 0) (void) close(q->fd);
+  if (q->busy && --queue_run_count < 0) queue_run_count = 0;
+  *q = (qrunner) { .pid = 0, .fd = -1, .busy = FALSE };
+  DEBUG(D_any) debug_printf("persistent queue runner %d ended\n", (int)pid);
+  return TRUE;
+  }
+return FALSE;
+}
 
 
 
 /*************************************************
-*       Check wildcard listen special cases      *
+*     Start and stop the connection cache        *
 *************************************************/
 
-/* This function is used when binding and listening on lists of addresses and
-ports. It tests for special cases of wildcard listening, when IPv4 and IPv6
-sockets may interact in different ways in different operating systems. It is
-passed an error number, the list of listening addresses, and the current
-address. Two checks are available: for a previous wildcard IPv6 address, or for
-a following wildcard IPv4 address, in both cases on the same port.
-
-In practice, pairs of wildcard addresses should be adjacent in the address list
-because they are sorted that way below.
-
-Arguments:
-  eno            the error number
-  addresses      the list of addresses
-  ipa            the current IP address
-  back           if TRUE, check for previous wildcard IPv6 address
-                 if FALSE, check for a following wildcard IPv4 address
+/* When smtp_connection_cache is set, the daemon listens on that unix socket,
+and keeps one helper process running to hold idle outbound SMTP connections
+for its children (see smtp_conn_cache_serve()). A replacement is started at
+most once a second.
 
-Returns:         TRUE or FALSE
+Returns:   TRUE if the helper could not be started yet
 */
 
 static BOOL
-check_special_case(int eno, ip_address_item *addresses, ip_address_item *ipa,
-  BOOL back)
+conn_cache_spawn(void)
 {
-ip_address_item *ipa2;
+time_t now = time(NULL);
+pid_t pid;
 
-/* For the "back" case, if the failure was "address in use" for a wildcard IPv4
-address, seek a previous IPv6 wildcard address on the same port. As it is
-previous, it must have been successfully bound and be listening. Flag it as a
-"6 including 4" listener. */
+if (conn_cache_pid > 0) return FALSE;
+if (now == conn_cache_spawned) return TRUE;
+conn_cache_spawned = now;
 
-if (back)
+if ((pid = exim_fork(US"conn-cache")) == 0)
   {
-  if (eno != EADDRINUSE || ipa->address[0] != 0) return FALSE;
-  for (ipa2 = addresses; ipa2 != ipa; ipa2 = ipa2->next)
-    {
-    if (ipa2->address[1] == 0 && ipa2->port == ipa->port)
-      {
-      ipa2->v6_include_v4 = TRUE;
-      return TRUE;
-      }
-    }
+  if (f.debug_daemon) debug_selector = 0;
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  if (daemon_notifier_fd >= 0) (void) close(daemon_notifier_fd);
+  if (lookup_proxy_fd >= 0) (void) close(lookup_proxy_fd);
+  set_process_info("connection cache");
+  smtp_conn_cache_serve(conn_cache_fd);
+  /* Control never returns here. */
   }
 
-/* For the "forward" case, if the current address is a wildcard IPv6 address,
-we seek a following wildcard IPv4 address on the same port. */
-
-else
+if (pid < 0)
   {
-  if (ipa->address[0] != ':' || ipa->address[1] != 0) return FALSE;
-  for (ipa2 = ipa->next; ipa2 != NULL; ipa2 = ipa2->next)
-    if (ipa2->address[0] == 0 && ipa->port == ipa2->port) return TRUE;
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of connection cache "
+    "failed: %s", strerror(errno));
+  return TRUE;
   }
-
+conn_cache_pid = pid;
+DEBUG(D_any) debug_printf("forked connection cache %d\n", (int)pid);
 return FALSE;
 }
 
 
+/* Stop the helper and remove its socket. Any connections it holds are
+closed without QUIT. */
+
+static void
+conn_cache_stop(void)
+{
+if (conn_cache_pid > 0) (void) kill(conn_cache_pid, SIGTERM);
+if (conn_cache_path)
+  {
+  DEBUG(D_any) debug_printf("unlinking connection cache socket %s\n",
+    conn_cache_path);
+  (void) Uunlink(conn_cache_path);
+  }
+}
 
 
+
+#if !defined(DISABLE_TLS) && !defined(DISABLE_OCSP)
 /*************************************************
-*         Handle terminating subprocesses        *
+*        OCSP response refresh helper            *
 *************************************************/
 
-/* Handle the termination of child processes. Theoretically, this need be done
-only when sigchld_seen is TRUE, but rumour has it that some systems lose
-SIGCHLD signals at busy times, so to be on the safe side, this function is
-called each time round. It shouldn't be too expensive.
+/* With tls_ocsp_refresh set, the daemon looks once a minute to see whether
+any server OCSP response is due for refreshing, and if so forks a helper to
+fetch it, so that the daemon itself never waits on a responder. The helper is
+limited in time, and if the responder cannot be reached there is no new attempt
+for ten minutes. The responses are shared with the processes that handle
+connections through the files they are written to. */
 
-Arguments:  none
-Returns:    nothing
-*/
+#define OCSP_REFRESH_INTERVAL	60
+#define OCSP_REFRESH_RETRY	600
+#define OCSP_REFRESH_TIMEOUT	60
 
 static void
-handle_ending_processes(void)
+ocsp_refresh_check(void)
 {
-int status;
+time_t now = time(NULL), due;
+rmark reset_point;
 pid_t pid;
 
-while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
-  {
-  DEBUG(D_any)
-    {
-    debug_printf("child %d ended: status=0x%x\n", (int)pid, status);
-#ifdef WCOREDUMP
-    if (WIFEXITED(status))
-      debug_printf("  normal exit, %d\n", WEXITSTATUS(status));
-    else if (WIFSIGNALED(status))
-      debug_printf("  signal exit, signal %d%s\n", WTERMSIG(status),
-          WCOREDUMP(status) ? " (core dumped)" : "");
-#endif
-    }
-
-  /* If it's a listening daemon for which we are keeping track of individual
-  subprocesses, deal with an accepting process that has terminated. */
-
-  if (smtp_slots)
-    {
-    int i;
-    for (i = 0; i < smtp_accept_max; i++)
-      if (smtp_slots[i].pid == pid)
-        {
-        if (smtp_slots[i].host_address)
-          store_free(smtp_slots[i].host_address);
-        smtp_slots[i] = empty_smtp_slot;
-        if (--smtp_accept_count < 0) smtp_accept_count = 0;
-        DEBUG(D_any) debug_printf("%d SMTP accept process%s now running\n",
-          smtp_accept_count, (smtp_accept_count == 1)? "" : "es");
-        break;
-        }
-    if (i < smtp_accept_max) continue;  /* Found an accepting process */
-    }
+if (!tls_ocsp_refresh || now < ocsp_refresh_checked + OCSP_REFRESH_INTERVAL)
+  return;
+ocsp_refresh_checked = now;
 
-  /* If it wasn't an accepting process, see if it was a queue-runner
-  process that we are tracking. */
+reset_point = store_mark();
+due = tls_ocsp_refresh_files(FALSE);
+store_reset(reset_point);
+if (!due || due > now)
+  {
+  ocsp_refresh_started = 0;		/* the last attempt, if any, worked */
+  return;
+  }
+if (now < ocsp_refresh_started + OCSP_REFRESH_RETRY) return;
 
-  if (queue_pid_slots)
-    {
-    int max = atoi(CS expand_string(queue_run_max));
-    for (int i = 0; i < max; i++)
-      if (queue_pid_slots[i] == pid)
-        {
-        queue_pid_slots[i] = 0;
-        if (--queue_run_count < 0) queue_run_count = 0;
-        DEBUG(D_any) debug_printf("%d queue-runner process%s now running\n",
-          queue_run_count, (queue_run_count == 1)? "" : "es");
-        break;
-        }
-    }
+ocsp_refresh_started = now;
+if ((pid = exim_fork(US"ocsp-refresh")) == 0)
+  {
+  if (f.debug_daemon) debug_selector = 0;
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGALRM, SIG_DFL);		/* the timeout kills the helper */
+  if (daemon_notifier_fd >= 0) (void) close(daemon_notifier_fd);
+  if (lookup_proxy_fd >= 0) (void) close(lookup_proxy_fd);
+  if (conn_cache_fd >= 0) (void) close(conn_cache_fd);
+  set_process_info("OCSP refresh");
+  if (getuid() == root_uid)
+    exim_setugid(exim_uid, exim_gid, FALSE, US"OCSP refresh");
+  (void) alarm(OCSP_REFRESH_TIMEOUT);
+  (void) tls_ocsp_refresh_files(TRUE);
+  exim_underbar_exit(EXIT_SUCCESS);
   }
+
+if (pid < 0)
+  log_write(0, LOG_MAIN|LOG_PANIC, "daemon: fork of OCSP refresh helper "
+    "failed: %s", strerror(errno));
+else
+  DEBUG(D_any) debug_printf("forked OCSP refresh helper %d\n", (int)pid);
 }
+#endif
 
 
 
@@ -963,6 +2784,10 @@ daemon_die(void)
 {
 int pid;
 
+prefork_stop();
+lookup_proxy_stop();
+conn_cache_stop();
+
 if (daemon_notifier_fd >= 0)
   {
   close(daemon_notifier_fd);
@@ -1043,64 +2868,366 @@ len = offsetof(struct sockaddr_un, sun_path)
 DEBUG(D_any) debug_printf(" %s\n", sa_un.sun_path);
 #endif
 
-if (bind(fd, (const struct sockaddr *)&sa_un, len) < 0)
-  { where = US"bind"; goto bad; }
+if (bind(fd, (const struct sockaddr *)&sa_un, len) < 0)
+  { where = US"bind"; goto bad; }
+
+#ifdef SO_PASSCRED		/* Linux */
+if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+  { where = US"SO_PASSCRED"; goto bad2; }
+#elif defined(LOCAL_CREDS)	/* FreeBSD-ish */
+if (setsockopt(fd, 0, LOCAL_CREDS, &on, sizeof(on)) < 0)
+  { where = US"LOCAL_CREDS"; goto bad2; }
+#endif
+
+/* debug_printf("%s: fd %d\n", __FUNCTION__, fd); */
+daemon_notifier_fd = fd;
+return;
+
+bad2:
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sa_un.sun_path);
+#endif
+bad:
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s %s: %s",
+    __FUNCTION__, where, strerror(errno));
+  close(fd);
+  return;
+}
+
+
+static uschar queuerun_msgid[MESSAGE_ID_LENGTH+1];
+
+
+
+/*************************************************
+*        Build the answer to a metrics request   *
+*************************************************/
+
+/* This gives the state of the daemon, in the Prometheus text format, from
+what it already tracks for its limits. Accepts and notifications are counters
+since the daemon started; rates are left to the collector. The biggest items
+from profiled processes (see profile_sample) follow.
+
+Argument:   growable string to append to, or NULL
+Returns:    the string
+*/
+
+static gstring *
+daemon_metrics(gstring * g)
+{
+static const uschar * notify_names[NOTIFY_TYPE_COUNT] = {
+  US"unknown", US"queue_run", US"queue_size_req", US"queue_add",
+  US"queue_del", US"queue_count_req", US"store_stats", US"store_stats_req",
+  US"smtp_phases", US"smtp_phases_req", US"metrics_req", US"delivery",
+  US"park", US"profile" };
+int connections = smtp_accept_count + (prefork_slots ? prefork_busy_count(NULL) : 0);
+int qrun_max = atoi(CS expand_string(queue_run_max));
+int load = OS_GETLOADAVG();
+
+g = string_fmt_append(g,
+  "# TYPE exim_daemon_uptime_seconds gauge\n"
+  "exim_daemon_uptime_seconds %ld\n"
+  "# TYPE exim_smtp_connections gauge\n"
+  "exim_smtp_connections %d\n"
+  "exim_smtp_connections_max %d\n"
+  "# TYPE exim_queue_runners gauge\n"
+  "exim_queue_runners %d\n"
+  "exim_queue_runners_max %d\n",
+  (long)(time(NULL) - daemon_started),
+  connections, smtp_accept_max,
+  queue_run_count, qrun_max);
+
+if (prefork_slots)
+  g = string_fmt_append(g,
+    "# TYPE exim_prefork_workers gauge\n"
+    "exim_prefork_workers %d\n"
+    "exim_prefork_workers_busy %d\n",
+    daemon_prefork_workers, prefork_busy_count(NULL));
+
+if (parked_conns)
+  g = string_fmt_append(g,
+    "# TYPE exim_smtp_parked gauge\n"
+    "exim_smtp_parked %d\n"
+    "exim_smtp_parked_max %d\n",
+    parked_count, daemon_park_max);
+
+g = string_fmt_append(g,
+  "# TYPE exim_deliveries gauge\n"
+  "exim_deliveries %lu\n"
+  "# TYPE exim_deliveries_total counter\n"
+  "exim_deliveries_total %lu\n",
+  deliveries_started > deliveries_done ? deliveries_started - deliveries_done : 0,
+  deliveries_done);
+
+if (screen_table)
+  g = string_fmt_append(g,
+    "# TYPE exim_smtp_screen_rejects_total counter\n"
+    "exim_smtp_screen_rejects_total %lu\n", screen_table->rejects);
+
+if (listen_metrics_count > 0)
+  {
+  g = string_cat(g, US"# TYPE exim_listener_accepts_total counter\n");
+  for (int sk = 0; sk < listen_metrics_count; sk++)
+    g = string_fmt_append(g, "exim_listener_accepts_total{%s} %lu\n",
+      listen_labels[sk], listen_accepts[sk]);
+  }
+
+/* The load average is given as -1 when the OS cannot say; the gating options
+are -1 when unset, and then never gate. */
+
+g = string_fmt_append(g,
+  "# TYPE exim_load_average gauge\n"
+  "exim_load_average %.3f\n"
+  "exim_queue_only_load %.3f\n"
+  "exim_queue_only_load_active %d\n"
+  "exim_smtp_load_reserve %.3f\n"
+  "exim_smtp_load_reserve_active %d\n",
+  load < 0 ? -1.0 : (double)load/1000.0,
+  queue_only_load < 0 ? -1.0 : (double)queue_only_load/1000.0,
+  queue_only_load >= 0 && load > queue_only_load,
+  smtp_load_reserve < 0 ? -1.0 : (double)smtp_load_reserve/1000.0,
+  smtp_load_reserve >= 0 && load > smtp_load_reserve);
+
+g = string_cat(g, US"# TYPE exim_notifications_total counter\n");
+for (int i = 1; i < NOTIFY_TYPE_COUNT; i++)
+  if (notify_counts[i])
+    g = string_fmt_append(g, "exim_notifications_total{type=\"%s\"} %lu\n",
+      notify_names[i], notify_counts[i]);
+return profile_summary(g);
+}
+
+
+
+/*************************************************
+*        Park a delayed connection               *
+*************************************************/
+
+/* This is called in a process that the daemon has forked for a connection,
+when the connect ACL asks for a delay. Rather than the whole process sleeping,
+the connection is passed over the notifier socket to the daemon, which holds it
+until the delay has run out and then deals with it as if it had just been
+accepted. The delay served is credited against those of the connect ACL when
+it is run again. Connections carrying state that cannot be passed (anything
+already read, TLS-on-connect, a proxy) are not parked, nor are those of
+prefork workers.
+
+Arguments:
+  delay      the delay, in seconds
+  served     the total of connect ACL delays to credit when resumed
+
+Returns:     TRUE if the daemon has taken the connection; the caller must
+             then exit without using it
+*/
+
+BOOL
+daemon_park_connection(int delay, int served)
+{
+uschar buf[64], resp[4];
+int len;
+
+if (  daemon_park_max <= 0 || smtp_accept_count <= 0 || prefork_slot_self >= 0
+   || !smtp_in || smtp_buffered()
+#ifndef DISABLE_TLS
+   || tls_in.active.sock >= 0
+#endif
+#ifdef SUPPORT_PROXY
+   || proxy_session
+#endif
+   )
+  return FALSE;
+
+buf[0] = NOTIFY_PARK;
+len = 1 + snprintf(CS buf+1, sizeof(buf)-1, "%d %d", delay, served);
+if (  queue_daemon_request(buf, len, fileno(smtp_in), resp, sizeof(resp), 2) != 1
+   || resp[0] != 'Y')
+  {
+  DEBUG(D_any) debug_printf("daemon did not take the connection for the delay\n");
+  return FALSE;
+  }
+DEBUG(D_any)
+  debug_printf("connection passed to the daemon for a %d-second delay\n", delay);
+return TRUE;
+}
+
+
+/* In the daemon, take a connection passed with a park request "<delay>
+<served>". Returns TRUE if it is now held. */
+
+static BOOL
+park_take(const uschar * req, int fd)
+{
+union sockaddr_46 sa;
+EXIM_SOCKLEN_T len = sizeof(sa);
+int delay, served, port;
+parked_conn * p;
+
+if (  fd < 0 || !parked_conns || parked_count >= daemon_park_max
+   || sscanf(CCS req, "%d %d", &delay, &served) != 2
+   || delay <= 0 || served < delay
+   || getpeername(fd, (struct sockaddr *)&sa, &len) < 0)
+  return FALSE;
+
+p = &parked_conns[parked_count++];
+p->fd = fd;
+p->watch = TRUE;
+p->served = served;
+(void) gettimeofday(&p->due, NULL);
+p->due.tv_sec += delay;
+(void) host_ntoa(-1, &sa, p->host_address, &port);
+DEBUG(D_any) debug_printf("holding connection from %s for %d seconds "
+  "(%d parked)\n", p->host_address, delay, parked_count);
+return TRUE;
+}
+
+
+static void
+park_remove(int i)
+{
+if (i < --parked_count) parked_conns[i] = parked_conns[parked_count];
+}
+
+
+/* Return the milliseconds until the first parked connection is due, or -1
+if there are none. */
+
+static int
+park_timeout(void)
+{
+struct timeval now;
+int timeout = -1;
+
+(void) gettimeofday(&now, NULL);
+for (int i = 0; i < parked_count; i++)
+  {
+  const struct timeval * due = &parked_conns[i].due;
+  long ms = (due->tv_sec - now.tv_sec) * 1000
+	  + (due->tv_usec - now.tv_usec + 999) / 1000;
+
+  if (ms < 0) ms = 0;
+  if (timeout < 0 || ms < timeout) timeout = (int)ms;
+  }
+return timeout;
+}
+
+
+/*************************************************
+*      Service the parked connections            *
+*************************************************/
+
+/* Drop any parked connections that the client has closed, and resume those
+whose delays have run out, as if they had just been accepted. One that sends
+data early is no longer watched, and waits out its delay as it would have in
+its own process. A resumption waits a second longer if the connection limit has
+been reached.
+
+Arguments:
+  ready        readiness of the first nready parked connections, as waited on,
+               or NULL if the wait failed
+  nready       the number of those
+  listen_sockets, listen_socket_count      for handle_smtp_call()
+
+Returns:       nothing
+*/
+
+static void
+park_service(const BOOL * ready, int nready, int * listen_sockets,
+  int listen_socket_count)
+{
+struct timeval now;
+
+/* Work downwards, so that the entry moved into the place of a removed one has
+already been dealt with. */
+
+if (ready) for (int i = nready - 1; i >= 0; i--) if (ready[i])
+  {
+  parked_conn * p = &parked_conns[i];
+  uschar c;
+  int rc = recv(p->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  if (rc > 0)
+    p->watch = FALSE;
+  else if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+    DEBUG(D_any)
+      debug_printf("parked connection from %s closed\n", p->host_address);
+    (void) close(p->fd);
+    park_remove(i);
+    }
+  }
+
+(void) gettimeofday(&now, NULL);
+for (int i = parked_count - 1; i >= 0; i--)
+  {
+  parked_conn * p = &parked_conns[i];
+  union sockaddr_46 sa;
+  EXIM_SOCKLEN_T len = sizeof(sa);
+  int fd = p->fd, served = p->served;
 
-#ifdef SO_PASSCRED		/* Linux */
-if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
-  { where = US"SO_PASSCRED"; goto bad2; }
-#elif defined(LOCAL_CREDS)	/* FreeBSD-ish */
-if (setsockopt(fd, 0, LOCAL_CREDS, &on, sizeof(on)) < 0)
-  { where = US"LOCAL_CREDS"; goto bad2; }
-#endif
+  if (timercmp(&now, &p->due, <)) continue;
+  if (smtp_accept_max > 0 && smtp_accept_count >= smtp_accept_max)
+    {
+    p->due.tv_sec = now.tv_sec + 1;
+    continue;
+    }
 
-/* debug_printf("%s: fd %d\n", __FUNCTION__, fd); */
-daemon_notifier_fd = fd;
-return;
+  DEBUG(D_any) debug_printf("resuming parked connection from %s\n",
+    p->host_address);
+  park_remove(i);
+  if (getpeername(fd, (struct sockaddr *)&sa, &len) < 0)
+    {
+    (void) close(fd);
+    continue;
+    }
+  daemon_park_served = served;
+  handle_smtp_call(listen_sockets, listen_socket_count, fd,
+    (struct sockaddr *)&sa);
+  daemon_park_served = 0;
+  }
+}
 
-bad2:
-#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-  Uunlink(sa_un.sun_path);
-#endif
-bad:
-  log_write(0, LOG_MAIN|LOG_PANIC, "%s %s: %s",
-    __FUNCTION__, where, strerror(errno));
-  close(fd);
-  return;
+
+
+/* Close every descriptor passed with a notification */
+
+static void
+daemon_notify_fds_close(struct msghdr * msg)
+{
+for (struct cmsghdr * cp = CMSG_FIRSTHDR(msg); cp; cp = CMSG_NXTHDR(msg, cp))
+  if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == SCM_RIGHTS)
+    for (int i = 0, n = (cp->cmsg_len - CMSG_LEN(0)) / sizeof(int); i < n; i++)
+      {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cp) + i * sizeof(int), sizeof(int));
+      (void) close(fd);
+      }
 }
 
 
-static uschar queuerun_msgid[MESSAGE_ID_LENGTH+1];
+/* Return the descriptor passed with a notification if there is exactly one,
+or -1 */
 
-/* Return TRUE if a sigalrm should be emulated */
-static BOOL
-daemon_notification(void)
+static int
+daemon_notify_fd_single(struct msghdr * msg)
 {
-uschar buf[256], cbuf[256];
-struct sockaddr_un sa_un;
-struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)-1};
-struct msghdr msg = { .msg_name = &sa_un,
-		      .msg_namelen = sizeof(sa_un),
-		      .msg_iov = &iov,
-		      .msg_iovlen = 1,
-		      .msg_control = cbuf,
-		      .msg_controllen = sizeof(cbuf)
-		    };
-ssize_t sz;
+int fd = -1, count = 0;
 
-buf[sizeof(buf)-1] = 0;
-if ((sz = recvmsg(daemon_notifier_fd, &msg, 0)) <= 0) return FALSE;
-if (sz >= sizeof(buf)) return FALSE;
+for (struct cmsghdr * cp = CMSG_FIRSTHDR(msg); cp; cp = CMSG_NXTHDR(msg, cp))
+  if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == SCM_RIGHTS)
+    {
+    count += (cp->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (cp->cmsg_len == CMSG_LEN(sizeof(int)))
+      memcpy(&fd, CMSG_DATA(cp), sizeof(int));
+    }
+return count == 1 ? fd : -1;
+}
 
-#ifdef notdef
-debug_printf("addrlen %d\n", msg.msg_namelen);
-#endif
-DEBUG(D_queue_run) debug_printf("%s from addr '%s%.*s'\n", __FUNCTION__,
-  *sa_un.sun_path ? "" : "@",
-  (int)msg.msg_namelen - (*sa_un.sun_path ? 0 : 1),
-  sa_un.sun_path + (*sa_un.sun_path ? 0 : 1));
 
-/* Refuse to handle the item unless the peer has good credentials */
+/* Check the credentials of the sender of a notification. Refuse to handle the
+item unless the peer is root or the Exim user. */
+
+static BOOL
+daemon_notify_creds_ok(struct msghdr * msg)
+{
 #ifdef SCM_CREDENTIALS
 # define EXIM_SCM_CR_TYPE SCM_CREDENTIALS
 #elif defined(LOCAL_CREDS) && defined(SCM_CREDS)
@@ -1111,9 +3238,9 @@ DEBUG(D_queue_run) debug_printf("%s from addr '%s%.*s'\n", __FUNCTION__,
 #endif
 
 #ifdef EXIM_SCM_CR_TYPE
-for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
+for (struct cmsghdr * cp = CMSG_FIRSTHDR(msg);
      cp;
-     cp = CMSG_NXTHDR(&msg, cp))
+     cp = CMSG_NXTHDR(msg, cp))
   if (cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == EXIM_SCM_CR_TYPE)
   {
 # ifdef SCM_CREDENTIALS					/* Linux */
@@ -1136,8 +3263,59 @@ for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg);
   break;
   }
 #endif
+return TRUE;
+}
+
+
+/* Deal with a notification. A descriptor passed with a park request from a
+sender with good credentials is returned via passed_fd, which is set to -1
+again if it is taken over; any other descriptors passed are closed here.
+
+Return TRUE if a sigalrm should be emulated */
+
+static BOOL
+daemon_notify_handle(int * passed_fd)
+{
+uschar buf[4096], cbuf[256];	/* big enough for an SMTP phase report */
+struct sockaddr_un sa_un;
+struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)-1};
+struct msghdr msg = { .msg_name = &sa_un,
+		      .msg_namelen = sizeof(sa_un),
+		      .msg_iov = &iov,
+		      .msg_iovlen = 1,
+		      .msg_control = cbuf,
+		      .msg_controllen = sizeof(cbuf)
+		    };
+ssize_t sz;
+
+buf[sizeof(buf)-1] = 0;
+if ((sz = recvmsg(daemon_notifier_fd, &msg, 0)) <= 0) return FALSE;
+
+#ifdef notdef
+debug_printf("addrlen %d\n", msg.msg_namelen);
+#endif
+DEBUG(D_queue_run) debug_printf("%s from addr '%s%.*s'\n", __FUNCTION__,
+  *sa_un.sun_path ? "" : "@",
+  (int)msg.msg_namelen - (*sa_un.sun_path ? 0 : 1),
+  sa_un.sun_path + (*sa_un.sun_path ? 0 : 1));
+
+/* A truncated control part may have lost the credentials, or some of the
+descriptors (those that did arrive are still open). */
+
+if (  sz >= sizeof(buf) || msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)
+   || !daemon_notify_creds_ok(&msg))
+  {
+  daemon_notify_fds_close(&msg);
+  return FALSE;
+  }
+
+if (buf[0] != NOTIFY_PARK || (*passed_fd = daemon_notify_fd_single(&msg)) < 0)
+  daemon_notify_fds_close(&msg);
+else
+  (void) fcntl(*passed_fd, F_SETFD, fcntl(*passed_fd, F_GETFD) | FD_CLOEXEC);
 
 buf[sz] = 0;
+notify_counts[buf[0] < NOTIFY_TYPE_COUNT ? buf[0] : 0]++;
 switch (buf[0])
   {
 #ifndef DISABLE_QUEUE_RAMP
@@ -1152,7 +3330,9 @@ switch (buf[0])
   case NOTIFY_QUEUE_SIZE_REQ:
     {
     uschar buf[16];
-    int len = snprintf(CS buf, sizeof(buf), "%u", queue_count_cached());
+    int n = queue_index_count(queue_name);
+    int len = snprintf(CS buf, sizeof(buf), "%u",
+			n >= 0 ? (unsigned)n : queue_count_cached());
 
     DEBUG(D_queue_run)
       debug_printf("%s: queue size request: %s\n", __FUNCTION__, buf);
@@ -1163,11 +3343,99 @@ switch (buf[0])
 	"%s: sendto: %s\n", __FUNCTION__, strerror(errno));
     return FALSE;
     }
+
+  case NOTIFY_QUEUE_ADD:
+  case NOTIFY_QUEUE_DEL:
+    queue_index_update(buf, sz);
+    return FALSE;
+
+  case NOTIFY_QUEUE_COUNT_REQ:
+    {
+    /* The request names the queue; an empty response means that we have
+    no index for it, and the requester must scan the spool itself. */
+
+    uschar buf2[16];
+    int n = queue_index_count(buf+1);
+    int len = n >= 0 ? snprintf(CS buf2, sizeof(buf2), "%d", n) : 0;
+
+    DEBUG(D_queue_run)
+      debug_printf("%s: queue count request: '%.*s'\n", __FUNCTION__, len, buf2);
+
+    if (sendto(daemon_notifier_fd, buf2, len, 0,
+		(const struct sockaddr *)&sa_un, msg.msg_namelen) < 0)
+      log_write(0, LOG_MAIN|LOG_PANIC,
+	"%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+    }
+
+  case NOTIFY_STORE_STATS:
+    store_stats_accumulate(buf+1);
+    return FALSE;
+
+  case NOTIFY_SMTP_PHASES:
+    smtp_phase_accumulate(buf+1);
+    return FALSE;
+
+  case NOTIFY_PROFILE:
+    profile_accumulate(buf+1);
+    return FALSE;
+
+  case NOTIFY_DELIVERY:
+    if (buf[1] == '+') deliveries_started++; else deliveries_done++;
+    daemon_counts_update();
+    return FALSE;
+
+  case NOTIFY_PARK:
+    {
+    uschar resp = 'N';
+
+    if (park_take(buf+1, *passed_fd))
+      {
+      *passed_fd = -1;
+      resp = 'Y';
+      }
+    if (sendto(daemon_notifier_fd, &resp, 1, 0,
+		(const struct sockaddr *)&sa_un, msg.msg_namelen) < 0)
+      log_write(0, LOG_MAIN|LOG_PANIC,
+	"%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+    return FALSE;
+    }
+
+  case NOTIFY_STORE_STATS_REQ:
+  case NOTIFY_SMTP_PHASES_REQ:
+  case NOTIFY_METRICS_REQ:
+    {
+    rmark reset_point = store_mark();
+    gstring * g = buf[0] == NOTIFY_STORE_STATS_REQ ? store_stats_summary(NULL)
+      : buf[0] == NOTIFY_SMTP_PHASES_REQ ? smtp_phase_summary(NULL)
+      : daemon_metrics(NULL);
+
+    DEBUG(D_any) debug_printf("%s: %s request\n", __FUNCTION__,
+      buf[0] == NOTIFY_STORE_STATS_REQ ? "store stats"
+      : buf[0] == NOTIFY_SMTP_PHASES_REQ ? "smtp phase times" : "metrics");
+    if (sendto(daemon_notifier_fd, g->s, g->ptr, 0,
+		(const struct sockaddr *)&sa_un, msg.msg_namelen) < 0)
+      log_write(0, LOG_MAIN|LOG_PANIC,
+	"%s: sendto: %s\n", __FUNCTION__, strerror(errno));
+    store_reset(reset_point);
+    return FALSE;
+    }
   }
 return FALSE;
 }
 
 
+static BOOL
+daemon_notification(void)
+{
+int fd = -1;
+BOOL rc = daemon_notify_handle(&fd);
+
+if (fd >= 0) (void) close(fd);
+return rc;
+}
+
+
 /*************************************************
 *              Exim Daemon Mainline              *
 *************************************************/
@@ -1197,6 +3465,9 @@ daemon_go(void)
 struct passwd *pw;
 int *listen_sockets = NULL;
 int listen_socket_count = 0;
+int *wait_fds = NULL;
+BOOL *wait_ready = NULL;
+int nwait;
 ip_address_item *addresses = NULL;
 time_t last_connection_time = (time_t)0;
 int local_queue_run_max = atoi(CS expand_string(queue_run_max));
@@ -1562,10 +3833,7 @@ if (f.daemon_listen)
   track of them for total number and queue/host limits. */
 
   if (smtp_accept_max > 0)
-    {
-    smtp_slots = store_get(smtp_accept_max * sizeof(smtp_slot), FALSE);
-    for (int i = 0; i < smtp_accept_max; i++) smtp_slots[i] = empty_smtp_slot;
-    }
+    smtp_slots_init();
   }
 
 /* The variable background_daemon is always false when debugging, but
@@ -1617,6 +3885,13 @@ the listening sockets if required. */
 
 daemon_notifier_socket();
 
+/* The queue index is kept up to date via the notifier socket, so is only
+worth having if that exists. Build it after the socket is set up, so that no
+changes to the queue are missed. */
+
+if (queue_index && daemon_notifier_fd >= 0)
+  queue_index_build(TRUE);
+
 if (f.daemon_listen && !f.inetd_wait_mode)
   {
   int sk;
@@ -1840,8 +4115,22 @@ Normally we do this, in order to set up the groups for the Exim user. However,
 if we are not root at this time - some odd installations run that way - we
 cannot do this. */
 
+if (  daemon_delivery_helper && f.daemon_listen
+   && geteuid() == root_uid && !deliver_drop_privilege)
+  delivery_helper_start(listen_sockets, listen_socket_count);
+
 exim_setugid(exim_uid, exim_gid, geteuid()==root_uid, US"running as a daemon");
 
+/* Set up the sockets for the lookup helpers and the connection cache, now
+that they will belong to the Exim user. The helpers are started in the main
+loop. */
+
+if (lookup_proxy_socket && *lookup_proxy_socket && lookup_proxy_workers > 0)
+  lookup_proxy_listen();
+if (smtp_connection_cache && *smtp_connection_cache)
+  conn_cache_fd = daemon_helper_listen(smtp_connection_cache,
+    US"connection cache", &conn_cache_path);
+
 /* Update the originator_xxx fields so that received messages as listed as
 coming from Exim, not whoever started the daemon. */
 
@@ -1858,6 +4147,8 @@ if (queue_interval > 0 && local_queue_run_max > 0)
   queue_pid_slots = store_get(local_queue_run_max * sizeof(pid_t), FALSE);
   for (int i = 0; i < local_queue_run_max; i++) queue_pid_slots[i] = 0;
   }
+if (queue_interval > 0 && queue_run_persistent > 0)
+  qrunner_init();
 
 /* Set up the handler for termination of child processes, and the one
 telling us to die. */
@@ -1868,6 +4159,45 @@ os_non_restarting_signal(SIGCHLD, main_sigchld_handler);
 sigterm_seen = FALSE;
 os_non_restarting_signal(SIGTERM, main_sigterm_handler);
 
+/* When listening, set up the pipe by which the signal handlers wake the main
+loop, and make the listening sockets non-blocking so that several connections
+can be accepted at each wakeup. There are as many as two more descriptors to
+wait for than there are listening sockets, and then any parked connections
+and persistent queue runners. */
+
+nwait = listen_socket_count + 2;
+if (f.daemon_listen)
+  {
+
+  if (pipe(daemon_wake_pipe) == 0)
+    for (int i = 0; i < 2; i++)
+      {
+      (void) fcntl(daemon_wake_pipe[i], F_SETFL,
+		  fcntl(daemon_wake_pipe[i], F_GETFL) | O_NONBLOCK);
+      (void) fcntl(daemon_wake_pipe[i], F_SETFD,
+		  fcntl(daemon_wake_pipe[i], F_GETFD) | FD_CLOEXEC);
+      }
+  else
+    daemon_wake_pipe[0] = daemon_wake_pipe[1] = -1;
+
+  for (int sk = 0; sk < listen_socket_count; sk++)
+    (void) fcntl(listen_sockets[sk], F_SETFL,
+		fcntl(listen_sockets[sk], F_GETFL) | O_NONBLOCK);
+
+  if (daemon_park_max > 0 && daemon_prefork_workers <= 0)
+    {
+    parked_conns = store_get(daemon_park_max * sizeof(parked_conn), FALSE);
+    nwait += daemon_park_max;
+    }
+  }
+
+if (f.daemon_listen || qrunners)
+  {
+  if (qrunners) nwait += queue_run_persistent;
+  wait_fds = store_get(nwait * sizeof(int), FALSE);
+  wait_ready = store_get(nwait * sizeof(BOOL), FALSE);
+  }
+
 /* If we are to run the queue periodically, pretend the alarm has just gone
 off. This will cause the first queue-runner to get kicked off straight away. */
 
@@ -2030,15 +4360,111 @@ smtp_deliver_init();	/* Used for callouts */
 # ifdef MEASURE_TIMING
   report_time_since(&t0, US"dkim_exim_init (delta)");
 # endif
+  dkim_exim_preload_keys();
   }
 #endif
 
+expand_readfile_preload();
+
 #ifdef WITH_CONTENT_SCAN
 malware_init();
 #endif
 #ifdef SUPPORT_SPF
 spf_init();
 #endif
+#ifdef SUPPORT_DMARC
+(void) dmarc_tld_load();
+#endif
+
+/* Set up the slots for a prefork pool, if one is wanted. This has to be done
+after the initialization above, so that the workers inherit the results. The
+workers are started from the daemon loop. There is no point in having more
+workers than smtp_accept_max would let handle a connection at once. */
+
+if (daemon_prefork_workers > 0 && f.daemon_listen && !f.inetd_wait_mode)
+  {
+  if (smtp_accept_max > 0 && daemon_prefork_workers > smtp_accept_max)
+    daemon_prefork_workers = smtp_accept_max;
+  if ((prefork_slots = mmap(NULL, daemon_prefork_workers * sizeof(prefork_slot),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0))
+      == MAP_FAILED)
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "daemon: failed to map memory for "
+      "prefork worker slots: %s", strerror(errno));
+  memset(prefork_slots, 0, daemon_prefork_workers * sizeof(prefork_slot));
+  DEBUG(D_any) debug_printf("using %d prefork workers\n",
+    daemon_prefork_workers);
+  }
+
+/* Set up the shared activity counts. Without them the counts read as -1, and
+the options gating on them have no effect. */
+
+if ((daemon_counts = mmap(NULL, DCOUNT_COUNT * sizeof(int),
+		      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0))
+    == MAP_FAILED)
+  {
+  DEBUG(D_any) debug_printf("failed to map memory for activity counts: %s\n",
+    strerror(errno));
+  daemon_counts = NULL;
+  }
+else
+  memset(daemon_counts, 0, DCOUNT_COUNT * sizeof(int));
+
+/* Map the screen table now, as root, so that it is made with the right owner
+and the children inherit it. */
+
+if (f.daemon_listen && smtp_screen_table_size > 0 && !screen_table_open())
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to map the screen table; "
+    "connections will not be screened");
+
+/* Set up the per-listener accept counts for the metrics request, labelled by
+address and port. They are shared so that prefork workers can count too. A
+failure here just loses those metrics. */
+
+daemon_started = time(NULL);
+if (f.daemon_listen && listen_socket_count > 0)
+  {
+  if ((listen_accepts = mmap(NULL, listen_socket_count * sizeof(unsigned long),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0))
+      == MAP_FAILED)
+    {
+    DEBUG(D_any) debug_printf("failed to map memory for accept counts: %s\n",
+      strerror(errno));
+    listen_accepts = NULL;
+    }
+  else
+    {
+    ip_address_item * ipa = addresses;
+
+    memset(listen_accepts, 0, listen_socket_count * sizeof(unsigned long));
+    listen_labels = store_malloc(listen_socket_count * sizeof(uschar *));
+    for (int sk = 0; sk < listen_socket_count; sk++)
+      {
+      listen_labels[sk] = !ipa
+	? string_copy_malloc(US"address=\"inetd\"")
+	: string_copy_malloc(string_sprintf("address=\"%s\",port=\"%d\"",
+	    ipa->address[0] == 0 ? US"0.0.0.0"
+	    : ipa->address[0] == ':' && ipa->address[1] == 0 ? US"::"
+	    : ipa->address,
+	    ipa->port));
+      if (ipa) ipa = ipa->next;
+      }
+    listen_metrics_count = listen_socket_count;
+    }
+  }
+
+/* The configuration is complete. Its store is page-aligned and shared with
+every child until written to; if wanted, make it read-only so that anything
+which does write to it shows up at once. */
+
+if (daemon_config_readonly)
+  {
+  int n = store_writeprotect();
+  if (n < 0)
+    log_write(0, LOG_MAIN|LOG_PANIC, "daemon: failed to write-protect the "
+      "configuration: %s", strerror(errno));
+  else
+    DEBUG(D_any) debug_printf("write-protected %d bytes of configuration\n", n);
+  }
 
 /* Close the log so it can be renamed and moved. In the few cases below where
 this long-running process writes to the log (always exceptional conditions), it
@@ -2120,19 +4546,32 @@ for (;;)
 
     else
       {
+      BOOL handed = FALSE;
+
       DEBUG(D_any) debug_printf("%s received\n",
 #ifndef DISABLE_QUEUE_RAMP
 	*queuerun_msgid ? "qrun notification" :
 #endif
 	"SIGALRM");
 
-      /* Do a full queue run in a child process, if required, unless we already
-      have enough queue runners on the go. If we are not running as root, a
-      re-exec is required. */
+      /* Give the run to an idle persistent queue runner if there is one,
+      starting them first if need be. */
+
+      if (qrunners)
+	{
+	queue_index_build(FALSE);	/* rescan, if due */
+	(void) qrunner_spawn(listen_sockets, listen_socket_count);
+	handed = qrunner_wake(queuerun_msgid);
+	}
+
+      /* Otherwise do a full queue run in a child process, if required, unless
+      we already have enough queue runners on the go. If we are not running as
+      root, a re-exec is required. */
 
-      if (  queue_interval > 0
+      if (  !handed && queue_interval > 0
          && (local_queue_run_max <= 0 || queue_run_count < local_queue_run_max))
         {
+        queue_index_build(FALSE);	/* rescan, if due */
         if ((pid = exim_fork(US"queue-runner")) == 0)
           {
           /* Disable debugging if it's required only for the daemon process. We
@@ -2241,6 +4680,7 @@ for (;;)
               queue_run_count++;
               break;
               }
+          daemon_counts_update();
           DEBUG(D_any) debug_printf("%d queue-runner process%s running\n",
             queue_run_count, queue_run_count == 1 ? "" : "es");
           }
@@ -2271,28 +4711,72 @@ for (;;)
 
   if (f.daemon_listen)
     {
-    int lcount, select_errno;
-    int max_socket = 0;
+    int lcount, select_errno, nfds;
     BOOL select_failed = FALSE;
-    fd_set select_listen;
+    struct timeval respawn_tv = { .tv_sec = 1 };
+    struct timeval preload_tv = { .tv_sec = 60 };
+    struct timeval * select_tv = NULL;
+    int timeout, park_base, park_waited, qrunner_base;
 
-    FD_ZERO(&select_listen);
-    if (daemon_notifier_fd >= 0)
-      FD_SET(daemon_notifier_fd, &select_listen);
-    for (int sk = 0; sk < listen_socket_count; sk++)
+#ifndef DISABLE_TLS
+    /* Build or refresh any preloaded TLS server contexts before starting
+    workers or accepting, so that they are inherited. Workers with stale ones
+    are told to finish, and are replaced below. The daemon does not otherwise
+    wake while the workers are accepting, or while idle, so make it look now
+    and then; likewise for OCSP responses due for refreshing. */
+
+    if (tls_server_preload_check()) prefork_stop();
+    if (prefork_slots && tls_server_preload) select_tv = &preload_tv;
+# ifndef DISABLE_OCSP
+    ocsp_refresh_check();
+    if (tls_ocsp_refresh) select_tv = &preload_tv;
+# endif
+#endif
+
+    /* With a prefork pool, the workers do all the accepting; the daemon just
+    keeps the pool topped up, waking again shortly if a worker could not be
+    replaced yet. */
+
+    if (prefork_slots && prefork_spawn(listen_sockets, listen_socket_count))
+      select_tv = &respawn_tv;
+    if (lookup_proxy_pids && lookup_proxy_spawn())
+      select_tv = &respawn_tv;
+    if (conn_cache_fd >= 0 && conn_cache_spawn())
+      select_tv = &respawn_tv;
+    if (qrunners && qrunner_spawn(listen_sockets, listen_socket_count))
+      select_tv = &respawn_tv;
+
+    /* The wake pipe and the notifier come first, then the listening sockets
+    unless the prefork workers are doing the accepting. */
+
+    wait_fds[0] = daemon_wake_pipe[0];
+    wait_fds[1] = daemon_notifier_fd;
+    nfds = 2;
+    if (!prefork_slots) for (int sk = 0; sk < listen_socket_count; sk++)
+      wait_fds[nfds++] = listen_sockets[sk];
+
+    /* Parked connections are waited on only for closing, and the wait ends
+    when the first is due to be resumed. */
+
+    timeout = select_tv ? select_tv->tv_sec * 1000 : -1;
+    park_base = nfds;
+    park_waited = parked_count;
+    for (int i = 0; i < parked_count; i++)
+      wait_fds[nfds++] = parked_conns[i].watch ? parked_conns[i].fd : -1;
+    qrunner_base = nfds;
+    if (qrunners) nfds += qrunner_wait_fds(wait_fds + nfds);
+    if (parked_count)
       {
-      FD_SET(listen_sockets[sk], &select_listen);
-      if (listen_sockets[sk] > max_socket) max_socket = listen_sockets[sk];
+      int t = park_timeout();
+      if (timeout < 0 || t < timeout) timeout = t;
       }
 
     DEBUG(D_any) debug_printf("Listening...\n");
 
-    /* In rare cases we may have had a SIGCHLD signal in the time between
-    setting the handler (below) and getting back here. If so, pretend that the
-    select() was interrupted so that we reap the child. This might still leave
-    a small window when a SIGCHLD could get lost. However, since we use SIGCHLD
-    only to do the reaping more quickly, it shouldn't result in anything other
-    than a delay until something else causes a wake-up. */
+    /* We may have had a SIGCHLD signal in the time between setting the handler
+    (below) and getting back here. If so, pretend that the wait was interrupted
+    so that we reap the child. One arriving after this test is not lost: the
+    handler writes to the wake pipe, which ends the wait. */
 
     if (sigchld_seen)
       {
@@ -2300,121 +4784,102 @@ for (;;)
       errno = EINTR;
       }
     else
-      lcount = select(max_socket + 1, (SELECT_ARG2_TYPE *)&select_listen,
-        NULL, NULL, NULL);
+      lcount = daemon_wait(wait_fds, wait_ready, nfds, timeout);
 
-    if (lcount < 0)
-      {
-      select_failed = TRUE;
-      lcount = 1;
-      }
+    if (lcount < 0) select_failed = TRUE;
 
     /* Clean up any subprocesses that may have terminated. We need to do this
     here so that smtp_accept_max_per_host works when a connection to that host
     has completed, and we are about to accept a new one. When this code was
     later in the sequence, a new connection could be rejected, even though an
-    old one had just finished. Preserve the errno from any select() failure for
-    the use of the common select/accept error processing below. */
+    old one had just finished. Preserve the errno from any wait failure for
+    the use of the common error processing below. */
 
     select_errno = errno;
     handle_ending_processes();
     errno = select_errno;
 
 #ifndef DISABLE_TLS
-    /* Create or rotate any required keys */
+    /* Create or rotate any required keys, and refresh any preloaded server
+    contexts */
     tls_daemon_init();
+    if (tls_server_preload_check()) prefork_stop();
+# ifndef DISABLE_OCSP
+    ocsp_refresh_check();
+# endif
 #endif
 
-    /* Loop for all the sockets that are currently ready to go. If select
-    actually failed, we have set the count to 1 and select_failed=TRUE, so as
-    to use the common error code for select/accept below. */
-
-    while (lcount-- > 0)
+    if (select_failed)
       {
-      int accept_socket = -1;
+      if (errno != EINTR) accept_failed(errno, TRUE);
+      }
 
-      if (!select_failed)
+    /* Empty the wake pipe; its signal has already been dealt with or will be
+    below. A notification can start a queue run, which is done at the top of
+    the loop. */
+
+    else
+      {
+      if (wait_ready[0])
 	{
-	if (  daemon_notifier_fd >= 0
-	   && FD_ISSET(daemon_notifier_fd, &select_listen))
-	  {
-	  FD_CLR(daemon_notifier_fd, &select_listen);
-	  sigalrm_seen = daemon_notification();
-	  break;	/* to top of daemon loop */
-	  }
-        for (int sk = 0; sk < listen_socket_count; sk++)
-          if (FD_ISSET(listen_sockets[sk], &select_listen))
-            {
-            len = sizeof(accepted);
-            accept_socket = accept(listen_sockets[sk],
-              (struct sockaddr *)&accepted, &len);
-            FD_CLR(listen_sockets[sk], &select_listen);
-            break;
-            }
+	uschar buf[64];
+	while (read(daemon_wake_pipe[0], buf, sizeof(buf)) > 0) ;
 	}
+      if (wait_ready[1])
+	sigalrm_seen = daemon_notification();
+
+      /* Take up to a batch of connections from each socket that is ready, so
+      that a busy listener does not need a wait for every connection, but
+      cannot keep the others or the signals waiting for long. The sockets are
+      non-blocking, so accept() stops when there are no more. */
+
+      for (int sk = 0; sk < listen_socket_count && !sigalrm_seen; sk++)
+	if (!prefork_slots && wait_ready[2 + sk])
+	  for (int n = 0;
+	       n < DAEMON_ACCEPT_BATCH && !sighup_seen && !sigterm_seen; n++)
+	    {
+	    int accept_socket;
 
-      /* If select or accept has failed and this was not caused by an
-      interruption, log the incident and try again. With asymmetric TCP/IP
-      routing errors such as "No route to network" have been seen here. Also
-      "connection reset by peer" has been seen. These cannot be classed as
-      disastrous errors, but they could fill up a lot of log. The code in smail
-      crashes the daemon after 10 successive failures of accept, on the grounds
-      that some OS fail continuously. Exim originally followed suit, but this
-      appears to have caused problems. Now it just keeps going, but instead of
-      logging each error, it batches them up when they are continuous. */
-
-      if (accept_socket < 0 && errno != EINTR)
-        {
-        if (accept_retry_count == 0)
-          {
-          accept_retry_errno = errno;
-          accept_retry_select_failed = select_failed;
-          }
-        else
-          {
-          if (errno != accept_retry_errno ||
-              select_failed != accept_retry_select_failed ||
-              accept_retry_count >= 50)
-            {
-            log_write(0, LOG_MAIN | ((accept_retry_count >= 50)? LOG_PANIC : 0),
-              "%d %s() failure%s: %s",
-              accept_retry_count,
-              accept_retry_select_failed? "select" : "accept",
-              (accept_retry_count == 1)? "" : "s",
-              strerror(accept_retry_errno));
-            log_close_all();
-            accept_retry_count = 0;
-            accept_retry_errno = errno;
-            accept_retry_select_failed = select_failed;
-            }
-          }
-        accept_retry_count++;
-        }
+	    len = sizeof(accepted);
+	    if ((accept_socket = accept(listen_sockets[sk],
+		  (struct sockaddr *)&accepted, &len)) < 0)
+	      {
+	      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		accept_failed(errno, FALSE);
+	      break;
+	      }
+	    accept_succeeded();
+	    if (listen_accepts && sk < listen_metrics_count)
+	      (void) __sync_fetch_and_add(&listen_accepts[sk], 1);
 
-      else
-        {
-        if (accept_retry_count > 0)
-          {
-          log_write(0, LOG_MAIN, "%d %s() failure%s: %s",
-            accept_retry_count,
-            accept_retry_select_failed? "select" : "accept",
-            (accept_retry_count == 1)? "" : "s",
-            strerror(accept_retry_errno));
-          log_close_all();
-          accept_retry_count = 0;
-          }
-        }
+	    /* Some systems pass on the non-blocking flag to the accepted
+	    socket */
 
-      /* If select/accept succeeded, deal with the connection. */
+	    (void) fcntl(accept_socket, F_SETFL,
+			fcntl(accept_socket, F_GETFL) & ~O_NONBLOCK);
 
-      if (accept_socket >= 0)
-        {
-        if (inetd_wait_timeout)
-          last_connection_time = time(NULL);
-        handle_smtp_call(listen_sockets, listen_socket_count, accept_socket,
-          (struct sockaddr *)&accepted);
-        }
+	    if (inetd_wait_timeout)
+	      last_connection_time = time(NULL);
+	    handle_smtp_call(listen_sockets, listen_socket_count, accept_socket,
+	      (struct sockaddr *)&accepted);
+
+	    /* Reap finished children as we go, for the benefit of the
+	    connection limits */
+
+	    if (sigchld_seen)
+	      {
+	      handle_ending_processes();
+	      sigchld_seen = FALSE;
+	      os_non_restarting_signal(SIGCHLD, main_sigchld_handler);
+	      }
+	    }
       }
+
+    if (qrunners && !select_failed)
+      qrunner_service(wait_ready + qrunner_base);
+    if (parked_count && !sighup_seen && !sigterm_seen)
+      park_service(select_failed ? NULL : wait_ready + park_base, park_waited,
+	listen_sockets, listen_socket_count);
     }
 
   /* If not listening, then just sleep for the queue interval. If we woke
@@ -2427,9 +4892,23 @@ for (;;)
   else
     {
     struct timeval tv;
-    tv.tv_sec = queue_interval;
+    BOOL respawn = lookup_proxy_pids && lookup_proxy_spawn();
+
+    if (conn_cache_fd >= 0 && conn_cache_spawn()) respawn = TRUE;
+    if (qrunners && qrunner_spawn(NULL, 0)) respawn = TRUE;
+    tv.tv_sec = respawn ? 1 : queue_interval;
     tv.tv_usec = 0;
-    select(0, NULL, NULL, NULL, &tv);
+
+    /* Persistent queue runners report on their sockets when they finish */
+
+    if (qrunners)
+      {
+      int n = qrunner_wait_fds(wait_fds);
+      if (daemon_wait(wait_fds, wait_ready, n, tv.tv_sec * 1000) > 0)
+	qrunner_service(wait_ready);
+      }
+    else
+      select(0, NULL, NULL, NULL, &tv);
     handle_ending_processes();
     }
 
@@ -2454,6 +4933,9 @@ for (;;)
     {
     log_write(0, LOG_MAIN, "pid %d: SIGHUP received: re-exec daemon",
       getpid());
+    prefork_stop();
+    lookup_proxy_stop();
+    conn_cache_stop();
     close_daemon_sockets(daemon_notifier_fd,
       listen_sockets, listen_socket_count);
     ALARM_CLR(0);
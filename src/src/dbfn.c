@@ -26,10 +26,24 @@ sequentially.
 
 Synchronization is required on the database files, and this is achieved by
 means of locking on independent lock files. (Earlier attempts to lock on the
-DBM files themselves were never completely successful.) Since callers may in
+DBM files themselves were never completely successful.) The exception is LMDB,
+which has its own locking that does not make readers wait. Since callers may in
 general want to do more than one read or write while holding the lock, there
 are separate open and close functions. However, the calling modules should
-arrange to hold the locks for the bare minimum of time. */
+arrange to hold the locks for the bare minimum of time.
+
+If hints_db_shards is set greater than one, the databases whose records are
+independent of each other are each split into that many files, named by adding
+".<n>" to the database name, and a record lives in the file chosen by a hash of
+its key. Each file has its own lock, so processes using different keys do not
+wait for each other. The wait-<transport> databases are not split, because
+their records are chained together.
+
+If hints_shared_server is set, the databases named in hints_shared_databases
+are also kept on a server that speaks the Redis protocol, so that a cluster of
+hosts can share them; see the functions below. The wait-<transport> databases
+cannot be shared, for the same reason that they are not split, and nor can
+"misc", whose serialization counts belong to one host. */
 
 
 
@@ -86,13 +100,16 @@ this in December 2005, I'm not sure if this is correct or not, but for the
 moment I haven't changed them.
 */
 
-open_db *
-dbfn_open(uschar *name, int flags, open_db *dbblock, BOOL lof, BOOL panic)
+static open_db *
+dbfn_open_file(uschar *name, int flags, open_db *dbblock, BOOL lof, BOOL panic)
 {
-int rc, save_errno;
-BOOL read_only = flags == O_RDONLY;
+int save_errno;
 BOOL created = FALSE;
+#ifndef USE_LMDB
+int rc;
+BOOL read_only = flags == O_RDONLY;
 flock_t lock_data;
+#endif
 uschar dirname[256], filename[256];
 
 DEBUG(D_hints_lookup) acl_level++;
@@ -111,6 +128,14 @@ unnecessarily, because usually the lock file will be there. If the directory
 exists, there is no error. */
 
 snprintf(CS dirname, sizeof(dirname), "%s/db", spool_directory);
+
+#ifdef USE_LMDB
+/* LMDB does its own locking, in which readers never wait and writers wait only
+for each other, so there is no lock file. */
+
+dbblock->lockfd = -1;
+
+#else
 snprintf(CS filename, sizeof(filename), "%s/%s.lockfile", dirname, name);
 
 if ((dbblock->lockfd = Uopen(filename, O_RDWR, EXIMDB_LOCKFILE_MODE)) < 0)
@@ -156,6 +181,7 @@ if (rc < 0)
   }
 
 DEBUG(D_hints_lookup) debug_printf_indent("locked  %s\n", filename);
+#endif	/*!USE_LMDB*/
 
 /* At this point we have an opened and locked separate lock file, that is,
 exclusive access to the database, so we can go ahead and open it. If we are
@@ -174,6 +200,9 @@ if (!dbblock->dbptr && errno == ENOENT && flags == O_RDWR)
   DEBUG(D_hints_lookup)
     debug_printf_indent("%s appears not to exist: trying to create\n", filename);
   created = TRUE;
+#ifdef USE_LMDB
+  (void)directory_make(spool_directory, US"db", EXIMDB_DIRECTORY_MODE, panic);
+#endif
   EXIM_DBOPEN(filename, dirname, flags|O_CREAT, EXIMDB_MODE, &(dbblock->dbptr));
   }
 
@@ -236,7 +265,7 @@ if (!dbblock->dbptr)
     DEBUG(D_hints_lookup)
       debug_printf_indent("%s\n", CS string_open_failed("DB file %s",
           filename));
-  (void)close(dbblock->lockfd);
+  if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
   errno = save_errno;
   DEBUG(D_hints_lookup) acl_level--;
   return NULL;
@@ -258,12 +287,331 @@ return dbblock;
 
 
 
+/*************************************************
+*          Hints shared with other hosts         *
+*************************************************/
+
+/* The local file acts as a cache for a shared database. A local record that
+was written less than hints_shared_ttl ago is used as it is; otherwise the
+server's copy is fetched, and used (and stored locally) if it is newer. The
+changes made while a database is open are collected and sent to the server in
+one batch when it is closed. Records are stored on the server under
+"exim:<database>:<key>" exactly as they are in the files, so all the hosts
+must have the same architecture. If the server cannot be used, the hints are
+kept locally only for the rest of the process.
+
+The connection is kept open for the life of the process; a process that
+inherits one makes its own, so that replies are not shared. */
+
+#define SHARED_TIMEOUT 5
+
+/* The largest reply accepted from the server. Shared records are at most a
+few hundred bytes, apart from lookup results (up to 4096 bytes of data and
+400 of key, in "lookup"); anything much bigger than that is not a record of
+ours. */
+
+#define SHARED_DATA_MAX (16 * 1024)
+
+static int    shared_fd = -1;
+static pid_t  shared_pid = 0;
+static BOOL   shared_down = FALSE;
+static uschar shared_buf[4096];
+static int    shared_len = 0;
+static int    shared_off = 0;
+
+
+static void
+shared_fail(const uschar * why)
+{
+log_write(0, LOG_MAIN, "hints_shared_server %s: %s: using local hints only",
+  hints_shared_server, why);
+if (shared_fd >= 0) (void)close(shared_fd);
+shared_fd = -1;
+shared_down = TRUE;
+}
+
+
+static BOOL
+shared_connect(void)
+{
+uschar * errstr;
+uschar * save_address = callout_address;
+
+if (shared_down) return FALSE;
+if (shared_fd >= 0)
+  {
+  if (shared_pid == getpid()) return TRUE;
+  (void)close(shared_fd);
+  }
+
+shared_fd = ip_streamsocket(hints_shared_server, &errstr, SHARED_TIMEOUT, NULL);
+callout_address = save_address;
+if (shared_fd < 0)
+  {
+  shared_fail(errstr);
+  return FALSE;
+  }
+(void)fcntl(shared_fd, F_SETFD, fcntl(shared_fd, F_GETFD) | FD_CLOEXEC);
+shared_pid = getpid();
+shared_len = shared_off = 0;
+DEBUG(D_hints_lookup)
+  debug_printf_indent("connected to hints server %s\n", hints_shared_server);
+return TRUE;
+}
+
+
+static int
+shared_getc(time_t limit)
+{
+if (shared_off >= shared_len)
+  {
+  if (!fd_ready(shared_fd, limit)) return -1;
+  if ((shared_len = read(shared_fd, shared_buf, sizeof(shared_buf))) <= 0)
+    return -1;
+  shared_off = 0;
+  }
+return shared_buf[shared_off++];
+}
+
+
+/* Read one reply from the server.
+
+Arguments:
+  data      where to return the data of a bulk string reply (NULL for a null
+            reply or one of another type), or NULL if it is not wanted
+  length    where to return the length of the data
+
+Returns:    the type character of the reply, or -1 on failure
+*/
+
+static int
+shared_reply(uschar ** data, int * length)
+{
+time_t limit = time(NULL) + SHARED_TIMEOUT;
+uschar line[64];
+int type, c, n = 0;
+
+if (data) *data = NULL;
+if ((type = shared_getc(limit)) < 0) return -1;
+while ((c = shared_getc(limit)) != '\n')
+  {
+  if (c < 0) return -1;
+  if (n < sizeof(line) - 1) line[n++] = c;
+  }
+if (n > 0 && line[n-1] == '\r') n--;
+line[n] = '\0';
+
+if (type == '-')
+  DEBUG(D_hints_lookup) debug_printf_indent("hints server error: %s\n", line);
+
+if (type == '$' && (n = atoi(CS line)) >= 0)
+  {
+  uschar * s;
+
+  if (n > SHARED_DATA_MAX)
+    {
+    DEBUG(D_hints_lookup)
+      debug_printf_indent("hints server reply too long: %d bytes\n", n);
+    return -1;
+    }
+  s = store_get(n + 2, TRUE);			/* data and CRLF */
+  for (int i = 0; i < n + 2; i++)
+    if ((c = shared_getc(limit)) < 0) return -1; else s[i] = c;
+  if (data)
+    {
+    *data = s;
+    *length = n;
+    }
+  }
+return type;
+}
+
+
+static gstring *
+shared_arg(gstring * g, const uschar * s, int len)
+{
+g = string_fmt_append(g, "$%d\r\n", len);
+g = string_catn(g, s, len);
+return string_catn(g, US"\r\n", 2);
+}
+
+
+static gstring *
+shared_key(gstring * g, const open_db * dbblock, const uschar * key)
+{
+const uschar * k = string_sprintf("%s%s", dbblock->shared, key);
+return shared_arg(g, k, Ustrlen(k));
+}
+
+
+static BOOL
+shared_send(const gstring * g)
+{
+for (int off = 0, n; off < g->ptr; off += n)
+  if ((n = write(shared_fd, g->s + off, g->ptr - off)) <= 0)
+    return FALSE;
+return TRUE;
+}
+
+
+/* Fetch a record from the server. Returns NULL if there is none, or it is too
+short to be a record. */
+
+static void *
+shared_get(const open_db * dbblock, const uschar * key, int * length)
+{
+gstring * g;
+uschar * data;
+
+if (!shared_connect()) return NULL;
+g = string_catn(NULL, US"*2\r\n", 4);
+g = shared_arg(g, US"GET", 3);
+g = shared_key(g, dbblock, key);
+if (!shared_send(g) || shared_reply(&data, length) < 0)
+  {
+  shared_fail(US"lost connection");
+  return NULL;
+  }
+return data && *length >= sizeof(dbdata_generic) ? data : NULL;
+}
+
+
+/* Send the changes that were collected while a database was open, and wait
+for the server to acknowledge them. */
+
+static void
+shared_flush(open_db * dbblock)
+{
+if (shared_connect())
+  {
+  DEBUG(D_hints_lookup)
+    debug_printf_indent("sending %d changes to hints server\n",
+      dbblock->npending);
+  if (!shared_send(dbblock->pending))
+    shared_fail(US"lost connection");
+  else
+    for (int n = dbblock->npending; n > 0; n--)
+      if (shared_reply(NULL, NULL) < 0)
+	{
+	shared_fail(US"lost connection");
+	break;
+	}
+  }
+dbblock->pending = NULL;
+dbblock->npending = 0;
+}
+
+
+
+/* For a database that is split into shards, just record what is needed for
+opening a shard when the first key is seen; otherwise open and lock the file
+at once. The arguments and results are as for dbfn_open_file() above, except
+that a sharded database always yields success. */
+
+open_db *
+dbfn_open(uschar *name, int flags, open_db *dbblock, BOOL lof, BOOL panic)
+{
+dbblock->shard = -1;
+dbblock->name = NULL;
+dbblock->flags = flags;
+dbblock->shared = NULL;
+dbblock->pending = NULL;
+dbblock->npending = 0;
+
+if (  hints_shared_server && !shared_down
+   && Ustrncmp(name, "wait-", 5) != 0 && Ustrcmp(name, "misc") != 0)
+  {
+  const uschar * list = hints_shared_databases;
+  if (match_isinlist(name, &list, 0, NULL, NULL, MCL_STRING, TRUE, NULL) == OK)
+    dbblock->shared = string_sprintf("exim:%s:", name);
+  }
+
+if (hints_db_shards > 1 && Ustrncmp(name, "wait-", 5) != 0)
+  {
+  dbblock->dbptr = NULL;
+  dbblock->lockfd = -1;
+  dbblock->name = string_copy_perm(name, FALSE);
+  dbblock->lof = lof;
+  dbblock->panic = panic;
+  DEBUG(D_hints_lookup)
+    debug_printf_indent("hints database %s is split into %d shards\n",
+      name, hints_db_shards);
+  return dbblock;
+  }
+
+return dbfn_open_file(name, flags, dbblock, lof, panic);
+}
+
+
+
+/*************************************************
+*          Select the shard for a key            *
+*************************************************/
+
+/* For a sharded database, make sure that the given shard is the one that is
+open, closing (and so unlocking) any other first.
+
+Arguments:
+  dbblock   a pointer to an open database block
+  shard     the shard that is wanted
+
+Returns:    the DBM handle, or NULL if the shard could not be opened
+*/
+
+static EXIM_DB *
+dbfn_shard_open(open_db * dbblock, int shard)
+{
+uschar sname[256];
+
+if (dbblock->shard == shard) return dbblock->dbptr;
+if (dbblock->shard >= 0)
+  {
+  EXIM_DBCLOSE(dbblock->dbptr);
+  if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
+  DEBUG(D_hints_lookup) acl_level--;
+  dbblock->shard = -1;
+  }
+
+snprintf(CS sname, sizeof(sname), "%s.%d", dbblock->name, shard);
+if (!dbfn_open_file(sname, dbblock->flags, dbblock, dbblock->lof, dbblock->panic))
+  {
+  dbblock->dbptr = NULL;
+  return NULL;
+  }
+dbblock->shard = shard;
+return dbblock->dbptr;
+}
+
+
+/* Find the DBM handle for a key. For a database that is not sharded, this is
+the one that is already open.
+
+Arguments:
+  dbblock   a pointer to an open database block
+  key       the key of a record
+
+Returns:    the DBM handle, or NULL if the shard could not be opened
+*/
+
+static EXIM_DB *
+dbfn_db(open_db * dbblock, const uschar * key)
+{
+unsigned h = 2166136261u;			/* FNV-1a */
+
+if (!dbblock->name) return dbblock->dbptr;
+for (const uschar * s = key; *s; s++) h = (h ^ *s) * 16777619u;
+return dbfn_shard_open(dbblock, (int)(h % (unsigned)hints_db_shards));
+}
+
+
+
+
 /*************************************************
 *         Unlock and close a database file       *
 *************************************************/
 
 /* Closing a file automatically unlocks it, so after closing the database, just
-close the lock file.
+close the lock file. Then send any changes to a shared database to the server.
 
 Argument: a pointer to an open database block
 Returns:  nothing
@@ -272,10 +620,14 @@ Returns:  nothing
 void
 dbfn_close(open_db *dbblock)
 {
-EXIM_DBCLOSE(dbblock->dbptr);
-(void)close(dbblock->lockfd);
-DEBUG(D_hints_lookup)
-  { debug_printf_indent("closed hints database and lockfile\n"); acl_level--; }
+if (!dbblock->name || dbblock->shard >= 0)
+  {
+  EXIM_DBCLOSE(dbblock->dbptr);
+  if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
+  DEBUG(D_hints_lookup)
+    { debug_printf_indent("closed hints database and lockfile\n"); acl_level--; }
+  }
+if (dbblock->pending) shared_flush(dbblock);
 }
 
 
@@ -300,13 +652,18 @@ Arguments:
 
 Returns: a pointer to the retrieved record, or
          NULL if the record is not found
+
+For a shared database, a copy from the server is used instead of the local
+record if that is stale and the server's copy is newer.
 */
 
 void *
 dbfn_read_with_length(open_db *dbblock, const uschar *key, int *length)
 {
-void *yield;
+void *yield = NULL;
+EXIM_DB * db = dbfn_db(dbblock, key);
 EXIM_DATUM key_datum, result_datum;
+int ylen = 0;
 int klen = Ustrlen(key) + 1;
 uschar * key_copy = store_get(klen, is_tainted(key));
 
@@ -319,16 +676,42 @@ EXIM_DATUM_INIT(result_datum);      /* to be cleared before use. */
 EXIM_DATUM_DATA(key_datum) = CS key_copy;
 EXIM_DATUM_SIZE(key_datum) = klen;
 
-if (!EXIM_DBGET(dbblock->dbptr, key_datum, result_datum)) return NULL;
-
 /* Assume the data store could have been tainted.  Properly, we should
 store the taint status with the data. */
 
-yield = store_get(EXIM_DATUM_SIZE(result_datum), TRUE);
-memcpy(yield, EXIM_DATUM_DATA(result_datum), EXIM_DATUM_SIZE(result_datum));
-if (length != NULL) *length = EXIM_DATUM_SIZE(result_datum);
+if (db && EXIM_DBGET(db, key_datum, result_datum))
+  {
+  ylen = EXIM_DATUM_SIZE(result_datum);
+  yield = store_get(ylen, TRUE);
+  memcpy(yield, EXIM_DATUM_DATA(result_datum), ylen);
+  EXIM_DATUM_FREE(result_datum);    /* Some DBM libs require freeing */
+  }
+
+if (  dbblock->shared
+   && (  !yield || ylen < sizeof(dbdata_generic)
+      || time(NULL) - ((dbdata_generic *)yield)->time_stamp >= hints_shared_ttl))
+  {
+  int rlen;
+  dbdata_generic * r = shared_get(dbblock, key, &rlen);
 
-EXIM_DATUM_FREE(result_datum);    /* Some DBM libs require freeing */
+  if (r && (!yield || r->time_stamp > ((dbdata_generic *)yield)->time_stamp))
+    {
+    DEBUG(D_hints_lookup)
+      debug_printf_indent("dbfn_read: using record from hints server\n");
+    if (db && (dbblock->flags & O_ACCMODE) != O_RDONLY)
+      {
+      EXIM_DATUM value_datum;
+      EXIM_DATUM_INIT(value_datum);
+      EXIM_DATUM_DATA(value_datum) = CS r;
+      EXIM_DATUM_SIZE(value_datum) = rlen;
+      (void) EXIM_DBPUT(db, key_datum, value_datum);
+      }
+    yield = r;
+    ylen = rlen;
+    }
+  }
+
+if (yield && length) *length = ylen;
 return yield;
 }
 
@@ -352,6 +735,7 @@ Returns:    the yield of the underlying dbm or db "write" function. If this
 int
 dbfn_write(open_db *dbblock, const uschar *key, void *ptr, int length)
 {
+EXIM_DB * db = dbfn_db(dbblock, key);
 EXIM_DATUM key_datum, value_datum;
 dbdata_generic *gptr = (dbdata_generic *)ptr;
 int klen = Ustrlen(key) + 1;
@@ -362,13 +746,26 @@ gptr->time_stamp = time(NULL);
 
 DEBUG(D_hints_lookup) debug_printf_indent("dbfn_write: key=%s\n", key);
 
+if (dbblock->shared)
+  {
+  gstring * g = string_catn(dbblock->pending, US"*5\r\n", 4);
+  const uschar * expire = string_sprintf("%d", retry_data_expire);
+
+  g = shared_arg(g, US"SET", 3);
+  g = shared_key(g, dbblock, key);
+  g = shared_arg(g, ptr, length);
+  g = shared_arg(g, US"EX", 2);
+  dbblock->pending = shared_arg(g, expire, Ustrlen(expire));
+  dbblock->npending++;
+  }
+
 EXIM_DATUM_INIT(key_datum);         /* Some DBM libraries require the datum */
 EXIM_DATUM_INIT(value_datum);       /* to be cleared before use. */
 EXIM_DATUM_DATA(key_datum) = CS key_copy;
 EXIM_DATUM_SIZE(key_datum) = klen;
 EXIM_DATUM_DATA(value_datum) = CS ptr;
 EXIM_DATUM_SIZE(value_datum) = length;
-return EXIM_DBPUT(dbblock->dbptr, key_datum, value_datum);
+return db ? EXIM_DBPUT(db, key_datum, value_datum) : -1;
 }
 
 
@@ -388,17 +785,26 @@ Returns: the yield of the underlying dbm or db "delete" function.
 int
 dbfn_delete(open_db *dbblock, const uschar *key)
 {
+EXIM_DB * db = dbfn_db(dbblock, key);
 int klen = Ustrlen(key) + 1;
 uschar * key_copy = store_get(klen, is_tainted(key));
 
 DEBUG(D_hints_lookup) debug_printf_indent("dbfn_delete: key=%s\n", key);
 
+if (dbblock->shared)
+  {
+  gstring * g = string_catn(dbblock->pending, US"*2\r\n", 4);
+  g = shared_arg(g, US"DEL", 3);
+  dbblock->pending = shared_key(g, dbblock, key);
+  dbblock->npending++;
+  }
+
 memcpy(key_copy, key, klen);
 EXIM_DATUM key_datum;
 EXIM_DATUM_INIT(key_datum);         /* Some DBM libraries require clearing */
 EXIM_DATUM_DATA(key_datum) = CS key_copy;
 EXIM_DATUM_SIZE(key_datum) = klen;
-return EXIM_DBDEL(dbblock->dbptr, key_datum);
+return db ? EXIM_DBDEL(db, key_datum) : -1;
 }
 
 
@@ -417,33 +823,294 @@ Arguments:
 
 Returns:   the next record from the file, or
            NULL if there are no more
+
+For a sharded database, the shards are scanned in turn. The shard being
+scanned is the open one, so a record can be read using the key just returned.
 */
 
 uschar *
 dbfn_scan(open_db *dbblock, BOOL start, EXIM_CURSOR **cursor)
 {
 EXIM_DATUM key_datum, value_datum;
+EXIM_DB * db = dbblock->dbptr;
+int shard = start ? 0 : dbblock->shard;
 uschar *yield;
 
 DEBUG(D_hints_lookup) debug_printf_indent("dbfn_scan\n");
 
-/* Some dbm require an initialization */
+for (;;)
+  {
+  if (dbblock->name && !(db = dbfn_shard_open(dbblock, shard)))
+    yield = NULL;
+  else
+    {
+    /* Some dbm require an initialization */
 
-if (start) EXIM_DBCREATE_CURSOR(dbblock->dbptr, cursor);
+    if (start) EXIM_DBCREATE_CURSOR(db, cursor);
 
-EXIM_DATUM_INIT(key_datum);         /* Some DBM libraries require the datum */
-EXIM_DATUM_INIT(value_datum);       /* to be cleared before use. */
+    EXIM_DATUM_INIT(key_datum);         /* Some DBM libraries require the datum */
+    EXIM_DATUM_INIT(value_datum);       /* to be cleared before use. */
 
-yield = (EXIM_DBSCAN(dbblock->dbptr, key_datum, value_datum, start, *cursor))?
-  US EXIM_DATUM_DATA(key_datum) : NULL;
+    yield = (EXIM_DBSCAN(db, key_datum, value_datum, start, *cursor))?
+      US EXIM_DATUM_DATA(key_datum) : NULL;
 
-/* Some dbm require a termination */
+    /* Some dbm require a termination */
 
-if (!yield) EXIM_DBDELETE_CURSOR(*cursor);
-return yield;
+    if (!yield) EXIM_DBDELETE_CURSOR(*cursor);
+    }
+
+  if (yield || !dbblock->name || ++shard >= hints_db_shards) return yield;
+  start = TRUE;
+  }
+}
+
+
+
+
+/*************************************************
+*        Map a shared table in the hints dir     *
+*************************************************/
+
+/* Several caches are files in the hints directory which every process maps
+shared. Each begins with a dbfn_shared_header holding a magic number, the
+number of slots, and the sizes of the whole header and of a slot, and each slot
+begins with a dbfn_shared_slot. The file name has the number of slots appended, so that
+processes running with different settings of the option that sizes the table
+use different files, and a new setting starts a new file.
+
+A file which is in use is never truncated or rewritten in place, because other
+processes may have it mapped, and would fault on pages beyond a new end, or
+index past it. Instead, a new file is built complete under a temporary name and
+then linked into place (if there is none) or renamed over the one that is
+unusable. Processes that have the old one mapped keep an intact copy until they
+go away. Failure is not an error; there is just no sharing in this process.
+
+Arguments:
+  name      the base name of the file, within the db directory
+  magic     the magic number identifying the layout
+  slots     the number of slots
+  hsize     the size of the header
+  ssize     the size of a slot
+
+Returns:    the mapping, or NULL if it is not available
+*/
+
+void *
+dbfn_map_shared(const uschar * name, unsigned magic, unsigned slots,
+  size_t hsize, size_t ssize)
+{
+uschar * fname = string_sprintf("%s/db/%s.%u", spool_directory, name, slots);
+uschar * tname;
+size_t size = hsize + (size_t)slots * ssize;
+struct stat statbuf;
+BOOL exists;
+int fd, save_errno;
+void * map;
+
+for (int tries = 0; tries < 2; tries++)
+  {
+  dbfn_shared_header * h;
+
+  if ((fd = Uopen(fname, O_RDWR, 0)) >= 0)
+    {
+    map = fstat(fd, &statbuf) == 0 && statbuf.st_size == size
+      ? mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    (void)close(fd);
+    if (map != MAP_FAILED)
+      {
+      h = map;
+      if (  h->magic == magic && h->slots == slots
+	 && h->header_size == hsize && h->slot_size == ssize)
+	return map;
+      (void)munmap(map, size);
+      }
+    DEBUG(D_hints_lookup) debug_printf("%s: not usable: replacing\n", fname);
+    exists = TRUE;
+    }
+  else if (errno == ENOENT)
+    exists = FALSE;
+  else
+    {
+    DEBUG(D_hints_lookup) debug_printf("%s: open: %s\n", fname, strerror(errno));
+    return NULL;
+    }
+
+  /* Build a new file, zero-filled apart from its header */
+
+  tname = string_sprintf("%s.%d", fname, (int)getpid());
+  (void)Uunlink(tname);
+  if (  (fd = Uopen(tname, O_RDWR|O_CREAT|O_EXCL, EXIMDB_MODE)) < 0
+     && errno == ENOENT)
+    {
+    (void)directory_make(spool_directory, US"db", EXIMDB_DIRECTORY_MODE, FALSE);
+    fd = Uopen(tname, O_RDWR|O_CREAT|O_EXCL, EXIMDB_MODE);
+    }
+  if (fd < 0)
+    {
+    DEBUG(D_hints_lookup) debug_printf("%s: open: %s\n", tname, strerror(errno));
+    return NULL;
+    }
+  if (getuid() == root_uid) (void) exim_fchown(fd, exim_uid, exim_gid, tname);
+  map = ftruncate(fd, size) == 0
+    ? mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  (void)close(fd);
+  if (map == MAP_FAILED)
+    {
+    DEBUG(D_hints_lookup) debug_printf("%s: %s\n", tname, strerror(errno));
+    (void)Uunlink(tname);
+    return NULL;
+    }
+  h = map;
+  h->slots = slots;
+  h->header_size = hsize;
+  h->slot_size = ssize;
+  h->magic = magic;
+
+  /* If another process has put a file in place meanwhile, use that one */
+
+  if ((exists ? Urename(tname, fname) : Ulink(tname, fname)) == 0)
+    {
+    if (!exists) (void)Uunlink(tname);
+    return map;
+    }
+  save_errno = errno;
+  DEBUG(D_hints_lookup)
+    debug_printf("%s: install: %s\n", fname, strerror(save_errno));
+  (void)munmap(map, size);
+  (void)Uunlink(tname);
+  if (save_errno != EEXIST) return NULL;
+  }
+return NULL;
+}
+
+
+
+/*************************************************
+*     Find and update slots in a shared table    *
+*************************************************/
+
+/* A table is indexed by a hash of the key, with a little linear probing;
+dbfn_slot_n() gives the slot for one probe. Each slot is written under its
+sequence word. A writer claims the slot by compare-and-swap of an even count
+to the next odd one, writes, and releases it by making the count even again.
+A reader takes the word before reading and checks it is unchanged afterwards,
+treating a slot that was being written, or was rewritten meanwhile, as a miss.
+
+A writer that is killed part way through leaves the count odd. Once that has
+lasted DBFN_SLOT_STALE seconds, the next writer takes the slot over and
+overwrites whatever it held; readers have been ignoring it all the while. */
+
+#define DBFN_SLOT_STALE	10
+
+/*
+Arguments:
+  table     the mapping returned by dbfn_map_shared()
+  hash      the hash of the key
+  probe     the probe number, counting from zero
+
+Returns:    the slot
+*/
+
+void *
+dbfn_slot_n(void * table, unsigned hash, int probe)
+{
+dbfn_shared_header * h = table;
+return US table + h->header_size
+  + (size_t)((hash + probe) % h->slots) * h->slot_size;
+}
+
+
+/* Claim a slot for writing. A slot that another process is writing is tried
+again, up to a limit; callers that can simply skip the write give a limit of
+one.
+
+Arguments:
+  s         the slot
+  tries     the number of attempts to make
+  seqp      where to put the sequence word, for dbfn_slot_release()
+
+Returns:    TRUE if the slot is claimed
+*/
+
+BOOL
+dbfn_slot_claim(dbfn_shared_slot * s, int tries, uint64_t * seqp)
+{
+uint64_t now = (uint64_t)time(NULL) << 32;
+
+while (tries-- > 0)
+  {
+  uint64_t seq = s->seq, new;
+
+  if (!(seq & 1))
+    new = now | ((seq + 1) & 0xffffffff);
+  else if (now >> 32 > (seq >> 32) + DBFN_SLOT_STALE)
+    {
+    DEBUG(D_hints_lookup) debug_printf("taking over stale shared slot\n");
+    new = now | ((seq + 2) & 0xffffffff);
+    }
+  else
+    continue;
+
+  if (__sync_bool_compare_and_swap(&s->seq, seq, new))
+    {
+    *seqp = new;
+    return TRUE;
+    }
+  }
+return FALSE;
 }
 
 
+/* Release a claimed slot. If it was taken over meanwhile, because this
+process took too long, it is left to the new writer.
+
+Arguments:
+  s         the slot
+  seq       the sequence word from dbfn_slot_claim()
+*/
+
+void
+dbfn_slot_release(dbfn_shared_slot * s, uint64_t seq)
+{
+__sync_synchronize();
+(void) __sync_bool_compare_and_swap(&s->seq, seq,
+  (seq & ~(uint64_t)0xffffffff) | ((seq + 1) & 0xffffffff));
+}
+
+
+/* Start reading a slot.
+
+Arguments:
+  s         the slot
+  seqp      where to put the sequence word, for dbfn_slot_read_end()
+
+Returns:    FALSE if the slot is being written
+*/
+
+BOOL
+dbfn_slot_read_begin(const dbfn_shared_slot * s, uint64_t * seqp)
+{
+if ((*seqp = s->seq) & 1) return FALSE;
+__sync_synchronize();
+return TRUE;
+}
+
+
+/* Finish reading a slot.
+
+Arguments:
+  s         the slot
+  seq       the sequence word from dbfn_slot_read_begin()
+
+Returns:    TRUE if what was read is consistent
+*/
+
+BOOL
+dbfn_slot_read_end(const dbfn_shared_slot * s, uint64_t seq)
+{
+__sync_synchronize();
+return s->seq == seq;
+}
 
 /*************************************************
 **************************************************
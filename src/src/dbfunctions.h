@@ -8,11 +8,35 @@
 
 /* Functions for reading/writing exim database files */
 
+/* The start of the header of each table mapped by dbfn_map_shared() */
+
+typedef struct {
+  unsigned	magic;
+  unsigned	slots;
+  unsigned	header_size;		/* bytes before the first slot */
+  unsigned	slot_size;
+} dbfn_shared_header;
+
+/* The start of each slot in such a table. The low half of the sequence word
+counts writes, and is odd while the slot is being written; the high half is
+the time at which the latest write began. */
+
+typedef struct {
+  volatile uint64_t	seq;
+  volatile unsigned	hash;
+} dbfn_shared_slot;
+
 void     dbfn_close(open_db *);
 int      dbfn_delete(open_db *, const uschar *);
+void    *dbfn_map_shared(const uschar *, unsigned, unsigned, size_t, size_t);
 open_db *dbfn_open(uschar *, int, open_db *, BOOL, BOOL);
 void    *dbfn_read_with_length(open_db *, const uschar *, int *);
 uschar  *dbfn_scan(open_db *, BOOL, EXIM_CURSOR **);
+BOOL     dbfn_slot_claim(dbfn_shared_slot *, int, uint64_t *);
+void    *dbfn_slot_n(void *, unsigned, int);
+BOOL     dbfn_slot_read_begin(const dbfn_shared_slot *, uint64_t *);
+BOOL     dbfn_slot_read_end(const dbfn_shared_slot *, uint64_t);
+void     dbfn_slot_release(dbfn_shared_slot *, uint64_t);
 int      dbfn_write(open_db *, const uschar *, void *, int);
 
 /* Macro for the common call to read without wanting to know the length. */
@@ -10,8 +10,9 @@
 libraries can be used by Exim. Nigel Metheringham provided the original set for
 Berkeley DB 1.x in native mode and ndbm. Subsequently, versions for Berkeley DB
 2.x and 3.x were added. Later still, support for tdb was added, courtesy of
-James Antill. Most recently, support for native mode gdbm was added, with code
-from Pierre A. Humblet, so Exim could be made to work with Cygwin.
+James Antill. Then support for native mode gdbm was added, with code from
+Pierre A. Humblet, so Exim could be made to work with Cygwin. Most recently,
+support for LMDB was added.
 
 For convenience, the definitions of the structures used in the various hints
 databases are also kept in this file, which is used by the maintenance
@@ -543,11 +544,342 @@ after reading data. */
 #define EXIM_DATUM_INIT(datum)
 #define EXIM_DATUM_FREE(datum) free(datum.dptr)
 
-#else  /* USE_GDBM */
+/********************* LMDB interface definitions **********************/
 
+#elif defined USE_LMDB
 
-/* If none of USE_DB, USG_GDBM, or USE_TDB are set, the default is the NDBM
-interface */
+/* LMDB is a memory-mapped B-tree store with multi-version concurrency
+control. Readers never block, and writers are serialized by LMDB itself, so no
+separate lock file is needed (see dbfn_open()). Every access is done inside a
+transaction, which is begun by the open and committed by the close.
+
+Setting up the environment (a mapping of the file) is the expensive part, so
+each process keeps the environments that it has opened, and reuses them for
+later opens of the same file. An environment must not be used after a fork, so
+the cache is keyed by process id as well as by file name, and the file's inode
+is compared on each open, in case it has been replaced (for example, by
+exim_dbmbuild). Nested opens for writing by one process share the same write
+transaction, just as nested fcntl() locks do not conflict.
+
+The map has a fixed size, which can only be changed when the process has no
+transaction running on it. It starts at EXIM_LMDB_MAPSIZE and is doubled when a
+write transaction is begun with it more than half full, or as soon as a write
+takes it more than half full if that can be done by committing the transaction
+so far and starting another. Another process that finds the map has been grown
+picks up the new size. If it fills none the less, the update fails, and the
+failure is logged. */
+
+#include <lmdb.h>
+
+#ifndef EXIM_LMDB_MAPSIZE
+# define EXIM_LMDB_MAPSIZE	(16 * 1024 * 1024)
+#endif
+
+typedef struct exim_lmdb_env {
+  struct exim_lmdb_env * next;
+  MDB_env *	env;
+  MDB_dbi	dbi;
+  pid_t		pid;
+  dev_t		dev;
+  ino_t		ino;
+  MDB_txn *	wtxn;		/* Current write transaction, if any */
+  int		wrefs;		/* and the opens that are sharing it */
+  int		rrefs;		/* Read transactions open */
+  BOOL		full;		/* A write failed for lack of room */
+  char		name[1];
+} exim_lmdb_env;
+
+/* Basic DB type */
+typedef struct {
+  exim_lmdb_env * e;
+  MDB_txn *	txn;
+  BOOL		write;
+  BOOL		scanned;	/* A cursor has been opened */
+} EXIM_DB;
+
+/* Cursor type */
+#define EXIM_CURSOR MDB_cursor
+
+/* The datum type used for queries */
+#define EXIM_DATUM MDB_val
+
+/* Some text for messages */
+#define EXIM_DBTYPE "lmdb"
+
+/* Double the size of the map if it is more than half used (or a write has
+failed for lack of room), counting the given number of pages in use if that is
+more than the file has. There must be no transaction running. */
+
+static inline void
+exim_lmdb_room(exim_lmdb_env * e, size_t pages)
+{
+MDB_envinfo info;
+MDB_stat st;
+size_t used, size;
+
+if (  mdb_env_info(e->env, &info) != MDB_SUCCESS
+   || mdb_env_stat(e->env, &st) != MDB_SUCCESS)
+  return;
+if ((used = info.me_last_pgno + 1) < pages) used = pages;
+used *= st.ms_psize;
+if (!e->full && used <= info.me_mapsize / 2) return;
+
+for (size = info.me_mapsize * 2; size < used * 2; ) size *= 2;
+if (mdb_env_set_mapsize(e->env, size) == MDB_SUCCESS)
+  e->full = FALSE;
+}
+
+/* Begin a transaction. If another process has grown the map, and there is no
+other transaction running, pick up the new size and try again. */
+
+static inline int
+exim_lmdb_begin(exim_lmdb_env * e, unsigned flags, MDB_txn ** txnp)
+{
+int rc;
+
+if (!(flags & MDB_RDONLY) && e->rrefs == 0) exim_lmdb_room(e, 0);
+if (  (rc = mdb_txn_begin(e->env, NULL, flags, txnp)) == MDB_MAP_RESIZED
+   && !e->wtxn && e->rrefs == 0
+   && mdb_env_set_mapsize(e->env, 0) == MDB_SUCCESS)
+  rc = mdb_txn_begin(e->env, NULL, flags, txnp);
+return rc;
+}
+
+static inline EXIM_DB *
+exim_lmdb_open(const char * name, int flags, int mode)
+{
+static exim_lmdb_env * envs = NULL;
+exim_lmdb_env * e;
+EXIM_DB * db;
+struct stat statbuf;
+pid_t pid = getpid();
+int rc;
+
+if (stat(name, &statbuf) < 0)
+  {
+  if (!(flags & O_CREAT)) return NULL;	/* errno is ENOENT */
+  statbuf.st_dev = 0;
+  statbuf.st_ino = 0;
+  }
+else if ((flags & (O_CREAT|O_EXCL)) == (O_CREAT|O_EXCL))
+  { errno = EEXIST; return NULL; }
+
+for (e = envs; e; e = e->next)
+  if (e->pid == pid && strcmp(e->name, name) == 0)
+    {
+    if (e->dev == statbuf.st_dev && e->ino == statbuf.st_ino) break;
+    if (!e->wtxn)
+      {
+      mdb_env_close(e->env);		/* File replaced; forget it */
+      e->pid = 0;
+      }
+    }
+
+if (!e)
+  {
+  MDB_txn * txn;
+
+  if (!(e = malloc(sizeof(exim_lmdb_env) + strlen(name))))
+    return NULL;
+  if ((rc = mdb_env_create(&e->env)) != MDB_SUCCESS)
+    { free(e); errno = rc; return NULL; }
+  (void) mdb_env_set_mapsize(e->env, EXIM_LMDB_MAPSIZE);	/* or the file's */
+
+  /* Hints are hints: a crash may lose the most recent updates, but the file
+  stays consistent, so there is no need to sync on every commit. */
+
+  if (  (rc = mdb_env_open(e->env, name,
+		MDB_NOSUBDIR | MDB_NOTLS | MDB_NOSYNC, mode)) != MDB_SUCCESS
+     || (rc = mdb_txn_begin(e->env, NULL, 0, &txn)) != MDB_SUCCESS
+     )
+    {
+    mdb_env_close(e->env);
+    free(e);
+    errno = rc == MDB_INVALID ? EINVAL : rc;
+    return NULL;
+    }
+  if (  (rc = mdb_dbi_open(txn, NULL, 0, &e->dbi)) != MDB_SUCCESS
+     || (rc = mdb_txn_commit(txn)) != MDB_SUCCESS
+     )
+    {
+    mdb_env_close(e->env);
+    free(e);
+    errno = rc;
+    return NULL;
+    }
+
+  (void) stat(name, &statbuf);
+  strcpy(e->name, name);
+  e->pid = pid;
+  e->dev = statbuf.st_dev;
+  e->ino = statbuf.st_ino;
+  e->wtxn = NULL;
+  e->wrefs = 0;
+  e->rrefs = 0;
+  e->full = FALSE;
+  e->next = envs;
+  envs = e;
+  }
+
+if (!(db = malloc(sizeof(EXIM_DB)))) return NULL;
+db->e = e;
+db->write = (flags & (O_RDWR|O_WRONLY)) != 0;
+db->scanned = FALSE;
+
+if (db->write && e->wtxn)
+  db->txn = e->wtxn;
+else if ((rc = exim_lmdb_begin(e, db->write ? 0 : MDB_RDONLY, &db->txn))
+	  != MDB_SUCCESS)
+  {
+  free(db);
+  errno = rc == MDB_MAP_RESIZED ? EAGAIN : rc;
+  return NULL;
+  }
+
+if (db->write)
+  {
+  e->wtxn = db->txn;
+  e->wrefs++;
+  }
+else
+  e->rrefs++;
+return db;
+}
+
+/* Write a record. If this is the only transaction running, its data have not
+been scanned, and the map is more than half full, commit what has been done so
+far and grow the map first. Failures other than a duplicate key for a
+non-overwriting write are logged. */
+
+static inline int
+exim_lmdb_put(EXIM_DB * db, MDB_val * key, MDB_val * data, unsigned flags)
+{
+exim_lmdb_env * e = db->e;
+MDB_stat st;
+int rc;
+
+if (  db->write && db->txn && !db->scanned && e->wrefs == 1 && e->rrefs == 0
+   && mdb_stat(db->txn, e->dbi, &st) == MDB_SUCCESS)
+  {
+  MDB_envinfo info;
+  size_t pages = st.ms_branch_pages + st.ms_leaf_pages + st.ms_overflow_pages;
+
+  if (  mdb_env_info(e->env, &info) == MDB_SUCCESS
+     && pages * st.ms_psize > info.me_mapsize / 2)
+    {
+    if ((rc = mdb_txn_commit(db->txn)) != MDB_SUCCESS)
+      log_write(0, LOG_MAIN, "hints database %s: commit failed: %s",
+	e->name, mdb_strerror(rc));
+    e->wtxn = NULL;
+    exim_lmdb_room(e, pages);
+    if ((rc = exim_lmdb_begin(e, 0, &db->txn)) != MDB_SUCCESS)
+      {
+      log_write(0, LOG_MAIN, "hints database %s: %s", e->name,
+	mdb_strerror(rc));
+      db->txn = NULL;
+      e->wrefs = 0;
+      return rc;
+      }
+    e->wtxn = db->txn;
+    }
+  }
+
+if (!db->txn) return MDB_BAD_TXN;
+if ((rc = mdb_put(db->txn, e->dbi, key, data, flags)) != MDB_SUCCESS
+   && !(rc == MDB_KEYEXIST && flags & MDB_NOOVERWRITE))
+  {
+  if (!e->full)
+    log_write(0, LOG_MAIN, "hints database %s: write failed: %s",
+      e->name, mdb_strerror(rc));
+  if (rc == MDB_MAP_FULL) e->full = TRUE;	/* grow at the next begin */
+  }
+return rc;
+}
+
+static inline void
+exim_lmdb_close(EXIM_DB * db)
+{
+exim_lmdb_env * e = db->e;
+
+if (!db->write)
+  {
+  mdb_txn_abort(db->txn);		/* Read-only: nothing to commit */
+  e->rrefs--;
+  }
+else if (e->wrefs > 0 && --e->wrefs == 0)
+  {
+  int rc = mdb_txn_commit(e->wtxn);
+  if (rc != MDB_SUCCESS)
+    log_write(0, LOG_MAIN, "hints database %s: commit failed: %s",
+      e->name, mdb_strerror(rc));
+  e->wtxn = NULL;
+  }
+free(db);
+}
+
+/* Access functions */
+
+/* EXIM_DBOPEN - sets *dbpp to point to an EXIM_DB, NULL if failed */
+#define EXIM_DBOPEN__(name, dirname, flags, mode, dbpp) \
+       *(dbpp) = exim_lmdb_open(CCS (name), flags, mode)
+
+/* EXIM_DBGET - returns TRUE if successful, FALSE otherwise */
+#define EXIM_DBGET(db, key, data)      \
+       ((db)->txn \
+	&& mdb_get((db)->txn, (db)->e->dbi, &(key), &(data)) == MDB_SUCCESS)
+
+/* EXIM_DBPUT - returns nothing useful, assumes replace mode */
+#define EXIM_DBPUT(db, key, data)      \
+       exim_lmdb_put(db, &(key), &(data), 0)
+
+/* EXIM_DBPUTB - non-overwriting for use by dbmbuild */
+#define EXIM_DBPUTB(db, key, data)      \
+       exim_lmdb_put(db, &(key), &(data), MDB_NOOVERWRITE)
+
+/* Returns from EXIM_DBPUTB */
+
+#define EXIM_DBPUTB_OK  0
+#define EXIM_DBPUTB_DUP MDB_KEYEXIST
+
+/* EXIM_DBDEL */
+#define EXIM_DBDEL(db, key) \
+       ((db)->txn \
+	? mdb_del((db)->txn, (db)->e->dbi, &(key), NULL) : MDB_BAD_TXN)
+
+/* EXIM_DBCREATE_CURSOR - initialize for scanning operation */
+#define EXIM_DBCREATE_CURSOR(db, cursor) \
+       ((db)->scanned = TRUE, (db)->txn \
+	? mdb_cursor_open((db)->txn, (db)->e->dbi, cursor) : MDB_BAD_TXN)
+
+/* EXIM_DBSCAN - returns TRUE if data is returned, FALSE at end */
+#define EXIM_DBSCAN(db, key, data, first, cursor)      \
+       (mdb_cursor_get(cursor, &(key), &(data), \
+	  (first) ? MDB_FIRST : MDB_NEXT) == MDB_SUCCESS)
+
+/* EXIM_DBDELETE_CURSOR - terminate scanning operation */
+#define EXIM_DBDELETE_CURSOR(cursor) mdb_cursor_close(cursor)
+
+/* EXIM_DBCLOSE */
+#define EXIM_DBCLOSE__(db)        exim_lmdb_close(db)
+
+/* Datum access types - these are intended to be assignable */
+
+#define EXIM_DATUM_SIZE(datum)  (datum).mv_size
+#define EXIM_DATUM_DATA(datum)  (datum).mv_data
+
+/* There's no clearing required before use, and the data belongs to the
+transaction, so there is nothing to free. */
+
+#define EXIM_DATUM_INIT(datum)
+#define EXIM_DATUM_FREE(datum)
+
+
+
+#else  /* USE_LMDB */
+
+
+/* If none of USE_DB, USG_GDBM, USE_TDB or USE_LMDB are set, the default is the
+NDBM interface */
 
 
 /********************* ndbm interface definitions **********************/
@@ -617,7 +949,7 @@ after reading data. */
 #define EXIM_DATUM_INIT(datum)
 #define EXIM_DATUM_FREE(datum)
 
-#endif /* USE_GDBM */
+#endif /* USE_LMDB */
 
 
 
@@ -661,11 +993,23 @@ after reading data. */
 
 
 /* Structure for carrying around an open DBM file, and an open locking file
-that relates to it. */
+that relates to it. For a database that is split into shards, the open of the
+shard file is deferred until a key is known, and the remaining fields record
+what is needed to do it; only one shard is open at once. For a database that
+is shared via hints_shared_server, the changes to send to the server are
+collected until it is closed. */
 
 typedef struct {
   EXIM_DB *dbptr;
   int lockfd;
+  int shard;			/* shard currently open, or -1 */
+  int flags;
+  BOOL lof;
+  BOOL panic;
+  uschar *name;			/* NULL if not sharded */
+  uschar *shared;		/* key prefix on the server, or NULL */
+  struct gstring *pending;	/* commands waiting to be sent */
+  int npending;
 } open_db;
 
 
@@ -771,6 +1115,18 @@ typedef struct {
 } dbdata_serialize;
 
 
+/* This structure keeps the number of connections to a host with an adaptive
+connection limit, and the current limit. It starts as a serialization record
+does, so that the count is handled in the same way. */
+
+typedef struct {
+  time_t time_stamp;
+  /*************/
+  int    count;           /* Connections now open */
+  int    limit;           /* Current limit */
+} dbdata_adapt;
+
+
 /* This structure records the information required for the ratelimit
 ACL condition. */
 
@@ -816,5 +1172,103 @@ typedef struct {
   uschar session[1];
 } dbdata_tls_session;
 
+/* This structure records the result of a lookup that uses the "cache=shared"
+option, so that other processes can use it. A failed lookup is recorded too,
+with no data. */
+
+typedef struct {
+  time_t time_stamp;      /* Time of the lookup */
+  /*************/
+  time_t expiry;          /* Not to be used after this */
+  uschar found:1;         /* The lookup succeeded */
+  uschar tainted:1;       /* The data is tainted */
+  uschar data[1];         /* The data, zero-terminated */
+} dbdata_lookup;
+
+/* This structure records the routing of a top-level address of a queued
+message, so that a later delivery attempt can skip the routers. It is only
+used if the configuration is unchanged. */
+
+typedef struct {
+  time_t time_stamp;      /* Time the address was routed */
+  /*************/
+  time_t expiry;          /* Not to be used after this */
+  unsigned config_hash;   /* Hash of the configuration that routed it */
+  uschar data[1];         /* The encoded routing, zero-terminated */
+} dbdata_route;
+
+/* This structure records that some content, whose hash is the key, was found
+clean by a malware scanner. It is only used with the same scanner version. */
+
+typedef struct {
+  time_t time_stamp;      /* Time of the scan */
+  /*************/
+  uschar version[1];      /* The scanner version, zero-terminated */
+} dbdata_malware;
+
+/* This structure holds the SCRAM keys derived from a password by the gsasl
+authenticator. The key is the user name with a hash of the password and the
+SCRAM parameters. */
+
+typedef struct {
+  time_t time_stamp;      /* Time of the derivation */
+  /*************/
+  uschar keys[1];         /* StoredKey and ServerKey, each zero-terminated */
+} dbdata_gsasl;
+
+/* This structure records how an IP address has performed as an SMTP server,
+for the smtp transport's hosts_order_by_latency option. The times are moving
+averages, in milliseconds, and are zero until there is a sample. */
+
+typedef struct {
+  time_t time_stamp;      /* Time of the last attempt */
+  /*************/
+  unsigned attempts;      /* Delivery attempts recorded */
+  unsigned failures;      /* Of which failed */
+  double fail_rate;       /* Moving average of failures, 0 to 1 */
+  double connect_ms;      /* Making the connection */
+  double ehlo_ms;         /* From then to the end of EHLO */
+  double txn_ms;          /* From then to the end of the delivery */
+} dbdata_hoststats;
+
+/* This structure is the token bucket for one source address of an interface
+pool and one destination domain. The key is "<address>/<domain>". */
+
+typedef struct {
+  time_t time_stamp;      /* Time the tokens were counted */
+  /*************/
+  time_t first_used;      /* For the warm-up period */
+  time_t throttled;       /* Not to be used before this */
+  double tokens;          /* Connections that can be made now */
+} dbdata_sourceip;
+
+/* This structure counts the reject log entries for one reason in the current
+period, when they are sampled or rate limited. The key is the reason. */
+
+typedef struct {
+  time_t time_stamp;      /* Time of the last entry */
+  /*************/
+  time_t period_start;    /* Start of the current period */
+  int    seen;            /* Entries in the period */
+  int    written;         /* Of which written */
+  int    suppressed;      /* Of which not written */
+} dbdata_rejectlog;
+
+/* This structure records the result of verifying an address by routing, so
+that other processes can use it. The strings are the messages, the address data
+and the failure reason, each flagged as set or unset. */
+
+typedef struct {
+  time_t time_stamp;      /* Time of the verification */
+  /*************/
+  time_t expiry;          /* Not to be used after this */
+  unsigned config_hash;   /* Hash of the configuration that verified it */
+  int    rc;              /* OK or FAIL */
+  int    basic_errno;     /* From the verified address */
+  uschar routed:1;        /* Routing succeeded */
+  uschar pass_message:1;  /* The af_pass_message flag */
+  uschar data[1];         /* The strings */
+} dbdata_verify;
+
 
 /* End of dbstuff.h */
@@ -92,6 +92,28 @@ debug_printf_indent("---- End of tree ----\n");
 
 
 
+/*************************************************
+*               Print hash table                 *
+*************************************************/
+
+/* The names are printed in order, one per line. */
+
+void
+debug_print_hash(const char * title, const tree_hash * t)
+{
+rmark reset_point = store_mark();
+tree_node ** v = tree_hash_sorted(t);
+
+debug_printf_indent("%s:\n", title);
+if (!t->count) debug_printf_indent(" Empty Table\n");
+for (unsigned i = 0; i < t->count; i++)
+  debug_printf_indent(" -->%s\n", v[i]->name);
+debug_printf_indent("---- End of table ----\n");
+store_reset(reset_point);
+}
+
+
+
 /*************************************************
 *          Print an argv vector                  *
 *************************************************/
@@ -409,4 +431,396 @@ else
 }
 
 
+
+/*************************************************
+*             Trace ring buffer                  *
+*************************************************/
+
+/* When trace_ring_size is set, a few kinds of event (SMTP commands, ACL
+results, lookups and DNS queries) are recorded in a ring of that many entries,
+in every process and whatever the debug settings. Recording costs a clock read
+and a short copy. The ring is written to trace_log_path on a panic, when the
+process gets SIGUSR1 (as from exiwhat), and by "control = trace_dump" in an
+ACL. A forked process starts with a copy of its parent's ring. */
+
+static int trace_next = 0;		/* slot for the next event */
+static BOOL trace_wrapped = FALSE;	/* all slots are in use */
+
+void
+trace_init(void)
+{
+trace_ring = store_malloc(trace_ring_size * sizeof(trace_item));
+trace_next = 0;
+trace_wrapped = FALSE;
+}
+
+
+/* Record an event.
+
+Arguments:
+  type      TRACE_SMTP etc
+  v1, v2    numbers, as shown in trace_dump()
+  start     when the event started, or NULL if it has no duration
+  text      name or command; only the start is kept
+*/
+
+void
+trace_event(int type, int v1, int v2, const struct timeval * start,
+  const uschar * text)
+{
+trace_item * t = trace_ring + trace_next;
+uschar * p = t->text, * end = p + sizeof(t->text) - 1;
+
+if (++trace_next >= trace_ring_size)
+  {
+  trace_next = 0;
+  trace_wrapped = TRUE;
+  }
+
+gettimeofday(&t->tv, NULL);
+t->type = type;
+t->v1 = v1;
+t->v2 = v2;
+t->usec = start
+  ? (t->tv.tv_sec - start->tv_sec) * 1000000 + t->tv.tv_usec - start->tv_usec
+  : -1;
+if (text) while (*text && p < end) *p++ = *text++;
+*p = 0;
+}
+
+
+static const uschar *
+trace_rc_name(int rc)
+{
+return rc >= 0 && rc < (int)nelem(rc_names) && rc_names[rc]
+  ? rc_names[rc] : US"?";
+}
+
+
+/* Write out the ring, oldest event first. This may be called from a signal
+handler or while panicking, so it uses nothing more than formatting into a
+local buffer and write().
+
+Argument:   why it is being written
+*/
+
+void
+trace_dump(const uschar * reason)
+{
+static BOOL dumping = FALSE;
+int fd, n, i, len;
+char buf[256];
+
+if (!trace_ring || dumping) return;
+dumping = TRUE;
+
+if ((fd = Uopen(trace_log_path, O_APPEND|O_WRONLY, LOG_MODE)) < 0)
+  {
+  int euid = geteuid();
+  if (euid == exim_uid)
+    fd = Uopen(trace_log_path, O_CREAT|O_APPEND|O_WRONLY, LOG_MODE);
+  else if (euid == root_uid)
+    fd = log_create_as_exim(trace_log_path);
+  }
+if (fd < 0) { dumping = FALSE; return; }
+
+n = trace_wrapped ? trace_ring_size : trace_next;
+len = snprintf(buf, sizeof(buf), "%s %d trace (%s): %d event%s\n",
+  tod_stamp(tod_log), (int)getpid(), reason, n, n == 1 ? "" : "s");
+(void) write(fd, buf, len);
+
+for (i = trace_wrapped ? trace_next : 0; n > 0; n--, i = (i + 1) % trace_ring_size)
+  {
+  trace_item * t = trace_ring + i;
+  struct tm * tm = localtime(&t->tv.tv_sec);
+
+  len = snprintf(buf, sizeof(buf), "  %02d:%02d:%02d.%06d ",
+    tm->tm_hour, tm->tm_min, tm->tm_sec, (int)t->tv.tv_usec);
+
+  switch (t->type)
+    {
+    case TRACE_SMTP:
+      len += snprintf(buf + len, sizeof(buf) - len, "smtp %s", t->text);
+      break;
+    case TRACE_ACL:
+      len += snprintf(buf + len, sizeof(buf) - len, "acl %s %s", t->text,
+	trace_rc_name(t->v1));
+      break;
+    case TRACE_LOOKUP:
+      len += snprintf(buf + len, sizeof(buf) - len, "lookup %s %s %s",
+	lookup_list[t->v2]->name, trace_rc_name(t->v1), t->text);
+      break;
+    case TRACE_DNS:
+      len += t->v2
+	? snprintf(buf + len, sizeof(buf) - len, "dns %s %s h_errno=%d",
+	    dns_text_type(t->v1), t->text, t->v2)
+	: snprintf(buf + len, sizeof(buf) - len, "dns %s %s",
+	    dns_text_type(t->v1), t->text);
+      break;
+    }
+  if (t->usec >= 0)
+    len += snprintf(buf + len, sizeof(buf) - len, " %dus", t->usec);
+  if (len > (int)sizeof(buf) - 2) len = sizeof(buf) - 2;
+  buf[len++] = '\n';
+  (void) write(fd, buf, len);
+  }
+
+(void) close(fd);
+dumping = FALSE;
+}
+
+
+
+/*************************************************
+*             Configuration profiler             *
+*************************************************/
+
+/* When profile_sample is set, one in that many SMTP sessions and delivery
+processes counts the calls and the time taken by each ACL statement, each kind
+of ACL condition, the expansions done for each router and transport, and the
+lookups of each type. Times include anything nested within, so an ACL statement
+includes the lookups done by its conditions. At exit the items are logged,
+largest time first, and sent to the daemon, which adds them up over all
+processes for its metrics query. A forked process starts with an empty table,
+so the subprocesses that run transports report their own. */
+
+#define PROFILE_MAX		1000	/* items kept by a process */
+#define PROFILE_TOTAL_MAX	4000	/* items kept by the daemon */
+#define PROFILE_LOG_MAX		20	/* items logged at exit */
+#define PROFILE_METRICS_MAX	100	/* items in the metrics reply */
+
+typedef struct {
+  unsigned long	count;
+  unsigned long	usec;
+} profile_item;
+
+typedef struct {
+  const uschar *	name;
+  profile_item *	item;
+} profile_entry;
+
+static pid_t profile_pid = 0;		/* the process that sampled */
+static tree_node * profile_tree = NULL;
+static int profile_items = 0;
+
+/* Totals kept by the daemon */
+
+static tree_node * profile_totals = NULL;
+static int profile_total_items = 0;
+
+
+/* Decide whether this process is to be profiled. Nothing changes for a
+process that has already been sampled. */
+
+void
+profile_start(void)
+{
+if (profile_pid == getpid()) return;
+profile_pid = getpid();
+profile_reset();
+profiling = profile_sample > 0 && vaguely_random_number(profile_sample) == 0;
+DEBUG(D_any) if (profiling) debug_printf("profiling this process\n");
+}
+
+
+/* Forget the counts; a forked process keeps its parent's decision */
+
+void
+profile_reset(void)
+{
+profile_tree = NULL;
+profile_items = 0;
+}
+
+
+static profile_item *
+profile_find(tree_node ** root, int * count, int max, const uschar * name)
+{
+tree_node * t = tree_search(*root, name);
+profile_item * p;
+
+if (t) return t->data.ptr;
+if (*count >= max) return NULL;
+
+t = store_get_perm(sizeof(tree_node) + Ustrlen(name), FALSE);
+Ustrcpy(t->name, name);
+t->data.ptr = p = store_get_perm(sizeof(profile_item), FALSE);
+p->count = p->usec = 0;
+(void) tree_insertnode(root, t);
+(*count)++;
+return p;
+}
+
+
+/* Count a call of an item.
+
+Arguments:
+  name      the item
+  start     when the call started
+*/
+
+void
+profile_count(const uschar * name, const struct timeval * start)
+{
+profile_item * p = profile_find(&profile_tree, &profile_items, PROFILE_MAX, name);
+if (p)
+  {
+  p->count++;
+  p->usec += usec_since(start);
+  }
+}
+
+
+/* The items, largest time first */
+
+static void
+profile_collect(uschar * name, uschar * ptr, void * ctx)
+{
+profile_entry ** pp = ctx;
+(*pp)->name = name;
+(*pp)->item = (profile_item *)ptr;
+(*pp)++;
+}
+
+static int
+profile_cmp(const void * a, const void * b)
+{
+const profile_item * x = ((const profile_entry *)a)->item;
+const profile_item * y = ((const profile_entry *)b)->item;
+return x->usec < y->usec ? 1 : x->usec > y->usec ? -1 : 0;
+}
+
+static profile_entry *
+profile_sorted(tree_node * root, int count)
+{
+profile_entry * v = store_get(count * sizeof(profile_entry), FALSE), * e = v;
+tree_walk(root, profile_collect, &e);
+qsort(v, count, sizeof(profile_entry), profile_cmp);
+return v;
+}
+
+
+/* At exit, log the biggest items and send them all to the daemon, a line
+each giving the count, the microseconds and the name. The lines are split over
+datagrams that the daemon can take. */
+
+void
+profile_report(void)
+{
+rmark reset_point;
+profile_entry * v;
+gstring * g;
+uschar type = NOTIFY_PROFILE;
+int old_pool = store_pool;
+
+if (!profiling || !profile_tree) return;
+profiling = FALSE;
+
+store_pool = POOL_MAIN;
+reset_point = store_mark();
+v = profile_sorted(profile_tree, profile_items);
+
+g = string_fmt_append(NULL, "profile: %d item%s", profile_items,
+  profile_items == 1 ? "" : "s");
+for (int i = 0; i < profile_items && i < PROFILE_LOG_MAX; i++)
+  g = string_fmt_append(g, "\n  %lu.%06lus %lu %s",
+    v[i].item->usec / 1000000, v[i].item->usec % 1000000, v[i].item->count,
+    v[i].name);
+log_write(0, LOG_MAIN, "%s", string_from_gstring(g));
+
+if (notifier_socket && *notifier_socket)
+  {
+  g = string_catn(NULL, &type, 1);
+  for (int i = 0; i < profile_items; i++)
+    {
+    int start = g->ptr;
+    g = string_fmt_append(g, "%lu %lu %.*s\n", v[i].item->count,
+      v[i].item->usec, 256, v[i].name);
+    if (g->ptr > 4000)
+      {
+      notifier_send(g->s, start);
+      memmove(g->s + 1, g->s + start, g->ptr - start);
+      g->ptr -= start - 1;
+      }
+    }
+  if (g->ptr > 1) notifier_send(g->s, g->ptr);
+  }
+
+store_reset(reset_point);
+store_pool = old_pool;
+}
+
+
+/* The daemon's side: add in the counts from a process */
+
+void
+profile_accumulate(const uschar * s)
+{
+while (*s)
+  {
+  unsigned long count, usec;
+  const uschar * name, * eol;
+  uschar * end, buf[257];
+  profile_item * p;
+
+  count = Ustrtoul(s, &end, 10);
+  if (end == s || *end != ' ') return;		/* malformed */
+  s = end;
+  usec = Ustrtoul(s, &end, 10);
+  if (end == s || *end != ' ') return;
+  name = end + 1;
+  if (!(eol = Ustrchr(name, '\n')) || eol - name >= sizeof(buf)) return;
+  s = eol + 1;
+  memcpy(buf, name, eol - name);
+  buf[eol - name] = '\0';
+
+  if ((p = profile_find(&profile_totals, &profile_total_items,
+	PROFILE_TOTAL_MAX, buf)))
+    {
+    p->count += count;
+    p->usec += usec;
+    }
+  }
+}
+
+
+/* The biggest totals, in the Prometheus text format */
+
+static gstring *
+profile_label(gstring * g, const uschar * name)
+{
+g = string_catn(g, US"{item=\"", 7);
+for (const uschar * s = name; *s; s++)
+  {
+  if (*s == '"' || *s == '\\') g = string_catn(g, US"\\", 1);
+  g = string_catn(g, s, 1);
+  }
+return string_catn(g, US"\"}", 2);
+}
+
+gstring *
+profile_summary(gstring * g)
+{
+profile_entry * v;
+int n = profile_total_items < PROFILE_METRICS_MAX
+  ? profile_total_items : PROFILE_METRICS_MAX;
+
+if (!profile_totals) return g;
+v = profile_sorted(profile_totals, profile_total_items);
+
+g = string_cat(g, US"# TYPE exim_profile_calls_total counter\n");
+for (int i = 0; i < n; i++)
+  {
+  g = profile_label(string_cat(g, US"exim_profile_calls_total"), v[i].name);
+  g = string_fmt_append(g, " %lu\n", v[i].item->count);
+  }
+g = string_cat(g, US"# TYPE exim_profile_seconds_total counter\n");
+for (int i = 0; i < n; i++)
+  {
+  g = profile_label(string_cat(g, US"exim_profile_seconds_total"), v[i].name);
+  g = string_fmt_append(g, " %.6f\n", (double)v[i].item->usec / 1000000);
+  }
+return g;
+}
+
 /* End of debug.c */
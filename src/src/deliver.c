@@ -29,6 +29,20 @@ typedef struct pardata {
   uschar *return_path;         /* return_path for these addresses */
 } pardata;
 
+/* Local delivery subprocesses that are running in parallel */
+
+typedef struct lpardata {
+  address_item *addr;          /* chain of addresses */
+  transport_instance *tp;      /* the transport */
+  pid_t pid;                   /* subprocess pid */
+  int fd;                      /* pipe fd for getting result from subprocess */
+  uschar *return_path;         /* return_path for these addresses */
+  uschar *serialize_key;       /* key for transport max_parallel, or NULL */
+  struct timeval delivery_start; /* when the delivery started */
+  int logflags;                /* flags for logging the results */
+  BOOL disable_logging;        /* transport's disable_logging */
+} lpardata;
+
 /* Values for the process_recipients variable */
 
 enum { RECIP_ACCEPT, RECIP_IGNORE, RECIP_DEFER,
@@ -74,9 +88,15 @@ static BOOL update_spool;
 static BOOL remove_journal;
 static int  parcount = 0;
 static pardata *parlist = NULL;
+static int  lparcount = 0;
+static lpardata *lparlist = NULL;
+#ifndef NO_POLL_H
+static struct pollfd *parpoll = NULL;
+#endif
 static int  return_count;
 static uschar *frozen_info = US"";
 static uschar *used_return_path = NULL;
+static tree_node *copied_routing = NULL;	/* same_domain_copy_routing */
 
 
 
@@ -204,7 +224,7 @@ router_var = addr->prop.variables;
 /* These may be unset for multiple addresses */
 
 deliver_domain = addr->domain;
-self_hostname = addr->self_hostname;
+self_hostname = ADDR_COLD(addr)->self_hostname;
 
 #ifdef EXPERIMENTAL_BRIGHTMAIL
 bmi_deliver = 1;    /* deliver by default */
@@ -221,9 +241,9 @@ if (!addr->next)
 
   deliver_localpart = addr->local_part;
   deliver_localpart_prefix = addr->prefix;
-  deliver_localpart_prefix_v = addr->prefix_v;
+  deliver_localpart_prefix_v = ADDR_COLD(addr)->prefix_v;
   deliver_localpart_suffix = addr->suffix;
-  deliver_localpart_suffix_v = addr->suffix_v;
+  deliver_localpart_suffix_v = ADDR_COLD(addr)->suffix_v;
 
   for (addr_orig = addr; addr_orig->parent; addr_orig = addr_orig->parent) ;
   deliver_domain_orig = addr_orig->domain;
@@ -263,9 +283,9 @@ if (!addr->next)
       else if (deliver_localpart[0] == '|') address_pipe = addr->local_part;
       deliver_localpart = addr->parent->local_part;
       deliver_localpart_prefix = addr->parent->prefix;
-      deliver_localpart_prefix_v = addr->parent->prefix_v;
+      deliver_localpart_prefix_v = ADDR_COLD(addr->parent)->prefix_v;
       deliver_localpart_suffix = addr->parent->suffix;
-      deliver_localpart_suffix_v = addr->parent->suffix_v;
+      deliver_localpart_suffix_v = ADDR_COLD(addr->parent)->suffix_v;
       }
     }
 
@@ -299,8 +319,8 @@ else
     if (deliver_domain && Ustrcmp(deliver_domain, addr2->domain) != 0)
       deliver_domain = NULL;
     if (  self_hostname
-       && (  !addr2->self_hostname
-          || Ustrcmp(self_hostname, addr2->self_hostname) != 0
+       && (  !ADDR_COLD(addr2)->self_hostname
+          || Ustrcmp(self_hostname, ADDR_COLD(addr2)->self_hostname) != 0
        )  )
       self_hostname = NULL;
     if (!deliver_domain && !self_hostname) break;
@@ -371,7 +391,7 @@ for (int i = 2; i > 0; i--)
   if (errno != ENOENT)
     break;
 
-  (void)directory_make(spool_directory,
+  (void)directory_make(spool_root(message_id),
 			spool_sname(US"msglog", message_subdir),
 			MSGLOG_DIRECTORY_MODE, TRUE);
   }
@@ -825,6 +845,11 @@ if (LOGGING(tls_cipher) && addr->cipher)
     g = string_catn(g, US"*", 1);
 #endif
   }
+if (LOGGING(tls_ktls) && addr->cipher
+   && (testflag(addr, af_ktls_tx) || testflag(addr, af_ktls_rx)))
+  g = string_append(g, 2, US" KTLS=", tls_ktls_name(
+    (testflag(addr, af_ktls_tx) ? KTLS_TX : 0)
+    | (testflag(addr, af_ktls_rx) ? KTLS_RX : 0)));
 if (LOGGING(tls_certificate_verified) && addr->cipher)
   g = string_append(g, 2, US" CV=",
     testflag(addr, af_cert_verified)
@@ -846,12 +871,92 @@ return g;
 
 
 #ifndef DISABLE_EVENT
+/* The events for which an event_action is expanded can be limited by the
+event_types option alongside it. Each item of that list is an event name, or a
+name ending in a colon that covers all the events below it (for example, "msg:"
+for all the message events). The list is compiled, once per process, into a
+bitmap over the known events, so an unwanted event costs no expansion. */
+
+static const uschar * event_known[] = {
+  US"dane:fail", US"msg:complete", US"msg:defer", US"msg:delivery",
+  US"msg:fail:delivery", US"msg:fail:internal", US"msg:host:defer",
+  US"msg:rcpt:defer", US"msg:rcpt:host:defer", US"smtp:connect",
+  US"smtp:ehlo", US"tcp:close", US"tcp:connect", US"tls:cert" };
+
+#define EVENT_MASK_DONE	BIT(31)
+
+static BOOL
+event_type_match(const uschar * list, const uschar * event)
+{
+int sep = -',';
+for (uschar * ele; ele = string_nextinlist(&list, &sep, NULL, 0); )
+  {
+  int len = Ustrlen(ele);
+  if (len > 0 && (ele[len-1] == ':'
+      ? Ustrncmp(event, ele, len) == 0 : Ustrcmp(event, ele) == 0))
+    return TRUE;
+  }
+return FALSE;
+}
+
+/* The action string is the one from the main configuration or from one of
+the transports, which says whose event_types applies. */
+
+static BOOL
+event_wanted(const uschar * action, const uschar * event)
+{
+static uint main_mask = 0;
+const uschar * types = NULL;
+uint * mask = NULL;
+
+if (action == event_action)
+  {
+  types = event_types;
+  mask = &main_mask;
+  }
+else for (transport_instance * t = transports; t; t = t->next)
+  if (action == t->event_action)
+    {
+    types = t->event_types;
+    mask = &t->event_mask;
+    break;
+    }
+if (!types) return TRUE;
+
+if (!(*mask & EVENT_MASK_DONE))
+  {
+  *mask = EVENT_MASK_DONE;
+  for (int i = 0; i < nelem(event_known); i++)
+    if (event_type_match(types, event_known[i])) *mask |= BIT(i);
+  }
+for (int i = 0; i < nelem(event_known); i++)
+  if (Ustrcmp(event, event_known[i]) == 0) return !!(*mask & BIT(i));
+return event_type_match(types, event);
+}
+
+
 uschar *
 event_raise(uschar * action, const uschar * event, uschar * ev_data)
 {
 uschar * s;
 if (action)
   {
+  struct timeval start;
+
+  if (profiling) gettimeofday(&start, NULL);
+  if (!event_wanted(action, event))
+    {
+    DEBUG(D_deliver)
+      debug_printf("Event(%s): not in event_types\n", event);
+    if (profiling)
+      {
+      uschar buf[64];
+      (void) string_format(buf, sizeof(buf), "event %s skipped", event);
+      profile_count(buf, &start);
+      }
+    return NULL;
+    }
+
   DEBUG(D_deliver)
     debug_printf("Event(%s): event_action=|%s| delivery_IP=%s\n",
       event,
@@ -867,6 +972,13 @@ if (action)
 
   event_name = event_data = NULL;
 
+  if (profiling)
+    {
+    uschar buf[64];
+    (void) string_format(buf, sizeof(buf), "event %s", event);
+    profile_count(buf, &start);
+    }
+
   /* If the expansion returns anything but an empty string, flag for
   the caller to modify his normal processing
   */
@@ -1062,7 +1174,7 @@ else
   string_from_gstring(g);	/* ensure nul-terminated */
   if (  strcmpic(cmp, topaddr->address) == 0
      && Ustrncmp(cmp, topaddr->address, Ustrchr(cmp, '@') - cmp) == 0
-     && !addr->onetime_parent
+     && !ADDR_COLD(addr)->onetime_parent
      && (!all_parents || !addr->parent || addr->parent == topaddr)
      )
     add_topaddr = FALSE;
@@ -1092,7 +1204,7 @@ if (  (all_parents || testflag(addr, af_pfr))
 if (add_topaddr)
   g = string_append(g, 3,
     US" <",
-    addr->onetime_parent ? addr->onetime_parent : topaddr->address,
+    ADDR_COLD(addr)->onetime_parent ? ADDR_COLD(addr)->onetime_parent : topaddr->address,
     US">");
 
 return g;
@@ -1111,6 +1223,58 @@ but sender-host and sender are prefixed and "msg" is inserted in the log line.
 Arguments:
   flags		passed to log_write()
 */
+/* Send a structured record for a delivery, deferral or failure of an
+address, if log_json_socket is set. The caller resets the store.
+
+Arguments:
+  event     the kind of record
+  addr      the address
+  size      bytes sent, or -1 if not known
+
+Returns:    nothing
+*/
+
+static void
+json_address_log(const uschar * event, address_item * addr, int size)
+{
+gstring * g;
+struct timeval qt;
+
+if (!(g = log_json_start(event))) return;
+
+g = log_json_str(g, "address", addr->address);
+g = log_json_str(g, "sender", sender_address);
+if (*queue_name) g = log_json_str(g, "queue", queue_name);
+if (addr->router) g = log_json_str(g, "router", addr->router->name);
+if (addr->transport) g = log_json_str(g, "transport", addr->transport->name);
+if (addr->host_used)
+  {
+  int port = addr->host_used->port;
+  g = log_json_str(g, "host", addr->host_used->name);
+  g = log_json_str(g, "host_address", addr->host_used->address);
+  g = log_json_int(g, "host_port", port == PORT_NONE ? 25 : port);
+  }
+#ifndef DISABLE_TLS
+g = log_json_str(g, "tls_version", addr->tlsver);
+g = log_json_str(g, "tls_cipher", addr->cipher);
+g = log_json_str(g, "tls_peerdn", addr->peerdn);
+#endif
+if (size >= 0) g = log_json_int(g, "size", size);
+if (addr->basic_errno)
+  {
+  g = log_json_int(g, "errno", addr->basic_errno);
+  if (addr->basic_errno > 0)
+    g = log_json_str(g, "error", US strerror(addr->basic_errno));
+  }
+g = log_json_str(g, "message", addr->message);
+timesince(&qt, &received_time);
+g = log_json_time(g, "queue_time", &qt);
+g = log_json_time(g, "delivery_time", &addr->delivery_time);
+log_json_send(g);
+}
+
+
+
 void
 delivery_log(int flags, address_item * addr, int logchar, uschar * msg)
 {
@@ -1184,8 +1348,8 @@ if (addr->transport->info->local)
   if (addr->host_list)
     g = string_append(g, 2, US" H=", addr->host_list->name);
   g = d_log_interface(g);
-  if (addr->shadow_message)
-    g = string_cat(g, addr->shadow_message);
+  if (ADDR_COLD(addr)->shadow_message)
+    g = string_cat(g, ADDR_COLD(addr)->shadow_message);
   }
 
 /* Remote delivery */
@@ -1274,10 +1438,14 @@ if (LOGGING(queue_time))
 if (LOGGING(deliver_time))
   g = string_append(g, 2, US" DT=", string_timediff(&addr->delivery_time));
 
+if (LOGGING(resource_usage) && addr->rusage)
+  g = string_rusage(g, addr->rusage);
+
 /* string_cat() always leaves room for the terminator. Release the
 store we used to build the line after writing it. */
 
 log_write(0, flags, "%s", string_from_gstring(g));
+if (!msg) json_address_log(US"delivery", addr, transport_count);
 
 #ifndef DISABLE_EVENT
 if (!msg) msg_event_raise(US"msg:delivery", addr);
@@ -1363,6 +1531,8 @@ others. */
 
 log_write(addr->basic_errno <= ERRNO_RETRY_BASE ? L_retry_defer : 0, logflags,
   "== %s", g->s);
+if (addr->basic_errno > ERRNO_RETRY_BASE)
+  json_address_log(US"defer", addr, -1);
 
 store_reset(reset_point);
 return;
@@ -1425,6 +1595,9 @@ if (addr->message)
 if (LOGGING(deliver_time))
   g = string_append(g, 2, US" DT=", string_timediff(&addr->delivery_time));
 
+if (LOGGING(resource_usage) && addr->rusage)
+  g = string_rusage(g, addr->rusage);
+
 (void) string_from_gstring(g);
 
 /* Do the logging. For the message log, "routing failed" for those cases,
@@ -1436,6 +1609,7 @@ else
   deliver_msglog("%s %s\n", now, g->s);
 
 log_write(0, LOG_MAIN, "** %s", g->s);
+json_address_log(US"fail", addr, -1);
 
 store_reset(reset_point);
 return;
@@ -1471,6 +1645,11 @@ uschar *driver_name = NULL;
 
 DEBUG(D_deliver) debug_printf("post-process %s (%d)\n", addr->address, result);
 
+if (driver_type == EXIM_DTYPE_TRANSPORT)
+  EXIM_PROBE5(delivery__done, message_id, addr->address,
+    addr->transport ? addr->transport->name : US"", result,
+    addr->delivery_time.tv_sec * 1000000L + addr->delivery_time.tv_usec);
+
 /* Set up driver kind and name for logging. Disable logging if the router or
 transport has disabled it. */
 
@@ -1522,7 +1701,7 @@ on a non-empty file.
 In any case, we close the message file, because we cannot afford to leave a
 file-descriptor for one address while processing (maybe very many) others. */
 
-if (addr->return_file >= 0 && addr->return_filename)
+if (addr->return_file >= 0 && ADDR_COLD(addr)->return_filename)
   {
   BOOL return_output = FALSE;
   struct stat statbuf;
@@ -1542,10 +1721,10 @@ if (addr->return_file >= 0 && addr->return_filename)
        )
       {
       uschar *s;
-      FILE *f = Ufopen(addr->return_filename, "rb");
+      FILE *f = Ufopen(ADDR_COLD(addr)->return_filename, "rb");
       if (!f)
         log_write(0, LOG_MAIN|LOG_PANIC, "failed to open %s to log output "
-          "from %s transport: %s", addr->return_filename, tb->name,
+          "from %s transport: %s", ADDR_COLD(addr)->return_filename, tb->name,
           strerror(errno));
       else
         if ((s = US Ufgets(big_buffer, big_buffer_size, f)))
@@ -1581,8 +1760,8 @@ if (addr->return_file >= 0 && addr->return_filename)
 
   if (!return_output)
     {
-    Uunlink(addr->return_filename);
-    addr->return_filename = NULL;
+    Uunlink(ADDR_COLD(addr)->return_filename);
+    addr_cold(addr)->return_filename = NULL;
     addr->return_file = -1;
     }
 
@@ -2037,7 +2216,7 @@ previously_transported(address_item *addr, BOOL testing)
 uschar * s = string_sprintf("%s/%s",
   addr->unique + (testflag(addr, af_homonym)? 3:0), addr->transport->name);
 
-if (tree_search(tree_nonrecipients, s) != 0)
+if (tree_hash_search(&tree_nonrecipients, s) != 0)
   {
   DEBUG(D_deliver|D_route|D_transport)
     debug_printf("%s was previously delivered (%s transport): discarded\n",
@@ -2114,6 +2293,10 @@ Using a separate process makes it more complicated to get error information
 back. We use a pipe to pass the return code and also an error code and error
 text string back to the parent process.
 
+This function starts the subprocess; deliver_local_finish() below collects its
+results. They are separate so that do_local_deliveries() can have more than
+one delivery running at once.
+
 Arguments:
   addr       points to an address block for this delivery; for "normal" local
              deliveries this is the only address to be delivered, but for
@@ -2124,17 +2307,18 @@ Arguments:
 
   shadowing  TRUE if running a shadow transport; this causes output from pipes
              to be ignored.
+  fdptr      where to put the fd for reading the results
 
-Returns:     nothing
+Returns:     the pid of the subprocess, or 0 if the delivery could not be
+             started, in which case the error is in the address(es)
 */
 
-void
-deliver_local(address_item *addr, BOOL shadowing)
+static pid_t
+deliver_local_start(address_item *addr, BOOL shadowing, int * fdptr)
 {
 BOOL use_initgroups;
 uid_t uid;
 gid_t gid;
-int status, len, rc;
 int pfd[2];
 pid_t pid;
 uschar *working_directory;
@@ -2163,7 +2347,7 @@ if (tp->return_path)
     common_error(TRUE, addr, ERRNO_EXPANDFAIL,
       US"Failed to expand return path \"%s\" in %s transport: %s",
       tp->return_path, tp->name, expand_string_message);
-    return;
+    return 0;
     }
   }
 
@@ -2176,14 +2360,14 @@ used_return_path = return_path;
 gets put into the address(es), and the expansions are unset, so we can just
 return. */
 
-if (!findugid(addr, tp, &uid, &gid, &use_initgroups)) return;
+if (!findugid(addr, tp, &uid, &gid, &use_initgroups)) return 0;
 
 /* See if either the transport or the address specifies a home directory. A
 home directory set in the address may already be expanded; a flag is set to
 indicate that. In other cases we must expand it. */
 
 if (  (deliver_home = tp->home_dir)		/* Set in transport, or */
-   || (  (deliver_home = addr->home_dir)	/* Set in address and */
+   || (  (deliver_home = ADDR_COLD(addr)->home_dir)	/* Set in address and */
       && !testflag(addr, af_home_expanded)	/*   not expanded */
    )  )
   {
@@ -2194,13 +2378,13 @@ if (  (deliver_home = tp->home_dir)		/* Set in transport, or */
     common_error(TRUE, addr, ERRNO_EXPANDFAIL, US"home directory \"%s\" failed "
       "to expand for %s transport: %s", rawhome, tp->name,
       expand_string_message);
-    return;
+    return 0;
     }
   if (*deliver_home != '/')
     {
     common_error(TRUE, addr, ERRNO_NOTABSOLUTE, US"home directory path \"%s\" "
       "is not absolute for %s transport", deliver_home, tp->name);
-    return;
+    return 0;
     }
   }
 
@@ -2211,7 +2395,7 @@ all users have access. It is necessary to be in a visible directory for some
 operating systems when running pipes, as some commands (e.g. "rm" under Solaris
 2.5) require this. */
 
-working_directory = tp->current_dir ? tp->current_dir : addr->current_dir;
+working_directory = tp->current_dir ? tp->current_dir : ADDR_COLD(addr)->current_dir;
 if (working_directory)
   {
   uschar *raw = working_directory;
@@ -2220,13 +2404,13 @@ if (working_directory)
     common_error(TRUE, addr, ERRNO_EXPANDFAIL, US"current directory \"%s\" "
       "failed to expand for %s transport: %s", raw, tp->name,
       expand_string_message);
-    return;
+    return 0;
     }
   if (*working_directory != '/')
     {
     common_error(TRUE, addr, ERRNO_NOTABSOLUTE, US"current directory path "
       "\"%s\" is not absolute for %s transport", working_directory, tp->name);
-    return;
+    return 0;
     }
   }
 else working_directory = deliver_home ? deliver_home : US"/";
@@ -2243,15 +2427,15 @@ if (  !shadowing
   {
   uschar * error;
 
-  addr->return_filename =
+  addr_cold(addr)->return_filename =
     spool_fname(US"msglog", message_subdir, message_id,
       string_sprintf("-%d-%d", getpid(), return_count++));
 
-  if ((addr->return_file = open_msglog_file(addr->return_filename, 0400, &error)) < 0)
+  if ((addr->return_file = open_msglog_file(ADDR_COLD(addr)->return_filename, 0400, &error)) < 0)
     {
     common_error(TRUE, addr, errno, US"Unable to %s file for %s transport "
       "to return message: %s", error, tp->name, strerror(errno));
-    return;
+    return 0;
     }
   }
 
@@ -2261,7 +2445,7 @@ if (pipe(pfd) != 0)
   {
   common_error(TRUE, addr, ERRNO_PIPEFAIL, US"Creation of pipe failed: %s",
     strerror(errno));
-  return;
+  return 0;
   }
 
 /* Now fork the process to do the real work in the subprocess, but first
@@ -2339,12 +2523,13 @@ if ((pid = exim_fork(US"delivery-local")) == 0)
   signal(SIGUSR1, SIG_IGN);
 
   /* Close the unwanted half of the pipe, and set close-on-exec for the other
-  half - for transports that exec things (e.g. pipe). Then set the required
-  gid/uid. */
+  half - for transports that exec things (e.g. pipe). Open the file for shared
+  syncs while still privileged. Then set the required gid/uid. */
 
   (void)close(pfd[pipe_read]);
   (void)fcntl(pfd[pipe_write], F_SETFD, fcntl(pfd[pipe_write], F_GETFD) |
     FD_CLOEXEC);
+  spool_fsync_group_open();
   exim_setugid(uid, gid, use_initgroups,
     string_sprintf("local delivery to %s <%s> transport=%s", addr->local_part,
       addr->address, addr->transport->name));
@@ -2452,6 +2637,7 @@ if ((pid = exim_fork(US"delivery-local")) == 0)
 
   (void)close(pfd[pipe_write]);
   search_tidyup();
+  profile_report();
   exit(EXIT_SUCCESS);
   }
 
@@ -2463,36 +2649,64 @@ if (pid < 0)
   log_write(0, LOG_MAIN|LOG_PANIC_DIE, "Fork failed for local delivery to %s",
     addr->address);
 
-/* Read the pipe to get the delivery status codes and error messages. Our copy
-of the writing end must be closed first, as otherwise read() won't return zero
-on an empty pipe. We check that a status exists for each address before
-overwriting the address structure. If data is missing, the default DEFER status
-will remain. Afterwards, close the reading end. */
+/* Our copy of the writing end of the pipe must be closed, as otherwise read()
+won't return zero on an empty pipe. */
 
 (void)close(pfd[pipe_write]);
+*fdptr = pfd[pipe_read];
+EXIM_PROBE4(delivery__start, message_id, addr->address, addr->transport->name,
+  pid);
+return pid;
+}
+
+
+
+/* Collect the results of a local delivery started by deliver_local_start().
+
+Arguments:
+  addr       the address(es) passed to deliver_local_start()
+  shadowing  TRUE if running a shadow transport
+  pid        the pid of the subprocess
+  fd         the fd for reading the results
+
+Returns:     nothing
+*/
+
+static void
+deliver_local_finish(address_item *addr, BOOL shadowing, pid_t pid, int fd)
+{
+int status, len, rc;
+struct rusage ru;
+address_item *addr2;
+transport_instance *tp = addr->transport;
+
+/* Read the pipe to get the delivery status codes and error messages. We check
+that a status exists for each address before overwriting the address structure.
+If data is missing, the default DEFER status will remain. Afterwards, close the
+reading end. */
 
 for (addr2 = addr; addr2; addr2 = addr2->next)
   {
-  if ((len = read(pfd[pipe_read], &status, sizeof(int))) > 0)
+  if ((len = read(fd, &status, sizeof(int))) > 0)
     {
     int i;
     uschar **sptr;
 
     addr2->transport_return = status;
-    len = read(pfd[pipe_read], &transport_count,
+    len = read(fd, &transport_count,
       sizeof(transport_count));
-    len = read(pfd[pipe_read], &addr2->flags, sizeof(addr2->flags));
-    len = read(pfd[pipe_read], &addr2->basic_errno,    sizeof(int));
-    len = read(pfd[pipe_read], &addr2->more_errno,     sizeof(int));
-    len = read(pfd[pipe_read], &addr2->delivery_time,  sizeof(struct timeval));
-    len = read(pfd[pipe_read], &addr2->special_action, sizeof(int));
-    len = read(pfd[pipe_read], &addr2->transport,
+    len = read(fd, &addr2->flags, sizeof(addr2->flags));
+    len = read(fd, &addr2->basic_errno,    sizeof(int));
+    len = read(fd, &addr2->more_errno,     sizeof(int));
+    len = read(fd, &addr2->delivery_time,  sizeof(struct timeval));
+    len = read(fd, &addr2->special_action, sizeof(int));
+    len = read(fd, &addr2->transport,
       sizeof(transport_instance *));
 
     if (testflag(addr2, af_file))
       {
       int llen;
-      if (  read(pfd[pipe_read], &llen, sizeof(int)) != sizeof(int)
+      if (  read(fd, &llen, sizeof(int)) != sizeof(int)
 	 || llen > 64*4	/* limit from rfc 5821, times I18N factor */
          )
 	{
@@ -2502,7 +2716,7 @@ for (addr2 = addr; addr2; addr2 = addr2->next)
 	}
       /* sanity-checked llen so disable the Coverity error */
       /* coverity[tainted_data] */
-      if (read(pfd[pipe_read], big_buffer, llen) != llen)
+      if (read(fd, big_buffer, llen) != llen)
 	{
 	log_write(0, LOG_MAIN|LOG_PANIC, "bad local_part read"
 	  " from delivery subprocess");
@@ -2515,10 +2729,10 @@ for (addr2 = addr; addr2; addr2 = addr2->next)
     for (i = 0, sptr = &addr2->message; i < 2; i++, sptr = &addr2->user_message)
       {
       int message_length;
-      len = read(pfd[pipe_read], &message_length, sizeof(int));
+      len = read(fd, &message_length, sizeof(int));
       if (message_length > 0)
         {
-        len = read(pfd[pipe_read], big_buffer, message_length);
+        len = read(fd, big_buffer, message_length);
 	big_buffer[big_buffer_size-1] = '\0';		/* guard byte */
         if (len > 0) *sptr = string_copy(big_buffer);
         }
@@ -2533,7 +2747,7 @@ for (addr2 = addr; addr2; addr2 = addr2->next)
     }
   }
 
-(void)close(pfd[pipe_read]);
+(void)close(fd);
 
 /* Unless shadowing, write all successful addresses immediately to the journal
 file, to ensure they are recorded asap. For homonymic addresses, use the base
@@ -2578,7 +2792,7 @@ when Exim was called from an MUA that set SIGCHLD to SIG_IGN. When that
 happens, wait() doesn't recognize the termination of child processes. Exim now
 resets SIGCHLD to SIG_DFL, but this code should still be robust. */
 
-while ((rc = wait(&status)) != pid)
+while ((rc = wait4(pid, &status, 0, &ru)) != pid)
   if (rc < 0 && errno == ECHILD)      /* Process has vanished */
     {
     log_write(0, LOG_MAIN, "%s transport process vanished unexpectedly",
@@ -2587,6 +2801,16 @@ while ((rc = wait(&status)) != pid)
     break;
     }
 
+/* The usage returned by wait4() covers the subprocess and anything it waited
+for, such as a pipe command. It applies to the whole batch. */
+
+if (rc == pid && LOGGING(resource_usage) && !shadowing)
+  {
+  struct rusage * rup = store_get(sizeof(struct rusage), FALSE);
+  *rup = ru;
+  for (addr2 = addr; addr2; addr2 = addr2->next) addr2->rusage = rup;
+  }
+
 if ((status & 0xffff) != 0)
   {
   int msb = (status >> 8) & 255;
@@ -2639,6 +2863,21 @@ if (addr->special_action == SPECIAL_WARN && addr->transport->warn_message)
 
 
 
+/* Do a local delivery and wait for it: see deliver_local_start() above for
+the arguments. */
+
+void
+deliver_local(address_item *addr, BOOL shadowing)
+{
+pid_t pid;
+int fd;
+
+if ((pid = deliver_local_start(addr, shadowing, &fd)) > 0)
+  deliver_local_finish(addr, shadowing, pid, fd);
+}
+
+
+
 
 /* Check transport for the given concurrency limit.  Return TRUE if over
 the limit (or an expansion failure), else FALSE and if there was a limit,
@@ -2685,6 +2924,326 @@ return FALSE;
 
 
 
+/*************************************************
+*       Finish off a batch of local deliveries   *
+*************************************************/
+
+/* This function is called when the transport for a batch of local addresses
+has run. It does any shadow delivery and then processes the results.
+
+Arguments:
+  addr            the chain of addresses
+  tp              the transport they were given to
+  serialize_key   the key for the transport's max_parallel count, or NULL
+  delivery_start  when the delivery was started
+  logflags        flags for logging the results
+
+Returns:          nothing
+*/
+
+static void
+local_delivery_done(address_item * addr, transport_instance * tp,
+  uschar * serialize_key, struct timeval * delivery_start, int logflags)
+{
+struct timeval deliver_time;
+address_item *addr2, *addr3, *nextaddr;
+int logchar = f.dont_deliver? '*' : '=';
+
+timesince(&deliver_time, delivery_start);
+
+/* If a shadow transport (which must perforce be another local transport), is
+defined, and its condition is met, we must pass the message to the shadow
+too, but only those addresses that succeeded. We do this by making a new
+chain of addresses - also to keep the original chain uncontaminated. We must
+use a chain rather than doing it one by one, because the shadow transport may
+batch.
+
+NOTE: if the condition fails because of a lookup defer, there is nothing we
+can do! */
+
+if (  tp->shadow
+   && (  !tp->shadow_condition
+      || expand_check_condition(tp->shadow_condition, tp->name, US"transport")
+   )  )
+  {
+  transport_instance *stp;
+  address_item *shadow_addr = NULL;
+  address_item **last = &shadow_addr;
+
+  for (stp = transports; stp; stp = stp->next)
+    if (Ustrcmp(stp->name, tp->shadow) == 0) break;
+
+  if (!stp)
+    log_write(0, LOG_MAIN|LOG_PANIC, "shadow transport \"%s\" not found ",
+      tp->shadow);
+
+  /* Pick off the addresses that have succeeded, and make clones. Put into
+  the shadow_message field a pointer to the shadow_message field of the real
+  address. */
+
+  else for (addr2 = addr; addr2; addr2 = addr2->next)
+    if (addr2->transport_return == OK)
+	{
+	addr3 = store_get(sizeof(address_item), FALSE);
+	*addr3 = *addr2;
+	addr3->next = NULL;
+	addr_cold_share(addr2);
+	addr_cold(addr3)->shadow_message = US &addr_cold(addr2)->shadow_message;
+	addr3->transport = stp;
+	addr3->transport_return = DEFER;
+	addr_cold(addr3)->return_filename = NULL;
+	addr3->return_file = -1;
+	*last = addr3;
+	last = &addr3->next;
+	}
+
+  /* If we found any addresses to shadow, run the delivery, and stick any
+  message back into the shadow_message field in the original. */
+
+  if (shadow_addr)
+    {
+    int save_count = transport_count;
+
+    DEBUG(D_deliver|D_transport)
+      debug_printf(">>>>>>>>>>>>>>>> Shadow delivery >>>>>>>>>>>>>>>>\n");
+    deliver_local(shadow_addr, TRUE);
+
+    for(; shadow_addr; shadow_addr = shadow_addr->next)
+      {
+      int sresult = shadow_addr->transport_return;
+      *(uschar **)ADDR_COLD(shadow_addr)->shadow_message =
+	  sresult == OK
+	  ? string_sprintf(" ST=%s", stp->name)
+	  : string_sprintf(" ST=%s (%s%s%s)", stp->name,
+	      shadow_addr->basic_errno <= 0
+	      ? US""
+	      : US strerror(shadow_addr->basic_errno),
+	      shadow_addr->basic_errno <= 0 || !shadow_addr->message
+	      ? US""
+	      : US": ",
+	      shadow_addr->message
+	      ? shadow_addr->message
+	      : shadow_addr->basic_errno <= 0
+	      ? US"unknown error"
+	      : US"");
+
+      DEBUG(D_deliver|D_transport)
+        debug_printf("%s shadow transport returned %s for %s\n",
+          stp->name, rc_to_string(sresult), shadow_addr->address);
+      }
+
+    DEBUG(D_deliver|D_transport)
+      debug_printf(">>>>>>>>>>>>>>>> End shadow delivery >>>>>>>>>>>>>>>>\n");
+
+    transport_count = save_count;   /* Restore original transport count */
+    }
+  }
+
+/* Cancel the expansions that were set up for the delivery. */
+
+deliver_set_expansions(NULL);
+
+/* If the transport was parallelism-limited, decrement the hints DB record. */
+
+if (serialize_key) enq_end(serialize_key);
+
+/* Now we can process the results of the real transport. We must take each
+address off the chain first, because post_process_one() puts it on another
+chain. */
+
+for (addr2 = addr; addr2; addr2 = nextaddr)
+  {
+  int result = addr2->transport_return;
+  nextaddr = addr2->next;
+
+  DEBUG(D_deliver|D_transport)
+    debug_printf("%s transport returned %s for %s\n",
+      tp->name, rc_to_string(result), addr2->address);
+
+  /* If there is a retry_record, or if delivery is deferred, build a retry
+  item for setting a new retry time or deleting the old retry record from
+  the database. These items are handled all together after all addresses
+  have been handled (so the database is open just for a short time for
+  updating). */
+
+  if (result == DEFER || testflag(addr2, af_lt_retry_exists))
+    {
+    int flags = result == DEFER ? 0 : rf_delete;
+    uschar *retry_key = string_copy(tp->retry_use_local_part
+	? addr2->address_retry_key : addr2->domain_retry_key);
+    *retry_key = 'T';
+    retry_add_item(addr2, retry_key, flags);
+    }
+
+  /* Done with this address */
+
+  addr2->delivery_time = deliver_time;
+  post_process_one(addr2, result, logflags, EXIM_DTYPE_TRANSPORT, logchar);
+
+  /* If a pipe delivery generated text to be sent back, the result may be
+  changed to FAIL, and we must copy this for subsequent addresses in the
+  batch. */
+
+  if (addr2->transport_return != result)
+    {
+    for (addr3 = nextaddr; addr3; addr3 = addr3->next)
+      {
+      addr3->transport_return = addr2->transport_return;
+      addr3->basic_errno = addr2->basic_errno;
+      addr3->message = addr2->message;
+      }
+    result = addr2->transport_return;
+    }
+
+  /* Whether or not the result was changed to FAIL, we need to copy the
+  return_file value from the first address into all the addresses of the
+  batch, so they are all listed in the error message. */
+
+  addr2->return_file = addr->return_file;
+
+  /* Change log character for recording successful deliveries. */
+
+  if (result == OK) logchar = '-';
+  }
+}
+
+
+
+/*************************************************
+*      Run local deliveries in parallel          *
+*************************************************/
+
+/* When local_max_parallel is greater than one, up to that many batches of
+local addresses are delivered at once. Each running batch has a slot in the
+lparlist vector. Results are collected as the subprocesses finish, by waiting
+for the result pipe of each to become readable; all the processing of results,
+including any shadow transport, then happens as for a delivery that was waited
+for. Two batches for the same local part and domain in the same transport are
+never run at once, so that homonymic and duplicate addresses are still seen to
+have been delivered.
+
+local_par_start() is called with the expansion variables set for the batch;
+it may first have to wait for a slot to become free. */
+
+static BOOL
+local_par_conflict(address_item * addr)
+{
+for (int i = 0; i < local_max_parallel; i++)
+  if (lparlist[i].pid)
+    for (address_item * a = addr; a; a = a->next)
+      for (address_item * b = lparlist[i].addr; b; b = b->next)
+	if (  lparlist[i].tp == addr->transport
+	   && Ustrcmp(a->local_part, b->local_part) == 0
+	   && Ustrcmp(a->domain, b->domain) == 0)
+	  return TRUE;
+return FALSE;
+}
+
+
+/* Wait for one running local delivery to finish, and deal with its results. */
+
+static void
+local_par_wait(void)
+{
+int i, rc;
+#ifndef NO_POLL_H
+struct pollfd * pfds = store_get(local_max_parallel * sizeof(struct pollfd),
+  FALSE);
+
+for (i = 0; i < local_max_parallel; i++)
+  {
+  pfds[i].fd = lparlist[i].pid ? lparlist[i].fd : -1;
+  pfds[i].events = POLLIN;
+  pfds[i].revents = 0;
+  }
+while ((rc = poll(pfds, local_max_parallel, -1)) < 0 && errno == EINTR) ;
+# define LPAR_READY(i) (pfds[i].fd >= 0 && pfds[i].revents)
+#else
+fd_set fds;
+int maxfd = -1;
+
+FD_ZERO(&fds);
+for (i = 0; i < local_max_parallel; i++) if (lparlist[i].pid)
+  {
+  FD_SET(lparlist[i].fd, &fds);
+  if (lparlist[i].fd > maxfd) maxfd = lparlist[i].fd;
+  }
+while ((rc = select(maxfd + 1, &fds, NULL, NULL, NULL)) < 0 && errno == EINTR) ;
+# define LPAR_READY(i) (lparlist[i].pid && FD_ISSET(lparlist[i].fd, &fds))
+#endif
+
+if (rc < 0)
+  log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed waiting for local "
+    "deliveries: %s", strerror(errno));
+
+for (i = 0; i < local_max_parallel; i++) if (LPAR_READY(i))
+  {
+  lpardata * p = lparlist + i;
+
+  DEBUG(D_deliver) debug_printf("local delivery process %d ended\n",
+    (int)p->pid);
+  deliver_set_expansions(p->addr);
+  f.disable_logging = p->disable_logging;
+  deliver_local_finish(p->addr, FALSE, p->pid, p->fd);
+  used_return_path = p->return_path;
+  p->pid = 0;
+  lparcount--;
+  local_delivery_done(p->addr, p->tp, p->serialize_key, &p->delivery_start,
+    p->logflags);
+  break;
+  }
+#undef LPAR_READY
+}
+
+
+static void
+local_par_start(address_item * addr, uschar * serialize_key,
+  struct timeval * delivery_start, int logflags)
+{
+lpardata * p;
+pid_t pid;
+int fd, i;
+
+if (lparcount > 0 && local_par_conflict(addr))
+  {
+  DEBUG(D_deliver) debug_printf("waiting for running local deliveries to "
+    "%s\n", addr->address);
+  while (lparcount > 0 && local_par_conflict(addr)) local_par_wait();
+  deliver_set_expansions(addr);
+  }
+if (lparcount >= local_max_parallel)
+  {
+  local_par_wait();
+  deliver_set_expansions(addr);
+  }
+f.disable_logging = addr->transport->disable_logging;
+
+if ((pid = deliver_local_start(addr, FALSE, &fd)) <= 0)
+  {
+  local_delivery_done(addr, addr->transport, serialize_key, delivery_start,
+    logflags);
+  return;
+  }
+
+for (i = 0; lparlist[i].pid; ) i++;
+p = lparlist + i;
+p->addr = addr;
+p->tp = addr->transport;
+p->pid = pid;
+p->fd = fd;
+p->return_path = used_return_path;
+p->serialize_key = serialize_key;
+p->delivery_start = *delivery_start;
+p->logflags = logflags;
+p->disable_logging = f.disable_logging;
+lparcount++;
+DEBUG(D_deliver) debug_printf("started local delivery process %d (%d running)"
+  "\n", (int)pid, lparcount);
+}
+
+
+
+
 /*************************************************
 *              Do local deliveries               *
 *************************************************/
@@ -2706,15 +3265,20 @@ open_db dbblock;
 open_db *dbm_file = NULL;
 time_t now = time(NULL);
 
+if (local_max_parallel > 1 && addr_local && addr_local->next)
+  {
+  lparlist = store_get(local_max_parallel * sizeof(lpardata), FALSE);
+  for (int i = 0; i < local_max_parallel; i++) lparlist[i].pid = 0;
+  lparcount = 0;
+  }
+
 /* Loop until we have exhausted the supply of local deliveries */
 
 while (addr_local)
   {
   struct timeval delivery_start;
-  struct timeval deliver_time;
-  address_item *addr2, *addr3, *nextaddr;
+  address_item *addr2, *addr3;
   int logflags = LOG_MAIN;
-  int logchar = f.dont_deliver? '*' : '=';
   transport_instance *tp;
   uschar * serialize_key = NULL;
 
@@ -2759,11 +3323,13 @@ while (addr_local)
   if (tp->batch_max > 1 && addr_local)
     {
     int batch_count = 1;
-    BOOL uses_dom = readconf_depends((driver_instance *)tp, US"domain");
+    BOOL uses_dom = !tp->batch_per_address
+		&& readconf_depends((driver_instance *)tp, US"domain");
     BOOL uses_lp = (  testflag(addr, af_pfr)
 		   && (testflag(addr, af_file) || addr->local_part[0] == '|')
 		   )
-		|| readconf_depends((driver_instance *)tp, US"local_part");
+		|| !tp->batch_per_address
+		   && readconf_depends((driver_instance *)tp, US"local_part");
     uschar *batch_id = NULL;
     address_item **anchor = &addr_local;
     address_item *last = addr;
@@ -2799,6 +3365,9 @@ while (addr_local)
       same headers to be removed
       same uid/gid for running the transport
       same first host if a host list is set
+      same home and current directories if the transport delivers to each
+        address of a batch separately, when differences in the local part
+        and domain do not matter
     */
 
     while ((next = *anchor) && batch_count < tp->batch_max)
@@ -2814,6 +3383,10 @@ while (addr_local)
 	&& same_headers(next->prop.extra_headers, addr->prop.extra_headers)
 	&& same_strings(next->prop.remove_headers, addr->prop.remove_headers)
 	&& same_ugid(tp, addr, next)
+	&& (  !tp->batch_per_address
+	   ||    same_strings(ADDR_COLD(next)->home_dir, ADDR_COLD(addr)->home_dir)
+	      && same_strings(ADDR_COLD(next)->current_dir, ADDR_COLD(addr)->current_dir)
+	   )
 	&& (  !addr->host_list && !next->host_list
 	   ||    addr->host_list
 	      && next->host_list
@@ -2898,6 +3471,7 @@ while (addr_local)
     {
     BOOL ok = TRUE;   /* to deliver this address */
     uschar *retry_key;
+    time_t due = 0;
 
     /* Set up the retry key to include the domain or not, and change its
     leading character from "R" to "T". Must make a copy before doing this,
@@ -2946,9 +3520,9 @@ while (addr_local)
           /* If we haven't reached the retry time, there is one more check
           to do, which is for the ultimate address timeout. */
 
-          if (!ok)
-            ok = retry_ultimate_address_timeout(retry_key, addr2->domain,
-                retry_record, now);
+          if (!ok && !(ok = retry_ultimate_address_timeout(retry_key,
+                addr2->domain, retry_record, now)))
+            due = retry_next_due(retry_key, addr2->domain, retry_record);
           }
         }
       else DEBUG(D_retry) debug_printf("no retry record exists\n");
@@ -2971,6 +3545,7 @@ while (addr_local)
       address_item *this = addr2;
       this->message = US"Retry time not yet reached";
       this->basic_errno = ERRNO_LRETRY;
+      this->retry_due = due;
       addr2 = addr3 ? (addr3->next = addr2->next)
 		    : (addr = addr2->next);
       post_process_one(this, DEFER, logflags, EXIM_DTYPE_TRANSPORT, 0);
@@ -3005,168 +3580,28 @@ while (addr_local)
 
   /* So, finally, we do have some addresses that can be passed to the
   transport. Before doing so, set up variables that are relevant to a
-  single delivery. */
+  single delivery. With local_max_parallel set, the delivery is started and
+  left running while later batches are set up; otherwise it is waited for. */
 
   deliver_set_expansions(addr);
 
   gettimeofday(&delivery_start, NULL);
-  deliver_local(addr, FALSE);
-  timesince(&deliver_time, &delivery_start);
-
-  /* If a shadow transport (which must perforce be another local transport), is
-  defined, and its condition is met, we must pass the message to the shadow
-  too, but only those addresses that succeeded. We do this by making a new
-  chain of addresses - also to keep the original chain uncontaminated. We must
-  use a chain rather than doing it one by one, because the shadow transport may
-  batch.
-
-  NOTE: if the condition fails because of a lookup defer, there is nothing we
-  can do! */
-
-  if (  tp->shadow
-     && (  !tp->shadow_condition
-        || expand_check_condition(tp->shadow_condition, tp->name, US"transport")
-     )  )
+  if (lparlist)
     {
-    transport_instance *stp;
-    address_item *shadow_addr = NULL;
-    address_item **last = &shadow_addr;
-
-    for (stp = transports; stp; stp = stp->next)
-      if (Ustrcmp(stp->name, tp->shadow) == 0) break;
-
-    if (!stp)
-      log_write(0, LOG_MAIN|LOG_PANIC, "shadow transport \"%s\" not found ",
-        tp->shadow);
-
-    /* Pick off the addresses that have succeeded, and make clones. Put into
-    the shadow_message field a pointer to the shadow_message field of the real
-    address. */
-
-    else for (addr2 = addr; addr2; addr2 = addr2->next)
-      if (addr2->transport_return == OK)
-	{
-	addr3 = store_get(sizeof(address_item), FALSE);
-	*addr3 = *addr2;
-	addr3->next = NULL;
-	addr3->shadow_message = US &addr2->shadow_message;
-	addr3->transport = stp;
-	addr3->transport_return = DEFER;
-	addr3->return_filename = NULL;
-	addr3->return_file = -1;
-	*last = addr3;
-	last = &addr3->next;
-	}
-
-    /* If we found any addresses to shadow, run the delivery, and stick any
-    message back into the shadow_message field in the original. */
-
-    if (shadow_addr)
-      {
-      int save_count = transport_count;
-
-      DEBUG(D_deliver|D_transport)
-        debug_printf(">>>>>>>>>>>>>>>> Shadow delivery >>>>>>>>>>>>>>>>\n");
-      deliver_local(shadow_addr, TRUE);
-
-      for(; shadow_addr; shadow_addr = shadow_addr->next)
-        {
-        int sresult = shadow_addr->transport_return;
-        *(uschar **)shadow_addr->shadow_message =
-	  sresult == OK
-	  ? string_sprintf(" ST=%s", stp->name)
-	  : string_sprintf(" ST=%s (%s%s%s)", stp->name,
-	      shadow_addr->basic_errno <= 0
-	      ? US""
-	      : US strerror(shadow_addr->basic_errno),
-	      shadow_addr->basic_errno <= 0 || !shadow_addr->message
-	      ? US""
-	      : US": ",
-	      shadow_addr->message
-	      ? shadow_addr->message
-	      : shadow_addr->basic_errno <= 0
-	      ? US"unknown error"
-	      : US"");
-
-        DEBUG(D_deliver|D_transport)
-          debug_printf("%s shadow transport returned %s for %s\n",
-            stp->name, rc_to_string(sresult), shadow_addr->address);
-        }
-
-      DEBUG(D_deliver|D_transport)
-        debug_printf(">>>>>>>>>>>>>>>> End shadow delivery >>>>>>>>>>>>>>>>\n");
-
-      transport_count = save_count;   /* Restore original transport count */
-      }
+    local_par_start(addr, serialize_key, &delivery_start, logflags);
+    deliver_set_expansions(NULL);
     }
-
-  /* Cancel the expansions that were set up for the delivery. */
-
-  deliver_set_expansions(NULL);
-
-  /* If the transport was parallelism-limited, decrement the hints DB record. */
-
-  if (serialize_key) enq_end(serialize_key);
-
-  /* Now we can process the results of the real transport. We must take each
-  address off the chain first, because post_process_one() puts it on another
-  chain. */
-
-  for (addr2 = addr; addr2; addr2 = nextaddr)
+  else
     {
-    int result = addr2->transport_return;
-    nextaddr = addr2->next;
-
-    DEBUG(D_deliver|D_transport)
-      debug_printf("%s transport returned %s for %s\n",
-        tp->name, rc_to_string(result), addr2->address);
-
-    /* If there is a retry_record, or if delivery is deferred, build a retry
-    item for setting a new retry time or deleting the old retry record from
-    the database. These items are handled all together after all addresses
-    have been handled (so the database is open just for a short time for
-    updating). */
-
-    if (result == DEFER || testflag(addr2, af_lt_retry_exists))
-      {
-      int flags = result == DEFER ? 0 : rf_delete;
-      uschar *retry_key = string_copy(tp->retry_use_local_part
-	? addr2->address_retry_key : addr2->domain_retry_key);
-      *retry_key = 'T';
-      retry_add_item(addr2, retry_key, flags);
-      }
-
-    /* Done with this address */
-
-    addr2->delivery_time = deliver_time;
-    post_process_one(addr2, result, logflags, EXIM_DTYPE_TRANSPORT, logchar);
-
-    /* If a pipe delivery generated text to be sent back, the result may be
-    changed to FAIL, and we must copy this for subsequent addresses in the
-    batch. */
-
-    if (addr2->transport_return != result)
-      {
-      for (addr3 = nextaddr; addr3; addr3 = addr3->next)
-        {
-        addr3->transport_return = addr2->transport_return;
-        addr3->basic_errno = addr2->basic_errno;
-        addr3->message = addr2->message;
-        }
-      result = addr2->transport_return;
-      }
-
-    /* Whether or not the result was changed to FAIL, we need to copy the
-    return_file value from the first address into all the addresses of the
-    batch, so they are all listed in the error message. */
-
-    addr2->return_file = addr->return_file;
-
-    /* Change log character for recording successful deliveries. */
-
-    if (result == OK) logchar = '-';
+    deliver_local(addr, FALSE);
+    local_delivery_done(addr, tp, serialize_key, &delivery_start, logflags);
     }
   }        /* Loop back for next batch of addresses */
+
+/* Wait for any deliveries that are still running. */
+
+while (lparcount > 0) local_par_wait();
+lparlist = NULL;
 }
 
 
@@ -3451,6 +3886,7 @@ while (!done)
 	memcpy(&r->more_errno, ptr, sizeof(r->more_errno));
 	ptr += sizeof(r->more_errno);
 	r->message = *ptr ? string_copy(ptr) : NULL;
+	r->next_try = 0;
 	DEBUG(D_deliver|D_retry) debug_printf("  added %s item\n",
 	    r->flags & rf_delete ? "delete" : "retry");
 	}
@@ -3474,6 +3910,20 @@ while (!done)
       ptr += sizeof(transport_count);
       break;
 
+#ifndef DISABLE_DKIM
+    /* DKIM bodyhashes for the message, kept in the spool header so that
+    later signings (and deliveries) need not hash the body again. */
+
+    case 'B':
+      if (dkim_exim_bodyhashes_merge(ptr))
+	{
+	update_spool = TRUE;
+	spool_dedup_bodyhashes_put();
+	}
+      while (*ptr++);
+      break;
+#endif
+
     /* Address items are in the order of items on the address chain. We
     remember the current address value in case this function is called
     several times to empty the pipe in stages. Information about delivery
@@ -3614,6 +4064,8 @@ while (!done)
 	  ptr += sizeof(addr->more_errno);
 	  memcpy(&addr->delivery_time, ptr, sizeof(addr->delivery_time));
 	  ptr += sizeof(addr->delivery_time);
+	  memcpy(&addr->retry_due, ptr, sizeof(addr->retry_due));
+	  ptr += sizeof(addr->retry_due);
 	  memcpy(&addr->flags, ptr, sizeof(addr->flags));
 	  ptr += sizeof(addr->flags);
 	  addr->message = *ptr ? string_copy(ptr) : NULL;
@@ -3655,6 +4107,17 @@ while (!done)
       while (*ptr++) ;
       break;
 
+    /* Resource usage of the subprocess, for all its addresses */
+
+    case 'U':
+      {
+      struct rusage * rup = store_get(sizeof(struct rusage), FALSE);
+      memcpy(rup, ptr, sizeof(struct rusage));
+      ptr += sizeof(struct rusage);
+      for (address_item * a = addrlist; a; a = a->next) a->rusage = rup;
+      }
+      break;
+
     /* Z marks the logical end of the data. It is followed by '0' if
     continue_transport was NULL at the end of transporting, otherwise '1'.
     We need to know when it becomes NULL during a delivery down a passed SMTP
@@ -3703,6 +4166,9 @@ pushing stuff into it. */
 
 (void)close(fd);
 p->fd = -1;
+#ifndef NO_POLL_H
+parpoll[poffset].fd = -1;
+#endif
 
 /* If we have finished without error, but haven't had data for every address,
 something is wrong. */
@@ -3858,6 +4324,14 @@ To avoid this, if all the data that is needed has been read from a subprocess
 after select(), an explicit wait() for it is done. We know that all it is doing
 is writing to the pipe and then exiting, so the wait should not be long.
 
+Where poll() is available it is used instead of select(). With a large value
+of remote_max_parallel, the pipe descriptors can exceed the limit of an fd_set,
+and the cost of each select() call grows with the highest descriptor number
+rather than with the number of subprocesses. The pollfd array is kept alongside
+the parlist vector, with one entry per slot, and updated as subprocesses are
+started and finish; idle slots have a negative descriptor, which poll()
+ignores.
+
 The non-blocking waitpid() is to some extent just insurance; if we could
 reliably detect end-of-file on the pipe, we could always know when to do a
 blocking wait() for a completed process. However, because some systems use
@@ -3875,9 +4349,12 @@ for (;;)   /* Normally we do not repeat this loop */
   {
   while ((pid = waitpid(-1, &status, WNOHANG)) <= 0)
     {
+#ifdef NO_POLL_H
     struct timeval tv;
     fd_set select_pipes;
-    int maxpipe, readycount;
+    int maxpipe;
+#endif
+    int readycount;
 
     /* A return value of -1 can mean several things. If errno != ECHILD, it
     either means invalid options (which we discount), or that this process was
@@ -3936,6 +4413,13 @@ for (;;)   /* Normally we do not repeat this loop */
 
     DEBUG(D_deliver) debug_printf("selecting on subprocess pipes\n");
 
+#ifndef NO_POLL_H
+    /* Stick in a 60-second timeout, just in case. */
+
+    readycount = poll(parpoll, remote_max_parallel, 60 * 1000);
+# define PAR_PIPE_READY(poffset) (parpoll[poffset].revents != 0)
+
+#else
     maxpipe = 0;
     FD_ZERO(&select_pipes);
     for (poffset = 0; poffset < remote_max_parallel; poffset++)
@@ -3953,10 +4437,12 @@ for (;;)   /* Normally we do not repeat this loop */
 
     readycount = select(maxpipe + 1, (SELECT_ARG2_TYPE *)&select_pipes,
          NULL, NULL, &tv);
+# define PAR_PIPE_READY(poffset) FD_ISSET(parlist[poffset].fd, &select_pipes)
+#endif
 
     /* Scan through the pipes and read any that are ready; use the count
-    returned by select() to stop when there are no more. Select() can return
-    with no processes (e.g. if interrupted). This shouldn't matter.
+    returned by select() or poll() to stop when there are no more. Either can
+    return with no processes (e.g. if interrupted). This shouldn't matter.
 
     If par_read_pipe() returns TRUE, it means that either the terminating Z was
     read, or there was a disaster. In either case, we are finished with this
@@ -3972,7 +4458,7 @@ for (;;)   /* Normally we do not repeat this loop */
          poffset++)
       {
       if (  (pid = parlist[poffset].pid) != 0
-         && FD_ISSET(parlist[poffset].fd, &select_pipes)
+         && PAR_PIPE_READY(poffset)
 	 )
         {
         readycount--;
@@ -3988,6 +4474,7 @@ for (;;)   /* Normally we do not repeat this loop */
             }
         }
       }
+#undef PAR_PIPE_READY
 
     /* Now go back and look for a completed subprocess again. */
     }
@@ -4071,6 +4558,9 @@ decrement the count of subprocesses, and return the address chain. */
 transport_count = parlist[poffset].transport_count;
 used_return_path = parlist[poffset].return_path;
 parlist[poffset].pid = 0;
+#ifndef NO_POLL_H
+parpoll[poffset].fd = -1;
+#endif
 parcount--;
 return addrlist;
 }
@@ -4212,6 +4702,14 @@ if (!parlist)
   parlist = store_get(remote_max_parallel * sizeof(pardata), FALSE);
   for (poffset = 0; poffset < remote_max_parallel; poffset++)
     parlist[poffset].pid = 0;
+#ifndef NO_POLL_H
+  parpoll = store_get(remote_max_parallel * sizeof(struct pollfd), FALSE);
+  for (poffset = 0; poffset < remote_max_parallel; poffset++)
+    {
+    parpoll[poffset].fd = -1;
+    parpoll[poffset].events = POLLIN;
+    }
+#endif
   }
 
 /* Now loop for each remote delivery */
@@ -4699,20 +5197,29 @@ all pipes, so I do not see a reason to use non-blocking IO here
     the file in order to get a new file descriptor with its own
     file pointer. We don't need to lock it, as the lock is held by
     the parent process. There doesn't seem to be any way of doing
-    a dup-with-new-file-pointer. */
+    a dup-with-new-file-pointer. A copy of a compressed file is made again,
+    from the compressed file, which is read without using its file pointer. */
 
     (void)close(deliver_datafile);
-    {
-    uschar * fname = spool_fname(US"input", message_subdir, message_id, US"-D");
+    if (deliver_datafile_lock >= 0)
+      {
+      if ((deliver_datafile = spool_datafile_plain(deliver_datafile_lock,
+				message_subdir, message_id)) < 0)
+	log_write(0, LOG_MAIN|LOG_PANIC_DIE, "Failed to reopen data file for "
+	  "remote parallel delivery");
+      }
+    else
+      {
+      uschar * fname = spool_fname(US"input", message_subdir, message_id, US"-D");
 
-    if ((deliver_datafile = Uopen(fname,
+      if ((deliver_datafile = Uopen(fname,
 #ifdef O_CLOEXEC
 					O_CLOEXEC |
 #endif
 					O_RDWR | O_APPEND, 0)) < 0)
-      log_write(0, LOG_MAIN|LOG_PANIC_DIE, "Failed to reopen %s for remote "
-        "parallel delivery: %s", fname, strerror(errno));
-    }
+	log_write(0, LOG_MAIN|LOG_PANIC_DIE, "Failed to reopen %s for remote "
+	  "parallel delivery: %s", fname, strerror(errno));
+      }
 
     /* Set the close-on-exec flag */
 #ifndef O_CLOEXEC
@@ -4770,6 +5277,14 @@ all pipes, so I do not see a reason to use non-blocking IO here
     memcpy(big_buffer, &transport_count, sizeof(transport_count));
     rmt_dlv_checked_write(fd, 'S', '0', big_buffer, sizeof(transport_count));
 
+#ifndef DISABLE_DKIM
+    /* Any DKIM bodyhashes computed by the transport */
+
+    if (dkim_bodyhashes)
+      rmt_dlv_checked_write(fd, 'B', '0', dkim_bodyhashes,
+			    Ustrlen(dkim_bodyhashes) + 1);
+#endif
+
     /* Information about what happened to each address. Four item types are
     used: an optional 'X' item first, for TLS information, then an optional "C"
     item for any client-auth info followed by 'R' items for any retry settings,
@@ -4787,6 +5302,8 @@ all pipes, so I do not see a reason to use non-blocking IO here
 # ifndef DISABLE_TLS_RESUME
       if (tls_out.resumption & RESUME_USED) setflag(addr, af_tls_resume);
 # endif
+      if (tls_out.ktls & KTLS_TX) setflag(addr, af_ktls_tx);
+      if (tls_out.ktls & KTLS_RX) setflag(addr, af_ktls_rx);
 
       /* Use an X item only if there's something to send */
 #ifndef DISABLE_TLS
@@ -4938,6 +5455,8 @@ all pipes, so I do not see a reason to use non-blocking IO here
       ptr += sizeof(addr->more_errno);
       memcpy(ptr, &addr->delivery_time, sizeof(addr->delivery_time));
       ptr += sizeof(addr->delivery_time);
+      memcpy(ptr, &addr->retry_due, sizeof(addr->retry_due));
+      ptr += sizeof(addr->retry_due);
       memcpy(ptr, &addr->flags, sizeof(addr->flags));
       ptr += sizeof(addr->flags);
 
@@ -4975,6 +5494,26 @@ all pipes, so I do not see a reason to use non-blocking IO here
       rmt_dlv_checked_write(fd, 'I', '0', big_buffer, ptr - big_buffer);
       }
 
+    /* Resources used by this process and any it has waited for. They apply
+    to all the addresses it handled. */
+
+    if (LOGGING(resource_usage))
+      {
+      struct rusage ru, ruc;
+      getrusage(RUSAGE_SELF, &ru);
+      getrusage(RUSAGE_CHILDREN, &ruc);
+      ru.ru_utime.tv_sec += ruc.ru_utime.tv_sec;
+      if ((ru.ru_utime.tv_usec += ruc.ru_utime.tv_usec) >= 1000*1000)
+	{ ru.ru_utime.tv_sec++; ru.ru_utime.tv_usec -= 1000*1000; }
+      ru.ru_stime.tv_sec += ruc.ru_stime.tv_sec;
+      if ((ru.ru_stime.tv_usec += ruc.ru_stime.tv_usec) >= 1000*1000)
+	{ ru.ru_stime.tv_sec++; ru.ru_stime.tv_usec -= 1000*1000; }
+      ru.ru_inblock += ruc.ru_inblock;
+      ru.ru_oublock += ruc.ru_oublock;
+      if (ruc.ru_maxrss > ru.ru_maxrss) ru.ru_maxrss = ruc.ru_maxrss;
+      rmt_dlv_checked_write(fd, 'U', '0', &ru, sizeof(ru));
+      }
+
     /* Add termination flag, close the pipe, and that's it. The character
     after 'Z' indicates whether continue_transport is now NULL or not.
     A change from non-NULL to NULL indicates a problem with a continuing
@@ -4983,6 +5522,7 @@ all pipes, so I do not see a reason to use non-blocking IO here
     big_buffer[0] = continue_transport ? '1' : '0';
     rmt_dlv_checked_write(fd, 'Z', '0', big_buffer, 1);
     (void)close(fd);
+    profile_report();
     exit(EXIT_SUCCESS);
     }
 
@@ -5018,9 +5558,13 @@ all pipes, so I do not see a reason to use non-blocking IO here
   when the process finishes. */
 
   parcount++;
+  EXIM_PROBE4(delivery__start, message_id, addr->address, tp->name, pid);
   parlist[poffset].addrlist = parlist[poffset].addr = addr;
   parlist[poffset].pid = pid;
   parlist[poffset].fd = pfd[pipe_read];
+#ifndef NO_POLL_H
+  parpoll[poffset].fd = pfd[pipe_read];
+#endif
   parlist[poffset].done = FALSE;
   parlist[poffset].msg = NULL;
   parlist[poffset].return_path = return_path;
@@ -5147,6 +5691,7 @@ if (percent_hack_domains)
     {
     address_item *new_parent = store_get(sizeof(address_item), FALSE);
     *new_parent = *addr;
+    addr_cold_share(addr);
     addr->parent = new_parent;
     new_parent->child_count = 1;
     addr->address = new_address;
@@ -5295,7 +5840,7 @@ fprintf(f, "%s", CS string_printing(printed));
 
 if (ancestor != addr)
   {
-  uschar *original = ancestor->onetime_parent;
+  uschar *original = ADDR_COLD(ancestor)->onetime_parent;
   if (!original) original= ancestor->address;
   if (strcmpic(original, printed) != 0)
     fprintf(f, "%s(%sgenerated from %s)", sc,
@@ -5465,7 +6010,7 @@ while ((addr = *anchor))
     {
     anchor = &(addr->next);
     }
-  else if ((tnode = tree_search(tree_duplicates, addr->unique)))
+  else if ((tnode = tree_hash_search(&tree_duplicates, addr->unique)))
     {
     DEBUG(D_deliver|D_route)
       debug_printf("%s is a duplicate address: discarded\n", addr->unique);
@@ -5546,6 +6091,80 @@ else if (!(fp = Ufopen(s, "rb")))
 return fp;
 }
 
+/*************************************************
+*     Copy routing from another address          *
+*************************************************/
+
+/* Used for same_domain_copy_routing, when an address with the same domain has
+already been routed by a router that has it set.
+
+Arguments:
+  addr2       the address to be given the routing
+  addr        the address that was routed
+*/
+
+static void
+copy_routing(address_item * addr2, address_item * addr)
+{
+addr2->domain = addr->domain;
+addr2->router = addr->router;
+addr2->transport = addr->transport;
+addr2->host_list = addr->host_list;
+addr2->fallback_hosts = addr->fallback_hosts;
+addr2->prop.errors_address = addr->prop.errors_address;
+copyflag(addr2, addr, af_hide_child);
+copyflag(addr2, addr, af_local_host_removed);
+
+DEBUG(D_deliver|D_route)
+  debug_printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n"
+	       "routing %s\n"
+	       "Routing for %s copied from %s\n",
+    addr2->address, addr2->address, addr->address);
+}
+
+
+
+/*************************************************
+*        Set up the delivery copy buffers        *
+*************************************************/
+
+/* The buffers used for copying the message during delivery are normally of a
+fixed size, but delivery_buffer_size can override it. If delivery_buffer_size_max
+is larger, the buffers are made bigger for a large message, doubling while the
+message is more than 16 times the buffer size, so that it is written in fewer
+and larger blocks without costing much memory for small messages. The size of
+the message's spool data file must be known.
+
+Arguments:    none
+Returns:      nothing
+*/
+
+void
+deliver_buffers_init(void)
+{
+int size = delivery_buffer_size;
+
+if (size > 0)
+  deliver_in_buffer_size = deliver_out_buffer_size = size;
+else
+  size = deliver_out_buffer_size;
+
+while (size < delivery_buffer_size_max && message_body_size / 16 > size)
+  size *= 2;
+if (size > deliver_out_buffer_size)
+  {
+  if (delivery_buffer_size_max < size) size = delivery_buffer_size_max;
+  deliver_in_buffer_size = deliver_out_buffer_size = size;
+  }
+
+DEBUG(D_deliver) debug_printf("delivery buffers: %d in, %d out\n",
+  deliver_in_buffer_size, deliver_out_buffer_size);
+deliver_in_buffer = store_malloc(deliver_in_buffer_size);
+deliver_out_buffer = store_malloc(deliver_out_buffer_size);
+}
+
+
+
 /*************************************************
 *              Deliver one message               *
 *************************************************/
@@ -5594,8 +6213,8 @@ time_t now = time(NULL);
 address_item *addr_last = NULL;
 uschar *filter_message = NULL;
 int process_recipients = RECIP_ACCEPT;
-open_db dbblock;
-open_db *dbm_file;
+open_db dbblock, route_dbblock;
+open_db *dbm_file, *route_dbm = NULL;
 extern int acl_where;
 uschar *info;
 
@@ -5612,6 +6231,10 @@ information. If not, we want to show this initial information if D_deliver or
 D_queue_run is set or in verbose mode. */
 
 set_process_info("%s", info);
+store_stats_pid = getpid();
+profile_start();
+mainlog_buffer_start();
+queue_delivery_notify(TRUE);
 
 if (  !(debug_selector & D_process_info)
    && (debug_selector & (D_deliver|D_queue_run|D_v))
@@ -5654,6 +6277,20 @@ message_size = 0;
 update_spool = FALSE;
 remove_journal = TRUE;
 
+/* A continued delivery that was not given a fresh process (see
+transport_pass_socket()) inherits the address lists of the previous message,
+and the subprocess table of the process that delivered it. Clear them. */
+
+addr_defer = addr_failed = addr_fallback = addr_local = addr_new = NULL;
+addr_remote = addr_route = addr_succeed = addr_senddsn = NULL;
+addr_duplicate = NULL;
+tree_duplicates = (tree_hash) { .slots = NULL };
+message_log = NULL;
+copied_routing = NULL;
+if (parlist)
+  for (int poffset = 0; poffset < remote_max_parallel; poffset++)
+    parlist[poffset].pid = 0;
+
 /* Set a known context for any ACLs we call via expansions */
 acl_where = ACL_WHERE_DELIVERY;
 
@@ -5718,16 +6355,23 @@ give up; if the message has been around for sufficiently long, remove it. */
       Uunlink(spool_fname(US"input", message_subdir, id, US"-D"));
       Uunlink(spool_fname(US"input", message_subdir, id, US"-H"));
       Uunlink(spool_fname(US"input", message_subdir, id, US"-J"));
+      queue_index_notify(NOTIFY_QUEUE_DEL, id, message_subdir[0], queue_name);
       log_write(0, LOG_MAIN, "Message removed because older than %s",
 	readconf_printtime(keep_malformed));
       }
 
-    (void)close(deliver_datafile);
-    deliver_datafile = -1;
+    spool_close_datafile();
     return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
     }
   }
 
+/* The data file itself says whether it is compressed; if an earlier attempt
+failed to record that in the header file, it will be put right when the file is
+next written. */
+
+if ((deliver_datafile_lock >= 0) != (spool_file_compressed > 0))
+  spool_file_compressed = deliver_datafile_lock >= 0 ? message_body_size : 0;
+
 /* The spool header file has been read. Look to see if there is an existing
 journal file for this message. If there is, it means that a previous delivery
 attempt crashed (program or host) before it could update the spool header file.
@@ -5781,8 +6425,7 @@ Otherwise it might be needed again. */
 
   if (!recipients_list)
     {
-    (void)close(deliver_datafile);
-    deliver_datafile = -1;
+    spool_close_datafile();
     log_write(0, LOG_MAIN, "Spool error: no recipients for %s", fname);
     return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
     }
@@ -5840,8 +6483,7 @@ if (f.deliver_freeze)
 	  || !f.admin_user || continue_hostname
        )  )
       {
-      (void)close(deliver_datafile);
-      deliver_datafile = -1;
+      spool_close_datafile();
       log_write(L_skip_delivery, LOG_MAIN, "Message is frozen");
       return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
       }
@@ -5971,8 +6613,7 @@ else if (system_filter && process_recipients != RECIP_FAIL_TIMEOUT)
 
   if (rc == FF_ERROR || rc == FF_NONEXIST)
     {
-    (void)close(deliver_datafile);
-    deliver_datafile = -1;
+    spool_close_datafile();
     log_write(0, LOG_MAIN|LOG_PANIC, "Error in system filter: %s",
       string_printing(filter_message));
     return continue_closedown();   /* yields DELIVER_NOT_ATTEMPTED */
@@ -6215,7 +6856,7 @@ complications for local addresses. */
 
 if (process_recipients != RECIP_IGNORE)
   for (i = 0; i < recipients_count; i++)
-    if (!tree_search(tree_nonrecipients, recipients_list[i].address))
+    if (!tree_hash_search(&tree_nonrecipients, recipients_list[i].address))
       {
       recipient_item *r = recipients_list + i;
       address_item *new = deliver_make_addr(r->address, FALSE);
@@ -6233,7 +6874,7 @@ if (process_recipients != RECIP_IGNORE)
 #endif
 
       if (r->pno >= 0)
-        new->onetime_parent = recipients_list[r->pno].address;
+        addr_cold(new)->onetime_parent = recipients_list[r->pno].address;
 
       /* If DSN support is enabled, set the dsn flags and the original receipt
       to be passed on to other DSN enabled MTAs */
@@ -6343,13 +6984,12 @@ DEBUG(D_deliver)
   debug_printf("Delivery address list:\n");
   for (address_item * p = addr_new; p; p = p->next)
     debug_printf("  %s %s\n", p->address,
-      p->onetime_parent ? p->onetime_parent : US"");
+      ADDR_COLD(p)->onetime_parent ? ADDR_COLD(p)->onetime_parent : US"");
   }
 
 /* Set up the buffers used for copying over the file when delivering. */
 
-deliver_in_buffer = store_malloc(DELIVER_IN_BUFFER_SIZE);
-deliver_out_buffer = store_malloc(DELIVER_OUT_BUFFER_SIZE);
+deliver_buffers_init();
 
 
 
@@ -6392,6 +7032,14 @@ deliver_out_buffer = store_malloc(DELIVER_OUT_BUFFER_SIZE);
 */
 
 f.header_rewritten = FALSE;          /* No headers rewritten yet */
+copied_routing = NULL;               /* No same_domain_copy_routing yet */
+
+/* Routings cached by an earlier delivery attempt can be used for top-level
+addresses. There cannot be any on the first attempt. */
+
+if (route_cache_ttl > 0 && !f.deliver_firsttime)
+  route_dbm = dbfn_open(US"routes", O_RDONLY, &route_dbblock, FALSE, TRUE);
+
 while (addr_new)           /* Loop until all addresses dealt with */
   {
   address_item *addr, *parent;
@@ -6461,10 +7109,10 @@ while (addr_new)           /* Loop until all addresses dealt with */
       keep piling '>' characters on the front. */
 
       if (addr->address[0] == '>')
-        while (tree_search(tree_duplicates, addr->unique))
+        while (tree_hash_search(&tree_duplicates, addr->unique))
           addr->unique = string_sprintf(">%s", addr->unique);
 
-      else if ((tnode = tree_search(tree_duplicates, addr->unique)))
+      else if ((tnode = tree_hash_search(&tree_duplicates, addr->unique)))
         {
         DEBUG(D_deliver|D_route)
           debug_printf("%s is a duplicate address: discarded\n", addr->address);
@@ -6478,7 +7126,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
 
       /* Check for previous delivery */
 
-      if (tree_search(tree_nonrecipients, addr->unique))
+      if (tree_hash_search(&tree_nonrecipients, addr->unique))
         {
         DEBUG(D_deliver|D_route)
           debug_printf("%s was previously delivered: discarded\n", addr->address);
@@ -6629,7 +7277,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
 
     DEBUG(D_deliver|D_route) debug_printf("unique = %s\n", addr->unique);
 
-    if (tree_search(tree_nonrecipients, addr->unique))
+    if (tree_hash_search(&tree_nonrecipients, addr->unique))
       {
       DEBUG(D_deliver|D_route)
         debug_printf("%s was previously delivered: discarded\n", addr->unique);
@@ -6777,6 +7425,17 @@ while (addr_new)           /* Loop until all addresses dealt with */
       {
       addr->message = US"retry time not reached";
       addr->basic_errno = ERRNO_RRETRY;
+
+      /* Routing is next allowed when neither record holds it back */
+
+      addr->retry_due = domain_retry_record && !domain_retry_record->expired
+	? domain_retry_record->next_try : 0;
+      if (address_retry_record && address_retry_record->next_try > addr->retry_due)
+	addr->retry_due = domain_retry_record
+	  ? address_retry_record->next_try
+	  : retry_next_due(addr->address_retry_key, addr->domain,
+			  address_retry_record);
+
       (void)post_process_one(addr, DEFER, LOG_MAIN, EXIM_DTYPE_ROUTER, 0);
 
       /* For remote-retry errors (here and just above) that we've not yet
@@ -6852,12 +7511,31 @@ while (addr_new)           /* Loop until all addresses dealt with */
   while (addr_route)
     {
     int rc;
+    tree_node *t;
     address_item *addr = addr_route;
+    address_item *old_new = addr_new;
     const uschar *old_domain = addr->domain;
     uschar *old_unique = addr->unique;
     addr_route = addr->next;
     addr->next = NULL;
 
+    /* If an address in the same domain has been routed by a router with
+    same_domain_copy_routing set, copy its routing. */
+
+    if (copied_routing && (t = tree_search(copied_routing, addr->domain)))
+      {
+      copy_routing(addr, t->data.ptr);
+      addr->next = addr_remote;
+      addr_remote = addr;
+      continue;  /* route next address */
+      }
+
+    /* Start at the router an earlier delivery attempt used, if it was
+    cached. */
+
+    if (route_dbm && !addr->parent)
+      (void) route_cache_get(route_dbm, addr);
+
     /* Just in case some router parameter refers to it. */
 
     if (!(return_path = addr->prop.errors_address))
@@ -6915,7 +7593,7 @@ while (addr_new)           /* Loop until all addresses dealt with */
     gets recorded. */
 
     if (  addr->unique != old_unique
-       && tree_search(tree_nonrecipients, addr->unique) != 0
+       && tree_hash_search(&tree_nonrecipients, addr->unique) != 0
        )
       {
       DEBUG(D_deliver|D_route) debug_printf("%s was previously delivered: "
@@ -6930,7 +7608,9 @@ while (addr_new)           /* Loop until all addresses dealt with */
     routing. The option is settable only on routers that generate host lists.
     We play it very safe, and do the optimization only if the address is routed
     to a remote transport, there are no header changes, and the domain was not
-    modified by the router. */
+    modified by the router. The domain is remembered for the rest of the
+    routing, so that addresses generated later, for example by expanding an
+    alias, are covered as well as those waiting now. */
 
     if (  addr_remote == addr
        && addr->router->same_domain_copy_routing
@@ -6939,45 +7619,30 @@ while (addr_new)           /* Loop until all addresses dealt with */
        && old_domain == addr->domain
        )
       {
-      address_item **chain = &addr_route;
-      while (*chain)
-        {
-        address_item *addr2 = *chain;
-        if (Ustrcmp(addr2->domain, addr->domain) != 0)
-          {
-          chain = &(addr2->next);
-          continue;
-          }
-
-        /* Found a suitable address; take it off the routing list and add it to
-        the remote delivery list. */
-
-        *chain = addr2->next;
-        addr2->next = addr_remote;
-        addr_remote = addr2;
-
-        /* Copy the routing data */
+      const uschar * domain = addr->domain;
+      tree_node * node = store_get(sizeof(tree_node) + Ustrlen(domain),
+				    is_tainted(domain));
+      Ustrcpy(node->name, domain);
+      node->data.ptr = addr;
+      (void) tree_insertnode(&copied_routing, node);
+      }
 
-        addr2->domain = addr->domain;
-        addr2->router = addr->router;
-        addr2->transport = addr->transport;
-        addr2->host_list = addr->host_list;
-        addr2->fallback_hosts = addr->fallback_hosts;
-        addr2->prop.errors_address = addr->prop.errors_address;
-        copyflag(addr2, addr, af_hide_child);
-        copyflag(addr2, addr, af_local_host_removed);
+    /* Remember the routing of a top-level address that went straight to a
+    transport, in case this delivery attempt defers. */
 
-        DEBUG(D_deliver|D_route)
-          debug_printf(">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n"
-                       "routing %s\n"
-                       "Routing for %s copied from %s\n",
-            addr2->address, addr2->address, addr->address);
-        }
-      }
+    if (  route_cache_ttl > 0
+       && !addr->parent
+       && (addr_local == addr || addr_remote == addr)
+       && addr_new == old_new
+       && old_domain == addr->domain
+       )
+      route_cache_put(addr);
     }  /* Continue with routing the next address. */
   }    /* Loop to process any child addresses that the routers created, and
           any rerouted addresses that got put back on the new chain. */
 
+if (route_dbm) dbfn_close(route_dbm);
+
 
 /* Debugging: show the results of the routing */
 
@@ -7331,7 +7996,10 @@ updating of the database if the -N flag is set, which is a debugging thing that
 prevents actual delivery. */
 
 else if (!f.dont_deliver)
+  {
   retry_update(&addr_defer, &addr_failed, &addr_succeed);
+  if (route_cache_ttl > 0) route_cache_write();
+  }
 
 /* Send DSN for successful messages if requested */
 addr_senddsn = NULL;
@@ -7367,6 +8035,7 @@ for (address_item * a = addr_succeed; a; a = a->next)
     address_item * addr_next = addr_senddsn;
     addr_senddsn = store_get(sizeof(address_item), FALSE);
     *addr_senddsn = *a;
+    addr_cold_share(a);
     addr_senddsn->next = addr_next;
     }
   else
@@ -7548,7 +8217,7 @@ while (addr_failed)
     {
     addr = addr_failed;
     addr_failed = addr->next;
-    if (addr->return_filename) Uunlink(addr->return_filename);
+    if (ADDR_COLD(addr)->return_filename) Uunlink(ADDR_COLD(addr)->return_filename);
 
 #ifndef DISABLE_EVENT
     msg_event_raise(US"msg:fail:delivery", addr);
@@ -7785,14 +8454,14 @@ wording. */
             {
             print_address_information(addr, fp, US"------ ",  US"\n       ",
               US" ------\n");
-            if (addr->return_filename) break;
+            if (ADDR_COLD(addr)->return_filename) break;
             addr = addr->next;
             }
 	  fputc('\n', fp);
 
           /* Now copy the file */
 
-          if (!(fm = Ufopen(addr->return_filename, "rb")))
+          if (!(fm = Ufopen(ADDR_COLD(addr)->return_filename, "rb")))
             fprintf(fp, "    +++ Exim error... failed to open text file: %s\n",
               strerror(errno));
           else
@@ -7800,7 +8469,7 @@ wording. */
             while ((ch = fgetc(fm)) != EOF) fputc(ch, fp);
             (void)fclose(fm);
             }
-          Uunlink(addr->return_filename);
+          Uunlink(ADDR_COLD(addr)->return_filename);
 
           /* Can now add to handled chain, first fishing off the next
           address on the msgchain. */
@@ -8028,7 +8697,7 @@ if (!addr_defer)
 
       if ((rc = Urename(fname, moname)) < 0)
         {
-        (void)directory_make(spool_directory,
+        (void)directory_make(spool_root(id),
 			      spool_sname(US"msglog.OLD", US""),
 			      MSGLOG_DIRECTORY_MODE, TRUE);
         rc = Urename(fname, moname);
@@ -8043,16 +8712,19 @@ if (!addr_defer)
 		  fname, strerror(errno));
     }
 
-  /* Remove the two message files. */
+  /* Remove the two message files, and any shared data file that is no longer
+needed. */
 
   fname = spool_fname(US"input", message_subdir, id, US"-D");
   if (Uunlink(fname) < 0)
     log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to unlink %s: %s",
       fname, strerror(errno));
+  spool_dedup_release(deliver_datafile);
   fname = spool_fname(US"input", message_subdir, id, US"-H");
   if (Uunlink(fname) < 0)
     log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to unlink %s: %s",
       fname, strerror(errno));
+  queue_index_notify(NOTIFY_QUEUE_DEL, id, message_subdir[0], queue_name);
 
   /* Log the end of this message, with queue time if requested. */
 
@@ -8124,14 +8796,14 @@ else if (addr_defer != (address_item *)(+1))
         deliver_domain = NULL;
       }
 
-    if (addr->return_filename) Uunlink(addr->return_filename);
+    if (ADDR_COLD(addr)->return_filename) Uunlink(ADDR_COLD(addr)->return_filename);
 
     /* Handle the case of one-time aliases. If any address in the ancestry
     of this one is flagged, ensure it is in the recipients list, suitably
     flagged, and that its parent is marked delivered. */
 
     for (otaddr = addr; otaddr; otaddr = otaddr->parent)
-      if (otaddr->onetime_parent) break;
+      if (ADDR_COLD(otaddr)->onetime_parent) break;
 
     if (otaddr)
       {
@@ -8141,7 +8813,7 @@ else if (addr_defer != (address_item *)(+1))
       for (i = 0; i < recipients_count; i++)
         {
         uschar *r = recipients_list[i].address;
-        if (Ustrcmp(otaddr->onetime_parent, r) == 0) t = i;
+        if (Ustrcmp(ADDR_COLD(otaddr)->onetime_parent, r) == 0) t = i;
         if (Ustrcmp(otaddr->address, r) == 0) break;
         }
 
@@ -8472,6 +9144,13 @@ else if (addr_defer != (address_item *)(+1))
     debug_printf("delivery deferred: update_spool=%d header_rewritten=%d\n",
       update_spool, f.header_rewritten);
 
+#ifdef SUPPORT_ZSTD
+  /* Now that the message is staying on the queue, a big data file may be
+  compressed; the size recorded in the -H file must then be updated. */
+
+  if (spool_compress_datafile(id)) update_spool = TRUE;
+#endif
+
   if (update_spool || f.header_rewritten)
     /* Panic-dies on error */
     (void)spool_write_header(message_id, SW_DELIVERING, NULL);
@@ -8516,8 +9195,7 @@ if (remove_journal)
 will go away. Otherwise the message becomes available for another process
 to try delivery. */
 
-(void)close(deliver_datafile);
-deliver_datafile = -1;
+spool_close_datafile();
 DEBUG(D_deliver) debug_printf("end delivery of %s\n", id);
 #ifdef MEASURE_TIMING
 report_time_since(&timestamp_startup, US"delivery end"); /* testcase 0005 */
@@ -8586,8 +9264,7 @@ if (rc != spool_read_OK)
 
 assert(new_sender_address);
 
-(void)close(deliver_datafile);
-deliver_datafile = -1;
+spool_close_datafile();
 
 return new_sender_address;
 }
@@ -22,7 +22,7 @@ can be NULL if the name is absolute.
 
 If a non-root uid has been specified for exim, and we are currently running as
 root, ensure the directory is owned by the non-root id if the parent is the
-spool directory.
+spool directory or one of the spool_stripes directories.
 
 Arguments:
   parent    parent directory name; if NULL the name must be absolute
@@ -44,6 +44,9 @@ uschar c = 1;
 struct stat statbuf;
 uschar * path;
 
+for (int i = 0; i < spool_stripe_count && !use_chown; i++)
+  if (parent == spool_stripe_dirs[i]) use_chown = geteuid() == root_uid;
+
 if (is_tainted(name)) 
   { p = US"create"; path = US name; errno = ERRNO_TAINT; goto bad; }
 
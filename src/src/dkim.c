@@ -126,6 +126,13 @@ if (dkim_verify_ctx)
 dkim_verify_ctx = pdkim_init_verify(&dkim_exim_query_dns_txt, dot_stuffing);
 dkim_collect_input = dkim_verify_ctx ? DKIM_MAX_SIGNATURES : 0;
 dkim_collect_error = NULL;
+dkim_bodyhashes = NULL;
+
+/* Any body hashes wanted for signing the message later are calculated
+along with those for verification. */
+
+if (dkim_verify_ctx && dkim_sign_bodyhashes)
+  pdkim_bodyhashes_request(dkim_verify_ctx, dkim_sign_bodyhashes);
 
 /* Start feed up with any cached data */
 receive_get_cache();
@@ -330,6 +337,14 @@ rc = pdkim_feed_finish(dkim_verify_ctx, (pdkim_signature **)&dkim_signatures,
 if (rc != PDKIM_OK && errstr)
   log_write(0, LOG_MAIN, "DKIM: validation error: %s", errstr);
 
+/* The whole body has been hashed, so keep the results for signing.  The
+hashes are of the SMTP input, which has the same canonical form as the
+spool data file except when the headers were ended by a non-header line;
+the caller must discard them in that case. */
+
+if (rc == PDKIM_OK)
+  dkim_bodyhashes = pdkim_bodyhashes_export(dkim_verify_ctx, NULL);
+
 /* Build a colon-separated list of signing domains (and identities, if present) in dkim_signers */
 
 for (pdkim_signature * sig = dkim_signatures; sig; sig = sig->next)
@@ -589,6 +604,135 @@ store_pool = old_pool;
 }
 
 
+/* Signing keys given as files are read once for each process and kept in
+POOL_PERM against their path, with the modification time and size seen; a
+changed file is read again on its next use. As when the file is read directly,
+the key is returned in big_buffer, which the caller wipes after use. */
+
+typedef struct {
+  time_t	mtime;
+  off_t		size;
+  int		len;
+  uschar *	text;
+} dkim_keyfile;
+
+static tree_node * dkim_keyfiles = NULL;
+
+static uschar *
+dkim_key_file(const uschar * path)
+{
+struct stat statbuf;
+tree_node * t;
+dkim_keyfile * k;
+uschar * key;
+int old_pool;
+
+if (Ustat(path, &statbuf) < 0)
+  return expand_file_big_buffer(path);		/* logs the error */
+
+if (  (t = tree_search(dkim_keyfiles, path))
+   && (k = t->data.ptr)->mtime == statbuf.st_mtime
+   && k->size == statbuf.st_size
+   && k->len < big_buffer_size)
+  {
+  memcpy(big_buffer, k->text, k->len + 1);
+  return big_buffer;
+  }
+
+if (!(key = expand_file_big_buffer(path)))
+  return NULL;
+
+old_pool = store_pool;
+store_pool = POOL_PERM;
+if (!t)
+  {
+  t = store_get(sizeof(tree_node) + Ustrlen(path), is_tainted(path));
+  Ustrcpy(t->name, path);
+  t->data.ptr = store_get(sizeof(dkim_keyfile), FALSE);
+  (void) tree_insertnode(&dkim_keyfiles, t);
+  }
+k = t->data.ptr;
+k->mtime = statbuf.st_mtime;
+k->size = statbuf.st_size;
+k->len = Ustrlen(key);
+k->text = string_copyn(key, k->len);
+store_pool = old_pool;
+return key;
+}
+
+
+/* Read and parse the signing keys named by dkim_preload_keys, to save each
+delivery process from doing so. Called by the daemon at startup; the processes
+it forks inherit the keys. A failure is logged but is not fatal, as the key
+will be tried again when it is used. */
+
+void
+dkim_exim_preload_keys(void)
+{
+const uschar * list = dkim_preload_keys;
+uschar * path;
+int sep = 0;
+
+while ((path = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  const uschar * err;
+  uschar * key;
+
+  if (*path != '/')
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC,
+      "DKIM: preload key '%s' is not an absolute path", path);
+    continue;
+    }
+  if (!(key = dkim_key_file(path)))
+    continue;
+  if ((err = pdkim_preload_key(key)))
+    log_write(0, LOG_MAIN|LOG_PANIC, "DKIM: preloading key %s: %s", path, err);
+  else
+    DEBUG(D_acl) debug_printf("DKIM: preloaded signing key %s\n", path);
+  key[0] = '\0';
+  }
+}
+
+
+/* Merge body hashes returned by a delivery process into those kept with the
+message. Parallel deliveries may each have added different ones, so items are
+matched on their "<canon>/<hash>" names rather than replacing the lot.
+
+Return: TRUE if anything was added
+*/
+
+BOOL
+dkim_exim_bodyhashes_merge(const uschar * list)
+{
+gstring * g = NULL;
+uschar * ele;
+int sep = ' ';
+
+while ((ele = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * eq = Ustrchr(ele, '=');
+  const uschar * old = dkim_bodyhashes;
+  uschar * oele;
+  int osep = ' ';
+  BOOL found = FALSE;
+
+  if (!eq) continue;
+  while (!found && (oele = string_nextinlist(&old, &osep, NULL, 0)))
+    found = Ustrncmp(oele, ele, eq - ele + 1) == 0;
+  if (!found)
+    {
+    if (!g) g = string_cat(NULL, dkim_bodyhashes ? dkim_bodyhashes : US"");
+    g = string_fmt_append(g, "%s%s", g->ptr ? " " : "", ele);
+    }
+  }
+
+if (!g) return FALSE;
+dkim_bodyhashes = string_copy_perm(string_from_gstring(g), FALSE);
+return TRUE;
+}
+
+
 /* Generate signatures for the given file.
 If a prefix is given, prepend it to the file for the calculations.
 
@@ -699,7 +843,7 @@ if (dkim_domain)
 
     if (  dkim_private_key_expanded[0] == '/'
        && !(dkim_private_key_expanded =
-	     expand_file_big_buffer(dkim_private_key_expanded)))
+	     dkim_key_file(dkim_private_key_expanded)))
       goto bad;
 
     if (!(dkim_hash_expanded = expand_string(dkim->dkim_hash)))
@@ -760,7 +904,15 @@ else
   if (prefix && (pdkim_rc = pdkim_feed(&dkim_sign_ctx, prefix, Ustrlen(prefix))) != PDKIM_OK)
     goto pk_bad;
 
-  if (lseek(fd, off, SEEK_SET) < 0)
+  /* If the body is the spool data file and we have its hashes from an
+earlier signing, perhaps of another message sharing the file, there is no need
+to read it. */
+
+  if (dkim->body_is_spool) spool_dedup_bodyhashes_get();
+  if (dkim->body_is_spool
+     && pdkim_bodyhashes_import(&dkim_sign_ctx, dkim_bodyhashes))
+    sread = 0;
+  else if (lseek(fd, off, SEEK_SET) < 0)
     sread = -1;
   else
     while ((sread = read(fd, &buf, sizeof(buf))) > 0)
@@ -780,6 +932,13 @@ else
   if ((pdkim_rc = pdkim_feed_finish(&dkim_sign_ctx, &sig, errstr)) != PDKIM_OK)
     goto pk_bad;
 
+  if (dkim->body_is_spool)
+    {
+    store_pool = POOL_PERM;
+    dkim_bodyhashes = pdkim_bodyhashes_export(&dkim_sign_ctx, dkim_bodyhashes);
+    store_pool = POOL_MAIN;
+    }
+
   if (!sig)
     {
     DEBUG(D_transport) debug_printf("DKIM: no signatures to use\n");
@@ -13,6 +13,7 @@ void    dkim_exim_verify_finish(void);
 void    dkim_exim_verify_log_all(void);
 int     dkim_exim_acl_run(uschar *, gstring **, uschar **, uschar **);
 uschar *dkim_exim_expand_query(int);
+BOOL    dkim_exim_bodyhashes_merge(const uschar *);
 
 #define DKIM_ALGO               1
 #define DKIM_BODYLENGTH         2
@@ -76,7 +76,7 @@ else
   if (lseek(in_fd, off, SEEK_SET) < 0) return FALSE;
 
   /* Send file down the original fd */
-  while((sread = read(in_fd, deliver_out_buffer, DELIVER_OUT_BUFFER_SIZE)) > 0)
+  while((sread = read(in_fd, deliver_out_buffer, deliver_out_buffer_size)) > 0)
     {
     uschar * p = deliver_out_buffer;
     /* write the chunk */
@@ -158,6 +158,7 @@ arc_sign_init();
 in wireformat. */
 
 dkim->dot_stuffed = f.spool_file_wireformat;
+dkim->body_is_spool = TRUE;
 if (!(dkim_signature = dkim_exim_sign(deliver_datafile, SPOOL_DATA_START_OFFSET,
 				    hdrs, dkim, &errstr)))
   if (!(rc = dkt_sign_fail(dkim, &errno)))
@@ -280,6 +281,7 @@ status of the file depends on the output of transport_write_message() just
 above, which should be the result of the end_dot flag in tctx->options. */
 
 dkim->dot_stuffed = !!(options & topt_end_dot);
+dkim->body_is_spool = FALSE;
 if (!(dkim_signature = dkim_exim_sign(dkim_fd, 0, NULL, dkim, &errstr)))
   {
   dlen = 0;
@@ -316,7 +318,7 @@ if (options & topt_use_bdat)
   MAIL & RCPT commands flushed, then reap the responses so we can
   error out on RCPT rejects before sending megabytes. */
 
-  if (  dlen + k_file_size > DELIVER_OUT_BUFFER_SIZE
+  if (  dlen + k_file_size > deliver_out_buffer_size
      && dlen > 0)
     {
     if (  tctx->chunk_cb(tctx, dlen, 0) != OK
@@ -392,9 +394,13 @@ if (  !(dkim->dkim_private_key && dkim->dkim_domain && dkim->dkim_selector)
 a dkim signature of it, send the signature and a reconstructed message. This
 avoids using a temprary file. */
 
-if (  !transport_filter_argv
-   || !*transport_filter_argv
-   || !**transport_filter_argv
+if (  (  !transport_filter_argv
+      || !*transport_filter_argv
+      || !**transport_filter_argv
+      )
+#ifdef EXPAND_DLFUNC
+   && !tctx->tblock->filter_dlfunc
+#endif
    )
   return dkt_direct(tctx, dkim, err);
 
@@ -38,6 +38,13 @@ u_char *header_from_sender = NULL;
 int history_file_status    = DMARC_HIST_OK;
 uschar *dkim_history_buffer= NULL;
 
+/* The public suffix list is kept loaded for the life of the process, and by
+the daemon for its children, since reading it costs far more than the rest of
+a DMARC check. It is read again only if the file is changed. */
+
+static uschar *dmarc_tld_loaded = NULL;
+static time_t dmarc_tld_mtime  = 0;
+
 typedef struct dmarc_exim_p {
   uschar *name;
   int    value;
@@ -75,6 +82,39 @@ eb->next  = NULL;
 return eblock;
 }
 
+/* dmarc_tld_load reads the dmarc_tld_file into libopendmarc, unless the
+   same file, unchanged, is already loaded.
+
+Return: TRUE for success */
+
+BOOL
+dmarc_tld_load(void)
+{
+struct stat statbuf;
+
+if (!dmarc_tld_file || !*dmarc_tld_file)
+  return FALSE;
+
+if (  dmarc_tld_loaded && Ustrcmp(dmarc_tld_loaded, dmarc_tld_file) == 0
+   && Ustat(dmarc_tld_file, &statbuf) == 0
+   && statbuf.st_mtime == dmarc_tld_mtime)
+  return TRUE;
+
+if (dmarc_tld_loaded)
+  {
+  store_free(dmarc_tld_loaded);
+  dmarc_tld_loaded = NULL;
+  }
+if (opendmarc_tld_read_file(CS dmarc_tld_file, NULL, NULL, NULL))
+  return FALSE;
+
+dmarc_tld_loaded = string_copy_malloc(dmarc_tld_file);
+dmarc_tld_mtime = Ustat(dmarc_tld_file, &statbuf) == 0 ? statbuf.st_mtime : 0;
+DEBUG(D_receive) debug_printf("DMARC: loaded tld list '%s'\n", dmarc_tld_file);
+return TRUE;
+}
+
+
 /* dmarc_init sets up a context that can be re-used for several
    messages on the same SMTP connection (that come from the
    same host with the same HELO string) */
@@ -115,7 +155,7 @@ if (!dmarc_tld_file || !*dmarc_tld_file)
   DEBUG(D_receive) debug_printf("DMARC: no dmarc_tld_file\n");
   dmarc_abort = TRUE;
   }
-else if (opendmarc_tld_read_file(CS dmarc_tld_file, NULL, NULL, NULL))
+else if (!dmarc_tld_load())
   {
   log_write(0, LOG_MAIN|LOG_PANIC, "DMARC failure to load tld list '%s': %s",
 		       dmarc_tld_file, strerror(errno));
@@ -593,11 +633,10 @@ if (!dmarc_abort && !sender_host_authenticated)
     }
   }
 
-/* shut down libopendmarc */
+/* shut down libopendmarc. The library shutdown would only discard the tld
+list, which we keep for the next message. */
 if (dmarc_pctx)
   (void) opendmarc_policy_connect_shutdown(dmarc_pctx);
-if (!f.dmarc_disable_verify)
-  (void) opendmarc_policy_library_shutdown(&dmarc_ctx);
 
 return OK;
 }
@@ -18,6 +18,7 @@
 
 /* prototypes */
 int dmarc_init();
+BOOL dmarc_tld_load(void);
 int dmarc_store_data(header_line *);
 int dmarc_process();
 uschar *dmarc_exim_expand_query(int);
@@ -760,6 +760,515 @@ return 0;
 }
 
 
+/*************************************************
+*          Shared cache of DNS answers           *
+*************************************************/
+
+/* If dns_cache_size is set, successful lookups and those giving NXDOMAIN or
+NODATA with a negative TTL from an SOA are recorded in a file in the hints
+directory, which every Exim process maps shared. This saves delivery and SMTP
+processes from repeating the same lookups, often of the same few MX and
+address records, many times a minute. An entry lasts for the smallest TTL of
+the records in the answer. The key includes the resolver options, as for the
+negative cache above, so that answers obtained with and without DNSSEC are
+kept apart; the whole packet is kept, so that the AD bit is available to
+dns_is_secure().
+
+The file holds a fixed number of slots, read and written as described for
+dbfn_slot_n(). Answers too big for a slot are not cached. */
+
+#ifndef STAND_ALONE
+
+#define DNS_CACHE_MAGIC		0x45444331	/* "EDC1" */
+#define DNS_CACHE_ANSWER_MAX	1800
+#define DNS_CACHE_PROBES	4
+
+typedef struct {
+  dbfn_shared_header sh;
+  unsigned long	hits;
+  unsigned long	misses;
+} dns_cache_header;
+
+typedef struct {
+  dbfn_shared_slot sl;
+  time_t	expiry;
+  int		rc;			/* DNS_SUCCEED, DNS_NOMATCH or DNS_NODATA */
+  int		answerlen;
+  uschar	key[DNS_FAILTAG_MAX];
+  uschar	answer[DNS_CACHE_ANSWER_MAX];
+} dns_cache_slot;
+
+static dns_cache_header * dns_cache = NULL;
+static BOOL dns_cache_tried = FALSE;
+
+
+/* Map the cache file, creating it if necessary. Failure is not an error;
+there is just no caching in this process.
+
+Returns:  TRUE if the cache is available
+*/
+
+static BOOL
+dns_cache_open(void)
+{
+if (dns_cache) return TRUE;
+if (dns_cache_tried || dns_cache_size <= 0) return FALSE;
+dns_cache_tried = TRUE;
+
+return !!(dns_cache = dbfn_map_shared(US"dnscache", DNS_CACHE_MAGIC,
+  dns_cache_size, sizeof(dns_cache_header), sizeof(dns_cache_slot)));
+}
+
+
+static unsigned
+dns_cache_hash(const uschar * key)
+{
+unsigned h = 2166136261u;			/* FNV-1a */
+while (*key) h = (h ^ *key++) * 16777619u;
+return h;
+}
+
+
+/* Look for an answer in the cache.
+
+Arguments:
+  dnsa      the answer structure, filled in on a hit
+  name      the domain name
+  type      the lookup type
+
+Returns:    the cached result, or -1 if there is none
+*/
+
+static int
+dns_cache_lookup(dns_answer * dnsa, const uschar * name, int type)
+{
+uschar key[DNS_FAILTAG_MAX];
+unsigned hash;
+time_t now = time(NULL);
+
+if (!dns_cache_open() || dns_cache->sh.magic != DNS_CACHE_MAGIC) return -1;
+
+dns_fail_tag(key, name, type);
+hash = dns_cache_hash(key);
+
+for (int i = 0; i < DNS_CACHE_PROBES; i++)
+  {
+  dns_cache_slot * s = dbfn_slot_n(dns_cache, hash, i);
+  uint64_t seq;
+  int rc, len;
+
+  if (  !dbfn_slot_read_begin(&s->sl, &seq)
+     || s->sl.hash != hash || Ustrcmp(s->key, key) != 0) continue;
+  if (s->expiry <= now) break;
+  rc = s->rc;
+  if ((len = s->answerlen) > 0 && len <= DNS_CACHE_ANSWER_MAX)
+    memcpy(dnsa->answer, s->answer, len);
+  if (!dbfn_slot_read_end(&s->sl, seq)) break;
+
+  dnsa->answerlen = rc == DNS_SUCCEED ? len : -1;
+  __sync_fetch_and_add(&dns_cache->hits, 1);
+  DEBUG(D_dns) debug_printf("DNS lookup of %.255s (%s): using shared cache"
+    " value %s, ttl %d (hits %lu misses %lu)\n",
+    name, dns_text_type(type), dns_rc_names[rc], (int)(s->expiry - now),
+    dns_cache->hits, dns_cache->misses);
+  return rc;
+  }
+
+__sync_fetch_and_add(&dns_cache->misses, 1);
+return -1;
+}
+
+
+/* Record an answer in the cache. An existing slot for the key is reused;
+otherwise an empty or expired one, or failing that the one nearest expiry,
+within the probe range.
+
+Arguments:
+  dnsa      the answer, for a positive result
+  name      the domain name
+  type      the lookup type
+  expiry    when the entry should expire
+  rc        the result
+*/
+
+static void
+dns_cache_store(const dns_answer * dnsa, const uschar * name, int type,
+  time_t expiry, int rc)
+{
+uschar key[DNS_FAILTAG_MAX];
+unsigned hash;
+uint64_t seq;
+int len = rc == DNS_SUCCEED ? dnsa->answerlen : 0;
+dns_cache_slot * s = NULL;
+time_t now = time(NULL);
+
+if (  expiry <= now || len > DNS_CACHE_ANSWER_MAX
+   || !dns_cache || dns_cache->sh.magic != DNS_CACHE_MAGIC)
+  return;
+
+dns_fail_tag(key, name, type);
+hash = dns_cache_hash(key);
+
+for (int i = 0; i < DNS_CACHE_PROBES; i++)
+  {
+  dns_cache_slot * t = dbfn_slot_n(dns_cache, hash, i);
+  if (t->sl.hash == hash && Ustrcmp(t->key, key) == 0) { s = t; break; }
+  if (!s || t->expiry < s->expiry) s = t;
+  }
+
+/* Claim the slot; if another process is writing it, give up */
+
+if (!dbfn_slot_claim(&s->sl, 1, &seq)) return;
+
+s->sl.hash = hash;
+Ustrcpy(s->key, key);
+s->expiry = expiry;
+s->rc = rc;
+s->answerlen = len;
+if (len > 0) memcpy(s->answer, dnsa->answer, len);
+dbfn_slot_release(&s->sl, seq);
+
+DEBUG(D_dns) debug_printf(" writing shared cache entry for %s, ttl %d\n",
+  key, (int)(expiry - now));
+}
+
+
+/* Find the expiry time for a positive answer: the smallest TTL of the
+records in it.
+
+Returns:  the expiry time, or zero if the answer has no records
+*/
+
+static time_t
+dns_expire_from_answer(const dns_answer * dnsa)
+{
+dns_scan dnss;
+int ttl = -1;
+
+for (dns_record * rr = dns_next_rr(dnsa, &dnss, RESET_ANSWERS);
+     rr; rr = dns_next_rr(dnsa, &dnss, RESET_NEXT))
+  if (ttl < 0 || rr->ttl < ttl) ttl = rr->ttl;
+return ttl > 0 ? time(NULL) + ttl : 0;
+}
+
+#endif	/*!STAND_ALONE*/
+
+
+/* Return a definite negative result, recording it in both the local and
+the shared cache for the time given by the SOA.
+
+Arguments:
+  dnsa      the answer, for finding the SOA
+  name      the domain name
+  type      the lookup type
+  rc        DNS_NOMATCH or DNS_NODATA
+
+Returns:    rc
+*/
+
+static int
+dns_negative_return(dns_answer * dnsa, const uschar * name, int type,
+  int rc)
+{
+time_t expiry = dns_expire_from_soa(dnsa, type);
+
+#ifndef STAND_ALONE
+if (dns_cache && expiry) dns_cache_store(dnsa, name, type, expiry, rc);
+#endif
+return dns_fail_return(name, type, expiry, rc);
+}
+
+
+
+/*************************************************
+*       Issue a set of lookups in parallel       *
+*************************************************/
+
+/* When a router or transport is about to look up the addresses (or TLSA
+records) of several hosts, one after the other, dns_parallel_lookups allows
+the queries to be sent together on a single UDP socket to the first configured
+name server. Each answer received in time is kept, keyed in the same way as the
+negative cache, and handed out (once) in place of the res_search() call when
+the ordinary lookup for it is made. An answer lasts for the smallest TTL of its
+records (the SOA minimum for a negative one), but no more than
+DNS_PREFETCH_LIFE, since it is meant for a lookup that is about to be made;
+answers are held in malloc store and freed when they are used or expire, so a
+long-lived process does not accumulate them. Anything else - a timeout, a truncated or
+SERVFAIL reply, or a resolver option that res_search() would act on, such as
+searching the domain list - simply leaves the later lookup to go through the
+resolver as usual, so the results are no different. */
+
+#ifndef STAND_ALONE
+
+#define DNS_PREFETCH_LIFE 60	/* seconds */
+
+typedef struct dns_prefetched {
+  struct dns_prefetched * next;
+  time_t	expiry;		/* last time the answer may be used */
+  int		len;		/* packet length */
+  int		herrno;		/* for a negative reply; 0 for a positive one */
+  uschar	tag[DNS_FAILTAG_MAX];
+  uschar	packet[1];
+} dns_prefetched;
+
+typedef struct {
+  const uschar * name;
+  int		type;
+  int		qlen;		/* length of query packet */
+  int		qdlen;		/* length of question section */
+  BOOL		done;
+  uschar	query[512];
+} dns_pquery;
+
+static dns_prefetched * dns_prefetch_list = NULL;
+
+
+/* Find an answer by its tag, freeing any expired ones on the way. If unlink is
+set, the answer is taken off the list, to be freed by the caller.
+
+Returns:    the answer, or NULL
+*/
+
+static dns_prefetched *
+dns_prefetch_find(const uschar * tag, BOOL unlink)
+{
+time_t now = time(NULL);
+
+for (dns_prefetched ** pp = &dns_prefetch_list, * p; (p = *pp); )
+  if (p->expiry < now)
+    {
+    *pp = p->next;
+    store_free(p);
+    }
+  else if (Ustrcmp(p->tag, tag) == 0)
+    {
+    if (unlink) *pp = p->next;
+    return p;
+    }
+  else
+    pp = &p->next;
+return NULL;
+}
+
+
+/* Record an answer from the name server. This is called within the
+dns_prefetch() store mark.
+
+Arguments:
+  q         the query
+  pkt       the reply packet
+  len       its length
+  herrno    the h_errno value res_search() would give, or 0 for success
+*/
+
+static void
+dns_prefetch_save(const dns_pquery * q, const uschar * pkt, int len, int herrno)
+{
+dns_answer * dnsa = store_get_dns_answer();
+dns_prefetched * p, * old;
+time_t now = time(NULL), expiry;
+
+memcpy(dnsa->answer, pkt, len);
+dnsa->answerlen = len;
+expiry = herrno ? dns_expire_from_soa(dnsa, q->type)
+  : dns_expire_from_answer(dnsa);
+if (expiry < now) expiry = now;
+else if (expiry > now + DNS_PREFETCH_LIFE) expiry = now + DNS_PREFETCH_LIFE;
+
+p = store_malloc(sizeof(dns_prefetched) + len);
+dns_fail_tag(p->tag, q->name, q->type);
+if ((old = dns_prefetch_find(p->tag, TRUE))) store_free(old);
+p->next = dns_prefetch_list;
+dns_prefetch_list = p;
+p->expiry = expiry;
+p->len = len;
+p->herrno = herrno;
+memcpy(p->packet, pkt, len);
+}
+
+
+/* Send a set of queries and collect the replies, waiting no longer than the
+resolver's retransmission interval.
+
+Arguments:
+  names     the domain names
+  types     the corresponding lookup types
+  count     the number of lookups
+*/
+
+void
+dns_prefetch(const uschar ** names, const int * types, int count)
+{
+const res_state resp = os_get_dns_resolver_res();
+dns_pquery * queries;
+uschar * buf;
+struct timeval deadline, now;
+int sock, pending = 0;
+rmark reset_point;
+
+if (  f.running_in_test_harness || count < 2
+   || resp->options & (RES_DNSRCH | RES_USEVC)
+   || resp->nscount < 1 || resp->nsaddr_list[0].sin_family != AF_INET
+   )
+  return;
+
+if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+  return;
+if (  connect(sock, (struct sockaddr *)&resp->nsaddr_list[0],
+	sizeof(resp->nsaddr_list[0])) < 0
+   || fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+  {
+  (void)close(sock);
+  return;
+  }
+
+reset_point = store_mark();
+queries = store_get(count * sizeof(dns_pquery), FALSE);
+buf = store_get(NS_MAXMSG, TRUE);
+
+for (int i = 0; i < count; i++)
+  {
+  dns_pquery * q = queries + i;
+  uschar tag[DNS_FAILTAG_MAX];
+
+  q->name = names[i];
+  q->type = types[i];
+  q->done = TRUE;
+
+  /* Skip names that res_search() would qualify, and ones we already have
+  an answer for */
+
+  if (!Ustrchr(q->name, '.') && resp->options & RES_DEFNAMES) continue;
+  dns_fail_tag(tag, q->name, q->type);
+  if (dns_prefetch_find(tag, FALSE)) continue;
+
+  if ((q->qlen = res_mkquery(ns_o_query, CCS q->name, C_IN, q->type, NULL, 0,
+		    NULL, q->query, sizeof(q->query) - 11)) < 0)
+    continue;
+  q->qdlen = q->qlen - HFIXEDSZ;
+
+#ifdef RES_USE_EDNS0
+  /* Add an OPT record, as libresolv does, setting DO if DNSSEC is wanted */
+
+  if (resp->options & RES_USE_EDNS0)
+    {
+    uschar * p = q->query + q->qlen;
+    unsigned flags = 0;
+
+# ifdef RES_USE_DNSSEC
+    if (resp->options & RES_USE_DNSSEC) flags = 0x8000;
+# endif
+    *p++ = 0;				/* root domain */
+    PUTSHORT(ns_t_opt, p);
+    PUTSHORT(1200, p);			/* UDP payload size */
+    PUTLONG(flags, p);			/* extended RCODE, version, flags */
+    PUTSHORT(0, p);			/* no options */
+    ((HEADER *)q->query)->arcount = htons(1);
+    q->qlen = p - q->query;
+    }
+#endif
+
+  if (send(sock, q->query, q->qlen, 0) == q->qlen)
+    {
+    q->done = FALSE;
+    pending++;
+    }
+  }
+
+DEBUG(D_dns) debug_printf("DNS: sent %d of %d lookups in parallel\n",
+  pending, count);
+
+gettimeofday(&deadline, NULL);
+deadline.tv_sec += resp->retrans > 0 ? resp->retrans : 5;
+while (pending > 0)
+  {
+  HEADER * h = (HEADER *)buf;
+  struct timeval tv;
+  int len;
+#ifndef NO_POLL_H
+  struct pollfd p = {.fd = sock, .events = POLLIN};
+#else
+  fd_set fds;
+#endif
+
+  gettimeofday(&now, NULL);
+  if (!timercmp(&now, &deadline, <)) break;
+  timersub(&deadline, &now, &tv);
+#ifndef NO_POLL_H
+  if (poll(&p, 1, tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000) <= 0) break;
+#else
+  FD_ZERO(&fds);
+  FD_SET(sock, &fds);
+  if (select(sock + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, &tv) <= 0) break;
+#endif
+  if ((len = recv(sock, buf, NS_MAXMSG, 0)) < HFIXEDSZ) continue;
+
+  for (dns_pquery * q = queries; q < queries + count; q++)
+    if (  !q->done
+       && memcmp(buf, q->query, 2) == 0			/* same ID */
+       && h->qr && ntohs(h->qdcount) == 1
+       && len >= HFIXEDSZ + q->qdlen
+       && memcmp(buf + HFIXEDSZ, q->query + HFIXEDSZ, q->qdlen) == 0
+       )
+      {
+      q->done = TRUE;
+      pending--;
+
+#ifdef RES_TRUSTAD
+      /* libresolv discards the AD bit unless told to trust the server */
+      if (!(resp->options & RES_TRUSTAD)) h->ad = 0;
+#endif
+      if (h->tc) break;
+      if (h->rcode == NXDOMAIN)
+	dns_prefetch_save(q, buf, len, HOST_NOT_FOUND);
+      else if (h->rcode == NOERROR)
+	dns_prefetch_save(q, buf, len, h->ancount ? 0 : NO_DATA);
+      break;
+      }
+  }
+
+DEBUG(D_dns) if (pending > 0)
+  debug_printf("DNS: %d parallel lookups not answered in time\n", pending);
+
+(void)close(sock);
+store_reset(reset_point);
+}
+
+
+/* Look for an answer obtained by dns_prefetch(), and if there is one,
+put it in place of the result of res_search().
+
+Arguments:
+  dnsa      the answer structure
+  name      the domain name
+  type      the lookup type
+
+Returns:    TRUE if an answer was found
+*/
+
+static BOOL
+dns_prefetched_answer(dns_answer * dnsa, const uschar * name, int type)
+{
+uschar tag[DNS_FAILTAG_MAX];
+dns_prefetched * p;
+
+if (!dns_prefetch_list) return FALSE;
+dns_fail_tag(tag, name, type);
+if (!(p = dns_prefetch_find(tag, TRUE))) return FALSE;
+
+memcpy(dnsa->answer, p->packet, p->len);
+dnsa->answerlen = p->herrno ? -1 : p->len;
+h_errno = p->herrno;
+store_free(p);
+DEBUG(D_dns) debug_printf("DNS lookup of %s (%s): using answer from parallel"
+  " lookup\n", name, dns_text_type(type));
+return TRUE;
+}
+
+#endif	/*!STAND_ALONE*/
+
+
+
 /*************************************************
 *              Do basic DNS lookup               *
 *************************************************/
@@ -799,8 +1308,9 @@ const uschar * save_domain;
 
 /* DNS lookup failures of any kind are cached in a tree. This is mainly so that
 a timeout on one domain doesn't happen time and time again for messages that
-have many addresses in the same domain. We rely on the resolver and name server
-caching for successful lookups.
+have many addresses in the same domain. Successful lookups, and those with a
+definite negative result, may also be kept in the shared cache if it is
+configured; otherwise we rely on the resolver and name server caching.
 */
 
 if ((rc = dns_fail_cache_hit(name, type)) > 0)
@@ -872,14 +1382,36 @@ specification of the DNS, so we lock it out. */
 if ((type == T_A || type == T_AAAA) && string_is_ip_address(name, NULL) != 0)
   return DNS_NOMATCH;
 
+#ifndef STAND_ALONE
+if ((rc = dns_cache_lookup(dnsa, name, type)) >= 0)
+  return rc;
+#endif
+
 /* If we are running in the test harness, instead of calling the normal resolver
 (res_search), we call fakens_search(), which recognizes certain special
-domains, and interfaces to a fake nameserver for certain special zones. */
+domains, and interfaces to a fake nameserver for certain special zones. If
+the answer has already been obtained by a parallel lookup, use that. */
 
 h_errno = 0;
-dnsa->answerlen = f.running_in_test_harness
-  ? fakens_search(name, type, dnsa->answer, sizeof(dnsa->answer))
-  : res_search(CCS name, C_IN, type, dnsa->answer, sizeof(dnsa->answer));
+#ifndef STAND_ALONE
+if (!dns_prefetched_answer(dnsa, name, type))
+#endif
+  {
+#ifndef STAND_ALONE
+  struct timeval start;
+  if (trace_ring || EXIM_PROBE_TIMING) gettimeofday(&start, NULL);
+#endif
+  dnsa->answerlen = f.running_in_test_harness
+    ? fakens_search(name, type, dnsa->answer, sizeof(dnsa->answer))
+    : res_search(CCS name, C_IN, type, dnsa->answer, sizeof(dnsa->answer));
+#ifndef STAND_ALONE
+  EXIM_PROBE4(dns__query, name, type, dnsa->answerlen < 0 ? h_errno : 0,
+    usec_since(&start));
+  if (trace_ring)
+    trace_event(TRACE_DNS, type, dnsa->answerlen < 0 ? h_errno : 0, &start,
+      name);
+#endif
+  }
 
 if (dnsa->answerlen > (int) sizeof(dnsa->answer))
   {
@@ -894,7 +1426,7 @@ if (dnsa->answerlen < 0) switch (h_errno)
   case HOST_NOT_FOUND:
     DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) gave HOST_NOT_FOUND\n"
       "returning DNS_NOMATCH\n", name, dns_text_type(type));
-    return dns_fail_return(name, type, dns_expire_from_soa(dnsa, type), DNS_NOMATCH);
+    return dns_negative_return(dnsa, name, type, DNS_NOMATCH);
 
   case TRY_AGAIN:
     DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) gave TRY_AGAIN\n",
@@ -928,7 +1460,7 @@ if (dnsa->answerlen < 0) switch (h_errno)
   case NO_DATA:
     DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) gave NO_DATA\n"
       "returning DNS_NODATA\n", name, dns_text_type(type));
-    return dns_fail_return(name, type, dns_expire_from_soa(dnsa, type), DNS_NODATA);
+    return dns_negative_return(dnsa, name, type, DNS_NODATA);
 
   default:
     DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) gave unknown DNS error %d\n"
@@ -939,6 +1471,11 @@ if (dnsa->answerlen < 0) switch (h_errno)
 DEBUG(D_dns) debug_printf("DNS lookup of %s (%s) succeeded\n",
   name, dns_text_type(type));
 
+#ifndef STAND_ALONE
+if (dns_cache)
+  dns_cache_store(dnsa, name, type, dns_expire_from_answer(dnsa), DNS_SUCCEED);
+#endif
+
 return DNS_SUCCEED;
 }
 
@@ -394,6 +394,85 @@ return FAIL;
 
 
 
+/*************************************************
+*     Send the queries for a dnslists list       *
+*************************************************/
+
+/* Called from verify_check_dnsbl() below when dns_parallel_lookups is set.
+The address queries for every list and key in the condition, that do not
+already have cached results, are sent at once, so that the checks made one by
+one in list order mostly find their answers waiting, instead of each waiting
+for a round trip to the name server in turn.
+
+Arguments:
+  list        the dnslists list
+  revadd      the inverted host address, or an empty string
+*/
+
+#define DNSBL_PREFETCH_MAX 64
+
+static void
+dnsbl_prefetch(const uschar * list, const uschar * revadd)
+{
+rmark reset_point = store_mark();
+const uschar * names[DNSBL_PREFETCH_MAX];
+int types[DNSBL_PREFETCH_MAX];
+int sep = 0, n = 0;
+time_t now = time(NULL);
+uschar * domain;
+
+while (n < DNSBL_PREFETCH_MAX && (domain = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * key, * s;
+  int keysep = 0;
+
+  if (domain[0] == '+') continue;
+  if ((key = Ustrchr(domain, '/'))) *key++ = 0;
+  if ((s = Ustrpbrk(domain, "=&"))) *(s > domain && s[-1] == '!' ? s-1 : s) = 0;
+  if ((s = Ustrchr(domain, ','))) domain = s+1;
+
+  /* Without a key string the query is for the inverted host address. */
+
+  for (BOOL more = TRUE; more && n < DNSBL_PREFETCH_MAX; )
+    {
+    uschar keyrevadd[128];
+    const uschar * prepend = revadd;
+    uschar * query;
+    tree_node * t;
+
+    if (!key)
+      {
+      if (!*revadd) break;
+      more = FALSE;
+      }
+    else if (!(s = string_nextinlist(CUSS &key, &keysep, NULL, 0)))
+      break;
+    else if (string_is_ip_address(s, NULL) != 0)
+      {
+      invert_address(keyrevadd, s);
+      prepend = keyrevadd;
+      }
+    else
+      prepend = s;
+
+    query = string_sprintf("%s.%s", prepend, domain);
+    if (  Ustrlen(query) < 256
+       && !(  (t = tree_search(dnsbl_cache, query))
+	   && ((dnsbl_cache_block *)t->data.ptr)->expiry > now))
+      {
+      names[n] = query;
+      types[n++] = T_A;
+      }
+    }
+  }
+
+HDEBUG(D_dnsbl) if (n > 1) debug_printf("dnslists: sending %d queries together\n", n);
+dns_prefetch(names, types, n);
+store_reset(reset_point);
+}
+
+
+
 /*************************************************
 *        Check host against DNS black lists      *
 *************************************************/
@@ -463,6 +542,14 @@ revadd[0] = 0;
 
 dns_init(FALSE, FALSE, FALSE);	/*XXX dnssec? */
 
+if (dns_parallel_lookups)
+  {
+  if (sender_host_address && where != ACL_WHERE_NOTSMTP_START
+     && where != ACL_WHERE_NOTSMTP)
+    invert_address(revadd, sender_host_address);
+  dnsbl_prefetch(list, revadd);
+  }
+
 /* Loop through all the domains supplied, until something matches */
 
 while ((domain = string_nextinlist(&list, &sep, NULL, 0)))
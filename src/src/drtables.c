@@ -572,7 +572,7 @@ extern lookup_module_info dsearch_lookup_module_info;
 #if defined(LOOKUP_IBASE) && LOOKUP_IBASE!=2
 extern lookup_module_info ibase_lookup_module_info;
 #endif
-#if defined(LOOKUP_JSON)
+#if defined(LOOKUP_JSON) && LOOKUP_JSON!=2
 extern lookup_module_info json_lookup_module_info;
 #endif
 #if defined(LOOKUP_LDAP)
@@ -621,14 +621,196 @@ extern lookup_module_info whoson_lookup_module_info;
 extern lookup_module_info readsock_lookup_module_info;
 
 
+#ifdef LOOKUP_MODULE_DIR
+/* The lookup modules that this build installs in LOOKUP_MODULE_DIR, and the
+lookup types that each provides. The types are registered at startup, and a
+module is not loaded until one of its types is first used. */
+
+static const struct {
+  const char *	file;			/* module file name, without extension */
+  const char *	lookups[4];		/* the lookup types it provides */
+} lookup_module_manifest[] = {
+#if defined(LOOKUP_CDB) && LOOKUP_CDB==2
+  { "cdb",	{ "cdb" } },
+#endif
+#if defined(LOOKUP_DBM) && LOOKUP_DBM==2
+  { "dbmdb",	{ "dbm", "dbmjz", "dbmnz" } },
+#endif
+#if defined(LOOKUP_DNSDB) && LOOKUP_DNSDB==2
+  { "dnsdb",	{ "dnsdb" } },
+#endif
+#if defined(LOOKUP_DSEARCH) && LOOKUP_DSEARCH==2
+  { "dsearch",	{ "dsearch" } },
+#endif
+#if defined(LOOKUP_IBASE) && LOOKUP_IBASE==2
+  { "ibase",	{ "ibase" } },
+#endif
+#if defined(LOOKUP_JSON) && LOOKUP_JSON==2
+  { "json",	{ "json" } },
+#endif
+#if defined(LOOKUP_LSEARCH) && LOOKUP_LSEARCH==2
+  { "lsearch",	{ "iplsearch", "lsearch", "nwildlsearch", "wildlsearch" } },
+#endif
+#if defined(LOOKUP_MYSQL) && LOOKUP_MYSQL==2
+  { "mysql",	{ "mysql" } },
+#endif
+#if defined(LOOKUP_NIS) && LOOKUP_NIS==2
+  { "nis",	{ "nis", "nis0" } },
+#endif
+#if defined(LOOKUP_NISPLUS) && LOOKUP_NISPLUS==2
+  { "nisplus",	{ "nisplus" } },
+#endif
+#if defined(LOOKUP_ORACLE) && LOOKUP_ORACLE==2
+  { "oracle",	{ "oracle" } },
+#endif
+#if defined(LOOKUP_PASSWD) && LOOKUP_PASSWD==2
+  { "passwd",	{ "passwd" } },
+#endif
+#if defined(LOOKUP_PGSQL) && LOOKUP_PGSQL==2
+  { "pgsql",	{ "pgsql" } },
+#endif
+#if defined(LOOKUP_REDIS) && LOOKUP_REDIS==2
+  { "redis",	{ "redis" } },
+#endif
+#if defined(LOOKUP_SQLITE) && LOOKUP_SQLITE==2
+  { "sqlite",	{ "sqlite" } },
+#endif
+#if defined(LOOKUP_TESTDB) && LOOKUP_TESTDB==2
+  { "testdb",	{ "testdb" } },
+#endif
+#if defined(LOOKUP_WHOSON) && LOOKUP_WHOSON==2
+  { "whoson",	{ "whoson" } },
+#endif
+  { NULL,	{ NULL } }
+};
+
+/* For each entry in lookup_list, the index in the manifest of the module that
+is still to be loaded for it, or LOOKUP_LOADED, or LOOKUP_LOAD_FAILED. */
+
+#define LOOKUP_LOADED		(-1)
+#define LOOKUP_LOAD_FAILED	(-2)
+
+static int *lookup_deferred = NULL;
+
+
+/* Load one module from LOOKUP_MODULE_DIR and check that it is a lookup module
+for this version of Exim. Errors are logged.
+
+Argument:   the module file name, without extension
+Returns:    the module's info block, or NULL
+*/
+
+static struct lookup_module_info *
+lookup_module_open(const char * file)
+{
+/* Not big_buffer: this can be called in the middle of an expansion */
+
+uschar *path = string_sprintf("%s/%s." DYNLIB_FN_EXT, LOOKUP_MODULE_DIR, file);
+void *dl;
+struct lookup_module_info *info;
+const char *errormsg;
+
+if (!(dl = dlopen(CS path, RTLD_NOW)))
+  {
+  errormsg = dlerror();
+  fprintf(stderr, "Error loading %s: %s\n", file, errormsg);
+  log_write(0, LOG_MAIN|LOG_PANIC, "Error loading lookup module %s: %s\n", file, errormsg);
+  return NULL;
+  }
+
+/* FreeBSD nsdispatch() can trigger dlerror() errors about
+ * _nss_cache_cycle_prevention_function; we need to clear the dlerror()
+ * state before calling dlsym(), so that any error afterwards only
+ * comes from dlsym().
+ */
+errormsg = dlerror();
+
+info = (struct lookup_module_info*) dlsym(dl, "_lookup_module_info");
+if ((errormsg = dlerror()))
+  {
+  fprintf(stderr, "%s does not appear to be a lookup module (%s)\n", file, errormsg);
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s does not appear to be a lookup module (%s)\n", file, errormsg);
+  dlclose(dl);
+  return NULL;
+  }
+if (info->magic != LOOKUP_MODULE_INFO_MAGIC)
+  {
+  fprintf(stderr, "Lookup module %s is not compatible with this version of Exim\n", file);
+  log_write(0, LOG_MAIN|LOG_PANIC, "Lookup module %s is not compatible with this version of Exim\n", file);
+  dlclose(dl);
+  return NULL;
+  }
+return info;
+}
+#endif	/*LOOKUP_MODULE_DIR*/
+
+
+
+/*************************************************
+*     Load a lookup module on first use          *
+*************************************************/
+
+/* Called by search_findtype() for each lookup type it finds. If the type is
+provided by a module that has not yet been loaded, load it now, and replace the
+placeholder entries in lookup_list for all its types. Their positions in the
+list do not change.
+
+Argument:   offset in lookup_list
+Returns:    TRUE if the lookup type is ready for use; FALSE, with a message in
+            search_error_message, if its module could not be loaded
+*/
+
+BOOL
+lookup_module_load(int type)
+{
+#ifdef LOOKUP_MODULE_DIR
+struct lookup_module_info *info;
+int m;
+
+if (!lookup_deferred || (m = lookup_deferred[type]) == LOOKUP_LOADED)
+  return TRUE;
+
+if (  m == LOOKUP_LOAD_FAILED
+   || !(info = lookup_module_open(lookup_module_manifest[m].file)))
+  {
+  for (int i = 0; i < lookup_list_count; i++)
+    if (lookup_deferred[i] == m) lookup_deferred[i] = LOOKUP_LOAD_FAILED;
+  search_error_message = string_sprintf("lookup type \"%s\" is not available "
+    "(module could not be loaded from " LOOKUP_MODULE_DIR ")",
+    lookup_list[type]->name);
+  return FALSE;
+  }
+
+for (int j = 0; j < info->lookupcount; j++)
+  for (int i = 0; i < lookup_list_count; i++)
+    if (  lookup_deferred[i] == m
+       && Ustrcmp(lookup_list[i]->name, info->lookups[j]->name) == 0)
+      {
+      lookup_list[i] = info->lookups[j];
+      lookup_deferred[i] = LOOKUP_LOADED;
+      break;
+      }
+
+/* Any type that the module did not after all provide stays unusable */
+
+for (int i = 0; i < lookup_list_count; i++)
+  if (lookup_deferred[i] == m) lookup_deferred[i] = LOOKUP_LOADED;
+
+DEBUG(D_lookup) debug_printf("Loaded \"%s\" (%d lookup types)\n",
+  lookup_module_manifest[m].file, info->lookupcount);
+#endif
+return TRUE;
+}
+
+
 void
 init_lookup_list(void)
 {
 #ifdef LOOKUP_MODULE_DIR
-DIR *dd;
-struct dirent *ent;
+lookup_info *placeholders;
+int *placeholder_module;
 int countmodules = 0;
-int moduleerrors = 0;
+int countdeferred = 0;
 #endif
 static BOOL lookup_list_init_done = FALSE;
 rmark reset_point;
@@ -662,7 +844,7 @@ addlookupmodule(NULL, &ibase_lookup_module_info);
 addlookupmodule(NULL, &ldap_lookup_module_info);
 #endif
 
-#ifdef LOOKUP_JSON
+#if defined(LOOKUP_JSON) && LOOKUP_JSON!=2
 addlookupmodule(NULL, &json_lookup_module_info);
 #endif
 
@@ -721,83 +903,29 @@ addlookupmodule(NULL, &whoson_lookup_module_info);
 addlookupmodule(NULL, &readsock_lookup_module_info);
 
 #ifdef LOOKUP_MODULE_DIR
-if (!(dd = exim_opendir(LOOKUP_MODULE_DIR)))
-  {
-  DEBUG(D_lookup) debug_printf("Couldn't open %s: not loading lookup modules\n", LOOKUP_MODULE_DIR);
-  log_write(0, LOG_MAIN, "Couldn't open %s: not loading lookup modules\n", LOOKUP_MODULE_DIR);
-  }
-else
-  {
-  const pcre *regex_islookupmod = regex_must_compile(
-    US"\\." DYNLIB_FN_EXT "$", FALSE, TRUE);
-
-  DEBUG(D_lookup) debug_printf("Loading lookup modules from %s\n", LOOKUP_MODULE_DIR);
-  while ((ent = readdir(dd)))
+/* Count the types provided by modules, and make a placeholder entry for each,
+with just the name, for lookup_module_load() to replace. */
+
+for (int m = 0; lookup_module_manifest[m].file; m++, countmodules++)
+  for (int j = 0; j < nelem(lookup_module_manifest[m].lookups)
+		  && lookup_module_manifest[m].lookups[j]; j++)
+    countdeferred++;
+
+placeholders = store_malloc(sizeof(lookup_info) * (countdeferred + 1));
+placeholder_module = store_malloc(sizeof(int) * (countdeferred + 1));
+memset(placeholders, 0, sizeof(lookup_info) * (countdeferred + 1));
+countdeferred = 0;
+for (int m = 0; lookup_module_manifest[m].file; m++)
+  for (int j = 0; j < nelem(lookup_module_manifest[m].lookups)
+		  && lookup_module_manifest[m].lookups[j]; j++)
     {
-    char *name = ent->d_name;
-    int len = (int)strlen(name);
-    if (pcre_exec(regex_islookupmod, NULL, name, len, 0, PCRE_EOPT, NULL, 0) >= 0)
-      {
-      int pathnamelen = len + (int)strlen(LOOKUP_MODULE_DIR) + 2;
-      void *dl;
-      struct lookup_module_info *info;
-      const char *errormsg;
-
-      /* SRH: am I being paranoid here or what? */
-      if (pathnamelen > big_buffer_size)
-	{
-	fprintf(stderr, "Loading lookup modules: %s/%s: name too long\n", LOOKUP_MODULE_DIR, name);
-	log_write(0, LOG_MAIN|LOG_PANIC, "%s/%s: name too long\n", LOOKUP_MODULE_DIR, name);
-	continue;
-	}
-
-      /* SRH: snprintf here? */
-      sprintf(CS big_buffer, "%s/%s", LOOKUP_MODULE_DIR, name);
-
-      if (!(dl = dlopen(CS big_buffer, RTLD_NOW)))
-	{
-	errormsg = dlerror();
-	fprintf(stderr, "Error loading %s: %s\n", name, errormsg);
-	log_write(0, LOG_MAIN|LOG_PANIC, "Error loading lookup module %s: %s\n", name, errormsg);
-	moduleerrors++;
-	continue;
-	}
-
-      /* FreeBSD nsdispatch() can trigger dlerror() errors about
-       * _nss_cache_cycle_prevention_function; we need to clear the dlerror()
-       * state before calling dlsym(), so that any error afterwards only
-       * comes from dlsym().
-       */
-      errormsg = dlerror();
-
-      info = (struct lookup_module_info*) dlsym(dl, "_lookup_module_info");
-      if ((errormsg = dlerror()))
-	{
-	fprintf(stderr, "%s does not appear to be a lookup module (%s)\n", name, errormsg);
-	log_write(0, LOG_MAIN|LOG_PANIC, "%s does not appear to be a lookup module (%s)\n", name, errormsg);
-	dlclose(dl);
-	moduleerrors++;
-	continue;
-	}
-      if (info->magic != LOOKUP_MODULE_INFO_MAGIC)
-	{
-	fprintf(stderr, "Lookup module %s is not compatible with this version of Exim\n", name);
-	log_write(0, LOG_MAIN|LOG_PANIC, "Lookup module %s is not compatible with this version of Exim\n", name);
-	dlclose(dl);
-	moduleerrors++;
-	continue;
-	}
-
-      addlookupmodule(dl, info);
-      DEBUG(D_lookup) debug_printf("Loaded \"%s\" (%d lookup types)\n", name, info->lookupcount);
-      countmodules++;
-      }
+    placeholders[countdeferred].name = US lookup_module_manifest[m].lookups[j];
+    placeholder_module[countdeferred++] = m;
     }
-  store_free((void*)regex_islookupmod);
-  closedir(dd);
-  }
+lookup_list_count += countdeferred;
 
-DEBUG(D_lookup) debug_printf("Loaded %d lookup modules\n", countmodules);
+DEBUG(D_lookup) debug_printf("Registered %d lookup modules from %s\n",
+  countmodules, LOOKUP_MODULE_DIR);
 #endif
 
 DEBUG(D_lookup) debug_printf("Total %d lookups\n", lookup_list_count);
@@ -809,6 +937,21 @@ memset(lookup_list, 0, sizeof(lookup_info *) * lookup_list_count);
 for (struct lookupmodulestr * p = lookupmodules; p; p = p->next)
   for (int j = 0; j < p->info->lookupcount; j++)
     add_lookup_to_list(p->info->lookups[j]);
+
+#ifdef LOOKUP_MODULE_DIR
+for (int i = 0; i < countdeferred; i++)
+  add_lookup_to_list(placeholders + i);
+
+lookup_deferred = store_malloc(sizeof(int) * lookup_list_count);
+for (int i = 0; i < lookup_list_count; i++)
+  {
+  lookup_deferred[i] = LOOKUP_LOADED;
+  if (lookup_list[i] >= placeholders && lookup_list[i] < placeholders + countdeferred)
+    lookup_deferred[i] = placeholder_module[lookup_list[i] - placeholders];
+  }
+store_free(placeholder_module);
+#endif
+
 store_reset(reset_point);
 /* just to be sure */
 lookupmodules = NULL;
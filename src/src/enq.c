@@ -119,4 +119,105 @@ else
 dbfn_close(dbm_file);
 }
 
+
+
+/*************************************************
+*       Start an adaptively limited connection   *
+*************************************************/
+
+/* This is like enq_start(), but the limit is kept in the record and adjusted
+by enq_adapt_end() as connections finish: it rises by one after each
+successful delivery, up to the maximum, and halves after each failure of the
+host, down to one. A new record starts at the maximum. A stale record (as for
+serialization, one that has not been written for six hours) is taken to have
+no connections open, but keeps its limit.
+
+Arguments:
+  key      string key for the record
+  max      the highest the limit may go
+
+Returns:   TRUE if it is OK to proceed; FALSE otherwise
+*/
+
+BOOL
+enq_adapt_start(uschar * key, int max)
+{
+dbdata_adapt * rec, new_record;
+open_db dbblock, * dbm_file;
+int len;
+
+if (!(dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
+  return TRUE;
+
+if (  (rec = dbfn_read_with_length(dbm_file, key, &len))
+   && len == sizeof(dbdata_adapt)
+   && rec->limit > 0)
+  {
+  new_record = *rec;
+  if (new_record.limit > max) new_record.limit = max;
+  if (time(NULL) - rec->time_stamp >= 6*60*60) new_record.count = 0;
+  }
+else
+  {
+  new_record.count = 0;
+  new_record.limit = max;
+  }
+
+if (new_record.count >= new_record.limit)
+  {
+  dbfn_close(dbm_file);
+  DEBUG(D_transport) debug_printf("adaptive connection limit %d reached for "
+    "%s\n", new_record.limit, key);
+  return FALSE;
+  }
+
+new_record.count++;
+DEBUG(D_transport) debug_printf("write adaptive record for %s: %d of %d\n",
+  key, new_record.count, new_record.limit);
+dbfn_write(dbm_file, key, &new_record, (int)sizeof(dbdata_adapt));
+dbfn_close(dbm_file);
+return TRUE;
+}
+
+
+
+/*************************************************
+*       End an adaptively limited connection     *
+*************************************************/
+
+/*
+Arguments:
+  key      string key for the record
+  max      the highest the limit may go
+  result   1 after a success, -1 after a failure of the host, 0 otherwise
+
+Returns:   nothing
+*/
+
+void
+enq_adapt_end(uschar * key, int max, int result)
+{
+dbdata_adapt * rec;
+open_db dbblock, * dbm_file;
+int len;
+
+if (!(dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
+  return;
+if (  !(rec = dbfn_read_with_length(dbm_file, key, &len))
+   || len != sizeof(dbdata_adapt))
+  {
+  dbfn_close(dbm_file);
+  return;
+  }
+
+if (rec->count > 0) rec->count--;
+if (result > 0 && rec->limit < max) rec->limit++;
+else if (result < 0 && (rec->limit /= 2) < 1) rec->limit = 1;
+
+DEBUG(D_transport) debug_printf("write adaptive record for %s: %d of %d\n",
+  key, rec->count, rec->limit);
+dbfn_write(dbm_file, key, rec, (int)sizeof(dbdata_adapt));
+dbfn_close(dbm_file);
+}
+
 /* End of enq.c */
@@ -80,6 +80,116 @@ enum commandline_info { CMDINFO_NONE=0,
 
 
 
+/*************************************************
+*     Compile regular expression, with cache     *
+*************************************************/
+
+/* Patterns that come from the configuration are compiled afresh each time
+they are used, which may be once per recipient. The compiled forms are kept in
+malloc store, in a hash table with a least-recently-used list, so that the
+same pattern with the same options is compiled only once. The number kept is
+set by regex_cache_size; when it is zero, patterns are compiled into the
+current store pool as before.
+
+A compiled pattern may be freed by any later call of this function, so it must
+not be used after anything that might compile another pattern.
+
+Arguments:
+  pattern     the pattern to compile
+  options     PCRE compile options
+  errstr      where to put an error message
+  erroffset   where to put the offset of an error
+
+Returns:      pointer to the compiled pattern, or NULL on error
+*/
+
+typedef struct regex_cache_entry {
+  struct regex_cache_entry * hnext;	/* Hash chain */
+  struct regex_cache_entry * prev;	/* LRU list, most recent first */
+  struct regex_cache_entry * next;
+  const pcre *	re;
+  unsigned	hash;
+  int		options;
+  uschar	pattern[1];
+} regex_cache_entry;
+
+#define REGEX_CACHE_HASH 256		/* Must be a power of two */
+
+static regex_cache_entry * regex_cache_hash[REGEX_CACHE_HASH];
+static regex_cache_entry * regex_cache_head = NULL;
+static regex_cache_entry * regex_cache_tail = NULL;
+static int regex_cache_count = 0;
+
+const pcre *
+regex_compile(const uschar * pattern, int options, const uschar ** errstr,
+  int * erroffset)
+{
+unsigned hash = options;
+regex_cache_entry * e, ** hp;
+const pcre * re;
+int len;
+
+if (regex_cache_size <= 0)
+  return pcre_compile(CCS pattern, options, CCSS errstr, erroffset, NULL);
+
+for (const uschar * s = pattern; *s; s++) hash = hash * 31 + *s;
+len = Ustrlen(pattern);
+hp = &regex_cache_hash[hash & (REGEX_CACHE_HASH - 1)];
+
+for (e = *hp; e; e = e->hnext)
+  if (e->options == options && Ustrcmp(e->pattern, pattern) == 0)
+    {
+    if (e != regex_cache_head)		/* Move to the front of the list */
+      {
+      e->prev->next = e->next;
+      if (e->next) e->next->prev = e->prev; else regex_cache_tail = e->prev;
+      e->prev = NULL;
+      e->next = regex_cache_head;
+      regex_cache_head = regex_cache_head->prev = e;
+      }
+    return e->re;
+    }
+
+pcre_malloc = function_store_malloc;
+pcre_free = function_store_free;
+re = pcre_compile(CCS pattern, options, CCSS errstr, erroffset, NULL);
+pcre_malloc = function_store_get;
+pcre_free = function_dummy_free;
+if (!re) return NULL;
+
+/* Discard the least recently used pattern if the cache is full */
+
+if (regex_cache_count >= regex_cache_size)
+  {
+  regex_cache_entry * old = regex_cache_tail, ** pp;
+
+  for (pp = &regex_cache_hash[old->hash & (REGEX_CACHE_HASH - 1)];
+       *pp != old; pp = &(*pp)->hnext) ;
+  *pp = old->hnext;
+  if ((regex_cache_tail = old->prev)) old->prev->next = NULL;
+  else regex_cache_head = NULL;
+  store_free((void *)old->re);
+  store_free(old);
+  regex_cache_count--;
+  }
+
+e = store_malloc(sizeof(regex_cache_entry) + len);
+memcpy(e->pattern, pattern, len + 1);
+e->re = re;
+e->hash = hash;
+e->options = options;
+e->hnext = *hp;
+*hp = e;
+e->prev = NULL;
+if ((e->next = regex_cache_head)) regex_cache_head->prev = e;
+else regex_cache_tail = e;
+regex_cache_head = e;
+regex_cache_count++;
+return re;
+}
+
+
+
 /*************************************************
 *  Compile regular expression and panic on fail  *
 *************************************************/
@@ -88,12 +198,13 @@ enum commandline_info { CMDINFO_NONE=0,
 to a panic exit. In other cases, pcre_compile() is called directly. In many
 cases where this function is used, the results of the compilation are to be
 placed in long-lived store, so we temporarily reset the store management
-functions that PCRE uses if the use_malloc flag is set.
+functions that PCRE uses if the use_malloc flag is set. Otherwise the pattern
+comes from the cache kept by regex_compile().
 
 Argument:
   pattern     the pattern to compile
   caseless    TRUE if caseless matching is required
-  use_malloc  TRUE if compile into malloc store
+  use_malloc  TRUE if compile into malloc store, not using the cache
 
 Returns:      pointer to the compiled pattern
 */
@@ -105,15 +216,17 @@ int offset;
 int options = PCRE_COPT;
 const pcre *yield;
 const uschar *error;
-if (use_malloc)
+if (caseless) options |= PCRE_CASELESS;
+if (!use_malloc)
+  yield = regex_compile(pattern, options, &error, &offset);
+else
   {
   pcre_malloc = function_store_malloc;
   pcre_free = function_store_free;
+  yield = pcre_compile(CCS pattern, options, CCSS &error, &offset, NULL);
+  pcre_malloc = function_store_get;
+  pcre_free = function_dummy_free;
   }
-if (caseless) options |= PCRE_CASELESS;
-yield = pcre_compile(CCS pattern, options, CCSS &error, &offset, NULL);
-pcre_malloc = function_store_get;
-pcre_free = function_dummy_free;
 if (yield == NULL)
   log_write(0, LOG_MAIN|LOG_PANIC_DIE, "regular expression error: "
     "%s at offset %d while compiling %s", error, offset, pattern);
@@ -254,6 +367,8 @@ if (fd < 0) return;
 
 (void)write(fd, process_info, process_info_len);
 (void)close(fd);
+
+if (trace_ring) trace_dump(US"signal");
 }
 
 
@@ -574,6 +689,141 @@ if (devnull > 2) (void)close(devnull);
 
 
 
+/*************************************************
+*        Restrict the process to some CPUs       *
+*************************************************/
+
+/* This is used by processes that handle SMTP connections and by queue runners,
+as set by smtp_cpus and queue_run_cpus. The list is of CPU numbers and ranges
+such as 0-15, separated by colons by default; commas are also accepted between
+the ranges in each item, as in the cpulist files in /sys.
+
+If a CPU number is given (from SO_INCOMING_CPU for an SMTP connection), the
+process is restricted to the CPUs of the NUMA node that CPU belongs to, within
+the list if there is one, so that it is handled near the memory the kernel used
+for the connection. If that leaves no CPUs, the list alone is used. With no
+list, the CPUs the process could use at its first call stand in for it, so
+that a preforked process that handles several connections can move between
+nodes.
+
+Arguments:
+  list      the CPU list, or NULL
+  cpu       a CPU whose node is preferred, or -1
+
+Returns:    TRUE if the affinity was set
+
+The options, and this function, exist only where EXIM_HAVE_CPU_AFFINITY is
+defined, so that setting them elsewhere is a configuration error.
+*/
+
+#ifdef EXIM_HAVE_CPU_AFFINITY
+static BOOL
+cpus_parse(const uschar * list, cpu_set_t * set)
+{
+const uschar * item;
+int sep = 0;
+
+CPU_ZERO(set);
+while ((item = string_nextinlist(&list, &sep, NULL, 0)))
+  for (const uschar * s = item; *s; )
+    {
+    uschar * end;
+    long lo = Ustrtol(s, &end, 10), hi = lo;
+
+    if (end == s || lo < 0) return FALSE;
+    if (*end == '-')
+      {
+      s = end + 1;
+      hi = Ustrtol(s, &end, 10);
+      if (end == s || hi < lo) return FALSE;
+      }
+    for ( ; lo <= hi && lo < CPU_SETSIZE; lo++) CPU_SET(lo, set);
+    while (isspace(*end)) end++;
+    if (*end == ',') end++;
+    else if (*end) return FALSE;
+    s = end;
+    }
+return CPU_COUNT(set) > 0;
+}
+
+
+/* Find the CPUs of the NUMA node that a CPU is on */
+
+static BOOL
+cpus_node(int cpu, cpu_set_t * set)
+{
+uschar * dirname = string_sprintf("/sys/devices/system/cpu/cpu%d", cpu);
+uschar buffer[256];
+DIR * dir;
+struct dirent * ent;
+int node = -1;
+FILE * f;
+
+if (!(dir = exim_opendir(dirname))) return FALSE;
+while ((ent = readdir(dir)))
+  if (Ustrncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4]))
+    { node = atoi(ent->d_name + 4); break; }
+closedir(dir);
+if (node < 0) return FALSE;
+
+if (!(f = Ufopen(string_sprintf("/sys/devices/system/node/node%d/cpulist",
+		  node), "r")))
+  return FALSE;
+if (!Ufgets(buffer, sizeof(buffer), f)) buffer[0] = '\0';
+(void)fclose(f);
+buffer[Ustrcspn(buffer, "\n")] = '\0';
+return cpus_parse(buffer, set);
+}
+
+
+BOOL
+exim_set_cpus(const uschar * list, int cpu)
+{
+static cpu_set_t initial;	/* before any change, for a NULL list */
+static BOOL have_initial = FALSE;
+cpu_set_t set, node;
+
+if (list)
+  {
+  if (!cpus_parse(list, &set))
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "malformed CPU list \"%s\"", list);
+    return FALSE;
+    }
+  }
+else if (cpu < 0)
+  return FALSE;
+else
+  {
+  if (!have_initial)
+    {
+    if (sched_getaffinity(0, sizeof(initial), &initial) != 0) return FALSE;
+    have_initial = TRUE;
+    }
+  set = initial;
+  }
+
+if (cpu >= 0 && cpus_node(cpu, &node))
+  {
+  cpu_set_t both;
+  CPU_AND(&both, &set, &node);
+  if (CPU_COUNT(&both) > 0) set = both;
+  }
+
+if (sched_setaffinity(0, sizeof(set), &set) != 0)
+  {
+  DEBUG(D_any) debug_printf("sched_setaffinity: %s\n", strerror(errno));
+  return FALSE;
+  }
+DEBUG(D_any) debug_printf("restricted to %d CPU%s\n",
+  CPU_COUNT(&set), CPU_COUNT(&set) == 1 ? "" : "s");
+return TRUE;
+}
+#endif	/*EXIM_HAVE_CPU_AFFINITY*/
+
+
+
+
 /*************************************************
 *   Close unwanted file descriptors for delivery *
 *************************************************/
@@ -711,6 +961,34 @@ DEBUG(D_uid)
 
 
 
+/*************************************************
+*          Report store use on exit              *
+*************************************************/
+
+/* For processes that received or delivered messages, log the store use if
+the store_stats log selector is set, and tell the daemon of the peaks. Forked
+subprocesses inherit the pid of the process that is due to report, so they
+stay quiet. */
+
+static void
+store_stats_report(void)
+{
+if (store_stats_pid != getpid()) return;
+store_stats_pid = 0;
+
+store_pool = POOL_MAIN;
+if (LOGGING(store_stats))
+  {
+  rmark reset_point = store_mark();
+  gstring * g = store_stats_string(NULL);
+  log_write(0, LOG_MAIN, "store usage: %s", string_from_gstring(g));
+  store_reset(reset_point);
+  }
+queue_store_stats_notify();
+}
+
+
+
 /*************************************************
 *               Exit point                       *
 *************************************************/
@@ -728,6 +1006,15 @@ void
 exim_exit(int rc)
 {
 search_tidyup();
+receive_message_id_wait();
+smtp_phase_report();
+profile_report();
+store_stats_report();
+queue_delivery_notify(FALSE);
+callout_kept_close();
+callout_cache_flush();
+mainlog_flush();
+syslog_native_exit();
 store_exit();
 DEBUG(D_any)
   debug_printf(">>>>>>>>>>>>>>>> Exim pid=%d (%s) terminating with rc=%d "
@@ -740,6 +1027,15 @@ exit(rc);
 void
 exim_underbar_exit(int rc)
 {
+receive_message_id_wait();
+smtp_phase_report();
+profile_report();
+store_stats_report();
+queue_delivery_notify(FALSE);
+callout_kept_close();
+callout_cache_flush();
+mainlog_flush();
+syslog_native_exit();
 store_exit();
 DEBUG(D_any)
   debug_printf(">>>>>>>>>>>>>>>> Exim pid=%d (%s) terminating with rc=%d "
@@ -885,6 +1181,8 @@ else
 fprintf(f, "Probably ndbm\n");
 #elif defined(USE_TDB)
 fprintf(f, "Using tdb\n");
+#elif defined(USE_LMDB)
+fprintf(f, "Using LMDB version %s\n", MDB_VERSION_STRING);
 #else
   #ifdef USE_GDBM
   fprintf(f, "Probably GDBM (native mode)\n");
@@ -970,6 +1268,9 @@ g = string_cat(NULL, US"Support for:");
 #ifdef SUPPORT_I18N
   g = string_cat(g, US" I18N");
 #endif
+#ifdef SUPPORT_IO_URING
+  g = string_cat(g, US" IO_URING");
+#endif
 #ifndef DISABLE_OCSP
   g = string_cat(g, US" OCSP");
 #endif
@@ -991,6 +1292,12 @@ g = string_cat(NULL, US"Support for:");
 #ifdef SUPPORT_SPF
   g = string_cat(g, US" SPF");
 #endif
+#ifdef SUPPORT_USDT
+  g = string_cat(g, US" USDT");
+#endif
+#ifdef SUPPORT_ZSTD
+  g = string_cat(g, US" ZSTD");
+#endif
 #if defined(SUPPORT_SRS)
   g = string_cat(g, US" SRS");
 #endif
@@ -1161,7 +1468,7 @@ show_db_version(fp);
 
   init_lookup_list();
   for (int i = 0; i < lookup_list_count; i++)
-    if (lookup_list[i]->version_report)
+    if (lookup_module_load(i) && lookup_list[i]->version_report)
       lookup_list[i]->version_report(fp);
 
 #ifdef WHITELIST_D_MACROS
@@ -1576,6 +1883,7 @@ Returns:    EXIT_SUCCESS if terminated successfully
               to the sender, and -oee was given
 */
 
+#ifndef COMPILE_BENCH
 int
 main(int argc, char **cargv)
 {
@@ -1604,6 +1912,7 @@ BOOL arg_queue_only = FALSE;
 BOOL bi_option = FALSE;
 BOOL checking = FALSE;
 BOOL count_queue = FALSE;
+BOOL screen_table = FALSE;
 BOOL expansion_test = FALSE;
 BOOL extract_recipients = FALSE;
 BOOL flag_G = FALSE;
@@ -1641,6 +1950,9 @@ uschar *ftest_prefix = NULL;
 uschar *ftest_suffix = NULL;
 uschar *log_oneline = NULL;
 uschar *malware_test_file = NULL;
+uschar *msg_select = NULL;
+uschar **msg_ids = NULL;
+int  msg_count = 0;
 uschar *real_sender_address;
 uschar *originator_home = US"/";
 size_t sz;
@@ -2084,6 +2396,12 @@ on the second character (the one after '-'), to save some effort. */
 
       switch (*argrest++)
 	{
+	/* -bB:  List or change the daemon's screen table */
+	case 'B':
+	  screen_table = TRUE;
+	  if (*argrest) badarg = TRUE;
+	  break;
+
 	/* -bd:  Run in daemon mode, awaiting SMTP connections.
 	   -bdf: Ditto, but in the foreground.
 	*/
@@ -2825,6 +3143,14 @@ on the second character (the one after '-'), to save some effort. */
 		  else badarg = TRUE;
 		  break;
 
+    /* -MCk: used with -MCt; the kernel holds the TLS state in both
+    directions, and the connection is the TLS socket itself rather than one
+    to a proxy process. */
+
+	case 'k': continue_proxy_ktls = TRUE;
+		  tls_out.ktls = KTLS_TX | KTLS_RX;
+		  break;
+
     /* -MCt: similar to -MCT below but the connection is still open
     via a proxy process which handles the TLS context and coding.
     Require three arguments for the proxied local address and port,
@@ -2872,6 +3198,9 @@ on the second character (the one after '-'), to save some effort. */
        -Mvc  show copy (of whole message, in RFC 2822 format)
        -Mvh  show header
        -Mvl  show log
+    Finally, -Msel is followed by a list of conditions, and must come before one
+    of the first group, which then acts on the messages that match instead of
+    on a list of message ids.
     */
 
     else if (!*argrest)
@@ -2911,6 +3240,12 @@ on the second character (the one after '-'), to save some effort. */
       one_msg_action = TRUE;
       }
     else if (Ustrcmp(argrest, "rm") == 0) msg_action = MSG_REMOVE;
+    else if (Ustrcmp(argrest, "sel") == 0)
+      {
+      if (++i >= argc) { badarg = TRUE; break; }
+      msg_select = string_copy_taint(argv[i], TRUE);
+      break;
+      }
     else if (Ustrcmp(argrest, "set") == 0)
       {
       msg_action = MSG_LOAD;
@@ -2939,9 +3274,17 @@ on the second character (the one after '-'), to save some effort. */
       }
     else { badarg = TRUE; break; }
 
-    /* All the -Mxx options require at least one message id. */
+    /* All the -Mxx options require at least one message id, unless -Msel
+    came first, when there must be none. */
 
     msg_action_arg = i + 1;
+    if (msg_select)
+      {
+      if (one_msg_action || msg_action_arg < argc)
+	exim_fail("exim: -Msel cannot be used with %s%s\n", arg,
+	  one_msg_action ? "" : " and message ids");
+      break;
+      }
     if (msg_action_arg >= argc)
       exim_fail("exim: no message ids given after %s option\n", arg);
 
@@ -3574,6 +3917,7 @@ if (  (  (smtp_input || extract_recipients || recipients_arg < argc)
       )
    || deliver_selectstring && queue_interval < 0
    || msg_action == MSG_LOAD && (!expansion_test || expansion_test_message)
+   || msg_select && msg_action_arg < 0
    )
   exim_fail("exim: incompatible command-line options or arguments\n");
 
@@ -3775,7 +4119,9 @@ In either case, we initialise the list of available lookups while running
 as root.  All dynamically modules are loaded from a directory which is
 hard-coded into the binary and is code which, if not a module, would be
 part of Exim already.  Ability to modify the content of the directory
-is equivalent to the ability to modify a setuid binary!
+is equivalent to the ability to modify a setuid binary!  The modules that
+this build installs there are only registered here; each is loaded by
+lookup_module_load() when one of its lookup types is first used.
 
 This needs to happen before we read the main configuration. */
 init_lookup_list();
@@ -3818,7 +4164,10 @@ defined) */
   (void)gettimeofday(&t0, NULL);
 #endif
 
+  int old_pool = store_pool;
+  store_pool = POOL_CONFIG;
   readconf_main(checking || list_options);
+  store_pool = old_pool;
 
 #ifdef MEASURE_TIMING
   report_time_since(&t0, US"readconf_main (delta)");
@@ -4013,6 +4362,7 @@ else
     *newp = NULL;
     environ = CSS new;
     tzset();
+    tod_reset();
     DEBUG(D_any) debug_printf("Reset TZ to %s: time is %s\n", timezone_string,
       tod_stamp(tod_log));
     }
@@ -4185,7 +4535,7 @@ count. Only an admin user can use the test interface to scan for email
 if (!f.admin_user)
   {
   BOOL debugset = (debug_selector & ~D_v) != 0;
-  if (  deliver_give_up || f.daemon_listen || malware_test_file
+  if (  deliver_give_up || f.daemon_listen || malware_test_file || screen_table
      || count_queue && queue_list_requires_admin
      || list_queue && queue_list_requires_admin
      || queue_interval >= 0 && prod_requires_admin
@@ -4396,15 +4746,107 @@ if (list_queue)
 if (count_queue)
   {
   set_process_info("counting the queue");
+
+  /* If the daemon keeps an index of this queue, it can answer without a scan
+  of the spool. An empty response means it has no index. */
+
+  if (queue_index && Ustrlen(queue_name) < 200)
+    {
+    uschar buf[256];
+    int len;
+
+    buf[0] = NOTIFY_QUEUE_COUNT_REQ;
+    Ustrcpy(buf+1, queue_name);
+    if ((len = queue_daemon_request(buf, Ustrlen(buf+1) + 2, -1, buf,
+				    sizeof(buf) - 1, 2)) > 0)
+      {
+      buf[len] = 0;
+      fprintf(stdout, "%s\n", buf);
+      exit(EXIT_SUCCESS);
+      }
+    }
+
   fprintf(stdout, "%u\n", queue_count());
   exit(EXIT_SUCCESS);
   }
 
+/* Handle a request to list or change the daemon's screen table. The daemon
+checks each connection against it, so a change takes effect at once. */
+
+if (screen_table)
+  {
+  const uschar * action = recipients_arg < argc ? argv[recipients_arg] : NULL;
+  uschar * address;
+  int nargs = argc - recipients_arg, seconds = 0, rc;
+
+  set_process_info("%s the screen table", action ? "changing" : "listing");
+  if (smtp_screen_table_size <= 0)
+    exim_fail("exim: smtp_screen_table_size is not set\n");
+  if (!action)
+    {
+    if (!daemon_screen_list())
+      exim_fail("exim: the screen table is not available\n");
+    exit(EXIT_SUCCESS);
+    }
+
+  if (Ustrcmp(action, "remove") == 0 ? nargs != 2
+     : Ustrcmp(action, "block") != 0 && Ustrcmp(action, "allow") != 0
+     || nargs != 3
+     || (seconds = readconf_readtime(argv[recipients_arg+2], 0, FALSE)) <= 0)
+    exim_fail("exim: usage: -bB [block|allow <address> <time> | "
+      "remove <address>]\n");
+
+  /* The daemon looks up the address in the form that it gets from the
+  connection, so an IPv6 address is put into the same form. */
+
+  address = argv[recipients_arg+1];
+  if ((rc = string_is_ip_address(address, NULL)) == 0)
+    exim_fail("exim: \"%s\" is not an IP address\n", address);
+#if HAVE_IPV6
+  if (rc == 6)
+    {
+    struct in6_addr in6;
+    if (inet_pton(AF_INET6, CS address, &in6) == 1)
+      address = host_ntoa(AF_INET6, &in6, NULL, NULL);
+    }
+#endif
+
+  if ((rc = daemon_screen_set(address, seconds,
+		Ustrcmp(action, "allow") == 0)) == DEFER)
+    exim_fail("exim: the screen table is not available\n");
+  if (rc != OK)
+    exim_fail(Ustrcmp(action, "block") == 0
+      ? "exim: %s has an allow entry, or the table is full there\n"
+      : "exim: no room in the table for %s\n", address);
+  exit(EXIT_SUCCESS);
+  }
+
 /* Handle actions on specific messages, except for the force delivery and
 message load actions, which are done below. Some actions take a whole list of
 message ids, which are known to continue up to the end of the arguments. Others
 take a single message id and then operate on the recipients list. */
 
+/* With -Msel, the messages to act on are found by one scan of the queue.
+Otherwise they are the remaining arguments. */
+
+if (msg_select)
+  {
+  uschar * errmsg;
+
+  if (!f.admin_user)
+    {
+    fprintf(stderr, "exim: Permission denied\n");
+    exim_exit(EXIT_FAILURE);
+    }
+  if (!(msg_ids = queue_select(msg_select, &msg_count, &errmsg)))
+    exim_fail("exim: %s\n", errmsg);
+  }
+else if (msg_action_arg > 0)
+  {
+  msg_ids = argv + msg_action_arg;
+  msg_count = argc - msg_action_arg;
+  }
+
 if (msg_action_arg > 0 && msg_action != MSG_DELIVER && msg_action != MSG_LOAD)
   {
   int yield = EXIT_SUCCESS;
@@ -4414,12 +4856,17 @@ if (msg_action_arg > 0 && msg_action != MSG_DELIVER && msg_action != MSG_LOAD)
   event_action gets expanded */
 
   if (msg_action == MSG_REMOVE)
+    {
+    int old_pool = store_pool;
+    store_pool = POOL_CONFIG;
     readconf_rest();
+    store_pool = old_pool;
+    }
 
   if (!one_msg_action)
     {
-    for (i = msg_action_arg; i < argc; i++)
-      if (!queue_action(argv[i], msg_action, NULL, 0, 0))
+    for (i = 0; i < msg_count; i++)
+      if (!queue_action(msg_ids[i], msg_action, NULL, 0, 0))
         yield = EXIT_FAILURE;
     switch (msg_action)
       {
@@ -4444,7 +4891,10 @@ needed in transports so we lost the optimisation. */
   (void)gettimeofday(&t0, NULL);
 #endif
 
+  int old_pool = store_pool;
+  store_pool = POOL_CONFIG;
   readconf_rest();
+  store_pool = old_pool;
 
 #ifdef MEASURE_TIMING
   report_time_since(&t0, US"readconf_rest (delta)");
@@ -4647,23 +5097,23 @@ if (msg_action_arg > 0 && msg_action != MSG_LOAD)
     }
   set_process_info("delivering specified messages");
   if (deliver_give_up) forced_delivery = f.deliver_force_thaw = TRUE;
-  for (i = msg_action_arg; i < argc; i++)
+  for (i = 0; i < msg_count; i++)
     {
     int status;
     pid_t pid;
     /*XXX This use of argv[i] for msg_id should really be tainted, but doing
     that runs into a later copy into the untainted global message_id[] */
-    if (i == argc - 1)
-      (void)deliver_message(argv[i], forced_delivery, deliver_give_up);
+    if (i == msg_count - 1)
+      (void)deliver_message(msg_ids[i], forced_delivery, deliver_give_up);
     else if ((pid = exim_fork(US"cmdline-delivery")) == 0)
       {
-      (void)deliver_message(argv[i], forced_delivery, deliver_give_up);
+      (void)deliver_message(msg_ids[i], forced_delivery, deliver_give_up);
       exim_underbar_exit(EXIT_SUCCESS);
       }
     else if (pid < 0)
       {
-      fprintf(stderr, "failed to fork delivery process for %s: %s\n", argv[i],
-        strerror(errno));
+      fprintf(stderr, "failed to fork delivery process for %s: %s\n",
+        msg_ids[i], strerror(errno));
       exim_exit(EXIT_FAILURE);
       }
     else wait(&status);
@@ -5052,11 +5502,7 @@ if (expansion_test)
 
   /* The data file will be open after -Mset */
 
-  if (deliver_datafile >= 0)
-    {
-    (void)close(deliver_datafile);
-    deliver_datafile = -1;
-    }
+  spool_close_datafile();
 
   exim_exit(EXIT_SUCCESS);
   }
@@ -5814,6 +6260,7 @@ moreloop:
 exim_exit(EXIT_SUCCESS);   /* Never returns */
 return 0;                  /* To stop compiler warning */
 }
+#endif	/*!COMPILE_BENCH*/
 
 
 /* End of exim.c */
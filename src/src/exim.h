@@ -257,7 +257,17 @@ or a macro with entries f_frsize and f_bsize. */
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/utsname.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#ifdef EXIM_HAVE_CPU_AFFINITY
+# include <sched.h>
+#endif
+
+/* Anonymous shared mappings are spelled differently by some older systems */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif
 
 /* There's a shambles in IRIX6 - it defines EX_OK in unistd.h which conflicts
 with the definition in sysexits.h. Exim does not actually use this macro, so we
@@ -516,9 +526,9 @@ requires various things that are set therein. */
 #endif
 
 #ifdef ENABLE_DISABLE_FSYNC
-# define EXIMfsync(f) (disable_fsync? 0 : fsync(f))
+# define EXIMfsync(f) (disable_fsync? 0 : spool_fsync_group(f))
 #else
-# define EXIMfsync(f) fsync(f)
+# define EXIMfsync(f) spool_fsync_group(f)
 #endif
 
 /* Backward compatibility; LOOKUP_LSEARCH now includes all three */
@@ -587,6 +597,33 @@ default to EDQUOT if it exists, otherwise ENOSPC. */
 # error DANE support requires DNSSEC support
 #endif
 
+/* io_uring is a Linux facility */
+#if defined(SUPPORT_IO_URING) && !defined(__linux__)
+# error SUPPORT_IO_URING is only available on Linux
+#endif
+
+/* Static tracepoints (USDT) for tools such as bpftrace and perf, using the SDT
+header from systemtap. Without SUPPORT_USDT the probes, and their arguments,
+compile to nothing. EXIM_PROBE_TIMING says whether the times that are passed
+to some probes are wanted. */
+
+#ifdef SUPPORT_USDT
+# include <sys/sdt.h>
+# define EXIM_PROBE_TIMING		TRUE
+# define EXIM_PROBE1(n,a)		DTRACE_PROBE1(exim, n, a)
+# define EXIM_PROBE2(n,a,b)		DTRACE_PROBE2(exim, n, a, b)
+# define EXIM_PROBE3(n,a,b,c)		DTRACE_PROBE3(exim, n, a, b, c)
+# define EXIM_PROBE4(n,a,b,c,d)		DTRACE_PROBE4(exim, n, a, b, c, d)
+# define EXIM_PROBE5(n,a,b,c,d,e)	DTRACE_PROBE5(exim, n, a, b, c, d, e)
+#else
+# define EXIM_PROBE_TIMING		FALSE
+# define EXIM_PROBE1(n,a)
+# define EXIM_PROBE2(n,a,b)
+# define EXIM_PROBE3(n,a,b,c)
+# define EXIM_PROBE4(n,a,b,c,d)
+# define EXIM_PROBE5(n,a,b,c,d,e)
+#endif
+
 /* Some platforms (FreeBSD, OpenBSD, Solaris) do not seem to define this */
 
 #ifndef POLLRDHUP
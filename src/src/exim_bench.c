@@ -0,0 +1,516 @@
+/*************************************************
+*     Exim - an Internet mail transport agent    *
+*************************************************/
+
+/* Copyright (c) The Exim Maintainers 2021 */
+/* See the file NOTICE for conditions of use and distribution. */
+
+/* This is a set of microbenchmarks for some of the functions that Exim spends
+most of its time in. The program is linked with all of Exim's modules, exim.c
+being compiled without its main() function, so each benchmark runs the real
+code. It is built by "make exim_bench" in the build directory, and "make bench"
+at the top level builds and runs it.
+
+Usage: exim_bench [-t <seconds>] [-c <file>] [<name> ...]
+
+Each benchmark is run for at least the given time (default 0.5 seconds), and
+one line is written for it, with the name, the number of iterations and the
+nanoseconds per iteration, separated by tabs. Names may be given to run only
+the benchmarks whose names start with them. With -c, the output of an earlier
+run is read from the file, and the old time and the percentage change are added
+to each line, so that results can be compared across commits. */
+
+
+#include "exim.h"
+
+#ifndef DISABLE_DKIM
+# include "pdkim/pdkim.h"
+#endif
+
+static uschar spool_name[] = "1xGwSm-0002nA-42-H";
+static uschar * data_file = NULL;
+
+
+
+/*************************************************
+*             Individual benchmarks              *
+*************************************************/
+
+/* Each of these runs its operation n times. Any setting up that need not be
+timed is done on the first call. */
+
+static void
+bench_expand(unsigned n)
+{
+static uschar * s =
+  US"${if eq{${lc:$local_part}}{postmaster}{yes}"
+     "{${sg{${domain}}{\\\\.}{-}}-${length_8:${local_part}}}}";
+
+deliver_localpart = US"Some.User";
+deliver_domain = US"mail.example.com";
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  if (!expand_string(s))
+    {
+    fprintf(stderr, "exim_bench: expansion failed: %s\n", expand_string_message);
+    exit(EXIT_FAILURE);
+    }
+  store_reset(reset_point);
+  }
+}
+
+
+static void
+bench_match(unsigned n)
+{
+static const uschar * subjects[] = {
+  US"www.example.com", US"foo.bar.example", US"mail42.test.ex",
+  US"nomatch.example.net" };
+
+while (n--)
+  {
+  const uschar * list =
+    US"*.example.com : foo.bar.example : \\N^mail\\d+\\.test\\.ex$\\N : "
+      "one.example.org : two.example.org : three.example.org";
+  (void) match_isinlist(subjects[n & 3], &list, 0, NULL, NULL, MCL_DOMAIN,
+    TRUE, NULL);
+  }
+}
+
+
+static void
+bench_nextinlist(unsigned n)
+{
+static uschar * list = NULL;
+uschar buffer[64];
+
+if (!list)
+  {
+  gstring * g = NULL;
+  for (int i = 0; i < 50; i++)
+    g = string_fmt_append(g, "%sitem%d.example", i ? " : " : "", i);
+  list = string_from_gstring(g);
+  }
+
+while (n--)
+  {
+  const uschar * s = list;
+  int sep = 0;
+  while (string_nextinlist(&s, &sep, buffer, sizeof(buffer))) ;
+  }
+}
+
+
+static void
+bench_store(unsigned n)
+{
+static void * volatile last;
+
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  for (int i = 0; i < 100; i++) last = store_get(16 + (i & 31) * 16, FALSE);
+  store_reset(reset_point);
+  }
+}
+
+
+/* Making the address items for a list of recipients */
+
+static void
+bench_make_addr(unsigned n)
+{
+static address_item * volatile last;
+
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  for (int i = 0; i < 1000; i++)
+    last = deliver_make_addr(US"recipient@example.org", FALSE);
+  store_reset(reset_point);
+  }
+}
+
+
+static void
+bench_tree(unsigned n)
+{
+static tree_node * nodes = NULL;
+
+if (!nodes)
+  {
+  nodes = store_malloc(1000 * (sizeof(tree_node) + 16));
+  for (int i = 0; i < 1000; i++)
+    {
+    tree_node * t = (tree_node *)((uschar *)nodes + i * (sizeof(tree_node) + 16));
+    sprintf(CS t->name, "k%08x", (unsigned)(i * 2654435761u));
+    }
+  }
+
+while (n--)
+  {
+  tree_node * root = NULL;
+  for (int i = 0; i < 1000; i++)
+    (void) tree_insertnode(&root,
+      (tree_node *)((uschar *)nodes + i * (sizeof(tree_node) + 16)));
+  }
+}
+
+
+static uschar b64_plain[1024];
+static uschar * b64_coded = NULL;
+
+static void
+b64_setup(void)
+{
+if (b64_coded) return;
+for (int i = 0; i < sizeof(b64_plain); i++) b64_plain[i] = (i * 7) & 0xff;
+b64_coded = string_copy_perm(b64encode(b64_plain, sizeof(b64_plain)), FALSE);
+}
+
+static void
+bench_b64encode(unsigned n)
+{
+b64_setup();
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  (void) b64encode(b64_plain, sizeof(b64_plain));
+  store_reset(reset_point);
+  }
+}
+
+static void
+bench_b64decode(unsigned n)
+{
+b64_setup();
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  uschar * out;
+  (void) b64decode(b64_coded, &out);
+  store_reset(reset_point);
+  }
+}
+
+
+#ifndef DISABLE_DKIM
+static uschar *
+bench_no_dns(const uschar * name)
+{
+return NULL;
+}
+
+static void
+bench_pdkim(unsigned n)
+{
+static gstring * msg = NULL;
+
+if (!msg)
+  {
+  pdkim_init();
+  msg = string_cat(NULL,
+    US"DKIM-Signature: v=1; a=rsa-sha256; c=relaxed/relaxed; d=example.com;\r\n"
+       "\ts=sel; h=from:to:subject:date; bh=47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=;\r\n"
+       "\tb=dGVzdA==\r\n"
+       "From: Someone <someone@example.com>\r\n"
+       "To: other@example.org\r\n"
+       "Subject: A   message  for\r\n\tbenchmarking\r\n"
+       "Date: Wed, 14 Oct 2026 10:44:00 +0000\r\n"
+       "\r\n");
+  for (int i = 0; i < 200; i++)
+    msg = string_fmt_append(msg,
+      "Line %d of the body,  with some  spaces \t and a tab in it.   \r\n", i);
+  msg = string_cat(msg, US"\r\n\r\n");
+  (void) string_from_gstring(msg);
+  }
+
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  pdkim_ctx * ctx = pdkim_init_verify(bench_no_dns, FALSE);
+
+  dkim_collect_input = 20;		/* signature limit, as in dkim.c */
+  (void) pdkim_feed(ctx, msg->s, msg->ptr);
+  pdkim_free_ctx(ctx);
+  store_reset(reset_point);
+  }
+dkim_collect_input = 0;
+}
+#endif
+
+
+/* The SMTP input benchmarks read a file of message data, of 64 KiB or so in
+lines of text, ending with the terminating dot. */
+
+static void
+smtp_setup(void)
+{
+FILE * f;
+
+if (data_file) return;
+data_file = string_sprintf("%s/data", spool_directory);
+if (!(f = Ufopen(data_file, "wb")))
+  {
+  fprintf(stderr, "exim_bench: %s: %s\n", data_file, strerror(errno));
+  exit(EXIT_FAILURE);
+  }
+for (int i = 0; i < 850; i++)
+  fprintf(f, "%s%05d The quick brown fox jumps over the lazy dog, "
+    "again and again.\r\n", i % 40 ? "" : ".", i);
+fprintf(f, ".\r\n");
+fclose(f);
+
+smtp_out = Ufopen("/dev/null", "wb");
+smtp_receive_timeout = 0;
+thismessage_size_limit = INT_MAX;
+}
+
+static void
+smtp_rewind(void)
+{
+if (smtp_in) fclose(smtp_in);
+if (!(smtp_in = Ufopen(data_file, "rb")))
+  {
+  fprintf(stderr, "exim_bench: %s: %s\n", data_file, strerror(errno));
+  exit(EXIT_FAILURE);
+  }
+smtp_buf_init();
+}
+
+static void
+bench_smtp_getc(unsigned n)
+{
+smtp_setup();
+while (n--)
+  {
+  smtp_rewind();
+  while (smtp_getc(GETC_BUFFER_UNLIMITED) != EOF) ;
+  }
+}
+
+static void
+bench_read_data(unsigned n)
+{
+static FILE * out = NULL;
+
+smtp_setup();
+if (!out) out = Ufopen("/dev/null", "wb");
+while (n--)
+  {
+  smtp_rewind();
+  message_size = 0;
+  if (read_message_data_smtp(out) != END_DOT)
+    {
+    fprintf(stderr, "exim_bench: message data not terminated\n");
+    exit(EXIT_FAILURE);
+    }
+  }
+}
+
+
+/* The spool header benchmark reads a header file with ten recipients and a
+dozen header lines. */
+
+static void
+bench_spool_read(unsigned n)
+{
+static BOOL done = FALSE;
+
+if (!done)
+  {
+  FILE * f = Ufopen(spool_fname(US"input", US"", spool_name, US""), "wb");
+  gstring * g = NULL;
+
+  if (!f)
+    {
+    fprintf(stderr, "exim_bench: %s: %s\n", spool_name, strerror(errno));
+    exit(EXIT_FAILURE);
+    }
+  fprintf(f, "%s\nexim 93 93\n<sender@example.com>\n1791974640 0\n"
+    "-received_time_usec .125132\n-ident exim\n-received_protocol esmtps\n"
+    "-body_linecount 120\n-max_received_linelength 78\n"
+    "-host_address 192.0.2.1.52044\n-host_name mail.example.com\n"
+    "-helo_name mail.example.com\n-interface_address 192.0.2.25.25\n"
+    "-aclm 0 4\nspam\nXX\n10\n", spool_name);
+  for (int i = 0; i < 10; i++) fprintf(f, "rcpt%d@example.org\n", i);
+  fprintf(f, "\n");
+  for (int i = 0; i < 12; i++)
+    {
+    g = string_fmt_append(g, "X-Header-%d: value of header %d, with some text"
+      " to make it a realistic length\n", i, i);
+    fprintf(f, "%03d  %s", g->ptr, string_from_gstring(g));
+    g->ptr = 0;
+    }
+  fclose(f);
+  done = TRUE;
+  }
+
+while (n--)
+  {
+  rmark reset_point = store_mark();
+  if (spool_read_header(spool_name, TRUE, TRUE) != spool_read_OK)
+    {
+    fprintf(stderr, "exim_bench: spool_read_header failed\n");
+    exit(EXIT_FAILURE);
+    }
+  spool_clear_header_globals();
+  store_reset(reset_point);
+  }
+}
+
+
+
+/*************************************************
+*               The benchmark table              *
+*************************************************/
+
+typedef struct {
+  const char *	name;
+  void		(*fn)(unsigned);
+} bench_item;
+
+static bench_item benches[] = {
+  { "expand_string",		bench_expand },
+  { "match_isinlist",		bench_match },
+  { "string_nextinlist/50",	bench_nextinlist },
+  { "store_get_reset/100",	bench_store },
+  { "deliver_make_addr/1000",	bench_make_addr },
+  { "tree_insertnode/1000",	bench_tree },
+  { "b64encode/1k",		bench_b64encode },
+  { "b64decode/1k",		bench_b64decode },
+#ifndef DISABLE_DKIM
+  { "pdkim_feed/16k",		bench_pdkim },
+#endif
+  { "smtp_getc/64k",		bench_smtp_getc },
+  { "read_message_data_smtp/64k", bench_read_data },
+  { "spool_read_header",	bench_spool_read },
+};
+
+
+
+/*************************************************
+*              Time one benchmark                *
+*************************************************/
+
+/* The number of iterations is doubled until the run lasts long enough, after
+one untimed call that does any setting up.
+
+Arguments:
+  b          the benchmark
+  min_ns     the minimum time for the final run
+  iterations where to return the number of iterations
+
+Returns:     nanoseconds per iteration
+*/
+
+static double
+bench_time(bench_item * b, double min_ns, unsigned * iterations)
+{
+unsigned n = 1;
+
+b->fn(1);
+for (;;)
+  {
+  struct timespec t0, t1;
+  double ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  b->fn(n);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  if (ns >= min_ns || n >= 1u << 30)
+    {
+    *iterations = n;
+    return ns / n;
+    }
+  n = ns < min_ns / 64 ? n * 8 : n * 2;
+  }
+}
+
+
+
+/*************************************************
+*                 Entry point                    *
+*************************************************/
+
+int
+main(int argc, char ** argv)
+{
+double min_ns = 5e8;
+const uschar * compare = NULL;
+uschar tmpdir[] = "/tmp/exim_bench.XXXXXX";
+int i;
+
+for (i = 1; i < argc && argv[i][0] == '-'; i++)
+  if (Ustrcmp(argv[i], "-t") == 0 && i + 1 < argc)
+    min_ns = atof(argv[++i]) * 1e9;
+  else if (Ustrcmp(argv[i], "-c") == 0 && i + 1 < argc)
+    compare = US argv[++i];
+  else
+    {
+    fprintf(stderr, "usage: exim_bench [-t <seconds>] [-c <file>] [<name> ...]\n");
+    exit(EXIT_FAILURE);
+    }
+
+big_buffer = store_malloc(big_buffer_size);
+log_stderr = stderr;
+
+/* Work in a private spool directory. */
+
+if (!mkdtemp(CS tmpdir))
+  {
+  fprintf(stderr, "exim_bench: mkdtemp: %s\n", strerror(errno));
+  exit(EXIT_FAILURE);
+  }
+spool_directory = tmpdir;
+(void) directory_make(spool_directory, US"input", 0700, FALSE);
+regex_ismsgid =
+  regex_must_compile(US"^(?:[^\\W_]{6}-){2}[^\\W_]{2}$", FALSE, TRUE);
+
+for (bench_item * b = benches; b < benches + nelem(benches); b++)
+  {
+  unsigned iterations;
+  double ns;
+  BOOL wanted = i >= argc;
+
+  for (int j = i; j < argc && !wanted; j++)
+    wanted = Ustrncmp(b->name, argv[j], Ustrlen(argv[j])) == 0;
+  if (!wanted) continue;
+
+  ns = bench_time(b, min_ns, &iterations);
+  printf("%s\t%u\t%.1f", b->name, iterations, ns);
+
+  /* Find the same benchmark in an earlier run */
+
+  if (compare)
+    {
+    FILE * f = Ufopen(compare, "rb");
+    uschar line[256];
+    int len = Ustrlen(b->name);
+
+    while (f && Ufgets(line, sizeof(line), f))
+      if (Ustrncmp(line, b->name, len) == 0 && line[len] == '\t')
+	{
+	uschar * s = Ustrchr(line + len + 1, '\t');
+	double old = s ? atof(CS s + 1) : 0;
+	if (old > 0) printf("\t%.1f\t%+.1f%%", old, (ns - old) * 100 / old);
+	break;
+	}
+    if (f) fclose(f);
+    }
+  printf("\n");
+  fflush(stdout);
+  }
+
+/* Tidy up */
+
+(void) Uunlink(spool_fname(US"input", US"", spool_name, US""));
+if (data_file) (void) Uunlink(data_file);
+(void) rmdir(CS string_sprintf("%s/input", spool_directory));
+(void) rmdir(CS spool_directory);
+return EXIT_SUCCESS;
+}
+
+/* End of exim_bench.c */
@@ -26,12 +26,18 @@ different.
 Input lines beginning with # are ignored, as are blank lines. Entries begin
 with a key terminated by a colon or end of line or whitespace and continue with
 indented lines. Keys may be quoted if they contain colons or whitespace or #
-characters. */
+characters.
+
+With the -cdb option a cdb file is written instead, by code in this program
+rather than a DBM library. The records are written out as they are read, so
+memory use does not grow with the size of the input. */
 
 
 #include "exim.h"
 
 uschar * spool_directory = NULL;	/* dummy for dbstuff.h */
+int spool_stripe_count = 0;		/* dummies for functions.h */
+const uschar ** spool_stripe_dirs = NULL;
 
 /******************************************************************************/
 					/* dummies needed by Solaris build */
@@ -167,6 +173,240 @@ return ch;
 }
 
 
+
+/*************************************************
+*              Write a cdb file                  *
+*************************************************/
+
+/* A cdb file starts with 256 (position, length) pairs, one for each of its
+hash tables, followed by the records, each a key length, a data length, the key
+and the data, and ends with the hash tables. A table has twice as many slots,
+each a hash value and a record position, as there are records whose hash lands
+in it. All numbers are four bytes, least significant first.
+
+Nothing needs to be kept in memory while the records are written, except a
+count for each table. The hash and position of each record go to a spill file,
+which is then read once for each group of tables that fits in CDB_BUILD_SLOTS,
+so that a very large file is built in several passes rather than in a very
+large amount of memory. Duplicate keys are found when a table is filled, by
+reading back the keys of records with the same hash. */
+
+#define CDB_HASH_SPLIT	256		/* number of hash tables */
+#define CDB_BUILD_SLOTS	(8*1024*1024)	/* table slots held in memory at once */
+
+typedef struct {
+  FILE *	out;			/* the new cdb file */
+  FILE *	spill;			/* each record's hash and position */
+  uint64_t	pos;			/* where the next record goes */
+  unsigned long	counts[CDB_HASH_SPLIT];	/* records for each table */
+} cdb_build;
+
+static uint32_t
+cdb_hash(const uschar * buf, unsigned len)
+{
+uint32_t h = 5381;
+while (len--) h = (h + (h << 5)) ^ *buf++;
+return h;
+}
+
+static void
+cdb_pack(uschar * buf, uint32_t num)
+{
+buf[0] = num; buf[1] = num >> 8; buf[2] = num >> 16; buf[3] = num >> 24;
+}
+
+static uint32_t
+cdb_unpack(const uschar * buf)
+{
+return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+
+/* Start the file, leaving room for the table positions.
+
+Arguments:
+  c          the build state
+  out        the new file, open for reading and writing
+  spill      an anonymous file for the hashes
+Returns:     0 or -1 on error
+*/
+
+static int
+cdb_start(cdb_build * c, FILE * out, FILE * spill)
+{
+uschar header[CDB_HASH_SPLIT * 8];
+
+memset(c, 0, sizeof(*c));
+c->out = out;
+c->spill = spill;
+c->pos = sizeof(header);
+memset(header, 0, sizeof(header));
+return fwrite(header, sizeof(header), 1, out) == 1 ? 0 : -1;
+}
+
+
+/* Add a record; returns EXIM_DBPUTB_OK or -1 on error */
+
+static int
+cdb_put(cdb_build * c, const uschar * key, int klen,
+  const uschar * data, int dlen)
+{
+uschar lens[8];
+uint32_t spill[2];
+uint32_t h = cdb_hash(key, klen);
+
+if (c->pos + 8 + klen + dlen > 0xffffffffUL)
+  {
+  errno = EFBIG;
+  return -1;
+  }
+cdb_pack(lens, klen);
+cdb_pack(lens + 4, dlen);
+spill[0] = h;
+spill[1] = (uint32_t)c->pos;
+if (  fwrite(lens, 8, 1, c->out) != 1
+   || fwrite(key, 1, klen, c->out) != klen
+   || fwrite(data, 1, dlen, c->out) != dlen
+   || fwrite(spill, sizeof(spill), 1, c->spill) != 1)
+  return -1;
+c->pos += 8 + klen + dlen;
+c->counts[h & (CDB_HASH_SPLIT - 1)]++;
+return EXIM_DBPUTB_OK;
+}
+
+
+/* Read back the key of a record */
+
+static int
+cdb_read_key(cdb_build * c, uint32_t pos, uschar * buf)
+{
+uschar lens[8];
+uint32_t klen;
+
+if (  pread(fileno(c->out), lens, 8, pos) != 8
+   || (klen = cdb_unpack(lens)) > 255
+   || pread(fileno(c->out), buf, klen, pos + 8) != klen)
+  return -1;
+buf[klen] = 0;
+return klen;
+}
+
+
+/* Write the hash tables and then the table positions at the start.
+
+Arguments:
+  c          the build state
+  warn       TRUE to report duplicate keys
+  lastdup    TRUE to keep the last of a set of duplicates, not the first
+  dupcount   incremented for each duplicate key
+Returns:     0 or -1 on error
+*/
+
+static int
+cdb_finish(cdb_build * c, BOOL warn, BOOL lastdup, int * dupcount)
+{
+uschar header[CDB_HASH_SPLIT * 8];
+uint32_t * slots = NULL;
+unsigned long starts[CDB_HASH_SPLIT];
+int first = 0;
+
+if (fflush(c->out) != 0) return -1;
+
+while (first < CDB_HASH_SPLIT)
+  {
+  unsigned long nslots = 0;
+  int last;
+
+  /* Take as many tables as fit; a single table can be bigger than that. */
+
+  for (last = first; last < CDB_HASH_SPLIT; last++)
+    {
+    if (last > first && nslots + 2*c->counts[last] > CDB_BUILD_SLOTS) break;
+    starts[last] = nslots;
+    nslots += 2*c->counts[last];
+    }
+
+  free(slots);
+  if (!(slots = calloc(nslots ? nslots : 1, 2 * sizeof(uint32_t))))
+    return -1;
+
+  /* Put each record belonging to these tables into its table, probing from
+  the slot given by its hash. A position of zero marks an empty slot, since no
+  record starts there. */
+
+  rewind(c->spill);
+  for (uint32_t e[2]; fread(e, sizeof(e), 1, c->spill) == 1; )
+    {
+    int t = e[0] & (CDB_HASH_SPLIT - 1);
+    unsigned long len, i;
+    uint32_t * table;
+
+    if (t < first || t >= last) continue;
+    len = 2*c->counts[t];
+    table = slots + 2*starts[t];
+
+    for (i = (e[0] >> 8) % len; table[2*i+1]; i = (i + 1) % len)
+      if (table[2*i] == e[0])
+	{
+	uschar k1[256], k2[256];
+	int l1 = cdb_read_key(c, table[2*i+1], k1);
+	int l2 = cdb_read_key(c, e[1], k2);
+
+	if (l1 < 0 || l2 < 0) { free(slots); return -1; }
+	if (l1 == l2 && memcmp(k1, k2, l1) == 0)
+	  {
+	  if (warn) fprintf(stderr, "** Duplicate key \"%s\"\n", k2);
+	  (*dupcount)++;
+	  if (lastdup) table[2*i+1] = e[1];
+	  break;
+	  }
+	}
+    if (!table[2*i+1])
+      {
+      table[2*i] = e[0];
+      table[2*i+1] = e[1];
+      }
+    }
+  if (ferror(c->spill)) { free(slots); return -1; }
+
+  /* Write out the tables, noting where each is */
+
+  if (fseek(c->out, (long)c->pos, SEEK_SET) != 0) { free(slots); return -1; }
+  for (int t = first; t < last; t++)
+    {
+    unsigned long len = 2*c->counts[t];
+    uint32_t * table = slots + 2*starts[t];
+
+    if (c->pos + 8*len > 0xffffffffUL)
+      {
+      errno = EFBIG;
+      free(slots);
+      return -1;
+      }
+    cdb_pack(header + 8*t, (uint32_t)c->pos);
+    cdb_pack(header + 8*t + 4, (uint32_t)len);
+    for (unsigned long i = 0; i < len; i++)
+      {
+      uschar buf[8];
+      cdb_pack(buf, table[2*i]);
+      cdb_pack(buf + 4, table[2*i+1]);
+      if (fwrite(buf, 8, 1, c->out) != 1) { free(slots); return -1; }
+      }
+    c->pos += 8*len;
+    }
+  first = last;
+  }
+
+free(slots);
+if (  fseek(c->out, 0, SEEK_SET) != 0
+   || fwrite(header, sizeof(header), 1, c->out) != 1
+   || fflush(c->out) != 0
+   || fsync(fileno(c->out)) != 0)
+  return -1;
+return 0;
+}
+
+
 /*************************************************
 *               Main Program                     *
 *************************************************/
@@ -183,12 +423,15 @@ BOOL lowercase = TRUE;
 BOOL warn = TRUE;
 BOOL duperr = TRUE;
 BOOL lastdup = FALSE;
-#if !defined (USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM)
+BOOL cdb = FALSE;
+cdb_build cw;
+#if !defined (USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM) \
+  && !defined(USE_LMDB)
 int is_db = 0;
 struct stat statbuf;
 #endif
 FILE *f;
-EXIM_DB *d;
+EXIM_DB *d = NULL;
 EXIM_DATUM key, content;
 uschar *bptr;
 uschar  keybuffer[256];
@@ -205,6 +448,7 @@ while (argc > 1)
   else if (Ustrcmp(argv[arg], "-lastdup") == 0)  lastdup = TRUE;
   else if (Ustrcmp(argv[arg], "-noduperr") == 0) duperr = FALSE;
   else if (Ustrcmp(argv[arg], "-nozero") == 0)   add_zero = 0;
+  else if (Ustrcmp(argv[arg], "-cdb") == 0)      cdb = TRUE;
   else break;
   arg++;
   argc--;
@@ -212,10 +456,14 @@ while (argc > 1)
 
 if (argc != 3)
   {
-  printf("usage: exim_dbmbuild [-nolc] <source file> <dbm base name>\n");
+  printf("usage: exim_dbmbuild [-nolc] [-cdb] <source file> <dbm base name>\n");
   exit(1);
   }
 
+/* The keys and data in a cdb file carry their lengths */
+
+if (cdb) add_zero = 0;
+
 if (Ustrcmp(argv[arg], "-") == 0)
   f = stdin;
 else if (!(f = fopen(argv[arg], "rb")))
@@ -225,20 +473,23 @@ else if (!(f = fopen(argv[arg], "rb")))
   }
 
 /* By default Berkeley db does not put extensions on... which
-can be painful! */
+can be painful! Nor is there one for a cdb file. */
 
-#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
-if (Ustrcmp(argv[arg], argv[arg+1]) == 0)
+if (
+#if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM) \
+  && !defined(USE_LMDB)
+    cdb &&
+#endif
+    Ustrcmp(argv[arg], argv[arg+1]) == 0)
   {
   printf("exim_dbmbuild: input and output filenames are the same\n");
   exit(1);
   }
-#endif
 
 /* Check length of filename; allow for adding .dbmbuild_temp and .db or
-.dir/.pag later. */
+.dir/.pag or -spill later. */
 
-if (strlen(argv[arg+1]) > sizeof(temp_dbmname) - 20)
+if (strlen(argv[arg+1]) > sizeof(temp_dbmname) - 24)
   {
   printf("exim_dbmbuild: output filename is ridiculously long\n");
   exit(1);
@@ -253,12 +504,37 @@ if ((bptr = Ustrrchr(dirname, '/')))
 else
   Ustrcpy(dirname, US".");
 
+/* A cdb file is written here. The spill file for its hashes is unlinked as
+soon as it is open, so that it goes away however the program ends. */
+
+if (cdb)
+  {
+  FILE * out = NULL, * spill = NULL;
+  int fd;
+
+  snprintf(CS real_dbmname, sizeof(real_dbmname), "%s-spill", temp_dbmname);
+  if (  (fd = Uopen(temp_dbmname, O_RDWR|O_CREAT|O_EXCL, 0644)) < 0
+     || !(out = fdopen(fd, "w+b"))
+     || (fd = Uopen(real_dbmname, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0
+     || Uunlink(real_dbmname) != 0
+     || !(spill = fdopen(fd, "w+b"))
+     || cdb_start(&cw, out, spill) != 0)
+    {
+    printf("exim_dbmbuild: unable to create %s: %s\n", temp_dbmname,
+      strerror(errno));
+    if (out) Uunlink(temp_dbmname);
+    (void)fclose(f);
+    exit(1);
+    }
+  }
+
 /* It is apparently necessary to open with O_RDWR for this to work
 with gdbm-1.7.3, though no reading is actually going to be done. */
 
-EXIM_DBOPEN(temp_dbmname, dirname, O_RDWR|O_CREAT|O_EXCL, 0644, &d);
+else
+  EXIM_DBOPEN(temp_dbmname, dirname, O_RDWR|O_CREAT|O_EXCL, 0644, &d);
 
-if (d == NULL)
+if (!cdb && d == NULL)
   {
   printf("exim_dbmbuild: unable to create %s: %s\n", temp_dbmname,
     strerror(errno));
@@ -269,9 +545,10 @@ if (d == NULL)
 /* Unless using native db calls, see if we have created <name>.db; if not,
 assume .dir & .pag */
 
-#if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM)
+#if !defined(USE_DB) && !defined(USE_TDB) && !defined(USE_GDBM) \
+  && !defined(USE_LMDB)
 sprintf(CS real_dbmname, "%s.db", temp_dbmname);
-is_db = Ustat(real_dbmname, &statbuf) == 0;
+is_db = !cdb && Ustat(real_dbmname, &statbuf) == 0;
 #endif
 
 /* Now do the business */
@@ -341,7 +618,11 @@ while (Ufgets(line, max_insize, f) != NULL)
       EXIM_DATUM_DATA(content) = CS buffer;
       EXIM_DATUM_SIZE(content) = bptr - buffer + add_zero;
 
-      switch(rc = EXIM_DBPUTB(d, key, content))
+      rc = cdb
+	? cdb_put(&cw, US EXIM_DATUM_DATA(key), EXIM_DATUM_SIZE(key),
+	    US EXIM_DATUM_DATA(content), EXIM_DATUM_SIZE(content))
+	: EXIM_DBPUTB(d, key, content);
+      switch(rc)
         {
         case EXIM_DBPUTB_OK:
 	  count++;
@@ -431,7 +712,11 @@ if (started)
   EXIM_DATUM_DATA(content) = CS buffer;
   EXIM_DATUM_SIZE(content) = bptr - buffer + add_zero;
 
-  switch(rc = EXIM_DBPUTB(d, key, content))
+  rc = cdb
+    ? cdb_put(&cw, US EXIM_DATUM_DATA(key), EXIM_DATUM_SIZE(key),
+	US EXIM_DATUM_DATA(content), EXIM_DATUM_SIZE(content))
+    : EXIM_DBPUTB(d, key, content);
+  switch(rc)
     {
     case EXIM_DBPUTB_OK:
     count++;
@@ -456,7 +741,21 @@ if (started)
 
 TIDYUP:
 
-EXIM_DBCLOSE(d);
+if (cdb)
+  {
+  if (yield < 2 && cdb_finish(&cw, warn, lastdup, &dupcount) != 0)
+    {
+    printf("Error while writing %s: %s\n", temp_dbmname, strerror(errno));
+    yield = 2;
+    }
+  else if (dupcount > 0 && duperr && yield == 0)
+    yield = 1;
+  count -= dupcount;
+  (void)fclose(cw.spill);
+  (void)fclose(cw.out);
+  }
+else
+  EXIM_DBCLOSE(d);
 (void)fclose(f);
 
 /* If successful, output the number of entries and rename the temporary
@@ -470,7 +769,20 @@ if (yield == 0 || yield == 1)
     printf("%d duplicate key%s \n", dupcount, (dupcount > 1)? "s" : "");
     }
 
-  #if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
+  /* Rename a cdb file */
+
+  if (cdb)
+    {
+    if (Urename(temp_dbmname, argv[arg+1]) != 0)
+      {
+      printf("Unable to rename %s as %s\n", temp_dbmname, argv[arg+1]);
+      return 1;
+      }
+    return yield;
+    }
+
+  #if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM) \
+  || defined(USE_LMDB)
   Ustrcpy(real_dbmname, temp_dbmname);
   Ustrcpy(buffer, US argv[arg+1]);
   if (Urename(real_dbmname, buffer) != 0)
@@ -478,6 +790,10 @@ if (yield == 0 || yield == 1)
     printf("Unable to rename %s as %s\n", real_dbmname, buffer);
     return 1;
     }
+  #ifdef USE_LMDB
+  Ustrcat(real_dbmname, US"-lock");	/* LMDB lock file: remade on use */
+  Uunlink(real_dbmname);
+  #endif
   #else
 
   /* Rename a single .db file */
@@ -522,10 +838,20 @@ if (yield == 0 || yield == 1)
 else
   {
   printf("dbmbuild abandoned\n");
-#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM)
+  if (cdb)
+    {
+    Uunlink(temp_dbmname);
+    return yield;
+    }
+#if defined(USE_DB) || defined(USE_TDB) || defined(USE_GDBM) \
+  || defined(USE_LMDB)
   /* We created it, so safe to delete despite the name coming from outside */
   /* coverity[tainted_string] */
   Uunlink(temp_dbmname);
+# ifdef USE_LMDB
+  Ustrcat(temp_dbmname, US"-lock");
+  Uunlink(temp_dbmname);
+# endif
 #else
   if (is_db)
     {
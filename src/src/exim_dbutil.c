@@ -23,6 +23,11 @@ argument is the name of the database file. The available names are:
   callout:    callout verification cache
   tls:	      TLS session resumption cache
 
+A database that Exim has split into shards (see hints_db_shards) is a set of
+files named <name>.0, <name>.1, and so on. Any of these names can be given, and
+exim_dumpdb and exim_tidydb process all the shards when they are given the
+plain name.
+
 There are a number of common subroutines, followed by three main programs,
 whose inclusion is controlled by -D on the compilation command. */
 
@@ -38,11 +43,22 @@ whose inclusion is controlled by -D on the compilation command. */
 #define type_callout   4
 #define type_ratelimit 5
 #define type_tls       6
+#define type_lookup    7
+#define type_autoreply 8
+#define type_route     9
+#define type_malware  10
+#define type_gsasl    11
+#define type_hoststats 12
+#define type_sourceip 13
+#define type_rejectlog 14
+#define type_verify   15
 
 
 /* This is used by our cut-down dbfn_open(). */
 
 uschar *spool_directory;
+int spool_stripe_count = 0;
+const uschar **spool_stripe_dirs = NULL;
 
 
 /******************************************************************************/
@@ -120,6 +136,8 @@ usage(uschar *name, uschar *options)
 {
 printf("Usage: exim_%s%s  <spool-directory> <database-name>\n", name, options);
 printf("  <database-name> = retry | misc | wait-<transport-name> | callout | ratelimit | tls\n");
+printf("                    | lookup | autoreply | routes | malware | gsasl\n");
+printf("                    | hoststats | sourceip | rejectlog | verify\n");
 exit(1);
 }
 
@@ -130,19 +148,33 @@ exit(1);
 *************************************************/
 
 /* This function checks that there are exactly 2 arguments, and checks the
-second of them to be sure it is a known database name. */
+second of them to be sure it is a known database name, possibly followed by
+a shard number. */
 
 static int
 check_args(int argc, uschar **argv, uschar *name, uschar *options)
 {
 if (argc == 3)
   {
-  if (Ustrcmp(argv[2], "retry") == 0) return type_retry;
-  if (Ustrcmp(argv[2], "misc") == 0) return type_misc;
-  if (Ustrncmp(argv[2], "wait-", 5) == 0) return type_wait;
-  if (Ustrcmp(argv[2], "callout") == 0) return type_callout;
-  if (Ustrcmp(argv[2], "ratelimit") == 0) return type_ratelimit;
-  if (Ustrcmp(argv[2], "tls") == 0) return type_tls;
+  uschar * s = argv[2], * dot = Ustrrchr(s, '.');
+  int len = dot && dot[1] && Ustrspn(dot+1, "0123456789") == Ustrlen(dot+1)
+    ? dot - s : Ustrlen(s);
+
+  if (len == 5 && Ustrncmp(s, "retry", 5) == 0) return type_retry;
+  if (len == 4 && Ustrncmp(s, "misc", 4) == 0) return type_misc;
+  if (Ustrncmp(s, "wait-", 5) == 0) return type_wait;
+  if (len == 7 && Ustrncmp(s, "callout", 7) == 0) return type_callout;
+  if (len == 9 && Ustrncmp(s, "ratelimit", 9) == 0) return type_ratelimit;
+  if (len == 3 && Ustrncmp(s, "tls", 3) == 0) return type_tls;
+  if (len == 6 && Ustrncmp(s, "lookup", 6) == 0) return type_lookup;
+  if (len == 9 && Ustrncmp(s, "autoreply", 9) == 0) return type_autoreply;
+  if (len == 6 && Ustrncmp(s, "routes", 6) == 0) return type_route;
+  if (len == 7 && Ustrncmp(s, "malware", 7) == 0) return type_malware;
+  if (len == 5 && Ustrncmp(s, "gsasl", 5) == 0) return type_gsasl;
+  if (len == 9 && Ustrncmp(s, "hoststats", 9) == 0) return type_hoststats;
+  if (len == 8 && Ustrncmp(s, "sourceip", 8) == 0) return type_sourceip;
+  if (len == 9 && Ustrncmp(s, "rejectlog", 9) == 0) return type_rejectlog;
+  if (len == 6 && Ustrncmp(s, "verify", 6) == 0) return type_verify;
   }
 usage(name, options);
 return -1;              /* Never obeyed */
@@ -277,24 +309,35 @@ Returns:   NULL if the open failed, or the locking failed.
 open_db *
 dbfn_open(uschar *name, int flags, open_db *dbblock, BOOL lof, BOOL panic)
 {
+#ifndef USE_LMDB
 int rc;
 struct flock lock_data;
+#endif
 BOOL read_only = flags == O_RDONLY;
 uschar * dirname, * filename;
 
 /* The first thing to do is to open a separate file on which to lock. This
 ensures that Exim has exclusive use of the database before it even tries to
-open it. If there is a database, there should be a lock file in existence. */
+open it. If there is a database, there should be a lock file in existence.
+LMDB does its own locking, and there is no lock file. */
 
 #ifdef COMPILE_UTILITY
-if (  asprintf(CSS &dirname, "%s/db", spool_directory) < 0
-   || asprintf(CSS &filename, "%s/%s.lockfile", dirname, name) < 0)
-  return NULL;
+if (asprintf(CSS &dirname, "%s/db", spool_directory) < 0) return NULL;
 #else
 dirname = string_sprintf("%s/db", spool_directory);
-filename = string_sprintf("%s/%s.lockfile", dirname, name);
 #endif
 
+#ifdef USE_LMDB
+dbblock->lockfd = -1;
+#else
+
+# ifdef COMPILE_UTILITY
+if (asprintf(CSS &filename, "%s/%s.lockfile", dirname, name) < 0)
+  return NULL;
+# else
+filename = string_sprintf("%s/%s.lockfile", dirname, name);
+# endif
+
 dbblock->lockfd = Uopen(filename, flags, 0);
 if (dbblock->lockfd < 0)
   {
@@ -325,6 +368,7 @@ if (rc < 0)
   (void)close(dbblock->lockfd);
   return NULL;
   }
+#endif	/*!USE_LMDB*/
 
 /* At this point we have an opened and locked separate lock file, that is,
 exclusive access to the database, so we can go ahead and open it. */
@@ -346,7 +390,7 @@ if (!dbblock->dbptr)
     ""
     #endif
     );
-  (void)close(dbblock->lockfd);
+  if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
   return NULL;
   }
 
@@ -371,7 +415,7 @@ void
 dbfn_close(open_db *dbblock)
 {
 EXIM_DBCLOSE(dbblock->dbptr);
-(void)close(dbblock->lockfd);
+if (dbblock->lockfd >= 0) (void)close(dbblock->lockfd);
 }
 
 
@@ -494,6 +538,66 @@ return EXIM_DBDEL(dbblock->dbptr, key_datum);
 
 
 #if defined(EXIM_DUMPDB) || defined(EXIM_TIDYDB)
+/*************************************************
+*            Find the shards of a database       *
+*************************************************/
+
+/* Build the name of a database file, or of one of its shards.
+
+Arguments:
+  buffer   where to put the name
+  size     size of buffer
+  name     the database name
+  shard    the shard number, or -1 for the unsplit file
+
+Returns:   buffer
+*/
+
+static uschar *
+db_shard_name(uschar * buffer, int size, const uschar * name, int shard)
+{
+if (shard < 0) snprintf(CS buffer, size, "%s", name);
+else snprintf(CS buffer, size, "%s.%d", name, shard);
+return buffer;
+}
+
+
+/* Test for the existence of a database file or shard, by way of its lock file
+when there is one. */
+
+static BOOL
+db_shard_exists(const uschar * name, int shard)
+{
+struct stat statbuf;
+uschar dbname[256], filename[512];
+
+snprintf(CS filename, sizeof(filename), "%s/db/%s%s", spool_directory,
+  db_shard_name(dbname, sizeof(dbname), name, shard),
+#ifdef USE_LMDB
+  ""
+#else
+  ".lockfile"
+#endif
+  );
+return Ustat(filename, &statbuf) == 0;
+}
+
+
+/* Work out which files to process for a database name. If it has shards, the
+unsplit file is included only if it also exists. The result is the first
+file number to use (-1 for the unsplit file), and the count of shards is
+returned via the pointer. */
+
+static int
+db_shards(const uschar * name, int * count)
+{
+int n = 0;
+while (db_shard_exists(name, n)) n++;
+*count = n;
+return n == 0 || db_shard_exists(name, -1) ? -1 : 0;
+}
+
+
 /*************************************************
 *         Scan the keys of a database file       *
 *************************************************/
@@ -540,22 +644,25 @@ return yield;
 *           The exim_dumpdb main program         *
 *************************************************/
 
-int
-main(int argc, char **cargv)
+/* Dump one database file.
+
+Arguments:
+  dbname       the name of the file
+  dbdata_type  the type of database
+
+Returns:       the exit code
+*/
+
+static int
+dump_db(uschar * dbname, int dbdata_type)
 {
-int dbdata_type = 0;
 int yield = 0;
 open_db dbblock;
 open_db *dbm;
 EXIM_CURSOR *cursor;
-uschar **argv = USS cargv;
 uschar keybuffer[1024];
 
-/* Check the arguments, and open the database */
-
-dbdata_type = check_args(argc, argv, US"dumpdb", US"");
-spool_directory = argv[1];
-if (!(dbm = dbfn_open(argv[2], O_RDONLY, &dbblock, FALSE, TRUE)))
+if (!(dbm = dbfn_open(dbname, O_RDONLY, &dbblock, FALSE, TRUE)))
   exit(1);
 
 /* Scan the file, formatting the information for each entry. Note
@@ -572,6 +679,14 @@ for (uschar * key = dbfn_scan(dbm, TRUE, &cursor);
   dbdata_ratelimit *ratelimit;
   dbdata_ratelimit_unique *rate_unique;
   dbdata_tls_session *session;
+  dbdata_lookup *lookup;
+  dbdata_route *route;
+  dbdata_malware *malware;
+  dbdata_gsasl *gsasl;
+  dbdata_hoststats *hoststats;
+  dbdata_sourceip *sourceip;
+  dbdata_rejectlog *rejectlog;
+  dbdata_verify *verify;
   int count_bad = 0;
   int length;
   uschar *t;
@@ -649,6 +764,7 @@ for (uschar * key = dbfn_scan(dbm, TRUE, &cursor);
 	break;
 
       case type_misc:
+      case type_autoreply:
 	printf("%s %s\n", print_time(((dbdata_generic *)value)->time_stamp),
 	  keybuffer);
 	break;
@@ -710,6 +826,65 @@ for (uschar * key = dbfn_scan(dbm, TRUE, &cursor);
 	session = (dbdata_tls_session *)value;
 	printf("  %s %.*s\n", keybuffer, length, session->session);
 	break;
+
+      case type_lookup:
+	lookup = (dbdata_lookup *)value;
+	printf("%s ", print_time(lookup->time_stamp));
+	printf("%s %s %s\n", print_time(lookup->expiry), keybuffer,
+	  lookup->found ? lookup->data : US"(not found)");
+	break;
+
+      case type_route:
+	route = (dbdata_route *)value;
+	printf("%s ", print_time(route->time_stamp));
+	printf("%s %08x %s %s\n", print_time(route->expiry), route->config_hash,
+	  keybuffer, route->data);
+	break;
+
+      case type_malware:
+	malware = (dbdata_malware *)value;
+	printf("%s %s %s\n", print_time(malware->time_stamp), keybuffer,
+	  malware->version);
+	break;
+
+      case type_gsasl:
+	gsasl = (dbdata_gsasl *)value;
+	printf("%s %s %s %s\n", print_time(gsasl->time_stamp), keybuffer,
+	  gsasl->keys, gsasl->keys + Ustrlen(gsasl->keys) + 1);
+	break;
+
+      case type_hoststats:
+	hoststats = (dbdata_hoststats *)value;
+	printf("%s %s %u/%u %.2f %.1f %.1f %.1f\n",
+	  print_time(hoststats->time_stamp), keybuffer, hoststats->failures,
+	  hoststats->attempts, hoststats->fail_rate, hoststats->connect_ms,
+	  hoststats->ehlo_ms, hoststats->txn_ms);
+	break;
+
+      case type_sourceip:
+	sourceip = (dbdata_sourceip *)value;
+	printf("%s %s %.2f", print_time(sourceip->time_stamp), keybuffer,
+	  sourceip->tokens);
+	if (sourceip->throttled > time(NULL))
+	  printf(" throttled until %s", print_time(sourceip->throttled));
+	printf("\n");
+	break;
+
+      case type_rejectlog:
+	rejectlog = (dbdata_rejectlog *)value;
+	printf("%s %s from %s seen %d written %d suppressed %d\n",
+	  print_time(rejectlog->time_stamp), keybuffer,
+	  print_time(rejectlog->period_start), rejectlog->seen,
+	  rejectlog->written, rejectlog->suppressed);
+	break;
+
+      case type_verify:
+	verify = (dbdata_verify *)value;
+	printf("%s ", print_time(verify->time_stamp));
+	printf("%s %08x %s %s\n", print_time(verify->expiry),
+	  verify->config_hash, keybuffer,
+	  verify->rc == OK ? "OK" : verify->rc == FAIL ? "FAIL" : "?");
+	break;
       }
     }
   store_reset(reset_point);
@@ -719,6 +894,28 @@ dbfn_close(dbm);
 return yield;
 }
 
+
+int
+main(int argc, char **cargv)
+{
+int dbdata_type = 0;
+int yield = 0;
+int shards;
+uschar **argv = USS cargv;
+uschar dbname[256];
+
+/* Check the arguments, and dump the database, or each of its shards */
+
+dbdata_type = check_args(argc, argv, US"dumpdb", US"");
+spool_directory = argv[1];
+
+for (int i = db_shards(argv[2], &shards); i < shards || i < 0; i++)
+  yield |= dump_db(db_shard_name(dbname, sizeof(dbname), argv[2], i),
+    dbdata_type);
+
+return yield;
+}
+
 #endif  /* EXIM_DUMPDB */
 
 
@@ -783,6 +980,13 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
   dbdata_ratelimit *ratelimit;
   dbdata_ratelimit_unique *rate_unique;
   dbdata_tls_session *session;
+  dbdata_lookup *lookup;
+  dbdata_route *route;
+  dbdata_malware *malware;
+  dbdata_gsasl *gsasl;
+  dbdata_hoststats *hoststats;
+  dbdata_sourceip *sourceip;
+  dbdata_rejectlog *rejectlog;
   int oldlength;
   uschar *t;
   uschar field[256], value[256];
@@ -884,7 +1088,9 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
 	      break;
 
             case type_misc:
-	      printf("Can't change contents of misc database record\n");
+            case type_autoreply:
+	      printf("Can't change contents of %s database record\n",
+		dbdata_type == type_misc ? "misc" : "autoreply");
 	      break;
 
             case type_callout:
@@ -965,6 +1171,144 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
             case type_tls:
 	      printf("Can't change contents of tls database record\n");
 	      break;
+
+            case type_lookup:
+	      lookup = (dbdata_lookup *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) lookup->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		case 1: if ((tt = read_time(value)) > 0) lookup->expiry = tt;
+			else printf("bad time value\n");
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_route:
+	      route = (dbdata_route *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) route->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		case 1: if ((tt = read_time(value)) > 0) route->expiry = tt;
+			else printf("bad time value\n");
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_malware:
+	      malware = (dbdata_malware *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) malware->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_gsasl:
+	      gsasl = (dbdata_gsasl *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) gsasl->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_hoststats:
+	      hoststats = (dbdata_hoststats *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) hoststats->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		case 1: hoststats->attempts = Uatoi(value);
+			break;
+		case 2: hoststats->failures = Uatoi(value);
+			break;
+		case 3: hoststats->fail_rate = Ustrtod(value, NULL);
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_sourceip:
+	      sourceip = (dbdata_sourceip *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) sourceip->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		case 1: if ((tt = read_time(value)) > 0) sourceip->first_used = tt;
+			else printf("bad time value\n");
+			break;
+		case 2: if ((tt = read_time(value)) > 0) sourceip->throttled = tt;
+			else printf("bad time value\n");
+			break;
+		case 3: sourceip->tokens = Ustrtod(value, NULL);
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_rejectlog:
+	      rejectlog = (dbdata_rejectlog *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) rejectlog->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		case 1: if ((tt = read_time(value)) > 0) rejectlog->period_start = tt;
+			else printf("bad time value\n");
+			break;
+		case 2: rejectlog->seen = Uatoi(value);
+			break;
+		case 3: rejectlog->written = Uatoi(value);
+			break;
+		case 4: rejectlog->suppressed = Uatoi(value);
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      break;
+
+            case type_verify:
+	      {
+	      dbdata_verify * vrec = (dbdata_verify *)record;
+	      switch(fieldno)
+		{
+		case 0: if ((tt = read_time(value)) > 0) vrec->time_stamp = tt;
+			else printf("bad time value\n");
+			break;
+		case 1: if ((tt = read_time(value)) > 0) vrec->expiry = tt;
+			else printf("bad time value\n");
+			break;
+		default: printf("unknown field number\n");
+			 verify = 0;
+			 break;
+		}
+	      }
+	      break;
             }
 
           dbfn_write(dbm, name, record, oldlength);
@@ -1047,6 +1391,7 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
 	break;
 
       case type_misc:
+      case type_autoreply:
 	break;
 
       case type_callout:
@@ -1082,6 +1427,73 @@ for(; (reset_point = store_mark()); store_reset(reset_point))
 	printf("0 time stamp:  %s\n", print_time(session->time_stamp));
 	printf("1 session: .%s\n", session->session);
 	break;
+
+      case type_lookup:
+	lookup = (dbdata_lookup *)record;
+	printf("0 time stamp:  %s\n", print_time(lookup->time_stamp));
+	printf("1 expiry time: %s\n", print_time(lookup->expiry));
+	printf("  data: %s\n", lookup->found ? lookup->data : US"(not found)");
+	break;
+
+      case type_route:
+	route = (dbdata_route *)record;
+	printf("0 time stamp:  %s\n", print_time(route->time_stamp));
+	printf("1 expiry time: %s\n", print_time(route->expiry));
+	printf("  config hash: %08x\n", route->config_hash);
+	printf("  data: %s\n", route->data);
+	break;
+
+      case type_malware:
+	malware = (dbdata_malware *)record;
+	printf("0 time stamp:  %s\n", print_time(malware->time_stamp));
+	printf("  version: %s\n", malware->version);
+	break;
+
+      case type_gsasl:
+	gsasl = (dbdata_gsasl *)record;
+	printf("0 time stamp:  %s\n", print_time(gsasl->time_stamp));
+	printf("  StoredKey: %s\n", gsasl->keys);
+	printf("  ServerKey: %s\n", gsasl->keys + Ustrlen(gsasl->keys) + 1);
+	break;
+
+      case type_hoststats:
+	hoststats = (dbdata_hoststats *)record;
+	printf("0 time stamp:  %s\n", print_time(hoststats->time_stamp));
+	printf("1 attempts:    %u\n", hoststats->attempts);
+	printf("2 failures:    %u\n", hoststats->failures);
+	printf("3 failure rate: %.2f\n", hoststats->fail_rate);
+	printf("  connect:     %.1fms\n", hoststats->connect_ms);
+	printf("  EHLO:        %.1fms\n", hoststats->ehlo_ms);
+	printf("  transaction: %.1fms\n", hoststats->txn_ms);
+	break;
+
+      case type_sourceip:
+	sourceip = (dbdata_sourceip *)record;
+	printf("0 time stamp:  %s\n", print_time(sourceip->time_stamp));
+	printf("1 first used:  %s\n", print_time(sourceip->first_used));
+	printf("2 throttled until: %s\n", print_time(sourceip->throttled));
+	printf("3 tokens:      %.2f\n", sourceip->tokens);
+	break;
+
+      case type_rejectlog:
+	rejectlog = (dbdata_rejectlog *)record;
+	printf("0 time stamp:   %s\n", print_time(rejectlog->time_stamp));
+	printf("1 period start: %s\n", print_time(rejectlog->period_start));
+	printf("2 seen:         %d\n", rejectlog->seen);
+	printf("3 written:      %d\n", rejectlog->written);
+	printf("4 suppressed:   %d\n", rejectlog->suppressed);
+	break;
+
+      case type_verify:
+	{
+	dbdata_verify * vrec = (dbdata_verify *)record;
+	printf("0 time stamp:  %s\n", print_time(vrec->time_stamp));
+	printf("1 expiry time: %s\n", print_time(vrec->expiry));
+	printf("  config hash: %08x\n", vrec->config_hash);
+	printf("  result: %s\n",
+	  vrec->rc == OK ? "OK" : vrec->rc == FAIL ? "FAIL" : "?");
+	}
+	break;
       }
     }
 
@@ -1104,33 +1516,76 @@ return 0;
 *************************************************/
 
 
-/* Utility program to tidy the contents of an exim database file. There is one
-option:
+/* Utility program to tidy the contents of an exim database file. There are
+these options:
 
    -t <time>  expiry time for old records - default 30 days
+   -b <count> number of records to process per database lock - default 1000
+   -s <list>  the spool_stripes directories, when messages are spread over them
 
 For backwards compatibility, an -f option is recognized and ignored. (It used
-to request a "full" tidy. This version always does the whole job.) */
+to request a "full" tidy. This version always does the whole job.)
+
+The keys are collected under a shared lock, and the records are then processed
+in batches, releasing the exclusive lock between batches so that Exim processes
+waiting to use the database are not held up for the whole run. */
 
 
 typedef struct key_item {
   struct key_item *next;
+  int shard;			/* file number, as for db_shards() */
   uschar key[1];
 } key_item;
 
 
-int main(int argc, char **cargv)
+/* Check whether a message is still on the spool, looking in both the places
+its -D file might be, in whichever spool root holds it. */
+
+static BOOL
+tidy_message_exists(const uschar * id)
 {
 struct stat statbuf;
+uschar buffer[512];
+const uschar * root = spool_root(id);
+
+snprintf(CS buffer, sizeof(buffer), "%s/input/%.*s-D",
+  root, MESSAGE_ID_LENGTH, id);
+if (Ustat(buffer, &statbuf) == 0) return TRUE;
+snprintf(CS buffer, sizeof(buffer), "%s/input/%c/%.*s-D",
+  root, id[5], MESSAGE_ID_LENGTH, id);
+return Ustat(buffer, &statbuf) == 0;
+}
+
+
+/* Set up the spool_stripes list from a -s option */
+
+static void
+tidy_stripes(uschar * list)
+{
+int n = 1;
+
+for (uschar * s = list; *s; s++) if (*s == ':') n++;
+spool_stripe_dirs = malloc(n * sizeof(uschar *));
+for (uschar * s = list, * t; s; s = t)
+  {
+  if ((t = Ustrchr(s, ':'))) *t++ = 0;
+  if (*s) spool_stripe_dirs[spool_stripe_count++] = s;
+  }
+}
+
+
+int main(int argc, char **cargv)
+{
 int maxkeep = 30 * 24 * 60 * 60;
-int dbdata_type, i, oldest, path_len;
+int batchsize = 1000, batchcount = 0;
+int dbdata_type, i, oldest, shards, first, dbshard = -1;
 key_item *keychain = NULL;
 rmark reset_point;
 open_db dbblock;
 open_db *dbm;
 EXIM_CURSOR *cursor;
 uschar **argv = USS cargv;
-uschar buffer[256];
+uschar dbname[256];
 uschar *key;
 
 /* Scan the options */
@@ -1139,7 +1594,17 @@ for (i = 1; i < argc; i++)
   {
   if (argv[i][0] != '-') break;
   if (Ustrcmp(argv[i], "-f") == 0) continue;
-  if (Ustrcmp(argv[i], "-t") == 0)
+  if (Ustrcmp(argv[i], "-b") == 0)
+    {
+    if (!argv[++i] || !isdigit(argv[i][0]) || (batchsize = atoi(CS argv[i])) <= 0)
+      usage(US"tidydb", US" [-t <time>] [-b <count>] [-s <stripes>]");
+    }
+  else if (Ustrcmp(argv[i], "-s") == 0)
+    {
+    if (!argv[++i]) usage(US"tidydb", US" [-t <time>] [-b <count>] [-s <stripes>]");
+    tidy_stripes(argv[i]);
+    }
+  else if (Ustrcmp(argv[i], "-t") == 0)
     {
     uschar *s;
     s = argv[++i];
@@ -1147,7 +1612,7 @@ for (i = 1; i < argc; i++)
     while (*s != 0)
       {
       int value, count;
-      if (!isdigit(*s)) usage(US"tidydb", US" [-t <time>]");
+      if (!isdigit(*s)) usage(US"tidydb", US" [-t <time>] [-b <count>] [-s <stripes>]");
       (void)sscanf(CS s, "%d%n", &value, &count);
       s += count;
       switch (*s)
@@ -1158,12 +1623,12 @@ for (i = 1; i < argc; i++)
         case 'm': value *= 60;
         case 's': s++;
         break;
-        default: usage(US"tidydb", US" [-t <time>]");
+        default: usage(US"tidydb", US" [-t <time>] [-b <count>] [-s <stripes>]");
         }
       maxkeep += value;
       }
     }
-  else usage(US"tidydb", US" [-t <time>]");
+  else usage(US"tidydb", US" [-t <time>] [-b <count>] [-s <stripes>]");
   }
 
 /* Adjust argument values and process arguments */
@@ -1171,46 +1636,71 @@ for (i = 1; i < argc; i++)
 argc -= --i;
 argv += i;
 
-dbdata_type = check_args(argc, argv, US"tidydb", US" [-t <time>]");
+dbdata_type = check_args(argc, argv, US"tidydb", US" [-t <time>] [-b <count>] [-s <stripes>]");
 
-/* Compute the oldest keep time, verify what we are doing, and open the
-database */
+/* Compute the oldest keep time, verify what we are doing, and find the files
+to process. */
 
 oldest = time(NULL) - maxkeep;
 printf("Tidying Exim hints database %s/db/%s\n", argv[1], argv[2]);
 
 spool_directory = argv[1];
-if (!(dbm = dbfn_open(argv[2], O_RDWR, &dbblock, FALSE, TRUE)))
-  exit(1);
-
-/* Prepare for building file names */
-
-sprintf(CS buffer, "%s/input/", argv[1]);
-path_len = Ustrlen(buffer);
+first = db_shards(argv[2], &shards);
 
 
 /* It appears, by experiment, that it is a bad idea to make changes
 to the file while scanning it. Pity the man page doesn't warn you about that.
 Therefore, we scan and build a list of all the keys. Then we use that to
-read the records and possibly update them. */
+read the records and possibly update them. For a sharded database, the keys
+of all the shards are collected, each file being opened for reading in turn. */
 
-for (key = dbfn_scan(dbm, TRUE, &cursor);
-     key;
-     key = dbfn_scan(dbm, FALSE, &cursor))
+for (int n = first; n < shards || n < 0; n++)
   {
-  key_item *k = store_get(sizeof(key_item) + Ustrlen(key), is_tainted(key));
-  k->next = keychain;
-  keychain = k;
-  Ustrcpy(k->key, key);
+  if (!(dbm = dbfn_open(db_shard_name(dbname, sizeof(dbname), argv[2], n),
+      O_RDONLY, &dbblock, FALSE, TRUE)))
+    exit(1);
+
+  for (key = dbfn_scan(dbm, TRUE, &cursor);
+       key;
+       key = dbfn_scan(dbm, FALSE, &cursor))
+    {
+    key_item *k = store_get(sizeof(key_item) + Ustrlen(key), is_tainted(key));
+    k->next = keychain;
+    k->shard = n;
+    keychain = k;
+    Ustrcpy(k->key, key);
+    }
+
+  dbfn_close(dbm);
+  dbm = NULL;
   }
 
 /* Now scan the collected keys and operate on the records, resetting
-the store each time round. */
+the store each time round. The database is opened for writing for each batch
+of records, and closed (unlocked) again when the batch is complete or the next
+key is in a different shard. Because of this, a record may have been changed
+or removed since its key was collected; it is always re-read here before
+deciding what to do with it. */
 
 for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
   {
   dbdata_generic *value;
 
+  if (dbm && (batchcount >= batchsize || keychain->shard != dbshard))
+    {
+    dbfn_close(dbm);
+    dbm = NULL;
+    }
+  if (!dbm)
+    {
+    dbshard = keychain->shard;
+    if (!(dbm = dbfn_open(db_shard_name(dbname, sizeof(dbname), argv[2],
+        dbshard), O_RDWR, &dbblock, FALSE, TRUE)))
+      exit(1);
+    batchcount = 0;
+    }
+  batchcount++;
+
   key = keychain->key;
   keychain = keychain->next;
   value = dbfn_read_with_length(dbm, key, NULL);
@@ -1229,6 +1719,21 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
     continue;
     }
 
+  /* Shared lookup results, cached routings and verification results are of
+  no use once they have expired */
+
+  if (  dbdata_type == type_lookup
+     && ((dbdata_lookup *)value)->expiry < time(NULL)
+     || dbdata_type == type_route
+     && ((dbdata_route *)value)->expiry < time(NULL)
+     || dbdata_type == type_verify
+     && ((dbdata_verify *)value)->expiry < time(NULL))
+    {
+    printf("deleted %s (expired)\n", key);
+    dbfn_delete(dbm, key);
+    continue;
+    }
+
   /* Do database-specific tidying for wait databases, and message-
   specific tidying for the retry database. */
 
@@ -1248,8 +1753,7 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
 
     /* Loop for renamed continuation records. For each message id,
     check to see if the message exists, and if not, remove its entry
-    from the record. Because of the possibility of split input directories,
-    we must look in both possible places for a -D file. */
+    from the record. */
 
     for (;;)
       {
@@ -1257,28 +1761,15 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
 
       for (int offset = length - MESSAGE_ID_LENGTH;
            offset >= 0; offset -= MESSAGE_ID_LENGTH)
-        {
-        Ustrncpy(buffer+path_len, wait->text + offset, MESSAGE_ID_LENGTH);
-        sprintf(CS(buffer+path_len + MESSAGE_ID_LENGTH), "-D");
-
-        if (Ustat(buffer, &statbuf) != 0)
+        if (!tidy_message_exists(wait->text + offset))
           {
-          buffer[path_len] = wait->text[offset+5];
-          buffer[path_len+1] = '/';
-          Ustrncpy(buffer+path_len+2, wait->text + offset, MESSAGE_ID_LENGTH);
-          sprintf(CS(buffer+path_len+2 + MESSAGE_ID_LENGTH), "-D");
-
-          if (Ustat(buffer, &statbuf) != 0)
-            {
-            int left = length - offset - MESSAGE_ID_LENGTH;
-            if (left > 0) Ustrncpy(wait->text + offset,
-              wait->text + offset + MESSAGE_ID_LENGTH, left);
-            wait->count--;
-            length -= MESSAGE_ID_LENGTH;
-            update = TRUE;
-            }
+          int left = length - offset - MESSAGE_ID_LENGTH;
+          if (left > 0) Ustrncpy(wait->text + offset,
+            wait->text + offset + MESSAGE_ID_LENGTH, left);
+          wait->count--;
+          length -= MESSAGE_ID_LENGTH;
+          update = TRUE;
           }
-        }
 
       /* If record is empty and the main record, either delete it or rename
       the next continuation, repeating if that is also empty. */
@@ -1319,6 +1810,16 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
       else break;
       }
 
+    /* A continuation record, or the marker record for a message, that has
+    been emptied is not needed. */
+
+    if (update && wait->count == 0 && Ustrchr(key, ':') != NULL)
+      {
+      dbfn_delete(dbm, key);
+      printf("deleted %s (empty)\n", key);
+      update = FALSE;
+      }
+
     /* Re-write the record if required */
 
     if (update)
@@ -1348,22 +1849,15 @@ for (; keychain && (reset_point = store_mark()); store_reset(reset_point))
         { if (!isalnum(id[i])) break; }
     if (i < MESSAGE_ID_LENGTH) continue;
 
-    Ustrncpy(buffer + path_len, id, MESSAGE_ID_LENGTH);
-    sprintf(CS(buffer + path_len + MESSAGE_ID_LENGTH), "-D");
-
-    if (Ustat(buffer, &statbuf) != 0)
+    if (!tidy_message_exists(id))
       {
-      sprintf(CS(buffer + path_len), "%c/%s-D", id[5], id);
-      if (Ustat(buffer, &statbuf) != 0)
-        {
-        dbfn_delete(dbm, key);
-        printf("deleted %s (no message)\n", key);
-        }
+      dbfn_delete(dbm, key);
+      printf("deleted %s (no message)\n", key);
       }
     }
   }
 
-dbfn_close(dbm);
+if (dbm) dbfn_close(dbm);
 printf("Tidying complete\n");
 return 0;
 }
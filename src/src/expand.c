@@ -469,7 +469,13 @@ typedef struct {
 
 static uschar * fn_recipients(void);
 typedef uschar * stringptr_fn_t(void);
+static uschar * fn_daemon_deliveries(void);
+static uschar * fn_daemon_metrics(void);
+static uschar * fn_daemon_queue_runners(void);
+static uschar * fn_daemon_smtp_connections(void);
 static uschar * fn_queue_size(void);
+static uschar * fn_smtp_phase_times(void);
+static uschar * fn_store_stats(void);
 
 /* This table must be kept in alphabetical order. */
 
@@ -521,6 +527,10 @@ static var_entry var_table[] = {
   { "config_dir",          vtype_stringptr,   &config_main_directory },
   { "config_file",         vtype_stringptr,   &config_main_filename },
   { "csa_status",          vtype_stringptr,   &csa_status },
+  { "daemon_deliveries",   vtype_string_func, &fn_daemon_deliveries },
+  { "daemon_metrics",      vtype_string_func, &fn_daemon_metrics },
+  { "daemon_queue_runners", vtype_string_func, &fn_daemon_queue_runners },
+  { "daemon_smtp_connections", vtype_string_func, &fn_daemon_smtp_connections },
 #ifdef EXPERIMENTAL_DCC
   { "dcc_header",          vtype_stringptr,   &dcc_header },
   { "dcc_result",          vtype_stringptr,   &dcc_result },
@@ -618,6 +628,7 @@ static var_entry var_table[] = {
   { "message_headers_raw", vtype_msgheaders_raw, NULL },
   { "message_id",          vtype_stringptr,   &message_id },
   { "message_linecount",   vtype_int,         &message_linecount },
+  { "message_priority",    vtype_int,         &message_priority },
   { "message_size",        vtype_int,         &message_size },
 #ifdef SUPPORT_I18N
   { "message_smtputf8",    vtype_bool,        &message_smtputf8 },
@@ -723,7 +734,10 @@ static var_entry var_table[] = {
   { "smtp_command_argument", vtype_stringptr, &smtp_cmd_argument },
   { "smtp_command_history", vtype_string_func, (void *) &smtp_cmd_hist },
   { "smtp_count_at_connection_start", vtype_int, &smtp_accept_count },
+  { "smtp_host_count_at_connection_start", vtype_int, &smtp_accept_host_count },
+  { "smtp_network_count_at_connection_start", vtype_int, &smtp_accept_network_count },
   { "smtp_notquit_reason", vtype_stringptr,   &smtp_notquit_reason },
+  { "smtp_phase_times",    vtype_string_func, &fn_smtp_phase_times },
   { "sn0",                 vtype_filter_int,  &filter_sn[0] },
   { "sn1",                 vtype_filter_int,  &filter_sn[1] },
   { "sn2",                 vtype_filter_int,  &filter_sn[2] },
@@ -764,6 +778,7 @@ static var_entry var_table[] = {
 #ifdef EXPERIMENTAL_SRS_ALT
   { "srs_status",          vtype_stringptr,   &srs_status },
 #endif
+  { "store_stats",         vtype_string_func, &fn_store_stats },
   { "thisaddress",         vtype_stringptr,   &filter_thisaddress },
 
   /* The non-(in,out) variables are now deprecated */
@@ -834,6 +849,14 @@ static var_entry var_table[] = {
 };
 
 static int var_table_size = nelem(var_table);
+
+/* Perfect hashes of the name tables, built when first searched */
+
+static tree_phash * var_phash = NULL;
+static tree_phash * item_phash = NULL;
+static tree_phash * op_underscore_phash = NULL;
+static tree_phash * op_main_phash = NULL;
+static tree_phash * cond_phash = NULL;
 static uschar var_buffer[256];
 static BOOL malformed_header;
 
@@ -909,12 +932,14 @@ static int utf8_table2[] = { 0xff, 0x1f, 0x0f, 0x07, 0x03, 0x01};
 static uschar * base32_chars = US"abcdefghijklmnopqrstuvwxyz234567";
 
 /*************************************************
-*           Binary chop search on a table        *
+*           Search a sorted name table           *
 *************************************************/
 
-/* This is used for matching expansion items and operators.
+/* This is used for matching expansion items and operators. The tables are
+sorted, and each is given a perfect hash when first searched.
 
 Arguments:
+  pp          where the table's hash is kept
   name        the name that is being sought
   table       the table to search
   table_size  the number of items in the table
@@ -923,20 +948,9 @@ Returns:      the offset in the table, or -1
 */
 
 static int
-chop_match(uschar *name, uschar **table, int table_size)
+chop_match(tree_phash ** pp, uschar *name, uschar **table, int table_size)
 {
-uschar **bot = table;
-uschar **top = table + table_size;
-
-while (top > bot)
-  {
-  uschar **mid = bot + (top - bot)/2;
-  int c = Ustrcmp(name, *mid);
-  if (c == 0) return mid - table;
-  if (c > 0) bot = mid + 1; else top = mid;
-  }
-
-return -1;
+return tree_phash_find(pp, table, table_size, sizeof(uschar *), name);
 }
 
 
@@ -1205,19 +1219,9 @@ return NULL;
 static var_entry *
 find_var_ent(uschar * name)
 {
-int first = 0;
-int last = var_table_size;
-
-while (last > first)
-  {
-  int middle = (first + last)/2;
-  int c = Ustrcmp(name, var_table[middle].name);
-
-  if (c > 0) { first = middle + 1; continue; }
-  if (c < 0) { last = middle; continue; }
-  return &var_table[middle];
-  }
-return NULL;
+int i = tree_phash_find(&var_phash, var_table, var_table_size,
+		      sizeof(var_entry), name);
+return i >= 0 ? &var_table[i] : NULL;
 }
 
 /*************************************************
@@ -1600,8 +1604,10 @@ BOOL found = !name;
 int len = name ? Ustrlen(name) : 0;
 BOOL comma = FALSE;
 gstring * g = NULL;
+header_line ** hv = len > 0 && name[len-1] == ':'
+  ? header_index_find(name, len) : NULL;
 
-for (header_line * h = header_list; h; h = h->next)
+for (header_line * h = hv ? *hv : header_list; h; h = hv ? *++hv : h->next)
   if (h->type != htype_old && h->text)  /* NULL => Received: placeholder */
     if (!name || (len <= h->slen && strncmpic(name, h->text, len) == 0))
       {
@@ -1753,83 +1759,111 @@ return g ? g->s : NULL;
 static uschar *
 fn_queue_size(void)
 {
-struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
 uschar buf[16];
-int fd;
-ssize_t len;
-const uschar * where;
-#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-uschar * sname;
-#endif
-fd_set fds;
-struct timeval tv;
+int len;
 
-if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+buf[0] = NOTIFY_QUEUE_SIZE_REQ;
+if ((len = queue_daemon_request(buf, 1, -1, buf, sizeof(buf), 2)) < 0)
   {
-  DEBUG(D_expand) debug_printf(" socket: %s\n", strerror(errno));
-  return NULL;
+  DEBUG(D_expand) debug_printf("no daemon response; using local evaluation\n");
+  len = snprintf(CS buf, sizeof(buf), "%u", queue_count_cached());
   }
+return string_copyn(buf, len);
+}
 
-#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-sa_un.sun_path[0] = 0;	/* Abstract local socket addr - Linux-specific? */
-len = offsetof(struct sockaddr_un, sun_path) + 1
-  + snprintf(sa_un.sun_path+1, sizeof(sa_un.sun_path)-1, "exim_%d", getpid());
-#else
-sname = string_sprintf("%s/p_%d", spool_directory, getpid());
-len = offsetof(struct sockaddr_un, sun_path)
-  + snprintf(sa_un.sun_path, sizeof(sa_un.sun_path), "%s", sname);
-#endif
 
-if (bind(fd, (const struct sockaddr *)&sa_un, len) < 0)
-  { where = US"bind"; goto bad; }
+/*************************************************
+*         Return daemon activity counts          *
+*************************************************/
+/* These are read from memory shared with the daemon, so they are current
+without asking it. Outside a daemon they are -1. */
+
+static uschar *
+fn_daemon_deliveries(void)
+{
+return string_sprintf("%d", daemon_count(DCOUNT_DELIVERIES));
+}
 
-#ifdef notdef
-debug_printf("local addr '%s%s'\n",
-  *sa_un.sun_path ? "" : "@",
-  sa_un.sun_path + (*sa_un.sun_path ? 0 : 1));
-#endif
+static uschar *
+fn_daemon_queue_runners(void)
+{
+return string_sprintf("%d", daemon_count(DCOUNT_QUEUE_RUNNERS));
+}
 
-#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-sa_un.sun_path[0] = 0;	/* Abstract local socket addr - Linux-specific? */
-len = offsetof(struct sockaddr_un, sun_path) + 1
-  + snprintf(sa_un.sun_path+1, sizeof(sa_un.sun_path)-1, "%s",
-	      expand_string(notifier_socket));
-#else
-len = offsetof(struct sockaddr_un, sun_path)
-  + snprintf(sa_un.sun_path, sizeof(sa_un.sun_path), "%s",
-	      expand_string(notifier_socket));
-#endif
+static uschar *
+fn_daemon_smtp_connections(void)
+{
+return string_sprintf("%d", daemon_count(DCOUNT_SMTP));
+}
 
-if (connect(fd, (const struct sockaddr *)&sa_un, len) < 0)
-  { where = US"connect"; goto bad2; }
 
-buf[0] = NOTIFY_QUEUE_SIZE_REQ;
-if (send(fd, buf, 1, 0) < 0) { where = US"send"; goto bad; }
+/*************************************************
+*           Return daemon metrics                *
+*************************************************/
+/* Ask the daemon for the state of its connections, queue runners, deliveries
+and listeners. Without a daemon the result is empty. */
 
-FD_ZERO(&fds); FD_SET(fd, &fds);
-tv.tv_sec = 2; tv.tv_usec = 0;
-if (select(fd + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, &tv) != 1)
+static uschar *
+fn_daemon_metrics(void)
+{
+int size = 65536;
+uschar * buf = store_get(size, FALSE);
+int len;
+
+buf[0] = NOTIFY_METRICS_REQ;
+if ((len = queue_daemon_request(buf, 1, -1, buf, size-1, 2)) < 0)
   {
-  DEBUG(D_expand) debug_printf("no daemon response; using local evaluation\n");
-  len = snprintf(CS buf, sizeof(buf), "%u", queue_count_cached());
+  DEBUG(D_expand) debug_printf("no daemon response for metrics\n");
+  return US"";
   }
-else if ((len = recv(fd, buf, sizeof(buf), 0)) < 0)
-  { where = US"recv"; goto bad2; }
+buf[len] = '\0';
+return buf;
+}
 
-close(fd);
-#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-Uunlink(sname);
-#endif
-return string_copyn(buf, len);
 
-bad2:
-#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-  Uunlink(sname);
-#endif
-bad:
-  close(fd);
-  DEBUG(D_expand) debug_printf(" %s: %s\n", where, strerror(errno));
-  return NULL;
+/*************************************************
+*           Return SMTP phase latencies          *
+*************************************************/
+/* Ask the daemon for the histograms of the times taken by the phases of SMTP
+sessions. The answer can be large. */
+
+static uschar *
+fn_smtp_phase_times(void)
+{
+int size = 65536;
+uschar * buf = store_get(size, FALSE);
+int len;
+
+buf[0] = NOTIFY_SMTP_PHASES_REQ;
+if ((len = queue_daemon_request(buf, 1, -1, buf, size-1, 2)) < 0)
+  {
+  DEBUG(D_expand) debug_printf("no daemon response for smtp phase times\n");
+  return US"";
+  }
+buf[len] = '\0';
+return buf;
+}
+
+
+/*************************************************
+*               Return store usage               *
+*************************************************/
+/* Ask the daemon for the store usage reported by its children; without a
+daemon, give the figures for this process */
+
+static uschar *
+fn_store_stats(void)
+{
+uschar buf[512];
+int len;
+
+buf[0] = NOTIFY_STORE_STATS_REQ;
+if ((len = queue_daemon_request(buf, 1, -1, buf, sizeof(buf), 2)) < 0)
+  {
+  DEBUG(D_expand) debug_printf("no daemon response; using local evaluation\n");
+  return string_from_gstring(store_stats_string(NULL));
+  }
+return string_copyn(buf, len);
 }
 
 
@@ -2390,7 +2424,7 @@ if (!name[0])
 if (opname)
   *opname = string_copy(name);
 
-return chop_match(name, cond_table, nelem(cond_table));
+return chop_match(&cond_phash, name, cond_table, nelem(cond_table));
 }
 
 
@@ -2975,8 +3009,7 @@ switch(cond_type = identify_operator(&s, &opname))
     break;
 
     case ECOND_MATCH:   /* Regular expression match */
-    if (!(re = pcre_compile(CS sub[1], PCRE_COPT, CCSS &rerror,
-			    &roffset, NULL)))
+    if (!(re = regex_compile(sub[1], PCRE_COPT, &rerror, &roffset)))
       {
       expand_string_message = string_sprintf("regular expression error in "
         "\"%s\": %s at offset %d", sub[1], rerror, roffset);
@@ -3982,6 +4015,367 @@ return yield;
 #endif
 
 
+
+/*************************************************
+*          Cache of files for readfile           *
+*************************************************/
+
+/* When readfile_cache_size is set, the contents of files read by ${readfile}
+are kept against their path, until their total reaches that size; files met
+after that are read every time. An entry is used only while the file's device,
+inode, size and modification and change times are as they were when it was
+read. A file changed within the last second is not cached, since a further
+change in the same second would not be seen. The text is malloc'd, so that of
+a changed file can be freed. A daemon caches the files named in
+readfile_preload at startup, for the processes it forks to inherit. */
+
+typedef struct {
+  dev_t		dev;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+  time_t	ctime;
+  uschar *	text;		/* NULL if dropped */
+} readfile_cached;
+
+static tree_node * readfile_cache = NULL;
+static off_t readfile_cached_bytes = 0;
+
+
+/* Get the cache entry for a file, reading the file if it is not cached or
+has changed and there is room.
+
+Arguments:
+  path		the file
+
+Returns:	the entry, or NULL if the file is not cached
+*/
+
+static readfile_cached *
+readfile_cache_get(const uschar * path)
+{
+struct stat st0, st;
+readfile_cached * c = NULL;
+tree_node * t;
+uschar * text;
+int fd, old_pool;
+ssize_t len = 0;
+
+if (Ustat(path, &st) < 0 || !S_ISREG(st.st_mode))
+  return NULL;
+if ((t = tree_search(readfile_cache, path)) && (c = t->data.ptr)->text)
+  {
+  if (  c->dev == st.st_dev && c->ino == st.st_ino && c->size == st.st_size
+     && c->mtime == st.st_mtime && c->ctime == st.st_ctime)
+    return c;
+  DEBUG(D_expand) debug_printf_indent("readfile cache: %s changed\n", path);
+  readfile_cached_bytes -= c->size;
+  store_free(c->text);
+  c->text = NULL;
+  }
+
+if (  readfile_cached_bytes + st.st_size > readfile_cache_size
+   || st.st_mtime >= time(NULL) - 1 || st.st_ctime >= time(NULL) - 1
+   || (fd = Uopen(path, O_RDONLY, 0)) < 0)
+  return NULL;
+
+/* The file read must be the one that was checked, all of it */
+
+st0 = st;
+text = store_malloc(st.st_size + 1);
+if (fstat(fd, &st) == 0 && st.st_ino == st0.st_ino && st.st_dev == st0.st_dev)
+  for (ssize_t n; len < st.st_size; len += n)
+    if ((n = read(fd, text + len, st.st_size - len)) <= 0) break;
+(void) close(fd);
+if (  len != st0.st_size || st.st_size != st0.st_size
+   || st.st_mtime != st0.st_mtime || memchr(text, 0, len))
+  {
+  store_free(text);
+  return NULL;
+  }
+text[len] = '\0';
+
+if (!t)
+  {
+  old_pool = store_pool;
+  store_pool = POOL_PERM;
+  t = store_get(sizeof(tree_node) + Ustrlen(path), is_tainted(path));
+  Ustrcpy(t->name, path);
+  t->data.ptr = store_get(sizeof(readfile_cached), FALSE);
+  (void) tree_insertnode(&readfile_cache, t);
+  store_pool = old_pool;
+  }
+c = t->data.ptr;
+c->dev = st.st_dev;
+c->ino = st.st_ino;
+c->size = st.st_size;
+c->mtime = st.st_mtime;
+c->ctime = st.st_ctime;
+c->text = text;
+readfile_cached_bytes += len;
+DEBUG(D_expand) debug_printf_indent("readfile cache: added %s\n", path);
+return c;
+}
+
+
+/* Join cached file text onto the output string, replacing newlines as
+cat_file() does */
+
+static gstring *
+cat_cached_file(readfile_cached * c, gstring * yield, uschar * eol)
+{
+const uschar * s = c->text, * end = s + c->size, * nl;
+
+if (!eol)
+  yield = string_catn(yield, s, c->size);
+else for ( ; s < end; s = nl + 1)
+  {
+  if (!(nl = memchr(s, '\n', end - s)))
+    {
+    yield = string_catn(yield, s, end - s);
+    break;
+    }
+  yield = string_catn(yield, s, nl - s);
+  yield = string_cat(yield, eol);
+  }
+
+(void) string_from_gstring(yield);
+return yield;
+}
+
+
+/* Called by the daemon: cache the files named in readfile_preload */
+
+void
+expand_readfile_preload(void)
+{
+const uschar * list = readfile_preload;
+uschar * path;
+int sep = 0;
+
+if (readfile_cache_size <= 0) return;
+while ((path = string_nextinlist(&list, &sep, NULL, 0)))
+  if (*path != '/')
+    log_write(0, LOG_MAIN|LOG_PANIC,
+      "readfile_preload: '%s' is not an absolute path", path);
+  else if (readfile_cache_get(path))
+    DEBUG(D_expand) debug_printf("readfile: preloaded %s\n", path);
+  else
+    DEBUG(D_expand) debug_printf("readfile: %s not preloaded\n", path);
+}
+
+
+
+/*************************************************
+*          Coprocesses for ${run}                *
+*************************************************/
+
+/* A command named in run_coprocesses is not run afresh for each ${run}. The
+first use in a process starts it with no arguments, and then it is sent one
+request per expansion on its standard input and replies on its standard
+output. Both are netstrings ("<length>:<bytes>,"). The request holds a
+netstring for each argument after the command name; the reply holds the return
+code in decimal, a space, and the output. The helper is restarted if it has
+gone away, and killed if it does not reply in time. It is not shared with
+forked processes, which start their own when they need one. */
+
+typedef struct coproc {
+  struct coproc *	next;
+  uschar *		command;	/* malloc'd */
+  pid_t			pid;		/* 0 when not running */
+  pid_t			owner;		/* process that started it */
+  int			fd_in;		/* its standard input */
+  int			fd_out;		/* its standard output */
+} coproc;
+
+static coproc * coprocs = NULL;
+
+
+/* Find the coprocess entry for a command, if it is to be run as one. One
+inherited from a parent process is disowned.
+
+Arguments:   the command name
+Returns:     the entry, or NULL if the command is not a coprocess
+*/
+
+static coproc *
+coproc_find(const uschar * command)
+{
+const uschar * list = run_coprocesses;
+uschar * name;
+coproc * c;
+int sep = 0;
+
+while ((name = string_nextinlist(&list, &sep, NULL, 0)))
+  if (Ustrcmp(name, command) == 0) break;
+if (!name) return NULL;
+
+for (c = coprocs; c; c = c->next)
+  if (Ustrcmp(c->command, command) == 0) break;
+if (!c)
+  {
+  c = store_malloc(sizeof(coproc));
+  c->command = string_copy_malloc(command);
+  c->pid = 0;
+  c->next = coprocs;
+  coprocs = c;
+  }
+else if (c->pid > 0 && c->owner != getpid())
+  {
+  (void) close(c->fd_in);
+  (void) close(c->fd_out);
+  c->pid = 0;
+  }
+return c;
+}
+
+
+/* Stop a coprocess, killing it unless it has already gone */
+
+static void
+coproc_stop(coproc * c, BOOL kill)
+{
+(void) close(c->fd_in);
+(void) close(c->fd_out);
+if (kill) killpg(c->pid, SIGKILL);
+(void) waitpid(c->pid, NULL, 0);
+c->pid = 0;
+}
+
+
+/* Read a netstring's length, given the file descriptor. Returns the length,
+or -1 on failure, -2 on timeout. */
+
+static int
+coproc_read_len(int fd)
+{
+int len = 0, ndigits = 0;
+uschar ch;
+
+for (;;)
+  {
+  int rc = read(fd, &ch, 1);
+  if (rc < 0 && errno == EINTR && !sigalrm_seen) continue;
+  if (rc <= 0) return sigalrm_seen ? -2 : -1;
+  if (ch == ':') return ndigits > 0 ? len : -1;
+  if (!isdigit(ch) || ++ndigits > 9) return -1;
+  len = len * 10 + ch - '0';
+  }
+}
+
+
+/* Send a ${run} request to a coprocess and get its reply. A helper that has
+died since the last request is restarted, once.
+
+Arguments:
+  c		the coprocess entry
+  argv		the arguments from the ${run}, starting with the command
+  output	where to put the output, in the current pool
+  errmsg	where to put an error message
+
+Returns:	the helper's return code; -1 on failure, -2 on timeout
+*/
+
+static int
+coproc_run(coproc * c, const uschar ** argv, uschar ** output, uschar ** errmsg)
+{
+gstring * req = NULL, * msg;
+int rc = -1;
+
+for (int i = 1; argv[i]; i++)
+  req = string_fmt_append(req, "%d:%s,", (int)Ustrlen(argv[i]), argv[i]);
+msg = string_fmt_append(NULL, "%d:", req ? req->ptr : 0);
+if (req) msg = string_catn(msg, req->s, req->ptr);
+msg = string_catn(msg, US",", 1);
+
+for (int attempt = 0; attempt < 2; attempt++)
+  {
+  const uschar * p = msg->s;
+  int left = msg->ptr, len;
+  uschar * reply, * q;
+
+  if (c->pid == 0)
+    {
+    const uschar * cargv[2] = { c->command, NULL };
+
+    if ((c->pid = child_open(USS cargv, NULL, 0077, &c->fd_in, &c->fd_out,
+			    TRUE, US"expand-run-coprocess")) < 0)
+      {
+      c->pid = 0;
+      *errmsg = string_sprintf("couldn't create coprocess: %s",
+	strerror(errno));
+      return -1;
+      }
+    (void) fcntl(c->fd_in, F_SETFD, FD_CLOEXEC);
+    (void) fcntl(c->fd_out, F_SETFD, FD_CLOEXEC);
+    c->owner = getpid();
+    DEBUG(D_expand) debug_printf_indent("started coprocess %s, pid %d\n",
+      c->command, (int)c->pid);
+    }
+
+  sigalrm_seen = FALSE;
+  ALARM(run_coprocess_timeout);
+
+  while (left > 0)
+    {
+    int n = write(c->fd_in, p, left);
+    if (n < 0 && errno == EINTR && !sigalrm_seen) continue;
+    if (n <= 0) break;
+    p += n;
+    left -= n;
+    }
+
+  /* A helper that went away before replying gets another chance */
+
+  if ((len = left > 0 ? -1 : coproc_read_len(c->fd_out)) < 0)
+    {
+    ALARM_CLR(0);
+    coproc_stop(c, TRUE);
+    if (sigalrm_seen) break;
+    DEBUG(D_expand) debug_printf_indent("coprocess %s failed\n", c->command);
+    *errmsg = US"coprocess failed";
+    continue;
+    }
+
+  reply = store_get(len + 2, FALSE);
+  for (q = reply; q < reply + len + 1; )
+    {
+    int n = read(c->fd_out, q, reply + len + 1 - q);
+    if (n < 0 && errno == EINTR && !sigalrm_seen) continue;
+    if (n <= 0) break;
+    q += n;
+    }
+  ALARM_CLR(0);
+
+  if (q < reply + len + 1 || reply[len] != ',')
+    {
+    coproc_stop(c, TRUE);
+    *errmsg = sigalrm_seen ? US"command timed out"
+      : US"malformed reply from coprocess";
+    return sigalrm_seen ? -2 : -1;
+    }
+  reply[len] = '\0';
+
+  rc = Ustrtol(reply, &q, 10);
+  if (q == reply || rc < 0 || (*q != ' ' && *q != '\0'))
+    {
+    *errmsg = US"malformed reply from coprocess";
+    return -1;
+    }
+  *output = *q ? q + 1 : q;
+  return rc;
+  }
+
+if (sigalrm_seen)
+  {
+  if (c->pid) coproc_stop(c, TRUE);
+  *errmsg = US"command timed out";
+  return -2;
+  }
+return -1;
+}
+
+
 /*************************************************
 *          Evaluate numeric expression           *
 *************************************************/
@@ -4585,7 +4979,7 @@ while (*s)
   OK. */
 
   s = read_name(name, sizeof(name), s, US"_-");
-  item_type = chop_match(name, item_table, nelem(item_table));
+  item_type = chop_match(&item_phash, name, item_table, nelem(item_table));
 
   switch(item_type)
     {
@@ -4780,6 +5174,7 @@ while (*s)
       int stype, partial, affixlen, starflags;
       int expand_setup = 0;
       int nameptr = 0;
+      BOOL batch = FALSE;
       uschar *key, *filename;
       const uschar * affix, * opts;
       uschar *save_lookup_value = lookup_value;
@@ -4838,6 +5233,28 @@ while (*s)
         goto EXPAND_FAILED;
         }
 
+      /* The "batch" option asks for a list of keys to be looked up at once; it
+      is not passed on to the lookup. */
+
+      if (opts)
+	{
+	const uschar * list = opts;
+	int sep = ',';
+	gstring * g = NULL;
+
+	for (uschar * ele; ele = string_nextinlist(&list, &sep, NULL, 0); )
+	  if (Ustrcmp(ele, "batch") == 0) batch = TRUE;
+	  else g = string_append_listele(g, ',', ele);
+	opts = string_from_gstring(g);
+
+	if (batch && (partial >= 0 || starflags))
+	  {
+	  expand_string_message = US"partial and default matching cannot be "
+	    "used in a batch lookup";
+	  goto EXPAND_FAILED;
+	  }
+	}
+
       /* Check that a key was provided for those lookup types that need it,
       and was not supplied for those that use the query style. */
 
@@ -4910,8 +5327,39 @@ while (*s)
           expand_string_message = search_error_message;
           goto EXPAND_FAILED;
           }
-        lookup_value = search_find(handle, filename, key, partial, affix,
-          affixlen, starflags, &expand_setup, opts);
+	if (batch)
+	  {
+	  /* Each item in the list of keys is looked up, and the results are
+	  returned as a list with the same separator, empty for a key that was
+	  not found. The lookup succeeds if anything was found. */
+
+	  const uschar * list = key;
+	  const uschar ** keys;
+	  uschar ** results;
+	  gstring * g = NULL;
+	  int sep = 0, count = 0;
+	  BOOL found = FALSE;
+
+	  while (string_nextinlist(&list, &sep, NULL, 0)) count++;
+	  keys = store_get((count + 1) * sizeof(uschar *), FALSE);
+	  results = store_get((count + 1) * sizeof(uschar *), FALSE);
+	  list = key;
+	  sep = 0;
+	  for (int i = 0; i < count; i++)
+	    keys[i] = string_nextinlist(&list, &sep, NULL, 0);
+
+	  if (search_find_batch(handle, filename, keys, count, results, opts)
+	      == OK)
+	    for (int i = 0; i < count; i++)
+	      {
+	      if (results[i]) found = TRUE;
+	      g = string_append_listele(g, sep, results[i] ? results[i] : US" ");
+	      }
+	  lookup_value = found ? string_from_gstring(g) : NULL;
+	  }
+	else
+	  lookup_value = search_find(handle, filename, key, partial, affix,
+	    affixlen, starflags, &expand_setup, opts);
         if (f.search_find_defer)
           {
           expand_string_message =
@@ -5257,7 +5705,17 @@ while (*s)
 
       if (skipping) continue;
 
-      /* Open the file and read it */
+      /* Use a cached copy if there is one, else open the file and read it */
+
+      if (readfile_cache_size > 0)
+	{
+	readfile_cached * c = readfile_cache_get(sub_arg[0]);
+	if (c)
+	  {
+	  yield = cat_cached_file(c, yield, sub_arg[1]);
+	  continue;
+	  }
+	}
 
       if (!(f = Ufopen(sub_arg[0], "rb")))
         {
@@ -5421,6 +5879,7 @@ while (*s)
       const uschar **argv;
       pid_t pid;
       int fd_in, fd_out;
+      coproc * cp;
 
       if ((expand_forbid & RDO_RUN) != 0)
         {
@@ -5459,6 +5918,19 @@ while (*s)
             &expand_string_message))            /* where to put error message */
           goto EXPAND_FAILED;
 
+        /* A command listed in run_coprocesses is handed to its helper */
+
+        if (run_coprocesses && (cp = coproc_find(argv[0])))
+          {
+          uschar * out;
+
+	  resetok = FALSE;
+          if ((runrc = coproc_run(cp, argv, &out, &expand_string_message)) < 0)
+            goto EXPAND_FAILED;
+          lookup_value = out;
+          goto RUN_DONE;
+          }
+
         /* Create the child process, making it a group leader. */
 
         if ((pid = child_open(USS argv, NULL, 0077, &fd_in, &fd_out, TRUE,
@@ -5510,6 +5982,7 @@ while (*s)
           }
         }
 
+    RUN_DONE:
       /* Process the yes/no strings; $value may be useful in both cases */
 
       switch(process_yesno(
@@ -5757,8 +6230,7 @@ while (*s)
 
       /* Compile the regular expression */
 
-      if (!(re = pcre_compile(CS sub[1], PCRE_COPT, CCSS &rerror,
-			      &roffset, NULL)))
+      if (!(re = regex_compile(sub[1], PCRE_COPT, &rerror, &roffset)))
         {
         expand_string_message = string_sprintf("regular expression error in "
           "\"%s\": %s at offset %d", sub[1], rerror, roffset);
@@ -5818,6 +6290,12 @@ while (*s)
 	  goto EXPAND_FAILED;
         yield = string_cat(yield, insert);
 
+	/* The expansion may have compiled other patterns and so discarded
+	this one from the cache; get it again. */
+
+	if (regex_cache_size > 0)
+	  re = regex_compile(sub[1], PCRE_COPT, &rerror, &roffset);
+
         moffset = ovector[1];
         moffsetextra = 0;
         emptyopt = 0;
@@ -6886,12 +7364,13 @@ while (*s)
     table of names that contain underscores. If there is no match, we cut off
     the arguments and then scan the main table. */
 
-    if ((c = chop_match(name, op_table_underscore,
+    if ((c = chop_match(&op_underscore_phash, name, op_table_underscore,
 			nelem(op_table_underscore))) < 0)
       {
       if ((arg = Ustrchr(name, '_')))
 	*arg = 0;
-      if ((c = chop_match(name, op_table_main, nelem(op_table_main))) >= 0)
+      if ((c = chop_match(&op_main_phash, name, op_table_main,
+			  nelem(op_table_main))) >= 0)
 	c += nelem(op_table_underscore);
       if (arg) *arg++ = '_';		/* Put back for error messages */
       }
@@ -8235,6 +8714,259 @@ return NULL;
 }
 
 
+/*************************************************
+*         Cache of compiled expansions           *
+*************************************************/
+
+/* Most of the strings that are expanded repeatedly are configuration options,
+and many of those contain nothing more than literal text and references to
+variables. Such a string is compiled, the second time it is seen at the same
+address, into a list of literal and variable items, which can then be
+evaluated without re-parsing. Strings that use anything else (expansion items,
+operators, conditions, header references, backslashes) are noted as needing
+the full interpreter.
+
+The cache is direct-mapped on the string's address. As strings in reset store
+may later have different content at the same address, each entry keeps a copy
+of its string, which is checked on every hit. Entries are in malloc store so
+that they can be freed when their slot is reused. */
+
+#define EXPAND_CACHE_SIZE	512	/* Must be a power of two */
+
+enum { ECI_LITERAL, ECI_VARIABLE, ECI_NUMBER };
+
+typedef struct {
+  int		type;
+  int		len;		/* For literal, its length; for number, the n */
+  const uschar * data;		/* Literal text, or variable name */
+} expand_citem;
+
+typedef struct {
+  const uschar * key;		/* The address of the string */
+  uschar *	copy;		/* and a copy of its content */
+  int		count;		/* Number of items; -1 if not compilable */
+  expand_citem	items[1];
+} expand_centry;
+
+static struct {
+  expand_centry * entry;
+  const uschar *  seen;		/* Address seen once, not yet compiled */
+} expand_cache[EXPAND_CACHE_SIZE];
+
+static unsigned expand_cache_lookups = 0, expand_cache_hits = 0;
+
+
+/* Compile a string, if it consists only of literal text and variables.
+
+Argument:  the string, which has no backslashes
+Returns:   a new cache entry, in malloc store
+*/
+
+static expand_centry *
+expand_compile(const uschar * string)
+{
+int len = Ustrlen(string), count = 0, nlen = 0;
+expand_centry * e;
+uschar * names;
+const uschar * s;
+
+/* First pass: check that all is simple, and count the items and the space
+needed for the variable names. */
+
+for (s = string; *s; )
+  {
+  uschar name[256];
+
+  if (*s != '$')
+    {
+    while (*s && *s != '$') s++;
+    count++;
+    continue;
+    }
+  s++;
+  if (isalpha(*s))
+    {
+    const uschar * t;
+
+    s = read_name(name, sizeof(name), s, US"_");
+    if (Ustrlen(name) >= sizeof(name) - 1) goto DYNAMIC;
+
+    /* Header references have their own syntax; leave them to the
+    interpreter. */
+
+    if (  ( *(t = name) == 'h'
+	  || (*t == 'r' || *t == 'l' || *t == 'b') && *++t == 'h'
+	  )
+       && (*++t == '_' || Ustrncmp(t, "eader_", 6) == 0)
+       )
+      goto DYNAMIC;
+    nlen += Ustrlen(name) + 1;
+    }
+  else if (isdigit(*s))
+    {
+    int n;
+    s = read_cnumber(&n, s);
+    }
+  else if (*s == '{' && isalpha(s[1]))
+    {
+    s = read_name(name, sizeof(name), s+1, US"_-");
+    if (  *s++ != '}'
+       || Ustrlen(name) >= sizeof(name) - 1
+       || chop_match(&item_phash, name, item_table, nelem(item_table)) >= 0
+       )
+      goto DYNAMIC;
+    nlen += Ustrlen(name) + 1;
+    }
+  else if (*s == '{' && isdigit(s[1]))
+    {
+    int n;
+    if (*(s = read_cnumber(&n, s+1)) != '}') goto DYNAMIC;
+    s++;
+    }
+  else
+    goto DYNAMIC;
+  count++;
+  }
+
+/* Second pass: build the items. Literal items point into the copy of the
+string; names go after the items. */
+
+e = store_malloc(sizeof(expand_centry) + count * sizeof(expand_citem)
+		+ nlen + len + 1);
+e->count = count;
+names = US (e->items + count);
+e->copy = names + nlen;
+memcpy(e->copy, string, len + 1);
+
+count = 0;
+for (s = e->copy; *s; count++)
+  {
+  expand_citem * ip = e->items + count;
+  BOOL braced;
+
+  if (*s != '$')
+    {
+    ip->type = ECI_LITERAL;
+    ip->data = s;
+    while (*s && *s != '$') s++;
+    ip->len = s - ip->data;
+    continue;
+    }
+
+  if ((braced = *++s == '{')) s++;
+  if (isdigit(*s))
+    {
+    ip->type = ECI_NUMBER;
+    s = read_cnumber(&ip->len, s);
+    }
+  else
+    {
+    ip->type = ECI_VARIABLE;
+    s = read_name(names, 256, s, braced ? US"_-" : US"_");
+    ip->data = names;
+    ip->len = braced;
+    names += Ustrlen(names) + 1;
+    }
+  if (braced) s++;
+  }
+return e;
+
+DYNAMIC:
+  e = store_malloc(sizeof(expand_centry) + len + 1);
+  e->count = -1;
+  e->copy = US (e + 1);
+  memcpy(e->copy, string, len + 1);
+  return e;
+}
+
+
+/* Evaluate a compiled expansion. If a variable is unknown, give up, so that
+the interpreter can produce the error.
+
+Argument:  the cache entry
+Returns:   the expansion, or NULL
+*/
+
+static uschar *
+expand_evaluate(const expand_centry * e)
+{
+rmark reset_point = store_mark();
+gstring * g = string_get(Ustrlen(e->copy) + 64);
+
+for (const expand_citem * ip = e->items; ip < e->items + e->count; ip++)
+  switch (ip->type)
+    {
+    case ECI_LITERAL:
+      g = string_catn(g, ip->data, ip->len);
+      break;
+
+    case ECI_NUMBER:
+      if (ip->len >= 0 && ip->len <= expand_nmax)
+	g = string_catn(g, expand_nstring[ip->len], expand_nlength[ip->len]);
+      break;
+
+    case ECI_VARIABLE:
+      {
+      int newsize = 0;
+      uschar * value = find_variable(US ip->data, FALSE, FALSE, &newsize);
+
+      if (!value)
+	{
+	store_reset(reset_point);
+	return NULL;
+	}
+
+      /* A value that is alone and in new store needs no copy */
+
+      if (e->count == 1 && newsize)
+	return value;
+      g = string_cat(g, value);
+      break;
+      }
+    }
+
+gstring_release_unused(g);
+return string_from_gstring(g);
+}
+
+
+/* Look for a string in the cache, adding it if this is the second time it has
+been seen at this address.
+
+Argument:  the string, untainted and without backslashes
+Returns:   the cache entry if the string is compiled, else NULL
+*/
+
+static const expand_centry *
+expand_cache_find(const uschar * string)
+{
+unsigned slot = ((unsigned long)string >> 3) & (EXPAND_CACHE_SIZE - 1);
+expand_centry * e = expand_cache[slot].entry;
+
+expand_cache_lookups++;
+if (e && e->key == string && Ustrcmp(e->copy, string) == 0)
+  {
+  if (e->count < 0) return NULL;
+  expand_cache_hits++;
+  return e;
+  }
+
+if (expand_cache[slot].seen != string)
+  {
+  expand_cache[slot].seen = string;
+  return NULL;
+  }
+
+if (e) store_free(e);
+e = expand_cache[slot].entry = expand_compile(string);
+e->key = string;
+expand_cache[slot].seen = NULL;
+return e->count < 0 ? NULL : e;
+}
+
+
+
+
 /* This is the external function call. Do a quick check for any expansion
 metacharacters, and if there are none, just return the input string.
 
@@ -8249,13 +8981,45 @@ expand_cstring(const uschar * string)
 if (Ustrpbrk(string, "$\\") != NULL)
   {
   int old_pool = store_pool;
-  uschar * s;
+  const expand_centry * e;
+  uschar * s = NULL;
+  struct timeval prof_start;
 
+  if (profiling && (transport_name || router_name))
+    gettimeofday(&prof_start, NULL);
   f.search_find_defer = FALSE;
   malformed_header = FALSE;
   store_pool = POOL_MAIN;
+
+  if (  !Ustrchr(string, '\\') && !is_tainted(string)
+     && (e = expand_cache_find(string))
+     && (s = expand_evaluate(e))
+     )
+    {
+    f.expand_string_forcedfail = FALSE;
+    expand_string_message = US"";
+    DEBUG(D_expand)
+      {
+      debug_printf_indent("compiled expansion (%u/%u cache hits): %s\n",
+	expand_cache_hits, expand_cache_lookups, string);
+      debug_printf_indent("  result: %s\n", s);
+      }
+    }
+  else
     s = expand_string_internal(string, FALSE, NULL, FALSE, TRUE, NULL);
   store_pool = old_pool;
+
+  /* Expansions done by routers and transports are profiled by driver. A
+  transport name is set for the whole of a transport subprocess. */
+
+  if (profiling && (transport_name || router_name))
+    {
+    uschar buf[96];
+    (void) string_format(buf, sizeof(buf), "expand %s %s",
+      transport_name ? "transport" : "router",
+      transport_name ? transport_name : router_name);
+    profile_count(buf, &prof_start);
+    }
   return s;
   }
 return string;
@@ -8572,9 +9336,9 @@ for (var_entry * v = var_table; v < var_table + var_table_size; v++)
 
 /* check dns and address trees */
 tree_walk(tree_dns_fails,     assert_variable_notin, &e);
-tree_walk(tree_duplicates,    assert_variable_notin, &e);
-tree_walk(tree_nonrecipients, assert_variable_notin, &e);
-tree_walk(tree_unusable,      assert_variable_notin, &e);
+tree_hash_walk(&tree_duplicates,    assert_variable_notin, &e);
+tree_hash_walk(&tree_nonrecipients, assert_variable_notin, &e);
+tree_hash_walk(&tree_unusable,      assert_variable_notin, &e);
 
 if (e.var_name)
   log_write(0, LOG_MAIN|LOG_PANIC_DIE,
@@ -1596,9 +1596,9 @@ switch (c->type)
       debug_printf_indent("  Pattern = %s\n", exp[1]);
       }
 
-    if (!(re = pcre_compile(CS exp[1],
+    if (!(re = regex_compile(exp[1],
       PCRE_COPT | ((c->type == cond_matches)? PCRE_CASELESS : 0),
-      CCSS &regcomp_error, &regcomp_error_offset, NULL)))
+      &regcomp_error, &regcomp_error_offset)))
       {
       *error_pointer = string_sprintf("error while compiling "
         "regular expression \"%s\": %s at offset %d",
@@ -1895,7 +1895,7 @@ while (commands)
 	  int ecount = expand_nmax >= 0 ? expand_nmax : -1;
 	  uschar **ss = store_get(sizeof(uschar *) * (ecount + 3), FALSE);
 
-	  addr->pipe_expandn = ss;
+	  addr_cold(addr)->pipe_expandn = ss;
 	  if (!filter_thisaddress) filter_thisaddress = US"";
 	  *ss++ = string_copy(filter_thisaddress);
 	  for (int i = 0; i <= expand_nmax; i++)
@@ -2213,6 +2213,7 @@ while (commands)
 	  uschar *tt;
 	  uschar *to = commands->args[mailarg_index_to].u;
 	  gstring * log_addr = NULL;
+	  reply_item * reply;
 
 	  if (!to) to = expand_string(US"$reply_address");
 	  while (isspace(*to)) to++;
@@ -2296,22 +2297,22 @@ while (commands)
 	  addr->next = *generated;
 	  *generated = addr;
 
-	  addr->reply = store_get(sizeof(reply_item), FALSE);
-	  addr->reply->from = NULL;
-	  addr->reply->to = string_copy(to);
-	  addr->reply->file_expand =
+	  reply = addr_cold(addr)->reply = store_get(sizeof(reply_item), FALSE);
+	  reply->from = NULL;
+	  reply->to = string_copy(to);
+	  reply->file_expand =
 	    commands->args[mailarg_index_expand].u != NULL;
-	  addr->reply->expand_forbid = expand_forbid;
-	  addr->reply->return_message =
+	  reply->expand_forbid = expand_forbid;
+	  reply->return_message =
 	    commands->args[mailarg_index_return].u != NULL;
-	  addr->reply->once_repeat = 0;
+	  reply->once_repeat = 0;
 
 	  if (commands->args[mailarg_index_once_repeat].u != NULL)
 	    {
-	    addr->reply->once_repeat =
+	    reply->once_repeat =
 	      readconf_readtime(commands->args[mailarg_index_once_repeat].u, 0,
 		FALSE);
-	    if (addr->reply->once_repeat < 0)
+	    if (reply->once_repeat < 0)
 	      {
 	      *error_pointer = string_sprintf("Bad time value for \"once_repeat\" "
 		"in mail or vacation command: %s",
@@ -2325,7 +2326,7 @@ while (commands)
 	  for (i = 1; i < mailargs_string_passed; i++)
 	    {
 	    uschar *ss = commands->args[i].u;
-	    *(USS((US addr->reply) + reply_offsets[i])) =
+	    *(USS((US reply) + reply_offsets[i])) =
 	      ss ? string_copy(ss) : NULL;
 	    }
 	  }
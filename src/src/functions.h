@@ -65,8 +65,14 @@ extern void    tls_free_cert(void **);
 extern int     tls_getc(unsigned);
 extern uschar *tls_getbuf(unsigned *);
 extern void    tls_get_cache(void);
+extern uschar *tls_peekbuf(unsigned *);
 extern BOOL    tls_import_cert(const uschar *, void **);
+extern const uschar * tls_ktls_name(unsigned);
+# ifndef DISABLE_OCSP
+extern time_t  tls_ocsp_refresh_files(BOOL);
+# endif
 extern int     tls_read(void *, uschar *, size_t);
+extern BOOL    tls_server_preload_check(void);
 extern int     tls_server_start(const uschar *, uschar **);
 extern BOOL    tls_smtp_buffered(void);
 extern int     tls_ungetc(int);
@@ -81,6 +87,8 @@ extern BOOL    tls_is_name_for_cert(const uschar *, void *);
 
 # ifdef SUPPORT_DANE
 extern int     tlsa_lookup(const host_item *, dns_answer *, BOOL);
+extern void    tlsa_prefetch(const host_item *, int, const uschar **,
+		  const uschar **);
 # endif
 
 #endif	/*DISABLE_TLS*/
@@ -93,7 +101,6 @@ extern int     acl_check(int, uschar *, uschar *, uschar **, uschar **);
 extern int     acl_eval(int, uschar *, uschar **, uschar **);
 
 extern tree_node *acl_var_create(uschar *);
-extern void    acl_var_write(uschar *, uschar *, void *);
 
 #ifdef EXPERIMENTAL_ARC
 extern void   *arc_ams_setup_sign_bodyhash(void);
@@ -149,6 +156,8 @@ extern void    bdat_flush_data(void);
 extern void    bits_clear(unsigned int *, size_t, int *);
 extern void    bits_set(unsigned int *, size_t, int *);
 
+extern void    callout_cache_flush(void);
+extern void    callout_kept_close(void);
 extern void    cancel_cutthrough_connection(BOOL, const uschar *);
 extern gstring *cat_file(FILE *, gstring *, uschar *);
 extern gstring *cat_file_tls(void *, gstring *, uschar *);
@@ -170,7 +179,11 @@ extern BOOL    cutthrough_headers_send(void);
 extern BOOL    cutthrough_predata(void);
 extern void    release_cutthrough_connection(const uschar *);
 
+extern int     daemon_count(int);
+extern BOOL    daemon_park_connection(int, int);
 extern void    daemon_go(void);
+extern BOOL    daemon_screen_list(void);
+extern int     daemon_screen_set(const uschar *, int, BOOL);
 
 #ifdef EXPERIMENTAL_DCC
 extern int     dcc_process(uschar **);
@@ -182,6 +195,7 @@ extern void    debug_print_argv(const uschar **);
 extern void    debug_print_ids(uschar *);
 extern void    debug_printf_indent(const char *, ...) PRINTF_FUNCTION(1,2);
 extern void    debug_print_string(uschar *);
+extern void    debug_print_hash(const char *, const tree_hash *);
 extern void    debug_print_tree(const char *, tree_node *);
 extern void    debug_vprintf(int, const char *, va_list);
 extern void    debug_print_socket(int);
@@ -189,6 +203,7 @@ extern void    debug_print_socket(int);
 extern void    decode_bits(unsigned int *, size_t, int *,
 	           uschar *, bit_table *, int, uschar *, int);
 extern void    delete_pid_file(void);
+extern void    deliver_buffers_init(void);
 extern void    deliver_local(address_item *, BOOL);
 extern address_item *deliver_make_addr(uschar *, BOOL);
 extern void    delivery_log(int, address_item *, int, uschar *);
@@ -204,6 +219,7 @@ extern void    delivery_re_exec(int);
 extern void    die_tainted(const uschar *, const uschar *, int);
 extern BOOL    directory_make(const uschar *, const uschar *, int, BOOL);
 #ifndef DISABLE_DKIM
+extern void    dkim_exim_preload_keys(void);
 extern uschar *dkim_exim_query_dns_txt(const uschar *);
 extern void    dkim_exim_sign_init(void);
 
@@ -219,12 +235,15 @@ extern BOOL    dns_is_aa(const dns_answer *);
 extern BOOL    dns_is_secure(const dns_answer *);
 extern int     dns_lookup(dns_answer *, const uschar *, int, const uschar **);
 extern void    dns_pattern_init(void);
+extern void    dns_prefetch(const uschar **, const int *, int);
 extern int     dns_special_lookup(dns_answer *, const uschar *, int, const uschar **);
 extern dns_record *dns_next_rr(const dns_answer *, dns_scan *, int);
 extern uschar *dns_text_type(int);
 extern void    dscp_list_to_stream(FILE *);
 extern BOOL    dscp_lookup(const uschar *, int, int *, int *, int *);
 
+extern void    enq_adapt_end(uschar *, int, int);
+extern BOOL    enq_adapt_start(uschar *, int);
 extern void    enq_end(uschar *);
 extern BOOL    enq_start(uschar *, unsigned);
 #ifndef DISABLE_EVENT
@@ -237,6 +256,9 @@ extern const uschar * exim_errstr(int);
 extern void    exim_exit(int) NORETURN;
 extern void    exim_gettime(struct timeval *);
 extern void    exim_nullstd(void);
+#ifdef EXIM_HAVE_CPU_AFFINITY
+extern BOOL    exim_set_cpus(const uschar *, int);
+#endif
 extern void    exim_setugid(uid_t, gid_t, BOOL, uschar *);
 extern void    exim_underbar_exit(int) NORETURN;
 extern void    exim_wait_tick(struct timeval *, int);
@@ -250,6 +272,7 @@ extern const uschar *expand_cstring(const uschar *); /* ... so use this one */
 extern uschar *expand_getkeyed(const uschar *, const uschar *);
 
 extern uschar *expand_hide_passwords(uschar * );
+extern void    expand_readfile_preload(void);
 extern uschar *expand_string_copy(const uschar *);
 extern int_eximarith_t expand_string_integer(uschar *, BOOL);
 extern void    modify_variable(uschar *, void *);
@@ -267,6 +290,8 @@ extern void    force_fd(int, int);
 extern void    header_add(int, const char *, ...);
 extern header_line *header_add_at_position_internal(BOOL, uschar *, BOOL, int, const char *, ...);
 extern int     header_checkname(header_line *, BOOL);
+extern header_line **header_index_find(const uschar *, int);
+extern void    header_index_reset(void);
 extern BOOL    header_match(uschar *, BOOL, BOOL, string_item *, int, ...);
 extern int     host_address_extract_port(uschar *);
 extern uschar *host_and_ident(BOOL);
@@ -313,17 +338,34 @@ extern uschar *local_part_quote(uschar *);
 extern int     log_create(uschar *);
 extern int     log_create_as_exim(uschar *);
 extern void    log_close_all(void);
+extern gstring *log_json_int(gstring *, const char *, long);
+extern void    log_json_send(gstring *);
+extern gstring *log_json_start(const uschar *);
+extern gstring *log_json_str(gstring *, const char *, const uschar *);
+extern gstring *log_json_time(gstring *, const char *, const struct timeval *);
+extern BOOL    lookup_module_load(int);
+extern void    lss_body_unmap(void);
 
 extern macro_item * macro_create(const uschar *, const uschar *, BOOL);
 extern BOOL    macro_read_assignment(uschar *);
 extern uschar *macros_expand(int, int *, BOOL *);
+extern void    mainlog_buffer_start(void);
 extern void    mainlog_close(void);
+extern void    mainlog_flush(void);
 #ifdef WITH_CONTENT_SCAN
 extern int     malware(const uschar *, int);
+extern int     malware_background(int);
+extern void    malware_bg_cancel(void);
 extern int     malware_in_file(uschar *);
 extern void    malware_init(void);
 extern gstring * malware_show_supported(gstring *);
 #endif
+#ifdef WITH_CONTENT_SCAN
+extern void    mbox_stream_close(mbox_stream *);
+extern uschar *mbox_stream_gets(mbox_stream *, uschar *, int);
+extern size_t  mbox_stream_read(mbox_stream *, uschar *, size_t);
+extern BOOL    mbox_stream_send(mbox_stream *, int);
+#endif
 extern int     match_address_list(const uschar *, BOOL, BOOL, const uschar **,
                  unsigned int *, int, int, const uschar **);
 extern int     match_address_list_basic(const uschar *, const uschar **, int);
@@ -343,7 +385,9 @@ struct mime_boundary_context;
 extern int     mime_acl_check(uschar *acl, FILE *f,
                  struct mime_boundary_context *, uschar **, uschar **);
 extern int     mime_decode(const uschar **);
-extern ssize_t mime_decode_base64(FILE *, FILE *, uschar *);
+extern ssize_t mime_decode_base64(FILE *, mime_sink *, uschar *);
+extern int     mime_decode_mem(uschar *, int);
+extern BOOL    mime_sink_write(mime_sink *, const uschar *, size_t);
 extern int     mime_regex(const uschar **);
 extern void    mime_set_anomaly(int);
 #endif
@@ -360,6 +404,7 @@ extern void    moan_write_from(FILE *);
 extern void    moan_write_references(FILE *, uschar *);
 extern FILE   *modefopen(const uschar *, const char *, mode_t);
 
+extern void    notifier_send(const uschar *, int);
 extern int     open_cutthrough_connection( address_item * addr );
 
 extern uschar *parse_extract_address(uschar *, uschar **, int *, int *, int *,
@@ -372,6 +417,12 @@ extern const uschar *parse_fix_phrase(const uschar *, int);
 extern uschar *parse_message_id(uschar *, uschar **, uschar **);
 extern const uschar *parse_quote_2047(const uschar *, int, uschar *, BOOL);
 extern uschar *parse_date_time(uschar *str, time_t *t);
+extern void    profile_accumulate(const uschar *);
+extern void    profile_count(const uschar *, const struct timeval *);
+extern void    profile_report(void);
+extern void    profile_reset(void);
+extern void    profile_start(void);
+extern gstring *profile_summary(gstring *);
 extern int     vaguely_random_number(int);
 #ifndef DISABLE_TLS
 extern int     vaguely_random_number_fallback(int);
@@ -381,11 +432,21 @@ extern BOOL    queue_action(uschar *, int, uschar **, int, int);
 extern void    queue_check_only(void);
 extern unsigned queue_count(void);
 extern unsigned queue_count_cached(void);
+extern int     queue_daemon_request(const uschar *, int, int, uschar *, int, int);
+extern void    queue_delivery_notify(BOOL);
+extern void    queue_store_stats_notify(void);
+extern void    queue_index_build(BOOL);
+extern int     queue_index_count(const uschar *);
+extern void    queue_index_notify(int, const uschar *, int, const uschar *);
+extern void    queue_index_update(const uschar *, int);
 extern void    queue_list(int, uschar **, int);
+extern void    queue_summary_write(const uschar *);
 #ifndef DISABLE_QUEUE_RAMP
 extern void    queue_notify_daemon(const uschar * hostname);
 #endif
+extern BOOL    queue_priority_urgent(int);
 extern void    queue_run(uschar *, uschar *, BOOL);
+extern uschar **queue_select(const uschar *, int *, uschar **);
 
 extern int     random_number(int);
 extern const uschar *rc_to_string(int);
@@ -407,21 +468,25 @@ extern void    readconf_rest(void);
 extern uschar *readconf_retry_error(const uschar *, const uschar *, int *, int *);
 extern void    readconf_save_config(const uschar *);
 extern void    read_message_body(BOOL);
+extern int     read_message_data_smtp(FILE *);
 extern void    receive_bomb_out(uschar *, uschar *) NORETURN;
 extern BOOL    receive_check_fs(int);
 extern BOOL    receive_check_set_sender(uschar *);
+extern void    receive_message_id_wait(void);
 extern BOOL    receive_msg(BOOL);
 extern int_eximarith_t receive_statvfs(BOOL, int *);
 extern void    receive_swallow_smtp(void);
 #ifdef WITH_CONTENT_SCAN
 extern int     regex(const uschar **);
 #endif
+extern const pcre *regex_compile(const uschar *, int, const uschar **, int *);
 extern BOOL    regex_match_and_setup(const pcre *, const uschar *, int, int);
 extern const pcre *regex_must_compile(const uschar *, BOOL, BOOL);
 extern void    retry_add_item(address_item *, uschar *, int);
 extern BOOL    retry_check_address(const uschar *, host_item *, uschar *, BOOL,
-                 uschar **, uschar **);
+                 uschar **, uschar **, time_t *);
 extern retry_config *retry_find_config(const uschar *, const uschar *, int, int);
+extern time_t  retry_next_due(uschar *, const uschar *, dbdata_retry *);
 extern BOOL    retry_ultimate_address_timeout(uschar *, const uschar *,
                  dbdata_retry *, time_t);
 extern void    retry_update(address_item **, address_item **, address_item **);
@@ -437,6 +502,9 @@ extern uschar *rfc2047_decode2(uschar *, BOOL, uschar *, int, int *, int *,
                  uschar **);
 extern int     route_address(address_item *, address_item **, address_item **,
                  address_item **, address_item **, int);
+extern BOOL    route_cache_get(open_db *, address_item *);
+extern void    route_cache_put(address_item *);
+extern void    route_cache_write(void);
 extern int     route_check_prefix(const uschar *, const uschar *, unsigned *);
 extern int     route_check_suffix(const uschar *, const uschar *, unsigned *);
 extern BOOL    route_findgroup(uschar *, gid_t *);
@@ -452,10 +520,15 @@ extern void    route_tidyup(void);
 extern uschar *search_args(int, uschar *, uschar *, uschar **, const uschar *);
 extern uschar *search_find(void *, const uschar *, uschar *, int,
 		 const uschar *, int, int, int *, const uschar *);
+extern int     search_find_batch(void *, const uschar *, const uschar **, int,
+		 uschar **, const uschar *);
 extern int     search_findtype(const uschar *, int);
 extern int     search_findtype_partial(const uschar *, int *, const uschar **, int *,
                  int *, const uschar **);
 extern void   *search_open(const uschar *, int, int, uid_t *, gid_t *);
+extern BOOL    search_proxy_query(const uschar *, const uschar *,
+		 const uschar *, uschar **, uschar **, uint *, int *);
+extern void    search_proxy_serve(int);
 extern void    search_tidyup(void);
 extern void    set_process_info(const char *, ...) PRINTF_FUNCTION(1,2);
 extern void    sha1_end(hctx *, const uschar *, int, uschar *);
@@ -465,6 +538,7 @@ extern int     sieve_interpret(uschar *, int, uschar *, uschar *, uschar *,
                  uschar *, address_item **, uschar **);
 extern void    sigalrm_handler(int);
 extern BOOL    smtp_buffered(void);
+extern void    smtp_buf_init(void);
 extern void    smtp_closedown(uschar *);
 extern void    smtp_command_timeout_exit(void) NORETURN;
 extern void    smtp_command_sigterm_exit(void) NORETURN;
@@ -472,7 +546,10 @@ extern void    smtp_data_timeout_exit(void) NORETURN;
 extern void    smtp_data_sigint_exit(void) NORETURN;
 extern void    smtp_deliver_init(void);
 extern uschar *smtp_cmd_hist(void);
+extern void    smtp_conn_cache_serve(int) NORETURN;
 extern int     smtp_connect(smtp_connect_args *, const blob *);
+extern host_item *smtp_race_connect(host_item *, int, transport_instance *, int,
+		 BOOL (*)(const host_item *, void *), void *);
 extern int     smtp_sock_connect(host_item *, int, int, uschar *,
 		 transport_instance * tb, int, const blob *);
 extern int     smtp_feof(void);
@@ -481,9 +558,11 @@ extern uschar *smtp_get_connection_info(void);
 extern BOOL    smtp_get_interface(uschar *, int, address_item *,
                  uschar **, uschar *);
 extern BOOL    smtp_get_port(uschar *, address_item *, int *, uschar *);
+extern void    smtp_interface_throttle(const uschar *, const uschar *, int);
 extern int     smtp_getc(unsigned);
 extern uschar *smtp_getbuf(unsigned *);
 extern void    smtp_get_cache(void);
+extern uschar *smtp_peekbuf(unsigned *);
 extern int     smtp_handle_acl_fail(int, int, uschar *, uschar *);
 extern void    smtp_log_no_mail(void);
 extern void    smtp_message_code(uschar **, int *, uschar **, uschar **, BOOL);
@@ -496,25 +575,55 @@ extern void    smtp_port_for_connect(host_item *, int);
 extern void    smtp_send_prohibition_message(int, uschar *);
 extern int     smtp_setup_msg(void);
 extern BOOL    smtp_start_session(void);
+extern void    smtp_phase_accumulate(const uschar *);
+extern void    smtp_phase_acl(int, const struct timeval *);
+extern void    smtp_phase_report(void);
+extern gstring *smtp_phase_summary(gstring *);
+extern void    smtp_phase_time(int, const struct timeval *);
 extern int     smtp_ungetc(int);
 extern BOOL    smtp_verify_helo(void);
 extern int     smtp_write_command(void *, int, const char *, ...) PRINTF_FUNCTION(3,4);
 #ifdef WITH_CONTENT_SCAN
 extern int     spam(const uschar **);
 extern FILE   *spool_mbox(unsigned long *, const uschar *, uschar **);
+extern mbox_stream *spool_mbox_stream(unsigned long *);
 #endif
 extern void    spool_clear_header_globals(void);
+extern void    spool_close_datafile(void);
+#ifdef SUPPORT_ZSTD
+extern BOOL    spool_compress_datafile(const uschar *);
+#endif
+extern int     spool_datafile_plain(int, const uschar *, const uschar *);
+#ifndef DISABLE_DKIM
+extern void    spool_dedup_bodyhashes_get(void);
+extern void    spool_dedup_bodyhashes_put(void);
+#endif
+extern BOOL    spool_dedup_link(int, const uschar *);
+extern void    spool_dedup_release(int);
+extern void    spool_dedup_store(void);
+extern void    spool_dedup_tidy(void);
+extern int     spool_fsync_group(int);
+extern void    spool_fsync_group_open(void);
+extern BOOL    spool_lock_datafile(int, const uschar *);
 extern BOOL    spool_move_message(uschar *, uschar *, uschar *, uschar *);
 extern int     spool_open_datafile(uschar *);
 extern int     spool_open_temp(uschar *);
 extern int     spool_read_header(uschar *, BOOL, BOOL);
+extern int     spool_read_priority(const uschar *, int);
 extern int     spool_write_header(uschar *, int, uschar **);
+#ifdef SUPPORT_IO_URING
+extern BOOL    spool_uring_defer_data_sync(void);
+#endif
 extern int     stdin_getc(unsigned);
 extern int     stdin_feof(void);
 extern int     stdin_ferror(void);
 extern int     stdin_ungetc(int);
 
 extern void    store_exit(void);
+extern void    store_stats_accumulate(const uschar *);
+extern gstring *store_stats_peaks(gstring *);
+extern gstring *store_stats_string(gstring *);
+extern gstring *store_stats_summary(gstring *);
 extern gstring *string_append(gstring *, int, ...) WARN_UNUSED_RESULT;
 extern gstring *string_append_listele(gstring *, uschar, const uschar *) WARN_UNUSED_RESULT;
 extern gstring *string_append_listele_n(gstring *, uschar, const uschar *, unsigned) WARN_UNUSED_RESULT;
@@ -567,6 +676,7 @@ extern uschar *string_nextinlist_trc(const uschar **listptr, int *separator, usc
 extern int     strcmpic(const uschar *, const uschar *);
 extern int     strncmpic(const uschar *, const uschar *, int);
 extern uschar *strstric(uschar *, uschar *, BOOL);
+extern void    syslog_native_exit(void);
 
 extern int     test_harness_fudged_queue_time(int);
 extern void    tcp_init(void);
@@ -574,15 +684,20 @@ extern void    tcp_init(void);
 extern void    tfo_probe(void);
 #endif
 extern void    tls_modify_variables(tls_support *);
+extern void    tod_reset(void);
 extern uschar *tod_stamp(int);
+extern void    trace_dump(const uschar *);
+extern void    trace_event(int, int, int, const struct timeval *, const uschar *);
+extern void    trace_init(void);
 
 extern BOOL    transport_check_waiting(const uschar *, const uschar *, int, uschar *,
                  oicf, void*);
 extern void    transport_init(void);
 extern void    transport_do_pass_socket(const uschar *, const uschar *,
 		 const uschar *, uschar *, int);
+extern BOOL    transport_pass_noexec(int);
 extern BOOL    transport_pass_socket(const uschar *, const uschar *, const uschar *, uschar *,
-                 int);
+                 int, int);
 extern uschar *transport_rcpt_address(address_item *, BOOL);
 extern BOOL    transport_set_up_command(const uschar ***, uschar *,
 		 BOOL, int, address_item *, uschar *, uschar **);
@@ -598,9 +713,14 @@ extern void    tree_add_duplicate(uschar *, address_item *);
 extern void    tree_add_nonrecipient(uschar *);
 extern void    tree_add_unusable(host_item *);
 extern void    tree_dup(tree_node **, tree_node *);
+extern BOOL    tree_hash_insert(tree_hash *, tree_node *);
+extern tree_node *tree_hash_search(const tree_hash *, const uschar *);
+extern tree_node **tree_hash_sorted(const tree_hash *);
+extern int     tree_phash_find(tree_phash **, const void *, int, size_t,
+                 const uschar *);
+extern void    tree_hash_walk(const tree_hash *, void (*)(uschar*, uschar*, void*), void *);
 extern int     tree_insertnode(tree_node **, tree_node *);
 extern tree_node *tree_search(tree_node *, const uschar *);
-extern void    tree_write(tree_node *, FILE *);
 extern void    tree_walk(tree_node *, void (*)(uschar*, uschar*, void*), void *);
 
 #ifdef WITH_CONTENT_SCAN
@@ -612,6 +732,9 @@ extern void    utf8_version_report(FILE *);
 
 extern int     verify_address(address_item *, FILE *, int, int, int, int,
                  uschar *, uschar *, BOOL *);
+extern BOOL    verify_cache_get(address_item *, int, int *, BOOL *);
+extern void    verify_cache_put(const uschar *, const address_item *, int, int,
+                 BOOL);
 extern int     verify_check_dnsbl(int, const uschar **, uschar **);
 extern int     verify_check_header_address(uschar **, uschar **, int, int, int,
                  uschar *, uschar *, int, int *);
@@ -967,11 +1090,49 @@ return store_get_3(sizeof(dns_answer), TRUE, CCS func, line);  /* use tainted me
 /******************************************************************************/
 /* Routines with knowledge of spool layout */
 
+/* When spool_stripes is set, each message lives under one of its directories,
+chosen from the message id, instead of under spool_directory. The choice must
+match that made by exipick and exim_tidydb. Anything that is not a message id
+stays in spool_directory. */
+
+static inline BOOL
+spool_is_id(const uschar * s)
+{
+if (!s) return FALSE;
+for (int i = 0; i < MESSAGE_ID_LENGTH; i++) if (!s[i]) return FALSE;
+return s[6] == '-' && s[13] == '-';
+}
+
+static inline const uschar *
+spool_root(const uschar * id)
+{
+unsigned sum = 0;
+
+if (spool_stripe_count <= 0 || !spool_is_id(id))
+  return spool_directory;
+for (int i = 0; i < MESSAGE_ID_LENGTH; i++) sum += id[i];
+return spool_stripe_dirs[sum % spool_stripe_count];
+}
+
+/* Index the spool roots, for scanning all of them */
+
+static inline const uschar *
+spool_root_n(int n)
+{
+return spool_stripe_count > 0 ? spool_stripe_dirs[n] : spool_directory;
+}
+
+static inline int
+spool_root_count(void)
+{
+return spool_stripe_count > 0 ? spool_stripe_count : 1;
+}
+
 # ifndef COMPILE_UTILITY
 static inline void
-spool_pname_buf(uschar * buf, int len)
+spool_pname_buf(uschar * buf, int len, const uschar * root)
 {
-snprintf(CS buf, len, "%s/%s/input", spool_directory, queue_name);
+snprintf(CS buf, len, "%s/%s/input", root, queue_name);
 }
 
 static inline uschar *
@@ -980,6 +1141,13 @@ spool_dname(const uschar * purpose, uschar * subdir)
 return string_sprintf("%s/%s/%s/%s",
 	spool_directory, queue_name, purpose, subdir);
 }
+
+static inline uschar *
+spool_id_dname(const uschar * purpose, uschar * subdir, const uschar * id)
+{
+return string_sprintf("%s/%s/%s/%s",
+	spool_root(id), queue_name, purpose, subdir);
+}
 # endif
 
 static inline uschar *
@@ -1002,7 +1170,8 @@ spool_q_fname(const uschar * purpose, const uschar * q,
 	const uschar * subdir, const uschar * fname, const uschar * suffix)
 {
 return string_sprintf("%s/%s/%s/%s/%s%s",
-	spool_directory, q, purpose, subdir, fname, suffix);
+	spool_root(spool_is_id(fname) ? fname : suffix),
+	q, purpose, subdir, fname, suffix);
 }
 
 static inline uschar *
@@ -1010,11 +1179,12 @@ spool_fname(const uschar * purpose, const uschar * subdir, const uschar * fname,
 	const uschar * suffix)
 {
 #ifdef COMPILE_UTILITY		/* version avoiding string-extension */
-int len = Ustrlen(spool_directory) + 1 + Ustrlen(queue_name) + 1 + Ustrlen(purpose) + 1
+const uschar * root = spool_root(spool_is_id(fname) ? fname : suffix);
+int len = Ustrlen(root) + 1 + Ustrlen(queue_name) + 1 + Ustrlen(purpose) + 1
 	+ Ustrlen(subdir) + 1 + Ustrlen(fname) + Ustrlen(suffix) + 1;
 uschar * buf = store_get(len, FALSE);
 string_format(buf, len, "%s/%s/%s/%s/%s%s",
-	spool_directory, queue_name, purpose, subdir, fname, suffix);
+	root, queue_name, purpose, subdir, fname, suffix);
 return buf;
 #else
 return spool_q_fname(purpose, queue_name, subdir, fname, suffix);
@@ -1030,6 +1200,17 @@ subdir_str[0] = split_spool_directory == (search_sequence == 0)
 subdir_str[1] = '\0';
 }
 
+/* The size of the data of a message, given the stat() of its -D file, for
+listings. For a compressed file it comes from the -H file, which must have
+been read. */
+
+static inline off_t
+spool_data_size(const struct stat * sp)
+{
+return spool_file_compressed > 0
+  ? spool_file_compressed : sp->st_size - SPOOL_DATA_START_OFFSET;
+}
+
 /******************************************************************************/
 /* Time calculations */
 
@@ -1045,6 +1226,14 @@ if ((diff->tv_usec -= then->tv_usec) < 0)
   }
 }
 
+static inline long
+usec_since(const struct timeval * then)
+{
+struct timeval diff;
+timesince(&diff, then);
+return diff.tv_sec * 1000000L + diff.tv_usec;
+}
+
 static inline uschar *
 string_timediff(const struct timeval * diff)
 {
@@ -1066,6 +1255,39 @@ timesince(&diff, then);
 return string_timediff(&diff);
 }
 
+/* Resources used since a previous sample from getrusage(). The CPU times and
+block I/O counts are differences; the maximum RSS is a high-water mark and so
+is left as the current value. */
+
+static inline void
+rusage_since(struct rusage * diff, const struct rusage * then)
+{
+getrusage(RUSAGE_SELF, diff);
+diff->ru_utime.tv_sec -= then->ru_utime.tv_sec;
+if ((diff->ru_utime.tv_usec -= then->ru_utime.tv_usec) < 0)
+  {
+  diff->ru_utime.tv_sec--;
+  diff->ru_utime.tv_usec += 1000*1000;
+  }
+diff->ru_stime.tv_sec -= then->ru_stime.tv_sec;
+if ((diff->ru_stime.tv_usec -= then->ru_stime.tv_usec) < 0)
+  {
+  diff->ru_stime.tv_sec--;
+  diff->ru_stime.tv_usec += 1000*1000;
+  }
+diff->ru_inblock -= then->ru_inblock;
+diff->ru_oublock -= then->ru_oublock;
+}
+
+static inline gstring *
+string_rusage(gstring * g, const struct rusage * ru)
+{
+return string_fmt_append(g, " RU=%u.%03uu/%u.%03us/%ldi/%ldo/%ldk",
+  (uint)ru->ru_utime.tv_sec, (uint)ru->ru_utime.tv_usec/1000,
+  (uint)ru->ru_stime.tv_sec, (uint)ru->ru_stime.tv_usec/1000,
+  (long)ru->ru_inblock, (long)ru->ru_oublock, (long)ru->ru_maxrss);
+}
+
 static inline void
 report_time_since(const struct timeval * t0, const uschar * where)
 {
@@ -1144,6 +1366,23 @@ return NULL;
 
 /******************************************************************************/
 # if !defined(COMPILE_UTILITY)
+/* The rarely used fields of an address (see structs.h), as a block that may
+be written: allocated when first needed, and copied when it is shared. */
+
+static inline address_item_cold *
+addr_cold(address_item * addr)
+{
+address_item_cold * c = addr->cold;
+if (!c || c->owner != addr)
+  {
+  address_item_cold * n = store_get(sizeof(address_item_cold), FALSE);
+  *n = c ? *c : address_cold_empty;
+  n->owner = addr;
+  addr->cold = c = n;
+  }
+return c;
+}
+
 /* Process manipulation */
 
 static inline pid_t
@@ -1151,9 +1390,11 @@ exim_fork(const unsigned char * purpose)
 {
 pid_t pid;
 DEBUG(D_any) debug_printf("%s forking for %s\n", process_purpose, purpose);
+mainlog_flush();
 if ((pid = fork()) == 0)
   {
   process_purpose = purpose;
+  if (profiling) profile_reset();
   DEBUG(D_any) debug_printf("postfork: %s\n", purpose);
   }
 else
@@ -92,6 +92,10 @@ uschar *redis_servers          = NULL;
 #ifdef LOOKUP_SQLITE
 uschar *sqlite_dbfile	       = NULL;
 int     sqlite_lock_timeout    = 5;
+int     sqlite_mmap_size       = 0;
+BOOL    sqlite_read_only       = FALSE;
+BOOL    sqlite_shared_cache    = FALSE;
+int     sqlite_statement_cache = 0;
 #endif
 
 #ifdef SUPPORT_MOVE_FROZEN_MESSAGES
@@ -120,6 +124,8 @@ uschar *dsn_advertise_hosts    = NULL;
 #ifndef DISABLE_TLS
 BOOL    gnutls_compat_mode     = FALSE;
 BOOL    gnutls_allow_auto_pkcs11 = FALSE;
+BOOL    openssl_async          = FALSE;
+uschar *openssl_engine         = NULL;
 uschar *openssl_options        = NULL;
 const pcre *regex_STARTTLS     = NULL;
 uschar *tls_advertise_hosts    = US"*";
@@ -132,14 +138,24 @@ int     tls_dh_max_bits        = 2236;
 uschar *tls_dhparam            = NULL;
 uschar *tls_eccurve            = US"auto";
 # ifndef DISABLE_OCSP
+int     tls_ocsp_cache_size    = 0;
 uschar *tls_ocsp_file          = NULL;
+BOOL    tls_ocsp_refresh       = FALSE;
 # endif
 uschar *tls_privatekey         = NULL;
 BOOL    tls_remember_esmtp     = FALSE;
 uschar *tls_require_ciphers    = NULL;
 # ifndef DISABLE_TLS_RESUME
+int     tls_resumption_cache_size = 0;
 uschar *tls_resumption_hosts   = NULL;
 # endif
+BOOL    tls_server_preload     = FALSE;
+uschar *tls_server_preload_sni = NULL;
+# ifndef DISABLE_TLS_RESUME
+uschar *tls_ticket_key_file    = NULL;
+int     tls_ticket_key_overlap = 1;
+int     tls_ticket_key_rotate  = 60*60;
+# endif
 uschar *tls_try_verify_hosts   = NULL;
 uschar *tls_verify_certificates= US"system";
 uschar *tls_verify_hosts       = NULL;
@@ -150,6 +166,7 @@ uschar *tls_advertise_hosts    = NULL;
 #ifndef DISABLE_PRDR
 /* Per Recipient Data Response variables */
 BOOL    prdr_enable            = FALSE;
+int     prdr_max_parallel      = 1;
 BOOL    prdr_requested         = FALSE;
 const pcre *regex_PRDR         = NULL;
 #endif
@@ -169,6 +186,7 @@ int (*lwr_receive_ungetc)(int) = stdin_ungetc;
 int (*receive_getc)(unsigned)  = stdin_getc;
 uschar * (*receive_getbuf)(unsigned *)  = NULL;
 void (*receive_get_cache)(void)= NULL;
+uschar * (*receive_peekbuf)(unsigned *) = NULL;
 int (*receive_ungetc)(int)     = stdin_ungetc;
 int (*receive_feof)(void)      = stdin_feof;
 int (*receive_ferror)(void)    = stdin_ferror;
@@ -308,6 +326,7 @@ struct global_flags f =
 	.smtp_in_pipelining_advertised = FALSE,
 	.smtp_in_pipelining_used = FALSE,
 	.smtp_in_quit		= FALSE,
+	.spool_file_dotfree     = FALSE,
 	.spool_file_wireformat  = FALSE,
 	.submission_mode        = FALSE,
 	.suppress_local_fixups  = FALSE,
@@ -342,6 +361,10 @@ BOOL    bounce_return_body     = TRUE;
 BOOL    bounce_return_message  = TRUE;
 BOOL    check_rfc2047_length   = TRUE;
 BOOL    commandline_checks_require_admin = FALSE;
+BOOL    config_snapshot        = FALSE;
+#ifdef WITH_CONTENT_SCAN
+BOOL    content_scan_direct    = FALSE;
+#endif
 
 #ifdef EXPERIMENTAL_DCC
 BOOL    dcc_direct_add_header  = FALSE;
@@ -365,10 +388,12 @@ BOOL    host_checking          = FALSE;
 BOOL    host_lookup_deferred   = FALSE;
 BOOL    host_lookup_failed     = FALSE;
 BOOL    ignore_fromline_local  = FALSE;
+BOOL    json_cache             = FALSE;
 
 BOOL    local_from_check       = TRUE;
 BOOL    local_sender_retain    = FALSE;
 BOOL    log_timezone           = FALSE;
+BOOL    lsearch_index          = FALSE;
 BOOL    message_body_newlines  = FALSE;
 BOOL    message_logs           = TRUE;
 #ifdef SUPPORT_I18N
@@ -386,11 +411,15 @@ BOOL    proxy_session          = FALSE;
 #ifndef DISABLE_QUEUE_RAMP
 BOOL    queue_fast_ramp		= FALSE;
 #endif
+BOOL    queue_index            = FALSE;
 BOOL    queue_list_requires_admin = TRUE;
 BOOL    queue_only             = FALSE;
 BOOL    queue_only_load_latch  = TRUE;
 BOOL    queue_only_override    = TRUE;
+BOOL    queue_retry_index      = FALSE;
+BOOL    queue_run_by_host      = FALSE;
 BOOL    queue_run_in_order     = FALSE;
+BOOL    queue_summary          = FALSE;
 BOOL    recipients_max_reject  = FALSE;
 BOOL    return_path_remove     = TRUE;
 
@@ -399,6 +428,9 @@ BOOL    sender_helo_dnssec     = FALSE;
 BOOL    sender_host_dnssec     = FALSE;
 BOOL    smtp_accept_keepalive  = TRUE;
 BOOL    smtp_check_spool_space = TRUE;
+#ifdef EXIM_HAVE_CPU_AFFINITY
+BOOL    smtp_cpus_follow_incoming = FALSE;
+#endif
 BOOL    smtp_enforce_sync      = TRUE;
 BOOL    smtp_etrn_serialize    = TRUE;
 BOOL    smtp_input             = FALSE;
@@ -407,6 +439,7 @@ BOOL    smtp_return_error_details = FALSE;
 BOOL    spf_result_guessed     = FALSE;
 #endif
 BOOL    split_spool_directory  = FALSE;
+BOOL    spool_header_binary    = FALSE;
 BOOL    spool_wireformat       = FALSE;
 #ifdef EXPERIMENTAL_SRS_ALT
 BOOL    srs_usehash            = TRUE;
@@ -536,7 +569,7 @@ address_item address_defaults = {
   .host_list =		NULL,
   .host_used =		NULL,
   .fallback_hosts =	NULL,
-  .reply =		NULL,
+  .cold =		NULL,
   .retries =		NULL,
   .address =		NULL,
   .unique =		NULL,
@@ -544,21 +577,12 @@ address_item address_defaults = {
   .lc_local_part =	NULL,
   .local_part =		NULL,
   .prefix =		NULL,
-  .prefix_v =		NULL,
   .suffix =		NULL,
-  .suffix_v =		NULL,
   .domain =		NULL,
   .address_retry_key =	NULL,
   .domain_retry_key =	NULL,
-  .current_dir =	NULL,
-  .home_dir =		NULL,
   .message =		NULL,
   .user_message =	NULL,
-  .onetime_parent =	NULL,
-  .pipe_expandn =	NULL,
-  .return_filename =	NULL,
-  .self_hostname =	NULL,
-  .shadow_message =	NULL,
 #ifndef DISABLE_TLS
   .cipher =		NULL,
   .ourcert =		NULL,
@@ -609,6 +633,8 @@ address_item address_defaults = {
   }
 };
 
+const address_item_cold address_cold_empty = { .owner = NULL };
+
 uschar *address_file           = NULL;
 uschar *address_pipe           = NULL;
 tree_node *addresslist_anchor  = NULL;
@@ -679,6 +705,7 @@ int     bsmtp_transaction_linecount = 0;
 int     body_8bitmime          = 0;
 int     body_linecount         = 0;
 int     body_zerocount         = 0;
+BOOL    bounce_in_process      = FALSE;
 uschar *bounce_message_file    = NULL;
 uschar *bounce_message_text    = NULL;
 uschar *bounce_recipient       = NULL;
@@ -691,6 +718,8 @@ int     callout_cache_domain_positive_expire = 7*24*60*60;
 int     callout_cache_domain_negative_expire = 3*60*60;
 int     callout_cache_positive_expire = 24*60*60;
 int     callout_cache_negative_expire = 2*60*60;
+int     callout_cache_write_batch = 0;
+int     callout_keep_idle      = 0;
 uschar *callout_random_local_part = US"$primary_hostname-$tod_epoch-testing";
 uschar *check_dns_names_pattern= US"(?i)^(?>(?(1)\\.|())[^\\W](?>[a-z0-9/_-]*[^\\W])?)+(\\.?)$";
 int     check_log_inodes       = 100;
@@ -711,6 +740,7 @@ int     clmacro_count          = 0;
 uschar *clmacros[MAX_CLMACROS];
 FILE   *config_file            = NULL;
 const uschar *config_filename  = NULL;
+unsigned config_hash            = 2166136261U;
 int     config_lineno          = 0;
 #ifdef CONFIGURE_GROUP
 gid_t   config_gid             = CONFIGURE_GROUP;
@@ -731,6 +761,7 @@ uid_t   config_uid             = 0;
 int     connection_max_messages= -1;
 uschar *continue_proxy_cipher  = NULL;
 BOOL    continue_proxy_dane    = FALSE;
+BOOL    continue_proxy_ktls    = FALSE;
 uschar *continue_proxy_sni     = NULL;
 uschar *continue_hostname      = NULL;
 uschar *continue_host_address  = NULL;
@@ -743,11 +774,20 @@ cut_t   cutthrough = {
   .delivery =		FALSE,				/* when to attempt */
   .defer_pass =		FALSE,				/* on defer: spool locally */
   .is_tls =		FALSE,				/* not a TLS conn yet */
+  .partial =		FALSE,				/* one outcome for all conns */
   .cctx =		{.sock = -1},			/* open connection */
   .nrcpt =		0,				/* number of addresses */
 };
+int     cutthrough_max_connections = 1;
 
+BOOL    daemon_config_readonly = FALSE;
+BOOL    daemon_delivery_helper = FALSE;
+int     daemon_delivery_helper_max = 0;
 int	daemon_notifier_fd     = -1;
+int     daemon_park_max        = 0;
+int     daemon_park_served     = 0;
+int     daemon_prefork_sessions = 100;
+int     daemon_prefork_workers = 0;
 uschar *daemon_smtp_port       = US"smtp";
 int     daemon_startup_retries = 9;
 int     daemon_startup_sleep   = 30;
@@ -813,6 +853,7 @@ uschar *delay_warning_condition=
             "} {no}{yes}}";
 uschar *deliver_address_data   = NULL;
 int     deliver_datafile       = -1;
+int     deliver_datafile_lock  = -1;
 const uschar *deliver_domain   = NULL;
 uschar *deliver_domain_data    = NULL;
 const uschar *deliver_domain_orig = NULL;
@@ -823,6 +864,7 @@ const uschar *deliver_host     = NULL;
 const uschar *deliver_host_address = NULL;
 int     deliver_host_port      = 0;
 uschar *deliver_in_buffer      = NULL;
+int     deliver_in_buffer_size = DELIVER_IN_BUFFER_SIZE;
 ino_t   deliver_inode          = 0;
 uschar *deliver_localpart      = NULL;
 uschar *deliver_localpart_data = NULL;
@@ -833,16 +875,22 @@ uschar *deliver_localpart_prefix_v = NULL;
 uschar *deliver_localpart_suffix = NULL;
 uschar *deliver_localpart_suffix_v = NULL;
 uschar *deliver_out_buffer     = NULL;
+int     deliver_out_buffer_size = DELIVER_OUT_BUFFER_SIZE;
 int     deliver_queue_load_max = -1;
 address_item  *deliver_recipients = NULL;
 uschar *deliver_selectstring   = NULL;
 uschar *deliver_selectstring_sender = NULL;
+int     delivery_buffer_size   = 0;
+int     delivery_buffer_size_max = 0;
 
 #ifndef DISABLE_DKIM
+uschar *dkim_bodyhashes          = NULL;
 unsigned dkim_collect_input      = 0;
 uschar *dkim_cur_signer          = NULL;
 int     dkim_key_length          = 0;
+uschar *dkim_preload_keys        = NULL;
 void   *dkim_signatures		 = NULL;
+uschar *dkim_sign_bodyhashes     = NULL;
 uschar *dkim_signers             = NULL;
 uschar *dkim_signing_domain      = NULL;
 uschar *dkim_signing_selector    = NULL;
@@ -866,12 +914,14 @@ uschar *dmarc_used_domain       = NULL;
 #endif
 
 uschar *dns_again_means_nonexist = NULL;
+int     dns_cache_size         = 0;
 int     dns_csa_search_limit   = 5;
 int	dns_cname_loops	       = 1;
 #ifdef SUPPORT_DANE
 int     dns_dane_ok            = -1;
 #endif
 uschar *dns_ipv4_lookup        = NULL;
+BOOL    dns_parallel_lookups   = FALSE;
 int     dns_retrans            = 0;
 int     dns_retry              = 0;
 int     dns_dnssec_ok          = -1; /* <0 = not coerced */
@@ -895,6 +945,7 @@ uschar *event_action             = NULL;	/* expansion for delivery events */
 uschar *event_data               = NULL;	/* auxiliary data variable for event */
 int     event_defer_errno        = 0;
 const uschar *event_name         = NULL;	/* event name variable */
+uschar *event_types              = NULL;	/* events for which event_action is expanded */
 #endif
 
 
@@ -921,10 +972,12 @@ int     filter_test            = FTEST_NONE;
 uschar *filter_test_sfile      = NULL;
 uschar *filter_test_ufile      = NULL;
 uschar *filter_thisaddress     = NULL;
+int     finduser_cache_ttl     = 0;
 int     finduser_retries       = 0;
 uid_t   fixed_never_users[]    = { FIXED_NEVER_USERS };
 uschar *freeze_tell            = NULL;
 uschar *freeze_tell_config     = NULL;
+BOOL    fsync_group_commit     = FALSE;
 uschar *fudged_queue_times     = US"";
 
 uschar *gecos_name             = NULL;
@@ -967,6 +1020,10 @@ uschar *helo_lookup_domains    = US"@ : @[]";
 uschar *helo_try_verify_hosts  = NULL;
 uschar *helo_verify_hosts      = NULL;
 const uschar *hex_digits       = CUS"0123456789abcdef";
+int     hints_db_shards        = 0;
+uschar *hints_shared_databases = US"retry : ratelimit : callout";
+uschar *hints_shared_server    = NULL;
+int     hints_shared_ttl       = 60;
 uschar *hold_domains           = NULL;
 uschar *host_data              = NULL;
 uschar *host_lookup            = NULL;
@@ -1004,6 +1061,7 @@ uschar *local_interfaces       = US"<; ::0 ; 0.0.0.0";
 #else
 uschar *local_interfaces       = US"0.0.0.0";
 #endif
+int     local_max_parallel     = 1;
 
 #ifdef HAVE_LOCAL_SCAN
 uschar *local_scan_data        = NULL;
@@ -1041,6 +1099,7 @@ int     log_default[]          = { /* for initializing log_selector */
 
 uschar *log_file_path          = US LOG_FILE_PATH
                            "\0<--------------Space to patch log_file_path->";
+uschar *log_json_socket        = NULL;
 
 int     log_notall[]           = {
   -1
@@ -1088,6 +1147,7 @@ bit_table log_options[]        = { /* must be in alphabetical order,
   BIT_TABLE(L, received_sender),
   BIT_TABLE(L, rejected_header),
   { US"rejected_headers", Li_rejected_header },
+  BIT_TABLE(L, resource_usage),
   BIT_TABLE(L, retry_defer),
   BIT_TABLE(L, return_path_on_delivery),
   BIT_TABLE(L, sender_on_delivery),
@@ -1101,9 +1161,12 @@ bit_table log_options[]        = { /* must be in alphabetical order,
   BIT_TABLE(L, smtp_no_mail),
   BIT_TABLE(L, smtp_protocol_error),
   BIT_TABLE(L, smtp_syntax_error),
+  BIT_TABLE(L, spool_commit_time),
+  BIT_TABLE(L, store_stats),
   BIT_TABLE(L, subject),
   BIT_TABLE(L, tls_certificate_verified),
   BIT_TABLE(L, tls_cipher),
+  BIT_TABLE(L, tls_ktls),
   BIT_TABLE(L, tls_peerdn),
   BIT_TABLE(L, tls_resumption),
   BIT_TABLE(L, tls_sni),
@@ -1118,11 +1181,16 @@ FILE   *log_stderr             = NULL;
 uschar *login_sender_address   = NULL;
 uschar *lookup_dnssec_authenticated = NULL;
 int     lookup_open_max        = 25;
+uschar *lookup_proxy_socket    = NULL;
+int     lookup_proxy_workers   = 4;
 uschar *lookup_value           = NULL;
 
 macro_item *macros_user        = NULL;
 uschar *mailstore_basename     = NULL;
+int     mainlog_buffer_size    = 0;
+BOOL    mainlog_index          = FALSE;
 #ifdef WITH_CONTENT_SCAN
+uschar *malware_cache_version  = NULL;
 uschar *malware_name           = NULL;  /* Virus Name */
 #endif
 int     max_received_linelength= 0;
@@ -1137,10 +1205,13 @@ uschar *message_headers        = NULL;
 uschar *message_id;
 uschar *message_id_domain      = NULL;
 uschar *message_id_text        = NULL;
+BOOL    message_id_sequence    = FALSE;
 struct timeval message_id_tv   = { 0, 0 };
 uschar  message_id_option[MESSAGE_ID_LENGTH + 3];
 uschar *message_id_external;
 int     message_linecount      = 0;
+int     message_priority       = 0;
+struct rusage message_rusage_start;
 int     message_size           = 0;
 uschar *message_size_limit     = US"50M";
 #ifdef SUPPORT_I18N
@@ -1167,6 +1238,7 @@ int     mime_is_multipart      = 0;
 int     mime_is_coverletter    = 0;
 int     mime_is_rfc822         = 0;
 int     mime_part_count        = -1;
+gstring *mime_part_hashes      = NULL;
 #endif
 
 uid_t  *never_users            = NULL;
@@ -1188,6 +1260,7 @@ uschar *pid_file_path          = US PID_FILE_PATH
                            "\0<--------------Space to patch pid_file_path->";
 #ifndef DISABLE_PIPE_CONNECT
 uschar *pipe_connect_advertise_hosts = US"*";
+int     pipe_connect_cache_size = 0;
 #endif
 uschar *pipelining_advertise_hosts = US"*";
 uschar *primary_hostname       = NULL;
@@ -1195,6 +1268,8 @@ uschar *process_info;
 int     process_info_len       = 0;
 uschar *process_log_path       = NULL;
 const uschar *process_purpose  = US"fresh-exec";
+int     profile_sample         = 0;
+BOOL    profiling              = FALSE;
 
 #if defined(SUPPORT_PROXY) || defined(SUPPORT_SOCKS)
 uschar *hosts_proxy            = NULL;
@@ -1212,19 +1287,30 @@ uschar *prvscheck_result       = NULL;
 const uschar *qualify_domain_recipient = NULL;
 uschar *qualify_domain_sender  = NULL;
 uschar *queue_domains          = NULL;
+int     queue_first_pass_workers = 0;
+int     queue_index_rescan     = 3600;
 int     queue_interval         = -1;
 uschar *queue_name             = US"";
 uschar *queue_name_dest        = NULL;
+int     queue_only_deliveries  = 0;
 uschar *queue_only_file        = NULL;
 int     queue_only_load        = -1;
+uschar *queue_priority_classes = NULL;
+#ifdef EXIM_HAVE_CPU_AFFINITY
+uschar *queue_run_cpus         = NULL;
+#endif
 uschar *queue_run_max          = US"5";
+int     queue_run_parallel     = 0;
+int     queue_run_persistent   = 0;
 pid_t   queue_run_pid          = (pid_t)0;
 int     queue_run_pipe         = -1;
 unsigned queue_size            = 0;
 time_t  queue_size_next        = 0;
+uschar *queue_size_lanes       = NULL;
 uschar *queue_smtp_domains     = NULL;
 
 uint32_t random_seed	       = 0;
+int     ratelimit_cache_size   = 0;
 tree_node *ratelimiters_cmd    = NULL;
 tree_node *ratelimiters_conn   = NULL;
 tree_node *ratelimiters_mail   = NULL;
@@ -1236,6 +1322,8 @@ int     raw_recipients_count   = 0;
 int     rcpt_count             = 0;
 int     rcpt_fail_count        = 0;
 int     rcpt_defer_count       = 0;
+int     readfile_cache_size    = 0;
+uschar *readfile_preload       = NULL;
 gid_t   real_gid;
 uid_t   real_uid;
 int     receive_linecount      = 0;
@@ -1276,6 +1364,7 @@ recipient_item  *recipients_list = NULL;
 int     recipients_list_max    = 0;
 int     recipients_max         = 0;
 const pcre *regex_AUTH         = NULL;
+int     regex_cache_size       = 100;
 const pcre *regex_check_dns_names = NULL;
 const pcre *regex_From         = NULL;
 const pcre *regex_IGNOREQUOTA  = NULL;
@@ -1293,6 +1382,8 @@ const pcre *regex_whitelisted_macro = NULL;
 #ifdef WITH_CONTENT_SCAN
 uschar *regex_match_string     = NULL;
 #endif
+uschar *rejectlog_ratelimit    = NULL;
+int     rejectlog_sample       = 1;
 int     remote_delivery_count  = 0;
 int     remote_max_parallel    = 2;
 uschar *remote_sort_domains    = NULL;
@@ -1306,6 +1397,7 @@ uschar *rfc1413_hosts          = US"@[]";
 int     rfc1413_query_timeout  = 0;
 uid_t   root_gid               = ROOT_GID;
 uid_t   root_uid               = ROOT_UID;
+int     route_cache_ttl        = 0;
 
 router_instance  *routers  = NULL;
 router_instance  router_defaults = {
@@ -1392,6 +1484,8 @@ router_instance  router_defaults = {
 uschar *router_name            = NULL;
 tree_node *router_var	       = NULL;
 
+int     run_coprocess_timeout  = 60;
+uschar *run_coprocesses        = NULL;
 ip_address_item *running_interfaces = NULL;
 
 /* This is a weird one. The following string gets patched in the binary by the
@@ -1440,11 +1534,13 @@ const uschar *sigalarm_setter  = NULL;
 uschar **sighup_argv           = NULL;
 int     slow_lookup_log        = 0;	/* millisecs, zero disables */
 int     smtp_accept_count      = 0;
+int     smtp_accept_host_count = 0;
 int     smtp_accept_max        = 20;
 int     smtp_accept_max_nonmail= 10;
 uschar *smtp_accept_max_nonmail_hosts = US"*";
 int     smtp_accept_max_per_connection = 1000;
 uschar *smtp_accept_max_per_host = NULL;
+int     smtp_accept_network_count = 0;
 int     smtp_accept_queue      = 0;
 int     smtp_accept_queue_per_connection = 10;
 int     smtp_accept_reserve    = 0;
@@ -1458,6 +1554,12 @@ uschar *smtp_cmd_buffer        = NULL;
 struct timeval smtp_connection_start  = {0,0};
 uschar  smtp_connection_had[SMTP_HBUFF_SIZE];
 int     smtp_connect_backlog   = 20;
+uschar *smtp_connection_cache  = NULL;
+int     smtp_connection_cache_limit = 2;
+int     smtp_connection_cache_timeout = 30;
+#ifdef EXIM_HAVE_CPU_AFFINITY
+uschar *smtp_cpus              = NULL;
+#endif
 double  smtp_delay_mail        = 0.0;
 double  smtp_delay_rcpt        = 0.0;
 FILE   *smtp_in                = NULL;
@@ -1473,7 +1575,9 @@ unsigned smtp_peer_options_wrap= 0;
 uschar *smtp_ratelimit_hosts   = NULL;
 uschar *smtp_ratelimit_mail    = NULL;
 uschar *smtp_ratelimit_rcpt    = NULL;
+BOOL    smtp_rcpt_prefetch     = FALSE;
 uschar *smtp_read_error        = US"";
+int     smtp_receive_buffer_size = 8192;
 int     smtp_receive_timeout   = 5*60;
 uschar *smtp_receive_timeout_s = NULL;
 uschar *smtp_reserve_hosts     = NULL;
@@ -1485,8 +1589,10 @@ int     smtp_rlr_base          = 0;
 double  smtp_rlr_factor        = 0.0;
 int     smtp_rlr_limit         = 0;
 int     smtp_rlr_threshold     = INT_MAX;
+int     smtp_screen_table_size = 0;
 #ifdef SUPPORT_I18N
 uschar *smtputf8_advertise_hosts = US"*";	/* overridden under test-harness */
+int     smtputf8_domain_cache_size = 100;
 #endif
 
 #ifdef WITH_CONTENT_SCAN
@@ -1509,9 +1615,19 @@ uschar *spf_smtp_comment_template
 
 #endif
 
+uschar *spool_body_hash        = NULL;
+struct timeval spool_commit_taken = { 0, 0 };
+#ifdef SUPPORT_ZSTD
+int     spool_compress_min_size = 0;
+#endif
 FILE   *spool_data_file	       = NULL;
+int     spool_dedup_min_size   = 0;
 uschar *spool_directory        = US SPOOL_DIRECTORY
                            "\0<--------------Space to patch spool_directory->";
+off_t   spool_file_compressed  = 0;
+int     spool_stripe_count     = 0;
+const uschar **spool_stripe_dirs = NULL;
+uschar *spool_stripes          = NULL;
 #ifdef EXPERIMENTAL_SRS_ALT
 uschar *srs_config             = NULL;
 uschar *srs_db_address         = NULL;
@@ -1528,6 +1644,7 @@ uschar *srs_status             = NULL;
 #ifdef SUPPORT_SRS
 uschar *srs_recipient          = NULL;
 #endif
+pid_t   store_stats_pid        = (pid_t)0;
 int     string_datestamp_offset= -1;
 int     string_datestamp_length= 0;
 int     string_datestamp_type  = -1;
@@ -1535,6 +1652,8 @@ const uschar *submission_domain = NULL;
 const uschar *submission_name  = NULL;
 int     syslog_facility        = LOG_MAIL;
 uschar *syslog_processname     = US"exim";
+int     syslog_queue_size      = 64;
+uschar *syslog_socket          = NULL;
 uschar *system_filter          = NULL;
 
 uschar *system_filter_directory_transport = NULL;
@@ -1576,6 +1695,7 @@ transport_instance  transport_defaults = {
     .max_addresses =		100,
     .connection_max_messages =	500,
     .deliver_as_creator =	FALSE,
+    .batch_per_address =	FALSE,
     .disable_logging =		FALSE,
     .initgroups =		FALSE,
     .uid_set =			FALSE,
@@ -1588,6 +1708,9 @@ transport_instance  transport_defaults = {
     .shadow =			NULL,
     .shadow_condition =		NULL,
     .filter_command =		NULL,
+#ifdef EXPAND_DLFUNC
+    .filter_dlfunc =		NULL,
+#endif
     .add_headers =		NULL,
     .remove_headers =		NULL,
     .return_path =		NULL,
@@ -1612,10 +1735,16 @@ transport_instance  transport_defaults = {
     .retry_use_local_part =	TRUE_UNSET,	/* retry_use_local_part: BOOL, but set neither
 						 1 nor 0 so can detect unset */
 #ifndef DISABLE_EVENT
-   .event_action =		NULL
+   .event_action =		NULL,
+   .event_types =		NULL,
+   .event_mask =		0
 #endif
 };
 
+uschar *trace_log_path         = NULL;
+trace_item *trace_ring         = NULL;
+int     trace_ring_size        = 0;
+
 int     transport_count;
 uschar *transport_name          = NULL;
 int     transport_newlines;
@@ -1624,9 +1753,9 @@ int     transport_filter_timeout;
 int     transport_write_timeout= 0;
 
 tree_node  *tree_dns_fails     = NULL;
-tree_node  *tree_duplicates    = NULL;
-tree_node  *tree_nonrecipients = NULL;
-tree_node  *tree_unusable      = NULL;
+tree_hash   tree_duplicates    = { .slots = NULL };
+tree_hash   tree_nonrecipients = { .slots = NULL };
+tree_hash   tree_unusable      = { .slots = NULL };
 
 gid_t  *trusted_groups         = NULL;
 uid_t  *trusted_users          = NULL;
@@ -1661,6 +1790,7 @@ uschar *uucp_from_pattern      = US
 
 uschar *uucp_from_sender       = US"$1";
 
+int     verify_cache_ttl       = 0;
 uschar *verify_mode	       = NULL;
 uschar *version_copyright      =
  US"Copyright (c) University of Cambridge, 1995 - 2018\n"
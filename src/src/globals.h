@@ -71,6 +71,10 @@ extern uschar *redis_servers;          /* List of servers and connect info */
 #ifdef LOOKUP_SQLITE
 extern uschar *sqlite_dbfile;	       /* Filname for database */
 extern int     sqlite_lock_timeout;    /* Internal lock waiting timeout */
+extern int     sqlite_mmap_size;       /* For PRAGMA mmap_size */
+extern BOOL    sqlite_read_only;       /* Open databases read-only */
+extern BOOL    sqlite_shared_cache;    /* Open with a shared cache */
+extern int     sqlite_statement_cache; /* Prepared statements kept per database */
 #endif
 
 #ifdef SUPPORT_MOVE_FROZEN_MESSAGES
@@ -114,6 +118,7 @@ typedef struct {
 #endif
   BOOL	  verify_override:1;	/* certificate_verified only due to tls_try_verify_hosts */
   BOOL	  ext_master_secret:1;	/* extended-master-secret was used */
+  unsigned ktls:2;		/* records handled by kernel TLS; KTLS_TX, KTLS_RX */
 } tls_support;
 extern tls_support tls_in;
 extern tls_support tls_out;
@@ -121,6 +126,8 @@ extern tls_support tls_out;
 #ifndef DISABLE_TLS
 extern BOOL    gnutls_compat_mode;     /* Less security, more compatibility */
 extern BOOL    gnutls_allow_auto_pkcs11; /* Let GnuTLS autoload PKCS11 modules */
+extern BOOL    openssl_async;          /* Asynchronous handshakes, for engines */
+extern uschar *openssl_engine;         /* OpenSSL engine to use by default */
 extern uschar *openssl_options;        /* OpenSSL compatibility options */
 extern const pcre *regex_STARTTLS;     /* For recognizing STARTTLS settings */
 extern uschar *tls_certificate;        /* Certificate file */
@@ -129,14 +136,24 @@ extern int     tls_dh_max_bits;        /* don't accept higher lib suggestions */
 extern uschar *tls_dhparam;            /* DH param file */
 extern uschar *tls_eccurve;            /* EC curve */
 # ifndef DISABLE_OCSP
+extern int     tls_ocsp_cache_size;    /* Slots in verified-OCSP cache */
 extern uschar *tls_ocsp_file;          /* OCSP stapling proof file */
+extern BOOL    tls_ocsp_refresh;       /* Daemon fetches OCSP responses */
 # endif
 extern uschar *tls_privatekey;         /* Private key file */
 extern BOOL    tls_remember_esmtp;     /* For YAEB */
 extern uschar *tls_require_ciphers;    /* So some can be avoided */
 # ifndef DISABLE_TLS_RESUME
+extern int     tls_resumption_cache_size; /* Slots in shared session cache */
 extern uschar *tls_resumption_hosts;   /* TLS session resumption */
 # endif
+extern BOOL    tls_server_preload;     /* Daemon builds server contexts */
+extern uschar *tls_server_preload_sni; /* and for these SNI names */
+# ifndef DISABLE_TLS_RESUME
+extern uschar *tls_ticket_key_file;    /* Shared secret for session tickets */
+extern int     tls_ticket_key_overlap; /* Older ticket keys still accepted */
+extern int     tls_ticket_key_rotate;  /* Ticket key lifetime */
+# endif
 extern uschar *tls_try_verify_hosts;   /* Optional client verification */
 extern uschar *tls_verify_certificates;/* Path for certificates to check */
 extern uschar *tls_verify_hosts;       /* Mandatory client verification */
@@ -157,6 +174,7 @@ extern int (*lwr_receive_ungetc)(int);
 extern int (*receive_getc)(unsigned);
 extern uschar * (*receive_getbuf)(unsigned *);
 extern void (*receive_get_cache)(void);
+extern uschar * (*receive_peekbuf)(unsigned *);
 extern int (*receive_ungetc)(int);
 extern int (*receive_feof)(void);
 extern int (*receive_ferror)(void);
@@ -270,6 +288,7 @@ extern struct global_flags {
  BOOL   smtp_in_pipelining_advertised	:1; /* server advertised PIPELINING */
  BOOL   smtp_in_pipelining_used		:1; /* server noted client using PIPELINING */
  BOOL   smtp_in_quit			:1; /* server noted QUIT command */
+ BOOL   spool_file_dotfree		:1; /* wireformat -D file has no line starting with "." */
  BOOL   spool_file_wireformat		:1; /* current -D file has CRLF rather than NL */
  BOOL   submission_mode			:1; /* Can be forced from ACL */
  BOOL   suppress_local_fixups		:1; /* Can be forced from ACL */
@@ -338,6 +357,7 @@ extern uschar *acl_wherecodes[];       /* Response codes for ACL fails */
 extern uschar *acl_wherenames[];       /* Names for messages */
 extern address_item *addr_duplicate;   /* Duplicate address list */
 extern address_item address_defaults;  /* Default data for address item */
+extern const address_item_cold address_cold_empty; /* For addresses without */
 extern uschar *address_file;           /* Name of file when delivering to one */
 extern uschar *address_pipe;           /* Pipe command when delivering to one */
 extern tree_node *addresslist_anchor;  /* Tree of defined address lists */
@@ -385,6 +405,7 @@ extern uschar *bmi_verdicts;           /* BASE64-encoded verdicts with recipient
 #endif
 extern int     bsmtp_transaction_linecount; /* Start of last transaction */
 extern int     body_8bitmime;          /* sender declared BODY= ; 7=7BIT, 8=8BITMIME */
+extern BOOL    bounce_in_process;      /* Receive bounces without exec */
 extern uschar *bounce_message_file;    /* Template file */
 extern uschar *bounce_message_text;    /* One-liner */
 extern uschar *bounce_recipient;       /* When writing an errmsg */
@@ -399,6 +420,8 @@ extern int     callout_cache_domain_positive_expire; /* Time for positive domain
 extern int     callout_cache_domain_negative_expire; /* Time for negative domain callout cache records to expire */
 extern int     callout_cache_positive_expire; /* Time for positive callout cache records to expire */
 extern int     callout_cache_negative_expire; /* Time for negative callout cache records to expire */
+extern int     callout_cache_write_batch; /* Callout cache records to hold before writing */
+extern int     callout_keep_idle;      /* Keep callout connections this long for reuse */
 extern uschar *callout_random_local_part; /* Local part to be used to check if server called will accept any local part */
 extern uschar *check_dns_names_pattern;/* Regex for syntax check */
 extern int     check_log_inodes;       /* Minimum for message acceptance */
@@ -420,13 +443,19 @@ extern int     connection_max_messages;/* Max down one SMTP connection */
 extern FILE   *config_file;            /* Configuration file */
 extern const uschar *config_filename;  /* Configuration file name */
 extern gid_t   config_gid;             /* Additional group owner */
+extern unsigned config_hash;           /* Hash of the logical config lines */
 extern int     config_lineno;          /* Line number */
 extern uschar *config_main_filelist;   /* List of possible config files */
 extern uschar *config_main_filename;   /* File name actually used */
 extern uschar *config_main_directory;  /* Directory where the main config file was found */
+extern BOOL    config_snapshot;        /* Daemon writes preprocessed config */
 extern uid_t   config_uid;             /* Additional owner */
+#ifdef WITH_CONTENT_SCAN
+extern BOOL    content_scan_direct;    /* Scanners read from the spool, not a .eml copy */
+#endif
 extern uschar *continue_proxy_cipher;  /* TLS cipher for proxied continued delivery */
 extern BOOL    continue_proxy_dane;    /* proxied conn is DANE */
+extern BOOL    continue_proxy_ktls;    /* conn is kernel TLS, with no proxy */
 extern uschar *continue_proxy_sni;     /* proxied conn SNI */
 extern uschar *continue_hostname;      /* Host for continued delivery */
 extern uschar *continue_host_address;  /* IP address for ditto */
@@ -440,6 +469,7 @@ typedef struct {
   unsigned     delivery:1;             /* When to attempt */
   unsigned     defer_pass:1;           /* Pass 4xx to caller rather than spooling */
   unsigned     is_tls:1;	       /* Conn has TLS active */
+  unsigned     partial:1;	       /* Only some of several conns accepted */
   client_conn_ctx cctx;                /* Open connection */
   int          nrcpt;                  /* Count of addresses */
   uschar *     transport;	       /* Name of transport */
@@ -451,8 +481,16 @@ typedef struct {
   address_item addr;                   /* (Chain of) addresses */
 } cut_t;
 extern cut_t cutthrough;               /* Deliver-concurrently */
+extern int     cutthrough_max_connections; /* Destinations one message may cut through to */
 
+extern BOOL    daemon_config_readonly; /* Write-protect config after startup */
+extern BOOL    daemon_delivery_helper; /* Root helper forks deliveries */
+extern int     daemon_delivery_helper_max; /* Limit on its deliveries */
 extern int     daemon_notifier_fd;     /* Unix socket for notifications */
+extern int     daemon_park_max;        /* Delayed connections the daemon holds */
+extern int     daemon_park_served;     /* Connect ACL delay already served */
+extern int     daemon_prefork_sessions; /* Sessions per prefork worker */
+extern int     daemon_prefork_workers; /* Size of prefork worker pool */
 extern uschar *daemon_smtp_port;       /* Can be a list of ports */
 extern int     daemon_startup_retries; /* Number of times to retry */
 extern int     daemon_startup_sleep;   /* Sleep between retries */
@@ -473,10 +511,13 @@ extern int     debug_options_count;    /* Size of table */
 extern BOOL    debug_store;	       /* Do extra checks on store_reset */
 extern int     delay_warning[];        /* Times between warnings */
 extern uschar *delay_warning_condition; /* Condition string for warnings */
+extern int     delivery_buffer_size;   /* Size of the delivery copy buffers */
+extern int     delivery_buffer_size_max; /* ... largest for a big message */
 extern BOOL    delivery_date_remove;   /* Remove delivery-date headers */
 
 extern uschar *deliver_address_data;   /* Arbitrary data for an address */
 extern int     deliver_datafile;       /* FD for data part of message */
+extern int     deliver_datafile_lock;  /* FD holding the lock, when deliver_datafile is a copy */
 extern const uschar *deliver_domain;   /* The local domain for delivery */
 extern uschar *deliver_domain_data;    /* From domain lookup */
 extern const uschar *deliver_domain_orig; /* The original local domain for delivery */
@@ -489,6 +530,7 @@ extern const uschar *deliver_host;     /* (First) host for routed local deliveri
 extern const uschar *deliver_host_address; /* Address for remote delivery filter */
 extern int     deliver_host_port;      /* Address for remote delivery filter */
 extern uschar *deliver_in_buffer;      /* Buffer for copying file */
+extern int     deliver_in_buffer_size; /* ... and its size */
 extern ino_t   deliver_inode;          /* Inode for appendfile */
 extern uschar *deliver_localpart;      /* The local part for delivery */
 extern uschar *deliver_localpart_data; /* From local part lookup (de-tainted) */
@@ -499,6 +541,7 @@ extern uschar *deliver_localpart_prefix_v; /* The stripped-prefix variable porti
 extern uschar *deliver_localpart_suffix; /* The stripped suffix, if any */
 extern uschar *deliver_localpart_suffix_v; /* The stripped-suffix variable portion, if any */
 extern uschar *deliver_out_buffer;     /* Buffer for copying file */
+extern int     deliver_out_buffer_size; /* ... and its size */
 extern int     deliver_queue_load_max; /* Different value for queue running */
 extern address_item *deliver_recipients; /* Current set of addresses */
 extern uschar *deliver_selectstring;   /* For selecting by recipient */
@@ -509,10 +552,13 @@ extern BOOL    disable_fsync;          /* Not for normal use */
 extern BOOL    disable_ipv6;           /* Don't do any IPv6 things */
 
 #ifndef DISABLE_DKIM
+extern uschar *dkim_bodyhashes;        /* Body hashes kept with the message, for signing */
 extern unsigned dkim_collect_input;    /* Runtime count of dkim signtures; tracks whether SMTP input is fed to DKIM validation */
 extern uschar *dkim_cur_signer;        /* Expansion variable, holds the current "signer" domain or identity during a acl_smtp_dkim run */
 extern int     dkim_key_length;        /* Expansion variable, length of signing key in bits */
+extern uschar *dkim_preload_keys;      /* Signing key files for the daemon to parse at startup */
 extern void   *dkim_signatures;	       /* Actually a (pdkim_signature *) but most files do not need to know */
+extern uschar *dkim_sign_bodyhashes;   /* Body hashes to compute on receipt, for signing */
 extern uschar *dkim_signers;           /* Expansion variable, holds colon-separated list of domains and identities that have signed a message */
 extern uschar *dkim_signing_domain;    /* Expansion variable, domain used for signing a message. */
 extern uschar *dkim_signing_selector;  /* Expansion variable, selector used for signing a message. */
@@ -536,10 +582,12 @@ extern uschar *dmarc_used_domain;      /* Expansion variable, domain libopendmar
 #endif
 
 extern uschar *dns_again_means_nonexist; /* Domains that are badly set up */
+extern int     dns_cache_size;         /* Entries in shared DNS cache */
 extern int     dns_csa_search_limit;   /* How deep to search for CSA SRV records */
 extern BOOL    dns_csa_use_reverse;    /* Check CSA in reverse DNS? (non-standard) */
 extern int     dns_cname_loops;	       /* Follow CNAMEs returned by resolver to this depth */
 extern uschar *dns_ipv4_lookup;        /* For these domains, don't look for AAAA (or A6) */
+extern BOOL    dns_parallel_lookups;   /* Send host address lookups together */
 #ifdef SUPPORT_DANE
 extern int     dns_dane_ok;            /* Ok to use DANE when checking TLS authenticity */
 #endif
@@ -573,6 +621,7 @@ extern uschar *event_action;           /* expansion for delivery events */
 extern uschar *event_data;	       /* event data */
 extern int     event_defer_errno;      /* error number set when a remote delivery is deferred with a host error */
 extern const uschar *event_name;       /* event classification */
+extern uschar *event_types;            /* events for which event_action is expanded */
 #endif
 
 extern gid_t   exim_gid;               /* To be used with exim_uid */
@@ -597,10 +646,12 @@ extern int     filter_test;            /* Filter test type */
 extern uschar *filter_test_sfile;      /* System filter test file */
 extern uschar *filter_test_ufile;      /* User filter test file */
 extern uschar *filter_thisaddress;     /* For address looping */
+extern int     finduser_cache_ttl;     /* How long to keep passwd/group results */
 extern int     finduser_retries;       /* Retry count for getpwnam() */
 extern uid_t   fixed_never_users[];    /* Can't be overridden */
 extern uschar *freeze_tell;            /* Message on (some) freezings */
 extern uschar *freeze_tell_config;     /* The configured setting */
+extern BOOL    fsync_group_commit;     /* Share file system syncs */
 extern uschar *fudged_queue_times;     /* For use in test harness */
 
 extern uschar *gecos_name;             /* To be expanded when pattern matches */
@@ -622,6 +673,10 @@ extern uschar *helo_lookup_domains;    /* If these given, lookup host name */
 extern uschar *helo_try_verify_hosts;  /* Soft check HELO argument for these */
 extern uschar *helo_verify_hosts;      /* Hard check HELO argument for these */
 extern const uschar *hex_digits;             /* Used in several places */
+extern int     hints_db_shards;        /* Split hints databases into this many files */
+extern uschar *hints_shared_databases; /* Hints databases shared via the server */
+extern uschar *hints_shared_server;    /* Server for sharing hints between hosts */
+extern int     hints_shared_ttl;       /* Trust local copies of shared hints this long */
 extern uschar *hold_domains;           /* Hold up deliveries to these */
 extern uschar *host_data;              /* Obtained from lookup in ACL */
 extern uschar *host_lookup;            /* For which IP addresses are always looked up */
@@ -645,6 +700,7 @@ extern uschar *initial_cwd;            /* The directory we where in at startup *
 extern uschar *iterate_item;           /* Item from iterate list */
 
 extern int     journal_fd;             /* Fd for journal file */
+extern BOOL    json_cache;             /* Keep parsed JSON lookup files */
 
 extern uschar *keep_environment;       /* Whitelist for environment variables */
 extern int     keep_malformed;         /* Time to keep malformed messages */
@@ -655,6 +711,7 @@ extern BOOL    local_from_check;       /* For adding Sender: (global value) */
 extern uschar *local_from_prefix;      /* Permitted prefixes */
 extern uschar *local_from_suffix;      /* Permitted suffixes */
 extern uschar *local_interfaces;       /* For forcing specific interfaces */
+extern int     local_max_parallel;     /* Maximum parallel local deliveries */
 #ifdef HAVE_LOCAL_SCAN
 extern uschar *local_scan_data;        /* Text returned by local_scan() */
 extern optionlist local_scan_options[];/* Option list for local_scan() */
@@ -669,6 +726,7 @@ extern int     localpartlist_count;    /* Number defined */
 extern uschar *log_buffer;             /* For constructing log entries */
 extern int     log_default[];          /* Initialization list for log_selector */
 extern uschar *log_file_path;          /* If unset, use default */
+extern uschar *log_json_socket;        /* For structured log records */
 extern int     log_notall[];           /* Log options excluded from +all */
 extern bit_table log_options[];        /* Table of options */
 extern int     log_options_count;      /* Size of table */
@@ -677,18 +735,24 @@ extern unsigned int log_selector[];    /* Bit map of logging options */
 extern uschar *log_selector_string;    /* As supplied in the config */
 extern FILE   *log_stderr;             /* Copy of stderr for log use, or NULL */
 extern BOOL    log_timezone;           /* TRUE to include the timezone in log lines */
+extern BOOL    lsearch_index;          /* Index lsearch files in memory */
 extern uschar *login_sender_address;   /* The actual sender address */
 extern lookup_info **lookup_list;      /* Array of pointers to available lookups */
 extern int     lookup_list_count;      /* Number of entries in the list */
 extern uschar *lookup_dnssec_authenticated; /* AD status of dns lookup */
 extern int     lookup_open_max;        /* Max lookup files to cache */
+extern uschar *lookup_proxy_socket;    /* Socket for SQL lookup helpers */
+extern int     lookup_proxy_workers;   /* Number of SQL lookup helpers */
 extern uschar *lookup_value;           /* Value looked up from file */
 
 extern macro_item *macros;             /* Configuration macros */
 extern macro_item *macros_user;        /* Non-builtin configuration macros */
 extern macro_item *mlast;              /* Last item in macro list */
 extern uschar *mailstore_basename;     /* For mailstore deliveries */
+extern int     mainlog_buffer_size;    /* Hold main log lines for writing together */
+extern BOOL    mainlog_index;          /* Index the main log by message ID */
 #ifdef WITH_CONTENT_SCAN
+extern uschar *malware_cache_version;  /* Scanner version for the verdict cache */
 extern uschar *malware_name;           /* Name of virus or malware ("W32/Klez-H") */
 #endif
 extern int     max_received_linelength;/* What it says */
@@ -705,8 +769,11 @@ extern uschar  message_id_option[];    /* -E<message-id> for use as option */
 extern uschar *message_id_external;    /* External form of following */
 extern uschar *message_id_domain;      /* Expanded to form domain-part of message_id */
 extern uschar *message_id_text;        /* Expanded to form message_id */
+extern BOOL    message_id_sequence;    /* Allocate id time slots; no wait */
 extern struct timeval message_id_tv;   /* Time used to create last message_id */
 extern int     message_linecount;      /* As it says */
+extern int     message_priority;       /* Priority class for queue runs */
+extern struct rusage message_rusage_start; /* Resources used when the message was started */
 extern BOOL    message_logs;           /* TRUE to write message logs */
 extern int     message_size;           /* Size of message */
 extern uschar *message_size_limit;     /* As it says */
@@ -736,6 +803,7 @@ extern int     mime_is_multipart;
 extern int     mime_is_coverletter;
 extern int     mime_is_rfc822;
 extern int     mime_part_count;
+extern gstring *mime_part_hashes;      /* Content hashes for the malware verdict cache */
 #endif
 
 extern BOOL    mua_wrapper;            /* TRUE when Exim is wrapping an MUA */
@@ -765,10 +833,12 @@ extern uschar *percent_hack_domains;   /* Local domains for which '% operates */
 extern uschar *pid_file_path;          /* For writing daemon pids */
 #ifndef DISABLE_PIPE_CONNECT
 extern uschar *pipe_connect_advertise_hosts; /* for banner/EHLO pipelining */
+extern int     pipe_connect_cache_size; /* Slots in shared EHLO-response cache */
 #endif
 extern uschar *pipelining_advertise_hosts; /* As it says */
 #ifndef DISABLE_PRDR
 extern BOOL    prdr_enable;            /* As it says */
+extern int     prdr_max_parallel;      /* Concurrent PRDR ACL subprocesses */
 extern BOOL    prdr_requested;         /* Connecting mail server wants PRDR */
 #endif
 extern BOOL    preserve_message_logs;  /* Save msglog files */
@@ -779,6 +849,8 @@ extern int     process_info_len;
 extern uschar *process_log_path;       /* Alternate path */
 extern const uschar *process_purpose;  /* for debug output */
 extern BOOL    prod_requires_admin;    /* TRUE if prodding requires admin */
+extern int     profile_sample;         /* Profile one in this many processes */
+extern BOOL    profiling;              /* This process is being profiled */
 
 #if defined(SUPPORT_PROXY) || defined(SUPPORT_SOCKS)
 extern uschar *hosts_proxy;            /* Hostlist which (require) use proxy protocol */
@@ -799,6 +871,9 @@ extern uschar *queue_domains;          /* Queue these domains */
 #ifndef DISABLE_QUEUE_RAMP
 extern BOOL    queue_fast_ramp;        /* 2-phase queue-run overlap */
 #endif
+extern int     queue_first_pass_workers; /* Processes for a -qq first phase */
+extern BOOL    queue_index;            /* Daemon maintains a queue index */
+extern int     queue_index_rescan;     /* Interval for rebuilding it */
 extern BOOL    queue_list_requires_admin; /* TRUE if -bp requires admin */
                                        /*   immediate children */
 extern pid_t   queue_run_pid;          /* PID of the queue running process or 0 */
@@ -807,17 +882,29 @@ extern int     queue_interval;         /* Queue running interval */
 extern uschar *queue_name;             /* Name of queue, if nondefault spooling */
 extern uschar *queue_name_dest;	       /* Destination queue, for moving messages */
 extern BOOL    queue_only;             /* TRUE to disable immediate delivery */
+extern int     queue_only_deliveries;  /* Max daemon deliveries before auto-queue */
 extern int     queue_only_load;        /* Max load before auto-queue */
 extern BOOL    queue_only_load_latch;  /* Latch queue_only_load TRUE */
 extern uschar *queue_only_file;        /* Queue if file exists/not-exists */
 extern BOOL    queue_only_override;    /* Allow override from command line */
+extern uschar *queue_priority_classes; /* Weights of priority classes */
+#ifdef EXIM_HAVE_CPU_AFFINITY
+extern uschar *queue_run_cpus;         /* CPUs for queue runners */
+#endif
+extern BOOL    queue_retry_index;      /* Skip messages not yet due */
+extern BOOL    queue_run_by_host;      /* Group the run by next hop */
 extern BOOL    queue_run_in_order;     /* As opposed to random */
 extern uschar *queue_run_max;          /* Max queue runners */
+extern int     queue_run_parallel;     /* Deliveries at once per runner */
+extern int     queue_run_persistent;   /* Queue runners kept between runs */
 extern unsigned queue_size;            /* items in queue */
 extern time_t  queue_size_next;        /* next time to evaluate queue_size */
+extern uschar *queue_size_lanes;       /* Size limits of queue run lanes */
 extern uschar *queue_smtp_domains;     /* Ditto, for these domains */
+extern BOOL    queue_summary;          /* Keep a summary file for -bp */
 
 extern unsigned int random_seed;       /* Seed for random numbers */
+extern int     ratelimit_cache_size;   /* Entries in shared ratelimit table */
 extern tree_node *ratelimiters_cmd;    /* Results of command ratelimit checks */
 extern tree_node *ratelimiters_conn;   /* Results of connection ratelimit checks */
 extern tree_node *ratelimiters_mail;   /* Results of per-mail ratelimit checks */
@@ -829,6 +916,8 @@ extern const uschar * rc_names[];      /* Mostly for debug output */
 extern int     rcpt_count;             /* Count of RCPT commands in a message */
 extern int     rcpt_fail_count;        /* Those that got 5xx */
 extern int     rcpt_defer_count;       /* Those that got 4xx */
+extern int     readfile_cache_size;    /* Limit for cached ${readfile} data */
+extern uschar *readfile_preload;       /* Files for the daemon to cache */
 extern gid_t   real_gid;               /* Real gid */
 extern uid_t   real_uid;               /* Real user running program */
 extern int     receive_linecount;      /* Mainly for BSMTP errors */
@@ -847,6 +936,7 @@ extern int     recipients_list_max;    /* Maximum number fitting in list */
 extern int     recipients_max;         /* Max permitted */
 extern BOOL    recipients_max_reject;  /* If TRUE, reject whole message */
 extern const pcre *regex_AUTH;         /* For recognizing AUTH settings */
+extern int     regex_cache_size;       /* Max compiled patterns kept */
 extern const pcre  *regex_check_dns_names; /* For DNS name checking */
 extern const pcre  *regex_From;        /* For recognizing "From_" lines */
 extern const pcre  *regex_CHUNKING;    /* For recognizing CHUNKING (RFC 3030) */
@@ -865,6 +955,8 @@ extern const pcre  *regex_whitelisted_macro; /* For -D macro values */
 #ifdef WITH_CONTENT_SCAN
 extern uschar *regex_match_string;     /* regex that matched a line (regex ACL condition) */
 #endif
+extern uschar *rejectlog_ratelimit;    /* Reject log entries per reason per period */
+extern int     rejectlog_sample;       /* Write one in this many reject log entries */
 extern int     remote_delivery_count;  /* Number of remote addresses */
 extern int     remote_max_parallel;    /* Maximum parallel delivery */
 extern uschar *remote_sort_domains;    /* Remote domain sorting order */
@@ -880,11 +972,14 @@ extern int     rfc1413_query_timeout;  /* Timeout on RFC 1413 calls */
 /* extern BOOL    rfc821_domains;  */       /* If set, syntax is 821, not 822 => being abolished */
 extern uid_t   root_gid;               /* The gid for root */
 extern uid_t   root_uid;               /* The uid for root */
+extern int     route_cache_ttl;        /* Lifetime of cached routings; 0 = off */
 extern router_info routers_available[];/* Vector of available routers */
 extern router_instance *routers;       /* Chain of instantiated routers */
 extern router_instance router_defaults;/* Default values */
 extern uschar *router_name;            /* Name of router last started */
 extern tree_node *router_var;	       /* Variables set by router */
+extern int     run_coprocess_timeout;  /* Timeout for a ${run} coprocess */
+extern uschar *run_coprocesses;        /* Commands run as coprocesses */
 extern ip_address_item *running_interfaces; /* Host's running interfaces */
 extern uschar *running_status;         /* Flag string for testing */
 extern int     runrc;                  /* rc from ${run} */
@@ -919,12 +1014,14 @@ extern const uschar *sigalarm_setter;  /* For debug, set to callpoint of alarm()
 extern uschar **sighup_argv;           /* Args for re-execing after SIGHUP */
 extern int     slow_lookup_log;        /* Log DNS lookups taking longer than N millisecs */
 extern int     smtp_accept_count;      /* Count of connections */
+extern int     smtp_accept_host_count; /* Count of connections from this host */
 extern BOOL    smtp_accept_keepalive;  /* Set keepalive on incoming */
 extern int     smtp_accept_max;        /* Max SMTP connections */
 extern int     smtp_accept_max_nonmail;/* Max non-mail commands in one con */
 extern uschar *smtp_accept_max_nonmail_hosts; /* Limit non-mail cmds from these hosts */
 extern int     smtp_accept_max_per_connection; /* Max msgs per connection */
 extern uschar *smtp_accept_max_per_host; /* Max SMTP cons from one IP addr */
+extern int     smtp_accept_network_count; /* Count of connections from this network */
 extern int     smtp_accept_queue;      /* Queue after so many connections */
 extern int     smtp_accept_queue_per_connection; /* Queue after so many msgs */
 extern int     smtp_accept_reserve;    /* Reserve these SMTP connections */
@@ -937,6 +1034,13 @@ extern uschar *smtp_cmd_buffer;        /* SMTP command buffer */
 extern struct timeval smtp_connection_start; /* Start time of SMTP connection */
 extern uschar  smtp_connection_had[];  /* Recent SMTP commands */
 extern int     smtp_connect_backlog;   /* Max backlog permitted */
+extern uschar *smtp_connection_cache;  /* Socket for idle outbound connections */
+extern int     smtp_connection_cache_limit; /* Idle connections kept per host */
+extern int     smtp_connection_cache_timeout; /* and how long for */
+#ifdef EXIM_HAVE_CPU_AFFINITY
+extern uschar *smtp_cpus;              /* CPUs for SMTP connection processes */
+extern BOOL    smtp_cpus_follow_incoming; /* Prefer the connection's NUMA node */
+#endif
 extern double  smtp_delay_mail;        /* Current MAIL delay */
 extern double  smtp_delay_rcpt;        /* Current RCPT delay */
 extern BOOL    smtp_enforce_sync;      /* Enforce sync rules */
@@ -953,7 +1057,9 @@ extern FILE   *smtp_out;               /* Incoming SMTP output file */
 extern uschar *smtp_ratelimit_hosts;   /* Rate limit these hosts */
 extern uschar *smtp_ratelimit_mail;    /* Parameters for MAIL limiting */
 extern uschar *smtp_ratelimit_rcpt;    /* Parameters for RCPT limiting */
+extern BOOL    smtp_rcpt_prefetch;     /* Look up domains of pipelined RCPTs together */
 extern uschar *smtp_read_error;        /* Message for SMTP input error */
+extern int     smtp_receive_buffer_size; /* Size of the SMTP input buffer */
 extern int     smtp_receive_timeout;   /* Applies to each received line */
 extern uschar *smtp_receive_timeout_s; /* ... expandable version */
 extern uschar *smtp_reserve_hosts;     /* Hosts for reserved slots */
@@ -966,10 +1072,12 @@ extern int     smtp_rlr_base;          /* Base interval for RCPT rate limit */
 extern double  smtp_rlr_factor;        /* Factor for RCPT rate limit */
 extern int     smtp_rlr_limit;         /* Max delay */
 extern int     smtp_rlr_threshold;     /* Threshold for RCPT rate limit */
+extern int     smtp_screen_table_size; /* Entries in shared IP screen table */
 extern unsigned smtp_peer_options;     /* Global flags for passed connections */
 extern unsigned smtp_peer_options_wrap; /* stacked version hidden by TLS */
 #ifdef SUPPORT_I18N
 extern uschar *smtputf8_advertise_hosts; /* ingress control */
+extern int     smtputf8_domain_cache_size; /* Cached IDNA domain conversions */
 #endif
 
 #ifdef WITH_CONTENT_SCAN
@@ -991,8 +1099,19 @@ extern uschar *spf_smtp_comment_template;
                                        /* template to construct the spf comment by libspf2 */
 #endif
 extern BOOL    split_spool_directory;  /* TRUE to use multiple subdirs */
+extern uschar *spool_body_hash;        /* Hash of a shareable -D file's body */
+extern struct timeval spool_commit_taken; /* Interval taken to make the spool files safe */
+#ifdef SUPPORT_ZSTD
+extern int     spool_compress_min_size; /* Smallest data for compressing -D files */
+#endif
 extern FILE   *spool_data_file;	       /* handle for -D file */
+extern int     spool_dedup_min_size;   /* Smallest body for sharing -D files */
 extern uschar *spool_directory;        /* Name of spool directory */
+extern off_t   spool_file_compressed;  /* Uncompressed data size of a compressed -D file */
+extern BOOL    spool_header_binary;    /* write binary-format -H files */
+extern int     spool_stripe_count;     /* Number of spool_stripes entries */
+extern const uschar **spool_stripe_dirs; /* The spool_stripes directories */
+extern uschar *spool_stripes;          /* Directories over which messages are spread */
 extern BOOL    spool_wireformat;       /* can write wireformat -D files */
 #ifdef EXPERIMENTAL_SRS_ALT
 extern uschar *srs_config;             /* SRS config secret:max age:hash length:use timestamp:use hash */
@@ -1012,6 +1131,7 @@ extern BOOL    srs_usetimestamp;       /* SRS use timestamp flag */
 #ifdef SUPPORT_SRS
 extern uschar *srs_recipient;          /* SRS recipient */
 #endif
+extern pid_t   store_stats_pid;        /* Process due to report store use at exit */
 extern BOOL    strict_acl_vars;        /* ACL variables have to be set before being used */
 extern int     string_datestamp_offset;/* After insertion by string_format */
 extern int     string_datestamp_length;/* After insertion by string_format */
@@ -1024,6 +1144,8 @@ extern BOOL    syslog_duplication;     /* FALSE => no duplicate logging */
 extern int     syslog_facility;        /* As defined by Syslog.h */
 extern BOOL    syslog_pid;             /* TRUE if PID on syslogs */
 extern uschar *syslog_processname;     /* 'ident' param to openlog() */
+extern int     syslog_queue_size;      /* Lines held when syslog_socket is busy */
+extern uschar *syslog_socket;          /* Unix socket for native syslog writes */
 extern BOOL    syslog_timestamp;       /* TRUE if time on syslogs */
 extern uschar *system_filter;          /* Name of system filter file */
 
@@ -1050,6 +1172,10 @@ extern int     timeout_frozen_after;   /* Max time to keep frozen messages */
 extern struct timeval timestamp_startup; /* For development measurements */
 #endif
 
+extern uschar *trace_log_path;         /* Where the trace ring is written */
+extern trace_item *trace_ring;         /* Recent events, if wanted */
+extern int     trace_ring_size;        /* Number of events kept */
+
 extern uschar *transport_name;         /* Name of transport last started */
 extern int     transport_count;        /* Count of bytes transported */
 extern int     transport_newlines;     /* Accurate count of number of newline chars transported */
@@ -1063,9 +1189,9 @@ extern transport_instance transport_defaults; /* Default values */
 extern int     transport_write_timeout;/* Set to time out individual writes */
 
 extern tree_node *tree_dns_fails;      /* Tree of DNS lookup failures */
-extern tree_node *tree_duplicates;     /* Tree of duplicate addresses */
-extern tree_node *tree_nonrecipients;  /* Tree of nonrecipient addresses */
-extern tree_node *tree_unusable;       /* Tree of unusable addresses */
+extern tree_hash tree_duplicates;      /* Table of duplicate addresses */
+extern tree_hash tree_nonrecipients;   /* Table of nonrecipient addresses */
+extern tree_hash tree_unusable;        /* Table of unusable addresses */
 
 extern gid_t  *trusted_groups;         /* List of trusted groups */
 extern uid_t  *trusted_users;          /* List of trusted users */
@@ -1082,6 +1208,7 @@ extern uschar *warnmsg_delay;          /* String form of delay time */
 extern uschar *warnmsg_recipients;     /* Recipients of warning message */
 extern BOOL    write_rejectlog;        /* Control of reject logging */
 
+extern int     verify_cache_ttl;       /* Lifetime of shared verify results; 0 = off */
 extern uschar *verify_mode;	       /* Running a router in verify mode */
 extern uschar *version_copyright;      /* Copyright notice */
 extern uschar *version_date;           /* Date of compilation */
@@ -10,6 +10,170 @@
 #include "exim.h"
 
 
+/*************************************************
+*            Index of header names               *
+*************************************************/
+
+/* Messages can have hundreds of header lines, and a configuration may look
+for headers by name many times, so rather than scanning the chain for each
+lookup, an index of the headers by name is built when it is first needed. It
+holds, for each different name (by hash), the headers with that name in chain
+order. Deleted headers are included, because some callers want them.
+
+The index is for the chain between header_list and header_last as they were
+when it was built, so it is rebuilt whenever either of them changes. Code that
+starts a new chain, or adds headers other than at the end, must call
+header_index_reset(). The index is in malloc store so that it is unaffected by
+store resets. */
+
+typedef struct {
+  unsigned	hash;
+  int		start;		/* in vec; the run ends with NULL */
+} hindex_group;
+
+static header_line *	hindex_list;	/* the chain that was indexed */
+static header_line *	hindex_last;
+static header_line *	hindex_pending;	/* a header with no text yet */
+static BOOL		hindex_valid = FALSE;
+static int		hindex_ngroups;
+static hindex_group *	hindex_groups;
+static header_line **	hindex_vec;
+
+static header_line *	hindex_none = NULL;	/* empty result */
+
+
+/* Find the length of a header name, without any trailing colon and the spaces
+and tabs that are permitted before it. */
+
+static int
+hindex_keylen(const uschar * s, int len)
+{
+while (len > 0 && (s[len-1] == ' ' || s[len-1] == '\t')) len--;
+return len;
+}
+
+static unsigned
+hindex_hash(const uschar * s, int len)
+{
+unsigned h = 2166136261u;				/* FNV-1a */
+while (len-- > 0) h = (h ^ tolower(*s++)) * 16777619u;
+return h;
+}
+
+typedef struct {
+  unsigned	hash;
+  int		pos;
+  header_line *	h;
+} hindex_entry;
+
+static int
+hindex_cmp(const void * a, const void * b)
+{
+const hindex_entry * x = a, * y = b;
+if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+return x->pos - y->pos;
+}
+
+
+void
+header_index_reset(void)
+{
+hindex_valid = FALSE;
+}
+
+
+static void
+header_index_build(void)
+{
+hindex_entry * e;
+int n = 0, count = 0;
+
+for (header_line * h = header_list; h; h = h->next) count++;
+
+if (hindex_groups)
+  {
+  store_free(hindex_groups);
+  store_free(hindex_vec);
+  }
+hindex_groups = store_malloc((count + 1) * sizeof(hindex_group));
+hindex_vec = store_malloc((2 * count + 1) * sizeof(header_line *));
+e = store_malloc((count + 1) * sizeof(hindex_entry));
+
+hindex_pending = NULL;
+for (header_line * h = header_list; h; h = h->next)
+  {
+  uschar * colon;
+  if (!h->text)
+    { if (!hindex_pending) hindex_pending = h; }
+  else if ((colon = Ustrchr(h->text, ':')))
+    {
+    e[n] = (hindex_entry)
+      { .hash = hindex_hash(h->text, hindex_keylen(h->text, colon - h->text)),
+	.pos = n, .h = h };
+    n++;
+    }
+  }
+qsort(e, n, sizeof(hindex_entry), hindex_cmp);
+
+hindex_ngroups = 0;
+for (int i = 0, v = 0; i < n; i++)
+  {
+  if (i == 0 || e[i].hash != e[i-1].hash)
+    {
+    if (i > 0) hindex_vec[v++] = NULL;
+    hindex_groups[hindex_ngroups++] = (hindex_group)
+      { .hash = e[i].hash, .start = v };
+    }
+  hindex_vec[v++] = e[i].h;
+  if (i == n - 1) hindex_vec[v] = NULL;
+  }
+store_free(e);
+
+hindex_list = header_list;
+hindex_last = header_last;
+hindex_valid = TRUE;
+}
+
+
+/* Get the headers that may have a given name. The name may end with a colon,
+which is ignored. The caller must still check each header, because names that
+hash alike are not separated.
+
+Arguments:
+  name      the name
+  len       its length
+
+Returns:    a NULL-terminated vector of headers, in chain order, that includes
+            all those with the name; or NULL if the name cannot be looked up
+            and the chain must be scanned
+*/
+
+header_line **
+header_index_find(const uschar * name, int len)
+{
+unsigned hash;
+int lo, hi;
+
+if (len > 0 && name[len-1] == ':') len--;
+if (memchr(name, ':', len)) return NULL;
+
+if (  !hindex_valid || hindex_list != header_list
+   || hindex_last != header_last
+   || (hindex_pending && hindex_pending->text))
+  header_index_build();
+
+hash = hindex_hash(name, hindex_keylen(name, len));
+for (lo = 0, hi = hindex_ngroups; lo < hi; )
+  {
+  int mid = (lo + hi) / 2;
+  if (hindex_groups[mid].hash < hash) lo = mid + 1; else hi = mid;
+  }
+return lo < hindex_ngroups && hindex_groups[lo].hash == hash
+  ? hindex_vec + hindex_groups[lo].start : &hindex_none;
+}
+
+
+
 /*************************************************
 *         Test a header for matching name        *
 *************************************************/
@@ -190,6 +354,7 @@ for (p = q = gs.s; *p; p = q)
 
   if (!h) header_last = new;
   }
+header_index_reset();
 return new;
 }
 
@@ -280,7 +445,9 @@ header_remove(int occ, const uschar *name)
 {
 int hcount = 0;
 int len = Ustrlen(name);
-for (header_line * h = header_list; h; h = h->next)
+header_line ** hv = header_index_find(name, len);
+
+for (header_line * h = hv ? *hv : header_list; h; h = hv ? *++hv : h->next)
   if (header_testname(h, name, len, TRUE) && (occ <= 0 || ++hcount == occ))
     {
     h->type = htype_old;
@@ -369,6 +536,8 @@ one_pattern_match(uschar *name, int slen, BOOL has_addresses, uschar *pattern)
 {
 BOOL yield = FALSE;
 const pcre *re = NULL;
+header_line ** hv = slen > 0 && name[slen-1] == ':'
+  ? header_index_find(name, slen) : NULL;
 
 /* If the pattern is a regex, compile it. Bomb out if compiling fails; these
 patterns are all constructed internally and should be valid. */
@@ -377,7 +546,8 @@ if (*pattern == '^') re = regex_must_compile(pattern, TRUE, FALSE);
 
 /* Scan for the required header(s) and scan each one */
 
-for (header_line * h = header_list; !yield && h; h = h->next)
+for (header_line * h = hv ? *hv : header_list; !yield && h;
+     h = hv ? *++hv : h->next)
   {
   if (h->type == htype_old || slen > h->slen ||
       strncmpic(name, h->text, slen) != 0)
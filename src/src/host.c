@@ -3040,6 +3040,41 @@ yield = HOST_FIND_FAILED;    /* Default yield */
 dns_init(FALSE, FALSE,       /* Disable qualify_single and search_parents */
 	 dnssec_request || dnssec_require);
 
+#ifndef STAND_ALONE
+/* If there is more than one host, the queries for all of them can be sent at
+once, so that the lookups below mostly find their answers waiting. */
+
+if (dns_parallel_lookups && host != last)
+  {
+  rmark reset_point = store_mark();
+  const uschar ** names;
+  int * types;
+  int max = 0, n = 0;
+
+  for (h = host; h != last->next; h = h->next) max += 2;
+  names = store_get(max * sizeof(uschar *), FALSE);
+  types = store_get(max * sizeof(int), FALSE);
+
+  for (h = host; h != last->next; h = h->next)
+    if (!h->address && string_is_ip_address(h->name, NULL) == 0)
+      {
+# if HAVE_IPV6
+      if (  !disable_ipv6
+	 && !(whichrrs & HOST_FIND_IPV4_ONLY)
+	 && !(  dns_ipv4_lookup
+	     && match_isinlist(h->name, CUSS &dns_ipv4_lookup, 0, NULL, NULL,
+		  MCL_DOMAIN, TRUE, NULL) == OK)
+	 )
+	{ names[n] = h->name; types[n++] = T_AAAA; }
+# endif
+      names[n] = h->name; types[n++] = T_A;
+      }
+
+  dns_prefetch(names, types, n);
+  store_reset(reset_point);
+  }
+#endif
+
 for (h = host; h != last->next; h = h->next)
   {
   if (h->address) continue;  /* Inserted by a multihomed host */
@@ -3241,6 +3276,46 @@ switch (rc)
     return dane_required ? FAIL : DEFER;
   }
 }
+
+
+/* Send the TLSA lookups for a list of hosts together, before the transport
+tries them one by one. Only hosts whose addresses were found with DNSSEC, and
+which are matched by one of the lists of hosts for DANE, are of interest.
+
+Arguments:
+  hostlist      the hosts
+  port          the transport's port, for hosts without their own
+  try_dane      the hosts_try_dane list
+  require_dane  the hosts_require_dane list
+*/
+
+void
+tlsa_prefetch(const host_item * hostlist, int port, const uschar ** try_dane,
+  const uschar ** require_dane)
+{
+rmark reset_point = store_mark();
+const uschar ** names;
+int * types;
+int max = 0, n = 0;
+
+for (const host_item * h = hostlist; h; h = h->next) max++;
+names = store_get(max * sizeof(uschar *), FALSE);
+types = store_get(max * sizeof(int), FALSE);
+
+for (const host_item * h = hostlist; h; h = h->next)
+  if (  h->address && h->dnssec == DS_YES && h->status < hstatus_unusable
+     && (  verify_check_given_host(require_dane, h) == OK
+	|| verify_check_given_host(try_dane, h) == OK
+     )  )
+    {
+    names[n] = string_sprintf("_%d._tcp.%.256s",
+      h->port != PORT_NONE ? h->port : port, h->name);
+    types[n++] = T_TLSA;
+    }
+
+dns_prefetch(names, types, n);
+store_reset(reset_point);
+}
 #endif	/*SUPPORT_DANE*/
 
 
@@ -41,7 +41,7 @@ each time a new feature is added (in a way that doesn't break backward
 compatibility). */
 
 #define LOCAL_SCAN_ABI_VERSION_MAJOR 4
-#define LOCAL_SCAN_ABI_VERSION_MINOR 1
+#define LOCAL_SCAN_ABI_VERSION_MINOR 2
 #define LOCAL_SCAN_ABI_VERSION \
   LOCAL_SCAN_ABI_VERSION_MAJOR.LOCAL_SCAN_ABI_VERSION_MINOR
 
@@ -71,6 +71,24 @@ and third arguments are standard argument count and vector, comprising the
 typedef int exim_dlfunc_t(uschar **yield, int argc, uschar *argv[]);
 
 
+/* A function named by the transport_filter_dlfunc option is called for each
+block of the message, in order, and then once more with NULL data and a zero
+length. It sets *out and *outlen to the data to be written in place of the
+block (which may be the block itself, or none), valid until the next call. The
+state field is NULL at the first call for a message, and is for the function's
+own use. A return other than OK fails the delivery; errmsg may be set. */
+
+typedef struct {
+  void    *state;                 /* For the function's own use */
+  int      argc;                  /* Arguments from transport_filter_dlfunc */
+  uschar **argv;
+  uschar  *errmsg;                /* Set by the function on error */
+} transport_filter_block;
+
+typedef int transport_filter_function(transport_filter_block *block,
+  const uschar *data, int len, const uschar **out, int *outlen);
+
+
 /* Return codes from the support functions lss_match_xxx(). These are also the
 codes that dynamically-loaded ${dlfunc functions must return. */
 
@@ -192,6 +210,10 @@ extern BOOL    header_testname_incomplete(header_line *, const uschar *, int, BO
 extern void    log_write(unsigned int, int, const char *format, ...) PRINTF_FUNCTION(3,4);
 extern int     lss_b64decode(uschar *, uschar **);
 extern uschar *lss_b64encode(uschar *, int);
+extern const uschar *lss_body_hash(void);
+extern const uschar *lss_body_view(int, off_t *);
+extern const uschar *lss_dkim_bodyhashes(void);
+extern header_line **lss_header_find(const uschar *);
 extern int     lss_match_domain(uschar *, uschar *);
 extern int     lss_match_local_part(uschar *, uschar *, BOOL);
 extern int     lss_match_address(uschar *, uschar *, BOOL);
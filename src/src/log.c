@@ -36,14 +36,25 @@ static uschar *mainlog_datestamp = NULL;
 static uschar *rejectlog_datestamp = NULL;
 
 static int    mainlogfd = -1;
+static int    mainlog_index_fd = -1;
 static int    rejectlogfd = -1;
 static ino_t  mainlog_inode = 0;
 static ino_t  rejectlog_inode = 0;
 
 static uschar *panic_save_buffer = NULL;
+static uschar *mainlog_buffer = NULL;	/* lines held for one write */
+static uschar *rejectlog_buffer = NULL;
+static int    json_log_fd = -1;
+static int    mainlog_buffered = 0;
+static int    rejectlog_buffered = 0;
 static BOOL   panic_recurseflag = FALSE;
 
 static BOOL   syslog_open = FALSE;
+static int    syslog_fd = -1;		/* native writer, see syslog_socket */
+static uschar **syslog_queue = NULL;	/* lines held while the socket is full */
+static int    syslog_queued = 0;
+static pid_t  syslog_queue_pid = 0;
+static unsigned syslog_dropped = 0;
 static BOOL   path_inspected = FALSE;
 static int    logging_mode = LOG_MODE_FILE;
 static uschar *file_path = US"";
@@ -125,6 +136,135 @@ exim_errstr(int err)
 return err < 0 ? exim_errstrings[-err] : CUS strerror(err);
 }
 
+/*************************************************
+*          Native nonblocking syslog writer      *
+*************************************************/
+
+/* When syslog_socket is set, syslog lines are formatted as RFC 5424 records
+and sent on a nonblocking datagram socket instead of calling syslog(), which
+blocks the process when the daemon stalls. A line that cannot be sent at once
+is held in a small per-process queue; when that is full, lines are dropped and
+counted, and the count is itself sent once the daemon is accepting again.
+
+Arguments:
+  priority       syslog priority
+  s              the line
+
+Returns:         TRUE if the record was sent
+*/
+
+static BOOL
+syslog_native_send(int priority, const uschar * s)
+{
+struct timeval now;
+struct tm * t;
+uschar tbuf[32];
+uschar * rec;
+int len;
+
+if (syslog_fd < 0)
+  {
+  struct sockaddr_un sun = {.sun_family = AF_UNIX};
+
+  if (Ustrlen(syslog_socket) >= sizeof(sun.sun_path)) return FALSE;
+  Ustrcpy(sun.sun_path, syslog_socket);
+  if ((syslog_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) return FALSE;
+  (void)fcntl(syslog_fd, F_SETFD, fcntl(syslog_fd, F_GETFD) | FD_CLOEXEC);
+  (void)fcntl(syslog_fd, F_SETFL, fcntl(syslog_fd, F_GETFL) | O_NONBLOCK);
+  if (connect(syslog_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    {
+    (void)close(syslog_fd);
+    syslog_fd = -1;
+    return FALSE;
+    }
+  }
+
+(void)gettimeofday(&now, NULL);
+t = gmtime(&now.tv_sec);
+(void)strftime(CS tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%S", t);
+
+rec = string_sprintf("<%d>1 %s.%06ldZ %s %s %ld - - %s",
+  syslog_facility | priority, tbuf, (long)now.tv_usec,
+  primary_hostname ? primary_hostname : US"-",
+  syslog_processname, (long)getpid(), s);
+len = Ustrlen(rec);
+
+if (send(syslog_fd, rec, len, 0) == len) return TRUE;
+
+/* Anything other than a full socket means the daemon has gone away or been
+restarted; reconnect on the next attempt. */
+
+if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+  {
+  (void)close(syslog_fd);
+  syslog_fd = -1;
+  }
+return FALSE;
+}
+
+
+/* Send what is queued, then report any drops. A queue inherited over a fork
+belongs to the parent, which will send it, so it is discarded. */
+
+static void
+syslog_native_drain(void)
+{
+int i;
+
+if (syslog_queue_pid != getpid())
+  {
+  for (i = 0; i < syslog_queued; i++) store_free(syslog_queue[i]);
+  syslog_queued = 0;
+  syslog_dropped = 0;
+  syslog_queue_pid = getpid();
+  }
+
+for (i = 0; i < syslog_queued; i++)
+  {
+  uschar * q = syslog_queue[i];
+  if (!syslog_native_send(q[0], q+1)) break;
+  store_free(q);
+  }
+if (i > 0)
+  {
+  memmove(syslog_queue, syslog_queue + i, (syslog_queued - i) * sizeof(uschar *));
+  syslog_queued -= i;
+  }
+
+if (syslog_queued == 0 && syslog_dropped > 0
+   && syslog_native_send(LOG_NOTICE,
+	string_sprintf("%u syslog lines were dropped because the syslog "
+	  "socket was not accepting data", syslog_dropped)))
+  syslog_dropped = 0;
+}
+
+
+static void
+syslog_native(int priority, const uschar * s)
+{
+int limit = syslog_queue_size > 0 ? syslog_queue_size : 0;
+
+syslog_native_drain();
+if (syslog_queued == 0 && syslog_native_send(priority, s)) return;
+
+if (syslog_queued >= limit)
+  {
+  syslog_dropped++;
+  return;
+  }
+if (!syslog_queue)
+  syslog_queue = store_malloc(limit * sizeof(uschar *));
+
+/* The priority is kept in the first byte of the saved line */
+
+syslog_queue[syslog_queued] = store_malloc(Ustrlen(s) + 2);
+syslog_queue[syslog_queued][0] = priority;
+Ustrcpy(syslog_queue[syslog_queued] + 1, s);
+syslog_queued++;
+}
+
+
+
 /*************************************************
 *              Write to syslog                   *
 *************************************************/
@@ -160,7 +300,7 @@ if (!syslog_timestamp)
 len = Ustrlen(s);
 
 #ifndef NO_OPENLOG
-if (!syslog_open && !f.running_in_test_harness)
+if (!syslog_open && !syslog_socket && !f.running_in_test_harness)
   {
 # ifdef SYSLOG_LOG_PID
   openlog(CS syslog_processname, LOG_PID|LOG_CONS, syslog_facility);
@@ -197,6 +337,12 @@ for (int pass = 0; pass < 2; pass++)
         fprintf(stderr, "SYSLOG: '[%d%c%d] %.*s'\n", i,
           ss[plen] == '\n' && tlen != 0 ? '\\' : '/',
           linecount, plen, ss);
+    else if (syslog_socket)
+      syslog_native(priority, linecount == 1
+        ? string_sprintf("%.*s", plen, ss)
+        : string_sprintf("[%d%c%d] %.*s", i,
+          ss[plen] == '\n' && tlen != 0 ? '\\' : '/',
+          linecount, plen, ss));
     else
       if (linecount == 1)
         syslog(priority, "%.*s", plen, ss);
@@ -403,18 +549,20 @@ it gets statted to see if it has been cycled. With a datestamp, the datestamp
 will be compared. The static slot for saving it is the same size as buffer,
 and the text has been checked above to fit, so this use of strcpy() is OK. */
 
-if (type == lt_main && string_datestamp_offset >= 0)
+if (type == lt_main)
   {
   Ustrcpy(mainlog_name, buffer);
-  mainlog_datestamp = mainlog_name + string_datestamp_offset;
+  if (string_datestamp_offset >= 0)
+    mainlog_datestamp = mainlog_name + string_datestamp_offset;
   }
 
 /* Ditto for the reject log */
 
-else if (type == lt_reject && string_datestamp_offset >= 0)
+else if (type == lt_reject)
   {
   Ustrcpy(rejectlog_name, buffer);
-  rejectlog_datestamp = rejectlog_name + string_datestamp_offset;
+  if (string_datestamp_offset >= 0)
+    rejectlog_datestamp = rejectlog_name + string_datestamp_offset;
   }
 
 /* and deal with the debug log (which keeps the datestamp, but does not
@@ -673,12 +821,409 @@ while ((t = string_nextinlist(&tt, &sep, log_buffer, LOG_BUFFER_SIZE)))
 void
 mainlog_close(void)
 {
+mainlog_flush();
+if (mainlog_index_fd >= 0)
+  { (void)close(mainlog_index_fd); mainlog_index_fd = -1; }
 if (mainlogfd < 0) return;
 (void)close(mainlogfd);
 mainlogfd = -1;
 mainlog_inode = 0;
 }
 
+
+
+/*************************************************
+*        Index the main log by message ID        *
+*************************************************/
+
+/* When mainlog_index is set, a line "<message id> <offset>" is appended to the
+file whose name is that of the main log with ".idx" added, for each main log
+line that is about a message, giving the byte offset of the line in the log.
+exigrep uses the index to find the lines for a message without reading the
+whole log, and exicyclog rotates it with the log. The index is reopened
+whenever the log is. Failure to open or write it is not an error: exigrep then
+reads the log. */
+
+static void
+mainlog_index_open(void)
+{
+uschar name[LOG_NAME_SIZE + 4];
+
+if (mainlog_index_fd >= 0) (void)close(mainlog_index_fd);
+mainlog_index_fd = -1;
+if (!string_format(name, sizeof(name), "%s.idx", mainlog_name)) return;
+
+if ((mainlog_index_fd = Uopen(name,
+#ifdef O_CLOEXEC
+		O_CLOEXEC |
+#endif
+		O_APPEND|O_WRONLY, LOG_MODE)) < 0)
+  {
+  uid_t euid = geteuid();
+  if (euid == exim_uid) mainlog_index_fd = log_create(name);
+  else if (euid == root_uid) mainlog_index_fd = log_create_as_exim(name);
+  }
+
+#ifndef O_CLOEXEC
+if (mainlog_index_fd >= 0)
+  (void)fcntl(mainlog_index_fd, F_SETFD,
+    fcntl(mainlog_index_fd, F_GETFD) | FD_CLOEXEC);
+#endif
+}
+
+
+/* Find the message ID in a log line: it follows the date, the time, and any
+timezone and pid. */
+
+static const uschar *
+mainlog_line_id(const uschar * p, const uschar * end)
+{
+for (int i = 0; i < 5 && p < end; i++, p++)
+  {
+  const uschar * t = p;
+  while (p < end && *p != ' ') p++;
+  if (p - t == MESSAGE_ID_LENGTH && t[6] == '-' && t[13] == '-')
+    return t;
+  if (i >= 2 && *t != '+' && *t != '-' && *t != '[') break;
+  }
+return NULL;
+}
+
+
+/* Write the index lines for data just written to the log, which ended at the
+log file's offset. */
+
+static void
+mainlog_index_write(const uschar * s, int len)
+{
+uschar buf[4096];
+int n = 0;
+off_t off = lseek(mainlogfd, 0, SEEK_CUR) - len;
+
+if (off < 0) return;
+for (const uschar * p = s, * end = s + len, * nl; p < end; p = nl + 1)
+  {
+  const uschar * id;
+
+  if (!(nl = memchr(p, '\n', end - p))) nl = end;
+  if (!(id = mainlog_line_id(p, nl))) continue;
+  if (n > sizeof(buf) - 64)
+    {
+    if (write(mainlog_index_fd, buf, n) != n) return;
+    n = 0;
+    }
+  n += snprintf(CS buf + n, sizeof(buf) - n, "%.*s " OFF_T_FMT "\n",
+    MESSAGE_ID_LENGTH, id, (off_t)(off + (p - s)));
+  }
+if (n > 0) (void) write(mainlog_index_fd, buf, n);
+}
+
+
+
+/*************************************************
+*             Write to the main log              *
+*************************************************/
+
+/* Check for rotation of the main log file, opening it if need be, and write
+one or more complete lines to it. Failing to write is disastrous.
+
+Arguments:
+  s         the data
+  len       its length
+
+Returns:    nothing
+*/
+
+static void
+mainlog_write(const uschar * s, int len)
+{
+struct stat statbuf;
+ssize_t written_len;
+
+/* Check for a change to the mainlog file name when datestamping is in
+operation. This happens at midnight, at which point we want to roll over
+the file. Closing it has the desired effect. */
+
+if (mainlog_datestamp)
+  {
+  uschar *nowstamp = tod_stamp(string_datestamp_type);
+  if (Ustrncmp (mainlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
+    {
+    (void)close(mainlogfd);       /* Close the file */
+    mainlogfd = -1;               /* Clear the file descriptor */
+    mainlog_inode = 0;            /* Unset the inode */
+    mainlog_datestamp = NULL;     /* Clear the datestamp */
+    }
+  }
+
+/* Otherwise, we want to check whether the file has been renamed by a
+cycling script. This could be "if else", but for safety's sake, leave it as
+"if" so that renaming the log starts a new file even when datestamping is
+happening. */
+
+if (mainlogfd >= 0)
+  if (Ustat(mainlog_name, &statbuf) < 0 || statbuf.st_ino != mainlog_inode)
+    {
+    (void)close(mainlogfd);
+    mainlogfd = -1;
+    mainlog_inode = 0;
+    }
+
+/* If the log is closed, open it. Then write the data. */
+
+if (mainlogfd < 0)
+  {
+  open_log(&mainlogfd, lt_main, NULL);     /* No return on error */
+  if (fstat(mainlogfd, &statbuf) >= 0) mainlog_inode = statbuf.st_ino;
+  if (mainlog_index) mainlog_index_open();
+  }
+
+if ((written_len = write_to_fd_buf(mainlogfd, s, len)) != len)
+  log_write_failed(US"main log", len, written_len);
+  /* That function does not return */
+
+if (mainlog_index_fd >= 0) mainlog_index_write(s, len);
+}
+
+
+
+/*************************************************
+*          Write data to the reject log          *
+*************************************************/
+
+static void
+rejectlog_write(const uschar * s, int len)
+{
+struct stat statbuf;
+ssize_t written_len;
+
+/* Check for a change to the rejectlog file name when datestamping is in
+operation. This happens at midnight, at which point we want to roll over
+the file. Closing it has the desired effect. */
+
+if (rejectlog_datestamp)
+  {
+  uschar *nowstamp = tod_stamp(string_datestamp_type);
+  if (Ustrncmp (rejectlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
+    {
+    (void)close(rejectlogfd);       /* Close the file */
+    rejectlogfd = -1;               /* Clear the file descriptor */
+    rejectlog_inode = 0;            /* Unset the inode */
+    rejectlog_datestamp = NULL;     /* Clear the datestamp */
+    }
+  }
+
+/* Otherwise, we want to check whether the file has been renamed by a
+cycling script. This could be "if else", but for safety's sake, leave it as
+"if" so that renaming the log starts a new file even when datestamping is
+happening. */
+
+if (rejectlogfd >= 0)
+  if (Ustat(rejectlog_name, &statbuf) < 0 ||
+       statbuf.st_ino != rejectlog_inode)
+    {
+    (void)close(rejectlogfd);
+    rejectlogfd = -1;
+    rejectlog_inode = 0;
+    }
+
+/* Open the file if necessary, and write the data */
+
+if (rejectlogfd < 0)
+  {
+  open_log(&rejectlogfd, lt_reject, NULL); /* No return on error */
+  if (fstat(rejectlogfd, &statbuf) >= 0) rejectlog_inode = statbuf.st_ino;
+  }
+
+if ((written_len = write_to_fd_buf(rejectlogfd, s, len)) != len)
+  log_write_failed(US"reject log", len, written_len);
+  /* That function does not return */
+}
+
+
+
+/*************************************************
+*      Sample and rate limit the reject log      *
+*************************************************/
+
+/* When rejectlog_sample or rejectlog_ratelimit is set, reject log entries are
+counted by reason in the "rejectlog" hints database, so that the limits apply
+across all Exim processes. The reason is the text that follows the first ": "
+after "rejected" in the log line (or the first ": " if the line does not
+contain "rejected"), up to 64 characters. In each period, the first of every
+rejectlog_sample entries is written, up to the rejectlog_ratelimit count. The
+period is that of rejectlog_ratelimit, or an hour if it is not set. When the
+reason next occurs in a later period, a line giving the number of entries that
+were not written, and over how long, is added to the reject log first.
+
+If the database cannot be used, the entry is written.
+
+Arguments:
+  s         the text of the log line, after the timestamp, pid, and message id
+  summary   where to put a summary line to be written first, or an empty
+            string
+  size      the size of summary
+
+Returns:    TRUE if the entry is to be written
+*/
+
+static BOOL
+rejectlog_permit(const uschar * s, uschar * summary, int size)
+{
+static int limit = -1;
+static int period = 60*60;
+open_db dbblock, * dbm_file;
+dbdata_rejectlog * r, rec;
+uschar key[65];
+const uschar * p;
+int len;
+time_t now = time(NULL);
+BOOL yield;
+
+*summary = 0;
+
+/* Read the rate limit once */
+
+if (limit < 0)
+  {
+  limit = 0;
+  if (rejectlog_ratelimit)
+    {
+    uschar * q;
+    int n = Ustrtol(rejectlog_ratelimit, &q, 10), t;
+
+    Uskip_whitespace(&q);
+    if (n <= 0 || *q++ != '/' || (Uskip_whitespace(&q),
+		(t = readconf_readtime(q, 0, FALSE)) <= 0))
+      log_write(0, LOG_MAIN|LOG_PANIC, "malformed rejectlog_ratelimit "
+	"setting \"%s\" ignored", rejectlog_ratelimit);
+    else
+      { limit = n; period = t; }
+    }
+  }
+
+/* Find the reason */
+
+if (  (p = Ustrstr(s, "rejected")) && (p = Ustrstr(p, ": "))
+   || (p = Ustrstr(s, ": ")))
+  p += 2;
+else
+  p = s;
+for (len = 0; len < sizeof(key) - 1 && p[len] && p[len] != '\n'; len++) ;
+memcpy(key, p, len);
+key[len] = 0;
+
+if (!(dbm_file = dbfn_open(US"rejectlog", O_RDWR, &dbblock, FALSE, TRUE)))
+  return TRUE;
+
+if (!(r = dbfn_read(dbm_file, key)) || r->period_start + period <= now)
+  {
+  if (r && r->suppressed > 0)
+    (void) string_format(summary, size, "%s %d reject log entries for "
+      "\"%s\" were not written in the last %s\n", tod_stamp(tod_log),
+      r->suppressed, key, readconf_printtime((int)(now - r->period_start)));
+  memset(&rec, 0, sizeof(rec));
+  rec.period_start = now;
+  r = &rec;
+  }
+
+yield = (r->seen++ % (rejectlog_sample > 1 ? rejectlog_sample : 1)) == 0
+	&& (limit <= 0 || r->written < limit);
+if (yield) r->written++; else r->suppressed++;
+
+(void) dbfn_write(dbm_file, key, r, sizeof(dbdata_rejectlog));
+dbfn_close(dbm_file);
+return yield;
+}
+
+
+
+/*************************************************
+*      Hold main log lines for fewer writes      *
+*************************************************/
+
+/* When mainlog_buffer_size is set, the main log lines of a process that is
+receiving or delivering messages are collected and written together; so are
+its reject log entries, in a second buffer of the same size. They are flushed
+when either buffer is full, when the process is about to wait for its SMTP
+client, and before it forks, execs, or exits. A panic writes them out at once,
+before its own line. Each write is of whole lines to a file opened for append,
+so lines from different processes are not mixed.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+void
+mainlog_buffer_start(void)
+{
+if (mainlog_buffer_size > 0 && !mainlog_buffer)
+  {
+  mainlog_buffer = store_malloc(mainlog_buffer_size);
+  rejectlog_buffer = store_malloc(mainlog_buffer_size);
+  }
+}
+
+
+void
+mainlog_flush(void)
+{
+int len;
+
+if ((len = mainlog_buffered) > 0)
+  {
+  mainlog_buffered = 0;			/* avoid recursion on failure */
+  mainlog_write(mainlog_buffer, len);
+  }
+if ((len = rejectlog_buffered) > 0)
+  {
+  rejectlog_buffered = 0;
+  rejectlog_write(rejectlog_buffer, len);
+  }
+if (syslog_queued > 0 || syslog_dropped > 0) syslog_native_drain();
+}
+
+
+/* Called as the process exits. Syslog lines that the native writer still
+holds are lost with the process, so if there are any, or any were dropped, a
+line saying how many goes to the main log file instead. */
+
+void
+syslog_native_exit(void)
+{
+uschar * s;
+
+if (syslog_queued > 0 || syslog_dropped > 0) syslog_native_drain();
+if (syslog_queue_pid != getpid() || syslog_queued + syslog_dropped == 0) return;
+
+syslog_dropped += syslog_queued;
+syslog_queued = 0;
+if (!(logging_mode & LOG_MODE_FILE)) return;
+s = string_sprintf("%s %u syslog lines were dropped because the syslog socket "
+  "was not accepting data\n", tod_stamp(tod_log), syslog_dropped);
+syslog_dropped = 0;
+mainlog_write(s, Ustrlen(s));
+}
+
+/* Write to the reject log, holding the data if buffering (see above) */
+
+static void
+rejectlog_out(const uschar * s, int len, int flags)
+{
+if (rejectlog_buffer && !(flags & LOG_PANIC) && len <= mainlog_buffer_size)
+  {
+  if (rejectlog_buffered + len > mainlog_buffer_size) mainlog_flush();
+  memcpy(rejectlog_buffer + rejectlog_buffered, s, len);
+  rejectlog_buffered += len;
+  }
+else
+  {
+  mainlog_flush();
+  rejectlog_write(s, len);
+  }
+}
+
+
 /*************************************************
 *            Write message to log file           *
 *************************************************/
@@ -743,6 +1288,8 @@ int paniclogfd;
 ssize_t written_len;
 gstring gs = { .size = LOG_BUFFER_SIZE-1, .ptr = 0, .s = log_buffer };
 gstring * g;
+int msg_start;
+uschar summary[256];
 va_list ap;
 
 /* If panic_recurseflag is set, we have failed to open the panic log. This is
@@ -926,6 +1473,7 @@ if (f.really_exim && message_id[0] != 0)
 if (flags & LOG_CONFIG)
   g = log_config_info(g, flags);
 
+msg_start = g->ptr;
 va_start(ap, format);
   {
   int i = g->ptr;
@@ -1002,58 +1550,57 @@ if (  flags & LOG_MAIN
      && (syslog_duplication || !(flags & (LOG_REJECT|LOG_PANIC))))
     write_syslog(LOG_INFO, log_buffer);
 
-  if (logging_mode & LOG_MODE_FILE)
-    {
-    struct stat statbuf;
-
-    /* Check for a change to the mainlog file name when datestamping is in
-    operation. This happens at midnight, at which point we want to roll over
-    the file. Closing it has the desired effect. */
+  /* Hold the line if buffering, unless it is a panic or will not fit */
 
-    if (mainlog_datestamp)
+  if (logging_mode & LOG_MODE_FILE)
+    if (mainlog_buffer && !(flags & LOG_PANIC) && g->ptr <= mainlog_buffer_size)
       {
-      uschar *nowstamp = tod_stamp(string_datestamp_type);
-      if (Ustrncmp (mainlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
-        {
-        (void)close(mainlogfd);       /* Close the file */
-        mainlogfd = -1;               /* Clear the file descriptor */
-        mainlog_inode = 0;            /* Unset the inode */
-        mainlog_datestamp = NULL;     /* Clear the datestamp */
-        }
+      if (mainlog_buffered + g->ptr > mainlog_buffer_size) mainlog_flush();
+      memcpy(mainlog_buffer + mainlog_buffered, g->s, g->ptr);
+      mainlog_buffered += g->ptr;
       }
-
-    /* Otherwise, we want to check whether the file has been renamed by a
-    cycling script. This could be "if else", but for safety's sake, leave it as
-    "if" so that renaming the log starts a new file even when datestamping is
-    happening. */
-
-    if (mainlogfd >= 0)
-      if (Ustat(mainlog_name, &statbuf) < 0 || statbuf.st_ino != mainlog_inode)
-	mainlog_close();
-
-    /* If the log is closed, open it. Then write the line. */
-
-    if (mainlogfd < 0)
+    else
       {
-      open_log(&mainlogfd, lt_main, NULL);     /* No return on error */
-      if (fstat(mainlogfd, &statbuf) >= 0) mainlog_inode = statbuf.st_ino;
+      mainlog_flush();
+      mainlog_write(g->s, g->ptr);
       }
+  }
 
-    /* Failing to write to the log is disastrous */
+/* Handle the log for rejected messages. This can be globally disabled, in
+which case the flags are altered above, or sampled and rate limited. If there
+are any header lines (i.e. if the rejection is happening after the DATA phase),
+log the recipients and the headers. */
 
-    written_len = write_to_fd_buf(mainlogfd, g->s, g->ptr);
-    if (written_len != g->ptr)
-      {
-      log_write_failed(US"main log", g->ptr, written_len);
-      /* That function does not return */
-      }
+*summary = 0;
+if (flags & LOG_REJECT && (rejectlog_sample > 1 || rejectlog_ratelimit))
+  {
+  /* The hints database functions can log, which uses the log buffer, so it
+  is saved while they are called. */
+
+  static uschar * reject_save_buffer = NULL;
+  BOOL permit;
+
+  if (!reject_save_buffer && !(reject_save_buffer = US malloc(LOG_BUFFER_SIZE)))
+    permit = TRUE;
+  else
+    {
+    int len = g->ptr;
+    memcpy(reject_save_buffer, g->s, len + 1);
+    permit = rejectlog_permit(reject_save_buffer + msg_start, summary,
+      sizeof(summary));
+    memcpy(g->s, reject_save_buffer, len + 1);
     }
+  if (!permit) flags &= ~LOG_REJECT;
   }
 
-/* Handle the log for rejected messages. This can be globally disabled, in
-which case the flags are altered above. If there are any header lines (i.e. if
-the rejection is happening after the DATA phase), log the recipients and the
-headers. */
+if (*summary)
+  {
+  if (  logging_mode & LOG_MODE_SYSLOG
+     && (syslog_duplication || !(flags & LOG_PANIC)))
+    write_syslog(LOG_NOTICE, summary);
+  if (logging_mode & LOG_MODE_FILE)
+    rejectlog_out(summary, Ustrlen(summary), flags);
+  }
 
 if (flags & LOG_REJECT)
   {
@@ -1114,55 +1661,8 @@ if (flags & LOG_REJECT)
      && (syslog_duplication || !(flags & LOG_PANIC)))
     write_syslog(LOG_NOTICE, string_from_gstring(g));
 
-  /* Check for a change to the rejectlog file name when datestamping is in
-  operation. This happens at midnight, at which point we want to roll over
-  the file. Closing it has the desired effect. */
-
   if (logging_mode & LOG_MODE_FILE)
-    {
-    struct stat statbuf;
-
-    if (rejectlog_datestamp)
-      {
-      uschar *nowstamp = tod_stamp(string_datestamp_type);
-      if (Ustrncmp (rejectlog_datestamp, nowstamp, Ustrlen(nowstamp)) != 0)
-        {
-        (void)close(rejectlogfd);       /* Close the file */
-        rejectlogfd = -1;               /* Clear the file descriptor */
-        rejectlog_inode = 0;            /* Unset the inode */
-        rejectlog_datestamp = NULL;     /* Clear the datestamp */
-        }
-      }
-
-    /* Otherwise, we want to check whether the file has been renamed by a
-    cycling script. This could be "if else", but for safety's sake, leave it as
-    "if" so that renaming the log starts a new file even when datestamping is
-    happening. */
-
-    if (rejectlogfd >= 0)
-      if (Ustat(rejectlog_name, &statbuf) < 0 ||
-           statbuf.st_ino != rejectlog_inode)
-        {
-        (void)close(rejectlogfd);
-        rejectlogfd = -1;
-        rejectlog_inode = 0;
-        }
-
-    /* Open the file if necessary, and write the data */
-
-    if (rejectlogfd < 0)
-      {
-      open_log(&rejectlogfd, lt_reject, NULL); /* No return on error */
-      if (fstat(rejectlogfd, &statbuf) >= 0) rejectlog_inode = statbuf.st_ino;
-      }
-
-    written_len = write_to_fd_buf(rejectlogfd, g->s, g->ptr);
-    if (written_len != g->ptr)
-      {
-      log_write_failed(US"reject log", g->ptr, written_len);
-      /* That function does not return */
-      }
-    }
+    rejectlog_out(g->s, g->ptr, flags);
   }
 
 
@@ -1205,6 +1705,10 @@ if (flags & LOG_PANIC)
     (void)close(paniclogfd);
     }
 
+  /* Write out the trace ring, which shows what led up to the panic */
+
+  if (trace_ring) trace_dump(US"panic");
+
   /* Give up if the DIE flag is set */
 
   if ((flags & LOG_PANIC_DIE) != LOG_PANIC)
@@ -1214,6 +1718,112 @@ if (flags & LOG_PANIC)
 
 
 
+/*************************************************
+*          Structured log records                *
+*************************************************/
+
+/* When log_json_socket is set, some events that are logged on the main log
+are also sent, as JSON objects of one line each, in datagrams to the
+unix-domain socket it names. A collector can then use the fields without
+parsing the log lines. The sends do not wait; if the collector is not keeping
+up, or is not there, records are dropped.
+
+A record is begun with log_json_start(), which returns NULL if there is no
+socket set. The other functions take and return the string being built, and
+do nothing if given NULL, so the caller need only test once. */
+
+gstring *
+log_json_start(const uschar * event)
+{
+struct timeval now;
+gstring * g;
+
+if (!log_json_socket || !*log_json_socket) return NULL;
+gettimeofday(&now, NULL);
+g = string_get_tainted(512, TRUE);
+g = string_fmt_append(g, "{\"time\":%ld.%03ld,\"pid\":%d",
+  (long)now.tv_sec, (long)now.tv_usec/1000, (int)getpid());
+g = log_json_str(g, "event", event);
+if (*message_id) g = log_json_str(g, "id", message_id);
+return g;
+}
+
+
+/* Add a string field, quoting as JSON needs. Nothing is added for a NULL
+value. */
+
+gstring *
+log_json_str(gstring * g, const char * name, const uschar * val)
+{
+const uschar * s;
+
+if (!g || !val) return g;
+g = string_fmt_append(g, ",\"%s\":\"", name);
+for (s = val; *s; s++)
+  if (*s == '"' || *s == '\\' || *s < 0x20)
+    {
+    g = string_catn(g, val, s - val);
+    g = *s == '"' || *s == '\\'
+      ? string_fmt_append(g, "\\%c", *s)
+      : string_fmt_append(g, "\\u%04x", *s);
+    val = s + 1;
+    }
+g = string_catn(g, val, s - val);
+return string_catn(g, US"\"", 1);
+}
+
+
+gstring *
+log_json_int(gstring * g, const char * name, long val)
+{
+return g ? string_fmt_append(g, ",\"%s\":%ld", name, val) : g;
+}
+
+
+/* A time interval, in seconds to the millisecond */
+
+gstring *
+log_json_time(gstring * g, const char * name, const struct timeval * t)
+{
+return g
+  ? string_fmt_append(g, ",\"%s\":%ld.%03ld",
+			name, (long)t->tv_sec, (long)t->tv_usec/1000)
+  : g;
+}
+
+
+/* Finish the record and send it. The socket is opened on first use and
+then kept, also by forked children. */
+
+void
+log_json_send(gstring * g)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+int len;
+
+if (!g) return;
+g = string_catn(g, US"}\n", 2);
+
+if (json_log_fd < 0)
+  {
+  if ((json_log_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+    {
+    DEBUG(D_any) debug_printf("json log socket: %s\n", strerror(errno));
+    return;
+    }
+  (void)fcntl(json_log_fd, F_SETFD, fcntl(json_log_fd, F_GETFD) | FD_CLOEXEC);
+  }
+
+len = offsetof(struct sockaddr_un, sun_path)
+  + snprintf(sa_un.sun_path, sizeof(sa_un.sun_path), "%s", log_json_socket);
+if (sendto(json_log_fd, g->s, g->ptr, MSG_DONTWAIT,
+	    (struct sockaddr *)&sa_un, len) < 0)
+  DEBUG(D_any) debug_printf("json log sendto %s: %s\n",
+    log_json_socket, strerror(errno));
+}
+
+
+
 /*************************************************
 *            Close any open log files            *
 *************************************************/
@@ -1221,10 +1831,19 @@ if (flags & LOG_PANIC)
 void
 log_close_all(void)
 {
+mainlog_flush();
+if (mainlog_index_fd >= 0)
+  { (void)close(mainlog_index_fd); mainlog_index_fd = -1; }
 if (mainlogfd >= 0)
   { (void)close(mainlogfd); mainlogfd = -1; }
 if (rejectlogfd >= 0)
   { (void)close(rejectlogfd); rejectlogfd = -1; }
+if (syslog_fd >= 0)
+  {
+  if (syslog_queued > 0) syslog_native_drain();
+  (void)close(syslog_fd);
+  syslog_fd = -1;
+  }
 closelog();
 syslog_open = FALSE;
 }
@@ -45,13 +45,23 @@ typedef struct lookup_info {
     uschar *);                    /* additional data from quote name */
   void (*version_report)(         /* diagnostic function */
     FILE *);                      /* fh to write to */
+  int (*batch_find)(              /* find several; NULL if not supported */
+    void *,                       /* handle */
+    const uschar *,               /* file name or NULL */
+    const uschar **,              /* keys or queries */
+    int,                          /* how many */
+    uschar **,                    /* for returning answers; NULL if not found */
+    uschar **,                    /* for error message */
+    uint *,                       /* cache TTL, seconds */
+    const uschar *);		  /* options */
 } lookup_info;
 
 /* This magic number is used by the following lookup_module_info structure
    for checking API compatibility. It used to be equivalent to the string"LMM3" */
-#define LOOKUP_MODULE_INFO_MAGIC 0x4c4d4933
+#define LOOKUP_MODULE_INFO_MAGIC 0x4c4d4934
 /* Version 2 adds: version_report */
 /* Version 3 change: non/cache becomes TTL in seconds */
+/* Version 4 adds: batch_find */
 
 typedef struct lookup_module_info {
   uint magic;
@@ -87,6 +87,29 @@ struct cdb_state {
   uschar *cdb_offsets;
 };
 
+#ifdef HAVE_MMAP
+/* Mappings are kept when a file is closed, so that reopening the same file (as
+happens after every search_tidyup() in a long-lived process) neither maps it
+again nor has to fault its pages back in. They are in malloc store, and are
+identified by the file's device, inode, size and modification time. A mapping
+is dropped when a file of the same name turns out to have been replaced, and
+the least recently used one goes when there are too many. */
+
+typedef struct cdb_mapping {
+  struct cdb_mapping *next;
+  dev_t   dev;
+  ino_t   ino;
+  off_t   size;
+  time_t  mtime;
+  uschar *map;
+  uschar  name[1];
+} cdb_mapping;
+
+#define CDB_MAPPINGS_MAX 16
+
+static cdb_mapping *cdb_mappings = NULL;
+#endif /* HAVE_MMAP */
+
 /* 32 bit unsigned type - this is an int on all modern machines */
 typedef unsigned int uint32;
 
@@ -147,13 +170,83 @@ return num;
 
 static void cdb_close(void *handle);
 
+#ifdef HAVE_MMAP
+/*************************************************
+*        Get a (possibly retained) mapping       *
+*************************************************/
+
+/* Find or make the mapping of an open file.
+
+Arguments:
+  filename   the name of the file
+  fileno     an fd open on it
+  statbuf    the result of fstat() on it
+
+Returns:     the start of the mapping, or NULL if the map failed
+*/
+
+static uschar *
+cdb_get_map(const uschar * filename, int fileno, const struct stat * statbuf)
+{
+cdb_mapping ** mp = &cdb_mappings, * m;
+int count = 0;
+void * mapbuf;
+
+while ((m = *mp))
+  {
+  if (  m->dev == statbuf->st_dev && m->ino == statbuf->st_ino
+     && m->size == statbuf->st_size && m->mtime == statbuf->st_mtime)
+    {
+    DEBUG(D_lookup) debug_printf_indent("cdb: re-using mapping of %s\n",
+      filename);
+    *mp = m->next;			/* move to front */
+    m->next = cdb_mappings;
+    cdb_mappings = m;
+    return m->map;
+    }
+
+  if (Ustrcmp(m->name, filename) == 0 || ++count >= CDB_MAPPINGS_MAX)
+    {
+    *mp = m->next;			/* replaced, or too many */
+    munmap(CS m->map, m->size);
+    store_free(m);
+    }
+  else
+    mp = &m->next;
+  }
+
+if ((mapbuf = mmap(NULL, statbuf->st_size, PROT_READ, MAP_SHARED, fileno, 0))
+    == MAP_FAILED)
+  return NULL;
+
+/* Lookups go to random places in the file, so readahead is mostly wasted
+on large ones. */
+
+#ifdef MADV_RANDOM
+(void) madvise(mapbuf, statbuf->st_size, MADV_RANDOM);
+#endif
+
+m = store_malloc(sizeof(cdb_mapping) + Ustrlen(filename));
+m->dev = statbuf->st_dev;
+m->ino = statbuf->st_ino;
+m->size = statbuf->st_size;
+m->mtime = statbuf->st_mtime;
+m->map = mapbuf;
+Ustrcpy(m->name, filename);
+m->next = cdb_mappings;
+cdb_mappings = m;
+return m->map;
+}
+#endif /* HAVE_MMAP */
+
+
 static void *
 cdb_open(const uschar * filename, uschar ** errmsg)
 {
 int fileno;
 struct cdb_state *cdbp;
 struct stat statbuf;
-void * mapbuf;
+uschar * mapbuf;
 
 if ((fileno = Uopen(filename, O_RDONLY, 0)) < 0)
   {
@@ -188,8 +281,7 @@ cdbp->cdb_offsets = NULL;
 
 /* if we are allowed to we use mmap here.... */
 #ifdef HAVE_MMAP
-if ((mapbuf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fileno, 0))
-    != MAP_FAILED)
+if ((mapbuf = cdb_get_map(filename, fileno, &statbuf)))
   {
   /* We have an mmap-ed section.  Now we can just use it */
   cdbp->cdb_map = mapbuf;
@@ -436,10 +528,11 @@ cdb_close(void *handle)
 {
 struct cdb_state * cdbp = handle;
 
+/* A mapping is left in place for re-use; see cdb_get_map() */
+
 #ifdef HAVE_MMAP
 if (cdbp->cdb_map)
   {
-  munmap(CS cdbp->cdb_map, cdbp->filelen);
   if (cdbp->cdb_map == cdbp->cdb_offsets)
      cdbp->cdb_offsets = NULL;
   }
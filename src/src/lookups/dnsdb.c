@@ -85,6 +85,88 @@ return (void *)(-1);   /* Any non-0 value */
 
 
 
+/*************************************************
+*      Send the queries for a list together      *
+*************************************************/
+
+/* When dns_parallel_lookups is set, the queries for all the domains in a
+dnsdb list are sent at once by dns_prefetch(), so that the lookups made one by
+one below find their answers waiting. The domains are worked out in the same
+way as for those lookups. The CSA and ZNS types, which make queries of their
+own devising, are not covered. For a batch of lookups, the queries of all of
+them are collected first, and sent together. */
+
+#define DNSDB_PREFETCH_MAX 64
+
+typedef struct {
+  const uschar * names[DNSDB_PREFETCH_MAX];
+  int		 types[DNSDB_PREFETCH_MAX];
+  int		 n;
+} dnsdb_queries;
+
+static dnsdb_queries * dnsdb_collecting = NULL;	/* Set during a batch */
+
+
+/* Add the queries for a list of domains to a set.
+
+Arguments:
+  q         the set
+  list      the list of domains
+  sep       the list separator, as for string_nextinlist()
+  type      the lookup type
+*/
+
+static void
+dnsdb_add_queries(dnsdb_queries * q, const uschar * list, int sep, int type)
+{
+uschar * domain;
+
+while (  q->n < DNSDB_PREFETCH_MAX - 1
+      && (domain = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  if (type == T_PTR && string_is_ip_address(domain, NULL) != 0)
+    domain = dns_build_reverse(domain);
+
+#if HAVE_IPV6
+  if (type == T_ADDRESSES)
+    {
+    q->names[q->n] = domain;
+    q->types[q->n++] = T_AAAA;
+    q->names[q->n] = domain;
+    q->types[q->n++] = T_A;
+    continue;
+    }
+#endif
+  q->names[q->n] = domain;
+  q->types[q->n++] = type == T_MXH ? T_MX : type;
+  }
+}
+
+
+/* Send a set of queries together */
+
+static void
+dnsdb_send_queries(dnsdb_queries * q)
+{
+DEBUG(D_lookup) if (q->n > 1)
+  debug_printf_indent("dnsdb: sending %d queries together\n", q->n);
+dns_prefetch(q->names, q->types, q->n);
+}
+
+
+static void
+dnsdb_prefetch(const uschar * list, int sep, int type)
+{
+dnsdb_queries q = { .n = 0 };
+rmark reset_point = store_mark();
+
+dnsdb_add_queries(&q, list, sep, type);
+dnsdb_send_queries(&q);
+store_reset(reset_point);
+}
+
+
+
 /*************************************************
 *           Find entry point for dnsdb           *
 *************************************************/
@@ -303,8 +385,22 @@ if (!outsep2) switch(type)
   case T_SRV: case T_MX: case T_TLSA: outsep2 = US" "; break;
   }
 
+/* When collecting the queries for a batch, that is all */
+
+if (dnsdb_collecting)
+  {
+  if (type != T_CSA && type != T_ZNS)
+    dnsdb_add_queries(dnsdb_collecting, keystring, sep, type);
+  dns_retrans = save_retrans;
+  dns_retry = save_retry;
+  return FAIL;
+  }
+
 /* Now scan the list and do a lookup for each item */
 
+if (dns_parallel_lookups && type != T_CSA && type != T_ZNS)
+  dnsdb_prefetch(keystring, sep, type);
+
 while ((domain = string_nextinlist(&keystring, &sep, NULL, 0)))
   {
   int searchtype = type == T_CSA ? T_SRV :         /* record type we want */
@@ -557,6 +653,55 @@ return OK;
 
 
 
+/*************************************************
+*        Batch find entry point for dnsdb        *
+*************************************************/
+
+/* See local README for interface description. When parallel lookups are
+enabled, the DNS queries of all the lookups are sent together, and then the
+lookups are done one by one, finding their answers waiting. */
+
+static int
+dnsdb_batch_find(void * handle, const uschar * filename, const uschar ** keys,
+  int count, uschar ** results, uschar ** errmsg, uint * do_cache,
+  const uschar * opts)
+{
+dnsdb_queries q = { .n = 0 };
+rmark reset_point = store_mark();
+
+if (!dns_parallel_lookups) return FAIL;
+
+dnsdb_collecting = &q;
+for (int i = 0; i < count; i++)
+  {
+  uschar * dummy;
+  uint dc;
+  (void) dnsdb_find(handle, filename, keys[i], Ustrlen(keys[i]), &dummy,
+    errmsg, &dc, opts);
+  }
+dnsdb_collecting = NULL;
+dnsdb_send_queries(&q);
+store_reset(reset_point);
+
+for (int i = 0; i < count; i++)
+  {
+  uint dc = UINT_MAX;
+
+  *errmsg = US"";
+  switch (dnsdb_find(handle, filename, keys[i], Ustrlen(keys[i]), results + i,
+	    errmsg, &dc, opts))
+    {
+    case OK:	break;
+    case DEFER:	return DEFER;
+    default:	results[i] = NULL; break;
+    }
+  if (dc < *do_cache) *do_cache = dc;
+  }
+return OK;
+}
+
+
+
 /*************************************************
 *         Version reporting entry point          *
 *************************************************/
@@ -583,7 +728,8 @@ static lookup_info _lookup_info = {
   .close = NULL,			/* no close function */
   .tidy = NULL,				/* no tidy function */
   .quote = NULL,			/* no quoting function */
-  .version_report = dnsdb_version_report           /* version reporting */
+  .version_report = dnsdb_version_report,          /* version reporting */
+  .batch_find = dnsdb_batch_find	/* batch find function */
 };
 
 #ifdef DYNLOOKUP
@@ -23,19 +23,30 @@ lstat()) rather than a directory scan). */
 /* See local README for interface description. We open the directory to test
 whether it exists and whether it is searchable. However, we don't need to keep
 it open, because the "search" can be done by a call to lstat() rather than
-actually scanning through the list of files. */
+actually scanning through the list of files. The handle carries a number that
+is different for each open, which is used by the "snapshot" option below. */
+
+typedef struct {
+  unsigned long open_id;
+} dsearch_handle;
+
+static unsigned long dsearch_opens = 0;
 
 static void *
 dsearch_open(const uschar * dirname, uschar ** errmsg)
 {
 DIR * dp = exim_opendir(dirname);
+dsearch_handle * h;
+
 if (!dp)
   {
   *errmsg = string_open_failed("%s for directory search", dirname);
   return NULL;
   }
 closedir(dp);
-return (void *)(-1);
+h = store_get(sizeof(dsearch_handle), FALSE);
+h->open_id = ++dsearch_opens;
+return h;
 }
 
 
@@ -43,9 +54,6 @@ return (void *)(-1);
 *             Check entry point                  *
 *************************************************/
 
-/* The handle will always be (void *)(-1), but don't try casting it to an
-integer as this gives warnings on 64-bit systems. */
-
 static BOOL
 dsearch_check(void * handle, const uschar * filename, int modemask,
   uid_t * owners, gid_t * owngroups, uschar ** errmsg)
@@ -69,10 +77,206 @@ return FALSE;
 #define FILTER_FILE	BIT(2)
 #define FILTER_DIR	BIT(3)
 #define FILTER_SUBDIR	BIT(4)
+#define SNAPSHOT	BIT(5)
+
+/* With the "snapshot" option, the names in a directory are read once into a
+hash table, and lookups are answered from that without any call to lstat() for
+a name that is not there. This helps when stat calls are slow, as on network
+file systems. A snapshot is kept in malloc store for the life of the process,
+and is checked against the directory's modification time (one stat) the first
+time it is used after each open; the directory is read again when it has
+changed. A directory that had changed very recently when it was read is read
+again at the next check, in case it changed again within the same second. A
+limited number of snapshots is kept, the least recently used being dropped.
+
+Each name is stored preceded by its d_type from readdir(); the table holds the
+offset plus one of each name in the block of names, zero meaning empty. */
+
+typedef struct dsearch_snap {
+  struct dsearch_snap *next;
+  dev_t    dev;
+  ino_t    ino;
+  time_t   mtime;
+  BOOL     racy;
+  unsigned long checked;		/* open_id of the last check */
+  unsigned mask;			/* table size - 1 */
+  unsigned *table;
+  uschar   *names;
+  uschar   dirname[1];
+} dsearch_snap;
+
+#define DSEARCH_SNAPS_MAX 64
+
+static dsearch_snap *dsearch_snaps = NULL;
+
+
+static unsigned
+dsearch_hash(const uschar * s)
+{
+unsigned h = 2166136261u;		/* FNV-1a */
+while (*s) h = (h ^ *s++) * 16777619u;
+return h;
+}
+
+
+static void
+dsearch_snap_free(dsearch_snap * sp)
+{
+store_free(sp->table);
+store_free(sp->names);
+store_free(sp);
+}
+
+
+/* Read a directory into a new snapshot.
+
+Arguments:
+  dirname   the directory
+  statbuf   the result of stat() on it
+
+Returns:    the snapshot, or NULL if the directory could not be read
+*/
+
+static dsearch_snap *
+dsearch_snap_read(const uschar * dirname, const struct stat * statbuf)
+{
+DIR * dp = exim_opendir(dirname);
+dsearch_snap * sp;
+unsigned count = 0, size = 1024, used = 0;
+uschar * names;
+
+if (!dp) return NULL;
+names = store_malloc(size);
+
+for (struct dirent * ent; (ent = readdir(dp)); count++)
+  {
+  int len = Ustrlen(ent->d_name) + 2;
+  if (used + len > size)
+    {
+    uschar * newnames;
+    while (used + len > size) size *= 2;
+    newnames = store_malloc(size);
+    memcpy(newnames, names, used);
+    store_free(names);
+    names = newnames;
+    }
+#ifdef _DIRENT_HAVE_D_TYPE
+  names[used] = ent->d_type;
+#else
+  names[used] = 0;
+#endif
+  Ustrcpy(names + used + 1, ent->d_name);
+  used += len;
+  }
+closedir(dp);
+
+sp = store_malloc(sizeof(dsearch_snap) + Ustrlen(dirname));
+for (sp->mask = 15; sp->mask < 2 * count; ) sp->mask = 2 * sp->mask + 1;
+sp->table = store_malloc((sp->mask + 1) * sizeof(unsigned));
+memset(sp->table, 0, (sp->mask + 1) * sizeof(unsigned));
+sp->names = names;
+
+for (unsigned off = 0; off < used; off += Ustrlen(names + off + 1) + 2)
+  {
+  unsigned n = dsearch_hash(names + off + 1) & sp->mask;
+  while (sp->table[n]) n = (n + 1) & sp->mask;
+  sp->table[n] = off + 1;
+  }
+
+sp->dev = statbuf->st_dev;
+sp->ino = statbuf->st_ino;
+sp->mtime = statbuf->st_mtime;
+sp->racy = time(NULL) - statbuf->st_mtime < 2;
+Ustrcpy(sp->dirname, dirname);
+DEBUG(D_lookup) debug_printf_indent("dsearch: read %u names from %s\n",
+  count, dirname);
+return sp;
+}
+
+
+/* Find the current snapshot of a directory, reading it if necessary.
+
+Arguments:
+  h         the handle from dsearch_open()
+  dirname   the directory
+
+Returns:    the snapshot, or NULL, with errno set, on failure
+*/
+
+static dsearch_snap *
+dsearch_snap_get(dsearch_handle * h, const uschar * dirname)
+{
+dsearch_snap ** spp = &dsearch_snaps, * sp;
+struct stat statbuf;
+BOOL known;
+int count = 0;
+
+for (; (sp = *spp); spp = &sp->next, count++)
+  if (Ustrcmp(sp->dirname, dirname) == 0) break;
+
+if ((known = !!sp))
+  {
+  *spp = sp->next;			/* take out; goes back at the front */
+  if (sp->checked == h->open_id) goto FOUND;
+  }
+
+if (Ustat(dirname, &statbuf) < 0)
+  {
+  if (sp) dsearch_snap_free(sp);
+  return NULL;
+  }
+
+if (  sp && (sp->racy || sp->dev != statbuf.st_dev
+   || sp->ino != statbuf.st_ino || sp->mtime != statbuf.st_mtime))
+  {
+  dsearch_snap_free(sp);
+  sp = NULL;
+  }
+
+if (!sp)
+  {
+  if (!(sp = dsearch_snap_read(dirname, &statbuf))) return NULL;
+  if (!known && count >= DSEARCH_SNAPS_MAX)	/* drop the least recently used */
+    {
+    for (spp = &dsearch_snaps; (*spp)->next; ) spp = &(*spp)->next;
+    dsearch_snap_free(*spp);
+    *spp = NULL;
+    }
+  }
+sp->checked = h->open_id;
+
+FOUND:
+sp->next = dsearch_snaps;
+dsearch_snaps = sp;
+return sp;
+}
+
+
+/* Look up a name in a snapshot.
+
+Arguments:
+  sp        the snapshot
+  name      the name
+
+Returns:    pointer to the d_type byte before the name, or NULL if not there
+*/
+
+static const uschar *
+dsearch_snap_find(const dsearch_snap * sp, const uschar * name)
+{
+for (unsigned n = dsearch_hash(name) & sp->mask; sp->table[n];
+     n = (n + 1) & sp->mask)
+  {
+  const uschar * s = sp->names + sp->table[n] - 1;
+  if (Ustrcmp(s + 1, name) == 0) return s;
+  }
+return NULL;
+}
+
 
 /* See local README for interface description. We use lstat() instead of
 scanning the directory, as it is hopefully faster to let the OS do the scanning
-for us. */
+for us, unless a snapshot is in use. */
 
 static int
 dsearch_find(void * handle, const uschar * dirname, const uschar * keystring,
@@ -109,9 +313,50 @@ if (opts)
       else if (Ustrcmp(ele, "subdir") == 0)
 	flags |= FILTER_TYPE | FILTER_SUBDIR;	/* like dir but not "." or ".." */
       }
+    else if (Ustrcmp(ele, "snapshot") == 0)
+      flags |= SNAPSHOT;
   }
 
 filename = string_sprintf("%s/%s", dirname, keystring);
+
+/* With a snapshot, a name that is not there fails at once. For one that is,
+the type is usually known from the directory listing; otherwise it is found by
+lstat() in the normal way below. */
+
+if (flags & SNAPSHOT)
+  {
+  dsearch_snap * sp = dsearch_snap_get(handle, dirname);
+  const uschar * ent;
+
+  if (!sp)
+    {
+    save_errno = errno;
+    *errmsg = string_sprintf("%s: cannot read directory: %s", dirname,
+      strerror(errno));
+    errno = save_errno;
+    return DEFER;
+    }
+  if (!(ent = dsearch_snap_find(sp, keystring))) return FAIL;
+
+#ifdef _DIRENT_HAVE_D_TYPE
+  if (!(flags & FILTER_TYPE) || *ent != DT_UNKNOWN)
+    {
+    if (  !(flags & FILTER_TYPE)
+       || flags & FILTER_FILE && *ent == DT_REG
+       || flags & (FILTER_DIR | FILTER_SUBDIR) && *ent == DT_DIR
+          && (  flags & FILTER_DIR
+	     || keystring[0] != '.'
+	     || keystring[1] && keystring[1] != '.'
+       )     )
+      {
+      *result = string_copy_taint(flags & RET_FULL ? filename : keystring, FALSE);
+      return OK;
+      }
+    return FAIL;
+    }
+#endif
+  }
+
 if (  Ulstat(filename, &statbuf) >= 0
    && (  !(flags & FILTER_TYPE)
       || (flags & FILTER_FILE && S_ISREG(statbuf.st_mode))
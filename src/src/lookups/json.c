@@ -33,6 +33,96 @@ json_free(void * p)
 /* debug_printf("%s: %p\n", __FUNCTION__, p); */
 }
 
+
+/* A file is parsed once for each open handle. When json_cache is set, the
+parsed document is also kept, in malloc'd memory, after the handle is closed
+by search_tidyup(), and used by later handles while the file's inode, size and
+modification time are unchanged. This suits large files in long-lived
+processes. The library keeps each object as a hash table, so keys are found
+without a walk. */
+
+typedef struct json_kept {
+  struct json_kept * next;
+  uschar *	filename;
+  dev_t		dev;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+  json_t *	doc;
+} json_kept;
+
+static json_kept * json_kept_docs = NULL;
+
+typedef struct {
+  FILE *	f;
+  json_t *	doc;
+} json_handle;
+
+
+static json_t *
+json_load(FILE * f, uschar ** errmsg)
+{
+json_t * j;
+json_error_t jerr;
+
+rewind(f);
+if (!(j = json_loadf(f, 0, &jerr)))
+  *errmsg = string_sprintf("json error on open: %.*s\n",
+       JSON_ERROR_TEXT_LENGTH, jerr.text);
+return j;
+}
+
+
+/* Get the document from the kept ones, or parse it into malloc'd memory and
+keep it */
+
+static json_t *
+json_kept_doc(FILE * f, const uschar * filename, uschar ** errmsg)
+{
+struct stat statbuf;
+json_kept * k;
+json_t * j;
+
+if (fstat(fileno(f), &statbuf) != 0)
+  return json_load(f, errmsg);
+
+for (k = json_kept_docs; k; k = k->next)
+  if (Ustrcmp(k->filename, filename) == 0) break;
+
+if (k && k->doc)
+  {
+  if (  k->dev == statbuf.st_dev && k->ino == statbuf.st_ino
+     && k->size == statbuf.st_size && k->mtime == statbuf.st_mtime)
+    {
+    DEBUG(D_lookup) debug_printf_indent("json: using kept parse of %s\n", filename);
+    return k->doc;
+    }
+  json_set_alloc_funcs(malloc, free);
+  json_decref(k->doc);
+  k->doc = NULL;
+  }
+
+json_set_alloc_funcs(malloc, free);
+j = json_load(f, errmsg);
+json_set_alloc_funcs(json_malloc, json_free);
+if (!j) return NULL;
+
+if (!k)
+  {
+  k = store_malloc(sizeof(json_kept));
+  k->filename = string_copy_malloc(filename);
+  k->next = json_kept_docs;
+  json_kept_docs = k;
+  }
+k->dev = statbuf.st_dev;
+k->ino = statbuf.st_ino;
+k->size = statbuf.st_size;
+k->mtime = statbuf.st_mtime;
+k->doc = j;
+DEBUG(D_lookup) debug_printf_indent("json: keeping parse of %s\n", filename);
+return j;
+}
+
 /*************************************************
 *              Open entry point                  *
 *************************************************/
@@ -43,12 +133,19 @@ static void *
 json_open(const uschar * filename, uschar ** errmsg)
 {
 FILE * f;
+json_handle * h;
 
 json_set_alloc_funcs(json_malloc, json_free);
 
 if (!(f = Ufopen(filename, "rb")))
+  {
   *errmsg = string_open_failed("%s for json search", filename);
-return f;
+  return NULL;
+  }
+h = store_get(sizeof(json_handle), FALSE);
+h->f = f;
+h->doc = NULL;
+return h;
 }
 
 
@@ -61,7 +158,7 @@ static BOOL
 json_check(void *handle, const uschar *filename, int modemask, uid_t *owners,
   gid_t *owngroups, uschar **errmsg)
 {
-return lf_check_file(fileno((FILE *)handle), filename, S_IFREG, modemask,
+return lf_check_file(fileno(((json_handle *)handle)->f), filename, S_IFREG, modemask,
   owners, owngroups, "json", errmsg) == 0;
 }
 
@@ -78,20 +175,15 @@ json_find(void * handle, const uschar * filename, const uschar * keystring,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-FILE * f = handle;
-json_t * j, * j0;
-json_error_t jerr;
+json_handle * h = handle;
+json_t * j;
 uschar * key;
 int sep = 0;
 
-rewind(f);
-if (!(j = json_loadf(f, 0, &jerr)))
-  {
-  *errmsg = string_sprintf("json error on open: %.*s\n",
-       JSON_ERROR_TEXT_LENGTH, jerr.text);
+if (!h->doc && !(h->doc = json_cache
+		  ? json_kept_doc(h->f, filename, errmsg) : json_load(h->f, errmsg)))
   return FAIL;
-  }
-j0 = j;
+j = h->doc;
 
 for (int k = 1;  (key = string_nextinlist(&keystring, &sep, NULL, 0)); k++)
   {
@@ -108,7 +200,6 @@ for (int k = 1;  (key = string_nextinlist(&keystring, &sep, NULL, 0)); k++)
       ? US"bad index, or not json array"
       : US"no such key, or not json object",
       k, key);
-    json_decref(j0);
     return FAIL;
     }
   }
@@ -129,7 +220,6 @@ switch (json_typeof(j))
   case JSON_NULL:	*result = NULL;		break;
   default:		*result = US json_dumps(j, 0); break;
   }
-json_decref(j0);
 return OK;
 }
 
@@ -144,7 +234,7 @@ return OK;
 static void
 json_close(void *handle)
 {
-(void)fclose((FILE *)handle);
+(void)fclose(((json_handle *)handle)->f);
 }
 
 
@@ -90,6 +90,33 @@ static LDAP_CONNECTION *ldap_connections = NULL;
 
 
 
+/*************************************************
+*          Discard a cached connection           *
+*************************************************/
+
+/* Called when a connection has failed, so that later searches make a new one
+instead of failing again on the same connection.
+
+Argument:  the connection
+Returns:   nothing
+*/
+
+static void
+ldap_drop_connection(LDAP_CONNECTION *lcp)
+{
+for (LDAP_CONNECTION ** lp = &ldap_connections; *lp; lp = &(*lp)->next)
+  if (*lp == lcp)
+    {
+    *lp = lcp->next;
+    break;
+    }
+DEBUG(D_lookup) debug_printf_indent("dropping LDAP connection to %s:%d\n",
+  lcp->host, lcp->port);
+ldap_unbind(lcp->ld);
+}
+
+
+
 /*************************************************
 *         Internal search function               *
 *************************************************/
@@ -163,6 +190,7 @@ int    port;
 int    rescount = 0;
 BOOL   attribute_found = FALSE;
 BOOL   ldapi = FALSE;
+BOOL   reused = FALSE;
 
 DEBUG(D_lookup) debug_printf_indent("perform_ldap_search:"
     " ldap%s URL = \"%s\" server=%s port=%d "
@@ -252,6 +280,7 @@ relevant for ldapi. The host name pointer is set to NULL if no host was given
 (implying the library default), rather than to the empty string. Note that in
 this case, there is no difference between ldap and ldapi. */
 
+CONNECT:
 for (lcp = ldap_connections; lcp; lcp = lcp->next)
   {
   if ((host == NULL) != (lcp->host == NULL) ||
@@ -511,9 +540,12 @@ if (!lcp)
 /* Found cached connection */
 
 else
+  {
   DEBUG(D_lookup)
     debug_printf_indent("re-using cached connection to LDAP server %s%s\n",
       host, porttext);
+  reused = TRUE;
+  }
 
 /* Bind with the user/password supplied, or an anonymous bind if these values
 are NULL, unless a cached connection is already bound with the same values. */
@@ -555,7 +587,7 @@ if (  !lcp->bound
     {
     *errmsg = string_sprintf("failed to bind the LDAP connection to server "
       "%s%s - ldap_bind() returned -1", host, porttext);
-    goto RETURN_ERROR;
+    goto RETURN_ERROR_CONNECTION;
     }
 
   if ((rc = ldap_result(lcp->ld, msgid, 1, timeoutptr, &result)) <= 0)
@@ -564,7 +596,7 @@ if (  !lcp->bound
       "%s%s - LDAP error: %s", host, porttext,
       rc == -1 ? "result retrieval failed" : "timeout" );
     result = NULL;
-    goto RETURN_ERROR;
+    goto RETURN_ERROR_CONNECTION;
     }
 
   rc = ldap_result2error(lcp->ld, result, 0);
@@ -652,7 +684,7 @@ if (msgid == -1)
   *errmsg = string_sprintf("ldap_search failed");
 #endif
 
-  goto RETURN_ERROR;
+  goto RETURN_ERROR_CONNECTION;
   }
 
 /* Loop to pick up results as they come in, setting a timeout if one was
@@ -886,7 +918,7 @@ if (rc == -1 || !result)
       lcp->ld->ld_errno, ldap_err2string(lcp->ld->ld_errno));
 #endif
 
-  goto RETURN_ERROR;
+  goto RETURN_ERROR_CONNECTION;
   }
 
 /* A return code that isn't -1 doesn't necessarily mean there were no problems
@@ -1024,6 +1056,23 @@ if (result) ldap_msgfree(result);
 ldap_free_urldesc(ludp);
 return OK;
 
+/* A failure of the connection itself means it is of no further use. If it was
+a cached one, the server may simply have closed it while it was idle, so unless
+some results have already been seen, try again once on a new connection. */
+
+RETURN_ERROR_CONNECTION:
+ldap_drop_connection(lcp);
+if (reused && rescount == 0)
+  {
+  DEBUG(D_lookup)
+    debug_printf_indent("%s: retrying on a new connection\n", *errmsg);
+  if (result) ldap_msgfree(result);
+  result = NULL;
+  reused = FALSE;
+  goto CONNECT;
+  }
+goto RETURN_ERROR;
+
 /* Error returns */
 
 RETURN_ERROR_BREAK:
@@ -46,6 +46,19 @@ BOOL defer_break = FALSE;
 
 DEBUG(D_lookup) debug_printf_indent("%s query: \"%s\" opts '%s'\n", name, query, opts);
 
+/* If there are helper processes for SQL lookups, pass the query to one of
+them. The lookup type name is the prefix of the servers option name. */
+
+if (lookup_proxy_socket && *lookup_proxy_socket)
+  {
+  const uschar * u = Ustrchr(optionname, '_');
+  uschar * type = string_copyn(optionname,
+    u ? u - optionname : Ustrlen(optionname));
+
+  if (search_proxy_query(type, query, opts, result, errmsg, do_cache, &rc))
+    return rc;
+  }
+
 /* Handle queries that do have server information at the start. */
 
 if (Ustrncmp(query, "servers", 7) == 0)
@@ -124,8 +137,9 @@ else
 
   if (opts)
     {
+    const uschar * list = opts;
     uschar * ele;
-    for (int sep = ','; ele = string_nextinlist(&opts, &sep, NULL, 0); )
+    for (int sep = ','; ele = string_nextinlist(&list, &sep, NULL, 0); )
       if (Ustrncmp(ele, "servers=", 8) == 0)
 	{ serverlist = ele + 8; break; }
     }
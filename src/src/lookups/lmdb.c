@@ -12,12 +12,36 @@
 
 #include <lmdb.h>
 
+/* Environments are kept open for the life of the process, so that each
+search_open() after a search_tidyup() does not have to map the file again, and
+a read transaction left over from a close is renewed rather than a new one
+being started. LMDB does not allow an environment to be used after a fork, so
+they are recorded with the pid of the process that opened them, and a child
+opens its own. An environment is identified by the file's name, device and
+inode; if the file has been replaced the old one is closed once it is not in
+use. */
+
+typedef struct lmdb_env
+{
+struct lmdb_env *next;
+MDB_env *env;
+MDB_dbi db_dbi;
+MDB_txn *spare;		/* reset read transaction for re-use */
+int refs;		/* handles open on this environment */
+pid_t pid;
+dev_t dev;
+ino_t ino;
+uschar name[1];
+} lmdb_env;
+
 typedef struct lmdbstrct
 {
+lmdb_env *e;
 MDB_txn *txn;
-MDB_dbi db_dbi;
 } Lmdbstrct;
 
+static lmdb_env *lmdb_envs = NULL;
+
 
 /*************************************************
 *              Open entry point                  *
@@ -26,43 +50,109 @@ MDB_dbi db_dbi;
 static void *
 lmdb_open(const uschar * filename, uschar ** errmsg)
 {
+lmdb_env * e;
 MDB_env * db_env = NULL;
+MDB_txn * txn = NULL;
+MDB_dbi dbi;
 Lmdbstrct * lmdb_p;
+struct stat statbuf;
+pid_t pid = getpid();
 int ret, save_errno;
 const uschar * errstr;
 
-lmdb_p = store_get(sizeof(Lmdbstrct), FALSE);
-lmdb_p->txn = NULL;
-
-if ((ret = mdb_env_create(&db_env)))
+if (Ustat(filename, &statbuf) < 0)
   {
-  errstr = US"create environment";
-  goto bad;
+  *errmsg = string_open_failed("%s for LMDB lookup", filename);
+  return NULL;
   }
 
-if ((ret = mdb_env_open(db_env, CS filename, MDB_NOSUBDIR|MDB_RDONLY, 0660)))
+for (lmdb_env ** ep = &lmdb_envs; (e = *ep); )
+  if (e->pid == pid && Ustrcmp(e->name, filename) == 0)
+    {
+    if (e->dev == statbuf.st_dev && e->ino == statbuf.st_ino) break;
+    if (e->refs > 0) ep = &e->next;
+    else
+      {
+      DEBUG(D_lookup) debug_printf_indent("LMDB: %s replaced\n", filename);
+      *ep = e->next;
+      if (e->spare) mdb_txn_abort(e->spare);
+      mdb_env_close(e->env);
+      store_free(e);
+      }
+    }
+  else
+    ep = &e->next;
+
+if (!e)
   {
-  errstr = string_sprintf("open environment with %s", filename);
-  goto bad;
+  if ((ret = mdb_env_create(&db_env)))
+    {
+    errstr = US"create environment";
+    goto bad;
+    }
+
+  if ((ret = mdb_env_open(db_env, CS filename,
+		      MDB_NOSUBDIR|MDB_RDONLY|MDB_NOTLS, 0660)))
+    {
+    errstr = string_sprintf("open environment with %s", filename);
+    goto bad;
+    }
+
+  if ((ret = mdb_txn_begin(db_env, NULL, MDB_RDONLY, &txn)))
+    {
+    errstr = US"start transaction";
+    goto bad;
+    }
+
+  if ((ret = mdb_open(txn, NULL, 0, &dbi)))
+    {
+    errstr = US"open database";
+    goto bad;
+    }
+
+  e = store_malloc(sizeof(lmdb_env) + Ustrlen(filename));
+  e->env = db_env;
+  e->db_dbi = dbi;
+  e->spare = NULL;
+  e->refs = 0;
+  e->pid = pid;
+  e->dev = statbuf.st_dev;
+  e->ino = statbuf.st_ino;
+  Ustrcpy(e->name, filename);
+  e->next = lmdb_envs;
+  lmdb_envs = e;
   }
 
-if ((ret = mdb_txn_begin(db_env, NULL, MDB_RDONLY, &lmdb_p->txn)))
+/* Re-use a reset read transaction if there is one */
+
+else if ((txn = e->spare))
   {
-  errstr = US"start transaction";
-  goto bad;
+  e->spare = NULL;
+  if ((ret = mdb_txn_renew(txn)))
+    {
+    mdb_txn_abort(txn);
+    txn = NULL;
+    }
+  else
+    DEBUG(D_lookup) debug_printf_indent("LMDB: re-using environment\n");
   }
 
-if ((ret = mdb_open(lmdb_p->txn, NULL, 0, &lmdb_p->db_dbi)))
+if (!txn && (ret = mdb_txn_begin(e->env, NULL, MDB_RDONLY, &txn)))
   {
-  errstr = US"open database";
-  goto bad;
+  *errmsg = string_sprintf("LMDB: Unable to start transaction: %s",
+    mdb_strerror(ret));
+  return NULL;
   }
 
+lmdb_p = store_get(sizeof(Lmdbstrct), FALSE);
+lmdb_p->e = e;
+lmdb_p->txn = txn;
+e->refs++;
 return lmdb_p;
 
 bad:
   save_errno = errno;
-  if (lmdb_p->txn) mdb_txn_abort(lmdb_p->txn);
+  if (txn) mdb_txn_abort(txn);
   if (db_env) mdb_env_close(db_env);
   *errmsg = string_sprintf("LMDB: Unable to %s: %s", errstr,  mdb_strerror(ret));
   errno = save_errno;
@@ -70,6 +160,54 @@ bad:
 }
 
 
+/*************************************************
+*          Longest matching prefix               *
+*************************************************/
+
+/* For the "prefix" option: find the longest key in the database that is a
+leading part of the given string. The keys are in sorted order, so such a key,
+if there is one, is the lookup string itself or comes before it. If the key
+before it is not a leading part of it, none longer than their common part can
+be, so the search is repeated with the string cut down to that.
+
+Arguments:
+  cursor     a cursor on the database
+  keystring  the string
+  length     its length
+  data       where to return the data for the key found
+
+Returns:     0 if a key was found, MDB_NOTFOUND, or another LMDB error
+*/
+
+static int
+lmdb_prefix_find(MDB_cursor * cursor, const uschar * keystring, int length,
+  MDB_val * data)
+{
+while (length > 0)
+  {
+  MDB_val dbkey = { .mv_size = length, .mv_data = CS keystring };
+  int ret = mdb_cursor_get(cursor, &dbkey, data, MDB_SET_RANGE);
+  int common;
+
+  if (ret == 0)
+    {
+    if (dbkey.mv_size == length && memcmp(dbkey.mv_data, keystring, length) == 0)
+      return 0;
+    ret = mdb_cursor_get(cursor, &dbkey, data, MDB_PREV);
+    }
+  else if (ret == MDB_NOTFOUND)
+    ret = mdb_cursor_get(cursor, &dbkey, data, MDB_LAST);
+  if (ret) return ret;
+
+  for (common = 0; common < dbkey.mv_size && common < length
+       && (US dbkey.mv_data)[common] == keystring[common]; ) common++;
+  if (common == dbkey.mv_size) return 0;	/* The key is a leading part */
+  length = common;
+  }
+return MDB_NOTFOUND;
+}
+
+
 /*************************************************
 *              Find entry point                  *
 *************************************************/
@@ -80,15 +218,39 @@ lmdb_find(void * handle, const uschar * filename,
     uint * do_cache, const uschar * opts)
 {
 int ret;
+BOOL prefix = FALSE;
 MDB_val dbkey, data;
 Lmdbstrct * lmdb_p = handle;
 
+if (opts)
+  {
+  int sep = ',';
+  uschar * ele;
+
+  while ((ele = string_nextinlist(&opts, &sep, NULL, 0)))
+    if (Ustrcmp(ele, "prefix") == 0)
+      { prefix = TRUE; break; }
+  }
+
 dbkey.mv_data = CS keystring;
 dbkey.mv_size = length;
 
-DEBUG(D_lookup) debug_printf_indent("LMDB: lookup key: %s\n", CS keystring);
+DEBUG(D_lookup) debug_printf_indent("LMDB: lookup %skey: %s\n",
+  prefix ? "prefix " : "", CS keystring);
 
-if ((ret = mdb_get(lmdb_p->txn, lmdb_p->db_dbi, &dbkey, &data)) == 0)
+if (prefix)
+  {
+  MDB_cursor * cursor;
+  if ((ret = mdb_cursor_open(lmdb_p->txn, lmdb_p->e->db_dbi, &cursor)) == 0)
+    {
+    ret = lmdb_prefix_find(cursor, keystring, length, &data);
+    mdb_cursor_close(cursor);
+    }
+  }
+else
+  ret = mdb_get(lmdb_p->txn, lmdb_p->e->db_dbi, &dbkey, &data);
+
+if (ret == 0)
   {
   *result = string_copyn(US data.mv_data, data.mv_size);
   DEBUG(D_lookup) debug_printf_indent("LMDB: lookup result: %s\n", *result);
@@ -113,13 +275,22 @@ else
 *              Close entry point                 *
 *************************************************/
 
+/* The environment stays open, and the read transaction is kept for re-use. */
+
 static void
 lmdb_close(void * handle)
 {
 Lmdbstrct * lmdb_p = handle;
-MDB_env * db_env = mdb_txn_env(lmdb_p->txn);
-mdb_txn_abort(lmdb_p->txn);
-mdb_env_close(db_env);
+lmdb_env * e = lmdb_p->e;
+
+e->refs--;
+if (e->spare)
+  mdb_txn_abort(lmdb_p->txn);
+else
+  {
+  mdb_txn_reset(lmdb_p->txn);
+  e->spare = lmdb_p->txn;
+  }
 }
 
 
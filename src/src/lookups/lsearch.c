@@ -18,6 +18,41 @@ enum {
   LSEARCH_IP            /* IP addresses and networks */
 };
 
+/* When lsearch_index is set, each file is indexed the first time it is
+searched in a process, and the index is kept until the file changes. Every
+line that starts a key has an entry, in file order, holding the line's offset
+and the hash of its lowercased key. Entries with the same hash are chained in
+file order. Keys that are not plain strings for wildlsearch or nwildlsearch are
+flagged, and are also listed in file order, because for those searches they
+must still be tried one by one. */
+
+#define LSI_WILD	1	/* Not a literal key for nwildlsearch */
+#define LSI_EXPAND	2	/* Not a literal key for wildlsearch */
+
+typedef struct {
+  long		offset;		/* Start of the line */
+  unsigned	hash;
+  int		flags;
+  int		next;		/* Next entry with this hash, or -1 */
+} lsearch_index_entry;
+
+typedef struct lsearch_index_block {
+  struct lsearch_index_block * next;
+  uschar *	filename;
+  dev_t		dev;
+  ino_t		ino;
+  off_t		size;
+  time_t	mtime;
+  int		count;
+  int		nbuckets;	/* A power of two */
+  int *		buckets;
+  lsearch_index_entry * entries;
+  int		nspecial;
+  int *		specials;	/* Flagged entries, in file order */
+} lsearch_index_block;
+
+static lsearch_index_block * lsearch_indexes = NULL;
+
 
 
 /*************************************************
@@ -62,6 +97,9 @@ Extra argument:
   type     one of the values LSEARCH_PLAIN, LSEARCH_WILD, LSEARCH_NWILD, or
            LSEARCH_IP
 
+  offset   if >= 0, try only the line that starts at this offset (from an
+           index); otherwise search from the start of the file
+
 There is some messy logic in here to cope with very long data lines that do not
 fit into the fixed sized buffer. Most of the time this will never be exercised,
 but people do occasionally do weird things. */
@@ -69,10 +107,10 @@ but people do occasionally do weird things. */
 static int
 internal_lsearch_find(void * handle, const uschar * filename,
   const uschar * keystring, int length, uschar ** result, uschar ** errmsg,
-  int type, const uschar * opts)
+  int type, const uschar * opts, long offset)
 {
 FILE *f = handle;
-BOOL ret_full = FALSE;
+BOOL ret_full = FALSE, line_tried = FALSE;
 int old_pool = store_pool;
 rmark reset_point = NULL;
 uschar buffer[4096];
@@ -99,7 +137,11 @@ if (type == LSEARCH_WILD || type == LSEARCH_NWILD)
   reset_point = store_mark();
   }
 
-rewind(f);
+if (offset < 0)
+  rewind(f);
+else if (fseek(f, offset, SEEK_SET) != 0)
+  goto NOT_FOUND;
+
 for (BOOL this_is_eol, last_was_eol = TRUE;
      Ufgets(buffer, sizeof(buffer), f) != NULL;
      last_was_eol = this_is_eol)
@@ -110,6 +152,9 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
   gstring * yield;
   uschar *s = buffer;
 
+  if (offset >= 0 && line_tried) break;
+  line_tried = TRUE;
+
   /* Check whether this the final segment of a line. If it follows an
   incomplete part-line, skip it. */
 
@@ -307,6 +352,7 @@ for (BOOL this_is_eol, last_was_eol = TRUE;
 
 /* Reset dynamic store, if we need to */
 
+NOT_FOUND:
 if (reset_point)
   {
   store_reset(reset_point);
@@ -317,6 +363,205 @@ return FAIL;
 }
 
 
+
+/*************************************************
+*          Build or find a file's index          *
+*************************************************/
+
+static unsigned
+lsearch_hash(const uschar * key, int length)
+{
+unsigned hash = 0;
+while (length-- > 0) hash = hash * 33 ^ tolower(*key++);
+return hash;
+}
+
+/* Read the file, note where each key line starts, and hash the keys. The keys
+are extracted in the same way as by internal_lsearch_find().
+
+Arguments:
+  f          the open file
+  filename   its name
+
+Returns:     the index, or NULL if the file cannot be examined
+*/
+
+static lsearch_index_block *
+lsearch_get_index(FILE * f, const uschar * filename)
+{
+lsearch_index_block * ix;
+struct stat statbuf;
+uschar buffer[4096];
+long pos;
+int max = 1024;
+
+if (fstat(fileno(f), &statbuf) != 0) return NULL;
+
+for (ix = lsearch_indexes; ix; ix = ix->next)
+  if (Ustrcmp(ix->filename, filename) == 0) break;
+
+if (ix)
+  {
+  if (  ix->dev == statbuf.st_dev && ix->ino == statbuf.st_ino
+     && ix->size == statbuf.st_size && ix->mtime == statbuf.st_mtime)
+    return ix;
+  store_free(ix->entries);
+  store_free(ix->buckets);
+  store_free(ix->specials);
+  }
+else
+  {
+  ix = store_malloc(sizeof(lsearch_index_block));
+  ix->filename = string_copy_malloc(filename);
+  ix->next = lsearch_indexes;
+  lsearch_indexes = ix;
+  }
+
+ix->count = ix->nspecial = 0;
+ix->entries = store_malloc(max * sizeof(lsearch_index_entry));
+
+rewind(f);
+for (BOOL this_is_eol, last_was_eol = TRUE;
+     (pos = ftell(f)) >= 0 && Ufgets(buffer, sizeof(buffer), f) != NULL;
+     last_was_eol = this_is_eol)
+  {
+  int p = Ustrlen(buffer);
+  uschar * s = buffer, * t;
+  lsearch_index_entry * e;
+
+  this_is_eol = p > 0 && buffer[p-1] == '\n';
+  if (!last_was_eol) continue;
+  if (this_is_eol)
+    {
+    while (p > 0 && isspace((uschar)buffer[p-1])) p--;
+    buffer[p] = 0;
+    }
+  if (buffer[0] == 0 || buffer[0] == '#' || isspace(buffer[0])) continue;
+
+  if (*s == '\"')
+    {
+    t = s++;
+    while (*s && *s != '\"')
+      {
+      *t++ = *s == '\\' ? string_interpret_escape(CUSS &s) : *s;
+      s++;
+      }
+    }
+  else
+    {
+    while (*s && *s != ':' && !isspace(*s)) s++;
+    t = s;
+    }
+
+  if (ix->count >= max)
+    {
+    lsearch_index_entry * new = store_malloc(2 * max * sizeof(lsearch_index_entry));
+    memcpy(new, ix->entries, max * sizeof(lsearch_index_entry));
+    store_free(ix->entries);
+    ix->entries = new;
+    max *= 2;
+    }
+  e = ix->entries + ix->count++;
+  e->offset = pos;
+  e->hash = lsearch_hash(buffer, t - buffer);
+
+  /* For the wild searches, a key that might be a pattern, a negation, a list
+  reference or a lookup is not literal. So is one that might be changed by
+  expansion, for wildlsearch. */
+
+  e->flags = t == buffer || Ustrchr("^*!+@", buffer[0])
+	      || memchr(buffer, ';', t - buffer)
+    ? LSI_WILD | LSI_EXPAND
+    : memchr(buffer, '$', t - buffer) || memchr(buffer, '\\', t - buffer)
+    ? LSI_EXPAND : 0;
+  if (e->flags) ix->nspecial++;
+  }
+
+for (ix->nbuckets = 16; ix->nbuckets < ix->count; ) ix->nbuckets *= 2;
+ix->buckets = store_malloc(ix->nbuckets * sizeof(int));
+memset(ix->buckets, 0xff, ix->nbuckets * sizeof(int));		/* all -1 */
+ix->specials = store_malloc((ix->nspecial + 1) * sizeof(int));
+
+/* Chain the entries backwards, so that each chain is in file order */
+
+for (int i = ix->count - 1, j = ix->nspecial; i >= 0; i--)
+  {
+  lsearch_index_entry * e = ix->entries + i;
+  int * bp = ix->buckets + (e->hash & (ix->nbuckets - 1));
+  e->next = *bp;
+  *bp = i;
+  if (e->flags) ix->specials[--j] = i;
+  }
+
+ix->dev = statbuf.st_dev;
+ix->ino = statbuf.st_ino;
+ix->size = statbuf.st_size;
+ix->mtime = statbuf.st_mtime;
+
+DEBUG(D_lookup) debug_printf_indent("lsearch: indexed %d keys (%d special) in %s\n",
+  ix->count, ix->nspecial, filename);
+return ix;
+}
+
+
+
+/*************************************************
+*     Find, using an index if there is one       *
+*************************************************/
+
+/* The candidate lines are those whose key hashes the same as the key sought
+and is literal for this kind of search. Any flagged keys that come before a
+candidate in the file are tried first, as they would be by a linear search.
+
+Arguments and returns are as for internal_lsearch_find(), without the offset.
+*/
+
+static int
+lsearch_indexed_find(void * handle, const uschar * filename,
+  const uschar * keystring, int length, uschar ** result, uschar ** errmsg,
+  int type, const uschar * opts)
+{
+lsearch_index_block * ix;
+lsearch_index_entry * entries;
+int flag = type == LSEARCH_WILD ? LSI_EXPAND
+	  : type == LSEARCH_NWILD ? LSI_WILD : 0;
+unsigned hash;
+int e, si = 0;
+
+if (!lsearch_index || !(ix = lsearch_get_index(handle, filename)))
+  return internal_lsearch_find(handle, filename, keystring, length, result,
+    errmsg, type, opts, -1);
+
+entries = ix->entries;
+hash = lsearch_hash(keystring, length);
+e = ix->buckets[hash & (ix->nbuckets - 1)];
+
+for (;;)
+  {
+  int rc;
+
+  while (e >= 0 && (entries[e].hash != hash || entries[e].flags & flag))
+    e = entries[e].next;
+
+  if (flag)
+    for (; si < ix->nspecial
+	   && (e < 0 || entries[ix->specials[si]].offset < entries[e].offset);
+	 si++)
+      if (  entries[ix->specials[si]].flags & flag
+	 && (rc = internal_lsearch_find(handle, filename, keystring, length,
+		  result, errmsg, type, opts, entries[ix->specials[si]].offset))
+	    != FAIL)
+	return rc;
+
+  if (e < 0) return FAIL;
+  if ((rc = internal_lsearch_find(handle, filename, keystring, length, result,
+	    errmsg, type, opts, entries[e].offset)) != FAIL)
+    return rc;
+  e = entries[e].next;
+  }
+}
+
+
 /*************************************************
 *         Find entry point for lsearch           *
 *************************************************/
@@ -328,7 +573,7 @@ lsearch_find(void * handle, const uschar * filename, const uschar * keystring,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-return internal_lsearch_find(handle, filename, keystring, length, result,
+return lsearch_indexed_find(handle, filename, keystring, length, result,
   errmsg, LSEARCH_PLAIN, opts);
 }
 
@@ -345,7 +590,7 @@ wildlsearch_find(void * handle, const uschar * filename, const uschar * keystrin
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-return internal_lsearch_find(handle, filename, keystring, length, result,
+return lsearch_indexed_find(handle, filename, keystring, length, result,
   errmsg, LSEARCH_WILD, opts);
 }
 
@@ -362,7 +607,7 @@ nwildlsearch_find(void * handle, const uschar * filename, const uschar * keystri
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
-return internal_lsearch_find(handle, filename, keystring, length, result,
+return lsearch_indexed_find(handle, filename, keystring, length, result,
   errmsg, LSEARCH_NWILD, opts);
 }
 
@@ -383,7 +628,7 @@ iplsearch_find(void * handle, uschar const * filename, const uschar * keystring,
 if ((length == 1 && keystring[0] == '*') ||
     string_is_ip_address(keystring, NULL) != 0)
   return internal_lsearch_find(handle, filename, keystring, length, result,
-    errmsg, LSEARCH_IP, opts);
+    errmsg, LSEARCH_IP, opts, -1);
 
 *errmsg = string_sprintf("\"%s\" is not a valid iplsearch key (an IP "
 "address, with optional CIDR mask, is wanted): "
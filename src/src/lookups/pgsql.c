@@ -25,6 +25,12 @@ typedef struct pgsql_connection {
 
 static pgsql_connection *pgsql_connections = NULL;
 
+/* While a batch of queries is being sent as one multi-statement string, the
+result of each statement is put here; NULL when it returned no data. */
+
+static uschar ** pgsql_batch_results = NULL;
+static int pgsql_batch_count = 0;
+
 
 
 /*************************************************
@@ -83,6 +89,92 @@ DEBUG(D_lookup) debug_printf_indent("PGSQL: %s\n", message);
 
 
 
+/*************************************************
+*        Build the text of a query result        *
+*************************************************/
+
+/* Turn the result of one statement into the string returned by a lookup.
+
+Arguments:
+  pg_result    the result from the server
+  query        the query, for error messages
+  resp         where to put the text; left NULL if no data was returned
+  errmsg       where to point an error message
+  do_cache     set zero if data is changed
+
+Returns:       OK or DEFER
+*/
+
+static int
+pgsql_result_text(PGresult * pg_result, const uschar * query, gstring ** resp,
+  uschar ** errmsg, uint * do_cache)
+{
+gstring * result = NULL;
+unsigned int num_fields, num_tuples;
+
+switch(PQresultStatus(pg_result))
+  {
+  case PGRES_EMPTY_QUERY:
+  case PGRES_COMMAND_OK:
+    /* The command was successful but did not return any data since it was
+    not SELECT but either an INSERT, UPDATE or DELETE statement. Tell the
+    high level code to not cache this query, and clean the current cache for
+    this handle by setting *do_cache zero. */
+
+    result = string_cat(result, US PQcmdTuples(pg_result));
+    *do_cache = 0;
+    DEBUG(D_lookup) debug_printf_indent("PGSQL: command does not return any data "
+      "but was successful. Rows affected: %s\n", string_from_gstring(result));
+    break;
+
+  case PGRES_TUPLES_OK:
+    break;
+
+  default:
+    /* This was the original code:
+    *errmsg = string_sprintf("PGSQL: query failed: %s\n",
+			     PQresultErrorMessage(pg_result));
+    This was suggested by a user:
+    */
+
+    *errmsg = string_sprintf("PGSQL: query failed: %s (%s) (%s)\n",
+			   PQresultErrorMessage(pg_result),
+			   PQresStatus(PQresultStatus(pg_result)), query);
+    return DEFER;
+  }
+
+/* Find the number of fields returned. If this is one, we don't add field
+names to the data. Otherwise we do. If the query did not return anything we
+skip the for loop; this also applies to the case PGRES_COMMAND_OK. */
+
+num_fields = PQnfields(pg_result);
+num_tuples = PQntuples(pg_result);
+
+/* Get the fields and construct the result string. If there is more than one
+row, we insert '\n' between them. */
+
+for (int i = 0; i < num_tuples; i++)
+  {
+  if (result)
+    result = string_catn(result, US"\n", 1);
+
+  if (num_fields == 1)
+    result = string_catn(result,
+	US PQgetvalue(pg_result, i, 0), PQgetlength(pg_result, i, 0));
+  else
+    for (int j = 0; j < num_fields; j++)
+      {
+      uschar *tmp = US PQgetvalue(pg_result, i, j);
+      result = lf_quote(US PQfname(pg_result, j), tmp, Ustrlen(tmp), result);
+      }
+  }
+
+*resp = result;
+return OK;
+}
+
+
+
 /*************************************************
 *        Internal search function                *
 *************************************************/
@@ -128,7 +220,6 @@ PGresult *pg_result = NULL;
 
 gstring * result = NULL;
 int yield = DEFER;
-unsigned int num_fields, num_tuples;
 pgsql_connection *cn;
 rmark reset_point = store_mark();
 uschar *server_copy = NULL;
@@ -277,67 +368,45 @@ else
     server_copy);
   }
 
-/* Run the query */
+/* For a batch, the statements go to the server as one string and each
+produces its own result, which are picked up in turn. PQgetResult() must be
+called until it returns NULL before the connection can be used again. */
 
-pg_result = PQexec(pg_conn, CS query);
-switch(PQresultStatus(pg_result))
+if (pgsql_batch_count > 0)
   {
-  case PGRES_EMPTY_QUERY:
-  case PGRES_COMMAND_OK:
-    /* The command was successful but did not return any data since it was
-    not SELECT but either an INSERT, UPDATE or DELETE statement. Tell the
-    high level code to not cache this query, and clean the current cache for
-    this handle by setting *do_cache zero. */
+  int n = 0;
 
-    result = string_cat(result, US PQcmdTuples(pg_result));
-    *do_cache = 0;
-    DEBUG(D_lookup) debug_printf_indent("PGSQL: command does not return any data "
-      "but was successful. Rows affected: %s\n", string_from_gstring(result));
-    break;
-
-  case PGRES_TUPLES_OK:
-    break;
-
-  default:
-    /* This was the original code:
+  if (!PQsendQuery(pg_conn, CS query))
+    {
     *errmsg = string_sprintf("PGSQL: query failed: %s\n",
-			     PQresultErrorMessage(pg_result));
-    This was suggested by a user:
-    */
-
-    *errmsg = string_sprintf("PGSQL: query failed: %s (%s) (%s)\n",
-			   PQresultErrorMessage(pg_result),
-			   PQresStatus(PQresultStatus(pg_result)), query);
+      PQerrorMessage(pg_conn));
     goto PGSQL_EXIT;
-  }
-
-/* Result is in pg_result. Find the number of fields returned. If this is one,
-we don't add field names to the data. Otherwise we do. If the query did not
-return anything we skip the for loop; this also applies to the case
-PGRES_COMMAND_OK. */
-
-num_fields = PQnfields(pg_result);
-num_tuples = PQntuples(pg_result);
-
-/* Get the fields and construct the result string. If there is more than one
-row, we insert '\n' between them. */
-
-for (int i = 0; i < num_tuples; i++)
-  {
-  if (result)
-    result = string_catn(result, US"\n", 1);
+    }
+  yield = OK;
+  for (int i = 0; i < pgsql_batch_count; i++) pgsql_batch_results[i] = NULL;
+  while ((pg_result = PQgetResult(pg_conn)))
+    {
+    gstring * g = NULL;
 
-  if (num_fields == 1)
-    result = string_catn(result,
-	US PQgetvalue(pg_result, i, 0), PQgetlength(pg_result, i, 0));
-  else
-    for (int j = 0; j < num_fields; j++)
+    if (yield == OK)
       {
-      uschar *tmp = US PQgetvalue(pg_result, i, j);
-      result = lf_quote(US PQfname(pg_result, j), tmp, Ustrlen(tmp), result);
+      if (pgsql_result_text(pg_result, query, &g, errmsg, do_cache) != OK)
+	yield = DEFER;
+      else if (n < pgsql_batch_count)
+	pgsql_batch_results[n++] = g ? string_from_gstring(g) : NULL;
       }
+    PQclear(pg_result);
+    }
+  if (yield == OK) result = string_get(1);
+  goto PGSQL_EXIT;
   }
 
+/* Run the query */
+
+pg_result = PQexec(pg_conn, CS query);
+if (pgsql_result_text(pg_result, query, &result, errmsg, do_cache) != OK)
+  goto PGSQL_EXIT;
+
 /* If result is NULL then no data has been found and so we return FAIL. */
 
 if (!result)
@@ -393,6 +462,46 @@ return lf_sqlperform(US"PostgreSQL", US"pgsql_servers", pgsql_servers, query,
 
 
 
+/*************************************************
+*             Batch find entry point             *
+*************************************************/
+
+/* See local README for interface description. The queries are joined into
+one multi-statement string, so that the whole batch costs a single round trip
+to the server. Only plain SELECT statements are batched; anything else, or a
+lookup passed to helper processes, is left to be done one by one. */
+
+static int
+pgsql_batch_find(void * handle, const uschar * filename,
+  const uschar ** queries, int count, uschar ** results, uschar ** errmsg,
+  uint * do_cache, const uschar * opts)
+{
+gstring * g = NULL;
+uschar * dummy;
+int rc;
+
+if (lookup_proxy_socket && *lookup_proxy_socket) return FAIL;
+for (int i = 0; i < count; i++)
+  {
+  const uschar * s = queries[i];
+
+  while (isspace(*s)) s++;
+  if (strncmpic(s, US"select", 6) != 0 || Ustrchr(s, ';')) return FAIL;
+  g = string_catn(g, US";", i > 0 ? 1 : 0);
+  g = string_cat(g, s);
+  }
+
+pgsql_batch_results = results;
+pgsql_batch_count = count;
+rc = lf_sqlperform(US"PostgreSQL", US"pgsql_servers", pgsql_servers,
+  string_from_gstring(g), &dummy, errmsg, do_cache, opts, perform_pgsql_search);
+pgsql_batch_results = NULL;
+pgsql_batch_count = 0;
+return rc;
+}
+
+
+
 /*************************************************
 *               Quote entry point                *
 *************************************************/
@@ -497,7 +606,8 @@ static lookup_info _lookup_info = {
   .close = NULL,			/* no close function */
   .tidy = pgsql_tidy,			/* tidy function */
   .quote = pgsql_quote,			/* quoting function */
-  .version_report = pgsql_version_report           /* version reporting */
+  .version_report = pgsql_version_report,          /* version reporting */
+  .batch_find = pgsql_batch_find		/* batch find function */
 };
 
 #ifdef DYNLOOKUP
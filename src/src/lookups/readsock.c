@@ -137,6 +137,261 @@ bad:
   return FAIL;
 }
 
+/* Connections used for framed requests are kept open for later requests by
+this process, including ones made for later messages.  They and their TLS
+state are in the permanent pool, so survive search_tidyup(). A process forked
+with some inherited must not use them; the pid tells. */
+
+typedef struct readsock_conn {
+  struct readsock_conn * next;
+  const uschar *	spec;
+  pid_t			pid;
+  BOOL			tls;
+  client_conn_ctx	cctx;
+} readsock_conn;
+
+static readsock_conn * readsock_conns = NULL;
+
+
+static void
+readsock_conn_drop(readsock_conn * conn)
+{
+if (conn->cctx.sock < 0) return;
+#ifndef DISABLE_TLS
+if (conn->cctx.tls_ctx)
+  tls_close(conn->cctx.tls_ctx,
+    conn->pid == getpid() ? TLS_SHUTDOWN_NOWAIT : TLS_NO_SHUTDOWN);
+#endif
+(void) close(conn->cctx.sock);
+conn->cctx.sock = -1;
+conn->cctx.tls_ctx = NULL;
+}
+
+
+/* Find, or make, the connection for a server.  A plain connection that has
+become readable while idle must have been closed by the server, or be out of
+step, so it is not reused.  Any other failure of a reused connection is found
+by the caller, as an error on the request.
+
+Arguments:
+  sspec		server spec
+  timeout	for the connect
+  do_tls	TLS wanted
+  reused	set TRUE if an existing connection is returned
+  errmsg	where to put an error message
+
+Returns:	the connection, or NULL
+*/
+
+static BOOL
+readsock_idle_readable(int fd)
+{
+fd_set fds;
+struct timeval tzero = {.tv_sec = 0, .tv_usec = 0};
+
+FD_ZERO(&fds);
+FD_SET(fd, &fds);
+return select(fd + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, &tzero) != 0;
+}
+
+
+static readsock_conn *
+readsock_conn_get(const uschar * sspec, int timeout, BOOL do_tls,
+  BOOL * reused, uschar ** errmsg)
+{
+readsock_conn * conn;
+uschar * spec = string_copy(sspec);	/* the open writes into it */
+int old_pool, rc;
+
+for (conn = readsock_conns; conn; conn = conn->next)
+  if (conn->tls == do_tls && Ustrcmp(conn->spec, sspec) == 0) break;
+
+if (conn && conn->cctx.sock >= 0)
+  if (conn->pid != getpid())
+    readsock_conn_drop(conn);
+  else if (!conn->cctx.tls_ctx && readsock_idle_readable(conn->cctx.sock))
+    {
+    DEBUG(D_lookup) debug_printf_indent("  kept readsocket connection closed\n");
+    readsock_conn_drop(conn);
+    }
+  else
+    {
+    DEBUG(D_lookup) debug_printf_indent("  reusing readsocket connection\n");
+    *reused = TRUE;
+    return conn;
+    }
+
+old_pool = store_pool;
+store_pool = POOL_PERM;
+if (!conn)
+  {
+  conn = store_get(sizeof(readsock_conn), FALSE);
+  conn->spec = string_copy_taint(sspec, FALSE);
+  conn->tls = do_tls;
+  conn->cctx.sock = -1;
+  conn->cctx.tls_ctx = NULL;
+  conn->next = readsock_conns;
+  readsock_conns = conn;
+  }
+
+rc = internal_readsock_open(&conn->cctx, spec, timeout, do_tls, errmsg);
+store_pool = old_pool;
+if (rc != OK)
+  {
+  conn->cctx.sock = -1;
+  conn->cctx.tls_ctx = NULL;
+  return NULL;
+  }
+(void) fcntl(conn->cctx.sock, F_SETFD, fcntl(conn->cctx.sock, F_GETFD) | FD_CLOEXEC);
+conn->pid = getpid();
+*reused = FALSE;
+return conn;
+}
+
+
+/* Read framed responses from a kept connection, until the given number of
+frame delimiters has been seen.
+
+Arguments:
+  cctx		the connection
+  frame		the delimiter
+  count		the number of responses
+  more		set TRUE if data arrived beyond them or, on failure, if any
+		data arrived
+  errmsg	where to put an error message
+
+Returns:	the responses, without the final delimiter, or NULL
+*/
+
+static gstring *
+readsock_read_frames(client_conn_ctx * cctx, const uschar * frame, int count,
+  BOOL * more, uschar ** errmsg)
+{
+int flen = Ustrlen(frame), scan = 0, found = 0;
+gstring * g = NULL;
+
+while (found < count)
+  {
+  uschar buffer[1024];
+  int rc =
+#ifndef DISABLE_TLS
+    cctx->tls_ctx ? tls_read(cctx->tls_ctx, buffer, sizeof(buffer)) :
+#endif
+    read(cctx->sock, buffer, sizeof(buffer));
+
+  if (rc <= 0)
+    {
+    *more = !!g;
+    *errmsg = sigalrm_seen ? US"socket read timed out"
+      : rc == 0 ? US"connection closed by server"
+      : string_sprintf("socket read failed: %s", strerror(errno));
+    return NULL;
+    }
+  g = string_catn(g, buffer, rc);
+
+  for ( ; scan + flen <= g->ptr; scan++)
+    if (memcmp(g->s + scan, frame, flen) == 0)
+      {
+      scan += flen - 1;
+      if (++found == count) break;
+      }
+  }
+
+/* scan is at the last byte of the final delimiter */
+
+*more = scan + 1 < g->ptr;
+g->ptr = scan + 1 - flen;
+return g;
+}
+
+
+/* Make a framed request, on a kept connection. With pipelining, the request
+string holds several requests, each ending with the delimiter, which are all
+sent at once; a response is expected for each. A reused connection that fails
+before any response arrives was most likely closed by the server while idle,
+so the request is tried once more on a new one.
+
+Returns:	OK or DEFER
+*/
+
+static int
+readsock_framed(const uschar * sspec, const uschar * keystring, int length,
+  const uschar * frame, BOOL pipeline, BOOL do_tls, int timeout,
+  const uschar * eol, uschar ** result, uschar ** errmsg)
+{
+int flen = Ustrlen(frame), count = 1;
+gstring * g;
+
+if (!flen)
+  {
+  *errmsg = US"empty frame delimiter for readsocket";
+  return DEFER;
+  }
+
+if (pipeline && length)
+  {
+  const uschar * s = keystring, * end = keystring + length;
+
+  for (count = 0; s < end; count++)
+    {
+    const uschar * t = s;
+    while (t + flen <= end && memcmp(t, frame, flen) != 0) t++;
+    s = t + flen <= end ? t + flen : end;
+    }
+  DEBUG(D_lookup) debug_printf_indent("  %d pipelined requests\n", count);
+  }
+
+for (BOOL retried = FALSE; ; retried = TRUE)
+  {
+  BOOL reused, more = FALSE;
+  readsock_conn * conn;
+
+  if (!(conn = readsock_conn_get(sspec, timeout, do_tls, &reused, errmsg)))
+    return DEFER;
+
+  if (length && (
+#ifndef DISABLE_TLS
+      conn->cctx.tls_ctx ? tls_write(conn->cctx.tls_ctx, keystring, length, FALSE) :
+#endif
+			   write(conn->cctx.sock, keystring, length)) != length)
+    *errmsg = string_sprintf("request write to socket "
+      "failed: %s", strerror(errno));
+  else
+    {
+    sigalrm_seen = FALSE;
+    ALARM(timeout);
+    g = readsock_read_frames(&conn->cctx, frame, count, &more, errmsg);
+    ALARM_CLR(0);
+    if (g)
+      {
+      if (more)
+	{
+	DEBUG(D_lookup)
+	  debug_printf_indent("  unexpected data after response; closing\n");
+	readsock_conn_drop(conn);
+	}
+      break;
+      }
+    }
+
+  readsock_conn_drop(conn);
+  if (!reused || retried || more || sigalrm_seen)
+    return DEFER;
+  DEBUG(D_lookup) debug_printf_indent("  %s: reconnecting\n", *errmsg);
+  }
+
+if (eol && g)
+  {
+  gstring * r = NULL;
+  for (uschar * s = g->s, * end = s + g->ptr; s < end; s++)
+    r = *s == '\n' ? string_cat(r, eol) : string_catn(r, s, 1);
+  g = r;
+  }
+*result = g ? string_from_gstring(g) : US"";
+return OK;
+}
+
+
 /* All use of allocations will be done against the POOL_SEARCH memory,
 which is freed once by search_tidyup(). */
 
@@ -179,8 +434,9 @@ struct {
 	BOOL do_shutdown:1;
 	BOOL do_tls:1;
 	BOOL cache:1;
+	BOOL pipeline:1;
 } lf = {.do_shutdown = TRUE};
-uschar * eol = NULL;
+uschar * eol = NULL, * frame = NULL;
 int timeout = 5;
 FILE * fp;
 gstring * yield;
@@ -203,6 +459,10 @@ if (opts) for (uschar * s; s = string_nextinlist(&opts, &sep, NULL, 0); )
 #endif
   else if (Ustrncmp(s, "eol=", 4) == 0)
     eol = string_unprinting(s + 4);
+  else if (Ustrncmp(s, "frame=", 6) == 0)
+    frame = string_unprinting(s + 6);
+  else if (Ustrcmp(s, "pipeline=yes") == 0)
+    lf.pipeline = TRUE;
   else if (Ustrcmp(s, "cache=yes") == 0)
     lf.cache = TRUE;
   else if (Ustrcmp(s, "send=no") == 0)
@@ -210,6 +470,16 @@ if (opts) for (uschar * s; s = string_nextinlist(&opts, &sep, NULL, 0); )
 
 if (!filename) return FAIL;	/* Server spec is required */
 
+/* Framed requests use a connection kept for the process */
+
+if (frame)
+  {
+  if ((ret = readsock_framed(filename, keystring, length, frame, lf.pipeline,
+	      lf.do_tls, timeout, eol, result, errmsg)) == OK && !lf.cache)
+    *do_cache = 0;
+  return ret;
+  }
+
 /* Open the socket, if not cached */
 
 if (cctx->sock == -1)
@@ -18,15 +18,30 @@
 # define nele(arr) (sizeof(arr) / sizeof(*arr))
 #endif
 
-/* Structure and anchor for caching connections. */
+#define REDIS_MAXARGS	32	/* Arguments in a command */
+
+/* Structure and anchor for caching connections. The connections are kept in
+malloc store, and are not closed by the tidy function, so that they last for
+the life of the process, across SMTP transactions and deliveries. A child
+process must not use its parent's connections; they are dropped when seen by
+the child. The database is selected, and the password given, only when a
+connection is made. */
+
 typedef struct redis_connection {
   struct redis_connection *next;
   uschar  *server;
   redisContext    *handle;
+  pid_t    pid;				/* The process that made the connection */
 } redis_connection;
 
 static redis_connection *redis_connections = NULL;
 
+/* While a batch of lookups is being done as a pipeline, the reply to each
+command is also put here; NULL for a nil reply. */
+
+static uschar ** redis_batch_results = NULL;
+static int redis_batch_count = 0;
+
 
 static void *
 redis_open(const uschar * filename, uschar ** errmsg)
@@ -35,22 +50,159 @@ return (void *)(1);
 }
 
 
+/* Close and forget a connection. */
+
+static void
+redis_drop(redis_connection * cn)
+{
+for (redis_connection ** cp = &redis_connections; *cp; cp = &(*cp)->next)
+  if (*cp == cn)
+    {
+    *cp = cn->next;
+    break;
+    }
+DEBUG(D_lookup) debug_printf_indent("close REDIS connection: %s\n", cn->server);
+redisFree(cn->handle);
+store_free(cn);
+}
+
+
+/* Tidying up closes only connections inherited from a parent process. */
+
 void
 redis_tidy(void)
 {
-redis_connection *cn;
+pid_t pid = getpid();
+
+for (redis_connection * cn = redis_connections, * next; cn; cn = next)
+  {
+  next = cn->next;
+  if (cn->pid != pid) redis_drop(cn);
+  }
+}
+
 
-/* XXX: Not sure how often this is called!
- Guess its called after every lookup which probably would mean to just
- not use the _tidy() function at all and leave with exim exiting to
- GC connections!  */
+/* Split a command into arguments at whitespace. A backslash protects the next
+character. When commands are pipelined, an unprotected newline ends a command.
+
+Arguments:
+  sp        pointer to the command; updated to point past it
+  argv      where to put the arguments
+  pipeline  TRUE if a newline ends the command
+
+Returns:    the number of arguments
+*/
 
-while ((cn = redis_connections))
+static int
+redis_split(const uschar ** sp, uschar ** argv, BOOL pipeline)
+{
+const uschar * s = *sp;
+int i;
+uschar c;
+
+while (isspace(*s) && !(pipeline && *s == '\n')) s++;
+
+for (i = 0; *s && !(pipeline && *s == '\n') && i < REDIS_MAXARGS; i++)
   {
-  redis_connections = cn->next;
-  DEBUG(D_lookup) debug_printf_indent("close REDIS connection: %s\n", cn->server);
-  redisFree(cn->handle);
+  gstring * g;
+
+  for (g = NULL; (c = *s) && !isspace(c); s++)
+    if (c != '\\' || *++s)		/* backslash protects next char */
+      g = string_catn(g, s, 1);
+  argv[i] = string_from_gstring(g);
+
+  DEBUG(D_lookup) debug_printf_indent("REDIS: argv[%d] '%s'\n", i, argv[i]);
+  while (isspace(*s) && !(pipeline && *s == '\n')) s++;
   }
+
+if (pipeline) while (*s && *s != '\n') s++;	/* Too many arguments */
+if (*s == '\n') s++;
+*sp = s;
+return i;
+}
+
+
+/* Add the text of a reply that is neither an error nor nil to a result.
+
+Arguments:
+  result       the result so far, or NULL
+  redis_reply  the reply
+
+Returns:       the extended result
+*/
+
+static gstring *
+redis_reply_text(gstring * result, redisReply * redis_reply)
+{
+redisReply * entry, * tentry;
+
+switch (redis_reply->type)
+  {
+  case REDIS_REPLY_INTEGER:
+    result = string_cat(result, redis_reply->integer != 0 ? US"true" : US"false");
+    break;
+
+  case REDIS_REPLY_STRING:
+  case REDIS_REPLY_STATUS:
+    result = string_catn(result, US redis_reply->str, redis_reply->len);
+    break;
+
+  case REDIS_REPLY_ARRAY:
+
+    /* NOTE: For now support 1 nested array result. If needed a limitless
+    result can be parsed */
+
+    for (int i = 0; i < redis_reply->elements; i++)
+      {
+      entry = redis_reply->element[i];
+
+      if (result)
+	result = string_catn(result, US"\n", 1);
+
+      switch (entry->type)
+	{
+	case REDIS_REPLY_INTEGER:
+	  result = string_fmt_append(result, "%d", entry->integer);
+	  break;
+	case REDIS_REPLY_STRING:
+	  result = string_catn(result, US entry->str, entry->len);
+	  break;
+	case REDIS_REPLY_ARRAY:
+	  for (int j = 0; j < entry->elements; j++)
+	    {
+	    tentry = entry->element[j];
+
+	    if (result)
+	      result = string_catn(result, US"\n", 1);
+
+	    switch (tentry->type)
+	      {
+	      case REDIS_REPLY_INTEGER:
+		result = string_fmt_append(result, "%d", tentry->integer);
+		break;
+	      case REDIS_REPLY_STRING:
+		result = string_catn(result, US tentry->str, tentry->len);
+		break;
+	      case REDIS_REPLY_ARRAY:
+		DEBUG(D_lookup)
+		  debug_printf_indent("REDIS: result has nesting of arrays which"
+		    " is not supported. Ignoring!\n");
+		break;
+	      default:
+		DEBUG(D_lookup) debug_printf_indent(
+			  "REDIS: result has unsupported type. Ignoring!\n");
+		break;
+	      }
+	    }
+	    break;
+	  default:
+	    DEBUG(D_lookup) debug_printf_indent("REDIS: query returned unsupported type\n");
+	    break;
+	  }
+	}
+      break;
+  }
+return result;
 }
 
 
@@ -70,6 +222,10 @@ single server.
     host:port. This string is in a nextinlist temporary buffer, so can be
     overwritten.
 
+    With the "pipeline" option, the query is a list of commands, one per line.
+    They are all sent before any reply is read, and the result is made from
+    the replies, one per line; a nil reply gives an empty line.
+
     Returns:       OK, FAIL, or DEFER 
 */
 
@@ -79,14 +235,21 @@ perform_redis_search(const uschar *command, uschar *server, uschar **resultptr,
 {
 redisContext *redis_handle = NULL;        /* Keep compilers happy */
 redisReply *redis_reply = NULL;
-redisReply *entry = NULL;
-redisReply *tentry = NULL;
 redis_connection *cn;
 int yield = DEFER;
-int i, j;
+int ncommands = 0;
+BOOL pipeline = FALSE, sent = TRUE, cached;
 gstring * result = NULL;
 uschar *server_copy = NULL;
 uschar *sdata[3];
+pid_t pid = getpid();
+
+if (opts)
+  {
+  uschar * ele;
+  for (int sep = ','; ele = string_nextinlist(&opts, &sep, NULL, 0); )
+    if (Ustrcmp(ele, "pipeline") == 0) pipeline = TRUE;
+  }
 
 /* Disaggregate the parameters from the server argument.
 The order is host:port(socket)
@@ -117,21 +280,24 @@ if (sdata[2][0] == 0) sdata[2] = NULL;
 
 /* See if we have a cached connection to the server */
 
+RECONNECT:
 for (cn = redis_connections; cn; cn = cn->next)
-  if (Ustrcmp(cn->server, server_copy) == 0)
+  if (cn->pid == pid && Ustrcmp(cn->server, server_copy) == 0)
     {
     redis_handle = cn->handle;
     break;
     }
 
+cached = cn != NULL;
 if (!cn)
   {
+  uschar *host = string_copy(sdata[0]);	/* Kept intact for a reconnection */
   uschar *p;
   uschar *socket = NULL;
   int port = 0;
   /* int redis_err = REDIS_OK; */
 
-  if ((p = Ustrchr(sdata[0], '(')))
+  if ((p = Ustrchr(host, '(')))
     {
     *p++ = 0;
     socket = p;
@@ -139,7 +305,7 @@ if (!cn)
     *p = 0;
     }
 
-  if ((p = Ustrchr(sdata[0], ':')))
+  if ((p = Ustrchr(host, ':')))
     {
     *p++ = 0;
     port = Uatoi(p);
@@ -147,33 +313,69 @@ if (!cn)
   else
     port = Uatoi("6379");
 
-  if (Ustrchr(server, '/'))
+  if (Ustrchr(host, '/'))
     {
     *errmsg = string_sprintf("unexpected slash in Redis server hostname: %s",
-      sdata[0]);
+      host);
     *defer_break = TRUE;
     return DEFER;
     }
 
   DEBUG(D_lookup)
     debug_printf_indent("REDIS new connection: host=%s port=%d socket=%s database=%s\n",
-      sdata[0], port, socket, sdata[1]);
+      host, port, socket, sdata[1]);
 
   /* Get store for a new handle, initialize it, and connect to the server */
   /* XXX: Use timeouts ? */
   redis_handle =
-    socket ? redisConnectUnix(CCS socket) : redisConnect(CCS server, port);
-  if (!redis_handle)
+    socket ? redisConnectUnix(CCS socket) : redisConnect(CCS host, port);
+  if (!redis_handle || redis_handle->err)
     {
-    *errmsg = US"REDIS connection failed";
+    *errmsg = redis_handle
+      ? string_sprintf("REDIS connection failed: %s", redis_handle->errstr)
+      : US"REDIS connection failed";
+    if (redis_handle) redisFree(redis_handle);
     *defer_break = FALSE;
     goto REDIS_EXIT;
     }
+  (void) fcntl(redis_handle->fd, F_SETFD,
+    fcntl(redis_handle->fd, F_GETFD) | FD_CLOEXEC);
+
+  /* Authenticate if there is a password */
+  if(sdata[2])
+    {
+    if (!(redis_reply = redisCommand(redis_handle, "AUTH %s", sdata[2])))
+      {
+      *errmsg = string_sprintf("REDIS Authentication failed: %s\n", redis_handle->errstr);
+      redisFree(redis_handle);
+      *defer_break = FALSE;
+      goto REDIS_EXIT;
+      }
+    freeReplyObject(redis_reply);
+    redis_reply = NULL;
+    }
+
+  /* Select the database if there is a dbnumber passed */
+  if(sdata[1])
+    {
+    if (!(redis_reply = redisCommand(redis_handle, "SELECT %s", sdata[1])))
+      {
+      *errmsg = string_sprintf("REDIS: Selecting database=%s failed: %s\n", sdata[1], redis_handle->errstr);
+      redisFree(redis_handle);
+      *defer_break = FALSE;
+      goto REDIS_EXIT;
+      }
+    freeReplyObject(redis_reply);
+    redis_reply = NULL;
+    DEBUG(D_lookup) debug_printf_indent("REDIS: Selecting database=%s\n", sdata[1]);
+    }
 
   /* Add the connection to the cache */
-  cn = store_get(sizeof(redis_connection), FALSE);
-  cn->server = server_copy;
+  cn = store_malloc(sizeof(redis_connection) + Ustrlen(server_copy) + 1);
+  cn->server = US (cn + 1);
+  Ustrcpy(cn->server, server_copy);
   cn->handle = redis_handle;
+  cn->pid = pid;
   cn->next = redis_connections;
   redis_connections = cn;
   }
@@ -183,61 +385,101 @@ else
     debug_printf_indent("REDIS using cached connection for %s\n", server_copy);
 }
 
-/* Authenticate if there is a password */
-if(sdata[2])
-  if (!(redis_reply = redisCommand(redis_handle, "AUTH %s", sdata[2])))
-    {
-    *errmsg = string_sprintf("REDIS Authentication failed: %s\n", redis_handle->errstr);
-    *defer_break = FALSE;
-    goto REDIS_EXIT;
-    }
+/* Split the command string into argv and run the command. We use the argv
+form rather than plain as that parses into args by whitespace yet has no
+escaping mechanism. When pipelining, all the commands are queued before the
+first reply is read. */
 
-/* Select the database if there is a dbnumber passed */
-if(sdata[1])
+for (const uschar * s = command; *s; )
   {
-  if (!(redis_reply = redisCommand(redis_handle, "SELECT %s", sdata[1])))
+  uschar * argv[REDIS_MAXARGS];
+  int argc = redis_split(&s, argv, pipeline);
+
+  if (argc == 0) continue;
+  ncommands++;
+  if (pipeline)
     {
-    *errmsg = string_sprintf("REDIS: Selecting database=%s failed: %s\n", sdata[1], redis_handle->errstr);
-    *defer_break = FALSE;
-    goto REDIS_EXIT;
+    if (redisAppendCommandArgv(redis_handle, argc, CCSS argv, NULL) != REDIS_OK)
+      { sent = FALSE; break; }
+    }
+  else
+    {
+    redis_reply = redisCommandArgv(redis_handle, argc, CCSS argv, NULL);
+    break;
     }
-  DEBUG(D_lookup) debug_printf_indent("REDIS: Selecting database=%s\n", sdata[1]);
   }
 
-/* split string on whitespace into argv */
+if (pipeline && sent) for (int i = 0; i < ncommands; i++)
   {
-  uschar * argv[32];
-  const uschar * s = command;
-  int siz, ptr, i;
-  uschar c;
+  void * r;
 
-  while (isspace(*s)) s++;
+  if (redisGetReply(redis_handle, &r) != REDIS_OK)
+    {
+    redis_reply = NULL;
+    break;
+    }
+  redis_reply = r;
 
-  for (i = 0; *s && i < nele(argv); i++)
+  if (redis_reply->type == REDIS_REPLY_ERROR)
     {
-    gstring * g;
+    *errmsg = string_sprintf("REDIS: lookup result failed: %s\n", redis_reply->str);
+    *defer_break = TRUE;
+    *do_cache = 0;
 
-    for (g = NULL; (c = *s) && !isspace(c); s++)
-      if (c != '\\' || *++s)		/* backslash protects next char */
-	g = string_catn(g, s, 1);
-    argv[i] = string_from_gstring(g);
+    /* Drain the remaining replies, so that the connection can be used again */
 
-    DEBUG(D_lookup) debug_printf_indent("REDIS: argv[%d] '%s'\n", i, argv[i]);
-    while (isspace(*s)) s++;
+    while (++i < ncommands && redisGetReply(redis_handle, &r) == REDIS_OK)
+      freeReplyObject(r);
+    result = NULL;
+    goto REDIS_EXIT;
     }
 
-  /* Run the command. We use the argv form rather than plain as that parses
-  into args by whitespace yet has no escaping mechanism. */
+  result = string_catn(result, US"\n", i > 0 ? 1 : 0);
+  if (redis_reply->type == REDIS_REPLY_NIL)
+    {
+    *do_cache = 0;
+    if (i < redis_batch_count) redis_batch_results[i] = NULL;
+    }
+  else
+    {
+    gstring * g = redis_reply_text(NULL, redis_reply);
+    if (g) result = string_catn(result, g->s, g->ptr);
+    if (i < redis_batch_count)
+      redis_batch_results[i] = g ? string_from_gstring(g) : US"";
+    }
 
-  if (!(redis_reply = redisCommandArgv(redis_handle, i, CCSS argv, NULL)))
+  if (i < ncommands - 1)
     {
-    *errmsg = string_sprintf("REDIS: query failed: %s\n", redis_handle->errstr);
-    *defer_break = FALSE;
-    goto REDIS_EXIT;
+    freeReplyObject(redis_reply);
+    redis_reply = NULL;
     }
   }
 
-switch (redis_reply->type)
+/* A failure on a connection that was already open may be because the server
+has closed it while it was idle, so try once more on a new connection. */
+
+if (!redis_reply)
+  {
+  *errmsg = ncommands == 0
+    ? US"REDIS: empty query"
+    : string_sprintf("REDIS: query failed: %s\n", redis_handle->errstr);
+  *defer_break = ncommands == 0;
+  result = NULL;
+  if (ncommands > 0)
+    {
+    redis_drop(cn);
+    if (cached)
+      {
+      DEBUG(D_lookup) debug_printf_indent("%s", *errmsg);
+      ncommands = 0;
+      sent = TRUE;
+      goto RECONNECT;
+      }
+    }
+  goto REDIS_EXIT;
+  }
+
+if (!pipeline) switch (redis_reply->type)
   {
   case REDIS_REPLY_ERROR:
     *errmsg = string_sprintf("REDIS: lookup result failed: %s\n", redis_reply->str);
@@ -251,6 +493,7 @@ switch (redis_reply->type)
       This is cheating, we simply set defer_break = FALSE to move on to
       the next server in the redis_servers list */
       *defer_break = FALSE;
+      freeReplyObject(redis_reply);
       return DEFER;
       } else {
       *defer_break = TRUE;
@@ -267,69 +510,9 @@ switch (redis_reply->type)
     goto REDIS_EXIT;
     /* NOTREACHED */
 
-  case REDIS_REPLY_INTEGER:
-    result = string_cat(result, redis_reply->integer != 0 ? US"true" : US"false");
+  default:
+    result = redis_reply_text(result, redis_reply);
     break;
-
-  case REDIS_REPLY_STRING:
-  case REDIS_REPLY_STATUS:
-    result = string_catn(result, US redis_reply->str, redis_reply->len);
-    break;
-
-  case REDIS_REPLY_ARRAY:
- 
-    /* NOTE: For now support 1 nested array result. If needed a limitless
-    result can be parsed */
-
-    for (int i = 0; i < redis_reply->elements; i++)
-      {
-      entry = redis_reply->element[i];
-
-      if (result)
-	result = string_catn(result, US"\n", 1);
-
-      switch (entry->type)
-	{
-	case REDIS_REPLY_INTEGER:
-	  result = string_fmt_append(result, "%d", entry->integer);
-	  break;
-	case REDIS_REPLY_STRING:
-	  result = string_catn(result, US entry->str, entry->len);
-	  break;
-	case REDIS_REPLY_ARRAY:
-	  for (int j = 0; j < entry->elements; j++)
-	    {
-	    tentry = entry->element[j];
-
-	    if (result)
-	      result = string_catn(result, US"\n", 1);
-
-	    switch (tentry->type)
-	      {
-	      case REDIS_REPLY_INTEGER:
-		result = string_fmt_append(result, "%d", tentry->integer);
-		break;
-	      case REDIS_REPLY_STRING:
-		result = string_catn(result, US tentry->str, tentry->len);
-		break;
-	      case REDIS_REPLY_ARRAY:
-		DEBUG(D_lookup)
-		  debug_printf_indent("REDIS: result has nesting of arrays which"
-		    " is not supported. Ignoring!\n");
-		break;
-	      default:
-		DEBUG(D_lookup) debug_printf_indent(
-			  "REDIS: result has unsupported type. Ignoring!\n");
-		break;
-	      }
-	    }
-	    break;
-	  default:
-	    DEBUG(D_lookup) debug_printf_indent("REDIS: query returned unsupported type\n");
-	    break;
-	  }
-	}
-      break;
   }
 
 
@@ -387,6 +570,50 @@ return lf_sqlperform(US"Redis", US"redis_servers", redis_servers, command,
 
 
 
+/*************************************************
+*             Batch find entry point             *
+*************************************************/
+
+/* See local README for interface description. The commands are run as one
+pipeline, as for the "pipeline" option. Commands that would not each make one
+line of the pipeline, or that choose their own servers, are left to be done
+one by one, as are lookups passed to helper processes. */
+
+static int
+redis_batch_find(void * handle __attribute__((unused)),
+  const uschar * filename __attribute__((unused)),
+  const uschar ** commands, int count, uschar ** results, uschar ** errmsg,
+  uint * do_cache, const uschar * opts)
+{
+gstring * g = NULL;
+uschar * dummy;
+int rc;
+
+if (lookup_proxy_socket && *lookup_proxy_socket) return FAIL;
+for (int i = 0; i < count; i++)
+  {
+  const uschar * s = commands[i];
+
+  while (isspace(*s)) s++;
+  if (!*s || Ustrchr(s, '\n') || Ustrncmp(s, "servers", 7) == 0)
+    return FAIL;
+  g = string_catn(g, US"\n", i > 0 ? 1 : 0);
+  g = string_cat(g, s);
+  results[i] = NULL;
+  }
+
+opts = opts ? string_sprintf("%s,pipeline", opts) : US"pipeline";
+redis_batch_results = results;
+redis_batch_count = count;
+rc = lf_sqlperform(US"Redis", US"redis_servers", redis_servers,
+  string_from_gstring(g), &dummy, errmsg, do_cache, opts, perform_redis_search);
+redis_batch_results = NULL;
+redis_batch_count = 0;
+return rc == DEFER ? DEFER : OK;
+}
+
+
+
 /*************************************************
 *               Quote entry point                *
 *************************************************/
@@ -457,7 +684,8 @@ static lookup_info redis_lookup_info = {
   .close = NULL,			/* no close function */
   .tidy = redis_tidy,			/* tidy function */
   .quote = redis_quote,			/* quoting function */
-  .version_report = redis_version_report           /* version reporting */
+  .version_report = redis_version_report,          /* version reporting */
+  .batch_find = redis_batch_find		/* batch find function */
 };
 
 #ifdef DYNLOOKUP
@@ -12,6 +12,25 @@
 #include <sqlite3.h>
 
 
+/* When sqlite_statement_cache is set, queries are run as prepared statements,
+which are kept with the open database for reuse. Each string literal in the
+query, as made by ${quote_sqlite:...}, is replaced by a parameter, so that
+queries differing only in those values share a statement; the values are bound
+when it is run. The statements are kept most recently used first, up to the
+given number, and finalized when the database is closed. */
+
+typedef struct sqlite_stmt {
+  struct sqlite_stmt *	next;
+  sqlite3_stmt *	stmt;
+  uschar		sql[1];		/* the template; extended */
+} sqlite_stmt;
+
+typedef struct {
+  sqlite3 *		db;
+  sqlite_stmt *		stmts;
+} sqlite_handle;
+
+
 /*************************************************
 *              Open entry point                  *
 *************************************************/
@@ -22,7 +41,9 @@ static void *
 sqlite_open(const uschar * filename, uschar ** errmsg)
 {
 sqlite3 *db = NULL;
-int ret;
+sqlite_handle * h;
+int ret, flags = sqlite_read_only
+  ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
 if (!filename || !*filename)
   {
@@ -31,7 +52,9 @@ if (!filename || !*filename)
   }
 if (!filename || *filename != '/')
   *errmsg = US"absolute file name expected for \"sqlite\" lookup";
-else if ((ret = sqlite3_open(CCS filename, &db)) != 0)
+else if ((ret = sqlite3_open_v2(CCS filename, &db,
+	      sqlite_shared_cache ? flags | SQLITE_OPEN_SHAREDCACHE : flags,
+	      NULL)) != 0)
   {
   *errmsg = (void *)sqlite3_errmsg(db);
   sqlite3_close(db);
@@ -39,9 +62,17 @@ else if ((ret = sqlite3_open(CCS filename, &db)) != 0)
   DEBUG(D_lookup) debug_printf_indent("Error opening database: %s\n", *errmsg);
   }
 
-if (db)
-  sqlite3_busy_timeout(db, 1000 * sqlite_lock_timeout);
-return db;
+if (!db) return NULL;
+
+sqlite3_busy_timeout(db, 1000 * sqlite_lock_timeout);
+if (sqlite_mmap_size > 0)
+  (void) sqlite3_exec(db,
+    CS string_sprintf("PRAGMA mmap_size=%d", sqlite_mmap_size), NULL, NULL, NULL);
+
+h = store_get(sizeof(sqlite_handle), FALSE);
+h->db = db;
+h->stmts = NULL;
+return h;
 }
 
 
@@ -79,15 +110,183 @@ return 0;
 }
 
 
+/* Make the template for a query: each string literal is replaced by a
+parameter, and its value, unquoted, is returned for binding. A query that has
+comments, parameters of its own, or unbalanced quotes is not templated; nor is
+a blob literal x'...' replaced.
+
+Arguments:
+  query		the query
+  vals		where to return the values
+  nvals		where to return the number of values
+
+Returns:	the template, or NULL
+*/
+
+static uschar *
+sqlite_template(const uschar * query, uschar *** vals, int * nvals)
+{
+gstring * g = NULL;
+int n = 0, max = 1;
+
+for (const uschar * s = query; *s; s++) if (*s == '\'') max++;
+*vals = store_get(max/2 * sizeof(uschar *) + sizeof(uschar *), FALSE);
+
+for (const uschar * s = query; *s; )
+  {
+  const uschar * t = s;
+
+  switch (*s)
+    {
+    case '\'':
+      if (s > query && (s[-1] == 'x' || s[-1] == 'X')
+	 && (s == query + 1 || !isalnum(s[-2]) && s[-2] != '_'))
+	goto verbatim;
+      {
+      gstring * v = NULL;
+      for (s++; ; s++)
+	if (!*s) return NULL;
+	else if (*s != '\'') v = string_catn(v, s, 1);
+	else if (s[1] == '\'') v = string_catn(v, s++, 1);
+	else break;
+      (*vals)[n++] = v ? string_from_gstring(v) : US"";
+      g = string_catn(g, US"?", 1);
+      s++;
+      continue;
+      }
+
+    case '"': case '`': case '[':
+    verbatim:
+      {
+      uschar close = *s == '[' ? ']' : *s;
+      for (s++; *s != close; s++)
+	if (!*s) return NULL;
+      s++;
+      g = string_catn(g, t, s - t);
+      continue;
+      }
+
+    case '?': case ':': case '@': case '$':
+      return NULL;
+
+    case '-': case '/':
+      if (s[1] == (*s == '-' ? '-' : '*')) return NULL;
+      /* fall through */
+
+    default:
+      g = string_catn(g, s++, 1);
+    }
+  }
+
+*nvals = n;
+return g ? string_from_gstring(g) : NULL;
+}
+
+
+/* Run a query as a cached prepared statement
+
+Returns:	OK, FAIL, or DEFER if the query cannot be templated
+*/
+
+static int
+sqlite_find_prepared(sqlite_handle * h, const uschar * query, gstring ** res,
+  uschar ** errmsg)
+{
+sqlite_stmt * st, ** pp;
+uschar * sql, ** vals;
+int nvals, rc, i;
+
+if (!(sql = sqlite_template(query, &vals, &nvals)))
+  return DEFER;
+
+for (pp = &h->stmts, i = 0; (st = *pp); pp = &st->next, i++)
+  if (Ustrcmp(st->sql, sql) == 0) break;
+
+if (st)
+  {
+  DEBUG(D_lookup) debug_printf_indent("sqlite: using kept statement\n");
+  *pp = st->next;		/* unlink, to move to the front */
+  }
+else
+  {
+  sqlite3_stmt * stmt;
+  const char * tail;
+
+  if (  sqlite3_prepare_v2(h->db, CCS sql, -1, &stmt, &tail) != SQLITE_OK
+     || !stmt)
+    return DEFER;		/* let sqlite3_exec() report it */
+  while (isspace(*tail) || *tail == ';') tail++;
+  if (*tail || sqlite3_bind_parameter_count(stmt) != nvals)
+    {
+    sqlite3_finalize(stmt);	/* several statements; not for us */
+    return DEFER;
+    }
+
+  DEBUG(D_lookup) debug_printf_indent("sqlite: prepared statement: %s\n", sql);
+  st = store_malloc(sizeof(sqlite_stmt) + Ustrlen(sql));
+  Ustrcpy(st->sql, sql);
+  st->stmt = stmt;
+
+  /* Drop the least recently used, if that makes too many */
+
+  if (i >= sqlite_statement_cache)
+    {
+    for (pp = &h->stmts; (*pp)->next; ) pp = &(*pp)->next;
+    sqlite3_finalize((*pp)->stmt);
+    store_free(*pp);
+    *pp = NULL;
+    }
+  }
+st->next = h->stmts;
+h->stmts = st;
+
+for (i = 0; i < nvals; i++)
+  sqlite3_bind_text(st->stmt, i+1, CCS vals[i], -1, SQLITE_STATIC);
+
+while ((rc = sqlite3_step(st->stmt)) == SQLITE_ROW)
+  {
+  int argc = sqlite3_column_count(st->stmt);
+  char ** argv = store_get(argc * sizeof(char *), FALSE);
+  char ** names = store_get(argc * sizeof(char *), FALSE);
+
+  for (i = 0; i < argc; i++)
+    {
+    argv[i] = (char *) sqlite3_column_text(st->stmt, i);
+    names[i] = (char *) sqlite3_column_name(st->stmt, i);
+    }
+  (void) sqlite_callback(res, argc, argv, names);
+  }
+
+if (rc != SQLITE_DONE)
+  *errmsg = string_copy(US sqlite3_errmsg(h->db));
+sqlite3_reset(st->stmt);
+sqlite3_clear_bindings(st->stmt);
+return rc == SQLITE_DONE ? OK : FAIL;
+}
+
+
 static int
 sqlite_find(void * handle, const uschar * filename, const uschar * query,
   int length, uschar ** result, uschar ** errmsg, uint * do_cache,
   const uschar * opts)
 {
+sqlite_handle * h = handle;
 int ret;
 gstring * res = NULL;
 
-ret = sqlite3_exec(handle, CS query, sqlite_callback, &res, CSS errmsg);
+if (sqlite_statement_cache > 0)
+  switch (sqlite_find_prepared(h, query, &res, errmsg))
+    {
+    case OK:
+      if (!res) *do_cache = 0;
+      *result = string_from_gstring(res);
+      return OK;
+    case FAIL:
+      DEBUG(D_lookup) debug_printf_indent("sqlite3_step failed: %s\n", *errmsg);
+      return FAIL;
+    }
+
+ret = sqlite3_exec(h->db, CS query, sqlite_callback, &res, CSS errmsg);
 if (ret != SQLITE_OK)
   {
   debug_printf_indent("sqlite3_exec failed: %s\n", *errmsg);
@@ -110,7 +309,15 @@ return OK;
 
 static void sqlite_close(void *handle)
 {
-sqlite3_close(handle);
+sqlite_handle * h = handle;
+
+for (sqlite_stmt * st = h->stmts, * next; st; st = next)
+  {
+  next = st->next;
+  sqlite3_finalize(st->stmt);
+  store_free(st);
+  }
+sqlite3_close(h->db);
 }
 
 
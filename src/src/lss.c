@@ -139,4 +139,138 @@ return b64decode(code, ptr);
 }
 
 
+
+/*************************************************
+*          Read-only view of the body            *
+*************************************************/
+
+/* The -D file is mapped once per message, so that a scanner can look at the
+body in place rather than reading it into store. The mapping stays until
+local_scan() returns, when receive_msg() calls lss_body_unmap().
+
+Arguments:
+  fd          the -D file descriptor that was passed to local_scan()
+  len         where to put the length of the body
+
+Returns:      a pointer to the first character of the body, or NULL if the
+              file could not be mapped (read it from fd instead)
+*/
+
+static uschar * lss_map = NULL;
+static size_t   lss_map_size;
+static int      lss_map_fd = -1;
+
+const uschar *
+lss_body_view(int fd, off_t * len)
+{
+struct stat statbuf;
+
+if (lss_map && lss_map_fd == fd)
+  {
+  *len = lss_map_size - SPOOL_DATA_START_OFFSET;
+  return lss_map + SPOOL_DATA_START_OFFSET;
+  }
+lss_body_unmap();
+
+if (fstat(fd, &statbuf) != 0) return NULL;
+if (statbuf.st_size <= SPOOL_DATA_START_OFFSET)
+  {
+  *len = 0;
+  return US"";
+  }
+if ((lss_map = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_SHARED, fd,
+		    0)) == MAP_FAILED)
+  {
+  DEBUG(D_local_scan) debug_printf("lss_body_view: mmap: %s\n", strerror(errno));
+  lss_map = NULL;
+  return NULL;
+  }
+lss_map_size = statbuf.st_size;
+lss_map_fd = fd;
+*len = lss_map_size - SPOOL_DATA_START_OFFSET;
+return lss_map + SPOOL_DATA_START_OFFSET;
+}
+
+
+void
+lss_body_unmap(void)
+{
+if (lss_map) (void)munmap(lss_map, lss_map_size);
+lss_map = NULL;
+lss_map_fd = -1;
+}
+
+
+
+/*************************************************
+*           Find headers by name                 *
+*************************************************/
+
+/* This uses the index of header names that $h_ expansions use, so a
+scanner need not walk and compare the whole chain for each name it wants.
+Headers that have been marked deleted are not included.
+
+Arguments:
+  name        the header name, with or without the colon
+
+Returns:      a NULL-terminated vector of the headers with that name, in the
+              order they appear, in working store
+*/
+
+header_line **
+lss_header_find(const uschar * name)
+{
+int len = Ustrlen(name), count = 1, n = 0;
+header_line ** vec, ** res;
+
+if (len > 0 && name[len-1] == ':') len--;
+if ((vec = header_index_find(name, len)))
+  {
+  for (header_line ** hp = vec; *hp; hp++) count++;
+  res = store_get(count * sizeof(header_line *), FALSE);
+  for ( ; *vec; vec++)
+    if (header_testname(*vec, name, len, TRUE))
+      res[n++] = *vec;
+  }
+else				/* Name not indexable; look at every header */
+  {
+  for (header_line * h = header_list; h; h = h->next) count++;
+  res = store_get(count * sizeof(header_line *), FALSE);
+  for (header_line * h = header_list; h; h = h->next)
+    if (header_testname(h, name, len, TRUE))
+      res[n++] = h;
+  }
+res[n] = NULL;
+return res;
+}
+
+
+
+/*************************************************
+*         Hashes computed on reception           *
+*************************************************/
+
+/* Body hashes that DKIM computed while the message was received, as a
+space-separated list of <canon>/<hash>=<base64> items; NULL if there are none */
+
+const uschar *
+lss_dkim_bodyhashes(void)
+{
+#ifndef DISABLE_DKIM
+return dkim_bodyhashes;
+#else
+return NULL;
+#endif
+}
+
+/* The hex SHA-256 hash of the body that was computed for spool_dedup_min_size;
+NULL if that was not done for this message */
+
+const uschar *
+lss_body_hash(void)
+{
+return spool_body_hash;
+}
+
+
 /* End of lss.c */
@@ -127,6 +127,9 @@ due to conflicts with other common macros. */
 #ifdef USE_TCP_WRAPPERS
   builtin_macro_create(US"_HAVE_TCPWRAPPERS");
 #endif
+#ifdef USE_LMDB
+  builtin_macro_create(US"_HAVE_DBM_LMDB");
+#endif
 #ifndef DISABLE_TLS
   builtin_macro_create(US"_HAVE_TLS");
 # ifdef USE_GNUTLS
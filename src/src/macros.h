@@ -39,6 +39,25 @@ manipulate them. */
 #define copyflag(addrnew, addrold, flagname) \
   addrnew->flags.flagname = addrold->flags.flagname
 
+/* The rarely used fields of an address are read through this; addr_cold()
+gives a block that may be written. Copying an address by assignment must be
+followed by addr_cold_share() on the original, so that neither changes the
+other's fields. */
+
+#define ADDR_COLD(addr) \
+  ((addr)->cold ? (const address_item_cold *)(addr)->cold : &address_cold_empty)
+
+#define addr_cold_share(addr) \
+  do { if ((addr)->cold) (addr)->cold->owner = NULL; } while (0)
+
+/* Set a rarely used field, without making a block just to hold NULL */
+
+#define addr_cold_set(addr, field, value) \
+  do { \
+    void * addr_cold_v = (void *)(value); \
+    if (addr_cold_v || (addr)->cold) addr_cold(addr)->field = addr_cold_v; \
+  } while (0)
+
 
 /* For almost all calls to convert things to printing characters, we want to
 allow tabs & spaces. A macro just makes life a bit easier. */
@@ -191,6 +210,11 @@ message id with a trailing "-H" or "-D" added. */
 
 #define SPOOL_NAME_LENGTH (MESSAGE_ID_LENGTH+2)
 
+/* Tag following the name on the first line of a binary-format -H file; it
+carries the version of the format. */
+
+#define SPOOL_HDR_BINARY_TAG "B1"
+
 /* The maximum number of message ids to store in a waiting database
 record. */
 
@@ -492,15 +516,19 @@ enum logbit {
   Li_received_sender,
   Li_received_recipients,
   Li_rejected_header,
+  Li_resource_usage,
   Li_return_path_on_delivery,
   Li_sender_on_delivery,
   Li_sender_verify_fail,
   Li_smtp_confirmation,
   Li_smtp_mailauth,
   Li_smtp_no_mail,
+  Li_spool_commit_time,
+  Li_store_stats,
   Li_subject,
   Li_tls_certificate_verified,
   Li_tls_cipher,
+  Li_tls_ktls,
   Li_tls_peerdn,
   Li_tls_resumption,
   Li_tls_sni,
@@ -885,6 +913,7 @@ enum {
 #define topt_output_string	0x200  /* create string rather than write to fd */
 #define topt_continuation	0x400  /* do not reset buffer */
 #define topt_not_socket		0x800  /* cannot do socket-only syscalls */
+#define topt_inproc_filter	0x1000 /* pass through transport_filter_dlfunc */
 
 /* Options for smtp_write_command */
 
@@ -1098,6 +1127,11 @@ should not be one active. */
 #define RESUME_SERVER_TICKET	BIT(3)
 #define RESUME_USED		BIT(4)
 
+/* Kernel TLS offload directions, for tls_support.ktls */
+
+#define KTLS_TX			BIT(0)
+#define KTLS_RX			BIT(1)
+
 #define RESUME_DECODE_STRING \
 	  US"not requested or offered : 0x02 :client requested, no server ticket" \
     ": 0x04 : 0x05 : 0x06 :client offered session, no server action" \
@@ -1117,5 +1151,39 @@ should not be one active. */
 #define NOTIFIER_SOCKET_NAME	"exim_daemon_notify"
 #define NOTIFY_MSG_QRUN		1	/* Notify message types */
 #define NOTIFY_QUEUE_SIZE_REQ	2
+#define NOTIFY_QUEUE_ADD	3
+#define NOTIFY_QUEUE_DEL	4
+#define NOTIFY_QUEUE_COUNT_REQ	5
+#define NOTIFY_STORE_STATS	6
+#define NOTIFY_STORE_STATS_REQ	7
+#define NOTIFY_SMTP_PHASES	8
+#define NOTIFY_SMTP_PHASES_REQ	9
+#define NOTIFY_METRICS_REQ	10
+#define NOTIFY_DELIVERY		11
+#define NOTIFY_PARK		12
+#define NOTIFY_PROFILE		13
+#define NOTIFY_TYPE_COUNT	14
+
+/* Indexes into the daemon's shared activity counts */
+
+#define DCOUNT_SMTP		0
+#define DCOUNT_DELIVERIES	1
+#define DCOUNT_QUEUE_RUNNERS	2
+#define DCOUNT_COUNT		3
+
+/* Phases of SMTP sessions that are timed, for the daemon's latency
+histograms. Names are in smtp_in.c. */
+
+enum { SMTP_PHASE_CONNECT, SMTP_PHASE_HELO, SMTP_PHASE_STARTTLS,
+       SMTP_PHASE_AUTH, SMTP_PHASE_MAIL, SMTP_PHASE_RCPT, SMTP_PHASE_PREDATA,
+       SMTP_PHASE_DATA_READ, SMTP_PHASE_SPOOL_DATA, SMTP_PHASE_DKIM,
+       SMTP_PHASE_MIME, SMTP_PHASE_DATA, SMTP_PHASE_SPOOL_HEADER,
+       SMTP_PHASE_QUIT, SMTP_PHASE_OTHER_ACL, SMTP_PHASE_DNSLISTS,
+       SMTP_PHASE_VERIFY, SMTP_PHASE_SCAN,
+       SMTP_PHASE_COUNT };
+
+/* Kinds of event recorded in the trace ring */
+
+enum { TRACE_SMTP, TRACE_ACL, TRACE_LOOKUP, TRACE_DNS };
 
 /* End of macros.h */
@@ -142,7 +142,28 @@ typedef struct clamd_address {
   uschar * hostspec;
   unsigned tcp_port;
   unsigned retry;
+  BOOL	   session;
 } clamd_address;
+
+/* Sessions (IDSESSION) with clamd servers, kept open for later messages. A
+session is taken out of the table while it is in use, and put back only once
+clamd has answered; so any failure just loses it. Sessions unused for longer
+than CLAMD_SESSION_IDLE are dropped, as clamd is likely to close them soon. */
+
+# define CLAMD_SESSION_IDLE 20
+
+typedef struct clamd_session {
+  uschar * hostspec;
+  unsigned tcp_port;		/* 0 for a Unix socket */
+  int	   sock;		/* -1 if none, or in use */
+  unsigned cmds;		/* commands sent in the session */
+  time_t   used;
+} clamd_session;
+
+static clamd_session clamd_sessions[MAX_CLAMD_SERVERS];
+static int clamd_nsessions = 0;
+static pid_t clamd_sessions_pid = 0;
+static unsigned clamd_next_server = 0;
 #endif
 
 
@@ -214,6 +235,7 @@ BOOL malware_ok = FALSE;
 the scan directory normally for that case, but look into rigging up the
 needed header variables if not already set on the command-line? */
 extern int spool_mbox_ok;
+extern int acl_where;		/* src/acl.c */
 extern uschar spooled_message_id[MESSAGE_ID_LENGTH+1];
 
 
@@ -533,6 +555,7 @@ clamd_option(clamd_address * cd, const uschar * optstr, int * subsep)
 uschar * s;
 
 cd->retry = 0;
+cd->session = FALSE;
 while ((s = string_nextinlist(&optstr, subsep, NULL, 0)))
   if (Ustrncmp(s, "retry=", 6) == 0)
     {
@@ -541,11 +564,136 @@ while ((s = string_nextinlist(&optstr, subsep, NULL, 0)))
       return FAIL;
     cd->retry = sec;
     }
+  else if (Ustrcmp(s, "session") == 0)
+    cd->session = TRUE;
   else
     return FAIL;
 return OK;
 }
+
+
+/* Find the table entry for a server's session, making one if need be.
+Sessions inherited from a parent process are its own, so they are forgotten.
+
+Argument:  the server
+Returns:   the entry, or NULL if the table is full
+*/
+
+static clamd_session *
+clamd_session_find(const clamd_address * cd)
+{
+clamd_session * cs;
+
+if (clamd_sessions_pid != getpid())
+  {
+  for (cs = clamd_sessions; cs < clamd_sessions + clamd_nsessions; cs++)
+    if (cs->sock >= 0) (void)close(cs->sock);
+  clamd_nsessions = 0;
+  clamd_sessions_pid = getpid();
+  }
+
+for (cs = clamd_sessions; cs < clamd_sessions + clamd_nsessions; cs++)
+  if (cs->tcp_port == cd->tcp_port && Ustrcmp(cs->hostspec, cd->hostspec) == 0)
+    return cs;
+if (clamd_nsessions >= MAX_CLAMD_SERVERS)
+  return NULL;
+
+cs = clamd_sessions + clamd_nsessions++;
+cs->hostspec = string_copy_perm(cd->hostspec, FALSE);
+cs->tcp_port = cd->tcp_port;
+cs->sock = -1;
+return cs;
+}
+
+
+/* Take a server's open session out of the table for use, checking that it is
+still healthy: clamd must not have sent anything, or closed it, since its last
+answer, and it must not have been idle too long.
+
+Argument:  the table entry
+Returns:   the socket, or -1 if there is no usable session
+*/
+
+static int
+clamd_session_take(clamd_session * cs)
+{
+int sock = cs->sock;
+BOOL stale;
+
+if (sock < 0) return -1;
+cs->sock = -1;
+if (!(stale = time(NULL) - cs->used > CLAMD_SESSION_IDLE))
+  {
+#ifndef NO_POLL_H
+  struct pollfd p = { .fd = sock, .events = POLLIN|POLLRDHUP };
+  stale = poll(&p, 1, 0) != 0;
+#else
+  fd_set fds;
+  struct timeval tv = {0};
+
+  FD_ZERO(&fds);
+  FD_SET(sock, &fds);
+  stale = select(sock + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, &tv) != 0;
 #endif
+  }
+if (stale)
+  {
+  DEBUG(D_acl) debug_printf_indent("dropping stale clamd session to %s\n",
+    cs->hostspec);
+  (void)close(sock);
+  return -1;
+  }
+DEBUG(D_acl) debug_printf_indent("reusing clamd session to %s (%u commands)\n",
+  cs->hostspec, cs->cmds);
+return sock;
+}
+
+
+/* Read a reply in a session, which is terminated by a NUL.
+
+Returns:  the number of bytes read, the buffer size if it filled without a
+	  NUL, or as for ip_recv() on failure
+*/
+
+static int
+clamd_session_recv(client_conn_ctx * cctx, uschar * buf, int size, time_t tmo)
+{
+int len = 0;
+
+while (len < size)
+  {
+  int n = ip_recv(cctx, buf + len, size - len, tmo);
+  if (n <= 0) return n;
+  if (memchr(buf + len, 0, n)) return len + n;
+  len += n;
+  }
+return size;
+}
+#endif
+
+
+
+/* Make the mbox file, if it was put off in the hope of sending the message to
+the scanner straight from the spool, but is needed after all.
+
+Argument:  the flag saying it was put off; it is cleared
+Returns:   FALSE on failure
+*/
+
+static BOOL
+m_spool_mbox(BOOL * direct)
+{
+unsigned long mbox_size;
+FILE * mbox_file;
+uschar * eml_filename;
+
+if (!*direct) return TRUE;
+*direct = FALSE;
+if (!(mbox_file = spool_mbox(&mbox_size, NULL, &eml_filename)))
+  return FALSE;
+(void) fclose(mbox_file);
+return TRUE;
+}
 
 
 
@@ -581,19 +729,26 @@ const uschar * scanner_options;
 client_conn_ctx malware_daemon_ctx = {.sock = -1};
 time_t tmo;
 uschar * eml_filename, * eml_dir;
+BOOL direct = content_scan_direct && !scan_filename;
 
 if (!malware_re)
   return FAIL;		/* empty means "don't match anything" */
 
-/* Ensure the eml mbox file is spooled up */
+/* Ensure the eml mbox file is spooled up. With content_scan_direct, clamd
+can be sent the message from the spool instead, so the decision is left
+until the scanner is known. */
 
-if (!(mbox_file = spool_mbox(&mbox_size, scan_filename, &eml_filename)))
+if (direct)
+  eml_filename = string_sprintf("%s/scan/%s/%s.eml",
+    spool_directory, message_id, message_id);
+else if (!(mbox_file = spool_mbox(&mbox_size, scan_filename, &eml_filename)))
   return malware_panic_defer(US"error while creating mbox spool file");
 
 /* None of our current scanners need the mbox file as a stream (they use
 the name), so we can close it right away.  Get the directory too. */
 
-(void) fclose(mbox_file);
+else
+  (void) fclose(mbox_file);
 eml_dir = string_copyn(eml_filename, Ustrrchr(eml_filename, '/') - eml_filename);
 
 /* parse 1st option */
@@ -673,6 +828,12 @@ if (!malware_ok)
     break;
   }
 
+  if (scanent->scancode != M_CLAMD && !m_spool_mbox(&direct))
+    {
+    if (malware_daemon_ctx.sock >= 0) (void)close(malware_daemon_ctx.sock);
+    return malware_panic_defer(US"error while creating mbox spool file");
+    }
+
   switch (scanent->scancode)
     {
 #ifndef DISABLE_MAL_FFROTD
@@ -1454,7 +1615,10 @@ badseek:  err = errno;
       clamd_address * cv[MAX_CLAMD_SERVERS];
       int num_servers = 0;
       uint32_t send_size, send_final_zeroblock;
-      blob cmd_str;
+      blob cmd_str, plain_cmd, sess_cmd;
+      clamd_session * cs;
+      BOOL any_session = FALSE, reused = FALSE;
+      mbox_stream * ms;
 
       /*XXX if unixdomain socket, only one server supported. Needs fixing;
       there's no reason we should not mix local and remote servers */
@@ -1473,11 +1637,13 @@ badseek:  err = errno;
 	/* extract socket-path part */
 	sublist = scanner_options;
 	cd->hostspec = string_nextinlist(&sublist, &subsep, NULL, 0);
+	cd->tcp_port = 0;
 
 	/* parse options */
 	if (clamd_option(cd, sublist, &subsep) != OK)
 	  return m_panic_defer(scanent, NULL,
 	    string_sprintf("bad option '%s'", scanner_options));
+	any_session = cd->session;
 	cv[0] = cd;
 	}
       else
@@ -1525,6 +1691,7 @@ badseek:  err = errno;
 	  if (clamd_option(cd, sublist, &subsep) != OK)
 	    return m_panic_defer(scanent, NULL,
 	      string_sprintf("bad option '%s'", scanner_options));
+	  if (cd->session) any_session = TRUE;
 
 	  cv[num_servers++] = cd;
 	  if (num_servers >= MAX_CLAMD_SERVERS)
@@ -1543,6 +1710,11 @@ badseek:  err = errno;
 	    US"no useable server addresses in malware configuration option.");
 	}
 
+      /* The SCAN command needs the mbox file */
+      if (use_scan_command && !m_spool_mbox(&direct))
+	return m_panic_defer(scanent, NULL,
+	  US"error while creating mbox spool file");
+
       /* See the discussion of response formats below to see why we really
       don't like colons in filenames when passing filenames to ClamAV. */
       if (use_scan_command && Ustrchr(eml_filename, ':'))
@@ -1558,6 +1730,35 @@ badseek:  err = errno;
 	cmd_str.data = string_sprintf("SCAN %s\n", eml_filename);
 	cmd_str.len = Ustrlen(cmd_str.data);
 	}
+      plain_cmd = cmd_str;
+
+      /* In a session the commands are all of the NUL-terminated kind, and the
+      first one is preceded by IDSESSION. Replies start with the number of the
+      command in the session. */
+      if (any_session)
+	{
+	uschar * cmd = use_scan_command
+	  ? string_sprintf("zSCAN %s", eml_filename) : US"zINSTREAM";
+	int len = Ustrlen(cmd) + 1;
+
+	sess_cmd.len = 11 + len;
+	sess_cmd.data = store_get(sess_cmd.len, FALSE);
+	memcpy(sess_cmd.data, "zIDSESSION", 11);
+	memcpy(sess_cmd.data + 11, cmd, len);
+	}
+
+      /* We come back here if a session that was reused turns out to have
+      failed, which can happen if clamd closed it just after it was checked. */
+clamd_connect:
+      if (reused)
+	{
+	DEBUG(D_acl)
+	  debug_printf_indent("clamd session failed; connecting afresh\n");
+	(void)close(malware_daemon_ctx.sock);
+	malware_daemon_ctx.sock = -1;
+	reused = FALSE;
+	}
+      cs = NULL;
 
       /* We have some network servers specified */
       if (num_servers)
@@ -1568,12 +1769,25 @@ badseek:  err = errno;
 
 	while (num_servers > 0)
 	  {
-	  int i = random_number(num_servers);
+	  int i = any_session
+	    ? clamd_next_server++ % num_servers : random_number(num_servers);
 	  clamd_address * cd = cv[i];
 
 	  DEBUG(D_acl) debug_printf_indent("trying server name %s, port %u\n",
 			 cd->hostspec, cd->tcp_port);
 
+	  /* An open session to the server saves connecting */
+	  if (  cd->session && (cs = clamd_session_find(cd))
+	     && (malware_daemon_ctx.sock = clamd_session_take(cs)) >= 0)
+	    {
+	    hostname = cd->hostspec;
+	    cmd_str.data = sess_cmd.data + 11;
+	    cmd_str.len = sess_cmd.len - 11;
+	    reused = TRUE;
+	    break;
+	    }
+	  cmd_str = cs ? sess_cmd : plain_cmd;
+
 	  /* Lookup the host. This is to ensure that we connect to the same IP
 	   * on both connections (as one host could resolve to multiple ips) */
 	  for (;;)
@@ -1585,6 +1799,7 @@ badseek:  err = errno;
 	      /* Connection successfully established with a server */
 	      hostname = cd->hostspec;
 	      cmd_str.len = 0;
+	      if (cs) cs->cmds = 0;
 	      break;
 	      }
 	    if (cd->retry <= 0) break;
@@ -1592,6 +1807,7 @@ badseek:  err = errno;
 	    }
 	  if (malware_daemon_ctx.sock >= 0)
 	    break;
+	  cs = NULL;
 
 	  (void) m_panic_defer(scanent, CUS callout_address, errstr);
 
@@ -1604,7 +1820,16 @@ badseek:  err = errno;
 	if (num_servers == 0)
 	  return m_panic_defer(scanent, NULL, US"all servers failed");
 	}
+      else if (  cv[0]->session && (cs = clamd_session_find(cv[0]))
+	      && (malware_daemon_ctx.sock = clamd_session_take(cs)) >= 0)
+	{
+	hostname = cv[0]->hostspec;
+	cmd_str.data = sess_cmd.data + 11;
+	cmd_str.len = sess_cmd.len - 11;
+	reused = TRUE;
+	}
       else
+	{
 	for (;;)
 	  {
 	  if ((malware_daemon_ctx.sock = ip_unixsocket(cv[0]->hostspec, &errstr)) >= 0)
@@ -1616,6 +1841,12 @@ badseek:  err = errno;
 	    return m_panic_defer(scanent, CUS callout_address, errstr);
 	  while (cv[0]->retry > 0) cv[0]->retry = sleep(cv[0]->retry);
 	  }
+	if (cs)
+	  {
+	  cmd_str = sess_cmd;
+	  cs->cmds = 0;
+	  }
+	}
 
       /* have socket in variable "sock"; command to use is semi-independent of
        * the socket protocol.  We use SCAN if is local (either Unix/local
@@ -1635,75 +1866,114 @@ badseek:  err = errno;
 	/* Pass the string to ClamAV (10 = "zINSTREAM\0"), if not already sent */
 	if (cmd_str.len)
 	  if (send(malware_daemon_ctx.sock, cmd_str.data, cmd_str.len, 0) < 0)
+	    {
+	    if (reused) goto clamd_connect;
 	    return m_panic_defer_3(scanent, CUS hostname,
 	      string_sprintf("unable to send zINSTREAM to socket (%s)",
 		strerror(errno)),
 	      malware_daemon_ctx.sock);
+	    }
 
-	/* calc file size */
-	if ((clam_fd = exim_open2(CS eml_filename, O_RDONLY)) < 0)
+	/* Send the message straight from the spool if possible, as one chunk,
+	so its size must fit the 32-bit length. Otherwise the mbox file is made,
+	if it was not already, and sent. */
+	if (  (ms = direct ? spool_mbox_stream(&mbox_size) : NULL)
+	   && (unsigned long)(fsize_uint = (unsigned int) mbox_size) != mbox_size)
 	  {
-	  int err = errno;
-	  return m_panic_defer_3(scanent, NULL,
-	    string_sprintf("can't open spool file %s: %s",
-	      eml_filename, strerror(err)),
-	    malware_daemon_ctx.sock);
+	  mbox_stream_close(ms);
+	  ms = NULL;
 	  }
-	if ((fsize = lseek(clam_fd, 0, SEEK_END)) < 0)
+
+	if (ms)
 	  {
-	  int err;
-b_seek:   err = errno;
-	  (void)close(clam_fd);
-	  return m_panic_defer_3(scanent, NULL,
-	    string_sprintf("can't seek spool file %s: %s",
-	      eml_filename, strerror(err)),
-	    malware_daemon_ctx.sock);
+	  BOOL ok;
+
+	  send_size = htonl(fsize_uint);
+	  send_final_zeroblock = 0;
+	  ok = send(malware_daemon_ctx.sock, &send_size, sizeof(send_size), 0) >= 0
+	    && mbox_stream_send(ms, malware_daemon_ctx.sock)
+	    && send(malware_daemon_ctx.sock, &send_final_zeroblock,
+		    sizeof(send_final_zeroblock), 0) >= 0;
+	  mbox_stream_close(ms);
+	  if (!ok)
+	    {
+	    if (reused) goto clamd_connect;
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("unable to send message to socket (%s)", hostname),
+	      malware_daemon_ctx.sock);
+	    }
 	  }
-	fsize_uint = (unsigned int) fsize;
-	if ((off_t)fsize_uint != fsize)
-	  {
-	  (void)close(clam_fd);
+	else if (!m_spool_mbox(&direct))
 	  return m_panic_defer_3(scanent, NULL,
-	    string_sprintf("seeking spool file %s, size overflow",
-	      eml_filename),
-	    malware_daemon_ctx.sock);
-	  }
-	if (lseek(clam_fd, 0, SEEK_SET) < 0)
-	  goto b_seek;
-
-	if (!(clamav_fbuf = store_malloc(fsize_uint)))
+	    US"error while creating mbox spool file", malware_daemon_ctx.sock);
+	else
 	  {
-	  (void)close(clam_fd);
-	  return m_panic_defer_3(scanent, NULL,
-	    string_sprintf("unable to allocate memory %u for file (%s)",
-	      fsize_uint, eml_filename),
-	    malware_daemon_ctx.sock);
-	  }
+	  /* calc file size */
+	  if ((clam_fd = exim_open2(CS eml_filename, O_RDONLY)) < 0)
+	    {
+	    int err = errno;
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("can't open spool file %s: %s",
+		eml_filename, strerror(err)),
+	      malware_daemon_ctx.sock);
+	    }
+	  if ((fsize = lseek(clam_fd, 0, SEEK_END)) < 0)
+	    {
+	    int err;
+b_seek:     err = errno;
+	    (void)close(clam_fd);
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("can't seek spool file %s: %s",
+		eml_filename, strerror(err)),
+	      malware_daemon_ctx.sock);
+	    }
+	  fsize_uint = (unsigned int) fsize;
+	  if ((off_t)fsize_uint != fsize)
+	    {
+	    (void)close(clam_fd);
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("seeking spool file %s, size overflow",
+		eml_filename),
+	      malware_daemon_ctx.sock);
+	    }
+	  if (lseek(clam_fd, 0, SEEK_SET) < 0)
+	    goto b_seek;
 
-	if ((result = read(clam_fd, clamav_fbuf, fsize_uint)) < 0)
-	  {
-	  int err = errno;
-	  store_free(clamav_fbuf); (void)close(clam_fd);
-	  return m_panic_defer_3(scanent, NULL,
-	    string_sprintf("can't read spool file %s: %s",
-	      eml_filename, strerror(err)),
-	    malware_daemon_ctx.sock);
-	  }
-	(void)close(clam_fd);
+	  if (!(clamav_fbuf = store_malloc(fsize_uint)))
+	    {
+	    (void)close(clam_fd);
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("unable to allocate memory %u for file (%s)",
+		fsize_uint, eml_filename),
+	      malware_daemon_ctx.sock);
+	    }
 
-	/* send file body to socket */
-	send_size = htonl(fsize_uint);
-	send_final_zeroblock = 0;
-	if ((send(malware_daemon_ctx.sock, &send_size, sizeof(send_size), 0) < 0) ||
-	    (send(malware_daemon_ctx.sock, clamav_fbuf, fsize_uint, 0) < 0) ||
-	    (send(malware_daemon_ctx.sock, &send_final_zeroblock, sizeof(send_final_zeroblock), 0) < 0))
-	  {
+	  if ((result = read(clam_fd, clamav_fbuf, fsize_uint)) < 0)
+	    {
+	    int err = errno;
+	    store_free(clamav_fbuf); (void)close(clam_fd);
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("can't read spool file %s: %s",
+		eml_filename, strerror(err)),
+	      malware_daemon_ctx.sock);
+	    }
+	  (void)close(clam_fd);
+
+	  /* send file body to socket */
+	  send_size = htonl(fsize_uint);
+	  send_final_zeroblock = 0;
+	  if ((send(malware_daemon_ctx.sock, &send_size, sizeof(send_size), 0) < 0) ||
+	      (send(malware_daemon_ctx.sock, clamav_fbuf, fsize_uint, 0) < 0) ||
+	      (send(malware_daemon_ctx.sock, &send_final_zeroblock, sizeof(send_final_zeroblock), 0) < 0))
+	    {
+	    store_free(clamav_fbuf);
+	    if (reused) goto clamd_connect;
+	    return m_panic_defer_3(scanent, NULL,
+	      string_sprintf("unable to send file body to socket (%s)", hostname),
+	      malware_daemon_ctx.sock);
+	    }
 	  store_free(clamav_fbuf);
-	  return m_panic_defer_3(scanent, NULL,
-	    string_sprintf("unable to send file body to socket (%s)", hostname),
-	    malware_daemon_ctx.sock);
 	  }
-	store_free(clamav_fbuf);
 	}
       else
 	{ /* use scan command */
@@ -1728,9 +1998,12 @@ b_seek:   err = errno;
 
 	if (cmd_str.len)
 	  if (send(malware_daemon_ctx.sock, cmd_str.data, cmd_str.len, 0) < 0)
+	    {
+	    if (reused) goto clamd_connect;
 	    return m_panic_defer_3(scanent, CUS callout_address,
 	      string_sprintf("unable to write to socket (%s)", strerror(errno)),
 	      malware_daemon_ctx.sock);
+	    }
 
 	/* Do not shut down the socket for writing; a user report noted that
 	 * clamd 0.70 does not react well to this. */
@@ -1738,10 +2011,41 @@ b_seek:   err = errno;
       /* Commands have been sent, no matter which scan method or connection
        * type we're using; now just read the result, independent of method. */
 
-      /* Read the result */
+      /* Read the result. A session is kept for the next message once its
+      reply has been checked. */
       memset(av_buffer, 0, sizeof(av_buffer));
-      bread = ip_recv(&malware_daemon_ctx, av_buffer, sizeof(av_buffer), tmo);
-      (void)close(malware_daemon_ctx.sock);
+      if (cs)
+	{
+	unsigned long id = 0;
+
+	bread = clamd_session_recv(&malware_daemon_ctx, av_buffer,
+				    sizeof(av_buffer), tmo);
+	if (bread <= 0 && reused && errno != ETIMEDOUT)
+	  goto clamd_connect;
+	if (bread > 0 && bread < sizeof(av_buffer))
+	  id = Ustrtoul(av_buffer, &p, 10);
+	if (id > 0 && id == ++cs->cmds && *p == ':')
+	  {
+	  while (*++p == ' ') ;
+	  memmove(av_buffer, p, Ustrlen(p) + 1);
+	  bread = Ustrlen(av_buffer) + 1;
+	  cs->sock = malware_daemon_ctx.sock;
+	  cs->used = time(NULL);
+	  }
+	else
+	  {
+	  if (bread > 0 && bread < sizeof(av_buffer))
+	    return m_panic_defer_3(scanent, CUS callout_address,
+	      string_sprintf("unexpected reply in clamd session: %s", av_buffer),
+	      malware_daemon_ctx.sock);
+	  (void)close(malware_daemon_ctx.sock);
+	  }
+	}
+      else
+	{
+	bread = ip_recv(&malware_daemon_ctx, av_buffer, sizeof(av_buffer), tmo);
+	(void)close(malware_daemon_ctx.sock);
+	}
       malware_daemon_ctx.sock = -1;
       malware_daemon_ctx.tls_ctx = NULL;
 
@@ -2171,6 +2475,256 @@ else
 }
 
 
+/*************************************************
+*      Scan an email for malware, in background  *
+*************************************************/
+
+/* A scan started by "malware = * / background" runs in a subprocess, so that
+the ACL can go on to other work, such as a spam condition, while the scanner
+is busy. The subprocess does an ordinary scan and sends back its result down a
+pipe: "D" if it deferred, "N" if nothing was found, or "F" and the malware
+name. The next malware condition waits for that instead of scanning; its own
+regex is then matched in the usual way, against the remembered name.
+
+Unless content_scan_direct is set, the mbox file is created before the fork,
+so that the subprocess and any later spam or regex condition do not both
+write it. */
+
+static pid_t malware_bg_pid = -1;
+static int malware_bg_fd = -1;
+static int malware_bg_timeout;
+
+
+/* Stop a background scan whose result is no longer wanted, because the
+message is finished with. */
+
+void
+malware_bg_cancel(void)
+{
+if (malware_bg_pid <= 0) return;
+DEBUG(D_acl) debug_printf_indent("cancelling background malware scan (pid %d)\n",
+  (int)malware_bg_pid);
+(void)kill(malware_bg_pid, SIGKILL);
+(void)waitpid(malware_bg_pid, NULL, 0);
+(void)close(malware_bg_fd);
+malware_bg_pid = malware_bg_fd = -1;
+}
+
+
+/* Start a background scan.
+
+Argument:   timeout in seconds, or zero for the default
+Returns:    FAIL, always; the result comes from a later malware condition
+*/
+
+int
+malware_background(int timeout)
+{
+int pfd[2];
+pid_t pid;
+
+if (malware_ok || malware_bg_pid > 0) return FAIL;
+if (!content_scan_direct)
+  {
+  unsigned long mbox_size;
+  FILE * mbox_file = spool_mbox(&mbox_size, NULL, NULL);
+
+  if (!mbox_file) return FAIL;	/* the next condition will say why */
+  (void) fclose(mbox_file);
+  }
+
+if (pipe(pfd) != 0)
+  {
+  DEBUG(D_acl) debug_printf_indent("malware background pipe: %s\n",
+    strerror(errno));
+  return FAIL;
+  }
+
+if ((pid = exim_fork(US"malware-scan")) == 0)
+  {
+  gstring * g;
+  int rc;
+
+  (void)close(pfd[0]);
+  rc = malware_internal(US"*", NULL, timeout);
+  g = string_catn(NULL, !malware_ok ? US"D" : malware_name ? US"F" : US"N", 1);
+  if (malware_ok && malware_name)
+    g = string_cat(g, malware_name);
+  if (write(pfd[1], g->s, g->ptr) != g->ptr) rc = DEFER;
+  exim_underbar_exit(rc == DEFER ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+(void)close(pfd[1]);
+if (pid < 0)
+  {
+  DEBUG(D_acl) debug_printf_indent("malware background fork: %s\n",
+    strerror(errno));
+  (void)close(pfd[0]);
+  return FAIL;
+  }
+
+DEBUG(D_acl) debug_printf_indent("started background malware scan (pid %d)\n",
+  (int)pid);
+malware_bg_pid = pid;
+malware_bg_fd = pfd[0];
+malware_bg_timeout = timeout ? timeout : MALWARE_TIMEOUT;
+return FAIL;
+}
+
+
+/* Collect the result of a background scan. The subprocess has its own
+timeouts, but allow for it being stuck.
+
+Returns:   OK if malware_name and malware_ok are set from the scan,
+           DEFER if it failed, or
+           FAIL if there is no usable result and the scan should be redone
+*/
+
+static int
+malware_bg_join(void)
+{
+uschar buf[256];
+int len = 0, n, rc;
+time_t tmo = time(NULL) + malware_bg_timeout + 5;
+
+DEBUG(D_acl) debug_printf_indent("waiting for background malware scan\n");
+for (;;)
+  {
+  if (!fd_ready(malware_bg_fd, tmo))
+    {
+    DEBUG(D_acl) debug_printf_indent("background malware scan timed out\n");
+    malware_bg_cancel();
+    return FAIL;
+    }
+  if ((n = read(malware_bg_fd, buf + len, sizeof(buf) - 1 - len)) < 0)
+    {
+    if (errno == EINTR) continue;
+    break;
+    }
+  if (n == 0 || (len += n) >= sizeof(buf) - 1) break;
+  }
+buf[len] = 0;
+
+(void)close(malware_bg_fd);
+(void)waitpid(malware_bg_pid, NULL, 0);
+malware_bg_pid = malware_bg_fd = -1;
+
+switch (len > 0 ? buf[0] : 0)
+  {
+  case 'D':
+    DEBUG(D_acl) debug_printf_indent("background malware scan deferred\n");
+    return DEFER;
+  case 'F':
+    malware_name = string_copy(buf + 1);
+    rc = OK;
+    break;
+  case 'N':
+    malware_name = NULL;
+    rc = OK;
+    break;
+  default:
+    DEBUG(D_acl) debug_printf_indent("no result from background malware scan\n");
+    return FAIL;
+  }
+DEBUG(D_acl) debug_printf_indent("background malware scan: %s\n",
+  malware_name ? malware_name : US"clean");
+malware_ok = TRUE;
+return rc;
+}
+
+
+/*************************************************
+*             Verdict cache                      *
+*************************************************/
+
+/* When malware_cache_version is set, mime_acl_check() leaves a list of hashes
+in mime_part_hashes: one for the decoded content of each MIME part, and one
+for each run of text between parts. Content found clean is recorded in the
+"malware" hints database against its hash, with the scanner version given by
+the expansion of malware_cache_version, so a record is used only until the
+scanner's signatures change. A message all of whose content is recorded is not
+scanned again. Nothing is recorded for a message in which malware is found.
+
+Returns:   the expanded version, or NULL if the cache is not to be used
+*/
+
+static const uschar *
+malware_cache_vers(void)
+{
+const uschar * vers;
+
+if (  !malware_cache_version || !mime_part_hashes
+   || acl_where == ACL_WHERE_MIME		/* list not complete */
+   || *av_scanner == '$')			/* scanner not fixed */
+  return NULL;
+if (!(vers = expand_cstring(malware_cache_version)))
+  {
+  if (!f.expand_string_forcedfail)
+    log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand "
+      "malware_cache_version: %s", expand_string_message);
+  return NULL;
+  }
+return *vers ? vers : NULL;
+}
+
+
+/* Look up all the content of the message.
+
+Returns:   TRUE if all of it is recorded as clean
+*/
+
+static BOOL
+malware_cache_check(const uschar * vers)
+{
+const uschar * list = string_from_gstring(mime_part_hashes);
+open_db dbblock, * dbm;
+uschar * key;
+int sep = ' ', n = 0;
+BOOL yield = TRUE;
+
+if (!(dbm = dbfn_open(US"malware", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return FALSE;
+while (yield && (key = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  dbdata_malware * rec = dbfn_read(dbm, key);
+  if (!rec || Ustrcmp(rec->version, vers) != 0)
+    yield = FALSE;
+  else
+    n++;
+  }
+dbfn_close(dbm);
+
+DEBUG(D_acl) if (yield)
+  debug_printf_indent("malware verdict cache: all %d items clean\n", n);
+else
+  debug_printf_indent("malware verdict cache: %d items clean, then a miss\n", n);
+return yield;
+}
+
+
+/* Record all the content of the message as clean */
+
+static void
+malware_cache_record(const uschar * vers)
+{
+const uschar * list = string_from_gstring(mime_part_hashes);
+open_db dbblock, * dbm;
+dbdata_malware * rec;
+uschar * key;
+int sep = ' ', len = Ustrlen(vers);
+
+if (!(dbm = dbfn_open(US"malware", O_RDWR, &dbblock, TRUE, TRUE)))
+  return;
+rec = store_get(sizeof(dbdata_malware) + len, FALSE);
+memcpy(rec->version, vers, len + 1);
+while ((key = string_nextinlist(&list, &sep, NULL, 0)))
+  (void) dbfn_write(dbm, key, rec, sizeof(dbdata_malware) + len);
+dbfn_close(dbm);
+DEBUG(D_acl) debug_printf_indent("malware verdict cache: recorded clean\n");
+}
+
+
+
 /*************************************************
 *          Scan an email for malware             *
 *************************************************/
@@ -2188,9 +2742,25 @@ Returns:      Exim message processing code (OK, FAIL, DEFER, ...)
 int
 malware(const uschar * malware_re, int timeout)
 {
-int ret = malware_internal(malware_re, NULL, timeout);
+const uschar * vers = NULL;
+int ret;
+
+/* If the verdict cache knows all the content to be clean, the result is as
+for a clean scan */
+
+if (!malware_ok && (vers = malware_cache_vers()) && malware_cache_check(vers))
+  {
+  if (malware_bg_pid > 0) malware_bg_cancel();
+  malware_name = NULL;
+  malware_ok = TRUE;
+  vers = NULL;
+  }
+
+ret = malware_bg_pid > 0 && malware_bg_join() == DEFER
+  ? DEFER : malware_internal(malware_re, NULL, timeout);
 
 if (ret == DEFER) av_failed = TRUE;
+else if (vers && malware_ok && !malware_name) malware_cache_record(vers);
 return ret;
 }
 
@@ -378,6 +378,326 @@ return US"";  /* In practice, should never happen */
 
 
 
+/*************************************************
+*     Index runs of plain items in named lists   *
+*************************************************/
+
+/* A long named list, such as local_domains with many thousands of entries or
+relay_from_hosts with thousands of networks, costs a comparison with every
+item each time a new value is looked up in it. So, the first time such a list
+is used, runs of simple items are indexed. In a domain or local part list
+these are plain strings, or "*" followed by a plain suffix, which go in a hash
+table: a run is tested with one lookup for the whole value and one for each of
+its tails. In a host list they are IP addresses and networks, which go in a
+binary tree of address bits: a run is tested by following the bits of the
+host's address, seeing every network that contains it on the way.
+
+The item found is checked with its usual matching function, so that variables
+are set just as if the list had been scanned. Within a run of positive items it
+does not matter which one matches, except for what is saved as the matched
+item; the first one in the list is the one chosen.
+
+Only caseless matching uses the hash tables, because the keys are lower cased.
+Other items, such as negated ones, regular expressions, lookups, files, named
+lists, host names and special "@" forms, are scanned in the usual way, in
+order. A list whose text is changed by expansion is not indexed. */
+
+#define LIST_RUN_MIN	8	/* shorter runs are scanned */
+
+typedef struct {
+  const uschar *	pattern;	/* as it appears, for the match function */
+  const uschar *	key;		/* lower cased, without any "*" */
+  unsigned		hash;
+  BOOL			tail;
+} list_run_item;
+
+typedef struct {
+  int			child[2];	/* node numbers, or 0 for none */
+  int			item;		/* network ending here, or -1 */
+} list_run_node;
+
+typedef struct list_run {
+  struct list_run *	next;
+  const uschar *	start;		/* list position before the first item */
+  const uschar *	end;		/* list position after the last item */
+  int			sep;		/* the list's separator */
+  list_run_item *	items;
+  int *			slots;		/* item numbers, or -1; NULL for nets */
+  unsigned		mask;		/* number of slots - 1 */
+  BOOL			tails;		/* some items are "*" suffixes */
+  list_run_node *	nodes;		/* 0 and 1 are the IPv4 and IPv6 roots */
+  int			nnodes;
+} list_run;
+
+
+static unsigned
+list_run_hash(const uschar * s, int len, BOOL tail)
+{
+unsigned h = tail ? 2166136261u ^ '*' : 2166136261u;	/* FNV-1a */
+while (len-- > 0) h = (h ^ *s++) * 16777619u;
+return h;
+}
+
+
+/* Look up a key in a run's table.
+
+Returns:   the item number, or -1 if not found
+*/
+
+static int
+list_run_lookup(const list_run * r, const uschar * key, int len, BOOL tail)
+{
+unsigned h = list_run_hash(key, len, tail);
+
+for (unsigned n = h & r->mask; r->slots[n] >= 0; n = (n + 1) & r->mask)
+  {
+  const list_run_item * it = r->items + r->slots[n];
+  if (it->hash == h && it->tail == tail && Ustrcmp(it->key, key) == 0)
+    return r->slots[n];
+  }
+return -1;
+}
+
+
+/* Convert an address to binary, as host_is_in_net() does, with an IPv4 address
+in IPv6 compatible form taken as IPv4.
+
+Returns:   the number of 32-bit words
+*/
+
+static int
+list_run_aton(const uschar * s, int * address)
+{
+int size = host_aton(s, address);
+
+if (size == 4 && address[0] == 0 && address[1] == 0 && address[2] == 0xffff)
+  {
+  address[0] = address[3];
+  size = 1;
+  }
+return size;
+}
+
+
+/* Find the first item in a run that the subject matches: for strings, the
+whole of it, or any of its tails for "*" items; for addresses, any network
+that contains it.
+
+Returns:   the item's pattern, or NULL if none matches
+*/
+
+static const uschar *
+list_run_find(const list_run * r, const uschar * subject)
+{
+int best;
+
+if (r->nodes)
+  {
+  int address[4], size = list_run_aton(subject, address);
+  int n = size == 1 ? 0 : 1;
+
+  best = r->nodes[n].item;
+  for (int i = 0; i < 32 * size; i++)
+    {
+    int bit = (address[i/32] >> (31 - i%32)) & 1;
+    int item;
+    if (!(n = r->nodes[n].child[bit])) break;
+    if ((item = r->nodes[n].item) >= 0 && (best < 0 || item < best))
+      best = item;
+    }
+  }
+else
+  {
+  int len = Ustrlen(subject);
+
+  best = list_run_lookup(r, subject, len, FALSE);
+  if (r->tails)
+    for (int i = 0; i <= len; i++)
+      {
+      int n = list_run_lookup(r, subject + i, len - i, TRUE);
+      if (n >= 0 && (best < 0 || n < best)) best = n;
+      }
+  }
+return best < 0 ? NULL : r->items[best].pattern;
+}
+
+
+/* Is a list item one that can be indexed? For strings, a plain string or "*"
+and a plain suffix; for hosts, an IP address or network. */
+
+static BOOL
+list_item_plain(const uschar * s, BOOL net)
+{
+int maskoffset;
+
+if (net) return string_is_ip_address(s, &maskoffset) != 0;
+if (!*s || Ustrchr(US"!^+/@<", *s) || Ustrchr(s, ';')) return FALSE;
+if (*s == '*') s++;
+return !Ustrchr(s, '*');
+}
+
+
+/* Put a network into a run's tree, making nodes as needed. A network that is
+already there keeps its earlier item. */
+
+static void
+list_run_net(list_run * r, int i, int * size)
+{
+const uschar * pattern = r->items[i].pattern;
+int address[4], maskoffset, mlen, n;
+int asize = host_aton(pattern, address);
+
+(void) string_is_ip_address(pattern, &maskoffset);
+mlen = maskoffset ? Uatoi(pattern + maskoffset + 1) : 128;
+if (mlen > 32 * asize) mlen = 32 * asize;
+
+n = asize == 1 ? 0 : 1;
+for (int b = 0; b < mlen; b++)
+  {
+  int bit = (address[b/32] >> (31 - b%32)) & 1;
+  if (!r->nodes[n].child[bit])
+    {
+    if (r->nnodes >= *size)
+      {
+      list_run_node * new = store_get(2 * *size * sizeof(list_run_node), FALSE);
+      memcpy(new, r->nodes, r->nnodes * sizeof(list_run_node));
+      r->nodes = new;
+      *size *= 2;
+      }
+    r->nodes[r->nnodes] = (list_run_node) {.item = -1};
+    r->nodes[n].child[bit] = r->nnodes++;
+    }
+  n = r->nodes[n].child[bit];
+  }
+if (r->nodes[n].item < 0) r->nodes[n].item = i;
+}
+
+
+/* Make the table or tree for one run of items.
+
+Arguments:
+  items      the items, in list order
+  count      how many
+  start      list position before the first
+  end        list position after the last
+  sep        the list separator
+  net        TRUE for a run of networks
+
+Returns:     the run
+*/
+
+static list_run *
+list_run_make(list_run_item * items, int count, const uschar * start,
+  const uschar * end, int sep, BOOL net)
+{
+list_run * r = store_get(sizeof(list_run), FALSE);
+unsigned size = 16;
+
+*r = (list_run) {.start = start, .end = end, .sep = sep, .items = items};
+
+if (net)
+  {
+  int nsize = 64;
+  r->nodes = store_get(nsize * sizeof(list_run_node), FALSE);
+  r->nodes[0] = r->nodes[1] = (list_run_node) {.item = -1};
+  r->nnodes = 2;
+  for (int i = 0; i < count; i++) list_run_net(r, i, &nsize);
+  return r;
+  }
+
+while (size < 2 * count) size <<= 1;
+r->mask = size - 1;
+r->slots = store_get(size * sizeof(int), FALSE);
+memset(r->slots, 0xff, size * sizeof(int));
+
+/* An item that repeats an earlier one is left out; the earlier one is the
+one that would match. */
+
+for (int i = 0; i < count; i++)
+  {
+  list_run_item * it = items + i;
+  if (it->tail) r->tails = TRUE;
+  if (list_run_lookup(r, it->key, Ustrlen(it->key), it->tail) < 0)
+    {
+    unsigned n = it->hash & r->mask;
+    while (r->slots[n] >= 0) n = (n + 1) & r->mask;
+    r->slots[n] = i;
+    }
+  }
+return r;
+}
+
+
+/* Find the runs in a named list, the first time it is used. Everything is
+kept in the permanent pool, like the list.
+
+Arguments:
+  nb         the named list
+  net        TRUE for a host list
+
+Returns:     the first run, or NULL if there are none
+*/
+
+static list_run *
+list_index(namedlist_block * nb, BOOL net)
+{
+int old_pool = store_pool, sep = 0, count = 0, size = 0;
+const uschar * list = nb->string, * start = NULL, * end = NULL;
+list_run_item * items = NULL;
+list_run * runs = NULL, ** rp = &runs;
+uschar * item;
+
+if (nb->indexed) return nb->index;
+nb->indexed = TRUE;
+
+store_pool = POOL_PERM;
+for (;;)
+  {
+  const uschar * before = list;
+  BOOL plain = (item = string_nextinlist(&list, &sep, NULL, 0))
+	       && list_item_plain(item, net);
+
+  if (plain)
+    {
+    list_run_item * it;
+    if (count >= size)
+      {
+      list_run_item * new = store_get((size = size ? 2*size : 64)
+				      * sizeof(list_run_item), FALSE);
+      if (count) memcpy(new, items, count * sizeof(list_run_item));
+      items = new;
+      }
+    if (count == 0) start = before;
+    it = items + count++;
+    it->pattern = item;
+    if (!net)
+      {
+      it->tail = *item == '*';
+      it->key = string_copylc(item + (it->tail ? 1 : 0));
+      it->hash = list_run_hash(it->key, Ustrlen(it->key), it->tail);
+      }
+    end = list;
+    continue;
+    }
+
+  if (count >= LIST_RUN_MIN)
+    {
+    *rp = list_run_make(items, count, start, end, sep, net);
+    rp = &(*rp)->next;
+    items = NULL;
+    size = 0;
+    }
+  count = 0;
+  if (!item) break;
+  }
+store_pool = old_pool;
+
+nb->index = runs;
+return runs;
+}
+
+
+
 /*************************************************
 *       Scan list and run matching function      *
 *************************************************/
@@ -417,6 +737,7 @@ Arguments:
                  be added to any value to suppress expansion of the list
   name         string to use in debugging info
   valueptr     where to pass back data from a lookup
+  named        the named list being scanned, or NULL
 
 Returns:       OK    if matched a non-negated item
                OK    if hit end of list after a negated item
@@ -426,10 +747,11 @@ Returns:       OK    if matched a non-negated item
                DEFER if a something deferred or expansion failed
 */
 
-int
-match_check_list(const uschar **listptr, int sep, tree_node **anchorptr,
+static int
+check_list(const uschar **listptr, int sep, tree_node **anchorptr,
   unsigned int **cache_ptr, int (*func)(void *,const uschar *,const uschar **,uschar **),
-  void *arg, int type, const uschar *name, const uschar **valueptr)
+  void *arg, int type, const uschar *name, const uschar **valueptr,
+  namedlist_block *named)
 {
 int yield = OK;
 unsigned int *original_cache_bits = *cache_ptr;
@@ -438,6 +760,7 @@ BOOL ignore_unknown = FALSE;
 BOOL include_defer = FALSE;
 BOOL ignore_defer = FALSE;
 const uschar *list;
+const list_run *run = NULL;
 uschar *sss;
 uschar *ot = NULL;
 
@@ -501,12 +824,63 @@ else
 
 HDEBUG(D_any) if (!ot) ot = string_sprintf("%s in \"%s\"?", name, list);
 
+/* A named list of domains, local parts or hosts that was not changed by
+expansion may have runs of simple items indexed. */
+
+if (named && list == named->string)
+  if (func == check_string && (type == MCL_DOMAIN || type == MCL_LOCALPART))
+    run = list_index(named, FALSE);
+  else if (func == check_host && type == MCL_HOST)
+    run = list_index(named, TRUE);
+
 /* Now scan the list and process each item in turn, until one of them matches,
 or we hit an error. */
 
-while ((sss = string_nextinlist(&list, &sep, NULL, 0)))
+for (;;)
   {
-  uschar * ss = sss;
+  uschar * ss;
+
+  /* At the start of an indexed run, look the value up instead of scanning the
+  run. The items are all positive. */
+
+  if (run && list == run->start)
+    {
+    const list_run * r = run;
+    const uschar * subject = NULL, * pattern;
+    uschar * error = NULL;
+
+    run = run->next;
+    if (!r->nodes)
+      {
+      check_string_block * cb = (check_string_block *)arg;
+      if (cb->caseless) subject = cb->subject;
+      }
+    else
+      {
+      check_host_block * cb = (check_host_block *)arg;
+      if (*cb->host_address) subject = cb->host_address;
+      }
+
+    if (subject)
+      {
+      if (!(pattern = list_run_find(r, subject)))
+	{
+	list = r->end;
+	sep = r->sep;
+	yield = OK;
+	continue;
+	}
+      if ((func)(arg, pattern, valueptr, &error) == OK)
+	{
+	HDEBUG(D_lists) debug_printf("%s yes (matched \"%s\" - indexed)\n",
+	  ot, pattern);
+	return OK;
+	}
+      }
+    }
+
+  if (!(sss = string_nextinlist(&list, &sep, NULL, 0))) break;
+  ss = sss;
 
   /* Address lists may contain +caseful, to restore caseful matching of the
   local part. We have to know the layout of the control block, unfortunately.
@@ -631,8 +1005,8 @@ while ((sss = string_nextinlist(&list, &sep, NULL, 0)))
 
       if (bits == 0)
         {
-        switch (match_check_list(&(nb->string), 0, anchorptr, &use_cache_bits,
-                func, arg, type, name, valueptr))
+        switch (check_list(&(nb->string), 0, anchorptr, &use_cache_bits,
+                func, arg, type, name, valueptr, nb))
           {
           case OK:   bits = 1; break;
           case FAIL: bits = 3; break;
@@ -897,6 +1271,16 @@ return DEFER;
 }
 
 
+int
+match_check_list(const uschar **listptr, int sep, tree_node **anchorptr,
+  unsigned int **cache_ptr, int (*func)(void *,const uschar *,const uschar **,uschar **),
+  void *arg, int type, const uschar *name, const uschar **valueptr)
+{
+return check_list(listptr, sep, anchorptr, cache_ptr, func, arg, type, name,
+  valueptr, NULL);
+}
+
+
 /*************************************************
 *          Match in colon-separated list         *
 *************************************************/
@@ -103,9 +103,37 @@ return initial_pos;
 }
 
 
+/* Write decoded data. A buffer takes what it has room for, and then refuses
+more, which stops the decoder.
+
+Returns:   FALSE on error or when a buffer is full
+*/
+
+BOOL
+mime_sink_write(mime_sink * out, const uschar * s, size_t len)
+{
+if (out->hash)
+  {
+  exim_sha_update(out->hash, s, len);
+  return TRUE;
+  }
+if (out->file)
+  return fwrite(s, 1, len, out->file) == len;
+if (len > out->size - out->len)
+  {
+  memcpy(out->buf + out->len, s, out->size - out->len);
+  out->len = out->size;
+  return FALSE;
+  }
+memcpy(out->buf + out->len, s, len);
+out->len += len;
+return TRUE;
+}
+
+
 /* just dump MIME part without any decoding */
 static ssize_t
-mime_decode_asis(FILE* in, FILE* out, uschar* boundary)
+mime_decode_asis(FILE* in, mime_sink* out, uschar* boundary)
 {
 ssize_t len, size = 0;
 uschar buffer[MIME_MAX_LINE_LENGTH];
@@ -119,7 +147,7 @@ while(fgets(CS buffer, MIME_MAX_LINE_LENGTH, mime_stream) != NULL)
     break;
 
   len = Ustrlen(buffer);
-  if (fwrite(buffer, 1, (size_t)len, out) < len)
+  if (!mime_sink_write(out, buffer, (size_t)len))
     return -1;
   size += len;
   } /* while */
@@ -130,7 +158,7 @@ return size;
 
 /* decode quoted-printable MIME part */
 static ssize_t
-mime_decode_qp(FILE* in, FILE* out, uschar* boundary)
+mime_decode_qp(FILE* in, mime_sink* out, uschar* boundary)
 {
 uschar ibuf[MIME_MAX_LINE_LENGTH], obuf[MIME_MAX_LINE_LENGTH];
 uschar *ipos, *opos;
@@ -174,7 +202,7 @@ while (fgets(CS ibuf, MIME_MAX_LINE_LENGTH, in) != NULL)
   len = opos - obuf;
   if (len > 0)
     {
-    if (fwrite(obuf, 1, len, out) != len) return -1; /* error */
+    if (!mime_sink_write(out, obuf, len)) return -1; /* error */
     size += len;
     }
   }
@@ -214,6 +242,21 @@ return modefopen(mime_decoded_filename, "wb+", SPOOL_MODE);
 }
 
 
+/* Choose the decoder for the current part */
+
+static ssize_t (*
+mime_decode_function(void))(FILE*, mime_sink*, uschar*)
+{
+return !mime_content_transfer_encoding
+  ? mime_decode_asis	/* no encoding, dump as-is */
+  : Ustrcmp(mime_content_transfer_encoding, "base64") == 0
+  ? mime_decode_base64
+  : Ustrcmp(mime_content_transfer_encoding, "quoted-printable") == 0
+  ? mime_decode_qp
+  : mime_decode_asis;	/* unknown encoding type, just dump as-is */
+}
+
+
 int
 mime_decode(const uschar **listptr)
 {
@@ -222,9 +265,9 @@ const uschar *list = *listptr;
 uschar * option;
 uschar * decode_path;
 FILE *decode_file = NULL;
+mime_sink sink = {0};
 long f_pos = 0;
 ssize_t size_counter = 0;
-ssize_t (*decode_function)(FILE*, FILE*, uschar*);
 
 if (!mime_stream || (f_pos = ftell(mime_stream)) < 0)
   return FAIL;
@@ -273,16 +316,8 @@ if (!decode_file)
   return DEFER;
 
 /* decode according to mime type */
-decode_function =
-  !mime_content_transfer_encoding
-  ? mime_decode_asis	/* no encoding, dump as-is */
-  : Ustrcmp(mime_content_transfer_encoding, "base64") == 0
-  ? mime_decode_base64
-  : Ustrcmp(mime_content_transfer_encoding, "quoted-printable") == 0
-  ? mime_decode_qp
-  : mime_decode_asis;	/* unknown encoding type, just dump as-is */
-
-size_counter = decode_function(mime_stream, decode_file, mime_current_boundary);
+sink.file = decode_file;
+size_counter = (mime_decode_function())(mime_stream, &sink, mime_current_boundary);
 
 clearerr(mime_stream);
 if (fseek(mime_stream, f_pos, SEEK_SET))
@@ -298,6 +333,73 @@ return OK;
 }
 
 
+/* For the malware verdict cache: add a finished content hash, in hex, to the
+list kept for the message */
+
+static void
+mime_hash_add(hctx * h)
+{
+blob b;
+
+exim_sha_finish(h, &b);
+mime_part_hashes = string_catn(mime_part_hashes,
+  mime_part_hashes ? US" " : US"", mime_part_hashes ? 1 : 0);
+for (int i = 0; i < b.len; i++)
+  mime_part_hashes = string_fmt_append(mime_part_hashes, "%02x", b.data[i]);
+}
+
+
+/* Hash the decoded content of the current part, which is a leaf, for the
+malware verdict cache. The stream is left where it was. */
+
+static void
+mime_hash_part(void)
+{
+hctx h;
+mime_sink sink = {.hash = &h};
+long f_pos;
+
+if (!mime_stream || (f_pos = ftell(mime_stream)) < 0)
+  return;
+if (!exim_sha_init(&h, HASH_SHA2_256))
+  return;
+(void) (mime_decode_function())(mime_stream, &sink, mime_current_boundary);
+clearerr(mime_stream);
+(void) fseek(mime_stream, f_pos, SEEK_SET);
+mime_hash_add(&h);
+}
+
+
+/* Decode the start of the current part into memory, for mime_regex when the
+part has not been decoded to a file. Decoding stops when the buffer is full,
+so a large attachment costs no more than its first few lines, and there is no
+file to write and read back.
+
+Arguments:
+  buf       where to put the data
+  size      the size of buf
+
+Returns:    the amount decoded, or -1 on error
+*/
+
+int
+mime_decode_mem(uschar * buf, int size)
+{
+mime_sink sink = {.buf = buf, .size = size};
+long f_pos;
+
+if (!mime_stream || (f_pos = ftell(mime_stream)) < 0)
+  return -1;
+
+(void) (mime_decode_function())(mime_stream, &sink, mime_current_boundary);
+
+clearerr(mime_stream);
+if (fseek(mime_stream, f_pos, SEEK_SET))
+  return -1;
+return sink.len;
+}
+
+
 static int
 mime_get_header(FILE *f, uschar *header)
 {
@@ -499,6 +601,8 @@ mime_acl_check(uschar *acl, FILE *f, struct mime_boundary_context *context,
 int rc = OK;
 uschar * header = NULL;
 struct mime_boundary_context nested_context;
+hctx gap;			/* text outside parts, for the verdict cache */
+BOOL in_gap = FALSE, after_leaf = FALSE;
 
 /* reserve a line buffer to work in.  Assume tainted data. */
 header = store_get(MIME_MAX_HEADER_SIZE+1, TRUE);
@@ -525,12 +629,18 @@ while(1)
    * (I have moved partway towards adding support, however, by adding
    * a "parent" field to my new boundary-context structure.)
    */
+  /* For the verdict cache, the lines skipped here are hashed as well, unless
+  they are the content of the leaf part just seen (which was hashed decoded);
+  otherwise they are a preamble, or text after a nested multipart, which is
+  also part of what a scanner would see. */
+
   if (context) for (;;)
     {
     if (!fgets(CS header, MIME_MAX_HEADER_SIZE, f))
       {
       /* Hit EOF or read error. Ugh. */
       DEBUG(D_acl) debug_printf_indent("MIME: Hit EOF ...\n");
+      if (in_gap) mime_hash_add(&gap);
       return rc;
       }
 
@@ -539,6 +649,11 @@ while(1)
        && Ustrncmp(header+2, context->boundary, Ustrlen(context->boundary)) == 0
        )
       {			/* found boundary */
+      if (in_gap)
+	{
+	mime_hash_add(&gap);
+	in_gap = FALSE;
+	}
       if (Ustrncmp((header+2+Ustrlen(context->boundary)), "--", 2) == 0)
 	{
 	/* END boundary found */
@@ -551,7 +666,14 @@ while(1)
 	context->boundary);
       break;
       }
+
+    if (malware_cache_version && !after_leaf)
+      {
+      if (!in_gap) in_gap = exim_sha_init(&gap, HASH_SHA2_256);
+      if (in_gap) exim_sha_update(&gap, header, Ustrlen(header));
+      }
     }
+  after_leaf = FALSE;
 
   /* parse headers, set up expansion variables */
   while (mime_get_header(f, header))
@@ -720,6 +842,12 @@ while(1)
   /* call ACL handling function */
   rc = acl_check(ACL_WHERE_MIME, NULL, acl, user_msgptr, log_msgptr);
 
+  if (rc == OK && malware_cache_version && !mime_is_multipart)
+    {
+    mime_hash_part();
+    after_leaf = TRUE;
+    }
+
   mime_stream = NULL;
   mime_current_boundary = NULL;
 
@@ -784,8 +912,20 @@ while(1)
     }
 
 NO_RFC822:
-  /* If the boundary of this instance is NULL, we are finished here */
-  if (!context) break;
+  /* If the boundary of this instance is NULL, we are finished here; for the
+  verdict cache, any text after the parts of a multipart message is hashed */
+
+  if (!context)
+    {
+    if (  malware_cache_version && mime_is_multipart
+       && exim_sha_init(&gap, HASH_SHA2_256))
+      {
+      while (fgets(CS header, MIME_MAX_HEADER_SIZE, f))
+	exim_sha_update(&gap, header, Ustrlen(header));
+      mime_hash_add(&gap);
+      }
+    break;
+    }
 
   if (context->context == MBC_COVERLETTER_ONESHOT)
     context->context = MBC_ATTACHMENT;
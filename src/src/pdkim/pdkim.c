@@ -51,6 +51,8 @@
 #define PDKIM_MAX_HEADERS           512
 #define PDKIM_MAX_BODY_LINE_LEN     16384
 #define PDKIM_DNS_TXT_MAX_NAMELEN   1024
+#define PDKIM_KEY_CACHE_SIZE        16
+#define PDKIM_MAX_PREFETCH          20
 
 /* -------------------------------------------------------------------------- */
 struct pdkim_stringlist {
@@ -716,70 +718,72 @@ return NULL;
 
 /* -------------------------------------------------------------------------- */
 
-/* Update one bodyhash with some additional data.
-If we have to relax the data for this sig, return our copy of it. */
+/* Relax a body line, for the relaxed canonicalization. The buffer given for
+the result must be at least one byte longer than the line. Runs of ordinary
+characters are copied as blocks; only whitespace and CR need individual
+treatment. */
 
-static blob *
-pdkim_update_ctx_bodyhash(pdkim_bodyhash * b, blob * orig_data, blob * relaxed_data)
+static void
+pdkim_relax_body_line(const blob * line, blob * relaxed)
 {
-blob * canon_data = orig_data;
-/* Defaults to simple canon (no further treatment necessary) */
+const uschar * p = line->data, * e = p + line->len;
+uschar * q = relaxed->data;
+BOOL seen_wsp = FALSE;
 
-if (b->canon_method == PDKIM_CANON_RELAXED)
+while (p < e)
   {
-  /* Relax the line if not done already */
-  if (!relaxed_data)
-    {
-    BOOL seen_wsp = FALSE;
-    int q = 0;
+  const uschar * s = p;
+  uschar c;
 
-    /* We want to be able to free this else we allocate
-    for the entire message which could be many MB. Since
-    we don't know what allocations the SHA routines might
-    do, not safe to use store_get()/store_reset(). */
-
-    relaxed_data = store_malloc(sizeof(blob) + orig_data->len+1);
-    relaxed_data->data = US (relaxed_data+1);
+  while (p < e && (c = *p) != ' ' && c != '\t' && c != '\r') p++;
+  if (p > s)
+    {
+    memcpy(q, s, p - s);
+    q += p - s;
+    seen_wsp = FALSE;
+    if (p >= e) break;
+    }
 
-    for (const uschar * p = orig_data->data, * r = p + orig_data->len; p < r; p++)
-      {
-      char c = *p;
-      if (c == '\r')
-	{
-	if (q > 0 && relaxed_data->data[q-1] == ' ')
-	  q--;
-	}
-      else if (c == '\t' || c == ' ')
-	{
-	c = ' '; /* Turns WSP into SP */
-	if (seen_wsp)
-	  continue;
-	seen_wsp = TRUE;
-	}
-      else
-	seen_wsp = FALSE;
-      relaxed_data->data[q++] = c;
-      }
-    relaxed_data->data[q] = '\0';
-    relaxed_data->len = q;
+  if ((c = *p++) == '\r')
+    {
+    if (q > relaxed->data && q[-1] == ' ')	/* Squash trailing WSP */
+      q--;
+    *q++ = c;
+    }
+  else if (!seen_wsp)				/* Turn WSP into a single SP */
+    {
+    *q++ = ' ';
+    seen_wsp = TRUE;
     }
-  canon_data = relaxed_data;
   }
+*q = '\0';
+relaxed->len = q - relaxed->data;
+}
+
+
+/* Update one bodyhash with some additional data, in its original form and,
+for the relaxed canonicalization, relaxed. */
+
+static void
+pdkim_update_ctx_bodyhash(pdkim_bodyhash * b, const blob * orig_data,
+  const blob * relaxed_data)
+{
+const blob * canon_data = b->canon_method == PDKIM_CANON_RELAXED
+  ? relaxed_data : orig_data;
+size_t len = canon_data->len;
 
 /* Make sure we don't exceed the to-be-signed body length */
 if (  b->bodylength >= 0
-   && b->signed_body_bytes + (unsigned long)canon_data->len > b->bodylength
+   && b->signed_body_bytes + (unsigned long)len > b->bodylength
    )
-  canon_data->len = b->bodylength - b->signed_body_bytes;
+  len = b->bodylength - b->signed_body_bytes;
 
-if (canon_data->len > 0)
+if (len > 0)
   {
-  exim_sha_update(&b->body_hash_ctx, CUS canon_data->data, canon_data->len);
-  b->signed_body_bytes += canon_data->len;
-  DEBUG(D_acl) pdkim_quoteprint(canon_data->data, canon_data->len);
+  exim_sha_update(&b->body_hash_ctx, CUS canon_data->data, len);
+  b->signed_body_bytes += len;
+  DEBUG(D_acl) pdkim_quoteprint(canon_data->data, len);
   }
-
-return relaxed_data;
 }
 
 
@@ -792,7 +796,13 @@ for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)     /* Finish hashes */
   {
   DEBUG(D_acl) debug_printf("DKIM: finish bodyhash %d/%d/%ld len %ld\n",
 	    b->hashtype, b->canon_method, b->bodylength, b->signed_body_bytes);
-  exim_sha_finish(&b->body_hash_ctx, &b->bh);
+  if (ctx->flags & PDKIM_BH_PRESET)
+    {
+    blob unused;				/* just release the context */
+    exim_sha_finish(&b->body_hash_ctx, &unused);
+    }
+  else
+    exim_sha_finish(&b->body_hash_ctx, &b->bh);
   }
 
 /* Traverse all signatures */
@@ -857,7 +867,7 @@ for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)
      && b->signed_body_bytes == 0
      && b->num_buffered_blanklines > 0
      )
-    (void) pdkim_update_ctx_bodyhash(b, &lineending, NULL);
+    pdkim_update_ctx_bodyhash(b, &lineending, &lineending);
 
 ctx->flags |= PDKIM_SEEN_EOD;
 ctx->linebuf_offset = 0;
@@ -866,26 +876,23 @@ ctx->linebuf_offset = 0;
 
 
 /* -------------------------------------------------------------------------- */
-/* Call from pdkim_feed below for processing complete body lines */
+/* Call from pdkim_feed below for processing complete body lines.  The line
+is either the line buffer or, when it arrived whole, is used in place in the
+caller's data.  It always ends in CRLF. */
 /* NOTE: the line is not NUL-terminated; but we have a count */
 
 static void
-pdkim_bodyline_complete(pdkim_ctx * ctx)
+pdkim_bodyline_complete(pdkim_ctx * ctx, blob line)
 {
-blob line = {.data = ctx->linebuf, .len = ctx->linebuf_offset};
-blob * rnl = NULL;
-blob * rline = NULL;
+blob rline = {.data = NULL};
 
 /* Ignore extra data if we've seen the end-of-data marker */
 if (ctx->flags & PDKIM_SEEN_EOD) goto all_skip;
 
-/* We've always got one extra byte to stuff a zero ... */
-ctx->linebuf[line.len] = '\0';
-
 /* Terminate on EOD marker */
 if (ctx->flags & PDKIM_DOT_TERM)
   {
-  if (memcmp(line.data, ".\r\n", 3) == 0)
+  if (line.len == 3 && memcmp(line.data, ".\r\n", 3) == 0)
     { pdkim_body_complete(ctx); return; }
 
   /* Unstuff dots */
@@ -901,42 +908,39 @@ if (memcmp(line.data, "\r\n", 2) == 0)
   goto all_skip;
   }
 
-/* Process line for each bodyhash separately */
+/* Process line for each bodyhash separately. The relaxed form is made once,
+when first needed, and shared by all the relaxed bodyhashes. */
+
 for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)
   {
   if (b->canon_method == PDKIM_CANON_RELAXED)
     {
-    /* Lines with just spaces need to be buffered too */
-    uschar * cp = line.data;
-    char c;
-
-    while ((c = *cp))
+    if (!rline.data)
       {
-      if (c == '\r' && cp[1] == '\n') break;
-      if (c != ' ' && c != '\t') goto hash_process;
-      cp++;
+      rline.data = ctx->relaxbuf;
+      pdkim_relax_body_line(&line, &rline);
       }
 
-    b->num_buffered_blanklines++;
-    goto hash_skip;
+    /* Lines with just spaces need to be buffered too */
+    if (  rline.len == 2 && memcmp(rline.data, "\r\n", 2) == 0
+       && line.data[line.len-2] == '\r')
+      {
+      b->num_buffered_blanklines++;
+      continue;
+      }
     }
 
-hash_process:
   /* At this point, we have a non-empty line, so release the buffered ones. */
 
   while (b->num_buffered_blanklines)
     {
-    rnl = pdkim_update_ctx_bodyhash(b, &lineending, rnl);
+    pdkim_update_ctx_bodyhash(b, &lineending, &lineending);
     b->num_buffered_blanklines--;
     }
 
-  rline = pdkim_update_ctx_bodyhash(b, &line, rline);
-hash_skip: ;
+  pdkim_update_ctx_bodyhash(b, &line, &rline);
   }
 
-if (rnl) store_free(rnl);
-if (rline) store_free(rline);
-
 all_skip:
 
 ctx->linebuf_offset = 0;
@@ -1022,6 +1026,48 @@ return PDKIM_OK;
 
 
 
+/* -------------------------------------------------------------------------- */
+/* Once the headers are done we know all the signatures to be verified.
+Start the DNS lookups for their keys together, so that a message with several
+waits once for the slowest rather than for each in turn at the end of the
+data. The answers are held by the DNS layer for pdkim_key_from_dns().
+Verification runs in the perm pool; the working store here is temporary. */
+
+static void
+pdkim_prefetch_keys(pdkim_ctx * ctx)
+{
+const uschar * names[PDKIM_MAX_PREFETCH];
+int types[PDKIM_MAX_PREFETCH];
+int n = 0, old_pool = store_pool;
+rmark reset_point;
+
+store_pool = POOL_MAIN;
+reset_point = store_mark();
+
+for (pdkim_signature * sig = ctx->sig; sig && n < nelem(names); sig = sig->next)
+  if (sig->domain && *sig->domain && sig->selector && *sig->selector)
+    {
+    uschar * name = string_sprintf("%s._domainkey.%s.",
+				  sig->selector, sig->domain);
+    int i;
+
+    for (i = 0; i < n; i++) if (Ustrcmp(names[i], name) == 0) break;
+    if (i < n) continue;
+    names[n] = name;
+    types[n++] = T_TXT;
+    }
+
+if (n > 1)
+  {
+  DEBUG(D_acl) debug_printf("DKIM: prefetching %d keys\n", n);
+  dns_init(FALSE, FALSE, FALSE);	/* as for dnsbl lookups */
+  dns_prefetch(names, types, n);
+  }
+store_reset(reset_point);
+store_pool = old_pool;
+}
+
+
 /* -------------------------------------------------------------------------- */
 #define HEADER_BUFFER_FRAG_SIZE 256
 
@@ -1039,25 +1085,44 @@ else for (int p = 0; p < len; p++)
 
   if (ctx->flags & PDKIM_PAST_HDRS)
     {
-    if (c == '\n' && !(ctx->flags & PDKIM_SEEN_CR))	/* emulate the CR */
+    /* Processing body bytes. A CRLF line held whole in the data is hashed
+    where it lies; otherwise everything up to the next LF is copied to the
+    line buffer as a block. */
+
+    if (c != '\n')
       {
-      ctx->linebuf[ctx->linebuf_offset++] = '\r';
-      if (ctx->linebuf_offset == PDKIM_MAX_BODY_LINE_LEN-1)
+      const uschar * nl = memchr(data + p, '\n', len - p);
+      int n = (nl ? nl - data : len) - p;
+
+      if (ctx->linebuf_offset == 0 && nl && nl[-1] == '\r')
+	{
+	if (n + 1 >= PDKIM_MAX_BODY_LINE_LEN-1)
+	  return PDKIM_ERR_LONG_LINE;
+	pdkim_bodyline_complete(ctx, (blob) {.data = data + p, .len = n + 1});
+	p += n;
+	continue;
+	}
+
+      if (ctx->linebuf_offset + n >= PDKIM_MAX_BODY_LINE_LEN-1)
 	return PDKIM_ERR_LONG_LINE;
+      memcpy(ctx->linebuf + ctx->linebuf_offset, data + p, n);
+      ctx->linebuf_offset += n;
+      if (!(ctx->flags & PDKIM_SEEN_CR) && memchr(data + p, '\r', n))
+	ctx->flags |= PDKIM_SEEN_CR;
+      if (!nl) break;
+      p += n;
       }
 
-    /* Processing body byte */
-    ctx->linebuf[ctx->linebuf_offset++] = c;
-    if (c == '\r')
-      ctx->flags |= PDKIM_SEEN_CR;
-    else if (c == '\n')
+    if (!(ctx->flags & PDKIM_SEEN_CR))		/* emulate the CR */
       {
-      ctx->flags &= ~PDKIM_SEEN_CR;
-      pdkim_bodyline_complete(ctx);
+      ctx->linebuf[ctx->linebuf_offset++] = '\r';
+      if (ctx->linebuf_offset == PDKIM_MAX_BODY_LINE_LEN-1)
+	return PDKIM_ERR_LONG_LINE;
       }
-
-    if (ctx->linebuf_offset == PDKIM_MAX_BODY_LINE_LEN-1)
-      return PDKIM_ERR_LONG_LINE;
+    ctx->linebuf[ctx->linebuf_offset++] = '\n';
+    ctx->flags &= ~PDKIM_SEEN_CR;
+    pdkim_bodyline_complete(ctx,
+      (blob) {.data = ctx->linebuf, .len = ctx->linebuf_offset});
     }
   else
     {
@@ -1075,6 +1140,8 @@ else for (int p = 0; p < len; p++)
 	  return rc;
 
 	ctx->flags = (ctx->flags & ~(PDKIM_SEEN_LF|PDKIM_SEEN_CR)) | PDKIM_PAST_HDRS;
+	if (!(ctx->flags & PDKIM_MODE_SIGN))
+	  pdkim_prefetch_keys(ctx);
 	DEBUG(D_acl) debug_printf(
 	    "DKIM >> Body data for hash, canonicalized >>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
 	continue;
@@ -1330,12 +1397,96 @@ if (excess > 0)
 }
 
 
+/* -------------------------------------------------------------------------- */
+/* Keys parsed and imported for verification, kept for the life of the
+process. A big sender uses the same selector for a great many messages, and
+a process handling a connection with several of them, or a run of signatures
+by the same signer, need not parse and import the key again. The DNS lookup
+is still done each time, so the DNS TTL (and the shared DNS cache, when
+configured) governs how long a key is used for; an entry is used only when the
+record text is exactly what it was made from. The table is not replaced into
+once full, so its memory is bounded. */
+
+typedef struct {
+  const uschar *	name;		/* selector._domainkey.domain. */
+  const uschar *	record;		/* the TXT record text */
+  pdkim_pubkey *	pubkey;
+  ev_ctx		vctx;		/* the imported key */
+  unsigned		keybits;
+} pdkim_key_cache_ent;
+
+static pdkim_key_cache_ent pdkim_key_cache[PDKIM_KEY_CACHE_SIZE];
+static unsigned pdkim_key_cache_used = 0;
+
+
+static const uschar *
+pdkim_blob_copy_perm(const blob * b)
+{
+uschar * s = store_get_perm(b->len, is_tainted(b->data));
+memcpy(s, b->data, b->len);
+return s;
+}
+
+#define PK_PERM(s) ((s) ? string_copy_perm(s, FALSE) : NULL)
+
+/* Add a key to the cache. Return TRUE if it was taken. */
+
+static BOOL
+pdkim_key_cache_add(const uschar * name, const uschar * record,
+  const pdkim_pubkey * p, const ev_ctx * vctx, unsigned keybits)
+{
+pdkim_key_cache_ent * e;
+pdkim_pubkey * pp;
+
+if (pdkim_key_cache_used >= PDKIM_KEY_CACHE_SIZE) return FALSE;
+e = &pdkim_key_cache[pdkim_key_cache_used++];
+
+pp = store_get_perm(sizeof(pdkim_pubkey), FALSE);
+*pp = *p;
+pp->version = PK_PERM(p->version);
+pp->granularity = PK_PERM(p->granularity);
+pp->hashes = PK_PERM(p->hashes);
+pp->keytype = PK_PERM(p->keytype);
+pp->srvtype = PK_PERM(p->srvtype);
+pp->notes = PK_PERM(p->notes);
+pp->key.data = US pdkim_blob_copy_perm(&p->key);
+
+e->name = string_copy_perm(name, FALSE);
+e->record = string_copy_perm(record, FALSE);
+e->pubkey = pp;
+e->vctx = *vctx;
+e->keybits = keybits;
+return TRUE;
+}
+
+#undef PK_PERM
+
+
+static pdkim_key_cache_ent *
+pdkim_key_cache_find(const uschar * name, const uschar * record, int keytype)
+{
+for (pdkim_key_cache_ent * e = pdkim_key_cache;
+     e < pdkim_key_cache + pdkim_key_cache_used; e++)
+  if (  e->vctx.keytype == keytype
+     && Ustrcmp(e->record, record) == 0
+     && Ustrcmp(e->name, name) == 0)
+    return e;
+return NULL;
+}
+
+
+/* Get the key for a signature, from DNS. If the key came from the cache,
+*cached is set TRUE, and it must not be released after use. */
+
 static pdkim_pubkey *
 pdkim_key_from_dns(pdkim_ctx * ctx, pdkim_signature * sig, ev_ctx * vctx,
-  const uschar ** errstr)
+  BOOL * cached, const uschar ** errstr)
 {
 uschar * dns_txt_name, * dns_txt_reply;
 pdkim_pubkey * p;
+pdkim_key_cache_ent * e;
+
+*cached = FALSE;
 
 /* Fetch public key for signing domain, from DNS */
 
@@ -1360,6 +1511,18 @@ DEBUG(D_acl)
   pdkim_quoteprint(CUS dns_txt_reply, Ustrlen(dns_txt_reply));
   }
 
+if (  sig->keytype >= 0
+   && (e = pdkim_key_cache_find(dns_txt_name, dns_txt_reply, sig->keytype)))
+  {
+  DEBUG(D_acl) debug_printf(
+      " using cached key\n"
+      "DKIM <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n");
+  *vctx = e->vctx;
+  sig->keybits = e->keybits;
+  *cached = TRUE;
+  return e->pubkey;
+  }
+
 if (  !(p = pdkim_parse_pubkey_record(CUS dns_txt_reply))
    || (Ustrcmp(p->srvtype, "*") != 0 && Ustrcmp(p->srvtype, "email") != 0)
    )
@@ -1412,6 +1575,7 @@ if ((*errstr = exim_dkim_verify_init(&p->key,
   }
 
 vctx->keytype = sig->keytype;
+*cached = pdkim_key_cache_add(dns_txt_name, dns_txt_reply, p, vctx, sig->keybits);
 return p;
 }
 
@@ -1471,6 +1635,51 @@ return yield;
 }
 
 
+/* -------------------------------------------------------------------------- */
+/* Imported signing keys are kept for the life of the process, indexed by their
+PEM text, so that a key used for many messages is parsed only once; the library
+objects for keys are never freed in any case. A daemon can preload keys, and
+the processes it forks then inherit them. */
+
+static tree_node * pdkim_signing_keys = NULL;
+
+static const uschar *
+pdkim_signing_key(const uschar * privkey, es_ctx * sctx)
+{
+tree_node * t;
+const uschar * err;
+int old_pool;
+
+if ((t = tree_search(pdkim_signing_keys, privkey)))
+  {
+  DEBUG(D_acl) debug_printf("DKIM: signing key found in cache\n");
+  *sctx = *(es_ctx *)t->data.ptr;
+  return NULL;
+  }
+
+if ((err = exim_dkim_signing_init(privkey, sctx)))
+  return err;
+
+old_pool = store_pool;
+store_pool = POOL_PERM;
+t = store_get(sizeof(tree_node) + Ustrlen(privkey), is_tainted(privkey));
+Ustrcpy(t->name, privkey);
+t->data.ptr = store_get(sizeof(es_ctx), FALSE);
+*(es_ctx *)t->data.ptr = *sctx;
+(void) tree_insertnode(&pdkim_signing_keys, t);
+store_pool = old_pool;
+return NULL;
+}
+
+
+const uschar *
+pdkim_preload_key(const uschar * privkey)
+{
+es_ctx sctx;
+return pdkim_signing_key(privkey, &sctx);
+}
+
+
 /* -------------------------------------------------------------------------- */
 
 DLLEXPORT int
@@ -1484,15 +1693,13 @@ BOOL verify_pass = FALSE;
    out of '<CR><LF>' */
 if (ctx->cur_header && ctx->cur_header->ptr > 0)
   {
-  blob * rnl = NULL;
   int rc;
 
   if ((rc = pdkim_header_complete(ctx)) != PDKIM_OK)
     return rc;
 
   for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)
-    rnl = pdkim_update_ctx_bodyhash(b, &lineending, rnl);
-  if (rnl) store_free(rnl);
+    pdkim_update_ctx_bodyhash(b, &lineending, &lineending);
   }
 else
   DEBUG(D_acl) debug_printf(
@@ -1586,7 +1793,7 @@ for (pdkim_signature * sig = ctx->sig; sig; sig = sig->next)
     /* Import private key, including the keytype which we need for building
     the signature header  */
 
-    if ((*err = exim_dkim_signing_init(CUS sig->privkey, &sctx)))
+    if ((*err = pdkim_signing_key(CUS sig->privkey, &sctx)))
       {
       log_write(0, LOG_MAIN|LOG_PANIC, "signing_init: %s", *err);
       return PDKIM_ERR_RSA_PRIVKEY;
@@ -1765,6 +1972,7 @@ for (pdkim_signature * sig = ctx->sig; sig; sig = sig->next)
   else
     {
     ev_ctx vctx;
+    BOOL key_cached;
     hashmethod hm;
 
     /* Make sure we have all required signature tags */
@@ -1813,7 +2021,7 @@ for (pdkim_signature * sig = ctx->sig; sig; sig = sig->next)
       pdkim_hexprint(sig->sighash.data, sig->sighash.len);
       }
 
-    if (!(sig->pubkey = pdkim_key_from_dns(ctx, sig, &vctx, err)))
+    if (!(sig->pubkey = pdkim_key_from_dns(ctx, sig, &vctx, &key_cached, err)))
       {
       log_write(0, LOG_MAIN, "DKIM: %s%s %s%s [failed key import]",
 	sig->domain   ? "d=" : "", sig->domain   ? sig->domain   : US"",
@@ -1852,7 +2060,9 @@ for (pdkim_signature * sig = ctx->sig; sig; sig = sig->next)
 
     /* Check the signature */
 
-    if ((*err = exim_dkim_verify(&vctx, hm, &hhash, &sig->sighash)))
+    *err = exim_dkim_verify(&vctx, hm, &hhash, &sig->sighash);
+    if (!key_cached) exim_dkim_verify_free(&vctx);
+    if (*err)
       {
       DEBUG(D_acl) debug_printf("headers verify: %s\n", *err);
       sig->verify_status =      PDKIM_VERIFY_FAIL;
@@ -1918,8 +2128,9 @@ ctx = store_get(sizeof(pdkim_ctx), FALSE);
 memset(ctx, 0, sizeof(pdkim_ctx));
 
 if (dot_stuffing) ctx->flags = PDKIM_DOT_TERM;
-/* The line-buffer is for message data, hence tainted */
+/* The line-buffers are for message data, hence tainted */
 ctx->linebuf = store_get(PDKIM_MAX_BODY_LINE_LEN, TRUE);
+ctx->relaxbuf = store_get(PDKIM_MAX_BODY_LINE_LEN, TRUE);
 ctx->dns_txt_callback = dns_txt_callback;
 
 return ctx;
@@ -1965,9 +2176,10 @@ DEBUG(D_acl)
   {
   pdkim_signature s = *sig;
   ev_ctx vctx;
+  BOOL key_cached;
 
   debug_printf("DKIM (checking verify key)>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
-  if (!pdkim_key_from_dns(ctx, &s, &vctx, errstr))
+  if (!pdkim_key_from_dns(ctx, &s, &vctx, &key_cached, errstr))
     debug_printf("WARNING: bad dkim key in dns\n");
   debug_printf("DKIM (finished checking verify key)<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n");
   }
@@ -2048,6 +2260,34 @@ return b;
 }
 
 
+/* Find, or create, a bodyhash from the canonicalization and hash names of a
+signature header: the "c=" tag and the hash part of "a=". This is how ARC asks
+for its bodyhashes, so that any with the same canonicalization, hash and length
+as those of DKIM signatures in the context are shared with them, and the body
+is canonicalized and hashed only once. */
+
+pdkim_bodyhash *
+pdkim_find_bodyhash(pdkim_ctx * ctx, const uschar * canon, unsigned clen,
+  const uschar * hash, unsigned hlen, long bodylength, BOOL create)
+{
+int canon_head = -1, canon_body = -1, hashtype;
+
+pdkim_cstring_to_canons(canon, clen, &canon_head, &canon_body);
+if ((hashtype = pdkim_hashname_to_hashtype(hash, hlen)) < 0 || canon_body < 0)
+  return NULL;
+
+if (!create)
+  {
+  for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)
+    if (  b->hashtype == hashtype && b->canon_method == canon_body
+       && b->bodylength == bodylength)
+      return b;
+  return NULL;
+  }
+return pdkim_set_bodyhash(ctx, hashtype, canon_body, bodylength);
+}
+
+
 /* Set up a blob for calculating the bodyhash according to the
 needs of this signature.  Use an existing one if possible, or
 create a new one.
@@ -2064,6 +2304,98 @@ return b;
 }
 
 
+/* -------------------------------------------------------------------------- */
+/* Bodyhashes in a form for keeping with a message, so that later signings of
+an unchanged body can skip hashing it: a space-separated list of items
+"<canon>/<hash>=<base64 value>". Only hashes of the whole body are kept. */
+
+static const uschar *
+pdkim_bodyhash_find(const pdkim_bodyhash * b, const uschar * list)
+{
+uschar * name = string_sprintf("%s/%s=", pdkim_canons[b->canon_method],
+			      pdkim_hashes[b->hashtype].dkim_hashname);
+int len = Ustrlen(name), sep = ' ';
+uschar * ele;
+
+if (list)
+  while ((ele = string_nextinlist(&list, &sep, NULL, 0)))
+    if (Ustrncmp(ele, name, len) == 0)
+      return ele + len;
+return NULL;
+}
+
+
+/* Add bodyhashes to be calculated, from a list of "<canon>/<hash>" names.
+Unrecognised items are ignored. */
+
+void
+pdkim_bodyhashes_request(pdkim_ctx * ctx, const uschar * list)
+{
+int sep = 0;
+uschar * ele;
+
+while ((ele = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  uschar * s = Ustrchr(ele, '/');
+  int canon = -1, hashtype;
+
+  if (!s) continue;
+  *s++ = '\0';
+  for (int i = 0; pdkim_canons[i]; i++)
+    if (Ustrcmp(ele, pdkim_canons[i]) == 0) { canon = i; break; }
+  if (canon >= 0 && (hashtype = pdkim_hashname_to_hashtype(s, 0)) >= 0)
+    (void) pdkim_set_bodyhash(ctx, hashtype, canon, -1);
+  }
+}
+
+
+/* Set every bodyhash of a context from a list. If that can be done (and only
+then) the body need not be fed, and TRUE is returned. */
+
+BOOL
+pdkim_bodyhashes_import(pdkim_ctx * ctx, const uschar * list)
+{
+if (!list || !ctx->bodyhash) return FALSE;
+
+for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)
+  {
+  const uschar * val;
+
+  if (b->bodylength >= 0 || !(val = pdkim_bodyhash_find(b, list)))
+    return FALSE;
+  pdkim_decode_base64(val, &b->bh);
+  if (!b->bh.data) return FALSE;
+  }
+
+DEBUG(D_transport) debug_printf("DKIM: using bodyhashes kept with message\n");
+ctx->flags |= PDKIM_BH_PRESET;
+return TRUE;
+}
+
+
+/* Add to a list any whole-body hashes, completed by pdkim_feed_finish(),
+that it does not already have. */
+
+uschar *
+pdkim_bodyhashes_export(pdkim_ctx * ctx, uschar * list)
+{
+gstring * g = NULL;
+
+if (ctx->flags & PDKIM_BH_PRESET) return list;
+
+for (pdkim_bodyhash * b = ctx->bodyhash; b; b = b->next)
+  if (b->bodylength < 0 && b->bh.data && !pdkim_bodyhash_find(b, list))
+    {
+    if (!g) g = string_cat(NULL, list ? list : US"");
+    g = string_fmt_append(g, "%s%s/%s=%s", g->ptr ? " " : "",
+	  pdkim_canons[b->canon_method],
+	  pdkim_hashes[b->hashtype].dkim_hashname,
+	  pdkim_encode_base64(&b->bh));
+    }
+return g ? string_from_gstring(g) : list;
+}
+
+
 /* -------------------------------------------------------------------------- */
 
 
@@ -2073,8 +2405,9 @@ pdkim_init_context(pdkim_ctx * ctx, BOOL dot_stuffed,
 {
 memset(ctx, 0, sizeof(pdkim_ctx));
 ctx->flags = dot_stuffed ? PDKIM_MODE_SIGN | PDKIM_DOT_TERM : PDKIM_MODE_SIGN;
-/* The line buffer is for message data, hence tainted */
+/* The line buffers are for message data, hence tainted */
 ctx->linebuf = store_get(PDKIM_MAX_BODY_LINE_LEN, TRUE);
+ctx->relaxbuf = store_get(PDKIM_MAX_BODY_LINE_LEN, TRUE);
 DEBUG(D_acl) ctx->dns_txt_callback = dns_txt_callback;
 }
 
@@ -279,6 +279,7 @@ typedef struct pdkim_ctx {
 #define PDKIM_SEEN_LF	  BIT(3)
 #define PDKIM_PAST_HDRS	  BIT(4)
 #define PDKIM_SEEN_EOD	  BIT(5)
+#define PDKIM_BH_PRESET	  BIT(6)	/* bodyhashes given; body not fed */
   unsigned   flags;
 
   /* One (signing) or several chained (verification) signatures */
@@ -294,6 +295,7 @@ typedef struct pdkim_ctx {
   gstring   *cur_header;
   uschar    *linebuf;
   int        linebuf_offset;
+  uschar    *relaxbuf;       /* Relaxed copy of the current body line */
   int        num_headers;
   pdkim_stringlist *headers; /* Raw headers for verification         */
 } pdkim_ctx;
@@ -331,6 +333,8 @@ pdkim_signature *pdkim_init_sign    (pdkim_ctx *,
 DLLEXPORT
 pdkim_ctx *pdkim_init_verify  (uschar * (*)(const uschar *), BOOL);
 
+const uschar *	pdkim_preload_key(const uschar *);
+
 DLLEXPORT
 void       pdkim_set_optional (pdkim_signature *, char *, char *,int, int,
                                long,
@@ -341,6 +345,11 @@ int		pdkim_hashname_to_hashtype(const uschar *, unsigned);
 void		pdkim_cstring_to_canons(const uschar *, unsigned, int *, int *);
 pdkim_bodyhash *pdkim_set_bodyhash(pdkim_ctx *, int, int, long);
 pdkim_bodyhash *pdkim_set_sig_bodyhash(pdkim_ctx *, pdkim_signature *);
+pdkim_bodyhash *pdkim_find_bodyhash(pdkim_ctx *, const uschar *, unsigned,
+		  const uschar *, unsigned, long, BOOL);
+void		pdkim_bodyhashes_request(pdkim_ctx *, const uschar *);
+BOOL		pdkim_bodyhashes_import(pdkim_ctx *, const uschar *);
+uschar *	pdkim_bodyhashes_export(pdkim_ctx *, uschar *);
 
 DLLEXPORT
 int        pdkim_feed         (pdkim_ctx *, uschar *, int);
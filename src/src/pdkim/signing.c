@@ -223,11 +223,19 @@ else
     ret = US gnutls_strerror(rc);
   }
 
-gnutls_pubkey_deinit(verify_ctx->key);
 return ret;
 }
 
 
+/* release an imported public key */
+
+void
+exim_dkim_verify_free(ev_ctx * verify_ctx)
+{
+gnutls_pubkey_deinit(verify_ctx->key);
+}
+
+
 
 
 #elif defined(SIGN_GCRYPT)
@@ -684,13 +692,21 @@ if (s_sig) gcry_sexp_release (s_sig);
 if (s_hash) gcry_sexp_release (s_hash);
 if (s_pkey) gcry_sexp_release (s_pkey);
 gcry_mpi_release (m_sig);
-gcry_mpi_release (verify_ctx->n);
-gcry_mpi_release (verify_ctx->e);
 
 return NULL;
 }
 
 
+/* release an imported public key */
+
+void
+exim_dkim_verify_free(ev_ctx * verify_ctx)
+{
+gcry_mpi_release (verify_ctx->n);
+gcry_mpi_release (verify_ctx->e);
+}
+
+
 
 
 #elif defined(SIGN_OPENSSL)
@@ -808,7 +824,6 @@ uschar * ret = NULL;
 switch(fmt)
   {
   case KEYFMT_DER:
-    /*XXX hmm, we never free this */
     if (!(verify_ctx->key = d2i_PUBKEY(NULL, &s, pubkey->len)))
       ret = US ERR_error_string(ERR_get_error(), NULL);
     break;
@@ -890,6 +905,15 @@ return US ERR_error_string(ERR_get_error(), NULL);
 }
 
 
+/* release an imported public key */
+
+void
+exim_dkim_verify_free(ev_ctx * verify_ctx)
+{
+EVP_PKEY_free(verify_ctx->key);
+}
+
+
 
 #endif
 /******************************************************************************/
@@ -92,6 +92,7 @@ extern const uschar * exim_dkim_signing_init(const uschar *, es_ctx *);
 extern const uschar * exim_dkim_sign(es_ctx *, hashmethod, blob *, blob *);
 extern const uschar * exim_dkim_verify_init(blob *, keyformat, ev_ctx *, unsigned *);
 extern const uschar * exim_dkim_verify(ev_ctx *, hashmethod, blob *, blob *);
+extern void exim_dkim_verify_free(ev_ctx *);
 
 #endif	/*DISABLE_DKIM*/
 /* End of File */
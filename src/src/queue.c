@@ -72,6 +72,266 @@ return first;
 
 
 
+/*************************************************
+*         Add an item to a list of spool files   *
+*************************************************/
+
+/* This is used while building the list in queue_get_spool_list(), either
+adding the item at the top or the bottom of a randomized list, or feeding it
+into the bottom-up merge sort.
+
+Arguments:
+  next         the new item
+  randomize    TRUE for a randomized list
+  yield        pointer to the top of the randomized list
+  last         pointer to the bottom of the randomized list
+  flags        pointer to the random bits in use
+  resetflags   random bits to reload flags with
+  root         the sublists for the merge sort
+
+Returns:       nothing
+*/
+
+static void
+queue_list_insert(queue_filename * next, BOOL randomize,
+  queue_filename ** yield, queue_filename ** last, int * flags, int resetflags,
+  queue_filename ** root)
+{
+/* Handle the creation of a randomized list. The first item becomes both
+the top and bottom of the list. Subsequent items are inserted either at
+the top or the bottom, randomly. This is, I argue, faster than doing a
+sort by allocating a random number to each item, and it also saves having
+to store the number with each item. */
+
+if (randomize)
+  if (!*yield)
+    {
+    next->next = NULL;
+    *yield = *last = next;
+    }
+  else
+    {
+    if (*flags == 0)
+      *flags = resetflags;
+    if ((*flags & 1) == 0)
+      {
+      next->next = *yield;
+      *yield = next;
+      }
+    else
+      {
+      next->next = NULL;
+      (*last)->next = next;
+      *last = next;
+      }
+    *flags = *flags >> 1;
+    }
+
+/* Otherwise do a bottom-up merge sort based on the name. */
+
+else
+  {
+  next->next = NULL;
+  for (int j = 0; j < LOG2_MAXNODES; j++)
+    if (root[j])
+      {
+      next = merge_queue_lists(next, root[j]);
+      root[j] = j == LOG2_MAXNODES - 1 ? next : NULL;
+      }
+    else
+      {
+      root[j] = next;
+      break;
+      }
+  }
+}
+
+
+
+/*************************************************
+*             In-memory queue index              *
+*************************************************/
+
+/* When queue_index is set, the daemon keeps a record of the messages on its
+queue. It is built by a scan of the spool when the daemon starts (and again
+every queue_index_rescan), and kept up to date by notifications, sent via the
+daemon notifier socket, from processes that add messages to the queue or remove
+them. Queue runners forked by the daemon inherit a copy, and make their lists
+from it instead of reading the spool directories. The entries are in malloc
+store, as they must survive the resets of the daemon's main pool. */
+
+typedef struct qindex_entry {
+  struct qindex_entry * next;
+  uschar dir_uschar;			/* subdirectory char, or 0 */
+  uschar text[SPOOL_NAME_LENGTH+1];	/* name of the -H file */
+} qindex_entry;
+
+#define QINDEX_INITIAL_SIZE 4096	/* initial count of hash buckets */
+
+static qindex_entry ** qindex_table = NULL;
+static unsigned qindex_size = 0;
+static unsigned qindex_entries = 0;
+static BOOL     qindex_valid = FALSE;
+static time_t   qindex_built = 0;
+
+
+static unsigned
+qindex_hash(const uschar * id)
+{
+unsigned h = 2166136261u;			/* FNV-1a */
+for (int i = 0; i < MESSAGE_ID_LENGTH; i++) h = (h ^ id[i]) * 16777619u;
+return h;
+}
+
+
+/* Double the number of hash buckets, rehashing the existing entries */
+
+static void
+qindex_grow(void)
+{
+unsigned newsize = qindex_size ? qindex_size * 2 : QINDEX_INITIAL_SIZE;
+qindex_entry ** newtable = store_malloc(newsize * sizeof(qindex_entry *));
+
+memset(newtable, 0, newsize * sizeof(qindex_entry *));
+for (unsigned i = 0; i < qindex_size; i++)
+  for (qindex_entry * e = qindex_table[i], * next; e; e = next)
+    {
+    unsigned h = qindex_hash(e->text) & (newsize - 1);
+    next = e->next;
+    e->next = newtable[h];
+    newtable[h] = e;
+    }
+if (qindex_table) store_free(qindex_table);
+qindex_table = newtable;
+qindex_size = newsize;
+}
+
+
+static void
+qindex_add(const uschar * id, int dir_uschar)
+{
+qindex_entry ** ep, * e;
+
+if (qindex_entries >= qindex_size * 2) qindex_grow();
+
+for (ep = qindex_table + (qindex_hash(id) & (qindex_size - 1)); *ep;
+     ep = &(*ep)->next)
+  if (Ustrncmp((*ep)->text, id, MESSAGE_ID_LENGTH) == 0)
+    {
+    (*ep)->dir_uschar = dir_uschar;
+    return;
+    }
+
+e = store_malloc(sizeof(qindex_entry));
+memcpy(e->text, id, MESSAGE_ID_LENGTH);
+Ustrcpy(e->text + MESSAGE_ID_LENGTH, US"-H");
+e->dir_uschar = dir_uschar;
+e->next = NULL;
+*ep = e;
+qindex_entries++;
+}
+
+
+static void
+qindex_del(const uschar * id)
+{
+if (qindex_size)
+  for (qindex_entry ** ep = qindex_table + (qindex_hash(id) & (qindex_size - 1));
+       *ep; ep = &(*ep)->next)
+    if (Ustrncmp((*ep)->text, id, MESSAGE_ID_LENGTH) == 0)
+      {
+      qindex_entry * e = *ep;
+      *ep = e->next;
+      store_free(e);
+      qindex_entries--;
+      return;
+      }
+}
+
+
+static void
+qindex_clear(void)
+{
+for (unsigned i = 0; i < qindex_size; i++)
+  {
+  for (qindex_entry * e = qindex_table[i], * next; e; e = next)
+    {
+    next = e->next;
+    store_free(e);
+    }
+  qindex_table[i] = NULL;
+  }
+qindex_entries = 0;
+}
+
+
+
+/*************************************************
+*       Get list of spool files from index       *
+*************************************************/
+
+/* This is the equivalent of queue_get_spool_list() below, for a process that
+has a queue index; the arguments and result are the same. The list of
+subdirectories is those in which the index has messages. */
+
+static queue_filename *
+qindex_get_spool_list(int subdiroffset, uschar * subdirs, int * subcount,
+  BOOL randomize, unsigned * pcount)
+{
+int flags = 0;
+int resetflags = -1;
+int want = subdiroffset > 0 ? subdirs[subdiroffset] : 0;
+queue_filename * yield = NULL, * last = NULL;
+queue_filename * root[LOG2_MAXNODES];
+
+if (pcount)
+  *pcount = 0;
+else if (randomize)
+  resetflags = time(NULL) & 0xFFFF;
+else
+  for (int i = 0; i < LOG2_MAXNODES; i++)
+    root[i] = NULL;
+
+if (subdiroffset <= 0)
+  {
+  BOOL seen[256];
+
+  memset(seen, 0, sizeof(seen));
+  subdirs[0] = 0;
+  *subcount = 0;
+  for (unsigned i = 0; i < qindex_size; i++)
+    for (qindex_entry * e = qindex_table[i]; e; e = e->next)
+      if (e->dir_uschar && !seen[e->dir_uschar])
+	{
+	seen[e->dir_uschar] = TRUE;
+	subdirs[++*subcount] = e->dir_uschar;
+	}
+  }
+
+for (unsigned i = 0; i < qindex_size; i++)
+  for (qindex_entry * e = qindex_table[i]; e; e = e->next)
+    if (subdiroffset < 0 || e->dir_uschar == want)
+      if (pcount)
+	(*pcount)++;
+      else
+	{
+	queue_filename * next =
+	  store_get(sizeof(queue_filename) + SPOOL_NAME_LENGTH, FALSE);
+	Ustrcpy(next->text, e->text);
+	next->dir_uschar = e->dir_uschar;
+	queue_list_insert(next, randomize, &yield, &last, &flags, resetflags,
+	  root);
+	}
+
+DEBUG(D_queue_run) debug_printf("queue list from index (%d)\n", subdiroffset);
+
+if (!pcount && !randomize)
+  for (int i = 0; i < LOG2_MAXNODES; ++i)
+    yield = merge_queue_lists(yield, root[i]);
+
+return yield;
+}
+
 
 
 /*************************************************
@@ -129,6 +389,13 @@ queue_filename *last = NULL;
 uschar buffer[256];
 queue_filename *root[LOG2_MAXNODES];
 
+/* A process holding a queue index (the daemon, or a queue runner it forked)
+makes the list from that rather than reading the directories. */
+
+if (qindex_valid)
+  return qindex_get_spool_list(subdiroffset, subdirs, subcount, randomize,
+    pcount);
+
 /* When randomizing, the file names are added to the start or end of the list
 according to the bits of the flags variable. Get a collection of bits from the
 current time. Use the bottom 16 and just keep re-using them if necessary. When
@@ -155,155 +422,817 @@ if (subdiroffset <= 0)
 else
   i = subdiroffset;
 
-/* Set up prototype for the directory name. */
-
-spool_pname_buf(buffer, sizeof(buffer));
-buffer[sizeof(buffer) - 3] = 0;
-subptr = Ustrlen(buffer);
-buffer[subptr+2] = 0;               /* terminator for lengthened name */
-
 /* This loop runs at least once, for the main or given directory, and then as
 many times as necessary to scan any subdirectories encountered in the main
-directory, if they are to be scanned at this time. */
+directory, if they are to be scanned at this time. When spool_stripes is set,
+each directory is scanned in every one of the spool roots, and a subdirectory
+found in any of them is scanned in all of them. */
 
 for (; i <= *subcount; i++)
   {
-  int count = 0;
   int subdirchar = subdirs[i];      /* 0 for main directory */
-  DIR *dd;
 
-  if (subdirchar != 0)
+  for (int r = 0; r < spool_root_count(); r++)
     {
-    buffer[subptr] = '/';
-    buffer[subptr+1] = subdirchar;
+    int count = 0;
+    DIR *dd;
+
+    /* Set up the directory name */
+
+    spool_pname_buf(buffer, sizeof(buffer), spool_root_n(r));
+    buffer[sizeof(buffer) - 3] = 0;
+    subptr = Ustrlen(buffer);
+    if (subdirchar != 0)
+      {
+      buffer[subptr] = '/';
+      buffer[subptr+1] = subdirchar;
+      buffer[subptr+2] = 0;
+      }
+
+    DEBUG(D_queue_run) debug_printf("looking in %s\n", buffer);
+    if (!(dd = exim_opendir(buffer)))
+      continue;
+
+    /* Now scan the directory. */
+
+    for (struct dirent *ent; ent = readdir(dd); )
+      {
+      uschar *name = US ent->d_name;
+      int len = Ustrlen(name);
+
+      /* Count entries */
+
+      count++;
+
+      /* If we find a single alphameric sub-directory in the base directory,
+      add it to the list for subsequent scans, unless another spool root has
+      already supplied it. */
+
+      if (i == 0 && len == 1 && isalnum(*name))
+	{
+	if (!memchr(subdirs + 1, *name, *subcount))
+	  {
+	  *subcount = *subcount + 1;
+	  subdirs[*subcount] = *name;
+	  }
+	continue;
+	}
+
+      /* Otherwise, if it is a header spool file, add it to the list */
+
+      if (len == SPOOL_NAME_LENGTH &&
+	  Ustrcmp(name + SPOOL_NAME_LENGTH - 2, "-H") == 0)
+	if (pcount)
+	  (*pcount)++;
+	else
+	  {
+	  queue_filename *next =
+	    store_get(sizeof(queue_filename) + Ustrlen(name), is_tainted(name));
+	  Ustrcpy(next->text, name);
+	  next->dir_uschar = subdirchar;
+	  queue_list_insert(next, randomize, &yield, &last, &flags, resetflags,
+	    root);
+	  }
+      }
+
+    /* Finished with this directory */
+
+    closedir(dd);
+
+    /* If we have just scanned a sub-directory, and it was empty (count == 2
+    implies just "." and ".." entries), and Exim is no longer configured to
+    use sub-directories, attempt to get rid of it. At the same time, try to
+    get rid of any corresponding msglog subdirectory. These are just cosmetic
+    tidying actions, so just ignore failures. */
+
+    if (i != 0 && !split_spool_directory && count <= 2)
+      {
+      rmdir(CS buffer);
+      rmdir(CS string_sprintf("%s/%s/msglog/%c",
+	spool_root_n(r), queue_name, subdirchar));
+      }
     }
 
-  DEBUG(D_queue_run) debug_printf("looking in %s\n", buffer);
-  if (!(dd = exim_opendir(buffer)))
-    continue;
+  /* If we are scanning just a single sub-directory, break the loop. If we
+  have just scanned the base directory, and subdiroffset is 0, we do not want
+  to continue scanning the sub-directories. */
+
+  if (i != 0)
+    {
+    if (subdiroffset > 0) break;    /* Single sub-directory */
+    }
+  else if (subdiroffset == 0)
+    break;
+  }    /* Loop for multiple subdirectories */
+
+/* When using a bottom-up merge sort, do the final merging of the sublists.
+Then pass back the final list of file items. */
+
+if (!pcount && !randomize)
+  for (i = 0; i < LOG2_MAXNODES; ++i)
+    yield = merge_queue_lists(yield, root[i]);
+
+return yield;
+}
+
+
+
+
+/*************************************************
+*          Parallel deliveries in a queue run    *
+*************************************************/
+
+/* When queue_run_parallel is greater than one, a queue runner makes a single
+list of the whole queue and keeps that many delivery processes going at once,
+starting the next message whenever one finishes. This does the work of several
+queue runners without each of them scanning the spool and competing for the
+same messages. A slot is busy until its delivery process has ended and so have
+any children it started to use its SMTP connections, as shown by the closing of
+its synchronizing pipe. */
+
+typedef struct {
+  pid_t		pid;			/* 0 when ended */
+  int		fd;			/* read end of the pipe; -1 when free */
+  int		pclass;			/* priority class, or -1 */
+  int		lane;			/* size lane, or -1 */
+  uschar	id[MESSAGE_ID_LENGTH + 1];
+} qrun_slot;
+
+static qrun_slot * qrun_slots = NULL;
+#ifndef NO_POLL_H
+static struct pollfd * qrun_pfds = NULL;
+#endif
+static int qrun_nslots = 0;
+static int qrun_busy = 0;
+
+
+/* Priority classes, from queue_priority_classes; see qprio_order() */
+
+#define QPRIO_MAX	16
+
+static int qprio_count = 0;
+static int qprio_weight[QPRIO_MAX];
+static int qprio_limit[QPRIO_MAX];
+
+
+/* Size lanes, from queue_size_lanes; see qlane_order() */
+
+#define QLANE_MAX	8
+
+static int qlane_count = 0;
+static int_eximarith_t qlane_size[QLANE_MAX];
+static int qlane_limit[QLANE_MAX];
+
+/* How far ahead a parallel run looks for a message that can be started, when
+the next one's class or lane has as many deliveries going as it may */
 
-  /* Now scan the directory. */
+#define QRUN_LOOKAHEAD	256
 
-  for (struct dirent *ent; ent = readdir(dd); )
+
+/* Check whether a priority class and a size lane have room for another
+delivery. Either may be -1 if not in use. */
+
+static BOOL
+qrun_class_full(int pclass, int lane)
+{
+int n = 0, m = 0;
+
+if (  (pclass < 0 || qprio_limit[pclass] <= 0)
+   && (lane < 0 || qlane_limit[lane] <= 0))
+  return FALSE;
+for (qrun_slot * s = qrun_slots; s < qrun_slots + qrun_nslots; s++)
+  if (s->fd >= 0)
     {
-    uschar *name = US ent->d_name;
-    int len = Ustrlen(name);
+    if (pclass >= 0 && s->pclass == pclass) n++;
+    if (lane >= 0 && s->lane == lane) m++;
+    }
+return pclass >= 0 && qprio_limit[pclass] > 0 && n >= qprio_limit[pclass]
+    || lane >= 0 && qlane_limit[lane] > 0 && m >= qlane_limit[lane];
+}
+
 
-    /* Count entries */
+/* Wait until no more than a given number of slots are busy, and there is room
+for another delivery of a given priority class and size lane.
 
-    count++;
+Arguments:
+  max       the number that may stay busy
+  pclass    the priority class, or -1
+  lane      the size lane, or -1
+  force     the force_delivery flag of the queue run, cleared when a delivery
+            has been attempted
 
-    /* If we find a single alphameric sub-directory in the base directory,
-    add it to the list for subsequent scans. */
+Returns:    nothing
+*/
 
-    if (i == 0 && len == 1 && isalnum(*name))
+static void
+qrun_slots_wait(int max, int pclass, int lane, BOOL * force)
+{
+while (qrun_busy > max || qrun_class_full(pclass, lane))
+  {
+  int rc;
+#ifndef NO_POLL_H
+  struct pollfd * pfds = qrun_pfds;
+
+  for (int i = 0; i < qrun_nslots; i++)
+    pfds[i] = (struct pollfd) {.fd = qrun_slots[i].fd, .events = POLLIN};
+
+  set_process_info("running queue: %d deliveries", qrun_busy);
+  rc = poll(pfds, qrun_nslots, -1);
+# define QRUN_READY(i) (pfds[i].revents)
+#else
+  fd_set fds;
+  int max_fd = -1;
+
+  FD_ZERO(&fds);
+  for (int i = 0; i < qrun_nslots; i++) if (qrun_slots[i].fd >= 0)
+    {
+    FD_SET(qrun_slots[i].fd, &fds);
+    if (qrun_slots[i].fd > max_fd) max_fd = qrun_slots[i].fd;
+    }
+
+  set_process_info("running queue: %d deliveries", qrun_busy);
+  rc = select(max_fd + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, NULL);
+# define QRUN_READY(i) (FD_ISSET(qrun_slots[i].fd, &fds))
+#endif
+
+  if (rc < 0)
+    {
+    if (errno == EINTR) continue;
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "queue run: wait failed: %s",
+      strerror(errno));
+    }
+
+  for (int i = 0; i < qrun_nslots; i++)
+    if (qrun_slots[i].fd >= 0 && QRUN_READY(i))
       {
-      *subcount = *subcount + 1;
-      subdirs[*subcount] = *name;
+      qrun_slot * s = qrun_slots + i;
+      uschar buffer[256];
+      int status = read(s->fd, buffer, sizeof(buffer));
+
+      if (status != 0)
+	log_write(0, LOG_MAIN|LOG_PANIC, status > 0 ?
+	  "queue run: unexpected data on pipe" : "queue run: error on pipe: %s",
+	  strerror(errno));
+      (void)close(s->fd);
+      s->fd = -1;
+
+      /* All the descendants have finished, so the delivery process has. */
+
+      while (waitpid(s->pid, &status, 0) < 0 && errno == EINTR) ;
+      if (!(status & 0xffff)) *force = f.queue_run_force;
+      else if (status & 0x00ff)
+	log_write(0, LOG_MAIN|LOG_PANIC,
+	  "queue run: process %d crashed with signal %d while delivering %s",
+	  (int)s->pid, status & 0x00ff, s->id);
+      DEBUG(D_queue_run) debug_printf("qrun delivery %d for %s finished\n",
+	(int)s->pid, s->id);
+      s->pid = 0;
+      qrun_busy--;
+      }
+#undef QRUN_READY
+  }
+set_process_info("running queue");
+}
+
+
+/* Record a delivery process in a free slot. */
+
+static void
+qrun_slot_add(pid_t pid, int fd, int pclass, int lane, const uschar * id)
+{
+for (qrun_slot * s = qrun_slots; s < qrun_slots + qrun_nslots; s++)
+  if (s->fd < 0)
+    {
+    s->pid = pid;
+    s->fd = fd;
+    s->pclass = pclass;
+    s->lane = lane;
+    Ustrncpy(s->id, id, MESSAGE_ID_LENGTH);
+    s->id[MESSAGE_ID_LENGTH] = 0;
+    qrun_busy++;
+    return;
+    }
+}
+
+
+/* When the next message of a parallel run is of a class or lane that has no
+room, look a little way ahead for one that can be started at once, and move it
+to the front, so that a run of big messages held to a few deliveries does not
+keep the other slots idle. The message passed over comes next.
+
+Arguments:
+  fq         the next message
+  by_class   TRUE if priority classes are in use
+  by_lane    TRUE if size lanes are in use
+
+Returns:     the message to deliver next
+*/
+
+static queue_filename *
+qrun_promote(queue_filename * fq, BOOL by_class, BOOL by_lane)
+{
+queue_filename * p = fq;
+
+if (!qrun_class_full(by_class ? fq->pclass : -1, by_lane ? fq->lane : -1))
+  return fq;
+for (int n = 0; n < QRUN_LOOKAHEAD && p->next; n++, p = p->next)
+  {
+  queue_filename * q = p->next;
+  if (!qrun_class_full(by_class ? q->pclass : -1, by_lane ? q->lane : -1))
+    {
+    DEBUG(D_queue_run) debug_printf("%.*s taken before %.*s\n",
+      MESSAGE_ID_LENGTH, q->text, MESSAGE_ID_LENGTH, fq->text);
+    p->next = q->next;
+    q->next = fq;
+    return q;
+    }
+  }
+return fq;
+}
+
+
+/* Rearrange a list of messages from the whole of a split spool so that
+consecutive messages come from different subdirectories, taking them from each
+in turn, so that the deliveries going on at once are spread across them. The
+order within each subdirectory is kept. */
+
+static queue_filename *
+qrun_interleave(queue_filename * list)
+{
+queue_filename * heads[256] = {NULL}, ** tails[256];
+uschar order[256];
+int ndirs = 0;
+queue_filename * yield = NULL, ** last = &yield;
+
+for (queue_filename * next; list; list = next)
+  {
+  int d = list->dir_uschar;
+  next = list->next;
+  if (!heads[d]) { order[ndirs++] = d; tails[d] = &heads[d]; }
+  *tails[d] = list;
+  tails[d] = &list->next;
+  list->next = NULL;
+  }
+
+for (BOOL more = TRUE; more; )
+  {
+  more = FALSE;
+  for (int i = 0; i < ndirs; i++)
+    {
+    int d = order[i];
+    if (heads[d])
+      {
+      *last = heads[d];
+      last = &heads[d]->next;
+      heads[d] = heads[d]->next;
+      *last = NULL;
+      more = TRUE;
+      }
+    }
+  }
+return yield;
+}
+
+
+
+/*************************************************
+*       Group a queue run by next-hop host       *
+*************************************************/
+
+/* When queue_run_by_host is set, the messages of a queue run are rearranged
+so that those waiting for the same host are delivered one after another, and a
+connection left open by one of them is more likely to be usable by the next.
+The hosts come from the marker records that remote transports keep in their
+wait-<transport> hints databases for messages that have been deferred (see
+transport_update_waiting()). A message waiting for more than one host goes
+with the one that has the most messages waiting. Each group is placed where its
+first message came in the list, and messages with no host stay where they are,
+so the run is otherwise in the same order.
+
+Arguments:
+  list      the list of messages for the run
+
+Returns:    the rearranged list
+*/
+
+typedef struct qhost_group {
+  struct qhost_group * next;		/* in order of first message */
+  int		count;			/* number of messages waiting */
+  queue_filename * first;		/* its first message in the run */
+  queue_filename * rest;		/* its other messages */
+  queue_filename ** tail;
+} qhost_group;
+
+static queue_filename *
+queue_order_by_host(queue_filename * list)
+{
+tree_node * hosts = NULL, * msgs = NULL;
+qhost_group * groups = NULL, ** glast = &groups;
+queue_filename * yield = NULL, ** last = &yield;
+int nmarkers = 0;
+
+for (transport_instance * t = transports; t; t = t->next)
+  {
+  open_db dbblock, * dbm;
+  EXIM_CURSOR * cursor;
+
+  if (t->info->local) continue;
+  if (!(dbm = dbfn_open(string_sprintf("wait-%.200s", t->name), O_RDONLY,
+		&dbblock, FALSE, TRUE)))
+    continue;
+
+  for (uschar * key = dbfn_scan(dbm, TRUE, &cursor); key;
+       key = dbfn_scan(dbm, FALSE, &cursor))
+    {
+    int len = Ustrlen(key);
+    const uschar * id = key + len - MESSAGE_ID_LENGTH;
+    uschar * hname;
+    tree_node * hn, * mn;
+
+    /* Only marker records, <host>:<message-id>, are wanted */
+
+    if (  len < MESSAGE_ID_LENGTH + 2 || id[-1] != ':'
+       || id[6] != '-' || id[13] != '-')
       continue;
+
+    if (!(hn = tree_search(hosts, hname = string_copyn(key, id - 1 - key))))
+      {
+      qhost_group * g = store_get(sizeof(qhost_group), FALSE);
+      *g = (qhost_group) {.count = 0, .first = NULL, .rest = NULL};
+      hn = store_get(sizeof(tree_node) + Ustrlen(hname), is_tainted(hname));
+      Ustrcpy(hn->name, hname);
+      hn->data.ptr = g;
+      (void) tree_insertnode(&hosts, hn);
       }
+    ((qhost_group *)hn->data.ptr)->count++;
 
-    /* Otherwise, if it is a header spool file, add it to the list */
+    /* Keep the host with the most messages for each message */
 
-    if (len == SPOOL_NAME_LENGTH &&
-        Ustrcmp(name + SPOOL_NAME_LENGTH - 2, "-H") == 0)
-      if (pcount)
-	(*pcount)++;
-      else
-	{
-	queue_filename *next =
-	  store_get(sizeof(queue_filename) + Ustrlen(name), is_tainted(name));
-	Ustrcpy(next->text, name);
-	next->dir_uschar = subdirchar;
-
-	/* Handle the creation of a randomized list. The first item becomes both
-	the top and bottom of the list. Subsequent items are inserted either at
-	the top or the bottom, randomly. This is, I argue, faster than doing a
-	sort by allocating a random number to each item, and it also saves having
-	to store the number with each item. */
-
-	if (randomize)
-	  if (!yield)
-	    {
-	    next->next = NULL;
-	    yield = last = next;
-	    }
-	  else
-	    {
-	    if (flags == 0)
-	      flags = resetflags;
-	    if ((flags & 1) == 0)
-	      {
-	      next->next = yield;
-	      yield = next;
-	      }
-	    else
-	      {
-	      next->next = NULL;
-	      last->next = next;
-	      last = next;
-	      }
-	    flags = flags >> 1;
-	    }
+    if (!(mn = tree_search(msgs, id)))
+      {
+      mn = store_get(sizeof(tree_node) + MESSAGE_ID_LENGTH, FALSE);
+      memcpy(mn->name, id, MESSAGE_ID_LENGTH + 1);
+      mn->data.ptr = hn->data.ptr;
+      (void) tree_insertnode(&msgs, mn);
+      nmarkers++;
+      }
+    else if (((qhost_group *)hn->data.ptr)->count
+	     > ((qhost_group *)mn->data.ptr)->count)
+      mn->data.ptr = hn->data.ptr;
+    }
+  dbfn_close(dbm);
+  }
+
+DEBUG(D_queue_run)
+  debug_printf("queue run by host: %d messages waiting for hosts\n", nmarkers);
+if (!msgs) return list;
+
+/* Make the new list, with the first message of each group in its place and
+the others set aside, then splice each group's others in after its first. */
+
+for (queue_filename * next; list; list = next)
+  {
+  uschar id[MESSAGE_ID_LENGTH + 1];
+  tree_node * mn;
+  qhost_group * g = NULL;
+
+  next = list->next;
+  list->next = NULL;
+  Ustrncpy(id, list->text, MESSAGE_ID_LENGTH);
+  id[MESSAGE_ID_LENGTH] = 0;
+
+  if ((mn = tree_search(msgs, id)) && (g = mn->data.ptr)->first)
+    {
+    *g->tail = list;
+    g->tail = &list->next;
+    continue;
+    }
+  if (mn)
+    {
+    g->first = list;
+    g->tail = &g->rest;
+    *glast = g;
+    glast = &g->next;
+    }
+  *last = list;
+  last = &list->next;
+  }
+
+*glast = NULL;
+for (qhost_group * g = groups; g; g = g->next)
+  if (g->rest)
+    {
+    *g->tail = g->first->next;
+    g->first->next = g->rest;
+    }
+return yield;
+}
+
+
+
+
+/*************************************************
+*      Order a queue run by priority class       *
+*************************************************/
+
+/* queue_priority_classes is a list of weights, one for each priority class
+from 0 upwards; messages of a higher class than the list covers are in the
+last. An item can have a slash and the greatest number of deliveries of the
+class to have going at once when queue_run_parallel is set.
+
+Read the option. Returns TRUE if classes are in use. */
+
+static BOOL
+qprio_setup(void)
+{
+const uschar * list = queue_priority_classes;
+int sep = 0;
+uschar * s;
+
+qprio_count = 0;
+if (!list) return FALSE;
+while ((s = string_nextinlist(&list, &sep, NULL, 0)) && qprio_count < QPRIO_MAX)
+  {
+  uschar * t;
+  long w = Ustrtol(s, &t, 10), l = 0;
+
+  if (*t == '/') l = Ustrtol(t + 1, &t, 10);
+  if (w <= 0 || w > 1000 || l < 0 || *t)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "malformed item \"%s\" in "
+      "queue_priority_classes", s);
+    return (qprio_count = 0);
+    }
+  qprio_weight[qprio_count] = w;
+  qprio_limit[qprio_count++] = l;
+  }
+return qprio_count > 0;
+}
+
+
+/* Say whether a message of the given class is in the most urgent one, when
+there is more than one. These get a queue run to themselves when they are not
+delivered at once. */
+
+BOOL
+queue_priority_urgent(int pclass)
+{
+return qprio_setup() && qprio_count > 1 && pclass >= qprio_count - 1;
+}
+
+
+/* Rearrange the messages of a run by priority class, each class keeping its
+order (or being grouped by host, if required). The classes take turns by smooth
+weighted round robin: each time, every class with messages left gains its
+weight in credit, and the one with the most provides the next message and loses
+the sum of the weights. Over the run each class gets places in proportion to
+its weight, spread evenly, so a small urgent class is never stuck behind a big
+bulk one.
+
+Arguments:
+  list      the list of messages for the run
+  by_host   TRUE to group each class by host
+
+Returns:    the rearranged list
+*/
+
+static queue_filename *
+qprio_order(queue_filename * list, BOOL by_host)
+{
+queue_filename * heads[QPRIO_MAX] = {NULL}, ** tails[QPRIO_MAX];
+int credit[QPRIO_MAX] = {0};
+queue_filename * yield = NULL, ** last = &yield;
+
+for (int c = 0; c < qprio_count; c++) tails[c] = &heads[c];
+for (queue_filename * next; list; list = next)
+  {
+  int c = spool_read_priority(list->text, list->dir_uschar);
+
+  if (c >= qprio_count) c = qprio_count - 1;
+  else if (c < 0) c = 0;
+  next = list->next;
+  list->next = NULL;
+  list->pclass = c;
+  *tails[c] = list;
+  tails[c] = &list->next;
+  }
+
+DEBUG(D_queue_run)
+  for (int c = 0; c < qprio_count; c++) if (heads[c])
+    {
+    int n = 0;
+    for (queue_filename * q = heads[c]; q; q = q->next) n++;
+    debug_printf("priority class %d: %d messages, weight %d\n", c, n,
+      qprio_weight[c]);
+    }
+
+if (by_host)
+  for (int c = 0; c < qprio_count; c++)
+    if (heads[c]) heads[c] = queue_order_by_host(heads[c]);
+
+for (;;)
+  {
+  int best = -1, total = 0;
+
+  for (int c = qprio_count - 1; c >= 0; c--) if (heads[c])
+    {
+    credit[c] += qprio_weight[c];
+    total += qprio_weight[c];
+    if (best < 0 || credit[c] > credit[best]) best = c;
+    }
+  if (best < 0) break;
+
+  credit[best] -= total;
+  *last = heads[best];
+  last = &heads[best]->next;
+  heads[best] = heads[best]->next;
+  *last = NULL;
+  }
+return yield;
+}
+
+
+
+
+/*************************************************
+*         Order a queue run by size lane         *
+*************************************************/
+
+/* queue_size_lanes is a list of message sizes in ascending order, each the
+greatest size for a lane; messages bigger than the last are in a lane of their
+own, which can be given as "*" to set its limit. An item can have a slash and
+the greatest number of deliveries of the lane to have going at once when
+queue_run_parallel is set.
+
+Read the option. Returns TRUE if lanes are in use. */
+
+static BOOL
+qlane_setup(void)
+{
+const uschar * list = queue_size_lanes;
+int sep = 0;
+uschar * s;
+
+qlane_count = 0;
+if (!list) return FALSE;
+while ((s = string_nextinlist(&list, &sep, NULL, 0)) && qlane_count < QLANE_MAX)
+  {
+  uschar * t = s;
+  int_eximarith_t size = -1;
+  long l = 0;
+
+  if (*t == '*') t++;
+  else
+    {
+    size = Ustrtol(s, &t, 10);
+    switch (*t)
+      {
+      case 'G': case 'g': size *= 1024;
+      case 'M': case 'm': size *= 1024;
+      case 'K': case 'k': size *= 1024; t++;
+      }
+    }
+  if (*t == '/') l = Ustrtol(t + 1, &t, 10);
+  if (  t == s || *t || l < 0 || size == 0
+     || size < 0 && list && *list
+     || qlane_count > 0 && size >= 0 && size <= qlane_size[qlane_count-1]
+     )
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "malformed item \"%s\" in "
+      "queue_size_lanes", s);
+    return (qlane_count = 0);
+    }
+  qlane_size[qlane_count] = size;
+  qlane_limit[qlane_count++] = l;
+  }
+
+/* Add the lane for the biggest messages, if not given */
+
+if (qlane_count > 0 && qlane_size[qlane_count-1] >= 0)
+  if (qlane_count < QLANE_MAX)
+    {
+    qlane_size[qlane_count] = -1;
+    qlane_limit[qlane_count++] = 0;
+    }
+  else
+    qlane_size[qlane_count-1] = -1;
+return qlane_count > 1;
+}
+
+
+/* Rearrange the messages of a run by size lane, each lane keeping its order.
+The size is that of the data file, which is found with a stat() and needs no
+reading of the spool. The lanes take turns, smallest first, so a burst of big
+messages is spread through the run instead of holding up the small ones behind
+it.
+
+Argument:   the list of messages for the run
+Returns:    the rearranged list
+*/
+
+static queue_filename *
+qlane_order(queue_filename * list)
+{
+queue_filename * heads[QLANE_MAX] = {NULL}, ** tails[QLANE_MAX];
+queue_filename * yield = NULL, ** last = &yield;
+
+for (int c = 0; c < qlane_count; c++) tails[c] = &heads[c];
+for (queue_filename * next; list; list = next)
+  {
+  uschar subdir_str[2] = { list->dir_uschar, 0 };
+  uschar * fname = spool_fname(US"input", subdir_str, list->text, US"");
+  struct stat statbuf;
+  int c = 0;
+
+  fname[Ustrlen(fname) - 1] = 'D';
+  if (Ustat(fname, &statbuf) == 0)
+    {
+    int_eximarith_t size = spool_data_size(&statbuf);
+    while (qlane_size[c] >= 0 && size > qlane_size[c]) c++;
+    }
+  next = list->next;
+  list->next = NULL;
+  list->lane = c;
+  *tails[c] = list;
+  tails[c] = &list->next;
+  }
 
-	/* Otherwise do a bottom-up merge sort based on the name. */
+DEBUG(D_queue_run)
+  for (int c = 0; c < qlane_count; c++) if (heads[c])
+    {
+    int n = 0;
+    for (queue_filename * q = heads[c]; q; q = q->next) n++;
+    debug_printf("size lane %d: %d messages\n", c, n);
+    }
 
-	else
-	  {
-	  next->next = NULL;
-	  for (int j = 0; j < LOG2_MAXNODES; j++)
-	    if (root[j])
-	      {
-	      next = merge_queue_lists(next, root[j]);
-	      root[j] = j == LOG2_MAXNODES - 1 ? next : NULL;
-	      }
-	    else
-	      {
-	      root[j] = next;
-	      break;
-	      }
-	  }
-	}
+for (BOOL more = TRUE; more; )
+  {
+  more = FALSE;
+  for (int c = 0; c < qlane_count; c++) if (heads[c])
+    {
+    *last = heads[c];
+    last = &heads[c]->next;
+    heads[c] = heads[c]->next;
+    *last = NULL;
+    more = TRUE;
     }
+  }
+return yield;
+}
 
-  /* Finished with this directory */
 
-  closedir(dd);
 
-  /* If we have just scanned a sub-directory, and it was empty (count == 2
-  implies just "." and ".." entries), and Exim is no longer configured to
-  use sub-directories, attempt to get rid of it. At the same time, try to
-  get rid of any corresponding msglog subdirectory. These are just cosmetic
-  tidying actions, so just ignore failures. If we are scanning just a single
-  sub-directory, break the loop. */
 
-  if (i != 0)
-    {
-    if (!split_spool_directory && count <= 2)
-      {
-      uschar subdir[2];
+/*************************************************
+*       Pass by messages that are not yet due    *
+*************************************************/
 
-      rmdir(CS buffer);
-      subdir[0] = subdirchar; subdir[1] = 0;
-      rmdir(CS spool_dname(US"msglog", subdir));
-      }
-    if (subdiroffset > 0) break;    /* Single sub-directory */
-    }
+/* With queue_retry_index, a delivery that leaves a message on the queue
+records in the retry database, keyed by "M:" and the message id, the earliest
+time at which any of its addresses could get further. Messages whose time has
+not come are taken out of a queue run here, so that their spool files are not
+even opened. The database is not held open, as deliveries are going on.
 
-  /* If we have just scanned the base directory, and subdiroffset is 0,
-  we do not want to continue scanning the sub-directories. */
+Argument:   the list of messages for the run
+Returns:    the list of those that are due
+*/
 
-  else if (subdiroffset == 0)
-    break;
-  }    /* Loop for multiple subdirectories */
+static queue_filename *
+queue_skip_not_due(queue_filename * list)
+{
+open_db dbblock, * dbm;
+queue_filename * yield = NULL, ** last = &yield;
+time_t now = time(NULL);
+rmark reset_point;
+int skipped = 0;
 
-/* When using a bottom-up merge sort, do the final merging of the sublists.
-Then pass back the final list of file items. */
+if (!(dbm = dbfn_open(US"retry", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return list;
+reset_point = store_mark();
 
-if (!pcount && !randomize)
-  for (i = 0; i < LOG2_MAXNODES; ++i)
-    yield = merge_queue_lists(yield, root[i]);
+for (queue_filename * next; list; list = next)
+  {
+  uschar key[MESSAGE_ID_LENGTH + 3];
+  dbdata_retry * retry_record;
+
+  next = list->next;
+  sprintf(CS key, "M:%.*s", MESSAGE_ID_LENGTH, list->text);
+  if (  (retry_record = dbfn_read(dbm, key))
+     && now < retry_record->next_try
+     && now - retry_record->time_stamp <= retry_data_expire)
+    skipped++;
+  else
+    {
+    *last = list;
+    last = &list->next;
+    }
+  }
+*last = NULL;
 
+dbfn_close(dbm);
+store_reset(reset_point);
+DEBUG(D_queue_run) if (skipped)
+  debug_printf("%d message%s not yet due\n", skipped, skipped == 1 ? "" : "s");
 return yield;
 }
 
@@ -354,6 +1283,13 @@ int subcount = 0;
 uschar subdirs[64];
 pid_t qpid[4] = {0};	/* Parallelism factor for q2stage 1st phase */
 BOOL single_id = FALSE;
+int parallel = 1;
+BOOL by_host = queue_run_by_host && !f.queue_2stage && !queue_run_in_order;
+BOOL by_class = FALSE;
+BOOL by_lane = FALSE;
+BOOL one_list;
+int workers = f.queue_2stage && !queue_run_in_order
+  ? MIN(queue_first_pass_workers, 256) : 0;
 
 #ifdef MEASURE_TIMING
 report_time_since(&timestamp_startup, US"queue_run start");
@@ -372,6 +1308,12 @@ f.queue_smtp = f.queue_2stage;
 queue_run_pid = getpid();
 f.queue_running = TRUE;
 
+/* Keep the queue runner, and the deliveries it starts, on its own CPUs */
+
+#ifdef EXIM_HAVE_CPU_AFFINITY
+if (queue_run_cpus && !recurse) (void) exim_set_cpus(queue_run_cpus, -1);
+#endif
+
 /* Log the true start of a queue run, and fancy options */
 
 if (!recurse)
@@ -409,16 +1351,50 @@ if (!recurse)
 
   single_id = start_id && stop_id && !f.queue_2stage
 	      && Ustrcmp(start_id, stop_id) == 0;
+
+  /* Lose any shared data files that messages no longer use */
+
+  if (!single_id) spool_dedup_tidy();
+  }
+
+/* Parallel deliveries are not used for the first phase of a 2-stage run,
+which has its own, or when the order of the queue is to be kept. */
+
+if (  queue_run_parallel > 1 && !f.queue_2stage && !queue_run_in_order
+   && !single_id)
+  {
+  parallel = queue_run_parallel;
+  if (qrun_nslots < parallel)
+    {
+    qrun_slots = store_malloc(parallel * sizeof(qrun_slot));
+#ifndef NO_POLL_H
+    qrun_pfds = store_malloc(parallel * sizeof(struct pollfd));
+#endif
+    qrun_nslots = parallel;
+    }
+  for (int i = 0; i < qrun_nslots; i++) qrun_slots[i].fd = -1;
+  qrun_busy = 0;
+  DEBUG(D_queue_run) debug_printf("queue run with %d deliveries at once\n",
+    parallel);
+  }
+if (!f.queue_2stage && !queue_run_in_order && !single_id)
+  {
+  by_class = qprio_setup();
+  by_lane = qlane_setup();
   }
+one_list = queue_run_in_order || parallel > 1 || by_host || by_class || by_lane
+  || workers > 0;
 
-/* If deliver_selectstring is a regex, compile it. */
+/* If deliver_selectstring is a regex, compile it. These are used for the
+whole queue run, so they are not taken from the regex cache, which might
+discard them. */
 
 if (deliver_selectstring && f.deliver_selectstring_regex)
-  selectstring_regex = regex_must_compile(deliver_selectstring, TRUE, FALSE);
+  selectstring_regex = regex_must_compile(deliver_selectstring, TRUE, TRUE);
 
 if (deliver_selectstring_sender && f.deliver_selectstring_sender_regex)
   selectstring_regex_sender =
-    regex_must_compile(deliver_selectstring_sender, TRUE, FALSE);
+    regex_must_compile(deliver_selectstring_sender, TRUE, TRUE);
 
 /* If the spool is split into subdirectories, we want to process it one
 directory at a time, so as to spread out the directory scanning and the
@@ -433,13 +1409,15 @@ then randomized after the first time through, before they are scanned in
 subsequent iterations.
 
 When the first argument of queue_get_spool_list() is -1 (for queue_run_in_
-order), it scans all directories and makes a single message list. */
+order, parallel deliveries, or grouping by host), it scans all directories and
+makes a single message list. That is then grouped by host, or for parallel
+deliveries interleaved by directory. */
 
-for (int i = queue_run_in_order ? -1 : 0;
-     i <= (queue_run_in_order ? -1 : subcount);
-     i++)
+for (int i = one_list ? -1 : 0; i <= (one_list ? -1 : subcount); i++)
   {
   rmark reset_point1 = store_mark();
+  queue_filename * fqlist;
+  int worker = -1, listed = 0;
 
   DEBUG(D_queue_run)
     {
@@ -451,9 +1429,47 @@ for (int i = queue_run_in_order ? -1 : 0;
       debug_printf("queue running subdirectory '%c'\n", subdirs[i]);
     }
 
-  for (queue_filename * fq = queue_get_spool_list(i, subdirs, &subcount,
-					     !queue_run_in_order, NULL);
-       fq; fq = fq->next)
+  fqlist = queue_get_spool_list(i, subdirs, &subcount, !queue_run_in_order,
+    NULL);
+  if (queue_retry_index && !force_delivery)
+    fqlist = queue_skip_not_due(fqlist);
+  if (by_lane)
+    fqlist = qlane_order(fqlist);
+  if (by_class)
+    fqlist = qprio_order(fqlist, by_host);
+  else if (by_host)
+    fqlist = queue_order_by_host(fqlist);
+  else if (parallel > 1 && subcount > 0)
+    fqlist = qrun_interleave(fqlist);
+
+  /* With queue_first_pass_workers, the first phase of a two-stage run is
+  shared by a pool of processes, each taking every so many messages of the list
+  and routing them one after another, instead of a process being forked for
+  each message. This process waits for them all. */
+
+  if (workers > 0)
+    {
+    pid_t wpids[256];
+
+    for (worker = 0; worker < workers; worker++)
+      if ((wpids[worker] = exim_fork(US"qrun-phase-one")) == 0)
+	break;
+      else if (wpids[worker] < 0)
+	log_write(0, LOG_MAIN|LOG_PANIC_DIE, "fork of first pass worker from "
+	  "queue runner %d failed", queue_run_pid);
+
+    if (worker >= workers)
+      {
+      DEBUG(D_queue_run) debug_printf("q2stage waiting for %d workers\n",
+	workers);
+      for (int k = 0; k < workers; k++)
+	while (waitpid(wpids[k], NULL, 0) < 0 && errno == EINTR) ;
+      worker = -1;
+      fqlist = NULL;
+      }
+    }
+
+  for (queue_filename * fq = fqlist; fq; fq = fq->next)
     {
     pid_t pid;
     int status;
@@ -461,6 +1477,12 @@ for (int i = queue_run_in_order ? -1 : 0;
     struct stat statbuf;
     uschar buffer[256];
 
+    if (worker >= 0 && listed++ % workers != worker)
+      continue;
+
+    if (parallel > 1 && (by_class || by_lane))
+      fq = qrun_promote(fq, by_class, by_lane);
+
     /* Unless deliveries are forced, if deliver_queue_load_max is non-negative,
     check that the load average is low enough to permit deliveries. */
 
@@ -482,7 +1504,7 @@ for (int i = queue_run_in_order ? -1 : 0;
     /* If initial of a 2-phase run, maintain a set of child procs
     to get disk parallelism */
 
-    if (f.queue_2stage && !queue_run_in_order)
+    if (f.queue_2stage && !queue_run_in_order && worker < 0)
       {
       int i;
       if (qpid[f.running_in_test_harness ? 0 : nelem(qpid) - 1])
@@ -511,7 +1533,13 @@ for (int i = queue_run_in_order ? -1 : 0;
 
     message_subdir[0] = fq->dir_uschar;
     if (Ustat(spool_fname(US"input", message_subdir, fq->text, US""), &statbuf) < 0)
+      {
+      /* If the list came from an index that was out of date, tell the daemon */
+
+      if (qindex_valid && errno == ENOENT)
+	queue_index_notify(NOTIFY_QUEUE_DEL, fq->text, fq->dir_uschar, queue_name);
       goto go_around;
+      }
 
     /* There are some tests that require the reading of the header file. Ensure
     the store used is scavenged afterwards so that this process doesn't keep
@@ -585,7 +1613,7 @@ for (int i = queue_run_in_order ? -1 : 0;
 		     Ustrlen(address), 0, PCRE_EOPT, NULL, 0) >= 0)
                 : (strstric(address, deliver_selectstring, FALSE) != NULL)
 		)
-             && tree_search(tree_nonrecipients, address) == NULL
+             && tree_hash_search(&tree_nonrecipients, address) == NULL
 	     )
             break;
           }
@@ -613,7 +1641,11 @@ for (int i = queue_run_in_order ? -1 : 0;
     pipe gets passed down; by reading on it here we detect when the last
     descendent dies by the unblocking of the read. It's a pity that for
     most of the time the pipe isn't used, but creating a pipe should be
-    pretty cheap. */
+    pretty cheap. With parallel deliveries, first wait for a free slot. */
+
+    if (parallel > 1)
+      qrun_slots_wait(parallel - 1, by_class ? fq->pclass : -1,
+	by_lane ? fq->lane : -1, &force_delivery);
 
     if (pipe(pfd) < 0)
       log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to create pipe in queue "
@@ -661,6 +1693,17 @@ single_item_retry:
       log_write(0, LOG_MAIN|LOG_PANIC_DIE, "fork of delivery process from "
         "queue runner %d failed\n", queue_run_pid);
 
+    /* With parallel deliveries, go on to the next message at once; the slot
+    is freed when the pipe is closed. */
+
+    if (parallel > 1)
+      {
+      (void)close(pfd[pipe_write]);
+      qrun_slot_add(pid, pfd[pipe_read], by_class ? fq->pclass : -1,
+	by_lane ? fq->lane : -1, fq->text);
+      continue;
+      }
+
     /* Close the writing end of the synchronizing pipe in this process,
     then wait for the first level process to terminate. */
 
@@ -723,11 +1766,14 @@ single_item_retry:
 
   go_around:
     /* If initial of a 2-phase run, we are a child - so just exit */
-    if (f.queue_2stage && !queue_run_in_order)
+    if (f.queue_2stage && !queue_run_in_order && worker < 0)
       exim_exit(EXIT_SUCCESS);
     }                                  /* End loop for list of messages */
 
-  tree_nonrecipients = NULL;
+  if (worker >= 0)
+    exim_exit(EXIT_SUCCESS);
+
+  tree_nonrecipients = (tree_hash) { .slots = NULL };
   store_reset(reset_point1);           /* Scavenge list of messages */
 
   /* If this was the first time through for random order processing, and
@@ -747,6 +1793,10 @@ single_item_retry:
       }
   }                                    /* End loop for multiple directories */
 
+/* Wait for any parallel deliveries that are still going on */
+
+if (parallel > 1) qrun_slots_wait(0, -1, -1, &force_delivery);
+
 /* If queue_2stage is true, we do it all again, with the 2stage flag
 turned off. */
 
@@ -782,66 +1832,527 @@ if (!recurse)
 
 
 
-/************************************************
-*         Count messages on the queue           *
-************************************************/
+/************************************************
+*         Count messages on the queue           *
+************************************************/
+
+/* Called as a result of -bpc
+
+Arguments:  none
+Returns:    count
+*/
+
+unsigned
+queue_count(void)
+{
+int subcount;
+unsigned count = 0;
+uschar subdirs[64];
+
+if (qindex_valid) return qindex_entries;
+(void) queue_get_spool_list(-1,		/* entire queue */
+			subdirs,        /* for holding sub list */
+			&subcount,      /* for subcount */
+			FALSE,		/* not random */
+			&count);	/* just get the count */
+return count;
+}
+
+
+#define QUEUE_SIZE_AGE 60	/* update rate for queue_size */
+
+unsigned
+queue_count_cached(void)
+{
+time_t now;
+if ((now = time(NULL)) >= queue_size_next)
+  {
+  queue_size = queue_count();
+  queue_size_next = now + (f.running_in_test_harness ? 3 : QUEUE_SIZE_AGE);
+  }
+return queue_size;
+}
+
+
+
+/************************************************
+*        Build or rebuild the queue index       *
+************************************************/
+
+/* Called in the daemon when it starts, if queue_index is set, and before it
+starts each queue run. A rebuild is done only when forced, or when the index
+is older than queue_index_rescan; this catches any changes to the spool that
+were not notified, for example the removal of files by hand.
+
+Argument:  TRUE to build unconditionally
+Returns:   nothing
+*/
+
+void
+queue_index_build(BOOL force)
+{
+time_t now = time(NULL);
+int subcount;
+uschar subdirs[64];
+rmark reset_point;
+
+if (!force)
+  if (!qindex_valid || queue_index_rescan <= 0
+     || now - qindex_built < queue_index_rescan)
+    return;
+
+qindex_valid = FALSE;		/* so that the spool is read */
+qindex_clear();
+
+reset_point = store_mark();
+for (queue_filename * qf = queue_get_spool_list(-1, subdirs, &subcount, TRUE,
+							      NULL);
+     qf; qf = qf->next)
+  qindex_add(qf->text, qf->dir_uschar);
+store_reset(reset_point);
+
+qindex_valid = TRUE;
+qindex_built = now;
+DEBUG(D_queue_run) debug_printf("queue index built: %u message%s\n",
+  qindex_entries, qindex_entries == 1 ? "" : "s");
+}
+
+
+
+/************************************************
+*     Handle a queue index notification         *
+************************************************/
+
+/* Called in the daemon for a NOTIFY_QUEUE_ADD or NOTIFY_QUEUE_DEL message.
+The layout is the type byte, the message id, the subdirectory character (zero
+for none), and the NUL-terminated queue name. Items for other queues are
+ignored.
+
+Arguments:
+  buf        the message, NUL-terminated
+  len        its length
+
+Returns:     nothing
+*/
+
+void
+queue_index_update(const uschar * buf, int len)
+{
+const uschar * id = buf + 1;
+int dir_uschar = buf[MESSAGE_ID_LENGTH + 1];
+
+if (!qindex_valid || len < MESSAGE_ID_LENGTH + 3) return;
+if (Ustrcmp(buf + MESSAGE_ID_LENGTH + 2, queue_name) != 0) return;
+
+/* The id becomes part of file names used by queue runners; insist on sanity */
+
+for (int i = 0; i < MESSAGE_ID_LENGTH; i++)
+  if (!isalnum(id[i]) && id[i] != '-') return;
+if (dir_uschar && !isalnum(dir_uschar)) return;
+
+DEBUG(D_queue_run) debug_printf("queue index %s %.*s\n",
+  *buf == NOTIFY_QUEUE_ADD ? "add" : "del", MESSAGE_ID_LENGTH, id);
+
+if (*buf == NOTIFY_QUEUE_ADD)
+  qindex_add(id, dir_uschar);
+else
+  qindex_del(id);
+}
+
+
+
+/************************************************
+*          Queue count from the index           *
+************************************************/
+
+/* Argument:  the name of the queue
+Returns:   the count of messages, or -1 if there is no index for the queue */
+
+int
+queue_index_count(const uschar * qname)
+{
+return qindex_valid && Ustrcmp(qname, queue_name) == 0 ? qindex_entries : -1;
+}
+
+/************************************************
+*          List extra deliveries                *
+************************************************/
+
+/* This is called from queue_list below to print out all addresses that
+have received a message but which were not primary addresses. That is, all
+the addresses in the table of non-recipients that are not primary addresses.
+The table has been scanned and the data field filled in for those that are
+primary addresses. They are listed in order.
+
+Argument:    points to the table
+Returns:     nothing
+*/
+
+static void
+queue_list_extras(const tree_hash *t)
+{
+tree_node ** v = tree_hash_sorted(t);
+for (unsigned i = 0; i < t->count; i++)
+  if (!v[i]->data.val) printf("       +D %s\n", v[i]->name);
+}
+
+
+
+/*************************************************
+*              Queue summary file                *
+*************************************************/
+
+/* When queue_summary is set, a line is appended to the file "summary" in a
+queue's input directory whenever a message's header file is written, and
+another when the message leaves the queue. The listings made by -bp, -bpu and
+their unsorted variants take what they need from the latest line for each
+message, instead of reading its header, data and journal files. A line has
+tab-separated fields:
+
+  <id> M <received time> <size> <frozen> <sender> <untrusted login> <count>
+
+followed by a field for each of the <count> recipients: "D" (delivered) or "+"
+and the address. A message that has gone from the queue has a line "<id> X".
+A listing that finds a message with no line, or with an X line, reads its
+header file as usual and appends a line with S for M, which is used only until
+an M line follows it. Writers hold a shared lock on the file while appending;
+the listing that compacts it holds an exclusive one, and writers that then find
+themselves with the old file open it again. */
+
+#define QSUM_FIELDS 8			/* fields before the recipients */
+
+static uschar *
+queue_summary_name(const uschar * qname)
+{
+return spool_q_fname(US"input", qname, US"", US"summary", US"");
+}
+
+
+/* Open the summary file for a queue and take a lock on it, making sure that
+the name still refers to it once the lock is held.
+
+Arguments:
+  qname     the queue name
+  type      F_RDLCK to append a line, F_WRLCK to rewrite the file
+  psize     where to return the file size, or NULL
+
+Returns:    the fd, or -1
+*/
+
+static int
+queue_summary_lock(const uschar * qname, int type, off_t * psize)
+{
+uschar * fname = queue_summary_name(qname);
+
+for (int tries = 0; tries < 5; tries++)
+  {
+  struct flock lock_data = { .l_type = type, .l_whence = SEEK_SET };
+  struct stat fst, pst;
+  int fd;
+
+  if ((fd = Uopen(fname, O_RDWR|O_APPEND|O_CREAT, SPOOL_MODE)) < 0)
+    {
+    DEBUG(D_any) debug_printf("queue summary %s: %s\n", fname, strerror(errno));
+    return -1;
+    }
+  if (  fcntl(fd, F_SETLKW, &lock_data) == 0
+     && fstat(fd, &fst) == 0 && Ustat(fname, &pst) == 0
+     && fst.st_ino == pst.st_ino && fst.st_dev == pst.st_dev)
+    {
+    if (fst.st_uid != exim_uid && geteuid() == root_uid)
+      (void) exim_fchown(fd, exim_uid, exim_gid, fname);
+    if (psize) *psize = fst.st_size;
+    return fd;
+    }
+  (void) close(fd);
+  }
+return -1;
+}
+
+
+/* Append a line to a queue's summary file, in a single write. Returns FALSE
+if the file could not be opened. */
+
+static BOOL
+queue_summary_append(const uschar * qname, const gstring * g)
+{
+int fd = queue_summary_lock(qname, F_RDLCK, NULL);
+
+if (fd < 0) return FALSE;
+if (write(fd, g->s, g->ptr) != g->ptr)
+  DEBUG(D_any) debug_printf("queue summary write: %s\n", strerror(errno));
+(void) close(fd);
+return TRUE;
+}
+
+
+/* Build an M or S line for the message whose envelope is in the globals. An
+address containing a tab or a newline cannot go in the file; an X line is
+built so that listings read the header file.
+
+Arguments:
+  id        the message id
+  kind      'M' or 'S'
+  size      the size to list
+
+Returns:    the line
+*/
+
+static gstring *
+queue_summary_line(const uschar * id, int kind, int size)
+{
+gstring * g;
+BOOL ok = !Ustrpbrk(sender_address, "\t\n")
+  && !(f.sender_set_untrusted && Ustrpbrk(originator_login, "\t\n"));
+
+for (int i = 0; ok && i < recipients_count; i++)
+  ok = !Ustrpbrk(recipients_list[i].address, "\t\n");
+if (!ok)
+  return string_fmt_append(NULL, "%.*s\tX\n", MESSAGE_ID_LENGTH, id);
+
+g = string_fmt_append(NULL, "%.*s\t%c\t%ld\t%d\t%d\t%s\t%s\t%d",
+  MESSAGE_ID_LENGTH, id, kind, (long)received_time.tv_sec, size,
+  f.deliver_freeze ? 1 : 0, sender_address,
+  f.sender_set_untrusted ? originator_login : US"", recipients_count);
+for (int i = 0; i < recipients_count; i++)
+  {
+  const uschar * a = recipients_list[i].address;
+  g = string_fmt_append(g, "\t%c%s",
+    tree_hash_search(&tree_nonrecipients, a) ? 'D' : '+', a);
+  }
+return string_catn(g, US"\n", 1);
+}
+
+
+/* Called after a message's header file has been written. The size is that
+which -bp would list: the transmitted headers, the data and the blank line.
+
+Argument:  the message id
+Returns:   nothing
+*/
+
+void
+queue_summary_write(const uschar * id)
+{
+rmark reset_point;
+struct stat statbuf;
+int size = 0;
+
+if (!queue_summary) return;
+reset_point = store_mark();
+for (header_line * h = header_list; h; h = h->next)
+  if (h->type != htype_old) size += h->slen;
+if (Ustat(spool_fname(US"input", message_subdir, id, US"-D"), &statbuf) == 0)
+  size += spool_data_size(&statbuf) + 1;
+else
+  size = 0;
+(void) queue_summary_append(queue_name, queue_summary_line(id, 'M', size));
+store_reset(reset_point);
+}
+
+
+/* Called when a message leaves a queue */
+
+static void
+queue_summary_remove(const uschar * id, const uschar * qname)
+{
+rmark reset_point = store_mark();
+(void) queue_summary_append(qname,
+  string_fmt_append(NULL, "%.*s\tX\n", MESSAGE_ID_LENGTH, id));
+store_reset(reset_point);
+}
+
+
+/* A table, by message id, of the latest lines of a summary file */
+
+typedef struct {
+  uschar * line;			/* latest line, or NULL for an empty slot */
+  BOOL     live;			/* message found on the queue */
+} qsum_slot;
+
+typedef struct {
+  qsum_slot * slots;
+  unsigned    size;			/* a power of two */
+  int         lines;			/* lines in the file */
+} qsum_table;
+
+
+static qsum_slot *
+qsum_find(const qsum_table * t, const uschar * id)
+{
+for (unsigned h = qindex_hash(id) & (t->size - 1); ; h = (h + 1) & (t->size - 1))
+  if (  !t->slots[h].line
+     || Ustrncmp(t->slots[h].line, id, MESSAGE_ID_LENGTH) == 0)
+    return t->slots + h;
+}
+
+
+/* Read a summary file and index its lines. The file is read in one go; lines
+are NUL-terminated in place, and a partial last line is ignored.
+
+Arguments:
+  fd        the open file
+  size      its size
+  t         the table to set up
+
+Returns:    TRUE if the table is set up
+*/
+
+static BOOL
+queue_summary_load(int fd, off_t size, qsum_table * t)
+{
+uschar * buf, * end;
+
+if (size < 0 || size >= INT_MAX) return FALSE;
+buf = store_get((int)size + 1, FALSE);
+if (size > 0 && pread(fd, buf, (size_t)size, 0) != size) return FALSE;
+buf[size] = 0;
+
+t->lines = 0;
+for (uschar * p = buf; (p = Ustrchr(p, '\n')); p++) t->lines++;
+for (t->size = 1024; t->size < 2 * (unsigned)t->lines; ) t->size *= 2;
+t->slots = store_get(t->size * sizeof(qsum_slot), FALSE);
+memset(t->slots, 0, t->size * sizeof(qsum_slot));
+
+for (uschar * p = buf; (end = Ustrchr(p, '\n')); p = end + 1)
+  {
+  qsum_slot * q;
+
+  *end = 0;
+  if (end - p < MESSAGE_ID_LENGTH + 2 || p[MESSAGE_ID_LENGTH] != '\t') continue;
+  q = qsum_find(t, p);
+  if (  p[MESSAGE_ID_LENGTH + 1] != 'S'
+     || !q->line || q->line[MESSAGE_ID_LENGTH + 1] == 'S')
+    q->line = p;
+  }
+return TRUE;
+}
+
 
-/* Called as a result of -bpc
+/* List one message from its summary line, as queue_list() would from the
+spool files. The line is split up in place.
 
-Arguments:  none
-Returns:    count
+Arguments:
+  line      the summary line
+  option    0 to list all top-level recipients, 1 for undelivered ones only
+  now       the time
+
+Returns:    FALSE if the line is not in the expected form
 */
 
-unsigned
-queue_count(void)
+static BOOL
+queue_summary_print(uschar * line, int option, int now)
 {
-int subcount;
-unsigned count = 0;
-uschar subdirs[64];
+uschar * field[QSUM_FIELDS + 1];
+int nfields = 0, count, i;
 
-(void) queue_get_spool_list(-1,		/* entire queue */
-			subdirs,        /* for holding sub list */
-			&subcount,      /* for subcount */
-			FALSE,		/* not random */
-			&count);	/* just get the count */
-return count;
-}
+for (uschar * p = line; nfields <= QSUM_FIELDS; )
+  {
+  field[nfields++] = p;
+  if (nfields > QSUM_FIELDS || !(p = Ustrchr(p, '\t'))) break;
+  *p++ = 0;
+  }
+if (nfields < QSUM_FIELDS) return FALSE;
+if ((count = Uatoi(field[7])) > 0 && nfields <= QSUM_FIELDS) return FALSE;
 
+i = (now - Uatoi(field[2]))/60;			/* minutes on queue */
+if (i > 90)
+  {
+  i = (i + 30)/60;
+  if (i > 72) printf("%2dd ", (i + 12)/24); else printf("%2dh ", i);
+  }
+else printf("%2dm ", i);
 
-#define QUEUE_SIZE_AGE 60	/* update rate for queue_size */
+printf("%s %.16s <%s>", string_format_size(Uatoi(field[3]), big_buffer),
+  field[0], field[5]);
+if (*field[6]) printf(" (%s)", field[6]);
+if (*field[4] == '1') printf(" *** frozen ***");
+printf("\n");
 
-unsigned
-queue_count_cached(void)
-{
-time_t now;
-if ((now = time(NULL)) >= queue_size_next)
+if (count > 0)
   {
-  queue_size = queue_count();
-  queue_size_next = now + (f.running_in_test_harness ? 3 : QUEUE_SIZE_AGE);
+  uschar * r = field[QSUM_FIELDS];
+  for (i = 0; i < count && r; i++)
+    {
+    uschar * next = Ustrchr(r, '\t');
+    if (next) *next++ = 0;
+    if (*r != 'D' || option != 1)
+      printf("        %s %s\n", *r == 'D' ? "D" : " ", r + 1);
+    r = next;
+    }
+  printf("\n");
   }
-return queue_size;
+return TRUE;
 }
 
-/************************************************
-*          List extra deliveries                *
-************************************************/
 
-/* This is called from queue_list below to print out all addresses that
-have received a message but which were not primary addresses. That is, all
-the addresses in the tree of non-recipients that are not primary addresses.
-The tree has been scanned and the data field filled in for those that are
-primary addresses.
+/* Rewrite a summary file with only the latest line for each message that is
+still on the queue. The file is read again under the exclusive lock, so nothing
+appended since the listing is lost; a message that the listing did not see is
+kept if its header file exists.
 
-Argument:    points to the tree node
-Returns:     nothing
+Arguments:
+  qname     the queue name
+  listed    the table made by the listing
+
+Returns:    nothing
 */
 
 static void
-queue_list_extras(tree_node *p)
+queue_summary_compact(const uschar * qname, const qsum_table * listed)
 {
-if (p->left) queue_list_extras(p->left);
-if (!p->data.val) printf("       +D %s\n", p->name);
-if (p->right) queue_list_extras(p->right);
+uschar * fname = queue_summary_name(qname);
+uschar * tname = string_sprintf("%s.new", fname);
+qsum_table t;
+gstring * g = NULL;
+off_t size;
+int fd, tfd, kept = 0;
+
+if ((fd = queue_summary_lock(qname, F_WRLCK, &size)) < 0) return;
+if (!queue_summary_load(fd, size, &t)) goto END;
+
+for (unsigned h = 0; h < t.size; h++)
+  {
+  uschar * line = t.slots[h].line;
+  BOOL keep;
+
+  if (!line || line[MESSAGE_ID_LENGTH + 1] == 'X') continue;
+  if (!(keep = qsum_find(listed, line)->live))
+    {
+    struct stat statbuf;
+    uschar id[MESSAGE_ID_LENGTH + 1], subdir[2];
+
+    Ustrncpy(id, line, MESSAGE_ID_LENGTH);
+    id[MESSAGE_ID_LENGTH] = 0;
+    for (int i = 0; i < 2 && !keep; i++)
+      {
+      set_subdir_str(subdir, id, i);
+      keep = Ustat(spool_q_fname(US"input", qname, subdir, id, US"-H"),
+		  &statbuf) == 0;
+      }
+    }
+  if (keep)
+    {
+    g = string_fmt_append(g, "%s\n", line);
+    kept++;
+    }
+  }
+
+if ((tfd = Uopen(tname, O_WRONLY|O_CREAT|O_TRUNC, SPOOL_MODE)) >= 0)
+  {
+  if (geteuid() == root_uid) (void) exim_fchown(tfd, exim_uid, exim_gid, tname);
+  if (  (!g || write(tfd, g->s, g->ptr) == g->ptr)
+     && close(tfd) == 0 && Urename(tname, fname) == 0)
+    {
+    DEBUG(D_any) debug_printf("queue summary %s: %d lines compacted to %d\n",
+      fname, t.lines, kept);
+    }
+  else
+    Uunlink(tname);
+  }
+
+END:
+(void) close(fd);
 }
 
 
@@ -877,6 +2388,9 @@ int now = (int)time(NULL);
 rmark reset_point;
 queue_filename * qf = NULL;
 uschar subdirs[64];
+qsum_table qsum;
+BOOL use_summary = FALSE, heal = TRUE;
+int listed = 0;
 
 /* If given a list of messages, build a chain containing their ids. */
 
@@ -907,6 +2421,27 @@ else
 
 if (option >= 8) option -= 8;
 
+/* With queue_summary set, the whole-queue listings that show only top-level
+recipients take each message from the summary file if they can. A missing file
+gives an empty table, so that lines are added for the messages read. */
+
+if (count <= 0 && queue_summary && option != 2)
+  {
+  struct stat statbuf;
+  int fd = Uopen(queue_summary_name(queue_name), O_RDONLY, 0);
+
+  if (fd < 0)
+    use_summary = queue_summary_load(-1, 0, &qsum);
+  else
+    {
+    use_summary = fstat(fd, &statbuf) == 0
+      && queue_summary_load(fd, statbuf.st_size, &qsum);
+    (void) close(fd);
+    }
+  DEBUG(D_any) if (use_summary)
+    debug_printf("queue summary: %d lines\n", qsum.lines);
+  }
+
 /* Now scan the chain and print information, resetting store used
 each time. */
 
@@ -919,6 +2454,17 @@ for (;
   int size = 0;
   BOOL env_read;
 
+  if (use_summary)
+    {
+    qsum_slot * q = qsum_find(&qsum, qf->text);
+    if (q->line && q->line[MESSAGE_ID_LENGTH + 1] != 'X')
+      {
+      q->live = TRUE;
+      listed++;
+      if (queue_summary_print(q->line, option, now)) continue;
+      }
+    }
+
   message_size = 0;
   message_subdir[0] = qf->dir_uschar;
   rc = spool_read_header(qf->text, FALSE, count <= 0);
@@ -943,7 +2489,7 @@ for (;
     that precedes the data. */
 
     if (Ustat(fname, &statbuf) == 0)
-      size = message_size + statbuf.st_size - SPOOL_DATA_START_OFFSET + 1;
+      size = message_size + spool_data_size(&statbuf) + 1;
     i = (now - received_time.tv_sec)/60;  /* minutes on queue */
     if (i > 90)
       {
@@ -1001,22 +2547,192 @@ for (;
 
   printf("\n");
 
+  if (use_summary && heal && rc == spool_read_OK)
+    heal = queue_summary_append(queue_name,
+      queue_summary_line(qf->text, 'S', size));
+
   if (recipients_list)
     {
     for (int i = 0; i < recipients_count; i++)
       {
       tree_node *delivered =
-        tree_search(tree_nonrecipients, recipients_list[i].address);
+        tree_hash_search(&tree_nonrecipients, recipients_list[i].address);
       if (!delivered || option != 1)
         printf("        %s %s\n",
 	  delivered ? "D" : " ", recipients_list[i].address);
       if (delivered) delivered->data.val = TRUE;
       }
-    if (option == 2 && tree_nonrecipients)
-      queue_list_extras(tree_nonrecipients);
+    if (option == 2 && tree_nonrecipients.count)
+      queue_list_extras(&tree_nonrecipients);
     printf("\n");
     }
   }
+
+/* If most of the summary file is out of date, rewrite it */
+
+if (use_summary && heal && qsum.lines > 2 * listed + 1000)
+  queue_summary_compact(queue_name, &qsum);
+}
+
+
+
+
+/*************************************************
+*      Select messages for a bulk action         *
+*************************************************/
+
+/* This is called for the -Msel option, which lets one of the -M actions that
+take a list of message ids work on every message that matches a set of
+conditions instead. The queue is scanned once and each header file is read
+without locking, as for a listing; the action itself locks and reads the
+message again, so one that changes state in between is handled correctly.
+
+The selector is a list of conditions, all of which must be true:
+
+  sender=<regex>      the sender address matches
+  recipient=<regex>   an undelivered recipient matches
+  domain=<domain>     an undelivered recipient is in this domain
+  older=<time>        the message has been on the queue at least this long
+  younger=<time>      the message has been on the queue for less than this
+  larger=<size>       the message is at least this big (as shown by -bp)
+  smaller=<size>      the message is smaller than this
+  frozen / unfrozen   the message is, or is not, frozen
+
+Arguments:
+  selector   the list of conditions
+  count      where to return the number of messages selected
+  errmsg     where to put an error message
+
+Returns:     a vector of message ids, or NULL if the selector is bad
+*/
+
+uschar **
+queue_select(const uschar * selector, int * count, uschar ** errmsg)
+{
+const pcre * sender_re = NULL, * rcpt_re = NULL;
+const uschar * domain = NULL;
+int older = -1, younger = -1, frozen = -1;
+int_eximarith_t larger = -1, smaller = -1;
+int sep = 0, subcount, n = 0, now = (int)time(NULL);
+const uschar * list = selector;
+uschar * item, * value = NULL, subdirs[64], ** ids;
+queue_filename * qf;
+
+while ((item = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  if ((value = Ustrchr(item, '='))) *value++ = 0;
+  if (Ustrcmp(item, "frozen") == 0 && !value) frozen = 1;
+  else if (Ustrcmp(item, "unfrozen") == 0 && !value) frozen = 0;
+  else if (!value || !*value) goto BAD;
+  else if (Ustrcmp(item, "sender") == 0)
+    {
+    if (sender_re) store_free(US sender_re);
+    sender_re = regex_must_compile(value, TRUE, TRUE);
+    }
+  else if (Ustrcmp(item, "recipient") == 0)
+    {
+    if (rcpt_re) store_free(US rcpt_re);
+    rcpt_re = regex_must_compile(value, TRUE, TRUE);
+    }
+  else if (Ustrcmp(item, "domain") == 0)
+    domain = value;
+  else if (Ustrcmp(item, "older") == 0 || Ustrcmp(item, "younger") == 0)
+    {
+    int t = readconf_readtime(value, 0, FALSE);
+    if (t < 0) goto BAD;
+    if (*item == 'o') older = t; else younger = t;
+    }
+  else if (Ustrcmp(item, "larger") == 0 || Ustrcmp(item, "smaller") == 0)
+    {
+    uschar * end;
+    int_eximarith_t v = Ustrtol(value, &end, 10);
+
+    switch (toupper(*end))
+      {
+      case 'G': v *= 1024;		/*FALLTHROUGH*/
+      case 'M': v *= 1024;		/*FALLTHROUGH*/
+      case 'K': v *= 1024; end++;
+      }
+    if (*end || end == value || v < 0) goto BAD;
+    if (*item == 'l') larger = v; else smaller = v;
+    }
+  else goto BAD;
+  }
+
+qf = queue_get_spool_list(-1, subdirs, &subcount, FALSE, NULL);
+for (queue_filename * q = qf; q; q = q->next) n++;
+ids = store_get((n + 1) * sizeof(uschar *), FALSE);
+n = 0;
+
+for (rmark reset_point;
+    qf && (reset_point = store_mark());
+    spool_clear_header_globals(), store_reset(reset_point), qf = qf->next
+    )
+  {
+  int age, i;
+  BOOL ok;
+
+  message_size = 0;
+  message_subdir[0] = qf->dir_uschar;
+  if (spool_read_header(qf->text, FALSE, TRUE) != spool_read_OK) continue;
+
+  age = now - received_time.tv_sec;
+  ok = (frozen < 0 || f.deliver_freeze == frozen)
+    && (older < 0 || age >= older)
+    && (younger < 0 || age < younger)
+    && (!sender_re || pcre_exec(sender_re, NULL, CS sender_address,
+		      Ustrlen(sender_address), 0, PCRE_EOPT, NULL, 0) >= 0);
+
+  if (ok && (larger >= 0 || smaller >= 0))
+    {
+    struct stat statbuf;
+    int_eximarith_t size = message_size;
+    uschar * fname = spool_fname(US"input", message_subdir, qf->text, US"");
+
+    fname[Ustrlen(fname) - 1] = 'D';
+    if (Ustat(fname, &statbuf) == 0)
+      size += spool_data_size(&statbuf) + 1;
+    ok = (larger < 0 || size >= larger) && (smaller < 0 || size < smaller);
+    }
+
+  if (ok && (rcpt_re || domain))
+    {
+    for (ok = FALSE, i = 0; !ok && i < recipients_count; i++)
+      {
+      uschar * addr = recipients_list[i].address, * at;
+
+      if (tree_hash_search(&tree_nonrecipients, addr)) continue;
+      ok = (!domain || (at = Ustrrchr(addr, '@')) && strcmpic(at+1, domain) == 0)
+	&& (!rcpt_re || pcre_exec(rcpt_re, NULL, CS addr, Ustrlen(addr), 0,
+		    PCRE_EOPT, NULL, 0) >= 0);
+      }
+    }
+
+  if (ok)
+    {
+    qf->text[MESSAGE_ID_LENGTH] = 0;
+    ids[n++] = qf->text;
+    }
+  }
+
+DEBUG(D_any) debug_printf("%d message%s selected by \"%s\"\n", n,
+  n == 1 ? "" : "s", selector);
+ids[n] = NULL;
+*count = n;
+
+/* The expressions are compiled into malloc store, so that they are not
+affected by the store resets for each message, and are ours to free. */
+
+TIDY:
+if (sender_re) store_free(US sender_re);
+if (rcpt_re) store_free(US rcpt_re);
+return ids;
+
+BAD:
+*errmsg = string_sprintf("bad condition \"%s%s%s\" in message selector",
+  item, value ? "=" : "", value ? value : US"");
+ids = NULL;
+goto TIDY;
 }
 
 
@@ -1108,6 +2824,21 @@ if (action >= MSG_SHOW_BODY)
     return FALSE;
     }
 
+  if (action == MSG_SHOW_BODY)
+    {
+    int pfd = spool_datafile_plain(fd, message_subdir, id);
+
+    if (pfd != fd)
+      {
+      (void)close(fd);
+      if ((fd = pfd) < 0)
+	{
+	printf("Failed to decompress data file for %s\n", id);
+	return FALSE;
+	}
+      }
+    }
+
   while((rc = read(fd, big_buffer, big_buffer_size)) > 0)
     rc = write(fileno(stdout), big_buffer, rc);
 
@@ -1152,8 +2883,7 @@ if (spool_read_header(spoolname, TRUE, FALSE) != spool_read_OK)
     printf("Spool format error for %s\n", spoolname);
   if (action != MSG_REMOVE || !f.admin_user)
     {
-    (void)close(deliver_datafile);
-    deliver_datafile = -1;
+    spool_close_datafile();
     return FALSE;
     }
   printf("Continuing to ensure all files removed\n");
@@ -1167,8 +2897,7 @@ why we leave this check until after the headers are read. */
 if (!f.admin_user && (action != MSG_REMOVE || real_uid != originator_uid))
   {
   printf("Permission denied\n");
-  (void)close(deliver_datafile);
-  deliver_datafile = -1;
+  spool_close_datafile();
   return FALSE;
   }
 
@@ -1187,8 +2916,7 @@ switch(action)
   case MSG_SHOW_COPY:
     {
     transport_ctx tctx = {{0}};
-    deliver_in_buffer = store_malloc(DELIVER_IN_BUFFER_SIZE);
-    deliver_out_buffer = store_malloc(DELIVER_OUT_BUFFER_SIZE);
+    deliver_buffers_init();
     tctx.u.fd = 1;
     (void) transport_write_message(&tctx, 0);
     break;
@@ -1310,11 +3038,12 @@ switch(action)
       else printf("has been removed or did not exist\n");
     if (removed)
       {
+      queue_index_notify(NOTIFY_QUEUE_DEL, id, id[5], queue_name);
 #ifndef DISABLE_EVENT
       if (event_action) for (int i = 0; i < recipients_count; i++)
 	{
 	tree_node *delivered =
-	  tree_search(tree_nonrecipients, recipients_list[i].address);
+	  tree_hash_search(&tree_nonrecipients, recipients_list[i].address);
 	if (!delivered)
 	  {
 	  uschar * save_local = deliver_localpart;
@@ -1478,11 +3207,7 @@ switch(action)
 /* Closing the datafile releases the lock and permits other processes
 to operate on the message (if it still exists). */
 
-if (deliver_datafile >= 0)
-  {
-  (void)close(deliver_datafile);
-  deliver_datafile = -1;
-  }
+spool_close_datafile();
 return yield;
 }
 
@@ -1531,41 +3256,244 @@ if (s)
 /******************************************************************************/
 /******************************************************************************/
 
+/* Build the address of the daemon notifier socket.
+
+Argument:  pointer to the socket address to fill in
+Returns:   the length of the address
+*/
+
+static int
+notifier_socket_addr(struct sockaddr_un * sa_un)
+{
+#ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+sa_un->sun_path[0] = 0;	/* Abstract local socket addr - Linux-specific? */
+return offsetof(struct sockaddr_un, sun_path) + 1
+  + snprintf(sa_un->sun_path+1, sizeof(sa_un->sun_path)-1, "%s",
+	      expand_string(notifier_socket));
+#else
+return offsetof(struct sockaddr_un, sun_path)
+  + snprintf(sa_un->sun_path, sizeof(sa_un->sun_path), "%s",
+	      expand_string(notifier_socket));
+#endif
+}
+
+
+/* Send a message to the daemon, not expecting a response.
+
+Arguments:
+  buf       the message
+  len       its length
+
+Returns:    nothing
+*/
+
+void
+notifier_send(const uschar * buf, int len)
+{
+int fd;
+
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
+  {
+  struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+  int alen = notifier_socket_addr(&sa_un);
+
+  if (sendto(fd, buf, len, 0, (struct sockaddr *)&sa_un, alen) < 0)
+    DEBUG(D_queue_run)
+      debug_printf("%s: sendto %s\n", __FUNCTION__, strerror(errno));
+  close(fd);
+  }
+else DEBUG(D_queue_run) debug_printf(" socket: %s\n", strerror(errno));
+}
+
+
 #ifndef DISABLE_QUEUE_RAMP
 void
 queue_notify_daemon(const uschar * msgid)
 {
 uschar buf[MESSAGE_ID_LENGTH + 2];
-int fd;
 
 DEBUG(D_queue_run) debug_printf("%s: %s\n", __FUNCTION__, msgid);
 
 buf[0] = NOTIFY_MSG_QRUN;
 memcpy(buf+1, msgid, MESSAGE_ID_LENGTH+1);
+notifier_send(buf, sizeof(buf));
+}
+#endif
 
-if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
+
+/* Tell the daemon that a message has been added to, or removed from, a queue,
+for the maintenance of its queue index. Nothing is done unless queue_index is
+set. A removal is also recorded in the queue's summary file, if queue_summary
+is set.
+
+Arguments:
+  type        NOTIFY_QUEUE_ADD or NOTIFY_QUEUE_DEL
+  id          the message id
+  dir_uschar  the spool subdirectory character, or 0
+  qname       the name of the queue
+
+Returns:      nothing
+*/
+
+void
+queue_index_notify(int type, const uschar * id, int dir_uschar,
+  const uschar * qname)
+{
+uschar buf[256];
+int len = Ustrlen(qname);
+
+if (queue_summary && type == NOTIFY_QUEUE_DEL) queue_summary_remove(id, qname);
+
+if (!queue_index || !notifier_socket || !*notifier_socket) return;
+if (len >= sizeof(buf) - MESSAGE_ID_LENGTH - 2) return;
+
+buf[0] = type;
+memcpy(buf+1, id, MESSAGE_ID_LENGTH);
+buf[MESSAGE_ID_LENGTH + 1] = dir_uschar;
+memcpy(buf + MESSAGE_ID_LENGTH + 2, qname, len + 1);
+notifier_send(buf, MESSAGE_ID_LENGTH + 3 + len);
+}
+
+
+/* Tell the daemon the peak store use of this process, for its summary.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+void
+queue_store_stats_notify(void)
+{
+uschar type = NOTIFY_STORE_STATS;
+gstring * g;
+
+if (!notifier_socket || !*notifier_socket) return;
+g = store_stats_peaks(string_catn(NULL, &type, 1));
+notifier_send(g->s, g->ptr);
+}
+
+
+/* Tell the daemon that a delivery process has started or finished, for its
+count of delivery subprocesses. Only the process that sent the start sends
+the finish; a subprocess that it forks inherits the pid check and stays quiet.
+
+Argument:   TRUE at the start of a delivery, FALSE at process exit
+Returns:    nothing
+*/
+
+void
+queue_delivery_notify(BOOL start)
+{
+static pid_t notified_pid = 0;
+uschar buf[2] = { NOTIFY_DELIVERY, '+' };
+
+if (!notifier_socket || !*notifier_socket) return;
+if (start)
   {
-  struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+  if (notified_pid == getpid()) return;
+  notified_pid = getpid();
+  }
+else
+  {
+  if (notified_pid != getpid()) return;
+  notified_pid = 0;
+  buf[1] = '-';
+  }
+notifier_send(buf, sizeof(buf));
+}
+
+
+/* Make a request of the daemon, and wait for the response.
+
+Arguments:
+  req        the request
+  reqlen     its length
+  passfd     a file descriptor to pass with the request, or -1
+  resp       buffer for the response
+  resplen    size of the buffer
+  timeout    seconds to wait for the response
+
+Returns:     length of the response, or -1 on failure
+*/
+
+int
+queue_daemon_request(const uschar * req, int reqlen, int passfd,
+  uschar * resp, int resplen, int timeout)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+int fd;
+ssize_t len;
+const uschar * where;
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+uschar * sname;
+#endif
+fd_set fds;
+struct timeval tv;
+
+if (!notifier_socket || !*notifier_socket) return -1;
+if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+  {
+  DEBUG(D_any) debug_printf(" socket: %s\n", strerror(errno));
+  return -1;
+  }
 
 #ifdef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
-  int len = offsetof(struct sockaddr_un, sun_path) + 1
-    + snprintf(sa_un.sun_path+1, sizeof(sa_un.sun_path)-1, "%s",
-		expand_string(notifier_socket));
-  sa_un.sun_path[0] = 0;
+sa_un.sun_path[0] = 0;	/* Abstract local socket addr - Linux-specific? */
+len = offsetof(struct sockaddr_un, sun_path) + 1
+  + snprintf(sa_un.sun_path+1, sizeof(sa_un.sun_path)-1, "exim_%d", getpid());
 #else
-  int len = offsetof(struct sockaddr_un, sun_path)
-    + snprintf(sa_un.sun_path, sizeof(sa_un.sun_path), "%s",
-		expand_string(notifier_socket));
+sname = string_sprintf("%s/p_%d", spool_directory, getpid());
+len = offsetof(struct sockaddr_un, sun_path)
+  + snprintf(sa_un.sun_path, sizeof(sa_un.sun_path), "%s", sname);
 #endif
 
-  if (sendto(fd, buf, sizeof(buf), 0, (struct sockaddr *)&sa_un, len) < 0)
-    DEBUG(D_queue_run)
-      debug_printf("%s: sendto %s\n", __FUNCTION__, strerror(errno));
-  close(fd);
+if (bind(fd, (const struct sockaddr *)&sa_un, len) < 0)
+  { where = US"bind"; goto bad; }
+
+len = notifier_socket_addr(&sa_un);
+if (connect(fd, (const struct sockaddr *)&sa_un, len) < 0)
+  { where = US"connect"; goto bad2; }
+
+if (passfd >= 0)
+  {
+  union { struct cmsghdr align; uschar buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+  struct iovec iov = {.iov_base = US req, .iov_len = reqlen};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+		       .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf)};
+  struct cmsghdr * cp;
+
+  memset(&cbuf, 0, sizeof(cbuf));
+  cp = CMSG_FIRSTHDR(&msg);
+  cp->cmsg_level = SOL_SOCKET;
+  cp->cmsg_type = SCM_RIGHTS;
+  cp->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cp), &passfd, sizeof(int));
+  if (sendmsg(fd, &msg, 0) < 0) { where = US"sendmsg"; goto bad2; }
   }
-else DEBUG(D_queue_run) debug_printf(" socket: %s\n", strerror(errno));
-}
+else if (send(fd, req, reqlen, 0) < 0) { where = US"send"; goto bad2; }
+
+FD_ZERO(&fds); FD_SET(fd, &fds);
+tv.tv_sec = timeout; tv.tv_usec = 0;
+if (select(fd + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, &tv) != 1)
+  { where = US"select"; errno = ETIMEDOUT; goto bad2; }
+if ((len = recv(fd, resp, resplen, 0)) < 0)
+  { where = US"recv"; goto bad2; }
+
+close(fd);
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+Uunlink(sname);
 #endif
+return len;
+
+bad2:
+#ifndef EXIM_HAVE_ABSTRACT_UNIX_SOCKETS
+  Uunlink(sname);
+#endif
+bad:
+  DEBUG(D_any) debug_printf("%s: %s: %s\n", __FUNCTION__, where, strerror(errno));
+  close(fd);
+  return -1;
+}
 
 #endif /*!COMPILE_UTILITY*/
 
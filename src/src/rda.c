@@ -598,6 +598,23 @@ create the sub-process. */
 if (rdata->isfile && rda_exists(data, error) == FILE_NOT_EXIST)
   return FF_NONEXIST;
 
+/* A subprocess would run with exactly the privilege this process already has
+if it is not root and is running as the given user and group, because
+exim_setugid() then changes nothing. This is common when
+deliver_drop_privilege is set and the files belong to the Exim user. The fork,
+and passing the results back, can then be skipped. */
+
+if (  geteuid() != root_uid
+   && geteuid() == ugid->uid && getegid() == ugid->gid
+   )
+  {
+  DEBUG(D_route) debug_printf("already running as uid=%ld gid=%ld: "
+    "interpreting in this process\n", (long int)ugid->uid, (long int)ugid->gid);
+  return rda_extract(rdata, options, include_directory,
+    sieve_vacation_directory, sieve_enotify_mailto_owner, sieve_useraddress,
+    sieve_subaddress, generated, error, eblockp, filtertype);
+  }
+
 /* If the file does exist, or we can't tell (non-root mounted NFS directory)
 we have to create the subprocess to do everything as the given user. The
 results of processing are passed back via a pipe. */
@@ -711,6 +728,8 @@ if ((pid = exim_fork(US"router-interpret")) == 0)
       {
       int reply_options = 0;
       int ig_err = addr->prop.ignore_error ? 1 : 0;
+      reply_item * reply = ADDR_COLD(addr)->reply;
+      uschar ** expandn = ADDR_COLD(addr)->pipe_expandn;
 
       if (  rda_write_string(fd, addr->address) != 0
          || write(fd, &addr->mode, sizeof(addr->mode)) != sizeof(addr->mode)
@@ -720,14 +739,14 @@ if ((pid = exim_fork(US"router-interpret")) == 0)
 	 )
 	goto bad;
 
-      if (addr->pipe_expandn)
-        for (uschar ** pp = addr->pipe_expandn; *pp; pp++)
+      if (expandn)
+        for (uschar ** pp = expandn; *pp; pp++)
           if (rda_write_string(fd, *pp) != 0)
 	    goto bad;
       if (rda_write_string(fd, NULL) != 0)
         goto bad;
 
-      if (!addr->reply)
+      if (!reply)
 	{
         if (write(fd, &reply_options, sizeof(int)) != sizeof(int))    /* 0 means no reply */
 	  goto bad;
@@ -735,24 +754,24 @@ if ((pid = exim_fork(US"router-interpret")) == 0)
       else
         {
         reply_options |= REPLY_EXISTS;
-        if (addr->reply->file_expand) reply_options |= REPLY_EXPAND;
-        if (addr->reply->return_message) reply_options |= REPLY_RETURN;
+        if (reply->file_expand) reply_options |= REPLY_EXPAND;
+        if (reply->return_message) reply_options |= REPLY_RETURN;
         if (  write(fd, &reply_options, sizeof(int)) != sizeof(int)
-           || write(fd, &(addr->reply->expand_forbid), sizeof(int))
+           || write(fd, &(reply->expand_forbid), sizeof(int))
 	      != sizeof(int)
-           || write(fd, &(addr->reply->once_repeat), sizeof(time_t))
+           || write(fd, &(reply->once_repeat), sizeof(time_t))
 	      != sizeof(time_t)
-           || rda_write_string(fd, addr->reply->to) != 0
-           || rda_write_string(fd, addr->reply->cc) != 0
-           || rda_write_string(fd, addr->reply->bcc) != 0
-           || rda_write_string(fd, addr->reply->from) != 0
-           || rda_write_string(fd, addr->reply->reply_to) != 0
-           || rda_write_string(fd, addr->reply->subject) != 0
-           || rda_write_string(fd, addr->reply->headers) != 0
-           || rda_write_string(fd, addr->reply->text) != 0
-           || rda_write_string(fd, addr->reply->file) != 0
-           || rda_write_string(fd, addr->reply->logfile) != 0
-           || rda_write_string(fd, addr->reply->oncelog) != 0
+           || rda_write_string(fd, reply->to) != 0
+           || rda_write_string(fd, reply->cc) != 0
+           || rda_write_string(fd, reply->bcc) != 0
+           || rda_write_string(fd, reply->from) != 0
+           || rda_write_string(fd, reply->reply_to) != 0
+           || rda_write_string(fd, reply->subject) != 0
+           || rda_write_string(fd, reply->headers) != 0
+           || rda_write_string(fd, reply->text) != 0
+           || rda_write_string(fd, reply->file) != 0
+           || rda_write_string(fd, reply->logfile) != 0
+           || rda_write_string(fd, reply->oncelog) != 0
 	   )
 	  goto bad;
         }
@@ -902,9 +921,10 @@ if (yield == FF_DELIVERED || yield == FF_NOTDELIVERED ||
 
     if (i > 0)
       {
-      addr->pipe_expandn = store_get((i+1) * sizeof(uschar *), FALSE);
-      addr->pipe_expandn[i] = NULL;
-      while (--i >= 0) addr->pipe_expandn[i] = expandn[i];
+      uschar ** pp = addr_cold(addr)->pipe_expandn =
+	store_get((i+1) * sizeof(uschar *), FALSE);
+      pp[i] = NULL;
+      while (--i >= 0) pp[i] = expandn[i];
       }
 
     /* Then an int containing reply options; zero => no reply data. */
@@ -912,26 +932,27 @@ if (yield == FF_DELIVERED || yield == FF_NOTDELIVERED ||
     if (read(fd, &reply_options, sizeof(int)) != sizeof(int)) goto DISASTER;
     if ((reply_options & REPLY_EXISTS) != 0)
       {
-      addr->reply = store_get(sizeof(reply_item), FALSE);
+      reply_item * reply = addr_cold(addr)->reply =
+	store_get(sizeof(reply_item), FALSE);
 
-      addr->reply->file_expand = (reply_options & REPLY_EXPAND) != 0;
-      addr->reply->return_message = (reply_options & REPLY_RETURN) != 0;
+      reply->file_expand = (reply_options & REPLY_EXPAND) != 0;
+      reply->return_message = (reply_options & REPLY_RETURN) != 0;
 
-      if (read(fd,&(addr->reply->expand_forbid),sizeof(int)) !=
+      if (read(fd,&(reply->expand_forbid),sizeof(int)) !=
             sizeof(int) ||
-          read(fd,&(addr->reply->once_repeat),sizeof(time_t)) !=
+          read(fd,&(reply->once_repeat),sizeof(time_t)) !=
             sizeof(time_t) ||
-          !rda_read_string(fd, &addr->reply->to) ||
-          !rda_read_string(fd, &addr->reply->cc) ||
-          !rda_read_string(fd, &addr->reply->bcc) ||
-          !rda_read_string(fd, &addr->reply->from) ||
-          !rda_read_string(fd, &addr->reply->reply_to) ||
-          !rda_read_string(fd, &addr->reply->subject) ||
-          !rda_read_string(fd, &addr->reply->headers) ||
-          !rda_read_string(fd, &addr->reply->text) ||
-          !rda_read_string(fd, &addr->reply->file) ||
-          !rda_read_string(fd, &addr->reply->logfile) ||
-          !rda_read_string(fd, &addr->reply->oncelog))
+          !rda_read_string(fd, &reply->to) ||
+          !rda_read_string(fd, &reply->cc) ||
+          !rda_read_string(fd, &reply->bcc) ||
+          !rda_read_string(fd, &reply->from) ||
+          !rda_read_string(fd, &reply->reply_to) ||
+          !rda_read_string(fd, &reply->subject) ||
+          !rda_read_string(fd, &reply->headers) ||
+          !rda_read_string(fd, &reply->text) ||
+          !rda_read_string(fd, &reply->file) ||
+          !rda_read_string(fd, &reply->logfile) ||
+          !rda_read_string(fd, &reply->oncelog))
         goto DISASTER;
       }
     }
@@ -79,6 +79,7 @@ static optionlist optionlist_config[] = {
 #ifdef EXPERIMENTAL_BRIGHTMAIL
   { "bmi_config_file",          opt_stringptr,   {&bmi_config_file} },
 #endif
+  { "bounce_in_process",        opt_bool,        {&bounce_in_process} },
   { "bounce_message_file",      opt_stringptr,   {&bounce_message_file} },
   { "bounce_message_text",      opt_stringptr,   {&bounce_message_text} },
   { "bounce_return_body",       opt_bool,        {&bounce_return_body} },
@@ -86,8 +87,10 @@ static optionlist optionlist_config[] = {
   { "bounce_return_message",    opt_bool,        {&bounce_return_message} },
   { "bounce_return_size_limit", opt_mkint,       {&bounce_return_size_limit} },
   { "bounce_sender_authentication",opt_stringptr,{&bounce_sender_authentication} },
+  { "callout_cache_write_batch", opt_int,       {&callout_cache_write_batch} },
   { "callout_domain_negative_expire", opt_time,  {&callout_cache_domain_negative_expire} },
   { "callout_domain_positive_expire", opt_time,  {&callout_cache_domain_positive_expire} },
+  { "callout_keep_idle",        opt_time,        {&callout_keep_idle} },
   { "callout_negative_expire",  opt_time,        {&callout_cache_negative_expire} },
   { "callout_positive_expire",  opt_time,        {&callout_cache_positive_expire} },
   { "callout_random_local_part",opt_stringptr,   {&callout_random_local_part} },
@@ -98,6 +101,17 @@ static optionlist optionlist_config[] = {
   { "check_spool_space",        opt_Kint,        {&check_spool_space} },
   { "chunking_advertise_hosts", opt_stringptr,	 {&chunking_advertise_hosts} },
   { "commandline_checks_require_admin", opt_bool,{&commandline_checks_require_admin} },
+  { "config_snapshot",          opt_bool,        {&config_snapshot} },
+#ifdef WITH_CONTENT_SCAN
+  { "content_scan_direct",      opt_bool,        {&content_scan_direct} },
+#endif
+  { "cutthrough_max_connections", opt_int,     {&cutthrough_max_connections} },
+  { "daemon_config_readonly",   opt_bool,        {&daemon_config_readonly} },
+  { "daemon_delivery_helper",   opt_bool,        {&daemon_delivery_helper} },
+  { "daemon_delivery_helper_max", opt_int,       {&daemon_delivery_helper_max} },
+  { "daemon_park_max",          opt_int,         {&daemon_park_max} },
+  { "daemon_prefork_sessions",  opt_int,         {&daemon_prefork_sessions} },
+  { "daemon_prefork_workers",   opt_int,         {&daemon_prefork_workers} },
   { "daemon_smtp_port",         opt_stringptr|opt_hidden, {&daemon_smtp_port} },
   { "daemon_smtp_ports",        opt_stringptr,   {&daemon_smtp_port} },
   { "daemon_startup_retries",   opt_int,         {&daemon_startup_retries} },
@@ -112,12 +126,16 @@ static optionlist optionlist_config[] = {
   { "delay_warning_condition",  opt_stringptr,   {&delay_warning_condition} },
   { "deliver_drop_privilege",   opt_bool,        {&deliver_drop_privilege} },
   { "deliver_queue_load_max",   opt_fixed,       {&deliver_queue_load_max} },
+  { "delivery_buffer_size",     opt_mkint,       {&delivery_buffer_size} },
+  { "delivery_buffer_size_max", opt_mkint,       {&delivery_buffer_size_max} },
   { "delivery_date_remove",     opt_bool,        {&delivery_date_remove} },
 #ifdef ENABLE_DISABLE_FSYNC
   { "disable_fsync",            opt_bool,        {&disable_fsync} },
 #endif
   { "disable_ipv6",             opt_bool,        {&disable_ipv6} },
 #ifndef DISABLE_DKIM
+  { "dkim_preload_keys",        opt_stringptr,   {&dkim_preload_keys} },
+  { "dkim_sign_bodyhashes",     opt_stringptr,   {&dkim_sign_bodyhashes} },
   { "dkim_verify_hashes",       opt_stringptr,   {&dkim_verify_hashes} },
   { "dkim_verify_keytypes",     opt_stringptr,   {&dkim_verify_keytypes} },
   { "dkim_verify_min_keysizes", opt_stringptr,   {&dkim_verify_min_keysizes} },
@@ -130,12 +148,14 @@ static optionlist optionlist_config[] = {
   { "dmarc_tld_file",           opt_stringptr,   {&dmarc_tld_file} },
 #endif
   { "dns_again_means_nonexist", opt_stringptr,   {&dns_again_means_nonexist} },
+  { "dns_cache_size",           opt_int,         {&dns_cache_size} },
   { "dns_check_names_pattern",  opt_stringptr,   {&check_dns_names_pattern} },
   { "dns_cname_loops",		opt_int,	 {&dns_cname_loops} },
   { "dns_csa_search_limit",     opt_int,         {&dns_csa_search_limit} },
   { "dns_csa_use_reverse",      opt_bool,        {&dns_csa_use_reverse} },
   { "dns_dnssec_ok",            opt_int,         {&dns_dnssec_ok} },
   { "dns_ipv4_lookup",          opt_stringptr,   {&dns_ipv4_lookup} },
+  { "dns_parallel_lookups",     opt_bool,        {&dns_parallel_lookups} },
   { "dns_retrans",              opt_time,        {&dns_retrans} },
   { "dns_retry",                opt_int,         {&dns_retry} },
   { "dns_trust_aa",             opt_stringptr,   {&dns_trust_aa} },
@@ -150,6 +170,7 @@ static optionlist optionlist_config[] = {
   { "errors_reply_to",          opt_stringptr,   {&errors_reply_to} },
 #ifndef DISABLE_EVENT
   { "event_action",             opt_stringptr,   {&event_action} },
+  { "event_types",              opt_stringptr,   {&event_types} },
 #endif
   { "exim_group",               opt_gid,         {&exim_gid} },
   { "exim_path",                opt_stringptr,   {&exim_path} },
@@ -157,8 +178,10 @@ static optionlist optionlist_config[] = {
   { "exim_version",             opt_stringptr,   {&version_string} },
   { "extra_local_interfaces",   opt_stringptr,   {&extra_local_interfaces} },
   { "extract_addresses_remove_arguments", opt_bool, {&extract_addresses_remove_arguments} },
+  { "finduser_cache_ttl",       opt_time,        {&finduser_cache_ttl} },
   { "finduser_retries",         opt_int,         {&finduser_retries} },
   { "freeze_tell",              opt_stringptr,   {&freeze_tell} },
+  { "fsync_group_commit",       opt_bool,        {&fsync_group_commit} },
   { "gecos_name",               opt_stringptr,   {&gecos_name} },
   { "gecos_pattern",            opt_stringptr,   {&gecos_pattern} },
 #ifndef DISABLE_TLS
@@ -173,6 +196,10 @@ static optionlist optionlist_config[] = {
   { "helo_lookup_domains",      opt_stringptr,   {&helo_lookup_domains} },
   { "helo_try_verify_hosts",    opt_stringptr,   {&helo_try_verify_hosts} },
   { "helo_verify_hosts",        opt_stringptr,   {&helo_verify_hosts} },
+  { "hints_db_shards",          opt_int,         {&hints_db_shards} },
+  { "hints_shared_databases",   opt_stringptr,   {&hints_shared_databases} },
+  { "hints_shared_server",      opt_stringptr,   {&hints_shared_server} },
+  { "hints_shared_ttl",         opt_time,        {&hints_shared_ttl} },
   { "hold_domains",             opt_stringptr,   {&hold_domains} },
   { "host_lookup",              opt_stringptr,   {&host_lookup} },
   { "host_lookup_order",        opt_stringptr,   {&host_lookup_order} },
@@ -188,6 +215,7 @@ static optionlist optionlist_config[] = {
   { "ignore_bounce_errors_after", opt_time,      {&ignore_bounce_errors_after} },
   { "ignore_fromline_hosts",    opt_stringptr,   {&ignore_fromline_hosts} },
   { "ignore_fromline_local",    opt_bool,        {&ignore_fromline_local} },
+  { "json_cache",               opt_bool,        {&json_cache} },
   { "keep_environment",         opt_stringptr,   {&keep_environment} },
   { "keep_malformed",           opt_time,        {&keep_malformed} },
 #ifdef LOOKUP_LDAP
@@ -205,20 +233,31 @@ static optionlist optionlist_config[] = {
   { "local_from_prefix",        opt_stringptr,   {&local_from_prefix} },
   { "local_from_suffix",        opt_stringptr,   {&local_from_suffix} },
   { "local_interfaces",         opt_stringptr,   {&local_interfaces} },
+  { "local_max_parallel",       opt_int,         {&local_max_parallel} },
 #ifdef HAVE_LOCAL_SCAN
   { "local_scan_timeout",       opt_time,        {&local_scan_timeout} },
 #endif
   { "local_sender_retain",      opt_bool,        {&local_sender_retain} },
   { "localhost_number",         opt_stringptr,   {&host_number_string} },
   { "log_file_path",            opt_stringptr,   {&log_file_path} },
+  { "log_json_socket",          opt_stringptr,   {&log_json_socket} },
   { "log_selector",             opt_stringptr,   {&log_selector_string} },
   { "log_timezone",             opt_bool,        {&log_timezone} },
   { "lookup_open_max",          opt_int,         {&lookup_open_max} },
+  { "lookup_proxy_socket",      opt_stringptr,   {&lookup_proxy_socket} },
+  { "lookup_proxy_workers",     opt_int,         {&lookup_proxy_workers} },
+  { "lsearch_index",            opt_bool,        {&lsearch_index} },
+  { "mainlog_buffer_size",      opt_mkint,       {&mainlog_buffer_size} },
+  { "mainlog_index",            opt_bool,        {&mainlog_index} },
+#ifdef WITH_CONTENT_SCAN
+  { "malware_cache_version",    opt_stringptr,   {&malware_cache_version} },
+#endif
   { "max_username_length",      opt_int,         {&max_username_length} },
   { "message_body_newlines",    opt_bool,        {&message_body_newlines} },
   { "message_body_visible",     opt_mkint,       {&message_body_visible} },
   { "message_id_header_domain", opt_stringptr,   {&message_id_domain} },
   { "message_id_header_text",   opt_stringptr,   {&message_id_text} },
+  { "message_id_sequence",      opt_bool,        {&message_id_sequence} },
   { "message_logs",             opt_bool,        {&message_logs} },
   { "message_size_limit",       opt_stringptr,   {&message_size_limit} },
 #ifdef SUPPORT_MOVE_FROZEN_MESSAGES
@@ -231,6 +270,8 @@ static optionlist optionlist_config[] = {
   { "never_users",              opt_uidlist,     {&never_users} },
   { "notifier_socket",          opt_stringptr,   {&notifier_socket} },
 #ifndef DISABLE_TLS
+  { "openssl_async",            opt_bool,        {&openssl_async} },
+  { "openssl_engine",           opt_stringptr,   {&openssl_engine} },
   { "openssl_options",          opt_stringptr,   {&openssl_options} },
 #endif
 #ifdef LOOKUP_ORACLE
@@ -250,30 +291,50 @@ static optionlist optionlist_config[] = {
 #ifndef DISABLE_PIPE_CONNECT
   { "pipelining_connect_advertise_hosts", opt_stringptr,
 						 {&pipe_connect_advertise_hosts} },
+  { "pipelining_connect_cache_size", opt_int,   {&pipe_connect_cache_size} },
 #endif
 #ifndef DISABLE_PRDR
   { "prdr_enable",              opt_bool,        {&prdr_enable} },
+  { "prdr_max_parallel",        opt_int,         {&prdr_max_parallel} },
 #endif
   { "preserve_message_logs",    opt_bool,        {&preserve_message_logs} },
   { "primary_hostname",         opt_stringptr,   {&primary_hostname} },
   { "print_topbitchars",        opt_bool,        {&print_topbitchars} },
   { "process_log_path",         opt_stringptr,   {&process_log_path} },
   { "prod_requires_admin",      opt_bool,        {&prod_requires_admin} },
+  { "profile_sample",           opt_int,         {&profile_sample} },
   { "qualify_domain",           opt_stringptr,   {&qualify_domain_sender} },
   { "qualify_recipient",        opt_stringptr,   {&qualify_domain_recipient} },
   { "queue_domains",            opt_stringptr,   {&queue_domains} },
 #ifndef DISABLE_QUEUE_RAMP
   { "queue_fast_ramp",          opt_bool,        {&queue_fast_ramp} },
 #endif
+  { "queue_first_pass_workers", opt_int,         {&queue_first_pass_workers} },
+  { "queue_index",              opt_bool,        {&queue_index} },
+  { "queue_index_rescan",       opt_time,        {&queue_index_rescan} },
   { "queue_list_requires_admin",opt_bool,        {&queue_list_requires_admin} },
   { "queue_only",               opt_bool,        {&queue_only} },
+  { "queue_only_deliveries",    opt_int,         {&queue_only_deliveries} },
   { "queue_only_file",          opt_stringptr,   {&queue_only_file} },
   { "queue_only_load",          opt_fixed,       {&queue_only_load} },
   { "queue_only_load_latch",    opt_bool,        {&queue_only_load_latch} },
   { "queue_only_override",      opt_bool,        {&queue_only_override} },
+  { "queue_priority_classes",   opt_stringptr,   {&queue_priority_classes} },
+  { "queue_retry_index",        opt_bool,        {&queue_retry_index} },
+  { "queue_run_by_host",        opt_bool,        {&queue_run_by_host} },
+#ifdef EXIM_HAVE_CPU_AFFINITY
+  { "queue_run_cpus",           opt_stringptr,   {&queue_run_cpus} },
+#endif
   { "queue_run_in_order",       opt_bool,        {&queue_run_in_order} },
   { "queue_run_max",            opt_stringptr,   {&queue_run_max} },
+  { "queue_run_parallel",       opt_int,         {&queue_run_parallel} },
+  { "queue_run_persistent",     opt_int,         {&queue_run_persistent} },
+  { "queue_size_lanes",         opt_stringptr,   {&queue_size_lanes} },
   { "queue_smtp_domains",       opt_stringptr,   {&queue_smtp_domains} },
+  { "queue_summary",            opt_bool,        {&queue_summary} },
+  { "ratelimit_cache_size",     opt_int,         {&ratelimit_cache_size} },
+  { "readfile_cache_size",      opt_mkint,       {&readfile_cache_size} },
+  { "readfile_preload",         opt_stringptr,   {&readfile_preload} },
   { "receive_timeout",          opt_time,        {&receive_timeout} },
   { "received_header_text",     opt_stringptr,   {&received_header_text} },
   { "received_headers_max",     opt_int,         {&received_headers_max} },
@@ -283,6 +344,9 @@ static optionlist optionlist_config[] = {
 #ifdef LOOKUP_REDIS
   { "redis_servers",            opt_stringptr,   {&redis_servers} },
 #endif
+  { "regex_cache_size",         opt_int,         {&regex_cache_size} },
+  { "rejectlog_ratelimit",      opt_stringptr,   {&rejectlog_ratelimit} },
+  { "rejectlog_sample",         opt_int,         {&rejectlog_sample} },
   { "remote_max_parallel",      opt_int,         {&remote_max_parallel} },
   { "remote_sort_domains",      opt_stringptr,   {&remote_sort_domains} },
   { "retry_data_expire",        opt_time,        {&retry_data_expire} },
@@ -291,6 +355,9 @@ static optionlist optionlist_config[] = {
   { "return_size_limit",        opt_mkint|opt_hidden, {&bounce_return_size_limit} },
   { "rfc1413_hosts",            opt_stringptr,   {&rfc1413_hosts} },
   { "rfc1413_query_timeout",    opt_time,        {&rfc1413_query_timeout} },
+  { "route_cache_ttl",          opt_time,        {&route_cache_ttl} },
+  { "run_coprocess_timeout",    opt_time,        {&run_coprocess_timeout} },
+  { "run_coprocesses",          opt_stringptr,   {&run_coprocesses} },
   { "sender_unqualified_hosts", opt_stringptr,   {&sender_unqualified_hosts} },
   { "slow_lookup_log",          opt_int,         {&slow_lookup_log} },
   { "smtp_accept_keepalive",    opt_bool,        {&smtp_accept_keepalive} },
@@ -306,6 +373,13 @@ static optionlist optionlist_config[] = {
   { "smtp_banner",              opt_stringptr,   {&smtp_banner} },
   { "smtp_check_spool_space",   opt_bool,        {&smtp_check_spool_space} },
   { "smtp_connect_backlog",     opt_int,         {&smtp_connect_backlog} },
+  { "smtp_connection_cache",    opt_stringptr,   {&smtp_connection_cache} },
+  { "smtp_connection_cache_limit", opt_int,      {&smtp_connection_cache_limit} },
+  { "smtp_connection_cache_timeout", opt_time,   {&smtp_connection_cache_timeout} },
+#ifdef EXIM_HAVE_CPU_AFFINITY
+  { "smtp_cpus",                opt_stringptr,   {&smtp_cpus} },
+  { "smtp_cpus_follow_incoming", opt_bool,       {&smtp_cpus_follow_incoming} },
+#endif
   { "smtp_enforce_sync",        opt_bool,        {&smtp_enforce_sync} },
   { "smtp_etrn_command",        opt_stringptr,   {&smtp_etrn_command} },
   { "smtp_etrn_serialize",      opt_bool,        {&smtp_etrn_serialize} },
@@ -315,11 +389,15 @@ static optionlist optionlist_config[] = {
   { "smtp_ratelimit_hosts",     opt_stringptr,   {&smtp_ratelimit_hosts} },
   { "smtp_ratelimit_mail",      opt_stringptr,   {&smtp_ratelimit_mail} },
   { "smtp_ratelimit_rcpt",      opt_stringptr,   {&smtp_ratelimit_rcpt} },
+  { "smtp_rcpt_prefetch",       opt_bool,        {&smtp_rcpt_prefetch} },
+  { "smtp_receive_buffer_size", opt_mkint,       {&smtp_receive_buffer_size} },
   { "smtp_receive_timeout",     opt_func,        {.fn = &fn_smtp_receive_timeout} },
   { "smtp_reserve_hosts",       opt_stringptr,   {&smtp_reserve_hosts} },
   { "smtp_return_error_details",opt_bool,        {&smtp_return_error_details} },
+  { "smtp_screen_table_size",   opt_int,         {&smtp_screen_table_size} },
 #ifdef SUPPORT_I18N
   { "smtputf8_advertise_hosts", opt_stringptr,   {&smtputf8_advertise_hosts} },
+  { "smtputf8_domain_cache_size", opt_int,       {&smtputf8_domain_cache_size} },
 #endif
 #ifdef WITH_CONTENT_SCAN
   { "spamd_address",            opt_stringptr,   {&spamd_address} },
@@ -329,11 +407,21 @@ static optionlist optionlist_config[] = {
   { "spf_smtp_comment_template",opt_stringptr,   {&spf_smtp_comment_template} },
 #endif
   { "split_spool_directory",    opt_bool,        {&split_spool_directory} },
+#ifdef SUPPORT_ZSTD
+  { "spool_compress_min_size",  opt_mkint,       {&spool_compress_min_size} },
+#endif
+  { "spool_dedup_min_size",     opt_mkint,       {&spool_dedup_min_size} },
   { "spool_directory",          opt_stringptr,   {&spool_directory} },
+  { "spool_header_binary",      opt_bool,        {&spool_header_binary} },
+  { "spool_stripes",            opt_stringptr,   {&spool_stripes} },
   { "spool_wireformat",         opt_bool,        {&spool_wireformat} },
 #ifdef LOOKUP_SQLITE
   { "sqlite_dbfile",            opt_stringptr,   {&sqlite_dbfile} },
   { "sqlite_lock_timeout",      opt_int,         {&sqlite_lock_timeout} },
+  { "sqlite_mmap_size",         opt_mkint,       {&sqlite_mmap_size} },
+  { "sqlite_read_only",         opt_bool,        {&sqlite_read_only} },
+  { "sqlite_shared_cache",      opt_bool,        {&sqlite_shared_cache} },
+  { "sqlite_statement_cache",   opt_int,         {&sqlite_statement_cache} },
 #endif
 #ifdef EXPERIMENTAL_SRS_ALT
   { "srs_config",               opt_stringptr,   {&srs_config} },
@@ -351,6 +439,8 @@ static optionlist optionlist_config[] = {
   { "syslog_facility",          opt_stringptr,   {&syslog_facility_str} },
   { "syslog_pid",               opt_bool,        {&syslog_pid} },
   { "syslog_processname",       opt_stringptr,   {&syslog_processname} },
+  { "syslog_queue_size",        opt_int,         {&syslog_queue_size} },
+  { "syslog_socket",            opt_stringptr,   {&syslog_socket} },
   { "syslog_timestamp",         opt_bool,        {&syslog_timestamp} },
   { "system_filter",            opt_stringptr,   {&system_filter} },
   { "system_filter_directory_transport", opt_stringptr,{&system_filter_directory_transport} },
@@ -373,19 +463,31 @@ static optionlist optionlist_config[] = {
   { "tls_dhparam",              opt_stringptr,   {&tls_dhparam} },
   { "tls_eccurve",              opt_stringptr,   {&tls_eccurve} },
 # ifndef DISABLE_OCSP
+  { "tls_ocsp_cache_size",      opt_int,         {&tls_ocsp_cache_size} },
   { "tls_ocsp_file",            opt_stringptr,   {&tls_ocsp_file} },
+  { "tls_ocsp_refresh",         opt_bool,        {&tls_ocsp_refresh} },
 # endif
   { "tls_on_connect_ports",     opt_stringptr,   {&tls_in.on_connect_ports} },
   { "tls_privatekey",           opt_stringptr,   {&tls_privatekey} },
   { "tls_remember_esmtp",       opt_bool,        {&tls_remember_esmtp} },
   { "tls_require_ciphers",      opt_stringptr,   {&tls_require_ciphers} },
 # ifndef DISABLE_TLS_RESUME
+  { "tls_resumption_cache_size", opt_int,       {&tls_resumption_cache_size} },
   { "tls_resumption_hosts",     opt_stringptr,   {&tls_resumption_hosts} },
+# endif
+  { "tls_server_preload",       opt_bool,        {&tls_server_preload} },
+  { "tls_server_preload_sni",   opt_stringptr,   {&tls_server_preload_sni} },
+# ifndef DISABLE_TLS_RESUME
+  { "tls_ticket_key_file",      opt_stringptr,   {&tls_ticket_key_file} },
+  { "tls_ticket_key_overlap",   opt_int,         {&tls_ticket_key_overlap} },
+  { "tls_ticket_key_rotate",    opt_time,        {&tls_ticket_key_rotate} },
 # endif
   { "tls_try_verify_hosts",     opt_stringptr,   {&tls_try_verify_hosts} },
   { "tls_verify_certificates",  opt_stringptr,   {&tls_verify_certificates} },
   { "tls_verify_hosts",         opt_stringptr,   {&tls_verify_hosts} },
 #endif
+  { "trace_log_path",           opt_stringptr,   {&trace_log_path} },
+  { "trace_ring_size",          opt_int,         {&trace_ring_size} },
   { "trusted_groups",           opt_gidlist,     {&trusted_groups} },
   { "trusted_users",            opt_uidlist,     {&trusted_users} },
   { "unknown_login",            opt_stringptr,   {&unknown_login} },
@@ -393,6 +495,7 @@ static optionlist optionlist_config[] = {
   { "untrusted_set_sender",     opt_stringptr,   {&untrusted_set_sender} },
   { "uucp_from_pattern",        opt_stringptr,   {&uucp_from_pattern} },
   { "uucp_from_sender",         opt_stringptr,   {&uucp_from_sender} },
+  { "verify_cache_ttl",         opt_time,        {&verify_cache_ttl} },
   { "warn_message_file",        opt_stringptr,   {&warn_message_file} },
   { "write_rejectlog",          opt_bool,        {&write_rejectlog} }
 };
@@ -878,6 +981,339 @@ Uskip_whitespace(&ss);
 return ss;
 }
 
+/*************************************************
+*        Snapshot of the configuration           *
+*************************************************/
+
+/* Reading a large configuration, with many macros and .include files, is a
+noticeable part of the work of a process that does little else, such as one
+re-executed for a single delivery. When config_snapshot is set, the daemon
+records the logical lines that it reads, after macro replacement, conditionals
+and .include processing, and writes them to a file in the spool directory's
+db subdirectory. Other processes using the same configuration take their lines
+from that file instead, as long as none of the files that went into it has
+changed, and the Exim binary and the command line macros are the same. The
+lines are still interpreted in the usual way.
+
+The file is named from a hash of the things that must be the same; this is
+also checked inside it. Then come the files read, with their inode numbers,
+sizes and times, and optional .include files that were absent, then the lines,
+each with the number of its file, its line number and its length.
+
+A snapshot is used only for a trusted configuration. It is written only by
+root, with mode 0600, and used only if it is owned by root and is accessible by
+nobody else, since it determines what root processes do (and may contain lines
+from files that only root can read). The db directory belongs to the Exim user,
+so the temporary file is created exclusively. The location is computed before
+the configuration is read, so it is under the spool directory that Exim was
+built with. */
+
+#define SNAP_MAGIC	"EXIMCONF1"
+#define SNAP_FILES_MAX	256
+
+static uschar * snap_dir = NULL;	/* the spool directory it is under */
+static uschar * snap_path = NULL;	/* the snapshot file */
+static uschar snap_hash[33];		/* hex hash of what it depends on */
+static BOOL snap_recording = FALSE;	/* collecting lines to write */
+static gstring * snap_files = NULL;	/* file list, while recording */
+static gstring * snap_lines = NULL;	/* lines, while recording */
+static const uschar * snap_names[SNAP_FILES_MAX];
+static int snap_nfiles = 0;
+static uschar * snap_ptr = NULL;	/* next line, while replaying */
+static uschar * snap_end = NULL;
+
+
+/* Work out the name of the snapshot for this configuration. */
+
+static void
+snap_setup(void)
+{
+uschar digest[16];
+gstring * g;
+md5 base;
+
+g = string_fmt_append(NULL, "%s\n%s\n%s\n%s\n%ld\n", version_string,
+  version_cnumber, version_date, config_main_filename, (long)original_euid);
+for (int i = 0; i < clmacro_count; i++)
+  g = string_fmt_append(g, "%s\n", clmacros[i]);
+
+md5_start(&base);
+md5_end(&base, g->s, g->ptr, digest);
+for (int i = 0; i < 16; i++) sprintf(CS snap_hash + 2*i, "%02x", digest[i]);
+
+snap_dir = string_copy(spool_directory);
+snap_path = string_sprintf("%s/db/config-%.16s", snap_dir, snap_hash);
+}
+
+
+/* Note a file that has gone into the configuration, or an optional one that
+was not there. Too many files just means no snapshot.
+
+Arguments:
+  name       the file name
+  fd         an open descriptor for it, or -1 if it does not exist
+*/
+
+static void
+snap_record_file(const uschar * name, int fd)
+{
+struct stat statbuf;
+int old_pool = store_pool;
+
+if (!snap_recording) return;
+if (snap_nfiles >= SNAP_FILES_MAX || fd >= 0 && fstat(fd, &statbuf) != 0)
+  {
+  snap_recording = FALSE;
+  return;
+  }
+
+store_pool = POOL_PERM;
+snap_names[snap_nfiles++] = string_copy(name);
+snap_files = fd < 0
+  ? string_fmt_append(snap_files, "A %s\n", name)
+  : string_fmt_append(snap_files, "F %lu %lu %ld %ld %ld %s\n",
+      (unsigned long)statbuf.st_dev, (unsigned long)statbuf.st_ino,
+      (long)statbuf.st_size, (long)statbuf.st_mtime, (long)statbuf.st_ctime,
+      name);
+store_pool = old_pool;
+}
+
+
+/* Note a logical line, from the current file. */
+
+static void
+snap_record_line(const uschar * line, int len)
+{
+int old_pool = store_pool, i;
+
+if (!snap_recording) return;
+for (i = snap_nfiles - 1; i > 0; i--)
+  if (Ustrcmp(snap_names[i], config_filename) == 0) break;
+
+store_pool = POOL_PERM;
+snap_lines = string_fmt_append(snap_lines, "%d %d %d\n", i, config_lineno, len);
+snap_lines = string_catn(snap_lines, line, len);
+snap_lines = string_catn(snap_lines, US"\n", 1);
+store_pool = old_pool;
+}
+
+
+/* Write the snapshot, once the whole configuration has been read, replacing
+any old one atomically. If the option is not set, remove any old one so that
+other processes stop using it. */
+
+static void
+snap_write(void)
+{
+uschar * temp;
+int fd;
+
+if (!snap_recording) return;
+snap_recording = FALSE;
+if (geteuid() != root_uid) return;
+
+if (!config_snapshot)
+  {
+  if (Uunlink(snap_path) == 0)
+    DEBUG(D_any) debug_printf("removed configuration snapshot %s\n", snap_path);
+  return;
+  }
+
+temp = string_sprintf("%s.%d", snap_path, (int)getpid());
+(void)Uunlink(temp);
+if ((fd = Uopen(temp, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0 && errno == ENOENT)
+  {
+  (void)directory_make(snap_dir, US"db", EXIMDB_DIRECTORY_MODE, FALSE);
+  fd = Uopen(temp, O_WRONLY|O_CREAT|O_EXCL, 0600);
+  }
+if (fd < 0)
+  {
+  DEBUG(D_any) debug_printf("configuration snapshot %s: %s\n", temp,
+    strerror(errno));
+  return;
+  }
+{
+gstring * g = string_fmt_append(NULL, SNAP_MAGIC " %s\n", snap_hash);
+BOOL ok = write(fd, g->s, g->ptr) == g->ptr
+  && write(fd, snap_files->s, snap_files->ptr) == snap_files->ptr
+  && write(fd, ".\n", 2) == 2
+  && (!snap_lines || write(fd, snap_lines->s, snap_lines->ptr) == snap_lines->ptr);
+
+if (close(fd) != 0 || !ok || Urename(temp, snap_path) != 0)
+  {
+  DEBUG(D_any) debug_printf("configuration snapshot %s: %s\n", snap_path,
+    strerror(errno));
+  (void)Uunlink(temp);
+  }
+else
+  DEBUG(D_any) debug_printf("wrote configuration snapshot %s\n", snap_path);
+}
+}
+
+
+/* Parse the head of a line in a snapshot.
+
+Arguments:
+  p          the start of the line
+  e          the end of the snapshot
+  idxp       where to put the file number
+  linenop    where to put the line number
+  lenp       where to put the length
+
+Returns:     the start of the text of the line, or NULL if it is malformed
+*/
+
+static uschar *
+snap_line_next(uschar * p, const uschar * e, int * idxp, int * linenop,
+  int * lenp)
+{
+int idx, lineno, len, n;
+
+if (  sscanf(CS p, "%d %d %d%n", &idx, &lineno, &len, &n) < 3
+   || p[n] != '\n' || idx < 0 || idx >= snap_nfiles || len < 0
+   || p + n + len + 2 > e || p[n + 1 + len] != '\n'
+   )
+  return NULL;
+*idxp = idx;
+*linenop = lineno;
+*lenp = len;
+return p + n + 1;
+}
+
+
+/* Load a snapshot, if there is a usable one. The main configuration file has
+been opened, and must be the first file in it.
+
+Returns:   TRUE if the lines will come from the snapshot
+*/
+
+static BOOL
+snap_load(void)
+{
+struct stat statbuf;
+uschar * buf, * p, * e;
+int fd;
+
+if ((fd = Uopen(snap_path, O_RDONLY, 0)) < 0) return FALSE;
+if (  fstat(fd, &statbuf) != 0
+   || statbuf.st_uid != root_uid
+   || statbuf.st_mode & 077
+   || statbuf.st_size < sizeof(SNAP_MAGIC) + 34
+   )
+  {
+  (void)close(fd);
+  return FALSE;
+  }
+
+buf = store_get_perm(statbuf.st_size + 1, FALSE);
+if (read(fd, buf, statbuf.st_size) != statbuf.st_size)
+  {
+  (void)close(fd);
+  return FALSE;
+  }
+(void)close(fd);
+buf[statbuf.st_size] = 0;
+e = buf + statbuf.st_size;
+
+if (  Ustrncmp(buf, SNAP_MAGIC " ", sizeof(SNAP_MAGIC)) != 0
+   || Ustrncmp(buf + sizeof(SNAP_MAGIC), snap_hash, 32) != 0
+   || buf[sizeof(SNAP_MAGIC) + 32] != '\n')
+  return FALSE;
+p = buf + sizeof(SNAP_MAGIC) + 33;
+
+/* Every file must be as it was when the snapshot was made */
+
+snap_nfiles = 0;
+while (p < e && *p != '.')
+  {
+  uschar * nl = Ustrchr(p, '\n'), * name;
+  unsigned long dev, ino;
+  long size, mtime, ctime;
+  int n;
+
+  if (!nl || snap_nfiles >= SNAP_FILES_MAX) return FALSE;
+  *nl = 0;
+  if (*p == 'A')
+    {
+    name = p + 2;
+    if (Ustat(name, &statbuf) == 0) goto changed;
+    }
+  else if (sscanf(CS p, "F %lu %lu %ld %ld %ld %n", &dev, &ino, &size,
+	    &mtime, &ctime, &n) < 5)
+    return FALSE;
+  else
+    {
+    name = p + n;
+    if (  Ustat(name, &statbuf) != 0
+       || (unsigned long)statbuf.st_dev != dev
+       || (unsigned long)statbuf.st_ino != ino
+       || (long)statbuf.st_size != size
+       || (long)statbuf.st_mtime != mtime
+       || (long)statbuf.st_ctime != ctime
+       || snap_nfiles == 0 && Ustrcmp(name, config_filename) != 0
+       )
+      goto changed;
+    }
+  snap_names[snap_nfiles++] = name;
+  p = nl + 1;
+  }
+if (p + 2 > e || p[1] != '\n' || snap_nfiles == 0) return FALSE;
+
+/* Check the form of all the lines, so that reading them cannot fail */
+
+for (uschar * q = p += 2; q < e; )
+  {
+  int idx, lineno, len;
+  if (!(q = snap_line_next(q, e, &idx, &lineno, &len))) return FALSE;
+  q += len + 1;
+  }
+
+snap_ptr = p;
+snap_end = e;
+DEBUG(D_any) debug_printf("reading configuration from snapshot %s\n", snap_path);
+return TRUE;
+
+changed:
+  DEBUG(D_any) debug_printf("configuration snapshot %s is out of date\n",
+    snap_path);
+  return FALSE;
+}
+
+
+/* Take the next logical line from a snapshot, into the big buffer. The lines
+were all checked when it was loaded.
+
+Returns:   the length of the line, or -1 at the end
+*/
+
+static int
+snap_read_line(void)
+{
+int idx, lineno, len;
+
+if (snap_ptr >= snap_end)
+  return -1;
+if (!(snap_ptr = snap_line_next(snap_ptr, snap_end, &idx, &lineno, &len)))
+  log_write(0, LOG_PANIC_DIE, "configuration snapshot %s is corrupt",
+    snap_path);
+
+while (len >= big_buffer_size)
+  {
+  store_free(big_buffer);
+  big_buffer_size += BIG_BUFFER_SIZE;
+  big_buffer = store_malloc(big_buffer_size);
+  }
+memcpy(big_buffer, snap_ptr, len);
+big_buffer[len] = 0;
+snap_ptr += len + 1;
+
+config_filename = snap_names[idx];
+config_lineno = lineno;
+return len;
+}
+
+
+
 /*************************************************
 *            Read configuration line             *
 *************************************************/
@@ -909,6 +1345,19 @@ int newlen;
 uschar *s, *ss;
 BOOL macro_found;
 
+/* When replaying a snapshot, the lines are ready-made. */
+
+if (snap_ptr)
+  {
+  if ((len = snap_read_line()) < 0)
+    {
+    next_section[0] = 0;
+    return NULL;
+    }
+  s = big_buffer;
+  goto have_line;
+  }
+
 /* Loop for handling continuation lines, skipping comments, and dealing with
 .include files. */
 
@@ -1069,7 +1518,11 @@ for (;;)
 	ss = string_from_gstring(g);
         }
 
-    if (include_if_exists != 0 && (Ustat(ss, &statbuf) != 0)) continue;
+    if (include_if_exists != 0 && (Ustat(ss, &statbuf) != 0))
+      {
+      snap_record_file(ss, -1);
+      continue;
+      }
 
     if (config_lines)
       save_config_position(config_filename, config_lineno);
@@ -1084,6 +1537,7 @@ for (;;)
     if (!(config_file = Ufopen(ss, "rb")))
       log_write(0, LOG_PANIC_DIE|LOG_CONFIG_IN, "failed to open included "
         "configuration file %s", ss);
+    snap_record_file(ss, fileno(config_file));
 
     config_filename = string_copy(ss);
     config_directory = string_copyn(ss, CUstrrchr(ss, '/') - ss);
@@ -1131,10 +1585,19 @@ next_section, truncate it. It will be unrecognized later, because all the known
 section names do fit. Leave space for pluralizing. */
 
 s = big_buffer + startoffset;            /* First non-space character */
+snap_record_line(s, big_buffer + len - s);
 
+have_line:
 if (config_lines)
   save_config_line(s);
 
+/* Keep a hash of the logical lines, so that anything derived from this
+configuration can be recognized as stale once it changes (FNV-1a). */
+
+for (const uschar * t = s; *t; t++)
+  config_hash = (config_hash ^ *t) * 16777619U;
+config_hash = (config_hash ^ '\n') * 16777619U;
+
 if (strncmpic(s, US"begin ", 6) == 0)
   {
   s += 6;
@@ -1294,7 +1757,10 @@ return (*s == terminator)? yield : (-1);
 *            Find option in list                 *
 *************************************************/
 
-/* The lists are always in order, so binary chop can be used.
+/* The lists are always in order. Each is given a perfect hash the first time
+it is searched; the hashes are kept in a short chain keyed by the list, with
+the most recently used at the front since options of one driver or section
+come together.
 
 Arguments:
   name      the option name to search for
@@ -1304,20 +1770,37 @@ Arguments:
 Returns:    pointer to an option entry, or NULL if not found
 */
 
+typedef struct option_phash {
+  struct option_phash * next;
+  optionlist *          ol;
+  int                   last;
+  tree_phash *          phash;
+} option_phash;
+
+static option_phash * option_phashes = NULL;
+
 static optionlist *
 find_option(uschar *name, optionlist *ol, int last)
 {
-int first = 0;
-while (last > first)
-  {
-  int middle = (first + last)/2;
-  int c = Ustrcmp(name, ol[middle].name);
+option_phash ** pp, * p;
+int i;
 
-  if (c == 0) return ol + middle;
-  else if (c > 0) first = middle + 1;
-  else last = middle;
+for (pp = &option_phashes; (p = *pp); pp = &p->next)
+  if (p->ol == ol && p->last == last) break;
+if (!p)
+  {
+  p = store_malloc(sizeof(option_phash));
+  p->ol = ol;
+  p->last = last;
+  p->phash = NULL;
   }
-return NULL;
+else
+  *pp = p->next;
+p->next = option_phashes;		/* move to front */
+option_phashes = p;
+
+i = tree_phash_find(&p->phash, ol, last, sizeof(optionlist), name);
+return i >= 0 ? ol + i : NULL;
 }
 
 
@@ -2966,7 +3449,8 @@ save the list in a tree, sorted by its name. Each entry also has a number,
 which can be used for caching tests, but if the string contains any expansion
 items other than $key, the number is set negative to inhibit caching. This
 mechanism is used for domain, host, and address lists that are referenced by
-the "+name" syntax.
+the "+name" syntax. The block holding the list is in the perm pool, because
+the match cache and the list index are written into it when the list is used.
 
 Arguments:
   anchorp     points to the tree anchor
@@ -2987,7 +3471,7 @@ read_named_list(tree_node **anchorp, int *numberp, int max, uschar *s,
 BOOL forcecache = FALSE;
 uschar *ss;
 tree_node *t;
-namedlist_block * nb = store_get(sizeof(namedlist_block), FALSE);
+namedlist_block * nb = store_get_perm(sizeof(namedlist_block), FALSE);
 
 if (Ustrncmp(s, "_cache", 6) == 0)
   {
@@ -3024,6 +3508,8 @@ if (*s++ != '=') log_write(0, LOG_PANIC_DIE|LOG_CONFIG_IN,
 Uskip_whitespace(&s);
 nb->string = read_string(s, t->name);
 nb->cache_data = NULL;
+nb->index = NULL;
+nb->indexed = FALSE;
 
 /* Check the string for any expansions; if any are found, mark this list
 uncacheable unless the user has explicited forced caching. */
@@ -3270,6 +3756,22 @@ if (f.trusted_config && Ustrcmp(filename, US"/dev/null"))
     }
   }
 
+/* A daemon reads the configuration files and, if config_snapshot is set,
+makes a snapshot of them; other processes use that if it is up to date.
+Neither applies when the original lines are needed for -bP config. */
+
+if (f.trusted_config && !config_lines)
+  {
+  snap_setup();
+  if (f.daemon_listen || queue_interval > 0)
+    {
+    snap_recording = TRUE;
+    snap_record_file(config_filename, fileno(config_file));
+    }
+  else
+    (void) snap_load();
+  }
+
 /* Process the main configuration settings. They all begin with a lower case
 letter. If we see something starting with an upper case letter, it is taken as
 a macro definition. */
@@ -3412,6 +3914,30 @@ if (!(s = expand_string(spool_directory)))
     "\"%s\": %s", spool_directory, expand_string_message);
 spool_directory = s;
 
+/* Likewise spool_stripes, which is a list of directories over which the
+messages are spread. Each must be an absolute path. */
+
+if (spool_stripes)
+  {
+  const uschar * list;
+  int sep = 0, n = 0;
+
+  if (!(s = expand_string(spool_stripes)))
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to expand spool_stripes "
+      "\"%s\": %s", spool_stripes, expand_string_message);
+  spool_stripes = s;
+
+  for (list = s; string_nextinlist(&list, &sep, NULL, 0); ) n++;
+  spool_stripe_dirs = store_get(n * sizeof(uschar *), FALSE);
+  for (list = s; (s = string_nextinlist(&list, &sep, NULL, 0)); )
+    {
+    if (*s != '/' || Ustrlen(s) > 200)
+      log_write(0, LOG_MAIN|LOG_PANIC_DIE, "spool_stripes: \"%s\" is not an "
+	"absolute path of at most 200 characters", s);
+    spool_stripe_dirs[spool_stripe_count++] = s;
+    }
+  }
+
 /* Expand log_file_path, which must contain "%s" in any component that isn't
 the null string or "syslog". It is also allowed to contain one instance of %D
 or %M. However, it must NOT contain % followed by anything else. */
@@ -3482,6 +4008,12 @@ if (*pid_file_path != 0)
 if (!process_log_path || *process_log_path =='\0')
   process_log_path = string_sprintf("%s/exim-process.info", spool_directory);
 
+/* Likewise for trace_log_path, and make the trace ring if one is wanted */
+
+if (!trace_log_path || *trace_log_path =='\0')
+  trace_log_path = string_sprintf("%s/exim-trace.info", spool_directory);
+if (trace_ring_size > 0 && !trace_ring) trace_init();
+
 /* Compile the regex for matching a UUCP-style "From_" line in an incoming
 message. */
 
@@ -3571,6 +4103,15 @@ if (host_number_string)
   host_number = n;
   }
 
+/* Keep the I/O buffers at a workable minimum size */
+
+if (delivery_buffer_size && delivery_buffer_size < 1024)
+  log_write(0, LOG_PANIC_DIE|LOG_CONFIG,
+    "delivery_buffer_size is too small, must be at least 1024");
+if (smtp_receive_buffer_size < 1024)
+  log_write(0, LOG_PANIC_DIE|LOG_CONFIG,
+    "smtp_receive_buffer_size is too small, must be at least 1024");
+
 #ifndef DISABLE_TLS
 /* If tls_verify_hosts is set, tls_verify_certificates must also be set */
 
@@ -3599,6 +4140,11 @@ if (openssl_options)
       "openssl_options parse error: %s", openssl_options);
 # endif
   }
+# ifdef USE_GNUTLS
+if (openssl_async || openssl_engine)
+  log_write(0, LOG_PANIC_DIE|LOG_CONFIG,
+    "openssl_async or openssl_engine is set but we're using GnuTLS");
+# endif
 #endif	/*DISABLE_TLS*/
 
 if (!nowarn && !keep_environment && environ && *environ)
@@ -3638,7 +4184,7 @@ for (driver_info * dd = drivers_available; dd->driver_name[0] != 0;
     {
     int len = dd->options_len;
     d->info = dd;
-    d->options_block = store_get(len, FALSE);
+    d->options_block = store_get_perm(len, FALSE);
     memcpy(d->options_block, dd->options_block, len);
     for (int i = 0; i < *(dd->options_count); i++)
       dd->options[i].type &= ~opt_set;
@@ -3749,9 +4295,11 @@ while ((buffer = get_config_line()))
           "there are two %ss called \"%s\"", class, name);
 
     /* Set up a new driver instance data block on the chain, with
-    its default values installed. */
+    its default values installed. Drivers keep working state in their instance
+    and options blocks, so these go in the perm pool rather than among the
+    frozen configuration data. */
 
-    d = store_get(instance_size, FALSE);
+    d = store_get_perm(instance_size, FALSE);
     memcpy(d, instance_default, instance_size);
     *p = d;
     p = &d->next;
@@ -4358,6 +4906,7 @@ while(next_section[0] != 0)
     }
   }
 
+snap_write();
 (void)fclose(config_file);
 }
 
@@ -145,6 +145,10 @@ Returns:        available on-root space, in kilobytes
 All values are -1 if the STATFS functions are not available.
 */
 
+#ifdef HAVE_STATFS
+static const uschar * spool_stripe_path = NULL;	/* while checking stripes */
+#endif
+
 int_eximarith_t
 receive_statvfs(BOOL isspool, int *inodeptr)
 {
@@ -155,11 +159,31 @@ uschar *path;
 uschar *name;
 uschar buffer[1024];
 
-/* The spool directory must always exist. */
+/* The spool directory must always exist. When messages are spread over
+spool_stripes, report the smallest figures among those directories. */
 
 if (isspool)
   {
-  path = spool_directory;
+  if (spool_stripe_count > 0 && !spool_stripe_path)
+    {
+    int_eximarith_t space = -1;
+    int inodes = -1;
+
+    for (int i = 0; i < spool_stripe_count; i++)
+      {
+      int_eximarith_t sp;
+      int in;
+
+      spool_stripe_path = spool_stripe_dirs[i];
+      sp = receive_statvfs(TRUE, &in);
+      if (sp >= 0 && (space < 0 || sp < space)) space = sp;
+      if (in >= 0 && (inodes < 0 || in < inodes)) inodes = in;
+      }
+    spool_stripe_path = NULL;
+    *inodeptr = inodes;
+    return space;
+    }
+  path = spool_stripe_path ? US spool_stripe_path : spool_directory;
   name = US"spool";
   }
 
@@ -780,6 +804,32 @@ return END_EOF;
 
 
 
+/*************************************************
+*      Return unused input to the SMTP layer     *
+*************************************************/
+
+/* When read_message_data_smtp() takes its input a block at a time, whatever
+is left over when it stops (normally, commands pipelined after the terminating
+dot) is handed back, so that it is there for reading the next command. As the
+block has not been refilled, this just steps back over it.
+
+Arguments:
+  rc        the value to return
+  ptr       start of the unused input
+  end       end of the block
+
+Returns:    rc
+*/
+
+static int
+data_smtp_unget(int rc, const uschar * ptr, const uschar * end)
+{
+while (end > ptr) (receive_ungetc)(*--end);
+return rc;
+}
+
+
+
 /*************************************************
 *      Read data portion of an SMTP message      *
 *************************************************/
@@ -806,15 +856,62 @@ Arguments:
 Returns:    One of the END_xxx values indicating why it stopped reading
 */
 
-static int
+int
 read_message_data_smtp(FILE *fout)
 {
 int ch_state = 0;
 int ch;
 int linelength = 0;
+uschar * ptr = NULL, * end = NULL;	/* Block of input, if in use */
 
-while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) != EOF)
+for (;;)
   {
+  /* Where the input layer supports it, take the input a block at a time.
+  In the middle of a line, everything as far as the next LF, CR or binary zero
+  needs no attention, so that run is copied in one go; the state machine is
+  then used for the character that ends it. */
+
+  if (receive_getbuf)
+    {
+    if (ptr >= end)
+      {
+      unsigned len = GETC_BUFFER_UNLIMITED;
+      if (!(ptr = (receive_getbuf)(&len))) break;
+      end = ptr + len;
+      }
+
+    if (ch_state == 1)
+      {
+      uschar * e, * s;
+      int n;
+
+      if (!(e = memchr(ptr, '\n', end - ptr))) e = end;
+      if ((s = memchr(ptr, '\r', e - ptr))) e = s;
+      if ((s = memchr(ptr, 0, e - ptr))) e = s;
+      if (fout && e - ptr > thismessage_size_limit - message_size)
+	e = ptr + (thismessage_size_limit - message_size) + 1;
+
+      if ((n = e - ptr) > 0)
+	{
+	message_size += n;
+	linelength += n;
+	if (fout)
+	  {
+	  if (fwrite(ptr, 1, n, fout) != n)
+	    return data_smtp_unget(END_WERROR, e, end);
+	  if (message_size > thismessage_size_limit)
+	    return data_smtp_unget(END_SIZE, e, end);
+	  }
+	cutthrough_data_puts(ptr, n);
+	ptr = e;
+	continue;
+	}
+      }
+    ch = *ptr++;
+    }
+  else if ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) == EOF)
+    break;
+
   if (ch == 0) body_zerocount++;
   switch (ch_state)
     {
@@ -856,7 +953,8 @@ while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) != EOF)
     else
       {
       message_size++;
-      if (fout != NULL && fputc('\n', fout) == EOF) return END_WERROR;
+      if (fout != NULL && fputc('\n', fout) == EOF)
+        return data_smtp_unget(END_WERROR, ptr, end);
       cutthrough_data_put_nl();
       if (ch != '\r') ch_state = 1; else continue;
       }
@@ -864,7 +962,7 @@ while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) != EOF)
 
     case 3:                             /* After [CR] LF . */
     if (ch == '\n')
-      return END_DOT;
+      return data_smtp_unget(END_DOT, ptr, end);
     if (ch == '\r')
       {
       ch_state = 4;
@@ -882,10 +980,11 @@ while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) != EOF)
     break;
 
     case 4:                             /* After [CR] LF . CR */
-    if (ch == '\n') return END_DOT;
+    if (ch == '\n') return data_smtp_unget(END_DOT, ptr, end);
     message_size++;
     body_linecount++;
-    if (fout != NULL && fputc('\n', fout) == EOF) return END_WERROR;
+    if (fout != NULL && fputc('\n', fout) == EOF)
+      return data_smtp_unget(END_WERROR, ptr, end);
     cutthrough_data_put_nl();
     if (ch == '\r')
       {
@@ -903,8 +1002,10 @@ while ((ch = (receive_getc)(GETC_BUFFER_UNLIMITED)) != EOF)
   linelength++;
   if (fout)
     {
-    if (fputc(ch, fout) == EOF) return END_WERROR;
-    if (message_size > thismessage_size_limit) return END_SIZE;
+    if (fputc(ch, fout) == EOF)
+      return data_smtp_unget(END_WERROR, ptr, end);
+    if (message_size > thismessage_size_limit)
+      return data_smtp_unget(END_SIZE, ptr, end);
     }
   if(ch == '\n')
     cutthrough_data_put_nl();
@@ -931,6 +1032,92 @@ body_linecount accounting for proper re-expansion for the wire, so use
 a cut-down version of the state-machine above; we don't need to do leading-dot
 detection and unstuffing.
 
+This is the per-character part of the state machine.
+
+Arguments:
+  fout      a FILE to which to write the message; NULL if skipping
+  ch        the character
+  statep    the line-ending state
+  linelenp  the length of the current line
+  fix_nl    TRUE if supplying a missing line-ending at the end of the data
+
+Returns:    END_NOTENDED, or one of the other END_xxx values if reading
+            should stop
+*/
+
+static int
+bdat_put_char(FILE * fout, int ch, enum CH_STATE * statep, int * linelenp,
+  BOOL fix_nl)
+{
+if (ch == '\0') body_zerocount++;
+
+switch (*statep)
+  {
+  case LF_SEEN:                             /* After LF or CRLF */
+    *statep = MID_LINE;
+    /* fall through to handle as normal uschar. */
+
+  case MID_LINE:                            /* Mid-line state */
+    if (ch == '\n')
+      {
+      *statep = LF_SEEN;
+      body_linecount++;
+      if (*linelenp > max_received_linelength)
+	max_received_linelength = *linelenp;
+      *linelenp = -1;
+      }
+    else if (ch == '\r')
+      {
+      *statep = CR_SEEN;
+      if (fix_nl) bdat_ungetc('\n');
+      return END_NOTENDED;		/* don't write CR */
+      }
+    break;
+
+  case CR_SEEN:                       /* After (unwritten) CR */
+    body_linecount++;
+    if (*linelenp > max_received_linelength)
+      max_received_linelength = *linelenp;
+    *linelenp = -1;
+    if (ch == '\n')
+      *statep = LF_SEEN;
+    else
+      {
+      message_size++;
+      if (fout && fputc('\n', fout) == EOF) return END_WERROR;
+      cutthrough_data_put_nl();
+      if (ch == '\r') return END_NOTENDED;	/* don't write CR */
+      *statep = MID_LINE;
+      }
+    break;
+  }
+
+/* Add the character to the spool file, unless skipping */
+
+message_size++;
+(*linelenp)++;
+if (fout)
+  {
+  if (fputc(ch, fout) == EOF) return END_WERROR;
+  if (message_size > thismessage_size_limit) return END_SIZE;
+  }
+if(ch == '\n')
+  cutthrough_data_put_nl();
+else
+  {
+  uschar c = ch;
+  cutthrough_data_puts(&c, 1);
+  }
+return END_NOTENDED;
+}
+
+
+/* Read the body of a CHUNKING message. The declared data of each chunk is
+taken a buffer at a time; runs of bytes without line-ending characters are
+written as blocks, and only the line-endings go through the state machine
+above. The BDAT commands between chunks, and the end of the data, are handled
+a character at a time via bdat_getc().
+
 Arguments:
   fout      a FILE to which to write the message; NULL if skipping;
             must be open for both writing and reading.
@@ -941,12 +1128,47 @@ Returns:    One of the END_xxx values indicating why it stopped reading
 static int
 read_message_bdat_smtp(FILE *fout)
 {
-int linelength = 0, ch;
+int linelength = 0, ch, rc;
 enum CH_STATE ch_state = LF_SEEN;
 BOOL fix_nl = FALSE;
 
 for(;;)
   {
+  if (chunking_data_left > 0 && !fix_nl)
+    {
+    unsigned len = chunking_data_left;
+    uschar * buf = bdat_getbuf(&len);
+
+    if (!buf) return END_EOF;
+    for (uschar * s = buf, * e = buf + len; s < e; )
+      {
+      if (ch_state != CR_SEEN)
+	{
+	uschar * p = s;
+	int n;
+
+	while (p < e && *p != '\r' && *p != '\n' && *p) p++;
+	if ((n = p - s) > 0)
+	  {
+	  message_size += n;
+	  linelength += n;
+	  if (fout)
+	    {
+	    if (fwrite(s, 1, n, fout) != n) return END_WERROR;
+	    if (message_size > thismessage_size_limit) return END_SIZE;
+	    }
+	  cutthrough_data_puts(s, n);
+	  ch_state = MID_LINE;
+	  if ((s = p) >= e) break;
+	  }
+	}
+      if ((rc = bdat_put_char(fout, *s++, &ch_state, &linelength, FALSE))
+	  != END_NOTENDED)
+	return rc;
+      }
+    continue;
+    }
+
   switch ((ch = bdat_getc(GETC_BUFFER_UNLIMITED)))
     {
     case EOF:	return END_EOF;
@@ -981,65 +1203,10 @@ for(;;)
       fix_nl = TRUE;
 
       continue;
-    case '\0':  body_zerocount++; break;
-    }
-  switch (ch_state)
-    {
-    case LF_SEEN:                             /* After LF or CRLF */
-      ch_state = MID_LINE;
-      /* fall through to handle as normal uschar. */
-
-    case MID_LINE:                            /* Mid-line state */
-      if (ch == '\n')
-	{
-	ch_state = LF_SEEN;
-	body_linecount++;
-	if (linelength > max_received_linelength)
-	  max_received_linelength = linelength;
-	linelength = -1;
-	}
-      else if (ch == '\r')
-	{
-	ch_state = CR_SEEN;
-       if (fix_nl) bdat_ungetc('\n');
-	continue;			/* don't write CR */
-	}
-      break;
-
-    case CR_SEEN:                       /* After (unwritten) CR */
-      body_linecount++;
-      if (linelength > max_received_linelength)
-	max_received_linelength = linelength;
-      linelength = -1;
-      if (ch == '\n')
-	ch_state = LF_SEEN;
-      else
-	{
-	message_size++;
-	if (fout && fputc('\n', fout) == EOF) return END_WERROR;
-	cutthrough_data_put_nl();
-	if (ch == '\r') continue;	/* don't write CR */
-	ch_state = MID_LINE;
-	}
-      break;
-    }
-
-  /* Add the character to the spool file, unless skipping */
-
-  message_size++;
-  linelength++;
-  if (fout)
-    {
-    if (fputc(ch, fout) == EOF) return END_WERROR;
-    if (message_size > thismessage_size_limit) return END_SIZE;
-    }
-  if(ch == '\n')
-    cutthrough_data_put_nl();
-  else
-    {
-    uschar c = ch;
-    cutthrough_data_puts(&c, 1);
     }
+  if ((rc = bdat_put_char(fout, ch, &ch_state, &linelength, fix_nl))
+      != END_NOTENDED)
+    return rc;
   }
 /*NOTREACHED*/
 }
@@ -1048,12 +1215,16 @@ static int
 read_message_bdat_smtp_wire(FILE *fout)
 {
 int ch;
+BOOL at_line_start = TRUE, dotfree = TRUE;
 
-/* Remember that this message uses wireformat. */
+/* Remember that this message uses wireformat. Also note whether no line of
+the body starts with a dot, and the body ends with a newline; if so, the -D
+file can be copied as it stands when sending with DATA as well as with BDAT. */
 
 DEBUG(D_receive) debug_printf("CHUNKING: %s\n",
 	fout ? "writing spoolfile in wire format" : "flushing input");
 f.spool_file_wireformat = TRUE;
+f.spool_file_dotfree = FALSE;
 
 for (;;)
   {
@@ -1065,11 +1236,23 @@ for (;;)
     if (!buf) return END_EOF;
     message_size += len;
     if (fout && fwrite(buf, len, 1, fout) != 1) return END_WERROR;
+
+    if (dotfree && len > 0)
+      {
+      if (at_line_start && *buf == '.')
+	dotfree = FALSE;
+      else
+	for (uschar * s = buf, * e = buf + len - 1;
+	     s < e && (s = memchr(s, '\n', e - s)); )
+	  if (*++s == '.') { dotfree = FALSE; break; }
+      at_line_start = buf[len-1] == '\n';
+      }
     }
   else switch (ch = bdat_getc(GETC_BUFFER_UNLIMITED))
     {
     case EOF: return END_EOF;
-    case EOD: return END_DOT;
+    case EOD: f.spool_file_dotfree = dotfree && at_line_start;
+	      return END_DOT;
     case ERR: return END_PROTOCOL;
 
     default:
@@ -1081,6 +1264,8 @@ for (;;)
   body_zerocount
   */
       if (fout && fputc(ch, fout) == EOF) return END_WERROR;
+      if (at_line_start && ch == '.') dotfree = FALSE;
+      at_line_start = ch == '\n';
       break;
     }
   if (message_size > thismessage_size_limit) return END_SIZE;
@@ -1308,6 +1493,7 @@ for (header_line * h = acl_added_headers, * next; h; h = next)
   }
 
 acl_added_headers = NULL;
+header_index_reset();
 DEBUG(D_receive|D_acl) debug_printf_indent(">>\n");
 }
 
@@ -1513,6 +1699,113 @@ return TRUE;
 
 
 
+#if defined(EXPERIMENTAL_ARC) || defined(SUPPORT_DMARC)
+/*************************************************
+*     Send the authentication queries early      *
+*************************************************/
+
+/* ARC verification looks up its keys only when the whole message has been
+read, and DMARC then looks up its policy record, each query waiting for the
+one before. When dns_parallel_lookups is set, the names they will need are
+worked out from the header lines as soon as these are complete, and the
+queries are sent together by dns_prefetch(), so that the later lookups find
+the answers in the DNS cache and their results are as they would have been.
+Only the values of the d= and s= tags are needed from the signatures. The keys
+for DKIM-Signature: headers are prefetched by pdkim itself, under the
+fully-qualified names it uses for the lookups.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+#define AUTH_PREFETCH_MAX 32
+
+static void
+receive_auth_prefetch(void)
+{
+const uschar * names[AUTH_PREFETCH_MAX];
+int types[AUTH_PREFETCH_MAX];
+int n = 0;
+
+for (header_line * h = header_list; h && n < AUTH_PREFETCH_MAX; h = h->next)
+  {
+  const uschar * s;
+  uschar * d = NULL, * sel = NULL;
+
+  if (h->type == htype_old) continue;
+
+#ifdef EXPERIMENTAL_ARC
+  if (  !f.dkim_disable_verify
+     && (  strncmpic(h->text, US"ARC-Seal:", 9) == 0
+	|| strncmpic(h->text, US"ARC-Message-Signature:", 22) == 0
+     )  )
+    {
+    /* Walk the tag list, keeping the values of d= and s= with any folding
+    whitespace removed. */
+
+    for (s = Ustrchr(h->text, ':') + 1; *s; )
+      {
+      const uschar * tag;
+      gstring * g = NULL;
+
+      while (isspace(*s)) s++;
+      tag = s;
+      while (*s && *s != '=' && *s != ';' && !isspace(*s)) s++;
+      if (s - tag != 1) tag = US"";
+      while (isspace(*s)) s++;
+      if (*s == '=')
+	for (s++; *s && *s != ';'; s++)
+	  if (!isspace(*s)) g = string_catn(g, s, 1);
+      if (*s == ';') s++;
+
+      if (g && (*tag == 'd' || *tag == 's'))
+	{
+	(void) string_from_gstring(g);
+	if (*tag == 'd') d = g->s; else sel = g->s;
+	}
+      }
+    if (d && sel)
+      {
+      names[n] = string_sprintf("%s._domainkey.%s", sel, d);
+      types[n++] = T_TXT;
+      }
+    }
+#endif
+
+#ifdef SUPPORT_DMARC
+  if (  !f.dmarc_disable_verify
+     && strncmpic(h->text, US"From:", 5) == 0 && sender_host_address)
+    {
+    uschar * errormsg, * p = h->text + 5, * addr;
+    int dummy, domain;
+    uschar saveend;
+
+    f.parse_allow_group = TRUE;
+    p = parse_find_address_end(p, FALSE);
+    saveend = *p; *p = '\0';
+    addr = parse_extract_address(h->text + 5, &errormsg, &dummy, &dummy,
+	      &domain, FALSE);
+    *p = saveend;
+    f.parse_allow_group = FALSE;
+    f.parse_found_group = FALSE;
+    if (addr && domain > 0)
+      {
+      names[n] = string_sprintf("_dmarc.%s", addr + domain);
+      types[n++] = T_TXT;
+      }
+    }
+#endif
+  }
+
+if (n < 2) return;
+DEBUG(D_receive) debug_printf("sending %d authentication queries together\n", n);
+dns_init(FALSE, FALSE, FALSE);
+dns_prefetch(names, types, n);
+}
+#endif
+
+
+
 void
 received_header_gen(void)
 {
@@ -1558,6 +1851,221 @@ DEBUG(D_receive) debug_printf(">>Generated Received: header line\n%c %s",
 
 
 
+#ifndef DISABLE_PRDR
+/*************************************************
+*   Run the PRDR ACL in parallel subprocesses    *
+*************************************************/
+
+/* With prdr_max_parallel above 1, the per-recipient PRDR ACL is run in
+subprocesses, up to that many at once, so that slow checks for different
+recipients overlap. Each subprocess passes back the ACL's return code and
+messages through a pipe, and the results are collected in recipient order for
+the caller to send the responses as before. Anything else the ACL does, such as
+setting ACL variables or adding header lines, is lost with the subprocess.
+
+Output to the client is flushed before any subprocess is started, so that none
+of them has a copy of pending responses to send again. Each subprocess then
+writes SMTP output only to /dev/null, and forgets any incoming TLS session, so
+that nothing it does (a "delay" flushes output, for example) can reach the
+client or disturb the session's state.
+
+Arguments:
+  count      the number of recipients
+  rcs        where to put the return codes
+  user_msgs  where to put the user messages
+  log_msgs   where to put the log messages
+
+Returns:     nothing
+*/
+
+/* Pass a message string, which may be NULL, through the pipe */
+
+static BOOL
+prdr_put_string(int fd, const uschar * s)
+{
+int len = s ? Ustrlen(s) : -1;
+return write(fd, &len, sizeof(int)) == sizeof(int)
+  && (len <= 0 || write(fd, s, len) == len);
+}
+
+static uschar *
+prdr_get_string(int fd)
+{
+int len;
+uschar * s;
+
+if (  read(fd, &len, sizeof(int)) != sizeof(int)
+   || len < 0 || len > 64*1024)
+  return NULL;
+s = store_get(len + 1, TRUE);
+if (len > 0 && read(fd, s, len) != len) return NULL;
+s[len] = '\0';
+return s;
+}
+
+static void
+prdr_acl_parallel(int count, int * rcs, uschar ** user_msgs,
+  uschar ** log_msgs)
+{
+int max = MIN(prdr_max_parallel, count);
+pid_t * pids = store_get(max * sizeof(pid_t), FALSE);
+int * fds = store_get(max * sizeof(int), FALSE);
+int started = 0;
+
+if (smtp_out) (void) smtp_fflush();
+
+#ifdef WITH_CONTENT_SCAN
+/* Make the scan file now, rather than have each subprocess that scans the
+message try to make it at the same time. spool_mbox() does nothing more than
+open it if it has already been made. */
+
+  {
+  unsigned long mbox_size;
+  FILE * mbox_file = spool_mbox(&mbox_size, NULL, NULL);
+  if (mbox_file) (void)fclose(mbox_file);
+  }
+#endif
+
+for (int done = 0; done < count; done++)
+  {
+  int slot;
+
+  /* Keep up to max subprocesses running, started in recipient order */
+
+  for ( ; started < count && started < done + max; started++)
+    {
+    int pfd[2];
+    slot = started % max;
+    pids[slot] = -1;
+    if (pipe(pfd) != 0) continue;
+
+    if ((pids[slot] = exim_fork(US"prdr-acl")) == 0)
+      {
+      uschar * user_msg, * log_msg;
+      int rc;
+
+      (void)close(pfd[pipe_read]);
+#ifndef DISABLE_TLS
+      tls_in.active.sock = -1;
+      tls_in.active.tls_ctx = NULL;
+#endif
+      if (smtp_out && !(smtp_out = Ufopen("/dev/null", "wb")))
+	exim_underbar_exit(EXIT_FAILURE);
+      rc = acl_check(ACL_WHERE_PRDR, recipients_list[started].address,
+		      acl_smtp_data_prdr, &user_msg, &log_msg);
+      (void)(  write(pfd[pipe_write], &rc, sizeof(int)) == sizeof(int)
+	    && prdr_put_string(pfd[pipe_write], user_msg)
+	    && prdr_put_string(pfd[pipe_write], log_msg));
+      exim_underbar_exit(EXIT_SUCCESS);
+      }
+
+    (void)close(pfd[pipe_write]);
+    if (pids[slot] < 0)
+      (void)close(pfd[pipe_read]);
+    else
+      fds[slot] = pfd[pipe_read];
+    }
+
+  /* Collect the results for the earliest outstanding recipient. If its
+  subprocess could not be started, or gave no result, run the ACL here. */
+
+  slot = done % max;
+  user_msgs[done] = log_msgs[done] = NULL;
+  if (pids[slot] > 0)
+    {
+    int fd = fds[slot], rc;
+    BOOL ok = read(fd, &rc, sizeof(int)) == sizeof(int);
+
+    if (ok)
+      {
+      rcs[done] = rc;
+      user_msgs[done] = prdr_get_string(fd);
+      log_msgs[done] = prdr_get_string(fd);
+      }
+    (void)close(fd);
+    (void)child_close(pids[slot], 0);
+    if (ok) continue;
+    }
+
+  DEBUG(D_receive) debug_printf("PRDR recipient %s: checking in this process\n",
+    recipients_list[done].address);
+  rcs[done] = acl_check(ACL_WHERE_PRDR, recipients_list[done].address,
+    acl_smtp_data_prdr, &user_msgs[done], &log_msgs[done]);
+  }
+}
+#endif	/*!DISABLE_PRDR*/
+
+
+
+/*************************************************
+*        Sequenced message id time slots         *
+*************************************************/
+
+/* When message_id_sequence is set, the time used for the final fields of a
+message id is a slot at the id resolution that is never reused by a process: it
+is the current slot, or the one after the last one this process used if that is
+later. So a fast SMTP session can take one slot per message without waiting for
+the clock to tick. The slots may run ahead of the clock, so before a process
+that has used them goes away (after which its pid can be reused), it waits
+until the clock has passed the last one; for a process that isn't receiving
+faster than the clock there is nothing to wait for.
+
+The pid is remembered with the slot so that forked children neither continue
+their parent's sequence nor wait for it.
+
+Arguments:
+  tv          the current time; updated to the slot to use
+  resolution  the length of a slot, in microseconds
+
+Returns:      nothing
+*/
+
+static struct timeval message_id_slot = { 0, 0 };
+static int message_id_slot_resolution = 0;
+static pid_t message_id_slot_pid = 0;
+
+static void
+message_id_next_slot(struct timeval * tv, int resolution)
+{
+pid_t pid = getpid();
+
+tv->tv_usec = (tv->tv_usec/resolution) * resolution;
+if (  pid == message_id_slot_pid
+   && resolution == message_id_slot_resolution
+   && (  tv->tv_sec < message_id_slot.tv_sec
+      || tv->tv_sec == message_id_slot.tv_sec
+	 && tv->tv_usec <= message_id_slot.tv_usec))
+  {
+  *tv = message_id_slot;
+  if ((tv->tv_usec += resolution) >= 1000000)
+    {
+    tv->tv_usec = 0;
+    tv->tv_sec++;
+    }
+  DEBUG(D_receive) debug_printf("message id slot %ld.%06ld is ahead of the"
+    " clock\n", (long)tv->tv_sec, (long)tv->tv_usec);
+  }
+message_id_slot = *tv;
+message_id_slot_resolution = resolution;
+message_id_slot_pid = pid;
+}
+
+
+/* Called before the process exits; waits if the last slot used is still in
+the future. */
+
+void
+receive_message_id_wait(void)
+{
+if (message_id_slot_pid == getpid())
+  {
+  exim_wait_tick(&message_id_slot, message_id_slot_resolution);
+  message_id_slot_pid = 0;
+  }
+}
+
+
+
 /*************************************************
 *                 Receive message                *
 *************************************************/
@@ -1661,6 +2169,8 @@ int  start, end, domain;
 int  id_resolution = 0;
 int  had_zero = 0;
 int  prevlines_length = 0;
+struct timeval phase_start;
+struct timeval commit_start;
 
 int ptr = 0;
 
@@ -1720,6 +2230,13 @@ accept the message - e.g. by verifying addresses - because reading a message
 might take a fair bit of real time. */
 
 search_tidyup();
+if (smtp_input) gettimeofday(&phase_start, NULL);
+
+/* For SMTP the resource usage of a message is counted from its MAIL command,
+so as to include the ACLs run for it; for anything else, start here. */
+
+if (LOGGING(resource_usage) && (!smtp_input || smtp_batched_input))
+  getrusage(RUSAGE_SELF, &message_rusage_start);
 
 /* Extracting the recipient list from an input file is incompatible with
 cutthrough delivery with the no-spool option.  It shouldn't be possible
@@ -1736,6 +2253,7 @@ header_list->next = NULL;
 header_list->type = htype_old;
 header_list->text = NULL;
 header_list->slen = 0;
+header_index_reset();
 
 /* Control block for the next header to be read. */
 
@@ -1767,6 +2285,7 @@ message_linecount = body_linecount = body_zerocount =
 mime_is_coverletter    = 0;
 mime_is_rfc822         = 0;
 mime_part_count        = -1;
+mime_part_hashes       = NULL;
 #endif
 
 #ifndef DISABLE_DKIM
@@ -2589,7 +3108,7 @@ if (extract_recip)
 
         else if (recipient != NULL)
           {
-          if (tree_search(tree_nonrecipients, recipient) == NULL)
+          if (tree_hash_search(&tree_nonrecipients, recipient) == NULL)
             receive_add_recipient(recipient, -1);
           else
             extracted_ignored = TRUE;
@@ -2664,32 +3183,40 @@ must also be changed to reflect the correct string length. The queue-sort code
 needs to know the layout. Then, of course, other programs that rely on the
 message id format will need updating too. */
 
-Ustrncpy(message_id, string_base62((long int)(message_id_tv.tv_sec)), 6);
-message_id[6] = '-';
-Ustrncpy(message_id + 7, string_base62((long int)getpid()), 6);
-
-/* Deal with the case where the host number is set. The value of the number was
-checked when it was read, to ensure it isn't too big. The timing granularity is
+/* The timing granularity depends on whether the host number is set. It is
 left in id_resolution so that an appropriate wait can be done after receiving
-the message, if necessary (we hope it won't be). */
+the message, if necessary (we hope it won't be). With message_id_sequence the
+id is made from the next unused time slot instead, and no wait is needed. */
 
-if (host_number_string)
   {
-  id_resolution = BASE_62 == 62 ? 5000 : 10000;
-  sprintf(CS(message_id + MESSAGE_ID_LENGTH - 3), "-%2s",
-    string_base62((long int)(
-      host_number * (1000000/id_resolution) +
-        message_id_tv.tv_usec/id_resolution)) + 4);
-  }
+  struct timeval id_tv = message_id_tv;
+  int res = host_number_string
+    ? BASE_62 == 62 ? 5000 : 10000
+    : BASE_62 == 62 ? 500 : 1000;
 
-/* Host number not set: final field is just the fractional time at an
-appropriate resolution. */
+  if (message_id_sequence)
+    message_id_next_slot(&id_tv, res);
+  else
+    id_resolution = res;
 
-else
-  {
-  id_resolution = BASE_62 == 62 ? 500 : 1000;
-  sprintf(CS(message_id + MESSAGE_ID_LENGTH - 3), "-%2s",
-    string_base62((long int)(message_id_tv.tv_usec/id_resolution)) + 4);
+  Ustrncpy(message_id, string_base62((long int)(id_tv.tv_sec)), 6);
+  message_id[6] = '-';
+  Ustrncpy(message_id + 7, string_base62((long int)getpid()), 6);
+
+  /* Deal with the case where the host number is set. The value of the number
+  was checked when it was read, to ensure it isn't too big. */
+
+  if (host_number_string)
+    sprintf(CS(message_id + MESSAGE_ID_LENGTH - 3), "-%2s",
+      string_base62((long int)(
+	host_number * (1000000/res) + id_tv.tv_usec/res)) + 4);
+
+  /* Host number not set: final field is just the fractional time at an
+  appropriate resolution. */
+
+  else
+    sprintf(CS(message_id + MESSAGE_ID_LENGTH - 3), "-%2s",
+      string_base62((long int)(id_tv.tv_usec/res)) + 4);
   }
 
 /* Add the current message id onto the current process info string if
@@ -3075,6 +3602,11 @@ if (cutthrough.cctx.sock >= 0 && cutthrough.delivery)
   }
 
 
+#if defined(EXPERIMENTAL_ARC) || defined(SUPPORT_DMARC)
+if (dns_parallel_lookups && smtp_input && !smtp_batched_input)
+  receive_auth_prefetch();
+#endif
+
 /* Open a new spool file for the data portion of the message. We need
 to access it both via a file descriptor and a stream. Try to make the
 directory if it isn't there. */
@@ -3086,7 +3618,7 @@ if ((data_fd = Uopen(spool_name, O_RDWR|O_CREAT|O_EXCL, SPOOL_MODE)) < 0)
   {
   if (errno == ENOENT)
     {
-    (void) directory_make(spool_directory,
+    (void) directory_make(spool_root(message_id),
 		        spool_sname(US"input", message_subdir),
 			INPUT_DIRECTORY_MODE, TRUE);
     data_fd = Uopen(spool_name, O_RDWR|O_CREAT|O_EXCL, SPOOL_MODE);
@@ -3230,9 +3762,24 @@ having to do this). If there was an I/O error on either input or output,
 attempt to send an error message, and unlink the spool file. For non-SMTP input
 we can then give up. Note that for SMTP input we must swallow the remainder of
 the input in cases of output errors, since the far end doesn't expect to see
-anything until the terminating dot line is sent. */
+anything until the terminating dot line is sent. When io_uring is in use, the
+sync of the data file is done later, together with the header file's. When the
+file is replaced by a link to an identical one already on the spool (see
+spool_dedup_min_size), it needs no sync. */
+
+if (smtp_input)
+  {
+  smtp_phase_time(SMTP_PHASE_DATA_READ, &phase_start);
+  gettimeofday(&phase_start, NULL);
+  }
+
+if (LOGGING(spool_commit_time)) gettimeofday(&commit_start, NULL);
 
 if (fflush(spool_data_file) == EOF || ferror(spool_data_file) ||
+    !spool_dedup_link(fileno(spool_data_file), spool_name) &&
+#ifdef SUPPORT_IO_URING
+    !spool_uring_defer_data_sync() &&
+#endif
     EXIMfsync(fileno(spool_data_file)) < 0 || (receive_ferror)())
   {
   uschar *msg_errno = US strerror(errno);
@@ -3271,8 +3818,11 @@ if (fflush(spool_data_file) == EOF || ferror(spool_data_file) ||
 
 /* No I/O errors were encountered while writing the data file. */
 
+if (smtp_input) smtp_phase_time(SMTP_PHASE_SPOOL_DATA, &phase_start);
+
 DEBUG(D_receive) debug_printf("Data file written for message %s\n", message_id);
 if (LOGGING(receive_time)) timesince(&received_time_taken, &received_time);
+if (LOGGING(spool_commit_time)) timesince(&spool_commit_taken, &commit_start);
 
 
 /* If there were any bad addresses extracted by -t, or there were no recipients
@@ -3408,6 +3958,11 @@ else
       /* Finish verification */
       dkim_exim_verify_finish();
 
+      /* Body hashes from the SMTP input do not match the spool data file
+      if a line taken as a header there was stored as the start of the body */
+
+      if (next) dkim_bodyhashes = NULL;
+
       /* Check if we must run the DKIM ACL */
       if (acl_smtp_dkim && dkim_verify_signers && *dkim_verify_signers)
         {
@@ -3515,10 +4070,25 @@ else
       {
       int all_pass = OK;
       int all_fail = FAIL;
+      int * prdr_rcs = NULL;
+      uschar ** prdr_user_msgs, ** prdr_log_msgs;
 
       smtp_printf("353 PRDR content analysis beginning\r\n", TRUE);
+
+      /* Run the ACLs for all the recipients first, if they may be run in
+      parallel. The results are indexed by the original recipient position. */
+
+      if (prdr_max_parallel > 1)
+	{
+	prdr_rcs = store_get(recipients_count * sizeof(int), FALSE);
+	prdr_user_msgs = store_get(recipients_count * sizeof(uschar *), FALSE);
+	prdr_log_msgs = store_get(recipients_count * sizeof(uschar *), FALSE);
+	prdr_acl_parallel(recipients_count, prdr_rcs, prdr_user_msgs,
+	  prdr_log_msgs);
+	}
+
       /* Loop through recipients, responses must be in same order received */
-      for (unsigned int c = 0; recipients_count > c; c++)
+      for (unsigned int c = 0, r = 0; recipients_count > c; c++, r++)
         {
 	uschar * addr= recipients_list[c].address;
 	uschar * msg= US"PRDR R=<%s> %s";
@@ -3526,8 +4096,15 @@ else
         DEBUG(D_receive)
           debug_printf("PRDR processing recipient %s (%d of %d)\n",
                        addr, c+1, recipients_count);
-        rc = acl_check(ACL_WHERE_PRDR, addr,
-                       acl_smtp_data_prdr, &user_msg, &log_msg);
+	if (prdr_rcs)
+	  {
+	  rc = prdr_rcs[r];
+	  user_msg = prdr_user_msgs[r];
+	  log_msg = prdr_log_msgs[r];
+	  }
+	else
+	  rc = acl_check(ACL_WHERE_PRDR, addr,
+			 acl_smtp_data_prdr, &user_msg, &log_msg);
 
         /* If any recipient rejected content, indicate it in final message */
         all_pass |= rc;
@@ -3719,6 +4296,8 @@ if (sigsetjmp(local_scan_env, 1) == 0)
   os_non_restarting_signal(SIGALRM, sigalrm_handler);
 
   f.enable_dollar_recipients = FALSE;
+  header_index_reset();		/* local_scan() may have edited the chain */
+  lss_body_unmap();
 
   store_pool = POOL_MAIN;   /* In case changed */
   DEBUG(D_receive) debug_printf("local_scan() returned %d %s\n", rc,
@@ -3918,7 +4497,23 @@ if (host_checking || blackholed_by)
 /* Write the -H file */
 
 else
-  if ((msg_size = spool_write_header(message_id, SW_RECEIVING, &errmsg)) < 0)
+  {
+  if (smtp_input) gettimeofday(&phase_start, NULL);
+  if (LOGGING(spool_commit_time)) gettimeofday(&commit_start, NULL);
+  msg_size = spool_write_header(message_id, SW_RECEIVING, &errmsg);
+  if (smtp_input) smtp_phase_time(SMTP_PHASE_SPOOL_HEADER, &phase_start);
+  if (LOGGING(spool_commit_time))
+    {
+    struct timeval t;
+    timesince(&t, &commit_start);
+    spool_commit_taken.tv_sec += t.tv_sec;
+    if ((spool_commit_taken.tv_usec += t.tv_usec) >= 1000000)
+      {
+      spool_commit_taken.tv_sec++;
+      spool_commit_taken.tv_usec -= 1000000;
+      }
+    }
+  if (msg_size < 0)
     {
     log_write(0, LOG_MAIN, "Message abandoned: %s", errmsg);
     Uunlink(spool_name);           /* Lose the data file */
@@ -3937,6 +4532,8 @@ else
       /* Does not return */
       }
     }
+  spool_dedup_store();
+  }
 
 
 /* The message has now been successfully received. */
@@ -3999,6 +4596,8 @@ if (LOGGING(tls_cipher) && tls_in.cipher)
     g = string_catn(g, US"*", 1);
 # endif
   }
+if (LOGGING(tls_ktls) && tls_in.ktls)
+  g = string_append(g, 2, US" KTLS=", tls_ktls_name(tls_in.ktls));
 if (LOGGING(tls_certificate_verified) && tls_in.cipher)
   g = string_append(g, 2, US" CV=", tls_in.certificate_verified ? "yes":"no");
 if (LOGGING(tls_peerdn) && tls_in.peerdn)
@@ -4052,6 +4651,16 @@ if (LOGGING(dkim) && arc_state && Ustrcmp(arc_state, "pass") == 0)
 if (LOGGING(receive_time))
   g = string_append(g, 2, US" RT=", string_timediff(&received_time_taken));
 
+if (LOGGING(spool_commit_time))
+  g = string_append(g, 2, US" SC=", string_timediff(&spool_commit_taken));
+
+if (LOGGING(resource_usage))
+  {
+  struct rusage ru;
+  rusage_since(&ru, &message_rusage_start);
+  g = string_rusage(g, &ru);
+  }
+
 if (*queue_name)
   g = string_append(g, 2, US" Q=", queue_name);
 
@@ -4117,7 +4726,7 @@ if (message_logs && !blackholed_by)
      && errno == ENOENT
      )
     {
-    (void)directory_make(spool_directory,
+    (void)directory_make(spool_root(message_id),
 			spool_sname(US"msglog", message_subdir),
 			MSGLOG_DIRECTORY_MODE, TRUE);
     fd = Uopen(m_name, O_WRONLY|O_APPEND|O_CREAT, SPOOL_MODE);
@@ -4212,7 +4821,10 @@ if (smtp_input && sender_host_address && !f.sender_host_notsocket &&
   }
 
 /* The connection has not gone away; we really are going to take responsibility
-for this message. */
+for this message. Tell the daemon, for its queue index. */
+
+if (!host_checking && !blackholed_by)
+  queue_index_notify(NOTIFY_QUEUE_ADD, message_id, message_subdir[0], queue_name);
 
 /* Cutthrough - had sender last-dot; assume we've sent (or bufferred) all
    data onward by now.
@@ -4234,6 +4846,11 @@ if(cutthrough.cctx.sock >= 0 && cutthrough.delivery)
   switch(msg[0])
     {
     case '2':	/* Accept. Do the same to the source; dump any spoolfiles.   */
+      if (cutthrough.partial)	/* Only some of several targets accepted; */
+	{			/* deliver the rest from the spool as usual */
+	cutthrough.partial = cutthrough.delivery = FALSE;
+	break;
+	}
       cutthrough_done = ACCEPTED;
       break;					/* message_id needed for SMTP accept below */
 
@@ -4265,6 +4882,35 @@ if(!smtp_reply)
     (LOGGING(received_recipients) ? LOG_RECIPIENTS : 0) |
     (LOGGING(received_sender) ? LOG_SENDER : 0),
     "%s", g->s);
+  EXIM_PROBE4(receive__done, message_id, msg_size, recipients_count,
+    usec_since(&received_time));
+
+  if ((g = log_json_start(US"arrival")))
+    {
+    struct timeval rt;
+
+    g = log_json_str(g, "sender", sender_address);
+    g = log_json_int(g, "size", msg_size);
+    g = log_json_int(g, "recipients", recipients_count);
+    g = log_json_str(g, "protocol", received_protocol);
+    if (*queue_name) g = log_json_str(g, "queue", queue_name);
+    g = log_json_str(g, "host", sender_host_name);
+    g = log_json_str(g, "host_address", sender_host_address);
+    if (sender_host_address) g = log_json_int(g, "host_port", sender_host_port);
+    g = log_json_str(g, "helo", sender_helo_name);
+    g = log_json_str(g, "ident", sender_ident);
+    g = log_json_str(g, "authenticator", sender_host_authenticated);
+    g = log_json_str(g, "auth_id", authenticated_id);
+#ifndef DISABLE_TLS
+    g = log_json_str(g, "tls_version", tls_in.ver);
+    g = log_json_str(g, "tls_cipher", tls_in.cipher);
+#endif
+    timesince(&rt, &received_time);
+    g = log_json_time(g, "receive_time", &rt);
+    if (LOGGING(spool_commit_time))
+      g = log_json_time(g, "spool_commit_time", &spool_commit_taken);
+    log_json_send(g);
+    }
 
   /* Log any control actions taken by an ACL or local_scan(). */
 
@@ -4405,6 +5051,8 @@ if (smtp_input)
 	Uunlink(spool_name);
 	Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
 	Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+	queue_index_notify(NOTIFY_QUEUE_DEL, message_id, message_subdir[0],
+	  queue_name);
 	break;
 
       case TMP_REJ:
@@ -4413,6 +5061,8 @@ if (smtp_input)
 	  Uunlink(spool_name);
 	  Uunlink(spool_fname(US"input", message_subdir, message_id, US"-H"));
 	  Uunlink(spool_fname(US"msglog", message_subdir, message_id, US""));
+	  queue_index_notify(NOTIFY_QUEUE_DEL, message_id, message_subdir[0],
+	    queue_name);
 	  }
       default:
 	break;
@@ -4463,6 +5113,7 @@ subsequent verifying (of another incoming message) from trying to add headers
 when they shouldn't. */
 
 header_list = header_last = NULL;
+header_index_reset();
 
 return yield;  /* TRUE if more messages (SMTP only) */
 }
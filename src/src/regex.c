@@ -18,6 +18,7 @@
 /* Structure to hold a list of Regular expressions */
 typedef struct pcre_list {
   pcre *re;
+  pcre_extra *extra;
   uschar *pcre_text;
   struct pcre_list *next;
 } pcre_list;
@@ -27,6 +28,32 @@ uschar regex_match_string_buffer[1024];
 extern FILE *mime_stream;
 extern uschar *mime_current_boundary;
 
+
+/* Study a compiled pattern, using the JIT compiler if the library has one.
+The result may be NULL, which pcre_exec() accepts. */
+
+static pcre_extra *
+study(const pcre * re)
+{
+const char * error;
+#ifdef PCRE_STUDY_JIT_COMPILE
+return pcre_study(re, PCRE_STUDY_JIT_COMPILE, &error);
+#else
+return pcre_study(re, 0, &error);
+#endif
+}
+
+/* JIT code is not in Exim's store, so it must be released explicitly */
+
+static void
+release(pcre_list * re_list_head)
+{
+#ifdef PCRE_STUDY_JIT_COMPILE
+for (pcre_list * ri = re_list_head; ri; ri = ri->next)
+  if (ri->extra) pcre_free_study(ri->extra);
+#endif
+}
+
 static pcre_list *
 compile(const uschar * list)
 {
@@ -55,6 +82,7 @@ while ((regex_string = string_nextinlist(&list, &sep, NULL, 0)))
 
     ri = store_get(sizeof(pcre_list), FALSE);
     ri->re = re;
+    ri->extra = study(re);
     ri->pcre_text = regex_string;
     ri->next = re_list_head;
     re_list_head = ri;
@@ -62,16 +90,79 @@ while ((regex_string = string_nextinlist(&list, &sep, NULL, 0)))
 return re_list_head;
 }
 
+/* With several patterns, build one that is the alternation of them all, so
+that each line can be rejected with a single scan. Only when it matches are
+the patterns tried one by one, to find which one it was and to set up the
+variables. Each pattern is put in a group of its own, which limits the scope
+of any option settings within it. Back references are numbered across the
+whole pattern, so a list with any (or with recursion or conditions, which may
+also refer to groups by number, or anything else that stops the combined
+pattern compiling) is not combined.
+
+Argument:  the list of compiled patterns
+Returns:   a single-element list for the combined pattern, or NULL
+*/
+
+static pcre_list *
+combine(pcre_list * re_list_head)
+{
+gstring * g = NULL;
+const char * pcre_error;
+int pcre_erroffset;
+pcre * re;
+pcre_list * ri;
+
+if (!re_list_head || !re_list_head->next) return NULL;
+
+for (ri = re_list_head; ri; ri = ri->next)
+  {
+  for (const uschar * s = ri->pcre_text; *s; s++)
+    if (*s == '\\' && (isdigit(s[1]) || s[1] == 'g' || s[1] == 'k'))
+      return NULL;
+    else if (*s == '\\' && s[1])
+      s++;
+    else if (*s == '(' && s[1] == '?' && (s[2] == 'P' || s[2] == '&'
+	    || s[2] == '(' || s[2] == 'R' || isdigit(s[2])
+	    || (s[2] == '+' || s[2] == '-') && isdigit(s[3])))
+      return NULL;
+
+  g = string_catn(g, g ? US")|(?:" : US"(?:", g ? 5 : 3);
+  g = string_cat(g, ri->pcre_text);
+  }
+g = string_catn(g, US")", 1);
+
+if (!(re = pcre_compile(CS string_from_gstring(g), 0, &pcre_error,
+			&pcre_erroffset, NULL)))
+  {
+  DEBUG(D_acl) debug_printf_indent("regex: patterns not combined: %s\n",
+    pcre_error);
+  return NULL;
+  }
+
+ri = store_get(sizeof(pcre_list), FALSE);
+ri->re = re;
+ri->extra = study(re);
+ri->pcre_text = NULL;
+ri->next = NULL;
+return ri;
+}
+
 static int
-matcher(pcre_list * re_list_head, uschar * linebuffer, int len)
+matcher(pcre_list * re_list_head, pcre_list * combined, uschar * linebuffer,
+  int len)
 {
+if (  combined
+   && pcre_exec(combined->re, combined->extra, CS linebuffer, len, 0, 0,
+		NULL, 0) < 0)
+  return FAIL;
+
 for(pcre_list * ri = re_list_head; ri; ri = ri->next)
   {
   int ovec[3*(REGEX_VARS+1)];
   int n;
 
   /* try matcher on the line */
-  if ((n = pcre_exec(ri->re, NULL, CS linebuffer, len, 0, 0, ovec, nelem(ovec))) > 0)
+  if ((n = pcre_exec(ri->re, ri->extra, CS linebuffer, len, 0, 0, ovec, nelem(ovec))) > 0)
     {
     Ustrncpy(regex_match_string_buffer, ri->pcre_text,
 	      sizeof(regex_match_string_buffer)-1);
@@ -91,8 +182,9 @@ int
 regex(const uschar **listptr)
 {
 unsigned long mbox_size;
-FILE *mbox_file;
-pcre_list *re_list_head;
+FILE *mbox_file = NULL;
+mbox_stream *ms = NULL;
+pcre_list *re_list_head, *combined;
 uschar *linebuffer;
 long f_pos = 0;
 int ret = FAIL;
@@ -102,7 +194,8 @@ regex_match_string = NULL;
 
 if (!mime_stream)				/* We are in the DATA ACL */
   {
-  if (!(mbox_file = spool_mbox(&mbox_size, NULL, NULL)))
+  if (  !(ms = spool_mbox_stream(&mbox_size))
+     && !(mbox_file = spool_mbox(&mbox_size, NULL, NULL)))
     {						/* error while spooling */
     log_write(0, LOG_MAIN|LOG_PANIC,
 	   "regex acl condition: error while creating mbox spool file");
@@ -123,10 +216,13 @@ else
 /* precompile our regexes */
 if (!(re_list_head = compile(*listptr)))
   return FAIL;			/* no regexes -> nothing to do */
+combined = combine(re_list_head);
 
 /* match each line against all regexes */
 linebuffer = store_get(32767, TRUE);	/* tainted */
-while (fgets(CS linebuffer, 32767, mbox_file))
+while (ms
+	? mbox_stream_gets(ms, linebuffer, 32767) != NULL
+	: fgets(CS linebuffer, 32767, mbox_file) != NULL)
   {
   if (  mime_stream && mime_current_boundary		/* check boundary */
      && Ustrncmp(linebuffer, "--", 2) == 0
@@ -134,13 +230,18 @@ while (fgets(CS linebuffer, 32767, mbox_file))
 		  Ustrlen(mime_current_boundary)) == 0)
       break;						/* found boundary */
 
-  if ((ret = matcher(re_list_head, linebuffer, (int)Ustrlen(linebuffer))) == OK)
+  if ((ret = matcher(re_list_head, combined, linebuffer,
+		      (int)Ustrlen(linebuffer))) == OK)
     goto done;
   }
 /* no matches ... */
 
 done:
-if (!mime_stream)
+release(re_list_head);
+release(combined);
+if (ms)
+  mbox_stream_close(ms);
+else if (!mime_stream)
   (void)fclose(mbox_file);
 else
   {
@@ -160,7 +261,7 @@ return ret;
 int
 mime_regex(const uschar **listptr)
 {
-pcre_list *re_list_head = NULL;
+pcre_list *re_list_head = NULL, *combined;
 FILE *f;
 uschar *mime_subject = NULL;
 int mime_subject_len = 0;
@@ -173,35 +274,41 @@ regex_match_string = NULL;
 if (!(re_list_head = compile(*listptr)))
   return FAIL;			/* no regexes -> nothing to do */
 
-/* check if the file is already decoded */
+/* get 32k memory, tainted */
+mime_subject = store_get(32767, TRUE);
+
+/* If the part has not been decoded to a file, decode as much as is needed
+into memory */
 if (!mime_decoded_filename)
-  {				/* no, decode it first */
-  const uschar *empty = US"";
-  mime_decode(&empty);
-  if (!mime_decoded_filename)
-    {				/* decoding failed */
+  {
+  if ((mime_subject_len = mime_decode_mem(mime_subject, 32766)) < 0)
+    {
     log_write(0, LOG_MAIN,
-       "mime_regex acl condition warning - could not decode MIME part to file");
+       "mime_regex acl condition warning - could not decode MIME part");
+    release(re_list_head);
     return DEFER;
     }
   }
 
 /* open file */
-if (!(f = fopen(CS mime_decoded_filename, "rb")))
+else if (!(f = fopen(CS mime_decoded_filename, "rb")))
   {
   log_write(0, LOG_MAIN,
        "mime_regex acl condition warning - can't open '%s' for reading",
        mime_decoded_filename);
+  release(re_list_head);
   return DEFER;
   }
+else
+  {
+  mime_subject_len = fread(mime_subject, 1, 32766, f);
+  (void)fclose(f);
+  }
 
-/* get 32k memory, tainted */
-mime_subject = store_get(32767, TRUE);
-
-mime_subject_len = fread(mime_subject, 1, 32766, f);
-
-ret = matcher(re_list_head, mime_subject, mime_subject_len);
-(void)fclose(f);
+combined = combine(re_list_head);
+ret = matcher(re_list_head, combined, mime_subject, mime_subject_len);
+release(re_list_head);
+release(combined);
 return ret;
 }
 
@@ -74,6 +74,99 @@ return address_timeout;
 
 
 
+/*************************************************
+*     Find when a retry record stops blocking    *
+*************************************************/
+
+/* A destination held back by a retry record is next tried at the record's
+retry time, or sooner if the message reaches the ultimate address timeout
+(see above) before then. This is used only for queue_retry_index, so an early
+answer does no harm.
+
+Arguments:
+  retry_key     the key to look up a retry rule
+  domain        the domain to look up a domain retry rule
+  retry_record  the record
+
+Returns:        the time
+*/
+
+time_t
+retry_next_due(uschar *retry_key, const uschar *domain,
+  dbdata_retry *retry_record)
+{
+retry_config * retry = retry_find_config(retry_key+2, domain,
+    retry_record->basic_errno, retry_record->more_errno);
+time_t t = retry_record->next_try;
+
+if (retry && retry->rules)
+  {
+  retry_rule * last_rule;
+  for (last_rule = retry->rules; last_rule->next; last_rule = last_rule->next) ;
+  if (received_time.tv_sec + last_rule->timeout + 1 < t)
+    t = received_time.tv_sec + last_rule->timeout + 1;
+  }
+return t;
+}
+
+
+
+/*************************************************
+*       Cached reads of host retry records       *
+*************************************************/
+
+/* A delivery process normally checks the retry data for every host of every
+remote address, and a transport process may do so for a long list of hosts.
+Rather than open and lock the hints database for each lookup, host and message
+retry records are remembered in a per-process tree once they have been read,
+including the fact that there is no record. The records for all the hosts in a
+list are read together, in one open of the database, when the first of them is
+needed. Nothing is written here; the database is updated in one go by
+retry_update() at the end of a delivery, which discards the cache.
+
+Arguments:
+  dbm_file     an open retry database, or NULL if there isn't one
+  key          the key of the record
+
+Returns:       pointer to the record, or NULL if there isn't one
+*/
+
+static tree_node *tree_retry_cache = NULL;
+
+static dbdata_retry *
+retry_cache_read(open_db *dbm_file, const uschar *key)
+{
+tree_node *node;
+int old_pool = store_pool;
+
+if ((node = tree_search(tree_retry_cache, key)))
+  return node->data.ptr;
+
+store_pool = POOL_PERM;
+node = store_get(sizeof(tree_node) + Ustrlen(key), is_tainted(key));
+Ustrcpy(node->name, key);
+node->data.ptr = dbm_file ? dbfn_read(dbm_file, key) : NULL;
+(void) tree_insertnode(&tree_retry_cache, node);
+store_pool = old_pool;
+return node->data.ptr;
+}
+
+
+
+/* Generate the retry database key for a host. Host names are lower cased
+(that's what %S does). */
+
+static uschar *
+retry_host_key_string(host_item *host, uschar *portstring,
+  BOOL include_ip_address)
+{
+return include_ip_address
+  ? string_sprintf("T:%S:%s%s", host->name, host->address, portstring)
+  : string_sprintf("T:%S%s", host->name, portstring);
+}
+
+
+
 /*************************************************
 *     Set status of a host+address item          *
 *************************************************/
@@ -116,6 +209,8 @@ Arguments:
                         retry record, if one is read and the host is usable
   retry_message_key   where to put a pointer to the key for the message+host
                         retry record, if one is read and the host is usable
+  retry_due           where to put the time the host will next be usable, if
+                        it is unusable because of a retry record; otherwise 0
 
 Returns:    TRUE if the host has expired but is usable because
              its retry time has come
@@ -123,7 +218,8 @@ Returns:    TRUE if the host has expired but is usable because
 
 BOOL
 retry_check_address(const uschar *domain, host_item *host, uschar *portstring,
-  BOOL include_ip_address, uschar **retry_host_key, uschar **retry_message_key)
+  BOOL include_ip_address, uschar **retry_host_key, uschar **retry_message_key,
+  time_t *retry_due)
 {
 BOOL yield = FALSE;
 time_t now = time(NULL);
@@ -134,6 +230,7 @@ tree_node *node;
 dbdata_retry *host_retry_record, *message_retry_record;
 
 *retry_host_key = *retry_message_key = NULL;
+*retry_due = 0;
 
 DEBUG(D_transport|D_retry) debug_printf("checking status of %s\n", host->name);
 
@@ -142,12 +239,9 @@ DEBUG(D_transport|D_retry) debug_printf("checking status of %s\n", host->name);
 if (host->status != hstatus_unknown) return FALSE;
 host->status = hstatus_usable;
 
-/* Generate the host key for the unusable tree and the retry database. Ensure
-host names are lower cased (that's what %S does). */
+/* Generate the host key for the unusable tree and the retry database. */
 
-host_key = include_ip_address?
-  string_sprintf("T:%S:%s%s", host->name, host->address, portstring) :
-  string_sprintf("T:%S%s", host->name, portstring);
+host_key = retry_host_key_string(host, portstring, include_ip_address);
 
 /* Generate the message-specific key */
 
@@ -159,7 +253,7 @@ deliveries (so as to do it all in one go). The tree records addresses that have
 become unusable during this delivery process (i.e. those that will get put into
 the retry database when it is updated). */
 
-if ((node = tree_search(tree_unusable, host_key)))
+if ((node = tree_hash_search(&tree_unusable, host_key)))
   {
   DEBUG(D_transport|D_retry) debug_printf("found in tree of unusables\n");
   host->status = (node->data.val > 255)?
@@ -168,18 +262,37 @@ if ((node = tree_search(tree_unusable, host_key)))
   return FALSE;
   }
 
-/* Open the retry database, giving up if there isn't one. Otherwise, search for
-the retry records, and then close the database again. */
+/* If the records have not already been read by this process, open the retry
+database and read them, together with those for the rest of the hosts in the
+list, on the assumption that they share the port and key style (any that do not
+are just read later). Then close the database again. A missing database is
+remembered in the same way as missing records. */
 
-if (!(dbm_file = dbfn_open(US"retry", O_RDONLY, &dbblock, FALSE, TRUE)))
+if (  !tree_search(tree_retry_cache, host_key)
+   || !tree_search(tree_retry_cache, message_key))
   {
-  DEBUG(D_deliver|D_retry|D_hints_lookup)
-    debug_printf("no retry data available\n");
-  return FALSE;
+  if (!(dbm_file = dbfn_open(US"retry", O_RDONLY, &dbblock, FALSE, TRUE)))
+    DEBUG(D_deliver|D_retry|D_hints_lookup)
+      debug_printf("no retry data available\n");
+
+  (void) retry_cache_read(dbm_file, host_key);
+  (void) retry_cache_read(dbm_file, message_key);
+
+  for (host_item * h = host->next; h; h = h->next)
+    if (h->address && h->status == hstatus_unknown)
+      {
+      uschar * hkey = retry_host_key_string(h, portstring, include_ip_address);
+      (void) retry_cache_read(dbm_file, hkey);
+      (void) retry_cache_read(dbm_file,
+	string_sprintf("%s:%s", hkey, message_id));
+      }
+
+  if (dbm_file) dbfn_close(dbm_file);
   }
-host_retry_record = dbfn_read(dbm_file, host_key);
-message_retry_record = dbfn_read(dbm_file, message_key);
-dbfn_close(dbm_file);
+else DEBUG(D_retry) debug_printf("using cached retry data\n");
+
+host_retry_record = retry_cache_read(NULL, host_key);
+message_retry_record = retry_cache_read(NULL, message_key);
 
 /* Ignore the data if it is too old - too long since it was written */
 
@@ -230,6 +343,9 @@ if (host_retry_record)
       hstatus_unusable_expired : hstatus_unusable;
     host->why = hwhy_retry;
     host->last_try = host_retry_record->last_try;
+    *retry_due = host_retry_record->expired
+      ? host_retry_record->next_try
+      : retry_next_due(host_key, domain, host_retry_record);
     return FALSE;
     }
 
@@ -252,6 +368,7 @@ if (message_retry_record)
       {
       host->status = hstatus_unusable;
       host->why = hwhy_retry;
+      *retry_due = retry_next_due(host_key, domain, message_retry_record);
       }
     return FALSE;
     }
@@ -304,6 +421,7 @@ rti->message = host
   ? string_sprintf("H=%s [%s]: %s", host->name, host->address, addr->message)
   : addr->message;
 rti->flags = flags;
+rti->next_try = 0;
 
 DEBUG(D_transport|D_retry)
   {
@@ -320,6 +438,153 @@ DEBUG(D_transport|D_retry)
 
 
 
+/*************************************************
+*        Index the retry configuration           *
+*************************************************/
+
+/* With many retry rules, matching each rule's pattern for every lookup is
+costly. So, the first time the rules are searched in a process, patterns that
+are a plain domain, or "*" followed by a plain domain suffix, optionally
+preceded by "*@", are put in trees of domains and suffixes. Such a pattern
+depends only on the domain of the key, so the rules it selects are found by a
+lookup of the domain and each of its tails, and the answer for each domain is
+kept for the life of the process. Other patterns (regular expressions,
+lookups, named lists, local parts, anything to be expanded) are matched in the
+usual way. The rules are still considered in order, so the first one that
+applies is found, as before. Everything is kept in the permanent pool, like the
+rules themselves. */
+
+#define RETRY_INDEX_MIN   8     /* fewer rules are just scanned */
+#define RETRY_MEMO_MAX    1000  /* domains remembered per process */
+
+typedef struct retry_index_rule {
+  struct retry_index_rule * next;
+  int			    n;    /* rule number */
+} retry_index_rule;
+
+static retry_config *	retry_indexed = NULL;   /* rules the index is for */
+static int		retry_count = 0;        /* number of rules */
+static uschar *		retry_scan = NULL;      /* TRUE for unindexed rules */
+static tree_node *	retry_domains = NULL;   /* plain domains */
+static tree_node *	retry_suffixes = NULL;  /* "*" suffixes */
+static tree_node *	retry_memo = NULL;      /* selections by domain */
+static int		retry_memo_count = 0;
+
+
+/* Is a pattern one that depends only on the domain in a simple way? If so,
+return its lower-cased domain or suffix. */
+
+static const uschar *
+retry_pattern_plain(const uschar * s, BOOL * tail)
+{
+if (s[0] == '*' && s[1] == '@') s += 2;
+if (!*s || Ustrchr(US"!^+@<", *s) || Ustrpbrk(s, "@;$\\ \t\n")) return NULL;
+if ((*tail = *s == '*')) s++;
+return Ustrchr(s, '*') ? NULL : string_copylc(s);
+}
+
+
+static void
+retry_index_add(tree_node ** root, const uschar * key, int n)
+{
+tree_node * t = tree_search(*root, key);
+retry_index_rule * r = store_get(sizeof(retry_index_rule), FALSE), ** rp;
+
+if (!t)
+  {
+  t = store_get(sizeof(tree_node) + Ustrlen(key), FALSE);
+  Ustrcpy(t->name, key);
+  t->data.ptr = NULL;
+  (void) tree_insertnode(root, t);
+  }
+for (rp = (retry_index_rule **)&t->data.ptr; *rp; rp = &(*rp)->next) ;
+r->n = n;
+r->next = NULL;
+*rp = r;
+}
+
+
+/* Build the index, if there are enough rules to make it worth while.
+
+Returns:   TRUE if the index can be used
+*/
+
+static BOOL
+retry_index(void)
+{
+int old_pool, n = 0;
+
+if (retry_indexed == retries) return !!retry_scan;
+retry_indexed = retries;
+retry_scan = NULL;
+retry_domains = retry_suffixes = retry_memo = NULL;
+retry_memo_count = 0;
+
+for (retry_config * r = retries; r; r = r->next) n++;
+if ((retry_count = n) < RETRY_INDEX_MIN) return FALSE;
+
+old_pool = store_pool;
+store_pool = POOL_PERM;
+retry_scan = store_get(n, FALSE);
+n = 0;
+for (retry_config * r = retries; r; r = r->next, n++)
+  {
+  BOOL tail;
+  const uschar * key = retry_pattern_plain(r->pattern, &tail);
+
+  if ((retry_scan[n] = !key)) continue;
+  retry_index_add(tail ? &retry_suffixes : &retry_domains, key, n);
+  }
+store_pool = old_pool;
+
+DEBUG(D_retry) debug_printf("indexed %d retry rules\n", n);
+return TRUE;
+}
+
+
+/* Find which indexed rules have patterns that match a key's domain.
+
+Argument:  the key, containing an @
+Returns:   a flag for each rule
+*/
+
+static const uschar *
+retry_index_select(const uschar * key)
+{
+const uschar * domain = Ustrrchr(key, '@') + 1;
+tree_node * t;
+uschar * sel, * lcdomain;
+int old_pool, len;
+
+if ((t = tree_search(retry_memo, domain))) return t->data.ptr;
+
+old_pool = store_pool;
+if (retry_memo_count < RETRY_MEMO_MAX) store_pool = POOL_PERM;
+sel = store_get(retry_count, FALSE);
+memset(sel, 0, retry_count);
+
+lcdomain = string_copylc(domain);
+len = Ustrlen(lcdomain);
+if ((t = tree_search(retry_domains, lcdomain)))
+  for (retry_index_rule * r = t->data.ptr; r; r = r->next) sel[r->n] = TRUE;
+for (int i = 0; i <= len; i++)
+  if ((t = tree_search(retry_suffixes, lcdomain + i)))
+    for (retry_index_rule * r = t->data.ptr; r; r = r->next) sel[r->n] = TRUE;
+
+if (retry_memo_count < RETRY_MEMO_MAX)
+  {
+  t = store_get(sizeof(tree_node) + Ustrlen(domain), is_tainted(domain));
+  Ustrcpy(t->name, domain);
+  t->data.ptr = sel;
+  (void) tree_insertnode(&retry_memo, t);
+  retry_memo_count++;
+  }
+store_pool = old_pool;
+return sel;
+}
+
+
+
 /*************************************************
 *        Find retry configuration data           *
 *************************************************/
@@ -347,7 +612,9 @@ retry_find_config(const uschar *key, const uschar *alternate, int basic_errno,
   int more_errno)
 {
 const uschar *colon = Ustrchr(key, ':');
+const uschar *keysel = NULL, *altsel = NULL;
 retry_config *yield;
+int n = 0;
 
 /* If there's a colon in the key, there are two possibilities:
 
@@ -376,13 +643,28 @@ if (colon)
 if (!Ustrchr(key, '@')) key = string_sprintf("*@%s", key);
 if (alternate)    alternate = string_sprintf("*@%s", alternate);
 
+/* With enough rules, find which of the indexed ones match. Keys that address
+matching would truncate are left to the scan. */
+
+if (  retry_index()
+   && Ustrlen(key) <= 255 && (!alternate || Ustrlen(alternate) <= 255))
+  {
+  keysel = retry_index_select(key);
+  if (alternate) altsel = retry_index_select(alternate);
+  }
+
 /* Scan the configured retry items. */
 
-for (yield = retries; yield; yield = yield->next)
+for (yield = retries; yield; yield = yield->next, n++)
   {
   const uschar *plist = yield->pattern;
   const uschar *slist = yield->senders;
 
+  /* An indexed rule whose pattern does not match can be skipped at once. */
+
+  if (keysel && !retry_scan[n] && !keysel[n] && !(altsel && altsel[n]))
+    continue;
+
   /* If a specific error is set for this item, check that we are handling that
   specific error, and if so, check any additional error information if
   required. */
@@ -479,9 +761,11 @@ for (yield = retries; yield; yield = yield->next)
     continue;
 
   /* Check for a match between the address list item at the start of this retry
-  rule and either the main or alternate keys. */
+  rule and either the main or alternate keys. An indexed rule that gets here
+  is known to match. */
 
-  if (  match_address_list_basic(key, &plist, UCHAR_MAX+1) == OK
+  if (  keysel && !retry_scan[n]
+     || match_address_list_basic(key, &plist, UCHAR_MAX+1) == OK
      || (  alternate
 	&& match_address_list_basic(alternate, &plist, UCHAR_MAX+1) == OK
      )  )
@@ -494,6 +778,63 @@ return yield;
 
 
 
+/* Support for queue_retry_index: take account of the retry items of an address
+and its ancestors, which have all been written to the database. An item with
+no retry time (no configured rule) means another attempt could be made now.
+
+Arguments:
+  addr      the address
+  t         the time found so far, or 0
+
+Returns:    the earlier time
+*/
+
+static time_t
+retry_items_due(address_item * addr, time_t t)
+{
+for (; addr; addr = addr->parent)
+  for (retry_item * rti = addr->retries; rti; rti = rti->next)
+    if (!(rti->flags & rf_delete))
+      {
+      if (rti->next_try <= 0) return 1;
+      if (!t || rti->next_try < t) t = rti->next_try;
+      }
+return t;
+}
+
+
+/* Work out when a deferred message is next worth a delivery attempt: the
+earliest time any of its addresses could get further. An address that was
+skipped has the time its skipping ends; one that was tried has the retry times
+just written. If nothing is known for an address, it could be tried now. The
+first address of a batch holds the retry items for all of it.
+
+Arguments:
+  addr_defer   the deferred addresses
+  now          the current time
+
+Returns:       the time, or 0 if it is now
+*/
+
+static time_t
+retry_message_due(address_item * addr_defer, time_t now)
+{
+time_t due = 0;
+
+for (address_item * addr = addr_defer; addr; addr = addr->next)
+  {
+  time_t t = retry_items_due(addr, addr->retry_due);
+
+  if (addr->first && addr->first != addr) t = retry_items_due(addr->first, t);
+  if (t <= now) return 0;
+  if (!due || t < due) due = t;
+  }
+return due;
+}
+
+
+
+
 /*************************************************
 *              Update retry database             *
 *************************************************/
@@ -824,7 +1165,7 @@ for (int i = 0; i < 3; i++)
         length for very long error strings. */
 
         retry_record->last_try = now;
-        retry_record->next_try = next_try;
+        retry_record->next_try = rti->next_try = next_try;
         retry_record->basic_errno = rti->basic_errno;
         retry_record->more_errno = rti->more_errno;
         Ustrncpy(retry_record->text, message, message_length);
@@ -925,9 +1266,42 @@ for (int i = 0; i < 3; i++)
     }                                 /* Loop for all addresses  */
   }                                   /* Loop for succeed, fail, defer */
 
-/* Close and unlock the database */
+/* If the message is staying on the queue, record when it is next worth
+trying, so that queue runs can pass it by until then without opening it. The
+record for a completed message is removed if the database is open anyway;
+otherwise exim_tidydb clears it out. */
+
+if (queue_retry_index && (*addr_defer || dbm_file))
+  {
+  time_t due = *addr_defer ? retry_message_due(*addr_defer, now) : 0;
+  uschar * key = string_sprintf("M:%s", message_id);
+
+  if (!dbm_file)
+    dbm_file = dbfn_open(US"retry", O_RDWR, &dbblock, TRUE, TRUE);
+  if (!dbm_file)
+    {
+    DEBUG(D_retry) debug_printf("retry database not available for %s\n", key);
+    }
+  else if (!due)
+    {
+    if (dbfn_delete(dbm_file, key) == 0)
+      DEBUG(D_retry) debug_printf("deleted retry information for %s\n", key);
+    }
+  else
+    {
+    dbdata_retry retry_record = {0};
+
+    retry_record.first_failed = retry_record.last_try = now;
+    retry_record.next_try = due;
+    (void)dbfn_write(dbm_file, key, &retry_record, sizeof(dbdata_retry));
+    DEBUG(D_retry) debug_printf("message next due at now%+d\n", (int)(due - now));
+    }
+  }
+
+/* Close and unlock the database, and forget any records read earlier */
 
 if (dbm_file) dbfn_close(dbm_file);
+tree_retry_cache = NULL;
 
 DEBUG(D_retry) debug_printf("end of retry processing\n");
 }
@@ -449,8 +449,10 @@ rewrite_one_header(header_line *h, int flag,
 {
 int lastnewline = 0;
 header_line *newh = NULL;
-rmark function_reset_point = store_mark();
 uschar *s = Ustrchr(h->text, ':') + 1;
+const uschar *copied = h->text;		/* end of the text already copied */
+uschar *newt = NULL;			/* new text, in malloc store */
+int newtlen = 0, newtsize = 0;
 while (isspace(*s)) s++;
 
 DEBUG(D_rewrite)
@@ -460,10 +462,10 @@ f.parse_allow_group = TRUE;     /* Allow group syntax */
 
 /* Loop for multiple addresses in the header. We have to go through them all
 in case any need qualifying, even if there's no rewriting. Pathological headers
-may have thousands of addresses in them, so cause the store to be reset for
-any that don't actually get rewritten. We also play silly games for those that
-_are_ rewritten so as to avoid runaway store usage for these kinds of header.
-We want to avoid keeping store for any intermediate versions. */
+may have thousands of addresses in them, so cause the store to be reset after
+each one. The new text is built up in a malloc block as the addresses are
+scanned, copying each stretch of the old text only once, so that a header
+with many rewritten addresses does not cost the square of its length. */
 
 while (*s)
   {
@@ -565,105 +567,93 @@ while (*s)
       }
     }
 
-  /* If nothing has changed, lose all dynamic store obtained in this loop, and
-  move on to the next address. We can't reset to the function start store
-  point, because we may have a rewritten line from a previous time round the
-  loop. */
+  /* If the address has changed, add the text up to it, and the rewritten
+  address, to the new text. Then, whether or not anything has changed, lose
+  all dynamic store obtained in this loop, and move on to the next address. */
 
-  if (!changed) loop_reset_point = store_reset(loop_reset_point);
-
-  /* If the address has changed, create a new header containing the
-  rewritten address. We do not need to set the chain pointers at this
-  stage. We want to avoid using more and more memory if the header is very long
-  and contains lots and lots of rewritten addresses. Therefore, we build the
-  new text string in malloc store, then at the end we reset dynamic store
-  before copying the new header to a new block (and then freeing the malloc
-  block). The header must end up in dynamic store so that it's freed at the end
-  of receiving a message. */
-
-  else
+  if (changed)
     {
-    int remlen;
     int newlen = Ustrlen(new);
     int oldlen = end - start;
+    int remlen = s - (sprev + end);
+    int need = newtlen + (sprev + start - copied) + newlen + remlen + 3;
 
-    header_line * prev = newh ? newh : h;
-    uschar * newt = store_get_perm(prev->slen - oldlen + newlen + 4, TRUE);
-    uschar * newtstart = newt;
-
-    int type = prev->type;
-    int slen = prev->slen - oldlen + newlen;
-
-    /* Build the new header text by copying the old and putting in the
-    replacement. This process may make the header substantially longer
-    than it was before - qualification of a list of bare addresses can
-    often do this - so we stick in a newline after the re-written address
-    if it has increased in length and ends more than 40 characters in. In
-    fact, the code is not perfect, since it does not scan for existing
-    newlines in the header, but it doesn't seem worth going to that
-    amount of trouble. */
-
-    Ustrncpy(newt, prev->text, sprev - prev->text + start);
-    newt += sprev - prev->text + start;
-    *newt = 0;
-    Ustrcat(newt, new);
-    newt += newlen;
-    remlen = s - (sprev + end);
-    if (remlen > 0)
+    if (need > newtsize)
       {
-      Ustrncpy(newt, sprev + end, remlen);
-      newt += remlen;
-      *newt = 0;
+      uschar * bigger;
+      newtsize = need + h->slen;
+      bigger = store_malloc(newtsize);
+      if (newt)
+	{
+	memcpy(bigger, newt, newtlen);
+	store_free(newt);
+	}
+      newt = bigger;
       }
 
+    /* Copy the old text up to the address, then the replacement and what
+    followed the old address up to the next one. The header may get
+    substantially longer than it was before - qualification of a list of bare
+    addresses can often do this - so we stick in a newline after the
+    re-written address if it has increased in length and ends more than 40
+    characters in. In fact, the code is not perfect, since it does not scan
+    for existing newlines in the header, but it doesn't seem worth going to
+    that amount of trouble. */
+
+    memcpy(newt + newtlen, copied, sprev + start - copied);
+    newtlen += sprev + start - copied;
+    memcpy(newt + newtlen, new, newlen);
+    newtlen += newlen;
+    memcpy(newt + newtlen, sprev + end, remlen);
+    newtlen += remlen;
+    copied = s;
+
     /* Must check that there isn't a newline here anyway; in particular, there
     will be one at the very end of the header, where we DON'T want to insert
     another one! The pointer s has been skipped over white space, so just
     look back to see if the last non-space-or-tab was a newline. */
 
-    if (newlen > oldlen && newt - newtstart - lastnewline > 40)
+    if (newlen > oldlen && newtlen - lastnewline > 40)
       {
       uschar *p = s - 1;
-      while (p >= prev->text && (*p == ' ' || *p == '\t')) p--;
+      while (p >= h->text && (*p == ' ' || *p == '\t')) p--;
       if (*p != '\n')
         {
-        lastnewline = newt - newtstart;
-        Ustrcat(newt, US"\n\t");
-        slen += 2;
+        lastnewline = newtlen;
+        memcpy(newt + newtlen, "\n\t", 2);
+        newtlen += 2;
         }
       }
 
-    /* Finally, the remaining unprocessed addresses, if any. */
-
-    Ustrcat(newt, s);
-
-    DEBUG(D_rewrite) debug_printf("newlen=%d newtype=%c newtext:\n%s",
-      slen, type, newtstart);
-
-    /* Compute the length of the rest of the header line before we possibly
-    flatten a previously rewritten copy. */
-
-    remlen = (s - prev->text) - oldlen + newlen;
-
-    /* We have the new text in a malloc block. That enables us to release all
-    the memory that has been used, back to the point at which the function was
-    entered. Then set up a new header in dynamic store. This will override a
-    rewritten copy from a previous time round this loop. */
+    DEBUG(D_rewrite) debug_printf("rewritten as %s; remainder: %s", new,
+      *s == 0 ? US"\n" : s);
+    }
 
-    store_reset(function_reset_point);
-    function_reset_point = store_mark();
-    newh = store_get(sizeof(header_line), FALSE);
-    newh->type = type;
-    newh->slen = slen;
-    newh->text = string_copyn(newtstart, slen);
+  loop_reset_point = store_reset(loop_reset_point);
+  }
 
-    /* Set up for scanning the rest of the header */
+/* If anything was rewritten, add the rest of the old text and make the new
+header in dynamic store, so that it's freed at the end of receiving a
+message. */
 
-    s = newh->text + remlen;
-    DEBUG(D_rewrite) debug_printf("remainder: %s", (*s == 0)? US"\n" : s);
-    }
+if (newt)
+  {
+  int remlen = h->text + h->slen - copied;
+
+  newh = store_get(sizeof(header_line), FALSE);
+  newh->type = h->type;
+  newh->slen = newtlen + remlen;
+  newh->text = store_get(newh->slen + 1, TRUE);
+  memcpy(newh->text, newt, newtlen);
+  memcpy(newh->text + newtlen, copied, remlen);
+  newh->text[newh->slen] = 0;
+  store_free(newt);
+
+  DEBUG(D_rewrite) debug_printf("newlen=%d newtype=%c newtext:\n%s",
+    newh->slen, newh->type, newh->text);
   }
 
+
 f.parse_allow_group = FALSE;  /* Reset group flags */
 f.parse_found_group = FALSE;
 
@@ -676,6 +666,7 @@ if (newh != NULL && replace)
   if (newh->next == NULL) header_last = newh;
   h->type = htype_old;
   h->next = newh;
+  header_index_reset();
   }
 
 return newh;
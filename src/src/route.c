@@ -1081,6 +1081,110 @@ return OK;
 
 
 
+/* When finduser_cache_ttl is set, the results of getpwnam() and getgrnam(),
+including clean "not found" results, are also kept in trees for that long, so
+that repeated lookups of different users during a delivery or an SMTP session
+do not each go to the name service. They are kept only in the memory of the
+process: the uids, gids and home directories are used by processes running as
+root, so they must not come from anything the Exim user can write. */
+
+typedef struct finduser_entry {
+  time_t	expiry;		/* Not to be used after this */
+  BOOL		found;		/* The user or group exists */
+  struct passwd	pw;		/* The uid, gid and strings; only gid for groups */
+} finduser_entry;
+
+static tree_node *finduser_users = NULL;
+static tree_node *finduser_groups = NULL;
+
+
+/* Find an unexpired cache entry.
+
+Arguments:
+  user        TRUE for a user, FALSE for a group
+  name        the user or group name
+
+Returns:      the entry, or NULL
+*/
+
+static finduser_entry *
+finduser_cache_get(BOOL user, const uschar * name)
+{
+tree_node * t = tree_search(user ? finduser_users : finduser_groups, name);
+finduser_entry * e;
+
+return t && (e = t->data.ptr)->expiry > time(NULL) ? e : NULL;
+}
+
+
+/* Add or refresh a cache entry. The strings are copied to permanent store; a refreshed entry gets new copies
+only if they have changed.
+
+Arguments:
+  user        TRUE for a user, FALSE for a group
+  name        the user or group name
+  found       TRUE if it exists
+  pw          the data (only pw_gid is used for a group); ignored if not found
+  expiry      when the entry expires
+
+Returns:      the entry
+*/
+
+static finduser_entry *
+finduser_cache_set(BOOL user, const uschar * name, BOOL found,
+  const struct passwd * pw, time_t expiry)
+{
+tree_node ** root = user ? &finduser_users : &finduser_groups;
+tree_node * t = tree_search(*root, name);
+finduser_entry * e;
+int old_pool = store_pool;
+
+store_pool = POOL_PERM;
+if (t)
+  e = t->data.ptr;
+else
+  {
+  int len = Ustrlen(name);
+  t = store_get(sizeof(tree_node) + len, is_tainted(name));
+  memcpy(t->name, name, len + 1);
+  t->data.ptr = e = store_get(sizeof(finduser_entry), FALSE);
+  e->pw.pw_name = CS t->name;
+  e->pw.pw_dir = e->pw.pw_gecos = e->pw.pw_shell = NULL;
+  (void) tree_insertnode(root, t);
+  }
+
+e->expiry = expiry;
+if ((e->found = found))
+  {
+  e->pw.pw_uid = pw->pw_uid;
+  e->pw.pw_gid = pw->pw_gid;
+  if (user)
+    {
+    if (!e->pw.pw_dir || Ustrcmp(e->pw.pw_dir, pw->pw_dir) != 0)
+      e->pw.pw_dir = CS string_copy(US pw->pw_dir);
+    if (!e->pw.pw_gecos || Ustrcmp(e->pw.pw_gecos, pw->pw_gecos) != 0)
+      e->pw.pw_gecos = CS string_copy(US pw->pw_gecos);
+    if (!e->pw.pw_shell || Ustrcmp(e->pw.pw_shell, pw->pw_shell) != 0)
+      e->pw.pw_shell = CS string_copy(US pw->pw_shell);
+    }
+  }
+store_pool = old_pool;
+return e;
+}
+
+
+/* Decide whether a failed getpwnam() or getgrnam() means that the name does
+not exist, as opposed to the name service failing, so that a negative result
+can be cached. */
+
+static BOOL
+finduser_clean_miss(int err)
+{
+return err == 0 || err == ENOENT || err == ESRCH;
+}
+
+
+
 /*************************************************
 *           Find a local user                    *
 *************************************************/
@@ -1096,7 +1200,8 @@ pointer to a passwd structure, if found, is passed back via pw, if not NULL.
 Because this may be called several times in succession for the same user for
 different routers, cache the result of the previous getpwnam call so that it
 can be re-used. Note that we can't just copy the structure, as the store it
-points to can get trashed.
+points to can get trashed. If finduser_cache_ttl is set, older results are
+kept as well (see above).
 
 Arguments:
   s           the login name or textual form of the numerical uid of the user
@@ -1126,6 +1231,7 @@ DEBUG(D_uid) debug_printf("seeking password data for user \"%s\": %s\n", s,
 if (!cache_set)
   {
   int i = 0;
+  finduser_entry * e;
 
   if (return_uid && (isdigit(*s) || *s == '-') &&
        s[Ustrspn(s+1, "0123456789")+1] == 0)
@@ -1146,32 +1252,54 @@ if (!cache_set)
     lastpw = NULL;
     }
 
-  /* Try a few times if so configured; this handles delays in NIS etc. */
+  /* Use an unexpired result from the cache, if there is one. The entry's
+  strings are in permanent store, and are not overwritten. */
 
-  else for (;;)
+  else if (finduser_cache_ttl > 0 && (e = finduser_cache_get(TRUE, s)))
     {
-    errno = 0;
-    if ((lastpw = getpwnam(CS s))) break;
-    if (++i > finduser_retries) break;
-    sleep(1);
+    DEBUG(D_uid) debug_printf("using cached passwd data for \"%s\"\n", s);
+    if (e->found)
+      {
+      pwcopy = e->pw;
+      pwcopy.pw_name = CS lastname;
+      lastpw = &pwcopy;
+      }
+    else lastpw = NULL;
     }
 
-  if (lastpw)
+  /* Try a few times if so configured; this handles delays in NIS etc. */
+
+  else
     {
-    pwcopy.pw_uid = lastpw->pw_uid;
-    pwcopy.pw_gid = lastpw->pw_gid;
-    (void)string_format(lastdir, sizeof(lastdir), "%s", lastpw->pw_dir);
-    (void)string_format(lastgecos, sizeof(lastgecos), "%s", lastpw->pw_gecos);
-    (void)string_format(lastshell, sizeof(lastshell), "%s", lastpw->pw_shell);
-    pwcopy.pw_name = CS lastname;
-    pwcopy.pw_dir = CS lastdir;
-    pwcopy.pw_gecos = CS lastgecos;
-    pwcopy.pw_shell = CS lastshell;
-    lastpw = &pwcopy;
-    }
+    for (;;)
+      {
+      errno = 0;
+      if ((lastpw = getpwnam(CS s))) break;
+      if (++i > finduser_retries) break;
+      sleep(1);
+      }
+
+    if (finduser_cache_ttl > 0 && (lastpw || finduser_clean_miss(errno)))
+      (void) finduser_cache_set(TRUE, s, !!lastpw, lastpw,
+	time(NULL) + finduser_cache_ttl);
+
+    if (lastpw)
+      {
+      pwcopy.pw_uid = lastpw->pw_uid;
+      pwcopy.pw_gid = lastpw->pw_gid;
+      (void)string_format(lastdir, sizeof(lastdir), "%s", lastpw->pw_dir);
+      (void)string_format(lastgecos, sizeof(lastgecos), "%s", lastpw->pw_gecos);
+      (void)string_format(lastshell, sizeof(lastshell), "%s", lastpw->pw_shell);
+      pwcopy.pw_name = CS lastname;
+      pwcopy.pw_dir = CS lastdir;
+      pwcopy.pw_gecos = CS lastgecos;
+      pwcopy.pw_shell = CS lastshell;
+      lastpw = &pwcopy;
+      }
 
-  else DEBUG(D_uid) if (errno != 0)
-    debug_printf("getpwnam(%s) failed: %s\n", s, strerror(errno));
+    else DEBUG(D_uid) if (errno != 0)
+      debug_printf("getpwnam(%s) failed: %s\n", s, strerror(errno));
+    }
   }
 
 if (!lastpw)
@@ -1198,7 +1326,8 @@ return TRUE;
 
 /* Try several times (if configured) to find a local group, in case delays in
 NIS or NFS whatever cause an incorrect refusal. It's a pity that getgrnam()
-doesn't have some kind of indication as to why it has failed.
+doesn't have some kind of indication as to why it has failed. Results are
+cached if finduser_cache_ttl is set.
 
 Arguments:
   s           the group name or textual form of the numerical gid
@@ -1213,6 +1342,7 @@ route_findgroup(uschar *s, gid_t *return_gid)
 {
 int i = 0;
 struct group *gr;
+finduser_entry * e;
 
 if ((isdigit(*s) || *s == '-') && s[Ustrspn(s+1, "0123456789")+1] == 0)
   {
@@ -1220,10 +1350,24 @@ if ((isdigit(*s) || *s == '-') && s[Ustrspn(s+1, "0123456789")+1] == 0)
   return TRUE;
   }
 
+if (finduser_cache_ttl > 0 && (e = finduser_cache_get(FALSE, s)))
+  {
+  DEBUG(D_uid) debug_printf("using cached group data for \"%s\"\n", s);
+  if (e->found) *return_gid = e->pw.pw_gid;
+  return e->found;
+  }
+
 for (;;)
   {
+  errno = 0;
   if ((gr = getgrnam(CS s)))
     {
+    if (finduser_cache_ttl > 0)
+      {
+      struct passwd pw = { .pw_gid = gr->gr_gid };
+      (void) finduser_cache_set(FALSE, s, TRUE, &pw,
+	time(NULL) + finduser_cache_ttl);
+      }
     *return_gid = gr->gr_gid;
     return TRUE;
     }
@@ -1231,6 +1375,9 @@ for (;;)
   sleep(1);
   }
 
+if (finduser_cache_ttl > 0 && finduser_clean_miss(errno))
+  (void) finduser_cache_set(FALSE, s, FALSE, NULL,
+    time(NULL) + finduser_cache_ttl);
 return FALSE;
 }
 
@@ -1364,6 +1511,7 @@ this copies its parent pointer. It has two children, and its errors_address is
 from the original address' parent, if present, otherwise unset. */
 
 *parent = *addr;
+addr_cold_share(addr);
 parent->child_count = 2;
 parent->prop.errors_address =
   addr->parent ? addr->parent->prop.errors_address : NULL;
@@ -1415,7 +1563,7 @@ delivered. If so, we take it off the relevant queue so that it isn't delivered
 again. Otherwise, it was an alias or something, and the addresses it generated
 are handled in the normal way. */
 
-if (addr->transport && tree_search(tree_nonrecipients, addr->unique))
+if (addr->transport && tree_hash_search(&tree_nonrecipients, addr->unique))
   {
   DEBUG(D_route)
     debug_printf("\"unseen\" delivery previously done - discarded\n");
@@ -1638,7 +1786,9 @@ for (r = addr->start_router ? addr->start_router : routers; r; r = nextr)
   /* Default no affixes and select whether to use a caseful or caseless local
   part in this router. */
 
-  addr->prefix = addr->prefix_v = addr->suffix = addr->suffix_v = NULL;
+  addr->prefix = addr->suffix = NULL;
+  addr_cold_set(addr, prefix_v, NULL);
+  addr_cold_set(addr, suffix_v, NULL);
   addr->local_part = r->caseful_local_part
     ? addr->cc_local_part : addr->lc_local_part;
 
@@ -1663,7 +1813,7 @@ for (r = addr->start_router ? addr->start_router : routers; r; r = nextr)
       if (vlen)
 	{
 	addr->prefix = string_copyn(addr->local_part, plen);
-	addr->prefix_v = string_copyn(addr->local_part, vlen);
+	addr_cold(addr)->prefix_v = string_copyn(addr->local_part, vlen);
 	}
       else
 	addr->prefix = string_copyn_taint(addr->local_part, plen, FALSE);
@@ -1690,7 +1840,7 @@ for (r = addr->start_router ? addr->start_router : routers; r; r = nextr)
       addr->suffix = vlen
 	? addr->local_part + lplen
 	: string_copy_taint(addr->local_part + lplen, slen);
-      addr->suffix_v = addr->suffix + Ustrlen(addr->suffix) - vlen;
+      addr_cold(addr)->suffix_v = addr->suffix + Ustrlen(addr->suffix) - vlen;
       addr->local_part = string_copyn(addr->local_part, lplen);
       DEBUG(D_route) debug_printf("stripped suffix %s\n", addr->suffix);
       }
@@ -2049,5 +2199,150 @@ f.disable_logging = FALSE;
 return yield;
 }
 
+
+
+/*************************************************
+*         Cache of routing results               *
+*************************************************/
+
+/* When route_cache_ttl is set, the router that accepted a top-level address
+of a message that is deferred is kept in the "routes" hints database, keyed by
+message id and address, so that a later delivery attempt can start routing the
+address at that router instead of running all the ones before it. Each record
+contains a hash of the configuration, and is ignored if that has changed.
+
+Only the name of the router is kept. The database can be written by the Exim
+user, so nothing that decides the identity a delivery runs as, or where it
+goes, is taken from it: the router is run again, and its transport, uid, gid,
+home directory and hosts come from the configuration as usual. */
+
+typedef struct route_cache_item {
+  struct route_cache_item * next;
+  address_item *	addr;
+} route_cache_item;
+
+static route_cache_item * route_cache_pending = NULL;
+
+
+
+/*************************************************
+*       Remember the routing of an address       *
+*************************************************/
+
+/* This is called after an address has been routed, when the caller has
+checked that it is a top-level address that was routed directly to a
+transport, without a change of domain and without generating any other
+addresses. The router is only written to the cache by route_cache_write() if
+the delivery attempt then defers.
+
+Argument:   the address
+Returns:    nothing
+*/
+
+void
+route_cache_put(address_item * addr)
+{
+route_cache_item * r = store_get(sizeof(route_cache_item), FALSE);
+r->addr = addr;
+r->next = route_cache_pending;
+route_cache_pending = r;
+}
+
+
+
+/*************************************************
+*     Write remembered routings to the cache     *
+*************************************************/
+
+/* This is called at the end of a delivery attempt. The routers of addresses
+that were deferred are written to the cache, stamped with the current
+configuration hash, so that the next attempt can use them. Those that have been
+delivered or have failed are forgotten.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+void
+route_cache_write(void)
+{
+open_db dbblock, * dbm;
+route_cache_item * r;
+
+for (r = route_cache_pending; r; r = r->next)
+  if (r->addr->transport_return == DEFER) break;
+
+if (r && (dbm = dbfn_open(US"routes", O_RDWR, &dbblock, TRUE, TRUE)))
+  {
+  for ( ; r; r = r->next) if (r->addr->transport_return == DEFER)
+    {
+    int len = Ustrlen(r->addr->router->name);
+    dbdata_route * rec = store_get(sizeof(dbdata_route) + len, FALSE);
+
+    rec->expiry = time(NULL) + route_cache_ttl;
+    rec->config_hash = config_hash;
+    memcpy(rec->data, r->addr->router->name, len + 1);
+    (void) dbfn_write(dbm,
+      string_sprintf("%s:%s", message_id, r->addr->unique),
+      rec, sizeof(dbdata_route) + len);
+    DEBUG(D_route) debug_printf("routing of %s cached\n", r->addr->address);
+    }
+  dbfn_close(dbm);
+  }
+
+route_cache_pending = NULL;
+}
+
+
+
+/*************************************************
+*     Take the routing of an address from cache  *
+*************************************************/
+
+/* This is called before routing a top-level address. If the cache has an
+unexpired record for it that came from the current configuration, and the
+router it names still exists, routing of the address is made to start at that
+router. If the router no longer accepts the address, the routers after it are
+tried as usual.
+
+Arguments:
+  dbm            the open "routes" database
+  addr           the address
+
+Returns:         TRUE if the router was taken from the cache
+*/
+
+BOOL
+route_cache_get(open_db * dbm, address_item * addr)
+{
+dbdata_route * rec;
+router_instance * rblock;
+int len;
+
+if (  !(rec = dbfn_read_with_length(dbm,
+	  string_sprintf("%s:%s", message_id, addr->unique), &len))
+   || len < (int)sizeof(dbdata_route)
+   || rec->expiry <= time(NULL)
+   || rec->config_hash != config_hash)
+  return FALSE;
+
+len -= offsetof(dbdata_route, data);
+if (!memchr(rec->data, 0, len))
+  {
+  DEBUG(D_route) debug_printf("bad cached routing for %s ignored\n",
+    addr->address);
+  return FALSE;
+  }
+
+for (rblock = routers; rblock; rblock = rblock->next)
+  if (Ustrcmp(rblock->name, rec->data) == 0) break;
+if (!rblock) return FALSE;
+
+addr->start_router = rblock;
+DEBUG(D_route) debug_printf("routing of %s starts at cached router %s\n",
+  addr->address, rblock->name);
+return TRUE;
+}
+
 #endif	/*!MACRO_PREDEF*/
 /* End of route.c */
@@ -339,7 +339,7 @@ while (generated)
   if (ob->one_time && !f.queue_2stage)
     {
     for (parent = addr; parent->parent; parent = parent->parent) ;
-    next->onetime_parent = parent->address;
+    addr_cold(next)->onetime_parent = parent->address;
     }
 
   if (ob->hide_child_in_errmsg) setflag(next, af_hide_child);
@@ -385,17 +385,17 @@ while (generated)
     contain $ characters. */
 
     if (rblock->home_directory != NULL)
-      next->home_dir = rblock->home_directory;
+      addr_cold(next)->home_dir = rblock->home_directory;
     else if (rblock->check_local_user)
-      next->home_dir = string_sprintf("\\N%s\\N", pw->pw_dir);
+      addr_cold(next)->home_dir = string_sprintf("\\N%s\\N", pw->pw_dir);
     else if (rblock->router_home_directory != NULL &&
              testflag(addr, af_home_expanded))
       {
-      next->home_dir = deliver_home;
+      addr_cold_set(next, home_dir, deliver_home);
       setflag(next, af_home_expanded);
       }
 
-    next->current_dir = rblock->current_directory;
+    addr_cold_set(next, current_dir, rblock->current_directory);
 
     /* Permission options */
 
@@ -470,7 +470,7 @@ while (generated)
     if (next->prop.utf8_msg) debug_printf("utf8 ");
 #endif
 
-    debug_printf("home=%s\n", next->home_dir);
+    debug_printf("home=%s\n", ADDR_COLD(next)->home_dir);
     }
   }
 }
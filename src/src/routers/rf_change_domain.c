@@ -46,6 +46,7 @@ DEBUG(D_route) debug_printf("domain changed to %s\n", domain);
 up in the old space. */
 
 *parent = *addr;
+addr_cold_share(parent);
 
 /* First copy in initializing values, to wipe out stuff such as the named
 domain cache. Then copy over the propagating fields from the parent. Then set
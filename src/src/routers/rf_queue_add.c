@@ -57,7 +57,7 @@ if (addr->transport && addr->transport->info->local)
     setflag(addr, af_uid_set);
     setflag(addr, af_gid_set);
     setflag(addr, af_home_expanded);
-    addr->home_dir = string_copy(US pw->pw_dir);
+    addr_cold(addr)->home_dir = string_copy(US pw->pw_dir);
     }
 
   if (!rf_get_ugid(rblock, addr, &ugid)) return FALSE;
@@ -69,13 +69,13 @@ if (addr->transport && addr->transport->info->local)
 
   if (rblock->home_directory)
     {
-    addr->home_dir = rblock->home_directory;
+    addr_cold(addr)->home_dir = rblock->home_directory;
     clearflag(addr, af_home_expanded);
     }
-  else if (!addr->home_dir && testflag(addr, af_home_expanded))
-    addr->home_dir = deliver_home;
+  else if (!ADDR_COLD(addr)->home_dir && testflag(addr, af_home_expanded))
+    addr_cold_set(addr, home_dir, deliver_home);
 
-  addr->current_dir = rblock->current_directory;
+  addr_cold_set(addr, current_dir, rblock->current_directory);
 
   addr->next = *paddr_local;
   *paddr_local = addr;
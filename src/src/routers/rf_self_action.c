@@ -106,7 +106,7 @@ switch (code)
     DEBUG(D_route)
       debug_printf("%s: %s: passed to next router (self = pass)\n", msg, addr->domain);
     addr->message = msg;
-    addr->self_hostname = string_copy(host->name);
+    addr_cold(addr)->self_hostname = string_copy(host->name);
     return PASS;
 
   case self_fail:
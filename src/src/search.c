@@ -36,6 +36,45 @@ too many files are open. */
 static tree_node *open_top = NULL;
 static tree_node *open_bot = NULL;
 
+/* Results of lookups with the "cache=shared" option are kept in a hints
+database, so that other processes can use them. Keys that are too long for
+every database library, and long results, are not kept. */
+
+#define SEARCH_SHARED_TTL	60	/* Default, in seconds */
+#define SEARCH_SHARED_KEYMAX	400
+#define SEARCH_SHARED_DATAMAX	4096
+
+/* SQL lookups can be handed to helper processes that are started by the
+daemon and keep their connections to the database servers open (see
+lf_sqlperform()). A client keeps one connection to a helper for the life of the
+process. Each request is a search_proxy_request followed by the lookup type
+name, the query, and the options; each reply is a search_proxy_reply followed
+by the result or the error message. A helper tidies up its lookups, closing
+their connections and freeing the store used by results, every so many
+queries. */
+
+#define SEARCH_PROXY_TIDY	1000	/* Queries between tidyups in a helper */
+#define SEARCH_PROXY_TIMEOUT	60	/* Seconds to wait for a reply */
+#define SEARCH_PROXY_IDLE	30	/* Seconds between checks on the daemon */
+#define SEARCH_PROXY_TEXTMAX	65536
+
+typedef struct {
+  unsigned	typelen;
+  unsigned	querylen;
+  int		optslen;		/* -1 for no options */
+  BOOL		tainted;		/* The query is tainted */
+} search_proxy_request;
+
+typedef struct {
+  int		rc;
+  uint		do_cache;
+  unsigned	len;			/* Of the text that follows */
+  BOOL		tainted;
+} search_proxy_reply;
+
+static int   search_proxy_fd = -1;
+static pid_t search_proxy_pid = 0;
+
 /* Count of open databases that use real files */
 
 static int open_filecount = 0;
@@ -82,6 +121,7 @@ while (top > bot)
 
   if (c == 0 && Ustrlen(lookup_list[mid]->name) == len)
     {
+    if (!lookup_module_load(mid)) return -1;
     if (lookup_list[mid]->find != NULL) return mid;
     search_error_message  = string_sprintf("lookup type \"%.*s\" is not "
       "available (not in the binary - check buildtime LOOKUP configuration)",
@@ -498,6 +538,111 @@ return t;
 
 
 
+/*************************************************
+*       Shared lookup cache read and write       *
+*************************************************/
+
+/* Look for a lookup result in the shared cache.
+
+Arguments:
+  key        the cache key, naming the lookup, file, options and key
+  data       where to put the data; NULL for a recorded failure
+
+Returns:     TRUE if an unexpired result was found
+*/
+
+static BOOL
+search_shared_read(const uschar * key, uschar ** data)
+{
+open_db dbblock, * dbm;
+dbdata_lookup * rec;
+BOOL yield = FALSE;
+
+if (!(dbm = dbfn_open(US"lookup", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return FALSE;
+if ((rec = dbfn_read(dbm, key)) && rec->expiry > time(NULL))
+  {
+  *data = rec->found ? string_copy_taint(rec->data, rec->tainted) : NULL;
+  yield = TRUE;
+  }
+dbfn_close(dbm);
+return yield;
+}
+
+
+/* Record a lookup result in the shared cache.
+
+Arguments:
+  key        the cache key
+  data       the data, or NULL if the lookup failed
+  ttl        how long the result may be used for, in seconds
+*/
+
+static void
+search_shared_write(const uschar * key, const uschar * data, int ttl)
+{
+open_db dbblock, * dbm;
+dbdata_lookup * rec;
+int len = data ? Ustrlen(data) : 0;
+
+if (len > SEARCH_SHARED_DATAMAX) return;
+if (!(dbm = dbfn_open(US"lookup", O_RDWR, &dbblock, TRUE, TRUE))) return;
+
+rec = store_get(sizeof(dbdata_lookup) + len, FALSE);
+rec->expiry = time(NULL) + ttl;
+rec->found = !!data;
+rec->tainted = data && is_tainted(data);
+if (data) memcpy(rec->data, data, len + 1); else rec->data[0] = 0;
+(void) dbfn_write(dbm, key, rec, sizeof(dbdata_lookup) + len);
+dbfn_close(dbm);
+}
+
+
+
+/*************************************************
+*        Add or replace a lookup cache entry     *
+*************************************************/
+
+/* Called in the search pool.
+
+Arguments:
+  c		the cache for the open lookup
+  t		the existing, out-of-date or unusable, entry for the key, or NULL
+  keystring	the key
+  data		the result, or NULL if nothing was found
+  do_cache	the lifetime in seconds; UINT_MAX for no limit
+  opts		the type-specific options of the lookup
+*/
+
+static void
+search_cache_set(search_cache * c, tree_node * t, const uschar * keystring,
+  uschar * data, uint do_cache, const uschar * opts)
+{
+expiring_data * e;
+
+DEBUG(D_lookup) debug_printf_indent("%s cache entry\n",
+  t ? "replacing old" : "creating new");
+if (!t)	/* No existing entry.  Create new one. */
+  {
+  int len = Ustrlen(keystring) + 1;
+  e = store_get(sizeof(expiring_data) + sizeof(tree_node) + len,
+		is_tainted(keystring));
+  t = (tree_node *)(e+1);
+  memcpy(t->name, keystring, len);
+  t->data.ptr = e;
+  tree_insertnode(&c->item_cache, t);
+  }
+  /* Else previous, out-of-date cache entry.  Update with the */
+  /* new result and forget the old one */
+else
+  e = t->data.ptr;
+e->expiry = do_cache == UINT_MAX ? 0 : time(NULL)+do_cache;
+e->opts = opts ? string_copy(opts) : NULL;
+e->data.ptr = data;
+}
+
+
+
 /*************************************************
 *  Internal function: Find one item in database  *
 *************************************************/
@@ -512,6 +657,7 @@ Arguments:
   keystring    the keystring for single-key+file lookups, or
                the querystring for query-style lookups
   cache_rd     FALSE to avoid lookup in cache layer
+  shared_ttl   if > 0, use the shared cache, with this TTL
   opts	       type-specific options
 
 Returns:       a pointer to a dynamic string containing the answer,
@@ -522,7 +668,7 @@ Returns:       a pointer to a dynamic string containing the answer,
 
 static uschar *
 internal_search_find(void * handle, const uschar * filename, uschar * keystring,
-  BOOL cache_rd, const uschar * opts)
+  BOOL cache_rd, int shared_ttl, const uschar * opts)
 {
 tree_node * t = (tree_node *)handle;
 search_cache * c = (search_cache *)(t->data.ptr);
@@ -569,6 +715,8 @@ else
   {
   uint do_cache = UINT_MAX;
   int keylength = Ustrlen(keystring);
+  uschar * shared_key = NULL;
+  BOOL shared_hit = FALSE;
 
   DEBUG(D_lookup)
     {
@@ -582,13 +730,44 @@ else
       filename ? US"\n  in " : US"", filename ? filename : US"");
     }
 
+  /* If the shared cache is in use, another process may have done this
+  lookup already. */
+
+  if (shared_ttl > 0)
+    {
+    shared_key = string_sprintf("%s:%s:%s:%s", lookup_list[search_type]->name,
+      filename ? filename : US"", opts ? opts : US"", keystring);
+    if (Ustrlen(shared_key) > SEARCH_SHARED_KEYMAX)
+      shared_key = NULL;
+    else if (cache_rd && (shared_hit = search_shared_read(shared_key, &data)))
+      DEBUG(D_lookup) debug_printf_indent("shared cache entry used\n");
+    }
+
   /* Call the code for the different kinds of search. DEFER is handled
   like FAIL, except that search_find_defer is set so the caller can
   distinguish if necessary. */
 
-  if (lookup_list[search_type]->find(c->handle, filename, keystring, keylength,
-      &data, &search_error_message, &do_cache, opts) == DEFER)
-    f.search_find_defer = TRUE;
+  if (!shared_hit)
+    {
+    struct timeval start;
+    int rc;
+
+    if (trace_ring || profiling || EXIM_PROBE_TIMING) gettimeofday(&start, NULL);
+    rc = lookup_list[search_type]->find(c->handle, filename, keystring,
+	  keylength, &data, &search_error_message, &do_cache, opts);
+    EXIM_PROBE4(lookup, lookup_list[search_type]->name, keystring, rc,
+      usec_since(&start));
+    if (trace_ring)
+      trace_event(TRACE_LOOKUP, rc, search_type, &start, keystring);
+    if (profiling)
+      {
+      uschar buf[64];
+      (void) string_format(buf, sizeof(buf), "lookup %s",
+	lookup_list[search_type]->name);
+      profile_count(buf, &start);
+      }
+    if (rc == DEFER) f.search_find_defer = TRUE;
+    }
 
   /* A record that has been found is now in data, which is either NULL
   or points to a bit of dynamic store. Cache the result of the lookup if
@@ -598,25 +777,13 @@ else
   cache entry; the dnsdb lookup does.
   Finally, the caller can request no caching by setting an option. */
 
-  else if (do_cache)
+  if (!f.search_find_defer && do_cache)
     {
-    DEBUG(D_lookup) debug_printf_indent("%s cache entry\n",
-      t ? "replacing old" : "creating new");
-    if (!t)	/* No existing entry.  Create new one. */
-      {
-      int len = keylength + 1;
-      e = store_get(sizeof(expiring_data) + sizeof(tree_node) + len,
-		    is_tainted(keystring));
-      t = (tree_node *)(e+1);
-      memcpy(t->name, keystring, len);
-      t->data.ptr = e;
-      tree_insertnode(&c->item_cache, t);
-      }
-      /* Else previous, out-of-date cache entry.  Update with the */
-      /* new result and forget the old one */
-    e->expiry = do_cache == UINT_MAX ? 0 : time(NULL)+do_cache;
-    e->opts = opts ? string_copy(opts) : NULL;
-    e->data.ptr = data;
+    if (shared_key && !shared_hit)
+      search_shared_write(shared_key, data,
+	do_cache < (uint)shared_ttl ? (int)do_cache : shared_ttl);
+
+    search_cache_set(c, t, keystring, data, do_cache, opts);
     }
 
   /* If caching was disabled, empty the cache tree. We just set the cache
@@ -647,6 +814,48 @@ return data ? string_copy(data) : NULL;
 
 
 
+/*************************************************
+*          Parse global lookup options           *
+*************************************************/
+
+/* Create a new options list with the global options dropped so that the
+cache-modifiers are not used in the cache key.
+
+Arguments:
+  opts		the options given with the lookup type, or NULL
+  ret_key	set TRUE for "ret=key"
+  cache_rd	set FALSE for "cache=no_rd"
+  cache_shared	set TRUE for "cache=shared"
+  shared_ttl	set by "ttl="; set to -1, with search_error_message, if the
+		  value is malformed
+
+Returns:	the type-specific options, or NULL if there are none
+*/
+
+static const uschar *
+search_global_opts(const uschar * opts, BOOL * ret_key, BOOL * cache_rd,
+  BOOL * cache_shared, int * shared_ttl)
+{
+int sep = ',';
+gstring * g = NULL;
+
+if (!opts) return NULL;
+for (uschar * ele; ele = string_nextinlist(&opts, &sep, NULL, 0); )
+  if (Ustrcmp(ele, "ret=key") == 0) *ret_key = TRUE;
+  else if (Ustrcmp(ele, "cache=no_rd") == 0) *cache_rd = FALSE;
+  else if (Ustrcmp(ele, "cache=shared") == 0) *cache_shared = TRUE;
+  else if (Ustrncmp(ele, "ttl=", 4) == 0)
+    {
+    if ((*shared_ttl = readconf_readtime(ele + 4, 0, FALSE)) < 0)
+      search_error_message = string_sprintf("bad time value in \"%s\"", ele);
+    }
+  else g = string_append_listele(g, ',', ele);
+
+return string_from_gstring(g);
+}
+
+
+
 /*************************************************
 * Find one item in database, possibly wildcarded *
 *************************************************/
@@ -681,6 +890,8 @@ search_find(void * handle, const uschar * filename, uschar * keystring,
 {
 tree_node * t = (tree_node *)handle;
 BOOL set_null_wild = FALSE, cache_rd = TRUE, ret_key = FALSE;
+BOOL cache_shared = FALSE;
+int shared_ttl = SEARCH_SHARED_TTL;
 uschar * yield;
 
 DEBUG(D_lookup)
@@ -694,22 +905,14 @@ DEBUG(D_lookup)
 
   }
 
-/* Parse global lookup options. Also, create a new options list with
-the global options dropped so that the cache-modifiers are not
-used in the cache key. */
-
-if (opts)
+opts = search_global_opts(opts, &ret_key, &cache_rd, &cache_shared, &shared_ttl);
+if (shared_ttl < 0)
   {
-  int sep = ',';
-  gstring * g = NULL;
-
-  for (uschar * ele; ele = string_nextinlist(&opts, &sep, NULL, 0); )
-    if (Ustrcmp(ele, "ret=key") == 0) ret_key = TRUE;
-    else if (Ustrcmp(ele, "cache=no_rd") == 0) cache_rd = FALSE;
-    else g = string_append_listele(g, ',', ele);
-
-  opts = string_from_gstring(g);
+  DEBUG(D_lookup) debug_printf_indent("%s\n", search_error_message);
+  f.search_find_defer = TRUE;
+  return NULL;
   }
+if (!cache_shared) shared_ttl = 0;
 
 /* Arrange to put this database at the top of the LRU chain if it is a type
 that opens real files. */
@@ -758,7 +961,8 @@ DEBUG(D_lookup)
 /* First of all, try to match the key string verbatim. If matched a complete
 entry but could have been partial, flag to set up variables. */
 
-yield = internal_search_find(handle, filename, keystring, cache_rd, opts);
+yield = internal_search_find(handle, filename, keystring, cache_rd, shared_ttl,
+  opts);
 if (f.search_find_defer) return NULL;
 
 if (yield) { if (partial >= 0) set_null_wild = TRUE; }
@@ -783,7 +987,8 @@ else if (partial >= 0)
     Ustrncpy(keystring2, affix, affixlen);
     Ustrcpy(keystring2 + affixlen, keystring);
     DEBUG(D_lookup) debug_printf_indent("trying partial match %s\n", keystring2);
-    yield = internal_search_find(handle, filename, keystring2, cache_rd, opts);
+    yield = internal_search_find(handle, filename, keystring2, cache_rd,
+      shared_ttl, opts);
     if (f.search_find_defer) return NULL;
     }
 
@@ -822,7 +1027,7 @@ else if (partial >= 0)
 
       DEBUG(D_lookup) debug_printf_indent("trying partial match %s\n", keystring3);
       yield = internal_search_find(handle, filename, keystring3,
-		cache_rd, opts);
+		cache_rd, shared_ttl, opts);
       if (f.search_find_defer) return NULL;
       if (yield)
         {
@@ -863,7 +1068,8 @@ if (!yield  &&  starflags & SEARCH_STARAT)
     *atat = '*';
 
     DEBUG(D_lookup) debug_printf_indent("trying default match %s\n", atat);
-    yield = internal_search_find(handle, filename, atat, cache_rd, opts);
+    yield = internal_search_find(handle, filename, atat, cache_rd, shared_ttl,
+      opts);
     *atat = savechar;
     if (f.search_find_defer) return NULL;
 
@@ -886,7 +1092,8 @@ and the second is empty. */
 if (!yield  &&  starflags & (SEARCH_STAR|SEARCH_STARAT))
   {
   DEBUG(D_lookup) debug_printf_indent("trying to match *\n");
-  yield = internal_search_find(handle, filename, US"*", cache_rd, opts);
+  yield = internal_search_find(handle, filename, US"*", cache_rd, shared_ttl,
+    opts);
   if (yield && expand_setup && *expand_setup >= 0)
     {
     *expand_setup += 1;
@@ -925,4 +1132,430 @@ if (yield && ret_key)
 return yield;
 }
 
+
+
+
+/*************************************************
+*         Find several items in a database       *
+*************************************************/
+
+/* The keys that are not in the cache are handed to the lookup's batch_find
+function, if it has one, so that a lookup on a server can do them all in one
+round trip; otherwise, or if the lookup cannot do this set together, they are
+looked up one by one. The results are cached as for single lookups. Partial
+matching, defaults and the shared cache are not supported.
+
+Arguments:
+  handle	the handle from search_open
+  filename	the filename that was handed to search_open, or
+		  NULL for query-style searches
+  keys		the keys or queries
+  count		how many
+  results	where to put the answers, in dynamic store; NULL for not found
+  opts		type-specific options
+
+Returns:	OK, or DEFER with search_find_defer set
+*/
+
+int
+search_find_batch(void * handle, const uschar * filename, const uschar ** keys,
+  int count, uschar ** results, const uschar * opts)
+{
+tree_node * t = (tree_node *)handle;
+search_cache * c = (search_cache *)(t->data.ptr);
+lookup_info * li = lookup_list[t->name[0] - '0'];
+BOOL ret_key = FALSE, cache_rd = TRUE, cache_shared = FALSE;
+int shared_ttl = 0, nmiss = 0;
+const uschar ** misses = store_get(count * sizeof(uschar *), FALSE);
+int * slots = store_get(count * sizeof(int), FALSE);
+
+search_error_message = US"";
+opts = search_global_opts(opts, &ret_key, &cache_rd, &cache_shared, &shared_ttl);
+if (shared_ttl < 0)
+  {
+  f.search_find_defer = TRUE;
+  return DEFER;
+  }
+f.search_find_defer = FALSE;
+
+/* Take what we can from the cache */
+
+for (int i = 0; i < count; i++)
+  {
+  expiring_data * e;
+
+  results[i] = NULL;
+  if (!*keys[i]) continue;
+  if (  cache_rd
+     && (t = tree_search(c->item_cache, keys[i]))
+     && (!(e = t->data.ptr)->expiry || e->expiry > time(NULL))
+     && (!opts && !e->opts  ||  opts && e->opts && Ustrcmp(opts, e->opts) == 0)
+     )
+    {
+    if (e->data.ptr) results[i] = string_copy(e->data.ptr);
+    }
+  else
+    {
+    misses[nmiss] = keys[i];
+    slots[nmiss++] = i;
+    }
+  }
+
+DEBUG(D_lookup) debug_printf_indent("search_find_batch: %s: %d keys, %d not "
+  "cached\n", li->name, count, nmiss);
+
+if (nmiss > 1 && li->batch_find)
+  {
+  int old_pool = store_pool;
+  uint do_cache = UINT_MAX;
+  uschar ** answers;
+  int rc;
+
+  store_pool = POOL_SEARCH;
+  answers = store_get(nmiss * sizeof(uschar *), FALSE);
+  rc = li->batch_find(c->handle, filename, misses, nmiss, answers,
+	&search_error_message, &do_cache, opts);
+
+  if (rc == OK)
+    {
+    for (int i = 0; i < nmiss; i++)
+      if (do_cache)
+	search_cache_set(c, tree_search(c->item_cache, misses[i]), misses[i],
+	  answers[i], do_cache, opts);
+    if (!do_cache) c->item_cache = NULL;
+    }
+  store_pool = old_pool;
+
+  if (rc == DEFER)
+    {
+    DEBUG(D_lookup) debug_printf_indent("batch lookup deferred: %s\n",
+      search_error_message);
+    f.search_find_defer = TRUE;
+    return DEFER;
+    }
+  if (rc == OK)
+    {
+    for (int i = 0; i < nmiss; i++)
+      if (answers[i]) results[slots[i]] = string_copy(answers[i]);
+    nmiss = 0;
+    }
+  else
+    DEBUG(D_lookup) debug_printf_indent("keys cannot be looked up together\n");
+  }
+
+for (int i = 0; i < nmiss; i++)
+  {
+  results[slots[i]] = internal_search_find(handle, filename, US misses[i],
+    cache_rd, 0, opts);
+  if (f.search_find_defer) return DEFER;
+  }
+
+if (ret_key)
+  for (int i = 0; i < count; i++)
+    if (results[i]) results[i] = string_copy_taint(keys[i], FALSE);
+return OK;
+}
+
+
+
+/*************************************************
+*        Read a known amount from a socket       *
+*************************************************/
+
+/* Arguments:
+  fd        the socket
+  buffer    where to put the data
+  len       the amount wanted
+
+Returns:    TRUE if all of it was read
+*/
+
+static BOOL
+search_proxy_read(int fd, void * buffer, size_t len)
+{
+uschar * next = buffer, * end = next + len;
+
+while (next < end)
+  {
+  ssize_t got = read(fd, next, end - next);
+  if (got < 0 && errno == EINTR) continue;
+  if (got <= 0) return FALSE;
+  next += got;
+  }
+return TRUE;
+}
+
+
+
+/*************************************************
+*       Hand a query to a lookup helper          *
+*************************************************/
+
+/* This is called by the SQL lookups when lookup_proxy_socket is set. A
+connection to a helper is made on first use, and kept. If no helper can be
+reached, or a helper has gone away since the connection was made, the caller
+is told to do the lookup itself; once a query has been sent, a failure is a
+DEFER, as the query might have been run.
+
+Arguments:
+  type       the lookup type name, e.g. "mysql"
+  query      the query, including any leading "servers=" setting
+  opts       the lookup options, or NULL
+  result     where to pass back the result
+  errmsg     where to pass back an error message
+  do_cache   where to pass back the caching permission from the lookup
+  rcp        where to pass back the return from the lookup
+
+Returns:     TRUE if a helper dealt with the query; FALSE if not
+*/
+
+BOOL
+search_proxy_query(const uschar * type, const uschar * query,
+  const uschar * opts, uschar ** result, uschar ** errmsg, uint * do_cache,
+  int * rcp)
+{
+search_proxy_request req = {.typelen = Ustrlen(type),
+  .querylen = Ustrlen(query), .optslen = opts ? Ustrlen(opts) : -1,
+  .tainted = is_tainted(query)};
+search_proxy_reply rep;
+gstring * g;
+uschar * s;
+pid_t pid = getpid();
+
+/* A connection inherited over a fork belongs to the parent. */
+
+if (search_proxy_pid != pid)
+  {
+  if (search_proxy_fd >= 0) (void) close(search_proxy_fd);
+  search_proxy_fd = -1;
+  search_proxy_pid = pid;
+  }
+
+if (  req.querylen > SEARCH_PROXY_TEXTMAX
+   || req.optslen > SEARCH_PROXY_TEXTMAX)
+  return FALSE;
+
+g = string_catn(NULL, US &req, sizeof(req));
+g = string_catn(g, type, req.typelen);
+g = string_catn(g, query, req.querylen);
+if (opts) g = string_catn(g, opts, req.optslen);
+
+for (int tries = 0; ; tries++)
+  {
+  if (search_proxy_fd < 0)
+    {
+    struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+    struct timeval tv = {.tv_sec = SEARCH_PROXY_TIMEOUT};
+    const uschar * path = expand_cstring(lookup_proxy_socket);
+    int fd;
+
+    if (!path || Ustrlen(path) >= sizeof(sa_un.sun_path)) return FALSE;
+    Ustrcpy(sa_un.sun_path, path);
+
+    if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) return FALSE;
+    (void) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    if (connect(fd, (struct sockaddr *)&sa_un, sizeof(sa_un)) < 0)
+      {
+      DEBUG(D_lookup) debug_printf_indent("lookup helper %s: %s\n",
+	path, strerror(errno));
+      (void) close(fd);
+      return FALSE;
+      }
+    (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    search_proxy_fd = fd;
+    }
+
+  if (write_to_fd_buf(search_proxy_fd, g->s, g->ptr) == g->ptr) break;
+
+  (void) close(search_proxy_fd);
+  search_proxy_fd = -1;
+  if (tries > 0) return FALSE;
+  }
+
+DEBUG(D_lookup) debug_printf_indent("query passed to lookup helper\n");
+*rcp = DEFER;
+errno = 0;
+
+if (  !search_proxy_read(search_proxy_fd, &rep, sizeof(rep))
+   || rep.len > SEARCH_PROXY_TEXTMAX * 16
+   || rep.rc != OK && rep.rc != FAIL && rep.rc != DEFER
+   || !search_proxy_read(search_proxy_fd,
+	s = store_get(rep.len + 1, rep.tainted), rep.len)
+   )
+  {
+  *errmsg = string_sprintf("failed to get reply from lookup helper: %s",
+    errno ? strerror(errno) : "connection closed");
+  (void) close(search_proxy_fd);
+  search_proxy_fd = -1;
+  return TRUE;
+  }
+
+s[rep.len] = 0;
+if (rep.rc == OK) *result = s; else *errmsg = s;
+*do_cache = rep.do_cache;
+*rcp = rep.rc;
+return TRUE;
+}
+
+
+
+/*************************************************
+*     Answer one query, in a lookup helper       *
+*************************************************/
+
+/* Arguments:
+  fd         the connection to the client
+
+Returns:     FALSE if the connection has failed or been closed
+*/
+
+static BOOL
+search_proxy_answer(int fd)
+{
+search_proxy_request req;
+search_proxy_reply rep = {.rc = DEFER, .do_cache = UINT_MAX};
+uschar * type, * query, * opts = NULL, * result = NULL, * errmsg = NULL;
+uschar * s;
+void * handle;
+int stype;
+gstring * g;
+rmark reset_point = store_mark();
+BOOL yield = FALSE;
+
+if (  !search_proxy_read(fd, &req, sizeof(req))
+   || req.typelen == 0 || req.typelen > 32
+   || req.querylen > SEARCH_PROXY_TEXTMAX
+   || req.optslen > SEARCH_PROXY_TEXTMAX
+   || !search_proxy_read(fd, type = store_get(req.typelen + 1, FALSE),
+	req.typelen)
+   || !search_proxy_read(fd, query = store_get(req.querylen + 1, req.tainted),
+	req.querylen)
+   || req.optslen >= 0
+      && !search_proxy_read(fd, opts = store_get(req.optslen + 1, FALSE),
+	req.optslen)
+   )
+  goto out;
+
+type[req.typelen] = query[req.querylen] = 0;
+if (opts) opts[req.optslen] = 0;
+
+if ((stype = search_findtype(type, req.typelen)) < 0)
+  errmsg = search_error_message;
+else if (!mac_islookup(stype, lookup_querystyle))
+  errmsg = string_sprintf("\"%s\" is not a query-style lookup type", type);
+else if (!(handle = search_open(NULL, stype, 0, NULL, NULL)))
+  errmsg = search_error_message;
+else
+  {
+  search_cache * c = (search_cache *)(((tree_node *)handle)->data.ptr);
+  int old_pool = store_pool;
+
+  /* The lookup keeps its connections in the search pool, so the result is
+  put there too; it is freed at the next tidyup. */
+
+  store_pool = POOL_SEARCH;
+  rep.rc = lookup_list[stype]->find(c->handle, NULL, query, req.querylen,
+    &result, &errmsg, &rep.do_cache, opts);
+  store_pool = old_pool;
+  }
+
+s = rep.rc == OK ? result : errmsg;
+if (!s) s = US"";
+rep.len = Ustrlen(s);
+rep.tainted = is_tainted(s);
+
+g = string_catn(NULL, US &rep, sizeof(rep));
+g = string_catn(g, s, rep.len);
+yield = write_to_fd_buf(fd, g->s, g->ptr) == g->ptr;
+
+out:
+store_reset(reset_point);
+return yield;
+}
+
+
+
+/*************************************************
+*            Run as a lookup helper              *
+*************************************************/
+
+/* This is run in a process forked by the daemon; several such processes may
+share the listening socket. Connections from clients are accepted and kept
+open, and their queries are answered one at a time, using the lookup code in
+this process, so that connections to the database servers stay up from one
+query to the next. The process exits if the daemon goes away.
+
+Argument:   the listening socket, which is non-blocking
+Returns:    does not return
+*/
+
+void
+search_proxy_serve(int listen_fd)
+{
+fd_set clients;
+int max_fd = listen_fd;
+unsigned queries = 0;
+pid_t daemon_pid = getppid();
+
+FD_ZERO(&clients);
+lookup_proxy_socket = NULL;		/* Never pass queries on from here */
+
+for (;;)
+  {
+  fd_set ready = clients;
+  struct timeval tv = {.tv_sec = SEARCH_PROXY_IDLE};
+  int n;
+
+  FD_SET(listen_fd, &ready);
+  if ((n = select(max_fd + 1, &ready, NULL, NULL, &tv)) < 0)
+    {
+    if (errno == EINTR) continue;
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "lookup helper: select failed: %s",
+      strerror(errno));
+    }
+
+  if (getppid() != daemon_pid)
+    {
+    DEBUG(D_any) debug_printf("lookup helper: daemon has gone; exiting\n");
+    exim_exit(EXIT_SUCCESS);
+    }
+  if (n == 0) continue;
+
+  if (FD_ISSET(listen_fd, &ready))
+    {
+    int fd = accept(listen_fd, NULL, NULL);
+
+    /* The accept fails if another helper took the connection first. */
+
+    if (fd >= FD_SETSIZE)
+      (void) close(fd);
+    else if (fd >= 0)
+      {
+      struct timeval rtv = {.tv_sec = SEARCH_PROXY_TIMEOUT};
+
+      (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+      (void) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+      (void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rtv, sizeof(rtv));
+      FD_SET(fd, &clients);
+      if (fd > max_fd) max_fd = fd;
+      }
+    }
+
+  for (int fd = 0; fd <= max_fd; fd++)
+    if (fd != listen_fd && FD_ISSET(fd, &ready))
+      {
+      if (!search_proxy_answer(fd))
+	{
+	(void) close(fd);
+	FD_CLR(fd, &clients);
+	}
+      else if (++queries >= SEARCH_PROXY_TIDY)
+	{
+	search_tidyup();
+	queries = 0;
+	}
+      }
+  }
+}
+
 /* End of search.c */
@@ -3257,6 +3257,7 @@ while (*filter->pc)
     if (exec)
       {
       address_item *addr;
+      reply_item *reply;
       md5 base;
       uschar digest[16];
       uschar hexdigest[33];
@@ -3327,17 +3328,17 @@ while (*filter->pc)
           addr->prop.ignore_error = TRUE;
           addr->next = *generated;
           *generated = addr;
-          addr->reply = store_get(sizeof(reply_item), FALSE);
-          memset(addr->reply,0,sizeof(reply_item)); /* XXX */
-          addr->reply->to = string_copy(sender_address);
+          reply = addr_cold(addr)->reply = store_get(sizeof(reply_item), FALSE);
+          memset(reply,0,sizeof(reply_item)); /* XXX */
+          reply->to = string_copy(sender_address);
           if (from.length==-1)
-            addr->reply->from = expand_string(US"$local_part@$domain");
+            reply->from = expand_string(US"$local_part@$domain");
           else
-            addr->reply->from = from.character;
+            reply->from = from.character;
 	  /* deconst cast safe as we pass in a non-const item */
-          addr->reply->subject = US parse_quote_2047(subject.character, subject.length, US"utf-8", TRUE);
-          addr->reply->oncelog = string_from_gstring(once);
-          addr->reply->once_repeat=days*86400;
+          reply->subject = US parse_quote_2047(subject.character, subject.length, US"utf-8", TRUE);
+          reply->oncelog = string_from_gstring(once);
+          reply->once_repeat=days*86400;
 
           /* build body and MIME headers */
 
@@ -3352,21 +3353,21 @@ while (*filter->pc)
               mime_body < (reason_end-(sizeof(nlnl)-1)) && memcmp(mime_body, nlnl, (sizeof(nlnl)-1));
 	      ) mime_body++;
 
-            addr->reply->headers = string_copyn(reason.character, mime_body-reason.character);
+            reply->headers = string_copyn(reason.character, mime_body-reason.character);
 
             if (mime_body+(sizeof(nlnl)-1)<reason_end) mime_body+=(sizeof(nlnl)-1);
             else mime_body=reason_end-1;
-            addr->reply->text = string_copyn(mime_body, reason_end-mime_body);
+            reply->text = string_copyn(mime_body, reason_end-mime_body);
             }
           else
             {
             struct String qp = { .character = NULL, .length = 0 };  /* Keep compiler happy (PH) */
 
-            addr->reply->headers = US"MIME-Version: 1.0\n"
+            reply->headers = US"MIME-Version: 1.0\n"
                                    "Content-Type: text/plain;\n"
                                    "\tcharset=\"utf-8\"\n"
                                    "Content-Transfer-Encoding: quoted-printable";
-            addr->reply->text = quoted_printable_encode(&reason,&qp)->character;
+            reply->text = quoted_printable_encode(&reason,&qp)->character;
             }
           }
         }
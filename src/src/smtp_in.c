@@ -47,10 +47,6 @@ we need room to handle large base64-encoded AUTHs for GSSAPI.
 
 #define SMTP_CMD_BUFFER_SIZE  16384
 
-/* Size of buffer for reading SMTP incoming packets */
-
-#define IN_BUFFER_SIZE  8192
-
 /* Structure for SMTP command list */
 
 typedef struct {
@@ -165,6 +161,7 @@ static int  synprot_error_count;
 static int  unknown_command_count;
 static int  sync_cmd_limit;
 static int  smtp_write_error = 0;
+static int  rcpt_prefetch_left = 0;	/* pipelined RCPTs already looked at */
 
 static uschar *rcpt_smtp_response;
 static uschar *smtp_data_buffer;
@@ -504,12 +501,13 @@ smtp_refill(unsigned lim)
 int rc, save_errno;
 if (!smtp_out) return FALSE;
 fflush(smtp_out);
+mainlog_flush();
 if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
 
 /* Limit amount read, so non-message data is not fed to DKIM.
 Take care to not touch the safety NUL at the end of the buffer. */
 
-rc = read(fileno(smtp_in), smtp_inbuffer, MIN(IN_BUFFER_SIZE-1, lim));
+rc = read(fileno(smtp_in), smtp_inbuffer, MIN(smtp_receive_buffer_size-1, lim));
 save_errno = errno;
 if (smtp_receive_timeout > 0) ALARM_CLR(0);
 if (rc <= 0)
@@ -582,6 +580,15 @@ smtp_inptr += size;
 return buf;
 }
 
+/* Give the data waiting in the buffer, without taking it */
+
+uschar *
+smtp_peekbuf(unsigned * len)
+{
+*len = smtp_inend - smtp_inptr;
+return smtp_inptr;
+}
+
 void
 smtp_get_cache(void)
 {
@@ -1619,6 +1626,18 @@ smtp_cmd_buffer[ptr] = 0;
 
 DEBUG(D_receive) debug_printf("SMTP<< %s\n", smtp_cmd_buffer);
 
+EXIM_PROBE1(smtp__command, smtp_cmd_buffer);
+
+/* Record the command in the trace ring, without any AUTH initial response. */
+
+if (trace_ring)
+  {
+  const uschar * s = smtp_cmd_buffer, * sp;
+  if (strncmpic(s, US"AUTH ", 5) == 0 && (sp = Ustrchr(s + 5, ' ')))
+    s = string_copyn(s, sp - s);
+  trace_event(TRACE_SMTP, 0, 0, NULL, s);
+  }
+
 /* NULLs are not allowed in SMTP commands */
 
 if (hadnull) return BADCHAR_CMD;
@@ -1807,6 +1826,8 @@ if (LOGGING(tls_cipher) && tls_in.cipher)
     g = string_catn(g, US"*", 1);
 #endif
   }
+if (LOGGING(tls_ktls) && tls_in.ktls)
+  g = string_append(g, 2, US" KTLS=", tls_ktls_name(tls_in.ktls));
 if (LOGGING(tls_certificate_verified) && tls_in.cipher)
   g = string_append(g, 2, US" CV=", tls_in.certificate_verified? "yes":"no");
 if (LOGGING(tls_peerdn) && tls_in.peerdn)
@@ -2044,7 +2065,9 @@ smtp_reset(void *reset_point)
 recipients_list = NULL;
 rcpt_count = rcpt_defer_count = rcpt_fail_count =
   raw_recipients_count = recipients_count = recipients_list_max = 0;
+rcpt_prefetch_left = 0;
 message_linecount = 0;
+message_priority = 0;
 message_size = -1;
 message_body = message_body_end = NULL;
 acl_added_headers = NULL;
@@ -2092,6 +2115,7 @@ spf_result_guessed = FALSE;
 dkim_cur_signer = dkim_signers =
 dkim_signing_domain = dkim_signing_selector = dkim_signatures = NULL;
 dkim_cur_signer = dkim_signers = dkim_signing_domain = dkim_signing_selector = NULL;
+dkim_bodyhashes = NULL;
 f.dkim_disable_verify = FALSE;
 dkim_collect_input = 0;
 dkim_verify_overall = dkim_verify_status = dkim_verify_reason = NULL;
@@ -2449,6 +2473,317 @@ else DEBUG(D_receive)
 #endif
 
 
+/*************************************************
+*        Latency of the phases of a session      *
+*************************************************/
+
+/* The time taken by the ACLs and other stages of each SMTP session is counted
+in a histogram per phase. Bucket 0 counts those under a millisecond, bucket n
+those under 2^n ms, and the last bucket everything longer. At the end of the
+session the counts are sent to the daemon, which adds them up over all
+sessions for $smtp_phase_times. DNS list and verification times are also
+included in the times of the ACLs that use them. */
+
+#define SMTP_PHASE_BUCKETS 16
+
+static const uschar * smtp_phase_names[] = {
+  [SMTP_PHASE_CONNECT] =	US"connect",
+  [SMTP_PHASE_HELO] =		US"helo",
+  [SMTP_PHASE_STARTTLS] =	US"starttls",
+  [SMTP_PHASE_AUTH] =		US"auth",
+  [SMTP_PHASE_MAIL] =		US"mail",
+  [SMTP_PHASE_RCPT] =		US"rcpt",
+  [SMTP_PHASE_PREDATA] =	US"predata",
+  [SMTP_PHASE_DATA_READ] =	US"data_read",
+  [SMTP_PHASE_SPOOL_DATA] =	US"spool_data",
+  [SMTP_PHASE_DKIM] =		US"dkim",
+  [SMTP_PHASE_MIME] =		US"mime",
+  [SMTP_PHASE_DATA] =		US"data",
+  [SMTP_PHASE_SPOOL_HEADER] =	US"spool_header",
+  [SMTP_PHASE_QUIT] =		US"quit",
+  [SMTP_PHASE_OTHER_ACL] =	US"other_acl",
+  [SMTP_PHASE_DNSLISTS] =	US"dnslists",
+  [SMTP_PHASE_VERIFY] =		US"verify",
+  [SMTP_PHASE_SCAN] =		US"scan",
+};
+
+static pid_t smtp_phase_pid = 0;	/* the session process */
+static unsigned smtp_phase_hist[SMTP_PHASE_COUNT][SMTP_PHASE_BUCKETS];
+static unsigned long smtp_phase_usec[SMTP_PHASE_COUNT];
+
+/* Totals kept by the daemon */
+
+static unsigned long smtp_phase_total[SMTP_PHASE_COUNT][SMTP_PHASE_BUCKETS];
+static unsigned long smtp_phase_total_usec[SMTP_PHASE_COUNT];
+
+
+/* Count the time since the start of a phase.
+
+Arguments:
+  phase     SMTP_PHASE_xxx
+  start     when the phase began
+
+Returns:    nothing
+*/
+
+void
+smtp_phase_time(int phase, const struct timeval * start)
+{
+struct timeval diff;
+unsigned long ms;
+int b = 0;
+
+if (!smtp_input || !smtp_phase_pid) return;
+timesince(&diff, start);
+ms = diff.tv_sec * 1000000 + diff.tv_usec;
+smtp_phase_usec[phase] += ms;
+ms /= 1000;
+while (ms && b < SMTP_PHASE_BUCKETS-1) { ms >>= 1; b++; }
+smtp_phase_hist[phase][b]++;
+}
+
+
+/* Count the time taken by an ACL, by where it is used */
+
+void
+smtp_phase_acl(int where, const struct timeval * start)
+{
+int phase;
+switch (where)
+  {
+  case ACL_WHERE_CONNECT:	phase = SMTP_PHASE_CONNECT; break;
+  case ACL_WHERE_HELO:		phase = SMTP_PHASE_HELO; break;
+  case ACL_WHERE_STARTTLS:	phase = SMTP_PHASE_STARTTLS; break;
+  case ACL_WHERE_AUTH:
+  case ACL_WHERE_MAILAUTH:	phase = SMTP_PHASE_AUTH; break;
+  case ACL_WHERE_MAIL:		phase = SMTP_PHASE_MAIL; break;
+  case ACL_WHERE_RCPT:		phase = SMTP_PHASE_RCPT; break;
+  case ACL_WHERE_PREDATA:	phase = SMTP_PHASE_PREDATA; break;
+  case ACL_WHERE_DKIM:		phase = SMTP_PHASE_DKIM; break;
+  case ACL_WHERE_MIME:		phase = SMTP_PHASE_MIME; break;
+  case ACL_WHERE_DATA:		phase = SMTP_PHASE_DATA; break;
+  case ACL_WHERE_QUIT:
+  case ACL_WHERE_NOTQUIT:	phase = SMTP_PHASE_QUIT; break;
+  default:			phase = SMTP_PHASE_OTHER_ACL; break;
+  }
+smtp_phase_time(phase, start);
+}
+
+
+/* At the end of the session, send the counts to the daemon: a line for each
+phase that was timed, giving its number, the total microseconds and the bucket
+counts. */
+
+void
+smtp_phase_report(void)
+{
+uschar type = NOTIFY_SMTP_PHASES;
+gstring * g;
+
+if (smtp_phase_pid != getpid()) return;
+smtp_phase_pid = 0;
+if (!notifier_socket || !*notifier_socket) return;
+
+g = string_catn(NULL, &type, 1);
+for (int i = 0; i < SMTP_PHASE_COUNT; i++)
+  {
+  unsigned n = 0;
+  for (int b = 0; b < SMTP_PHASE_BUCKETS; b++) n += smtp_phase_hist[i][b];
+  if (!n) continue;
+  g = string_fmt_append(g, "%d %lu", i, smtp_phase_usec[i]);
+  for (int b = 0; b < SMTP_PHASE_BUCKETS; b++)
+    g = string_fmt_append(g, " %u", smtp_phase_hist[i][b]);
+  g = string_catn(g, US"\n", 1);
+  }
+if (g->ptr > 1) notifier_send(g->s, g->ptr);
+}
+
+
+/* The daemon's side: add in the counts from one session */
+
+void
+smtp_phase_accumulate(const uschar * s)
+{
+while (*s)
+  {
+  unsigned long v[SMTP_PHASE_BUCKETS + 2];
+  uschar * end;
+  int i;
+
+  for (i = 0; i < SMTP_PHASE_BUCKETS + 2; i++, s = end)
+    if ((v[i] = Ustrtoul(s, &end, 10)), end == s) return;	/* malformed */
+  if (v[0] >= SMTP_PHASE_COUNT) return;
+
+  smtp_phase_total_usec[v[0]] += v[1];
+  for (i = 0; i < SMTP_PHASE_BUCKETS; i++)
+    smtp_phase_total[v[0]][i] += v[i+2];
+  while (isspace(*s)) s++;
+  }
+}
+
+
+/* The totals, in the Prometheus text format for histograms */
+
+gstring *
+smtp_phase_summary(gstring * g)
+{
+g = string_cat(g, US"# TYPE exim_smtp_phase_seconds histogram\n");
+for (int i = 0; i < SMTP_PHASE_COUNT; i++)
+  {
+  unsigned long n = 0;
+
+  for (int b = 0; b < SMTP_PHASE_BUCKETS; b++) n += smtp_phase_total[i][b];
+  if (!n) continue;
+
+  n = 0;
+  for (int b = 0; b < SMTP_PHASE_BUCKETS-1; b++)
+    g = string_fmt_append(g,
+      "exim_smtp_phase_seconds_bucket{phase=\"%s\",le=\"%.3f\"} %lu\n",
+      smtp_phase_names[i], (double)(1 << b) / 1000,
+      n += smtp_phase_total[i][b]);
+  n += smtp_phase_total[i][SMTP_PHASE_BUCKETS-1];
+  g = string_fmt_append(g,
+    "exim_smtp_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+    "exim_smtp_phase_seconds_sum{phase=\"%s\"} %.6f\n"
+    "exim_smtp_phase_seconds_count{phase=\"%s\"} %lu\n",
+    smtp_phase_names[i], n,
+    smtp_phase_names[i], (double)smtp_phase_total_usec[i] / 1000000,
+    smtp_phase_names[i], n);
+  }
+return g;
+}
+
+
+
+#define RCPT_PREFETCH_MAX 100
+
+/* Get the domain from the operand of a waiting RCPT, or NULL */
+
+static const uschar *
+rcpt_line_domain(const uschar * s, const uschar * eol)
+{
+const uschar * at = NULL, * e;
+
+while (s < eol && isspace(*s)) s++;
+if (s < eol && *s == '<') s++;
+for (e = s; e < eol && *e != '>' && !isspace(*e); e++)
+  if (*e == '"') return NULL;
+  else if (*e == '@') at = e;
+
+if (!at || ++at >= e || *at == '[' || e - at > 255) return NULL;
+for (const uschar * p = at; p < e; p++)
+  if (!isalnum(*p) && *p != '.' && *p != '-' && *p != '_') return NULL;
+return string_copynlc(US at, e - at);
+}
+
+
+
+/*************************************************
+*     Look ahead at pipelined RCPT commands      *
+*************************************************/
+
+/* The RCPT ACL runs for one recipient at a time, and each verification may
+wait on DNS lookups. When smtp_rcpt_prefetch is set and further RCPT commands
+are already waiting in the input buffer, the MX records of all their domains
+are looked up at once, using the parallel DNS lookup, so that routing for
+verification mostly finds the answers waiting. An answer that is not used
+costs nothing but the query; the responses still go out in order.
+
+Anything odd in a waiting command (a quoted local part, a domain literal, a
+non-ASCII domain) just leaves that one out; it is looked up as usual later.
+
+Argument:   the domain of the RCPT being handled now
+Returns:    nothing
+*/
+
+static void
+smtp_rcpt_prefetch_dns(const uschar * domain)
+{
+rmark reset_point;
+const uschar ** names;
+int * types;
+uschar * s, * end;
+unsigned len;
+int n = 0, lines = 0;
+
+if (rcpt_prefetch_left > 0) { rcpt_prefetch_left--; return; }
+if (  !receive_peekbuf || !(s = receive_peekbuf(&len))
+   || len < sizeof("RCPT TO:<@>\r\n") - 1)
+  return;
+
+reset_point = store_mark();
+names = store_get((RCPT_PREFETCH_MAX + 1) * sizeof(uschar *), FALSE);
+types = store_get((RCPT_PREFETCH_MAX + 1) * sizeof(int), FALSE);
+names[n++] = string_copylc(domain);
+
+for (end = s + len; s < end && n <= RCPT_PREFETCH_MAX; )
+  {
+  uschar * eol = memchr(s, '\n', end - s);
+  const uschar * d;
+  int i;
+
+  if (!eol) break;				/* an incomplete command */
+  if (eol - s > 8 && strncmpic(s, US"rcpt to:", 8) == 0)
+    {
+    lines++;
+    if ((d = rcpt_line_domain(s + 8, eol)))
+      {
+      for (i = 0; i < n; i++) if (Ustrcmp(names[i], d) == 0) break;
+      if (i >= n) names[n++] = d;
+      }
+    }
+  s = eol + 1;
+  }
+
+rcpt_prefetch_left = lines;
+if (n > 1)
+  {
+  for (int i = 0; i < n; i++) types[i] = T_MX;
+  DEBUG(D_receive) debug_printf("prefetching MX for %d domains of %d "
+    "pipelined RCPTs\n", n, lines + 1);
+
+  /* Set the resolver up as the dnslookup router does by default
+  (qualify_single, but not search_parents, and asking for DNSSEC), because the
+  answers are kept by the resolver options as well as the name. */
+
+  dns_init(TRUE, FALSE, TRUE);
+  dns_prefetch(names, types, n);
+  }
+store_reset(reset_point);
+}
+
+
+
+/*************************************************
+*          Set up the SMTP input buffer          *
+*************************************************/
+
+/* Set up the buffer for inputting using direct read() calls, and arrange to
+call the local functions instead of the standard C ones.  Place a NUL at the
+end of the buffer to safety-stop C-string reads from it. Input is read from
+smtp_in, which must already be set. */
+
+void
+smtp_buf_init(void)
+{
+if (!smtp_inbuffer && !(smtp_inbuffer = US malloc(smtp_receive_buffer_size)))
+  log_write(0, LOG_MAIN|LOG_PANIC_DIE, "malloc() failed for SMTP input buffer");
+smtp_inbuffer[smtp_receive_buffer_size-1] = '\0';
+
+receive_getc = smtp_getc;
+receive_getbuf = smtp_getbuf;
+receive_get_cache = smtp_get_cache;
+receive_peekbuf = smtp_peekbuf;
+receive_ungetc = smtp_ungetc;
+receive_feof = smtp_feof;
+receive_ferror = smtp_ferror;
+receive_smtp_buffered = smtp_buffered;
+smtp_inptr = smtp_inend = smtp_inbuffer;
+smtp_had_eof = smtp_had_error = 0;
+}
+
+
+
 /*************************************************
 *          Start an SMTP session                 *
 *************************************************/
@@ -2472,6 +2807,10 @@ uschar *p, *s;
 gstring * ss;
 
 gettimeofday(&smtp_connection_start, NULL);
+store_stats_pid = smtp_phase_pid = getpid();
+profile_start();
+EXIM_PROBE2(smtp__connect, sender_host_address, sender_host_port);
+mainlog_buffer_start();
 for (smtp_ch_index = 0; smtp_ch_index < SMTP_HBUFF_SIZE; smtp_ch_index++)
   smtp_connection_had[smtp_ch_index] = SCH_NONE;
 smtp_ch_index = 0;
@@ -2512,9 +2851,12 @@ fl.smtputf8_advertised = FALSE;
 
 acl_var_c = NULL;
 
-/* Allow for trailing 0 in the command and data buffers.  Tainted. */
+/* Allow for trailing 0 in the command and data buffers.  Tainted.
+A daemon prefork worker runs many sessions, so keep the buffers from any
+previous one. */
 
-smtp_cmd_buffer = store_get_perm(2*SMTP_CMD_BUFFER_SIZE + 2, TRUE);
+if (!smtp_cmd_buffer)
+  smtp_cmd_buffer = store_get_perm(2*SMTP_CMD_BUFFER_SIZE + 2, TRUE);
 
 smtp_cmd_buffer[0] = 0;
 smtp_data_buffer = smtp_cmd_buffer + SMTP_CMD_BUFFER_SIZE + 1;
@@ -2534,23 +2876,7 @@ else
   received_protocol =
     (sender_host_address ? protocols : protocols_local) [pnormal];
 
-/* Set up the buffer for inputting using direct read() calls, and arrange to
-call the local functions instead of the standard C ones.  Place a NUL at the
-end of the buffer to safety-stop C-string reads from it. */
-
-if (!(smtp_inbuffer = US malloc(IN_BUFFER_SIZE)))
-  log_write(0, LOG_MAIN|LOG_PANIC_DIE, "malloc() failed for SMTP input buffer");
-smtp_inbuffer[IN_BUFFER_SIZE-1] = '\0';
-
-receive_getc = smtp_getc;
-receive_getbuf = smtp_getbuf;
-receive_get_cache = smtp_get_cache;
-receive_ungetc = smtp_ungetc;
-receive_feof = smtp_feof;
-receive_ferror = smtp_ferror;
-receive_smtp_buffered = smtp_buffered;
-smtp_inptr = smtp_inend = smtp_inbuffer;
-smtp_had_eof = smtp_had_error = 0;
+smtp_buf_init();
 
 /* Set up the message size limit; this may be host-specific */
 
@@ -4534,6 +4860,7 @@ while (done <= 0)
     case MAIL_CMD:
       HAD(SCH_MAIL);
       smtp_mailcmd_count++;              /* Count for limit and ratelimit */
+      if (LOGGING(resource_usage)) getrusage(RUSAGE_SELF, &message_rusage_start);
       was_rej_mail = TRUE;               /* Reset if accepted */
       env_mail_type_t * mail_args;       /* Sanity check & validate args */
 
@@ -5140,6 +5467,12 @@ while (done <= 0)
 	  smtp_delay_rcpt = (double)smtp_rlr_limit;
 	}
 
+      /* Look up the domains of any further pipelined RCPTs all at once */
+
+      if (  smtp_rcpt_prefetch && f.smtp_in_pipelining_advertised
+	 && !f.recipients_discarded)
+	smtp_rcpt_prefetch_dns(recipient + recipient_domain);
+
       /* If the MAIL ACL discarded all the recipients, we bypass ACL checking
       for them. Otherwise, check the access control list for this recipient. As
       there may be a delay in this, re-check for a synchronization error
@@ -5479,7 +5812,7 @@ while (done <= 0)
       It seems safest to just wipe away the content rather than leave it as a
       target to jump to. */
 
-      memset(smtp_inbuffer, 0, IN_BUFFER_SIZE);
+      memset(smtp_inbuffer, 0, smtp_receive_buffer_size);
 
       /* Attempt to start up a TLS session, and if successful, discard all
       knowledge that was obtained previously. At least, that's what the RFC says,
@@ -5773,6 +6106,7 @@ while (done <= 0)
 	   || (pid = exim_fork(US"etrn-serialised-command")) == 0)
 	  {
 	  DEBUG(D_exec) debug_print_argv(argv);
+	  mainlog_flush();
 	  exim_nullstd();                   /* Ensure std{in,out,err} exist */
 	  execv(CS argv[0], (char *const *)argv);
 	  log_write(0, LOG_MAIN|LOG_PANIC_DIE, "exec of \"%s\" (ETRN) failed: %s",
@@ -5840,8 +6174,8 @@ while (done <= 0)
 
     case BADSYN_CMD:
     SYNC_FAILURE:
-      if (smtp_inend >= smtp_inbuffer + IN_BUFFER_SIZE)
-	smtp_inend = smtp_inbuffer + IN_BUFFER_SIZE - 1;
+      if (smtp_inend >= smtp_inbuffer + smtp_receive_buffer_size)
+	smtp_inend = smtp_inbuffer + smtp_receive_buffer_size - 1;
       c = smtp_inend - smtp_inptr;
       if (c > 150) c = 150;	/* limit logged amount */
       smtp_inptr[c] = 0;
@@ -12,6 +12,202 @@
 #include "exim.h"
 #include "transports/smtp.h"
 
+/* A connection made by smtp_race_connect(), waiting to be picked up by
+smtp_sock_connect(), and the addresses that failed in the race, so that they
+are not waited for a second time. */
+
+#define SMTP_RACE_MAX	4		/* Addresses raced */
+
+static int race_sock = -1;
+static const uschar * race_address = NULL;
+static int race_port;
+
+static struct {
+  const uschar * address;
+  int		port;
+  int		err;
+} race_failed[SMTP_RACE_MAX];
+static int race_nfailed = 0;
+
+
+
+/*************************************************
+*      Choose an address from a pool             *
+*************************************************/
+
+/* An interface list whose items carry a rate ("address/rate[/warmup]") is a
+pool. Each address has a token bucket for each destination domain, kept in the
+"sourceip" hints database so that all the delivery processes share it. A
+bucket fills at the address's rate per hour and holds at most a minute's worth
+(but at least one); each connection takes a token. With a warm-up time, the
+rate rises from a tenth of its value to the full value over that time from the
+first use of the address for the domain. An address that has had a temporary
+error response is not used for the domain until smtp_interface_throttle()'s
+time has passed. An item with no rate is not limited. Of the usable addresses
+of the right family, the one with the fullest bucket is chosen, starting at a
+random place so that ties are spread.
+
+Arguments:
+  list       the expanded interface list
+  host_af    AF_INET or AF_INET6 for the outgoing IP address
+  addr       the mail address being handled (for the domain and errors)
+  interface  point this to the interface
+  msg        to add to any error message
+
+Returns:     TRUE on success (*interface is unchanged if no address is of the
+               right family), FALSE on failure, with transport_return set to
+               DEFER if no address can be used now, or PANIC
+*/
+
+#define POOL_MAX 64
+
+static BOOL
+smtp_pool_interface(const uschar * list, int host_af, address_item * addr,
+  uschar ** interface, uschar * msg)
+{
+struct {
+  uschar * address;
+  double rate, capacity, fill;
+  int warmup;
+  dbdata_sourceip rec;
+} pool[POOL_MAX];
+open_db dbblock, * dbm_file;
+time_t now = time(NULL);
+uschar * item;
+int sep = 0, n = 0, best = -1;
+
+while ((item = string_nextinlist(&list, &sep, NULL, 0)) && n < POOL_MAX)
+  {
+  uschar * s = Ustrchr(item, '/');
+
+  if (s) *s++ = '\0';
+  if (string_is_ip_address(item, NULL) == 0)
+    {
+    addr->transport_return = PANIC;
+    addr->message = string_sprintf("\"%s\" is not a valid IP "
+      "address for the \"interface\" option for %s", item, msg);
+    return FALSE;
+    }
+  if ((Ustrchr(item, ':') ? AF_INET6 : AF_INET) != host_af) continue;
+
+  pool[n].address = item;
+  pool[n].rate = s ? Ustrtod(s, &s) : 0;
+  pool[n].warmup = 0;
+  if (s && *s)
+    pool[n].warmup = *s == '/' ? readconf_readtime(s+1, 0, FALSE) : -1;
+  if (pool[n].rate < 0 || pool[n].warmup < 0)
+    {
+    addr->transport_return = PANIC;
+    addr->message = string_sprintf("malformed rate for \"%s\" in the "
+      "\"interface\" option for %s", item, msg);
+    return FALSE;
+    }
+  n++;
+  }
+if (n == 0) return TRUE;
+
+if (!(dbm_file = dbfn_open(US"sourceip", O_RDWR, &dbblock, TRUE, TRUE)))
+  {
+  *interface = pool[0].address;		/* unshaped rather than failing */
+  return TRUE;
+  }
+
+for (int j = 0, start = random_number(n); j < n; j++)
+  {
+  int i = (start + j) % n;
+  double rate = pool[i].rate;
+  const uschar * key = string_sprintf("%s/%s", pool[i].address, addr->domain);
+  dbdata_sourceip * r = dbfn_read(dbm_file, key);
+
+  if (r)
+    pool[i].rec = *r;
+  else
+    {
+    pool[i].rec.time_stamp = pool[i].rec.first_used = now;
+    pool[i].rec.throttled = 0;
+    pool[i].rec.tokens = -1;		/* a full bucket */
+    }
+
+  if (pool[i].rec.throttled > now) continue;
+  if (rate == 0)
+    pool[i].fill = 1.0;
+  else
+    {
+    if (pool[i].warmup > 0 && now - pool[i].rec.first_used < pool[i].warmup)
+      rate *= 0.1 + 0.9 * (now - pool[i].rec.first_used) / pool[i].warmup;
+    pool[i].capacity = rate / 60 > 1 ? rate / 60 : 1;
+    if (  pool[i].rec.tokens < 0
+       || (pool[i].rec.tokens += (now - pool[i].rec.time_stamp) * rate / 3600)
+	  > pool[i].capacity)
+      pool[i].rec.tokens = pool[i].capacity;
+    if (pool[i].rec.tokens < 1) continue;
+    pool[i].fill = pool[i].rec.tokens / pool[i].capacity;
+    }
+  if (best < 0 || pool[i].fill > pool[best].fill) best = i;
+  }
+
+if (best >= 0)
+  {
+  if (pool[best].rate > 0) pool[best].rec.tokens -= 1;
+  (void) dbfn_write(dbm_file,
+    string_sprintf("%s/%s", pool[best].address, addr->domain),
+    &pool[best].rec, sizeof(dbdata_sourceip));
+  }
+dbfn_close(dbm_file);
+
+if (best < 0)
+  {
+  addr->transport_return = DEFER;
+  addr->message = string_sprintf("no address in the \"interface\" pool "
+    "for %s can be used now for %s", msg, addr->domain);
+  return FALSE;
+  }
+
+DEBUG(D_transport|D_v) debug_printf("pool interface %s for %s (%.1f tokens)\n",
+  pool[best].address, addr->domain, pool[best].rec.tokens);
+*interface = pool[best].address;
+return TRUE;
+}
+
+
+
+/*************************************************
+*   Note throttling of an address from a pool    *
+*************************************************/
+
+/* Called by the smtp transport when a server has given a temporary error
+response. If the source address has a bucket for the domain, it is emptied and
+the address is not used for the domain for the given time.
+
+Arguments:
+  interface  the source address that was used
+  domain     the destination domain
+  backoff    how long to avoid the address
+
+Returns:     nothing
+*/
+
+void
+smtp_interface_throttle(const uschar * interface, const uschar * domain,
+  int backoff)
+{
+open_db dbblock, * dbm_file;
+const uschar * key = string_sprintf("%s/%s", interface, domain);
+dbdata_sourceip * r;
+
+if (!(dbm_file = dbfn_open(US"sourceip", O_RDWR, &dbblock, FALSE, TRUE)))
+  return;
+if ((r = dbfn_read(dbm_file, key)))
+  {
+  DEBUG(D_transport) debug_printf("pool interface %s throttled for %s\n",
+    interface, domain);
+  r->tokens = 0;
+  r->throttled = time(NULL) + backoff;
+  (void) dbfn_write(dbm_file, key, r, sizeof(dbdata_sourceip));
+  }
+dbfn_close(dbm_file);
+}
+
 
 
 /*************************************************
@@ -67,6 +263,9 @@ if (is_tainted(expint))
 Uskip_whitespace(&expint);
 if (!*expint) return TRUE;
 
+if (Ustrchr(expint, '/'))
+  return smtp_pool_interface(expint, host_af, addr, interface, msg);
+
 while ((iface = string_nextinlist(&expint, &sep, big_buffer,
           big_buffer_size)))
   {
@@ -255,13 +454,50 @@ int save_errno = 0;
 const blob * fastopen_blob = NULL;
 
 
+BOOL raced = FALSE;
+
 #ifndef DISABLE_EVENT
 deliver_host_address = host->address;
 deliver_host_port = port;
-if (event_raise(tb->event_action, US"tcp:connect", NULL)) return -1;
 #endif
 
-if ((sock = ip_socket(SOCK_STREAM, host_af)) < 0) return -1;
+/* Use the connection left by smtp_race_connect() if it is to this address;
+otherwise it is not wanted. An address that failed in the race fails again
+straight away. The tcp:connect event has already been raised for both. */
+
+for (int i = 0; i < race_nfailed; i++)
+  if (port == race_failed[i].port && !interface
+     && Ustrcmp(host->address, race_failed[i].address) == 0)
+    {
+    HDEBUG(D_transport|D_acl|D_v)
+      debug_printf_indent(" failed in race: %s\n",
+	CUstrerror(race_failed[i].err));
+    errno = race_failed[i].err;
+    race_failed[i] = race_failed[--race_nfailed];
+    return -1;
+    }
+
+if (race_sock >= 0)
+  if (  !interface && port == race_port
+     && Ustrcmp(host->address, race_address) == 0)
+    {
+    HDEBUG(D_transport|D_acl|D_v)
+      debug_printf_indent("using connection from race ");
+    sock = race_sock;
+    race_sock = -1;
+    raced = TRUE;
+    }
+  else
+    {
+    (void) close(race_sock);
+    race_sock = -1;
+    }
+
+#ifndef DISABLE_EVENT
+if (!raced && event_raise(tb->event_action, US"tcp:connect", NULL)) return -1;
+#endif
+
+if (!raced && (sock = ip_socket(SOCK_STREAM, host_af)) < 0) return -1;
 
 /* Set TCP_NODELAY; Exim does its own buffering. */
 
@@ -305,11 +541,13 @@ early-data but no TFO support, send it after connecting. */
 else
   {
 #ifdef TCP_FASTOPEN
-  if (verify_check_given_host(CUSS &ob->hosts_try_fastopen, host) == OK)
+  if (  !raced
+     && verify_check_given_host(CUSS &ob->hosts_try_fastopen, host) == OK)
     fastopen_blob = early_data ? early_data : &tcp_fastopen_nodata;
 #endif
 
-  if (ip_connect(sock, host_af, host->address, port, timeout, fastopen_blob) < 0)
+  if (  !raced
+     && ip_connect(sock, host_af, host->address, port, timeout, fastopen_blob) < 0)
     save_errno = errno;
   else if (early_data && !fastopen_blob && early_data->data && early_data->len)
     {
@@ -703,6 +941,7 @@ for (;;)
 
   ptrend = inblock->ptrend = inblock->buffer + rc;
   ptr = inblock->buffer;
+  inblock->reads++;
   DEBUG(D_transport|D_acl) debug_printf_indent("read response data: size=%d\n", rc);
   }
 
@@ -822,6 +1061,844 @@ errno = 0;
 return buffer[0] == okdigit;
 }
 
+
+
+
+/*************************************************
+*    Race connections to equivalent addresses    *
+*************************************************/
+
+/* This implements the connection racing of RFC 8305 ("happy eyeballs"), so
+that an address which does not answer does not hold up delivery for the whole
+connect timeout. The candidates are the given host and those immediately after
+it that are equivalent: the other addresses of the same name or, for hosts
+found from MX records, of the same preference, that the caller's usable()
+function accepts (the transport uses it to leave out those that its retry data
+says not to try yet). They are tried alternating between IPv6 and IPv4, starting with the family of the given host, and a new
+attempt is started every SMTP_RACE_DELAY milliseconds, or as soon as one
+fails, while the earlier ones carry on. The first to connect wins, and the
+connection is kept for smtp_sock_connect() to pick up; the rest are closed.
+The tcp:connect event is raised before each attempt, and one that it rejects
+is not made.
+
+Arguments:
+  host       the first host; its address must be set
+  defport    the port for hosts that don't have their own
+  tb         the transport
+  timeout    connect timeout for the race as a whole
+  usable     function to check a candidate, or NULL to accept them all
+  ctx        passed to usable()
+
+Returns:     the host that answered, or NULL if there was no race or no
+	     address answered
+*/
+
+#define SMTP_RACE_DELAY	250		/* Milliseconds between attempts */
+
+static long
+race_ms(void)
+{
+struct timeval tv;
+(void) gettimeofday(&tv, NULL);
+return (long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Wait for some of the attempts to finish, marking those that have (connected
+or failed) in ready[]. Negative descriptors are ignored. */
+
+static int
+race_wait(const int * fds, BOOL * ready, int n, int wait)
+{
+int rc;
+#ifndef NO_POLL_H
+struct pollfd pfds[SMTP_RACE_MAX];
+
+for (int i = 0; i < n; i++)
+  pfds[i] = (struct pollfd) {.fd = fds[i], .events = POLLOUT};
+rc = poll(pfds, n, wait);
+for (int i = 0; i < n; i++) ready[i] = rc > 0 && pfds[i].revents != 0;
+#else
+fd_set wfds;
+struct timeval tv = { .tv_sec = wait/1000, .tv_usec = (wait%1000)*1000 };
+int max_fd = -1;
+
+FD_ZERO(&wfds);
+for (int i = 0; i < n; i++) if (fds[i] >= 0)
+  {
+  FD_SET(fds[i], &wfds);
+  if (fds[i] > max_fd) max_fd = fds[i];
+  }
+rc = select(max_fd + 1, NULL, (SELECT_ARG2_TYPE *)&wfds, NULL, &tv);
+for (int i = 0; i < n; i++)
+  ready[i] = rc > 0 && fds[i] >= 0 && FD_ISSET(fds[i], &wfds);
+#endif
+return rc;
+}
+
+host_item *
+smtp_race_connect(host_item * host, int defport, transport_instance * tb,
+  int timeout, BOOL (*usable)(const host_item *, void *), void * ctx)
+{
+host_item * fam[2][SMTP_RACE_MAX], * cand[SMTP_RACE_MAX];
+int fds[SMTP_RACE_MAX];
+BOOL ready[SMTP_RACE_MAX];
+int nfam[2] = {0, 0}, ports[SMTP_RACE_MAX];
+int first_v6 = Ustrchr(host->address, ':') != NULL;
+int n = 0, started = 0, live = 0, won = -1;
+long now = race_ms(), next_start = now;
+long deadline = timeout > 0 ? now + timeout * 1000L : LONG_MAX;
+
+if (race_sock >= 0)
+  {
+  (void) close(race_sock);
+  race_sock = -1;
+  }
+
+for (host_item * h = host; h && nfam[0] + nfam[1] < SMTP_RACE_MAX; h = h->next)
+  {
+  int v6;
+  if (  h->mx != host->mx
+     || h->mx == MX_NONE && Ustrcmp(h->name, host->name) != 0)
+    break;
+  if (  !h->address || h->status >= hstatus_unusable
+     || usable && !usable(h, ctx))
+    continue;
+  v6 = Ustrchr(h->address, ':') != NULL;
+  fam[v6 == first_v6 ? 0 : 1][nfam[v6 == first_v6 ? 0 : 1]++] = h;
+  }
+
+for (int i = 0; i < SMTP_RACE_MAX; i++)
+  {
+  if (i < nfam[0]) cand[n++] = fam[0][i];
+  if (i < nfam[1]) cand[n++] = fam[1][i];
+  }
+if (n < 2) return NULL;
+race_nfailed = 0;
+
+DEBUG(D_transport)
+  {
+  debug_printf_indent("racing connections:");
+  for (int i = 0; i < n; i++) debug_printf(" %s", cand[i]->address);
+  debug_printf("\n");
+  }
+
+while (won < 0)
+  {
+  int wait;
+
+  /* Start the next attempt when it is due */
+
+  if (started < n && now >= next_start)
+    {
+    host_item * h = cand[started];
+    int af = Ustrchr(h->address, ':') ? AF_INET6 : AF_INET;
+    int sock = -1;
+
+    ports[started] = h->port == PORT_NONE ? defport : h->port;
+    fds[started] = -1;
+
+#ifndef DISABLE_EVENT
+    /* A rejected attempt is left out of the race, to be turned down again if
+    there is a serial attempt to that address later. */
+
+    deliver_host_address = h->address;
+    deliver_host_port = ports[started];
+    if (event_raise(tb->event_action, US"tcp:connect", NULL))
+      {
+      DEBUG(D_transport) debug_printf_indent("race: %s: rejected by event\n",
+	h->address);
+      started++;
+      next_start = now;
+      continue;
+      }
+#endif
+
+    if ((sock = ip_socket(SOCK_STREAM, af)) >= 0)
+      {
+      union sockaddr_46 sa;
+      int len = ip_addr(&sa, af, h->address, ports[started]);
+
+      (void) fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+      if (connect(sock, (struct sockaddr *)&sa, len) == 0)
+	{
+	fds[started] = sock;
+	won = started++;
+	break;
+	}
+      if (errno == EINPROGRESS)
+	{
+	fds[started] = sock;
+	live++;
+	}
+      else
+	{
+	DEBUG(D_transport) debug_printf_indent("race: %s: %s\n",
+	  h->address, strerror(errno));
+	race_failed[race_nfailed].address = h->address;
+	race_failed[race_nfailed].port = ports[started];
+	race_failed[race_nfailed++].err = errno;
+	(void) close(sock);
+	}
+      }
+    started++;
+    next_start = live ? now + SMTP_RACE_DELAY : now;
+    continue;
+    }
+
+  if (live == 0 && started >= n) break;		/* all failed */
+  if (now >= deadline) break;
+
+  wait = deadline - now > 60000 ? 60000 : (int)(deadline - now);
+  if (started < n && next_start - now < wait) wait = (int)(next_start - now);
+
+  if (race_wait(fds, ready, started, wait) < 0 && errno != EINTR) break;
+  now = race_ms();
+
+  for (int i = 0; i < started; i++)
+    if (ready[i])
+      {
+      int err = 0;
+      socklen_t elen = sizeof(err);
+
+      if (  getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &elen) == 0
+	 && err == 0)
+	{ won = i; break; }
+
+      DEBUG(D_transport) debug_printf_indent("race: %s: %s\n",
+	cand[i]->address, strerror(err));
+      race_failed[race_nfailed].address = cand[i]->address;
+      race_failed[race_nfailed].port = ports[i];
+      race_failed[race_nfailed++].err = err;
+      (void) close(fds[i]);
+      fds[i] = -1;
+      live--;
+      next_start = now;			/* start the next one straight away */
+      }
+  }
+
+/* With no winner, attempts still in progress have timed out; with a winner,
+they are merely abandoned. */
+
+for (int i = 0; i < started; i++)
+  if (i != won && fds[i] >= 0)
+    {
+    if (won < 0)
+      {
+      race_failed[race_nfailed].address = cand[i]->address;
+      race_failed[race_nfailed].port = ports[i];
+      race_failed[race_nfailed++].err = ETIMEDOUT;
+      }
+    (void) close(fds[i]);
+    }
+
+if (won < 0)
+  {
+  DEBUG(D_transport) debug_printf_indent("race: no address answered\n");
+  return NULL;
+  }
+
+(void) fcntl(fds[won], F_SETFL, fcntl(fds[won], F_GETFL) & ~O_NONBLOCK);
+race_sock = fds[won];
+race_address = cand[won]->address;
+race_port = ports[won];
+DEBUG(D_transport) debug_printf_indent("race won by %s\n", race_address);
+return cand[won];
+}
+
+
+
+/*************************************************
+*      Cache of idle outbound connections        *
+*************************************************/
+
+/* When smtp_connection_cache is set, the daemon runs a helper process that
+holds open SMTP connections whose deliveries have finished (see
+smtp_conn_cache_serve()). Instead of sending QUIT, a delivery process parks its
+connection with the helper, passing the file descriptor over the unix socket
+with SCM_RIGHTS. A later delivery to the same host by the same transport leases
+the connection back, and carries on after an RSET, rather than connecting and
+going through the banner, EHLO and AUTH again.
+
+A TLS session cannot be handed to another process, so only connections without
+TLS are parked, and not those to servers that offer STARTTLS, since a later
+delivery might want to use it. Each request is an smtp_conn_cache_msg on a
+fresh connection to the helper, and is answered by another; the file descriptor
+goes with a park request and with a successful lease reply.
+
+Whatever identifies the client to the server is part of the key: the HELO name
+and (for completeness) the client certificate and key, as well as the
+transport, address, port and interface. The authenticated identity is checked
+by the leasing process instead, because it is not known until authentication
+has been done. An authenticated connection is parked only if its authenticator
+has client_set_id; the leasing process will take it only if it would have used
+the same authenticator and client_set_id expands to the same value. One that
+is not authenticated is taken only by a delivery that would not have tried to
+authenticate. A connection that does not suit is handed back. */
+
+#define SMTP_CONN_CACHE_MAX	128	/* Idle connections held in total */
+#define SMTP_CONN_CACHE_TIMEOUT	5	/* For talking to the helper */
+#define SMTP_CONN_CACHE_TRIES	3	/* Leases tried before connecting */
+
+typedef struct {
+  uschar	op;		/* 'P'ark or 'L'ease; 'Y' or 'N' in replies */
+  BOOL		authenticated;
+  BOOL		esmtp;
+  unsigned	peer_options;
+  uschar	key[1024];	/* Transport, address, port, interface, HELO name,
+				client certificate and key */
+  uschar	auth[256];	/* Authenticator name and client_set_id value,
+				each zero-terminated */
+} smtp_conn_cache_msg;
+
+typedef struct {
+  int		fd;
+  time_t	expires;
+  smtp_conn_cache_msg m;
+} smtp_conn_cache_entry;
+
+
+/* Send a message to or from the helper, with a file descriptor if fd is not
+negative.
+
+Returns:   TRUE if the message was sent
+*/
+
+static BOOL
+smtp_conn_cache_send(int sock, smtp_conn_cache_msg * m, int fd)
+{
+union { struct cmsghdr align; uschar buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+struct iovec iov = {.iov_base = m, .iov_len = sizeof(*m)};
+struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+if (fd >= 0)
+  {
+  struct cmsghdr * cp;
+
+  memset(&cbuf, 0, sizeof(cbuf));
+  msg.msg_control = cbuf.buf;
+  msg.msg_controllen = sizeof(cbuf.buf);
+  cp = CMSG_FIRSTHDR(&msg);
+  cp->cmsg_level = SOL_SOCKET;
+  cp->cmsg_type = SCM_RIGHTS;
+  cp->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cp), &fd, sizeof(int));
+  }
+return sendmsg(sock, &msg, 0) == sizeof(*m);
+}
+
+
+/* Receive a message, and the file descriptor that may come with it.
+
+Returns:   TRUE if a whole message was received; *fdp is -1 if there was no
+	   descriptor
+*/
+
+static BOOL
+smtp_conn_cache_recv(int sock, smtp_conn_cache_msg * m, int * fdp)
+{
+union { struct cmsghdr align; uschar buf[CMSG_SPACE(sizeof(int))]; } cbuf;
+struct iovec iov = {.iov_base = m, .iov_len = sizeof(*m)};
+struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+		     .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf)};
+ssize_t n = recvmsg(sock, &msg, MSG_WAITALL);
+
+*fdp = -1;
+if (n > 0)
+  for (struct cmsghdr * cp = CMSG_FIRSTHDR(&msg); cp;
+       cp = CMSG_NXTHDR(&msg, cp))
+    if (  cp->cmsg_level == SOL_SOCKET && cp->cmsg_type == SCM_RIGHTS
+       && cp->cmsg_len == CMSG_LEN(sizeof(int)))
+      {
+      memcpy(fdp, CMSG_DATA(cp), sizeof(int));
+      (void) fcntl(*fdp, F_SETFD, fcntl(*fdp, F_GETFD) | FD_CLOEXEC);
+      }
+
+if (n != sizeof(*m))
+  {
+  if (*fdp >= 0) (void) close(*fdp);
+  *fdp = -1;
+  return FALSE;
+  }
+m->key[sizeof(m->key)-1] = '\0';
+m->auth[sizeof(m->auth)-2] = m->auth[sizeof(m->auth)-1] = '\0';
+return TRUE;
+}
+
+
+/* Open a connection to the helper.
+
+Returns:   a socket, or -1 if there is no helper to talk to
+*/
+
+static int
+smtp_conn_cache_connect(void)
+{
+struct sockaddr_un sa_un = {.sun_family = AF_UNIX};
+struct timeval tv = {.tv_sec = SMTP_CONN_CACHE_TIMEOUT};
+const uschar * path = expand_cstring(smtp_connection_cache);
+int fd;
+
+if (!path || Ustrlen(path) >= sizeof(sa_un.sun_path)) return -1;
+Ustrcpy(sa_un.sun_path, path);
+
+if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+(void) fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+if (connect(fd, (struct sockaddr *)&sa_un, sizeof(sa_un)) < 0)
+  {
+  DEBUG(D_transport) debug_printf_indent("connection cache %s: %s\n",
+    path, strerror(errno));
+  (void) close(fd);
+  return -1;
+  }
+(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+return fd;
+}
+
+
+/* Connections are shared only between deliveries by the same transport, to
+the same address and port, from the same interface, that send the same HELO
+name and would use the same client certificate. When parking, the HELO name is
+the one that was sent; when leasing, or parking a connection that was leased
+(for which the name was not needed), it is the one that would be sent.
+
+Arguments:
+  sx	     the SMTP context
+  m	     the message whose key is to be set
+  park	     TRUE when parking
+
+Returns:     FALSE if the key cannot be made; the connection should then not
+	     be parked or leased
+*/
+
+static BOOL
+smtp_conn_cache_key(smtp_context * sx, smtp_conn_cache_msg * m, BOOL park)
+{
+smtp_connect_args * sc = &sx->conn_args;
+smtp_transport_options_block * ob = sc->ob;
+const uschar * helo = park && sx->helo_data
+  ? sx->helo_data : expand_cstring(ob->helo_data);
+const uschar * cert = US"", * key = US"";
+
+#ifndef DISABLE_TLS
+if (  ob->tls_certificate && !(cert = expand_cstring(ob->tls_certificate))
+   || ob->tls_privatekey && !(key = expand_cstring(ob->tls_privatekey)))
+  return FALSE;
+#endif
+return helo
+  && string_format(m->key, sizeof(m->key), "%s %s %d %s %s %s %s",
+      sc->tblock->name, sc->host->address, sc->host->port,
+      sc->interface ? sc->interface : US"", helo, cert, key);
+}
+
+
+/* Check that a delivery would have authenticated with the server in the same
+way as the one that parked a connection. The server does not allow a second
+AUTH on an authenticated connection, so a connection whose authentication does
+not match cannot be used.
+
+Arguments:
+  sx	     the SMTP context
+  m	     the reply to the lease request, or the park request
+  park	     TRUE when parking
+
+Returns:     TRUE if the connection may be used
+*/
+
+static BOOL
+smtp_conn_cache_auth_ok(smtp_context * sx, const smtp_conn_cache_msg * m,
+  BOOL park)
+{
+smtp_transport_options_block * ob = sx->conn_args.ob;
+host_item * host = sx->conn_args.host;
+BOOL try_auth =
+     verify_check_given_host(CUSS &ob->hosts_require_auth, host) == OK
+  || verify_check_given_host(CUSS &ob->hosts_try_auth, host) == OK;
+const uschar * id;
+auth_instance * au;
+
+if (!m->authenticated) return !try_auth;
+if (!try_auth) return FALSE;
+
+for (au = auths; au; au = au->next)
+  if (Ustrcmp(au->name, m->auth) == 0) break;
+if (  !au || !au->client || !au->set_client_id
+   || au->client_condition
+      && !expand_check_condition(au->client_condition, au->name,
+	    US"client authenticator"))
+  return FALSE;
+
+/* When parking, client_authenticated_id has been set already */
+
+if (park) return TRUE;
+id = expand_cstring(au->set_client_id);
+return id && Ustrcmp(id, m->auth + Ustrlen(m->auth) + 1) == 0;
+}
+
+
+/* Hand a connection to the helper.
+
+Arguments:
+  m	     the park request, with its key set
+  fd	     the connection
+
+Returns:     TRUE if the helper has taken the connection
+*/
+
+static BOOL
+smtp_conn_cache_give(smtp_conn_cache_msg * m, int fd)
+{
+BOOL yield;
+int pfd, cfd;
+
+if ((cfd = smtp_conn_cache_connect()) < 0) return FALSE;
+m->op = 'P';
+yield = smtp_conn_cache_send(cfd, m, fd)
+  && smtp_conn_cache_recv(cfd, m, &pfd) && m->op == 'Y';
+if (pfd >= 0) (void) close(pfd);
+(void) close(cfd);
+return yield;
+}
+
+
+/*************************************************
+*     Lease an idle connection from the cache    *
+*************************************************/
+
+/* Called from the smtp transport before it makes a new connection. A leased
+connection is checked with RSET before it is used; one that fails is closed,
+and another is tried. One whose authentication does not match this delivery's
+is handed back, and a new connection is made. So is one to a host for which
+this delivery requires TLS.
+
+Arguments:
+  sx	     the SMTP context; the host's port must already be set
+
+Returns:     TRUE if sx->cctx.sock is a usable connection, with
+	     smtp_peer_options, sx->esmtp and the authentication state as they
+	     were when it was parked
+*/
+
+BOOL
+smtp_conn_cache_lease(smtp_context * sx)
+{
+smtp_transport_options_block * ob = sx->conn_args.ob;
+
+if (  !smtp_connection_cache || sx->lmtp || sx->smtps
+#ifndef DISABLE_TLS
+   || verify_check_given_host(CUSS &ob->hosts_require_tls, sx->conn_args.host)
+      == OK
+#endif
+   )
+  return FALSE;
+
+for (int tries = 0; tries < SMTP_CONN_CACHE_TRIES; tries++)
+  {
+  smtp_conn_cache_msg m = {.op = 'L'};
+  union sockaddr_46 interface_sock;
+  EXIM_SOCKLEN_T size = sizeof(interface_sock);
+  int fd, cfd;
+
+  if (!smtp_conn_cache_key(sx, &m, FALSE)) return FALSE;
+  if ((cfd = smtp_conn_cache_connect()) < 0) return FALSE;
+  if (  !smtp_conn_cache_send(cfd, &m, -1)
+     || !smtp_conn_cache_recv(cfd, &m, &fd)
+     || m.op != 'Y' || fd < 0)
+    {
+    if (fd >= 0) (void) close(fd);
+    (void) close(cfd);
+    return FALSE;
+    }
+  (void) close(cfd);
+
+  if (m.peer_options & OPTION_TLS || !smtp_conn_cache_auth_ok(sx, &m, FALSE))
+    {
+    DEBUG(D_transport) debug_printf_indent("leased connection does not suit;"
+      " handing it back\n");
+    (void) smtp_conn_cache_give(&m, fd);
+    (void) close(fd);
+    return FALSE;
+    }
+
+  callout_address = string_sprintf("[%s]:%d", sx->conn_args.host->address,
+    sx->conn_args.host->port);
+  DEBUG(D_transport) debug_printf_indent("leased connection to %s %s\n",
+    sx->conn_args.host->name, callout_address);
+
+  sx->cctx.sock = fd;
+  sx->cctx.tls_ctx = NULL;
+  sx->inblock.cctx = sx->outblock.cctx = &sx->cctx;
+  sx->inblock.ptr = sx->inblock.ptrend = sx->inblock.buffer;
+
+  if (  getsockname(fd, (struct sockaddr *)(&interface_sock), &size) == 0
+     && smtp_write_command(sx, SCMD_FLUSH, "RSET\r\n") >= 0
+     && smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2',
+	  ob->command_timeout)
+     )
+    {
+    sending_ip_address = host_ntoa(-1, &interface_sock, NULL, &sending_port);
+    smtp_peer_options = m.peer_options;
+    sx->esmtp = m.esmtp;
+    if ((f.smtp_authenticated = m.authenticated))
+      {
+      client_authenticator = string_copy(m.auth);
+      client_authenticated_id = string_copy(m.auth + Ustrlen(m.auth) + 1);
+      }
+    return TRUE;
+    }
+
+  DEBUG(D_transport) debug_printf_indent("leased connection failed RSET\n");
+  (void) close(fd);
+  sx->cctx.sock = -1;
+  }
+return FALSE;
+}
+
+
+/*************************************************
+*       Park an idle connection in the cache     *
+*************************************************/
+
+/* Called from the smtp transport instead of sending QUIT, when the session is
+in good order.
+
+Arguments:
+  sx	     the SMTP context
+
+Returns:     TRUE if the helper has taken the connection; the caller should
+	     then close its copy without sending anything
+*/
+
+BOOL
+smtp_conn_cache_park(smtp_context * sx)
+{
+smtp_conn_cache_msg m = {.op = 'P', .peer_options = smtp_peer_options,
+			 .authenticated = f.smtp_authenticated,
+			 .esmtp = sx->esmtp};
+BOOL yield;
+
+if (  !smtp_connection_cache || sx->lmtp || sx->smtps || sx->cctx.tls_ctx
+   || smtp_peer_options & OPTION_TLS
+#ifndef DISABLE_TLS
+   || continue_proxy_cipher || tls_out.active.sock >= 0
+#endif
+   )
+  return FALSE;
+
+if (f.smtp_authenticated)
+  {
+  int nlen, ilen;
+
+  if (  !client_authenticator || !client_authenticated_id
+     || (nlen = Ustrlen(client_authenticator))
+	+ (ilen = Ustrlen(client_authenticated_id)) + 2 > sizeof(m.auth))
+    return FALSE;
+  memcpy(m.auth, client_authenticator, nlen + 1);
+  memcpy(m.auth + nlen + 1, client_authenticated_id, ilen + 1);
+  }
+
+if (  !smtp_conn_cache_auth_ok(sx, &m, TRUE)
+   || !smtp_conn_cache_key(sx, &m, TRUE))
+  return FALSE;
+
+yield = smtp_conn_cache_give(&m, sx->cctx.sock);
+
+DEBUG(D_transport) debug_printf_indent("connection %s\n",
+  yield ? "parked in cache" : "not parked");
+return yield;
+}
+
+
+/* The helper's connections, and its handling of one request. */
+
+static smtp_conn_cache_entry * conn_cache = NULL;
+static int conn_cache_count = 0;
+
+static void
+smtp_conn_cache_drop(int i, BOOL quit)
+{
+if (quit) (void) !write(conn_cache[i].fd, "QUIT\r\n", 6);
+(void) close(conn_cache[i].fd);
+conn_cache[i] = conn_cache[--conn_cache_count];
+}
+
+static void
+smtp_conn_cache_answer(int fd)
+{
+smtp_conn_cache_msg m;
+struct timeval tv = {.tv_sec = SMTP_CONN_CACHE_TIMEOUT};
+int pfd, count = 0, found = -1;
+
+(void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+if (!smtp_conn_cache_recv(fd, &m, &pfd)) return;
+
+for (int i = 0; i < conn_cache_count; i++)
+  if (Ustrcmp(conn_cache[i].m.key, m.key) == 0)
+    {
+    count++;
+    if (found < 0 || conn_cache[i].expires > conn_cache[found].expires)
+      found = i;
+    }
+
+if (m.op == 'P' && pfd >= 0)
+  {
+  if (  count < smtp_connection_cache_limit
+     && conn_cache_count < SMTP_CONN_CACHE_MAX)
+    {
+    smtp_conn_cache_entry * e = &conn_cache[conn_cache_count++];
+
+    e->fd = pfd;
+    e->expires = time(NULL) + smtp_connection_cache_timeout;
+    e->m = m;
+    pfd = -1;
+    m.op = 'Y';
+    DEBUG(D_transport) debug_printf("connection cache: parked %s\n", m.key);
+    }
+  else
+    m.op = 'N';
+  (void) smtp_conn_cache_send(fd, &m, -1);
+  }
+
+else if (m.op == 'L')
+  if (found >= 0)
+    {
+    m = conn_cache[found].m;
+    m.op = 'Y';
+    if (smtp_conn_cache_send(fd, &m, conn_cache[found].fd))
+      {
+      DEBUG(D_transport) debug_printf("connection cache: leased %s\n", m.key);
+      smtp_conn_cache_drop(found, FALSE);
+      }
+    }
+  else
+    {
+    m.op = 'N';
+    (void) smtp_conn_cache_send(fd, &m, -1);
+    }
+
+if (pfd >= 0) (void) close(pfd);
+}
+
+
+/*************************************************
+*     Hold idle connections, in a helper         *
+*************************************************/
+
+/* This is the main loop of the connection cache helper, which is started by
+the daemon. It holds at most smtp_connection_cache_limit idle connections for
+each key, and sends QUIT on any that have been idle for
+smtp_connection_cache_timeout. A parked connection that becomes readable has
+been closed by the server, or has had something (most likely a 421) sent on it,
+so it is dropped. The helper exits when the daemon goes away.
+
+Argument:  the listening socket
+Returns:   does not return
+*/
+
+void
+smtp_conn_cache_serve(int listen_fd)
+{
+BOOL * ready;
+pid_t daemon_pid = getppid();
+#ifndef NO_POLL_H
+struct pollfd * pfds;
+
+pfds = store_malloc((SMTP_CONN_CACHE_MAX + 1) * sizeof(struct pollfd));
+#endif
+
+conn_cache = store_malloc(SMTP_CONN_CACHE_MAX * sizeof(smtp_conn_cache_entry));
+ready = store_malloc((SMTP_CONN_CACHE_MAX + 1) * sizeof(BOOL));
+smtp_connection_cache = NULL;		/* Never park from here */
+
+for (;;)
+  {
+  time_t now = time(NULL);
+  int timeout = 30, n;			/* For noticing the daemon going */
+#ifdef NO_POLL_H
+  fd_set fds;
+  struct timeval tv;
+  int max_fd = listen_fd;
+#endif
+
+  for (int i = 0; i < conn_cache_count; )
+    if (conn_cache[i].expires <= now)
+      {
+      DEBUG(D_transport) debug_printf("connection cache: closing idle %s\n",
+	conn_cache[i].m.key);
+      smtp_conn_cache_drop(i, TRUE);
+      }
+    else
+      {
+      if (conn_cache[i].expires - now < timeout)
+	timeout = conn_cache[i].expires - now;
+      i++;
+      }
+
+#ifndef NO_POLL_H
+  pfds[0] = (struct pollfd) {.fd = listen_fd, .events = POLLIN};
+  for (int i = 0; i < conn_cache_count; i++)
+    pfds[i+1] = (struct pollfd) {.fd = conn_cache[i].fd, .events = POLLIN};
+
+  n = poll(pfds, conn_cache_count + 1, timeout * 1000);
+  ready[0] = n > 0 && pfds[0].revents & POLLIN;
+  for (int i = 1; i <= conn_cache_count; i++)
+    ready[i] = n > 0 && pfds[i].revents != 0;
+#else
+  FD_ZERO(&fds);
+  FD_SET(listen_fd, &fds);
+  for (int i = 0; i < conn_cache_count; i++)
+    {
+    FD_SET(conn_cache[i].fd, &fds);
+    if (conn_cache[i].fd > max_fd) max_fd = conn_cache[i].fd;
+    }
+  tv = (struct timeval) {.tv_sec = timeout};
+
+  n = select(max_fd + 1, (SELECT_ARG2_TYPE *)&fds, NULL, NULL, &tv);
+  ready[0] = n > 0 && FD_ISSET(listen_fd, &fds);
+  for (int i = 0; i < conn_cache_count; i++)
+    ready[i+1] = n > 0 && FD_ISSET(conn_cache[i].fd, &fds);
+#endif
+  if (n < 0)
+    {
+    if (errno == EINTR) continue;
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "connection cache: wait failed: %s",
+      strerror(errno));
+    }
+
+  if (getppid() != daemon_pid)
+    {
+    DEBUG(D_any) debug_printf("connection cache: daemon has gone; exiting\n");
+    while (conn_cache_count > 0) smtp_conn_cache_drop(0, TRUE);
+    exim_exit(EXIT_SUCCESS);
+    }
+  if (n == 0) continue;
+
+  /* Work down from the top, because dropping an entry moves the last one into
+  its place. */
+
+  for (int i = conn_cache_count - 1; i >= 0; i--)
+    if (ready[i+1])
+      {
+      DEBUG(D_transport) debug_printf("connection cache: %s closed by server\n",
+	conn_cache[i].m.key);
+      smtp_conn_cache_drop(i, FALSE);
+      }
+
+  if (ready[0])
+    {
+    int fd = accept(listen_fd, NULL, NULL);
+
+    if (fd >= 0)
+      {
+      smtp_conn_cache_answer(fd);
+      (void) close(fd);
+      }
+    }
+  }
+}
+
 /* End of smtp_out.c */
 /* vi: aw ai sw=2
 */
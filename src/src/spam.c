@@ -191,7 +191,8 @@ int sep = 0;
 const uschar *list = *listptr;
 uschar *user_name;
 unsigned long mbox_size;
-FILE *mbox_file;
+FILE *mbox_file = NULL;
+mbox_stream *ms;
 client_conn_ctx spamd_cctx = {.sock = -1};
 uschar spamd_buffer[32600];
 int i, j, offset, result;
@@ -256,9 +257,11 @@ if (  spam_ok
 if (spam_ok && Ustrcmp(prev_user_name, user_name) == 0)
   return override ? OK : spam_rc;
 
-/* make sure the eml mbox file is spooled up */
+/* make sure the eml mbox file is spooled up, unless the message can be sent
+straight from the spool */
 
-if (!(mbox_file = spool_mbox(&mbox_size, NULL, NULL)))
+if (  !(ms = spool_mbox_stream(&mbox_size))
+   && !(mbox_file = spool_mbox(&mbox_size, NULL, NULL)))
   {								/* error while spooling */
   log_write(0, LOG_MAIN|LOG_PANIC,
 	 "%s error while creating mbox spool file", loglabel);
@@ -421,7 +424,9 @@ pollfd.events = POLLOUT;
 (void)fcntl(spamd_cctx.sock, F_SETFL, O_NONBLOCK);
 do
   {
-  read = fread(spamd_buffer,1,sizeof(spamd_buffer),mbox_file);
+  read = ms
+    ? mbox_stream_read(ms, spamd_buffer, sizeof(spamd_buffer))
+    : fread(spamd_buffer,1,sizeof(spamd_buffer),mbox_file);
   if (read > 0)
     {
     offset = 0;
@@ -472,9 +477,9 @@ again:
       }
     }
   }
-while (!feof(mbox_file) && !ferror(mbox_file));
+while (ms ? !ms->eof && !ms->error : !feof(mbox_file) && !ferror(mbox_file));
 
-if (ferror(mbox_file))
+if (ms ? ms->error : ferror(mbox_file))
   {
   log_write(0, LOG_MAIN|LOG_PANIC,
     "%s error reading spool file: %s", loglabel, strerror(errno));
@@ -482,7 +487,7 @@ if (ferror(mbox_file))
   goto defer;
   }
 
-(void)fclose(mbox_file);
+if (ms) mbox_stream_close(ms); else (void)fclose(mbox_file);
 
 /* we're done sending, close socket for writing */
 if (!sd->is_rspamd)
@@ -632,7 +637,7 @@ return override
   : spam_rc;
 
 defer:
-  (void)fclose(mbox_file);
+  if (ms) mbox_stream_close(ms); else (void)fclose(mbox_file);
   return DEFER;
 }
 
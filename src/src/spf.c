@@ -33,6 +33,22 @@ SPF_response_t  *spf_response_2mx = NULL;
 
 SPF_dns_rr_t  * spf_nxdomain = NULL;
 
+/* Results already obtained on this connection, for the current HELO. An ACL
+commonly tests the spf condition for each recipient, and a connection may
+carry several messages from the same sender; each evaluation can cost many DNS
+lookups. The client address and HELO name are fixed between calls of
+spf_conn_init(), so the envelope sender and whether the query was a fallback
+one are enough for the key. */
+
+typedef struct spf_cache {
+  struct spf_cache *	next;
+  SPF_response_t *	response;
+  BOOL			fallback;
+  uschar		sender[1];	/* Extended as needed */
+} spf_cache;
+
+static spf_cache * spf_results = NULL;
+
 
 void
 spf_lib_version_report(FILE * fp)
@@ -269,6 +285,12 @@ spf_conn_init(uschar * spf_helo_domain, uschar * spf_remote_addr)
 DEBUG(D_receive)
   debug_printf("spf_conn_init: %s %s\n", spf_helo_domain, spf_remote_addr);
 
+for (spf_cache * c; c = spf_results; store_free(c))
+  {
+  spf_results = c->next;
+  if (c->response != spf_response) SPF_response_free(c->response);
+  }
+
 if (!spf_server && !spf_init()) return FALSE;
 
 if (SPF_server_set_rec_dom(spf_server, CS primary_hostname))
@@ -335,27 +357,57 @@ int sep = 0;
 const uschar *list = *listptr;
 uschar *spf_result_id;
 int rc = SPF_RESULT_PERMERROR;
+BOOL fallback = action == SPF_PROCESS_FALLBACK;
+spf_cache * c = NULL;
 
 DEBUG(D_receive) debug_printf("spf_process\n");
 
+if (spf_server && spf_request)
+  for (c = spf_results; c; c = c->next)
+    if (c->fallback == fallback && Ustrcmp(c->sender, spf_envelope_sender) == 0)
+      break;
+
 if (!(spf_server && spf_request))
   /* no global context, assume temp error and skip to evaluation */
   rc = SPF_RESULT_PERMERROR;
 
-else if (SPF_request_set_env_from(spf_request, CS spf_envelope_sender))
+else if (!c && SPF_request_set_env_from(spf_request, CS spf_envelope_sender))
   /* Invalid sender address. This should be a real rare occurrence */
   rc = SPF_RESULT_PERMERROR;
 
 else
   {
-  /* get SPF result */
-  if (action == SPF_PROCESS_FALLBACK)
+  if (c)
     {
-    SPF_request_query_fallback(spf_request, &spf_response, CS spf_guess);
-    spf_result_guessed = TRUE;
+    DEBUG(D_receive) debug_printf("spf: using earlier result for <%s>\n",
+      spf_envelope_sender);
+    spf_response = c->response;
+    if (fallback) spf_result_guessed = TRUE;
     }
+
+  /* get SPF result */
   else
-    SPF_request_query_mailfrom(spf_request, &spf_response);
+    {
+    spf_response = NULL;
+    if (fallback)
+      {
+      SPF_request_query_fallback(spf_request, &spf_response, CS spf_guess);
+      spf_result_guessed = TRUE;
+      }
+    else
+      SPF_request_query_mailfrom(spf_request, &spf_response);
+
+    if (spf_response)
+      {
+      int len = Ustrlen(spf_envelope_sender);
+      c = store_malloc(sizeof(spf_cache) + len);
+      memcpy(c->sender, spf_envelope_sender, len + 1);
+      c->response = spf_response;
+      c->fallback = fallback;
+      c->next = spf_results;
+      spf_results = c;
+      }
+    }
 
   /* set up expansion items */
   spf_header_comment     = US SPF_response_get_header_comment(spf_response);
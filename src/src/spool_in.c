@@ -11,10 +11,172 @@ not all are needed, and some functionality can be cut out. */
 
 
 #include "exim.h"
+#ifdef SUPPORT_ZSTD
+# include <zstd.h>
+#endif
 
 
 
 #ifndef COMPILE_UTILITY
+/* The byte of a data file to lock for a message; see below. It is beyond the
+first line, and usually beyond the end of the file. */
+
+static off_t
+spool_lock_offset(const uschar * id)
+{
+unsigned h = 0;
+
+for (int i = 0; i < MESSAGE_ID_LENGTH; i++) h = h * 33 + id[i];
+return SPOOL_DATA_START_OFFSET + (off_t)(h & 0x3fffffff);
+}
+
+
+/*************************************************
+*           Lock a data file                     *
+*************************************************/
+
+/* See spool_open_datafile() for what is locked.
+
+Arguments:  the open file and the message id
+Returns:    TRUE if the lock was obtained
+*/
+
+BOOL
+spool_lock_datafile(int fd, const uschar * id)
+{
+flock_t lock_data;
+
+lock_data.l_type = F_WRLCK;
+lock_data.l_whence = SEEK_SET;
+lock_data.l_start = 0;
+lock_data.l_len = SPOOL_DATA_START_OFFSET;
+
+return (spool_dedup_min_size > 0 || fcntl(fd, F_SETLK, &lock_data) == 0)
+  && (  lock_data.l_start = spool_lock_offset(id), lock_data.l_len = 1,
+	fcntl(fd, F_SETLK, &lock_data) == 0);
+}
+
+
+
+/*************************************************
+*       Read a possibly compressed data file     *
+*************************************************/
+
+/* A data file compressed by spool_compress_datafile() has "-Z" in place of
+"-D" at the end of its first line, followed by the data as a zstd stream.
+Everything that reads data files expects the data as it was written, starting
+at SPOOL_DATA_START_OFFSET, and some of it seeks in the file or hands it to
+sendfile(), so a compressed file is decompressed into a temporary file in the
+same directory, which is unlinked at once and has the usual first line.
+
+Arguments:
+  fd        the open data file
+  subdir    the spool subdirectory it is in
+  id        the message id
+Returns:    fd if the file is not compressed, an fd for the copy, positioned
+            at the start, if it is, or -1 on failure (logged); fd is left open
+*/
+
+int
+spool_datafile_plain(int fd, const uschar * subdir, const uschar * id)
+{
+uschar first[SPOOL_DATA_START_OFFSET];
+
+if (  pread(fd, first, sizeof(first), 0) != sizeof(first)
+   || first[SPOOL_DATA_START_OFFSET-2] != 'Z')
+  return fd;
+
+#ifdef SUPPORT_ZSTD
+  {
+  uschar ibuf[16384], obuf[16384];
+  uschar * tname = spool_fname(US"input", subdir, id,
+			      string_sprintf("-U%d", (int)getpid()));
+  ZSTD_DCtx * dc = NULL;
+  off_t off = SPOOL_DATA_START_OFFSET;
+  size_t zr = 1;
+  BOOL ok;
+  int tfd;
+
+  (void)Uunlink(tname);
+  if ((tfd = Uopen(tname,
+#ifdef O_CLOEXEC
+		    O_CLOEXEC |
+#endif
+		    O_RDWR | O_CREAT | O_EXCL, SPOOL_MODE)) < 0)
+    {
+    log_write(0, LOG_MAIN, "Failed to create %s: %s", tname, strerror(errno));
+    return -1;
+    }
+  (void)Uunlink(tname);
+#ifndef O_CLOEXEC
+  (void)fcntl(tfd, F_SETFD, fcntl(tfd, F_GETFD) | FD_CLOEXEC);
+#endif
+
+  first[SPOOL_DATA_START_OFFSET-2] = 'D';
+  ok = write(tfd, first, sizeof(first)) == sizeof(first)
+    && (dc = ZSTD_createDCtx());
+
+  /* Keep calling while there is input, or the output buffer was filled, as
+  there may then be more to come. */
+
+  while (ok)
+    {
+    ssize_t n = pread(fd, ibuf, sizeof(ibuf), off);
+    ZSTD_inBuffer in = { .src = ibuf, .size = n > 0 ? n : 0, .pos = 0 };
+    ZSTD_outBuffer out;
+
+    if (n <= 0)
+      {
+      ok = n == 0 && zr == 0;		/* the frame must be complete */
+      break;
+      }
+    off += n;
+    do
+      {
+      out = (ZSTD_outBuffer) { .dst = obuf, .size = sizeof(obuf), .pos = 0 };
+      zr = ZSTD_decompressStream(dc, &out, &in);
+      ok = !ZSTD_isError(zr) && write(tfd, obuf, out.pos) == (ssize_t)out.pos;
+      }
+    while (ok && (in.pos < in.size || out.pos == out.size));
+    }
+  ZSTD_freeDCtx(dc);
+
+  if (ok && lseek(tfd, 0, SEEK_SET) == 0)
+    {
+    DEBUG(D_deliver) debug_printf_indent("decompressed data file for %s\n", id);
+    return tfd;
+    }
+  log_write(0, LOG_MAIN|LOG_PANIC, "Failed to decompress data file for %s%s%s",
+    id, ZSTD_isError(zr) ? ": " : "", ZSTD_isError(zr) ? ZSTD_getErrorName(zr) : "");
+  (void)close(tfd);
+  return -1;
+  }
+#else
+log_write(0, LOG_MAIN|LOG_PANIC, "Data file for %s is compressed, but this "
+  "Exim was built without SUPPORT_ZSTD", id);
+return -1;
+#endif
+}
+
+
+
+/*************************************************
+*           Close a message's data file          *
+*************************************************/
+
+/* Close deliver_datafile, and the compressed file that holds the lock when it
+is a copy. This frees the lock. */
+
+void
+spool_close_datafile(void)
+{
+if (deliver_datafile >= 0) (void)close(deliver_datafile);
+if (deliver_datafile_lock >= 0) (void)close(deliver_datafile_lock);
+deliver_datafile = deliver_datafile_lock = -1;
+}
+
+
+
 /*************************************************
 *           Open and lock data file              *
 *************************************************/
@@ -38,8 +200,13 @@ int
 spool_open_datafile(uschar *id)
 {
 struct stat statbuf;
-flock_t lock_data;
-int fd;
+int fd, pfd;
+
+if (deliver_datafile_lock >= 0)
+  {
+  (void)close(deliver_datafile_lock);
+  deliver_datafile_lock = -1;
+  }
 
 /* If split_spool_directory is set, first look for the file in the appropriate
 sub-directory of the input directory. If it is not found there, try the input
@@ -93,18 +260,19 @@ because this apparently is needed for running Exim under Cygwin. If the entire
 file is locked in one process, a sub-process cannot access it, even when passed
 an open file descriptor (at least, I think that's the Cygwin story). On real
 Unix systems it doesn't make any difference as long as Exim is consistent in
-what it locks. */
+what it locks.
+
+When spool_dedup_min_size is set, messages can share a data file, so the lock
+must instead be on a byte chosen by the message id. That byte is locked in any
+case, so that processes with the option set and unset exclude each other. Two
+messages that share a file and happen to get the same byte cannot be delivered
+at the same time, which does no harm. */
 
 #ifndef O_CLOEXEC
 (void)fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 #endif
 
-lock_data.l_type = F_WRLCK;
-lock_data.l_whence = SEEK_SET;
-lock_data.l_start = 0;
-lock_data.l_len = SPOOL_DATA_START_OFFSET;
-
-if (fcntl(fd, F_SETLK, &lock_data) < 0)
+if (!spool_lock_datafile(fd, id))
   {
   log_write(L_skip_delivery, LOG_MAIN,
       "Spool file for %s is locked (another process is handling this message)",
@@ -114,6 +282,21 @@ if (fcntl(fd, F_SETLK, &lock_data) < 0)
   return -1;
   }
 
+/* A compressed file is read through an uncompressed copy, while the file
+itself stays open to hold the lock. */
+
+if ((pfd = spool_datafile_plain(fd, message_subdir, id)) != fd)
+  {
+  if (pfd < 0)
+    {
+    (void)close(fd);
+    errno = EIO;
+    return -1;
+    }
+  deliver_datafile_lock = fd;
+  fd = pfd;
+  }
+
 /* Get the size of the data; don't include the leading filename line
 in the count, but add one for the newline before the data. */
 
@@ -129,6 +312,141 @@ return fd;
 
 
 
+/*************************************************
+*          Read from a spool header file         *
+*************************************************/
+
+/* A header file is in the text format, which is read via stdio, or in the
+binary format (see spool_out.c). After its first line, the binary format is a
+sequence of records, each being a four-byte big-endian length followed by that
+many bytes. That part of the file is mapped into memory, and these functions
+present it as though it were the text, with a newline at the end of each
+record, so that the same code parses the envelope for both. The message
+headers are handled separately. */
+
+typedef struct spool_hfile {
+  FILE *	fp;
+  uschar *	map;		/* the mapped file, binary format only */
+  size_t	size;		/* size of the mapping */
+  size_t	off;		/* offset of the next unread byte */
+  size_t	left;		/* bytes remaining in the current record */
+  BOOL		in_rec;		/* part way through a record */
+} spool_hfile;
+
+
+/* Start on the next record. Returns FALSE at the end of the file, or if the
+record is truncated; errno is zero in both cases. */
+
+static BOOL
+spool_hfile_rec(spool_hfile * sf)
+{
+const uschar * p = sf->map + sf->off;
+
+errno = 0;
+if (sf->size - sf->off < 4) return FALSE;
+sf->left = (size_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+sf->off += 4;
+if (sf->left > sf->size - sf->off) return FALSE;
+sf->in_rec = TRUE;
+return TRUE;
+}
+
+
+/* Copy up to count bytes of the text, stopping after a newline if line is
+set. Returns the number of bytes copied. */
+
+static size_t
+spool_hfile_copy(uschar * buf, size_t count, spool_hfile * sf, BOOL line)
+{
+size_t n = 0;
+
+while (n < count)
+  if (!sf->in_rec && !spool_hfile_rec(sf))
+    break;
+  else if (sf->left == 0)
+    {
+    buf[n++] = '\n';
+    sf->in_rec = FALSE;
+    if (line) break;
+    }
+  else
+    {
+    size_t k = sf->left < count - n ? sf->left : count - n;
+    memcpy(buf + n, sf->map + sf->off, k);
+    sf->off += k;
+    sf->left -= k;
+    n += k;
+    }
+return n;
+}
+
+
+/* The equivalent of fgets() */
+
+static uschar *
+spool_hfile_gets(uschar * buf, int size, spool_hfile * sf)
+{
+size_t n;
+
+if (!sf->map) return Ufgets(buf, size, sf->fp);
+if ((n = spool_hfile_copy(buf, size - 1, sf, TRUE)) == 0) return NULL;
+buf[n] = 0;
+return buf;
+}
+
+
+/* The equivalent of fread() of bytes */
+
+static size_t
+spool_hfile_read(uschar * buf, size_t count, spool_hfile * sf)
+{
+return sf->map
+  ? spool_hfile_copy(buf, count, sf, FALSE) : fread(buf, 1, count, sf->fp);
+}
+
+
+static void
+spool_hfile_close(spool_hfile * sf)
+{
+if (sf->map) munmap(sf->map, sf->size);
+fclose(sf->fp);
+}
+
+
+/* Check the first line of a header file, which has been read into the big
+buffer, and for the binary format map the rest of the file. Returns FALSE if
+the file is malformed or cannot be mapped; errno is zero for the former. */
+
+static BOOL
+spool_hfile_start(const uschar * name, spool_hfile * sf)
+{
+struct stat statbuf;
+void * map;
+int n;
+
+errno = 0;
+if (Ustrncmp(big_buffer, name, MESSAGE_ID_LENGTH + 2) != 0)
+  return FALSE;
+if ((n = Ustrlen(big_buffer)) == MESSAGE_ID_LENGTH + 3)
+  return TRUE;
+
+if (  n != MESSAGE_ID_LENGTH + 3 + Ustrlen(SPOOL_HDR_BINARY_TAG)
+   || Ustrcmp(big_buffer + MESSAGE_ID_LENGTH + 2, SPOOL_HDR_BINARY_TAG "\n")
+      != 0)
+  return FALSE;
+
+if (fstat(fileno(sf->fp), &statbuf) < 0) return FALSE;
+if ((map = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE,
+		fileno(sf->fp), 0)) == MAP_FAILED)
+  return FALSE;
+sf->map = map;
+sf->size = statbuf.st_size;
+sf->off = n;
+return TRUE;
+}
+
+
+
 /*************************************************
 *    Read non-recipients tree from spool file    *
 *************************************************/
@@ -144,32 +462,11 @@ makes it easy to read back into a tree. The format is as follows:
 This function is entered with the next input line in the buffer. Note we must
 save the right flag before recursing with the same buffer.
 
-Once the tree is read, we re-construct the balance fields by scanning the tree.
-I forgot to write them out originally, and the compatible fix is to do it this
-way. This initial local recursing function does the necessary.
+The names are put into a hash table; the shape of the tree is not kept.
 
 Arguments:
-  node      tree node
-
-Returns:    maximum depth below the node, including the node itself
-*/
-
-static int
-count_below(tree_node *node)
-{
-int nleft, nright;
-if (node == NULL) return 0;
-nleft = count_below(node->left);
-nright = count_below(node->right);
-node->balance = (nleft > nright)? 1 : ((nright > nleft)? 2 : 0);
-return 1 + ((nleft > nright)? nleft : nright);
-}
-
-/* This is the real function...
-
-Arguments:
-  connect      pointer to the root of the tree
-  f            FILE to read data from
+  t            the table
+  sf           spool file to read data from
   buffer       contains next input line; further lines read into it
   buffer_size  size of the buffer
 
@@ -177,37 +474,30 @@ Returns:       FALSE on format error
 */
 
 static BOOL
-read_nonrecipients_tree(tree_node **connect, FILE *f, uschar *buffer,
+read_nonrecipients_tree(tree_hash *t, spool_hfile *sf, uschar *buffer,
   int buffer_size)
 {
 tree_node *node;
 int n = Ustrlen(buffer);
-BOOL right = buffer[1] == 'Y';
+BOOL left = buffer[0] == 'Y', right = buffer[1] == 'Y';
 
 if (n < 5) return FALSE;    /* malformed line */
 buffer[n-1] = 0;            /* Remove \n */
 node = store_get(sizeof(tree_node) + n - 3, TRUE);	/* rcpt names tainted */
-*connect = node;
 Ustrcpy(node->name, buffer + 3);
 node->data.ptr = NULL;
+(void) tree_hash_insert(t, node);
 
-if (buffer[0] == 'Y')
-  {
-  if (Ufgets(buffer, buffer_size, f) == NULL ||
-    !read_nonrecipients_tree(&node->left, f, buffer, buffer_size))
+if (left)
+  if (spool_hfile_gets(buffer, buffer_size, sf) == NULL ||
+    !read_nonrecipients_tree(t, sf, buffer, buffer_size))
       return FALSE;
-  }
-else node->left = NULL;
 
 if (right)
-  {
-  if (Ufgets(buffer, buffer_size, f) == NULL ||
-    !read_nonrecipients_tree(&node->right, f, buffer, buffer_size))
+  if (spool_hfile_gets(buffer, buffer_size, sf) == NULL ||
+    !read_nonrecipients_tree(t, sf, buffer, buffer_size))
       return FALSE;
-  }
-else node->right = NULL;
 
-(void) count_below(*connect);
 return TRUE;
 }
 
@@ -234,6 +524,9 @@ deliver_frozen_at = 0;
 f.deliver_manual_thaw = FALSE;
 /* f.dont_deliver must NOT be reset */
 header_list = header_last = NULL;
+#ifndef COMPILE_UTILITY
+header_index_reset();
+#endif
 host_lookup_deferred = FALSE;
 host_lookup_failed = FALSE;
 interface_address = NULL;
@@ -244,6 +537,7 @@ local_scan_data = NULL;
 #endif
 max_received_linelength = 0;
 message_linecount = 0;
+message_priority = 0;
 received_protocol = NULL;
 received_count = 0;
 recipients_list = NULL;
@@ -260,8 +554,11 @@ f.sender_set_untrusted = FALSE;
 smtp_active_hostname = primary_hostname;
 #ifndef COMPILE_UTILITY
 f.spool_file_wireformat = FALSE;
+f.spool_file_dotfree = FALSE;
+spool_body_hash = NULL;
+spool_file_compressed = 0;
 #endif
-tree_nonrecipients = NULL;
+tree_nonrecipients = (tree_hash) { .slots = NULL };
 
 #ifdef EXPERIMENTAL_BRIGHTMAIL
 bmi_run = 0;
@@ -270,6 +567,7 @@ bmi_verdicts = NULL;
 
 #ifndef DISABLE_DKIM
 dkim_signers = NULL;
+dkim_bodyhashes = NULL;
 f.dkim_disable_verify = FALSE;
 dkim_collect_input = 0;
 #endif
@@ -337,7 +635,7 @@ Returns:        spool_read_OK        success
 int
 spool_read_header(uschar *name, BOOL read_headers, BOOL subdir_set)
 {
-FILE * fp = NULL;
+spool_hfile sf = {0};
 int n;
 int rcount = 0;
 long int uid, gid;
@@ -358,7 +656,7 @@ for (int n = 0; n < 2; n++)
   if (!subdir_set)
     set_subdir_str(message_subdir, name, n);
 
-  if ((fp = Ufopen(spool_fname(US"input", message_subdir, name, US""), "rb")))
+  if ((sf.fp = Ufopen(spool_fname(US"input", message_subdir, name, US""), "rb")))
     break;
   if (n != 0 || subdir_set || errno != ENOENT)
     return spool_read_notopen;
@@ -371,12 +669,11 @@ DEBUG(D_deliver) debug_printf_indent("reading spool file %s\n", name);
 #endif  /* COMPILE_UTILITY */
 
 /* The first line of a spool file contains the message id followed by -H (i.e.
-the file name), in order to make the file self-identifying. */
+the file name), in order to make the file self-identifying. For the binary
+format, a tag follows; the rest of the file is then read from a mapping. */
 
-if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
-if (Ustrlen(big_buffer) != MESSAGE_ID_LENGTH + 3 ||
-    Ustrncmp(big_buffer, name, MESSAGE_ID_LENGTH + 2) != 0)
-  goto SPOOL_FORMAT_ERROR;
+if (Ufgets(big_buffer, big_buffer_size, sf.fp) == NULL) goto SPOOL_READ_ERROR;
+if (!spool_hfile_start(name, &sf)) goto SPOOL_READ_ERROR;
 
 /* The next three lines in the header file are in a fixed format. The first
 contains the login, uid, and gid of the user who caused the file to be written.
@@ -385,7 +682,7 @@ negative uids and gids. The second contains the mail address of the message's
 sender, enclosed in <>. The third contains the time the message was received,
 and the number of warning messages for delivery delays that have been sent. */
 
-if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
+if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
 
  {
   uschar *p = big_buffer + Ustrlen(big_buffer);
@@ -408,7 +705,7 @@ originator_uid = (uid_t)uid;
 originator_gid = (gid_t)gid;
 
 /* envelope from */
-if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
+if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
 n = Ustrlen(big_buffer);
 if (n < 3 || big_buffer[0] != '<' || big_buffer[n-2] != '>')
   goto SPOOL_FORMAT_ERROR;
@@ -418,7 +715,7 @@ Ustrncpy(sender_address, big_buffer+1, n-3);
 sender_address[n-3] = 0;
 
 /* time */
-if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
+if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
 if (sscanf(CS big_buffer, TIME_T_FMT " %d", &received_time.tv_sec, &warning_count) != 2)
   goto SPOOL_FORMAT_ERROR;
 received_time.tv_usec = 0;
@@ -457,7 +754,7 @@ for (;;)
   uschar * var;
   const uschar * p;
 
-  if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
+  if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
   if (big_buffer[0] != '-') break;
   while (  (len = Ustrlen(big_buffer)) == big_buffer_size-1
 	&& big_buffer[len-1] != '\n'
@@ -468,7 +765,7 @@ for (;;)
     buf = store_get_perm(big_buffer_size *= 2, FALSE);
     memcpy(buf, big_buffer, --len);
     big_buffer = buf;
-    if (Ufgets(big_buffer+len, big_buffer_size-len, fp) == NULL)
+    if (spool_hfile_gets(big_buffer+len, big_buffer_size-len, &sf) == NULL)
       goto SPOOL_READ_ERROR;
     }
   big_buffer[len-1] = 0;
@@ -499,7 +796,7 @@ for (;;)
       if (sscanf(CS endptr, " %d", &count) != 1) goto SPOOL_FORMAT_ERROR;
       node = acl_var_create(name);
       node->data.ptr = store_get(count + 1, tainted);
-      if (fread(node->data.ptr, 1, count+1, fp) < count) goto SPOOL_READ_ERROR;
+      if (spool_hfile_read(node->data.ptr, count+1, &sf) < count) goto SPOOL_READ_ERROR;
       ((uschar*)node->data.ptr)[count] = 0;
       }
 
@@ -540,7 +837,7 @@ for (;;)
       node->data.ptr = store_get(count + 1, tainted);
       /* We sanity-checked the count, so disable the Coverity error */
       /* coverity[tainted_data] */
-      if (fread(node->data.ptr, 1, count+1, fp) < count) goto SPOOL_READ_ERROR;
+      if (spool_hfile_read(node->data.ptr, count+1, &sf) < count) goto SPOOL_READ_ERROR;
       (US node->data.ptr)[count] = '\0';
       }
     break;
@@ -564,6 +861,10 @@ for (;;)
       dsn_ret= atoi(CS var + 7);
     else if (Ustrncmp(p, "sn_envid", 8) == 0)
       dsn_envid = string_copy_taint(var + 10, tainted);
+#ifndef DISABLE_DKIM
+    else if (Ustrncmp(p, "kim_bodyhashes ", 15) == 0)
+      dkim_bodyhashes = string_copy_taint(var + 16, tainted);
+#endif
     break;
 
     case 'f':
@@ -630,6 +931,11 @@ for (;;)
     if (*p == 0) f.dont_deliver = TRUE;   /* -N */
     break;
 
+    case 'p':
+    if (Ustrncmp(p, "riority ", 8) == 0)
+      message_priority = Uatoi(var + 9);
+    break;
+
     case 'r':
     if (Ustrncmp(p, "eceived_protocol", 16) == 0)
       received_protocol = string_copy_taint(var + 18, tainted);
@@ -655,6 +961,15 @@ for (;;)
 #ifndef COMPILE_UTILITY
     else if (Ustrncmp(p, "pool_file_wireformat", 20) == 0)
       f.spool_file_wireformat = TRUE;
+    else if (Ustrncmp(p, "pool_file_dotfree", 17) == 0)
+      f.spool_file_dotfree = TRUE;
+    else if (Ustrncmp(p, "pool_file_compressed ", 21) == 0)
+      spool_file_compressed = (off_t) strtoll(CS var + 22, NULL, 10);
+    else if (Ustrncmp(p, "pool_body_hash ", 15) == 0)
+      {			/* used in file names, so checked */
+      if (Ustrlen(var + 16) == 64 && strspn(CS var + 16, "0123456789abcdef") == 64)
+	spool_body_hash = string_copy_taint(var + 16, FALSE);
+      }
 #endif
 #if defined(SUPPORT_I18N) && !defined(COMPILE_UTILITY)
     else if (Ustrncmp(p, "mtputf8", 7) == 0)
@@ -720,22 +1035,24 @@ DEBUG(D_deliver)
 #endif  /* COMPILE_UTILITY */
 
 /* We now have the tree of addresses NOT to deliver to, or a line
-containing "XX", indicating no tree. */
+containing "XX", indicating no tree. It is read into a hash table. */
 
 if (Ustrncmp(big_buffer, "XX\n", 3) != 0 &&
-  !read_nonrecipients_tree(&tree_nonrecipients, fp, big_buffer, big_buffer_size))
+  !read_nonrecipients_tree(&tree_nonrecipients, &sf, big_buffer, big_buffer_size))
     goto SPOOL_FORMAT_ERROR;
 
 #ifndef COMPILE_UTILITY
-DEBUG(D_deliver) debug_print_tree("Non-recipients", tree_nonrecipients);
+DEBUG(D_deliver) debug_print_hash("Non-recipients", &tree_nonrecipients);
 #endif  /* COMPILE_UTILITY */
 
 /* After reading the tree, the next line has not yet been read into the
 buffer. It contains the count of recipients which follow on separate lines.
-Apply an arbitrary sanity check.*/
+Apply a sanity check that is no smaller than any message that can be received;
+a message for a large mailing list may have hundreds of thousands. */
 
-if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
-if (sscanf(CS big_buffer, "%d", &rcount) != 1 || rcount > 16384)
+if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
+if (  sscanf(CS big_buffer, "%d", &rcount) != 1 || rcount < 0
+   || rcount > INT_MAX / (int)sizeof(recipient_item))
   goto SPOOL_FORMAT_ERROR;
 
 #ifndef COMPILE_UTILITY
@@ -758,7 +1075,7 @@ for (recipients_count = 0; recipients_count < rcount; recipients_count++)
   uschar *errors_to = NULL;
   uschar *p;
 
-  if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
+  if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
   nn = Ustrlen(big_buffer);
   if (nn < 2) goto SPOOL_FORMAT_ERROR;
 
@@ -900,17 +1217,54 @@ always, in order to check on the format of the file, but only create a header
 list if requested to do so. */
 
 inheader = TRUE;
-if (Ufgets(big_buffer, big_buffer_size, fp) == NULL) goto SPOOL_READ_ERROR;
+if (spool_hfile_gets(big_buffer, big_buffer_size, &sf) == NULL) goto SPOOL_READ_ERROR;
 if (big_buffer[0] != '\n') goto SPOOL_FORMAT_ERROR;
 
-while ((n = fgetc(fp)) != EOF)
+/* In the binary format, each header is a record of its flag and text */
+
+if (sf.map)
+  {
+  while (spool_hfile_rec(&sf))
+    {
+    const uschar * p = sf.map + sf.off;
+    header_line * h;
+
+    if ((n = sf.left - 1) < 0 || memchr(p, 0, sf.left)) goto SPOOL_FORMAT_ERROR;
+    sf.off += sf.left;
+    sf.in_rec = FALSE;
+    if (*p != '*') message_size += n;  /* Omit non-transmitted headers */
+
+    if (read_headers)
+      {
+      h = store_get(sizeof(header_line), FALSE);
+      h->next = NULL;
+      h->type = *p++;
+      h->slen = n;
+      h->text = store_get(n+1, TRUE);	/* tainted */
+      memcpy(h->text, p, n);
+      h->text[n] = 0;
+
+      if (h->type == htype_received) received_count++;
+      if (h->type != htype_old)
+	for (const uschar * q = p; q = memchr(q, '\n', p + n - q); q++)
+	  message_linecount++;
+
+      if (header_list) header_last->next = h;
+      else header_list = h;
+      header_last = h;
+      }
+    }
+  if (sf.off != sf.size) goto SPOOL_FORMAT_ERROR;
+  }
+
+else while ((n = fgetc(sf.fp)) != EOF)
   {
   header_line *h;
   uschar flag[4];
   int i;
 
   if (!isdigit(n)) goto SPOOL_FORMAT_ERROR;
-  if(ungetc(n, fp) == EOF  ||  fscanf(fp, "%d%c ", &n, flag) == EOF)
+  if(ungetc(n, sf.fp) == EOF  ||  fscanf(sf.fp, "%d%c ", &n, flag) == EOF)
     goto SPOOL_READ_ERROR;
   if (flag[0] != '*') message_size += n;  /* Omit non-transmitted headers */
 
@@ -928,21 +1282,21 @@ while ((n = fgetc(fp)) != EOF)
     else header_list = h;
     header_last = h;
 
-    for (i = 0; i < n; i++)
-      {
-      int c = fgetc(fp);
-      if (c == 0 || c == EOF) goto SPOOL_FORMAT_ERROR;
-      if (c == '\n' && h->type != htype_old) message_linecount++;
-      h->text[i] = c;
-      }
-    h->text[i] = 0;
+    /* Read the text in one go, then check it */
+
+    if (n < 0 || fread(h->text, 1, n, sf.fp) != n || memchr(h->text, 0, n))
+      goto SPOOL_FORMAT_ERROR;
+    h->text[n] = 0;
+    if (h->type != htype_old)
+      for (const uschar * q = h->text; q = Ustrchr(q, '\n'); q++)
+	message_linecount++;
     }
 
   /* Not requiring header data, just skip through the bytes */
 
   else for (i = 0; i < n; i++)
     {
-    int c = fgetc(fp);
+    int c = fgetc(sf.fp);
     if (c == 0 || c == EOF) goto SPOOL_FORMAT_ERROR;
     }
   }
@@ -958,7 +1312,7 @@ DEBUG(D_deliver) debug_printf_indent("body_linecount=%d message_linecount=%d\n",
 
 message_linecount += body_linecount;
 
-fclose(fp);
+spool_hfile_close(&sf);
 return spool_read_OK;
 
 
@@ -975,7 +1329,7 @@ if (errno != 0)
   DEBUG(D_any) debug_printf("Error while reading spool file %s\n", name);
 #endif  /* COMPILE_UTILITY */
 
-  fclose(fp);
+  spool_hfile_close(&sf);
   errno = n;
   return inheader ? spool_read_hdrerror : spool_read_enverror;
   }
@@ -986,11 +1340,51 @@ SPOOL_FORMAT_ERROR:
 DEBUG(D_any) debug_printf("Format error in spool file %s\n", name);
 #endif  /* COMPILE_UTILITY */
 
-fclose(fp);
+spool_hfile_close(&sf);
 errno = ERRNO_SPOOLFORMAT;
 return inheader? spool_read_hdrerror : spool_read_enverror;
 }
 
+
+
+#ifndef COMPILE_UTILITY
+/*************************************************
+*      Read the priority class of a message      *
+*************************************************/
+
+/* A queue runner that schedules by priority class needs only that from each
+header file, so this reads no further than the line where it is written, just
+after the received time.
+
+Arguments:
+  name        name of the header file, including the -H
+  subdir      the spool subdirectory character, or 0
+
+Returns:      the priority class; 0 if none is set or the file cannot be read
+*/
+
+int
+spool_read_priority(const uschar * name, int subdir)
+{
+spool_hfile sf = {0};
+uschar subdir_str[2] = { subdir, 0 };
+int yield = 0;
+
+if (!(sf.fp = Ufopen(spool_fname(US"input", subdir_str, name, US""), "rb")))
+  return 0;
+if (Ufgets(big_buffer, big_buffer_size, sf.fp) && spool_hfile_start(name, &sf))
+  for (int i = 0; i < 5 && spool_hfile_gets(big_buffer, big_buffer_size, &sf);
+       i++)
+    if (i >= 3 && Ustrncmp(big_buffer, "-priority ", 10) == 0)
+      {
+      yield = Uatoi(big_buffer + 10);
+      break;
+      }
+spool_hfile_close(&sf);
+return yield;
+}
+#endif  /* COMPILE_UTILITY */
+
 /* vi: aw ai sw=2
 */
 /* End of spool_in.c */
@@ -19,6 +19,34 @@ extern int spam_ok;
 int spool_mbox_ok = 0;
 uschar spooled_message_id[MESSAGE_ID_LENGTH+1];
 
+
+/*
+Build everything in the MBOX-style file that precedes the message body: the
+From line, the envelope headers, the non-deleted header lines and the blank
+line that ends them.
+
+The $received_for variable is (up to at least Exim 4.64) never set here,
+because it is only set when expanding the contents of the Received: header
+line. However, the code below will use it if it should become available in
+future.
+*/
+
+static gstring *
+spool_mbox_head(void)
+{
+gstring * g = NULL;
+uschar * s = expand_string(
+    US"From ${if def:return_path{$return_path}{MAILER-DAEMON}} ${tod_bsdinbox}\n"
+    "${if def:sender_address{X-Envelope-From: <${sender_address}>\n}}"
+    "${if def:recipients{X-Envelope-To: ${recipients}\n}}");
+
+if (s) g = string_cat(g, s);
+for (header_line * h = header_list; h; h = h->next)
+  if (h->type != '*')
+    g = string_catn(g, h->text, h->slen);
+return string_catn(g, US"\n", 1);
+}
+
 /*
 Create an MBOX-style message file from the spooled files.
 
@@ -67,43 +95,18 @@ if (!spool_mbox_ok)
     goto OUT;
     }
 
-  /* Generate mailbox headers. The $received_for variable is (up to at least
-  Exim 4.64) never set here, because it is only set when expanding the
-  contents of the Received: header line. However, the code below will use it
-  if it should become available in future. */
-
-  temp_string = expand_string(
-    US"From ${if def:return_path{$return_path}{MAILER-DAEMON}} ${tod_bsdinbox}\n"
-    "${if def:sender_address{X-Envelope-From: <${sender_address}>\n}}"
-    "${if def:recipients{X-Envelope-To: ${recipients}\n}}");
-
-  if (temp_string)
-    if (fwrite(temp_string, Ustrlen(temp_string), 1, mbox_file) != 1)
-      {
-      log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
-	  mailbox headers to %s", mbox_path);
-      goto OUT;
-      }
-
-  /* write all non-deleted header lines to mbox file */
+  /* Generate mailbox headers, and write them with the message headers */
 
-  for (header_line * my_headerlist = header_list; my_headerlist;
-      my_headerlist = my_headerlist->next)
-    if (my_headerlist->type != '*')
-      if (fwrite(my_headerlist->text, my_headerlist->slen, 1, mbox_file) != 1)
-	{
-	log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
-	    message headers to %s", mbox_path);
-	goto OUT;
-	}
+  {
+  gstring * g = spool_mbox_head();
 
-  /* End headers */
-  if (fwrite("\n", 1, 1, mbox_file) != 1)
+  if (fwrite(g->s, g->ptr, 1, mbox_file) != 1)
     {
     log_write(0, LOG_MAIN|LOG_PANIC, "Error/short write while writing \
       message headers to %s", mbox_path);
     goto OUT;
     }
+  }
 
   /* Copy body file.  If the main receive still has it open then it is holding
   a lock, and we must not close it (which releases the lock), so just use the
@@ -117,9 +120,19 @@ if (!spool_mbox_ok)
     message_subdir[1] = '\0';
     for (int i = 0; i < 2; i++)
       {
+      int fd, pfd;
+
       set_subdir_str(message_subdir, message_id, i);
       temp_string = spool_fname(US"input", message_subdir, message_id, US"-D");
-      if ((l_data_file = Ufopen(temp_string, "rb"))) break;
+      if ((fd = Uopen(temp_string, O_RDONLY, 0)) < 0) continue;
+
+      /* A compressed file is read through an uncompressed copy */
+
+      if ((pfd = spool_datafile_plain(fd, message_subdir, message_id)) != fd)
+	(void)close(fd);
+      if (pfd >= 0 && !(l_data_file = fdopen(pfd, "rb")))
+	(void)close(pfd);
+      break;
       }
     }
 
@@ -201,11 +214,199 @@ return yield;
 
 
 
+/*
+When content_scan_direct is set, scanners that read the message as a stream
+take it from here instead of from a MBOX-style file. The part before the body
+is built in memory, and the body is read from the spool data file, which saves
+writing a copy of the message that is read once and then deleted. The data
+file is read with pread(), or sent with sendfile(), so that the position of
+spool_data_file is not disturbed; and as for spool_mbox(), it is not closed if
+this process already has it open, since that would release its lock.
+
+A data file in wire format would have to have its line endings changed, so in
+that case, or if a scan file has already been made, NULL is returned and the
+caller uses spool_mbox() as usual.
+
+Returns a pointer to the stream, and puts the size in bytes into
+mbox_file_size.
+*/
+
+mbox_stream *
+spool_mbox_stream(unsigned long * mbox_file_size)
+{
+mbox_stream * ms;
+struct stat statbuf;
+int fd = -1;
+
+if (!content_scan_direct || spool_mbox_ok || f.spool_file_wireformat)
+  return NULL;
+
+if (spool_data_file)
+  fd = fileno(spool_data_file);
+else
+  {
+  uschar message_subdir[2];
+
+  message_subdir[1] = '\0';
+  for (int i = 0; i < 2 && fd < 0; i++)
+    {
+    set_subdir_str(message_subdir, message_id, i);
+    fd = Uopen(spool_fname(US"input", message_subdir, message_id, US"-D"),
+		O_RDONLY, 0);
+    }
+  if (fd >= 0)
+    {
+    int pfd = spool_datafile_plain(fd, message_subdir, message_id);
+
+    if (pfd != fd)
+      {
+      (void)close(fd);
+      fd = pfd;
+      }
+    }
+  }
+
+if (fd < 0 || fstat(fd, &statbuf) != 0
+   || statbuf.st_size < SPOOL_DATA_START_OFFSET)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "Could not open datafile for message %s",
+    message_id);
+  if (fd >= 0 && !spool_data_file) (void)close(fd);
+  return NULL;
+  }
+
+ms = store_get(sizeof(mbox_stream), FALSE);
+memset(ms, 0, sizeof(*ms));
+ms->head = spool_mbox_head();
+ms->fd = fd;
+ms->own_fd = !spool_data_file;
+ms->off = SPOOL_DATA_START_OFFSET;
+ms->end = statbuf.st_size;
+
+*mbox_file_size = ms->head->ptr + (ms->end - ms->off);
+DEBUG(D_acl) debug_printf_indent("scanning message %s from spool, size %lu\n",
+  message_id, *mbox_file_size);
+return ms;
+}
+
+
+/* Read from a stream, in the manner of fread(): a short count means the end,
+or an error, which are noted in the stream. */
+
+size_t
+mbox_stream_read(mbox_stream * ms, uschar * buf, size_t len)
+{
+ssize_t n;
+
+if (ms->hoff < ms->head->ptr)
+  {
+  n = MIN(len, ms->head->ptr - ms->hoff);
+  memcpy(buf, ms->head->s + ms->hoff, n);
+  ms->hoff += n;
+  return n;
+  }
+if (ms->off >= ms->end || ms->error)
+  {
+  ms->eof = TRUE;
+  return 0;
+  }
+if ((n = pread(ms->fd, buf, MIN(len, ms->end - ms->off), ms->off)) <= 0)
+  {
+  if (n < 0) ms->error = TRUE; else ms->eof = TRUE;
+  return 0;
+  }
+ms->off += n;
+return n;
+}
+
+
+/* Read a line from a stream, in the manner of fgets(). */
+
+uschar *
+mbox_stream_gets(mbox_stream * ms, uschar * buf, int size)
+{
+int len = 0;
+
+while (len < size - 1)
+  {
+  uschar * nl;
+  int n;
+
+  if (ms->rpos >= ms->rlen)
+    {
+    ms->rpos = 0;
+    if (!(ms->rlen = mbox_stream_read(ms, ms->rbuf, sizeof(ms->rbuf))))
+      break;
+    }
+  n = MIN(ms->rlen - ms->rpos, size - 1 - len);
+  if ((nl = memchr(ms->rbuf + ms->rpos, '\n', n)))
+    n = nl - (ms->rbuf + ms->rpos) + 1;
+  memcpy(buf + len, ms->rbuf + ms->rpos, n);
+  ms->rpos += n;
+  len += n;
+  if (nl) break;
+  }
+if (len == 0) return NULL;
+buf[len] = '\0';
+return buf;
+}
+
+
+/* Send the whole of a stream down a socket, which must not be non-blocking.
+The body goes by sendfile() if the OS has it.
+
+Returns:  TRUE on success, FALSE with errno set on failure
+*/
+
+BOOL
+mbox_stream_send(mbox_stream * ms, int sock)
+{
+uschar buffer[16384];
+size_t n;
+
+while (ms->hoff < ms->head->ptr)
+  {
+  ssize_t sent = send(sock, ms->head->s + ms->hoff, ms->head->ptr - ms->hoff, 0);
+  if (sent < 0) return FALSE;
+  ms->hoff += sent;
+  }
+
+#ifdef OS_SENDFILE
+while (ms->off < ms->end)
+  {
+  ssize_t copied = os_sendfile(sock, ms->fd, &ms->off, ms->end - ms->off);
+  if (copied < 0) return FALSE;
+  if (copied == 0) { errno = EPIPE; return FALSE; }	/* file shrank */
+  }
+#endif
+
+while ((n = mbox_stream_read(ms, buffer, sizeof(buffer))) > 0)
+  for (uschar * p = buffer; n > 0; )
+    {
+    ssize_t sent = send(sock, p, n, 0);
+    if (sent < 0) return FALSE;
+    p += sent;
+    n -= sent;
+    }
+return !ms->error;
+}
+
+
+void
+mbox_stream_close(mbox_stream * ms)
+{
+if (ms->own_fd) (void)close(ms->fd);
+}
+
+
+
+
 /* remove mbox spool file and temp directory */
 void
 unspool_mbox(void)
 {
 spam_ok = 0;
+malware_bg_cancel();
 malware_ok = 0;
 
 if (spool_mbox_ok && !f.no_mbox_unspool)
@@ -11,6 +11,14 @@
 
 #include "exim.h"
 
+#ifdef SUPPORT_IO_URING
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+#endif
+#ifdef SUPPORT_ZSTD
+# include <zstd.h>
+#endif
+
 
 
 /*************************************************
@@ -105,13 +113,497 @@ return fd;
 
 
 
+/*************************************************
+*          Sync a file, sharing the work         *
+*************************************************/
+
+/* Every message that is received or delivered costs several calls of fsync(),
+and on a busy server much of the time of each process goes in waiting for
+them. When fsync_group_commit is set and the OS has syncfs(), processes that
+want a file system synced at about the same time share the work: one of them
+syncs the whole file system while the others wait, and a sync that started
+after a process wrote its data does just as well as one of its own.
+
+The coordination is done in a file in the hints directory that holds a slot
+for each of a few file systems, with a count of the syncs started and the
+number of the last one completed. A process notes the count after writing, then
+takes an fcntl() lock on the slot. If by then a later sync has completed,
+there is nothing more to do; otherwise this process starts the next one,
+holding the lock while it runs, so that processes arriving meanwhile queue up
+for the one after. Any trouble with the file means a plain fsync(). */
+
+#define FSYNC_GROUP_SLOTS 64
+
+typedef struct {
+  uint64_t	dev;
+  uint64_t	started;
+  uint64_t	completed;
+} fsync_group_slot;
+
+static int fsync_group_fd = -1;
+static BOOL fsync_group_tried = FALSE;
+
+
+/* Open the file, creating it if necessary. This is called before a local
+delivery process gives up privilege, so that the transport can use it. */
+
+void
+spool_fsync_group_open(void)
+{
+#ifdef EXIM_HAVE_SYNCFS
+uschar * fname;
+
+if (!fsync_group_commit || fsync_group_fd >= 0 || fsync_group_tried) return;
+fsync_group_tried = TRUE;
+
+fname = string_sprintf("%s/db/fsyncgroup", spool_directory);
+if ((fsync_group_fd = Uopen(fname, O_RDWR|O_CREAT, EXIMDB_MODE)) < 0
+   && errno == ENOENT)
+  {
+  (void)directory_make(spool_directory, US"db", EXIMDB_DIRECTORY_MODE, FALSE);
+  fsync_group_fd = Uopen(fname, O_RDWR|O_CREAT, EXIMDB_MODE);
+  }
+if (fsync_group_fd < 0)
+  {
+  DEBUG(D_any) debug_printf("fsync group file %s: %s\n", fname,
+    strerror(errno));
+  return;
+  }
+(void)fcntl(fsync_group_fd, F_SETFD, fcntl(fsync_group_fd, F_GETFD) | FD_CLOEXEC);
+if (getuid() == root_uid)
+  (void) exim_fchown(fsync_group_fd, exim_uid, exim_gid, fname);
+#endif
+}
+
+
+/* Sync a file to disk, as fsync() does.
+
+Argument:   the file descriptor
+Returns:    0 on success, -1 on failure with errno set
+*/
+
+int
+spool_fsync_group(int fd)
+{
+#ifdef EXIM_HAVE_SYNCFS
+struct stat statbuf;
+struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET,
+		      .l_len = sizeof(fsync_group_slot) };
+fsync_group_slot slot;
+uint64_t ticket = 0;
+int rc;
+
+if (!fsync_group_commit) return fsync(fd);
+spool_fsync_group_open();
+if (fsync_group_fd < 0 || fstat(fd, &statbuf) != 0) return fsync(fd);
+
+lock.l_start = (off_t)((uint64_t)statbuf.st_dev % FSYNC_GROUP_SLOTS)
+		* sizeof(fsync_group_slot);
+
+/* Note how many syncs had started once our data was written. A slot holding
+another file system's counts gives a ticket that is too high, which costs at
+worst a sync of our own. */
+
+if (pread(fsync_group_fd, &slot, sizeof(slot), lock.l_start) == sizeof(slot))
+  ticket = slot.started;
+
+if (fcntl(fsync_group_fd, F_SETLKW, &lock) < 0) return fsync(fd);
+
+if (pread(fsync_group_fd, &slot, sizeof(slot), lock.l_start) != sizeof(slot))
+  memset(&slot, 0, sizeof(slot));
+if (slot.dev != (uint64_t)statbuf.st_dev)
+  {
+  slot.dev = (uint64_t)statbuf.st_dev;
+  slot.started = slot.completed = 0;
+  }
+else if (slot.completed > ticket)
+  {
+  DEBUG(D_any) debug_printf("fsync of fd %d covered by group sync %lu\n", fd,
+    (unsigned long)slot.completed);
+  lock.l_type = F_UNLCK;
+  (void)fcntl(fsync_group_fd, F_SETLK, &lock);
+  return 0;
+  }
+
+/* Start the next sync, and record its completion */
+
+slot.started++;
+(void)pwrite(fsync_group_fd, &slot, sizeof(slot), lock.l_start);
+rc = syncfs(fd);
+if (rc == 0)
+  {
+  slot.completed = slot.started;
+  (void)pwrite(fsync_group_fd, &slot, sizeof(slot), lock.l_start);
+  }
+DEBUG(D_any) debug_printf("group sync %lu for fd %d: %s\n",
+  (unsigned long)slot.started, fd, rc == 0 ? "done" : strerror(errno));
+
+lock.l_type = F_UNLCK;
+(void)fcntl(fsync_group_fd, F_SETLK, &lock);
+return rc == 0 ? 0 : fsync(fd);
+
+#else
+return fsync(fd);
+#endif
+}
+
+
+
+
+#ifdef SUPPORT_IO_URING
+/*************************************************
+*     Commit a received message with io_uring    *
+*************************************************/
+
+/* The system calls that make a newly received message safe are, in order,
+the sync of the data file, the sync of the header file under its temporary
+name, the rename of the header file into place, and the sync of the directory.
+With io_uring these can go to the kernel as one chain of linked requests,
+each started only if the one before it succeeded, and the process waits for
+the lot in a single system call. The files are still written through stdio.
+
+The ring is set up the first time it is needed in a process. If that fails, or
+the kernel does not support the operations, or the syncs are being shared
+between processes by fsync_group_commit, the usual calls are made. */
+
+#define URING_ENTRIES 8
+
+static struct {
+  int		fd;
+  pid_t		pid;			/* process that set it up, or tried to */
+  unsigned *	sq_head;
+  unsigned *	sq_tail;
+  unsigned *	sq_mask;
+  unsigned *	sq_array;
+  unsigned *	cq_head;
+  unsigned *	cq_tail;
+  unsigned *	cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+} uring = { .fd = -1 };
+
+static BOOL uring_data_deferred = FALSE;
+
+
+/* Set up the ring, if it has not already been tried in this process. One
+inherited from a parent process is abandoned.
+
+Returns:   TRUE if the ring can be used
+*/
+
+static BOOL
+spool_uring_setup(void)
+{
+struct io_uring_params p;
+struct io_uring_probe * probe;
+size_t probe_size, sq_size, cq_size;
+uschar * sq, * cq = NULL;
+void * sqes = MAP_FAILED;
+int fd;
+
+if (uring.pid == getpid()) return uring.fd >= 0;
+if (uring.fd >= 0) (void)close(uring.fd);
+uring.fd = -1;
+uring.pid = getpid();
+
+memset(&p, 0, sizeof(p));
+if ((fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+  {
+  DEBUG(D_receive) debug_printf("io_uring setup: %s\n", strerror(errno));
+  return FALSE;
+  }
+
+probe_size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+probe = store_get(probe_size, FALSE);
+memset(probe, 0, probe_size);
+if (  syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0
+   || probe->last_op < IORING_OP_RENAMEAT
+   || !(probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED)
+   || !(probe->ops[IORING_OP_RENAMEAT].flags & IO_URING_OP_SUPPORTED)
+   )
+  {
+  DEBUG(D_receive) debug_printf("io_uring does not support fsync and rename\n");
+  (void)close(fd);
+  return FALSE;
+  }
+
+sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+if (p.features & IORING_FEAT_SINGLE_MMAP && cq_size > sq_size)
+  sq_size = cq_size;
+
+if (  (sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	    fd, IORING_OFF_SQ_RING)) == MAP_FAILED
+   || (cq = p.features & IORING_FEAT_SINGLE_MMAP
+	  ? sq
+	  : mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	      fd, IORING_OFF_CQ_RING)) == MAP_FAILED
+   || (sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	      PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+	      fd, IORING_OFF_SQES)) == MAP_FAILED
+   )
+  {
+  DEBUG(D_receive) debug_printf("io_uring mmap: %s\n", strerror(errno));
+  if (sq != MAP_FAILED) (void)munmap(sq, sq_size);
+  if (cq && cq != MAP_FAILED && cq != sq) (void)munmap(cq, cq_size);
+  (void)close(fd);
+  return FALSE;
+  }
+
+uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+uring.sqes = sqes;
+uring.fd = fd;
+DEBUG(D_receive) debug_printf("io_uring set up for spool commits\n");
+return TRUE;
+}
+
+
+/* Submit the chain of requests and wait for them all to complete. A request
+that follows a failed one completes with ECANCELED. As for the usual calls,
+EINVAL from the directory sync is ignored.
+
+Arguments:
+  dfd        the data file, or -1 if it does not need syncing
+  hfd        the header file
+  tname      the header file's temporary name
+  fname      the header file's final name
+  dirfd      the spool directory, or -1 if it does not need syncing
+
+Returns:     0 on success;
+             -1 if nothing was done, so the usual calls should be made;
+             otherwise the step that failed, with errno set: 1 for the data
+               file sync, 2 for the header file sync, 3 for the rename, 4 for
+               the directory sync
+*/
+
+static int
+spool_uring_commit(int dfd, int hfd, const uschar * tname, const uschar * fname,
+  int dirfd)
+{
+int fds[4] = { dfd, hfd, AT_FDCWD, dirfd };
+int res[4] = { 0, 0, 0, 0 };
+unsigned tail = *uring.sq_tail, mask = *uring.sq_mask, head;
+int n = 0, done = 0, to_submit;
+struct io_uring_sqe * sqe = NULL;
+
+for (int step = 0; step < 4; step++) if (fds[step] != -1)
+  {
+  unsigned idx = (tail + n++) & mask;
+
+  sqe = uring.sqes + idx;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = step;
+  sqe->fd = fds[step];
+  sqe->flags = IOSQE_IO_LINK;
+  if (step == 2)
+    {
+    sqe->opcode = IORING_OP_RENAMEAT;
+    sqe->addr = (uintptr_t)tname;
+    sqe->len = AT_FDCWD;
+    sqe->addr2 = (uintptr_t)fname;
+    }
+  else
+    sqe->opcode = IORING_OP_FSYNC;
+  uring.sq_array[idx] = idx;
+  }
+sqe->flags = 0;					/* end of the chain */
+__atomic_store_n(uring.sq_tail, tail + n, __ATOMIC_RELEASE);
+
+for (to_submit = n; done < n; )
+  {
+  int rc = syscall(__NR_io_uring_enter, uring.fd, to_submit, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+  if (rc < 0)
+    {
+    if (errno == EINTR) continue;
+    DEBUG(D_receive) debug_printf("io_uring enter: %s\n", strerror(errno));
+
+    /* The ring is not used again in this process. If the kernel has not
+    taken the requests, withdraw them and let the usual calls be made. */
+
+    (void)close(uring.fd);
+    uring.fd = -1;
+    if (__atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == tail)
+      return -1;
+    return 1;
+    }
+  to_submit -= rc;
+
+  head = *uring.cq_head;
+  for ( ; head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE); head++)
+    {
+    struct io_uring_cqe * cqe = uring.cqes + (head & *uring.cq_mask);
+    if (cqe->user_data < 4) res[cqe->user_data] = cqe->res;
+    done++;
+    }
+  __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+for (int step = 0; step < 4; step++)
+  if (res[step] < 0 && !(step == 3 && res[step] == -EINVAL))
+    {
+    errno = -res[step];
+    return step + 1;
+    }
+return 0;
+}
+
+
+/* This is called when the data file of a message that is being received has
+been written. If the ring can be used, the sync of the data file is left to be
+done in the same chain as the header file's.
+
+Returns:   TRUE if the caller should not sync the data file
+*/
+
+BOOL
+spool_uring_defer_data_sync(void)
+{
+uring_data_deferred = !fsync_group_commit
+#ifdef ENABLE_DISABLE_FSYNC
+  && !disable_fsync
+#endif
+  && spool_uring_setup();
+return uring_data_deferred;
+}
+#endif	/* SUPPORT_IO_URING */
+
+
+
+/*************************************************
+*        Write items to the header file          *
+*************************************************/
+
+/* The header file is written in the text format, or in the binary format if
+spool_header_binary is set. In the binary format, everything after the first
+line is a sequence of records, each being a four-byte big-endian length
+followed by that many bytes. The envelope records have the content of the
+lines of the text format, without the newline, and each message header is a
+record of its flag character followed by its text. This allows
+spool_read_header() to work from a mapping of the file, without searching for
+ends of lines or reading headers byte by byte. */
+
+static BOOL spool_hdr_binary;
+
+
+/* Write a record of given data; in the text format, a line. */
+
+static void
+spool_record(FILE * fp, const uschar * data, int len)
+{
+if (spool_hdr_binary)
+  {
+  uschar l[4] = { len >> 24, len >> 16, len >> 8, len };
+  fwrite(l, 1, sizeof(l), fp);
+  }
+fwrite(data, 1, len, fp);
+if (!spool_hdr_binary) putc('\n', fp);
+}
+
+
+/* Write a formatted record; the format does not include the newline. */
+
+static void PRINTF_FUNCTION(2,3)
+spool_line(FILE * fp, const char * format, ...)
+{
+va_list ap;
+
+va_start(ap, format);
+if (spool_hdr_binary)
+  {
+  uschar buf[1024];
+  uschar * s = buf;
+  int len;
+  va_list aq;
+
+  va_copy(aq, ap);
+  if ((len = vsnprintf(CS buf, sizeof(buf), format, ap)) >= sizeof(buf))
+    (void) vsnprintf(CS (s = store_get(len + 1, FALSE)), len + 1, format, aq);
+  va_end(aq);
+  spool_record(fp, s, len);
+  }
+else
+  {
+  vfprintf(fp, format, ap);
+  putc('\n', fp);
+  }
+va_end(ap);
+}
+
+
 static void
 spool_var_write(FILE * fp, const uschar * name, const uschar * val)
 {
-if (is_tainted(val)) putc('-', fp);
-fprintf(fp, "-%s %s\n", name, val);
+spool_line(fp, "%s-%s %s", is_tainted(val) ? "-" : "", name, val);
 }
 
+
+/* Write an ACL variable; used as a callback for tree_walk(). To retain spool
+file compatibility, what is written is -aclc or -aclm followed by the rest of
+the name and the data length, space separated, then the value itself as a
+separate line (or record). When we had only numbered ACL variables, the first
+line might look like this: "-aclc 5 20". Now it might be "-aclc foo 20" for the
+variable called acl_cfoo. */
+
+static void
+spool_acl_var_write(uschar * name, uschar * value, void * ctx)
+{
+FILE * fp = ctx;
+int len = Ustrlen(value);
+
+spool_line(fp, "%s-acl%c %s %d", is_tainted(value) ? "-" : "",
+  name[0], name+1, len);
+spool_record(fp, value, len);
+}
+
+
+/* Write out a tree in a form in which it can easily be re-read. It is used
+for writing out the non-recipients tree, for retrieval at the next retry time.
+
+The format is as follows:
+
+   . If the tree is empty, write one line containing XX.
+
+   . Otherwise, each node is written, preceded by two letters
+     (Y/N) indicating whether it has left or right children.
+
+   . The left subtree (if any) then follows, then the right subtree.
+
+The non-recipients are kept in a hash table, so the tree that is written is a
+balanced one made from the sorted names. It is searchable as it stands.
+
+Arguments:
+  v          sorted vector of nodes
+  n          how many
+  fp         FILE to write to
+
+Returns:     nothing
+*/
+
+static void
+spool_tree_write(tree_node ** v, int n, FILE * fp)
+{
+int mid = n/2;
+
+if (n <= 0)
+  {
+  spool_line(fp, "XX");
+  return;
+  }
+spool_line(fp, "%c%c %s", mid > 0 ? 'Y' : 'N', n - mid > 1 ? 'Y' : 'N',
+  v[mid]->name);
+if (mid > 0) spool_tree_write(v, mid, fp);
+if (n - mid > 1) spool_tree_write(v + mid + 1, n - mid - 1, fp);
+}
+
+
 /*************************************************
 *          Write the header spool file           *
 *************************************************/
@@ -141,7 +633,9 @@ FILE * fp;
 struct stat statbuf;
 uschar * tname;
 uschar * fname;
+struct timeval write_start;
 
+if (EXIM_PROBE_TIMING) gettimeofday(&write_start, NULL);
 tname = spool_fname(US"input", message_subdir, US"hdr.", message_id);
 
 if ((fd = spool_open_temp(tname)) < 0)
@@ -155,13 +649,20 @@ identity of the submitting user, followed by the sender's address. The sender's
 address is enclosed in <> because it might be the null address. Then write the
 received time and the number of warning messages that have been sent. */
 
-fprintf(fp, "%s-H\n", message_id);
-fprintf(fp, "%.63s %ld %ld\n", originator_login, (long int)originator_uid,
+spool_hdr_binary = spool_header_binary;
+fprintf(fp, "%s-H%s\n", message_id,
+  spool_hdr_binary ? SPOOL_HDR_BINARY_TAG : "");
+spool_line(fp, "%.63s %ld %ld", originator_login, (long int)originator_uid,
   (long int)originator_gid);
-fprintf(fp, "<%s>\n", sender_address);
-fprintf(fp, "%d %d\n", (int)received_time.tv_sec, warning_count);
+spool_line(fp, "<%s>", sender_address);
+spool_line(fp, "%d %d", (int)received_time.tv_sec, warning_count);
+
+spool_line(fp, "-received_time_usec .%06d", (int)received_time.tv_usec);
+
+/* The priority class comes next, where spool_read_priority() looks for it. */
 
-fprintf(fp, "-received_time_usec .%06d\n", (int)received_time.tv_usec);
+if (message_priority)
+  spool_line(fp, "-priority %d", message_priority);
 
 /* If there is information about a sending host, remember it. The HELO
 data can be set for local SMTP as well as remote. */
@@ -170,8 +671,9 @@ if (sender_helo_name) spool_var_write(fp, US"helo_name", sender_helo_name);
 
 if (sender_host_address)
   {
-  if (is_tainted(sender_host_address)) putc('-', fp);
-  fprintf(fp, "-host_address %s.%d\n", sender_host_address, sender_host_port);
+  spool_line(fp, "%s-host_address %s.%d",
+    is_tainted(sender_host_address) ? "-" : "",
+    sender_host_address, sender_host_port);
   if (sender_host_name)
     spool_var_write(fp, US"host_name", sender_host_name);
   if (sender_host_authenticated)
@@ -182,8 +684,8 @@ if (sender_host_address)
 
 if (interface_address)
   {
-  if (is_tainted(interface_address)) putc('-', fp);
-  fprintf(fp, "-interface_address %s.%d\n", interface_address, interface_port);
+  spool_line(fp, "%s-interface_address %s.%d",
+    is_tainted(interface_address) ? "-" : "", interface_address, interface_port);
   }
 
 if (smtp_active_hostname != primary_hostname)
@@ -203,33 +705,40 @@ if (received_protocol)
 
 /* Preserve any ACL variables that are set. */
 
-tree_walk(acl_var_c, &acl_var_write, fp);
-tree_walk(acl_var_m, &acl_var_write, fp);
+tree_walk(acl_var_c, &spool_acl_var_write, fp);
+tree_walk(acl_var_m, &spool_acl_var_write, fp);
 
 /* Now any other data that needs to be remembered. */
 
 if (f.spool_file_wireformat)
-  fprintf(fp, "-spool_file_wireformat\n");
+  {
+  spool_line(fp, "-spool_file_wireformat");
+  if (f.spool_file_dotfree)
+    spool_line(fp, "-spool_file_dotfree");
+  }
 else
-  fprintf(fp, "-body_linecount %d\n", body_linecount);
-fprintf(fp, "-max_received_linelength %d\n", max_received_linelength);
+  spool_line(fp, "-body_linecount %d", body_linecount);
+if (spool_body_hash) spool_line(fp, "-spool_body_hash %s", spool_body_hash);
+if (spool_file_compressed > 0)
+  spool_line(fp, "-spool_file_compressed " OFF_T_FMT, spool_file_compressed);
+spool_line(fp, "-max_received_linelength %d", max_received_linelength);
 
-if (body_zerocount > 0) fprintf(fp, "-body_zerocount %d\n", body_zerocount);
+if (body_zerocount > 0) spool_line(fp, "-body_zerocount %d", body_zerocount);
 
 if (authenticated_id)
   spool_var_write(fp, US"auth_id", authenticated_id);
 if (authenticated_sender)
   spool_var_write(fp, US"auth_sender", authenticated_sender);
 
-if (f.allow_unqualified_recipient) fprintf(fp, "-allow_unqualified_recipient\n");
-if (f.allow_unqualified_sender) fprintf(fp, "-allow_unqualified_sender\n");
-if (f.deliver_firsttime) fprintf(fp, "-deliver_firsttime\n");
-if (f.deliver_freeze) fprintf(fp, "-frozen " TIME_T_FMT "\n", deliver_frozen_at);
-if (f.dont_deliver) fprintf(fp, "-N\n");
-if (host_lookup_deferred) fprintf(fp, "-host_lookup_deferred\n");
-if (host_lookup_failed) fprintf(fp, "-host_lookup_failed\n");
-if (f.sender_local) fprintf(fp, "-local\n");
-if (f.local_error_message) fprintf(fp, "-localerror\n");
+if (f.allow_unqualified_recipient) spool_line(fp, "-allow_unqualified_recipient");
+if (f.allow_unqualified_sender) spool_line(fp, "-allow_unqualified_sender");
+if (f.deliver_firsttime) spool_line(fp, "-deliver_firsttime");
+if (f.deliver_freeze) spool_line(fp, "-frozen " TIME_T_FMT, deliver_frozen_at);
+if (f.dont_deliver) spool_line(fp, "-N");
+if (host_lookup_deferred) spool_line(fp, "-host_lookup_deferred");
+if (host_lookup_failed) spool_line(fp, "-host_lookup_failed");
+if (f.sender_local) spool_line(fp, "-local");
+if (f.local_error_message) spool_line(fp, "-localerror");
 #ifdef HAVE_LOCAL_SCAN
 if (local_scan_data) spool_var_write(fp, US"local_scan", local_scan_data);
 #endif
@@ -238,31 +747,31 @@ if (spam_bar)       spool_var_write(fp, US"spam_bar",       spam_bar);
 if (spam_score)     spool_var_write(fp, US"spam_score",     spam_score);
 if (spam_score_int) spool_var_write(fp, US"spam_score_int", spam_score_int);
 #endif
-if (f.deliver_manual_thaw) fprintf(fp, "-manual_thaw\n");
-if (f.sender_set_untrusted) fprintf(fp, "-sender_set_untrusted\n");
+if (f.deliver_manual_thaw) spool_line(fp, "-manual_thaw");
+if (f.sender_set_untrusted) spool_line(fp, "-sender_set_untrusted");
 
 #ifdef EXPERIMENTAL_BRIGHTMAIL
 if (bmi_verdicts) spool_var_write(fp, US"bmi_verdicts", bmi_verdicts);
 #endif
 
 #ifndef DISABLE_TLS
-if (tls_in.certificate_verified) fprintf(fp, "-tls_certificate_verified\n");
+if (tls_in.certificate_verified) spool_line(fp, "-tls_certificate_verified");
 if (tls_in.cipher) spool_var_write(fp, US"tls_cipher", tls_in.cipher);
 if (tls_in.peercert)
   {
   if (tls_export_cert(big_buffer, big_buffer_size, tls_in.peercert))
-    fprintf(fp, "--tls_peercert %s\n", CS big_buffer);
+    spool_line(fp, "--tls_peercert %s", CS big_buffer);
   }
 if (tls_in.peerdn)       spool_var_write(fp, US"tls_peerdn", string_printing(tls_in.peerdn));
 if (tls_in.sni)		 spool_var_write(fp, US"tls_sni",    string_printing(tls_in.sni));
 if (tls_in.ourcert)
   {
   if (tls_export_cert(big_buffer, big_buffer_size, tls_in.ourcert))
-    fprintf(fp, "-tls_ourcert %s\n", CS big_buffer);
+    spool_line(fp, "-tls_ourcert %s", CS big_buffer);
   }
-if (tls_in.ocsp)	 fprintf(fp, "-tls_ocsp %d\n",   tls_in.ocsp);
+if (tls_in.ocsp)	 spool_line(fp, "-tls_ocsp %d",   tls_in.ocsp);
 # ifndef DISABLE_TLS_RESUME
-fprintf(fp, "-tls_resumption %c\n", 'A' + tls_in.resumption);
+spool_line(fp, "-tls_resumption %c", 'A' + tls_in.resumption);
 # endif
 if (tls_in.ver) spool_var_write(fp, US"tls_ver", tls_in.ver);
 #endif
@@ -270,25 +779,34 @@ if (tls_in.ver) spool_var_write(fp, US"tls_ver", tls_in.ver);
 #ifdef SUPPORT_I18N
 if (message_smtputf8)
   {
-  fprintf(fp, "-smtputf8\n");
+  spool_line(fp, "-smtputf8");
   if (message_utf8_downconvert)
-    fprintf(fp, "-utf8_%sdowncvt\n", message_utf8_downconvert < 0 ? "opt" : "");
+    spool_line(fp, "-utf8_%sdowncvt", message_utf8_downconvert < 0 ? "opt" : "");
   }
 #endif
 
 /* Write the dsn flags to the spool header file */
 /* DEBUG(D_deliver) debug_printf("DSN: Write SPOOL: -dsn_envid %s\n", dsn_envid); */
-if (dsn_envid) fprintf(fp, "-dsn_envid %s\n", dsn_envid);
+if (dsn_envid) spool_line(fp, "-dsn_envid %s", dsn_envid);
 /* DEBUG(D_deliver) debug_printf("DSN: Write SPOOL: -dsn_ret %d\n", dsn_ret); */
-if (dsn_ret) fprintf(fp, "-dsn_ret %d\n", dsn_ret);
+if (dsn_ret) spool_line(fp, "-dsn_ret %d", dsn_ret);
+
+#ifndef DISABLE_DKIM
+if (dkim_bodyhashes) spool_line(fp, "-dkim_bodyhashes %s", dkim_bodyhashes);
+#endif
 
 /* To complete the envelope, write out the tree of non-recipients, followed by
 the list of recipients. These won't be disjoint the first time, when no
 checking has been done. If a recipient is a "one-time" alias, it is followed by
 a space and its parent address number (pno). */
 
-tree_write(tree_nonrecipients, fp);
-fprintf(fp, "%d\n", recipients_count);
+  {
+  rmark reset_point = store_mark();
+  spool_tree_write(tree_hash_sorted(&tree_nonrecipients),
+    tree_nonrecipients.count, fp);
+  store_reset(reset_point);
+  }
+spool_line(fp, "%d", recipients_count);
 for (int i = 0; i < recipients_count; i++)
   {
   recipient_item *r = recipients_list + i;
@@ -296,7 +814,7 @@ for (int i = 0; i < recipients_count; i++)
   /* DEBUG(D_deliver) debug_printf("DSN: Flags: 0x%x\n", r->dsn_flags); */
 
   if (r->pno < 0 && !r->errors_to && r->dsn_flags == 0)
-    fprintf(fp, "%s\n", r->address);
+    spool_line(fp, "%s", r->address);
   else
     {
     uschar * errors_to = r->errors_to ? r->errors_to : US"";
@@ -304,7 +822,7 @@ for (int i = 0; i < recipients_count; i++)
     adding new values upfront and add flag 0x02 */
     uschar * orcpt = r->orcpt ? r->orcpt : US"";
 
-    fprintf(fp, "%s %s %d,%d %s %d,%d#3\n", r->address, orcpt, Ustrlen(orcpt),
+    spool_line(fp, "%s %s %d,%d %s %d,%d#3", r->address, orcpt, Ustrlen(orcpt),
       r->dsn_flags, errors_to, Ustrlen(errors_to), r->pno);
     }
 
@@ -315,7 +833,7 @@ for (int i = 0; i < recipients_count; i++)
 
 /* Put a blank line before the headers */
 
-fprintf(fp, "\n");
+spool_line(fp, "%s", "");
 
 /* Save the size of the file so far so we can subtract it from the final length
 to get the actual size of the headers. */
@@ -335,7 +853,15 @@ size. */
 
 for (header_line * h = header_list; h; h = h->next)
   {
-  fprintf(fp, "%03d%c %s", h->slen, h->type, h->text);
+  if (spool_hdr_binary)
+    {
+    int len = h->slen + 1;
+    uschar l[5] = { len >> 24, len >> 16, len >> 8, len, h->type };
+    fwrite(l, 1, sizeof(l), fp);
+    fwrite(h->text, 1, h->slen, fp);
+    }
+  else
+    fprintf(fp, "%03d%c %s", h->slen, h->type, h->text);
   size_correction += 5;
   if (h->type == '*') size_correction += h->slen;
   }
@@ -345,6 +871,48 @@ for (header_line * h = header_list; h; h = h->next)
 if (fflush(fp) != 0 || ferror(fp))
   return spool_write_error(where, errmsg, US"write", tname, fp);
 
+/* If the sync of a received message's data file was held back, make all the
+remaining calls in one go if possible. Otherwise, sync the data file here, and
+carry on as usual. */
+
+#ifdef SUPPORT_IO_URING
+if (where == SW_RECEIVING && uring_data_deferred)
+  {
+  static uschar * step_names[] =
+    { NULL, US"data sync", US"sync", US"rename", US"directory sync" };
+  int dfd = spool_data_file ? fileno(spool_data_file) : -1, dirfd = -1, rc;
+
+  uring_data_deferred = FALSE;
+  fname = spool_fname(US"input", message_subdir, id, US"-H");
+  if (fstat(fd, &statbuf) != 0)
+    return spool_write_error(where, errmsg, US"fstat", tname, fp);
+
+# ifdef NEED_SYNC_DIRECTORY
+  if ((dirfd = Uopen(spool_id_dname(US"input", message_subdir, id),
+		    O_RDONLY|O_DIRECTORY, 0)) < 0)
+    return spool_write_error(where, errmsg, US"directory open", tname, fp);
+# endif
+
+  DEBUG(D_receive) debug_printf("Committing spool files via io_uring: %s\n",
+    fname);
+  rc = spool_uring_commit(dfd, fd, tname, fname, dirfd);
+  if (dirfd >= 0) (void)close(dirfd);
+
+  if (rc == 0)
+    {
+    if (fclose(fp) != 0)
+      return spool_write_error(where, errmsg, US"close", fname, NULL);
+    goto COMMITTED;
+    }
+  if (rc > 0)
+    return spool_write_error(where, errmsg, step_names[rc],
+      rc == 4 ? fname : tname, fp);
+
+  if (dfd >= 0 && EXIMfsync(dfd) < 0)
+    return spool_write_error(where, errmsg, US"data sync", tname, fp);
+  }
+#endif
+
 /* Force the file's contents to be written to disk. Note that fflush()
 just pushes it out of C, and fclose() doesn't guarantee to do the write
 either. That's just the way Unix works... */
@@ -380,7 +948,7 @@ these cases. One hack on top of another... but that's life. */
 
 #ifdef NEED_SYNC_DIRECTORY
 
-tname = spool_fname(US"input", message_subdir, US".", US"");
+tname = spool_id_dname(US"input", message_subdir, id);
 
 # ifndef O_DIRECTORY
 #  define O_DIRECTORY 0
@@ -397,6 +965,13 @@ if (close(fd) < 0)
 
 #endif  /* NEED_SYNC_DIRECTORY */
 
+#ifdef SUPPORT_IO_URING
+COMMITTED:
+#endif
+
+queue_summary_write(id);
+EXIM_PROBE3(spool__write, id, where, usec_since(&write_start));
+
 /* Return the number of characters in the headers, which is the file size, less
 the preliminary stuff, less the additional count fields on the headers. */
 
@@ -510,10 +1085,10 @@ dest_qname = string_copy_taint(dest_qname, FALSE);
 
 /* Create any output directories that do not exist. */
 
-(void) directory_make(spool_directory,
+(void) directory_make(spool_root(id),
   spool_q_sname(string_sprintf("%sinput", to), dest_qname, subdir),
   INPUT_DIRECTORY_MODE, TRUE);
-(void) directory_make(spool_directory,
+(void) directory_make(spool_root(id),
   spool_q_sname(string_sprintf("%smsglog", to), dest_qname, subdir),
   INPUT_DIRECTORY_MODE, TRUE);
 
@@ -536,6 +1111,11 @@ if (!break_link(US"input",  subdir, id, US"-H", from, FALSE) ||
     !break_link(US"msglog", subdir, id, US"", from, TRUE))
   return FALSE;
 
+/* Only the main input directories are covered by the daemon's queue index */
+
+if (!*from) queue_index_notify(NOTIFY_QUEUE_DEL, id, *subdir, queue_name);
+if (!*to)   queue_index_notify(NOTIFY_QUEUE_ADD, id, *subdir, dest_qname);
+
 log_write(0, LOG_MAIN, "moved from %s%s%s%sinput, %smsglog to %s%s%s%sinput, %smsglog",
    *queue_name?"(":"", *queue_name?queue_name:US"", *queue_name?") ":"",
    from, from,
@@ -546,6 +1126,359 @@ return TRUE;
 }
 
 
+
+/*************************************************
+*       Share the data files of messages         *
+*************************************************/
+
+/* When spool_dedup_min_size is set, a message whose body (the -D file after
+its first line) is the same as that of a message already on the spool gets a
+link to the existing file in place of its own, which then need not be synced.
+Files that can be shared are linked from the "dedup" directory in the spool
+root, named by the SHA-256 hash of the body, which is also kept in the -H file
+of each message using one. The link count of a file counts its users: once only
+the dedup link is left, the file is no longer needed. Any failure here just
+leaves a message with a file of its own. The first line of a shared file holds
+the id of the message that wrote it, which nothing relies on. */
+
+static BOOL dedup_linked = FALSE;	/* this message's -D was replaced */
+
+
+static uschar *
+spool_dedup_name(const uschar * suffix)
+{
+return string_sprintf("%s/dedup/%s%s",
+  spool_root(message_id), spool_body_hash, suffix);
+}
+
+
+#ifdef EXIM_HAVE_SHA2
+/* Return the hex hash of the body in a -D file, or NULL */
+
+static uschar *
+spool_dedup_hash(int fd)
+{
+uschar buf[16384];
+off_t off = SPOOL_DATA_START_OFFSET;
+ssize_t len;
+hctx h;
+blob b;
+gstring * g = NULL;
+
+if (!exim_sha_init(&h, HASH_SHA2_256)) return NULL;
+while ((len = pread(fd, buf, sizeof(buf), off)) > 0)
+  {
+  exim_sha_update(&h, buf, (int)len);
+  off += len;
+  }
+exim_sha_finish(&h, &b);
+if (len < 0) return NULL;
+while (b.len-- > 0) g = string_fmt_append(g, "%02x", *b.data++);
+return string_from_gstring(g);
+}
+
+
+/* Compare two bodies of the given file size. Having the same hash is not
+trusted to mean having the same contents. */
+
+static BOOL
+spool_dedup_same(int fd1, int fd2, off_t size)
+{
+uschar b1[16384], b2[16384];
+
+for (off_t off = SPOOL_DATA_START_OFFSET; off < size; )
+  {
+  ssize_t len = pread(fd1, b1, sizeof(b1), off);
+  if (len <= 0 || pread(fd2, b2, len, off) != len || memcmp(b1, b2, len) != 0)
+    return FALSE;
+  off += len;
+  }
+return TRUE;
+}
+#endif
+
+
+/* Called when the data file of a message has been written, before it is
+synced. If a shared file has the same body, replace the message's file with a
+link to it.
+
+Arguments:
+  fd        the open -D file
+  dname     its name
+
+Returns:    TRUE if the file was replaced, so that no sync is needed
+*/
+
+BOOL
+spool_dedup_link(int fd, const uschar * dname)
+{
+#ifdef EXIM_HAVE_SHA2
+struct stat statbuf, sstatbuf;
+uschar * sname, * tname;
+int sfd;
+BOOL same;
+
+spool_body_hash = NULL;
+dedup_linked = FALSE;
+
+if (  spool_dedup_min_size <= 0 || fstat(fd, &statbuf) != 0
+   || statbuf.st_size - SPOOL_DATA_START_OFFSET < spool_dedup_min_size
+   || !(spool_body_hash = spool_dedup_hash(fd)))
+  return FALSE;
+
+sname = spool_dedup_name(US"");
+if (  Ulstat(sname, &sstatbuf) != 0 || !S_ISREG(sstatbuf.st_mode)
+   || sstatbuf.st_size != statbuf.st_size || sstatbuf.st_dev != statbuf.st_dev
+   || (sfd = Uopen(sname, O_RDONLY, 0)) < 0)
+  return FALSE;
+same = spool_dedup_same(fd, sfd, statbuf.st_size);
+(void)close(sfd);
+if (!same) return FALSE;
+
+/* Make the new link under a temporary name and rename it over the message's
+own file, so that there is always a complete -D file. */
+
+tname = string_sprintf("%s.dedup", dname);
+if (Ulink(sname, tname) < 0)
+  return FALSE;
+if (Urename(tname, dname) < 0)
+  {
+  (void)Uunlink(tname);
+  return FALSE;
+  }
+DEBUG(D_receive) debug_printf("data file shared with %s\n", sname);
+return dedup_linked = TRUE;
+#else
+spool_body_hash = NULL;
+return FALSE;
+#endif
+}
+
+
+/* Called when a received message has been committed to the spool. If its data
+file was not replaced by a shared one, offer it for sharing. */
+
+void
+spool_dedup_store(void)
+{
+uschar * dname, * sname;
+
+if (!spool_body_hash || dedup_linked) return;
+dname = spool_fname(US"input", message_subdir, message_id, US"-D");
+sname = spool_dedup_name(US"");
+if (Ulink(dname, sname) < 0 && errno == ENOENT)
+  {
+  (void)directory_make(spool_root(message_id), US"dedup",
+    INPUT_DIRECTORY_MODE, FALSE);
+  (void)Ulink(dname, sname);
+  }
+}
+
+
+/* Called when a message is complete and its -D file has been unlinked. If the
+shared file it used now has no other users, remove it.
+
+Argument:   the open -D file
+*/
+
+void
+spool_dedup_release(int fd)
+{
+struct stat statbuf, sstatbuf;
+uschar * sname;
+
+if (  !spool_body_hash || fd < 0 || fstat(fd, &statbuf) != 0
+   || statbuf.st_nlink != 1)
+  return;
+sname = spool_dedup_name(US"");
+if (  Ulstat(sname, &sstatbuf) == 0 && sstatbuf.st_ino == statbuf.st_ino
+   && sstatbuf.st_dev == statbuf.st_dev)
+  {
+  (void)Uunlink(sname);
+#ifndef DISABLE_DKIM
+  (void)Uunlink(spool_dedup_name(US".dkim"));
+#endif
+  }
+}
+
+
+/* Called by a queue runner, to remove any shared files that are no longer
+used, for example by messages that were removed by hand. */
+
+void
+spool_dedup_tidy(void)
+{
+for (int r = 0; r < spool_root_count(); r++)
+  {
+  uschar * dir = string_sprintf("%s/dedup", spool_root_n(r));
+  DIR * dd = exim_opendir(dir);
+
+  if (!dd) continue;
+  for (struct dirent * ent; (ent = readdir(dd)); )
+    {
+    uschar * name = US ent->d_name;
+    uschar * fname = string_sprintf("%s/%s", dir, name);
+    struct stat statbuf;
+    int len = Ustrlen(name);
+
+    if (*name == '.') continue;
+    if (len > 5 && Ustrcmp(name + len - 5, ".dkim") == 0)
+      {
+      /* A sidecar whose data file has gone */
+      uschar * dname = string_copyn(fname, Ustrlen(fname) - 5);
+      if (Ulstat(dname, &statbuf) != 0 && errno == ENOENT)
+	(void)Uunlink(fname);
+      }
+    else if (  Ulstat(fname, &statbuf) == 0 && S_ISREG(statbuf.st_mode)
+	    && statbuf.st_nlink == 1)
+      {
+      DEBUG(D_queue_run) debug_printf("removing unused %s\n", fname);
+      (void)Uunlink(fname);
+      }
+    }
+  closedir(dd);
+  }
+}
+
+
+#ifndef DISABLE_DKIM
+/* The DKIM body hashes found for a message are kept beside a shared data
+file, for the other messages using it. Add any there to dkim_bodyhashes. */
+
+void
+spool_dedup_bodyhashes_get(void)
+{
+uschar buf[1024];
+int fd, len = 0;
+
+if (!spool_body_hash) return;
+if ((fd = Uopen(spool_dedup_name(US".dkim"), O_RDONLY, 0)) < 0) return;
+len = read(fd, buf, sizeof(buf) - 1);
+(void)close(fd);
+if (len <= 0) return;
+buf[len] = 0;
+if (buf[len-1] == '\n') buf[len-1] = 0;
+(void) dkim_exim_bodyhashes_merge(buf);
+}
+
+
+/* Write dkim_bodyhashes beside the shared data file, if there is one */
+
+void
+spool_dedup_bodyhashes_put(void)
+{
+struct stat statbuf;
+uschar * fname, * tname;
+int fd, len;
+BOOL ok;
+
+if (  !spool_body_hash || !dkim_bodyhashes
+   || Ustat(spool_dedup_name(US""), &statbuf) != 0)
+  return;
+
+fname = spool_dedup_name(US".dkim");
+tname = string_sprintf("%s.%d", fname, (int)getpid());
+if ((fd = Uopen(tname, O_WRONLY|O_CREAT|O_TRUNC, SPOOL_MODE)) < 0) return;
+len = Ustrlen(dkim_bodyhashes);
+ok = write(fd, dkim_bodyhashes, len) == len
+  && (geteuid() != root_uid || exim_fchown(fd, exim_uid, exim_gid, tname) == 0);
+if (close(fd) < 0 || !ok || Urename(tname, fname) < 0)
+  (void)Uunlink(tname);
+}
+#endif
+
+#ifdef SUPPORT_ZSTD
+/*************************************************
+*        Compress a message's data file          *
+*************************************************/
+
+/* Called at the end of a delivery attempt that leaves a message on the queue,
+while its data file is open and locked. If spool_compress_min_size is set and
+the data is at least that big, the file is replaced by one with "-Z" in place
+of "-D" at the end of its first line, followed by the data as a zstd stream
+(see spool_datafile_plain() for the reading side). The new file is locked
+before it is renamed into place, so that the message stays locked. Files that
+are already compressed, or are shared with other messages, are left alone, as
+is any file that does not get smaller. After a success the caller must rewrite
+the -H file, which records the uncompressed size for queue listings. Failures
+just leave the file as it was.
+
+Argument:  the message id
+Returns:   TRUE if the file was compressed
+*/
+
+BOOL
+spool_compress_datafile(const uschar * id)
+{
+struct stat statbuf, zstatbuf;
+uschar ibuf[16384], obuf[16384];
+uschar * dname, * tname;
+ZSTD_CCtx * cc = NULL;
+off_t off = SPOOL_DATA_START_OFFSET;
+BOOL ok;
+int tfd;
+
+if (  spool_compress_min_size <= 0
+   || deliver_datafile < 0 || deliver_datafile_lock >= 0
+   || fstat(deliver_datafile, &statbuf) != 0 || statbuf.st_nlink != 1
+   || statbuf.st_size - SPOOL_DATA_START_OFFSET < spool_compress_min_size)
+  return FALSE;
+
+dname = spool_fname(US"input", message_subdir, id, US"-D");
+tname = spool_fname(US"input", message_subdir, id, US"-Z");
+if ((tfd = spool_open_temp(tname)) < 0)
+  {
+  DEBUG(D_deliver) debug_printf("failed to create %s: %s\n", tname,
+    strerror(errno));
+  return FALSE;
+  }
+(void)fcntl(tfd, F_SETFD, fcntl(tfd, F_GETFD) | FD_CLOEXEC);
+
+(void)string_format(obuf, sizeof(obuf), "%s-Z\n", id);
+ok = write(tfd, obuf, SPOOL_DATA_START_OFFSET) == SPOOL_DATA_START_OFFSET
+  && (cc = ZSTD_createCCtx());
+
+while (ok)
+  {
+  ssize_t n = pread(deliver_datafile, ibuf, sizeof(ibuf), off);
+  ZSTD_EndDirective mode = n > 0 ? ZSTD_e_continue : ZSTD_e_end;
+  ZSTD_inBuffer in = { .src = ibuf, .size = n > 0 ? n : 0, .pos = 0 };
+  size_t left;
+
+  if (n < 0) { ok = FALSE; break; }
+  off += n;
+  do
+    {
+    ZSTD_outBuffer out = { .dst = obuf, .size = sizeof(obuf), .pos = 0 };
+    left = ZSTD_compressStream2(cc, &out, &in, mode);
+    ok = !ZSTD_isError(left) && write(tfd, obuf, out.pos) == (ssize_t)out.pos;
+    }
+  while (ok && (mode == ZSTD_e_end ? left != 0 : in.pos < in.size));
+  if (n == 0) break;
+  }
+ZSTD_freeCCtx(cc);
+
+if (  !ok || fstat(tfd, &zstatbuf) != 0 || zstatbuf.st_size >= statbuf.st_size
+   || spool_fsync_group(tfd) != 0 || !spool_lock_datafile(tfd, id)
+   || Urename(tname, dname) < 0)
+  {
+  DEBUG(D_deliver) debug_printf("data file for %s not compressed\n", id);
+  (void)close(tfd);
+  (void)Uunlink(tname);
+  return FALSE;
+  }
+
+/* The copy that was being read is the old file, now unlinked; the new one
+holds the lock until the delivery process finishes. */
+
+deliver_datafile_lock = tfd;
+spool_file_compressed = statbuf.st_size - SPOOL_DATA_START_OFFSET;
+DEBUG(D_deliver) debug_printf("data file for %s compressed from " OFF_T_FMT
+  " to " OFF_T_FMT " bytes\n", id, statbuf.st_size, zstatbuf.st_size);
+return TRUE;
+}
+#endif	/* SUPPORT_ZSTD */
+
 /* End of spool_out.c */
 /* vi: aw ai sw=2
 */
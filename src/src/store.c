@@ -106,6 +106,24 @@ suitably aligned. */
 
 #define STORE_BLOCK_SIZE (8192 - ALIGNED_SIZEOF_STOREBLOCK)
 
+/* As a pool grows its blocks get bigger, the malloc size doubling each time
+the number of blocks in use passes STORE_BLOCK_ORDER_STEP times the current
+multiple, up to a limit. A pool that has needed many blocks is likely to need
+many again (eg. for the next message on an SMTP connection) so the order is not
+brought back down by store_reset(). */
+
+#define STORE_BLOCK_MAX_ORDER	4
+#define STORE_BLOCK_ORDER_STEP	4
+#define STORE_BLOCK_LENGTH(order) \
+  (((STORE_BLOCK_SIZE + ALIGNED_SIZEOF_STOREBLOCK) << (order)) \
+   - ALIGNED_SIZEOF_STOREBLOCK)
+
+/* Blocks released by store_reset() are kept on a list per pool, up to this
+many, for reuse instead of going back to malloc; only those of no more than the
+largest standard size are kept. */
+
+#define STORE_FREELIST_MAX	4
+
 /* Variables holding data for the local pools of store. The current pool number
 is held in store_pool, which is global so that it can be changed from outside.
 Setting the initial length values to -1 forces a malloc for the first call,
@@ -113,11 +131,14 @@ even if the length is zero (which is used for getting a point to reset to). */
 
 int store_pool = POOL_MAIN;
 
-#define NPOOLS 6
+#define NPOOLS 8
 static storeblock *chainbase[NPOOLS];
 static storeblock *current_block[NPOOLS];
 static void *next_yield[NPOOLS];
-static int yield_length[NPOOLS] = { -1, -1, -1,  -1, -1, -1 };
+static int yield_length[NPOOLS] = { -1, -1, -1, -1,  -1, -1, -1, -1 };
+static int store_block_order[NPOOLS];
+static storeblock *freelist[NPOOLS];
+static int nfree[NPOOLS];
 
 /* pool_malloc holds the amount of memory used by the store pools; this goes up
 and down as store is reset or released. nonpool_malloc is the total got by
@@ -143,6 +164,8 @@ static int n_nonpool_blocks;	/* current number of direct store_malloc() blocks *
 static int max_nonpool_blocks;
 static int max_pool_malloc;	/* max value for pool_malloc */
 static int max_nonpool_malloc;	/* max value for nonpool_malloc */
+static unsigned long n_extend;	/* store_extend() calls */
+static unsigned long n_extend_ok; /* ... that could extend in place */
 
 
 #ifndef COMPILE_UTILITY
@@ -150,31 +173,91 @@ static const uschar * pooluse[NPOOLS] = {
 [POOL_MAIN] =		US"main",
 [POOL_PERM] =		US"perm",
 [POOL_SEARCH] =		US"search",
+[POOL_CONFIG] =		US"config",
 [POOL_TAINT_MAIN] =	US"main",
 [POOL_TAINT_PERM] =	US"perm",
 [POOL_TAINT_SEARCH] =	US"search",
+[POOL_TAINT_CONFIG] =	US"config",
 };
 static const uschar * poolclass[NPOOLS] = {
 [POOL_MAIN] =		US"untainted",
 [POOL_PERM] =		US"untainted",
 [POOL_SEARCH] =		US"untainted",
+[POOL_CONFIG] =		US"untainted",
 [POOL_TAINT_MAIN] =	US"tainted",
 [POOL_TAINT_PERM] =	US"tainted",
 [POOL_TAINT_SEARCH] =	US"tainted",
+[POOL_TAINT_CONFIG] =	US"tainted",
 };
 #endif
 
 
 static void * internal_store_malloc(int, const char *, int);
+static void * internal_store_malloc_pages(int *, const char *, int);
 static void   internal_store_free(void *, const char *, int linenumber);
 
 /******************************************************************************/
 
+/* The blocks in the chains of the tainted pools, sorted by address, so that
+is_tainted_fn() can do a binary search instead of walking every chain. A
+message with a very large number of recipients can use thousands of blocks, and
+the test is made for most strings that are copied. The vector is in malloc
+store, and is changed whenever a block joins or leaves a tainted chain. */
+
+static storeblock ** taint_index;
+static int taint_index_count;
+static int taint_index_size;
+
+/* Find the number of blocks in the index below a given address. */
+
+static int
+taint_index_below(const void * p)
+{
+int lo = 0, hi = taint_index_count;
+while (lo < hi)
+  {
+  int mid = (lo + hi) / 2;
+  if (CS taint_index[mid] < CS p) lo = mid + 1; else hi = mid;
+  }
+return lo;
+}
+
+static void
+taint_index_add(storeblock * b)
+{
+int n;
+
+if (taint_index_count >= taint_index_size)
+  {
+  int size = taint_index_size ? 2 * taint_index_size : 64;
+  storeblock ** new = realloc(taint_index, size * sizeof(storeblock *));
+  if (!new)
+    log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to grow the index of "
+      "tainted store to %d blocks", size);
+  taint_index = new;
+  taint_index_size = size;
+  }
+n = taint_index_below(b);
+memmove(taint_index + n + 1, taint_index + n,
+  (taint_index_count++ - n) * sizeof(storeblock *));
+taint_index[n] = b;
+}
+
+static void
+taint_index_remove(storeblock * b)
+{
+int n = taint_index_below(b);
+if (n < taint_index_count && taint_index[n] == b)
+  memmove(taint_index + n, taint_index + n + 1,
+    (--taint_index_count - n) * sizeof(storeblock *));
+}
+
+
 /* Test if a pointer refers to tainted memory.
 
 Slower version check, for use when platform intermixes malloc and mmap area
-addresses. Test against the current-block of all tainted pools first, then all
-blocks of all tainted pools.
+addresses. Test against the current-block of all tainted pools first, then
+look for the one block of any tainted pool that could contain it.
 
 Return: TRUE iff tainted
 */
@@ -183,6 +266,7 @@ BOOL
 is_tainted_fn(const void * p)
 {
 storeblock * b;
+int n;
 
 for (int pool = POOL_TAINT_BASE; pool < nelem(chainbase); pool++)
   if ((b = current_block[pool]))
@@ -191,12 +275,11 @@ for (int pool = POOL_TAINT_BASE; pool < nelem(chainbase); pool++)
     if (US p >= bc && US p < bc + b->length) return TRUE;
     }
 
-for (int pool = POOL_TAINT_BASE; pool < nelem(chainbase); pool++)
-  for (b = chainbase[pool]; b; b = b->next)
-    {
-    uschar * bc = US b + ALIGNED_SIZEOF_STOREBLOCK;
-    if (US p >= bc && US p < bc + b->length) return TRUE;
-    }
+if ((n = taint_index_below(US p + 1)) > 0)
+  {
+  uschar * bc = US taint_index[n-1] + ALIGNED_SIZEOF_STOREBLOCK;
+  if (US p >= bc && US p < bc + taint_index[n-1]->length) return TRUE;
+  }
 return FALSE;
 }
 
@@ -242,12 +325,13 @@ instructions on a Sparc (alignment = 8). */
 if (size % alignment != 0) size += alignment - (size % alignment);
 
 /* If there isn't room in the current block, get a new one. The minimum
-size is STORE_BLOCK_SIZE, and we would expect this to be the norm, since
-these functions are mostly called for small amounts of store. */
+size is the pool's current standard block size, and we would expect this to be
+the norm, since these functions are mostly called for small amounts of store. */
 
 if (size > yield_length[pool])
   {
-  int length = size <= STORE_BLOCK_SIZE ? STORE_BLOCK_SIZE : size;
+  int stdlength = STORE_BLOCK_LENGTH(store_block_order[pool]);
+  int length = size <= stdlength ? stdlength : size;
   int mlength = length + ALIGNED_SIZEOF_STOREBLOCK;
   storeblock * newblock;
 
@@ -255,35 +339,57 @@ if (size > yield_length[pool])
 
   if (  (newblock = current_block[pool])
      && (newblock = newblock->next)
-     && newblock->length < length
+     && newblock->length < size
      )
     {
     /* Give up on this block, because it's too small */
     nblocks[pool]--;
+    if (pool >= POOL_TAINT_BASE) taint_index_remove(newblock);
     internal_store_free(newblock, func, linenumber);
     newblock = NULL;
     }
 
-  /* If there was no free block, get a new one */
+  /* If there was no free block, try for one released earlier, and failing
+  that get a new one. Blocks on the list are still counted in pool_malloc. */
 
   if (!newblock)
     {
+    storeblock ** bp;
+
+    for (bp = &freelist[pool]; *bp; bp = &(*bp)->next)
+      if ((*bp)->length >= length) break;
+
+    if ((newblock = *bp))
+      {
+      *bp = newblock->next;
+      nfree[pool]--;
+      mlength = newblock->length + ALIGNED_SIZEOF_STOREBLOCK;
+      }
+    else
+      {
+      newblock = store_pool == POOL_CONFIG
+	? internal_store_malloc_pages(&mlength, func, linenumber)
+	: internal_store_malloc(mlength, func, linenumber);
+      if ((pool_malloc += mlength) > max_pool_malloc)	/* Used in pools */
+	max_pool_malloc = pool_malloc;
+      nonpool_malloc -= mlength;		/* Exclude from overall total */
+      newblock->length = mlength - ALIGNED_SIZEOF_STOREBLOCK;
+      }
+    newblock->next = NULL;
+
     if ((nbytes[pool] += mlength) > maxbytes[pool])
       maxbytes[pool] = nbytes[pool];
-    if ((pool_malloc += mlength) > max_pool_malloc)	/* Used in pools */
-      max_pool_malloc = pool_malloc;
-    nonpool_malloc -= mlength;			/* Exclude from overall total */
     if (++nblocks[pool] > maxblocks[pool])
       maxblocks[pool] = nblocks[pool];
-
-    newblock = internal_store_malloc(mlength, func, linenumber);
-    newblock->next = NULL;
-    newblock->length = length;
+    if (  store_block_order[pool] < STORE_BLOCK_MAX_ORDER
+       && nblocks[pool] > STORE_BLOCK_ORDER_STEP << store_block_order[pool])
+      store_block_order[pool]++;
 
     if (!chainbase[pool])
       chainbase[pool] = newblock;
     else
       current_block[pool]->next = newblock;
+    if (pool >= POOL_TAINT_BASE) taint_index_add(newblock);
     }
 
   current_block[pool] = newblock;
@@ -379,6 +485,7 @@ int rounded_oldsize = oldsize;
 /* Check that the block being extended was already of the required taint status;
 refuse to extend if not. */
 
+n_extend++;
 if (is_tainted(ptr) != tainted)
   return FALSE;
 
@@ -398,6 +505,7 @@ DEBUG(D_memory)
     func, linenumber);
 #endif  /* COMPILE_UTILITY */
 
+n_extend_ok++;
 if (newsize % alignment != 0) newsize += alignment - (newsize % alignment);
 next_yield[pool] = CS ptr + newsize;
 yield_length[pool] -= newsize - rounded_oldsize;
@@ -479,11 +587,11 @@ current_block[pool] = b;
 /* Free any subsequent block. Do NOT free the first
 successor, if our current block has less than 256 bytes left. This should
 prevent us from flapping memory. However, keep this block only when it has
-the default size. */
+no more than the standard size. */
 
 if (  yield_length[pool] < STOREPOOL_MIN_SIZE
    && b->next
-   && b->next->length == STORE_BLOCK_SIZE)
+   && b->next->length <= STORE_BLOCK_LENGTH(store_block_order[pool]))
   {
   b = b->next;
 #ifndef COMPILE_UTILITY
@@ -508,9 +616,21 @@ while ((b = bb))
 #endif
   bb = bb->next;
   nbytes[pool] -= siz;
-  pool_malloc -= siz;
   nblocks[pool]--;
-  internal_store_free(b, func, linenumber);
+  if (pool >= POOL_TAINT_BASE) taint_index_remove(b);
+  if (  nfree[pool] < STORE_FREELIST_MAX
+     && b->length <= STORE_BLOCK_LENGTH(STORE_BLOCK_MAX_ORDER))
+    {
+    (void) VALGRIND_MAKE_MEM_NOACCESS(CS b + ALIGNED_SIZEOF_STOREBLOCK, b->length);
+    b->next = freelist[pool];
+    freelist[pool] = b;
+    nfree[pool]++;
+    }
+  else
+    {
+    pool_malloc -= siz;
+    internal_store_free(b, func, linenumber);
+    }
   }
 
 /* Cut out the debugging stuff for utilities, but stop picky compilers from
@@ -664,6 +784,7 @@ for (storeblock * b = chainbase[pool]; b; b = b->next)
     {
     int siz = bb->length + ALIGNED_SIZEOF_STOREBLOCK;
     b->next = bb->next;
+    if (pool >= POOL_TAINT_BASE) taint_index_remove(bb);
     nbytes[pool] -= siz;
     pool_malloc -= siz;
     nblocks[pool]--;
@@ -733,6 +854,51 @@ return (void *)newtext;
 
 
 
+/*************************************************
+*        Make the config pools read-only         *
+*************************************************/
+
+/* The daemon calls this once the configuration is complete and before it
+starts forking, so that any later write into the parsed configuration faults
+instead of silently unsharing a page in every child. The blocks are forgotten
+by the pool (but stay in the taint index), so that any further allocation from
+it starts a fresh, writeable chain.
+
+Arguments:   none
+Returns:     number of bytes protected, or -1 if mprotect() failed
+*/
+
+int
+store_writeprotect(void)
+{
+int total = 0;
+
+for (int pool = POOL_CONFIG; pool < NPOOLS; pool += POOL_TAINT_BASE)
+  {
+  for (storeblock * b = chainbase[pool], * next; b; b = next)
+    {
+    int size = b->length + ALIGNED_SIZEOF_STOREBLOCK;
+    next = b->next;
+    if (mprotect(b, (size_t)size, PROT_READ) < 0) return -1;
+    total += size;
+    }
+  for (storeblock * b = freelist[pool], * next; b; b = next)
+    {
+    next = b->next;
+    pool_malloc -= b->length + ALIGNED_SIZEOF_STOREBLOCK;
+    free(b);
+    }
+  chainbase[pool] = current_block[pool] = freelist[pool] = NULL;
+  next_yield[pool] = store_last_get[pool] = NULL;
+  yield_length[pool] = -1;
+  nfree[pool] = 0;
+  }
+return total;
+}
+
+
+
+
 /*************************************************
 *                Malloc store                    *
 *************************************************/
@@ -779,6 +945,30 @@ DEBUG(D_memory) debug_printf("--Malloc %6p %5d bytes\t%-14s %4d\tpool %5d  nonpo
 return yield;
 }
 
+/* Get whole pages, page-aligned, for the config pools. The size is rounded up
+to a multiple of the page size and passed back. */
+
+static void *
+internal_store_malloc_pages(int * size, const char * func, int line)
+{
+static long pagesize = 0;
+void * yield = NULL;
+
+if (!pagesize && (pagesize = sysconf(_SC_PAGESIZE)) <= 0) pagesize = 4096;
+*size = ((*size + pagesize - 1) / pagesize) * pagesize;
+
+if (posix_memalign(&yield, (size_t)pagesize, (size_t)*size) != 0)
+  log_write(0, LOG_MAIN|LOG_PANIC_DIE, "failed to get %d bytes of "
+    "page-aligned memory: called from line %d in %s", *size, line, func);
+
+nonpool_malloc += *size;
+#ifndef COMPILE_UTILITY
+DEBUG(D_memory) debug_printf("--Malloc %6p %5d bytes\t%-14s %4d\tpages\n",
+  yield, *size, func, line);
+#endif
+return yield;
+}
+
 void *
 store_malloc_3(int size, const char *func, int linenumber)
 {
@@ -820,6 +1010,76 @@ internal_store_free(block, func, linenumber);
 }
 
 /******************************************************************************/
+/* Stats for logging and for the daemon. The counts are kept all the time; they
+are cheap. For each pool, in the order of the pool numbers, the current and
+peak kilobytes and the block count; then the store_extend() figures. */
+
+#ifndef COMPILE_UTILITY
+gstring *
+store_stats_string(gstring * g)
+{
+for (int i = 0; i < NPOOLS; i++)
+  g = string_fmt_append(g, "%s%s%s=%dk/%dk/%d", g && g->ptr ? " " : "",
+	i >= POOL_TAINT_BASE ? "t-" : "", pooluse[i],
+	(nbytes[i] + 1023)/1024, (maxbytes[i] + 1023)/1024, nblocks[i]);
+return string_fmt_append(g, " extend=%lu/%lu", n_extend_ok, n_extend);
+}
+
+
+/* The peak kilobytes for each pool, as a list of numbers for reporting to the
+daemon */
+
+gstring *
+store_stats_peaks(gstring * g)
+{
+for (int i = 0; i < NPOOLS; i++)
+  g = string_fmt_append(g, "%s%d", i ? " " : "", (maxbytes[i] + 1023)/1024);
+return g;
+}
+
+
+/* The daemon's side: add one process' report of peaks to the totals, and show
+the maximum and mean per pool over the processes reporting. */
+
+static unsigned long n_stats_reports;
+static int stats_peak_max[NPOOLS];
+static unsigned long stats_peak_sum[NPOOLS];
+
+void
+store_stats_accumulate(const uschar * s)
+{
+int peaks[NPOOLS];
+
+for (int i = 0; i < NPOOLS; i++)
+  {
+  uschar * end;
+  peaks[i] = Ustrtol(s, &end, 10);
+  if (end == s || peaks[i] < 0) return;		/* malformed; ignore it all */
+  s = end;
+  }
+for (int i = 0; i < NPOOLS; i++)
+  {
+  if (peaks[i] > stats_peak_max[i]) stats_peak_max[i] = peaks[i];
+  stats_peak_sum[i] += peaks[i];
+  }
+n_stats_reports++;
+}
+
+
+gstring *
+store_stats_summary(gstring * g)
+{
+g = string_fmt_append(g, "%lu processes;", n_stats_reports);
+for (int i = 0; i < NPOOLS; i++)
+  g = string_fmt_append(g, " %s%s=%luk/%dk",
+	i >= POOL_TAINT_BASE ? "t-" : "", pooluse[i],
+	n_stats_reports ? stats_peak_sum[i] / n_stats_reports : 0,
+	stats_peak_max[i]);
+return g;
+}
+#endif
+
+
 /* Stats output on process exit */
 void
 store_exit(void)
@@ -1099,10 +1099,17 @@ strings, it is helpful to call store_release() on the old string, to release
 memory blocks that have become empty. (The block will be freed if the string
 is at its start.) However, we can do this only if we know that the old string
 was the last item on the dynamic memory stack. This is the case if it matches
-store_last_get. */
+store_last_get.
+
+A string that has to be copied is given at least double its old size, since
+one built up among other allocations (eg. a log line) would otherwise be
+copied again every few additions. */
 
 if (!store_extend(g->s, tainted, oldsize, g->size))
+  {
+  if (g->size < oldsize * 2 && oldsize < INT_MAX/2) g->size = oldsize * 2;
   g->s = store_newblock(g->s, tainted, g->size, p);
+  }
 }
 
 
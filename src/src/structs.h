@@ -179,6 +179,7 @@ typedef struct transport_instance {
   int     connection_max_messages;/* )                                  */
                                   /**************************************/
   BOOL    deliver_as_creator;     /* Used only by pipe at present */
+  BOOL    batch_per_address;      /* Used only by appendfile at present */
   BOOL    disable_logging;        /* For very weird requirements */
   BOOL    initgroups;             /* Initialize groups when setting uid */
   BOOL    uid_set;                /* uid is set */
@@ -191,6 +192,9 @@ typedef struct transport_instance {
   uschar *shadow;                 /* Name of shadow transport */
   uschar *shadow_condition;       /* Condition for running it */
   uschar *filter_command;         /* For on-the-fly-filtering */
+#ifdef EXPAND_DLFUNC
+  uschar *filter_dlfunc;          /* For in-process filtering */
+#endif
   uschar *add_headers;            /* Add these headers */
   uschar *remove_headers;         /* Remove these headers */
   uschar *return_path;            /* Overriding (rewriting) return path */
@@ -215,6 +219,8 @@ typedef struct transport_instance {
   BOOL    retry_use_local_part;   /* Defaults true for local, false for remote */
 #ifndef DISABLE_EVENT
   uschar  *event_action;          /* String to expand on notable events */
+  uschar  *event_types;           /* Events for which it is expanded */
+  uint     event_mask;            /* event_types, compiled */
 #endif
 } transport_instance;
 
@@ -265,6 +271,7 @@ typedef struct transport_context {
 
   /* items below only used with option topt_use_bdat */
   tpt_chunk_cmd_cb	  chunk_cb;		/* per-datachunk callback */
+  int			  chunk_single_size;	/* largest sent as one LAST chunk */
   void			* smtp_context;
 } transport_ctx;
 
@@ -472,6 +479,7 @@ typedef struct retry_item {
   int     more_errno;             /* additional error information */
   uschar *message;                /* local error message */
   int     flags;                  /* see below */
+  time_t  next_try;               /* next try time, once the record is written */
 } retry_item;
 
 /* Retry data flags */
@@ -530,6 +538,30 @@ typedef struct address_item_propagated {
 } address_item_propagated;
 
 
+/* Fields of an address that most addresses never use: those set by filters,
+local deliveries, shadow transports, and routers with unusual options. They
+are kept in a block allocated the first time one of them is set, so that the
+many addresses of a large message do not each carry them. Read them with
+ADDR_COLD(), which gives an empty block for an address that has none, and set
+them through addr_cold(). An address copied by structure assignment shares the
+block; as the block records the one address that may change it in place, a
+write through any other address, or after addr_cold_share(), copies it first. */
+
+typedef struct address_item_cold {
+  struct address_item *owner;     /* address that may change it in place */
+  reply_item *reply;              /* data for autoreply */
+  uschar *prefix_v;		  /* variable part of stripped prefix */
+  uschar *suffix_v;		  /* variable part of stripped suffix */
+  uschar *current_dir;            /* current directory for transporting */
+  uschar *home_dir;               /* home directory for transporting */
+  uschar *onetime_parent;         /* saved original parent for onetime */
+  uschar **pipe_expandn;          /* numeric expansions for pipe from filter */
+  uschar *return_filename;        /* name of return file */
+  uschar *self_hostname;          /* after self=pass */
+  uschar *shadow_message;         /* info about shadow transporting */
+} address_item_cold;
+
+
 /* The main address structure. Note that fields that are to be copied to
 generated addresses should be put in the address_item_propagated structure (see
 above) rather than directly into the address_item structure. */
@@ -548,7 +580,7 @@ typedef struct address_item {
   host_item *host_used;           /* host that took delivery or failed hard */
   host_item *fallback_hosts;      /* to try if delivery defers */
 
-  reply_item *reply;              /* data for autoreply */
+  address_item_cold *cold;        /* rarely used fields, or NULL */
   retry_item *retries;            /* chain of retry information */
 
   uschar *address;                /* address being delivered or routed */
@@ -557,24 +589,15 @@ typedef struct address_item {
   uschar *lc_local_part;          /* lowercased local part */
   uschar *local_part;             /* points to cc or lc version */
   uschar *prefix;                 /* stripped prefix of local part */
-  uschar *prefix_v;		  /*  variable part of above */
   uschar *suffix;                 /* stripped suffix of local part */
-  uschar *suffix_v;		  /*  variable part of above */
   const uschar *domain;           /* working domain (lower cased) */
 
   uschar *address_retry_key;      /* retry key including full address */
   uschar *domain_retry_key;       /* retry key for domain only */
 
-  uschar *current_dir;            /* current directory for transporting */
-  uschar *home_dir;               /* home directory for transporting */
   uschar *message;                /* error message */
   uschar *user_message;           /* error message that can be sent over SMTP
                                      or quoted in bounce message */
-  uschar *onetime_parent;         /* saved original parent for onetime */
-  uschar **pipe_expandn;          /* numeric expansions for pipe from filter */
-  uschar *return_filename;        /* name of return file */
-  uschar *self_hostname;          /* after self=pass */
-  uschar *shadow_message;         /* info about shadow transporting */
 
 #ifndef DISABLE_TLS
   const uschar *tlsver;           /* version used for transport */
@@ -650,6 +673,8 @@ typedef struct address_item {
 #ifndef DISABLE_TLS_RESUME
     BOOL af_tls_resume:1;		/* TLS used a resumed session */
 #endif
+    BOOL af_ktls_tx:1;			/* TLS sending was done by the kernel */
+    BOOL af_ktls_rx:1;			/* TLS receiving was done by the kernel */
   } flags;
 
   unsigned int domain_cache[(MAX_NAMED_LIST * 2)/32];
@@ -658,6 +683,9 @@ typedef struct address_item {
   int	  basic_errno;		  /* status after failure */
   int     more_errno;             /* additional error information */
   struct timeval delivery_time;   /* time taken to do delivery/attempt */
+  struct rusage * rusage;         /* resources used by the delivery process */
+  time_t  retry_due;              /* when a deferred address is next worth
+                                     trying, if known from its skipping */
 
   unsigned short child_count;     /* number of child addresses */
   short int return_file;          /* fileno of return data file */
@@ -692,6 +720,8 @@ typedef struct error_block {
 typedef struct queue_filename {
   struct queue_filename *next;
   uschar dir_uschar;
+  uschar pclass;			/* priority class, when scheduling by it */
+  uschar lane;				/* size lane, when scheduling by it */
   uschar text[1];
 } queue_filename;
 
@@ -728,6 +758,26 @@ typedef struct tree_node {
   uschar  name[1];                /* node name - variable length */
 } tree_node;
 
+/* Structure for a hash table of tree nodes, for sets that are searched only
+by whole name. The table is empty when slots is NULL. */
+
+typedef struct tree_hash {
+  tree_node **slots;              /* size pointers, NULL for unused */
+  unsigned    size;               /* a power of two */
+  unsigned    count;              /* slots in use */
+} tree_hash;
+
+/* Structure for a perfect hash of a fixed, sorted table of names, built the
+first time the table is searched. Mask zero means the build failed and the
+table is searched by binary chop. */
+
+typedef struct tree_phash {
+  unsigned        mask;           /* slots - 1 */
+  unsigned        bmask;          /* buckets - 1 */
+  unsigned short *disp;           /* displacement for each bucket */
+  short          *slot;           /* table offset for each slot, or -1 */
+} tree_phash;
+
 /* Structure for holding time-limited data such as DNS returns.
 We use this rather than extending tree_node to avoid wasting
 space for most tree use (variables...) at the cost of complexity
@@ -843,6 +893,7 @@ typedef struct smtp_inblock {
   uschar *ptr;                    /* current position in the buffer */
   uschar *ptrend;                 /* end of data in the buffer */
   uschar *buffer;                 /* the buffer itself */
+  int     reads;                  /* count of packets read */
 } smtp_inblock;
 
 /* Structure used to hold buffered outgoing packets of SMTP commands for a
@@ -896,8 +947,10 @@ typedef struct namedlist_cacheblock {
 typedef struct namedlist_block {
   const uschar *string;			/* the list string */
   namedlist_cacheblock *cache_data;	/* cached domain_data or localpart_data */
+  struct list_run *index;		/* hashed runs of plain items */
   short		number;			/* the number of the list for caching */
   BOOL		hide;			/* -bP does not display value */
+  BOOL		indexed;		/* index has been built */
 } namedlist_block;
 
 /* Structures for Access Control Lists */
@@ -936,9 +989,48 @@ struct ob_dkim {
   uschar *dkim_timestamps;
   BOOL    dot_stuffed;
   BOOL    force_bodyhash;
+  BOOL    body_is_spool;	/* body is the unmodified spool data file */
 #ifdef EXPERIMENTAL_ARC
   uschar *arc_signspec;
 #endif
 };
 
+#ifdef WITH_CONTENT_SCAN
+/* A message being read for content scanning straight from the spool */
+typedef struct {
+  gstring *	head;		/* mbox From line, envelope and message headers */
+  int		hoff;		/* amount of head read */
+  int		fd;		/* the -D file */
+  BOOL		own_fd;		/* opened for the stream, so close it */
+  BOOL		eof;
+  BOOL		error;
+  off_t		off;		/* next offset in the -D file */
+  off_t		end;
+  uschar	rbuf[8192];	/* line buffer for mbox_stream_gets() */
+  int		rpos;
+  int		rlen;
+} mbox_stream;
+
+/* Where a MIME part is decoded to: a file, a buffer that takes as much
+of the start of it as there is room for, or a hash */
+typedef struct {
+  FILE *	file;
+  uschar *	buf;
+  size_t	size;
+  size_t	len;
+  void *	hash;		/* or an hctx, for just a hash of the content */
+} mime_sink;
+#endif
+
+/* An event in the trace ring. The numbers depend on the kind of event; see
+trace_dump(). */
+typedef struct {
+  struct timeval tv;		/* when it happened */
+  int		type;		/* TRACE_SMTP etc */
+  int		v1;
+  int		v2;
+  int		usec;		/* how long it took, or -1 */
+  uschar	text[40];	/* leading part of a name or command */
+} trace_item;
+
 /* End of structs.h */
@@ -98,6 +98,11 @@ require current GnuTLS, then we'll drop support for the ancient libraries).
 # define SUPPORT_GNUTLS_EXT_RAW_PARSE
 # define GNUTLS_OCSP_STATUS_REQUEST_GET2
 #endif
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+/* kTLS is enabled by the library's system configuration, not per-session */
+# include <gnutls/socket.h>
+# define EXIM_HAVE_KTLS
+#endif
 
 #ifdef SUPPORT_DANE
 # if GNUTLS_VERSION_NUMBER >= 0x030000
@@ -346,13 +351,46 @@ the strength at least matches that of the ciphersuite (but GnuTLS does not
 document this). */
 
 static BOOL once = FALSE;
+uschar secret[256];
+int len;
+
 if (once) return;
 once = TRUE;
-gnutls_session_ticket_key_generate(&server_sessticket_key);	/* >= 2.10.0 */
+
+/* With tls_ticket_key_file, the master key is derived from the shared secret
+so that the other hosts that have it can decrypt our tickets. GnuTLS rotates
+the keys it derives from that itself, so the file is read only once. */
+
+if ((len = tls_ticket_secret(secret, sizeof(secret))) > 0)
+  {
+  server_sessticket_key.size = 64;
+  server_sessticket_key.data = gnutls_malloc(server_sessticket_key.size);
+  gnutls_hash_fast(GNUTLS_DIG_SHA512, secret, len, server_sessticket_key.data);
+  DEBUG(D_tls) debug_printf("GnuTLS: STEK derived from tls_ticket_key_file\n");
+  }
+else
+  gnutls_session_ticket_key_generate(&server_sessticket_key);	/* >= 2.10.0 */
 if (f.running_in_test_harness) ssl_session_timeout = 6;
 #endif
 }
 
+/* Preloading of server contexts by the daemon (tls_server_preload) is
+supported only for OpenSSL. */
+BOOL
+tls_server_preload_check(void)
+{
+return FALSE;
+}
+
+#ifndef DISABLE_OCSP
+/* Nor is the refreshing of OCSP responses (tls_ocsp_refresh) */
+time_t
+tls_ocsp_refresh_files(BOOL fetch)
+{
+return 0;
+}
+#endif
+
 /* ------------------------------------------------------------------------ */
 /* Static functions */
 
@@ -2392,6 +2430,25 @@ if (gnutls_session_is_resumed(state->session))
   }
 }
 #endif
+
+
+/* Note which directions of the connection, if any, have had the record layer
+moved into the kernel. */
+
+static unsigned
+tls_ktls_state(exim_gnutls_state_st * state)
+{
+unsigned ktls = 0;
+#ifdef EXIM_HAVE_KTLS
+gnutls_transport_ktls_enable_flags_t k =
+  gnutls_transport_is_ktls_enabled(state->session);
+
+if (k & GNUTLS_KTLS_SEND) ktls |= KTLS_TX;
+if (k & GNUTLS_KTLS_RECV) ktls |= KTLS_RX;
+#endif
+DEBUG(D_tls) if (ktls) debug_printf("kernel TLS: %s\n", tls_ktls_name(ktls));
+return ktls;
+}
 /* ------------------------------------------------------------------------ */
 /* Exported functions */
 
@@ -2557,6 +2614,7 @@ if (rc != GNUTLS_E_SUCCESS)
 if (gnutls_session_get_flags(state->session) & GNUTLS_SFLAGS_EXT_MASTER_SECRET)
   tls_in.ext_master_secret = TRUE;
 #endif
+tls_in.ktls = tls_ktls_state(state);
 
 #ifdef EXIM_HAVE_TLS_RESUME
 tls_server_resume_posthandshake(state);
@@ -2590,6 +2648,7 @@ state->xfer_buffer = store_malloc(ssl_xfer_buffer_size);
 receive_getc = tls_getc;
 receive_getbuf = tls_getbuf;
 receive_get_cache = tls_get_cache;
+receive_peekbuf = tls_peekbuf;
 receive_ungetc = tls_ungetc;
 receive_feof = tls_feof;
 receive_ferror = tls_ferror;
@@ -2692,8 +2751,8 @@ return TRUE;
 
 
 #ifdef EXIM_HAVE_TLS_RESUME
-/* On the client, get any stashed session for the given IP from hints db
-and apply it to the ssl-connection for attempted resumption.  Although
+/* On the client, get any stashed session for the given IP from the shared
+cache or the hints db and apply it to the ssl-connection for attempted resumption.  Although
 there is a gnutls_session_ticket_enable_client() interface it is
 documented as unnecessary (as of 3.6.7) as "session tickets are emabled
 by deafult".  There seems to be no way to disable them, so even hosts not
@@ -2707,7 +2766,7 @@ tls_retrieve_session(tls_support * tlsp, gnutls_session_t session,
 tlsp->resumption = RESUME_SUPPORTED;
 if (verify_check_given_host(CUSS &ob->tls_resumption_hosts, host) == OK)
   {
-  dbdata_tls_session * dt;
+  dbdata_tls_session * dt = NULL;
   int len, rc;
   open_db dbblock, * dbm_file;
 
@@ -2715,22 +2774,27 @@ if (verify_check_given_host(CUSS &ob->tls_resumption_hosts, host) == OK)
     debug_printf("check for resumable session for %s\n", host->address);
   tlsp->host_resumable = TRUE;
   tlsp->resumption |= RESUME_CLIENT_REQUESTED;
-  if ((dbm_file = dbfn_open(US"tls", O_RDONLY, &dbblock, FALSE, FALSE)))
-    {
-    /* Key for the db is the IP.  We'd like to filter the retrieved session
-    for ticket advisory expiry, but 3.6.1 seems to give no access to that */
 
-    if ((dt = dbfn_read_with_length(dbm_file, host->address, &len)))
-      if (!(rc = gnutls_session_set_data(session,
-		    CUS dt->session, (size_t)len - sizeof(dbdata_tls_session))))
-	{
-	DEBUG(D_tls) debug_printf("good session\n");
-	tlsp->resumption |= RESUME_CLIENT_SUGGESTED;
-	}
-      else DEBUG(D_tls) debug_printf("setting session resumption data: %s\n",
-	    US gnutls_strerror(rc));
+  /* Key for the db is the IP.  We'd like to filter the retrieved session
+  for ticket advisory expiry, but 3.6.1 seems to give no access to that */
+
+  if (tls_resume_cache_open())
+    dt = tls_resume_cache_read(host->address, &len);
+  else if ((dbm_file = dbfn_open(US"tls", O_RDONLY, &dbblock, FALSE, FALSE)))
+    {
+    dt = dbfn_read_with_length(dbm_file, host->address, &len);
     dbfn_close(dbm_file);
     }
+
+  if (dt)
+    if (!(rc = gnutls_session_set_data(session,
+		  CUS dt->session, (size_t)len - sizeof(dbdata_tls_session))))
+      {
+      DEBUG(D_tls) debug_printf("good session\n");
+      tlsp->resumption |= RESUME_CLIENT_SUGGESTED;
+      }
+    else DEBUG(D_tls) debug_printf("setting session resumption data: %s\n",
+	  US gnutls_strerror(rc));
   }
 }
 
@@ -2763,7 +2827,9 @@ if (gnutls_session_get_flags(session) & GNUTLS_SFLAGS_SESSION_TICKET)
       memcpy(dt->session, tkt.data, tkt.size);
       gnutls_free(tkt.data);
 
-      if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
+      if (tls_resume_cache_open())
+	tls_resume_cache_write(host->address, dt, dlen);
+      else if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
 	{
 	/* key for the db is the IP */
 	dbfn_delete(dbm_file, host->address);
@@ -2821,6 +2887,8 @@ if (gnutls_session_is_resumed(state->session))
   DEBUG(D_tls) debug_printf("Session resumed\n");
   tlsp->resumption |= RESUME_USED;
   }
+if (tlsp->resumption & RESUME_CLIENT_SUGGESTED)
+  tls_resume_cache_note(host->address, !!(tlsp->resumption & RESUME_USED));
 
 tls_save_session(tlsp, state->session, host);
 }
@@ -3032,6 +3100,7 @@ if (!verify_certificate(state, errstr))
 if (gnutls_session_get_flags(state->session) & GNUTLS_SFLAGS_EXT_MASTER_SECRET)
   tlsp->ext_master_secret = TRUE;
 #endif
+tlsp->ktls = tls_ktls_state(state);
 
 #ifndef DISABLE_OCSP
 if (request_ocsp)
@@ -3133,6 +3202,7 @@ if (!ct_ctx)	/* server */
   receive_getc =	smtp_getc;
   receive_getbuf =	smtp_getbuf;
   receive_get_cache =	smtp_get_cache;
+  receive_peekbuf =	smtp_peekbuf;
   receive_ungetc =	smtp_ungetc;
   receive_feof =	smtp_feof;
   receive_ferror =	smtp_ferror;
@@ -3271,6 +3341,18 @@ return buf;
 }
 
 
+/* Give the data waiting in the buffer, without taking it */
+
+uschar *
+tls_peekbuf(unsigned * len)
+{
+exim_gnutls_state_st * state = &state_server;
+
+*len = state->xfer_buffer_hwm - state->xfer_buffer_lwm;
+return &state->xfer_buffer[state->xfer_buffer_lwm];
+}
+
+
 void
 tls_get_cache()
 {
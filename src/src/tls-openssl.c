@@ -32,6 +32,13 @@ functions from the OpenSSL library. */
 #ifdef SUPPORT_DANE
 # include "danessl.h"
 #endif
+#ifndef OPENSSL_NO_ENGINE
+# include <openssl/engine.h>
+# define EXIM_HAVE_OPENSSL_ENGINE
+#endif
+#ifdef SSL_MODE_ASYNC
+# define EXIM_HAVE_OPENSSL_ASYNC
+#endif
 
 
 #ifndef DISABLE_OCSP
@@ -72,6 +79,7 @@ change this guard and punt the issue for a while longer. */
 #  define EXIM_HAVE_OPENSSL_CHECKHOST
 #  define EXIM_HAVE_OPENSSL_DH_BITS
 #  define EXIM_HAVE_OPENSSL_TLS_METHOD
+#  define EXIM_HAVE_OPENSSL_CTX_UP_REF
 #  define EXIM_HAVE_OPENSSL_KEYLOG
 #  define EXIM_HAVE_OPENSSL_CIPHER_GET_ID
 #  define EXIM_HAVE_SESSION_TICKET
@@ -175,6 +183,9 @@ static exim_openssl_option exim_openssl_options[] = {
 #ifdef SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS
   { US"dont_insert_empty_fragments", SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS },
 #endif
+#ifdef SSL_OP_ENABLE_KTLS
+  { US"enable_ktls", SSL_OP_ENABLE_KTLS },
+#endif
 #ifdef SSL_OP_ENABLE_MIDDLEBOX_COMPAT
   { US"enable_middlebox_compat", SSL_OP_ENABLE_MIDDLEBOX_COMPAT },
 #endif
@@ -364,6 +375,7 @@ static BOOL client_verify_optional = FALSE;
 static BOOL server_verify_optional = FALSE;
 
 static BOOL reexpand_tls_files_for_sni = FALSE;
+static BOOL server_preloading = FALSE;	/* building preloaded contexts */
 
 
 typedef struct ocsp_resp {
@@ -387,6 +399,7 @@ typedef struct tls_ext_ctx_cb {
     struct {
       X509_STORE    *verify_store;	/* non-null if status requested */
       BOOL	    verify_required;
+      const uschar  *cache_id;		/* for tls_ocsp_cache; NULL for none */
     } client;
   } u_ocsp;
 #endif
@@ -407,6 +420,29 @@ For now, we hack around it. */
 tls_ext_ctx_cb *client_static_cbinfo = NULL;	/*XXX should not use static; multiple concurrent clients! */
 tls_ext_ctx_cb *server_static_cbinfo = NULL;
 
+#ifdef EXIM_HAVE_OPENSSL_CTX_UP_REF
+/* Server contexts built by the daemon before it accepts connections, when
+tls_server_preload is set, so that the processes handling the connections
+inherit them ready-made. The first is the default context; any others are for
+the tls_server_preload_sni names. */
+
+typedef struct server_preload_ctx {
+  struct server_preload_ctx * next;
+  const uschar *	sni;		/* NULL for the default context */
+  SSL_CTX *		ctx;
+  tls_ext_ctx_cb *	cbinfo;
+  long			options;	/* as built */
+  long			init_options;	/* from openssl_options */
+} server_preload_ctx;
+
+static server_preload_ctx * server_preload = NULL;
+static time_t server_preload_ctime = 0;		/* newest file used */
+static time_t server_preload_checked = 0;
+static BOOL   server_ctx_preloaded = FALSE;	/* in use for this session */
+
+# define TLS_PRELOAD_CHECK_INTERVAL 60
+#endif
+
 static int
 setup_certs(SSL_CTX *sctx, uschar *certs, uschar *crl, host_item *host, BOOL optional,
     int (*cert_vfy_cb)(int, X509_STORE_CTX *), uschar ** errstr );
@@ -907,11 +943,61 @@ typedef struct {			/* Session ticket encryption key */
 static exim_stek exim_tk;	/* current key */
 static exim_stek exim_tk_old;	/* previous key */
 
+/* With tls_ticket_key_file, the key for each tls_ticket_key_rotate period is
+derived from the shared secret, so every host that has the file uses the same
+one. Its name carries the period, so the key for a ticket made in one of the
+tls_ticket_key_overlap earlier periods can be derived again to decrypt it. */
+
+static uschar tk_secret[256];
+static int    tk_secret_len = 0;
+static time_t tk_period = -1;
+
+static void
+tk_derive(exim_stek * key, time_t period)
+{
+uschar data[9], md[EVP_MAX_MD_SIZE];
+unsigned mdlen;
+
+for (int i = 1; i <= 8; i++) data[i] = (uschar)(period >> (64 - 8*i));
+
+data[0] = 'n';
+HMAC(EVP_sha256(), tk_secret, tk_secret_len, data, sizeof(data), md, &mdlen);
+key->name[0] = 'S';
+memcpy(key->name+1, data+1, 8);
+memcpy(key->name+9, md, sizeof(key->name)-9);
+
+data[0] = 'a';
+HMAC(EVP_sha256(), tk_secret, tk_secret_len, data, sizeof(data), md, &mdlen);
+memcpy(key->aes_key, md, sizeof(key->aes_key));
+data[0] = 'h';
+HMAC(EVP_sha256(), tk_secret, tk_secret_len, data, sizeof(data), md, &mdlen);
+memcpy(key->hmac_key, md, sizeof(key->hmac_key));
+
+key->aes_cipher = EVP_aes_256_cbc();
+key->hmac_hash = EVP_sha256();
+key->renew = (period + 1) * tls_ticket_key_rotate;
+key->expire = (period + 1 + tls_ticket_key_overlap) * tls_ticket_key_rotate;
+}
+
 static void
 tk_init(void)
 {
 time_t t = time(NULL);
 
+if (tls_ticket_key_file && tls_ticket_key_rotate > 0)
+  {
+  time_t period = t / tls_ticket_key_rotate;
+
+  if (period == tk_period) return;
+  tk_period = period;		/* a failure is retried next period */
+  if ((tk_secret_len = tls_ticket_secret(tk_secret, sizeof(tk_secret))) > 0)
+    {
+    DEBUG(D_tls) debug_printf("OpenSSL: deriving shared STEK\n");
+    tk_derive(&exim_tk, period);
+    return;
+    }
+  }
+
 if (exim_tk.name[0])
   {
   if (exim_tk.renew >= t) return;
@@ -942,6 +1028,17 @@ return &exim_tk;
 static exim_stek *
 tk_find(const uschar * name)
 {
+if (name[0] == 'S' && tk_secret_len > 0)
+  {
+  static exim_stek key;
+  time_t period = 0;
+
+  for (int i = 1; i <= 8; i++) period = period << 8 | name[i];
+  if (period > tk_period + 1 || period < tk_period - tls_ticket_key_overlap)
+    return NULL;
+  tk_derive(&key, period);
+  return memcmp(name, key.name, sizeof(key.name)) == 0 ? &key : NULL;
+  }
 return memcmp(name, exim_tk.name, sizeof(exim_tk.name)) == 0 ? &exim_tk
   : memcmp(name, exim_tk_old.name, sizeof(exim_tk_old.name)) == 0 ? &exim_tk_old
   : NULL;
@@ -1657,6 +1754,90 @@ return OK;
 
 
 
+/*************************************************
+*     Build a server context for an SNI name     *
+*************************************************/
+
+/* The certificate, key and OCSP options are re-expanded with $tls_sni set.
+
+Arguments:
+  tmpl            the context to copy settings from
+  cbinfo          our callback context
+  errstr          error string pointer
+
+Returns:          the new context, or NULL on error
+*/
+
+#ifdef EXIM_HAVE_OPENSSL_TLSEXT
+static int tls_servername_cb(SSL *s, int *ad ARG_UNUSED, void *arg);
+
+static SSL_CTX *
+tls_server_sni_ctx(SSL_CTX * tmpl, tls_ext_ctx_cb * cbinfo, uschar ** errstr)
+{
+SSL_CTX * sctx;
+
+/* Can't find an SSL_CTX_clone() or equivalent, so we do it manually;
+not confident that memcpy wouldn't break some internal reference counting.
+Especially since there's a references struct member, which would be off. */
+
+#ifdef EXIM_HAVE_OPENSSL_TLS_METHOD
+if (!(sctx = SSL_CTX_new(TLS_server_method())))
+#else
+if (!(sctx = SSL_CTX_new(SSLv23_server_method())))
+#endif
+  {
+  ERR_error_string_n(ERR_get_error(), ssl_errstring, sizeof(ssl_errstring));
+  DEBUG(D_tls) debug_printf("SSL_CTX_new() failed: %s\n", ssl_errstring);
+  return NULL;
+  }
+
+/* Not sure how many of these are actually needed, since SSL object
+already exists.  Might even need this selfsame callback, for reneg? */
+
+SSL_CTX_set_info_callback(sctx, SSL_CTX_get_info_callback(tmpl));
+SSL_CTX_set_mode(sctx, SSL_CTX_get_mode(tmpl));
+SSL_CTX_set_options(sctx, SSL_CTX_get_options(tmpl));
+SSL_CTX_set_timeout(sctx, SSL_CTX_get_timeout(tmpl));
+SSL_CTX_set_tlsext_servername_callback(sctx, tls_servername_cb);
+SSL_CTX_set_tlsext_servername_arg(sctx, cbinfo);
+
+if (  !init_dh(sctx, cbinfo->dhparam, NULL, errstr)
+   || !init_ecdh(sctx, NULL, errstr)
+   )
+  goto bad;
+
+if (  cbinfo->server_cipher_list
+   && !SSL_CTX_set_cipher_list(sctx, CS cbinfo->server_cipher_list))
+  goto bad;
+
+#ifndef DISABLE_OCSP
+if (cbinfo->u_ocsp.server.file)
+  {
+  SSL_CTX_set_tlsext_status_cb(sctx, tls_server_stapling_cb);
+  SSL_CTX_set_tlsext_status_arg(sctx, cbinfo);
+  }
+#endif
+
+if (setup_certs(sctx, tls_verify_certificates, tls_crl, NULL, FALSE,
+		      verify_callback_server, errstr) != OK)
+  goto bad;
+
+/* do this after setup_certs, because this can require the certs for verifying
+OCSP information. */
+if (tls_expand_session_files(sctx, cbinfo, errstr) != OK)
+  goto bad;
+
+return sctx;
+
+bad:
+  SSL_CTX_free(sctx);
+  return NULL;
+}
+#endif /* EXIM_HAVE_OPENSSL_TLSEXT */
+
+
+
+
 /*************************************************
 *            Callback to handle SNI              *
 *************************************************/
@@ -1683,7 +1864,6 @@ tls_servername_cb(SSL *s, int *ad ARG_UNUSED, void *arg)
 {
 const char *servername = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
 tls_ext_ctx_cb *cbinfo = (tls_ext_ctx_cb *) arg;
-int rc;
 int old_pool = store_pool;
 uschar * dummy_errstr;
 
@@ -1701,62 +1881,35 @@ store_pool = old_pool;
 if (!reexpand_tls_files_for_sni)
   return SSL_TLSEXT_ERR_OK;
 
-/* Can't find an SSL_CTX_clone() or equivalent, so we do it manually;
-not confident that memcpy wouldn't break some internal reference counting.
-Especially since there's a references struct member, which would be off. */
-
-#ifdef EXIM_HAVE_OPENSSL_TLS_METHOD
-if (!(server_sni = SSL_CTX_new(TLS_server_method())))
-#else
-if (!(server_sni = SSL_CTX_new(SSLv23_server_method())))
-#endif
-  {
-  ERR_error_string_n(ERR_get_error(), ssl_errstring, sizeof(ssl_errstring));
-  DEBUG(D_tls) debug_printf("SSL_CTX_new() failed: %s\n", ssl_errstring);
-  goto bad;
-  }
-
-/* Not sure how many of these are actually needed, since SSL object
-already exists.  Might even need this selfsame callback, for reneg? */
-
-SSL_CTX_set_info_callback(server_sni, SSL_CTX_get_info_callback(server_ctx));
-SSL_CTX_set_mode(server_sni, SSL_CTX_get_mode(server_ctx));
-SSL_CTX_set_options(server_sni, SSL_CTX_get_options(server_ctx));
-SSL_CTX_set_timeout(server_sni, SSL_CTX_get_timeout(server_ctx));
-SSL_CTX_set_tlsext_servername_callback(server_sni, tls_servername_cb);
-SSL_CTX_set_tlsext_servername_arg(server_sni, cbinfo);
-
-if (  !init_dh(server_sni, cbinfo->dhparam, NULL, &dummy_errstr)
-   || !init_ecdh(server_sni, NULL, &dummy_errstr)
-   )
-  goto bad;
+#ifdef EXIM_HAVE_OPENSSL_CTX_UP_REF
+for (server_preload_ctx * p = server_preload; p; p = p->next)
+  if (p->sni && strcmpic(US p->sni, US servername) == 0)
+    {
+    if (cbinfo->server_cipher_list)
+      (void) SSL_CTX_set_cipher_list(p->ctx, CS cbinfo->server_cipher_list);
+    DEBUG(D_tls) debug_printf("Switching to preloaded SSL context.\n");
+    SSL_set_SSL_CTX(s, p->ctx);
+    return SSL_TLSEXT_ERR_OK;
+    }
 
-if (  cbinfo->server_cipher_list
-   && !SSL_CTX_set_cipher_list(server_sni, CS cbinfo->server_cipher_list))
-  goto bad;
+# ifndef DISABLE_OCSP
+/* The OCSP responses of a preloaded context are shared with later sessions;
+load our own rather than having them freed by the re-expansion. */
 
-#ifndef DISABLE_OCSP
-if (cbinfo->u_ocsp.server.file)
+if (server_ctx_preloaded)
   {
-  SSL_CTX_set_tlsext_status_cb(server_sni, tls_server_stapling_cb);
-  SSL_CTX_set_tlsext_status_arg(server_sni, cbinfo);
+  cbinfo->u_ocsp.server.olist = NULL;
+  cbinfo->u_ocsp.server.file_expanded = NULL;
   }
+# endif
 #endif
 
-if ((rc = setup_certs(server_sni, tls_verify_certificates, tls_crl, NULL, FALSE,
-		      verify_callback_server, &dummy_errstr)) != OK)
-  goto bad;
-
-/* do this after setup_certs, because this can require the certs for verifying
-OCSP information. */
-if ((rc = tls_expand_session_files(server_sni, cbinfo, &dummy_errstr)) != OK)
-  goto bad;
+if (!(server_sni = tls_server_sni_ctx(server_ctx, cbinfo, &dummy_errstr)))
+  return SSL_TLSEXT_ERR_ALERT_FATAL;
 
 DEBUG(D_tls) debug_printf("Switching SSL context.\n");
 SSL_set_SSL_CTX(s, server_sni);
 return SSL_TLSEXT_ERR_OK;
-
-bad: return SSL_TLSEXT_ERR_ALERT_FATAL;
 }
 #endif /* EXIM_HAVE_OPENSSL_TLSEXT */
 
@@ -1869,6 +2022,48 @@ ASN1_GENERALIZEDTIME_print(bp, time);
 BIO_puts(bp, "\n");
 }
 
+/* Convert an ASN.1 time to a time_t, or zero if that cannot be done */
+
+static time_t
+asn1_time_epoch(const ASN1_TIME * t)
+{
+int days, secs;
+return t && ASN1_TIME_diff(&days, &secs, NULL, t)
+  ? time(NULL) + (time_t)days * 86400 + secs : 0;
+}
+
+
+/* The key for the verified-OCSP cache covers the chain which was used to
+verify the response as well as the response itself, since a response is only
+good with respect to its signer. The chain is only good with respect to the
+trust anchors it was verified against, so the key also covers the transport and
+its expanded tls_verify_certificates (the id). */
+
+static BOOL
+tls_ocsp_cache_digest(const uschar * id, const unsigned char * resp, int len,
+  STACK_OF(X509) * chain, uschar * digest)
+{
+EVP_MD_CTX * mctx;
+BOOL ok;
+
+if (!id || !(mctx = EVP_MD_CTX_create())) return FALSE;
+ok = EVP_DigestInit_ex(mctx, EVP_sha256(), NULL)
+  && EVP_DigestUpdate(mctx, id, Ustrlen(id) + 1)
+  && EVP_DigestUpdate(mctx, resp, len);
+for (int i = 0; ok && i < sk_X509_num(chain); i++)
+  {
+  unsigned char * der = NULL;
+  int dlen = i2d_X509(sk_X509_value(chain, i), &der);
+
+  ok = dlen > 0 && EVP_DigestUpdate(mctx, der, dlen);
+  OPENSSL_free(der);
+  }
+ok = ok && EVP_DigestFinal_ex(mctx, digest, NULL);
+EVP_MD_CTX_destroy(mctx);
+return ok;
+}
+
+
 static int
 tls_client_stapling_cb(SSL *s, void *arg)
 {
@@ -1878,6 +2073,9 @@ int len;
 OCSP_RESPONSE * rsp;
 OCSP_BASICRESP * bs;
 int i;
+uschar digest[TLS_OCSP_DIGEST_LEN];
+BOOL cacheable = FALSE;
+time_t expiry = 0;
 
 DEBUG(D_tls) debug_printf("Received TLS status callback (OCSP stapling):\n");
 len = SSL_get_tlsext_status_ocsp_resp(s, &p);
@@ -1891,6 +2089,16 @@ if(!p)
   return cbinfo->u_ocsp.client.verify_required ? 0 : 1;
  }
 
+if (  tls_ocsp_cache_size > 0
+   && (cacheable = tls_ocsp_cache_digest(cbinfo->u_ocsp.client.cache_id,
+		      p, len, cbinfo->verify_stack, digest))
+   && tls_ocsp_cache_check(digest))
+  {
+  DEBUG(D_tls) debug_printf(" verified (cached)\n");
+  tls_out.ocsp = OCSP_VFIED;
+  return 1;
+  }
+
 if (!(rsp = d2i_OCSP_RESPONSE(NULL, &p, len)))
   {
   tls_out.ocsp = OCSP_FAILED;	/*XXX should use tlsp-> to permit concurrent outbound */
@@ -1990,6 +2198,12 @@ if (!(bs = OCSP_response_get1_basic(rsp)))
 	log_write(0, LOG_MAIN, "Server OSCP dates invalid");
 	goto failed;
 	}
+      if (cacheable)
+	{
+	time_t t = asn1_time_epoch(nextupd);
+	if (!t) cacheable = FALSE;		/* no expiry; do not keep */
+	else if (!expiry || t < expiry) expiry = t;
+	}
 
       DEBUG(D_tls) BIO_printf(bp, "Certificate status: %s\n",
 		    OCSP_cert_status_str(status));
@@ -2014,6 +2228,7 @@ if (!(bs = OCSP_response_get1_basic(rsp)))
 
     i = 1;
     tls_out.ocsp = OCSP_VFIED;
+    if (cacheable) tls_ocsp_cache_store(digest, expiry);
     goto good;
 
   failed:
@@ -2049,6 +2264,100 @@ EVP_add_digest(EVP_sha256());
 }
 
 
+#ifdef EXIM_HAVE_OPENSSL_ENGINE
+/* Make an engine (typically for a crypto accelerator) the default for all the
+algorithms it supports, once per process. Failure is logged, and the library's
+own implementations are used. This is done only when a context is made for a
+connection, not for the check of tls_require_ciphers. */
+
+static void
+tls_openssl_engine_init(void)
+{
+static BOOL engine_done = FALSE;
+
+if (openssl_engine && !engine_done)
+  {
+  ENGINE * e;
+
+  engine_done = TRUE;
+  ENGINE_load_builtin_engines();
+  if (!(e = ENGINE_by_id(CCS openssl_engine)) || !ENGINE_init(e))
+    log_write(0, LOG_MAIN, "OpenSSL engine %s could not be loaded",
+      openssl_engine);
+  else
+    {
+    if (ENGINE_set_default(e, ENGINE_METHOD_ALL))
+      DEBUG(D_tls) debug_printf("OpenSSL engine %s in use\n", openssl_engine);
+    else
+      log_write(0, LOG_MAIN, "OpenSSL engine %s could not be made the default",
+	openssl_engine);
+    ENGINE_finish(e);		/* the default holds its own reference */
+    }
+  if (e) ENGINE_free(e);
+  }
+}
+#endif
+
+
+
+/* Run a handshake. With openssl_async, the library returns when an engine
+has taken over a crypto operation; wait for that to complete (on the fds the
+engine gives, or by polling if it gives none) and call again. An alarm stops
+the wait. The mode is cleared afterwards, so that reads and writes on the
+connection never need this.
+
+Arguments:
+  ssl       the connection
+  fn        SSL_accept or SSL_connect
+
+Returns:    the value from the last call of fn
+*/
+
+static int
+tls_handshake(SSL * ssl, int (*fn)(SSL *))
+{
+int rc;
+
+#ifdef EXIM_HAVE_OPENSSL_ASYNC
+while (  (rc = fn(ssl)) <= 0
+      && SSL_get_error(ssl, rc) == SSL_ERROR_WANT_ASYNC
+      && !sigalrm_seen)
+  {
+  OSSL_ASYNC_FD fds[4];
+  size_t n = 0;
+# ifndef NO_POLL_H
+  struct pollfd p[4];
+# else
+  fd_set rfds;
+  struct timeval tv = { .tv_usec = 1000 };
+  int max_fd = -1;
+# endif
+
+  if (  !SSL_get_all_async_fds(ssl, NULL, &n) || n > nelem(fds)
+     || !SSL_get_all_async_fds(ssl, fds, &n))
+    n = 0;
+# ifndef NO_POLL_H
+  for (int i = 0; i < n; i++) { p[i].fd = fds[i]; p[i].events = POLLIN; }
+  (void) poll(p, n, n ? -1 : 1);
+# else
+  FD_ZERO(&rfds);
+  for (int i = 0; i < n; i++)
+    {
+    FD_SET(fds[i], &rfds);
+    if (fds[i] > max_fd) max_fd = fds[i];
+    }
+  (void) select(max_fd + 1, (SELECT_ARG2_TYPE *)&rfds, NULL, NULL,
+    n ? NULL : &tv);
+# endif
+  }
+SSL_clear_mode(ssl, SSL_MODE_ASYNC);
+#else
+rc = fn(ssl);
+#endif
+return rc;
+}
+
+
 
 /* Called from both server and client code, to do preliminary initialization
 of the library.  We allocate and return a context structure.
@@ -2096,7 +2405,10 @@ if (!host)
   cbinfo->u_ocsp.server.olist = NULL;
   }
 else
+  {
   cbinfo->u_ocsp.client.verify_store = NULL;
+  cbinfo->u_ocsp.client.cache_id = NULL;
+  }
 #endif
 cbinfo->dhparam = dhparam;
 cbinfo->server_cipher_list = NULL;
@@ -2106,6 +2418,9 @@ cbinfo->event_action = NULL;
 #endif
 
 tls_openssl_init();
+#ifdef EXIM_HAVE_OPENSSL_ENGINE
+tls_openssl_engine_init();
+#endif
 
 /* Create a context.
 The OpenSSL docs in 1.0.1b have not been updated to clarify TLS variant
@@ -2162,6 +2477,9 @@ DEBUG(D_tls)
 
 /* Automatically re-try reads/writes after renegotiation. */
 (void) SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
+#ifdef EXIM_HAVE_OPENSSL_ASYNC
+if (openssl_async) (void) SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#endif
 
 /* Apply administrator-supplied work-arounds.
 Historically we applied just one requested option,
@@ -2182,7 +2500,8 @@ if (init_options)
   {
 #ifndef DISABLE_TLS_RESUME
   /* Should the server offer session resumption? */
-  if (!host && verify_check_host(&tls_resumption_hosts) == OK)
+  if (!host && !server_preloading
+     && verify_check_host(&tls_resumption_hosts) == OK)
     {
     DEBUG(D_tls) debug_printf("tls_resumption_hosts overrides openssl_options\n");
     init_options &= ~SSL_OP_NO_TICKET;
@@ -2351,6 +2670,23 @@ return CUS s;
 }
 
 
+/* Note which directions of the connection, if any, have had the record layer
+moved into the kernel. This needs the "enable_ktls" option, and kernel and
+library support. */
+
+static unsigned
+tls_ktls_state(SSL * ssl)
+{
+unsigned ktls = 0;
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+if (BIO_get_ktls_send(SSL_get_wbio(ssl))) ktls |= KTLS_TX;
+if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) ktls |= KTLS_RX;
+#endif
+DEBUG(D_tls) if (ktls) debug_printf("kernel TLS: %s\n", tls_ktls_name(ktls));
+return ktls;
+}
+
+
 static void
 peer_cert(SSL * ssl, tls_support * tlsp, uschar * peerdn, unsigned siz)
 {
@@ -2593,6 +2929,527 @@ return OK;
 
 
 
+#ifdef EXIM_HAVE_OPENSSL_CTX_UP_REF
+/*************************************************
+*      Preloaded server contexts, in daemon      *
+*************************************************/
+
+/* With tls_server_preload set, the daemon builds the server contexts before
+accepting connections, so that loading and parsing the certificates, keys,
+DH parameters and OCSP responses is not repeated for every STARTTLS. The
+options are expanded with $tls_sni unset for the default context, and set to
+each of the tls_server_preload_sni names for the others; anything that depends
+on the connection is not available. The files are checked for changes once
+a minute, and the contexts rebuilt if any has changed. */
+
+static void
+tls_server_preload_free(server_preload_ctx * list)
+{
+for (server_preload_ctx * p; p = list; )
+  {
+  list = p->next;
+  SSL_CTX_free(p->ctx);
+#ifndef DISABLE_OCSP
+  ocsp_free_response_list(p->cbinfo);
+  if (p->cbinfo->verify_stack)
+    sk_X509_pop_free(p->cbinfo->verify_stack, X509_free);
+#endif
+  store_free(p->cbinfo);
+  store_free(p);
+  }
+}
+
+
+/* Find the newest change time of the files named by an option.
+
+Arguments:
+  opt       the option value, unexpanded
+  is_ocsp   TRUE if items may have a format prefix
+  ctimep    the newest time so far, updated
+*/
+
+static void
+tls_preload_stat_list(const uschar * opt, BOOL is_ocsp, time_t * ctimep)
+{
+const uschar * list;
+uschar * file;
+int sep = 0;
+struct stat statbuf;
+
+if (!opt || !(list = expand_string(US opt))) return;
+while ((file = string_nextinlist(&list, &sep, NULL, 0)))
+  {
+  if (is_ocsp && (Ustrncmp(file, "PEM ", 4) == 0 || Ustrncmp(file, "DER ", 4) == 0))
+    file += 4;
+  if (*file == '/' && Ustat(file, &statbuf) == 0 && statbuf.st_ctime > *ctimep)
+    *ctimep = statbuf.st_ctime;
+  }
+}
+
+
+static time_t
+tls_server_preload_ctime(void)
+{
+const uschar * names = tls_server_preload_sni;
+uschar * name = NULL;
+int sep = 0;
+time_t ctime = 0;
+rmark reset_point = store_mark();
+
+do
+  {
+  tls_in.sni = name;
+  tls_preload_stat_list(tls_certificate, FALSE, &ctime);
+  tls_preload_stat_list(tls_privatekey, FALSE, &ctime);
+#ifndef DISABLE_OCSP
+  tls_preload_stat_list(tls_ocsp_file, TRUE, &ctime);
+#endif
+  }
+  while (reexpand_tls_files_for_sni
+	&& (name = string_nextinlist(&names, &sep, NULL, 0)));
+tls_in.sni = NULL;
+
+tls_preload_stat_list(tls_dhparam, FALSE, &ctime);
+tls_preload_stat_list(tls_verify_certificates, FALSE, &ctime);
+tls_preload_stat_list(tls_crl, FALSE, &ctime);
+store_reset(reset_point);
+return ctime;
+}
+
+
+/* Build the contexts. On failure, any existing ones are kept, and there is
+no retry until the files change again.
+
+Returns:  TRUE if new contexts were built
+*/
+
+static BOOL
+tls_server_preload_build(void)
+{
+server_preload_ctx * list = NULL, ** tail = &list;
+const uschar * names = tls_server_preload_sni;
+uschar * name = NULL, * errstr = NULL;
+int sep = 0, old_pool = store_pool;
+BOOL ok = FALSE;
+
+DEBUG(D_tls) debug_printf("building preloaded TLS server contexts\n");
+store_pool = POOL_PERM;
+server_preloading = TRUE;
+
+do
+  {
+  server_preload_ctx * p = store_malloc(sizeof(server_preload_ctx));
+
+  p->next = NULL;
+  p->sni = name;
+  p->ctx = NULL;
+  (void) tls_openssl_options_parse(openssl_options, &p->init_options);
+
+  if (!name)
+    {
+    if (tls_init(&p->ctx, NULL, tls_dhparam, tls_certificate, tls_privatekey,
+#ifndef DISABLE_OCSP
+	  tls_ocsp_file,
+#endif
+	  NULL, &p->cbinfo, &tls_in, &errstr) != OK)
+      {
+      if (p->ctx) SSL_CTX_free(p->ctx);
+      store_free(p);
+      goto done;
+      }
+    }
+#ifdef EXIM_HAVE_OPENSSL_TLSEXT
+  else
+    {
+    /* Each name has its own copy of the callback context, for its OCSP
+    responses. */
+
+    p->cbinfo = store_malloc(sizeof(tls_ext_ctx_cb));
+    *p->cbinfo = *list->cbinfo;
+# ifndef DISABLE_OCSP
+    p->cbinfo->u_ocsp.server.olist = NULL;
+    p->cbinfo->u_ocsp.server.file_expanded = NULL;
+    p->cbinfo->verify_stack = sk_X509_new_null();
+# endif
+
+    DEBUG(D_tls) debug_printf("preloading context for SNI %s\n", name);
+    tls_in.sni = name;
+    server_static_cbinfo = p->cbinfo;
+    p->ctx = tls_server_sni_ctx(list->ctx, p->cbinfo, &errstr);
+    server_static_cbinfo = NULL;
+    tls_in.sni = NULL;
+    if (!p->ctx)
+      {
+      p->next = list;
+      list = p;
+      goto done;
+      }
+    }
+#endif
+
+  p->options = SSL_CTX_get_options(p->ctx);
+  *tail = p;
+  tail = &p->next;
+  }
+  while (reexpand_tls_files_for_sni
+	&& (name = string_nextinlist(&names, &sep, NULL, 0)));
+ok = TRUE;
+
+done:
+server_preloading = FALSE;
+store_pool = old_pool;
+
+if (!ok)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to preload TLS server context%s%s: %s",
+    name ? " for SNI " : "", name ? name : US"", errstr ? errstr : US"");
+  tls_server_preload_free(list);
+  }
+else
+  {
+  if (server_preload)
+    {
+    log_write(0, LOG_MAIN, "TLS server credentials changed; contexts rebuilt");
+    tls_server_preload_free(server_preload);
+    }
+  server_preload = list;
+  }
+server_preload_ctime = tls_server_preload_ctime();
+return ok;
+}
+#endif	/*EXIM_HAVE_OPENSSL_CTX_UP_REF*/
+
+
+/* Called by the daemon before accepting connections, and before starting
+prefork workers, to build the preloaded server contexts, or rebuild them if
+the files they came from have changed.
+
+Returns:  TRUE if the contexts were (re)built
+*/
+
+BOOL
+tls_server_preload_check(void)
+{
+#ifdef EXIM_HAVE_OPENSSL_CTX_UP_REF
+time_t now = time(NULL);
+
+if (!tls_server_preload || now < server_preload_checked + TLS_PRELOAD_CHECK_INTERVAL)
+  return FALSE;
+if (server_preload_checked && tls_server_preload_ctime() == server_preload_ctime)
+  {
+  server_preload_checked = now;
+  return FALSE;
+  }
+server_preload_checked = now;
+return tls_server_preload_build();
+#else
+return FALSE;
+#endif
+}
+
+
+#ifndef DISABLE_OCSP
+/*************************************************
+*     Refresh OCSP responses for the server      *
+*************************************************/
+
+/* With tls_ocsp_refresh set, the daemon keeps the files named by tls_ocsp_file
+up to date itself, by running a helper which calls here. Once half of the
+validity period of a response has passed, or there is no usable response, the
+OCSP responder named in the certificate is asked for a new one, which replaces
+the file. Only http responders are supported, and the certificate file must
+hold the issuer's certificate next after the server's. */
+
+/* Return the time at which the response in a file is due to be refreshed, or
+zero if there is no usable response */
+
+static time_t
+ocsp_refresh_due(const uschar * filename, BOOL is_pem)
+{
+BIO * bio;
+OCSP_RESPONSE * resp = NULL;
+OCSP_BASICRESP * bs;
+time_t due = 0;
+
+if (!(bio = BIO_new_file(CS filename, "rb"))) return 0;
+if (is_pem)
+  {
+  uschar * data, * freep;
+  char * name, * header;
+  long len;
+
+  if (PEM_read_bio(bio, &name, &header, &data, &len))
+    {
+    freep = data;
+    resp = d2i_OCSP_RESPONSE(NULL, CUSS &data, len);
+    OPENSSL_free(freep);
+    OPENSSL_free(name);
+    OPENSSL_free(header);
+    }
+  }
+else
+  resp = d2i_OCSP_RESPONSE_bio(bio, NULL);
+BIO_free(bio);
+if (!resp) return 0;
+
+if (  OCSP_response_status(resp) == OCSP_RESPONSE_STATUS_SUCCESSFUL
+   && (bs = OCSP_response_get1_basic(resp)))
+  {
+  OCSP_SINGLERESP * single = OCSP_resp_get0(bs, 0);
+  ASN1_GENERALIZEDTIME * rev, * thisupd, * nextupd;
+  int reason;
+
+  if (single
+     && OCSP_single_get0_status(single, &reason, &rev, &thisupd, &nextupd) >= 0)
+    {
+    time_t t0 = asn1_time_epoch(thisupd), t1 = asn1_time_epoch(nextupd);
+
+    /* A response without a nextUpdate time is refreshed daily */
+    if (t0) due = t0 + (t1 > t0 ? (t1 - t0) / 2 : 86400);
+    }
+  OCSP_BASICRESP_free(bs);
+  }
+OCSP_RESPONSE_free(resp);
+return due;
+}
+
+
+/* Fetch a new response for a certificate, and write it to a file. The file is
+replaced by renaming, so that it is never seen incomplete.
+
+Arguments:
+  certfile    the file holding the certificate and its issuer
+  ocspfile    the response file to write
+  is_pem      TRUE to write PEM format, else DER
+*/
+
+static void
+ocsp_refresh_fetch(const uschar * certfile, const uschar * ocspfile,
+  BOOL is_pem)
+{
+BIO * bio, * cbio = NULL;
+X509 * cert = NULL, * issuer = NULL;
+STACK_OF(OPENSSL_STRING) * urls = NULL;
+STACK_OF(X509) * chain = NULL;
+X509_STORE * store = NULL;
+OCSP_CERTID * id = NULL;
+OCSP_REQUEST * req = NULL;
+OCSP_REQ_CTX * rctx = NULL;
+OCSP_RESPONSE * resp = NULL;
+OCSP_BASICRESP * bs = NULL;
+ASN1_GENERALIZEDTIME * rev, * thisupd, * nextupd;
+char * url = NULL, * host = NULL, * port = NULL, * path = NULL;
+int ssl, status, reason, rc, fd;
+uschar * tmp;
+const char * err = NULL;
+
+if ((bio = BIO_new_file(CS certfile, "r")))
+  {
+  cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  issuer = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  BIO_free(bio);
+  }
+if (!cert || !issuer)
+  { err = "no issuer certificate following the server's"; goto done; }
+if (  !(urls = X509_get1_ocsp(cert))
+   || !(url = sk_OPENSSL_STRING_value(urls, 0)))
+  { err = "no OCSP responder named in the certificate"; goto done; }
+if (!OCSP_parse_url(url, &host, &port, &path, &ssl) || ssl)
+  { err = "unsupported OCSP responder URL"; goto done; }
+
+if (  !(id = OCSP_cert_to_id(NULL, cert, issuer))
+   || !(req = OCSP_REQUEST_new())
+   || !OCSP_request_add0_id(req, OCSP_CERTID_dup(id)))
+  { err = "failed to build request"; goto done; }
+
+DEBUG(D_tls) debug_printf("OCSP refresh for %s from %s\n", certfile, url);
+if (  !(cbio = BIO_new_connect(host))
+   || !BIO_set_conn_port(cbio, port)
+   || BIO_do_connect(cbio) <= 0)
+  { err = "failed to connect to responder"; goto done; }
+
+if (  !(rctx = OCSP_sendreq_new(cbio, path, NULL, -1))
+   || !OCSP_REQ_CTX_add1_header(rctx, "Host", host)
+   || !OCSP_REQ_CTX_set1_req(rctx, req))
+  { err = "failed to send request"; goto done; }
+while ((rc = OCSP_sendreq_nbio(&resp, rctx)) == -1 && BIO_should_retry(cbio)) ;
+if (rc <= 0 || !resp)
+  { err = "no response from responder"; goto done; }
+
+if ((status = OCSP_response_status(resp)) != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+  { err = OCSP_response_status_str(status); goto done; }
+
+/* The signer must be the issuer, or be delegated by it */
+
+if (  !(bs = OCSP_response_get1_basic(resp))
+   || !(store = X509_STORE_new())
+   || !X509_STORE_add_cert(store, issuer)
+   || !X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN)
+   || !(chain = sk_X509_new_null())
+   || !sk_X509_push(chain, issuer)
+   || OCSP_basic_verify(bs, chain, store, 0) <= 0)
+  { err = "response did not verify"; goto done; }
+
+if (  !OCSP_resp_find_status(bs, id, &status, &reason, &rev, &thisupd, &nextupd)
+   || !OCSP_check_validity(thisupd, nextupd,
+	EXIM_OCSP_SKEW_SECONDS, EXIM_OCSP_MAX_AGE))
+  { err = "response is not current for the certificate"; goto done; }
+
+tmp = string_sprintf("%s.%d.tmp", ocspfile, (int)getpid());
+if (  (fd = Uopen(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0
+   || !(bio = BIO_new_fd(fd, BIO_CLOSE)))
+  {
+  err = strerror(errno);
+  if (fd >= 0) (void) close(fd);
+  goto done;
+  }
+rc = is_pem
+  ? PEM_write_bio_OCSP_RESPONSE(bio, resp) : i2d_OCSP_RESPONSE_bio(bio, resp);
+if (BIO_flush(bio) <= 0) rc = 0;
+BIO_free(bio);
+if (!rc || Urename(tmp, ocspfile) < 0)
+  {
+  err = rc ? strerror(errno) : "failed to write the response";
+  (void) Uunlink(tmp);
+  goto done;
+  }
+
+log_write(0, LOG_MAIN, "OCSP response for %s refreshed: %s",
+  certfile, OCSP_cert_status_str(status));
+
+done:
+if (err)
+  log_write(0, LOG_MAIN, "OCSP refresh for %s failed: %s", certfile, err);
+OCSP_BASICRESP_free(bs);
+OCSP_RESPONSE_free(resp);
+if (rctx) OCSP_REQ_CTX_free(rctx);
+BIO_free_all(cbio);
+OCSP_REQUEST_free(req);
+OCSP_CERTID_free(id);
+sk_X509_free(chain);
+X509_STORE_free(store);
+X509_email_free(urls);
+OPENSSL_free(host);
+OPENSSL_free(port);
+OPENSSL_free(path);
+X509_free(issuer);
+X509_free(cert);
+}
+
+
+/* Called by the daemon, to learn when a refresh is next needed, and by its
+helper, to do the refreshing. The certificate and response files are taken in
+pairs, for the default context and for each name in tls_server_preload_sni when
+they depend on SNI.
+
+Argument:   TRUE to fetch the responses which are due
+Returns:    the earliest time at which a response is due, zero if none
+*/
+
+time_t
+tls_ocsp_refresh_files(BOOL fetch)
+{
+const uschar * names = tls_server_preload_sni;
+uschar * name = NULL;
+int nsep = 0;
+time_t now = time(NULL), next = 0;
+BOOL by_sni = reexpand_tls_files_for_sni
+  || tls_certificate
+     && (  Ustrstr(tls_certificate, US"tls_sni")
+	|| Ustrstr(tls_certificate, US"tls_in_sni"));
+
+if (!tls_certificate || !tls_ocsp_file) return 0;
+do
+  {
+  const uschar * certs, * ocsps;
+  uschar * cert, * ofile;
+  int sep = 0, osep = 0;
+
+  tls_in.sni = name;
+  if (  (certs = expand_cstring(tls_certificate))
+     && (ocsps = expand_cstring(tls_ocsp_file)))
+    while (  (cert = string_nextinlist(&certs, &sep, NULL, 0))
+	  && (ofile = string_nextinlist(&ocsps, &osep, NULL, 0)))
+      {
+      BOOL is_pem = FALSE;
+      time_t due;
+
+      if (Ustrncmp(ofile, US"PEM ", 4) == 0)
+	{ is_pem = TRUE; ofile += 4; }
+      else if (Ustrncmp(ofile, US"DER ", 4) == 0)
+	ofile += 4;
+
+      if ((due = ocsp_refresh_due(ofile, is_pem)) <= now)
+	if (fetch)
+	  {
+	  ocsp_refresh_fetch(cert, ofile, is_pem);
+	  due = ocsp_refresh_due(ofile, is_pem);
+	  }
+	else
+	  due = now;
+      if (due && (!next || due < next)) next = due;
+      }
+  }
+  while (by_sni && (name = string_nextinlist(&names, &nsep, NULL, 0)));
+tls_in.sni = NULL;
+return next;
+}
+#endif	/*!DISABLE_OCSP*/
+
+
+#ifdef EXIM_HAVE_OPENSSL_CTX_UP_REF
+/* In a process handling a connection, take up the preloaded default context.
+A prefork worker uses it for more than one connection, so undo anything that a
+previous session did to it.
+
+Returns:  OK
+*/
+
+static int
+tls_server_preloaded(void)
+{
+server_preload_ctx * p = server_preload;
+tls_ext_ctx_cb * cbinfo = store_malloc(sizeof(tls_ext_ctx_cb));
+
+*cbinfo = *p->cbinfo;
+cbinfo->server_cipher_list = NULL;
+#ifndef DISABLE_OCSP
+cbinfo->verify_stack = sk_X509_new_null();
+#endif
+
+SSL_CTX_up_ref(p->ctx);
+server_ctx = p->ctx;
+server_static_cbinfo = cbinfo;
+server_ctx_preloaded = TRUE;
+
+SSL_CTX_clear_options(server_ctx, SSL_CTX_get_options(server_ctx) & ~p->options);
+SSL_CTX_set_options(server_ctx, p->options);
+SSL_CTX_set_verify(server_ctx, SSL_VERIFY_NONE, NULL);
+SSL_CTX_set_tlsext_servername_arg(server_ctx, cbinfo);
+#ifndef DISABLE_OCSP
+if (cbinfo->u_ocsp.server.file)
+  SSL_CTX_set_tlsext_status_arg(server_ctx, cbinfo);
+#endif
+
+#ifndef DISABLE_TLS_RESUME
+tls_in.resumption = RESUME_SUPPORTED;
+tls_in.host_resumable = FALSE;
+if (p->init_options && verify_check_host(&tls_resumption_hosts) == OK)
+  {
+  DEBUG(D_tls) debug_printf("tls_resumption_hosts overrides openssl_options\n");
+  SSL_CTX_clear_options(server_ctx, SSL_OP_NO_TICKET);
+  tls_in.resumption |= RESUME_SERVER_TICKET;
+  tls_in.host_resumable = TRUE;
+  }
+#endif
+
+DEBUG(D_tls) debug_printf("using preloaded TLS server context\n");
+return OK;
+}
+#endif
+
+
+
 /*************************************************
 *       Start a TLS session in a server          *
 *************************************************/
@@ -2629,13 +3486,18 @@ if (tls_in.active.sock >= 0)
   }
 
 /* Initialize the SSL library. If it fails, it will already have logged
-the error. */
+the error. The daemon may have done it for us. */
 
-rc = tls_init(&server_ctx, NULL, tls_dhparam, tls_certificate, tls_privatekey,
+#ifdef EXIM_HAVE_OPENSSL_CTX_UP_REF
+if (server_preload)
+  rc = tls_server_preloaded();
+else
+#endif
+  rc = tls_init(&server_ctx, NULL, tls_dhparam, tls_certificate, tls_privatekey,
 #ifndef DISABLE_OCSP
-    tls_ocsp_file,
+      tls_ocsp_file,
 #endif
-    NULL, &server_static_cbinfo, &tls_in, errstr);
+      NULL, &server_static_cbinfo, &tls_in, errstr);
 if (rc != OK) return rc;
 cbinfo = server_static_cbinfo;
 
@@ -2740,7 +3602,7 @@ DEBUG(D_tls) debug_printf("Calling SSL_accept\n");
 ERR_clear_error();
 sigalrm_seen = FALSE;
 if (smtp_receive_timeout > 0) ALARM(smtp_receive_timeout);
-rc = SSL_accept(server_ssl);
+rc = tls_handshake(server_ssl, SSL_accept);
 ALARM_CLR(0);
 
 if (rc <= 0)
@@ -2813,6 +3675,7 @@ adjust the input functions to read via TLS, and initialize things. */
 #ifdef SSL_get_extms_support
 tls_in.ext_master_secret = SSL_get_extms_support(server_ssl) == 1;
 #endif
+tls_in.ktls = tls_ktls_state(server_ssl);
 peer_cert(server_ssl, &tls_in, peerdn, sizeof(peerdn));
 
 tls_in.ver = tlsver_name(server_ssl);
@@ -2875,6 +3738,7 @@ ssl_xfer_eof = ssl_xfer_error = FALSE;
 receive_getc = tls_getc;
 receive_getbuf = tls_getbuf;
 receive_get_cache = tls_get_cache;
+receive_peekbuf = tls_peekbuf;
 receive_ungetc = tls_ungetc;
 receive_feof = tls_feof;
 receive_ferror = tls_ferror;
@@ -2987,8 +3851,8 @@ return DEFER;
 
 
 #ifndef DISABLE_TLS_RESUME
-/* On the client, get any stashed session for the given IP from hints db
-and apply it to the ssl-connection for attempted resumption. */
+/* On the client, get any stashed session for the given IP from the shared
+cache or the hints db and apply it to the ssl-connection for attempted resumption. */
 
 static void
 tls_retrieve_session(tls_support * tlsp, SSL * ssl, const uschar * key)
@@ -2998,14 +3862,16 @@ if (tlsp->host_resumable)
   {
   dbdata_tls_session * dt;
   int len;
-  open_db dbblock, * dbm_file;
+  open_db dbblock, * dbm_file = NULL;
+  BOOL cached = tls_resume_cache_open();
 
   tlsp->resumption |= RESUME_CLIENT_REQUESTED;
   DEBUG(D_tls) debug_printf("checking for resumable session for %s\n", key);
-  if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
+  if (cached || (dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
     {
     /* key for the db is the IP */
-    if ((dt = dbfn_read_with_length(dbm_file, key, &len)))
+    if ((dt = cached ? tls_resume_cache_read(key, &len)
+		     : dbfn_read_with_length(dbm_file, key, &len)))
       {
       SSL_SESSION * ss = NULL;
       const uschar * sess_asn1 = dt->session;
@@ -3025,7 +3891,8 @@ if (tlsp->host_resumable)
 	       < time(NULL))
 	{
 	DEBUG(D_tls) debug_printf("session expired\n");
-	dbfn_delete(dbm_file, key);
+	if (cached) tls_resume_cache_delete(key);
+	else dbfn_delete(dbm_file, key);
 	}
 #endif
       else if (!SSL_set_session(ssl, ss))
@@ -3047,7 +3914,7 @@ if (tlsp->host_resumable)
       }
     else
       DEBUG(D_tls) debug_printf("no session record\n");
-    dbfn_close(dbm_file);
+    if (dbm_file) dbfn_close(dbm_file);
     }
   }
 }
@@ -3082,7 +3949,9 @@ if (SSL_SESSION_is_resumable(ss)) 	/* 1.1.1 */
   dt->ocsp = tlsp->ocsp;
   (void) i2d_SSL_SESSION(ss, &s);		/* s gets bumped to end */
 
-  if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
+  if (tls_resume_cache_open())
+    tls_resume_cache_write(cbinfo->host->address, dt, dlen);
+  else if ((dbm_file = dbfn_open(US"tls", O_RDWR, &dbblock, FALSE, FALSE)))
     {
     const uschar * key = cbinfo->host->address;
     dbfn_delete(dbm_file, key);
@@ -3140,13 +4009,15 @@ return TRUE;
 
 static void
 tls_client_resume_posthandshake(exim_openssl_client_tls_ctx * exim_client_ctx,
-  tls_support * tlsp)
+  tls_support * tlsp, host_item * host)
 {
 if (SSL_session_reused(exim_client_ctx->ssl))
   {
   DEBUG(D_tls) debug_printf("The session was reused\n");
   tlsp->resumption |= RESUME_USED;
   }
+if (tlsp->resumption & RESUME_CLIENT_SUGGESTED)
+  tls_resume_cache_note(host->address, !!(tlsp->resumption & RESUME_USED));
 }
 #endif	/* !DISABLE_TLS_RESUME */
 
@@ -3366,6 +4237,21 @@ if (request_ocsp)
   SSL_set_tlsext_status_type(exim_client_ctx->ssl, TLSEXT_STATUSTYPE_ocsp);
   client_static_cbinfo->u_ocsp.client.verify_required = require_ocsp;
   tlsp->ocsp = OCSP_NOT_RESP;
+
+  if (tls_ocsp_cache_size > 0)
+    {
+    uschar * certs = NULL;
+    const uschar * dane = US"";
+# ifdef SUPPORT_DANE
+    if (conn_args->dane) dane = US"dane";
+# endif
+    client_static_cbinfo->u_ocsp.client.cache_id =
+      expand_check(ob->tls_verify_certificates, US"tls_verify_certificates",
+		    &certs, errstr)
+      ? string_sprintf("%s\n%s\n%s", tb ? tb->name : US"",
+	  certs ? certs : US"", dane)
+      : NULL;
+    }
   }
 #endif
 
@@ -3384,7 +4270,7 @@ client_static_cbinfo->event_action = tb ? tb->event_action : NULL;
 DEBUG(D_tls) debug_printf("Calling SSL_connect\n");
 sigalrm_seen = FALSE;
 ALARM(ob->command_timeout);
-rc = SSL_connect(exim_client_ctx->ssl);
+rc = tls_handshake(exim_client_ctx->ssl, SSL_connect);
 ALARM_CLR(0);
 
 #ifdef SUPPORT_DANE
@@ -3411,12 +4297,13 @@ DEBUG(D_tls)
   }
 
 #ifndef DISABLE_TLS_RESUME
-tls_client_resume_posthandshake(exim_client_ctx, tlsp);
+tls_client_resume_posthandshake(exim_client_ctx, tlsp, host);
 #endif
 
 #ifdef SSL_get_extms_support
 tlsp->ext_master_secret = SSL_get_extms_support(exim_client_ctx->ssl) == 1;
 #endif
+tlsp->ktls = tls_ktls_state(exim_client_ctx->ssl);
 peer_cert(exim_client_ctx->ssl, tlsp, peerdn, sizeof(peerdn));
 
 tlsp->ver = tlsver_name(exim_client_ctx->ssl);
@@ -3568,6 +4455,16 @@ return buf;
 }
 
 
+/* Give the data waiting in the buffer, without taking it */
+
+uschar *
+tls_peekbuf(unsigned * len)
+{
+*len = ssl_xfer_buffer_hwm - ssl_xfer_buffer_lwm;
+return &ssl_xfer_buffer[ssl_xfer_buffer_lwm];
+}
+
+
 void
 tls_get_cache()
 {
@@ -3804,6 +4701,7 @@ if (!o_ctx)		/* server side */
   receive_getc =	smtp_getc;
   receive_getbuf =	smtp_getbuf;
   receive_get_cache =	smtp_get_cache;
+  receive_peekbuf =	smtp_peekbuf;
   receive_ungetc =	smtp_ungetc;
   receive_feof =	smtp_feof;
   receive_ferror =	smtp_ferror;
@@ -106,6 +106,7 @@ to_tz(uschar * tz)
 uschar * old = US getenv("TZ");
 (void) setenv("TZ", CCS tz, 1);
 tzset();
+tod_reset();
 return old;
 }
 
@@ -117,8 +118,442 @@ if (tz)
 else
   (void) os_unsetenv(US"TZ");
 tzset();
+tod_reset();
 }
 
+
+#ifndef DISABLE_TLS_RESUME
+/*************************************************
+*   Shared cache of client resumption sessions   *
+*************************************************/
+
+/* If tls_resumption_cache_size is set, the sessions that a client keeps for
+resumption are stored in a file in the hints directory, which every Exim
+process maps shared, instead of in the "tls" hints database. That saves an
+open, lock and write of the database on each outbound TLS handshake, which
+contends badly when many deliveries run in parallel. The key is the same as
+for the database (the server's IP address), and the value is the same
+dbdata_tls_session image, so the library-specific code does not change.
+
+The file holds a fixed number of slots, read and written as described for
+dbfn_slot_n(). When a new key is stored and its probe range is full, the least
+recently used slot is replaced. Each
+slot also counts the handshakes that asked the server to resume its session,
+and how many of those the server accepted, giving a resumption rate per
+destination. Sessions too big for a slot are not cached. */
+
+#define TLS_RESUME_CACHE_MAGIC	0x45544331	/* "ETC1" */
+#define TLS_RESUME_CACHE_DATA	7168
+#define TLS_RESUME_CACHE_PROBES	8
+
+typedef struct {
+  dbfn_shared_header sh;
+  unsigned long	lookups;
+  unsigned long	hits;
+  unsigned long	resumed;
+  unsigned long	evictions;
+} tls_resume_cache_header;
+
+typedef struct {
+  dbfn_shared_slot sl;
+  time_t	last_used;
+  unsigned	tries;			/* resumptions requested */
+  unsigned	resumed;		/* and accepted */
+  int		len;
+  uschar	key[48];
+  uschar	data[TLS_RESUME_CACHE_DATA];
+} tls_resume_cache_slot;
+
+static tls_resume_cache_header * tls_resume_cache = NULL;
+static BOOL tls_resume_cache_tried = FALSE;
+
+
+/* Map the cache file, creating it if necessary. Failure is not an error; the
+hints database is used instead.
+
+Returns:  TRUE if the cache is available
+*/
+
+static BOOL
+tls_resume_cache_open(void)
+{
+if (tls_resume_cache) return TRUE;
+if (tls_resume_cache_tried || tls_resumption_cache_size <= 0) return FALSE;
+tls_resume_cache_tried = TRUE;
+
+return !!(tls_resume_cache = dbfn_map_shared(US"tlscache",
+  TLS_RESUME_CACHE_MAGIC, tls_resumption_cache_size,
+  sizeof(tls_resume_cache_header), sizeof(tls_resume_cache_slot)));
+}
+
+
+static unsigned
+tls_resume_cache_hash(const uschar * key)
+{
+unsigned h = 2166136261u;			/* FNV-1a */
+while (*key) h = (h ^ *key++) * 16777619u;
+return h;
+}
+
+
+/* Find the slot holding a key, within its probe range.
+
+Arguments:
+  key       the key
+  hash      its hash
+
+Returns:    the slot, or NULL
+*/
+
+static tls_resume_cache_slot *
+tls_resume_cache_find(const uschar * key, unsigned hash)
+{
+for (int i = 0; i < TLS_RESUME_CACHE_PROBES; i++)
+  {
+  tls_resume_cache_slot * s = dbfn_slot_n(tls_resume_cache, hash, i);
+  if (s->sl.hash == hash && s->len > 0 && Ustrcmp(s->key, key) == 0)
+    return s;
+  }
+return NULL;
+}
+
+
+/* Look for a session in the cache. The caller has checked that the cache is
+open. Each slot in the probe range is read under its sequence number, retrying
+a few times while it is being written, so that a slot rewritten meanwhile for
+another key is never taken as a match. A slot that keeps changing is treated as
+a miss.
+
+Arguments:
+  key       the key
+  lenp      where to put the length of the record
+
+Returns:    a copy of the record, or NULL
+*/
+
+static dbdata_tls_session *
+tls_resume_cache_read(const uschar * key, int * lenp)
+{
+unsigned hash = tls_resume_cache_hash(key);
+int klen = Ustrlen(key);
+
+__sync_fetch_and_add(&tls_resume_cache->lookups, 1);
+if (klen < sizeof(((tls_resume_cache_slot *)0)->key))
+  for (int i = 0; i < TLS_RESUME_CACHE_PROBES; i++)
+    {
+    tls_resume_cache_slot * s = dbfn_slot_n(tls_resume_cache, hash, i);
+
+    for (int tries = 0; tries < 4; tries++)
+      {
+      uint64_t seq;
+      dbdata_tls_session * dt;
+      int len;
+
+      if (!dbfn_slot_read_begin(&s->sl, &seq)) continue;
+      if (  s->sl.hash != hash || memcmp(s->key, key, klen + 1) != 0
+	 || (len = s->len) <= 0 || len > TLS_RESUME_CACHE_DATA)
+	{
+	if (dbfn_slot_read_end(&s->sl, seq)) break;	/* stable, and not this key */
+	continue;
+	}
+      dt = store_get(len, TRUE);
+      memcpy(dt, s->data, len);
+      if (!dbfn_slot_read_end(&s->sl, seq)) continue;
+
+      s->last_used = time(NULL);
+      __sync_fetch_and_add(&tls_resume_cache->hits, 1);
+      DEBUG(D_tls) debug_printf("session from shared cache (len %d):"
+	" host resumed %u of %u, cache hits %lu of %lu\n",
+	len, s->resumed, s->tries, tls_resume_cache->hits,
+	tls_resume_cache->lookups);
+      *lenp = len;
+      return dt;
+      }
+    }
+
+DEBUG(D_tls) debug_printf("no session in shared cache\n");
+return NULL;
+}
+
+
+/* Record a session in the cache. An existing slot for the key is reused,
+keeping its counts; otherwise an empty one or, failing that, the least recently
+used slot in the probe range. The caller has checked that the cache is open.
+
+Arguments:
+  key       the key
+  dt        the record
+  len       its length
+*/
+
+static void
+tls_resume_cache_write(const uschar * key, dbdata_tls_session * dt, int len)
+{
+unsigned hash = tls_resume_cache_hash(key);
+uint64_t seq;
+tls_resume_cache_slot * s;
+BOOL fresh = FALSE;
+
+if (len > TLS_RESUME_CACHE_DATA || Ustrlen(key) >= sizeof(s->key))
+  {
+  DEBUG(D_tls) debug_printf("session too big for shared cache\n");
+  return;
+  }
+
+if (!(s = tls_resume_cache_find(key, hash)))
+  {
+  for (int i = 0; i < TLS_RESUME_CACHE_PROBES; i++)
+    {
+    tls_resume_cache_slot * t = dbfn_slot_n(tls_resume_cache, hash, i);
+    if (t->len <= 0) { s = t; break; }
+    if (!s || t->last_used < s->last_used) s = t;
+    }
+  if (s->len > 0) __sync_fetch_and_add(&tls_resume_cache->evictions, 1);
+  fresh = TRUE;
+  }
+
+/* Claim the slot; if another process is writing it, give up */
+
+if (!dbfn_slot_claim(&s->sl, 1, &seq)) return;
+
+s->sl.hash = hash;
+Ustrcpy(s->key, key);
+if (fresh) s->tries = s->resumed = 0;
+s->last_used = dt->time_stamp = time(NULL);
+memcpy(s->data, dt, len);
+s->len = len;
+dbfn_slot_release(&s->sl, seq);
+
+DEBUG(D_tls) debug_printf("wrote session (len %d) to shared cache\n", len);
+}
+
+
+/* Remove a session from the cache, leaving the slot's counts, and so its slot,
+for the next session from the same server.
+
+Arguments:
+  key       the key
+*/
+
+static void
+tls_resume_cache_delete(const uschar * key)
+{
+tls_resume_cache_slot * s;
+uint64_t seq;
+
+if (  (s = tls_resume_cache_find(key, tls_resume_cache_hash(key)))
+   && dbfn_slot_claim(&s->sl, 1, &seq))
+  {
+  s->len = 0;
+  dbfn_slot_release(&s->sl, seq);
+  }
+}
+
+
+/* Count a handshake for which resumption was requested, and whether the
+server accepted it.
+
+Arguments:
+  key       the key
+  resumed   TRUE if the session was resumed
+*/
+
+static void
+tls_resume_cache_note(const uschar * key, BOOL resumed)
+{
+tls_resume_cache_slot * s;
+
+if (!tls_resume_cache_open()) return;
+if ((s = tls_resume_cache_find(key, tls_resume_cache_hash(key))))
+  {
+  __sync_fetch_and_add(&s->tries, 1);
+  if (resumed) __sync_fetch_and_add(&s->resumed, 1);
+  }
+if (resumed) __sync_fetch_and_add(&tls_resume_cache->resumed, 1);
+}
+#endif	/*!DISABLE_TLS_RESUME*/
+
+
+#ifndef DISABLE_OCSP
+/*************************************************
+*  Shared cache of verified OCSP stapled replies *
+*************************************************/
+
+/* Verifying the signature on a stapled OCSP response is repeated on every
+connection to a host that requires one, though the host staples the same
+response until it is refreshed. When tls_ocsp_cache_size is set, the digest of
+each response which verified as good (taken together with the certificate chain
+it was verified against) is kept, with the time at which the response
+expires, in a shared file. A later identical response, with an identical chain,
+is then accepted without being parsed again. Only good results are kept, and
+the entries cannot be stale beyond the response's own nextUpdate time. */
+
+#define TLS_OCSP_CACHE_MAGIC	0x454f4331	/* "EOC1" */
+#define TLS_OCSP_CACHE_PROBES	8
+#define TLS_OCSP_DIGEST_LEN	32
+
+typedef struct {
+  dbfn_shared_header sh;
+  unsigned long	lookups;
+  unsigned long	hits;
+} tls_ocsp_cache_header;
+
+typedef struct {
+  dbfn_shared_slot sl;
+  time_t	expiry;
+  uschar	digest[TLS_OCSP_DIGEST_LEN];
+} tls_ocsp_cache_slot;
+
+static tls_ocsp_cache_header * tls_ocsp_cache = NULL;
+static BOOL tls_ocsp_cache_tried = FALSE;
+
+
+static BOOL
+tls_ocsp_cache_open(void)
+{
+if (tls_ocsp_cache) return TRUE;
+if (tls_ocsp_cache_tried || tls_ocsp_cache_size <= 0) return FALSE;
+tls_ocsp_cache_tried = TRUE;
+
+return !!(tls_ocsp_cache = dbfn_map_shared(US"ocspcache",
+  TLS_OCSP_CACHE_MAGIC, tls_ocsp_cache_size,
+  sizeof(tls_ocsp_cache_header), sizeof(tls_ocsp_cache_slot)));
+}
+
+
+/* The digest is already well mixed, so its leading bytes serve as the hash */
+
+static tls_ocsp_cache_slot *
+tls_ocsp_cache_slot_n(const uschar * digest, int probe)
+{
+unsigned h;
+memcpy(&h, digest, sizeof(h));
+return dbfn_slot_n(tls_ocsp_cache, h, probe);
+}
+
+
+/*************************************************
+*      Look for a verified OCSP response         *
+*************************************************/
+
+/*
+Argument:   the digest of the response and its verifying chain
+Returns:    TRUE if the response is known to have verified, and is still valid
+*/
+
+static BOOL
+tls_ocsp_cache_check(const uschar * digest)
+{
+time_t now = time(NULL);
+
+if (!tls_ocsp_cache_open()) return FALSE;
+__sync_fetch_and_add(&tls_ocsp_cache->lookups, 1);
+
+for (int i = 0; i < TLS_OCSP_CACHE_PROBES; i++)
+  {
+  tls_ocsp_cache_slot * s = tls_ocsp_cache_slot_n(digest, i);
+  uint64_t seq;
+  BOOL match;
+
+  if (!dbfn_slot_read_begin(&s->sl, &seq)) continue;
+  if (!s->expiry) break;		/* never used */
+  match = memcmp(s->digest, digest, TLS_OCSP_DIGEST_LEN) == 0
+	  && s->expiry > now;
+  if (match && dbfn_slot_read_end(&s->sl, seq))
+    {
+    __sync_fetch_and_add(&tls_ocsp_cache->hits, 1);
+    return TRUE;
+    }
+  }
+return FALSE;
+}
+
+
+/*************************************************
+*        Record a verified OCSP response         *
+*************************************************/
+
+/* The slot used is an expired one within the probe sequence, failing which
+the one which expires soonest.
+
+Arguments:
+  digest    the digest of the response and its verifying chain
+  expiry    the time after which the response may not be used
+*/
+
+static void
+tls_ocsp_cache_store(const uschar * digest, time_t expiry)
+{
+tls_ocsp_cache_slot * s = NULL;
+time_t now = time(NULL);
+uint64_t seq;
+
+if (!tls_ocsp_cache_open() || expiry <= now) return;
+
+for (int i = 0; i < TLS_OCSP_CACHE_PROBES; i++)
+  {
+  tls_ocsp_cache_slot * t = tls_ocsp_cache_slot_n(digest, i);
+  if (t->expiry <= now || memcmp(t->digest, digest, TLS_OCSP_DIGEST_LEN) == 0)
+    { s = t; break; }
+  if (!s || t->expiry < s->expiry) s = t;
+  }
+
+if (!dbfn_slot_claim(&s->sl, 1, &seq))
+  return;			/* someone else is writing it */
+memcpy(s->digest, digest, TLS_OCSP_DIGEST_LEN);
+s->expiry = expiry;
+dbfn_slot_release(&s->sl, seq);
+DEBUG(D_tls) debug_printf("OCSP response added to verification cache\n");
+}
+#endif	/*!DISABLE_OCSP*/
+
+#ifndef DISABLE_TLS_RESUME
+/*************************************************
+*     Read the shared session ticket secret      *
+*************************************************/
+
+/* If tls_ticket_key_file is set, the keys with which a server encrypts the
+session tickets it gives to clients are derived from the secret in that file
+instead of being made at random, so that all the hosts that share the file can
+resume each other's sessions. Failure is logged, and random keys are used.
+
+Arguments:
+  buf     where to put the secret
+  size    the size of the buffer
+
+Returns:  the length of the secret, or 0 if there is none
+*/
+
+static int
+tls_ticket_secret(uschar * buf, int size)
+{
+uschar * file;
+int fd, len;
+
+if (!tls_ticket_key_file) return 0;
+if (!(file = expand_string(tls_ticket_key_file)))
+  {
+  log_write(0, LOG_MAIN, "failed to expand tls_ticket_key_file: %s",
+    expand_string_message);
+  return 0;
+  }
+if ((fd = Uopen(file, O_RDONLY, 0)) < 0)
+  {
+  log_write(0, LOG_MAIN, "tls_ticket_key_file %s: %s", file, strerror(errno));
+  return 0;
+  }
+len = read(fd, buf, size);
+(void)close(fd);
+if (len < 32)
+  {
+  log_write(0, LOG_MAIN, "tls_ticket_key_file %s: secret is shorter than 32 bytes",
+    file);
+  return 0;
+  }
+return len;
+}
+#endif	/*!DISABLE_TLS_RESUME*/
+
 /*************************************************
 *        Many functions are package-specific     *
 *************************************************/
@@ -221,6 +656,23 @@ return ssl_xfer_buffer_lwm < ssl_xfer_buffer_hwm;
 }
 
 
+
+/*************************************************
+*      Describe kernel TLS offload for logs      *
+*************************************************/
+
+/*
+Arguments:     KTLS_TX and/or KTLS_RX bits
+Returns:       "tx", "rx" or "txrx"
+*/
+
+const uschar *
+tls_ktls_name(unsigned ktls)
+{
+return ktls == (KTLS_TX|KTLS_RX) ? US"txrx" : ktls & KTLS_TX ? US"tx" : US"rx";
+}
+
+
 #endif  /*DISABLE_TLS*/
 
 void
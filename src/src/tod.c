@@ -16,6 +16,32 @@
 
 static uschar timebuf[sizeof("www, dd-mmm-yyyy hh:mm:ss.ddd +zzzz")];
 
+/* The last stamp made of each type that needs the local time, for reuse
+within the same second. A log line is written for most things that happen,
+and working out the time and formatting it each time is a noticeable cost.
+For the millisecond log formats only the fraction is made afresh. */
+
+static struct {
+  time_t	sec;
+  BOOL		utc;
+  BOOL		ms;
+  uschar	stamp[sizeof(timebuf)];
+} tod_cache[tod_epoch];
+
+
+/*************************************************
+*           Forget the cached timestamps         *
+*************************************************/
+
+/* Called when the timezone is changed */
+
+void
+tod_reset(void)
+{
+for (int i = 0; i < nelem(tod_cache); i++) tod_cache[i].sec = 0;
+}
+
+
 
 /*************************************************
 *                Return timestamp                *
@@ -55,6 +81,7 @@ tod_stamp(int type)
 {
 struct timeval now;
 struct tm * t;
+BOOL ms = FALSE;
 
 gettimeofday(&now, NULL);
 
@@ -83,6 +110,26 @@ switch(type)
 
 if (type == tod_log) type = log_timezone ? tod_log_zone : tod_log_bare;
 
+#ifndef COMPILE_UTILITY
+ms = LOGGING(millisec) && (type == tod_log_bare || type == tod_log_zone);
+#endif
+
+if (  type < nelem(tod_cache)
+   && tod_cache[type].sec == now.tv_sec
+   && tod_cache[type].utc == f.timestamps_utc
+   && tod_cache[type].ms == ms)
+  {
+  memcpy(timebuf, tod_cache[type].stamp, sizeof(timebuf));
+  if (ms)
+    {
+    uint msec = (uint)(now.tv_usec/1000);
+    timebuf[20] = '0' + msec/100;
+    timebuf[21] = '0' + msec/10 % 10;
+    timebuf[22] = '0' + msec % 10;
+    }
+  return timebuf;
+  }
+
 /* Convert to local time or UTC */
 
 t = f.timestamps_utc ? gmtime(&now.tv_sec) : localtime(&now.tv_sec);
@@ -233,6 +280,13 @@ switch(type)
     break;
   }
 
+if (type < nelem(tod_cache))
+  {
+  tod_cache[type].sec = now.tv_sec;
+  tod_cache[type].utc = f.timestamps_utc;
+  tod_cache[type].ms = ms;
+  memcpy(tod_cache[type].stamp, timebuf, sizeof(timebuf));
+  }
 return timebuf;
 }
 
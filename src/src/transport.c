@@ -49,6 +49,8 @@ optionlist optionlist_transports[] = {
 #ifndef DISABLE_EVENT
   { "event_action",     opt_stringptr | opt_public,
                  LOFF(event_action) },
+  { "event_types",      opt_stringptr | opt_public,
+                 LOFF(event_types) },
 #endif
   { "group",             opt_expand_gid|opt_public,
                  LOFF(gid) },
@@ -82,6 +84,10 @@ optionlist optionlist_transports[] = {
                  LOFF(shadow) },
   { "transport_filter", opt_stringptr|opt_public,
                  LOFF(filter_command) },
+#ifdef EXPAND_DLFUNC
+  { "transport_filter_dlfunc", opt_stringptr|opt_public,
+                 LOFF(filter_dlfunc) },
+#endif
   { "transport_filter_timeout", opt_time|opt_public,
                  LOFF(filter_timeout) },
   { "user",             opt_expand_uid|opt_public,
@@ -128,6 +134,7 @@ static int     nl_check_length;     /* length of same */
 static uschar *nl_escape;           /* string to insert */
 static int     nl_escape_length;    /* length of same */
 static int     nl_partial_match;    /* length matched at chunk end */
+static int     noexec_count = 0;    /* deliveries since the last exec */
 
 
 /*************************************************
@@ -165,6 +172,12 @@ for (transport_instance * t = transports; t; t = t->next)
     log_write(0, LOG_PANIC_DIE|LOG_CONFIG,
       "%s transport: body_only and headers_only are mutually exclusive",
       t->name);
+
+#ifdef EXPAND_DLFUNC
+  if (t->filter_command && t->filter_dlfunc)
+    log_write(0, LOG_PANIC_DIE|LOG_CONFIG, "%s transport: transport_filter "
+      "and transport_filter_dlfunc are mutually exclusive", t->name);
+#endif
   }
 }
 
@@ -348,9 +361,18 @@ return FALSE;
 }
 
 
+#ifdef EXPAND_DLFUNC
+static BOOL tpt_inproc_write(const uschar *, int);
+#endif
+
 BOOL
 transport_write_block(transport_ctx * tctx, uschar *block, int len, BOOL more)
 {
+#ifdef EXPAND_DLFUNC
+if (tctx->options & topt_inproc_filter)
+  return tpt_inproc_write(block, len);
+#endif
+
 if (!(tctx->options & topt_output_string))
   return transport_write_block_fd(tctx, block, len, more);
 
@@ -439,7 +461,7 @@ write_chunk(transport_ctx * tctx, uschar *chunk, int len)
 {
 uschar *start = chunk;
 uschar *end = chunk + len;
-int mlen = DELIVER_OUT_BUFFER_SIZE - nl_escape_length - 2;
+int mlen = deliver_out_buffer_size - nl_escape_length - 2;
 
 /* The assumption is made that the check string will never stretch over move
 than one chunk since the only time there are partial matches is when copying
@@ -856,6 +878,92 @@ return sendfn(tctx, US"\n", 1);
 }
 
 
+/*************************************************
+*        Write the body from a file mapping      *
+*************************************************/
+
+/* A big body is scanned for write_chunk() straight from a mapping of the
+spool data file, which saves copying it into the input buffer with read() on
+the way. The last piece is copied all the same, because the scan can look one
+character past the end of what it is given, and past the end of the file there
+may be no mapped page.
+
+Arguments:
+  tctx      transport context
+  size      the most to write
+
+Returns:    OK if written, FAIL on a write error (errno set), or DEFER if the
+            body is small or cannot be mapped, and should be read
+*/
+
+#define TRANSPORT_MMAP_MIN	4		/* input buffers' worth */
+#define TRANSPORT_MMAP_STEP	(1024*1024)
+
+static int
+write_body_mapped(transport_ctx * tctx, unsigned long size)
+{
+struct stat statbuf;
+size_t msize;
+uschar * map, * p, * end;
+BOOL ok = TRUE;
+
+if (  fstat(deliver_datafile, &statbuf) < 0
+   || statbuf.st_size - SPOOL_DATA_START_OFFSET
+      <= TRANSPORT_MMAP_MIN * (off_t)deliver_in_buffer_size
+   )
+  return DEFER;
+
+msize = statbuf.st_size;
+if ((map = mmap(NULL, msize, PROT_READ, MAP_PRIVATE, deliver_datafile, 0))
+    == MAP_FAILED)
+  {
+  DEBUG(D_transport) debug_printf("mmap of body failed: %s\n", strerror(errno));
+  return DEFER;
+  }
+DEBUG(D_transport) debug_printf("writing body from mmap\n");
+#ifdef MADV_SEQUENTIAL
+(void) madvise(map, msize, MADV_SEQUENTIAL);
+#endif
+
+p = map + SPOOL_DATA_START_OFFSET;
+end = size < msize - SPOOL_DATA_START_OFFSET ? p + size : map + msize;
+while (ok && p < end)
+  {
+  int len = MIN(end - p, TRANSPORT_MMAP_STEP);
+
+  /* The last piece, or the last of the input buffer size, goes by a copy */
+
+  if (len == end - p)
+    if (len <= deliver_in_buffer_size)
+      {
+      memcpy(deliver_in_buffer, p, len);
+      ok = write_chunk(tctx, deliver_in_buffer, len);
+      break;
+      }
+    else
+      len -= deliver_in_buffer_size;
+
+  /* Do not split a CRLF, which the scan looks ahead to see when it is to
+  remove the CR */
+
+  while (len > 1 && p[len-1] == '\r') len--;
+  ok = write_chunk(tctx, p, len);
+  p += len;
+  }
+
+if (!ok)
+  {
+  int save_errno = errno;
+  (void) munmap(map, msize);
+  errno = save_errno;
+  return FAIL;
+  }
+(void) munmap(map, msize);
+return OK;
+}
+
+
+
 /*************************************************
 *                Write the message               *
 *************************************************/
@@ -923,6 +1031,7 @@ static BOOL
 internal_transport_write_message(transport_ctx * tctx, int size_limit)
 {
 int len, size = 0;
+BOOL body_sent = FALSE;
 
 /* Initialize pointer in output buffer. */
 
@@ -1053,9 +1162,14 @@ if (tctx->options & topt_use_bdat)
   headers, and reap the command responses.  This lets us error out early
   on RCPT rejects rather than sending megabytes of data.  Include headers
   on the assumption they are cheap enough and some clever implementations
-  might errorcheck them too, on-the-fly, and reject that chunk. */
-
-  if (size > DELIVER_OUT_BUFFER_SIZE && hsize > 0)
+  might errorcheck them too, on-the-fly, and reject that chunk.
+  Anything up to the transport's chunk_single_size (by default the buffer
+  size) goes as a single LAST chunk, pipelined behind the MAIL and RCPTs,
+  saving a round trip. */
+
+  if (  size > (tctx->chunk_single_size > 0
+		? tctx->chunk_single_size : deliver_out_buffer_size)
+     && hsize > 0)
     {
     DEBUG(D_transport)
       debug_printf("sending small initial BDAT; hsize=%d\n", hsize);
@@ -1083,70 +1197,103 @@ is positioned at the start of its file (following the message id), then write
 it, applying the size limit if required. */
 
 /* If we have a wireformat -D file (CRNL lines, non-dotstuffed, no ending dot)
-and we want to send a body without dotstuffing or ending-dot, in-clear,
-then we can just dump it using sendfile.
+and we want to send a body without dotstuffing or ending-dot, in-clear or over
+a TLS connection whose record layer is in the kernel, then we can just dump it
+using sendfile.
 This should get used for CHUNKING output and also for writing the -K file for
-dkim signing,  when we had CHUNKING input.  */
+dkim signing,  when we had CHUNKING input.
+
+If, when the message was received, no line of the body started with a dot (and
+the body ended with a newline), the file needs no dotstuffing, so it can be
+dumped in the same way for SMTP output without CHUNKING; the terminating dot is
+then added below. */
 
 #ifdef OS_SENDFILE
 if (  f.spool_file_wireformat
-   && !(tctx->options & (topt_no_body | topt_end_dot))
-   && !nl_check_length
-   && tls_out.active.sock != tctx->u.fd
+   && !(tctx->options & (topt_no_body | topt_inproc_filter))
+   && (  !(tctx->options & topt_end_dot) && !nl_check_length
+      ||    f.spool_file_dotfree
+	 && tctx->options & topt_use_crlf
+	 && size_limit <= 0
+	 && (!nl_check_length || Ustrcmp(nl_check, ".") == 0)
+      )
+   && (tls_out.active.sock != tctx->u.fd || tls_out.ktls & KTLS_TX)
    )
   {
   ssize_t copied = 0;
   off_t offset = SPOOL_DATA_START_OFFSET;
+  BOOL tls = tls_out.active.sock == tctx->u.fd;
 
-  /* Write out any header data in the buffer */
+  /* Write out any header data in the buffer. For TLS nothing must be left
+  corked in the library, as the body goes straight to the socket. */
 
-  if ((len = chunk_ptr - deliver_out_buffer) > 0)
+  if ((len = chunk_ptr - deliver_out_buffer) > 0 || tls)
     {
-    if (!transport_write_block(tctx, deliver_out_buffer, len, TRUE))
+    if (!transport_write_block(tctx, deliver_out_buffer, len, !tls))
       return FALSE;
+    chunk_ptr = deliver_out_buffer;
     size -= len;
     }
 
+  /* Without CHUNKING the amount of body has not yet been found */
+
+  if (!(tctx->options & topt_use_bdat))
+    {
+    off_t fsize;
+    if ((fsize = lseek(deliver_datafile, 0, SEEK_END)) < 0) return FALSE;
+    fsize -= SPOOL_DATA_START_OFFSET;
+    size = size_limit > 0 && fsize > size_limit ? size_limit : fsize;
+    }
+
   DEBUG(D_transport) debug_printf("using sendfile for body\n");
 
   while(size > 0)
     {
     if ((copied = os_sendfile(tctx->u.fd, deliver_datafile, &offset, size)) <= 0) break;
+    transport_count += copied;
     size -= copied;
     }
-  return copied >= 0;
+  if (copied < 0) return FALSE;
+  if (!(tctx->options & topt_end_dot)) return TRUE;
+  body_sent = TRUE;
   }
 #else
 DEBUG(D_transport) debug_printf("cannot use sendfile for body: no support\n");
 #endif
 
 DEBUG(D_transport)
-  if (!(tctx->options & topt_no_body))
+  if (!(tctx->options & topt_no_body) && !body_sent)
     debug_printf("cannot use sendfile for body: %s\n",
       !f.spool_file_wireformat ? "spoolfile not wireformat"
-      : tctx->options & topt_end_dot ? "terminating dot wanted"
-      : nl_check_length ? "dot- or From-stuffing wanted"
-      : "TLS output wanted");
+      : tls_out.active.sock == tctx->u.fd ? "TLS output without kernel TLS"
+      : !(tctx->options & topt_end_dot) || f.spool_file_dotfree
+	? "dot- or From-stuffing wanted"
+      : "terminating dot wanted");
 
-if (!(tctx->options & topt_no_body))
+if (!(tctx->options & topt_no_body) && !body_sent)
   {
   unsigned long size = size_limit > 0 ? size_limit : ULONG_MAX;
+  int rc;
 
   nl_check_length = abs(nl_check_length);
   nl_partial_match = 0;
-  if (lseek(deliver_datafile, SPOOL_DATA_START_OFFSET, SEEK_SET) < 0)
-    return FALSE;
-  while (  (len = MIN(DELIVER_IN_BUFFER_SIZE, size)) > 0
-	&& (len = read(deliver_datafile, deliver_in_buffer, len)) > 0)
+  if ((rc = write_body_mapped(tctx, size)) == FAIL) return FALSE;
+  if (rc == DEFER)
     {
-    if (!write_chunk(tctx, deliver_in_buffer, len))
+    if (lseek(deliver_datafile, SPOOL_DATA_START_OFFSET, SEEK_SET) < 0)
       return FALSE;
-    size -= len;
-    }
+    while (  (len = MIN(deliver_in_buffer_size, size)) > 0
+	  && (len = read(deliver_datafile, deliver_in_buffer, len)) > 0)
+      {
+      if (!write_chunk(tctx, deliver_in_buffer, len))
+	return FALSE;
+      size -= len;
+      }
 
-  /* A read error on the body will have left len == -1 and errno set. */
+    /* A read error on the body will have left len == -1 and errno set. */
 
-  if (len != 0) return FALSE;
+    if (len != 0) return FALSE;
+    }
   }
 
 /* Finished with the check string, and spool-format consideration */
@@ -1168,16 +1315,244 @@ return (len = chunk_ptr - deliver_out_buffer) <= 0 ||
 
 
 
+#ifdef EXPAND_DLFUNC
+/*************************************************
+*        In-process transport filtering          *
+*************************************************/
+
+/* When transport_filter_dlfunc is set, the message is written by
+internal_transport_write_message() as it would be to a filter process, and the
+blocks that it would write are passed to the function instead. What the
+function returns is written with the transport's own processing, as the output
+of a filter process would be. Both stages use write_chunk(), so its static data
+is swapped between them. */
+
+typedef struct {
+  uschar *	buffer;			/* deliver_out_buffer */
+  uschar *	ptr;			/* chunk_ptr */
+  uschar *	check;			/* nl_check */
+  int		check_length;		/* nl_check_length */
+  uschar *	escape;			/* nl_escape */
+  int		escape_length;		/* nl_escape_length */
+  int		partial_match;		/* nl_partial_match */
+  BOOL		wireformat;		/* f.spool_file_wireformat */
+} chunk_state;
+
+static struct {
+  transport_filter_function *	func;
+  transport_filter_block	block;
+  transport_ctx *		tctx;		/* for the real output */
+  chunk_state			other;		/* the stage not running */
+  uschar *			buffer;		/* output buffer for the first stage */
+  BOOL				last_was_NL;
+} tpt_inproc;
+
+#define TRANSPORT_FILTER_MAX_ARGS 8
+
+
+static void
+chunk_state_swap(chunk_state * s)
+{
+chunk_state t = {
+  .buffer = deliver_out_buffer, .ptr = chunk_ptr,
+  .check = nl_check, .check_length = nl_check_length,
+  .escape = nl_escape, .escape_length = nl_escape_length,
+  .partial_match = nl_partial_match, .wireformat = f.spool_file_wireformat };
+
+deliver_out_buffer = s->buffer;
+chunk_ptr = s->ptr;
+nl_check = s->check;
+nl_check_length = s->check_length;
+nl_escape = s->escape;
+nl_escape_length = s->escape_length;
+nl_partial_match = s->partial_match;
+f.spool_file_wireformat = s->wireformat;
+*s = t;
+}
+
+
+/* Called from transport_write_block() for each block written by the first
+stage, and at the end with no data. Pass the block to the function, and write
+whatever it returns.
+
+Arguments:
+  data       the block, or NULL at the end of the message
+  len        its length
+
+Returns:     TRUE on success, FALSE on failure (with errno set)
+*/
+
+static BOOL
+tpt_inproc_write(const uschar * data, int len)
+{
+const uschar * out = NULL;
+int outlen = 0, rc;
+BOOL yield = TRUE;
+
+if ((rc = (tpt_inproc.func)(&tpt_inproc.block, data, len, &out, &outlen)) != OK)
+  {
+  log_write(0, LOG_MAIN, "transport_filter_dlfunc failed (%d): %s", rc,
+    tpt_inproc.block.errmsg ? tpt_inproc.block.errmsg : US"(no message)");
+  tpt_inproc.tctx->addr->more_errno = rc;
+  errno = ERRNO_FILTER_FAIL;
+  return FALSE;
+  }
+
+if (out && outlen > 0)
+  {
+  chunk_state_swap(&tpt_inproc.other);
+  if ((yield = write_chunk(tpt_inproc.tctx, US out, outlen)))
+    tpt_inproc.last_was_NL = out[outlen-1] == '\n';
+  chunk_state_swap(&tpt_inproc.other);
+  }
+return yield;
+}
+
+
+/* Write the message through the function named by transport_filter_dlfunc.
+The option is a colon-separated list of the library, the function, and up to
+TRANSPORT_FILTER_MAX_ARGS arguments for it.
+
+Arguments:   as for internal_transport_write_message()
+Returns:     TRUE on success; FALSE (with errno) for any failure
+*/
+
+static BOOL
+tpt_inproc_filter(transport_ctx * tctx, int size_limit)
+{
+transport_ctx tctx1 = *tctx;
+const uschar * list;
+uschar * argv[TRANSPORT_FILTER_MAX_ARGS + 3];
+int sep = 0, argc = 0, len;
+tree_node * t;
+BOOL yield;
+
+if (!(list = expand_cstring(tctx->tblock->filter_dlfunc)))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "failed to expand transport_filter_dlfunc "
+    "in %s transport: %s", tctx->tblock->name, expand_string_message);
+  tctx->addr->more_errno = ERROR;
+  errno = ERRNO_FILTER_FAIL;
+  return FALSE;
+  }
+while (argc < nelem(argv) - 1 && (argv[argc] = string_nextinlist(&list, &sep, NULL, 0)))
+  argc++;
+argv[argc] = NULL;
+if (argc < 2)
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "%s transport: transport_filter_dlfunc "
+    "needs a file and a function name", tctx->tblock->name);
+  tctx->addr->more_errno = ERROR;
+  errno = ERRNO_FILTER_FAIL;
+  return FALSE;
+  }
+
+/* Look up the dynamically loaded object handle in the tree shared with
+${dlfunc, loading it if not already done. */
+
+if (!(t = tree_search(dlobj_anchor, argv[0])))
+  {
+  void * handle = dlopen(CS argv[0], RTLD_LAZY);
+  if (!handle)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "dlopen \"%s\" failed: %s",
+      argv[0], dlerror());
+    tctx->addr->more_errno = ERROR;
+    errno = ERRNO_FILTER_FAIL;
+    return FALSE;
+    }
+  t = store_get_perm(sizeof(tree_node) + Ustrlen(argv[0]), is_tainted(argv[0]));
+  Ustrcpy(t->name, argv[0]);
+  t->data.ptr = handle;
+  (void)tree_insertnode(&dlobj_anchor, t);
+  }
+
+if (!(tpt_inproc.func = (transport_filter_function *)dlsym(t->data.ptr, CS argv[1])))
+  {
+  log_write(0, LOG_MAIN|LOG_PANIC, "dlsym \"%s\" in \"%s\" failed: %s",
+    argv[1], argv[0], dlerror());
+  tctx->addr->more_errno = ERROR;
+  errno = ERRNO_FILTER_FAIL;
+  return FALSE;
+  }
+
+DEBUG(D_transport) debug_printf("in-process transport filter %s in %s\n",
+  argv[1], argv[0]);
+
+tpt_inproc.block.state = NULL;
+tpt_inproc.block.argc = argc - 2;
+tpt_inproc.block.argv = argv + 2;
+tpt_inproc.block.errmsg = NULL;
+tpt_inproc.tctx = tctx;
+tpt_inproc.last_was_NL = TRUE;
+
+/* Set up the output processing for the second stage, keeping the real output
+buffer for it. The first stage gets a buffer of its own and, as when writing
+to a filter process, no CRLF, smtp dots or check string processing. */
+
+tpt_inproc.other = (chunk_state) {
+  .buffer = deliver_out_buffer, .ptr = deliver_out_buffer,
+  .check = tctx->check_string, .escape = tctx->escape_string,
+  .check_length = tctx->check_string && tctx->escape_string
+		  ? Ustrlen(tctx->check_string) : 0,
+  .escape_length = tctx->check_string && tctx->escape_string
+		  ? Ustrlen(tctx->escape_string) : 0,
+  .partial_match = -1, .wireformat = FALSE };
+
+if (!tpt_inproc.buffer)
+  tpt_inproc.buffer = store_malloc(deliver_out_buffer_size);
+deliver_out_buffer = tpt_inproc.buffer;
+tctx1.check_string = tctx1.escape_string = NULL;
+tctx1.options = tctx->options
+  & ~(topt_use_crlf | topt_end_dot | topt_use_bdat | topt_continuation)
+  | topt_inproc_filter;
+
+yield = internal_transport_write_message(&tctx1, size_limit)
+     && tpt_inproc_write(NULL, 0);
+
+/* Back to the second stage, for the terminating "." if this is SMTP output,
+with a NL first if the filter output did not end with one, and the flush. */
+
+chunk_state_swap(&tpt_inproc.other);
+
+if (yield)
+  {
+  nl_check_length = nl_escape_length = 0;
+  f.spool_file_wireformat = FALSE;
+  if (  tctx->options & topt_end_dot
+     && ( tpt_inproc.last_was_NL
+        ? !write_chunk(tctx, US".\n", 2)
+	: !write_chunk(tctx, US"\n.\n", 3)
+     )  )
+    yield = FALSE;
+  else
+    yield = (len = chunk_ptr - deliver_out_buffer) <= 0
+	  || transport_write_block(tctx, deliver_out_buffer, len, FALSE);
+  }
+
+DEBUG(D_transport)
+  {
+  debug_printf("end of in-process filtering: yield=%d\n", yield);
+  if (!yield)
+    debug_printf(" errno=%d more_errno=%d\n", errno, tctx->addr->more_errno);
+  }
+return yield;
+}
+#endif	/*EXPAND_DLFUNC*/
+
+
+
+
 /*************************************************
 *    External interface to write the message     *
 *************************************************/
 
 /* If there is no filtering required, call the internal function above to do
-the real work, passing over all the arguments from this function. Otherwise,
-set up a filtering process, fork another process to call the internal function
-to write to the filter, and in this process just suck from the filter and write
-down the fd in the transport context. At the end, tidy up the pipes and the
-processes.
+the real work, passing over all the arguments from this function. An in-process
+filter is handled by tpt_inproc_filter() above. Otherwise, set up a filtering
+process, fork another process to call the internal function to write to the
+filter, and in this process just suck from the filter and write down the fd in
+the transport context. At the end, tidy up the pipes and the processes.
 
 Arguments:     as for internal_transport_write_message() above
 
@@ -1197,6 +1572,11 @@ pid_t filter_pid, write_pid;
 
 f.transport_filter_timed_out = FALSE;
 
+#ifdef EXPAND_DLFUNC
+if (tctx->tblock && tctx->tblock->filter_dlfunc)
+  return tpt_inproc_filter(tctx, size_limit);
+#endif
+
 /* If there is no filter command set up, call the internal function that does
 the actual work, passing it the incoming fd, and return its result. */
 
@@ -1319,7 +1699,7 @@ for (;;)
   {
   sigalrm_seen = FALSE;
   ALARM(transport_filter_timeout);
-  len = read(fd_read, deliver_in_buffer, DELIVER_IN_BUFFER_SIZE);
+  len = read(fd_read, deliver_in_buffer, deliver_in_buffer_size);
   ALARM_CLR(0);
   if (sigalrm_seen)
     {
@@ -1451,6 +1831,16 @@ return yield;
 
 
 
+/* The name of the marker record for a message waiting for a host; see
+transport_update_waiting() below. */
+
+static uschar *
+wait_marker_key(const uschar * hostname, const uschar * id)
+{
+return string_sprintf("%.200s:%.*s", hostname, MESSAGE_ID_LENGTH, id);
+}
+
+
 /*************************************************
 *            Update waiting database             *
 *************************************************/
@@ -1472,12 +1862,15 @@ this host. If the sequence field is 0, there are none. If it is 1, then another
 record with the name <hostname>:0 exists; if it is 2, then two other records
 with sequence numbers 0 and 1 exist, and so on.
 
-Currently, an exhaustive search of all continuation records has to be done to
-determine whether to add a message id to a given record. This shouldn't be
-too bad except in extreme cases. I can't figure out a *simple* way of doing
-better.
+So that we need not search all the continuation records to find out whether
+a message is already listed, there is also a marker record for each listed
+message, with the name <hostname>:<message-id>, holding just that id. It is
+removed when the id is taken off the list by transport_check_waiting(). Adding
+or taking a message is therefore a fixed amount of work, however many messages
+are waiting for the host.
 
-Old records should eventually get swept up by the exim_tidydb utility.
+Old records should eventually get swept up by the exim_tidydb utility, which
+also removes the markers of messages that no longer exist.
 
 Arguments:
   hostlist  list of hosts that this message could be sent to
@@ -1507,9 +1900,10 @@ that the message id is in each host record. */
 for (host_item * host = hostlist; host; host = host->next)
   {
   BOOL already = FALSE;
-  dbdata_wait *host_record;
+  dbdata_wait *host_record, *marker;
   int host_length;
   uschar buffer[256];
+  uschar * mkey;
 
   /* Skip if this is the same host as we just processed; otherwise remember
   the name for next time. */
@@ -1517,6 +1911,15 @@ for (host_item * host = hostlist; host; host = host->next)
   if (Ustrcmp(prevname, host->name) == 0) continue;
   prevname = host->name;
 
+  /* A marker record says that the message is listed already. */
+
+  mkey = wait_marker_key(host->name, message_id);
+  if (dbfn_read(dbm_file, mkey))
+    {
+    DEBUG(D_transport) debug_printf("already listed for %s\n", host->name);
+    continue;
+    }
+
   /* Look up the host record; if there isn't one, make an empty one. */
 
   if (!(host_record = dbfn_read(dbm_file, host->name)))
@@ -1529,29 +1932,15 @@ for (host_item * host = hostlist; host; host = host->next)
 
   host_length = host_record->count * MESSAGE_ID_LENGTH;
 
-  /* Search the record to see if the current message is already in it. */
+  /* Search the record to see if the current message is already in it; it
+may have been listed before there were marker records. The continuation
+records are not searched. */
 
   for (uschar * s = host_record->text; s < host_record->text + host_length;
        s += MESSAGE_ID_LENGTH)
     if (Ustrncmp(s, message_id, MESSAGE_ID_LENGTH) == 0)
       { already = TRUE; break; }
 
-  /* If we haven't found this message in the main record, search any
-  continuation records that exist. */
-
-  for (int i = host_record->sequence - 1; i >= 0 && !already; i--)
-    {
-    dbdata_wait *cont;
-    sprintf(CS buffer, "%.200s:%d", host->name, i);
-    if ((cont = dbfn_read(dbm_file, buffer)))
-      {
-      int clen = cont->count * MESSAGE_ID_LENGTH;
-      for (uschar * s = cont->text; s < cont->text + clen; s += MESSAGE_ID_LENGTH)
-        if (Ustrncmp(s, message_id, MESSAGE_ID_LENGTH) == 0)
-          { already = TRUE; break; }
-      }
-    }
-
   /* If this message is already in a record, no need to update. */
 
   if (already)
@@ -1596,9 +1985,16 @@ for (host_item * host = hostlist; host; host = host->next)
   host_record->count++;
   host_length += MESSAGE_ID_LENGTH;
 
-  /* Update the database */
+  /* Update the database, and add the marker */
 
   dbfn_write(dbm_file, host->name, host_record, sizeof(dbdata_wait) + host_length);
+
+  marker = store_get(sizeof(dbdata_wait) + MESSAGE_ID_LENGTH, FALSE);
+  marker->count = 1;
+  marker->sequence = 0;
+  memcpy(marker->text, message_id, MESSAGE_ID_LENGTH);
+  marker->text[MESSAGE_ID_LENGTH] = '\0';
+  dbfn_write(dbm_file, mkey, marker, sizeof(dbdata_wait) + MESSAGE_ID_LENGTH);
   DEBUG(D_transport) debug_printf("added to list for %s\n", host->name);
   }
 
@@ -1738,6 +2134,7 @@ while (1)
     if (Ustrcmp(msgq[i].message_id, message_id) == 0)
       {
       msgq[i].bKeep = FALSE;
+      dbfn_delete(dbm_file, wait_marker_key(hostname, message_id));
       break;
       }
 
@@ -1750,11 +2147,15 @@ while (1)
 
     set_subdir_str(subdir, mid, 0);
     if (Ustat(spool_fname(US"input", subdir, mid, US"-D"), &statbuf) != 0)
+      {
       msgq[i].bKeep = FALSE;
+      dbfn_delete(dbm_file, wait_marker_key(hostname, mid));
+      }
     else if (!oicf_func || oicf_func(mid, oicf_data))
       {
       Ustrcpy_nt(new_message_id, mid);
       msgq[i].bKeep = FALSE;
+      dbfn_delete(dbm_file, wait_marker_key(hostname, mid));
       bFound = TRUE;
       break;
       }
@@ -1877,7 +2278,7 @@ void
 transport_do_pass_socket(const uschar *transport_name, const uschar *hostname,
   const uschar *hostaddress, uschar *id, int socket_fd)
 {
-int i = 22;
+int i = 23;
 const uschar **argv;
 
 /* Set up the calling arguments; use the standard function for the basics,
@@ -1897,7 +2298,9 @@ if (smtp_peer_options & OPTION_TLS)
     argv[i++] = US"-MCt";
     argv[i++] = sending_ip_address;
     argv[i++] = string_sprintf("%d", sending_port);
-    argv[i++] = tls_out.active.sock >= 0 ? tls_out.cipher : continue_proxy_cipher;
+    argv[i++] = tls_out.active.sock >= 0 && tls_out.cipher
+      ? tls_out.cipher : continue_proxy_cipher;
+    if (continue_proxy_ktls) argv[i++] = US"-MCk";
 
     if (tls_out.sni)
       {
@@ -1937,6 +2340,7 @@ if (socket_fd != 0)
   }
 
 DEBUG(D_exec) debug_print_argv(argv);
+mainlog_flush();
 exim_nullstd();                          /* Ensure std{out,err} exist */
 execv(CS argv[0], (char *const *)argv);
 
@@ -1946,9 +2350,91 @@ _exit(errno);         /* Note: must be _exit(), NOT exit() */
 
 
 
+/* The no-exec alternative, for when the new process would not have root
+privilege anyway. The disconnected process delivers the message itself, with
+the connection set up as a continued one; its globals still describe the
+connection, and a TLS session carries on as it is, with no proxy. Descriptors
+that an exec would have closed (such as the pipe back to the delivery process)
+are pointed at /dev/null, so that nothing holds them open and any stale
+reference to them is harmless. Does not return. */
+
+static void
+transport_do_continue(const uschar *transport_name, const uschar *hostname,
+  const uschar *hostaddress, uschar *id, int socket_fd)
+{
+int max = sysconf(_SC_OPEN_MAX), nullfd;
+
+#ifndef DISABLE_TLS
+if (tls_out.active.sock >= 0)
+  {
+  if (tls_out.cipher)		/* else already a continued one */
+    continue_proxy_cipher = string_copy_perm(tls_out.cipher, FALSE);
+  continue_proxy_sni = tls_out.sni ? string_copy_perm(tls_out.sni, FALSE) : NULL;
+# ifdef SUPPORT_DANE
+  continue_proxy_dane = tls_out.dane_verified;
+# endif
+  }
+else
+#endif
+  if (socket_fd != 0)
+    {
+    (void)dup2(socket_fd, 0);           /* Arrange for the channel to be on */
+    (void)close(socket_fd);             /* stdin, as after an exec */
+    socket_fd = 0;
+    }
+
+if ((nullfd = open("/dev/null", O_RDWR)) >= 0)
+  {
+  if (max < 0 || max > 1024) max = 1024;
+  for (int fd = 3; fd < max; fd++)
+    if (fd != socket_fd && fd != nullfd && fcntl(fd, F_GETFD) > 0)
+      (void)dup2(nullfd, fd);
+  (void)close(nullfd);
+  }
+log_close_all();
+search_tidyup();
+
+signal(SIGHUP,  SIG_DFL);
+signal(SIGCHLD, SIG_DFL);
+signal(SIGTERM, SIG_DFL);
+
+continue_transport = US transport_name;
+continue_hostname = US hostname;
+continue_host_address = US hostaddress;
+continue_sequence++;
+message_subdir[0] = 0;
+noexec_count++;
+
+set_process_info("continued delivery of %s to %s", id, hostname);
+(void) deliver_message(id, TRUE, FALSE);
+search_tidyup();
+exim_underbar_exit(EXIT_SUCCESS);
+}
+
+
+
+/* Decide whether a message passed on a continued connection may be delivered
+without an exec. That is only so when the exec would not regain root, either
+because we have it or because delivery drops it; noexec_max bounds the chain
+so that the process is refreshed now and again.
+
+Argument:   the transport's limit; 0 for never
+Returns:    TRUE if the exec can be skipped
+*/
+
+BOOL
+transport_pass_noexec(int noexec_max)
+{
+return noexec_count < noexec_max
+  && (geteuid() == root_uid || deliver_drop_privilege);
+}
+
+
+
 /* Fork a new exim process to deliver the message, and do a re-exec, both to
 get a clean delivery process, and to regain root privilege in cases where it
-has been given away.
+has been given away. If the caller allows it, and no root privilege would be
+regained, up to noexec_max successive messages skip the exec.
 
 Arguments:
   transport_name  to pass to the new process
@@ -1956,14 +2442,16 @@ Arguments:
   hostaddress     ditto
   id              the new message to process
   socket_fd       the connected socket
+  noexec_max      chain length for deliveries without an exec; 0 for none
 
 Returns:          FALSE if fork fails; TRUE otherwise
 */
 
 BOOL
 transport_pass_socket(const uschar *transport_name, const uschar *hostname,
-  const uschar *hostaddress, uschar *id, int socket_fd)
+  const uschar *hostaddress, uschar *id, int socket_fd, int noexec_max)
 {
+BOOL noexec = transport_pass_noexec(noexec_max);
 pid_t pid;
 int status;
 
@@ -1980,6 +2468,9 @@ if ((pid = exim_fork(US"continued-transport-interproc")) == 0)
     _exit(EXIT_SUCCESS);
   testharness_pause_ms(1000);
 
+  if (noexec)
+    transport_do_continue(transport_name, hostname, hostaddress,
+      id, socket_fd);
   transport_do_pass_socket(transport_name, hostname, hostaddress,
     id, socket_fd);
   }
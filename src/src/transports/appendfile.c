@@ -56,7 +56,9 @@ optionlist appendfile_transport_options[] = {
   { "mailbox_filecount", opt_stringptr,	LOFF(mailbox_filecount_string) },
   { "mailbox_size",      opt_stringptr,	LOFF(mailbox_size_string) },
 #ifdef SUPPORT_MAILDIR
+  { "maildir_batch_link", opt_bool,	LOFF(maildir_batch_link) },
   { "maildir_format",    opt_bool,	LOFF(maildir_format ) } ,
+  { "maildir_quota_cache_time", opt_time, LOFF(maildir_quota_cache_time) },
   { "maildir_quota_directory_regex", opt_stringptr, LOFF(maildir_dir_regex) },
   { "maildir_retries",   opt_int,	LOFF(maildir_retries) },
   { "maildir_tag",       opt_stringptr,	LOFF(maildir_tag) },
@@ -148,6 +150,7 @@ appendfile_transport_options_block appendfile_transport_option_defaults = {
   10,             /* lock_retries */
    3,             /* lock_interval */
   10,             /* maildir_retries */
+  0,              /* maildir_quota_cache_time */
   create_anywhere,/* create_file */
   0,              /* options */
   FALSE,          /* allow_fifo */
@@ -170,6 +173,7 @@ appendfile_transport_options_block appendfile_transport_option_defaults = {
   TRUE,           /* mode_fail_narrower */
   FALSE,          /* maildir_format */
   FALSE,          /* maildir_use_size_file */
+  FALSE,          /* maildir_batch_link */
   FALSE,          /* mailstore_format */
   FALSE,          /* mbx_format */
   FALSE,          /* quota_warn_threshold_is_percent */
@@ -197,29 +201,21 @@ static const char *mailbox_formats[] = {
 
 
 /*************************************************
-*              Setup entry point                 *
+*            Expand quota settings               *
 *************************************************/
 
-/* Called for each delivery in the privileged state, just before the uid/gid
-are changed and the main entry point is called. We use this function to
-expand any quota settings, so that it can access files that may not be readable
-by the user. It is also used to pick up external mailbox size information, if
-set.
+/* Expand the quota settings and the external mailbox size information, and
+leave the values in the options block.
 
 Arguments:
   tblock     points to the transport instance
-  addrlist   addresses about to be delivered (not used)
-  dummy      not used (doesn't pass back data)
-  uid        the uid that will be set (not used)
-  gid        the gid that will be set (not used)
   errmsg     where to put an error message
 
 Returns:     OK, FAIL, or DEFER
 */
 
 static int
-appendfile_transport_setup(transport_instance *tblock, address_item *addrlist,
-  transport_feedback *dummy, uid_t uid, gid_t gid, uschar **errmsg)
+appendfile_setup_values(transport_instance *tblock, uschar **errmsg)
 {
 appendfile_transport_options_block *ob =
   (appendfile_transport_options_block *)(tblock->options_block);
@@ -348,6 +344,92 @@ return OK;
 }
 
 
+#ifdef SUPPORT_MAILDIR
+/* When maildir_batch_link is set, the addresses of a batch are delivered one
+by one, and each has its own quota settings. They are worked out here, while
+privileged, and kept for the main entry point to pick up. */
+
+typedef struct batch_values {
+  struct batch_values *next;
+  address_item *addr;
+  int rc;                             /* from appendfile_setup_values() */
+  uschar *message;                    /* error message if not OK */
+  appendfile_transport_options_block ob;
+} batch_values;
+
+static batch_values *batch_values_list = NULL;
+
+/* The first file written for such a batch, for the others to be linked to */
+
+static BOOL batch_linking = FALSE;
+static uschar *batch_link_source = NULL;
+static int batch_link_count;
+static int batch_link_newlines;
+#endif
+
+
+/*************************************************
+*              Setup entry point                 *
+*************************************************/
+
+/* Called for each delivery in the privileged state, just before the uid/gid
+are changed and the main entry point is called. We use this function to
+expand any quota settings, so that it can access files that may not be readable
+by the user. It is also used to pick up external mailbox size information, if
+set.
+
+Arguments:
+  tblock     points to the transport instance
+  addrlist   addresses about to be delivered (used only for a batch when
+               maildir_batch_link is set)
+  dummy      not used (doesn't pass back data)
+  uid        the uid that will be set (not used)
+  gid        the gid that will be set (not used)
+  errmsg     where to put an error message
+
+Returns:     OK, FAIL, or DEFER
+*/
+
+static int
+appendfile_transport_setup(transport_instance *tblock, address_item *addrlist,
+  transport_feedback *dummy, uid_t uid, gid_t gid, uschar **errmsg)
+{
+#ifdef SUPPORT_MAILDIR
+appendfile_transport_options_block *ob =
+  (appendfile_transport_options_block *)(tblock->options_block);
+
+if (ob->maildir_batch_link && addrlist->next)
+  {
+  appendfile_transport_options_block orig = *ob;
+  batch_values **bp = &batch_values_list;
+
+  for (address_item *a = addrlist; a; a = a->next)
+    {
+    address_item *next = a->next;
+    batch_values *bv = store_get(sizeof(batch_values), FALSE);
+
+    a->next = NULL;
+    deliver_set_expansions(a);
+    a->next = next;
+    *ob = orig;
+    bv->message = NULL;
+    bv->rc = appendfile_setup_values(tblock, &bv->message);
+    bv->addr = a;
+    bv->ob = *ob;
+    bv->next = NULL;
+    *bp = bv;
+    bp = &bv->next;
+    }
+  deliver_set_expansions(addrlist);
+  *ob = orig;
+  return OK;
+  }
+#endif
+
+return appendfile_setup_values(tblock, errmsg);
+}
+
+
 
 /*************************************************
 *          Initialization entry point            *
@@ -451,6 +533,20 @@ if (ob->dirname)
       "quota must be set if quota_directory is set", tblock->name);
   }
 
+/* Linking the files of a batch needs maildir format, and the same message
+for every address. */
+
+if (ob->maildir_batch_link)
+  {
+  if (!ob->maildir_format)
+    log_write(0, LOG_PANIC_DIE|LOG_CONFIG_FOR, "%s transport:\n  "
+      "maildir_batch_link requires maildir_format", tblock->name);
+  if (tblock->envelope_to_add)
+    log_write(0, LOG_PANIC_DIE|LOG_CONFIG_FOR, "%s transport:\n  "
+      "envelope_to_add cannot be used with maildir_batch_link", tblock->name);
+  tblock->batch_per_address = TRUE;
+  }
+
 /* If a fixed uid field is set, then a gid field must also be set. */
 
 if (tblock->uid_set && !tblock->gid_set && !tblock->expand_gid)
@@ -718,6 +814,9 @@ for (struct dirent *ent; ent = readdir(dir); )
   struct stat statbuf;
 
   if (Ustrcmp(name, ".") == 0 || Ustrcmp(name, "..") == 0) continue;
+  #ifdef SUPPORT_MAILDIR
+  if (Ustrcmp(name, MAILDIR_QUOTA_CACHE) == 0) continue;
+  #endif
 
   count++;
 
@@ -906,7 +1005,7 @@ if (lseek(from_fd, 0 , SEEK_SET) < 0) return DEFER;
 while (size > 0)
   {
   int len = read(from_fd, deliver_out_buffer + used,
-    DELIVER_OUT_BUFFER_SIZE - used);
+    deliver_out_buffer_size - used);
   if (len <= 0)
     {
     if (len == 0) errno = ERRNO_MBXLENGTH;
@@ -1216,11 +1315,47 @@ FILE *temp_file = NULL;
 #ifdef SUPPORT_MAILDIR
 int maildirsize_fd = -1;      /* fd for maildirsize file */
 int maildir_save_errno;
+BOOL linked = FALSE;          /* file linked to an earlier one in the batch */
 #endif
 
 
 DEBUG(D_transport) debug_printf("appendfile transport entered\n");
 
+#ifdef SUPPORT_MAILDIR
+/* For a batch with maildir_batch_link set, deliver to each address in turn,
+with its own expansions and the quota settings found for it by the setup
+function. The message is written for the first address that gets that far;
+the files for the rest are hard links to that one. */
+
+if (batch_values_list && addr->next)
+  {
+  for (batch_values *bv = batch_values_list; bv; bv = bv->next)
+    {
+    address_item *a = bv->addr, *next = a->next;
+
+    if (bv->rc != OK)
+      {
+      a->transport_return = bv->rc == DEFER ? DEFER : PANIC;
+      a->message = bv->message;
+      continue;
+      }
+    DEBUG(D_transport) debug_printf("batched maildir delivery for %s\n",
+      a->address);
+    *ob = bv->ob;
+    a->next = NULL;
+    deliver_set_expansions(a);
+    batch_linking = TRUE;
+    (void)appendfile_transport_entry(tblock, a);
+    a->next = next;
+    }
+  batch_linking = FALSE;
+  batch_values_list = NULL;
+  batch_link_source = NULL;
+  deliver_set_expansions(addr);
+  return TRUE;
+  }
+#endif
+
 /* An "address_file" or "address_directory" transport is used to deliver to
 files specified via .forward or an alias file. Prior to release 4.20, the
 "file" and "directory" options were ignored in this case. This has been changed
@@ -2413,7 +2548,16 @@ else
     int filecount = 0;
     DEBUG(D_transport)
       debug_printf("quota checks on directory %s\n", check_path);
+    #ifdef SUPPORT_MAILDIR
+    if (  mbformat != mbf_maildir
+       || !maildir_cache_check(check_path, ob, NULL, FALSE, &size, &filecount))
+      {
+      size = check_dir_size(check_path, &filecount, regex);
+      if (mbformat == mbf_maildir) maildir_cache_update(size, filecount);
+      }
+    #else
     size = check_dir_size(check_path, &filecount, regex);
+    #endif
     if (mailbox_size < 0) mailbox_size = size;
     if (mailbox_filecount < 0) mailbox_filecount = filecount;
     }
@@ -2490,6 +2634,22 @@ else
         errno = EEXIST;
       else if (errno == ENOENT)
         {
+        if (batch_link_source)
+          {
+          if (Ulink(batch_link_source, filename) == 0)
+            {
+            if ((fd = Uopen(filename, O_RDONLY, 0)) >= 0)
+              {
+              DEBUG(D_transport) debug_printf("linked %s to %s\n", filename,
+                batch_link_source);
+              linked = TRUE;
+              break;
+              }
+            Uunlink(filename);
+            }
+          else DEBUG(D_transport) debug_printf("link to %s failed: %s\n",
+            batch_link_source, strerror(errno));
+          }
         if ((fd = Uopen(filename, O_WRONLY | O_CREAT | O_EXCL, mode)) >= 0)
 	  break;
         DEBUG (D_transport) debug_printf ("open failed for %s: %s\n",
@@ -2748,6 +2908,18 @@ if (verify_mode)
   goto RETURN;
   }
 
+/* A file linked to one written for an earlier address of the batch already
+holds the message, and that one has been synced. */
+
+#ifdef SUPPORT_MAILDIR
+if (linked && yield == OK)
+  {
+  transport_count = batch_link_count;
+  transport_newlines = batch_link_newlines;
+  goto WRITTEN;
+  }
+#endif
+
 /* If we are writing in MBX format, what we actually do is to write the message
 to a temporary file, and then copy it to the real file once we know its size.
 This is the most straightforward way of getting the correct length in the
@@ -2902,6 +3074,9 @@ written, including added headers. Note; we subtract 1 from message_linecount as
 this variable doesn't count the new line between the header and the body of the
 message. */
 
+#ifdef SUPPORT_MAILDIR
+WRITTEN:
+#endif
 message_size = transport_count;
 message_linecount = transport_newlines - 1;
 
@@ -3237,6 +3412,18 @@ else
           DEBUG(D_transport) debug_printf("renamed %s as %s\n", filename,
             renamename);
           filename = dataname = NULL;   /* Prevents attempt to unlink at end */
+          #ifdef SUPPORT_MAILDIR
+          if (batch_linking && !batch_link_source && mbformat == mbf_maildir)
+            {
+            batch_link_source = string_sprintf("%s/%s", path, renamename);
+            batch_link_count = transport_count;
+            batch_link_newlines = transport_newlines;
+            }
+          #endif
+          #ifdef SUPPORT_MAILDIR
+          if (mbformat == mbf_maildir && !disable_quota)
+            maildir_cache_record(message_size);
+          #endif
           }
         }        /* maildir or mailstore */
       }          /* successful write + close */
@@ -3275,6 +3462,10 @@ detected, in order to get the file closed and the lock file tidied away. */
 
 RETURN:
 
+#ifdef SUPPORT_MAILDIR
+maildir_cache_close();
+#endif
+
 #ifdef SUPPORT_MBX
 if (mbx_lockfd >= 0)
   {
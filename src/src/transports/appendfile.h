@@ -44,6 +44,7 @@ typedef struct {
   int   lock_retries;
   int   lock_interval;
   int   maildir_retries;
+  int   maildir_quota_cache_time;
   int   create_file;
   int   options;
   BOOL  allow_fifo;
@@ -66,6 +67,7 @@ typedef struct {
   BOOL  mode_fail_narrower;
   BOOL  maildir_format;
   BOOL  maildir_use_size_file;
+  BOOL  maildir_batch_link;
   BOOL  mailstore_format;
   BOOL  mbx_format;
   BOOL  quota_warn_threshold_is_percent;
@@ -32,6 +32,7 @@ optionlist autoreply_transport_options[] = {
   { "never_mail",        opt_stringptr,	LOFF(never_mail) },
   { "once",              opt_stringptr,	LOFF(oncelog) },
   { "once_file_size",    opt_int,	LOFF(once_file_size) },
+  { "once_hintsdb",      opt_bool,	LOFF(once_hintsdb) },
   { "once_repeat",       opt_stringptr,	LOFF(once_repeat) },
   { "reply_to",          opt_stringptr,	LOFF(reply_to) },
   { "return_message",    opt_bool,	LOFF(return_message) },
@@ -77,6 +78,7 @@ autoreply_transport_options_block autoreply_transport_option_defaults = {
   0,              /* once_file_size */
   FALSE,          /* file_expand */
   FALSE,          /* file_optional */
+  FALSE,          /* once_hintsdb */
   FALSE           /* return message */
 };
 
@@ -264,6 +266,7 @@ int cache_fd = -1;
 int cache_size = 0;
 int add_size = 0;
 EXIM_DB *dbm_file = NULL;
+uschar *once_key = NULL;
 BOOL file_expand, return_message;
 uschar *from, *reply_to, *to, *cc, *bcc, *subject, *headers, *text, *file;
 uschar *logfile, *oncelog;
@@ -271,6 +274,7 @@ uschar *cache_buff = NULL;
 uschar *cache_time = NULL;
 uschar *message_id = NULL;
 header_line *h;
+reply_item *reply;
 time_t now = time(NULL);
 time_t once_repeat_sec = 0;
 FILE *fp;
@@ -291,24 +295,24 @@ from that block. It has typically been set up by a mail filter processing
 router. Otherwise, the data must be supplied by this transport, and
 it has to be expanded here. */
 
-if (addr->reply)
+if ((reply = ADDR_COLD(addr)->reply))
   {
   DEBUG(D_transport) debug_printf("taking data from address\n");
-  from = addr->reply->from;
-  reply_to = addr->reply->reply_to;
-  to = addr->reply->to;
-  cc = addr->reply->cc;
-  bcc = addr->reply->bcc;
-  subject = addr->reply->subject;
-  headers = addr->reply->headers;
-  text = addr->reply->text;
-  file = addr->reply->file;
-  logfile = addr->reply->logfile;
-  oncelog = addr->reply->oncelog;
-  once_repeat_sec = addr->reply->once_repeat;
-  file_expand = addr->reply->file_expand;
-  expand_forbid = addr->reply->expand_forbid;
-  return_message = addr->reply->return_message;
+  from = reply->from;
+  reply_to = reply->reply_to;
+  to = reply->to;
+  cc = reply->cc;
+  bcc = reply->bcc;
+  subject = reply->subject;
+  headers = reply->headers;
+  text = reply->text;
+  file = reply->file;
+  logfile = reply->logfile;
+  oncelog = reply->oncelog;
+  once_repeat_sec = reply->once_repeat;
+  file_expand = reply->file_expand;
+  expand_forbid = reply->expand_forbid;
+  return_message = reply->return_message;
   }
 else
   {
@@ -400,13 +404,30 @@ given recipient(s). This works only on the "To" field. If there is no "To"
 field, the message is always sent. If the To: field contains more than one
 recipient, the effect might not be quite as envisaged. If once_file_size is
 set, instead of a dbm file, we use a regular file containing a circular buffer
-recipient cache. */
+recipient cache. If once_hintsdb is set, the "once" value is not a file name
+but a key prefix for the shared "autoreply" hints database. */
 
 if (oncelog && *oncelog && to)
   {
   time_t then = 0;
 
-  if (is_tainted(oncelog))
+  /* Look up the hints database, without holding it open (and locked) while
+  the message is sent. The record's time stamp is that of the last sending. */
+
+  if (ob->once_hintsdb)
+    {
+    open_db dbblock, * dbm;
+    dbdata_generic * rec;
+
+    once_key = string_sprintf("%s:%s", oncelog, to);
+    if ((dbm = dbfn_open(US"autoreply", O_RDONLY, &dbblock, FALSE, FALSE)))
+      {
+      if ((rec = dbfn_read(dbm, once_key))) then = rec->time_stamp;
+      dbfn_close(dbm);
+      }
+    }
+
+  else if (is_tainted(oncelog))
     {
     addr->transport_return = DEFER;
     addr->basic_errno = EACCES;
@@ -417,7 +438,7 @@ if (oncelog && *oncelog && to)
 
   /* Handle fixed-size cache file. */
 
-  if (ob->once_file_size > 0)
+  else if (ob->once_file_size > 0)
     {
     uschar * nextp;
     struct stat statbuf;
@@ -701,37 +722,66 @@ cache_fd set to a fixed size, circular buffer file, or dbm_file set to an open
 DBM file (or neither, if "once" is not set). */
 
 /* Update fixed-size cache file. If cache_time is set, we found a previous
-entry; that is the spot into which to put the current time. Otherwise we have
-to add a new record; remove the first one in the file if the file is too big.
-We always rewrite the entire file in a single write operation. This is
-(hopefully) going to be the safest thing because there is no interlocking
-between multiple simultaneous deliveries. */
+entry; that is the spot into which to put the current time, and only the time
+is rewritten. Otherwise we have to add a new record: while the file is small
+enough it is appended, but once it gets too big, the first record is removed
+and the entire file rewritten. Each update is done in a single write operation.
+This is (hopefully) going to be the safest thing because there is no
+interlocking between multiple simultaneous deliveries. */
 
 if (cache_fd >= 0)
   {
   uschar *from = cache_buff;
   int size = cache_size;
+  off_t offset = 0;
 
-  if (lseek(cache_fd, 0, SEEK_SET) == 0)
+  if (cache_time)
     {
-    if (!cache_time)
+    from = cache_time;
+    size = sizeof(time_t);
+    offset = cache_time - cache_buff;
+    }
+  else
+    {
+    cache_time = from + size;
+    memcpy(cache_time + sizeof(time_t), to, add_size - sizeof(time_t));
+    size += add_size;
+
+    if (cache_size > 0 && size > ob->once_file_size)
       {
-      cache_time = from + size;
-      memcpy(cache_time + sizeof(time_t), to, add_size - sizeof(time_t));
-      size += add_size;
-
-      if (cache_size > 0 && size > ob->once_file_size)
-	{
-	from += sizeof(time_t) + Ustrlen(from + sizeof(time_t)) + 1;
-	size -= (from - cache_buff);
-	}
+      from += sizeof(time_t) + Ustrlen(from + sizeof(time_t)) + 1;
+      size -= (from - cache_buff);
       }
+    else
+      {
+      from = cache_time;
+      size = add_size;
+      offset = cache_size;
+      }
+    }
+
+  memcpy(cache_time, &now, sizeof(time_t));
+  if (lseek(cache_fd, offset, SEEK_SET) != offset
+     || write(cache_fd, from, size) != size)
+    DEBUG(D_transport) debug_printf("Problem writing cache file %s for %s "
+      "transport\n", oncelog, tblock->name);
+  }
 
-    memcpy(cache_time, &now, sizeof(time_t));
-    if(write(cache_fd, from, size) != size)
-      DEBUG(D_transport) debug_printf("Problem writing cache file %s for %s "
-	"transport\n", oncelog, tblock->name);
+/* Update the hints database. The write sets the time stamp. */
+
+else if (once_key)
+  {
+  open_db dbblock, * dbm;
+  dbdata_generic rec;
+
+  if ((dbm = dbfn_open(US"autoreply", O_RDWR, &dbblock, TRUE, FALSE)))
+    {
+    dbfn_write(dbm, once_key, &rec, sizeof(rec));
+    dbfn_close(dbm);
     }
+  else
+    DEBUG(D_transport) debug_printf("Problem opening autoreply hints database "
+      "for %s transport\n", tblock->name);
   }
 
 /* Update DBM file */
@@ -25,6 +25,7 @@ typedef struct {
   off_t once_file_size;
   BOOL  file_expand;
   BOOL  file_optional;
+  BOOL  once_hintsdb;
   BOOL  return_message;
 } autoreply_transport_options_block;
 
@@ -12,6 +12,12 @@
 
 #define PENDING_OK 256
 
+/* When the server advertises PIPELINING, MAIL and RCPT commands are sent in
+blocks of up to this many before the responses are read, so that a large batch
+cannot fill the connection in both directions at once. */
+
+#define LMTP_PIPE_MAX 100
+
 
 /* Options specific to the lmtp transport. They must be in alphabetic
 order (note that "_" comes before the lower case letters). Those starting
@@ -211,10 +217,12 @@ return FALSE;
 *************************************************/
 
 /* The formatted command is left in big_buffer so that it can be reflected in
-any error message.
+any error message. When a pipelining buffer is given, the command is added to
+it instead of being written; lmtp_flush() sends the lot.
 
 Arguments:
   fd         the fd to write to
+  pipe       the pipelining buffer, or NULL to write the command at once
   format     a format, starting with one of
              of HELO, MAIL FROM, RCPT TO, DATA, ".", or QUIT.
   ...        data for the format
@@ -223,7 +231,7 @@ Returns:     TRUE if successful, FALSE if not, with errno set
 */
 
 static BOOL
-lmtp_write_command(int fd, const char *format, ...)
+lmtp_write_command(int fd, gstring * pipe, const char *format, ...)
 {
 gstring gs = { .size = big_buffer_size, .ptr = 0, .s = big_buffer };
 int rc;
@@ -240,8 +248,15 @@ if (!string_vformat(&gs, SVFMT_TAINT_NOCHK, CS format, ap))
   return FALSE;
   }
 va_end(ap);
-DEBUG(D_transport|D_v) debug_printf("  LMTP>> %s", string_from_gstring(&gs));
-rc = write(fd, gs.s, gs.ptr);
+DEBUG(D_transport|D_v) debug_printf("  LMTP%s>> %s", pipe ? "+" : "",
+  string_from_gstring(&gs));
+if (pipe)
+  {
+  pipe = string_catn(pipe, gs.s, gs.ptr);
+  rc = 1;
+  }
+else
+  rc = write(fd, gs.s, gs.ptr);
 gs.ptr -= 2; string_from_gstring(&gs); /* remove \r\n for debug and error message */
 if (rc > 0) return TRUE;
 DEBUG(D_transport) debug_printf("write failed: %s\n", strerror(errno));
@@ -250,6 +265,38 @@ return FALSE;
 
 
 
+/*************************************************
+*         Send pipelined LMTP commands           *
+*************************************************/
+
+/* Write out, and empty, the buffer of commands built up by
+lmtp_write_command().
+
+Arguments:
+  fd         the fd to write to
+  pipe       the pipelining buffer
+
+Returns:     TRUE if successful, FALSE if not, with errno set
+*/
+
+static BOOL
+lmtp_flush(int fd, gstring * pipe)
+{
+DEBUG(D_transport|D_v)
+  debug_printf("  LMTP>> (flushing %d bytes of pipelined commands)\n", pipe->ptr);
+for (int off = 0, rc; off < pipe->ptr; off += rc)
+  if ((rc = write(fd, pipe->s + off, pipe->ptr - off)) <= 0)
+    {
+    if (rc < 0 && errno == EINTR) { rc = 0; continue; }
+    DEBUG(D_transport) debug_printf("write failed: %s\n", strerror(errno));
+    return FALSE;
+    }
+pipe->ptr = 0;
+return TRUE;
+}
+
+
+
 
 /*************************************************
 *              Read LMTP response                *
@@ -447,6 +494,60 @@ return buffer[0] == okdigit;
 
 
 
+/*************************************************
+*     Handle the responses to MAIL and RCPT      *
+*************************************************/
+
+/* These are separate so that they can be used both after a single command
+and when reading the responses to a pipelined block.
+
+Arguments:
+  out        the FILE to read from
+  buffer     buffer for the response
+  size       size of the buffer
+  addr       the address list (MAIL) or the address (RCPT)
+  timeout    the timeout
+
+Returns:     TRUE if the response has been dealt with, FALSE if the whole
+             transaction has failed (the caller goes to RESPONSE_FAILED)
+*/
+
+static BOOL
+lmtp_mail_response(FILE * out, uschar * buffer, int size, address_item * addr,
+  int timeout)
+{
+if (lmtp_read_response(out, buffer, size, '2', timeout)) return TRUE;
+if (errno == 0 && buffer[0] == '4')
+  {
+  errno = ERRNO_MAIL4XX;
+  addr->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
+  }
+return FALSE;
+}
+
+static BOOL
+lmtp_rcpt_response(FILE * out, uschar * buffer, int size, address_item * addr,
+  int timeout)
+{
+if (lmtp_read_response(out, buffer, size, '2', timeout))
+  {
+  addr->transport_return = PENDING_OK;
+  return TRUE;
+  }
+if (errno != 0 || buffer[0] == 0) return FALSE;
+addr->message = string_sprintf("LMTP error after %s: %s", big_buffer,
+  string_printing(buffer));
+setflag(addr, af_pass_message);   /* Allow message to go to user */
+if (buffer[0] == '5') addr->transport_return = FAIL; else
+  {
+  addr->basic_errno = ERRNO_RCPT4XX;
+  addr->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
+  }
+return TRUE;
+}
+
+
+
 
 
 
@@ -471,8 +572,9 @@ lmtp_transport_options_block *ob =
 struct sockaddr_un sockun;         /* don't call this "sun" ! */
 int timeout = ob->timeout;
 int fd_in = -1, fd_out = -1;
-int code, save_errno;
+int code, save_errno, pipe_count = 0;
 BOOL send_data;
+gstring * pipe = NULL;
 BOOL yield = FALSE;
 uschar *igquotstr = US"";
 uschar *sockname = NULL;
@@ -563,7 +665,7 @@ if (!lmtp_read_response(out, buffer, sizeof(buffer), '2',
 
 /* Next, we send a LHLO command, and expect a positive response */
 
-if (!lmtp_write_command(fd_in, "%s %s\r\n", "LHLO",
+if (!lmtp_write_command(fd_in, NULL, "%s %s\r\n", "LHLO",
   primary_hostname)) goto WRITE_FAILED;
 
 if (!lmtp_read_response(out, buffer, sizeof(buffer), '2',
@@ -576,49 +678,73 @@ if (ob->ignore_quota)
   igquotstr = (pcre_exec(regex_IGNOREQUOTA, NULL, CS buffer,
     Ustrlen(CS buffer), 0, PCRE_EOPT, NULL, 0) >= 0)? US" IGNOREQUOTA" : US"";
 
+/* If the server supports PIPELINING (which RFC 2033 requires of it), the
+envelope commands are buffered and sent in blocks, saving a round trip for
+each recipient. DATA is not pipelined, as it must not be sent if no recipient
+has been accepted. */
+
+if (!regex_PIPELINING) regex_PIPELINING =
+  regex_must_compile(US"\\n250[\\s\\-]PIPELINING(\\s|\\n|$)", FALSE, TRUE);
+
+if (pcre_exec(regex_PIPELINING, NULL, CS buffer, Ustrlen(CS buffer), 0,
+      PCRE_EOPT, NULL, 0) >= 0)
+  {
+  DEBUG(D_transport) debug_printf("server supports PIPELINING\n");
+  pipe = string_get(1024);
+  }
+
 /* Now the envelope sender */
 
-if (!lmtp_write_command(fd_in, "MAIL FROM:<%s>\r\n", return_path))
+if (!lmtp_write_command(fd_in, pipe, "MAIL FROM:<%s>\r\n", return_path))
   goto WRITE_FAILED;
 
-if (!lmtp_read_response(out, buffer, sizeof(buffer), '2', timeout))
-  {
-  if (errno == 0 && buffer[0] == '4')
-    {
-    errno = ERRNO_MAIL4XX;
-    addrlist->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
-    }
+if (!pipe && !lmtp_mail_response(out, buffer, sizeof(buffer), addrlist, timeout))
   goto RESPONSE_FAILED;
-  }
 
 /* Next, we hand over all the recipients. Some may be permanently or
-temporarily rejected; others may be accepted, for now. */
+temporarily rejected; others may be accepted, for now. When pipelining, the
+responses for a block are read once it is full or the recipients run out;
+the command for each is reconstructed in big_buffer for any error message. */
 
-send_data = FALSE;
-for (address_item * addr = addrlist; addr; addr = addr->next)
+for (address_item * addr = addrlist, * first = addrlist; addr; addr = addr->next)
   {
-  if (!lmtp_write_command(fd_in, "RCPT TO:<%s>%s\r\n",
+  if (!lmtp_write_command(fd_in, pipe, "RCPT TO:<%s>%s\r\n",
        transport_rcpt_address(addr, tblock->rcpt_include_affixes), igquotstr))
     goto WRITE_FAILED;
-  if (lmtp_read_response(out, buffer, sizeof(buffer), '2', timeout))
+
+  if (!pipe)
     {
-    send_data = TRUE;
-    addr->transport_return = PENDING_OK;
+    if (!lmtp_rcpt_response(out, buffer, sizeof(buffer), addr, timeout))
+      goto RESPONSE_FAILED;
     }
-  else
+
+  else if (!addr->next || ++pipe_count >= LMTP_PIPE_MAX)
     {
-    if (errno != 0 || buffer[0] == 0) goto RESPONSE_FAILED;
-    addr->message = string_sprintf("LMTP error after %s: %s", big_buffer,
-      string_printing(buffer));
-    setflag(addr, af_pass_message);   /* Allow message to go to user */
-    if (buffer[0] == '5') addr->transport_return = FAIL; else
+    if (!lmtp_flush(fd_in, pipe)) goto WRITE_FAILED;
+
+    if (first == addrlist)
+      {
+      string_format_nt(big_buffer, big_buffer_size, "MAIL FROM:<%s>", return_path);
+      if (!lmtp_mail_response(out, buffer, sizeof(buffer), addrlist, timeout))
+        goto RESPONSE_FAILED;
+      }
+
+    for (address_item * a = first; a != addr->next; a = a->next)
       {
-      addr->basic_errno = ERRNO_RCPT4XX;
-      addr->more_errno |= ((buffer[1] - '0')*10 + buffer[2] - '0') << 8;
+      string_format_nt(big_buffer, big_buffer_size, "RCPT TO:<%s>%s",
+        transport_rcpt_address(a, tblock->rcpt_include_affixes), igquotstr);
+      if (!lmtp_rcpt_response(out, buffer, sizeof(buffer), a, timeout))
+        goto RESPONSE_FAILED;
       }
+    first = addr->next;
+    pipe_count = 0;
     }
   }
 
+send_data = FALSE;
+for (address_item * addr = addrlist; addr; addr = addr->next)
+  if (addr->transport_return == PENDING_OK) send_data = TRUE;
+
 /* Now send the text of the message if there were any good recipients. */
 
 if (send_data)
@@ -632,7 +758,7 @@ if (send_data)
     ob->options
   };
 
-  if (!lmtp_write_command(fd_in, "DATA\r\n")) goto WRITE_FAILED;
+  if (!lmtp_write_command(fd_in, NULL, "DATA\r\n")) goto WRITE_FAILED;
   if (!lmtp_read_response(out, buffer, sizeof(buffer), '3', timeout))
     {
     if (errno == 0 && buffer[0] == '4')
@@ -723,7 +849,7 @@ all the addresses have necessarily been transferred, but each has its status
 set, so we change the yield to TRUE. */
 
 yield = TRUE;
-(void) lmtp_write_command(fd_in, "QUIT\r\n");
+(void) lmtp_write_command(fd_in, NULL, "QUIT\r\n");
 (void) lmtp_read_response(out, buffer, sizeof(buffer), '2', 1);
 
 goto RETURN;
@@ -745,7 +871,7 @@ addrlist->message = NULL;
 if (check_response(&save_errno, addrlist->more_errno,
     buffer, &code, &(addrlist->message)))
   {
-  (void) lmtp_write_command(fd_in, "QUIT\r\n");
+  (void) lmtp_write_command(fd_in, NULL, "QUIT\r\n");
   (void) lmtp_read_response(out, buffer, sizeof(buffer), '2', 1);
   }
 
@@ -602,11 +602,11 @@ if (is_tainted(cmd))
 
 /* When a pipe is set up by a filter file, there may be values for $thisaddress
 and numerical the variables in existence. These are passed in
-addr->pipe_expandn for use here. */
+addr->cold->pipe_expandn for use here. */
 
-if (expand_arguments && addr->pipe_expandn)
+if (expand_arguments && ADDR_COLD(addr)->pipe_expandn)
   {
-  uschar **ss = addr->pipe_expandn;
+  uschar **ss = ADDR_COLD(addr)->pipe_expandn;
   expand_nmax = -1;
   if (*ss) filter_thisaddress = *ss++;
   while (*ss)
@@ -67,7 +67,9 @@ if (!ob->dirname)
     "directory must be set for the %s transport", tblock->name);
 }
 
-/* This function will copy from a file to another
+/* This function will copy from a file to another. Where the OS can copy in
+the kernel (which some file systems do by sharing the blocks) that is tried
+first; if it is not supported for these files, the data is read and written.
 
 Arguments:
   dst        fd to write to (the destination queue file)
@@ -82,6 +84,19 @@ copy_spool_file(int dst, int src)
 int i, j;
 uschar buffer[16384];
 
+#ifdef EXIM_HAVE_COPY_FILE_RANGE
+loff_t off = 0;
+ssize_t n;
+
+while ((n = copy_file_range(src, &off, dst, NULL, 1024*1024*1024, 0)) > 0) ;
+if (n == 0) return TRUE;
+if (off > 0 || errno != ENOSYS && errno != EXDEV && errno != EINVAL
+	       && errno != EOPNOTSUPP && errno != EBADF)
+  return FALSE;
+DEBUG(D_transport) debug_printf("copy_file_range: %s; copying by hand\n",
+  strerror(errno));
+#endif
+
 if (lseek(src, 0, SEEK_SET) != 0)
   return FALSE;
 
@@ -108,6 +123,9 @@ Arguments:
   link_file     BOOL use linkat instead of data copy
   srcfd		fd for data file, or -1 for header file
 
+If linking fails other than because the file exists, the file is copied
+instead. A copied file is synced before it is closed.
+
 Returns:       TRUE if all went well, FALSE otherwise
 */
 
@@ -117,7 +135,7 @@ copy_spool_files(transport_instance * tb, address_item * addr,
 {
 BOOL is_hdr_file = srcfd < 0;
 const uschar * suffix = srcfd < 0 ? US"H" : US"D";
-int dstfd;
+int dstfd = -1, save_errno;
 const uschar * filename = string_sprintf("%s-%s", message_id, suffix);
 const uschar * srcpath = spool_fname(US"input", message_subdir, message_id, suffix);
 const uschar * s, * op;
@@ -134,8 +152,15 @@ if (link_file)
 
   op = US"linking";
   s = dstpath;
+  if (errno != EEXIST)
+    {
+    DEBUG(D_transport) debug_printf("%s transport, linking failed: %s\n",
+      tb->name, strerror(errno));
+    link_file = FALSE;
+    }
   }
-else					/* use data copy */
+
+if (!link_file)				/* use data copy */
   {
   DEBUG(D_transport) debug_printf("%s transport, copying %s => %s\n",
     tb->name, srcpath, dstpath);
@@ -156,7 +181,19 @@ else					/* use data copy */
       if (!copy_spool_file(dstfd, srcfd))
 	op = US"creating";
       else
-	return TRUE;
+	if (EXIMfsync(dstfd) < 0)
+	  op = US"syncing";
+	else
+	  {
+	  (void) close(dstfd);
+	  if (is_hdr_file) (void) close(srcfd);
+	  return TRUE;
+	  }
+
+  save_errno = errno;
+  if (dstfd >= 0) (void) close(dstfd);
+  if (is_hdr_file && srcfd >= 0) (void) close(srcfd);
+  errno = save_errno;
   }
 
 addr->basic_errno = errno;
@@ -179,7 +216,7 @@ queuefile_transport_entry(transport_instance * tblock, address_item * addr)
 queuefile_transport_options_block * ob =
   (queuefile_transport_options_block *) tblock->options_block;
 BOOL can_link;
-uschar * sourcedir = spool_dname(US"input", message_subdir);
+uschar * sourcedir = spool_id_dname(US"input", message_subdir, message_id);
 uschar * s, * dstdir;
 struct stat dstatbuf, sstatbuf;
 int ddfd = -1, sdfd = -1;
@@ -268,6 +305,22 @@ if (!copy_spool_files(tblock, addr, dstdir, sdfd, ddfd, can_link,
   goto RETURN;
   }
 
+/* Make the new directory entries durable. When fsync_group_commit is set,
+this sync is shared with other processes moving messages at the same time. */
+
+#ifdef NEED_SYNC_DIRECTORY
+if (EXIMfsync(ddfd) < 0 && errno != EINVAL)
+  {
+  addr->basic_errno = errno;
+  addr->message = string_sprintf("%s transport syncing directory: %s "
+    "failed with error: %s", tblock->name, dstdir, strerror(errno));
+  addr->transport_return = DEFER;
+  Uunlink(string_sprintf("%s/%s-D", dstdir, message_id));
+  Uunlink(string_sprintf("%s/%s-H", dstdir, message_id));
+  goto RETURN;
+  }
+#endif
+
 DEBUG(D_transport)
   debug_printf("%s transport succeeded\n", tblock->name);
 
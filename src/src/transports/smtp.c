@@ -27,6 +27,7 @@ optionlist smtp_transport_options[] = {
   { "*expand_retry_include_ip_address", opt_stringptr | opt_hidden,
       LOFF(expand_retry_include_ip_address) },
 
+  { "adaptive_concurrency_max", opt_int,  LOFF(adaptive_concurrency_max) },
   { "address_retry_include_sender", opt_bool,
       LOFF(address_retry_include_sender) },
   { "allow_localhost",      opt_bool,	   LOFF(allow_localhost) },
@@ -35,10 +36,12 @@ optionlist smtp_transport_options[] = {
 #endif
   { "authenticated_sender", opt_stringptr, LOFF(authenticated_sender) },
   { "authenticated_sender_force", opt_bool, LOFF(authenticated_sender_force) },
+  { "chunking_single_size", opt_mkint,	   LOFF(chunking_single_size) },
   { "command_timeout",      opt_time,	   LOFF(command_timeout) },
   { "connect_timeout",      opt_time,	   LOFF(connect_timeout) },
   { "connection_max_messages", opt_int | opt_public,
       OPT_OFF(transport_instance, connection_max_messages) },
+  { "continue_noexec_max",  opt_int,	   LOFF(continue_noexec_max) },
 # ifdef SUPPORT_DANE
   { "dane_require_tls_ciphers", opt_stringptr, LOFF(dane_require_tls_ciphers) },
 # endif
@@ -65,21 +68,25 @@ optionlist smtp_transport_options[] = {
   { "gethostbyname",        opt_bool,	   LOFF(gethostbyname) },
   { "helo_data",            opt_stringptr, LOFF(helo_data) },
   { "hosts",                opt_stringptr, LOFF(hosts) },
+  { "hosts_adaptive_concurrency", opt_stringptr, LOFF(hosts_adaptive_concurrency) },
   { "hosts_avoid_esmtp",    opt_stringptr, LOFF(hosts_avoid_esmtp) },
   { "hosts_avoid_pipelining", opt_stringptr, LOFF(hosts_avoid_pipelining) },
 #ifndef DISABLE_TLS
   { "hosts_avoid_tls",      opt_stringptr, LOFF(hosts_avoid_tls) },
 #endif
+  { "hosts_latency_explore", opt_int,	   LOFF(hosts_latency_explore) },
   { "hosts_max_try",        opt_int,	   LOFF(hosts_max_try) },
   { "hosts_max_try_hardlimit", opt_int,	   LOFF(hosts_max_try_hardlimit) },
 #ifndef DISABLE_TLS
   { "hosts_nopass_tls",     opt_stringptr, LOFF(hosts_nopass_tls) },
   { "hosts_noproxy_tls",    opt_stringptr, LOFF(hosts_noproxy_tls) },
 #endif
+  { "hosts_order_by_latency", opt_bool,	   LOFF(hosts_order_by_latency) },
   { "hosts_override",       opt_bool,	   LOFF(hosts_override) },
 #ifndef DISABLE_PIPE_CONNECT
   { "hosts_pipe_connect",   opt_stringptr, LOFF(hosts_pipe_connect) },
 #endif
+  { "hosts_race_connect",   opt_stringptr, LOFF(hosts_race_connect) },
   { "hosts_randomize",      opt_bool,	   LOFF(hosts_randomize) },
 #if !defined(DISABLE_TLS) && !defined(DISABLE_OCSP)
   { "hosts_request_ocsp",   opt_stringptr, LOFF(hosts_request_ocsp) },
@@ -107,6 +114,7 @@ optionlist smtp_transport_options[] = {
   { "hosts_verify_avoid_tls", opt_stringptr, LOFF(hosts_verify_avoid_tls) },
 #endif
   { "interface",            opt_stringptr, LOFF(interface) },
+  { "interface_pool_backoff", opt_time,    LOFF(interface_pool_backoff) },
   { "keepalive",            opt_bool,	   LOFF(keepalive) },
   { "lmtp_ignore_quota",    opt_bool,	   LOFF(lmtp_ignore_quota) },
   { "max_rcpt",             opt_int | opt_public,
@@ -173,6 +181,7 @@ smtp_transport_options_block smtp_transport_option_defaults = {
   .protocol =			US"smtp",
   .dscp =			NULL,
   .serialize_hosts =		NULL,
+  .hosts_adaptive_concurrency =	NULL,
   .hosts_try_auth =		NULL,
   .hosts_require_auth =		NULL,
   .hosts_try_chunking =		US"*",
@@ -182,6 +191,7 @@ smtp_transport_options_block smtp_transport_option_defaults = {
   .dane_require_tls_ciphers =	NULL,
 #endif
   .hosts_try_fastopen =		US"*",
+  .hosts_race_connect =		NULL,
 #ifndef DISABLE_PRDR
   .hosts_try_prdr =		US"*",
 #endif
@@ -208,6 +218,11 @@ smtp_transport_options_block smtp_transport_option_defaults = {
   .size_addition =		1024,
   .hosts_max_try =		5,
   .hosts_max_try_hardlimit =	50,
+  .adaptive_concurrency_max =	10,
+  .hosts_latency_explore =	10,
+  .interface_pool_backoff =	15*60,
+  .chunking_single_size =	0,
+  .continue_noexec_max =	0,
   .message_linelength_limit =	998,
   .address_retry_include_sender = TRUE,
   .allow_localhost =		FALSE,
@@ -217,6 +232,7 @@ smtp_transport_options_block smtp_transport_option_defaults = {
   .dns_search_parents =		FALSE,
   .dnssec = { .request= US"*", .require=NULL },
   .delay_after_cutoff =		TRUE,
+  .hosts_order_by_latency =	FALSE,
   .hosts_override =		FALSE,
   .hosts_randomize =		FALSE,
   .keepalive =			TRUE,
@@ -258,6 +274,7 @@ smtp_transport_options_block smtp_transport_option_defaults = {
     .dkim_timestamps =		NULL,
     .dot_stuffed =		FALSE,
     .force_bodyhash =		FALSE,
+    .body_is_spool =		FALSE,
 # ifdef EXPERIMENTAL_ARC
     .arc_signspec =		NULL,
 # endif
@@ -806,7 +823,326 @@ return TRUE;
 
 
 
+/* When hosts_order_by_latency is set, each delivery attempt records, for the
+IP address used, the time taken to connect, to get through the banner and EHLO,
+and for the rest of the delivery, and whether it worked. They are kept as
+moving averages in the "hoststats" hints database. Before the hosts loop, hosts
+of equal preference are then sorted by the sum of the times plus the failure
+rate times connect_timeout, so that the faster and more reliable ones are tried
+first. Hosts with no record come first, so that they get measured. So that the
+figures for the slower hosts do not go stale, a proportion of deliveries, set
+by hosts_latency_explore, keep the usual order. smtp_setup_conn() notes when
+each stage is reached; a stage not reached has a zero time. */
+
+#define HOSTSTATS_WEIGHT	0.2	/* weight of a new sample in an average */
+
+static struct {
+  struct timeval	start;
+  struct timeval	connected;
+  struct timeval	greeted;
+} host_times;
+
+
+static double
+hoststats_ms(const struct timeval * from, const struct timeval * to)
+{
+return (to->tv_sec - from->tv_sec) * 1000.0
+  + (to->tv_usec - from->tv_usec) / 1000.0;
+}
+
+static void
+hoststats_avg(double * avg, double sample)
+{
+*avg = *avg > 0 ? *avg + HOSTSTATS_WEIGHT * (sample - *avg) : sample;
+}
+
+
+/* Record the result of a delivery attempt to a host.
+
+Arguments:
+  host      the host tried
+  ok        TRUE if the delivery attempt worked
+*/
+
+static void
+hoststats_record(const host_item * host, BOOL ok)
+{
+open_db dbblock, * dbm_file;
+dbdata_hoststats * old, hs;
+struct timeval now;
+int len;
+
+if (!host->address
+   || !(dbm_file = dbfn_open(US"hoststats", O_RDWR, &dbblock, TRUE, TRUE)))
+  return;
+
+gettimeofday(&now, NULL);
+if (  (old = dbfn_read_with_length(dbm_file, host->address, &len))
+   && len == sizeof(hs) && now.tv_sec - old->time_stamp <= retry_data_expire)
+  hs = *old;
+else
+  memset(&hs, 0, sizeof(hs));
+
+hs.attempts++;
+if (!ok) hs.failures++;
+hs.fail_rate = hs.attempts == 1 ? !ok
+  : hs.fail_rate + HOSTSTATS_WEIGHT * (!ok - hs.fail_rate);
+
+if (host_times.connected.tv_sec)
+  {
+  hoststats_avg(&hs.connect_ms,
+    hoststats_ms(&host_times.start, &host_times.connected));
+  if (host_times.greeted.tv_sec)
+    {
+    hoststats_avg(&hs.ehlo_ms,
+      hoststats_ms(&host_times.connected, &host_times.greeted));
+    if (ok)
+      hoststats_avg(&hs.txn_ms, hoststats_ms(&host_times.greeted, &now));
+    }
+  }
+
+DEBUG(D_transport) debug_printf("hoststats %s: %u/%u failed, connect %.1fms"
+  " EHLO %.1fms transaction %.1fms\n", host->address, hs.failures, hs.attempts,
+  hs.connect_ms, hs.ehlo_ms, hs.txn_ms);
+dbfn_write(dbm_file, host->address, &hs, (int)sizeof(hs));
+dbfn_close(dbm_file);
+}
+
+
+/* Sort runs of hosts that have the same MX preference by their records, and
+all the hosts if the list is not from MX records and has been randomized. A
+host whose address is not yet known can be found only if its name is an IP
+address. The list is copied, because it may be shared with other deliveries.
+
+Arguments:
+  hostlist    the list of hosts
+  ob          the transport options
+
+Returns:      the new list, or the old one if nothing is known
+*/
+
+static host_item *
+hoststats_order(host_item * hostlist, smtp_transport_options_block * ob)
+{
+open_db dbblock, * dbm_file;
+host_item ** hosts, * newlist = NULL, ** last = &newlist;
+double * score;
+time_t now = time(NULL);
+int n = 0;
+BOOL known = FALSE;
+
+if (ob->hosts_latency_explore > 0
+   && random_number(100) < ob->hosts_latency_explore)
+  {
+  DEBUG(D_transport) debug_printf("keeping host order for exploration\n");
+  return hostlist;
+  }
+if (!(dbm_file = dbfn_open(US"hoststats", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return hostlist;
+
+for (host_item * h = hostlist; h; h = h->next) n++;
+hosts = store_get(n * sizeof(host_item *), FALSE);
+score = store_get(n * sizeof(double), FALSE);
+
+n = 0;
+for (host_item * h = hostlist; h; h = h->next, n++)
+  {
+  const uschar * key = h->address ? h->address
+    : string_is_ip_address(h->name, NULL) != 0 ? h->name : NULL;
+  dbdata_hoststats * hs;
+  int len;
+
+  hosts[n] = h;
+  score[n] = 0;
+  if (  key
+     && (hs = dbfn_read_with_length(dbm_file, key, &len))
+     && len == sizeof(*hs) && now - hs->time_stamp <= retry_data_expire)
+    {
+    score[n] = hs->connect_ms + hs->ehlo_ms + hs->txn_ms
+      + hs->fail_rate * ob->connect_timeout * 1000.0;
+    known = TRUE;
+    }
+  }
+dbfn_close(dbm_file);
+if (!known) return hostlist;
+
+/* A stable insertion sort within each run */
+
+for (int i = 1; i < n; i++)
+  {
+  host_item * h = hosts[i];
+  double sc = score[i];
+  int j = i;
+
+  if (h->mx == MX_NONE && !ob->hosts_randomize) continue;
+  for ( ; j > 0 && hosts[j-1]->mx == h->mx && score[j-1] > sc; j--)
+    {
+    hosts[j] = hosts[j-1];
+    score[j] = score[j-1];
+    }
+  hosts[j] = h;
+  score[j] = sc;
+  }
+
+DEBUG(D_transport) debug_printf("hosts ordered by latency:\n");
+for (int i = 0; i < n; i++)
+  {
+  host_item * h = store_get(sizeof(host_item), FALSE);
+
+  *h = *hosts[i];
+  *last = h;
+  last = &h->next;
+  DEBUG(D_transport) debug_printf("  %s [%s] MX=%d score=%.1f\n",
+    h->name, h->address ? h->address : US"<null>", h->mx, score[i]);
+  }
+*last = NULL;
+return newlist;
+}
+
+
+
 #ifndef DISABLE_PIPE_CONNECT
+/* If pipelining_connect_cache_size is set, the EHLO responses are kept in a
+file in the hints directory which every Exim process maps shared, rather than
+in the "misc" hints database. Reading the cache is then a hash probe, without
+the open and lock of the database on every new connection. The key and the
+record are as for the database; the record already holds the cleartext and
+crypted capability bits (STARTTLS, CHUNKING, PIPELINING, ...) and the matching
+AUTH methods.
+
+The file holds a fixed number of slots, read and written as described for
+dbfn_slot_n(), replacing the oldest entry in the probe range when it is
+full. */
+
+#define EHLO_CACHE_MAGIC	0x45454331	/* "EEC1" */
+#define EHLO_CACHE_PROBES	8
+
+typedef struct {
+  dbfn_shared_header sh;
+} ehlo_cache_header;
+
+typedef struct {
+  dbfn_shared_slot sl;
+  uschar	key[60];
+  dbdata_ehlo_resp er;		/* zero time_stamp for an empty slot */
+} ehlo_cache_slot;
+
+static ehlo_cache_header * ehlo_cache = NULL;
+static BOOL ehlo_cache_tried = FALSE;
+
+
+/* Map the cache file, creating it if necessary. Failure is not an error; the
+hints database is used instead.
+
+Returns:  TRUE if the cache is available
+*/
+
+static BOOL
+ehlo_cache_open(void)
+{
+if (ehlo_cache) return TRUE;
+if (ehlo_cache_tried || pipe_connect_cache_size <= 0) return FALSE;
+ehlo_cache_tried = TRUE;
+
+return !!(ehlo_cache = dbfn_map_shared(US"ehlocache", EHLO_CACHE_MAGIC,
+  pipe_connect_cache_size,
+  sizeof(ehlo_cache_header), sizeof(ehlo_cache_slot)));
+}
+
+
+static unsigned
+ehlo_cache_hash(const uschar * key)
+{
+unsigned h = 2166136261u;			/* FNV-1a */
+while (*key) h = (h ^ *key++) * 16777619u;
+return h;
+}
+
+
+/* Find the slot for a key. If it is not present and "new" is set, return the
+empty or oldest slot in the probe range.
+
+Arguments:
+  key       the key
+  hash      its hash
+  new       TRUE to find a slot for writing
+
+Returns:    the slot, or NULL
+*/
+
+static ehlo_cache_slot *
+ehlo_cache_find(const uschar * key, unsigned hash, BOOL new)
+{
+ehlo_cache_slot * old = NULL;
+
+for (int i = 0; i < EHLO_CACHE_PROBES; i++)
+  {
+  ehlo_cache_slot * s = dbfn_slot_n(ehlo_cache, hash, i);
+  if (s->sl.hash == hash && s->er.time_stamp && Ustrcmp(s->key, key) == 0)
+    return s;
+  if (!old || s->er.time_stamp < old->er.time_stamp) old = s;
+  }
+return new ? old : NULL;
+}
+
+
+/* Write a record to the cache or, with no data, empty the slot for the key.
+If another process is writing the slot, give up; the cache is only advisory.
+
+Arguments:
+  key       the key
+  data      the capability bits, or NULL
+*/
+
+static void
+ehlo_cache_write(const uschar * key, const ehlo_resp_precis * data)
+{
+unsigned hash = ehlo_cache_hash(key);
+uint64_t seq;
+ehlo_cache_slot * s;
+
+if (  Ustrlen(key) >= sizeof(s->key)
+   || !(s = ehlo_cache_find(key, hash, !!data))
+   || !dbfn_slot_claim(&s->sl, 1, &seq))
+  return;
+
+s->sl.hash = hash;
+Ustrcpy(s->key, key);
+if (data)
+  {
+  s->er.data = *data;
+  s->er.time_stamp = time(NULL);
+  }
+else
+  s->er.time_stamp = 0;
+dbfn_slot_release(&s->sl, seq);
+}
+
+
+/* Read a record from the cache. The caller has checked that it is open.
+
+Arguments:
+  key       the key
+  er        where to put the record
+
+Returns:    TRUE if found
+*/
+
+static BOOL
+ehlo_cache_read(const uschar * key, dbdata_ehlo_resp * er)
+{
+ehlo_cache_slot * s;
+uint64_t seq;
+
+if (  !(s = ehlo_cache_find(key, ehlo_cache_hash(key), FALSE))
+   || !dbfn_slot_read_begin(&s->sl, &seq))
+  return FALSE;
+*er = s->er;
+return dbfn_slot_read_end(&s->sl, seq) && er->time_stamp;
+}
+
+
+
 static uschar *
 ehlo_cache_key(const smtp_context * sx)
 {
@@ -823,7 +1159,15 @@ write_ehlo_cache_entry(const smtp_context * sx)
 {
 open_db dbblock, * dbm_file;
 
-if ((dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
+if (ehlo_cache_open())
+  {
+  HDEBUG(D_transport) debug_printf("writing clr %04x/%04x cry %04x/%04x"
+    " to shared cache\n",
+    sx->ehlo_resp.cleartext_features, sx->ehlo_resp.cleartext_auths,
+    sx->ehlo_resp.crypted_features, sx->ehlo_resp.crypted_auths);
+  ehlo_cache_write(ehlo_cache_key(sx), &sx->ehlo_resp);
+  }
+else if ((dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
   {
   uschar * ehlo_resp_key = ehlo_cache_key(sx);
   dbdata_ehlo_resp er = { .data = sx->ehlo_resp };
@@ -842,8 +1186,11 @@ invalidate_ehlo_cache_entry(smtp_context * sx)
 {
 open_db dbblock, * dbm_file;
 
-if (  sx->early_pipe_active
-   && (dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
+if (!sx->early_pipe_active)
+  return;
+if (ehlo_cache_open())
+  ehlo_cache_write(ehlo_cache_key(sx), NULL);
+else if ((dbm_file = dbfn_open(US"misc", O_RDWR, &dbblock, TRUE, TRUE)))
   {
   uschar * ehlo_resp_key = ehlo_cache_key(sx);
   dbfn_delete(dbm_file, ehlo_resp_key);
@@ -857,6 +1204,29 @@ read_ehlo_cache_entry(smtp_context * sx)
 open_db dbblock;
 open_db * dbm_file;
 
+if (ehlo_cache_open())
+  {
+  dbdata_ehlo_resp er;
+
+  if (!ehlo_cache_read(ehlo_cache_key(sx), &er))
+    { DEBUG(D_transport) debug_printf("no ehlo-resp record in shared cache\n"); }
+  else if (time(NULL) - er.time_stamp > retry_data_expire)
+    {
+    DEBUG(D_transport) debug_printf("ehlo-resp record too old\n");
+    ehlo_cache_write(ehlo_cache_key(sx), NULL);
+    }
+  else
+    {
+    sx->ehlo_resp = er.data;
+    DEBUG(D_transport) debug_printf(
+	"EHLO response bits from shared cache: cleartext 0x%04x/0x%04x crypted 0x%04x/0x%04x\n",
+	er.data.cleartext_features, er.data.cleartext_auths,
+	er.data.crypted_features, er.data.crypted_auths);
+    return TRUE;
+    }
+  return FALSE;
+  }
+
 if (!(dbm_file = dbfn_open(US"misc", O_RDONLY, &dbblock, FALSE, TRUE)))
   { DEBUG(D_transport) debug_printf("ehlo-cache: no misc DB\n"); }
 else
@@ -1947,6 +2317,7 @@ sx->inblock.buffer = sx->inbuffer;
 sx->inblock.buffersize = sizeof(sx->inbuffer);
 sx->inblock.ptr = sx->inbuffer;
 sx->inblock.ptrend = sx->inbuffer;
+sx->inblock.reads = 0;
 
 /* Set up the buffer for holding SMTP commands while pipelining */
 
@@ -1989,7 +2360,8 @@ if (sx->smtps)
   }
 #else
 
-/* If we have a proxied TLS connection, check usability for this message */
+/* If we have a proxied TLS connection, or one carried over without an exec,
+check usability for this message */
 
 if (continue_hostname && continue_proxy_cipher)
   {
@@ -2051,8 +2423,18 @@ if (continue_hostname && continue_proxy_cipher)
       debug_printf("Closing proxied-TLS connection due to SNI mismatch\n");
 
     HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP>> QUIT\n");
-    write(0, "QUIT\r\n", 6);
-    close(0);
+    if (tls_out.active.sock >= 0)
+      {
+      int fd = tls_out.active.sock;
+      (void) tls_write(tls_out.active.tls_ctx, US"QUIT\r\n", 6, FALSE);
+      tls_close(tls_out.active.tls_ctx, TLS_SHUTDOWN_NOWAIT);
+      close(fd);
+      }
+    else
+      {
+      write(0, "QUIT\r\n", 6);
+      close(0);
+      }
     continue_hostname = continue_proxy_cipher = NULL;
     f.continue_more = FALSE;
     continue_sequence = 1;	/* Unfortunately, this process cannot affect success log
@@ -2120,6 +2502,24 @@ if (!continue_hostname)
     }
 #endif	/*DANE*/
 
+  /* Take an idle connection from the cache if there is one; it will have been
+  through the banner, EHLO and any authentication already. */
+
+  if (  !sx->verify
+#ifdef SUPPORT_DANE
+     && !sx->conn_args.dane
+#endif
+     && smtp_conn_cache_lease(sx))
+    {
+    sx->conn_leased = TRUE;
+    smtp_command = big_buffer;
+    sx->peer_offered = smtp_peer_options;
+    sx->avoid_option = 0;
+    sx->helo_data = NULL;		/* ensure we re-expand ob->helo_data */
+    goto CONN_LEASED;
+    }
+  sx->conn_leased = FALSE;
+
   /* Make the TCP connection */
 
   sx->cctx.tls_ctx = NULL;
@@ -2166,6 +2566,7 @@ PIPE_CONNECT_RETRY:
       sx->send_quit = FALSE;
       return DEFER;
       }
+    gettimeofday(&host_times.connected, NULL);
     }
   /* Expand the greeting message while waiting for the initial response. (Makes
   sense if helo_data contains ${lookup dnsdb ...} stuff). The expansion is
@@ -2419,6 +2820,11 @@ goto SEND_QUIT;
     smtp_peer_options |= sx->peer_offered & OPTION_TLS;
 #endif
     }
+
+#ifndef DISABLE_PIPE_CONNECT
+  if (!sx->early_pipe_active)
+#endif
+    gettimeofday(&host_times.greeted, NULL);
   }
 
 /* For continuing deliveries down the same channel, having re-exec'd  the socket
@@ -2442,6 +2848,13 @@ else
     sx->cctx = cutthrough.cctx;
     sx->conn_args.host->port = sx->port = cutthrough.host.port;
     }
+#ifndef DISABLE_TLS
+  else if (continue_proxy_cipher && tls_out.active.sock >= 0)
+    {
+    sx->cctx = tls_out.active;			/* TLS kept over, no exec */
+    smtp_port_for_connect(sx->conn_args.host, sx->port);
+    }
+#endif
   else
     {
     sx->cctx.sock = 0;				/* stdin */
@@ -2463,7 +2876,9 @@ else
     {
     sx->pipelining_used = pipelining_active = !!(smtp_peer_options & OPTION_PIPE);
     HDEBUG(D_transport) debug_printf("continued connection, %s TLS\n",
-      continue_proxy_cipher ? "proxied" : "verify conn with");
+      !continue_proxy_cipher ? "verify conn with"
+      : tls_out.active.sock >= 0 ? "retained"
+      : continue_proxy_ktls ? "kernel" : "proxied");
     return OK;
     }
   HDEBUG(D_transport) debug_printf("continued connection, no TLS\n");
@@ -2477,6 +2892,7 @@ negative, the original EHLO data is available for subsequent analysis, should
 the client not be required to use TLS. If the response is bad, copy the buffer
 for error analysis. */
 
+CONN_LEASED:
 #ifndef DISABLE_TLS
 if (  smtp_peer_options & OPTION_TLS
    && !suppress_tls
@@ -2714,14 +3130,14 @@ else if (  sx->smtps
 
 /* If TLS is active, we have just started it up and re-done the EHLO command,
 so its response needs to be analyzed. If TLS is not active and this is a
-continued session down a previously-used socket, we haven't just done EHLO, so
-we skip this. */
+continued session down a previously-used socket, or one leased from the
+connection cache, we haven't just done EHLO, so we skip this. */
 
-if (continue_hostname == NULL
+if (  (!continue_hostname && !sx->conn_leased)
 #ifndef DISABLE_TLS
-    || tls_out.active.sock >= 0
+   || tls_out.active.sock >= 0
 #endif
-    )
+   )
   {
   if (sx->esmtp || sx->lmtp)
     {
@@ -3510,6 +3926,7 @@ smtp_transport_options_block * ob = SOB tblock->options_block;
 int yield = OK;
 int save_errno;
 int rc;
+int start_reads;
 
 BOOL pass_message = FALSE;
 uschar *message = NULL;
@@ -3604,6 +4021,20 @@ if (tblock->filter_command)
     }
   }
 
+#ifdef EXPAND_DLFUNC
+if (  tblock->filter_dlfunc
+   && sx->peer_offered & OPTION_CHUNKING
+# ifndef DISABLE_DKIM
+   && !(ob->dkim.dkim_private_key && ob->dkim.dkim_domain && ob->dkim.dkim_selector)
+   && !ob->dkim.force_bodyhash
+# endif
+   )
+  {
+  sx->peer_offered &= ~OPTION_CHUNKING;
+  DEBUG(D_transport) debug_printf("CHUNKING not usable due to transport filter\n");
+  }
+#endif
+
 /* For messages that have more than the maximum number of envelope recipients,
 we want to send several transactions down the same SMTP connection. (See
 comments in deliver.c as to how this reconciles, heuristically, with
@@ -3614,6 +4045,7 @@ transaction to handle. */
 
 SEND_MESSAGE:
 sx->from_addr = return_path;
+start_reads = sx->inblock.reads;
 sx->sync_addr = sx->first_addr;
 sx->ok = FALSE;
 sx->send_rset = TRUE;
@@ -3747,6 +4179,7 @@ else
     tctx.check_string = tctx.escape_string = NULL;
     tctx.options |= topt_use_bdat;
     tctx.chunk_cb = smtp_chunk_cmd_callback;
+    tctx.chunk_single_size = ob->chunking_single_size;
     sx->pending_BDAT = FALSE;
     sx->good_RCPT = sx->ok;
     sx->cmd_count = 0;
@@ -4256,9 +4689,14 @@ can), so we do not pass such a connection on if the host matches
 hosts_nopass_tls. */
 
 DEBUG(D_transport)
+  {
+  debug_printf("transaction took %d round trip%s\n",
+    sx->inblock.reads - start_reads,
+    sx->inblock.reads - start_reads == 1 ? "" : "s");
   debug_printf("ok=%d send_quit=%d send_rset=%d continue_more=%d "
     "yield=%d first_address is %sNULL\n", sx->ok, sx->send_quit,
     sx->send_rset, f.continue_more, yield, sx->first_addr ? "not " : "");
+  }
 
 if (sx->completed_addr && sx->ok && sx->send_quit)
   {
@@ -4352,10 +4790,23 @@ if (sx->completed_addr && sx->ok && sx->send_quit)
 	  }
 	else
 	  {
-	  /* Set up a pipe for proxying TLS for the new transport process */
+	  /* Set up a pipe for proxying TLS for the new transport process,
+	  unless it is to be one that keeps our TLS session, without an exec,
+	  or the kernel holds the session state in both directions. In that
+	  last case the new process can use the socket directly, the kernel
+	  doing the record coding. */
 
 	  smtp_peer_options |= OPTION_TLS;
-	  if ((sx->ok = socketpair(AF_UNIX, SOCK_STREAM, 0, pfd) == 0))
+	  if (transport_pass_noexec(ob->continue_noexec_max))
+	    {
+	    DEBUG(D_transport) debug_printf("passing TLS session without exec\n");
+	    }
+	  else if (tls_out.ktls == (KTLS_TX | KTLS_RX))
+	    {
+	    DEBUG(D_transport) debug_printf("passing kernel TLS socket\n");
+	    continue_proxy_ktls = TRUE;
+	    }
+	  else if ((sx->ok = socketpair(AF_UNIX, SOCK_STREAM, 0, pfd) == 0))
 	    socket_fd = pfd[1];
 	  else
 	    set_errno(sx->first_addr, errno, US"internal allocation problem",
@@ -4377,7 +4828,7 @@ if (sx->completed_addr && sx->ok && sx->send_quit)
 propagate it from the initial
 */
       if (sx->ok && transport_pass_socket(tblock->name, host->name,
-	    host->address, new_message_id, socket_fd))
+	    host->address, new_message_id, socket_fd, ob->continue_noexec_max))
 	{
         sx->send_quit = FALSE;
 
@@ -4387,6 +4838,20 @@ propagate it from the initial
 	get logging done asap.  Which way to place the work makes assumptions
 	about post-fork prioritisation which may not hold on all platforms. */
 #ifndef DISABLE_TLS
+	if (tls_out.active.sock >= 0 && socket_fd == sx->cctx.sock)
+	  {
+	  /* The new process has the TLS session itself, or the kernel has it;
+	  no proxy is needed. Drop our copy of the library state without any
+	  shutdown alert. */
+
+	  tls_close(sx->cctx.tls_ctx, TLS_NO_SHUTDOWN);
+	  sx->cctx.tls_ctx = NULL;
+	  (void)close(sx->cctx.sock);
+	  sx->cctx.sock = -1;
+	  continue_transport = NULL;
+	  continue_hostname = NULL;
+	  goto TIDYUP;
+	  }
 	if (tls_out.active.sock >= 0)
 	  {
 	  int pid = exim_fork(US"tls-proxy-interproc");
@@ -4442,7 +4907,13 @@ This enables the response sent by the server to be properly ACKed rather than
 timed out, as can happen on broken TCP/IP implementations on other OS.
 
 This change is being made on 31-Jul-98. After over a year of trouble-free
-operation, the old commented-out code was removed on 17-Sep-99. */
+operation, the old commented-out code was removed on 17-Sep-99.
+
+A session that is still in good order may instead be parked in the connection
+cache, for a later delivery to the same host. */
+
+if (sx->ok && sx->send_quit && smtp_conn_cache_park(sx))
+  sx->send_quit = FALSE;
 
 SEND_QUIT:
 #ifdef TCP_CORK
@@ -4548,7 +5019,8 @@ uschar inbuffer[4096];
 uschar outbuffer[16];
 
 /*XXX really we need an active-smtp-client ctx, rather than assuming stdout */
-cctx.sock = fileno(stdin);
+cctx.sock = continue_proxy_cipher && tls_out.active.sock >= 0
+  ? tls_out.active.sock : fileno(stdin);
 cctx.tls_ctx = cctx.sock == tls_out.active.sock ? tls_out.active.tls_ctx : NULL;
 
 sx.inblock.cctx = &cctx;
@@ -4556,6 +5028,7 @@ sx.inblock.buffer = inbuffer;
 sx.inblock.buffersize = sizeof(inbuffer);
 sx.inblock.ptr = inbuffer;
 sx.inblock.ptrend = inbuffer;
+sx.inblock.reads = 0;
 
 sx.outblock.cctx = &cctx;
 sx.outblock.buffersize = sizeof(outbuffer);
@@ -4619,6 +5092,47 @@ return first_addr;
 
 
 
+/*************************************************
+*    Check retry data for a connection race      *
+*************************************************/
+
+/* This is the usable() function for smtp_race_connect(). It checks a copy of
+the host block, so that the status of the real one is left for the main
+delivery loop to set (retry_check_address() does nothing to a host whose status
+is already known, and the loop needs the retry keys it returns).
+
+Arguments:
+  h            the candidate host
+  ctx          the race_retry_ctx
+
+Returns:       TRUE if the retry data allow the host to be tried now
+*/
+
+typedef struct {
+  const uschar * domain;
+  int		defport;
+  BOOL		incl_ip;
+} race_retry_ctx;
+
+static BOOL
+race_retry_usable(const host_item * h, void * ctx)
+{
+race_retry_ctx * r = ctx;
+host_item hc = *h;
+uschar * pistring = string_sprintf(":%d",
+  h->port == PORT_NONE ? r->defport : h->port);
+uschar * host_key, * message_key;
+time_t due;
+
+if (Ustrcmp(pistring, ":25") == 0) pistring = US"";
+hc.status = hstatus_unknown;
+(void) retry_check_address(r->domain, &hc, pistring, r->incl_ip,
+  &host_key, &message_key, &due);
+return hc.status == hstatus_usable;
+}
+
+
+
 /*************************************************
 *              Main entry point                  *
 *************************************************/
@@ -4642,6 +5156,7 @@ int hosts_retry = 0;
 int hosts_serial = 0;
 int hosts_total = 0;
 int total_hosts_tried = 0;
+time_t hosts_retry_due = 0;
 BOOL expired = TRUE;
 uschar *expanded_hosts = NULL;
 uschar *pistring;
@@ -4812,10 +5327,32 @@ else if (ob->hosts_randomize && hostlist->mx == MX_NONE && !continue_hostname)
   hostlist = addrlist->host_list = newlist;
   }
 
+/* Put hosts of equal preference in order of their recorded performance. The
+top address must have the new list, which holds the status of each host after
+the delivery. The fallback hosts are left alone, as the top address's list is
+compared with them below. */
+
+if (  ob->hosts_order_by_latency && !continue_hostname
+   && hostlist != addrlist->fallback_hosts)
+  {
+  host_item * newlist = hoststats_order(hostlist, ob);
+
+  if (hostlist == addrlist->host_list) addrlist->host_list = newlist;
+  hostlist = newlist;
+  }
+
 /* Sort out the default port.  */
 
 if (!smtp_get_port(ob->port, addrlist, &defport, tid)) return FALSE;
 
+#ifdef SUPPORT_DANE
+/* Get the TLSA records for all the hosts at once, if permitted */
+
+if (dns_parallel_lookups && !continue_hostname)
+  tlsa_prefetch(hostlist, defport, CUSS &ob->hosts_try_dane,
+    CUSS &ob->hosts_require_dane);
+#endif
+
 /* For each host-plus-IP-address on the list:
 
 .  If this is a continued delivery and the host isn't the one with the
@@ -4886,6 +5423,8 @@ retry_non_continued:
     uschar *retry_host_key = NULL;
     uschar *retry_message_key = NULL;
     uschar *serialize_key = NULL;
+    uschar *adapt_key = NULL;
+    time_t due = 0;
 
     /* Default next host is next host. :-) But this can vary if the
     hosts_max_try limit is hit (see below). It may also be reset if a host
@@ -5044,6 +5583,39 @@ retry_non_continued:
 
     hosts_total++;
 
+    /* If the host is one of several equivalent addresses, race connections
+    to them (RFC 8305), and bring the one that answers first to the front, so
+    that it is the one the retry and delivery code below deal with. The others
+    stay in the list to be tried in the usual way if need be. Addresses that
+    the retry data say are not to be tried yet are left out of the race. */
+
+    if (  cutoff_retry == 0 && !continue_hostname && !f.dont_deliver
+       && !ob->interface
+#ifdef SUPPORT_SOCKS
+       && !ob->socks_proxy
+#endif
+       && verify_check_given_host(CUSS &ob->hosts_race_connect, host) == OK)
+      {
+      race_retry_ctx r = { .domain = addrlist->domain, .defport = defport };
+      host_item * w = NULL;
+
+      if (exp_bool(addrlist, US"transport", tblock->name, D_transport,
+		US"retry_include_ip_address", ob->retry_include_ip_address,
+		ob->expand_retry_include_ip_address, &r.incl_ip) == OK)
+	w = smtp_race_connect(host, defport, tblock, ob->connect_timeout,
+				race_retry_usable, &r);
+
+      if (w && w != host)
+	{
+	host_item h = *host, * hnext = host->next, * wnext = w->next;
+
+	*host = *w;
+	host->next = hnext;
+	*w = h;
+	w->next = wnext;
+	}
+      }
+
     /* Set $host and $host address now in case they are needed for the
     interface expansion or the serialize_hosts check; they remain set if an
     actual delivery happens. */
@@ -5098,7 +5670,7 @@ retry_non_continued:
 	continue;	/* with next host */
 
       host_is_expired = retry_check_address(addrlist->domain, host, pistring,
-        incl_ip, &retry_host_key, &retry_message_key);
+        incl_ip, &retry_host_key, &retry_message_key, &due);
 
       DEBUG(D_transport) debug_printf("%s [%s]%s retry-status = %s\n", host->name,
         host->address ? host->address : US"", pistring,
@@ -5117,6 +5689,8 @@ retry_non_continued:
 	  /* Fall through */
 
         case hstatus_unusable_expired:
+	  if (due && (!hosts_retry_due || due < hosts_retry_due))
+	    hosts_retry_due = due;
 	  switch (host->why)
 	    {
 	    case hwhy_retry: hosts_retry++; break;
@@ -5174,6 +5748,25 @@ retry_non_continued:
         }
       }
 
+    /* Likewise if the host is one whose connections are limited adaptively,
+    by a limit shared by all Exim processes that is lowered when the host
+    fails and raised again as deliveries to it succeed. */
+
+    if (  !continue_hostname
+       && verify_check_given_host(CUSS &ob->hosts_adaptive_concurrency, host) == OK)
+      {
+      adapt_key = string_sprintf("host-adapt-%s", host->name);
+      if (!enq_adapt_start(adapt_key, ob->adaptive_concurrency_max))
+        {
+        DEBUG(D_transport)
+          debug_printf("skipping host %s because its adaptive connection limit "
+            "is reached\n", host->name);
+        if (serialize_key) enq_end(serialize_key);
+        hosts_serial++;
+        continue;
+        }
+      }
+
     /* OK, we have an IP address that is not waiting for its retry time to
     arrive (it might be expired) OR (second time round the loop) we have an
     expired host that hasn't been tried since the message arrived. Have a go
@@ -5262,8 +5855,28 @@ retry_non_continued:
       /* Attempt the delivery. */
 
       total_hosts_tried++;
+      memset(&host_times, 0, sizeof(host_times));
+      gettimeofday(&host_times.start, NULL);
       rc = smtp_deliver(addrlist, thost, host_af, defport, interface, tblock,
         &message_defer, FALSE);
+      if (ob->hosts_order_by_latency && !continue_hostname)
+	hoststats_record(host, rc == OK);
+
+      /* A temporary error response may mean that the server is limiting the
+      rate from this source address; if it came from a pool, take it out of
+      use for the domain for a while. */
+
+      if (interface && ob->interface_pool_backoff > 0)
+	for (address_item * a = addrlist; a; a = a->next)
+	  if (  (a->transport_return == DEFER || a->transport_return == PENDING_DEFER)
+	     && (  a->basic_errno == ERRNO_MAIL4XX
+		|| a->basic_errno == ERRNO_RCPT4XX
+		|| a->basic_errno == ERRNO_DATA4XX))
+	    {
+	    smtp_interface_throttle(interface, a->domain,
+	      ob->interface_pool_backoff);
+	    break;
+	    }
 
       /* Yield is one of:
          OK     => connection made, each address contains its result;
@@ -5339,9 +5952,12 @@ retry_non_continued:
       message_id, host->name, host->address, pistring, addrlist->address,
       addrlist->next ? " (& others)" : "", rc_to_string(rc));
 
-    /* Release serialization if set up */
+    /* Release serialization if set up, and adjust any adaptive limit */
 
     if (serialize_key) enq_end(serialize_key);
+    if (adapt_key)
+      enq_adapt_end(adapt_key, ob->adaptive_concurrency_max,
+	f.dont_deliver ? 0 : rc == OK && !message_defer ? 1 : rc == DEFER ? -1 : 0);
 
     /* If the result is DEFER, or if a host retry record is known to exist, we
     need to add an item to the retry chain for updating the retry database
@@ -5515,6 +6131,13 @@ retry_non_continued:
       cutthrough.cctx.tls_ctx = NULL;
       cutthrough.is_tls = FALSE;
       }
+    else if (continue_proxy_cipher && tls_out.active.sock >= 0)
+      {
+      fd = tls_out.active.sock;
+      (void) tls_write(tls_out.active.tls_ctx, US"QUIT\r\n", 6, FALSE);
+      tls_close(tls_out.active.tls_ctx, TLS_SHUTDOWN_NOWAIT);
+      continue_proxy_cipher = NULL;
+      }
     else
 #else
       (void) write(fd, US"QUIT\r\n", 6);
@@ -5584,6 +6207,13 @@ for (address_item * addr = addrlist; addr; addr = addr->next)
       setflag(addr, af_retry_skipped);
       }
 
+  /* For queue_retry_index: the address can get further when the first of the
+  hosts skipped for their retry times becomes usable, unless some were left
+  alone for another reason and could be tried at once. */
+
+  addr->retry_due = host || hosts_defer || hosts_serial || f.queue_smtp
+    ? 1 : hosts_retry_due;
+
   if (f.queue_smtp)    /* no deliveries attempted */
     {
     addr->transport_return = DEFER;
@@ -27,6 +27,7 @@ typedef struct {
   uschar	*protocol;
   uschar	*dscp;
   uschar	*serialize_hosts;
+  uschar	*hosts_adaptive_concurrency;
   uschar	*hosts_try_auth;
   uschar	*hosts_require_auth;
   uschar	*hosts_try_chunking;
@@ -36,6 +37,7 @@ typedef struct {
   uschar	*dane_require_tls_ciphers;
 #endif
   uschar	*hosts_try_fastopen;
+  uschar	*hosts_race_connect;
 #ifndef DISABLE_PRDR
   uschar	*hosts_try_prdr;
 #endif
@@ -62,6 +64,11 @@ typedef struct {
   int		size_addition;
   int		hosts_max_try;
   int		hosts_max_try_hardlimit;
+  int		adaptive_concurrency_max;
+  int		hosts_latency_explore;
+  int		interface_pool_backoff;
+  int		chunking_single_size;
+  int		continue_noexec_max;
   int			message_linelength_limit;
   BOOL		address_retry_include_sender;
   BOOL		allow_localhost;
@@ -71,6 +78,7 @@ typedef struct {
   BOOL		dns_search_parents;
   dnssec_domains dnssec;
   BOOL		delay_after_cutoff;
+  BOOL		hosts_order_by_latency;
   BOOL		hosts_override;
   BOOL		hosts_randomize;
   BOOL		keepalive;
@@ -151,6 +159,7 @@ typedef struct {
   BOOL completed_addr:1;
   BOOL send_rset:1;
   BOOL send_quit:1;
+  BOOL conn_leased:1;
 
   int		max_rcpt;
   int		cmd_count;
@@ -180,6 +189,8 @@ typedef struct {
   uschar	outbuffer[4096];
 } smtp_context;
 
+extern BOOL smtp_conn_cache_lease(smtp_context *);
+extern BOOL smtp_conn_cache_park(smtp_context *);
 extern int smtp_setup_conn(smtp_context *, BOOL);
 extern int smtp_write_mail_and_rcpt_cmds(smtp_context *, int *);
 extern int smtp_reap_early_pipe(smtp_context *, int *);
@@ -328,6 +328,220 @@ return sum;
 
 
 
+/*************************************************
+*           Cached size of a maildir             *
+*************************************************/
+
+/* When maildir_quota_cache_time is set, the size of a maildir is kept in a
+file at its top level, so that a check of the quota does not have to scan all
+the messages for every delivery. The first line of the file gives the kind of
+scan that it stands for and the time of that scan; the next line gives the
+size and file count that it found, and each delivery since then appends a line
+with the size of its message. Every line ends with the latest modification
+time of the maildir's subdirectories as they stood when it was written. A
+difference from the current times means that something other than a delivery
+through this cache has changed the maildir, so it is scanned again; it is also
+scanned again when the last scan is older than the option, whatever the lines
+say. When the file grows large, it is rewritten as a single total.
+
+The file is opened before the check and kept open until after the delivery has
+been recorded. Errors are not fatal: there is just a full scan. */
+
+static int qcache_fd = -1;		/* the open cache file */
+static uschar *qcache_path;		/* the maildir */
+static const pcre *qcache_dir_regex;	/* directories for the timestamps */
+static int qcache_kind;			/* 1 = whole tree, 2 = maildirsize scan */
+static time_t qcache_scan;		/* time of the scan recorded */
+static time_t qcache_stamp;		/* subdirectory timestamp at the check */
+
+
+/* Rewrite the cache as a single entry. */
+
+static void
+maildir_cache_write(off_t size, int count)
+{
+uschar buffer[256];
+int len;
+
+(void)sprintf(CS buffer, "%d " TIME_T_FMT "\n" OFF_T_FMT " %d " TIME_T_FMT "\n",
+  qcache_kind, qcache_scan, size, count, qcache_stamp);
+len = Ustrlen(buffer);
+if (ftruncate(qcache_fd, 0) < 0 || write(qcache_fd, buffer, len) != len)
+  {
+  DEBUG(D_transport) debug_printf("failed to write %s/" MAILDIR_QUOTA_CACHE
+    ": %s\n", qcache_path, strerror(errno));
+  maildir_cache_close();
+  return;
+  }
+DEBUG(D_transport) debug_printf("wrote " MAILDIR_QUOTA_CACHE ": size="
+  OFF_T_FMT " filecount=%d\n", size, count);
+}
+
+
+/* This function is called before the quota is checked for a delivery into a
+maildir. It opens the cache file, creating it if necessary, and gets the size
+of the maildir from it if the contents are still good.
+
+Arguments:
+  path           the path to the maildir directory
+  ob             the appendfile options block
+  dir_regex      a compiled regex for selecting maildir directories for a
+                   maildirsize scan, or NULL for a scan of the whole tree
+  sizefile       TRUE for a scan by maildir_compute_size(), FALSE for one by
+                   check_dir_size()
+  size           where to return the size
+  count          where to return the file count
+
+Returns:         TRUE if the size and count have been set from the cache
+*/
+
+BOOL
+maildir_cache_check(uschar *path, appendfile_transport_options_block *ob,
+  const pcre *dir_regex, BOOL sizefile, off_t *size, int *count)
+{
+uschar buffer[MAX_FILE_SIZE];
+uschar *ptr, *endptr;
+off_t sum = 0;
+int len, n = 0, kind;
+time_t scan, stamp = 0;
+
+if (ob->maildir_quota_cache_time <= 0 || ob->quota_directory) return FALSE;
+if (qcache_fd < 0)
+  {
+  uschar *filename = string_sprintf("%s/" MAILDIR_QUOTA_CACHE, path);
+  if ((qcache_fd = Uopen(filename, O_RDWR|O_APPEND|O_CREAT,
+	ob->mode ? ob->mode : 0600)) < 0)
+    {
+    DEBUG(D_transport) debug_printf("failed to open %s: %s\n", filename,
+      strerror(errno));
+    return FALSE;
+    }
+  }
+
+qcache_path = path;
+qcache_dir_regex = dir_regex;
+qcache_kind = sizefile ? 2 : 1;
+qcache_scan = time(NULL);
+qcache_stamp = 0;
+(void)maildir_compute_size(path, NULL, &qcache_stamp, NULL, dir_regex, TRUE);
+
+if ((len = pread(qcache_fd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+  {
+  DEBUG(D_transport) debug_printf(MAILDIR_QUOTA_CACHE " is empty\n");
+  return FALSE;
+  }
+buffer[len] = 0;
+
+if (  len >= sizeof(buffer) - 1
+   || sscanf(CS buffer, "%d " TIME_T_FMT "\n", &kind, &scan) != 2
+   || kind != qcache_kind
+   || !(ptr = Ustrchr(buffer, '\n'))
+   )
+  {
+  DEBUG(D_transport) debug_printf(MAILDIR_QUOTA_CACHE " is not usable\n");
+  return FALSE;
+  }
+
+if (qcache_scan - scan > ob->maildir_quota_cache_time || scan > qcache_scan)
+  {
+  DEBUG(D_transport) debug_printf(MAILDIR_QUOTA_CACHE " is older than %s\n",
+    readconf_printtime(ob->maildir_quota_cache_time));
+  return FALSE;
+  }
+
+/* Add up the lines; each must be complete */
+
+while (*++ptr)
+  {
+  sum += (off_t)Ustrtod(ptr, &endptr);
+  if (*endptr++ != ' ') break;
+  n += Ustrtol(endptr, &endptr, 10);
+  if (*endptr++ != ' ') break;
+  stamp = (time_t)Ustrtol(endptr, &endptr, 10);
+  if (*endptr != '\n') break;
+  ptr = endptr;
+  }
+
+if (*ptr || sum < 0 || n < 0 || stamp == 0)
+  {
+  DEBUG(D_transport) debug_printf("error in " MAILDIR_QUOTA_CACHE "\n");
+  return FALSE;
+  }
+if (stamp != qcache_stamp)
+  {
+  DEBUG(D_transport) debug_printf("maildir changed since " MAILDIR_QUOTA_CACHE
+    " was written\n");
+  return FALSE;
+  }
+
+DEBUG(D_transport) debug_printf("size from " MAILDIR_QUOTA_CACHE ": size="
+  OFF_T_FMT " filecount=%d\n", sum, n);
+if (len > MAX_FILE_SIZE/2)
+  {
+  qcache_scan = scan;
+  maildir_cache_write(sum, n);
+  }
+*size = sum;
+*count = n;
+return TRUE;
+}
+
+
+/* This function is called after a scan of a maildir, to record its result in
+the cache, if there is one open. The timestamp is the one found before the
+scan, so that a change made while it was in progress causes another.
+
+Arguments:
+  size           the size that was found
+  count          the file count that was found
+
+Returns:         nothing
+*/
+
+void
+maildir_cache_update(off_t size, int count)
+{
+if (qcache_fd >= 0) maildir_cache_write(size, count);
+}
+
+
+/* This function is called after a message has been added to a maildir, to add
+its size to the cache, if there is one open, and close it.
+
+Argument:        the size of the message
+Returns:         nothing
+*/
+
+void
+maildir_cache_record(int size)
+{
+uschar buffer[256];
+time_t stamp = 0;
+int len;
+
+if (qcache_fd < 0) return;
+(void)maildir_compute_size(qcache_path, NULL, &stamp, NULL, qcache_dir_regex,
+  TRUE);
+(void)sprintf(CS buffer, "%d 1 " TIME_T_FMT "\n", size, stamp);
+len = Ustrlen(buffer);
+len = write(qcache_fd, buffer, len);
+DEBUG(D_transport)
+  debug_printf("added '%.*s' to " MAILDIR_QUOTA_CACHE "\n", len-1, buffer);
+maildir_cache_close();
+}
+
+
+/* Close the cache, if it is open. */
+
+void
+maildir_cache_close(void)
+{
+if (qcache_fd >= 0) (void)close(qcache_fd);
+qcache_fd = -1;
+}
+
+
+
 /*************************************************
 *        Create or update maildirsizefile        *
 *************************************************/
@@ -371,6 +585,15 @@ uschar *filename;
 uschar buffer[MAX_FILE_SIZE];
 uschar *ptr = buffer;
 uschar *endptr;
+off_t cached_size;
+int cached_filecount;
+BOOL cached;
+
+/* If there is a cache of the maildir's size, a recalculation can take the
+size from it. */
+
+cached = maildir_cache_check(path, ob, dir_regex, TRUE, &cached_size,
+  &cached_filecount);
 
 /* Try a few times to open or create the file, in case another process is doing
 the same thing. */
@@ -535,9 +758,19 @@ else
 
   if (fd >= 0) (void)close(fd);
   old_latest = 0;
-  filecount = 0;
-  size = maildir_compute_size(path, &filecount, &old_latest, regex, dir_regex,
-    FALSE);
+  if (cached)
+    {
+    size = cached_size;
+    filecount = cached_filecount;
+    (void)maildir_compute_size(path, NULL, &old_latest, NULL, dir_regex, TRUE);
+    }
+  else
+    {
+    filecount = 0;
+    size = maildir_compute_size(path, &filecount, &old_latest, regex,
+      dir_regex, FALSE);
+    maildir_cache_update(size, filecount);
+    }
 
   (void)gettimeofday(&tv, NULL);
   tempname = string_sprintf("%s/tmp/" TIME_T_FMT ".H%luP%lu.%s",
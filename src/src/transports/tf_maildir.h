@@ -8,6 +8,14 @@
 /* Header file for the functions that are used to support the use of
 maildirsize files for quota handling in maildir directories. */
 
+#define MAILDIR_QUOTA_CACHE "exim-quotacache"
+
+extern BOOL   maildir_cache_check(uschar *,
+                appendfile_transport_options_block *, const pcre *, BOOL,
+                off_t *, int *);
+extern void   maildir_cache_close(void);
+extern void   maildir_cache_record(int);
+extern void   maildir_cache_update(off_t, int);
 extern off_t  maildir_compute_size(uschar *, int *, time_t *, const pcre *,
                 const pcre *, BOOL);
 extern BOOL   maildir_ensure_directories(uschar *, address_item *, BOOL, int,
@@ -6,7 +6,7 @@
 /* See the file NOTICE for conditions of use and distribution. */
 
 /* Functions for maintaining binary balanced trees and some associated
-functions as well. */
+functions as well, including hash tables of tree nodes. */
 
 
 #include "exim.h"
@@ -29,11 +29,12 @@ Returns:  nothing
 void
 tree_add_nonrecipient(uschar *s)
 {
-rmark rpoint = store_mark();
-tree_node *node = store_get(sizeof(tree_node) + Ustrlen(s), is_tainted(s));
+tree_node *node;
+if (tree_hash_search(&tree_nonrecipients, s)) return;
+node = store_get(sizeof(tree_node) + Ustrlen(s), is_tainted(s));
 Ustrcpy(node->name, s);
 node->data.ptr = NULL;
-if (!tree_insertnode(&tree_nonrecipients, node)) store_reset(rpoint);
+(void) tree_hash_insert(&tree_nonrecipients, node);
 }
 
 
@@ -54,11 +55,12 @@ Returns:  nothing
 void
 tree_add_duplicate(uschar *s, address_item *addr)
 {
-rmark rpoint = store_mark();
-tree_node *node = store_get(sizeof(tree_node) + Ustrlen(s), is_tainted(s));
+tree_node *node;
+if (tree_hash_search(&tree_duplicates, s)) return;
+node = store_get(sizeof(tree_node) + Ustrlen(s), is_tainted(s));
 Ustrcpy(node->name, s);
 node->data.ptr = addr;
-if (!tree_insertnode(&tree_duplicates, node)) store_reset(rpoint);
+(void) tree_hash_insert(&tree_duplicates, node);
 }
 
 
@@ -76,70 +78,18 @@ Returns:     nothing
 void
 tree_add_unusable(host_item *h)
 {
-rmark rpoint = store_mark();
 tree_node *node;
 uschar s[256];
 sprintf(CS s, "T:%.200s:%s", h->name, h->address);
+if (tree_hash_search(&tree_unusable, s)) return;
 node = store_get(sizeof(tree_node) + Ustrlen(s),
 			is_tainted(h->name) || is_tainted(h->address));
 Ustrcpy(node->name, s);
 node->data.val = h->why;
 if (h->status == hstatus_unusable_expired) node->data.val += 256;
-if (!tree_insertnode(&tree_unusable, node)) store_reset(rpoint);
-}
-
-
-
-/*************************************************
-*        Write a tree in re-readable form        *
-*************************************************/
-
-/* This function writes out a tree in a form in which it can
-easily be re-read. It is used for writing out the non-recipients
-tree onto the spool, for retrieval at the next retry time.
-
-The format is as follows:
-
-   . If the tree is empty, write one line containing XX.
-
-   . Otherwise, each node is written, preceded by two letters
-     (Y/N) indicating whether it has left or right children.
-
-   . The left subtree (if any) then follows, then the right subtree.
-
-First, there's an internal recursive subroutine.
-
-Arguments:
-  p          current node
-  f          FILE to write to
-
-Returns:     nothing
-*/
-
-static void
-write_tree(tree_node *p, FILE *f)
-{
-fprintf(f, "%c%c %s\n",
-  (p->left == NULL)? 'N':'Y', (p->right == NULL)? 'N':'Y', p->name);
-if (p->left != NULL) write_tree(p->left, f);
-if (p->right != NULL) write_tree(p->right, f);
+(void) tree_hash_insert(&tree_unusable, node);
 }
 
-/* This is the top-level function, with the same arguments. */
-
-void
-tree_write(tree_node *p, FILE *f)
-{
-if (p == NULL)
-  {
-  fprintf(f, "XX\n");
-  return;
-  }
-write_tree(p, f);
-}
-
-
-
 
 
 /***********************************************************
@@ -389,4 +339,311 @@ tree_walk(src, tree_add_var, dstp);
 
 
 
+/***********************************************************
+*             Hash Tables of Tree Nodes                    *
+***********************************************************/
+
+/* Some sets of names, such as the non-recipients of a message, can become very
+large and are only ever searched for a whole name, so there is no need to keep
+them in order. They are kept in open addressing hash tables of pointers to
+tree nodes, which are allocated from the current pool as the nodes are; the
+nodes' left, right and balance fields are not used. A table is empty when its
+slots pointer is NULL, so clearing the structure resets it. */
+
+#define TREE_HASH_MIN	64	/* initial number of slots */
+
+static unsigned
+tree_hash_name(const uschar * name)
+{
+unsigned h = 2166136261u;				/* FNV-1a */
+while (*name) h = (h ^ *name++) * 16777619u;
+return h;
+}
+
+
+/*************************************************
+*        Search a hash table for a name          *
+*************************************************/
+
+/*
+Arguments:
+  t         the table
+  name      key to search for
+
+Returns:    pointer to node, or NULL if not found
+*/
+
+tree_node *
+tree_hash_search(const tree_hash * t, const uschar * name)
+{
+tree_node * p;
+
+if (!t->slots) return NULL;
+for (unsigned n = tree_hash_name(name) & (t->size - 1); (p = t->slots[n]);
+     n = (n + 1) & (t->size - 1))
+  if (Ustrcmp(name, p->name) == 0) return p;
+return NULL;
+}
+
+
+/*************************************************
+*       Insert a new node into a hash table      *
+*************************************************/
+
+/* The table is doubled when it becomes half full. The old slots are left in
+the pool; the total is no more than twice the final size.
+
+Arguments:
+  t         the table
+  node      the node, with its name set
+
+Returns:    TRUE if node inserted; FALSE if the name was already there
+*/
+
+BOOL
+tree_hash_insert(tree_hash * t, tree_node * node)
+{
+unsigned n;
+
+if (tree_hash_search(t, node->name)) return FALSE;
+
+if (2 * (t->count + 1) > t->size)
+  {
+  tree_hash new = { .size = t->size ? 2 * t->size : TREE_HASH_MIN };
+
+  new.slots = store_get(new.size * sizeof(tree_node *), FALSE);
+  memset(new.slots, 0, new.size * sizeof(tree_node *));
+  for (unsigned i = 0; i < t->size; i++) if (t->slots[i])
+    {
+    for (n = tree_hash_name(t->slots[i]->name) & (new.size - 1); new.slots[n];
+	 n = (n + 1) & (new.size - 1)) ;
+    new.slots[n] = t->slots[i];
+    }
+  new.count = t->count;
+  *t = new;
+  }
+
+for (n = tree_hash_name(node->name) & (t->size - 1); t->slots[n];
+     n = (n + 1) & (t->size - 1)) ;
+t->slots[n] = node;
+t->count++;
+return TRUE;
+}
+
+
+/*************************************************
+*   Walk hash table and execute function         *
+*************************************************/
+
+/* The nodes are visited in no particular order.
+
+Arguments:
+  t       the table
+  f       function to execute for each name-value-pair
+  ctx     context data for f
+*/
+
+void
+tree_hash_walk(const tree_hash * t, void (*f)(uschar*, uschar*, void*), void *ctx)
+{
+for (unsigned i = 0; i < t->size; i++) if (t->slots[i])
+  f(t->slots[i]->name, t->slots[i]->data.ptr, ctx);
+}
+
+
+/*************************************************
+*      Get the nodes of a hash table in order    *
+*************************************************/
+
+/* For output that people read, or that has to be a sorted tree.
+
+Argument:   the table
+Returns:    a vector of t->count node pointers, sorted by name, in the
+            current pool
+*/
+
+static int
+tree_hash_cmp(const void * a, const void * b)
+{
+return Ustrcmp((*(tree_node * const *)a)->name, (*(tree_node * const *)b)->name);
+}
+
+tree_node **
+tree_hash_sorted(const tree_hash * t)
+{
+tree_node ** v = store_get((t->count + 1) * sizeof(tree_node *), FALSE);
+int n = 0;
+
+for (unsigned i = 0; i < t->size; i++) if (t->slots[i]) v[n++] = t->slots[i];
+qsort(v, n, sizeof(tree_node *), tree_hash_cmp);
+return v;
+}
+
+
+
+/***********************************************************
+*            Perfect Hashes of Static Tables               *
+***********************************************************/
+
+/* The expansion variables, items and operators, and the option lists, are
+fixed tables sorted by name, searched many times in a process. Rather than a
+binary chop, each is given a collision-free hash the first time it is searched,
+by "hash and displace": names are put into buckets by one hash, and for each
+bucket, largest first, a displacement is found that sends a second hash of all
+its names to unused slots. A search is then one pass over the name, two table
+reads and one string comparison. The tables are built in malloc store, so they
+last for the life of the process and are inherited by its children.
+
+The entries of a table must each start with a pointer to the name. */
+
+#define PHASH_NAME(table, stride, i) \
+  (*(const uschar * const *)((const uschar *)(table) + (i) * (stride)))
+
+static void
+tree_phash_hashes(const uschar * name, unsigned * h1, unsigned * h2)
+{
+unsigned a = 2166136261u, b = 5381;			/* FNV-1a, djb2 */
+for (; *name; name++)
+  {
+  a = (a ^ *name) * 16777619u;
+  b = b * 33 + *name;
+  }
+*h1 = a;
+*h2 = b;
+}
+
+static unsigned
+tree_phash_slot(unsigned h2, unsigned d, unsigned mask)
+{
+unsigned x = h2 ^ (d * 0x9e3779b9u);
+x ^= x >> 15;
+x *= 0x2c1b3c6du;
+x ^= x >> 12;
+return x & mask;
+}
+
+static int
+tree_phash_bucket_cmp(const void * a, const void * b)
+{
+return ((const int *)b)[1] - ((const int *)a)[1];
+}
+
+static tree_phash *
+tree_phash_build(const void * table, int count, size_t stride)
+{
+tree_phash * p = store_malloc(sizeof(tree_phash));
+unsigned size, nb;
+unsigned * h1 = store_malloc(2 * count * sizeof(unsigned));
+unsigned * h2 = h1 + count;
+
+for (int i = 0; i < count; i++)
+  tree_phash_hashes(PHASH_NAME(table, stride, i), h1 + i, h2 + i);
+
+for (size = 16; size < 2 * count; ) size <<= 1;
+for (nb = 4; nb < count / 2; ) nb <<= 1;
+
+for (; count < SHRT_MAX && size <= 16 * count + 16; size <<= 1)
+  {
+  int (*order)[2] = store_malloc(nb * sizeof(*order));
+  short * slot = store_malloc(size * sizeof(short));
+  unsigned short * disp = store_malloc(nb * sizeof(unsigned short));
+  BOOL ok = TRUE;
+
+  for (unsigned s = 0; s < size; s++) slot[s] = -1;
+  memset(disp, 0, nb * sizeof(unsigned short));
+  for (unsigned b = 0; b < nb; b++) { order[b][0] = b; order[b][1] = 0; }
+  for (int i = 0; i < count; i++) order[h1[i] & (nb-1)][1]++;
+  qsort(order, nb, sizeof(*order), tree_phash_bucket_cmp);
+
+  for (unsigned k = 0; ok && k < nb && order[k][1] > 0; k++)
+    {
+    unsigned b = order[k][0], d;
+
+    for (d = 0; d <= USHRT_MAX; d++)
+      {
+      int i;
+      for (i = 0; i < count; i++)
+	if ((h1[i] & (nb-1)) == b)
+	  {
+	  unsigned s = tree_phash_slot(h2[i], d, size-1);
+	  if (slot[s] >= 0) break;
+	  slot[s] = i;
+	  }
+      if (i >= count) break;			/* all placed */
+
+      for (int j = 0; j < i; j++)		/* undo this attempt */
+	if ((h1[j] & (nb-1)) == b)
+	  slot[tree_phash_slot(h2[j], d, size-1)] = -1;
+      }
+    if (d > USHRT_MAX) ok = FALSE; else disp[b] = d;
+    }
+
+  store_free(order);
+  if (ok)
+    {
+    p->mask = size - 1;
+    p->bmask = nb - 1;
+    p->disp = disp;
+    p->slot = slot;
+    store_free(h1);
+    return p;
+    }
+  store_free(slot);
+  store_free(disp);
+  }
+
+/* Duplicate names, or a pathologically unlucky table */
+
+p->mask = 0;
+store_free(h1);
+return p;
+}
+
+
+/*************************************************
+*         Search a static table for a name       *
+*************************************************/
+
+/*
+Arguments:
+  pp        where the table's hash is kept; NULL before the first search
+  table     the table, sorted by name
+  count     the number of entries
+  stride    the size of an entry
+  name      the name to search for
+
+Returns:    the offset of the entry in the table, or -1
+*/
+
+int
+tree_phash_find(tree_phash ** pp, const void * table, int count, size_t stride,
+  const uschar * name)
+{
+tree_phash * p;
+
+if (!(p = *pp)) p = *pp = tree_phash_build(table, count, stride);
+
+if (p->mask)
+  {
+  unsigned h1, h2;
+  int i;
+
+  tree_phash_hashes(name, &h1, &h2);
+  i = p->slot[tree_phash_slot(h2, p->disp[h1 & p->bmask], p->mask)];
+  return i >= 0 && Ustrcmp(name, PHASH_NAME(table, stride, i)) == 0 ? i : -1;
+  }
+
+for (int first = 0, last = count; last > first; )
+  {
+  int middle = (first + last)/2;
+  int c = Ustrcmp(name, PHASH_NAME(table, stride, middle));
+
+  if (c == 0) return middle;
+  if (c > 0) first = middle + 1; else last = middle;
+  }
+return -1;
+}
+
+
+
 /* End of tree.c */
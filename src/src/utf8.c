@@ -45,8 +45,8 @@ The *err string pointer should be null before the call
 Return NULL for error, with optional errstr pointer filled in
 */
 
-uschar *
-string_domain_utf8_to_alabel(const uschar * utf8, uschar ** err)
+static uschar *
+domain_utf8_to_alabel(const uschar * utf8, uschar ** err)
 {
 uschar * s1, * s;
 int rc;
@@ -91,8 +91,8 @@ return s;
 
 
 
-uschar *
-string_domain_alabel_to_utf8(const uschar * alabel, uschar ** err)
+static uschar *
+domain_alabel_to_utf8(const uschar * alabel, uschar ** err)
 {
 #ifdef SUPPORT_I18N_2008
 const uschar * label;
@@ -125,6 +125,117 @@ return s;
 #endif
 }
 
+
+
+/* Per-process cache of domain conversions, in both directions.  The same
+few domains are converted over and over while routing and delivering a
+message, and each conversion is a trip through the IDNA library.  Results
+are held in malloc store, most recently used first, and the oldest one is
+discarded when the cache reaches smtputf8_domain_cache_size entries.
+Failed conversions are not cached. */
+
+typedef struct idna_cache_entry {
+  struct idna_cache_entry * hnext;	/* Hash chain */
+  struct idna_cache_entry * prev;	/* LRU list, most recent first */
+  struct idna_cache_entry * next;
+  uschar *	result;
+  unsigned	hash;
+  BOOL		to_alabel;
+  BOOL		tainted;		/* Taint of the domain given */
+  BOOL		result_tainted;
+  uschar	domain[1];
+} idna_cache_entry;
+
+#define IDNA_CACHE_HASH 256		/* Must be a power of two */
+
+static idna_cache_entry * idna_cache_hash[IDNA_CACHE_HASH];
+static idna_cache_entry * idna_cache_head = NULL;
+static idna_cache_entry * idna_cache_tail = NULL;
+static int idna_cache_count = 0;
+
+static uschar *
+domain_convert(const uschar * domain, BOOL to_alabel, uschar ** err)
+{
+unsigned hash = to_alabel;
+BOOL tainted = is_tainted(domain);
+idna_cache_entry * e, ** hp;
+uschar * res;
+int len, rlen;
+
+if (smtputf8_domain_cache_size <= 0)
+  return to_alabel
+    ? domain_utf8_to_alabel(domain, err) : domain_alabel_to_utf8(domain, err);
+
+for (const uschar * s = domain; *s; s++) hash = hash * 31 + *s;
+hp = &idna_cache_hash[hash & (IDNA_CACHE_HASH - 1)];
+
+for (e = *hp; e; e = e->hnext)
+  if (  e->to_alabel == to_alabel && e->tainted == tainted
+     && Ustrcmp(e->domain, domain) == 0)
+    {
+    if (e != idna_cache_head)		/* Move to the front of the list */
+      {
+      e->prev->next = e->next;
+      if (e->next) e->next->prev = e->prev; else idna_cache_tail = e->prev;
+      e->prev = NULL;
+      e->next = idna_cache_head;
+      idna_cache_head = idna_cache_head->prev = e;
+      }
+    return string_copy_taint(e->result, e->result_tainted);
+    }
+
+if (!(res = to_alabel
+    ? domain_utf8_to_alabel(domain, err) : domain_alabel_to_utf8(domain, err)))
+  return NULL;
+
+/* Discard the least recently used conversion if the cache is full */
+
+if (idna_cache_count >= smtputf8_domain_cache_size)
+  {
+  idna_cache_entry * old = idna_cache_tail, ** pp;
+
+  for (pp = &idna_cache_hash[old->hash & (IDNA_CACHE_HASH - 1)];
+       *pp != old; pp = &(*pp)->hnext) ;
+  *pp = old->hnext;
+  if ((idna_cache_tail = old->prev)) old->prev->next = NULL;
+  else idna_cache_head = NULL;
+  store_free(old);
+  idna_cache_count--;
+  }
+
+len = Ustrlen(domain);
+rlen = Ustrlen(res);
+e = store_malloc(sizeof(idna_cache_entry) + len + rlen + 1);
+memcpy(e->domain, domain, len + 1);
+e->result = e->domain + len + 1;
+memcpy(e->result, res, rlen + 1);
+e->hash = hash;
+e->to_alabel = to_alabel;
+e->tainted = tainted;
+e->result_tainted = is_tainted(res);
+e->hnext = *hp;
+*hp = e;
+e->prev = NULL;
+if ((e->next = idna_cache_head)) idna_cache_head->prev = e;
+else idna_cache_tail = e;
+idna_cache_head = e;
+idna_cache_count++;
+return res;
+}
+
+
+uschar *
+string_domain_utf8_to_alabel(const uschar * utf8, uschar ** err)
+{
+return domain_convert(utf8, TRUE, err);
+}
+
+uschar *
+string_domain_alabel_to_utf8(const uschar * alabel, uschar ** err)
+{
+return domain_convert(alabel, FALSE, err);
+}
+
 /**************************************************/
 /* localpart conversions */
 /* the *err string pointer should be null before the call */
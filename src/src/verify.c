@@ -15,11 +15,177 @@ caching was contributed by Kevin Fleming (but I hacked it around a bit). */
 
 #define CUTTHROUGH_CMD_TIMEOUT  30	/* timeout for cutthrough-routing calls */
 #define CUTTHROUGH_DATA_TIMEOUT 60	/* timeout for cutthrough-routing calls */
+#define CUTTHROUGH_MAX_CONNS	8	/* cap for cutthrough_max_connections */
 static smtp_context ctctx;
 uschar ctbuffer[8192];
 
+/* Cutthrough connections to further destinations for the same message, when
+cutthrough_max_connections permits.  Whichever connection is in use is swapped
+into the cutthrough global, with its output buffer into ctctx, so that the
+single-connection code serves each in turn. */
+
+static struct {
+  cut_t		ct;
+  uschar *	buffer;
+  uschar *	ptr;
+} cutthrough_more[CUTTHROUGH_MAX_CONNS-1];
+static int cutthrough_nmore = 0;
+static uschar ctbuffer_more[CUTTHROUGH_MAX_CONNS-1][sizeof(ctbuffer)];
+
 
 static uschar cutthrough_response(client_conn_ctx *, char, uschar **, int);
+static void close_cutthrough_connection(const uschar *);
+
+/* A callout connection kept open for the next callout to the same host, when
+callout_keep_idle is set. The context is in permanent store so that it survives
+between SMTP commands; a forked process must not use its parent's connection. */
+
+static struct {
+  smtp_context *	sx;
+  BOOL			open;
+  pid_t			pid;
+  time_t		last_used;
+  unsigned		peer_options;
+  int			sending_port;
+  uschar		sending_ip[46];
+  uschar		key[256];
+} callout_kept = {.sx = NULL, .open = FALSE};
+
+
+
+/*************************************************
+*      In-process tier of the callout cache      *
+*************************************************/
+
+/* Callout cache records that a process has read or written are kept in a tree,
+so that later verifications in the same process (an SMTP session with many
+recipients, say) need not open the hints database again. The records are
+exactly those of the database, with the same expiry rules applied on reading.
+
+When callout_cache_write_batch is set, new records are only marked dirty here,
+and written to the database together when enough of them have built up, when
+the oldest has waited a few seconds, or when the process ends. */
+
+#define CALLOUT_MEM_MAX		1000	/* records kept per process */
+#define CALLOUT_FLUSH_DELAY	5	/* seconds a dirty record may wait */
+
+typedef struct {
+  int		length;
+  BOOL		dirty;
+  dbdata_callout_cache record;		/* big enough for either type */
+} callout_mem;
+
+static tree_node * callout_mem_tree = NULL;
+static int	callout_mem_count = 0;
+static int	callout_mem_dirty = 0;
+static time_t	callout_mem_dirty_since;
+static pid_t	callout_mem_pid = 0;	/* process owning the dirty records */
+
+
+/* Find a record in the tree. The type (the first letter of "domain" or
+"address") is the first character of the tree key, since the database keys of
+the two types cannot be told apart.
+
+Returns:   a copy of the record, or NULL
+*/
+
+static dbdata_callout_cache *
+callout_mem_read(const uschar * key, const uschar * type, int * length)
+{
+tree_node * node;
+callout_mem * m;
+dbdata_callout_cache * rec;
+
+if (!callout_mem_tree) return NULL;
+if (!(node = tree_search(callout_mem_tree, string_sprintf("%c%s", *type, key))))
+  return NULL;
+m = node->data.ptr;
+rec = store_get(sizeof(dbdata_callout_cache), FALSE);
+memcpy(rec, &m->record, m->length);
+*length = m->length;
+HDEBUG(D_verify)
+  debug_printf_indent("callout cache: %s record for %s held in process\n", type, key);
+return rec;
+}
+
+
+/* Add or update a record in the tree.
+
+Returns:  TRUE if the record is now held; FALSE if the tree is full
+*/
+
+static BOOL
+callout_mem_save(const uschar * key, const uschar * type, const void * rec,
+  int length, BOOL dirty)
+{
+uschar * name = string_sprintf("%c%s", *type, key);
+tree_node * node;
+callout_mem * m;
+
+if (length > sizeof(dbdata_callout_cache)) return FALSE;
+if ((node = tree_search(callout_mem_tree, name)))
+  m = node->data.ptr;
+else
+  {
+  if (callout_mem_count >= CALLOUT_MEM_MAX) return FALSE;
+  node = store_get_perm(sizeof(tree_node) + Ustrlen(name), is_tainted(name));
+  Ustrcpy(node->name, name);
+  node->data.ptr = m = store_get_perm(sizeof(callout_mem), FALSE);
+  m->dirty = FALSE;
+  (void)tree_insertnode(&callout_mem_tree, node);
+  callout_mem_count++;
+  }
+
+memcpy(&m->record, rec, length);
+m->length = length;
+if (dirty && !m->dirty)
+  {
+  if (callout_mem_dirty++ == 0 || callout_mem_pid != getpid())
+    {
+    callout_mem_dirty_since = time(NULL);
+    callout_mem_pid = getpid();
+    }
+  m->dirty = TRUE;
+  }
+return TRUE;
+}
+
+
+static void
+callout_mem_write(uschar * name, uschar * data, void * ctx)
+{
+callout_mem * m = (callout_mem *)data;
+
+if (!m->dirty) return;
+m->dirty = FALSE;
+(void)dbfn_write((open_db *)ctx, name+1, &m->record, m->length);
+}
+
+
+/* Write the dirty records to the hints database in one go. A forked process
+leaves them to the process that made them.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+void
+callout_cache_flush(void)
+{
+open_db dbblock, * dbm_file;
+
+if (!callout_mem_dirty || callout_mem_pid != getpid()) return;
+if ((dbm_file = dbfn_open(US"callout", O_RDWR|O_CREAT, &dbblock, FALSE, TRUE)))
+  {
+  tree_walk(callout_mem_tree, callout_mem_write, dbm_file);
+  dbfn_close(dbm_file);
+  HDEBUG(D_verify)
+    debug_printf_indent("callout cache: wrote %d held records\n", callout_mem_dirty);
+  }
+else
+  HDEBUG(D_verify) debug_printf_indent("callout cache: not available\n");
+callout_mem_dirty = 0;
+}
 
 
 
@@ -27,10 +193,12 @@ static uschar cutthrough_response(client_conn_ctx *, char, uschar **, int);
 *          Retrieve a callout cache record       *
 *************************************************/
 
-/* If a record exists, check whether it has expired.
+/* If a record exists, check whether it has expired. The in-process tier is
+tried first; the hints database is opened, for reading, only if that fails.
 
 Arguments:
-  dbm_file          an open hints file
+  dbm_file          pointer to an open hints file, or to NULL
+  dbblock           block for opening the hints file
   key               the record key
   type              "address" or "domain"
   positive_expire   expire time for positive records
@@ -40,18 +208,28 @@ Returns:            the cache record if a non-expired one exists, else NULL
 */
 
 static dbdata_callout_cache *
-get_callout_cache_record(open_db *dbm_file, const uschar *key, uschar *type,
-  int positive_expire, int negative_expire)
+get_callout_cache_record(open_db ** dbm_file, open_db * dbblock,
+  const uschar *key, uschar *type, int positive_expire, int negative_expire)
 {
 BOOL negative;
 int length, expire;
 time_t now;
 dbdata_callout_cache *cache_record;
 
-if (!(cache_record = dbfn_read_with_length(dbm_file, key, &length)))
+if (!(cache_record = callout_mem_read(key, type, &length)))
   {
-  HDEBUG(D_verify) debug_printf_indent("callout cache: no %s record found for %s\n", type, key);
-  return NULL;
+  if (  !*dbm_file
+     && !(*dbm_file = dbfn_open(US"callout", O_RDONLY, dbblock, FALSE, TRUE)))
+    {
+    HDEBUG(D_verify) debug_printf_indent("callout cache: not available\n");
+    return NULL;
+    }
+  if (!(cache_record = dbfn_read_with_length(*dbm_file, key, &length)))
+    {
+    HDEBUG(D_verify) debug_printf_indent("callout cache: no %s record found for %s\n", type, key);
+    return NULL;
+    }
+  (void) callout_mem_save(key, type, cache_record, length, FALSE);
   }
 
 /* We treat a record as "negative" if its result field is not positive, or if
@@ -113,24 +291,21 @@ int options = *opt_ptr;
 open_db dbblock;
 open_db *dbm_file = NULL;
 
-/* Open the callout cache database, it it exists, for reading only at this
-stage, unless caching has been disabled. */
+/* Look in the callout cache, unless caching has been disabled. The database,
+if it exists, is opened for reading only at this stage, and only when the
+records are not already held by this process. */
 
 if (options & vopt_callout_no_cache)
   {
   HDEBUG(D_verify) debug_printf_indent("callout cache: disabled by no_cache\n");
   }
-else if (!(dbm_file = dbfn_open(US"callout", O_RDWR, &dbblock, FALSE, TRUE)))
-  {
-  HDEBUG(D_verify) debug_printf_indent("callout cache: not available\n");
-  }
 else
   {
   /* If a cache database is available see if we can avoid the need to do an
   actual callout by making use of previously-obtained data. */
 
   dbdata_callout_cache_address * cache_address_record;
-  dbdata_callout_cache * cache_record = get_callout_cache_record(dbm_file,
+  dbdata_callout_cache * cache_record = get_callout_cache_record(&dbm_file, &dbblock,
       addr->domain, US"domain",
       callout_cache_domain_positive_expire, callout_cache_domain_negative_expire);
 
@@ -159,7 +334,7 @@ else
       addr->user_message = US"(result of an earlier callout reused).";
       *yield = FAIL;
       *failure_ptr = US"mail";
-      dbfn_close(dbm_file);
+      if (dbm_file) dbfn_close(dbm_file);
       return TRUE;
       }
 
@@ -176,7 +351,7 @@ else
 	HDEBUG(D_verify)
 	  debug_printf_indent("callout cache: domain accepts random addresses\n");
 	*failure_ptr = US"random";
-	dbfn_close(dbm_file);
+	if (dbm_file) dbfn_close(dbm_file);
 	return TRUE;     /* Default yield is OK */
 
       case ccache_reject:
@@ -191,7 +366,7 @@ else
 	HDEBUG(D_verify)
 	  debug_printf_indent("callout cache: need to check random address handling "
 	    "(not cached or cache expired)\n");
-	dbfn_close(dbm_file);
+	if (dbm_file) dbfn_close(dbm_file);
 	return FALSE;
       }
 
@@ -212,7 +387,7 @@ else
 	*failure_ptr = US"postmaster";
 	setflag(addr, af_verify_pmfail);
 	addr->user_message = US"(result of earlier verification reused).";
-	dbfn_close(dbm_file);
+	if (dbm_file) dbfn_close(dbm_file);
 	return TRUE;
 	}
       if (cache_record->postmaster_result == ccache_unknown)
@@ -220,7 +395,7 @@ else
 	HDEBUG(D_verify)
 	  debug_printf_indent("callout cache: need to check RCPT "
 	    "TO:<postmaster@domain> (not cached or cache expired)\n");
-	dbfn_close(dbm_file);
+	if (dbm_file) dbfn_close(dbm_file);
 	return FALSE;
 	}
 
@@ -243,10 +418,10 @@ else
   */
 
   if (!(cache_address_record = (dbdata_callout_cache_address *)
-    get_callout_cache_record(dbm_file, address_key, US"address",
+    get_callout_cache_record(&dbm_file, &dbblock, address_key, US"address",
       callout_cache_positive_expire, callout_cache_negative_expire)))
     {
-    dbfn_close(dbm_file);
+    if (dbm_file) dbfn_close(dbm_file);
     return FALSE;
     }
 
@@ -266,13 +441,53 @@ else
 
   /* Close the cache database while we actually do the callout for real. */
 
-  dbfn_close(dbm_file);
+  if (dbm_file) dbfn_close(dbm_file);
   return TRUE;
   }
 return FALSE;
 }
 
 
+/* Store one callout cache record. When writes are batched it is only held in
+this process for now; otherwise it is written to the hints database at once,
+which is opened if need be.
+
+Arguments:
+  dbm_file    pointer to an open hints file, or to NULL
+  dbblock     block for opening the hints file
+  key         the record key
+  type        "address" or "domain"
+  rec         the record
+  length      its length
+
+Returns:      TRUE if the record was stored
+*/
+
+static BOOL
+callout_cache_put(open_db ** dbm_file, open_db * dbblock, const uschar * key,
+  const uschar * type, void * rec, int length)
+{
+if (callout_cache_write_batch > 0)
+  {
+  ((dbdata_generic *)rec)->time_stamp = time(NULL);
+  if (callout_mem_save(key, type, rec, length, TRUE))
+    {
+    if (  callout_mem_dirty >= callout_cache_write_batch
+       || time(NULL) - callout_mem_dirty_since >= CALLOUT_FLUSH_DELAY)
+      callout_cache_flush();
+    return TRUE;
+    }
+  }
+
+if (  !*dbm_file
+   && !(*dbm_file = dbfn_open(US"callout", O_RDWR|O_CREAT, dbblock, FALSE, TRUE)))
+  return FALSE;
+(void)dbfn_write(*dbm_file, key, rec, length);
+(void) callout_mem_save(key, type, rec, length, FALSE);
+return TRUE;
+}
+
+
 /* Write results to callout cache
 */
 static void
@@ -293,14 +508,13 @@ implying some kind of I/O error. We don't want to write the cache in that case.
 Otherwise the value is ccache_accept, ccache_reject, or ccache_reject_mfnull. */
 
 if (dom_rec->result != ccache_unknown)
-  if (!(dbm_file = dbfn_open(US"callout", O_RDWR|O_CREAT, &dbblock, FALSE, TRUE)))
+  if (!callout_cache_put(&dbm_file, &dbblock, domain, US"domain", dom_rec,
+      (int)sizeof(dbdata_callout_cache)))
     {
     HDEBUG(D_verify) debug_printf_indent("callout cache: not available\n");
     }
   else
     {
-    (void)dbfn_write(dbm_file, domain, dom_rec,
-      (int)sizeof(dbdata_callout_cache));
     HDEBUG(D_verify) debug_printf_indent("wrote callout cache domain record for %s:\n"
       "  result=%d postmaster=%d random=%d\n",
       domain,
@@ -313,44 +527,87 @@ if (dom_rec->result != ccache_unknown)
 is disabled. */
 
 if (done  &&  addr_rec->result != ccache_unknown)
-  {
-  if (!dbm_file)
-    dbm_file = dbfn_open(US"callout", O_RDWR|O_CREAT, &dbblock, FALSE, TRUE);
-  if (!dbm_file)
+  if (!callout_cache_put(&dbm_file, &dbblock, address_key, US"address",
+      addr_rec, (int)sizeof(dbdata_callout_cache_address)))
     {
     HDEBUG(D_verify) debug_printf_indent("no callout cache available\n");
     }
   else
     {
-    (void)dbfn_write(dbm_file, address_key, addr_rec,
-      (int)sizeof(dbdata_callout_cache_address));
     HDEBUG(D_verify) debug_printf_indent("wrote %s callout cache address record for %s\n",
       addr_rec->result == ccache_accept ? "positive" : "negative",
       address_key);
     }
-  }
 
 if (dbm_file) dbfn_close(dbm_file);
 }
 
 
-/* Cutthrough-multi.  If the existing cached cutthrough connection matches
-the one we would make for a subsequent recipient, use it.  Send the RCPT TO
-and check the result, nonpipelined as it may be wanted immediately for
-recipient-verification.
+/* Exchange the cutthrough connection in use with a parked one.  The
+message-wide state stays where it is. */
 
-It seems simpler to deal with this case separately from the main callout loop.
-We will need to remember it has sent, or not, so that rcpt-acl tail code
-can do it there for the non-rcpt-verify case.  For this we keep an addresscount.
+static void
+cutthrough_swap(int i)
+{
+cut_t t = cutthrough;
+uschar * b = ctctx.outblock.buffer, * p = ctctx.outblock.ptr;
+
+cutthrough = cutthrough_more[i].ct;
+cutthrough.callout_hold_only = t.callout_hold_only;
+cutthrough.delivery = t.delivery;
+cutthrough.defer_pass = t.defer_pass;
+cutthrough.partial = t.partial;
+cutthrough.nrcpt = t.nrcpt;
+cutthrough_more[i].ct = t;
+
+ctctx.outblock.buffer = cutthrough_more[i].buffer;
+ctctx.outblock.ptr = cutthrough_more[i].ptr;
+cutthrough_more[i].buffer = b;
+cutthrough_more[i].ptr = p;
+}
 
-Return: TRUE for a definitive result for the recipient
-*/
-static int
-cutthrough_multi(address_item * addr, host_item * host_list,
-  transport_feedback * tf, int * yield)
+
+/* Park the cutthrough connection in use, leaving the slot free for a
+connection to another destination. */
+
+static void
+cutthrough_park(void)
 {
-BOOL done = FALSE;
+int i = cutthrough_nmore++;
+
+if (!cutthrough_more[i].buffer)
+  cutthrough_more[i].buffer = cutthrough_more[i].ptr = ctbuffer_more[i];
+cutthrough_more[i].ct = (cut_t) {.cctx = {.sock = -1}};
+cutthrough_swap(i);
+HDEBUG(D_acl) debug_printf_indent("cutthrough: parked conn to %s, %d held\n",
+  cutthrough_more[i].ct.host.address, cutthrough_nmore + 1);
+}
+
 
+/* Close any parked cutthrough connections */
+
+static void
+cutthrough_close_more(const uschar * why)
+{
+int n = cutthrough_nmore;
+
+cutthrough_nmore = 0;		/* avoid recursion via read timeout */
+for (int i = 0; i < n; i++)
+  {
+  cutthrough_swap(i);
+  close_cutthrough_connection(why);
+  cutthrough_swap(i);
+  }
+}
+
+
+/* Check whether the cutthrough connection in use is the one we would make
+for the given recipient and its hosts. */
+
+static BOOL
+cutthrough_matches(address_item * addr, host_item * host_list,
+  transport_feedback * tf)
+{
 if (addr->transport == cutthrough.addr.transport)
   for (host_item * host = host_list; host; host = host->next)
     if (Ustrcmp(host->address, cutthrough.host.address) == 0)
@@ -376,75 +633,248 @@ if (addr->transport == cutthrough.addr.transport)
 
       smtp_port_for_connect(host, port);
 
-      if (  (  interface == cutthrough.interface
-	    || (  interface
-	       && cutthrough.interface
-	       && Ustrcmp(interface, cutthrough.interface) == 0
-	    )  )
-	 && host->port == cutthrough.host.port
-	 )
-	{
-	uschar * resp = NULL;
+      return (  interface == cutthrough.interface
+	     || (  interface
+		&& cutthrough.interface
+		&& Ustrcmp(interface, cutthrough.interface) == 0
+	     )  )
+	  && host->port == cutthrough.host.port;
+      }
+return FALSE;
+}
 
-	/* Match!  Send the RCPT TO, set done from the response */
-	done =
-	     smtp_write_command(&ctctx, SCMD_FLUSH, "RCPT TO:<%.1000s>\r\n",
-	      transport_rcpt_address(addr,
-		 addr->transport->rcpt_include_affixes)) >= 0
-	  && cutthrough_response(&cutthrough.cctx, '2', &resp,
-	      CUTTHROUGH_DATA_TIMEOUT) == '2';
 
-	/* This would go horribly wrong if a callout fail was ignored by ACL.
-	We punt by abandoning cutthrough on a reject, like the
-	first-rcpt does. */
+/* Cutthrough-multi.  If the existing cached cutthrough connection matches
+the one we would make for a subsequent recipient, use it.  Send the RCPT TO
+and check the result, nonpipelined as it may be wanted immediately for
+recipient-verification.
 
-	if (done)
-	  {
-	  address_item * na = store_get(sizeof(address_item), FALSE);
-	  *na = cutthrough.addr;
-	  cutthrough.addr = *addr;
-	  cutthrough.addr.host_used = &cutthrough.host;
-	  cutthrough.addr.next = na;
+It seems simpler to deal with this case separately from the main callout loop.
+We will need to remember it has sent, or not, so that rcpt-acl tail code
+can do it there for the non-rcpt-verify case.  For this we keep an addresscount.
 
-	  cutthrough.nrcpt++;
-	  }
-	else
-	  {
-	  cancel_cutthrough_connection(TRUE, US"recipient rejected");
-	  if (!resp || errno == ETIMEDOUT)
-	    {
-	    HDEBUG(D_verify) debug_printf("SMTP timeout\n");
-	    }
-	  else if (errno == 0)
-	    {
-	    if (*resp == 0)
-	      Ustrcpy(resp, US"connection dropped");
+With cutthrough_max_connections above one, a connection parked earlier for
+another destination may match instead; if none do and there is room, the one
+in use is parked so that the caller makes a new one for this recipient.
 
-	    addr->message =
-	      string_sprintf("response to \"%s\" was: %s",
-		big_buffer, string_printing(resp));
+Return: TRUE for a definitive result for the recipient
+*/
+static int
+cutthrough_multi(address_item * addr, host_item * host_list,
+  transport_feedback * tf, int * yield)
+{
+BOOL done = FALSE, match = cutthrough_matches(addr, host_list, tf);
 
-	    addr->user_message =
-	      string_sprintf("Callout verification failed:\n%s", resp);
+for (int i = 0; !match && i < cutthrough_nmore; i++)
+  {
+  cutthrough_swap(i);
+  if (!(match = cutthrough_matches(addr, host_list, tf)))
+    cutthrough_swap(i);
+  }
 
-	    /* Hard rejection ends the process */
+if (match)
+  {
+  uschar * resp = NULL;
 
-	    if (resp[0] == '5')   /* Address rejected */
-	      {
-	      *yield = FAIL;
-	      done = TRUE;
-	      }
-	    }
-	  }
+  /* Match!  Send the RCPT TO, set done from the response */
+  done =
+       smtp_write_command(&ctctx, SCMD_FLUSH, "RCPT TO:<%.1000s>\r\n",
+	transport_rcpt_address(addr,
+	   addr->transport->rcpt_include_affixes)) >= 0
+    && cutthrough_response(&cutthrough.cctx, '2', &resp,
+	CUTTHROUGH_DATA_TIMEOUT) == '2';
+
+  /* This would go horribly wrong if a callout fail was ignored by ACL.
+  We punt by abandoning cutthrough on a reject, like the
+  first-rcpt does. */
+
+  if (done)
+    {
+    address_item * na = store_get(sizeof(address_item), FALSE);
+    *na = cutthrough.addr;
+    cutthrough.addr = *addr;
+    addr_cold_share(addr);
+    cutthrough.addr.host_used = &cutthrough.host;
+    cutthrough.addr.next = na;
+
+    cutthrough.nrcpt++;
+    }
+  else
+    {
+    cancel_cutthrough_connection(TRUE, US"recipient rejected");
+    if (!resp || errno == ETIMEDOUT)
+      {
+      HDEBUG(D_verify) debug_printf("SMTP timeout\n");
+      }
+    else if (errno == 0)
+      {
+      if (*resp == 0)
+	Ustrcpy(resp, US"connection dropped");
+
+      addr->message =
+	string_sprintf("response to \"%s\" was: %s",
+	  big_buffer, string_printing(resp));
+
+      addr->user_message =
+	string_sprintf("Callout verification failed:\n%s", resp);
+
+      /* Hard rejection ends the process */
+
+      if (resp[0] == '5')   /* Address rejected */
+	{
+	*yield = FAIL;
+	done = TRUE;
 	}
-      break;	/* host_list */
       }
+    }
+  }
+else if (  cutthrough.delivery
+	&& cutthrough_nmore + 1 < cutthrough_max_connections
+	&& cutthrough_nmore + 1 < CUTTHROUGH_MAX_CONNS)
+  {
+  cutthrough_park();
+  return FALSE;
+  }
+
 if (!done)
   cancel_cutthrough_connection(TRUE, US"incompatible connection");
 return done;
 }
 
 
+
+/*************************************************
+*       Close a kept callout connection          *
+*************************************************/
+
+/* Called when a kept connection does not suit the next callout, when it has
+been idle too long, and at the end of a process or prefork worker session.
+
+Arguments:  none
+Returns:    nothing
+*/
+
+void
+callout_kept_close(void)
+{
+smtp_context * sx = callout_kept.sx;
+
+if (!callout_kept.open) return;
+callout_kept.open = FALSE;
+if (callout_kept.pid != getpid()) return;	/* the parent's connection */
+
+HDEBUG(D_verify) debug_printf_indent("closing kept callout connection\n");
+if (smtp_write_command(sx, SCMD_FLUSH, "QUIT\r\n") != -1)
+  smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2', 1);
+#ifndef DISABLE_TLS
+if (sx->cctx.tls_ctx)
+  {
+  tls_close(sx->cctx.tls_ctx, TLS_SHUTDOWN_NOWAIT);
+  sx->cctx.tls_ctx = NULL;
+  }
+#endif
+HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP(close)>>\n");
+(void)close(sx->cctx.sock);
+sx->cctx.sock = -1;
+#ifndef DISABLE_EVENT
+(void) event_raise(sx->conn_args.tblock->event_action, US"tcp:close", NULL);
+#endif
+}
+
+
+/* Check whether the kept connection is to the host a callout is about to use,
+and if so, get it ready for MAIL with an RSET. Otherwise close it.
+
+Arguments:
+  key       transport, host address, port and interface of the callout
+  host      the host
+  port      the port
+  timeout   command timeout
+
+Returns:    TRUE if the kept connection can be used
+*/
+
+static BOOL
+callout_kept_resume(const uschar * key, host_item * host, int port, int timeout)
+{
+smtp_context * sx = callout_kept.sx;
+
+if (!callout_kept.open) return FALSE;
+if (callout_kept.pid != getpid())
+  {
+  callout_kept.open = FALSE;
+  return FALSE;
+  }
+if (  Ustrcmp(callout_kept.key, key) != 0
+   || time(NULL) - callout_kept.last_used > callout_keep_idle)
+  {
+  callout_kept_close();
+  return FALSE;
+  }
+
+if (  smtp_write_command(sx, SCMD_FLUSH, "RSET\r\n") < 0
+   || !smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2', timeout))
+  {
+  HDEBUG(D_verify) debug_printf_indent("kept callout connection failed RSET\n");
+  callout_kept.open = FALSE;
+#ifndef DISABLE_TLS
+  if (sx->cctx.tls_ctx)
+    {
+    tls_close(sx->cctx.tls_ctx, TLS_NO_SHUTDOWN);
+    sx->cctx.tls_ctx = NULL;
+    }
+#endif
+  (void)close(sx->cctx.sock);
+  sx->cctx.sock = -1;
+  return FALSE;
+  }
+
+/* Put back what smtp_setup_conn() would have set */
+
+callout_kept.open = FALSE;
+smtp_peer_options = callout_kept.peer_options;
+sending_ip_address = string_copy(callout_kept.sending_ip);
+sending_port = callout_kept.sending_port;
+callout_address = string_sprintf("[%s]:%d", host->address, port);
+HDEBUG(D_verify) debug_printf_indent("reusing kept callout connection to %s\n",
+  callout_address);
+return TRUE;
+}
+
+
+/* After a callout with a definite answer to RCPT, keep the connection instead of
+sending QUIT. Authenticated and LMTP connections are not kept.
+
+Arguments:
+  sx        the connection context; the kept one
+  key       as for callout_kept_resume()
+
+Returns:    TRUE if the connection was kept
+*/
+
+static BOOL
+callout_kept_save(smtp_context * sx, const uschar * key)
+{
+if (  sx != callout_kept.sx || !sx->send_quit || sx->cctx.sock < 0 || sx->lmtp
+   || client_authenticator
+   || Ustrlen(key) >= sizeof(callout_kept.key)
+   || !sending_ip_address
+   || Ustrlen(sending_ip_address) >= sizeof(callout_kept.sending_ip))
+  return FALSE;
+
+Ustrcpy(callout_kept.key, key);
+Ustrcpy(callout_kept.sending_ip, sending_ip_address);
+callout_kept.sending_port = sending_port;
+callout_kept.peer_options = smtp_peer_options;
+callout_kept.pid = getpid();
+callout_kept.last_used = time(NULL);
+callout_kept.open = TRUE;
+HDEBUG(D_verify) debug_printf_indent("keeping callout connection open\n");
+return TRUE;
+}
+
+
+
 /*************************************************
 *      Do callout verification for an address    *
 *************************************************/
@@ -612,6 +1042,8 @@ coding means skipping this whole loop and doing the append separately.  */
     int host_af;
     int port = 25;
     uschar * interface = NULL;  /* Outgoing interface to use; NULL => any */
+    uschar * keep_key = NULL;
+    BOOL reused = FALSE, keepable = FALSE;
 
     if (!host->address)
       {
@@ -651,8 +1083,32 @@ coding means skipping this whole loop and doing the append separately.  */
       log_write(0, LOG_MAIN|LOG_PANIC, "<%s>: %s", addr->address,
         addr->message);
 
-    if (!sx) sx = store_get(sizeof(*sx), TRUE);	/* tainted buffers */
-    memset(sx, 0, sizeof(*sx));
+    /* If callout connections are kept, use the permanent context, and the
+    open connection in it if that is to this host. Connections for cutthrough,
+    or held for it, are managed separately. */
+
+    if (callout_keep_idle > 0 && !cutthrough.delivery
+       && !(options & vopt_callout_hold))
+      {
+      int kport = host->port == PORT_NONE ? port : host->port;
+
+      keep_key = string_sprintf("%s %s %d %s", addr->transport->name,
+	host->address, kport, interface ? interface : US"");
+      if (!(reused = callout_kept_resume(keep_key, host, kport, callout)))
+	{
+	if (!callout_kept.sx)
+	  callout_kept.sx = store_get_perm(sizeof(smtp_context), TRUE);
+	memset(callout_kept.sx, 0, sizeof(smtp_context));
+	}
+      sx = callout_kept.sx;
+      }
+    else
+      {
+      callout_kept_close();
+      if (!sx || sx == callout_kept.sx)
+	sx = store_get(sizeof(*sx), TRUE);	/* tainted buffers */
+      memset(sx, 0, sizeof(*sx));
+      }
 
     sx->addrlist = sx->first_addr = addr;
     sx->conn_args.host = host;
@@ -674,7 +1130,14 @@ tls_retry_connection:
     SMTP command to send.  If we tried TLS but it failed, try again without
     if permitted */
 
-    yield = smtp_setup_conn(sx, FALSE);
+    if (reused)
+      {
+      reused = FALSE;			/* a retry makes a new connection */
+      sx->send_quit = TRUE;
+      yield = OK;
+      }
+    else
+      yield = smtp_setup_conn(sx, FALSE);
 #ifndef DISABLE_TLS
     if (  yield == DEFER
        && addr->basic_errno == ERRNO_TLSFAILURE
@@ -852,10 +1315,10 @@ tls_retry_connection:
 	{
 	case 0:  switch(addr->transport_return)	/* ok so far */
 		    {
-		    case PENDING_OK:  done = TRUE;
+		    case PENDING_OK:  done = keepable = TRUE;
 				      new_address_record.result = ccache_accept;
 				      break;
-		    case FAIL:	      done = TRUE;
+		    case FAIL:	      done = keepable = TRUE;
 				      yield = FAIL;
 				      *failure_ptr = US"recipient";
 				      new_address_record.result = ccache_reject;
@@ -1055,7 +1518,7 @@ no_conn:
       }
 
     if (  (cutthrough.delivery || options & vopt_callout_hold)
-       && rcpt_count == 1
+       && (rcpt_count == 1 || cutthrough_nmore > 0 && cutthrough.delivery)
        && done
        && yield == OK
        &&    (options & (vopt_callout_recipsender|vopt_callout_recippmaster|vopt_success_on_redirect))
@@ -1074,7 +1537,7 @@ no_conn:
       cutthrough.is_tls =	tls_out.active.sock >= 0;
       /* We assume no buffer in use in the outblock */
       cutthrough.cctx =		sx->cctx;
-      cutthrough.nrcpt =	1;
+      cutthrough.nrcpt =	cutthrough_nmore ? cutthrough.nrcpt + 1 : 1;
       cutthrough.transport =	addr->transport->name;
       cutthrough.interface =	interface;
       cutthrough.snd_port =	sending_port;
@@ -1098,9 +1561,9 @@ no_conn:
 	   caddr = caddr->parent, parent = parent->parent)
         *(caddr->parent = store_get(sizeof(address_item), FALSE)) = *parent;
 
-      ctctx.outblock.buffer = ctbuffer;
+      if (!ctctx.outblock.buffer) ctctx.outblock.buffer = ctbuffer;
       ctctx.outblock.buffersize = sizeof(ctbuffer);
-      ctctx.outblock.ptr = ctbuffer;
+      ctctx.outblock.ptr = ctctx.outblock.buffer;
       /* ctctx.outblock.cmd_count = 0; ctctx.outblock.authenticating = FALSE; */
       ctctx.outblock.cctx = &cutthrough.cctx;
       }
@@ -1109,26 +1572,31 @@ no_conn:
       /* Ensure no cutthrough on multiple verifies that were incompatible */
       if (options & vopt_callout_recipsender)
         cancel_cutthrough_connection(TRUE, US"not usable for cutthrough");
-      if (sx->send_quit)
-	if (smtp_write_command(sx, SCMD_FLUSH, "QUIT\r\n") != -1)
-	  /* Wait a short time for response, and discard it */
-	  smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2', 1);
-
-      if (sx->cctx.sock >= 0)
+      if (done && keepable && keep_key && callout_kept_save(sx, keep_key))
+	;
+      else
 	{
-#ifndef DISABLE_TLS
-	if (sx->cctx.tls_ctx)
+	if (sx->send_quit)
+	  if (smtp_write_command(sx, SCMD_FLUSH, "QUIT\r\n") != -1)
+	    /* Wait a short time for response, and discard it */
+	    smtp_read_response(sx, sx->buffer, sizeof(sx->buffer), '2', 1);
+
+	if (sx->cctx.sock >= 0)
 	  {
-	  tls_close(sx->cctx.tls_ctx, TLS_SHUTDOWN_NOWAIT);
-	  sx->cctx.tls_ctx = NULL;
-	  }
+#ifndef DISABLE_TLS
+	  if (sx->cctx.tls_ctx)
+	    {
+	    tls_close(sx->cctx.tls_ctx, TLS_SHUTDOWN_NOWAIT);
+	    sx->cctx.tls_ctx = NULL;
+	    }
 #endif
-	HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP(close)>>\n");
-	(void)close(sx->cctx.sock);
-	sx->cctx.sock = -1;
+	  HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP(close)>>\n");
+	  (void)close(sx->cctx.sock);
+	  sx->cctx.sock = -1;
 #ifndef DISABLE_EVENT
-	(void) event_raise(addr->transport->event_action, US"tcp:close", NULL);
+	  (void) event_raise(addr->transport->event_action, US"tcp:close", NULL);
 #endif
+	  }
 	}
       }
 
@@ -1147,6 +1615,12 @@ if (!(options & vopt_callout_no_cache))
   cache_callout_write(&new_domain_record, addr->domain,
     done, &new_address_record, address_key);
 
+/* Connections parked by cutthrough_multi() are no use unless this recipient
+got one of its own. */
+
+if (cutthrough_nmore && cutthrough.cctx.sock < 0)
+  cancel_cutthrough_connection(TRUE, US"no connection for recipient");
+
 /* Failure to connect to any host, or any response other than 2xx or 5xx is a
 temporary error. If there was only one host, and a response was received, leave
 it alone if supplying details. Otherwise, give a generic response. */
@@ -1200,6 +1674,7 @@ int rc;
 get rewritten. */
 
 addr2 = *addr;
+addr_cold_share(addr);
 HDEBUG(D_acl) debug_printf_indent("----------- %s cutthrough setup ------------\n",
   rcpt_count > 1 ? "more" : "start");
 rc = verify_address(&addr2, NULL,
@@ -1268,11 +1743,38 @@ return FALSE;
 void
 cutthrough_data_puts(uschar * cp, int n)
 {
-if (cutthrough.delivery) (void) cutthrough_puts(cp, n);
+if (cutthrough.delivery)
+  {
+  for (int i = 0; i < cutthrough_nmore; i++)
+    {
+    cutthrough_swap(i);
+    (void) cutthrough_puts(cp, n);
+    cutthrough_swap(i);
+    }
+  (void) cutthrough_puts(cp, n);
+  }
 return;
 }
 
 
+/* Run a function for each parked cutthrough connection, and then the one in
+use.  Return FALSE if any call did. */
+
+static BOOL
+cutthrough_each(BOOL (*fn)(void))
+{
+BOOL yield = TRUE;
+
+for (int i = 0; i < cutthrough_nmore; i++)
+  {
+  cutthrough_swap(i);
+  if (!fn()) yield = FALSE;
+  cutthrough_swap(i);
+  }
+return fn() && yield;
+}
+
+
 static BOOL
 _cutthrough_flush_send(void)
 {
@@ -1309,9 +1811,13 @@ cutthrough_data_puts(US"\r\n", 2);
 }
 
 
-/* Get and check response from cutthrough target */
+/* Get and check response from cutthrough target, without acting on a
+failure.  Return the first response character (zero if nothing was read),
+and set *okp for the expected class. */
+
 static uschar
-cutthrough_response(client_conn_ctx * cctx, char expect, uschar ** copy, int timeout)
+_cutthrough_response(client_conn_ctx * cctx, char expect, uschar ** copy,
+  int timeout, BOOL * okp)
 {
 smtp_context sx = {0};
 uschar inbuffer[4096];
@@ -1322,8 +1828,9 @@ sx.inblock.buffersize = sizeof(inbuffer);
 sx.inblock.ptr = inbuffer;
 sx.inblock.ptrend = inbuffer;
 sx.inblock.cctx = cctx;
-if(!smtp_read_response(&sx, responsebuffer, sizeof(responsebuffer), expect, timeout))
-  cancel_cutthrough_connection(TRUE, US"target timeout on read");
+*responsebuffer = '\0';
+*okp = smtp_read_response(&sx, responsebuffer, sizeof(responsebuffer),
+			  expect, timeout);
 
 if(copy)
   {
@@ -1339,22 +1846,49 @@ return responsebuffer[0];
 }
 
 
-/* Negotiate dataphase with the cutthrough target, returning success boolean */
-BOOL
-cutthrough_predata(void)
+/* Get and check response from cutthrough target */
+static uschar
+cutthrough_response(client_conn_ctx * cctx, char expect, uschar ** copy, int timeout)
 {
-if(cutthrough.cctx.sock < 0 || cutthrough.callout_hold_only)
-  return FALSE;
+BOOL ok;
+uschar res = _cutthrough_response(cctx, expect, copy, timeout, &ok);
+
+if (!ok)
+  cancel_cutthrough_connection(TRUE, US"target timeout on read");
+return res;
+}
+
 
+static BOOL
+cutthrough_predata_send(void)
+{
 HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP>> DATA\n");
 cutthrough_puts(US"DATA\r\n", 6);
-cutthrough_flush_send();
+return cutthrough_flush_send();
+}
 
+static BOOL
+cutthrough_predata_response(void)
+{
 /* Assume nothing buffered.  If it was it gets ignored. */
 return cutthrough_response(&cutthrough.cctx, '3', NULL, CUTTHROUGH_DATA_TIMEOUT) == '3';
 }
 
 
+/* Negotiate dataphase with the cutthrough target(s), returning success
+boolean.  Where there are several the DATA goes to all before any response is
+awaited. */
+BOOL
+cutthrough_predata(void)
+{
+if(cutthrough.cctx.sock < 0 || cutthrough.callout_hold_only)
+  return FALSE;
+
+(void) cutthrough_each(cutthrough_predata_send);
+return cutthrough_each(cutthrough_predata_response);
+}
+
+
 /* tctx arg only to match write_chunk() */
 static BOOL
 cutthrough_write_chunk(transport_ctx * tctx, uschar * s, int len)
@@ -1370,17 +1904,11 @@ return TRUE;
 }
 
 
-/* Buffered send of headers.  Return success boolean. */
-/* Expands newlines to wire format (CR,NL).           */
-/* Also sends header-terminating blank line.          */
-BOOL
-cutthrough_headers_send(void)
+static BOOL
+cutthrough_headers_send_one(void)
 {
 transport_ctx tctx;
 
-if(cutthrough.cctx.sock < 0 || cutthrough.callout_hold_only)
-  return FALSE;
-
 /* We share a routine with the mainline transport to handle header add/remove/rewrites,
    but having a separate buffered-output function (for now)
 */
@@ -1402,6 +1930,19 @@ return TRUE;
 }
 
 
+/* Buffered send of headers.  Return success boolean. */
+/* Expands newlines to wire format (CR,NL).           */
+/* Also sends header-terminating blank line.          */
+/* Each cutthrough connection gets them as amended by its own transport. */
+BOOL
+cutthrough_headers_send(void)
+{
+if(cutthrough.cctx.sock < 0 || cutthrough.callout_hold_only)
+  return FALSE;
+return cutthrough_each(cutthrough_headers_send_one);
+}
+
+
 static void
 close_cutthrough_connection(const uschar * why)
 {
@@ -1413,7 +1954,7 @@ if(fd >= 0)
      conn before the final dot.
   */
   client_conn_ctx tmp_ctx = cutthrough.cctx;
-  ctctx.outblock.ptr = ctbuffer;
+  ctctx.outblock.ptr = ctctx.outblock.buffer;
   HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP>> QUIT\n");
   _cutthrough_puts(US"QUIT\r\n", 6);	/* avoid recursion */
   _cutthrough_flush_send();
@@ -1435,7 +1976,7 @@ if(fd >= 0)
   (void)close(fd);
   HDEBUG(D_acl) debug_printf_indent("----------- cutthrough shutdown (%s) ------------\n", why);
   }
-ctctx.outblock.ptr = ctbuffer;
+ctctx.outblock.ptr = ctctx.outblock.buffer;
 }
 
 void
@@ -1443,6 +1984,7 @@ cancel_cutthrough_connection(BOOL close_noncutthrough_verifies, const uschar * w
 {
 if (cutthrough.delivery || close_noncutthrough_verifies)
   close_cutthrough_connection(why);
+cutthrough_close_more(why);
 cutthrough.delivery = cutthrough.callout_hold_only = FALSE;
 }
 
@@ -1460,26 +2002,12 @@ cutthrough.delivery = cutthrough.callout_hold_only = FALSE;
 
 
 
-/* Have senders final-dot.  Send one to cutthrough target, and grab the response.
-   Log an OK response as a transmission.
-   Close the connection.
-   Return smtp response-class digit.
-*/
-uschar *
-cutthrough_finaldot(void)
-{
-uschar res;
-HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP>> .\n");
+/* Log the final response from the cutthrough connection in use against each
+of its recipients. */
 
-/* Assume data finshed with new-line */
-if(  !cutthrough_puts(US".", 1)
-  || !cutthrough_put_nl()
-  || !cutthrough_flush_send()
-  )
-  return cutthrough.addr.message;
-
-res = cutthrough_response(&cutthrough.cctx, '2', &cutthrough.addr.message,
-	CUTTHROUGH_DATA_TIMEOUT);
+static void
+cutthrough_log_response(uschar res)
+{
 for (address_item * addr = &cutthrough.addr; addr; addr = addr->next)
   {
   addr->message = cutthrough.addr.message;
@@ -1504,6 +2032,137 @@ for (address_item * addr = &cutthrough.addr; addr; addr = addr->next)
       break;
     }
   }
+}
+
+
+/* Record the recipients of the cutthrough connection in use in the journal
+file for the message, so that the delivery from spool of the others takes them
+as done.  The journal is opened on the first call. */
+
+static void
+cutthrough_journal(int * fdp)
+{
+if (*fdp < 0)
+  {
+  uschar * fname = spool_fname(US"input", message_subdir, message_id, US"-J");
+
+  if ((*fdp = Uopen(fname, O_WRONLY|O_APPEND|O_CREAT, SPOOL_MODE)) < 0)
+    {
+    log_write(0, LOG_MAIN|LOG_PANIC, "Couldn't open journal file %s: %s",
+      fname, strerror(errno));
+    return;
+    }
+  (void) exim_fchown(*fdp, exim_uid, exim_gid, fname);
+  }
+
+for (address_item * addr = &cutthrough.addr; addr; addr = addr->next)
+  {
+  address_item * top = addr;
+  uschar * s;
+  int len;
+
+  while (top->parent) top = top->parent;
+  s = string_sprintf("%.500s\n", top->address);
+  len = Ustrlen(s);
+  DEBUG(D_acl) debug_printf_indent("journalling %s", s);
+  if (write(*fdp, s, len) != len)
+    log_write(0, LOG_MAIN|LOG_PANIC, "failed to update journal for %s: %s",
+      top->address, strerror(errno));
+  }
+}
+
+
+/* Final dot for several cutthrough connections.  The dot goes to all before
+any response is awaited, so that the destinations work on the message
+together; a failure on one affects only that one.  If they all accept (or none
+do) the result is as for a single connection.  Otherwise the accepting ones'
+recipients are journalled and the partial flag set, for the message to be
+accepted and the rest delivered from spool. */
+
+static uschar *
+cutthrough_finaldot_multi(void)
+{
+int n = cutthrough_nmore, nok = 0, jfd = -1;
+uschar res[CUTTHROUGH_MAX_CONNS];
+uschar * okmsg = NULL, * tmpmsg = NULL, * permmsg = NULL;
+
+for (int i = 0; i <= n; i++)
+  {
+  if (i < n) cutthrough_swap(i);
+  HDEBUG(D_transport|D_acl|D_v)
+    debug_printf_indent("  SMTP>> . [%s]\n", cutthrough.host.address);
+  res[i] = _cutthrough_puts(US".\r\n", 3) && _cutthrough_flush_send();
+  if (i < n) cutthrough_swap(i);
+  }
+
+for (int i = 0; i <= n; i++)
+  {
+  BOOL ok;
+
+  if (i < n) cutthrough_swap(i);
+  if (!res[i] || !(res[i] = _cutthrough_response(&cutthrough.cctx, '2',
+		  &cutthrough.addr.message, CUTTHROUGH_DATA_TIMEOUT, &ok)))
+    cutthrough.addr.message = US"cutthrough connection failed";
+  cutthrough_log_response(res[i]);
+  switch (res[i])
+    {
+    case '2':	nok++; okmsg = cutthrough.addr.message; break;
+    case '5':	if (!permmsg) permmsg = cutthrough.addr.message; break;
+    default:	if (!tmpmsg) tmpmsg = cutthrough.addr.message; break;
+    }
+  if (i < n) cutthrough_swap(i);
+  }
+
+if (nok > 0 && nok <= n)
+  {
+  for (int i = 0; i <= n; i++) if (res[i] == '2')
+    {
+    if (i < n) cutthrough_swap(i);
+    cutthrough_journal(&jfd);
+    if (i < n) cutthrough_swap(i);
+    }
+  if (jfd >= 0)
+    {
+    if (EXIMfsync(jfd) < 0)
+      log_write(0, LOG_MAIN|LOG_PANIC, "failed to fsync journal: %s",
+	strerror(errno));
+    (void) close(jfd);
+    }
+  HDEBUG(D_acl) debug_printf_indent("cutthrough: %d of %d accepted;"
+    " spooling for the rest\n", nok, n + 1);
+  cutthrough.partial = TRUE;
+  }
+
+close_cutthrough_connection(US"dataphase done");
+cutthrough_close_more(US"dataphase done");
+return nok ? okmsg : tmpmsg ? tmpmsg : permmsg;
+}
+
+
+/* Have senders final-dot.  Send one to cutthrough target, and grab the response.
+   Log an OK response as a transmission.
+   Close the connection.
+   Return smtp response-class digit.
+*/
+uschar *
+cutthrough_finaldot(void)
+{
+uschar res;
+
+if (cutthrough_nmore) return cutthrough_finaldot_multi();
+
+HDEBUG(D_transport|D_acl|D_v) debug_printf_indent("  SMTP>> .\n");
+
+/* Assume data finshed with new-line */
+if(  !cutthrough_puts(US".", 1)
+  || !cutthrough_put_nl()
+  || !cutthrough_flush_send()
+  )
+  return cutthrough.addr.message;
+
+res = cutthrough_response(&cutthrough.cctx, '2', &cutthrough.addr.message,
+	CUTTHROUGH_DATA_TIMEOUT);
+cutthrough_log_response(res);
 return cutthrough.addr.message;
 }
 
@@ -1582,6 +2241,150 @@ va_end(ap);
 
 
 
+/*************************************************
+*        Shared cache of verification results    *
+*************************************************/
+
+/* When verify_cache_ttl is set, the outcome of a routing-only verification
+(one without a callout) is kept in the "verify" hints database, so that other
+processes verifying the same address with the same options need not run the
+routers again. The key is made from the address and the option bits; a result
+is used only if the configuration is unchanged. Deferrals are not recorded, nor
+are results for addresses that verification rewrote or that set router
+variables, since those also change things outside the result.
+
+The strings in the record are each a '+' or '-' for set or unset, followed by
+the value and a terminating zero. A record in which a string is not terminated
+before its end is treated as not found. */
+
+static uschar *
+verify_cache_key(const uschar * address, int options)
+{
+return string_sprintf("%c%x:%s", options & vopt_is_recipient ? 'R' : 'S',
+  options, address);
+}
+
+static gstring *
+vc_put_string(gstring * g, const uschar * s)
+{
+g = string_catn(g, s ? US"+" : US"-", 1);
+if (s) g = string_cat(g, s);
+return string_catn(g, US"", 1);
+}
+
+static const uschar *
+vc_get_string(const uschar * p, const uschar * end, uschar ** sp)
+{
+const uschar * nul;
+if (!p || p >= end || !(nul = memchr(p, 0, end - p))) return NULL;
+*sp = *p == '+' ? string_copy(p+1) : NULL;
+return nul + 1;
+}
+
+
+/* Take a verification result from the cache.
+
+Arguments:
+  vaddr      the address being verified; the result is copied into it
+  options    the verify option bits
+  rc         where to put the return code
+  routed     if not NULL, set TRUE if routing succeeded
+
+Returns:     TRUE if the result was found
+*/
+
+BOOL
+verify_cache_get(address_item * vaddr, int options, int * rc, BOOL * routed)
+{
+open_db dbblock, * dbm;
+dbdata_verify * rec;
+BOOL yield = FALSE;
+int len;
+
+if (verify_cache_ttl <= 0) return FALSE;
+if (!(dbm = dbfn_open(US"verify", O_RDONLY, &dbblock, FALSE, TRUE)))
+  return FALSE;
+
+if (  (rec = dbfn_read_with_length(dbm, verify_cache_key(vaddr->address, options),
+	&len))
+   && rec->expiry > time(NULL)
+   && rec->config_hash == config_hash)
+  {
+  const uschar * p = rec->data, * end = US rec + len;
+  uschar * message, * user_message, * address_data, * failure;
+
+  p = vc_get_string(p, end, &message);
+  p = vc_get_string(p, end, &user_message);
+  p = vc_get_string(p, end, &address_data);
+  if (vc_get_string(p, end, &failure))
+    {
+    vaddr->message = message;
+    vaddr->user_message = user_message;
+    vaddr->prop.address_data = address_data;
+    vaddr->basic_errno = rec->basic_errno;
+    if (rec->pass_message) setflag(vaddr, af_pass_message);
+    if (options & vopt_is_recipient) recipient_verify_failure = failure;
+    else sender_verify_failure = failure;
+    if (routed) *routed = rec->routed;
+    *rc = rec->rc;
+    yield = TRUE;
+    DEBUG(D_verify) debug_printf("verify result for %s from cache: %s\n",
+      vaddr->address, rc_names[*rc]);
+    }
+  }
+dbfn_close(dbm);
+return yield;
+}
+
+
+/* Record a verification result in the cache.
+
+Arguments:
+  address    the address as it was before verification
+  vaddr      the verified address
+  options    the verify option bits
+  rc         the result
+  routed     TRUE if routing succeeded
+*/
+
+void
+verify_cache_put(const uschar * address, const address_item * vaddr,
+  int options, int rc, BOOL routed)
+{
+open_db dbblock, * dbm;
+dbdata_verify * rec;
+gstring * g = NULL;
+int len;
+
+if (  verify_cache_ttl <= 0
+   || rc != OK && rc != FAIL
+   || Ustrcmp(address, vaddr->address) != 0
+   || vaddr->prop.variables)
+  return;
+
+g = vc_put_string(g, vaddr->message);
+g = vc_put_string(g, vaddr->user_message);
+g = vc_put_string(g, vaddr->prop.address_data);
+g = vc_put_string(g, options & vopt_is_recipient
+  ? recipient_verify_failure : sender_verify_failure);
+len = gstring_length(g);
+
+if (!(dbm = dbfn_open(US"verify", O_RDWR, &dbblock, TRUE, TRUE))) return;
+rec = store_get(sizeof(dbdata_verify) + len, FALSE);
+rec->expiry = time(NULL) + verify_cache_ttl;
+rec->config_hash = config_hash;
+rec->rc = rc;
+rec->basic_errno = vaddr->basic_errno;
+rec->routed = routed;
+rec->pass_message = testflag(vaddr, af_pass_message);
+memcpy(rec->data, g->s, len);
+(void) dbfn_write(dbm, verify_cache_key(address, options), rec,
+  sizeof(dbdata_verify) + len);
+dbfn_close(dbm);
+}
+
+
+
 /*************************************************
 *            Verify an email address             *
 *************************************************/
@@ -2158,7 +2961,7 @@ for (addr_list = addr_local, i = 0; i < 2; addr_list = addr_remote, i++)
     if (!testflag(addr, af_pfr))
       {
       tree_node *tnode;
-      if ((tnode = tree_search(tree_duplicates, addr->unique)))
+      if ((tnode = tree_hash_search(&tree_duplicates, addr->unique)))
         fprintf(fp, "   [duplicate, would not be delivered]");
       else tree_add_duplicate(addr->unique, addr);
       }
@@ -3415,21 +4218,16 @@ dbdata_callout_cache_address * cache_address_record;
 
 if (!pos_cache && !neg_cache)
   return FALSE;
-if (!(dbm_file = dbfn_open(US"callout", O_RDWR, &dbblock, FALSE, TRUE)))
-  {
-  HDEBUG(D_verify) debug_printf_indent("quota cache: not available\n");
-  return FALSE;
-  }
 if (!(cache_address_record = (dbdata_callout_cache_address *)
-    get_callout_cache_record(dbm_file, rcpt, US"address",
+    get_callout_cache_record(&dbm_file, &dbblock, rcpt, US"address",
       pos_cache, neg_cache)))
   {
-  dbfn_close(dbm_file);
+  if (dbm_file) dbfn_close(dbm_file);
   return FALSE;
   }
 if (cache_address_record->result == ccache_accept)
   *yield = OK;
-dbfn_close(dbm_file);
+if (dbm_file) dbfn_close(dbm_file);
 return TRUE;
 }
 
@@ -3443,20 +4241,19 @@ dbdata_callout_cache_address cache_address_record;
 
 if (!pos_cache && !neg_cache)
   return;
-if (!(dbm_file = dbfn_open(US"callout", O_RDWR|O_CREAT, &dbblock, FALSE, TRUE)))
+
+cache_address_record.result = yield == OK ? ccache_accept : ccache_reject;
+
+if (!callout_cache_put(&dbm_file, &dbblock, rcpt, US"address",
+    &cache_address_record, (int)sizeof(dbdata_callout_cache_address)))
   {
   HDEBUG(D_verify) debug_printf_indent("quota cache: not available\n");
   return;
   }
-
-cache_address_record.result = yield == OK ? ccache_accept : ccache_reject;
-
-(void)dbfn_write(dbm_file, rcpt, &cache_address_record,
-	(int)sizeof(dbdata_callout_cache_address));
 HDEBUG(D_verify) debug_printf_indent("wrote %s quota cache record for %s\n",
       yield == OK ? "positive" : "negative", rcpt);
 
-dbfn_close(dbm_file);
+if (dbm_file) dbfn_close(dbm_file);
 return;
 }
 
@@ -104,18 +104,42 @@ sub inc_message_header_linecount {
   open(my $out, '>:perlio', $name_out) or do { warn "write-open(${name_out}) failed: $!\n"; return -1 };
   my $seen = 0;
   my $lc;
-  foreach (<$in>) {
-    if ($seen) {
-      print {$out} $_;
-      next;
+  my $first = <$in>;
+  print {$out} $first if defined $first;
+  if (defined $first and $first =~ /-HB1$/) {
+    # binary format (spool_header_binary): after the first line, records of a
+    # four-byte big-endian length and data, the envelope ones being the lines
+    # of the text format, except that an ACL variable's value follows its line
+    local $/;
+    my $data = <$in>;
+    $data = '' unless defined $data;
+    my ($off, $is_value) = (0, 0);
+    while ($off + 4 <= length($data)) {
+      my $len = unpack('N', substr($data, $off, 4));
+      my $rec = substr($data, $off + 4, $len);
+      $off += 4 + $len;
+      if (!$seen and !$is_value and $rec =~ /^(-body_linecount\s+)(\d+)(\s*)$/) {
+        $lc = $2 + 1;
+        $rec = "${1}${lc}${3}";
+        $seen = 1;
+      }
+      $is_value = !$is_value && $rec =~ /^-?-acl[cm]?\s\S+\s\d+$/;
+      print {$out} pack('N', length($rec)), $rec;
     }
-    if (/^(-body_linecount\s+)(\d+)(\s*)$/) {
-      $lc = $2 + 1;
-      print {$out} "${1}${lc}${3}";
-      $seen = 1;
-      next;
+  } else {
+    foreach (<$in>) {
+      if ($seen) {
+        print {$out} $_;
+        next;
+      }
+      if (/^(-body_linecount\s+)(\d+)(\s*)$/) {
+        $lc = $2 + 1;
+        print {$out} "${1}${lc}${3}";
+        $seen = 1;
+        next;
+      }
+      print {$out} $_;
     }
-    print {$out} $_;
   }
   close($in) or do {
     warn "read-close(${msgid}-H) failed, assuming incomplete: $!\n";
@@ -33,6 +33,8 @@ ripped from the openssl ocsp and s_client utilities. */
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <utime.h>
 
@@ -943,6 +945,901 @@ nextinput:
 
 
 
+/*************************************************
+*                Load generation                 *
+*************************************************/
+
+/* With -load the client becomes a load generator. Rather than running one
+script, it runs many SMTP sessions over a number of concurrent connections.
+Each connection is handled by a separate process, which runs its sessions one
+after another. A session is either synthetic, built from the -m, -r, -s,
+-pipelining and -starttls options, or a replay of a captured session given with
+-replay.
+
+In a replay file each line, after the unescaping done for scripts, is sent to
+the server, and the responses to the commands in it are read before the next
+line is sent; a line holding several commands separated by \r\n is therefore
+pipelined. The message lines that follow a DATA command are sent without
+waiting, up to the terminating dot. Script lines that are not sent ("???",
+"+++" and the like) are ignored, so the scripts of the test suite can be
+replayed. If there are several replay files, sessions take them in turn.
+
+At the end, the rates of sessions and accepted messages, the errors, and the
+latency percentiles for each kind of command are written to stdout. The time
+for a command runs from the sending of the line that contains it to the end of
+its response. The times are kept in histograms with 16 buckets to each power
+of two microseconds, so the percentiles are good to about 6%. */
+
+enum { LV_CONNECT, LV_EHLO, LV_STARTTLS, LV_TLS, LV_AUTH, LV_MAIL, LV_RCPT,
+  LV_DATA, LV_DOT, LV_RSET, LV_QUIT, LV_OTHER, LV_COUNT };
+
+static const char * load_verb_names[] = {
+  "connect", "ehlo", "starttls", "tls", "auth", "mail", "rcpt", "data", "dot",
+  "rset", "quit", "other" };
+
+enum { LE_CONNECT, LE_TIMEOUT, LE_IO, LE_TLS, LE_4XX, LE_5XX, LE_COUNT };
+
+static const char * load_error_names[] = {
+  "connect", "timeout", "io", "tls", "4xx", "5xx" };
+
+#define LOAD_SUB	16		/* histogram buckets per power of two */
+#define LOAD_BUCKETS	(28 * LOAD_SUB)	/* up to about half an hour */
+#define LOAD_MAX_RCPTS	1000
+#define LOAD_MAX_REPLAY	32
+#define LOAD_MAX_WORKERS 1000
+
+typedef struct {
+  unsigned long	sessions;
+  unsigned long	failed;			/* sessions that did not complete */
+  unsigned long	messages;		/* given a 354 for DATA */
+  unsigned long	accepted;		/* given a 2xx for the dot */
+  unsigned long	errors[LE_COUNT];
+  unsigned long	count[LV_COUNT];
+  unsigned long	max[LV_COUNT];
+  unsigned long	hist[LV_COUNT][LOAD_BUCKETS];
+} load_stats;
+
+typedef struct {
+  char *	s;
+  int		len;
+  int		raw;			/* ">>> " line: no CRLF added */
+} load_line;
+
+typedef struct {
+  load_line *	lines;
+  int		count;
+} load_script;
+
+typedef struct {
+  int		sock;
+  int		tls;
+  int		pipelining;		/* advertised by the server */
+  int		starttls;
+#ifdef HAVE_OPENSSL
+  SSL *		ssl;
+#endif
+#ifdef HAVE_GNUTLS
+  gnutls_session_t session;
+#endif
+  int		len, off;		/* of the unused input */
+  char		buf[16384];
+  char		resp[2048];		/* the last response */
+} load_conn;
+
+static struct {
+  int		on;
+  int		workers;
+  long		sessions;
+  int		duration;
+  int		messages;
+  int		rcpts;
+  int		size_min, size_max;
+  int		pipelining;
+  int		starttls;
+  const char *	from;
+  const char *	domain;
+  const char *	helo;
+  const char *	replay[LOAD_MAX_REPLAY];
+  int		nreplay;
+} load = {
+  .workers = 10, .sessions = 100, .messages = 1, .rcpts = 1,
+  .size_min = 2048, .size_max = 2048,
+  .from = "load@client.test.ex", .domain = "test.ex", .helo = "client.test.ex" };
+
+static load_stats * lstats;
+static load_script load_scripts[LOAD_MAX_REPLAY];
+static struct addrinfo * load_addr, * load_iface;
+static int load_timeout;
+static int load_tls_on_connect;
+static char * load_body;
+static char load_cmds[(LOAD_MAX_RCPTS + 2) * 300];
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX * load_ctx;
+#endif
+
+
+/* Parse the options for load generation. Returns TRUE if one was taken. */
+
+static int
+load_option(int argc, char ** argv, int * argip)
+{
+const char * o = argv[*argip], * v = *argip + 1 < argc ? argv[*argip + 1] : NULL;
+
+if (strcmp(o, "-load") == 0) load.on = 1;
+else if (strcmp(o, "-pipelining") == 0) load.pipelining = 1;
+else if (strcmp(o, "-starttls") == 0) load.starttls = 1;
+else if (!v) return FALSE;
+else
+  {
+  if (strcmp(o, "-c") == 0) load.workers = atoi(v);
+  else if (strcmp(o, "-n") == 0) load.sessions = atol(v);
+  else if (strcmp(o, "-d") == 0) load.duration = atoi(v);
+  else if (strcmp(o, "-m") == 0) load.messages = atoi(v);
+  else if (strcmp(o, "-r") == 0) load.rcpts = atoi(v);
+  else if (strcmp(o, "-s") == 0)
+    {
+    const char * dash = strchr(v, '-');
+    load.size_min = atoi(v);
+    load.size_max = dash ? atoi(dash + 1) : load.size_min;
+    }
+  else if (strcmp(o, "-from") == 0) load.from = v;
+  else if (strcmp(o, "-domain") == 0) load.domain = v;
+  else if (strcmp(o, "-helo") == 0) load.helo = v;
+  else if (strcmp(o, "-replay") == 0 && load.nreplay < LOAD_MAX_REPLAY)
+    load.replay[load.nreplay++] = v;
+  else return FALSE;
+  (*argip)++;
+  }
+(*argip)++;
+return TRUE;
+}
+
+
+/* Read a replay file into store */
+
+static void
+load_read_script(const char * name, load_script * sc)
+{
+FILE * f = fopen(name, "r");
+char line[40 * 1024];
+int size = 0;
+
+if (!f)
+  {
+  fprintf(stderr, "Failed to open %s: %s\n", name, strerror(errno));
+  exit(96);
+  }
+while (fgets(line, sizeof(line) / 2, f))
+  {
+  int n = (int)strlen(line), raw = 0;
+  char * s = line;
+  load_line * l;
+
+  if (n > 0 && line[n-1] == '\n') line[--n] = 0;
+  if (n > 0 && line[n-1] == '\r') line[--n] = 0;
+  if (  strncmp(line, "???", 3) == 0 || strncmp(line, "+++", 3) == 0
+     || strncmp(line, "****", 4) == 0 || strncmp(line, "<<< ", 4) == 0)
+    continue;
+  if (strncmp(line, ">>> ", 4) == 0) { s += 4; n -= 4; raw = 1; }
+
+  if (sc->count >= size)
+    sc->lines = realloc(sc->lines, (size += 64) * sizeof(load_line));
+  /* unescape_buf() can move bytes beyond the end of the line, so it works on
+  the line buffer, which has room */
+
+  l = sc->lines + sc->count++;
+  l->len = unescape_buf(US s, n);
+  l->s = malloc(l->len + 1);
+  memcpy(l->s, s, l->len);
+  l->raw = raw;
+  }
+fclose(f);
+}
+
+
+static unsigned long
+load_usec(const struct timeval * t0)
+{
+struct timeval t;
+gettimeofday(&t, NULL);
+return (t.tv_sec - t0->tv_sec) * 1000000L + t.tv_usec - t0->tv_usec;
+}
+
+
+/* Count the time since t0 against a kind of command. Bucket b holds the values
+from load_bucket_value(b) up to that of the next bucket. */
+
+static void
+load_record(int verb, const struct timeval * t0)
+{
+unsigned long v = load_usec(t0);
+int b;
+
+if (v < LOAD_SUB)
+  b = (int)v;
+else
+  {
+  int e = 0;
+  for (unsigned long t = v; t >>= 1; ) e++;
+  b = (e - 3) * LOAD_SUB + (int)((v >> (e - 4)) & (LOAD_SUB - 1));
+  if (b >= LOAD_BUCKETS) b = LOAD_BUCKETS - 1;
+  }
+lstats->count[verb]++;
+lstats->hist[verb][b]++;
+if (v > lstats->max[verb]) lstats->max[verb] = v;
+}
+
+static unsigned long
+load_bucket_value(int b)
+{
+return b < LOAD_SUB
+  ? (unsigned long)b
+  : (unsigned long)(LOAD_SUB + b % LOAD_SUB) << (b / LOAD_SUB - 1);
+}
+
+
+static void
+load_io_error(void)
+{
+lstats->errors[errno == EAGAIN || errno == EWOULDBLOCK ? LE_TIMEOUT : LE_IO]++;
+}
+
+
+static int
+load_write(load_conn * c, const char * s, int len)
+{
+while (len > 0)
+  {
+  int rc;
+#ifdef HAVE_OPENSSL
+  if (c->tls) rc = SSL_write(c->ssl, s, len); else
+#endif
+#ifdef HAVE_GNUTLS
+  if (c->tls) rc = gnutls_record_send(c->session, s, len); else
+#endif
+  rc = write(c->sock, s, len);
+  if (rc <= 0) return -1;
+  s += rc;
+  len -= rc;
+  }
+return 0;
+}
+
+
+static int
+load_fill(load_conn * c)
+{
+int rc, room;
+
+if (c->off > 0)
+  {
+  memmove(c->buf, c->buf + c->off, c->len - c->off);
+  c->len -= c->off;
+  c->off = 0;
+  }
+if ((room = (int)sizeof(c->buf) - 1 - c->len) <= 0) return -1;
+
+errno = 0;
+#ifdef HAVE_OPENSSL
+if (c->tls) rc = SSL_read(c->ssl, c->buf + c->len, room); else
+#endif
+#ifdef HAVE_GNUTLS
+if (c->tls) rc = gnutls_record_recv(c->session, c->buf + c->len, room); else
+#endif
+rc = read(c->sock, c->buf + c->len, room);
+if (rc <= 0) return -1;
+c->len += rc;
+return rc;
+}
+
+
+/* Read a response, which may have several lines, keeping its text. Returns
+the code, or -1 (and counts the error) on a timeout, EOF or other failure. */
+
+static int
+load_response(load_conn * c)
+{
+int rlen = 0;
+
+for (;;)
+  {
+  char * line = c->buf + c->off, * nl;
+  int n;
+
+  if (!(nl = memchr(line, '\n', c->len - c->off)))
+    {
+    if (load_fill(c) < 0) { load_io_error(); return -1; }
+    continue;
+    }
+  n = nl - line + 1;
+  c->off += n;
+  if (rlen + n < (int)sizeof(c->resp))
+    {
+    memcpy(c->resp + rlen, line, n);
+    rlen += n;
+    }
+  c->resp[rlen] = 0;
+
+  if (  n >= 4 && isdigit((uschar)line[0]) && isdigit((uschar)line[1])
+     && isdigit((uschar)line[2]) && line[3] != '-')
+    return atoi(line);
+  }
+}
+
+
+/* Send some commands and collect their responses in codes[], timing each
+from the sending. Returns TRUE if all the responses were read. */
+
+static int
+load_exchange(load_conn * c, const char * s, int len, int n,
+  const int * verbs, int * codes)
+{
+struct timeval t0;
+
+gettimeofday(&t0, NULL);
+if (load_write(c, s, len) < 0)
+  {
+  load_io_error();
+  return FALSE;
+  }
+for (int i = 0; i < n; i++)
+  {
+  if ((codes[i] = load_response(c)) < 0) return FALSE;
+  load_record(verbs[i], &t0);
+  if (codes[i] >= 500) lstats->errors[LE_5XX]++;
+  else if (codes[i] >= 400) lstats->errors[LE_4XX]++;
+  }
+return TRUE;
+}
+
+
+static int
+load_command(load_conn * c, int verb, const char * fmt, ...)
+{
+char buf[1024];
+va_list ap;
+int len, code;
+
+va_start(ap, fmt);
+len = vsnprintf(buf, sizeof(buf) - 2, fmt, ap);
+va_end(ap);
+if (len > (int)sizeof(buf) - 3) len = sizeof(buf) - 3;
+memcpy(buf + len, "\r\n", 3);
+return load_exchange(c, buf, len + 2, 1, &verb, &code) ? code : -1;
+}
+
+
+static int
+load_verb(const char * s)
+{
+static const struct { const char * name; int verb; } verbs[] = {
+  { "EHLO", LV_EHLO }, { "HELO", LV_EHLO }, { "LHLO", LV_EHLO },
+  { "STARTTLS", LV_STARTTLS }, { "AUTH", LV_AUTH }, { "MAIL", LV_MAIL },
+  { "RCPT", LV_RCPT }, { "DATA", LV_DATA }, { "BDAT", LV_DATA },
+  { "RSET", LV_RSET }, { "QUIT", LV_QUIT } };
+
+for (int i = 0; i < (int)(sizeof(verbs)/sizeof(verbs[0])); i++)
+  if (strncasecmp(s, verbs[i].name, strlen(verbs[i].name)) == 0)
+    return verbs[i].verb;
+return LV_OTHER;
+}
+
+
+/* Start TLS on a connection; any unread clear text is discarded */
+
+static int
+load_tls_start(load_conn * c)
+{
+struct timeval t0;
+int ok = FALSE;
+
+gettimeofday(&t0, NULL);
+#ifdef HAVE_OPENSSL
+c->ssl = SSL_new(load_ctx);
+SSL_set_fd(c->ssl, c->sock);
+ok = SSL_connect(c->ssl) == 1;
+#endif
+#ifdef HAVE_GNUTLS
+  {
+  int rc;
+  gnutls_init(&c->session, GNUTLS_CLIENT);
+  if (pri_string) gnutls_priority_set_direct(c->session, pri_string, NULL);
+  else gnutls_set_default_priority(c->session);
+  gnutls_credentials_set(c->session, GNUTLS_CRD_CERTIFICATE, x509_cred);
+  gnutls_transport_set_ptr(c->session, (gnutls_transport_ptr_t)(intptr_t)c->sock);
+  do rc = gnutls_handshake(c->session); while (rc == GNUTLS_E_INTERRUPTED);
+  ok = rc >= 0;
+  }
+#endif
+
+if (!ok)
+  {
+  lstats->errors[LE_TLS]++;
+  return FALSE;
+  }
+c->tls = TRUE;
+c->off = c->len = 0;
+load_record(LV_TLS, &t0);
+return TRUE;
+}
+
+
+static void
+load_close(load_conn * c)
+{
+#ifdef HAVE_OPENSSL
+if (c->ssl)
+  {
+  if (c->tls) SSL_shutdown(c->ssl);
+  SSL_free(c->ssl);
+  }
+#endif
+#ifdef HAVE_GNUTLS
+if (c->session)
+  {
+  if (c->tls) gnutls_bye(c->session, GNUTLS_SHUT_WR);
+  gnutls_deinit(c->session);
+  }
+#endif
+close(c->sock);
+}
+
+
+/* Connect and read the banner. The timeout applies to the connect and then
+to each read and write on the connection. */
+
+static int
+load_connect(load_conn * c)
+{
+struct timeval t0, tv = { load_timeout, 0 };
+int err = 0, code;
+socklen_t elen = sizeof(err);
+
+memset(c, 0, offsetof(load_conn, buf));
+gettimeofday(&t0, NULL);
+
+if (  (c->sock = socket(load_addr->ai_family, SOCK_STREAM, 0)) < 0
+   || load_iface
+      && bind(c->sock, load_iface->ai_addr, load_iface->ai_addrlen) < 0
+   || fcntl(c->sock, F_SETFL, O_NONBLOCK) < 0)
+  goto FAILED;
+
+if (connect(c->sock, load_addr->ai_addr, load_addr->ai_addrlen) < 0)
+  {
+  struct pollfd p = { .fd = c->sock, .events = POLLOUT };
+  if (  errno != EINPROGRESS
+     || poll(&p, 1, load_timeout * 1000) <= 0
+     || getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &elen) < 0
+     || err != 0)
+    goto FAILED;
+  }
+
+(void) fcntl(c->sock, F_SETFL, 0);
+(void) setsockopt(c->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+(void) setsockopt(c->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+if (load_tls_on_connect && !load_tls_start(c))
+  {
+  load_close(c);
+  return FALSE;
+  }
+if ((code = load_response(c)) < 0)
+  {
+  load_close(c);
+  return FALSE;
+  }
+load_record(LV_CONNECT, &t0);
+if (code == 220) return TRUE;
+
+lstats->errors[code >= 500 ? LE_5XX : LE_4XX]++;
+load_close(c);
+return FALSE;
+
+FAILED:
+lstats->errors[LE_CONNECT]++;
+if (c->sock >= 0) close(c->sock);
+return FALSE;
+}
+
+
+static int
+load_ehlo(load_conn * c)
+{
+if (load_command(c, LV_EHLO, "EHLO %s", load.helo) != 250) return FALSE;
+c->pipelining = strstr(c->resp, "PIPELINING") != NULL;
+c->starttls = strstr(c->resp, "STARTTLS") != NULL;
+return TRUE;
+}
+
+
+/* Send a message of about the given size after a 354 */
+
+static int
+load_message(load_conn * c, unsigned long seq, int m, int size)
+{
+char head[1024];
+int hlen, blen, verb = LV_DOT, code;
+
+hlen = snprintf(head, sizeof(head),
+  "From: <%s>\r\nTo: <load%lu.0@%s>\r\nSubject: load %lu.%d\r\n"
+  "Message-ID: <load.%d.%lu.%d@%s>\r\n\r\n",
+  load.from, seq, load.domain, seq, m, (int)getpid(), seq, m, load.helo);
+blen = size > hlen ? ((size - hlen) / 80) * 80 : 0;
+
+if (load_write(c, head, hlen) < 0 || load_write(c, load_body, blen) < 0)
+  {
+  load_io_error();
+  return FALSE;
+  }
+if (!load_exchange(c, ".\r\n", 3, 1, &verb, &code)) return FALSE;
+if (code / 100 == 2) lstats->accepted++;
+return TRUE;
+}
+
+
+static int
+load_synthetic(load_conn * c, unsigned long seq)
+{
+if (!load_ehlo(c)) return FALSE;
+
+if (load.starttls && !load_tls_on_connect)
+  {
+  if (!c->starttls)
+    {
+    lstats->errors[LE_TLS]++;
+    return FALSE;
+    }
+  if (  load_command(c, LV_STARTTLS, "STARTTLS") != 220
+     || !load_tls_start(c) || !load_ehlo(c))
+    return FALSE;
+  }
+
+for (int m = 0; m < load.messages; m++)
+  {
+  int verbs[LOAD_MAX_RCPTS + 2], codes[LOAD_MAX_RCPTS + 2];
+  int n = 0, len = 0, size = load.size_min;
+
+  if (load.size_max > load.size_min)
+    size += random() % (load.size_max - load.size_min + 1);
+
+  len += sprintf(load_cmds + len, "MAIL FROM:<%s>\r\n", load.from);
+  verbs[n++] = LV_MAIL;
+  for (int r = 0; r < load.rcpts; r++)
+    {
+    len += sprintf(load_cmds + len, "RCPT TO:<load%lu.%d@%s>\r\n", seq, r,
+      load.domain);
+    verbs[n++] = LV_RCPT;
+    }
+  len += sprintf(load_cmds + len, "DATA\r\n");
+  verbs[n++] = LV_DATA;
+
+  if (load.pipelining && c->pipelining)
+    {
+    if (!load_exchange(c, load_cmds, len, n, verbs, codes)) return FALSE;
+    }
+  else
+    for (int i = 0, off = 0; i < n; i++)
+      {
+      int clen = (int)(strstr(load_cmds + off, "\r\n") - (load_cmds + off)) + 2;
+      if (!load_exchange(c, load_cmds + off, clen, 1, verbs + i, codes + i))
+	return FALSE;
+      off += clen;
+      }
+
+  if (codes[n-1] == 354)
+    {
+    lstats->messages++;
+    if (!load_message(c, seq, m, size)) return FALSE;
+    }
+  else if (load_command(c, LV_RSET, "RSET") < 0)
+    return FALSE;
+  }
+
+return load_command(c, LV_QUIT, "QUIT") == 221;
+}
+
+
+static int
+load_replay(load_conn * c, const load_script * sc)
+{
+int content = FALSE;
+
+for (int i = 0; i < sc->count; i++)
+  {
+  const load_line * l = sc->lines + i;
+  int verbs[64], codes[64], n = 0, len = l->len;
+
+  memcpy(load_cmds, l->s, len);
+  if (!l->raw)
+    {
+    memcpy(load_cmds + len, "\r\n", 2);
+    len += 2;
+    }
+
+  if (content)
+    {
+    if (l->len == 1 && l->s[0] == '.')
+      {
+      verbs[0] = LV_DOT;
+      if (!load_exchange(c, load_cmds, len, 1, verbs, codes)) return FALSE;
+      if (codes[0] / 100 == 2) lstats->accepted++;
+      content = FALSE;
+      }
+    else if (load_write(c, load_cmds, len) < 0)
+      {
+      load_io_error();
+      return FALSE;
+      }
+    continue;
+    }
+
+  /* Each complete command in the line gets a response */
+
+  for (char * s = load_cmds, * e; n < 64 && (e = memchr(s, '\n', load_cmds + len - s)); s = e + 1)
+    verbs[n++] = load_verb(s);
+  if (n == 0)
+    {
+    if (load_write(c, load_cmds, len) < 0) { load_io_error(); return FALSE; }
+    continue;
+    }
+  if (!load_exchange(c, load_cmds, len, n, verbs, codes)) return FALSE;
+
+  switch (verbs[n-1])
+    {
+    case LV_DATA:
+      if (codes[n-1] == 354) { lstats->messages++; content = TRUE; }
+      break;
+    case LV_STARTTLS:
+      if (codes[n-1] == 220 && !load_tls_start(c)) return FALSE;
+      break;
+    case LV_QUIT:
+      return TRUE;
+    }
+  }
+
+return load_command(c, LV_QUIT, "QUIT") == 221;
+}
+
+
+/* A worker process: run sessions one after another until the count or the
+time is used up, then send the counts to the parent */
+
+static void
+load_worker(int fd, int id, long sessions, const struct timeval * deadline)
+{
+load_conn * c = malloc(sizeof(load_conn));
+char * p;
+int len;
+
+if (!(lstats = calloc(1, sizeof(load_stats))) || !c)
+  {
+  fprintf(stderr, "Out of memory\n");
+  exit(97);
+  }
+srandom(getpid());
+signal(SIGPIPE, SIG_IGN);
+
+for (unsigned long i = 0; ; i++)
+  {
+  unsigned long seq = id + i * load.workers;
+  struct timeval now;
+  int ok = FALSE;
+
+  if (deadline)
+    {
+    gettimeofday(&now, NULL);
+    if (  now.tv_sec > deadline->tv_sec
+       || now.tv_sec == deadline->tv_sec && now.tv_usec >= deadline->tv_usec)
+      break;
+    }
+  else if ((long)i >= sessions)
+    break;
+
+  lstats->sessions++;
+  if (load_connect(c))
+    {
+    ok = load.nreplay
+      ? load_replay(c, load_scripts + seq % load.nreplay)
+      : load_synthetic(c, seq);
+    load_close(c);
+    }
+  if (!ok) lstats->failed++;
+  }
+
+for (p = (char *)lstats, len = sizeof(load_stats); len > 0; )
+  {
+  int rc = write(fd, p, len);
+  if (rc <= 0) exit(1);
+  p += rc;
+  len -= rc;
+  }
+exit(0);
+}
+
+
+static unsigned long
+load_percentile(const unsigned long * hist, unsigned long count, double q)
+{
+unsigned long want = (unsigned long)(q * count + 0.999999), n = 0;
+int b;
+
+for (b = 0; b < LOAD_BUCKETS - 1; b++)
+  if ((n += hist[b]) >= want) break;
+return load_bucket_value(b);
+}
+
+
+/* Run the load: start the workers, add up what they send back, and report */
+
+static void
+load_run(const char * address, int port, const char * interface,
+  const char * certfile, const char * keyfile)
+{
+struct addrinfo hints = { .ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICHOST };
+struct timeval start, deadline;
+char portstr[16];
+load_stats * total;
+pid_t pids[LOAD_MAX_WORKERS];
+int fds[LOAD_MAX_WORKERS];
+double secs;
+int rc;
+
+if (load.workers < 1 || load.workers > LOAD_MAX_WORKERS)
+  {
+  fprintf(stderr, "Concurrency must be from 1 to %d\n", LOAD_MAX_WORKERS);
+  exit(96);
+  }
+if (load.rcpts < 1 || load.rcpts > LOAD_MAX_RCPTS)
+  {
+  fprintf(stderr, "Recipient count must be from 1 to %d\n", LOAD_MAX_RCPTS);
+  exit(96);
+  }
+if (load.size_max < load.size_min) load.size_max = load.size_min;
+
+sprintf(portstr, "%d", port);
+if ((rc = getaddrinfo(address, portstr, &hints, &load_addr)) != 0)
+  {
+  fprintf(stderr, "Unable to parse \"%s\": %s\n", address, gai_strerror(rc));
+  exit(86);
+  }
+if (interface && (rc = getaddrinfo(interface, NULL, &hints, &load_iface)) != 0)
+  {
+  fprintf(stderr, "Unable to parse \"%s\": %s\n", interface, gai_strerror(rc));
+  exit(88);
+  }
+
+for (int i = 0; i < load.nreplay; i++)
+  load_read_script(load.replay[i], load_scripts + i);
+
+/* The body is lines of 78 printing characters; a message takes as many
+whole lines as fit its size */
+
+load_body = malloc(load.size_max + 80);
+for (int i = 0; i + 80 <= load.size_max + 80; i += 80)
+  {
+  for (int j = 0; j < 78; j++) load_body[i+j] = 'a' + (i/80 + j) % 26;
+  load_body[i+78] = '\r';
+  load_body[i+79] = '\n';
+  }
+
+#ifdef HAVE_OPENSSL
+SSL_library_init();
+SSL_load_error_strings();
+if (!(load_ctx = SSL_CTX_new(SSLv23_method())))
+  {
+  printf ("SSL_CTX_new failed\n");
+  exit(84);
+  }
+if (certfile && !SSL_CTX_use_certificate_file(load_ctx, certfile, SSL_FILETYPE_PEM))
+  {
+  printf("SSL_CTX_use_certificate_file failed\n");
+  exit(83);
+  }
+if (keyfile && !SSL_CTX_use_PrivateKey_file(load_ctx, keyfile, SSL_FILETYPE_PEM))
+  {
+  printf("SSL_CTX_use_PrivateKey_file failed\n");
+  exit(82);
+  }
+#endif
+#ifdef HAVE_GNUTLS
+if ((rc = gnutls_global_init()) < 0)
+  gnutls_error(US"gnutls_global_init", rc);
+if ((rc = gnutls_certificate_allocate_credentials(&x509_cred)) < 0)
+  gnutls_error(US"certificate_allocate_credentials", rc);
+if (  certfile
+   && (rc = gnutls_certificate_set_x509_key_file(x509_cred, certfile,
+	  keyfile ? keyfile : certfile, GNUTLS_X509_FMT_PEM)) < 0)
+  gnutls_error(US"gnutls_certificate", rc);
+#endif
+#ifndef HAVE_TLS
+if (load.starttls || load_tls_on_connect)
+  {
+  fprintf(stderr, "This client was built without TLS support\n");
+  exit(96);
+  }
+#endif
+
+fflush(stdout);
+gettimeofday(&start, NULL);
+deadline.tv_sec = start.tv_sec + load.duration;
+deadline.tv_usec = start.tv_usec;
+
+for (int w = 0; w < load.workers; w++)
+  {
+  int pfd[2];
+  long n = load.sessions / load.workers + (w < load.sessions % load.workers);
+
+  if (pipe(pfd) < 0 || (pids[w] = fork()) < 0)
+    {
+    fprintf(stderr, "Failed to start worker: %s\n", strerror(errno));
+    exit(89);
+    }
+  if (pids[w] == 0)
+    {
+    close(pfd[0]);
+    load_worker(pfd[1], w, n, load.duration > 0 ? &deadline : NULL);
+    }
+  close(pfd[1]);
+  fds[w] = pfd[0];
+  }
+
+/* Each worker writes its counts only at the end, so they can be read one
+after another. */
+
+total = calloc(1, sizeof(load_stats));
+lstats = malloc(sizeof(load_stats));
+for (int w = 0; w < load.workers; w++)
+  {
+  char * p = (char *)lstats;
+  int len = sizeof(load_stats);
+
+  while (len > 0 && (rc = read(fds[w], p, len)) > 0) { p += rc; len -= rc; }
+  close(fds[w]);
+  waitpid(pids[w], NULL, 0);
+  if (len > 0)
+    {
+    fprintf(stderr, "Worker %d failed to report\n", w);
+    continue;
+    }
+
+  total->sessions += lstats->sessions;
+  total->failed += lstats->failed;
+  total->messages += lstats->messages;
+  total->accepted += lstats->accepted;
+  for (int i = 0; i < LE_COUNT; i++) total->errors[i] += lstats->errors[i];
+  for (int v = 0; v < LV_COUNT; v++)
+    {
+    total->count[v] += lstats->count[v];
+    if (lstats->max[v] > total->max[v]) total->max[v] = lstats->max[v];
+    for (int b = 0; b < LOAD_BUCKETS; b++)
+      total->hist[v][b] += lstats->hist[v][b];
+    }
+  }
+secs = (double)load_usec(&start) / 1000000.0;
+
+printf("%lu sessions, %lu failed, in %.3fs: %.1f/s\n", total->sessions,
+  total->failed, secs, total->sessions / secs);
+printf("%lu messages, %lu accepted: %.1f/s\n", total->messages,
+  total->accepted, total->accepted / secs);
+printf("errors:");
+for (int i = 0; i < LE_COUNT; i++)
+  printf(" %s=%lu", load_error_names[i], total->errors[i]);
+printf("\n%-9s %9s %9s %9s %9s %9s  (ms)\n", "command", "count", "p50", "p90",
+  "p99", "max");
+for (int v = 0; v < LV_COUNT; v++) if (total->count[v])
+  printf("%-9s %9lu %9.3f %9.3f %9.3f %9.3f\n", load_verb_names[v],
+    total->count[v],
+    load_percentile(total->hist[v], total->count[v], 0.50) / 1000.0,
+    load_percentile(total->hist[v], total->count[v], 0.90) / 1000.0,
+    load_percentile(total->hist[v], total->count[v], 0.99) / 1000.0,
+    total->max[v] / 1000.0);
+exit(total->failed ? 1 : 0);
+}
+
+
+
+
 /*************************************************
 *                 Main Program                   *
 *************************************************/
@@ -960,6 +1857,10 @@ Usage: client\n"
 #endif
 "\
           [-tn] n seconds timeout\n\
+          [-load [-c workers] [-n sessions] [-d seconds]\n\
+             [-m messages] [-r recipients] [-s size[-size]]\n\
+             [-pipelining] [-starttls] [-from address] [-domain domain]\n\
+             [-helo name] [-replay file]...]\n\
           <IP address>\n\
           <port>\n\
           [<outgoing interface>]\n\
@@ -1035,6 +1936,8 @@ while (argc >= argi + 1 && argv[argi][0] == '-')
 #endif
 
 #endif
+  else if (load_option(argc, argv, &argi))
+    ;
   else if (argv[argi][1] == 't' && isdigit(argv[argi][2]))
     {
     tmplong = strtol(argv[argi]+2, &end, 10);
@@ -1097,6 +2000,13 @@ if (argc > argi &&
 if (argc > argi) certfile = argv[argi++];
 if (argc > argi) keyfile = argv[argi++];
 
+if (load.on)
+  {
+  load_timeout = timeout;
+  load_tls_on_connect = tls_on_connect;
+  load_run(address, port, interface, certfile, keyfile);
+  }
+
 
 #if HAVE_IPV6
 /* For an IPv6 address, use an IPv6 sockaddr structure. */
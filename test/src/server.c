@@ -21,6 +21,7 @@ on all interfaces, unless the option -noipv6 is given. */
 
 #include <errno.h>
 #include <dirent.h>
+#include <poll.h>
 #include <sys/types.h>
 
 #include <netinet/in_systm.h>
@@ -150,6 +151,410 @@ putchar('\n');
 
 
 
+/*************************************************
+*          Benchmark sink - many sessions        *
+*************************************************/
+
+/* With -sink the script is not used. Instead the program acts as a sink for
+outbound delivery benchmarks: it accepts any number of simultaneous SMTP
+connections, handled by a single poll() loop, and takes every message it is
+offered. PIPELINING and CHUNKING are advertised; with -sink-starttls, STARTTLS
+is advertised too but refused with a 454, since this program has no TLS
+support. Replies can be delayed, and a percentage of recipients and of messages
+failed temporarily or permanently, using a fixed random seed so that runs are
+reproducible. Message counts and rates are reported on stdout. */
+
+enum { SK_CMD, SK_DATA, SK_BDAT, SK_QUIT };
+
+typedef struct sconn {
+  int   fd;
+  int   state;
+  int   rcpts;                  /* accepted for the current message */
+  long  bdat_left;              /* bytes of the current chunk to come */
+  BOOL  bdat_last;
+  BOOL  midline;                /* a DATA line was too long for the buffer */
+  struct timeval due;           /* when pending output may be sent */
+  int   inlen;
+  char  in[4096];
+  int   outlen, outsize;
+  char *out;
+} sconn;
+
+typedef struct {
+  int  delay;                   /* ms before each batch of replies */
+  int  tmp_rate, perm_rate;     /* percentages */
+  int  report;                  /* seconds between reports */
+  BOOL starttls;
+  long limit;                   /* messages to take, or 0 */
+} sink_opts;
+
+static long sk_messages = 0, sk_rcpts = 0, sk_bytes = 0;
+static long sk_tmpfails = 0, sk_permfails = 0, sk_connections = 0;
+static volatile sig_atomic_t sk_stop = 0;
+
+static void
+sink_sigterm(int sig)
+{
+sk_stop = sig;
+}
+
+static double
+tv_diff(struct timeval * a, struct timeval * b)
+{
+return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static void
+sink_report(struct timeval * start, long last_messages, double interval,
+  int open)
+{
+struct timeval now;
+double t;
+
+gettimeofday(&now, NULL);
+t = tv_diff(start, &now);
+printf("sink: %.1fs conns %ld open %d msgs %ld (%.1f/s",
+  t, sk_connections, open, sk_messages, t > 0 ? sk_messages / t : 0.0);
+if (interval > 0) printf(", now %.1f/s", (sk_messages - last_messages) / interval);
+printf(") rcpts %ld bytes %ld tmpfail %ld permfail %ld\n",
+  sk_rcpts, sk_bytes, sk_tmpfails, sk_permfails);
+fflush(stdout);
+}
+
+static void
+sink_reply(sconn * c, const char * fmt, ...)
+{
+va_list ap;
+int n;
+
+if (c->outsize - c->outlen < 256)
+  c->out = realloc(c->out, c->outsize += 1024);
+va_start(ap, fmt);
+n = vsnprintf(c->out + c->outlen, c->outsize - c->outlen, fmt, ap);
+va_end(ap);
+if (n > 0 && n < c->outsize - c->outlen) c->outlen += n;
+}
+
+static int
+sink_draw(sink_opts * o)
+{
+int r = random() % 100;
+return r < o->tmp_rate ? 4 : r < o->tmp_rate + o->perm_rate ? 5 : 2;
+}
+
+static void
+sink_message_end(sconn * c, sink_opts * o)
+{
+if (c->rcpts == 0)			/* BDAT after all RCPTs failed */
+  sink_reply(c, "554 5.5.1 No valid recipients\r\n");
+else switch (sink_draw(o))
+  {
+  case 4: sk_tmpfails++;  sink_reply(c, "451 4.3.0 sink temporary failure\r\n"); break;
+  case 5: sk_permfails++; sink_reply(c, "554 5.6.0 sink permanent failure\r\n"); break;
+  default:
+    sk_messages++;
+    sk_rcpts += c->rcpts;
+    sink_reply(c, "250 OK id=%ld\r\n", sk_messages);
+  }
+c->rcpts = 0;
+}
+
+/* Handle one command line, without its line ending */
+
+static void
+sink_command(sconn * c, sink_opts * o, char * cmd)
+{
+if (strncasecmp(cmd, "EHLO", 4) == 0)
+  {
+  sink_reply(c, "250-sink\r\n250-PIPELINING\r\n250-CHUNKING\r\n250-8BITMIME\r\n");
+  if (o->starttls) sink_reply(c, "250-STARTTLS\r\n");
+  sink_reply(c, "250 SIZE\r\n");
+  c->rcpts = 0;
+  }
+else if (strncasecmp(cmd, "HELO", 4) == 0)
+  { sink_reply(c, "250 sink\r\n"); c->rcpts = 0; }
+else if (strncasecmp(cmd, "MAIL", 4) == 0)
+  { sink_reply(c, "250 OK\r\n"); c->rcpts = 0; }
+else if (strncasecmp(cmd, "RCPT", 4) == 0)
+  switch (sink_draw(o))
+    {
+    case 4: sink_reply(c, "451 4.3.0 sink temporary recipient failure\r\n"); break;
+    case 5: sink_reply(c, "550 5.1.1 sink permanent recipient failure\r\n"); break;
+    default: c->rcpts++; sink_reply(c, "250 Accepted\r\n");
+    }
+else if (strncasecmp(cmd, "DATA", 4) == 0)
+  if (c->rcpts == 0)
+    sink_reply(c, "503 No valid recipients\r\n");
+  else
+    {
+    sink_reply(c, "354 Enter message\r\n");
+    c->state = SK_DATA;
+    c->midline = FALSE;
+    }
+else if (strncasecmp(cmd, "BDAT ", 5) == 0)
+  {
+  char * end;
+  c->bdat_left = strtol(cmd + 5, &end, 10);
+  while (*end == ' ') end++;
+  c->bdat_last = strncasecmp(end, "LAST", 4) == 0;
+  c->state = SK_BDAT;
+  }
+else if (strncasecmp(cmd, "RSET", 4) == 0 || strncasecmp(cmd, "NOOP", 4) == 0)
+  { sink_reply(c, "250 OK\r\n"); if (toupper(*cmd) == 'R') c->rcpts = 0; }
+else if (strncasecmp(cmd, "STARTTLS", 8) == 0)
+  sink_reply(c, "454 4.7.0 TLS not available\r\n");
+else if (strncasecmp(cmd, "QUIT", 4) == 0)
+  {
+  sink_reply(c, "221 sink closing connection\r\n");
+  c->state = SK_QUIT;
+  }
+else
+  sink_reply(c, "500 Unrecognized command\r\n");
+}
+
+/* Work through the input that has been read. Complete command and data lines
+are taken off the front of the buffer; chunk data is consumed as it comes. */
+
+static void
+sink_input(sconn * c, sink_opts * o)
+{
+int used = 0;
+
+while (used < c->inlen && c->state != SK_QUIT)
+  {
+  char * p = c->in + used, * nl;
+  int avail = c->inlen - used;
+
+  if (c->state == SK_BDAT)
+    {
+    int n = avail < c->bdat_left ? avail : (int)c->bdat_left;
+    c->bdat_left -= n;
+    sk_bytes += n;
+    used += n;
+    if (c->bdat_left > 0) break;
+    c->state = SK_CMD;
+    if (c->bdat_last)
+      sink_message_end(c, o);
+    else
+      sink_reply(c, "250 chunk received\r\n");
+    continue;
+    }
+
+  if (!(nl = memchr(p, '\n', avail)))
+    {
+    if (used == 0 && c->inlen == sizeof(c->in))
+      {				/* overlong line; drop what we have */
+      if (c->state == SK_DATA)
+	{
+	sk_bytes += c->inlen;
+	c->midline = TRUE;
+	}
+      else
+	sink_reply(c, "500 Line too long\r\n");
+      used = c->inlen;
+      }
+    break;
+    }
+
+  used += nl - p + 1;
+  if (c->state == SK_DATA)
+    {
+    BOOL dot = !c->midline && *p == '.'
+	       && (nl == p + 1 || (nl == p + 2 && p[1] == '\r'));
+    c->midline = FALSE;
+    if (dot)
+      {
+      c->state = SK_CMD;
+      sink_message_end(c, o);
+      }
+    else
+      sk_bytes += nl - p + 1;
+    continue;
+    }
+
+  if (nl > p && nl[-1] == '\r') nl--;
+  *nl = 0;
+  sink_command(c, o, p);
+  }
+
+if (used > 0)
+  {
+  memmove(c->in, c->in + used, c->inlen - used);
+  c->inlen -= used;
+  }
+}
+
+static void
+sink_close(sconn ** conns, int * nconns, int i)
+{
+close(conns[i]->fd);
+free(conns[i]->out);
+free(conns[i]);
+conns[i] = conns[--*nconns];
+}
+
+static int
+sink_run(int * listen_socket, int nlisten, sink_opts * o, int timeout,
+  BOOL debug)
+{
+sconn ** conns = NULL;
+struct pollfd * pfds = NULL;
+int nconns = 0, maxconns = 0, polled;
+struct timeval start, last, idle_since;
+long last_messages = 0;
+struct rlimit rl;
+
+/* Allow for thousands of connections */
+
+if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+  {
+  rl.rlim_cur = rl.rlim_max;
+  (void)setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+signal(SIGPIPE, SIG_IGN);
+signal(SIGINT, sink_sigterm);
+signal(SIGTERM, sink_sigterm);
+srandom(1);
+
+for (int i = 0; i < nlisten; i++)
+  if (listen_socket[i] >= 0)
+    (void)fcntl(listen_socket[i], F_SETFL,
+      fcntl(listen_socket[i], F_GETFL) | O_NONBLOCK);
+
+printf("Sink listening\n");
+fflush(stdout);
+gettimeofday(&start, NULL);
+last = idle_since = start;
+
+while (!sk_stop && (o->limit <= 0 || sk_messages < o->limit))
+  {
+  struct timeval now;
+  int n = 0, wait = 1000;
+
+  if (nconns + nlisten > maxconns)
+    {
+    maxconns = 2 * (nconns + nlisten) + 64;
+    pfds = realloc(pfds, maxconns * sizeof(struct pollfd));
+    }
+
+  gettimeofday(&now, NULL);
+  for (int i = 0; i < nlisten; i++)
+    if (listen_socket[i] >= 0)
+      pfds[n++] = (struct pollfd) { .fd = listen_socket[i], .events = POLLIN };
+
+  /* A connection with output not yet due waits for the time to pass; it
+  reads nothing more in the meantime, like a slow server. */
+
+  for (int i = 0; i < nconns; i++)
+    {
+    sconn * c = conns[i];
+    short ev = POLLIN;
+    if (c->outlen > 0)
+      {
+      double d = tv_diff(&now, &c->due);
+      if (d > 0)
+	{
+	if (d * 1000 < wait) wait = (int)(d * 1000) + 1;
+	ev = 0;
+	}
+      else
+	ev = POLLOUT;
+      }
+    pfds[n++] = (struct pollfd) { .fd = c->fd, .events = ev };
+    }
+
+  if (poll(pfds, n, wait) < 0 && errno != EINTR)
+    {
+    printf("poll() failed: %s\n", strerror(errno));
+    break;
+    }
+  gettimeofday(&now, NULL);
+
+  /* New connections */
+
+  polled = nconns;
+  n = 0;
+  for (int i = 0; i < nlisten; i++)
+    if (listen_socket[i] >= 0 && pfds[n++].revents & POLLIN)
+      {
+      int fd;
+      while ((fd = accept(listen_socket[i], NULL, NULL)) >= 0)
+	{
+	sconn * c = calloc(1, sizeof(sconn));
+	(void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c->fd = fd;
+	c->state = SK_CMD;
+	sink_reply(c, "220 sink ESMTP\r\n");
+	c->due = now;
+	conns = realloc(conns, (nconns + 1) * sizeof(sconn *));
+	conns[nconns++] = c;
+	sk_connections++;
+	if (debug) printf("%ld: connection %ld\n", (long)now.tv_sec, sk_connections);
+	}
+      }
+
+  /* The connections that were polled. Closing one moves the last into its
+  place, so they are taken from the end. */
+
+  for (int i = polled - 1; i >= 0; i--)
+    {
+    sconn * c = conns[i];
+    short rev = pfds[n + i].revents;
+
+    if (rev & POLLOUT)
+      {
+      int w = write(c->fd, c->out, c->outlen);
+      if (w > 0)
+	{
+	memmove(c->out, c->out + w, c->outlen - w);
+	c->outlen -= w;
+	}
+      else if (w < 0 && errno != EAGAIN && errno != EINTR)
+	{ sink_close(conns, &nconns, i); continue; }
+      if (c->outlen == 0 && c->state == SK_QUIT)
+	{ sink_close(conns, &nconns, i); continue; }
+      }
+
+    if (rev & (POLLIN | POLLHUP | POLLERR))
+      {
+      int r = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+      if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+	{ sink_close(conns, &nconns, i); continue; }
+      if (r > 0)
+	{
+	BOOL had_output = c->outlen > 0;
+	c->inlen += r;
+	sink_input(c, o);
+	if (!had_output && c->outlen > 0)
+	  {
+	  c->due = now;
+	  c->due.tv_usec += o->delay * 1000;
+	  c->due.tv_sec += c->due.tv_usec / 1000000;
+	  c->due.tv_usec %= 1000000;
+	  }
+	}
+      }
+    }
+
+  if (nconns > 0) idle_since = now;
+  else if (timeout > 0 && tv_diff(&idle_since, &now) >= timeout)
+    break;
+
+  if (o->report > 0 && tv_diff(&last, &now) >= o->report)
+    {
+    sink_report(&start, last_messages, tv_diff(&last, &now), nconns);
+    last = now;
+    last_messages = sk_messages;
+    }
+  }
+
+sink_report(&start, 0, 0, nconns);
+return 0;
+}
+
+
+
 /*************************************************
 *                 Main Program                   *
 *************************************************/
@@ -182,6 +587,8 @@ line *s;
 FILE *in, *out;
 int linebuf = 1;
 char *pidfile = NULL;
+BOOL sink = FALSE;
+sink_opts sinkopts = { 0 };
 
 char *sockname = NULL;
 unsigned char buffer[10240];
@@ -215,6 +622,12 @@ if (argc > 1 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")))
        "\n\t-noipv4  disable ipv4"
        "\n\t-noipv6  disable ipv6"
        "\n\t-oP file write PID to file"
+       "\n\t-sink    benchmark sink; no script, count is messages to take"
+       "\n\t-sink-delay n     n ms delay before replies"
+       "\n\t-sink-permfail n  n% permanent failures"
+       "\n\t-sink-report n    report every n seconds"
+       "\n\t-sink-starttls    advertise (and refuse) STARTTLS"
+       "\n\t-sink-tmpfail n   n% temporary failures"
        "\n\t-t n     n seconds timeout"
        "\n\t-tfo     enable TCP Fast Open"
   );
@@ -233,6 +646,12 @@ while (na < argc && argv[na][0] == '-')
   else if (strcmp(argv[na], "-noipv4") == 0) use_ipv4 = 0;
   else if (strcmp(argv[na], "-noipv6") == 0) use_ipv6 = 0;
   else if (strcmp(argv[na], "-oP") == 0) pidfile = argv[++na];
+  else if (strcmp(argv[na], "-sink") == 0) sink = TRUE;
+  else if (strcmp(argv[na], "-sink-delay") == 0) sinkopts.delay = atoi(argv[++na]);
+  else if (strcmp(argv[na], "-sink-permfail") == 0) sinkopts.perm_rate = atoi(argv[++na]);
+  else if (strcmp(argv[na], "-sink-report") == 0) sinkopts.report = atoi(argv[++na]);
+  else if (strcmp(argv[na], "-sink-starttls") == 0) sinkopts.starttls = TRUE;
+  else if (strcmp(argv[na], "-sink-tmpfail") == 0) sinkopts.tmp_rate = atoi(argv[++na]);
   else
     {
     printf("server: unknown option %s, try -h or --help\n", argv[na]);
@@ -262,6 +681,7 @@ else port = atoi(argv[na]);
 na++;
 
 if (na < argc) connection_count = atoi(argv[na]);
+if (sink) sinkopts.limit = na < argc ? connection_count : 0;
 
 
 /* Initial pause (before creating listen sockets */
@@ -441,7 +861,7 @@ different for systems that do this and those that don't. */
 
 for (i = 0; i <= skn; i++) if (listen_socket[i] >= 0)
   {
-  if (listen(listen_socket[i], 5) < 0)
+  if (listen(listen_socket[i], sink ? 4096 : 5) < 0)
     if (i != v4n || listen_socket[v6n] < 0 || errno != EADDRINUSE)
       {
       printf("listen() failed: %s\n", strerror(errno));
@@ -469,6 +889,13 @@ if (pidfile)
   fclose(p);
   }
 
+if (sink)
+  {
+  int rc = sink_run(listen_socket, skn + 1, &sinkopts, timeout, debug);
+  if (sockname) unlink(sockname);
+  exit(rc);
+  }
+
 /* This program handles only a fixed number of connections, in sequence. Before
 waiting for the first connection, read the standard input, which contains the
 script of things to do. A line containing "++++" is treated as end of file.